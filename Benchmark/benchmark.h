@@ -0,0 +1,94 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace Benchmark
+{
+    // Bumpy height field over the unit square tessellated to at least numtriangles triangles,
+    // mixes large and small triangles at varying orientations unlike a flat grid
+    struct Terrain
+    {
+        std::vector<float> vertices;
+        std::vector<int> indices;
+        RadeonRays::bbox bounds;
+
+        explicit Terrain(int numtriangles);
+
+        int GetNumTriangles() const { return (int)indices.size() / 3; }
+    };
+
+    // Uniformly distributed origins inside bounds and directions
+    std::vector<RadeonRays::ray> GenerateRandomRays(RadeonRays::bbox const& bounds, int count, std::mt19937& rng);
+
+    // Random rays starting just above the terrain and going down onto it
+    std::vector<RadeonRays::ray> GenerateTerrainRays(Terrain const& terrain, int count, std::mt19937& rng);
+
+    // Average throughput of closest hit (or occlusion) queries over the rays in Mrays/s
+    float Measure(RadeonRays::IntersectionApi* api, std::vector<RadeonRays::ray> const& rays, bool occlusion, int iterations);
+
+    // Short platform name used in the reports
+    char const* GetPlatformName(RadeonRays::DeviceInfo::Platform platform);
+
+    // Escape string for JSON output
+    std::string Escape(std::string const& s);
+
+    // Averages and maxima of per ray traversal counters
+    struct TraversalSummary
+    {
+        double nodes;
+        double leaves;
+        double prims;
+        double spills;
+        int max_nodes;
+        int max_prims;
+        int max_spills;
+        // Rays spilling more than the short stack kernel global stack holds
+        int stack_overflows;
+    };
+
+    // Trace the rays once with "acc.traversal_stats" enabled and read back counters of every ray
+    std::vector<RadeonRays::TraversalStats> CollectTraversalStats(RadeonRays::IntersectionApi* api, std::vector<RadeonRays::ray> const& rays, bool occlusion);
+
+    // Aggregate per ray counters
+    TraversalSummary Summarize(std::vector<RadeonRays::TraversalStats> const& stats);
+
+    // Write visited nodes of width x height rays as binary PPM heatmap, false if it can't be written
+    bool WriteHeatmap(std::string const& path, std::vector<RadeonRays::TraversalStats> const& stats, int width, int height);
+
+    // Builder scaling benchmark, "Benchmark build ..." entry point
+    int RunBuildBenchmark(int argc, char** argv);
+
+    // Query latency percentiles over batch sizes, "Benchmark latency ..." entry point
+    int RunLatencyBenchmark(int argc, char** argv);
+
+    // Calc parallel primitives throughput over element counts, "Benchmark primitives ..." entry point
+    int RunPrimitivesBenchmark(int argc, char** argv);
+
+    // Replay of a "capture.path" workload capture on every device, "Benchmark replay ..." entry point
+    int RunReplayBenchmark(int argc, char** argv);
+}
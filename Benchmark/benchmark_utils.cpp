@@ -0,0 +1,173 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    Terrain::Terrain(int numtriangles)
+    {
+        int const n = std::max((int)std::ceil(std::sqrt(numtriangles * 0.5f)), 1);
+
+        vertices.reserve(3 * (n + 1) * (n + 1));
+        for (int i = 0; i <= n; ++i)
+        {
+            for (int j = 0; j <= n; ++j)
+            {
+                float const x = (float)i / n;
+                float const z = (float)j / n;
+                float const y = 0.1f * std::sin(25.f * x) * std::cos(17.f * z) + 0.02f * std::sin(193.f * x * z);
+                vertices.push_back(x);
+                vertices.push_back(y);
+                vertices.push_back(z);
+                bounds.grow(float3(x, y, z));
+            }
+        }
+
+        indices.reserve(6 * n * n);
+        for (int i = 0; i < n; ++i)
+        {
+            for (int j = 0; j < n; ++j)
+            {
+                int const v = i * (n + 1) + j;
+                int const quad[6] = { v, v + 1, v + n + 2, v, v + n + 2, v + n + 1 };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        }
+    }
+
+    std::vector<ray> GenerateRandomRays(bbox const& bounds, int count, std::mt19937& rng)
+    {
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+        std::vector<ray> rays(count);
+        float3 const ext = bounds.extents();
+
+        for (auto& r : rays)
+        {
+            float3 o = bounds.pmin + float3(dist(rng) * ext.x, dist(rng) * ext.y, dist(rng) * ext.z);
+            float const z = 2.f * dist(rng) - 1.f;
+            float const phi = 2.f * 3.1415926f * dist(rng);
+            float const s = std::sqrt(std::max(0.f, 1.f - z * z));
+            r = ray(o, float3(s * std::cos(phi), s * std::sin(phi), z));
+        }
+
+        return rays;
+    }
+
+    std::vector<ray> GenerateTerrainRays(Terrain const& terrain, int count, std::mt19937& rng)
+    {
+        bbox raybounds(terrain.bounds.pmin, terrain.bounds.pmax);
+        raybounds.pmin.y = terrain.bounds.pmax.y;
+        raybounds.pmax.y = terrain.bounds.pmax.y + 0.1f;
+
+        std::vector<ray> rays = GenerateRandomRays(raybounds, count, rng);
+        for (auto& r : rays)
+        {
+            r.d.y = -std::fabs(r.d.y);
+        }
+
+        return rays;
+    }
+
+    float Measure(IntersectionApi* api, std::vector<ray> const& rays, bool occlusion, int iterations)
+    {
+        if (rays.empty())
+        {
+            return 0.f;
+        }
+
+        int const count = (int)rays.size();
+        auto ray_buffer = api->CreateBuffer(count * sizeof(ray), const_cast<ray*>(&rays[0]));
+        auto hit_buffer = api->CreateBuffer(count * sizeof(Intersection), nullptr);
+
+        auto query = [&](Event** event)
+        {
+            if (occlusion)
+            {
+                api->QueryOcclusion(ray_buffer, count, hit_buffer, nullptr, event);
+            }
+            else
+            {
+                api->QueryIntersection(ray_buffer, count, hit_buffer, nullptr, event);
+            }
+        };
+
+        // Warm up run also waits for the uploads
+        Event* e = nullptr;
+        query(&e);
+        e->Wait();
+        api->DeleteEvent(e);
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        for (int i = 0; i < iterations - 1; ++i)
+        {
+            query(nullptr);
+        }
+
+        query(&e);
+        e->Wait();
+        api->DeleteEvent(e);
+
+        float const seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+
+        api->DeleteBuffer(ray_buffer);
+        api->DeleteBuffer(hit_buffer);
+
+        return (float)count * iterations / seconds * 1e-6f;
+    }
+
+    char const* GetPlatformName(DeviceInfo::Platform platform)
+    {
+        switch (platform)
+        {
+        case DeviceInfo::kOpenCL:
+            return "opencl";
+        case DeviceInfo::kVulkan:
+            return "vulkan";
+        case DeviceInfo::kEmbree:
+            return "embree";
+        default:
+            return "unknown";
+        }
+    }
+
+    std::string Escape(std::string const& s)
+    {
+        std::string res;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                res.push_back('\\');
+            }
+            res.push_back(c);
+        }
+        return res;
+    }
+}
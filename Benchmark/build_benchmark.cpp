@@ -0,0 +1,333 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Builder scaling benchmark: sweeps triangle count and CPU builder thread count
+/// for median, SAH and spatial split BVH builders and device HLBVH builder, recording
+/// commit and build time, peak memory, SAH cost and random ray throughput as JSON.
+/// The scenes come from the procedural generators of scene_generator.h, terrain by default,
+/// so the sweep runs over the same reproducible geometry on every machine.
+/// Each configuration commits into a fresh IntersectionApi, so the commit time
+/// includes the upload of the scene as it would for a customer scene.
+
+#include "benchmark.h"
+#include "scene_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    namespace
+    {
+        struct BuilderDesc
+        {
+            char const* name;
+            char const* acctype;
+            char const* builder;
+            // Spatial splits for "sah"
+            bool splits;
+            // Builds on the device, thread count does not apply
+            bool device;
+        };
+
+        BuilderDesc const kBuilders[] =
+        {
+            { "median", "bvh", "median", false, false },
+            { "sah", "bvh", "sah", false, false },
+            { "split", "bvh", "sah", true, false },
+            { "hlbvh", "hlbvh", "", false, true }
+        };
+
+        int const kTriangleCounts[] = { 1000, 10000, 100000, 1000000, 10000000, 50000000 };
+
+        // Rays traced to measure the quality of the built tree
+        int const kNumRays = 1 << 20;
+
+        struct Options
+        {
+            std::string output;
+            int max_triangles = 50000000;
+            int iterations = 10;
+            // 0 stands for all hardware threads
+            std::vector<int> threads = { 1, 2, 4, 8, 0 };
+            std::vector<SceneGenerator const*> scenes;
+        };
+
+        // Peak resident set size of the process in megabytes. The value never decreases,
+        // configurations run in growing triangle count order to keep it meaningful,
+        // list the largest scene last when sweeping several of them
+        float GetPeakHostMemory()
+        {
+#ifndef WIN32
+            rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+            return usage.ru_maxrss / (1024.f * 1024.f);
+#else
+            return usage.ru_maxrss / 1024.f;
+#endif
+#else
+            return 0.f;
+#endif
+        }
+
+        std::vector<int> ParseList(std::string const& s)
+        {
+            std::vector<int> res;
+            std::stringstream ss(s);
+            std::string item;
+            while (std::getline(ss, item, ','))
+            {
+                res.push_back(std::max(std::atoi(item.c_str()), 0));
+            }
+            return res;
+        }
+
+        bool ParseScenes(std::string const& s, std::vector<SceneGenerator const*>& scenes)
+        {
+            std::stringstream ss(s);
+            std::string item;
+            while (std::getline(ss, item, ','))
+            {
+                SceneGenerator const* generator = FindSceneGenerator(item);
+                if (!generator)
+                {
+                    return false;
+                }
+                scenes.push_back(generator);
+            }
+            return true;
+        }
+
+        bool ParseOptions(int argc, char** argv, Options& options)
+        {
+            for (int i = 1; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                bool const hasvalue = i + 1 < argc;
+
+                if (arg == "-o" && hasvalue)
+                {
+                    options.output = argv[++i];
+                }
+                else if (arg == "-t" && hasvalue)
+                {
+                    options.max_triangles = std::max(std::atoi(argv[++i]), 1);
+                }
+                else if (arg == "-n" && hasvalue)
+                {
+                    options.iterations = std::max(std::atoi(argv[++i]), 1);
+                }
+                else if (arg == "-j" && hasvalue)
+                {
+                    options.threads = ParseList(argv[++i]);
+                }
+                else if (arg == "-g" && hasvalue)
+                {
+                    if (!ParseScenes(argv[++i], options.scenes))
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            if (options.scenes.empty())
+            {
+                options.scenes.push_back(FindSceneGenerator("terrain"));
+            }
+
+            return !options.threads.empty();
+        }
+
+        // Rays of the terrain go down onto it as in GenerateTerrainRays, other scenes are traced with random rays
+        std::vector<ray> GenerateSceneRays(SceneGenerator const& generator, GeneratedScene const& scene, std::mt19937& rng)
+        {
+            if (std::string(generator.name) != "terrain")
+            {
+                return GenerateRandomRays(scene.bounds, kNumRays, rng);
+            }
+
+            bbox raybounds(scene.bounds.pmin, scene.bounds.pmax);
+            raybounds.pmin.y = scene.bounds.pmax.y;
+            raybounds.pmax.y = scene.bounds.pmax.y + 0.1f;
+
+            std::vector<ray> rays = GenerateRandomRays(raybounds, kNumRays, rng);
+            for (auto& r : rays)
+            {
+                r.d.y = -std::fabs(r.d.y);
+            }
+
+            return rays;
+        }
+
+        // Commit the scene with the builder and append a JSON record
+        void RunConfiguration(char const* name, GeneratedScene const& scene, std::vector<ray> const& rays, DeviceInfo const& info, std::uint32_t devidx,
+            BuilderDesc const& builder, int threads, Options const& options, std::ostream& json, bool& first)
+        {
+            std::stringstream record;
+            record << "    { \"backend\": \"" << GetPlatformName(info.platform) << "\", \"device\": \"" << Escape(info.name ? info.name : "")
+                << "\", \"scene\": \"" << name << "\", \"builder\": \"" << builder.name << "\", \"triangles\": " << scene.GetNumTriangles()
+                << ", \"threads\": " << threads;
+
+            IntersectionApi* api = nullptr;
+
+            try
+            {
+                api = IntersectionApi::Create(devidx);
+                api->SetOption("acc.type", builder.acctype);
+                api->SetOption("bvh.builder", builder.builder);
+                api->SetOption("bvh.sah.use_splits", builder.splits ? 1.f : 0.f);
+                api->SetOption("bvh.num_threads", (float)threads);
+
+                std::vector<Shape*> shapes = scene.Attach(api);
+                api->Commit();
+
+                CommitStatistics stats;
+                api->GetCommitStatistics(stats);
+
+                size_t const device_bytes = stats.nodes_bytes + stats.vertices_bytes + stats.faces_bytes + stats.shapes_bytes + stats.other_bytes;
+
+                record << ", \"commit_ms\": " << stats.total_time << ", \"build_ms\": " << stats.build_time
+                    << ", \"device_mb\": " << device_bytes / (1024.f * 1024.f) << ", \"host_peak_mb\": " << GetPeakHostMemory()
+                    << ", \"sah_cost\": " << stats.sah_cost << ", \"nodes\": " << stats.num_nodes;
+
+                float const mrays = Measure(api, rays, false, options.iterations);
+                record << ", \"mrays\": " << mrays;
+
+                std::cerr << GetPlatformName(info.platform) << " " << name << " " << builder.name << " " << scene.GetNumTriangles() << " tris "
+                    << threads << " threads: " << stats.build_time << " ms build, " << mrays << " Mrays/s\n";
+
+                for (auto it = shapes.rbegin(); it != shapes.rend(); ++it)
+                {
+                    api->DeleteShape(*it);
+                }
+            }
+            catch (Exception& e)
+            {
+                record << ", \"error\": \"" << Escape(e.what()) << "\"";
+                std::cerr << GetPlatformName(info.platform) << " " << name << " " << builder.name << " " << scene.GetNumTriangles() << " tris: " << e.what() << "\n";
+            }
+
+            if (api)
+            {
+                IntersectionApi::Delete(api);
+            }
+
+            record << " }";
+            json << (first ? "" : ",\n") << record.str();
+            first = false;
+        }
+    }
+
+    int RunBuildBenchmark(int argc, char** argv)
+    {
+        Options options;
+
+        if (!ParseOptions(argc, argv, options))
+        {
+            std::cerr << "Usage: Benchmark build [-o output.json] [-t max_triangles] [-j threads,...] [-n iterations] [-g scene,...]\n";
+            for (auto const& generator : GetSceneGenerators())
+            {
+                std::cerr << "    " << generator.name << ": " << generator.description << "\n";
+            }
+            return 1;
+        }
+
+        IntersectionApi::SetPlatform(DeviceInfo::kAny);
+
+        std::stringstream json;
+        json << "{\n  \"iterations\": " << options.iterations << ",\n  \"results\": [\n";
+        bool first = true;
+
+        for (auto generator : options.scenes)
+        {
+            for (auto numtriangles : kTriangleCounts)
+            {
+                if (numtriangles > options.max_triangles)
+                {
+                    break;
+                }
+
+                // Fixed seeds, so all builders and runs are compared on the same work
+                GeneratedScene scene;
+                generator->generate(numtriangles, 13, scene);
+
+                std::mt19937 rng(13);
+                std::vector<ray> rays = GenerateSceneRays(*generator, scene, rng);
+
+                for (std::uint32_t devidx = 0; devidx < IntersectionApi::GetDeviceCount(); ++devidx)
+                {
+                    DeviceInfo info;
+                    IntersectionApi::GetDeviceInfo(devidx, info);
+
+                    // Embree uses its own builders
+                    if (info.platform == DeviceInfo::kEmbree)
+                    {
+                        continue;
+                    }
+
+                    for (auto const& builder : kBuilders)
+                    {
+                        if (builder.device)
+                        {
+                            RunConfiguration(generator->name, scene, rays, info, devidx, builder, 0, options, json, first);
+                            continue;
+                        }
+
+                        for (auto threads : options.threads)
+                        {
+                            RunConfiguration(generator->name, scene, rays, info, devidx, builder, threads, options, json, first);
+                        }
+                    }
+                }
+            }
+        }
+
+        json << "\n  ]\n}\n";
+
+        if (options.output.empty())
+        {
+            std::cout << json.str();
+        }
+        else
+        {
+            std::ofstream out(options.output);
+            out << json.str();
+        }
+
+        return 0;
+    }
+}
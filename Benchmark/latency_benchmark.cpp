@@ -0,0 +1,353 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Query latency benchmark: sweeps batch sizes from 64 to 16M rays for every device and
+/// acceleration structure and records p50/p99 latency of closest hit queries as JSON.
+/// A sample is the end-to-end path of a caller: map the ray buffer, write rays, unmap,
+/// query until its event completes, map the hit buffer, read hits and unmap.
+/// "acc.profiling" is enabled on Calc devices, so the query part is split into GPU kernel
+/// time (traversal and decoding) and the launch overhead left around the kernels.
+/// Profiled launches are waited for one by one, which is part of the measured overhead.
+
+#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    namespace
+    {
+        char const* const kAccelerators[] = { "bvh", "fatbvh", "qbvh", "hlbvh", "hashbvh" };
+
+        int const kMinBatchSize = 64;
+        int const kMaxBatchSize = 16 * 1024 * 1024;
+
+        // Samples of large batches are cut to keep the rays traced per batch size around this number
+        int const kMaxRaysPerBatchSize = 64 * 1024 * 1024;
+        int const kMinSamples = 10;
+
+        // Upper bound of kernel timings read back per query
+        int const kMaxTimings = 64;
+
+        int const kNumTriangles = 1000000;
+
+        struct Options
+        {
+            std::string output;
+            int max_batch = kMaxBatchSize;
+            int samples = 100;
+        };
+
+        // Timings of a single query in milliseconds
+        struct Sample
+        {
+            float upload;
+            float query;
+            float kernels;
+            float download;
+        };
+
+        typedef std::chrono::high_resolution_clock Clock;
+
+        float GetElapsed(Clock::time_point start)
+        {
+            return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+        }
+
+        void Wait(IntersectionApi* api, Event* e)
+        {
+            e->Wait();
+            api->DeleteEvent(e);
+        }
+
+        // Nearest rank percentile, sorts values
+        float GetPercentile(std::vector<float>& values, float p)
+        {
+            std::sort(values.begin(), values.end());
+            std::size_t const rank = (std::size_t)std::ceil(p * values.size());
+            return values[std::min(std::max(rank, (std::size_t)1), values.size()) - 1];
+        }
+
+        // Append "name": { "p50": .., "p99": .. } of one field of the samples
+        void WritePercentiles(std::ostream& record, char const* name, std::vector<Sample> const& samples, float (*field)(Sample const&))
+        {
+            std::vector<float> values;
+            values.reserve(samples.size());
+            for (auto const& sample : samples)
+            {
+                values.push_back(field(sample));
+            }
+
+            record << ", \"" << name << "\": { \"p50\": " << GetPercentile(values, 0.5f) << ", \"p99\": " << GetPercentile(values, 0.99f)
+                << ", \"max\": " << values.back() << " }";
+        }
+
+        bool ParseOptions(int argc, char** argv, Options& options)
+        {
+            for (int i = 1; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                bool const hasvalue = i + 1 < argc;
+
+                if (arg == "-o" && hasvalue)
+                {
+                    options.output = argv[++i];
+                }
+                else if (arg == "-b" && hasvalue)
+                {
+                    options.max_batch = std::min(std::max(std::atoi(argv[++i]), kMinBatchSize), kMaxBatchSize);
+                }
+                else if (arg == "-n" && hasvalue)
+                {
+                    options.samples = std::max(std::atoi(argv[++i]), 1);
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        Sample RunSample(IntersectionApi* api, Buffer* ray_buffer, Buffer* hit_buffer, std::vector<ray> const& rays,
+            std::vector<Intersection>& hits, int count, bool profiled)
+        {
+            Sample sample = {};
+            Event* e = nullptr;
+
+            auto start = Clock::now();
+            ray* rayptr = nullptr;
+            api->MapBuffer(ray_buffer, kMapWrite, 0, count * sizeof(ray), (void**)&rayptr, &e);
+            Wait(api, e);
+            std::copy(rays.begin(), rays.begin() + count, rayptr);
+            api->UnmapBuffer(ray_buffer, rayptr, &e);
+            Wait(api, e);
+            sample.upload = GetElapsed(start);
+
+            start = Clock::now();
+            api->QueryIntersection(ray_buffer, count, hit_buffer, nullptr, &e);
+            Wait(api, e);
+            sample.query = GetElapsed(start);
+
+            if (profiled)
+            {
+                KernelTiming timings[kMaxTimings];
+                int const numtimings = std::min(api->GetLastQueryTimings(timings, kMaxTimings), kMaxTimings);
+                for (int i = 0; i < numtimings; ++i)
+                {
+                    sample.kernels += timings[i].time;
+                }
+            }
+
+            start = Clock::now();
+            Intersection* hitptr = nullptr;
+            api->MapBuffer(hit_buffer, kMapRead, 0, count * sizeof(Intersection), (void**)&hitptr, &e);
+            Wait(api, e);
+            std::copy(hitptr, hitptr + count, hits.begin());
+            api->UnmapBuffer(hit_buffer, hitptr, &e);
+            Wait(api, e);
+            sample.download = GetElapsed(start);
+
+            return sample;
+        }
+
+        // Sweep batch sizes on a committed terrain and append a JSON record per batch size
+        void RunConfiguration(Terrain const& terrain, std::vector<ray> const& rays, DeviceInfo const& info, std::uint32_t devidx,
+            char const* accel, Options const& options, std::ostream& json, bool& first)
+        {
+            std::string const prefix = std::string("    { \"backend\": \"") + GetPlatformName(info.platform) + "\", \"device\": \""
+                + Escape(info.name ? info.name : "") + "\", \"accel\": \"" + accel + "\"";
+
+            IntersectionApi* api = nullptr;
+            Shape* shape = nullptr;
+
+            try
+            {
+                api = IntersectionApi::Create(devidx);
+
+                // Embree has a single acceleration structure and no kernel timings
+                bool const profiled = info.platform != DeviceInfo::kEmbree;
+                if (profiled)
+                {
+                    api->SetOption("acc.type", accel);
+                    api->SetOption("acc.profiling", 1.f);
+                }
+
+                shape = api->CreateMesh(&terrain.vertices[0], (int)terrain.vertices.size() / 3, 3 * sizeof(float),
+                    &terrain.indices[0], 0, nullptr, terrain.GetNumTriangles());
+                api->AttachShape(shape);
+                api->Commit();
+
+                // Traversal state and kernels are set up once for the largest batch
+                QueryType const type = kQueryIntersection;
+                api->Prepare(options.max_batch, &type, 1);
+
+                std::vector<Intersection> hits(options.max_batch);
+
+                for (int batch = kMinBatchSize; batch <= options.max_batch; batch *= 4)
+                {
+                    std::stringstream record;
+                    record << prefix << ", \"batch\": " << batch;
+
+                    Buffer* ray_buffer = nullptr;
+                    Buffer* hit_buffer = nullptr;
+
+                    try
+                    {
+                        ray_buffer = api->CreateBuffer(batch * sizeof(ray), nullptr);
+                        hit_buffer = api->CreateBuffer(batch * sizeof(Intersection), nullptr);
+
+                        int const numsamples = std::max(std::min(options.samples, kMaxRaysPerBatchSize / batch), kMinSamples);
+
+                        // Warm up run is not recorded
+                        RunSample(api, ray_buffer, hit_buffer, rays, hits, batch, profiled);
+
+                        std::vector<Sample> samples;
+                        samples.reserve(numsamples);
+                        for (int i = 0; i < numsamples; ++i)
+                        {
+                            samples.push_back(RunSample(api, ray_buffer, hit_buffer, rays, hits, batch, profiled));
+                        }
+
+                        record << ", \"samples\": " << numsamples;
+                        WritePercentiles(record, "total_ms", samples, [](Sample const& s) { return s.upload + s.query + s.download; });
+                        WritePercentiles(record, "upload_ms", samples, [](Sample const& s) { return s.upload; });
+                        WritePercentiles(record, "query_ms", samples, [](Sample const& s) { return s.query; });
+                        WritePercentiles(record, "download_ms", samples, [](Sample const& s) { return s.download; });
+
+                        if (profiled)
+                        {
+                            WritePercentiles(record, "kernel_ms", samples, [](Sample const& s) { return s.kernels; });
+                            WritePercentiles(record, "launch_ms", samples, [](Sample const& s) { return std::max(s.query - s.kernels, 0.f); });
+                        }
+
+                        std::vector<float> totals;
+                        for (auto const& sample : samples)
+                        {
+                            totals.push_back(sample.upload + sample.query + sample.download);
+                        }
+
+                        std::cerr << GetPlatformName(info.platform) << " " << accel << " " << batch << " rays: p50 "
+                            << GetPercentile(totals, 0.5f) << " ms, p99 " << GetPercentile(totals, 0.99f) << " ms\n";
+                    }
+                    catch (Exception& e)
+                    {
+                        record << ", \"error\": \"" << Escape(e.what()) << "\"";
+                        std::cerr << GetPlatformName(info.platform) << " " << accel << " " << batch << " rays: " << e.what() << "\n";
+                    }
+
+                    if (ray_buffer)
+                    {
+                        api->DeleteBuffer(ray_buffer);
+                    }
+
+                    if (hit_buffer)
+                    {
+                        api->DeleteBuffer(hit_buffer);
+                    }
+
+                    record << " }";
+                    json << (first ? "" : ",\n") << record.str();
+                    first = false;
+                }
+            }
+            catch (Exception& e)
+            {
+                json << (first ? "" : ",\n") << prefix << ", \"error\": \"" << Escape(e.what()) << "\" }";
+                first = false;
+                std::cerr << GetPlatformName(info.platform) << " " << accel << ": " << e.what() << "\n";
+            }
+
+            if (api)
+            {
+                if (shape)
+                {
+                    api->DeleteShape(shape);
+                }
+
+                IntersectionApi::Delete(api);
+            }
+        }
+    }
+
+    int RunLatencyBenchmark(int argc, char** argv)
+    {
+        Options options;
+
+        if (!ParseOptions(argc, argv, options))
+        {
+            std::cerr << "Usage: Benchmark latency [-o output.json] [-b max_batch] [-n samples]\n";
+            return 1;
+        }
+
+        IntersectionApi::SetPlatform(DeviceInfo::kAny);
+
+        // Rays of all batch sizes are prefixes of the same set
+        Terrain terrain(kNumTriangles);
+        std::mt19937 rng(13);
+        std::vector<ray> rays = GenerateTerrainRays(terrain, options.max_batch, rng);
+
+        std::stringstream json;
+        json << "{\n  \"triangles\": " << terrain.GetNumTriangles() << ",\n  \"samples\": " << options.samples << ",\n  \"results\": [\n";
+        bool first = true;
+
+        for (std::uint32_t devidx = 0; devidx < IntersectionApi::GetDeviceCount(); ++devidx)
+        {
+            DeviceInfo info;
+            IntersectionApi::GetDeviceInfo(devidx, info);
+
+            if (info.platform == DeviceInfo::kEmbree)
+            {
+                RunConfiguration(terrain, rays, info, devidx, "embree", options, json, first);
+                continue;
+            }
+
+            for (auto accel : kAccelerators)
+            {
+                RunConfiguration(terrain, rays, info, devidx, accel, options, json, first);
+            }
+        }
+
+        json << "\n  ]\n}\n";
+
+        if (options.output.empty())
+        {
+            std::cout << json.str();
+        }
+        else
+        {
+            std::ofstream out(options.output);
+            out << json.str();
+        }
+
+        return 0;
+    }
+}
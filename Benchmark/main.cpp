@@ -0,0 +1,556 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Traversal benchmark: loads standard scenes and measures query throughput in Mrays/s
+/// for primary, diffuse bounce, shadow and random rays on every device and acceleration
+/// structure. Results are written as JSON.
+///
+/// Usage: Benchmark [-r resource_dir] [-o output.json] [-w width] [-n iterations] [-s heatmap_dir] [-c] [scene ...]
+///        Benchmark build [-o output.json] [-t max_triangles] [-j threads,...] [-n iterations] [-g scene,...]
+///        (builder scaling over triangle and thread counts on generated scenes, see build_benchmark.cpp
+///        and scene_generator.h)
+///        Benchmark latency [-o output.json] [-b max_batch] [-n samples]
+///        (query latency percentiles over batch sizes, see latency_benchmark.cpp)
+///        Benchmark primitives [-o output.json] [-s max_size] [-n iterations]
+///        (sort, scan, compact and reduce throughput of Calc devices, see primitives_benchmark.cpp)
+///        Benchmark replay capture_file [-o output.json] [-a acc.type,...] [-n iterations]
+///        (commit and query timings of a workload captured with "capture.path", see replay_benchmark.cpp)
+///
+/// Scenes are looked up in the resource directory (../Resources by default), missing ones are skipped.
+/// With -s traversal counters of "bvh" and "fatbvh" on OpenCL are collected in an extra pass,
+/// summarized in the report and primary ray node visits are written as PPM heatmaps to heatmap_dir.
+/// OBJ files are parsed in parallel, with -c they are also saved as .rrgeo binary geometry
+/// next to them, which later runs map instead of parsing.
+
+#include "radeon_rays.h"
+#include "geometry_ingest.h"
+#include "benchmark.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+using namespace Benchmark;
+
+namespace
+{
+    // Scene file and instancing layout
+    struct SceneDesc
+    {
+        char const* name;
+        char const* path;
+        // Instance the model on a grid x grid layout (0 for no instancing)
+        int grid;
+    };
+
+    SceneDesc const kScenes[] =
+    {
+        { "sponza", "sponza/sponza.obj", 0 },
+        { "san_miguel", "san-miguel/san-miguel.obj", 0 },
+        { "hairball", "hairball/hairball.obj", 0 },
+        { "forest", "tree/tree.obj", 32 }
+    };
+
+    // Acceleration structures to compare, "bvh2l" is "bvh" forced to 2 levels
+    char const* const kAccelerators[] = { "bvh", "fatbvh", "hlbvh", "bvh2l" };
+
+    // Ray sets traced for every configuration
+    enum RayType
+    {
+        kPrimary,
+        kDiffuse,
+        kShadow,
+        kRandom,
+        kNumRayTypes
+    };
+
+    char const* const kRayTypeNames[kNumRayTypes] = { "primary", "diffuse", "shadow", "random" };
+
+    struct Scene
+    {
+        std::string name;
+        GeometryIngest::Geometry geometry;
+        // Instance translations, empty for scenes without instancing
+        std::vector<float3> instances;
+        bbox bounds;
+    };
+
+    struct Options
+    {
+        std::string resources = "../Resources";
+        std::string output;
+        // Traversal statistics and heatmaps are collected if set
+        std::string heatmaps;
+        // Parsed OBJ files are saved as .rrgeo next to them and mapped by later runs
+        bool cache_geometry = false;
+        int width = 1024;
+        int iterations = 10;
+        std::vector<std::string> scenes;
+    };
+
+    bool LoadScene(Options const& options, SceneDesc const& desc, Scene& scene)
+    {
+        std::string path = options.resources + "/" + desc.path;
+        std::string cachepath = path.substr(0, path.find_last_of('.')) + ".rrgeo";
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Binary geometry written by an earlier run is mapped instead of parsing the OBJ
+        bool cached = GeometryIngest::LoadBinary(cachepath.c_str(), scene.geometry).empty();
+        std::string error = cached ? std::string() : GeometryIngest::LoadObj(path.c_str(), scene.geometry);
+
+        if (scene.geometry.GetMeshes().empty())
+        {
+            std::cerr << "Skipping " << desc.name << ": " << (error.empty() ? "no geometry" : error) << "\n";
+            return false;
+        }
+
+        auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::cerr << "Loaded " << desc.name << (cached ? " from " + cachepath : "") << " in " << elapsed << " ms\n";
+
+        if (!cached && options.cache_geometry)
+        {
+            error = GeometryIngest::WriteBinary(cachepath.c_str(), scene.geometry);
+            if (!error.empty())
+            {
+                std::cerr << error << "\n";
+            }
+        }
+
+        scene.name = desc.name;
+
+        bbox modelbounds;
+        for (auto const& mesh : scene.geometry.GetMeshes())
+        {
+            for (int i = 0; i < mesh.numvertices; ++i)
+            {
+                float const* p = mesh.positions + 3 * i;
+                modelbounds.grow(float3(p[0], p[1], p[2]));
+            }
+        }
+
+        if (desc.grid == 0)
+        {
+            scene.bounds = modelbounds;
+            return true;
+        }
+
+        // Instances are spread over xz plane leaving some space between them
+        float3 const ext = modelbounds.extents();
+        float const spacing = 1.2f * std::max(ext.x, ext.z);
+
+        for (int i = 0; i < desc.grid; ++i)
+        {
+            for (int j = 0; j < desc.grid; ++j)
+            {
+                float3 offset((i - desc.grid / 2) * spacing, 0.f, (j - desc.grid / 2) * spacing);
+                scene.instances.push_back(offset);
+                scene.bounds.grow(modelbounds.pmin + offset);
+                scene.bounds.grow(modelbounds.pmax + offset);
+            }
+        }
+
+        return true;
+    }
+
+    // Scene attached to an API, keeps shape to mesh mapping for normals
+    struct ApiScene
+    {
+        IntersectionApi* api;
+        std::vector<Shape*> shapes;
+        std::map<Id, int> meshes;
+
+        ~ApiScene()
+        {
+            for (auto shape : shapes)
+            {
+                api->DeleteShape(shape);
+            }
+        }
+    };
+
+    void AttachScene(Scene const& scene, ApiScene& apiscene)
+    {
+        auto api = apiscene.api;
+
+        auto const& meshes = scene.geometry.GetMeshes();
+
+        for (int i = 0; i < (int)meshes.size(); ++i)
+        {
+            // Meshes are copied straight from the mapped file or parsed arrays
+            auto const& mesh = meshes[i];
+            Shape* shape = api->CreateMesh(mesh.positions, mesh.numvertices, 3 * sizeof(float),
+                mesh.indices, 0, nullptr, mesh.numfaces);
+
+            apiscene.shapes.push_back(shape);
+            apiscene.meshes[shape->GetId()] = i;
+
+            if (scene.instances.empty())
+            {
+                api->AttachShape(shape);
+                continue;
+            }
+
+            for (auto const& offset : scene.instances)
+            {
+                Shape* instance = api->CreateInstance(shape);
+                matrix m = translation(offset);
+                instance->SetTransform(m, inverse(m));
+                api->AttachShape(instance);
+
+                apiscene.shapes.push_back(instance);
+                apiscene.meshes[instance->GetId()] = i;
+            }
+        }
+    }
+
+    // Pinhole camera in the middle of the scene looking along z, one ray per pixel
+    std::vector<ray> GeneratePrimaryRays(bbox const& bounds, int width)
+    {
+        std::vector<ray> rays(width * width);
+        float3 const eye = bounds.center();
+        float const tanfov = std::tan(0.5f * 60.f * 3.1415926f / 180.f);
+
+        for (int y = 0; y < width; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                float3 dir((2.f * (x + 0.5f) / width - 1.f) * tanfov, (2.f * (y + 0.5f) / width - 1.f) * tanfov, 1.f);
+                rays[y * width + x] = ray(eye, normalize(dir));
+            }
+        }
+
+        return rays;
+    }
+
+    // Geometric normal of a hit primitive
+    float3 GetNormal(Scene const& scene, ApiScene const& apiscene, Intersection const& hit)
+    {
+        auto const& mesh = scene.geometry.GetMeshes()[apiscene.meshes.find(hit.shapeid)->second];
+        float const* p = mesh.positions;
+        int const* idx = mesh.indices + 3 * hit.primid;
+        float3 v0(p[3 * idx[0]], p[3 * idx[0] + 1], p[3 * idx[0] + 2]);
+        float3 v1(p[3 * idx[1]], p[3 * idx[1] + 1], p[3 * idx[1] + 2]);
+        float3 v2(p[3 * idx[2]], p[3 * idx[2] + 1], p[3 * idx[2] + 2]);
+        return normalize(cross(v1 - v0, v2 - v0));
+    }
+
+    // Build secondary rays from primary hits: cosine weighted bounces and rays towards a light above the scene
+    void GenerateSecondaryRays(Scene const& scene, ApiScene const& apiscene, std::vector<ray> const& primary,
+        std::vector<Intersection> const& hits, std::mt19937& rng, std::vector<ray>& diffuse, std::vector<ray>& shadow)
+    {
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+        float3 const ext = scene.bounds.extents();
+        float3 const light = scene.bounds.center() + float3(0.f, 0.49f * ext.y, 0.f);
+        float const eps = 1e-4f * std::max(ext.x, std::max(ext.y, ext.z));
+
+        for (std::size_t i = 0; i < hits.size(); ++i)
+        {
+            if (hits[i].shapeid == kNullId)
+            {
+                continue;
+            }
+
+            float3 n = GetNormal(scene, apiscene, hits[i]);
+            if (dot(n, primary[i].d) > 0.f)
+            {
+                n = -n;
+            }
+
+            float3 const p = primary[i].o + hits[i].uvwt.w * primary[i].d + eps * n;
+
+            // Cosine weighted direction around the normal
+            float3 const t = normalize(std::fabs(n.x) > 0.5f ? cross(n, float3(0.f, 1.f, 0.f)) : cross(n, float3(1.f, 0.f, 0.f)));
+            float3 const b = cross(n, t);
+            float const r = std::sqrt(dist(rng));
+            float const phi = 2.f * 3.1415926f * dist(rng);
+            float3 const d = r * std::cos(phi) * t + r * std::sin(phi) * b + std::sqrt(std::max(0.f, 1.f - r * r)) * n;
+            diffuse.push_back(ray(p, normalize(d)));
+
+            float3 const l = light - p;
+            float const len = std::sqrt(dot(l, l));
+            shadow.push_back(ray(p, (1.f / len) * l, len));
+        }
+    }
+
+    // Trace all ray types of the scene with the current options and append a JSON record
+    void RunConfiguration(Scene const& scene, DeviceInfo const& info, std::uint32_t devidx, char const* accel,
+        Options const& options, std::ostream& json, bool& first)
+    {
+        std::stringstream record;
+        record << "    { \"scene\": \"" << scene.name << "\", \"backend\": \"" << GetPlatformName(info.platform)
+            << "\", \"device\": \"" << Escape(info.name ? info.name : "") << "\", \"accel\": \"" << accel << "\"";
+
+        IntersectionApi* api = nullptr;
+
+        try
+        {
+            api = IntersectionApi::Create(devidx);
+
+            if (std::strcmp(accel, "bvh2l") == 0)
+            {
+                api->SetOption("acc.type", "bvh");
+                api->SetOption("bvh.force2level", 1.f);
+            }
+            else
+            {
+                api->SetOption("acc.type", accel);
+            }
+
+            ApiScene apiscene;
+            apiscene.api = api;
+            AttachScene(scene, apiscene);
+
+            api->Commit();
+
+            CommitStatistics stats;
+            api->GetCommitStatistics(stats);
+            record << ", \"build_ms\": " << stats.total_time;
+
+            // Same rays for every configuration of the scene
+            std::mt19937 rng(13);
+            std::vector<ray> rays[kNumRayTypes];
+            rays[kPrimary] = GeneratePrimaryRays(scene.bounds, options.width);
+            rays[kRandom] = GenerateRandomRays(scene.bounds, options.width * options.width, rng);
+
+            // Secondary rays start at primary hits
+            {
+                std::vector<Intersection> hits(rays[kPrimary].size());
+                auto ray_buffer = api->CreateBuffer(rays[kPrimary].size() * sizeof(ray), &rays[kPrimary][0]);
+                auto hit_buffer = api->CreateBuffer(hits.size() * sizeof(Intersection), nullptr);
+
+                Event* e = nullptr;
+                api->QueryIntersection(ray_buffer, (int)rays[kPrimary].size(), hit_buffer, nullptr, nullptr);
+
+                Intersection* tmp = nullptr;
+                api->MapBuffer(hit_buffer, kMapRead, 0, hits.size() * sizeof(Intersection), (void**)&tmp, &e);
+                e->Wait();
+                api->DeleteEvent(e);
+                std::copy(tmp, tmp + hits.size(), hits.begin());
+                api->UnmapBuffer(hit_buffer, tmp, &e);
+                e->Wait();
+                api->DeleteEvent(e);
+
+                api->DeleteBuffer(ray_buffer);
+                api->DeleteBuffer(hit_buffer);
+
+                GenerateSecondaryRays(scene, apiscene, rays[kPrimary], hits, rng, rays[kDiffuse], rays[kShadow]);
+            }
+
+            record << ", \"mrays\": {";
+            for (int i = 0; i < kNumRayTypes; ++i)
+            {
+                float mrays = Measure(api, rays[i], i == kShadow, options.iterations);
+                record << (i ? ", " : " ") << "\"" << kRayTypeNames[i] << "\": " << mrays;
+                std::cerr << scene.name << " " << GetPlatformName(info.platform) << " " << accel << " "
+                    << kRayTypeNames[i] << ": " << mrays << " Mrays/s\n";
+            }
+            record << " }";
+
+            // Statistics kernels are slower, so counters are collected after timing
+            bool const hasstats = std::strcmp(accel, "bvh") == 0 || std::strcmp(accel, "fatbvh") == 0;
+
+            if (!options.heatmaps.empty() && hasstats && info.platform == DeviceInfo::kOpenCL)
+            {
+                api->SetOption("acc.traversal_stats", 1.f);
+                api->Commit();
+
+                record << ", \"traversal\": {";
+                for (int i = 0; i < kNumRayTypes; ++i)
+                {
+                    auto raystats = CollectTraversalStats(api, rays[i], i == kShadow);
+                    TraversalSummary summary = Summarize(raystats);
+                    record << (i ? ", " : " ") << "\"" << kRayTypeNames[i] << "\": { \"nodes\": " << summary.nodes
+                        << ", \"leaves\": " << summary.leaves << ", \"prims\": " << summary.prims
+                        << ", \"spills\": " << summary.spills << ", \"max_nodes\": " << summary.max_nodes
+                        << ", \"max_prims\": " << summary.max_prims << ", \"max_spills\": " << summary.max_spills
+                        << ", \"stack_overflows\": " << summary.stack_overflows << " }";
+
+                    if (i == kPrimary)
+                    {
+                        std::string path = options.heatmaps + "/" + scene.name + "_" + GetPlatformName(info.platform) + "_" + accel + ".ppm";
+                        if (!WriteHeatmap(path, raystats, options.width, options.width))
+                        {
+                            std::cerr << "Can't write " << path << "\n";
+                        }
+                    }
+                }
+                record << " }";
+            }
+        }
+        catch (Exception& e)
+        {
+            record << ", \"error\": \"" << Escape(e.what()) << "\"";
+            std::cerr << scene.name << " " << GetPlatformName(info.platform) << " " << accel << ": " << e.what() << "\n";
+        }
+
+        if (api)
+        {
+            IntersectionApi::Delete(api);
+        }
+
+        record << " }";
+        json << (first ? "" : ",\n") << record.str();
+        first = false;
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            bool const hasvalue = i + 1 < argc;
+
+            if (arg == "-r" && hasvalue)
+            {
+                options.resources = argv[++i];
+            }
+            else if (arg == "-o" && hasvalue)
+            {
+                options.output = argv[++i];
+            }
+            else if (arg == "-w" && hasvalue)
+            {
+                options.width = std::max(std::atoi(argv[++i]), 1);
+            }
+            else if (arg == "-n" && hasvalue)
+            {
+                options.iterations = std::max(std::atoi(argv[++i]), 1);
+            }
+            else if (arg == "-s" && hasvalue)
+            {
+                options.heatmaps = argv[++i];
+            }
+            else if (arg == "-c")
+            {
+                options.cache_geometry = true;
+            }
+            else if (arg[0] == '-')
+            {
+                return false;
+            }
+            else
+            {
+                options.scenes.push_back(arg);
+            }
+        }
+
+        return true;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "build")
+    {
+        return RunBuildBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "latency")
+    {
+        return RunLatencyBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "primitives")
+    {
+        return RunPrimitivesBenchmark(argc - 1, argv + 1);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "replay")
+    {
+        return RunReplayBenchmark(argc - 1, argv + 1);
+    }
+
+    Options options;
+
+    if (!ParseOptions(argc, argv, options))
+    {
+        std::cerr << "Usage: Benchmark [-r resource_dir] [-o output.json] [-w width] [-n iterations] [-s heatmap_dir] [-c] [scene ...]\n"
+            << "       Benchmark build [-o output.json] [-t max_triangles] [-j threads,...] [-n iterations] [-g scene,...]\n"
+            << "       Benchmark latency [-o output.json] [-b max_batch] [-n samples]\n"
+            << "       Benchmark primitives [-o output.json] [-s max_size] [-n iterations]\n"
+            << "       Benchmark replay capture_file [-o output.json] [-a acc.type,...] [-n iterations]\n";
+        return 1;
+    }
+
+    // Every platform is benchmarked
+    IntersectionApi::SetPlatform(DeviceInfo::kAny);
+
+    std::stringstream json;
+    json << "{\n  \"width\": " << options.width << ",\n  \"iterations\": " << options.iterations << ",\n  \"results\": [\n";
+    bool first = true;
+
+    for (auto const& desc : kScenes)
+    {
+        if (!options.scenes.empty() && std::find(options.scenes.begin(), options.scenes.end(), desc.name) == options.scenes.end())
+        {
+            continue;
+        }
+
+        Scene scene;
+        if (!LoadScene(options, desc, scene))
+        {
+            continue;
+        }
+
+        for (std::uint32_t devidx = 0; devidx < IntersectionApi::GetDeviceCount(); ++devidx)
+        {
+            DeviceInfo info;
+            IntersectionApi::GetDeviceInfo(devidx, info);
+
+            // Embree has a single acceleration structure of its own
+            if (info.platform == DeviceInfo::kEmbree)
+            {
+                RunConfiguration(scene, info, devidx, "embree", options, json, first);
+                continue;
+            }
+
+            for (auto accel : kAccelerators)
+            {
+                RunConfiguration(scene, info, devidx, accel, options, json, first);
+            }
+        }
+    }
+
+    json << "\n  ]\n}\n";
+
+    if (options.output.empty())
+    {
+        std::cout << json.str();
+    }
+    else
+    {
+        std::ofstream out(options.output);
+        out << json.str();
+    }
+
+    return 0;
+}
@@ -0,0 +1,359 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Parallel primitives benchmark: sweeps element counts from 1K to 16M and reports average
+/// time, effective bandwidth and element throughput of every Calc::Primitives operation
+/// on each OpenCL (CLWParallelPrimitives) and Vulkan device as JSON. Sorts and scans
+/// are on the HLBVH build path, so these numbers track the cost of device builds.
+/// Bandwidth counts the bytes each operation has to read and write at least once,
+/// e.g. keys and values in and out for sorts, so passes over temporaries lower it.
+
+#include "benchmark.h"
+
+#include "calc.h"
+#include "device.h"
+#include "primitives.h"
+#include "except.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+namespace Benchmark
+{
+    namespace
+    {
+        int const kMinSize = 1024;
+        int const kMaxSize = 16 * 1024 * 1024;
+
+        // Keys per segment of the segmented sort
+        int const kSegmentSize = 1024;
+
+        struct Options
+        {
+            std::string output;
+            int max_size = kMaxSize;
+            int iterations = 20;
+        };
+
+        typedef std::chrono::high_resolution_clock Clock;
+
+        bool ParseOptions(int argc, char** argv, Options& options)
+        {
+            for (int i = 1; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                bool const hasvalue = i + 1 < argc;
+
+                if (arg == "-o" && hasvalue)
+                {
+                    options.output = argv[++i];
+                }
+                else if (arg == "-s" && hasvalue)
+                {
+                    options.max_size = std::min(std::max(std::atoi(argv[++i]), kMinSize), kMaxSize);
+                }
+                else if (arg == "-n" && hasvalue)
+                {
+                    options.iterations = std::max(std::atoi(argv[++i]), 1);
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        // Device buffers of a single size shared by all the operations
+        struct Buffers
+        {
+            Calc::Device* device;
+            Calc::Buffer* keys;
+            Calc::Buffer* keys64;
+            Calc::Buffer* values;
+            Calc::Buffer* segments;
+            Calc::Buffer* starts;
+            Calc::Buffer* predicate;
+            Calc::Buffer* bounds;
+            Calc::Buffer* out_keys;
+            Calc::Buffer* out_values;
+            Calc::Buffer* out_bounds;
+            Calc::Buffer* count;
+
+            explicit Buffers(Calc::Device* device)
+                : device(device), keys(nullptr), keys64(nullptr), values(nullptr), segments(nullptr), starts(nullptr), predicate(nullptr)
+                , bounds(nullptr), out_keys(nullptr), out_values(nullptr), out_bounds(nullptr), count(nullptr)
+            {
+            }
+
+            ~Buffers()
+            {
+                for (auto buffer : { keys, keys64, values, segments, starts, predicate, bounds, out_keys, out_values, out_bounds, count })
+                {
+                    if (buffer)
+                    {
+                        device->DeleteBuffer(buffer);
+                    }
+                }
+            }
+
+            void Create(int size, std::mt19937& rng)
+            {
+                std::uniform_int_distribution<std::uint32_t> bits;
+                std::uniform_real_distribution<float> coord(-1.f, 1.f);
+
+                std::vector<std::uint32_t> data(2 * size);
+                std::generate(data.begin(), data.end(), [&]() { return bits(rng); });
+                keys = Upload(&data[0], size * sizeof(std::uint32_t));
+                keys64 = Upload(&data[0], size * sizeof(std::uint64_t));
+
+                // Float keys are taken from the same bits with sign and exponent cleared, so none is NaN
+                for (int i = 0; i < size; ++i)
+                {
+                    data[i] = (data[i] & 0x007FFFFF) | 0x3F800000;
+                }
+                values = Upload(&data[0], size * sizeof(std::uint32_t));
+
+                for (int i = 0; i < size; ++i)
+                {
+                    data[i] = i / kSegmentSize;
+                }
+                segments = Upload(&data[0], size * sizeof(std::uint32_t));
+
+                // Sizes are multiples of kSegmentSize
+                for (int i = 0; i < size / kSegmentSize; ++i)
+                {
+                    data[i] = i * kSegmentSize;
+                }
+                starts = Upload(&data[0], size / kSegmentSize * sizeof(std::uint32_t));
+
+                for (int i = 0; i < size; ++i)
+                {
+                    data[i] = bits(rng) & 1;
+                }
+                predicate = Upload(&data[0], size * sizeof(std::uint32_t));
+
+                std::vector<float> boxes(8 * size);
+                for (int i = 0; i < size; ++i)
+                {
+                    for (int j = 0; j < 3; ++j)
+                    {
+                        float const a = coord(rng);
+                        float const b = coord(rng);
+                        boxes[8 * i + j] = std::min(a, b);
+                        boxes[8 * i + 4 + j] = std::max(a, b);
+                    }
+                }
+                bounds = Upload(&boxes[0], boxes.size() * sizeof(float));
+
+                out_keys = device->CreateBuffer(size * sizeof(std::uint64_t), Calc::kRead | Calc::kWrite);
+                out_values = device->CreateBuffer(size * sizeof(std::uint32_t), Calc::kRead | Calc::kWrite);
+                out_bounds = device->CreateBuffer(size / kSegmentSize * 8 * sizeof(float), Calc::kRead | Calc::kWrite);
+                count = device->CreateBuffer(sizeof(std::uint32_t), Calc::kRead | Calc::kWrite);
+            }
+
+            Calc::Buffer* Upload(void* data, std::size_t size)
+            {
+                return device->CreateBuffer(size, Calc::kRead | Calc::kWrite, data);
+            }
+        };
+
+        // Operation measured: name, bytes read and written per element and the call itself
+        struct Operation
+        {
+            char const* name;
+            int bytes;
+            std::function<void(Calc::Primitives*, Buffers&, std::size_t)> run;
+        };
+
+        std::vector<Operation> GetOperations()
+        {
+            return {
+                { "sort_int32", 16, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->SortRadixInt32(0, b.keys, b.out_keys, b.values, b.out_values, n); } },
+                { "sort_int64", 24, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->SortRadixInt64(0, b.keys64, b.out_keys, b.values, b.out_values, n); } },
+                { "sort_float", 16, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->SortRadixFloat(0, b.values, b.out_keys, b.keys, b.out_values, n); } },
+                { "sort_segmented", 20, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->SortRadixSegmented(0, b.segments, b.keys, b.out_keys, b.values, b.out_values, n); } },
+                { "scan_int32", 8, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->ScanExclusiveAddInt32(0, b.predicate, b.out_values, n); } },
+                { "scan_float", 8, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->ScanExclusiveAddFloat(0, b.values, b.out_values, n); } },
+                { "compact_int32", 12, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->CompactInt32(0, b.predicate, b.keys, b.out_values, n, b.count); } },
+                { "reduce_int32", 4, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->ReduceAddInt32(0, b.predicate, b.out_values, n); } },
+                { "reduce_float", 4, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->ReduceAddFloat(0, b.values, b.out_values, n); } },
+                { "reduce_bounds", 32, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->ReduceBounds(0, b.bounds, b.out_bounds, n); } },
+                { "segmented_reduce_bounds", 32, [](Calc::Primitives* prims, Buffers& b, std::size_t n) { prims->SegmentedReduceBounds(0, b.starts, b.bounds, b.out_bounds, n, n / kSegmentSize); } }
+            };
+        }
+
+        char const* GetCalcPlatformName(Calc::Platform platform)
+        {
+            return platform == Calc::Platform::kOpenCL ? "opencl" : "vulkan";
+        }
+
+        // Sweep sizes on a device and append a JSON record per operation and size
+        void RunDevice(Calc::Calc* calc, Calc::Platform platform, std::uint32_t devidx, Options const& options, std::ostream& json, bool& first)
+        {
+            Calc::DeviceSpec spec;
+            calc->GetDeviceSpec(devidx, spec);
+
+            std::string const prefix = std::string("    { \"backend\": \"") + GetCalcPlatformName(platform) + "\", \"device\": \""
+                + Escape(spec.name ? spec.name : "") + "\"";
+
+            Calc::Device* device = nullptr;
+            Calc::Primitives* prims = nullptr;
+
+            try
+            {
+                device = calc->CreateDevice(devidx);
+                prims = device->CreatePrimitives();
+
+                auto const operations = GetOperations();
+                std::mt19937 rng(13);
+
+                for (int size = kMinSize; size <= options.max_size; size *= 4)
+                {
+                    // 64-bit keys are the largest single allocation
+                    if (spec.max_alloc_size && (std::size_t)size * sizeof(std::uint64_t) > spec.max_alloc_size)
+                    {
+                        break;
+                    }
+
+                    Buffers buffers(device);
+                    buffers.Create(size, rng);
+
+                    for (auto const& op : operations)
+                    {
+                        std::stringstream record;
+                        record << prefix << ", \"primitive\": \"" << op.name << "\", \"size\": " << size;
+
+                        try
+                        {
+                            // Warm up run compiles kernels and allocates temporaries
+                            op.run(prims, buffers, size);
+                            device->Finish(0);
+
+                            auto start = Clock::now();
+                            for (int i = 0; i < options.iterations; ++i)
+                            {
+                                op.run(prims, buffers, size);
+                            }
+                            device->Finish(0);
+
+                            double const ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / options.iterations;
+                            double const gbps = (double)size * op.bytes / (ms * 1e6);
+                            double const mkeys = size / (ms * 1e3);
+
+                            record << ", \"ms\": " << ms << ", \"gb_per_s\": " << gbps << ", \"mkeys_per_s\": " << mkeys;
+                            std::cerr << GetCalcPlatformName(platform) << " " << op.name << " " << size << ": "
+                                << ms << " ms, " << gbps << " GB/s, " << mkeys << " Mkeys/s\n";
+                        }
+                        catch (Calc::Exception& e)
+                        {
+                            record << ", \"error\": \"" << Escape(e.what()) << "\"";
+                            std::cerr << GetCalcPlatformName(platform) << " " << op.name << " " << size << ": " << e.what() << "\n";
+                        }
+
+                        record << " }";
+                        json << (first ? "" : ",\n") << record.str();
+                        first = false;
+                    }
+                }
+            }
+            catch (Calc::Exception& e)
+            {
+                json << (first ? "" : ",\n") << prefix << ", \"error\": \"" << Escape(e.what()) << "\" }";
+                first = false;
+                std::cerr << GetCalcPlatformName(platform) << ": " << e.what() << "\n";
+            }
+
+            if (device)
+            {
+                if (prims)
+                {
+                    device->DeletePrimitives(prims);
+                }
+
+                calc->DeleteDevice(device);
+            }
+        }
+    }
+
+    int RunPrimitivesBenchmark(int argc, char** argv)
+    {
+        Options options;
+
+        if (!ParseOptions(argc, argv, options))
+        {
+            std::cerr << "Usage: Benchmark primitives [-o output.json] [-s max_size] [-n iterations]\n";
+            return 1;
+        }
+
+        std::stringstream json;
+        json << "{\n  \"iterations\": " << options.iterations << ",\n  \"results\": [\n";
+        bool first = true;
+
+        // Backends not compiled in are skipped
+        for (auto platform : { Calc::Platform::kOpenCL, Calc::Platform::kVulkan })
+        {
+            Calc::Calc* calc = nullptr;
+
+            try
+            {
+                calc = CreateCalc(platform, 0);
+            }
+            catch (Calc::Exception& e)
+            {
+                std::cerr << GetCalcPlatformName(platform) << ": " << e.what() << "\n";
+            }
+
+            if (!calc)
+            {
+                continue;
+            }
+
+            for (std::uint32_t devidx = 0; devidx < calc->GetDeviceCount(); ++devidx)
+            {
+                RunDevice(calc, platform, devidx, options, json, first);
+            }
+
+            DeleteCalc(calc);
+        }
+
+        json << "\n  ]\n}\n";
+
+        if (options.output.empty())
+        {
+            std::cout << json.str();
+        }
+        else
+        {
+            std::ofstream out(options.output);
+            out << json.str();
+        }
+
+        return 0;
+    }
+}
@@ -0,0 +1,392 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Workload replay: runs a capture written with the "capture.path" option on every device and
+/// acceleration structure. Every captured commit is loaded with its options and committed, then
+/// the query batches captured after it are traced. Commit time and average query time over
+/// iterations of each batch are written as JSON, so that a production workload can be compared
+/// across backends and "acc.type" values without the application that produced it.
+/// Rays are replayed in the captured "acc.ray_format", hits aren't checked.
+
+#include "benchmark.h"
+
+#include "world/workload_capture.h"
+#include "device/remote_protocol.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    namespace
+    {
+        struct Options
+        {
+            std::string capture;
+            std::string output;
+            // Empty for the captured acc.type
+            std::vector<std::string> accels;
+            int iterations = 10;
+        };
+
+        // Query batch captured after a commit
+        struct Batch
+        {
+            QueryType type;
+            int numrays;
+            std::vector<char> rays;
+        };
+
+        // Captured commit and the batches following it
+        struct Frame
+        {
+            std::vector<Remote::SceneOption> options;
+            // Snapshot file written next to the capture for LoadSnapshot
+            std::string path;
+            std::vector<Batch> batches;
+        };
+
+        typedef std::chrono::high_resolution_clock Clock;
+
+        float GetElapsed(Clock::time_point start)
+        {
+            return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+        }
+
+        void Wait(IntersectionApi* api, Event* e)
+        {
+            e->Wait();
+            api->DeleteEvent(e);
+        }
+
+        bool ParseOptions(int argc, char** argv, Options& options)
+        {
+            for (int i = 1; i < argc; ++i)
+            {
+                std::string arg = argv[i];
+                bool const hasvalue = i + 1 < argc;
+
+                if (arg == "-o" && hasvalue)
+                {
+                    options.output = argv[++i];
+                }
+                else if (arg == "-a" && hasvalue)
+                {
+                    std::stringstream list(argv[++i]);
+                    std::string accel;
+                    while (std::getline(list, accel, ','))
+                    {
+                        options.accels.push_back(accel);
+                    }
+                }
+                else if (arg == "-n" && hasvalue)
+                {
+                    options.iterations = std::max(std::atoi(argv[++i]), 1);
+                }
+                else if (options.capture.empty() && arg[0] != '-')
+                {
+                    options.capture = arg;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+
+            return !options.capture.empty();
+        }
+
+        // Split the capture into frames and write their snapshots, false if the file is malformed.
+        // Frames read up to a malformed record are kept
+        bool ReadCapture(std::string const& path, std::vector<Frame>& frames)
+        {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file)
+            {
+                return false;
+            }
+
+            bool ok = true;
+            long end = 0;
+            Capture::RecordHeader header;
+            std::vector<char> payload;
+            while (ok && Capture::ReadRecord(file, header, payload))
+            {
+                if (header.type == Capture::kScene)
+                {
+                    Frame frame;
+                    std::size_t const offset = Remote::ReadSceneOptions(payload, frame.options);
+                    frame.path = path + "." + std::to_string(frames.size()) + ".rrsnap";
+
+                    std::FILE* snapshot = offset ? std::fopen(frame.path.c_str(), "wb") : nullptr;
+                    ok = snapshot && std::fwrite(&payload[offset], payload.size() - offset, 1, snapshot) == 1;
+                    if (snapshot)
+                    {
+                        std::fclose(snapshot);
+                    }
+
+                    if (ok)
+                    {
+                        frames.push_back(std::move(frame));
+                    }
+                    else
+                    {
+                        std::remove(frame.path.c_str());
+                    }
+                }
+                else if (header.type == Capture::kQuery)
+                {
+                    // Queries ahead of the first scene can't be replayed
+                    Capture::QueryRecord record;
+                    ok = !frames.empty() && payload.size() >= sizeof(record);
+                    if (ok)
+                    {
+                        std::memcpy(&record, payload.data(), sizeof(record));
+                        ok = payload.size() - sizeof(record) == (std::size_t)record.numrays * record.stride;
+                    }
+
+                    if (ok)
+                    {
+                        Batch batch;
+                        batch.type = static_cast<QueryType>(record.type);
+                        batch.numrays = (int)record.numrays;
+                        batch.rays.assign(payload.begin() + sizeof(record), payload.end());
+                        frames.back().batches.push_back(std::move(batch));
+                    }
+                }
+
+                end = std::ftell(file);
+            }
+
+            // Records end at the end of the file unless the capturing application crashed mid-record
+            std::fseek(file, 0, SEEK_END);
+            ok = ok && std::ftell(file) == end;
+            std::fclose(file);
+            return ok;
+        }
+
+        // Replay the frames on a device with acc.type overridden unless accel is empty and append a JSON record
+        void RunConfiguration(std::vector<Frame> const& frames, DeviceInfo const& info, std::uint32_t devidx,
+            std::string const& accel, Options const& options, std::ostream& json, bool& first)
+        {
+            std::string const prefix = std::string("    { \"backend\": \"") + GetPlatformName(info.platform) + "\", \"device\": \""
+                + Escape(info.name ? info.name : "") + "\", \"accel\": \"" + Escape(accel.empty() ? "captured" : accel) + "\"";
+
+            std::stringstream record;
+            record << prefix;
+
+            IntersectionApi* api = nullptr;
+            std::vector<Shape*> shapes;
+
+            try
+            {
+                api = IntersectionApi::Create(devidx);
+
+                float commit_ms = 0.f;
+                float query_ms = 0.f;
+                double numrays = 0.0;
+
+                record << ", \"frames\": [";
+                for (std::size_t i = 0; i < frames.size(); ++i)
+                {
+                    auto const& frame = frames[i];
+
+                    for (auto shape : shapes)
+                    {
+                        api->DeleteShape(shape);
+                    }
+                    shapes.clear();
+                    api->DetachAll();
+
+                    for (auto const& option : frame.options)
+                    {
+                        if (option.is_string)
+                            api->SetOption(option.name.c_str(), option.strval.c_str());
+                        else
+                            api->SetOption(option.name.c_str(), option.floatval);
+                    }
+
+                    // Embree has a single acceleration structure
+                    if (!accel.empty() && info.platform != DeviceInfo::kEmbree)
+                    {
+                        api->SetOption("acc.type", accel.c_str());
+                    }
+
+                    shapes.resize(api->LoadSnapshot(frame.path.c_str(), nullptr, 0));
+                    if (!shapes.empty())
+                    {
+                        api->LoadSnapshot(frame.path.c_str(), &shapes[0], (int)shapes.size());
+                    }
+
+                    auto start = Clock::now();
+                    api->Commit();
+                    float const commit = GetElapsed(start);
+                    commit_ms += commit;
+
+                    record << (i ? ", " : "") << "{ \"commit_ms\": " << commit << ", \"queries\": [";
+                    for (std::size_t j = 0; j < frame.batches.size(); ++j)
+                    {
+                        auto const& batch = frame.batches[j];
+
+                        // Full hits are the largest result of any hit or occlusion format
+                        Buffer* ray_buffer = api->CreateBuffer(batch.rays.size(), const_cast<char*>(batch.rays.data()));
+                        Buffer* hit_buffer = api->CreateBuffer(batch.numrays * sizeof(Intersection), nullptr);
+                        Event* e = nullptr;
+
+                        auto query = [&]()
+                        {
+                            if (batch.type == kQueryOcclusion)
+                                api->QueryOcclusion(ray_buffer, batch.numrays, hit_buffer, nullptr, &e);
+                            else
+                                api->QueryIntersection(ray_buffer, batch.numrays, hit_buffer, nullptr, &e);
+                            Wait(api, e);
+                        };
+
+                        // Warm up run is not recorded
+                        query();
+
+                        start = Clock::now();
+                        for (int k = 0; k < options.iterations; ++k)
+                        {
+                            query();
+                        }
+                        float const ms = GetElapsed(start) / options.iterations;
+
+                        api->DeleteBuffer(ray_buffer);
+                        api->DeleteBuffer(hit_buffer);
+
+                        query_ms += ms;
+                        numrays += batch.numrays;
+
+                        record << (j ? ", " : "") << "{ \"type\": \"" << (batch.type == kQueryOcclusion ? "occlusion" : "intersection")
+                            << "\", \"rays\": " << batch.numrays << ", \"ms\": " << ms << ", \"mrays\": " << batch.numrays / (ms * 1000.f) << " }";
+                    }
+                    record << "] }";
+                }
+
+                float const mrays = query_ms > 0.f ? (float)(numrays / (query_ms * 1000.0)) : 0.f;
+                record << "], \"commit_ms\": " << commit_ms << ", \"query_ms\": " << query_ms << ", \"mrays\": " << mrays;
+
+                std::cerr << GetPlatformName(info.platform) << " " << (accel.empty() ? "captured" : accel) << ": commit "
+                    << commit_ms << " ms, queries " << query_ms << " ms, " << mrays << " Mrays/s\n";
+            }
+            catch (Exception& e)
+            {
+                // Drop the partial frames of the failed configuration
+                record.str("");
+                record << prefix << ", \"error\": \"" << Escape(e.what()) << "\"";
+                std::cerr << GetPlatformName(info.platform) << " " << accel << ": " << e.what() << "\n";
+            }
+
+            if (api)
+            {
+                for (auto shape : shapes)
+                {
+                    api->DeleteShape(shape);
+                }
+
+                IntersectionApi::Delete(api);
+            }
+
+            record << " }";
+            json << (first ? "" : ",\n") << record.str();
+            first = false;
+        }
+    }
+
+    int RunReplayBenchmark(int argc, char** argv)
+    {
+        Options options;
+
+        if (!ParseOptions(argc, argv, options))
+        {
+            std::cerr << "Usage: Benchmark replay capture_file [-o output.json] [-a acc.type,...] [-n iterations]\n";
+            return 1;
+        }
+
+        std::vector<Frame> frames;
+        bool const ok = ReadCapture(options.capture, frames);
+
+        int numbatches = 0;
+        for (auto const& frame : frames)
+        {
+            numbatches += (int)frame.batches.size();
+        }
+
+        if (!ok)
+        {
+            std::cerr << "Capture " << options.capture << " is truncated or malformed, replaying "
+                << frames.size() << " complete scenes\n";
+        }
+
+        IntersectionApi::SetPlatform(DeviceInfo::kAny);
+
+        std::stringstream json;
+        json << "{\n  \"capture\": \"" << Escape(options.capture) << "\",\n  \"scenes\": " << frames.size()
+            << ",\n  \"queries\": " << numbatches << ",\n  \"iterations\": " << options.iterations << ",\n  \"results\": [\n";
+        bool first = true;
+
+        for (std::uint32_t devidx = 0; devidx < IntersectionApi::GetDeviceCount() && !frames.empty(); ++devidx)
+        {
+            DeviceInfo info;
+            IntersectionApi::GetDeviceInfo(devidx, info);
+
+            if (info.platform == DeviceInfo::kEmbree || options.accels.empty())
+            {
+                RunConfiguration(frames, info, devidx, "", options, json, first);
+                continue;
+            }
+
+            for (auto const& accel : options.accels)
+            {
+                RunConfiguration(frames, info, devidx, accel, options, json, first);
+            }
+        }
+
+        json << "\n  ]\n}\n";
+
+        for (auto const& frame : frames)
+        {
+            std::remove(frame.path.c_str());
+        }
+
+        if (options.output.empty())
+        {
+            std::cout << json.str();
+        }
+        else
+        {
+            std::ofstream out(options.output);
+            out << json.str();
+        }
+
+        return frames.empty() ? 1 : 0;
+    }
+}
@@ -0,0 +1,574 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Procedural stress scenes for the benchmarks. Every generator takes a triangle budget
+/// and a seed, so build and traversal can be swept over scale on reproducible scenes
+/// exercising cases the standard scenes do not: many small objects, thin overlapping
+/// primitives, heavy instancing, degenerate input and long diagonal triangles.
+/// Random numbers come straight from std::mt19937, which is fully specified, rather
+/// than from std distributions, which differ between standard library implementations.
+
+#include "scene_generator.h"
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    namespace
+    {
+        typedef GeneratedScene::Mesh Mesh;
+
+        // Uniform float in [0, 1)
+        float Random(std::mt19937& rng)
+        {
+            return (rng() >> 8) * (1.f / 16777216.f);
+        }
+
+        float Random(std::mt19937& rng, float a, float b)
+        {
+            return a + (b - a) * Random(rng);
+        }
+
+        float3 RandomDirection(std::mt19937& rng)
+        {
+            float const z = Random(rng, -1.f, 1.f);
+            float const phi = Random(rng, 0.f, 2.f * PI);
+            float const r = std::sqrt(std::max(1.f - z * z, 0.f));
+            return float3(r * std::cos(phi), r * std::sin(phi), z);
+        }
+
+        // Random unit vector perpendicular to d
+        float3 RandomPerpendicular(float3 const& d, std::mt19937& rng)
+        {
+            float3 p = cross(d, RandomDirection(rng));
+            if (p.sqnorm() < 1e-8f)
+            {
+                p = cross(d, float3(0.f, 1.f, 0.f));
+            }
+            return normalize(p);
+        }
+
+        int AddVertex(Mesh& mesh, float3 const& v)
+        {
+            mesh.vertices.push_back(v.x);
+            mesh.vertices.push_back(v.y);
+            mesh.vertices.push_back(v.z);
+            return (int)mesh.vertices.size() / 3 - 1;
+        }
+
+        void AddTriangle(Mesh& mesh, int i0, int i1, int i2)
+        {
+            mesh.indices.push_back(i0);
+            mesh.indices.push_back(i1);
+            mesh.indices.push_back(i2);
+        }
+
+        // Connect consecutive rings of slices vertices starting at first. Rings of a single
+        // point (poles) get one triangle per slice instead of a degenerate quad
+        void Stitch(Mesh& mesh, int first, std::vector<bool> const& poles, int slices)
+        {
+            for (int i = 0; i + 1 < (int)poles.size(); ++i)
+            {
+                int const r0 = first + i * slices;
+                int const r1 = r0 + slices;
+
+                for (int j = 0; j < slices; ++j)
+                {
+                    int const j1 = (j + 1) % slices;
+
+                    if (!poles[i])
+                    {
+                        AddTriangle(mesh, r0 + j, r1 + j, r0 + j1);
+                    }
+
+                    if (!poles[i + 1])
+                    {
+                        AddTriangle(mesh, r0 + j1, r1 + j, r1 + j1);
+                    }
+                }
+            }
+        }
+
+        // Surface of revolution around the y axis through center, profile points are (radius, height)
+        void Lathe(Mesh& mesh, std::vector<float2> const& profile, int slices, float3 const& center)
+        {
+            int const first = (int)mesh.vertices.size() / 3;
+            std::vector<bool> poles(profile.size());
+
+            for (size_t i = 0; i < profile.size(); ++i)
+            {
+                poles[i] = profile[i].x == 0.f;
+
+                for (int j = 0; j < slices; ++j)
+                {
+                    float const phi = 2.f * PI * j / slices;
+                    AddVertex(mesh, center + float3(profile[i].x * std::cos(phi), profile[i].y, profile[i].x * std::sin(phi)));
+                }
+            }
+
+            Stitch(mesh, first, poles, slices);
+        }
+
+        // Open tube along a path in the xy plane
+        void Tube(Mesh& mesh, std::vector<float3> const& path, std::vector<float> const& radii, int slices)
+        {
+            int const first = (int)mesh.vertices.size() / 3;
+            float3 const b(0.f, 0.f, 1.f);
+
+            for (size_t i = 0; i < path.size(); ++i)
+            {
+                float3 const t = normalize(path[std::min(i + 1, path.size() - 1)] - path[i > 0 ? i - 1 : 0]);
+                float3 const n = normalize(cross(b, t));
+
+                for (int j = 0; j < slices; ++j)
+                {
+                    float const phi = 2.f * PI * j / slices;
+                    AddVertex(mesh, path[i] + radii[i] * (std::cos(phi) * n + std::sin(phi) * b));
+                }
+            }
+
+            Stitch(mesh, first, std::vector<bool>(path.size(), false), slices);
+        }
+
+        // Piecewise linear resampling of keypoints to count points
+        template <typename T>
+        std::vector<T> Resample(std::vector<T> const& keys, int count)
+        {
+            std::vector<T> res(count);
+            for (int i = 0; i < count; ++i)
+            {
+                float const s = (float)i / (count - 1) * (keys.size() - 1);
+                size_t const k = std::min((size_t)s, keys.size() - 2);
+                float const f = s - k;
+                res[i] = keys[k] * (1.f - f) + keys[k + 1] * f;
+            }
+            return res;
+        }
+
+        float3 Bezier(float3 const& p0, float3 const& p1, float3 const& p2, float3 const& p3, float t)
+        {
+            float const s = 1.f - t;
+            return s * s * s * p0 + 3.f * s * s * t * p1 + 3.f * s * t * t * p2 + t * t * t * p3;
+        }
+
+        // Copy of mesh rotated around y and moved by offset
+        void Place(Mesh const& src, float angle, float3 const& offset, Mesh& dst)
+        {
+            float const c = std::cos(angle);
+            float const s = std::sin(angle);
+            dst.vertices.resize(src.vertices.size());
+
+            for (size_t i = 0; i < src.vertices.size(); i += 3)
+            {
+                float const x = src.vertices[i];
+                float const z = src.vertices[i + 2];
+                dst.vertices[i] = c * x + s * z + offset.x;
+                dst.vertices[i + 1] = src.vertices[i + 1] + offset.y;
+                dst.vertices[i + 2] = -s * x + c * z + offset.z;
+            }
+
+            dst.indices = src.indices;
+        }
+
+        // Mesh count per side of a cube holding count of them
+        int GridSize(int count)
+        {
+            int n = std::max((int)std::cbrt((float)count), 1);
+            while (n * n * n < count)
+            {
+                ++n;
+            }
+            return n;
+        }
+
+        void GenerateTerrain(int numtriangles, unsigned, GeneratedScene& scene)
+        {
+            Terrain terrain(numtriangles);
+            scene.meshes.resize(1);
+            scene.meshes[0].vertices = std::move(terrain.vertices);
+            scene.meshes[0].indices = std::move(terrain.indices);
+        }
+
+        // Jittered grid of UV spheres as separate meshes, both count and tessellation grow with the budget
+        void GenerateSpheres(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+            int const count = std::max((int)std::cbrt(numtriangles / 8.f), 1);
+            int const grid = GridSize(count);
+            // Triangles of a sphere are 4 * stacks^2 - 4 * stacks
+            int const stacks = std::max((int)std::sqrt(numtriangles / (4.f * count)), 3);
+
+            scene.meshes.resize(count);
+            for (int i = 0; i < count; ++i)
+            {
+                float const radius = Random(rng, 0.25f, 0.6f);
+                float3 const center(i % grid + Random(rng, 0.3f, 0.7f), (i / grid) % grid + Random(rng, 0.3f, 0.7f), i / (grid * grid) + Random(rng, 0.3f, 0.7f));
+
+                std::vector<float2> profile(stacks + 1);
+                for (int j = 0; j <= stacks; ++j)
+                {
+                    float const theta = PI * j / stacks;
+                    profile[j] = float2(j == 0 || j == stacks ? 0.f : radius * std::sin(theta), -radius * std::cos(theta));
+                }
+
+                Lathe(scene.meshes[i], profile, 2 * stacks, center);
+            }
+        }
+
+        // Random walk strands of thin ribbons crossing each other inside a unit ball, one mesh
+        void GenerateHairball(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+            int const segments = 64;
+            int const strands = std::max(numtriangles / (2 * segments), 1);
+            float const step = 0.04f;
+            float const width = 0.003f;
+
+            scene.meshes.resize(1);
+            Mesh& mesh = scene.meshes[0];
+            mesh.vertices.reserve(6 * strands * (segments + 1));
+            mesh.indices.reserve(6 * strands * segments);
+
+            for (int i = 0; i < strands; ++i)
+            {
+                float3 p = std::cbrt(Random(rng)) * RandomDirection(rng);
+                float3 d = RandomDirection(rng);
+
+                for (int j = 0; j <= segments; ++j)
+                {
+                    float3 const side = width * RandomPerpendicular(d, rng);
+                    int const v = AddVertex(mesh, p - side);
+                    AddVertex(mesh, p + side);
+
+                    if (j > 0)
+                    {
+                        AddTriangle(mesh, v - 2, v - 1, v);
+                        AddTriangle(mesh, v - 1, v + 1, v);
+                    }
+
+                    d = normalize(d + 0.4f * RandomDirection(rng));
+                    // Turn back towards the center near the surface of the ball
+                    if ((p + step * d).sqnorm() > 1.f)
+                    {
+                        d = normalize(d - p);
+                    }
+                    p += step * d;
+                }
+            }
+        }
+
+        // Tree of about 1800 triangles: trunk and stacked cones of foliage
+        void MakeTree(Mesh& tree)
+        {
+            int const slices = 24;
+            Lathe(tree, Resample(std::vector<float2>{ float2(0.05f, 0.f), float2(0.035f, 0.4f) }, 2), slices, float3());
+
+            for (int i = 0; i < 4; ++i)
+            {
+                float const base = 0.25f + 0.18f * i;
+                float const radius = 0.35f - 0.06f * i;
+                std::vector<float2> keys = { float2(0.f, base), float2(radius, base), float2(0.f, base + 0.35f) };
+                Lathe(tree, Resample(keys, 11), slices, float3());
+            }
+        }
+
+        // Square patch of randomly rotated and scaled instances of one tree, the tree itself is not attached
+        void GenerateForest(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+
+            scene.meshes.resize(1);
+            MakeTree(scene.meshes[0]);
+            scene.meshes[0].attached = false;
+
+            int const count = std::max(numtriangles / scene.meshes[0].GetNumTriangles(), 1);
+            int const grid = std::max((int)std::ceil(std::sqrt((float)count)), 1);
+
+            scene.instances.resize(count);
+            for (int i = 0; i < count; ++i)
+            {
+                float3 const position(0.5f * (i % grid) + Random(rng, -0.15f, 0.15f), 0.f, 0.5f * (i / grid) + Random(rng, -0.15f, 0.15f));
+                float const size = Random(rng, 0.7f, 1.3f);
+                scene.instances[i].mesh = 0;
+                scene.instances[i].transform = translation(position) * rotation_y(Random(rng, 0.f, 2.f * PI)) * scale(float3(size, size, size));
+            }
+        }
+
+        // Teapot of about 40 * level^2 triangles: lathed body and lid, swept spout and handle
+        void MakeTeapot(int level, Mesh& teapot)
+        {
+            int const slices = 4 * level;
+            std::vector<float2> body = { float2(0.f, 0.f), float2(1.2f, 0.f), float2(1.45f, 0.25f), float2(1.5f, 0.7f),
+                float2(1.35f, 1.2f), float2(1.1f, 1.45f), float2(1.f, 1.5f) };
+            std::vector<float2> lid = { float2(1.f, 1.5f), float2(0.6f, 1.6f), float2(0.15f, 1.7f), float2(0.22f, 1.85f), float2(0.f, 1.95f) };
+            Lathe(teapot, Resample(body, 3 * level), slices, float3());
+            Lathe(teapot, Resample(lid, 2 * level), slices, float3());
+
+            std::vector<float3> path(2 * level);
+            std::vector<float> radii(2 * level);
+
+            for (int i = 0; i < 2 * level; ++i)
+            {
+                float const t = (float)i / (2 * level - 1);
+                path[i] = Bezier(float3(1.2f, 0.5f, 0.f), float3(2.2f, 0.5f, 0.f), float3(2.f, 1.3f, 0.f), float3(2.6f, 1.5f, 0.f), t);
+                radii[i] = 0.3f - 0.2f * t;
+            }
+            Tube(teapot, path, radii, level);
+
+            for (int i = 0; i < 2 * level; ++i)
+            {
+                float const t = (float)i / (2 * level - 1);
+                path[i] = Bezier(float3(-1.35f, 1.2f, 0.f), float3(-2.3f, 1.4f, 0.f), float3(-2.3f, 0.3f, 0.f), float3(-1.45f, 0.4f, 0.f), t);
+                radii[i] = 0.1f;
+            }
+            Tube(teapot, path, radii, level);
+        }
+
+        // Grid of randomly rotated teapots as separate meshes, both count and tessellation grow with the budget
+        void GenerateTeapots(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+            int const count = std::max((int)std::sqrt(numtriangles / 1000.f), 1);
+            int const grid = std::max((int)std::ceil(std::sqrt((float)count)), 1);
+            int const level = std::max((int)std::sqrt(numtriangles / (40.f * count)), 2);
+
+            Mesh teapot;
+            MakeTeapot(level, teapot);
+
+            scene.meshes.resize(count);
+            for (int i = 0; i < count; ++i)
+            {
+                Place(teapot, Random(rng, 0.f, 2.f * PI), float3(6.f * (i % grid), 0.f, 6.f * (i / grid)), scene.meshes[i]);
+            }
+        }
+
+        // Randomly oriented triangles overlapping each other many times over in the unit cube
+        void GenerateSoup(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+            float const size = 4.f / std::cbrt((float)std::max(numtriangles, 1));
+
+            scene.meshes.resize(1);
+            Mesh& mesh = scene.meshes[0];
+
+            for (int i = 0; i < numtriangles; ++i)
+            {
+                float3 const c(Random(rng), Random(rng), Random(rng));
+                int const v = AddVertex(mesh, c + size * RandomDirection(rng));
+                AddVertex(mesh, c + size * RandomDirection(rng));
+                AddVertex(mesh, c + size * RandomDirection(rng));
+                AddTriangle(mesh, v, v + 1, v + 2);
+            }
+        }
+
+        // Soup with duplicated, collinear and single point triangles mixed in
+        void GenerateDegenerate(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+            float const size = 4.f / std::cbrt((float)std::max(numtriangles, 1));
+
+            scene.meshes.resize(1);
+            Mesh& mesh = scene.meshes[0];
+
+            for (int i = 0; i < numtriangles; ++i)
+            {
+                float const kind = Random(rng);
+                float3 const c(Random(rng), Random(rng), Random(rng));
+                float3 const d = size * RandomDirection(rng);
+
+                if (kind < 0.2f && i > 0)
+                {
+                    // Same vertices as the previous triangle
+                    mesh.indices.insert(mesh.indices.end(), mesh.indices.end() - 3, mesh.indices.end());
+                    continue;
+                }
+
+                int v = 0;
+                if (kind < 0.35f)
+                {
+                    v = AddVertex(mesh, c - d);
+                    AddVertex(mesh, c + d);
+                    AddVertex(mesh, c + Random(rng, -1.f, 1.f) * d);
+                }
+                else if (kind < 0.45f)
+                {
+                    v = AddVertex(mesh, c);
+                    AddVertex(mesh, c);
+                    AddVertex(mesh, c);
+                }
+                else
+                {
+                    v = AddVertex(mesh, c + d);
+                    AddVertex(mesh, c + size * RandomDirection(rng));
+                    AddVertex(mesh, c + size * RandomDirection(rng));
+                }
+
+                AddTriangle(mesh, v, v + 1, v + 2);
+            }
+        }
+
+        // Long thin triangles crossing the unit cube diagonally, their boxes overlap most of the scene
+        void GenerateSlivers(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            std::mt19937 rng(seed);
+
+            scene.meshes.resize(1);
+            Mesh& mesh = scene.meshes[0];
+
+            for (int i = 0; i < numtriangles; ++i)
+            {
+                float3 const p0(Random(rng), Random(rng), Random(rng));
+                float3 const p1(Random(rng), Random(rng), Random(rng));
+                float3 const side = 1e-3f * RandomPerpendicular(p1 - p0, rng);
+
+                int const v = AddVertex(mesh, p0);
+                AddVertex(mesh, p1);
+                AddVertex(mesh, 0.5f * (p0 + p1) + side);
+                AddTriangle(mesh, v, v + 1, v + 2);
+            }
+        }
+
+        bbox GetBounds(Mesh const& mesh)
+        {
+            bbox res;
+            for (size_t i = 0; i < mesh.vertices.size(); i += 3)
+            {
+                res.grow(float3(mesh.vertices[i], mesh.vertices[i + 1], mesh.vertices[i + 2]));
+            }
+            return res;
+        }
+
+        // Wrap a generator to fill the scene bounds after generation
+        template <void (*Generate)(int, unsigned, GeneratedScene&)>
+        void GenerateScene(int numtriangles, unsigned seed, GeneratedScene& scene)
+        {
+            scene = GeneratedScene();
+            Generate(std::max(numtriangles, 1), seed, scene);
+
+            std::vector<bbox> bounds(scene.meshes.size());
+            for (size_t i = 0; i < scene.meshes.size(); ++i)
+            {
+                bounds[i] = GetBounds(scene.meshes[i]);
+                if (scene.meshes[i].attached)
+                {
+                    scene.bounds.grow(bounds[i]);
+                }
+            }
+
+            for (auto const& instance : scene.instances)
+            {
+                scene.bounds.grow(transform_bbox(bounds[instance.mesh], instance.transform));
+            }
+        }
+    }
+
+    int GeneratedScene::GetNumTriangles() const
+    {
+        int res = 0;
+        for (auto const& mesh : meshes)
+        {
+            res += mesh.attached ? mesh.GetNumTriangles() : 0;
+        }
+
+        for (auto const& instance : instances)
+        {
+            res += meshes[instance.mesh].GetNumTriangles();
+        }
+
+        return res;
+    }
+
+    std::vector<Shape*> GeneratedScene::Attach(IntersectionApi* api) const
+    {
+        std::vector<Shape*> shapes;
+        shapes.reserve(meshes.size() + instances.size());
+
+        try
+        {
+            for (auto const& mesh : meshes)
+            {
+                Shape* shape = api->CreateMesh(&mesh.vertices[0], (int)mesh.vertices.size() / 3, 3 * sizeof(float),
+                    &mesh.indices[0], 0, nullptr, mesh.GetNumTriangles());
+                shapes.push_back(shape);
+
+                if (mesh.attached)
+                {
+                    api->AttachShape(shape);
+                }
+            }
+
+            for (auto const& instance : instances)
+            {
+                Shape* shape = api->CreateInstance(shapes[instance.mesh]);
+                shapes.push_back(shape);
+                shape->SetTransform(instance.transform, inverse(instance.transform));
+                api->AttachShape(shape);
+            }
+        }
+        catch (...)
+        {
+            // Instances go first as they refer to the meshes
+            for (auto it = shapes.rbegin(); it != shapes.rend(); ++it)
+            {
+                api->DeleteShape(*it);
+            }
+            throw;
+        }
+
+        return shapes;
+    }
+
+    std::vector<SceneGenerator> const& GetSceneGenerators()
+    {
+        static std::vector<SceneGenerator> const generators =
+        {
+            { "terrain", "bumpy height field in one mesh", GenerateScene<GenerateTerrain> },
+            { "spheres", "tessellated spheres as separate meshes", GenerateScene<GenerateSpheres> },
+            { "hairball", "random walk strands of thin ribbons in one mesh", GenerateScene<GenerateHairball> },
+            { "forest", "instances of a single tree", GenerateScene<GenerateForest> },
+            { "teapots", "grid of teapots as separate meshes", GenerateScene<GenerateTeapots> },
+            { "soup", "overlapping random triangles", GenerateScene<GenerateSoup> },
+            { "degenerate", "triangle soup with duplicate, collinear and point triangles", GenerateScene<GenerateDegenerate> },
+            { "slivers", "long thin triangles across the scene", GenerateScene<GenerateSlivers> }
+        };
+
+        return generators;
+    }
+
+    SceneGenerator const* FindSceneGenerator(std::string const& name)
+    {
+        for (auto const& generator : GetSceneGenerators())
+        {
+            if (name == generator.name)
+            {
+                return &generator;
+            }
+        }
+
+        return nullptr;
+    }
+}
@@ -0,0 +1,76 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+
+#include <string>
+#include <vector>
+
+namespace Benchmark
+{
+    // Procedurally generated scene. Meshes are in object space, they are attached
+    // by themselves or only through instances placing copies of them.
+    struct GeneratedScene
+    {
+        struct Mesh
+        {
+            std::vector<float> vertices;
+            std::vector<int> indices;
+            // Attached as a shape, otherwise only its instances are
+            bool attached = true;
+
+            int GetNumTriangles() const { return (int)indices.size() / 3; }
+        };
+
+        struct Instance
+        {
+            int mesh;
+            RadeonRays::matrix transform;
+        };
+
+        std::vector<Mesh> meshes;
+        std::vector<Instance> instances;
+        RadeonRays::bbox bounds;
+
+        // Triangles in the world including the instanced copies
+        int GetNumTriangles() const;
+
+        // Create meshes and instances and attach them, the shapes are deleted by the caller
+        std::vector<RadeonRays::Shape*> Attach(RadeonRays::IntersectionApi* api) const;
+    };
+
+    // Scene generator with a size knob: the number of triangles is close to the requested
+    // one and the same size and seed give the same scene on every platform
+    struct SceneGenerator
+    {
+        char const* name;
+        char const* description;
+        void (*generate)(int numtriangles, unsigned seed, GeneratedScene& scene);
+    };
+
+    // All the generators: "terrain", "spheres", "hairball", "forest", "teapots", "soup", "degenerate", "slivers"
+    std::vector<SceneGenerator> const& GetSceneGenerators();
+
+    // Generator of the given name, nullptr if there is none
+    SceneGenerator const* FindSceneGenerator(std::string const& name);
+}
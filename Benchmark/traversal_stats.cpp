@@ -0,0 +1,142 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+
+using namespace RadeonRays;
+
+namespace Benchmark
+{
+    // Spills the short stack kernel global stack holds (GLOBAL_STACK_SIZE / SHORT_STACK_SIZE),
+    // deeper spills overwrite the stack of the next ray
+    static int const kMaxStackSpills = 2;
+
+    std::vector<TraversalStats> CollectTraversalStats(IntersectionApi* api, std::vector<ray> const& rays, bool occlusion)
+    {
+        std::vector<TraversalStats> stats(rays.size());
+
+        if (rays.empty())
+        {
+            return stats;
+        }
+
+        int const count = (int)rays.size();
+        auto ray_buffer = api->CreateBuffer(count * sizeof(ray), const_cast<ray*>(&rays[0]));
+        auto hit_buffer = api->CreateBuffer(count * sizeof(Intersection), nullptr);
+        auto stats_buffer = api->CreateBuffer(count * sizeof(TraversalStats), nullptr);
+
+        api->SetTraversalStatsBuffer(stats_buffer);
+
+        if (occlusion)
+        {
+            api->QueryOcclusion(ray_buffer, count, hit_buffer, nullptr, nullptr);
+        }
+        else
+        {
+            api->QueryIntersection(ray_buffer, count, hit_buffer, nullptr, nullptr);
+        }
+
+        Event* e = nullptr;
+        TraversalStats* tmp = nullptr;
+        api->MapBuffer(stats_buffer, kMapRead, 0, count * sizeof(TraversalStats), (void**)&tmp, &e);
+        e->Wait();
+        api->DeleteEvent(e);
+        std::copy(tmp, tmp + count, stats.begin());
+        api->UnmapBuffer(stats_buffer, tmp, &e);
+        e->Wait();
+        api->DeleteEvent(e);
+
+        api->SetTraversalStatsBuffer(nullptr);
+        api->DeleteBuffer(ray_buffer);
+        api->DeleteBuffer(hit_buffer);
+        api->DeleteBuffer(stats_buffer);
+
+        return stats;
+    }
+
+    TraversalSummary Summarize(std::vector<TraversalStats> const& stats)
+    {
+        TraversalSummary summary = TraversalSummary();
+
+        for (auto const& s : stats)
+        {
+            summary.nodes += s.nodes;
+            summary.leaves += s.leaves;
+            summary.prims += s.prims;
+            summary.spills += s.spills;
+            summary.max_nodes = std::max(summary.max_nodes, s.nodes);
+            summary.max_prims = std::max(summary.max_prims, s.prims);
+            summary.max_spills = std::max(summary.max_spills, s.spills);
+            summary.stack_overflows += s.spills > kMaxStackSpills ? 1 : 0;
+        }
+
+        if (!stats.empty())
+        {
+            double const inv = 1.0 / stats.size();
+            summary.nodes *= inv;
+            summary.leaves *= inv;
+            summary.prims *= inv;
+            summary.spills *= inv;
+        }
+
+        return summary;
+    }
+
+    bool WriteHeatmap(std::string const& path, std::vector<TraversalStats> const& stats, int width, int height)
+    {
+        std::ofstream out(path, std::ios::binary);
+
+        if (!out || (int)stats.size() < width * height)
+        {
+            return false;
+        }
+
+        int maxnodes = 1;
+        for (auto const& s : stats)
+        {
+            maxnodes = std::max(maxnodes, s.nodes);
+        }
+
+        out << "P6\n" << width << " " << height << "\n255\n";
+
+        // Rows go bottom up in ray order, blue to green to red ramp over visited nodes
+        for (int y = height - 1; y >= 0; --y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                float const t = (float)stats[y * width + x].nodes / maxnodes;
+                unsigned char const rgb[3] =
+                {
+                    (unsigned char)(255.f * t),
+                    (unsigned char)(255.f * (1.f - std::abs(2.f * t - 1.f))),
+                    (unsigned char)(255.f * (1.f - t))
+                };
+                out.write((char const*)rgb, sizeof(rgb));
+            }
+        }
+
+        return (bool)out;
+    }
+}
@@ -310,6 +310,111 @@ DEFINE_SCAN_EXCLUSIVE_PART_4(float)
 DEFINE_DISTRIBUTE_PART_SUM_4(int)
 DEFINE_DISTRIBUTE_PART_SUM_4(float)
 
+// Sum reduction: every group strides over the array and writes its
+// partial sum, a single group over partial sums makes the total
+#define DEFINE_REDUCE_SUM(type)\
+    __attribute__((reqd_work_group_size(64, 1, 1)))\
+    __kernel void reduce_sum_##type(__global type const* in_array, uint numElems, __global type* out_sums)\
+{\
+    __local type shmem[64];\
+    int globalId  = get_global_id(0);\
+    int localId   = get_local_id(0);\
+    int globalSize = get_global_size(0);\
+    type sum = 0;\
+    for (int i = globalId; i < numElems; i += globalSize)\
+    {\
+        sum += in_array[i];\
+    }\
+    shmem[localId] = sum;\
+    barrier(CLK_LOCAL_MEM_FENCE);\
+    for (int stride = 32; stride > 0; stride >>= 1)\
+    {\
+        if (localId < stride)\
+        {\
+            shmem[localId] += shmem[localId + stride];\
+        }\
+        barrier(CLK_LOCAL_MEM_FENCE);\
+    }\
+    if (localId == 0)\
+    {\
+        out_sums[get_group_id(0)] = shmem[0];\
+    }\
+}
+
+DEFINE_REDUCE_SUM(int)
+DEFINE_REDUCE_SUM(float)
+
+// Bounds are min and max float4 pairs, empty bounds have min above max
+void group_reduce_bounds(int localId, __local float4* shmin, __local float4* shmax)
+{
+    for (int stride = 32; stride > 0; stride >>= 1)
+    {
+        if (localId < stride)
+        {
+            shmin[localId] = fmin(shmin[localId], shmin[localId + stride]);
+            shmax[localId] = fmax(shmax[localId], shmax[localId + stride]);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Bounds union: every group strides over the array and writes its
+// partial union, a single group over partial unions makes the total
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void reduce_bounds(__global float4 const* in_bounds, uint numElems, __global float4* out_bounds)
+{
+    __local float4 shmin[64];
+    __local float4 shmax[64];
+    int globalId  = get_global_id(0);
+    int localId   = get_local_id(0);
+    int globalSize = get_global_size(0);
+    float4 bmin = (float4)(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    float4 bmax = (float4)(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+    for (int i = globalId; i < numElems; i += globalSize)
+    {
+        bmin = fmin(bmin, in_bounds[2 * i]);
+        bmax = fmax(bmax, in_bounds[2 * i + 1]);
+    }
+    shmin[localId] = bmin;
+    shmax[localId] = bmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    group_reduce_bounds(localId, shmin, shmax);
+    if (localId == 0)
+    {
+        out_bounds[2 * get_group_id(0)] = shmin[0];
+        out_bounds[2 * get_group_id(0) + 1] = shmax[0];
+    }
+}
+
+// Bounds union per segment, a group per segment. Segment i covers
+// [segment_starts[i], segment_starts[i + 1]) and the last one ends at numElems.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+__kernel void segmented_reduce_bounds(__global float4 const* in_bounds, __global int const* segment_starts, uint numElems, uint numSegments, __global float4* out_bounds)
+{
+    __local float4 shmin[64];
+    __local float4 shmax[64];
+    int localId   = get_local_id(0);
+    int segment   = get_group_id(0);
+    int start = segment_starts[segment];
+    int end = segment + 1 < numSegments ? segment_starts[segment + 1] : numElems;
+    float4 bmin = (float4)(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    float4 bmax = (float4)(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+    for (int i = start + localId; i < end; i += 64)
+    {
+        bmin = fmin(bmin, in_bounds[2 * i]);
+        bmax = fmax(bmax, in_bounds[2 * i + 1]);
+    }
+    shmin[localId] = bmin;
+    shmax[localId] = bmax;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    group_reduce_bounds(localId, shmin, shmax);
+    if (localId == 0)
+    {
+        out_bounds[2 * segment] = shmin[0];
+        out_bounds[2 * segment + 1] = shmax[0];
+    }
+}
+
 /// Specific function for radix-sort needs
 /// Group exclusive add multiscan on 4 arrays of shorts in parallel
 /// with 4x reduction in registers
@@ -518,6 +623,21 @@ int4 safe_load_int4_intmax(__global int4* source, uint idx, uint sizeInInts)
     return res;
 }
 
+// Pad with all bits set, so padding goes after any unsigned key in every radix digit
+int4 safe_load_int4_uintmax(__global int4* source, uint idx, uint sizeInInts)
+{
+    int4 res = make_int4(-1, -1, -1, -1);
+    if (((idx + 1) << 2) <= sizeInInts)
+        res = source[idx];
+    else
+    {
+        if ((idx << 2) < sizeInInts) res.x = source[idx].x;
+        if ((idx << 2) + 1 < sizeInInts) res.y = source[idx].y;
+        if ((idx << 2) + 2 < sizeInInts) res.z = source[idx].z;
+    }
+    return res;
+}
+
 void safe_store_int(int val, __global int* dest, uint idx, uint sizeInInts)
 {
     if (idx < sizeInInts)
@@ -631,7 +751,7 @@ void BitHistogram(
     for (int block = 0; block < min(numblocks_per_group, maxblocks); ++block, loadidx += GROUP_SIZE)
     {
         /// Load single int4 value
-        int4 value = safe_load_int4_intmax(in_array, loadidx, numelems);
+        int4 value = safe_load_int4_uintmax(in_array, loadidx, numelems);
 
         /// Handle value adding histogram bins
         /// for all 4 elements
@@ -708,7 +828,7 @@ void ScatterKeys(// Number of bits to shift
     for (int block = 0; block < min(numblocks_per_group, maxblocks); ++block, loadidx += GROUP_SIZE)
     {
         // Load single int4 value
-        int4 localvals = safe_load_int4_intmax(in_keys, loadidx, numelems);
+        int4 localvals = safe_load_int4_uintmax(in_keys, loadidx, numelems);
 
         // Clear the histogram
         histogram[localid] = 0;
@@ -891,7 +1011,7 @@ void ScatterKeysAndValues(// Number of bits to shift
     for (int block = 0; block < min(numblocks_per_group, maxblocks); ++block, loadidx += GROUP_SIZE)
     {
         // Load single int4 value
-        int4 localkeys = safe_load_int4_intmax(in_keys, loadidx, numelems);
+        int4 localkeys = safe_load_int4_uintmax(in_keys, loadidx, numelems);
         int4 localvals = safe_load_int4_intmax(in_values, loadidx, numelems);
 
         // Clear the histogram
@@ -1092,6 +1212,113 @@ __kernel void copy(__global int4* in_input,
 }
 
 
+// Split 64-bit keys into 32-bit halves for two pass sorting
+// and initialize the permutation with identity
+__kernel void split_keys_64(__global ulong const* in_keys,
+    uint in_size,
+    __global uint* out_low,
+    __global uint* out_high,
+    __global int* out_permutation)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        ulong key = in_keys[global_id];
+        out_low[global_id] = (uint)key;
+        out_high[global_id] = (uint)(key >> 32);
+        out_permutation[global_id] = global_id;
+    }
+}
+
+// out_output[i] = in_input[in_permutation[i]]
+__kernel void gather_int(__global int const* in_input,
+    __global int const* in_permutation,
+    uint in_size,
+    __global int* out_output)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        out_output[global_id] = in_input[in_permutation[global_id]];
+    }
+}
+
+// Apply final permutation to 64-bit keys and their values
+__kernel void gather_keys_and_values_64(__global ulong const* in_keys,
+    __global int const* in_values,
+    __global int const* in_permutation,
+    uint in_size,
+    __global ulong* out_keys,
+    __global int* out_values)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        int idx = in_permutation[global_id];
+        out_keys[global_id] = in_keys[idx];
+        out_values[global_id] = in_values[idx];
+    }
+}
+
+// Map float keys to uints sorting in the same order:
+// negative floats get all bits flipped, positive ones the sign bit
+__kernel void float_keys_to_ordered(__global uint const* in_keys,
+    uint in_size,
+    __global uint* out_keys)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        uint key = in_keys[global_id];
+        out_keys[global_id] = key ^ ((key & 0x80000000u) ? 0xFFFFFFFFu : 0x80000000u);
+    }
+}
+
+// Inverse of float_keys_to_ordered, in place
+__kernel void ordered_keys_to_float(__global uint* inout_keys,
+    uint in_size)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        uint key = inout_keys[global_id];
+        inout_keys[global_id] = key ^ ((key & 0x80000000u) ? 0x80000000u : 0xFFFFFFFFu);
+    }
+}
+
+// Segment index goes to the high half, so a single 64-bit sort
+// groups keys by segment and sorts them within segments
+__kernel void make_segmented_keys_64(__global uint const* in_segments,
+    __global uint const* in_keys,
+    uint in_size,
+    __global ulong* out_keys)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        out_keys[global_id] = ((ulong)in_segments[global_id] << 32) | in_keys[global_id];
+    }
+}
+
+// Low halves of 64-bit keys
+__kernel void low_keys_64(__global ulong const* in_keys,
+    uint in_size,
+    __global uint* out_keys)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < in_size)
+    {
+        out_keys[global_id] = (uint)in_keys[global_id];
+    }
+}
+
 #define FLAG(x) (flags[(x)] & 0x1)
 #define FLAG_COMBINED(x) (flags[(x)])
 #define FLAG_ORIG(x) ((flags[(x)] >> 1) & 0x1)
@@ -1492,3 +1719,367 @@ __kernel void segmented_distribute_part_sum_int_nocut(
         }
     }
 }
+
+// ----------------- SINGLE PASS PRIMITIVES -----------------
+// Scan and radix sort with decoupled look-back (Merrill & Garland 2016,
+// Adinets & Merrill 2022). Every tile publishes its aggregate and then
+// sums the preceding ones walking backwards until it meets a tile with
+// the inclusive prefix already known. Groups take tile indices from an
+// atomic counter in the order they start, so all the tiles a group waits
+// for are either running or finished and the wait always terminates.
+#define LOOKBACK_GROUP_SIZE 256
+#define LOOKBACK_ITEMS_PER_THREAD 8
+#define LOOKBACK_TILE_SIZE (LOOKBACK_GROUP_SIZE * LOOKBACK_ITEMS_PER_THREAD)
+
+#define ONESWEEP_RADIX_BITS 8
+#define ONESWEEP_RADIX (1 << ONESWEEP_RADIX_BITS)
+#define ONESWEEP_RADIX_MASK (ONESWEEP_RADIX - 1)
+#define ONESWEEP_NUM_PASSES (32 / ONESWEEP_RADIX_BITS)
+
+// A thread per digit in the look-back
+#if ONESWEEP_RADIX != LOOKBACK_GROUP_SIZE
+#error ONESWEEP_RADIX must match LOOKBACK_GROUP_SIZE
+#endif
+
+// Tile flags of a later epoch are larger than the ones of the earlier
+// epochs, so sort passes share the flags without clearing them in between
+#define LOOKBACK_FLAG_AGGREGATE(epoch) (2 * (epoch) + 1)
+#define LOOKBACK_FLAG_PREFIX(epoch) (2 * (epoch) + 2)
+
+// Publish the tile aggregate and return the sum of the preceding tiles.
+// Status of the tile i is at i * stride, values are written before flags.
+int lookback_exclusive_prefix(
+    // Tile flags
+    __global volatile int* flags,
+    // Tile aggregates
+    __global volatile int* aggregates,
+    // Tile inclusive prefixes
+    __global volatile int* prefixes,
+    // Tile index
+    int tile,
+    // Distance between the status words of adjacent tiles
+    int stride,
+    // Epoch of the flags
+    int epoch,
+    // Tile aggregate
+    int aggregate
+    )
+{
+    if (tile == 0)
+    {
+        prefixes[0] = aggregate;
+        write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+        atomic_xchg(&flags[0], LOOKBACK_FLAG_PREFIX(epoch));
+        return 0;
+    }
+
+    aggregates[tile * stride] = aggregate;
+    write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+    atomic_xchg(&flags[tile * stride], LOOKBACK_FLAG_AGGREGATE(epoch));
+
+    int prefix = 0;
+    int i = tile - 1;
+    while (i >= 0)
+    {
+        int flag = atomic_add(&flags[i * stride], 0);
+
+        // Not published yet, spin
+        if (flag < LOOKBACK_FLAG_AGGREGATE(epoch))
+            continue;
+
+        read_mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+        if (flag == LOOKBACK_FLAG_PREFIX(epoch))
+        {
+            prefix += prefixes[i * stride];
+            break;
+        }
+
+        prefix += aggregates[i * stride];
+        --i;
+    }
+
+    prefixes[tile * stride] = prefix + aggregate;
+    write_mem_fence(CLK_GLOBAL_MEM_FENCE);
+    atomic_xchg(&flags[tile * stride], LOOKBACK_FLAG_PREFIX(epoch));
+
+    return prefix;
+}
+
+// Single pass exclusive scan, in_array and out_array might be the same.
+// Status holds the tile counter followed by the tile flags, both cleared.
+__kernel
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))
+void scan_exclusive_lookback_int(
+    // Input array
+    __global int const* in_array,
+    // Number of elements
+    uint numElems,
+    // Tile counter and flags
+    __global int* status,
+    // Tile aggregates
+    __global int* aggregates,
+    // Tile inclusive prefixes
+    __global int* prefixes,
+    // Output array
+    __global int* out_array
+    )
+{
+    __local int tile_values[LOOKBACK_TILE_SIZE];
+    __local int shmem[LOOKBACK_GROUP_SIZE];
+    __local int tile_index;
+    __local int tile_prefix;
+
+    int localId = get_local_id(0);
+
+    if (localId == 0)
+    {
+        tile_index = atomic_inc(&status[0]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int tileStart = tile_index * LOOKBACK_TILE_SIZE;
+
+    // Coalesced load
+    for (int i = localId; i < LOOKBACK_TILE_SIZE; i += LOOKBACK_GROUP_SIZE)
+    {
+        tile_values[i] = tileStart + i < numElems ? in_array[tileStart + i] : 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Every thread reduces its consecutive items
+    int items[LOOKBACK_ITEMS_PER_THREAD];
+    int sum = 0;
+    for (int i = 0; i < LOOKBACK_ITEMS_PER_THREAD; ++i)
+    {
+        items[i] = tile_values[localId * LOOKBACK_ITEMS_PER_THREAD + i];
+        sum += items[i];
+    }
+
+    shmem[localId] = sum;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int total = group_scan_exclusive_part_int(localId, LOOKBACK_GROUP_SIZE, shmem);
+
+    if (localId == 0)
+    {
+        tile_prefix = lookback_exclusive_prefix(status + 1, aggregates, prefixes, tile_index, 1, 0, total);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int prefix = tile_prefix + shmem[localId];
+    for (int i = 0; i < LOOKBACK_ITEMS_PER_THREAD; ++i)
+    {
+        tile_values[localId * LOOKBACK_ITEMS_PER_THREAD + i] = prefix;
+        prefix += items[i];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Coalesced store
+    for (int i = localId; i < LOOKBACK_TILE_SIZE; i += LOOKBACK_GROUP_SIZE)
+    {
+        if (tileStart + i < numElems)
+            out_array[tileStart + i] = tile_values[i];
+    }
+}
+
+// Digit histograms of all the sort passes in a single read of the keys,
+// out_histograms are expected to be cleared
+__kernel
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))
+void onesweep_histogram(
+    // Input keys
+    __global uint const* in_keys,
+    // Number of keys
+    uint numElems,
+    // Histograms, ONESWEEP_RADIX bins per pass
+    __global int* out_histograms
+    )
+{
+    __local int histograms[ONESWEEP_NUM_PASSES * ONESWEEP_RADIX];
+
+    int localId = get_local_id(0);
+
+    for (int i = localId; i < ONESWEEP_NUM_PASSES * ONESWEEP_RADIX; i += LOOKBACK_GROUP_SIZE)
+    {
+        histograms[i] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = get_global_id(0); i < numElems; i += get_global_size(0))
+    {
+        uint key = in_keys[i];
+
+        for (int pass = 0; pass < ONESWEEP_NUM_PASSES; ++pass)
+        {
+            atomic_inc(&histograms[pass * ONESWEEP_RADIX + ((key >> (pass * ONESWEEP_RADIX_BITS)) & ONESWEEP_RADIX_MASK)]);
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = localId; i < ONESWEEP_NUM_PASSES * ONESWEEP_RADIX; i += LOOKBACK_GROUP_SIZE)
+    {
+        atomic_add(&out_histograms[i], histograms[i]);
+    }
+}
+
+// Exclusive scan of the pass histograms in place, a group per pass
+__kernel
+__attribute__((reqd_work_group_size(ONESWEEP_RADIX, 1, 1)))
+void onesweep_scan_histograms(
+    // Histograms, ONESWEEP_RADIX bins per pass
+    __global int* histograms
+    )
+{
+    __local int shmem[ONESWEEP_RADIX];
+
+    int localId = get_local_id(0);
+    int pass = get_group_id(0);
+
+    shmem[localId] = histograms[pass * ONESWEEP_RADIX + localId];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    group_scan_exclusive_int(localId, ONESWEEP_RADIX, shmem);
+
+    histograms[pass * ONESWEEP_RADIX + localId] = shmem[localId];
+}
+
+// Single sort pass: the tile is sorted by the digit in local memory with
+// 1-bit splits, then digit offsets of the tile come from the look-back
+// over the tiles before it. Status holds the tile counters of all the
+// passes followed by ONESWEEP_RADIX flags per tile, both cleared before
+// the first pass.
+__kernel
+__attribute__((reqd_work_group_size(LOOKBACK_GROUP_SIZE, 1, 1)))
+void onesweep_scatter_keys_and_values(
+    // Sort pass
+    int pass,
+    // Input keys
+    __global uint const* restrict in_keys,
+    // Input values
+    __global int const* restrict in_values,
+    // Number of keys
+    uint numElems,
+    // Scanned histograms
+    __global int const* restrict in_histograms,
+    // Tile counters and flags
+    __global int* status,
+    // Tile digit aggregates
+    __global int* aggregates,
+    // Tile digit inclusive prefixes
+    __global int* prefixes,
+    // Output keys
+    __global uint* restrict out_keys,
+    // Output values
+    __global int* restrict out_values
+    )
+{
+    __local uint keys[LOOKBACK_TILE_SIZE];
+    __local int indices[LOOKBACK_TILE_SIZE];
+    __local uint shmem[LOOKBACK_GROUP_SIZE];
+    __local int digit_start[ONESWEEP_RADIX];
+    __local int digit_offset[ONESWEEP_RADIX];
+    __local int tile_index;
+
+    int localId = get_local_id(0);
+
+    if (localId == 0)
+    {
+        tile_index = atomic_inc(&status[pass]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int tile = tile_index;
+    int tileStart = tile * LOOKBACK_TILE_SIZE;
+    int numValid = min((int)numElems - tileStart, LOOKBACK_TILE_SIZE);
+    int shift = pass * ONESWEEP_RADIX_BITS;
+
+    // Keys past the end go to the back of the tile
+    for (int i = localId; i < LOOKBACK_TILE_SIZE; i += LOOKBACK_GROUP_SIZE)
+    {
+        keys[i] = i < numValid ? in_keys[tileStart + i] : 0xFFFFFFFF;
+        indices[i] = i;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Stable local sort by the digit
+    for (int bit = shift; bit < shift + ONESWEEP_RADIX_BITS; ++bit)
+    {
+        uint k[LOOKBACK_ITEMS_PER_THREAD];
+        int idx[LOOKBACK_ITEMS_PER_THREAD];
+        uint zeros = 0;
+
+        for (int i = 0; i < LOOKBACK_ITEMS_PER_THREAD; ++i)
+        {
+            k[i] = keys[localId * LOOKBACK_ITEMS_PER_THREAD + i];
+            idx[i] = indices[localId * LOOKBACK_ITEMS_PER_THREAD + i];
+            zeros += ((k[i] >> bit) & 1) ^ 1;
+        }
+
+        shmem[localId] = zeros;
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        uint totalZeros = 0;
+        group_scan_exclusive_sum_uint(localId, LOOKBACK_GROUP_SIZE, shmem, &totalZeros);
+
+        uint zerosBefore = shmem[localId];
+        for (int i = 0; i < LOOKBACK_ITEMS_PER_THREAD; ++i)
+        {
+            uint pos = localId * LOOKBACK_ITEMS_PER_THREAD + i;
+            uint b = (k[i] >> bit) & 1;
+            uint dst = b ? totalZeros + pos - zerosBefore : zerosBefore;
+            zerosBefore += b ^ 1;
+
+            keys[dst] = k[i];
+            indices[dst] = idx[i];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Digit counts of the valid keys, those occupy the front of the tile
+    digit_start[localId] = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = localId; i < numValid; i += LOOKBACK_GROUP_SIZE)
+    {
+        atomic_inc(&digit_start[(keys[i] >> shift) & ONESWEEP_RADIX_MASK]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int count = digit_start[localId];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    group_scan_exclusive_int(localId, ONESWEEP_RADIX, digit_start);
+
+    // A thread per digit walks back the tiles
+    int prefix = lookback_exclusive_prefix(status + ONESWEEP_NUM_PASSES + localId,
+        aggregates + localId, prefixes + localId, tile, ONESWEEP_RADIX, pass, count);
+
+    digit_offset[localId] = in_histograms[pass * ONESWEEP_RADIX + localId] + prefix - digit_start[localId];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int i = localId; i < numValid; i += LOOKBACK_GROUP_SIZE)
+    {
+        uint key = keys[i];
+        int dst = digit_offset[(key >> shift) & ONESWEEP_RADIX_MASK] + i;
+
+        out_keys[dst] = key;
+        out_values[dst] = in_values[tileStart + indices[i]];
+    }
+}
@@ -48,6 +48,9 @@ public:
     static CLWBuffer<T> Create(cl_context context, cl_mem_flags flags, size_t elementCount, void* data);
     static CLWBuffer<T> CreateFromClBuffer(cl_mem buffer);
 
+    // Region of elemCount elements starting at offset sharing the memory of this buffer
+    CLWBuffer<T> CreateSubBuffer(cl_mem_flags flags, size_t offset, size_t elemCount) const;
+
     CLWBuffer() : elementCount_(0){}
     virtual ~CLWBuffer();
     
@@ -60,13 +63,14 @@ public:
     
 private:
     CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t elemCount);
-    CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount);
+    CLWEvent WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents = std::vector<CLWEvent>());
     CLWEvent FillDeviceBuffer(CLWCommandQueue cmdQueue, T const& val, size_t elemCount);
+    CLWEvent FillDeviceBuffer(CLWCommandQueue cmdQueue, T const& val, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents = std::vector<CLWEvent>());
     CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t elemCount);
-    CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount);
+    CLWEvent ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents = std::vector<CLWEvent>());
     CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, T** mappedData);
-    CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData);
-    CLWEvent UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData);
+    CLWEvent MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& waitEvents = std::vector<CLWEvent>());
+    CLWEvent UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData, std::vector<CLWEvent> const& waitEvents = std::vector<CLWEvent>());
 
     CLWBuffer(cl_mem buffer, size_t elementCount);
 
@@ -92,7 +96,9 @@ template <typename T> CLWBuffer<T> CLWBuffer<T>::Create(cl_context context, cl_m
 template <typename T> CLWBuffer<T> CLWBuffer<T>::Create(cl_context context, cl_mem_flags flags, size_t elementCount, void* data)
 {
     cl_int status = CL_SUCCESS;
-    cl_mem deviceBuffer = clCreateBuffer(context, flags | CL_MEM_COPY_HOST_PTR, elementCount * sizeof(T), data, &status);
+    // Data is copied unless the buffer is asked to use it in place
+    cl_mem_flags hostPtrFlags = (flags & CL_MEM_USE_HOST_PTR) ? 0 : CL_MEM_COPY_HOST_PTR;
+    cl_mem deviceBuffer = clCreateBuffer(context, flags | hostPtrFlags, elementCount * sizeof(T), data, &status);
 
     ThrowIf(status != CL_SUCCESS, status, "clCreateBuffer failed");
     
@@ -115,6 +121,21 @@ template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateFromClBuffer(cl_mem buffe
     return CLWBuffer(buffer, bufferSize / sizeof(T));
 }
 
+template <typename T> CLWBuffer<T> CLWBuffer<T>::CreateSubBuffer(cl_mem_flags flags, size_t offset, size_t elemCount) const
+{
+    cl_int status = CL_SUCCESS;
+
+    cl_buffer_region region = { sizeof(T) * offset, sizeof(T) * elemCount };
+    cl_mem subBuffer = clCreateSubBuffer(*this, flags, CL_BUFFER_CREATE_TYPE_REGION, &region, &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateSubBuffer failed");
+
+    CLWBuffer<T> buffer(subBuffer, elemCount);
+    clReleaseMemObject(subBuffer);
+
+    return buffer;
+}
+
 template <typename T> CLWBuffer<T>::CLWBuffer(cl_mem buffer, size_t elementCount)
 : ReferenceCounter<cl_mem, clRetainMemObject, clReleaseMemObject>(buffer)
 , elementCount_(elementCount)
@@ -137,11 +158,13 @@ template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue c
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount)
+template <typename T> CLWEvent CLWBuffer<T>::WriteDeviceBuffer(CLWCommandQueue cmdQueue, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
-    status = clEnqueueWriteBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, 0, nullptr, &event);
+    std::vector<cl_event> events(waitEvents.begin(), waitEvents.end());
+
+    status = clEnqueueWriteBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, (cl_uint)events.size(), events.empty() ? nullptr : &events[0], &event);
 
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueWriteBuffer failed");
 
@@ -159,11 +182,13 @@ template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cm
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount)
+template <typename T> CLWEvent CLWBuffer<T>::ReadDeviceBuffer(CLWCommandQueue cmdQueue, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
-    status = clEnqueueReadBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, 0, nullptr, &event);
+    std::vector<cl_event> events(waitEvents.begin(), waitEvents.end());
+
+    status = clEnqueueReadBuffer(cmdQueue, *this, false, sizeof(T)*offset, sizeof(T)*elemCount, hostBuffer, (cl_uint)events.size(), events.empty() ? nullptr : &events[0], &event);
     
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueReadBuffer failed");
     
@@ -186,12 +211,14 @@ template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmd
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData)
+template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmdQueue, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& waitEvents)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
     
-    T* data = (T*)clEnqueueMapBuffer(cmdQueue, *this, false, flags, sizeof(T) * offset, sizeof(T)*elemCount, 0, nullptr, &event, &status);
+    std::vector<cl_event> events(waitEvents.begin(), waitEvents.end());
+
+    T* data = (T*)clEnqueueMapBuffer(cmdQueue, *this, false, flags, sizeof(T) * offset, sizeof(T)*elemCount, (cl_uint)events.size(), events.empty() ? nullptr : &events[0], &event, &status);
     
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueMapBuffer failed");
     
@@ -200,12 +227,14 @@ template <typename T> CLWEvent CLWBuffer<T>::MapDeviceBuffer(CLWCommandQueue cmd
     return CLWEvent::Create(event);
 }
 
-template <typename T> CLWEvent CLWBuffer<T>::UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData)
+template <typename T> CLWEvent CLWBuffer<T>::UnmapDeviceBuffer(CLWCommandQueue cmdQueue, T* mappedData, std::vector<CLWEvent> const& waitEvents)
 {
     cl_int status = CL_SUCCESS;
     cl_event event = nullptr;
 
-    status = clEnqueueUnmapMemObject(cmdQueue, *this,  mappedData, 0, nullptr, &event);
+    std::vector<cl_event> events(waitEvents.begin(), waitEvents.end());
+
+    status = clEnqueueUnmapMemObject(cmdQueue, *this,  mappedData, (cl_uint)events.size(), events.empty() ? nullptr : &events[0], &event);
 
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueUnmapMemObject failed");
     
@@ -223,5 +252,18 @@ template <typename T> CLWEvent CLWBuffer<T>::FillDeviceBuffer(CLWCommandQueue cm
     return CLWEvent::Create(event);
 }
 
+template <typename T> CLWEvent CLWBuffer<T>::FillDeviceBuffer(CLWCommandQueue cmdQueue, T const& val, size_t offset, size_t elemCount, std::vector<CLWEvent> const& waitEvents)
+{
+    cl_int status = CL_SUCCESS;
+    cl_event event = nullptr;
+    std::vector<cl_event> events(waitEvents.begin(), waitEvents.end());
+
+    status = clEnqueueFillBuffer(cmdQueue, *this, &val, sizeof(T), sizeof(T)*offset, sizeof(T)*elemCount, (cl_uint)events.size(), events.empty() ? nullptr : &events[0], &event);
+
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueFillBuffer failed");
+
+    return CLWEvent::Create(event);
+}
+
 
 #endif /* defined(__CLW__CLWBuffer__) */
@@ -28,11 +28,21 @@ THE SOFTWARE.
 #pragma warning(push)
 #pragma warning(disable:4996)
 
-CLWCommandQueue CLWCommandQueue::Create(CLWDevice device, CLWContext context)
+CLWCommandQueue CLWCommandQueue::Create(CLWDevice device, CLWContext context, bool outOfOrder)
 {
     cl_int status = CL_SUCCESS;
+    cl_command_queue_properties props = CL_QUEUE_PROFILING_ENABLE;
 
-    cl_command_queue commandQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &status);
+    if (outOfOrder)
+    {
+        cl_command_queue_properties supported = 0;
+        status = clGetDeviceInfo(device, CL_DEVICE_QUEUE_PROPERTIES, sizeof(supported), &supported, nullptr);
+        ThrowIf(status != CL_SUCCESS, status, "clGetDeviceInfo failed");
+
+        props |= supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    }
+
+    cl_command_queue commandQueue = clCreateCommandQueue(context, device, props, &status);
 
     ThrowIf(status != CL_SUCCESS, status, "clCreateCommandQueue failed");
 
@@ -39,7 +39,8 @@ class CLWDevice;
 class CLWCommandQueue : public ReferenceCounter<cl_command_queue, clRetainCommandQueue, clReleaseCommandQueue>
 {
 public:
-    static CLWCommandQueue Create(CLWDevice device, CLWContext context);
+    // Out of order queues fall back to in order ones on devices not supporting them
+    static CLWCommandQueue Create(CLWDevice device, CLWContext context, bool outOfOrder = false);
     static CLWCommandQueue Create(cl_command_queue queue);
     
     
@@ -101,7 +101,7 @@ CLWEvent CLWContext::Launch1D(unsigned int idx, size_t globalSize, size_t localS
     for (unsigned i = 0; i < events.size(); ++i)
         eventsToWait[i] = events[i];
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 1, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -140,7 +140,7 @@ CLWEvent CLWContext::Launch2D(unsigned int idx, size_t* globalSize, size_t* loca
     for (unsigned i = 0; i < events.size(); ++i)
         eventsToWait[i] = events[i];
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, globalSize, localSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, globalSize, localSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -180,7 +180,7 @@ CLWEvent CLWContext::Launch3D(unsigned int idx, size_t* globalSize, size_t* loca
     for (unsigned i = 0; i < events.size(); ++i)
         eventsToWait[i] = events[i];
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 3, nullptr, globalSize, localSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 3, nullptr, globalSize, localSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -252,6 +252,27 @@ void CLWContext::InitCL()
                   });
 }
 
+unsigned int CLWContext::CreateCommandQueue(unsigned int deviceIdx, bool outOfOrder)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(devices_[deviceIdx], *this, outOfOrder));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
+bool CLWContext::IsOutOfOrder(unsigned int idx) const
+{
+    cl_command_queue_properties props = 0;
+    cl_int status = clGetCommandQueueInfo(commandQueues_[idx], CL_QUEUE_PROPERTIES, sizeof(props), &props, nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetCommandQueueInfo failed");
+
+    return (props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+}
+
+unsigned int CLWContext::AddCommandQueue(cl_command_queue queue)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(queue));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
 CLWProgram CLWContext::CreateProgram(std::vector<char> const& sourceCode, char const* buildopts) const
 {
     return CLWProgram::CreateFromSource(&sourceCode[0], sourceCode.size(), buildopts, *this);
@@ -286,3 +307,19 @@ void CLWContext::Flush(unsigned int idx) const
     cl_int status = clFlush(commandQueues_[idx]);
     ThrowIf(status != CL_SUCCESS, status, "clFlush failed");
 }
+
+void CLWContext::WaitForEvent(unsigned int idx, CLWEvent event) const
+{
+    cl_event eventToWait = event;
+    cl_int status = clEnqueueBarrierWithWaitList(commandQueues_[idx], 1, &eventToWait, nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueBarrierWithWaitList failed");
+}
+
+CLWEvent CLWContext::Marker(unsigned int idx) const
+{
+    cl_event event = nullptr;
+    cl_int status = clEnqueueMarkerWithWaitList(commandQueues_[idx], 0, nullptr, &event);
+    ThrowIf(status != CL_SUCCESS, status, "clEnqueueMarkerWithWaitList failed");
+
+    return CLWEvent::Create(event);
+}
@@ -65,13 +65,19 @@ public:
 
     template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t elemCount) const;
     template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount) const;
+    template <typename T> CLWEvent  WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const;
     template <typename T> CLWEvent  FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t elemCount) const;
+    template <typename T> CLWEvent  FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const;
     template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t elemCount) const;
     template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount) const;
+    template <typename T> CLWEvent  ReadBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const;
     template <typename T> CLWEvent  CopyBuffer(unsigned int idx,  CLWBuffer<T> source, CLWBuffer<T> dest, size_t srcOffset, size_t destOffset, size_t elemCount) const;
+    template <typename T> CLWEvent  CopyBuffer(unsigned int idx,  CLWBuffer<T> source, CLWBuffer<T> dest, size_t srcOffset, size_t destOffset, size_t elemCount, std::vector<CLWEvent> const& events) const;
     template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, T** mappedData) const;
     template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData) const;
+    template <typename T> CLWEvent  MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events) const;
     template <typename T> CLWEvent  UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData) const;
+    template <typename T> CLWEvent  UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData, std::vector<CLWEvent> const& events) const;
 
     template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent Launch1D(unsigned int idx, cl_kernel kernel, Types ... args);
     template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent Launch1D(unsigned int idx, cl_kernel kernel, CLWEvent depEvent, Types ... args);
@@ -91,12 +97,25 @@ public:
 
     void Finish(unsigned int idx) const;
     void Flush(unsigned int idx) const;
+    // Commands enqueued to the queue after the call wait for the event
+    void WaitForEvent(unsigned int idx, CLWEvent event) const;
+    // Event signaled once all the commands enqueued to the queue before the call are complete,
+    // unlike WaitForEvent later commands are not held back
+    CLWEvent Marker(unsigned int idx) const;
 
     // GL interop 
     void AcquireGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
     void ReleaseGLObjects(unsigned int idx, std::vector<cl_mem> const& objects) const;
 
     CLWCommandQueue GetCommandQueue(unsigned int idx) const { return commandQueues_[idx]; }
+    unsigned int GetCommandQueueCount() const { return (unsigned int)commandQueues_.size(); }
+    // Create one more queue on a device of the context, returns its index. Out of order queues
+    // only order commands by their wait events, devices not supporting them get an in order queue
+    unsigned int CreateCommandQueue(unsigned int deviceIdx, bool outOfOrder = false);
+    // Whether the queue might execute commands out of order
+    bool IsOutOfOrder(unsigned int idx) const;
+    // Add an existing queue of a device of the context, the queue is retained, returns its index
+    unsigned int AddCommandQueue(cl_command_queue queue);
 
 private:
     void InitCL();
@@ -132,11 +151,21 @@ template <typename T> CLWEvent  CLWContext::WriteBuffer(unsigned int idx, CLWBuf
     return buffer.WriteDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount);
 }
 
+template <typename T> CLWEvent  CLWContext::WriteBuffer(unsigned int idx, CLWBuffer<T> buffer, T const* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const
+{
+    return buffer.WriteDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount, events);
+}
+
 template <typename T> CLWEvent  CLWContext::FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t elemCount) const
 {
     return buffer.FillDeviceBuffer(commandQueues_[idx], val, elemCount);
 }
 
+template <typename T> CLWEvent  CLWContext::FillBuffer(unsigned int idx, CLWBuffer<T> buffer, T const& val, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const
+{
+    return buffer.FillDeviceBuffer(commandQueues_[idx], val, offset, elemCount, events);
+}
+
 template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuffer<T> buffer, T* hostBuffer, size_t elemCount) const
 {
     return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, elemCount);
@@ -147,6 +176,11 @@ template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuff
     return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount);
 }
 
+template <typename T> CLWEvent  CLWContext::ReadBuffer(unsigned int idx, CLWBuffer<T> buffer, T* hostBuffer, size_t offset, size_t elemCount, std::vector<CLWEvent> const& events) const
+{
+    return buffer.ReadDeviceBuffer(commandQueues_[idx], hostBuffer, offset, elemCount, events);
+}
+
 template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent CLWContext::Launch1D(unsigned int idx, cl_kernel kernel, Types ... args)
 {
     std::vector<ParameterHolder> params{args...};
@@ -181,11 +215,17 @@ template <size_t globalSize, size_t localSize, typename ... Types> CLWEvent CLWC
 }
 
 template <typename T> CLWEvent  CLWContext::CopyBuffer(unsigned int idx, CLWBuffer<T> source, CLWBuffer<T> dest, size_t srcOffset, size_t destOffset, size_t elemCount) const
+{
+    return CopyBuffer(idx, source, dest, srcOffset, destOffset, elemCount, std::vector<CLWEvent>());
+}
+
+template <typename T> CLWEvent  CLWContext::CopyBuffer(unsigned int idx, CLWBuffer<T> source, CLWBuffer<T> dest, size_t srcOffset, size_t destOffset, size_t elemCount, std::vector<CLWEvent> const& events) const
 {
     cl_int status = CL_SUCCESS;
-    cl_event event;
+    cl_event event = nullptr;
+    std::vector<cl_event> waitEvents(events.begin(), events.end());
 
-    clEnqueueCopyBuffer(commandQueues_[idx], source, dest, srcOffset * sizeof(T), destOffset* sizeof(T), elemCount * sizeof(T), 0, nullptr, &event); 
+    status = clEnqueueCopyBuffer(commandQueues_[idx], source, dest, srcOffset * sizeof(T), destOffset* sizeof(T), elemCount * sizeof(T), (cl_uint)waitEvents.size(), waitEvents.empty() ? nullptr : &waitEvents[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueCopyBuffer failed");
 
     return CLWEvent::Create(event);
@@ -201,11 +241,21 @@ template <typename T> CLWEvent  CLWContext::MapBuffer(unsigned int idx,  CLWBuff
     return buffer.MapDeviceBuffer(commandQueues_[idx], flags, offset, elemCount, mappedData);
 }
 
+template <typename T> CLWEvent  CLWContext::MapBuffer(unsigned int idx,  CLWBuffer<T> buffer, cl_map_flags flags, size_t offset, size_t elemCount, T** mappedData, std::vector<CLWEvent> const& events) const
+{
+    return buffer.MapDeviceBuffer(commandQueues_[idx], flags, offset, elemCount, mappedData, events);
+}
+
 template <typename T> CLWEvent  CLWContext::UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData) const
 {
     return buffer.UnmapDeviceBuffer(commandQueues_[idx], mappedData);
 }
 
+template <typename T> CLWEvent  CLWContext::UnmapBuffer(unsigned int idx,  CLWBuffer<T> buffer, T* mappedData, std::vector<CLWEvent> const& events) const
+{
+    return buffer.UnmapDeviceBuffer(commandQueues_[idx], mappedData, events);
+}
+
 
 
 
@@ -22,6 +22,15 @@ THE SOFTWARE.
 #include "CLWDevice.h"
 #include "CLWExcept.h"
 
+// Vendor attribute queries, not every cl_ext.h has them
+#ifndef CL_DEVICE_WAVEFRONT_WIDTH_AMD
+#define CL_DEVICE_WAVEFRONT_WIDTH_AMD 0x4043
+#endif
+
+#ifndef CL_DEVICE_WARP_SIZE_NV
+#define CL_DEVICE_WARP_SIZE_NV 0x4003
+#endif
+
 CLWDevice CLWDevice::Create(cl_device_id id)
 {
     return CLWDevice(id);
@@ -33,15 +42,30 @@ CLWDevice::CLWDevice(cl_device_id id) : ReferenceCounter<cl_device_id, clRetainD
     GetDeviceInfoParameter(*this, CL_DEVICE_EXTENSIONS, extensions_);
     GetDeviceInfoParameter(*this, CL_DEVICE_VENDOR, vendor_);
     GetDeviceInfoParameter(*this, CL_DEVICE_VERSION, version_);
+    GetDeviceInfoParameter(*this, CL_DRIVER_VERSION, driverVersion_);
     GetDeviceInfoParameter(*this, CL_DEVICE_PROFILE, profile_);
     GetDeviceInfoParameter(*this, CL_DEVICE_TYPE, type_);
     
     GetDeviceInfoParameter(*this, CL_DEVICE_MAX_WORK_GROUP_SIZE, maxWorkGroupSize_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_MAX_COMPUTE_UNITS, maxComputeUnits_);
     GetDeviceInfoParameter(*this, CL_DEVICE_GLOBAL_MEM_SIZE, globalMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_SIZE, localMemSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_LOCAL_MEM_TYPE, localMemType_);
     GetDeviceInfoParameter(*this, CL_DEVICE_MAX_MEM_ALLOC_SIZE, maxAllocSize_);
     GetDeviceInfoParameter(*this, CL_DEVICE_MIN_DATA_TYPE_ALIGN_SIZE, minAlignSize_);
+    GetDeviceInfoParameter(*this, CL_DEVICE_HOST_UNIFIED_MEMORY, hostUnifiedMemory_);
+
+    // SIMD width is only available through vendor extensions
+    simdWidth_ = 0;
+
+    if (extensions_.find("cl_amd_device_attribute_query") != std::string::npos)
+    {
+        GetDeviceInfoParameter(*this, CL_DEVICE_WAVEFRONT_WIDTH_AMD, simdWidth_);
+    }
+    else if (extensions_.find("cl_nv_device_attribute_query") != std::string::npos)
+    {
+        GetDeviceInfoParameter(*this, CL_DEVICE_WARP_SIZE_NV, simdWidth_);
+    }
 }
 
 CLWDevice::~CLWDevice()
@@ -77,6 +101,11 @@ std::string const& CLWDevice::GetVersion() const
     return version_;
 }
 
+std::string const& CLWDevice::GetDriverVersion() const
+{
+    return driverVersion_;
+}
+
 std::string const& CLWDevice::GetProfile() const
 {
     return profile_;
@@ -108,6 +137,16 @@ size_t   CLWDevice::GetMaxWorkGroupSize() const
     return maxWorkGroupSize_;
 }
 
+cl_uint  CLWDevice::GetMaxComputeUnits() const
+{
+    return maxComputeUnits_;
+}
+
+cl_uint  CLWDevice::GetSimdWidth() const
+{
+    return simdWidth_;
+}
+
 cl_device_id CLWDevice::GetID() const
 {
     return *this;
@@ -123,6 +162,16 @@ cl_uint CLWDevice::GetMinAlignSize() const
     return minAlignSize_;
 }
 
+bool CLWDevice::HasUnifiedMemory() const
+{
+    return hostUnifiedMemory_ == CL_TRUE;
+}
+
+bool CLWDevice::HasSubgroups() const
+{
+    return extensions_.find("cl_khr_subgroups") != std::string::npos;
+}
+
 bool CLWDevice::HasGlInterop() const
 {
     return extensions_.find("cl_khr_gl_sharing") != std::string::npos
@@ -51,6 +51,9 @@ public:
     cl_ulong GetGlobalMemSize() const;
     cl_ulong GetMaxAllocSize() const;
     size_t   GetMaxWorkGroupSize() const;
+    cl_uint  GetMaxComputeUnits() const;
+    // Hardware SIMD width (AMD wavefront, NVIDIA warp), 0 if the driver does not report it
+    cl_uint  GetSimdWidth() const;
     cl_device_type GetType() const;
     cl_device_id GetID() const;
     cl_uint GetMinAlignSize() const;
@@ -59,11 +62,16 @@ public:
     std::string const& GetName() const;
     std::string const& GetVendor() const;
     std::string const& GetVersion() const;
+    std::string const& GetDriverVersion() const;
     std::string const& GetProfile() const;
     std::string const& GetExtensions() const;
 
     //
     bool         HasGlInterop() const;
+    // Device and host share physical memory (APUs)
+    bool         HasUnifiedMemory() const;
+    // Sub group votes and broadcasts (cl_khr_subgroups) are available to kernels
+    bool         HasSubgroups() const;
 
     // unsigned int GetGlobalMemCacheSize() const;
     // ...
@@ -79,6 +87,7 @@ private:
     std::string              name_;
     std::string              vendor_;
     std::string              version_;
+    std::string              driverVersion_;
     std::string              profile_;
     std::string              extensions_;
     cl_device_type           type_;
@@ -88,7 +97,10 @@ private:
     cl_ulong                 maxAllocSize_;
     cl_device_local_mem_type localMemType_;
     size_t                   maxWorkGroupSize_;
+    cl_uint                  maxComputeUnits_;
+    cl_uint                  simdWidth_;
     cl_uint                     minAlignSize_;
+    cl_bool                  hostUnifiedMemory_;
     
     friend class CLWPlatform;
 };
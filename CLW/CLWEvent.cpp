@@ -70,4 +70,24 @@ cl_int CLWEvent::GetCommandExecutionStatus() const
     ThrowIf(status != CL_SUCCESS, status, "clGetEventInfo failed");
 
     return execstatus;
-}
\ No newline at end of file
+}
+
+void CLWEvent::SetCompletionCallback(void (CL_CALLBACK *callback)(cl_event, cl_int, void*), void* data)
+{
+    cl_int status = clSetEventCallback(*this, CL_COMPLETE, callback, data);
+
+    ThrowIf(status != CL_SUCCESS, status, "clSetEventCallback failed");
+
+    cl_command_queue queue = nullptr;
+    status = clGetEventInfo(*this, CL_EVENT_COMMAND_QUEUE, sizeof(cl_command_queue), &queue, nullptr);
+
+    ThrowIf(status != CL_SUCCESS, status, "clGetEventInfo failed");
+
+    // User events have no queue
+    if (queue)
+    {
+        status = clFlush(queue);
+
+        ThrowIf(status != CL_SUCCESS, status, "clFlush failed");
+    }
+}
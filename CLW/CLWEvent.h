@@ -46,6 +46,9 @@ public:
     void  Wait();
     float GetDuration() const;
     cl_int GetCommandExecutionStatus() const;
+    // Call callback once the command reaches CL_COMPLETE status, the queue of
+    // the command is flushed so it gets to complete without further calls
+    void  SetCompletionCallback(void (CL_CALLBACK *callback)(cl_event, cl_int, void*), void* data);
 
 private:
     CLWEvent(cl_event program);
@@ -40,6 +40,13 @@ THE SOFTWARE.
 #define NUM_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SCAN_ELEMS_PER_WI)
 #define NUM_SEG_SCAN_ELEMS_PER_WG (WG_SIZE * NUM_SEG_SCAN_ELEMS_PER_WI)
 
+// Has to match single pass primitives in CLW.cl
+#define LOOKBACK_GROUP_SIZE 256
+#define LOOKBACK_TILE_SIZE (LOOKBACK_GROUP_SIZE * 8)
+#define ONESWEEP_RADIX 256
+#define ONESWEEP_NUM_PASSES 4
+#define ONESWEEP_NUM_HISTOGRAM_GROUPS 64
+
 CLWParallelPrimitives::CLWParallelPrimitives(CLWContext context, char const* buildopts)
     : context_(context)
 {
@@ -781,6 +788,325 @@ CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<char
     return event;
 }
 
+CLWEvent CLWParallelPrimitives::ScanExclusiveAddSinglePass(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
+{
+    if (numElems == 0)
+    {
+        return CLWEvent::Create(nullptr);
+    }
+
+    int NUM_TILES = (numElems + LOOKBACK_TILE_SIZE - 1) / LOOKBACK_TILE_SIZE;
+
+    // Tile counter followed by tile flags
+    auto deviceStatus = GetTempIntBuffer(1 + NUM_TILES);
+    auto deviceAggregates = GetTempIntBuffer(NUM_TILES);
+    auto devicePrefixes = GetTempIntBuffer(NUM_TILES);
+
+    context_.FillBuffer(deviceIdx, deviceStatus, 0, 1 + NUM_TILES);
+
+    CLWKernel scanKernel = program_.GetKernel("scan_exclusive_lookback_int");
+
+    scanKernel.SetArg(0, input);
+    scanKernel.SetArg(1, (cl_uint)numElems);
+    scanKernel.SetArg(2, deviceStatus);
+    scanKernel.SetArg(3, deviceAggregates);
+    scanKernel.SetArg(4, devicePrefixes);
+    scanKernel.SetArg(5, output);
+
+    CLWEvent event = context_.Launch1D(deviceIdx, NUM_TILES * LOOKBACK_GROUP_SIZE, LOOKBACK_GROUP_SIZE, scanKernel);
+
+    ReclaimTempIntBuffer(deviceStatus);
+    ReclaimTempIntBuffer(deviceAggregates);
+    ReclaimTempIntBuffer(devicePrefixes);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::SortRadixOnesweep(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+    CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
+{
+    if (numElems == 0)
+    {
+        return CLWEvent::Create(nullptr);
+    }
+
+    int NUM_TILES = (numElems + LOOKBACK_TILE_SIZE - 1) / LOOKBACK_TILE_SIZE;
+    int NUM_HISTOGRAM_GROUPS = std::min(NUM_TILES, ONESWEEP_NUM_HISTOGRAM_GROUPS);
+
+    auto deviceHistograms = GetTempIntBuffer(ONESWEEP_NUM_PASSES * ONESWEEP_RADIX);
+    // Tile counters of all the passes followed by tile flags, flags are
+    // tagged with the pass so they are cleared only once
+    auto deviceStatus = GetTempIntBuffer(ONESWEEP_NUM_PASSES + NUM_TILES * ONESWEEP_RADIX);
+    auto deviceAggregates = GetTempIntBuffer(NUM_TILES * ONESWEEP_RADIX);
+    auto devicePrefixes = GetTempIntBuffer(NUM_TILES * ONESWEEP_RADIX);
+    auto deviceTempKeysBuffer = GetTempCharBuffer(numElems * 4);
+    auto deviceTempValsBuffer = GetTempCharBuffer(numElems * 4);
+
+    context_.FillBuffer(deviceIdx, deviceHistograms, 0, ONESWEEP_NUM_PASSES * ONESWEEP_RADIX);
+    context_.FillBuffer(deviceIdx, deviceStatus, 0, ONESWEEP_NUM_PASSES + NUM_TILES * ONESWEEP_RADIX);
+
+    CLWKernel histogramKernel = program_.GetKernel("onesweep_histogram");
+    CLWKernel scanKernel = program_.GetKernel("onesweep_scan_histograms");
+    CLWKernel scatterKeysAndVals = program_.GetKernel("onesweep_scatter_keys_and_values");
+
+    histogramKernel.SetArg(0, inputKeys);
+    histogramKernel.SetArg(1, (cl_uint)numElems);
+    histogramKernel.SetArg(2, deviceHistograms);
+
+    context_.Launch1D(deviceIdx, NUM_HISTOGRAM_GROUPS * LOOKBACK_GROUP_SIZE, LOOKBACK_GROUP_SIZE, histogramKernel);
+
+    scanKernel.SetArg(0, deviceHistograms);
+
+    context_.Launch1D(deviceIdx, ONESWEEP_NUM_PASSES * ONESWEEP_RADIX, ONESWEEP_RADIX, scanKernel);
+
+    // Even number of passes ends in the output buffers
+    auto fromKeys = &inputKeys;
+    auto fromVals = &inputValues;
+    auto toKeys = &deviceTempKeysBuffer;
+    auto toVals = &deviceTempValsBuffer;
+
+    CLWEvent event;
+
+    for (int pass = 0; pass < ONESWEEP_NUM_PASSES; ++pass)
+    {
+        scatterKeysAndVals.SetArg(0, pass);
+        scatterKeysAndVals.SetArg(1, *fromKeys);
+        scatterKeysAndVals.SetArg(2, *fromVals);
+        scatterKeysAndVals.SetArg(3, (cl_uint)numElems);
+        scatterKeysAndVals.SetArg(4, deviceHistograms);
+        scatterKeysAndVals.SetArg(5, deviceStatus);
+        scatterKeysAndVals.SetArg(6, deviceAggregates);
+        scatterKeysAndVals.SetArg(7, devicePrefixes);
+        scatterKeysAndVals.SetArg(8, *toKeys);
+        scatterKeysAndVals.SetArg(9, *toVals);
+
+        event = context_.Launch1D(deviceIdx, NUM_TILES * LOOKBACK_GROUP_SIZE, LOOKBACK_GROUP_SIZE, scatterKeysAndVals);
+
+        if (pass == 0)
+        {
+            fromKeys = &outputKeys;
+            fromVals = &outputValues;
+        }
+
+        // Swap pointers
+        std::swap(fromKeys, toKeys);
+        std::swap(fromVals, toVals);
+    }
+
+    // Return buffers to memory manager
+    ReclaimTempIntBuffer(deviceHistograms);
+    ReclaimTempIntBuffer(deviceStatus);
+    ReclaimTempIntBuffer(deviceAggregates);
+    ReclaimTempIntBuffer(devicePrefixes);
+    ReclaimTempCharBuffer(deviceTempKeysBuffer);
+    ReclaimTempCharBuffer(deviceTempValsBuffer);
+
+    return event;
+}
+
+// 64-bit keys are sorted with two stable 32-bit passes: by the low halves
+// first and then by the high halves gathered in the order of the first pass.
+// Sorted values of both passes are permutations of the input, the final one
+// gathers keys and values at once.
+CLWEvent CLWParallelPrimitives::SortRadix64(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+    CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
+{
+    int NUM_BLOCKS = (numElems + WG_SIZE - 1) / WG_SIZE;
+
+    auto deviceLowKeys = GetTempCharBuffer(numElems * 4);
+    auto deviceHighKeys = GetTempCharBuffer(numElems * 4);
+    auto deviceSortedKeys = GetTempCharBuffer(numElems * 4);
+    auto devicePermutation = GetTempCharBuffer(numElems * 4);
+    auto deviceSortedPermutation = GetTempCharBuffer(numElems * 4);
+
+    CLWKernel splitKernel = program_.GetKernel("split_keys_64");
+    CLWKernel gatherKernel = program_.GetKernel("gather_int");
+    CLWKernel gatherKeysAndVals = program_.GetKernel("gather_keys_and_values_64");
+
+    splitKernel.SetArg(0, inputKeys);
+    splitKernel.SetArg(1, (cl_uint)numElems);
+    splitKernel.SetArg(2, deviceLowKeys);
+    splitKernel.SetArg(3, deviceHighKeys);
+    splitKernel.SetArg(4, devicePermutation);
+
+    context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, splitKernel);
+
+    // Sort by low halves
+    SortRadixOnesweep(deviceIdx, deviceLowKeys, deviceSortedKeys, devicePermutation, deviceSortedPermutation, numElems);
+
+    // Reorder high halves, low ones are not needed anymore
+    gatherKernel.SetArg(0, deviceHighKeys);
+    gatherKernel.SetArg(1, deviceSortedPermutation);
+    gatherKernel.SetArg(2, (cl_uint)numElems);
+    gatherKernel.SetArg(3, deviceLowKeys);
+
+    context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, gatherKernel);
+
+    // Sort by high halves carrying the permutation along
+    SortRadixOnesweep(deviceIdx, deviceLowKeys, deviceSortedKeys, deviceSortedPermutation, devicePermutation, numElems);
+
+    gatherKeysAndVals.SetArg(0, inputKeys);
+    gatherKeysAndVals.SetArg(1, inputValues);
+    gatherKeysAndVals.SetArg(2, devicePermutation);
+    gatherKeysAndVals.SetArg(3, (cl_uint)numElems);
+    gatherKeysAndVals.SetArg(4, outputKeys);
+    gatherKeysAndVals.SetArg(5, outputValues);
+
+    CLWEvent event = context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, gatherKeysAndVals);
+
+    // Return buffers to memory manager
+    ReclaimTempCharBuffer(deviceLowKeys);
+    ReclaimTempCharBuffer(deviceHighKeys);
+    ReclaimTempCharBuffer(deviceSortedKeys);
+    ReclaimTempCharBuffer(devicePermutation);
+    ReclaimTempCharBuffer(deviceSortedPermutation);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::SortRadixFloat(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+    CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
+{
+    int NUM_BLOCKS = (numElems + WG_SIZE - 1) / WG_SIZE;
+
+    auto deviceOrderedKeys = GetTempCharBuffer(numElems * 4);
+
+    CLWKernel toOrderedKernel = program_.GetKernel("float_keys_to_ordered");
+    CLWKernel toFloatKernel = program_.GetKernel("ordered_keys_to_float");
+
+    toOrderedKernel.SetArg(0, inputKeys);
+    toOrderedKernel.SetArg(1, (cl_uint)numElems);
+    toOrderedKernel.SetArg(2, deviceOrderedKeys);
+
+    context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, toOrderedKernel);
+
+    SortRadix(deviceIdx, deviceOrderedKeys, outputKeys, inputValues, outputValues, numElems);
+
+    toFloatKernel.SetArg(0, outputKeys);
+    toFloatKernel.SetArg(1, (cl_uint)numElems);
+
+    CLWEvent event = context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, toFloatKernel);
+
+    ReclaimTempCharBuffer(deviceOrderedKeys);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::SortRadixSegmented(unsigned int deviceIdx, CLWBuffer<char> inputSegments, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+    CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems)
+{
+    int NUM_BLOCKS = (numElems + WG_SIZE - 1) / WG_SIZE;
+
+    auto deviceKeys = GetTempCharBuffer(numElems * 8);
+    auto deviceSortedKeys = GetTempCharBuffer(numElems * 8);
+
+    CLWKernel makeKeysKernel = program_.GetKernel("make_segmented_keys_64");
+    CLWKernel lowKeysKernel = program_.GetKernel("low_keys_64");
+
+    makeKeysKernel.SetArg(0, inputSegments);
+    makeKeysKernel.SetArg(1, inputKeys);
+    makeKeysKernel.SetArg(2, (cl_uint)numElems);
+    makeKeysKernel.SetArg(3, deviceKeys);
+
+    context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, makeKeysKernel);
+
+    SortRadix64(deviceIdx, deviceKeys, deviceSortedKeys, inputValues, outputValues, numElems);
+
+    lowKeysKernel.SetArg(0, deviceSortedKeys);
+    lowKeysKernel.SetArg(1, (cl_uint)numElems);
+    lowKeysKernel.SetArg(2, outputKeys);
+
+    CLWEvent event = context_.Launch1D(0, NUM_BLOCKS * WG_SIZE, WG_SIZE, lowKeysKernel);
+
+    ReclaimTempCharBuffer(deviceKeys);
+    ReclaimTempCharBuffer(deviceSortedKeys);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::ReduceSum(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems)
+{
+    auto devicePartSums = GetTempIntBuffer(WG_SIZE);
+
+    CLWKernel reduceKernel = program_.GetKernel("reduce_sum_int");
+
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, (cl_uint)numElems);
+    reduceKernel.SetArg(2, devicePartSums);
+
+    context_.Launch1D(0, WG_SIZE * WG_SIZE, WG_SIZE, reduceKernel);
+
+    reduceKernel.SetArg(0, devicePartSums);
+    reduceKernel.SetArg(1, (cl_uint)WG_SIZE);
+    reduceKernel.SetArg(2, output);
+
+    CLWEvent event = context_.Launch1D(0, WG_SIZE, WG_SIZE, reduceKernel);
+
+    ReclaimTempIntBuffer(devicePartSums);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::ReduceSum(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems)
+{
+    auto devicePartSums = GetTempFloatBuffer(WG_SIZE);
+
+    CLWKernel reduceKernel = program_.GetKernel("reduce_sum_float");
+
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, (cl_uint)numElems);
+    reduceKernel.SetArg(2, devicePartSums);
+
+    context_.Launch1D(0, WG_SIZE * WG_SIZE, WG_SIZE, reduceKernel);
+
+    reduceKernel.SetArg(0, devicePartSums);
+    reduceKernel.SetArg(1, (cl_uint)WG_SIZE);
+    reduceKernel.SetArg(2, output);
+
+    CLWEvent event = context_.Launch1D(0, WG_SIZE, WG_SIZE, reduceKernel);
+
+    ReclaimTempFloatBuffer(devicePartSums);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::ReduceBounds(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numElems)
+{
+    // A box is two float4s
+    auto devicePartBounds = GetTempCharBuffer(WG_SIZE * 8 * sizeof(cl_float));
+
+    CLWKernel reduceKernel = program_.GetKernel("reduce_bounds");
+
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, (cl_uint)numElems);
+    reduceKernel.SetArg(2, devicePartBounds);
+
+    context_.Launch1D(0, WG_SIZE * WG_SIZE, WG_SIZE, reduceKernel);
+
+    reduceKernel.SetArg(0, devicePartBounds);
+    reduceKernel.SetArg(1, (cl_uint)WG_SIZE);
+    reduceKernel.SetArg(2, output);
+
+    CLWEvent event = context_.Launch1D(0, WG_SIZE, WG_SIZE, reduceKernel);
+
+    ReclaimTempCharBuffer(devicePartBounds);
+
+    return event;
+}
+
+CLWEvent CLWParallelPrimitives::SegmentedReduceBounds(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> inputSegmentStarts,
+    CLWBuffer<char> output, int numElems, int numSegments)
+{
+    CLWKernel reduceKernel = program_.GetKernel("segmented_reduce_bounds");
+
+    reduceKernel.SetArg(0, input);
+    reduceKernel.SetArg(1, inputSegmentStarts);
+    reduceKernel.SetArg(2, (cl_uint)numElems);
+    reduceKernel.SetArg(3, (cl_uint)numSegments);
+    reduceKernel.SetArg(4, output);
+
+    return context_.Launch1D(0, numSegments * WG_SIZE, WG_SIZE, reduceKernel);
+}
 
 CLWEvent CLWParallelPrimitives::SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys)
 {
@@ -41,6 +41,9 @@ public:
 
     CLWEvent ScanExclusiveAdd(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
 
+    // Single pass exclusive scan with decoupled look-back, input and output might be the same buffer
+    CLWEvent ScanExclusiveAddSinglePass(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
+
     CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys,
                        CLWBuffer<cl_int> inputValues, CLWBuffer<cl_int> outputValues, int numElems);
 
@@ -49,6 +52,36 @@ public:
 
     CLWEvent SortRadix(unsigned int deviceIdx, CLWBuffer<cl_int> inputKeys, CLWBuffer<cl_int> outputKeys);
 
+    // Stable sort of unsigned 32-bit keys with 32-bit values using 8-bit digits: histograms of all
+    // the digits are counted in one read of the keys and every digit pass is a single scatter
+    // kernel with decoupled look-back instead of separate histogram, scan and scatter passes
+    CLWEvent SortRadixOnesweep(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+        CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems);
+
+    // Stable sort of 64-bit unsigned keys with 32-bit values, equal keys keep their input order
+    CLWEvent SortRadix64(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+        CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems);
+
+    // Stable sort of float keys with 32-bit values
+    CLWEvent SortRadixFloat(unsigned int deviceIdx, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+        CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems);
+
+    // Stable sort of unsigned 32-bit keys within segments given by a segment index per key,
+    // the output is grouped by ascending segment index
+    CLWEvent SortRadixSegmented(unsigned int deviceIdx, CLWBuffer<char> inputSegments, CLWBuffer<char> inputKeys, CLWBuffer<char> outputKeys,
+        CLWBuffer<char> inputValues, CLWBuffer<char> outputValues, int numElems);
+
+    // Sum of the elements written to output[0]
+    CLWEvent ReduceSum(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
+    CLWEvent ReduceSum(unsigned int deviceIdx, CLWBuffer<cl_float> input, CLWBuffer<cl_float> output, int numElems);
+
+    // Union of bounding boxes (min and max float4 pairs) written to the first box of output
+    CLWEvent ReduceBounds(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> output, int numElems);
+    // Union of bounding boxes per segment, segment i starts at box inputSegmentStarts[i] (ascending 32-bit
+    // integers) and ends where the next one starts, output receives a box per segment
+    CLWEvent SegmentedReduceBounds(unsigned int deviceIdx, CLWBuffer<char> input, CLWBuffer<char> inputSegmentStarts,
+        CLWBuffer<char> output, int numElems, int numSegments);
+
     CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, cl_int& newSize);
     CLWEvent Compact(unsigned int deviceIdx, CLWBuffer<cl_int> predicate, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems, CLWBuffer<cl_int> newSize);
     CLWEvent Copy(unsigned int deviceIdx, CLWBuffer<cl_int> input, CLWBuffer<cl_int> output, int numElems);
@@ -29,6 +29,12 @@ THE SOFTWARE.
 #include <cassert>
 #include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 
 static void load_file_contents(std::string const& name, std::vector<char>& contents, bool binary)
 {
@@ -56,8 +62,208 @@ static void load_file_contents(std::string const& name, std::vector<char>& conte
     }
 }
 
+static std::mutex g_binary_cache_mutex;
+static std::string g_binary_cache_path;
+
+static std::string get_binary_cache_path()
+{
+    std::lock_guard<std::mutex> lock(g_binary_cache_mutex);
+    return g_binary_cache_path;
+}
+
+// 64-bit FNV-1a
+static void hash_bytes(std::uint64_t& hash, char const* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<std::uint8_t>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+}
+
+static void hash_string(std::uint64_t& hash, std::string const& str)
+{
+    // Size is hashed too to keep adjacent strings apart
+    std::uint64_t size = str.size();
+    hash_bytes(hash, reinterpret_cast<char const*>(&size), sizeof(size));
+    hash_bytes(hash, str.c_str(), str.size());
+}
+
+// Cache file for the program or an empty string if the program is not cached
+static std::string get_binary_cache_file(CLWContext context,
+                                         char const** sources,
+                                         size_t const* sourcesizes,
+                                         int numsources,
+                                         char const* buildopts)
+{
+    std::string path = get_binary_cache_path();
+
+    if (path.empty() || context.GetDeviceCount() != 1)
+    {
+        return std::string();
+    }
+
+    CLWDevice device = context.GetDevice(0);
+
+    std::uint64_t hash = 14695981039346656037ULL;
+    hash_string(hash, device.GetName());
+    hash_string(hash, device.GetVendor());
+    hash_string(hash, device.GetVersion());
+    hash_string(hash, device.GetDriverVersion());
+    hash_string(hash, buildopts ? buildopts : "");
+
+    for (int i = 0; i < numsources; ++i)
+    {
+        hash_string(hash, std::string(sources[i], sourcesizes[i]));
+    }
+
+    std::ostringstream name;
+    name << path;
+    if (path.back() != '/' && path.back() != '\\')
+    {
+        name << '/';
+    }
+    name << std::hex << std::setw(16) << std::setfill('0') << hash << ".clbin";
+
+    return name.str();
+}
+
+static bool load_cached_binary(std::string const& file, std::vector<char>& binary)
+{
+    std::ifstream in(file, std::ios::in | std::ios::binary);
+
+    if (!in)
+    {
+        return false;
+    }
+
+    in.seekg(0, std::ios::end);
+    std::streamoff size = in.tellg();
+    in.seekg(0, std::ios::beg);
+
+    if (size <= 0)
+    {
+        return false;
+    }
+
+    binary.resize(static_cast<size_t>(size));
+    in.read(&binary[0], size);
+
+    return !in.fail();
+}
+
+// Failures are ignored, the program is rebuilt from source next time
+static void store_cached_binary(std::string const& file, CLWProgram const& program)
+{
+    std::vector<std::uint8_t> binary;
+    program.GetBinary(binary);
+
+    if (binary.empty())
+    {
+        return;
+    }
+
+    // Write to a temporary file first so concurrent processes never read partial binaries
+    std::string temp = file + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+    {
+        std::ofstream out(temp, std::ios::out | std::ios::binary);
+
+        if (!out)
+        {
+            return;
+        }
+
+        out.write(reinterpret_cast<char const*>(&binary[0]), binary.size());
+
+        if (out.fail())
+        {
+            out.close();
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+
+    std::remove(file.c_str());
+
+    if (std::rename(temp.c_str(), file.c_str()) != 0)
+    {
+        std::remove(temp.c_str());
+    }
+}
+
+// Try the cache file, stale or broken binaries are rebuilt by the caller
+static bool create_from_cached_binary(std::string const& file, char const* buildopts, CLWContext context, CLWProgram& program)
+{
+    std::vector<char> binary;
+
+    if (file.empty() || !load_cached_binary(file, binary))
+    {
+        return false;
+    }
+
+    try
+    {
+        program = CLWProgram::CreateFromBinary(reinterpret_cast<std::uint8_t const*>(&binary[0]), binary.size(), buildopts, context);
+        return true;
+    }
+    catch (CLWException&)
+    {
+        return false;
+    }
+}
+
+void CLWProgram::SetBinaryCachePath(std::string const& path)
+{
+    std::lock_guard<std::mutex> lock(g_binary_cache_mutex);
+    g_binary_cache_path = path;
+}
+
+CLWProgram CLWProgram::CreateFromBinary(std::uint8_t const* binary,
+                                        size_t binarysize,
+                                        char const* buildopts,
+                                        CLWContext context)
+{
+    cl_int status = CL_SUCCESS;
+
+    std::vector<cl_device_id> deviceIds(context.GetDeviceCount());
+    std::vector<size_t> binarySizes(context.GetDeviceCount(), binarysize);
+    std::vector<unsigned char const*> binaries(context.GetDeviceCount(), binary);
+    std::vector<cl_int> binaryStatus(context.GetDeviceCount());
+    for(unsigned int i = 0; i < context.GetDeviceCount(); ++i)
+    {
+        deviceIds[i] = context.GetDevice(i);
+    }
+
+    cl_program program = clCreateProgramWithBinary(context, context.GetDeviceCount(), &deviceIds[0], &binarySizes[0], &binaries[0], &binaryStatus[0], &status);
+
+    ThrowIf(status != CL_SUCCESS, status, "clCreateProgramWithBinary failed");
+
+    status = clBuildProgram(program, context.GetDeviceCount(), &deviceIds[0], buildopts, nullptr, nullptr);
+
+    if(status != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        throw CLWException(status, "clBuildProgram failed for a binary");
+    }
+
+    CLWProgram prg(program);
+
+    clReleaseProgram(program);
+
+    return prg;
+}
+
 CLWProgram CLWProgram::CreateFromSource(char const* sourcecode, size_t sourcesize, char const* buildopts, CLWContext context)
 {
+    std::string cachefile = get_binary_cache_file(context, &sourcecode, &sourcesize, 1, buildopts);
+
+    CLWProgram cached;
+    if (create_from_cached_binary(cachefile, buildopts, context, cached))
+    {
+        return cached;
+    }
+
     cl_int status = CL_SUCCESS;
     
     cl_program program = clCreateProgramWithSource(context, 1, (const char**)&sourcecode, &sourcesize, &status);
@@ -94,6 +300,11 @@ CLWProgram CLWProgram::CreateFromSource(char const* sourcecode, size_t sourcesiz
     
     clReleaseProgram(program);
 
+    if (!cachefile.empty())
+    {
+        store_cached_binary(cachefile, prg);
+    }
+
     return prg;
 }
 
@@ -106,6 +317,25 @@ CLWProgram CLWProgram::CreateFromSource(char const* sourcecode,
                                         char const* buildopts,
                                         CLWContext context)
 {
+    // Headers are a part of the key along with their names
+    std::vector<char const*> keysources(1, sourcecode);
+    std::vector<size_t> keysizes(1, sourcesize);
+    for (int i = 0; i < numheaders; ++i)
+    {
+        keysources.push_back(headernames[i]);
+        keysizes.push_back(std::strlen(headernames[i]));
+        keysources.push_back(headers[i]);
+        keysizes.push_back(headersizes[i]);
+    }
+
+    std::string cachefile = get_binary_cache_file(context, &keysources[0], &keysizes[0], (int)keysources.size(), buildopts);
+
+    CLWProgram cached;
+    if (create_from_cached_binary(cachefile, buildopts, context, cached))
+    {
+        return cached;
+    }
+
     cl_int status = CL_SUCCESS;
     
     std::vector<cl_device_id> deviceIds(context.GetDeviceCount());
@@ -166,6 +396,11 @@ CLWProgram CLWProgram::CreateFromSource(char const* sourcecode,
     CLWProgram prg(program);
     
     clReleaseProgram(program);
+
+    if (!cachefile.empty())
+    {
+        store_cached_binary(cachefile, prg);
+    }
     
     return prg;
 }
@@ -258,3 +493,27 @@ CLWKernel CLWProgram::GetKernel(std::string const& funcName) const
     
     return iter->second;
 }
+
+void CLWProgram::GetBinary(std::vector<std::uint8_t>& binary) const
+{
+    cl_uint numDevices = 0;
+    cl_int status = clGetProgramInfo(*this, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &numDevices, nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    std::vector<size_t> binarySizes(numDevices);
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARY_SIZES, numDevices * sizeof(size_t), &binarySizes[0], nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    std::vector<std::vector<std::uint8_t> > binaries(numDevices);
+    std::vector<std::uint8_t*> binaryPtrs(numDevices);
+    for (cl_uint i = 0; i < numDevices; ++i)
+    {
+        binaries[i].resize(binarySizes[i]);
+        binaryPtrs[i] = binarySizes[i] > 0 ? &binaries[i][0] : nullptr;
+    }
+
+    status = clGetProgramInfo(*this, CL_PROGRAM_BINARIES, numDevices * sizeof(std::uint8_t*), &binaryPtrs[0], nullptr);
+    ThrowIf(status != CL_SUCCESS, status, "clGetProgramInfo failed");
+
+    binary.swap(binaries[0]);
+}
@@ -27,6 +27,7 @@ THE SOFTWARE.
 #include <vector>
 #include <map>
 #include <string>
+#include <cstdint>
 
 #ifdef __APPLE__
 #include <OpenCL/OpenCL.h>
@@ -62,11 +63,25 @@ public:
                                      char const* buildopts,
                                      CLWContext context);
 
+    // Create the program from a binary built for the devices of the context
+    static CLWProgram CreateFromBinary(std::uint8_t const* binary,
+                                       size_t binarysize,
+                                       char const* buildopts,
+                                       CLWContext context);
+
+    // Directory for compiled binaries, programs created from source for a single device
+    // context are looked up there by device, driver version, source and build options
+    // and stored after a successful build. Empty path disables the cache.
+    static void SetBinaryCachePath(std::string const& path);
+
     CLWProgram() {}
     virtual      ~CLWProgram();
 
     unsigned int GetKernelCount() const;
     CLWKernel    GetKernel(std::string const& funcName) const;
+
+    // Program binary for the first device
+    void         GetBinary(std::vector<std::uint8_t>& binary) const;
     
 private:
     CLWProgram(cl_program program);
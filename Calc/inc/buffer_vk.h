@@ -43,6 +43,7 @@ namespace Calc {
         BufferVulkan(Anvil::Buffer *inBuffer, bool inCreatedInternally)
                 : Buffer(), m_anvil_buffer(inBuffer)
                   , m_created_internally(inCreatedInternally)
+                  , m_id(GetNextId())
                   , m_fence_id(0) {
             ::memset(&m_mapped_memory, 0, sizeof(m_mapped_memory));
         }
@@ -57,6 +58,9 @@ namespace Calc {
 
         Anvil::Buffer *GetAnvilBuffer() const { return m_anvil_buffer; }
 
+        // unique id of the buffer, unlike Anvil pointers ids are never reused so they can key cached descriptor sets
+        uint64_t GetId() const { return m_id; }
+
         // set mapped memory info. the memory is mapped using a proxy allocation. if read, first the content of Vulkan buffer is copied to the proxy allocation. if write, the proxy buffer is filled with data and then copied to Vulkan buffer.
         void SetMappedMemory(uint8_t *inMappedMemory, uint32_t inMapType,
                              size_t inOffset, size_t inSize) {
@@ -78,9 +82,15 @@ namespace Calc {
     private:
         void SetFenceId( uint64_t id ) { m_fence_id = id; }
 
+        static uint64_t GetNextId() {
+            static std::atomic<uint64_t> next_id( 1 );
+            return next_id++;
+        }
+
         Anvil::Buffer *m_anvil_buffer;
         MappedMemory m_mapped_memory;
         bool m_created_internally;
+        uint64_t m_id;
 
         std::atomic<uint64_t> m_fence_id;
     };
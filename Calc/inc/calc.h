@@ -70,6 +70,8 @@ extern "C"
 #endif
     CALC_API Calc::Calc* CreateCalc(Calc::Platform inPlatform, int reserved);
     CALC_API void DeleteCalc(Calc::Calc* calc);
+    // Directory to cache compiled device binaries in, empty or null path disables the cache
+    CALC_API void SetCalcBinaryCachePath(char const* path);
 #ifdef __cplusplus
 }
 #endif
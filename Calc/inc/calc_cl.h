@@ -43,6 +43,8 @@ extern "C"
 {
 #endif
 CALC_API Calc::DeviceCl* CreateDeviceFromOpenCL(cl_context context, cl_device_id device, cl_command_queue queue);
+// Same as above with several application queues, Calc queue i is queues[i]
+CALC_API Calc::DeviceCl* CreateDeviceFromOpenCLQueues(cl_context context, cl_device_id device, cl_command_queue const* queues, int numqueues);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -48,7 +48,13 @@ namespace Calc
     {
         kRead = 0x1,
         kWrite = 0x2,
-        kPinned = 0x4
+        kPinned = 0x4,
+        // Host visible memory meant to stay mapped for the lifetime of the buffer,
+        // zero-copy on APUs and on GPUs exposing their memory to the host
+        kPersistent = 0x8,
+        // Use the memory passed as initdata in place instead of copying it,
+        // it has to outlive the buffer
+        kUseHostPtr = 0x10
     };
 
     enum MapType
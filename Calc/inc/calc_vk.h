@@ -25,10 +25,12 @@ THE SOFTWARE.
 
 #include "device_vk.h"
 
-namespace Anvil { class Device; class CommandPool; }
+namespace Anvil { class Device; class CommandPool; class Queue; }
 
 namespace Calc
 {
     CALC_API DeviceVulkan* CreateDeviceFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool);
+    // Same as above submitting the work to the application queue, null queue selects the device compute queue
+    CALC_API DeviceVulkan* CreateDeviceFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool, Anvil::Queue* queue);
 
 }
@@ -51,6 +51,15 @@ namespace Calc
         std::size_t local_mem_size;
         std::size_t max_alloc_size;
         std::size_t max_local_size;
+
+        // Number of compute units, 0 if unknown
+        std::uint32_t max_compute_units;
+        // Hardware SIMD width (wavefront, warp), 0 if unknown
+        std::uint32_t simd_width;
+        // Device memory is shared with the host (APUs), kUseHostPtr buffers avoid copies then
+        bool unified_memory;
+        // Kernels can use sub group votes and broadcasts (cl_khr_subgroups)
+        bool subgroups;
     };
 
     // Main interface to control compute device
@@ -73,12 +82,20 @@ namespace Calc
         virtual Buffer* CreateBuffer(std::size_t size, std::uint32_t flags) = 0;
         // Create buffer having initial data
         virtual Buffer* CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata) = 0;
+        // Create a view of size bytes of the buffer starting at offset, sharing its memory.
+        // offset has to be aligned to the device base address alignment.
+        // Deleted with DeleteBuffer, the parent buffer has to outlive it.
+        virtual Buffer* CreateSubBuffer(Buffer* buffer, std::size_t offset, std::size_t size) = 0;
         virtual void DeleteBuffer(Buffer* buffer) = 0;
 
         // Data movement
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
         virtual void ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const = 0;
         virtual void WriteBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e) = 0;
+        // Device side copy of size bytes between (possibly the same, non overlapping) buffers
+        virtual void CopyBuffer(Buffer const* src, Buffer const* dst, std::uint32_t queue, std::size_t src_offset, std::size_t dst_offset, std::size_t size, Event** e) = 0;
+        // Device side fill with a 32-bit pattern, offset and size are in bytes and have to be multiples of 4
+        virtual void FillBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t value, Event** e) = 0;
 
         // Buffer mapping
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
@@ -101,16 +118,26 @@ namespace Calc
         // Execution
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
         virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) = 0;
+        // Launch over a 1D, 2D or 3D range (e.g. 8x8 tiles of a screen), global_size and local_size hold
+        // dims sizes each. As for 1D launches, global_size counts work groups on Vulkan devices.
+        virtual void Execute(Function const* func, std::uint32_t queue, std::uint32_t dims, size_t const* global_size, size_t const* local_size, Event** e) = 0;
 
         // Events handling
         virtual void WaitForEvent(Event* e) = 0;
         virtual void WaitForMultipleEvents(Event** e, std::size_t num_events) = 0;
+        // Wait until at least one of the events is complete and return its index
+        virtual std::size_t WaitForAnyEvent(Event** e, std::size_t num_events) = 0;
+        // Make commands submitted to the queue after the call wait for the event on the device
+        virtual void EnqueueWaitForEvent(std::uint32_t queue, Event* e) = 0;
         virtual void DeleteEvent(Event* e) = 0;
 
         // Queue management functions
         virtual void Flush(std::uint32_t queue) = 0;
         virtual void Finish(std::uint32_t queue) = 0;
 
+        // Make events of the following commands report GPU execution time
+        virtual void SetProfilingEnabled(bool enabled) = 0;
+
         // Parallel prims handling
         virtual bool HasBuiltinPrimitives() const = 0;
         virtual Primitives* CreatePrimitives() const = 0;
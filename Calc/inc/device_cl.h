@@ -45,6 +45,11 @@ namespace Calc
         virtual ~DeviceCl() = default;
         
         virtual Buffer* CreateBuffer(cl_mem buffer) = 0;
+
+        // Wrap application event to wait for, the event is retained
+        virtual Event* AdoptEvent(cl_event event) = 0;
+        // OpenCL event of a Calc event, owned by the Calc event
+        virtual cl_event GetEvent(Event const* event) const = 0;
     };
 }
 
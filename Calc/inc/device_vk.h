@@ -28,6 +28,8 @@ THE SOFTWARE.
 #include "calc_common.h"
 #include "device.h"
 
+namespace Anvil { class Semaphore; }
+
 namespace Calc
 {
     class DeviceVulkan : public Device
@@ -35,5 +37,13 @@ namespace Calc
     public:
         DeviceVulkan() = default;
         virtual ~DeviceVulkan() = default;
+
+        // Make the next submission wait on the device for the semaphore at the given VkPipelineStageFlags
+        virtual void WaitSemaphore( Anvil::Semaphore* semaphore, std::uint32_t stage_mask ) = 0;
+        // Submit recorded work signalling the semaphore once it has completed
+        virtual void SignalSemaphore( Anvil::Semaphore* semaphore ) = 0;
+
+        // Dispatch a function with group counts read on the device from a VkDispatchIndirectCommand in args at offset
+        virtual void ExecuteIndirect( Function const* func, std::uint32_t queue, Buffer const* args, std::size_t offset, Event** e ) = 0;
     };
 }
\ No newline at end of file
@@ -29,11 +29,19 @@ namespace Calc
     class CALC_API Event
     {
     public:
+        typedef void (*CompletionCallback)(void* data);
+
         Event() {}
         virtual ~Event() = 0;
 
         virtual void Wait() = 0;
         virtual bool IsComplete() const = 0;
+        // GPU execution time of the command in milliseconds, the command has to be complete
+        // and submitted while profiling was enabled (see Device::SetProfilingEnabled)
+        virtual float GetDuration() const = 0;
+        // Call callback with data once the command is complete, right away if it already is.
+        // It is called on a driver or device thread and must not delete the event.
+        virtual void SetCompletionCallback(CompletionCallback callback, void* data) = 0;
 
         Event(Event const&) = delete;
         Event& operator = (Event const&) = delete;
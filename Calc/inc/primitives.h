@@ -34,6 +34,31 @@ namespace Calc
         virtual ~Primitives() = default;
 
         virtual void SortRadixInt32(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Stable sort of unsigned 64-bit keys with 32-bit values
+        virtual void SortRadixInt64(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Stable sort of float keys with 32-bit values
+        virtual void SortRadixFloat(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+        // Stable sort of unsigned 32-bit keys within segments, segment holds a 32-bit segment index per key
+        // and the output is grouped by ascending segment index
+        virtual void SortRadixSegmented(std::uint32_t queueidx, Buffer const* segment, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) = 0;
+
+        // Exclusive prefix sums
+        virtual void ScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+        virtual void ScanExclusiveAddFloat(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+
+        // Copy elements with predicate 1 out of 0 or 1 preserving their order, the number
+        // of copied elements is written to new_size, a single 32-bit integer
+        virtual void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* from, Buffer* to, std::size_t size, Buffer* new_size) = 0;
+
+        // Sum of the elements written to the first element of to
+        virtual void ReduceAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+        virtual void ReduceAddFloat(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+
+        // Union of bounding boxes (min and max float4 pairs, 32 bytes each) written to the first box of to
+        virtual void ReduceBounds(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) = 0;
+        // Union of bounding boxes per segment, segment i starts at box segment_starts[i] (ascending 32-bit
+        // integers) and ends where the next one starts, to receives a box per segment
+        virtual void SegmentedReduceBounds(std::uint32_t queueidx, Buffer const* segment_starts, Buffer const* from, Buffer* to, std::size_t size, std::size_t num_segments) = 0;
 
 
     private:
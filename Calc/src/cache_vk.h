@@ -0,0 +1,167 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace Calc {
+
+// On-disk cache for the Vulkan backend: SPIR-V blobs of compiled functions and
+// the driver pipeline cache data. Files are looked up in the directory set by
+// SetCalcBinaryCachePath, an empty path disables the cache.
+    namespace VulkanCache {
+
+        inline std::mutex &GetPathMutex() {
+            static std::mutex mutex;
+            return mutex;
+        }
+
+        inline std::string &GetPathStorage() {
+            static std::string path;
+            return path;
+        }
+
+        inline void SetPath(std::string const &path) {
+            std::lock_guard<std::mutex> lock(GetPathMutex());
+            GetPathStorage() = path;
+        }
+
+        inline std::string GetPath() {
+            std::lock_guard<std::mutex> lock(GetPathMutex());
+            return GetPathStorage();
+        }
+
+        // FNV-1a, has to match Tools/scripts/compile_spirv.py
+        inline void HashBytes(std::uint64_t &hash, char const *data, size_t size) {
+            for (size_t i = 0; i < size; ++i) {
+                hash ^= static_cast<std::uint8_t>(data[i]);
+                hash *= 1099511628211ULL;
+            }
+        }
+
+        inline void HashString(std::uint64_t &hash, std::string const &str) {
+            // Size is hashed too to keep adjacent strings apart
+            std::uint64_t size = str.size();
+            HashBytes(hash, reinterpret_cast<char const *>(&size), sizeof(size));
+            HashBytes(hash, str.c_str(), str.size());
+        }
+
+        // Key of a function compiled from source with the defines given,
+        // std::map keeps the defines sorted so the key does not depend on the
+        // order they were added in
+        inline std::uint64_t GetShaderKey(std::string const &source, std::string const &name,
+                                          std::map<std::string, std::string> const &defines) {
+            std::uint64_t hash = 14695981039346656037ULL;
+            HashString(hash, source);
+            HashString(hash, name);
+
+            for (auto &&item : defines) {
+                HashString(hash, item.first);
+                HashString(hash, item.second);
+            }
+
+            return hash;
+        }
+
+        // Full path of a cache file or an empty string if the cache is disabled
+        inline std::string GetFile(std::string const &prefix, std::uint64_t key, char const *ext) {
+            std::string path = GetPath();
+
+            if (path.empty()) {
+                return std::string();
+            }
+
+            std::ostringstream name;
+            name << path;
+            if (path.back() != '/' && path.back() != '\\') {
+                name << '/';
+            }
+            name << prefix << std::hex << std::setw(16) << std::setfill('0') << key << ext;
+
+            return name.str();
+        }
+
+        inline bool Load(std::string const &file, std::vector<char> &data) {
+            if (file.empty()) {
+                return false;
+            }
+
+            std::ifstream in(file, std::ios::in | std::ios::binary);
+
+            if (!in) {
+                return false;
+            }
+
+            in.seekg(0, std::ios::end);
+            std::streamoff size = in.tellg();
+            in.seekg(0, std::ios::beg);
+
+            if (size <= 0) {
+                return false;
+            }
+
+            data.resize(static_cast<size_t>(size));
+            in.read(&data[0], size);
+
+            return !!in;
+        }
+
+        inline void Store(std::string const &file, char const *data, size_t size) {
+            if (file.empty() || size == 0) {
+                return;
+            }
+
+            // Write to a temporary file first so concurrent processes never read partial files
+            std::string temp = file + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+
+            {
+                std::ofstream out(temp, std::ios::out | std::ios::binary);
+
+                if (!out) {
+                    return;
+                }
+
+                out.write(data, size);
+
+                if (!out) {
+                    out.close();
+                    std::remove(temp.c_str());
+                    return;
+                }
+            }
+
+            std::remove(file.c_str());
+            if (std::rename(temp.c_str(), file.c_str()) != 0) {
+                std::remove(temp.c_str());
+            }
+        }
+    }
+}
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #if USE_VULKAN
 #include "calc_vk.h"
 #include "calc_vkw.h"
+#include "cache_vk.h"
 #endif
 
 // Create corresponding calc
@@ -54,3 +55,13 @@ void DeleteCalc(Calc::Calc* calc)
 {
     delete calc;
 }
+
+void SetCalcBinaryCachePath(char const* path)
+{
+#if USE_OPENCL
+    CLWProgram::SetBinaryCachePath(path ? path : "");
+#endif
+#if USE_VULKAN
+    Calc::VulkanCache::SetPath(path ? path : "");
+#endif
+}
@@ -81,6 +81,10 @@ namespace Calc
         spec.min_alignment = m_devices[idx].GetMinAlignSize();
         spec.max_alloc_size = m_devices[idx].GetMaxAllocSize();
         spec.max_local_size = m_devices[idx].GetMaxWorkGroupSize();
+        spec.max_compute_units = m_devices[idx].GetMaxComputeUnits();
+        spec.simd_width = m_devices[idx].GetSimdWidth();
+        spec.unified_memory = m_devices[idx].HasUnifiedMemory();
+        spec.subgroups = m_devices[idx].HasSubgroups();
     }
 
     // Create the device with specified index
@@ -131,4 +135,19 @@ Calc::DeviceCl* CreateDeviceFromOpenCL(cl_context context, cl_device_id device,
     return new Calc::DeviceClw(clwDevice, clwContext);
 }
 
+Calc::DeviceCl* CreateDeviceFromOpenCLQueues(cl_context context, cl_device_id device, cl_command_queue const* queues, int numqueues)
+{
+    cl_command_queue queue = queues[0];
+    CLWContext clwContext = CLWContext::Create(context, &device, &queue, 1);
+
+    // Application queues go first, the device only creates the missing ones
+    for (int i = 1; i < numqueues; ++i)
+    {
+        clwContext.AddCommandQueue(queues[i]);
+    }
+
+    auto clwDevice = clwContext.GetDevice(0);
+    return new Calc::DeviceClw(clwDevice, clwContext);
+}
+
 #endif //use_opencl
\ No newline at end of file
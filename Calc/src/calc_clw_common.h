@@ -29,7 +29,21 @@ namespace Calc
     inline cl_mem_flags Convert2ClCreationFlags(std::uint32_t flags)
     {
         // TODO: implement correctly
-        return CL_MEM_READ_WRITE;
+        cl_mem_flags res = CL_MEM_READ_WRITE;
+
+        // Page locked host memory for DMA transfers
+        if (flags & kPinned)
+            res |= CL_MEM_ALLOC_HOST_PTR;
+
+        // Host accessible memory the driver places where kernels can reach it directly
+        if (flags & kPersistent)
+            res |= CL_MEM_ALLOC_HOST_PTR;
+
+        // Caller memory is host memory already, OpenCL rejects both flags together
+        if (flags & kUseHostPtr)
+            res &= ~static_cast<cl_mem_flags>(CL_MEM_ALLOC_HOST_PTR);
+
+        return res;
     }
 
     inline cl_mem_flags Convert2ClMapFlags(std::uint32_t flags)
@@ -35,9 +35,14 @@ namespace Calc
     }
 
     DeviceVulkan* CreateDeviceFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool)
+    {
+        return CreateDeviceFromVulkan(device, cmd_pool, nullptr);
+    }
+
+    DeviceVulkan* CreateDeviceFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool, Anvil::Queue* queue)
     {
         // TODO graphics or compute pipe selection
-        DeviceVulkanw* toReturn = new DeviceVulkanw(device, true);
+        DeviceVulkanw* toReturn = new DeviceVulkanw(device, true, queue);
         bool initVkOk = (nullptr != toReturn) ? toReturn->InitializeVulkanCommandBuffer(cmd_pool) : false;
         if (initVkOk == false)
         {
@@ -92,10 +97,14 @@ namespace Calc
 
             uint64_t localMemory = 0;
             uint64_t hostMemory = 0;
+            bool unifiedMemory = false;
 
             for ( uint32_t i = 0; i < device->get_memory_properties().types.size(); ++i )
             {
                 const Anvil::MemoryType& memoryType = device->get_memory_properties().types[ i ];
+                // Device local memory the host can map (APUs, resizable BAR)
+                unifiedMemory |= ( memoryType.flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ) != 0 &&
+                                 ( memoryType.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ) != 0;
                 if ( memoryType.flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT )
                 {
                     localMemory += memoryType.heap_ptr->size;
@@ -112,6 +121,12 @@ namespace Calc
             spec.min_alignment = static_cast< std::uint32_t >( device->get_device_properties().limits.minMemoryMapAlignment );
             spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
             spec.max_local_size = static_cast< std::size_t >(localMemory);
+            // Not exposed by Vulkan
+            spec.max_compute_units = 0;
+            spec.simd_width = 0;
+            spec.unified_memory = unifiedMemory;
+            // Shaders are compiled without build options, so there are no sub group variants to select
+            spec.subgroups = false;
         }
 
         else
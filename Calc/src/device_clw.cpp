@@ -28,6 +28,11 @@ THE SOFTWARE.
 #include "executable.h"
 #include "except_clw.h"
 #include "calc_clw_common.h"
+#include <algorithm>
+#include <condition_variable>
+#include <iterator>
+#include <memory>
+#include <mutex>
 
 namespace Calc
 {    
@@ -57,9 +62,13 @@ namespace Calc
 
         void Wait() override;
         bool IsComplete() const override;
+        float GetDuration() const override;
+        void SetCompletionCallback(CompletionCallback callback, void* data) override;
 
         void SetEvent(CLWEvent event);
 
+        CLWEvent GetEvent() const { return m_event; }
+
     private:
         CLWEvent m_event;
     };
@@ -97,6 +106,46 @@ namespace Calc
         }
     }
 
+    float EventClw::GetDuration() const
+    {
+        try
+        {
+            return m_event.GetDuration();
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    // Callback and data registered with the OpenCL event, deleted once called
+    struct EventClwCallback
+    {
+        Event::CompletionCallback callback;
+        void* data;
+    };
+
+    static void CL_CALLBACK OnEventClwComplete(cl_event, cl_int, void* data)
+    {
+        std::unique_ptr<EventClwCallback> payload(static_cast<EventClwCallback*>(data));
+        payload->callback(payload->data);
+    }
+
+    void EventClw::SetCompletionCallback(CompletionCallback callback, void* data)
+    {
+        std::unique_ptr<EventClwCallback> payload(new EventClwCallback{ callback, data });
+
+        try
+        {
+            m_event.SetCompletionCallback(OnEventClwComplete, payload.get());
+            payload.release();
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
     void EventClw::SetEvent(CLWEvent event)
     {
         m_event = event;
@@ -108,16 +157,27 @@ namespace Calc
         FunctionClw(CLWKernel kernel);
         ~FunctionClw();
 
-        // Argument setters
+        // Argument setters write into the kernel, so callers sharing a function serialize
+        // setting its arguments and executing it (RadeonRays holds its device lock)
         void SetArg(std::uint32_t idx, std::size_t arg_size, void* arg) override;
         void SetArg(std::uint32_t idx, Buffer const* arg) override;
         void SetArg(std::uint32_t idx, std::size_t size, SharedMemory shmem) override;
 
+        // Enqueue the kernel with its current arguments.
+        // The tracker orders the launch after the commands on its buffers, if any.
+        CLWEvent Launch(CLWContext& context, std::uint32_t queue, std::uint32_t dims, size_t const* global_size,
+            size_t const* local_size, DependencyTracker* tracker) const;
+
         // CLW object access
         CLWKernel GetKernel() const;
 
     private:
+        // Remember the buffer bound to an argument, nullptr for other arguments
+        void Bind(std::uint32_t idx, cl_mem buffer);
+
         CLWKernel m_kernel;
+        // Buffers bound to the kernel by argument index, nullptr for other arguments
+        std::vector<cl_mem> m_bound;
     };
 
 
@@ -130,12 +190,22 @@ namespace Calc
     {
     }
 
+    void FunctionClw::Bind(std::uint32_t idx, cl_mem buffer)
+    {
+        if (m_bound.size() <= idx)
+        {
+            m_bound.resize(idx + 1, nullptr);
+        }
+        m_bound[idx] = buffer;
+    }
+
     // Argument setters
     void FunctionClw::SetArg(std::uint32_t idx, std::size_t arg_size, void* arg)
     {
         try
         {
             m_kernel.SetArg(idx, arg_size, arg);
+            Bind(idx, nullptr);
         }
         catch (CLWException& e)
         {
@@ -149,6 +219,7 @@ namespace Calc
         {
             auto buffer_clw = static_cast<BufferClw const*>(arg);
             m_kernel.SetArg(idx, buffer_clw->GetData());
+            Bind(idx, buffer_clw->GetData());
         }
         catch (CLWException& e)
         {
@@ -161,6 +232,55 @@ namespace Calc
         try
         {
             m_kernel.SetArg(idx, ::SharedMemory(static_cast<cl_uint>(size)));
+            Bind(idx, nullptr);
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    CLWEvent FunctionClw::Launch(CLWContext& context, std::uint32_t queue, std::uint32_t dims, size_t const* global_size,
+        size_t const* local_size, DependencyTracker* tracker) const
+    {
+        if (dims < 1 || dims > 3)
+        {
+            throw ExceptionClw("Launch dimensions have to be in [1, 3]");
+        }
+
+        try
+        {
+            CLWKernel kernel = m_kernel;
+
+            // CLW takes mutable size arrays
+            size_t global[3] = { 1, 1, 1 };
+            size_t local[3] = { 1, 1, 1 };
+            std::copy(global_size, global_size + dims, global);
+            std::copy(local_size, local_size + dims, local);
+
+            auto launch = [&](std::vector<CLWEvent> const& events)
+            {
+                switch (dims)
+                {
+                case 1:
+                    return context.Launch1D(queue, global[0], local[0], kernel, events);
+                case 2:
+                    return context.Launch2D(queue, global, local, kernel, events);
+                default:
+                    return context.Launch3D(queue, global, local, kernel, events);
+                }
+            };
+
+            if (!tracker)
+            {
+                return launch(std::vector<CLWEvent>());
+            }
+
+            // Kernel arguments do not tell reads from writes, so the launch counts as a write of all its buffers
+            std::vector<cl_mem> buffers;
+            std::copy_if(m_bound.begin(), m_bound.end(), std::back_inserter(buffers), [](cl_mem mem) { return mem != nullptr; });
+
+            return tracker->Enqueue(buffers.data(), buffers.size(), launch);
         }
         catch (CLWException& e)
         {
@@ -184,6 +304,8 @@ namespace Calc
         Function* CreateFunction(char const* name) override;
         void DeleteFunction(Function* func) override;
 
+        CLWProgram GetProgram() const { return m_program; }
+
     private:
         CLWProgram m_program;
     };
@@ -221,6 +343,8 @@ namespace Calc
         : m_device(device)
         , m_context(CLWContext::Create(device))
     {
+        CreateQueues();
+
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
@@ -232,6 +356,8 @@ namespace Calc
     : m_device(device)
     , m_context(context)
     {
+        CreateQueues();
+
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
@@ -239,6 +365,91 @@ namespace Calc
         }
     }
 
+    void DeviceClw::CreateQueues()
+    {
+        try
+        {
+            // All queues are on the device the context has been created for,
+            // added queues execute out of order if the first one does
+            bool out_of_order = m_context.IsOutOfOrder(0);
+            while (m_context.GetCommandQueueCount() < NUM_QUEUES)
+            {
+                m_context.CreateCommandQueue(0, out_of_order);
+            }
+
+            m_out_of_order.resize(m_context.GetCommandQueueCount());
+            for (std::uint32_t i = 0; i < m_context.GetCommandQueueCount(); ++i)
+            {
+                m_out_of_order[i] = m_context.IsOutOfOrder(i);
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    DependencyTracker* DeviceClw::GetTracker(std::uint32_t queue) const
+    {
+        return m_out_of_order[queue] ? &m_tracker : nullptr;
+    }
+
+    CLWEvent DeviceClw::Enqueue(std::uint32_t queue, cl_mem const* buffers, std::size_t num_buffers,
+        std::function<CLWEvent(std::vector<CLWEvent> const&)> const& enqueue) const
+    {
+        auto tracker = GetTracker(queue);
+        return tracker ? tracker->Enqueue(buffers, num_buffers, enqueue) : enqueue(std::vector<CLWEvent>());
+    }
+
+    CLWEvent DependencyTracker::Enqueue(cl_mem const* buffers, std::size_t num_buffers,
+        std::function<CLWEvent(std::vector<CLWEvent> const&)> const& enqueue)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Sub-buffers overlap their parent, so both share the parent entry
+        std::vector<cl_mem> keys(buffers, buffers + num_buffers);
+        for (auto& key : keys)
+        {
+            auto parent = m_parents.find(key);
+            if (parent != m_parents.end())
+            {
+                key = parent->second;
+            }
+        }
+
+        std::vector<CLWEvent> events;
+        for (auto key : keys)
+        {
+            auto iter = m_latest.find(key);
+            if (iter != m_latest.end())
+            {
+                events.push_back(iter->second);
+            }
+        }
+
+        CLWEvent event = enqueue(events);
+
+        for (auto key : keys)
+        {
+            m_latest[key] = event;
+        }
+
+        return event;
+    }
+
+    void DependencyTracker::Forget(cl_mem buffer)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_latest.erase(buffer);
+        m_parents.erase(buffer);
+    }
+
+    void DependencyTracker::Alias(cl_mem sub_buffer, cl_mem parent)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_parents[sub_buffer] = parent;
+    }
+
     DeviceClw::~DeviceClw()
     {
         while (!m_event_pool.empty())
@@ -262,6 +473,11 @@ namespace Calc
         spec.min_alignment = m_device.GetMinAlignSize();
         spec.max_alloc_size = m_device.GetMaxAllocSize();
         spec.max_local_size = m_device.GetMaxWorkGroupSize();
+        spec.max_compute_units = m_device.GetMaxComputeUnits();
+        spec.simd_width = m_device.GetSimdWidth();
+        spec.unified_memory = m_device.HasUnifiedMemory();
+        spec.subgroups = m_device.HasSubgroups();
+        spec.max_num_queues = m_context.GetCommandQueueCount();
     }
 
     Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
@@ -280,7 +496,24 @@ namespace Calc
     {
         try
         {
-            return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | CL_MEM_COPY_HOST_PTR, initdata));
+            cl_mem_flags host_ptr = (flags & kUseHostPtr) ? CL_MEM_USE_HOST_PTR : 0;
+            return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | host_ptr, initdata));
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    Buffer* DeviceClw::CreateSubBuffer(Buffer* buffer, std::size_t offset, std::size_t size)
+    {
+        auto parent = static_cast<BufferClw*>(buffer)->GetData();
+
+        try
+        {
+            auto sub_buffer = parent.CreateSubBuffer(CL_MEM_READ_WRITE, offset, size);
+            m_tracker.Alias(sub_buffer, parent);
+            return new BufferClw(sub_buffer);
         }
         catch (CLWException& e)
         {
@@ -290,6 +523,7 @@ namespace Calc
 
     void DeviceClw::DeleteBuffer(Buffer* buffer)
     {
+        m_tracker.Forget(static_cast<BufferClw*>(buffer)->GetData());
         delete buffer;
     }
 
@@ -299,7 +533,11 @@ namespace Calc
 
         try
         {
-            CLWEvent event = m_context.ReadBuffer(queue, buffer_clw->GetData(), static_cast<char*>(dst), offset, size);
+            cl_mem mem = buffer_clw->GetData();
+            CLWEvent event = Enqueue(queue, &mem, 1, [&](std::vector<CLWEvent> const& events)
+            {
+                return m_context.ReadBuffer(queue, buffer_clw->GetData(), static_cast<char*>(dst), offset, size, events);
+            });
 
             if (e)
             {
@@ -320,7 +558,69 @@ namespace Calc
 
         try
         {
-            CLWEvent event = m_context.WriteBuffer(queue, buffer_clw->GetData(), static_cast<char*>(src), offset, size);
+            cl_mem mem = buffer_clw->GetData();
+            CLWEvent event = Enqueue(queue, &mem, 1, [&](std::vector<CLWEvent> const& events)
+            {
+                return m_context.WriteBuffer(queue, buffer_clw->GetData(), static_cast<char*>(src), offset, size, events);
+            });
+
+            if (e)
+            {
+                auto event_clw = CreateEventClw();
+                event_clw->SetEvent(event);
+                *e = event_clw;
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    void DeviceClw::CopyBuffer(Buffer const* src, Buffer const* dst, std::uint32_t queue, std::size_t src_offset, std::size_t dst_offset, std::size_t size, Event** e)
+    {
+        auto src_clw = static_cast<BufferClw const*>(src);
+        auto dst_clw = static_cast<BufferClw const*>(dst);
+
+        try
+        {
+            cl_mem mems[] = { src_clw->GetData(), dst_clw->GetData() };
+            CLWEvent event = Enqueue(queue, mems, 2, [&](std::vector<CLWEvent> const& events)
+            {
+                return m_context.CopyBuffer(queue, src_clw->GetData(), dst_clw->GetData(), src_offset, dst_offset, size, events);
+            });
+
+            if (e)
+            {
+                auto event_clw = CreateEventClw();
+                event_clw->SetEvent(event);
+                *e = event_clw;
+            }
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    void DeviceClw::FillBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t value, Event** e)
+    {
+        if ((offset | size) % sizeof(std::uint32_t) != 0)
+        {
+            throw ExceptionClw("Fill offset and size have to be multiples of 4");
+        }
+
+        auto buffer_clw = static_cast<BufferClw const*>(buffer);
+
+        try
+        {
+            cl_mem mem = buffer_clw->GetData();
+            CLWEvent event = Enqueue(queue, &mem, 1, [&](std::vector<CLWEvent> const& events)
+            {
+                // The pattern is 4 bytes wide, so fill through a uint view of the same memory
+                auto words = CLWBuffer<std::uint32_t>::CreateFromClBuffer(mem);
+                return m_context.FillBuffer(queue, words, value, offset / sizeof(std::uint32_t), size / sizeof(std::uint32_t), events);
+            });
 
             if (e)
             {
@@ -341,7 +641,11 @@ namespace Calc
 
         try
         {
-            CLWEvent event = m_context.MapBuffer(queue, buffer_clw->GetData(), Convert2ClMapFlags(map_type), offset, size, reinterpret_cast<char**>(mapdata));
+            cl_mem mem = buffer_clw->GetData();
+            CLWEvent event = Enqueue(queue, &mem, 1, [&](std::vector<CLWEvent> const& events)
+            {
+                return m_context.MapBuffer(queue, buffer_clw->GetData(), Convert2ClMapFlags(map_type), offset, size, reinterpret_cast<char**>(mapdata), events);
+            });
 
             if (e)
             {
@@ -362,7 +666,11 @@ namespace Calc
 
         try
         {
-            CLWEvent event = m_context.UnmapBuffer(queue, buffer_clw->GetData(), static_cast<char*>(mapdata));
+            cl_mem mem = buffer_clw->GetData();
+            CLWEvent event = Enqueue(queue, &mem, 1, [&](std::vector<CLWEvent> const& events)
+            {
+                return m_context.UnmapBuffer(queue, buffer_clw->GetData(), static_cast<char*>(mapdata), events);
+            });
 
             if (e)
             {
@@ -472,7 +780,14 @@ namespace Calc
 
     Executable* DeviceClw::CompileExecutable(std::uint8_t const* binary_code, std::size_t size, char const* options)
     {
-        return nullptr;
+        try
+        {
+            return new ExecutableClw(CLWProgram::CreateFromBinary(binary_code, size, options, m_context));
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::DeleteExecutable(Executable* executable)
@@ -482,21 +797,48 @@ namespace Calc
 
     size_t DeviceClw::GetExecutableBinarySize(Executable const* executable) const
     {
-        return 0;
+        auto executable_clw = static_cast<ExecutableClw const*>(executable);
+
+        try
+        {
+            std::vector<std::uint8_t> binary;
+            executable_clw->GetProgram().GetBinary(binary);
+            return binary.size();
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::GetExecutableBinary(Executable const* executable, std::uint8_t* binary) const
     {
+        auto executable_clw = static_cast<ExecutableClw const*>(executable);
 
+        try
+        {
+            std::vector<std::uint8_t> data;
+            executable_clw->GetProgram().GetBinary(data);
+            std::copy(data.begin(), data.end(), binary);
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
     }
 
     void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
+    {
+        Execute(func, queue, 1, &global_size, &local_size, e);
+    }
+
+    void DeviceClw::Execute(Function const* func, std::uint32_t queue, std::uint32_t dims, size_t const* global_size, size_t const* local_size, Event** e)
     {
         auto func_clw = static_cast<FunctionClw const*>(func);
 
         try
         {
-            CLWEvent event = m_context.Launch1D(queue, global_size, local_size, func_clw->GetKernel());
+            CLWEvent event = func_clw->Launch(m_context, queue, dims, global_size, local_size, GetTracker(queue));
 
             if (e)
             {
@@ -524,11 +866,89 @@ namespace Calc
         }
     }
 
+    // State shared by the callbacks of WaitForAnyEvent, it outlives the call
+    // as the callbacks of the events still running are called later
+    struct WaitAnyState
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::size_t index;
+        bool done;
+    };
+
+    struct WaitAnyCallback
+    {
+        std::shared_ptr<WaitAnyState> state;
+        std::size_t index;
+    };
+
+    static void OnWaitAnyComplete(void* data)
+    {
+        std::unique_ptr<WaitAnyCallback> payload(static_cast<WaitAnyCallback*>(data));
+        auto& state = *payload->state;
+
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.done)
+            {
+                return;
+            }
+
+            state.index = payload->index;
+            state.done = true;
+        }
+
+        state.cv.notify_one();
+    }
+
+    std::size_t DeviceClw::WaitForAnyEvent(Event** e, std::size_t num_events)
+    {
+        if (num_events == 0)
+        {
+            throw ExceptionClw("No events to wait for");
+        }
+
+        for (std::size_t i = 0; i < num_events; ++i)
+        {
+            if (e[i]->IsComplete())
+            {
+                return i;
+            }
+        }
+
+        auto state = std::make_shared<WaitAnyState>();
+        state->index = 0;
+        state->done = false;
+
+        for (std::size_t i = 0; i < num_events; ++i)
+        {
+            std::unique_ptr<WaitAnyCallback> payload(new WaitAnyCallback{ state, i });
+            e[i]->SetCompletionCallback(OnWaitAnyComplete, payload.get());
+            payload.release();
+        }
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&state]() { return state->done; });
+        return state->index;
+    }
+
     void DeviceClw::DeleteEvent(Event* e)
     {
         ReleaseEventClw(static_cast<EventClw*>(e));
     }
 
+    void DeviceClw::EnqueueWaitForEvent(std::uint32_t queue, Event* e)
+    {
+        try
+        {
+            m_context.WaitForEvent(queue, static_cast<EventClw*>(e)->GetEvent());
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
     void DeviceClw::Flush(std::uint32_t queue)
     {
         try
@@ -553,8 +973,31 @@ namespace Calc
         }
     }
 
+    void DeviceClw::SetProfilingEnabled(bool enabled)
+    {
+        if (!enabled)
+        {
+            return;
+        }
+
+        // Own queues are always created with profiling enabled, queues
+        // passed by the application might not be
+        for (auto i = 0U; i < m_context.GetCommandQueueCount(); ++i)
+        {
+            cl_command_queue_properties props = 0;
+            cl_int status = clGetCommandQueueInfo(m_context.GetCommandQueue(i), CL_QUEUE_PROPERTIES, sizeof(props), &props, nullptr);
+
+            if (status != CL_SUCCESS || !(props & CL_QUEUE_PROFILING_ENABLE))
+            {
+                throw ExceptionClw("Profiling requires command queues created with CL_QUEUE_PROFILING_ENABLE");
+            }
+        }
+    }
+
     EventClw* DeviceClw::CreateEventClw() const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
         if (m_event_pool.empty())
         {
             auto event = new EventClw();
@@ -570,6 +1013,7 @@ namespace Calc
 
     void DeviceClw::ReleaseEventClw(EventClw* e) const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
         m_event_pool.push(e);
     }
     
@@ -585,12 +1029,44 @@ namespace Calc
         }
     }
 
+    Event* DeviceClw::AdoptEvent(cl_event event)
+    {
+        try
+        {
+            // CLWEvent takes over the reference, keep the one of the application
+            clRetainEvent(event);
+
+            auto e = CreateEventClw();
+            e->SetEvent(CLWEvent::Create(event));
+            return e;
+        }
+        catch (CLWException& e)
+        {
+            throw ExceptionClw(e.what());
+        }
+    }
+
+    cl_event DeviceClw::GetEvent(Event const* event) const
+    {
+        return static_cast<EventClw const*>(event)->GetEvent();
+    }
+
 
     class PrimitivesClw : public Primitives
     {
     public:
-        PrimitivesClw(CLWContext context)
+        PrimitivesClw(CLWContext context, std::vector<bool> const& out_of_order)
+            : m_out_of_order(out_of_order)
+            , m_serial_queue(0)
         {
+            // Primitives enqueue several dependent kernels, on out of order queues they run on an in order queue of their own
+            if (std::find(out_of_order.begin(), out_of_order.end(), true) != out_of_order.end())
+            {
+                m_serial_queue = context.CreateCommandQueue(0);
+            }
+
+            m_context = context;
+
             std::string buildopts = "";
             
             buildopts.append(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
@@ -632,11 +1108,101 @@ namespace Calc
             auto from_value_clw = static_cast<BufferClw const*>(from_value);
             auto to_value_clw = static_cast<BufferClw*>(to_value);
 
-            m_pp.SortRadix((int)queueidx, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size);
+            Run(queueidx, [&](int queue) { m_pp.SortRadixOnesweep(queue, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size); });
+        }
+
+        void SortRadixInt64(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
+        {
+            auto from_key_clw = static_cast<BufferClw const*>(from_key);
+            auto to_key_clw = static_cast<BufferClw*>(to_key);
+            auto from_value_clw = static_cast<BufferClw const*>(from_value);
+            auto to_value_clw = static_cast<BufferClw*>(to_value);
+
+            Run(queueidx, [&](int queue) { m_pp.SortRadix64(queue, from_key_clw->GetData(), to_key_clw->GetData(), from_value_clw->GetData(), to_value_clw->GetData(), (int)size); });
+        }
+
+        void SortRadixFloat(std::uint32_t queueidx, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.SortRadixFloat(queue, GetData(from_key), GetData(to_key), GetData(from_value), GetData(to_value), (int)size); });
+        }
+
+        void SortRadixSegmented(std::uint32_t queueidx, Buffer const* segment, Buffer const* from_key, Buffer* to_key, Buffer const* from_value, Buffer* to_value, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.SortRadixSegmented(queue, GetData(segment), GetData(from_key), GetData(to_key), GetData(from_value), GetData(to_value), (int)size); });
+        }
+
+        void ScanExclusiveAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.ScanExclusiveAddSinglePass(queue, GetTypedData<cl_int>(from), GetTypedData<cl_int>(to), (int)size); });
+        }
+
+        void ScanExclusiveAddFloat(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.ScanExclusiveAdd(queue, GetTypedData<cl_float>(from), GetTypedData<cl_float>(to), (int)size); });
+        }
+
+        void CompactInt32(std::uint32_t queueidx, Buffer const* predicate, Buffer const* from, Buffer* to, std::size_t size, Buffer* new_size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.Compact(queue, GetTypedData<cl_int>(predicate), GetTypedData<cl_int>(from), GetTypedData<cl_int>(to), (int)size, GetTypedData<cl_int>(new_size)); });
+        }
+
+        void ReduceAddInt32(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.ReduceSum(queue, GetTypedData<cl_int>(from), GetTypedData<cl_int>(to), (int)size); });
+        }
+
+        void ReduceAddFloat(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.ReduceSum(queue, GetTypedData<cl_float>(from), GetTypedData<cl_float>(to), (int)size); });
+        }
+
+        void ReduceBounds(std::uint32_t queueidx, Buffer const* from, Buffer* to, std::size_t size) override
+        {
+            Run(queueidx, [&](int queue) { m_pp.ReduceBounds(queue, GetData(from), GetData(to), (int)size); });
+        }
+
+        void SegmentedReduceBounds(std::uint32_t queueidx, Buffer const* segment_starts, Buffer const* from, Buffer* to, std::size_t size, std::size_t num_segments) override
+        {
+            if (num_segments == 0)
+            {
+                return;
+            }
+
+            Run(queueidx, [&](int queue) { m_pp.SegmentedReduceBounds(queue, GetData(from), GetData(segment_starts), GetData(to), (int)size, (int)num_segments); });
         }
 
     private:
+        // Run the primitive after the commands enqueued to the queue before and ahead of the commands enqueued after
+        template <typename F>
+        void Run(std::uint32_t queueidx, F const& primitive)
+        {
+            if (!m_out_of_order[queueidx])
+            {
+                primitive(static_cast<int>(queueidx));
+                return;
+            }
+
+            m_context.WaitForEvent(m_serial_queue, m_context.Marker(queueidx));
+            primitive(static_cast<int>(m_serial_queue));
+            m_context.WaitForEvent(queueidx, m_context.Marker(m_serial_queue));
+        }
+
+        static CLWBuffer<char> GetData(Buffer const* buffer)
+        {
+            return static_cast<BufferClw const*>(buffer)->GetData();
+        }
+
+        // Typed view of the same memory object for typed parallel primitives
+        template <typename T>
+        static CLWBuffer<T> GetTypedData(Buffer const* buffer)
+        {
+            return CLWBuffer<T>::CreateFromClBuffer(GetData(buffer));
+        }
+
         CLWParallelPrimitives m_pp;
+        CLWContext m_context;
+        std::vector<bool> m_out_of_order;
+        unsigned int m_serial_queue;
     };
 
 
@@ -647,7 +1213,7 @@ namespace Calc
 
     Primitives* DeviceClw::CreatePrimitives() const
     {
-        return new PrimitivesClw(m_context);
+        return new PrimitivesClw(m_context, m_out_of_order);
     }
 
     void DeviceClw::DeletePrimitives(Primitives* prims)
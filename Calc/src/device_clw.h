@@ -25,11 +25,35 @@ THE SOFTWARE.
 #include "device_cl.h"
 #include "CLW.h"
 
+#include <functional>
+#include <mutex>
 #include <queue>
+#include <unordered_map>
+#include <vector>
 
 namespace Calc
 {
     class EventClw;
+
+    // Orders the commands of out of order queues by the buffers they use: a command waits for
+    // the latest command on each of its buffers, commands on disjoint buffers are free to overlap
+    class DependencyTracker
+    {
+    public:
+        // Enqueue a command using the buffers, enqueue gets the events it has to wait for
+        CLWEvent Enqueue(cl_mem const* buffers, std::size_t num_buffers,
+            std::function<CLWEvent(std::vector<CLWEvent> const&)> const& enqueue);
+        // Drop the latest command of a deleted buffer
+        void Forget(cl_mem buffer);
+        // Track commands on a sub-buffer as commands on its parent
+        void Alias(cl_mem sub_buffer, cl_mem parent);
+
+    private:
+        std::mutex m_mutex;
+        std::unordered_map<cl_mem, CLWEvent> m_latest;
+        std::unordered_map<cl_mem, cl_mem> m_parents;
+    };
+
     // Device implementation with CLW library
     class DeviceClw : public DeviceCl
     {
@@ -46,11 +70,14 @@ namespace Calc
         // Buffer creation and deletion
         Buffer* CreateBuffer(std::size_t size, std::uint32_t flags) override;
         Buffer* CreateBuffer(std::size_t size, std::uint32_t flags, void* initdata) override;
+        Buffer* CreateSubBuffer(Buffer* buffer, std::size_t offset, std::size_t size) override;
         void DeleteBuffer(Buffer* buffer) override;
 
         // Data movement
         void ReadBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e) const override;
         void WriteBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e) override;
+        void CopyBuffer(Buffer const* src, Buffer const* dst, std::uint32_t queue, std::size_t src_offset, std::size_t dst_offset, std::size_t size, Event** e) override;
+        void FillBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t value, Event** e) override;
 
         // Buffer mapping 
         void MapBuffer(Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t map_type, void** mapdata, Event** e) override;
@@ -69,16 +96,22 @@ namespace Calc
 
         // Execution
         void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) override;
+        void Execute(Function const* func, std::uint32_t queue, std::uint32_t dims, size_t const* global_size, size_t const* local_size, Event** e) override;
 
         // Events handling
         void WaitForEvent(Event* e) override;
         void WaitForMultipleEvents(Event** e, std::size_t num_events) override;
+        std::size_t WaitForAnyEvent(Event** e, std::size_t num_events) override;
+        void EnqueueWaitForEvent(std::uint32_t queue, Event* e) override;
         void DeleteEvent(Event* e) override;
 
         // Queue management functions
         void Flush(std::uint32_t queue) override;
         void Finish(std::uint32_t queue) override;
 
+        // Profiling
+        void SetProfilingEnabled(bool enabled) override;
+
         // Parallel prims handling
         bool HasBuiltinPrimitives() const override;
         Primitives* CreatePrimitives() const override;
@@ -86,20 +119,37 @@ namespace Calc
         
         // DeviceCl overrides
         Buffer* CreateBuffer(cl_mem buffer) override;
+        Event* AdoptEvent(cl_event event) override;
+        cl_event GetEvent(Event const* event) const override;
 
         Platform GetPlatform() const override { return Platform::kOpenCL; }
 
     protected:
         EventClw* CreateEventClw() const;
         void      ReleaseEventClw(EventClw* e) const;
+        // Create additional queues up to NUM_QUEUES
+        void      CreateQueues();
+        // Dependency tracker of the queue, nullptr for in order queues
+        DependencyTracker* GetTracker(std::uint32_t queue) const;
+        // Enqueue a command using the buffers after the commands it depends on
+        CLWEvent Enqueue(std::uint32_t queue, cl_mem const* buffers, std::size_t num_buffers,
+            std::function<CLWEvent(std::vector<CLWEvent> const&)> const& enqueue) const;
 
     private:
         CLWDevice m_device;
         CLWContext m_context;
 
+        // Number of queues, the first one is the queue the context has been created with
+        static const std::uint32_t NUM_QUEUES = 4;
         // Initial number of events in the pool
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
         // Event pool
         mutable std::queue<EventClw*> m_event_pool;
+        // Events are created by commits building in the background and by queries at the same time
+        mutable std::mutex m_event_pool_mutex;
+        // Queues executing commands out of order, e.g. application queues of interop devices,
+        // get their commands ordered by the buffers they use
+        std::vector<bool> m_out_of_order;
+        mutable DependencyTracker m_tracker;
     };
 }
\ No newline at end of file
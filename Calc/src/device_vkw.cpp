@@ -1,6 +1,7 @@
 #include "except_vk.h"
 #if defined(USE_VULKAN)
 
+#include <algorithm>
 #include <cassert>
 #include "misc/debug.h"
 #include "wrappers/device.h"
@@ -11,6 +12,7 @@
 #include "wrappers/compute_pipeline_manager.h"
 #include "wrappers/command_buffer.h"
 #include "wrappers/fence.h"
+#include "wrappers/semaphore.h"
 #include "wrappers/queue.h"
 #include "wrappers/pipeline_layout.h"
 #include "wrappers/physical_device.h"
@@ -22,11 +24,13 @@
 #include "executable.h"
 
 #include "common_vk.h"
+#include "cache_vk.h"
 #include "buffer_vk.h"
 #include "event_vk.h"
 #include "executable_vk.h"
 #include "function_vk.h"
 #include "device_vk.h"
+#include "wrappers/pipeline_cache.h"
 
 
 namespace Calc
@@ -50,13 +54,21 @@ namespace Calc
 
 
     // ctor
-    DeviceVulkanw::DeviceVulkanw( Anvil::Device* in_new_device, bool in_use_compute_pipe ) :
+    DeviceVulkanw::DeviceVulkanw( Anvil::Device* in_new_device, bool in_use_compute_pipe, Anvil::Queue* in_queue ) :
          DeviceVulkan()
          , m_anvil_device( in_new_device )
          , m_is_command_buffer_recording( false )
+         , m_num_batched_dispatches( 0 )
          , m_use_compute_pipe( in_use_compute_pipe )
+         , m_queue( in_queue )
+         , m_signal_semaphore( nullptr )
          , m_cpu_fence_id( 0 )
          , m_gpu_known_fence_id( 1 )
+         , m_submitted_fence_id( 1 )
+         , m_stop_fence_watcher( false )
+         , m_profiling( false )
+         , m_timestamp_pool( VK_NULL_HANDLE )
+         , m_next_timestamp_pair( 0 )
     {
         m_anvil_device->retain();
 
@@ -64,18 +76,100 @@ namespace Calc
         {
             fence.reset( new Anvil::Fence(m_anvil_device, true) );
         }
+
+        LoadPipelineCache();
     }
 
     // dtor
     DeviceVulkanw::~DeviceVulkanw()
     {
-        m_command_buffer.reset();
+        // Command buffers can't be released while the device is using them
+        Finish( 0 );
+
+        // All fences have been passed, so pending callbacks are called before the watcher stops
+        {
+            std::lock_guard<std::mutex> lock( m_fence_mutex );
+            m_stop_fence_watcher = true;
+        }
+        m_fence_cv.notify_one();
+
+        if ( m_fence_watcher.joinable() )
+        {
+            m_fence_watcher.join();
+        }
+
+        StorePipelineCache();
+
+        for (auto& command_buffer : m_command_buffers) { command_buffer.reset(); }
 
         for (auto& fence : m_anvil_fences) { fence.reset(); }
 
+        if ( VK_NULL_HANDLE != m_timestamp_pool )
+        {
+            vkDestroyQueryPool( m_anvil_device->get_device_vk(), m_timestamp_pool, nullptr );
+        }
+
         m_anvil_device->release();
     }
 
+    // Pipeline cache file is per physical device and driver, the driver
+    // validates the header of the data and ignores caches it can't use
+    std::string DeviceVulkanw::GetPipelineCacheFile() const
+    {
+        const VkPhysicalDeviceProperties& properties = m_anvil_device->get_physical_device()->get_device_properties();
+
+        std::uint64_t hash = 14695981039346656037ULL;
+        VulkanCache::HashString( hash, properties.deviceName );
+        VulkanCache::HashBytes( hash, reinterpret_cast<char const*>( &properties.vendorID ), sizeof( properties.vendorID ) );
+        VulkanCache::HashBytes( hash, reinterpret_cast<char const*>( &properties.deviceID ), sizeof( properties.deviceID ) );
+        VulkanCache::HashBytes( hash, reinterpret_cast<char const*>( &properties.driverVersion ), sizeof( properties.driverVersion ) );
+
+        return VulkanCache::GetFile( "pipeline_", hash, ".vkcache" );
+    }
+
+    // Seed device pipeline cache with the data stored by the previous run
+    void DeviceVulkanw::LoadPipelineCache()
+    {
+        std::vector<char> data;
+        if ( !VulkanCache::Load( GetPipelineCacheFile(), data ) )
+        {
+            return;
+        }
+
+        Anvil::PipelineCache* loaded = new Anvil::PipelineCache( m_anvil_device, data.size(), &data[0] );
+        const Anvil::PipelineCache* sources[] = { loaded };
+
+        m_anvil_device->get_pipeline_cache()->merge( 1, sources );
+
+        loaded->release();
+    }
+
+    // Write device pipeline cache back, compute pipelines created meanwhile are added to it
+    void DeviceVulkanw::StorePipelineCache()
+    {
+        std::string file = GetPipelineCacheFile();
+        if ( file.empty() )
+        {
+            return;
+        }
+
+        Anvil::PipelineCache* cache = m_anvil_device->get_pipeline_cache();
+
+        size_t size = 0;
+        if ( !cache->get_data( &size, nullptr ) || size == 0 )
+        {
+            return;
+        }
+
+        std::vector<char> data( size );
+        if ( !cache->get_data( &size, &data[0] ) )
+        {
+            return;
+        }
+
+        VulkanCache::Store( file, &data[0], size );
+    }
+
     // Allocate CommandBuffer used to record compute commands
     bool DeviceVulkanw::InitializeVulkanResources()
     {
@@ -88,16 +182,22 @@ namespace Calc
             return false;
         }
 
-        m_command_buffer.reset( cmd_pool->alloc_primary_level_command_buffer() );
-
-        return nullptr != m_command_buffer;
+        return InitializeVulkanCommandBuffer( cmd_pool );
     }
 
     bool DeviceVulkanw::InitializeVulkanCommandBuffer(Anvil::CommandPool* cmd_pool)
     {
-        m_command_buffer.reset(cmd_pool->alloc_primary_level_command_buffer());
+        for (auto& command_buffer : m_command_buffers)
+        {
+            command_buffer.reset(cmd_pool->alloc_primary_level_command_buffer());
+
+            if (nullptr == command_buffer)
+            {
+                return false;
+            }
+        }
 
-        return nullptr != m_command_buffer;
+        return true;
     }
 
     // Return specification of the device
@@ -112,10 +212,14 @@ namespace Calc
 
         uint64_t localMemory = 0;
         uint64_t hostMemory = 0;
+        bool unifiedMemory = false;
 
         for (uint32_t i = 0; i < device->get_memory_properties().types.size(); ++i)
         {
             const Anvil::MemoryType& memoryType = device->get_memory_properties().types[i];
+            // Device local memory the host can map (APUs, resizable BAR)
+            unifiedMemory |= (memoryType.flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0 &&
+                             (memoryType.flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
             if (memoryType.flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)
             {
                 localMemory += memoryType.heap_ptr->size;
@@ -132,6 +236,14 @@ namespace Calc
         spec.min_alignment = static_cast< std::uint32_t >(device->get_device_properties().limits.minMemoryMapAlignment);
         spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
         spec.max_local_size = static_cast< std::size_t >(localMemory);
+        // Not exposed by Vulkan
+        spec.max_compute_units = 0;
+        spec.simd_width = 0;
+        spec.unified_memory = unifiedMemory;
+        // Shaders are compiled without build options, so there are no sub group variants to select
+        spec.subgroups = false;
+        // Queue index is ignored by command buffer recording
+        spec.max_num_queues = 1;
 
     }
 
@@ -148,6 +260,11 @@ namespace Calc
             throw ExceptionVk("Buffer size of 0 isn't valid" );
             return nullptr;
         }
+
+        if ( ( flags & kUseHostPtr ) != 0 )
+        {
+            throw ExceptionVk( "Buffers using host memory in place aren't supported" );
+        }
         const Anvil::QueueFamilyBits queueToUse = (true == m_use_compute_pipe) ?
                                                 Anvil::QUEUE_FAMILY_COMPUTE_BIT :
                                                 Anvil::QUEUE_FAMILY_GRAPHICS_BIT;
@@ -156,14 +273,22 @@ namespace Calc
                                                         , size
                                                         , queueToUse
                                                         , VK_SHARING_MODE_EXCLUSIVE
-                                                        , VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                                                        , VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                                          VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT
                                                         , true
-                                                        , false
+                                                        , ( flags & ( kPinned | kPersistent ) ) != 0
                                                         , initdata );
 
         return new BufferVulkan( newBuffer, false );
     }
 
+    Buffer* DeviceVulkanw::CreateSubBuffer( Buffer* buffer, std::size_t offset, std::size_t size )
+    {
+        // Descriptor sets bind whole Anvil buffers
+        throw ExceptionVk( "Sub-buffers aren't supported" );
+        return nullptr;
+    }
+
     void DeviceVulkanw::DeleteBuffer( Buffer* buffer )
     {
         if ( nullptr != buffer )
@@ -203,6 +328,85 @@ namespace Calc
         anvilBuffer->write( offset, size, src );
     }
 
+    void DeviceVulkanw::CopyBuffer( Buffer const* src, Buffer const* dst, std::uint32_t queue, std::size_t src_offset, std::size_t dst_offset, std::size_t size, Event** e )
+    {
+        BufferVulkan* buffers[] = { ConstCast<BufferVulkan>( src ), ConstCast<BufferVulkan>( dst ) };
+        const VkAccessFlags access[] = { VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT };
+
+        VkBufferCopy region;
+        region.srcOffset = src_offset;
+        region.dstOffset = dst_offset;
+        region.size = size;
+
+        RecordTransfer( buffers, access, 2, [&]( VkCommandBuffer command_buffer )
+        {
+            vkCmdCopyBuffer( command_buffer,
+                             buffers[ 0 ]->GetAnvilBuffer()->get_buffer(),
+                             buffers[ 1 ]->GetAnvilBuffer()->get_buffer(),
+                             1, &region );
+        }, e );
+    }
+
+    void DeviceVulkanw::FillBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t value, Event** e )
+    {
+        if ( ( offset | size ) % sizeof( std::uint32_t ) != 0 )
+        {
+            throw ExceptionVk( "Fill offset and size have to be multiples of 4" );
+        }
+
+        BufferVulkan* vulkan_buffer = ConstCast<BufferVulkan>( buffer );
+        const VkAccessFlags access = VK_ACCESS_TRANSFER_WRITE_BIT;
+
+        RecordTransfer( &vulkan_buffer, &access, 1, [&]( VkCommandBuffer command_buffer )
+        {
+            vkCmdFillBuffer( command_buffer, vulkan_buffer->GetAnvilBuffer()->get_buffer(), offset, size, value );
+        }, e );
+    }
+
+    void DeviceVulkanw::RecordTransfer( BufferVulkan* const* buffers, VkAccessFlags const* access, uint32_t num_buffers,
+                                        std::function<void( VkCommandBuffer )> const& record, Event** e )
+    {
+        // transfers are batched along with the dispatches, so they never stall on the host
+        if ( false == m_is_command_buffer_recording )
+        {
+            StartRecording();
+        }
+
+        Anvil::PrimaryCommandBuffer* command_buffer = GetCommandBuffer();
+
+        for ( uint32_t i = 0; i < num_buffers; ++i )
+        {
+            // previous commands of the batch might have written the buffer
+            Anvil::BufferBarrier bufferBarrier( VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+                                                access[ i ],
+                                                GetQueue()->get_queue_family_index(),
+                                                GetQueue()->get_queue_family_index(),
+                                                buffers[ i ]->GetAnvilBuffer(),
+                                                0,
+                                                buffers[ i ]->GetSize() );
+
+            command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                    VK_FALSE,
+                                                    0, nullptr,
+                                                    1, &bufferBarrier,
+                                                    0, nullptr );
+            buffers[ i ]->SetFenceId( GetFenceId() );
+        }
+
+        record( command_buffer->get_command_buffer() );
+
+        if ( nullptr != e )
+        {
+            *e = new EventVulkan( this );
+        }
+
+        if ( ++m_num_batched_dispatches >= MAX_BATCHED_DISPATCHES )
+        {
+            CommitCommandBuffer( false );
+        }
+    }
+
     // Buffer mapping 
     void DeviceVulkanw::MapBuffer(   Buffer const* buffer,
                                     std::uint32_t queue,
@@ -301,6 +505,11 @@ namespace Calc
     // Get queue, the execution of vulkan shaders can be done through the compute queue or the graphic queue
     Anvil::Queue* DeviceVulkanw::GetQueue() const
     {
+        if ( nullptr != m_queue )
+        {
+            return m_queue;
+        }
+
         Anvil::Queue* toReturn = (true == m_use_compute_pipe) ?
                                  m_anvil_device->get_compute_queue( 0 ) :
                                  m_anvil_device->get_universal_queue( 0 );
@@ -312,75 +521,178 @@ namespace Calc
     {
         Assert( false == m_is_command_buffer_recording );
 
+        // waits until the CommandBuffer of this fence is not used by the GPU anymore
         AllocNextFenceId();
         const auto fence = GetFence( m_cpu_fence_id );
         fence->reset();
 
         m_is_command_buffer_recording = true;
-        m_command_buffer->reset( false );
-        m_command_buffer->start_recording( true, false );
+        m_num_batched_dispatches = 0;
+        GetCommandBuffer()->reset( false );
+        GetCommandBuffer()->start_recording( true, false );
     }
 
-    // Finish recording
-    void DeviceVulkanw::EndRecording( bool in_wait_till_completed, Event** out_event )
+    // Execute CommandBuffer
+    void DeviceVulkanw::CommitCommandBuffer( bool in_wait_till_completed ) const
     {
+        const auto fence = GetFence( m_cpu_fence_id );
 
-        // execute CommandBuffer if either wait_till_completed
-        // TODO buffer n exec's per commit
-        CommitCommandBuffer( in_wait_till_completed );
+        m_is_command_buffer_recording = false;
+        GetCommandBuffer()->stop_recording();
 
-        if ( nullptr != out_event )
+        if ( m_wait_semaphores.empty() && nullptr == m_signal_semaphore )
         {
-            *out_event = new EventVulkan( this );
+            GetQueue()->submit_command_buffer( GetCommandBuffer(), in_wait_till_completed, fence );
         }
+        else
+        {
+            // application semaphores are consumed by this submission only
+            GetQueue()->submit_command_buffer_with_signal_wait_semaphores( GetCommandBuffer(),
+                                                                           nullptr != m_signal_semaphore ? 1 : 0,
+                                                                           &m_signal_semaphore,
+                                                                           static_cast<uint32_t>( m_wait_semaphores.size() ),
+                                                                           m_wait_semaphores.empty() ? nullptr : &m_wait_semaphores[0],
+                                                                           m_wait_stage_masks.empty() ? nullptr : &m_wait_stage_masks[0],
+                                                                           in_wait_till_completed,
+                                                                           fence );
+
+            m_wait_semaphores.clear();
+            m_wait_stage_masks.clear();
+            m_signal_semaphore = nullptr;
+        }
+
+        // the watcher may wait for the fence now
+        {
+            std::lock_guard<std::mutex> lock( m_fence_mutex );
+            m_submitted_fence_id = m_cpu_fence_id + 1;
+        }
+        m_fence_cv.notify_one();
     }
 
-    // Execute CommandBuffer
-    void DeviceVulkanw::CommitCommandBuffer( bool in_wait_till_completed )
+    // Batch of the fence has to be submitted before anyone can wait for it
+    void DeviceVulkanw::SubmitFence( uint64_t id ) const
     {
-        const auto fence = GetFence( m_cpu_fence_id );
-
-        m_is_command_buffer_recording = false;
-        m_command_buffer->stop_recording();
-
-        GetQueue()->submit_command_buffer( m_command_buffer.get(), in_wait_till_completed, fence );
+        if ( m_is_command_buffer_recording && id >= m_cpu_fence_id )
+        {
+            CommitCommandBuffer( false );
+        }
     }
 
     // Execution Not thread safe
     void DeviceVulkanw::Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e )
     {
-        FunctionVulkan* vulkan_function = ConstCast<FunctionVulkan>( func );
+        const uint32_t num_groups[3] = { (uint32_t)global_size, 1, 1 };
+        Dispatch( func, nullptr, 0, num_groups, e );
+    }
 
-        uint32_t number_of_parameters = (uint32_t)( vulkan_function->GetParameters().size() );
+    void DeviceVulkanw::Execute( Function const* func, std::uint32_t queue, std::uint32_t dims, size_t const* global_size, size_t const* local_size, Event** e )
+    {
+        Assert( dims >= 1 && dims <= 3 );
 
-        // get the Function's descriptor set group
-        Anvil::DescriptorSetGroup* new_descriptor_set = vulkan_function->GetDescriptorSetGroup();
+        uint32_t num_groups[3] = { 1, 1, 1 };
+        for ( uint32_t i = 0; i < dims; ++i )
+        {
+            num_groups[ i ] = (uint32_t)global_size[ i ];
+        }
+
+        Dispatch( func, nullptr, 0, num_groups, e );
+    }
+
+    void DeviceVulkanw::ExecuteIndirect( Function const* func, std::uint32_t queue, Buffer const* args, std::size_t offset, Event** e )
+    {
+        const uint32_t num_groups[3] = { 0, 0, 0 };
+        Dispatch( func, args, offset, num_groups, e );
+    }
+
+    FunctionVulkan::DescriptorSet& DeviceVulkanw::AcquireDescriptorSet( FunctionVulkan* func )
+    {
+        const std::vector<Buffer const*>& parameters = func->GetParameters();
+        const uint32_t number_of_parameters = (uint32_t)( parameters.size() );
+
+        std::vector<uint64_t> buffer_ids( number_of_parameters, 0 );
+        for ( uint32_t i = 0; i < number_of_parameters; ++i )
+        {
+            if ( false == func->IsPushConstant( i ) )
+            {
+                Assert( nullptr != parameters[ i ] );
+                buffer_ids[ i ] = ConstCast<BufferVulkan>( parameters[ i ] )->GetId();
+            }
+        }
+
+        std::vector<FunctionVulkan::DescriptorSet>& descriptor_sets = func->GetDescriptorSets();
+
+        // sets with the same buffers are already written and can be bound again, even by batches in flight
+        for ( auto&& descriptor_set : descriptor_sets )
+        {
+            if ( descriptor_set.buffer_ids == buffer_ids )
+            {
+                return descriptor_set;
+            }
+        }
+
+        // otherwise rewrite the least recently used set, unless it may still be read by a batch
+        FunctionVulkan::DescriptorSet* target = nullptr;
+        for ( auto&& descriptor_set : descriptor_sets )
+        {
+            if ( nullptr == target || descriptor_set.fence_id < target->fence_id )
+            {
+                target = &descriptor_set;
+            }
+        }
 
-        // if it's empty, this is 1st run of the Function so we have to create it
-        if ( nullptr == new_descriptor_set )
+        if ( nullptr == target || ( false == HasFenceBeenPassed( target->fence_id ) && descriptor_sets.size() < MAX_CACHED_DESCRIPTOR_SETS ) )
         {
-            // allocate it through Anvil
-            new_descriptor_set = new Anvil::DescriptorSetGroup( m_anvil_device, false, 1 );
+            // allocate a new one through Anvil
+            Anvil::DescriptorSetGroup* descriptor_set_group = new Anvil::DescriptorSetGroup( m_anvil_device, false, 1 );
 
-            // add bindings and items (Buffers) to the new DSG
+            // add bindings for the buffers, push constants don't take any
             for ( uint32_t i = 0; i < number_of_parameters; ++i )
             {
-                const Buffer* parameter = vulkan_function->GetParameters()[ i ];
-                BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
-                new_descriptor_set->add_binding( 0, i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT );
+                if ( false == func->IsPushConstant( i ) )
+                {
+                    descriptor_set_group->add_binding( 0, i, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT );
+                }
             }
 
-            // set it to the Function to be reused during any subsequent run
-            vulkan_function->SetDescriptorSetGroup( new_descriptor_set );
+            FunctionVulkan::DescriptorSet descriptor_set = { std::vector<uint64_t>(), descriptor_set_group, 0 };
+            descriptor_sets.push_back( descriptor_set );
+            target = &descriptor_sets.back();
+        }
+        else if ( false == HasFenceBeenPassed( target->fence_id ) )
+        {
+            // every set is in flight, wait for the oldest one
+            WaitForFence( target->fence_id );
         }
 
-        // bind new items (Buffers), releasing the old ones
+        // bind new items (Buffers)
         for ( uint32_t i = 0; i < number_of_parameters; ++i )
         {
-            const Buffer* parameter = vulkan_function->GetParameters()[ i ];
-            BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
-            new_descriptor_set->set_binding_item( 0, i, buffer->GetAnvilBuffer() );
+            if ( false == func->IsPushConstant( i ) )
+            {
+                BufferVulkan* buffer = ConstCast<BufferVulkan>( parameters[ i ] );
+                target->descriptor_set_group->set_binding_item( 0, i, buffer->GetAnvilBuffer() );
+            }
+        }
+
+        target->buffer_ids.swap( buffer_ids );
+
+        return *target;
+    }
 
+    void DeviceVulkanw::Dispatch( Function const* func, Buffer const* args, std::size_t offset, uint32_t const num_groups[3], Event** e )
+    {
+        FunctionVulkan* vulkan_function = ConstCast<FunctionVulkan>( func );
+
+        uint32_t number_of_parameters = (uint32_t)( vulkan_function->GetParameters().size() );
+
+        // find the descriptor set first, it might have to wait for the open batch
+        FunctionVulkan::DescriptorSet& descriptor_set_entry = AcquireDescriptorSet( vulkan_function );
+        Anvil::DescriptorSetGroup* new_descriptor_set = descriptor_set_entry.descriptor_set_group;
+
+        // indicate we'll be recording Vulkan commands to the CommandBuffer from now on
+        if ( false == m_is_command_buffer_recording )
+        {
+            StartRecording();
         }
 
         // get the Function's pipeline
@@ -392,24 +704,38 @@ namespace Calc
             // create the pipeline through Anvil with the shader module as a parameter
             m_anvil_device->get_compute_pipeline_manager()->add_regular_pipeline( false, false, vulkan_function->GetFunctionEntryPoint(), &pipeline_id );
 
-            // attach the DSG to it
+            // attach the DSG to it, every cached DSG of the Function has the same layout
             m_anvil_device->get_compute_pipeline_manager()->attach_dsg_to_pipeline( pipeline_id, new_descriptor_set );
 
+            // scalar arguments take a single push constant range
+            if ( vulkan_function->GetPushConstantsSize() > 0 )
+            {
+                m_anvil_device->get_compute_pipeline_manager()->attach_push_constant_range_to_pipeline( pipeline_id, 0, vulkan_function->GetPushConstantsSize(), VK_SHADER_STAGE_COMPUTE_BIT );
+            }
+
             // remember the pipeline for any seubsequent run
             vulkan_function->SetPipelineID( pipeline_id );
         }
 
-        // indicate we'll be recording Vulkan commands to the CommandBuffer from now on
-        StartRecording();
+        Anvil::PrimaryCommandBuffer* command_buffer = GetCommandBuffer();
+
+        // profiled dispatches are enclosed by a pair of timestamps
+        int timestamp_pair = -1;
+        if ( m_profiling && nullptr != e )
+        {
+            timestamp_pair = static_cast<int>( m_next_timestamp_pair++ % MAX_TIMESTAMP_PAIRS );
+            vkCmdResetQueryPool( command_buffer->get_command_buffer(), m_timestamp_pool, 2 * timestamp_pair, 2 );
+            vkCmdWriteTimestamp( command_buffer->get_command_buffer(), VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_timestamp_pool, 2 * timestamp_pair );
+        }
 
         // attach pipeline
-        m_command_buffer->record_bind_pipeline( VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_id );
+        command_buffer->record_bind_pipeline( VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_id );
 
         Anvil::PipelineLayout* pipeline_layout = m_anvil_device->get_compute_pipeline_manager()->get_compute_pipeline_layout( pipeline_id );
         Anvil::DescriptorSet* descriptor_set = new_descriptor_set->get_descriptor_set( 0 );
 
         // attach layout and 0 descriptor set (we don't use any other set currently)
-        m_command_buffer->record_bind_descriptor_sets( VK_PIPELINE_BIND_POINT_COMPUTE,
+        command_buffer->record_bind_descriptor_sets( VK_PIPELINE_BIND_POINT_COMPUTE,
                                                     pipeline_layout,
                                                     0,
                                                     1,
@@ -417,13 +743,29 @@ namespace Calc
                                                     0,
                                                     nullptr );
 
+        // push constants are recorded by value, so they can change before the next dispatch
+        if ( vulkan_function->GetPushConstantsSize() > 0 )
+        {
+            command_buffer->record_push_constants( pipeline_layout,
+                                                   VK_SHADER_STAGE_COMPUTE_BIT,
+                                                   0,
+                                                   vulkan_function->GetPushConstantsSize(),
+                                                   vulkan_function->GetPushConstants() );
+        }
+
         // set memory barriers 
         for ( uint32_t i = 0; i < number_of_parameters; ++i )
         {
+            if ( vulkan_function->IsPushConstant( i ) )
+            {
+                continue;
+            }
+
             const Buffer* parameter = vulkan_function->GetParameters()[ i ];
             BufferVulkan* buffer = ConstCast<BufferVulkan>( parameter );
 
-            Anvil::BufferBarrier bufferBarrier( VK_ACCESS_HOST_WRITE_BIT,
+            // previous dispatches of the batch might have written the buffer as well
+            Anvil::BufferBarrier bufferBarrier( VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
                                                 VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
                                                 GetQueue()->get_queue_family_index(),
                                                 GetQueue()->get_queue_family_index(),
@@ -431,7 +773,7 @@ namespace Calc
                                                 0,
                                                 buffer->GetSize() );
 
-            m_command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
                                                     VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
                                                     VK_FALSE,
                                                     0, nullptr,
@@ -443,10 +785,52 @@ namespace Calc
         }
 
         // dispatch the Function's shader module
-        m_command_buffer->record_dispatch( (uint32_t)global_size, 1, 1 );
+        if ( nullptr != args )
+        {
+            BufferVulkan* args_buffer = ConstCast<BufferVulkan>( args );
+
+            // group counts are usually written by a previous dispatch of the batch
+            Anvil::BufferBarrier argsBarrier( VK_ACCESS_HOST_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+                                              VK_ACCESS_INDIRECT_COMMAND_READ_BIT,
+                                              GetQueue()->get_queue_family_index(),
+                                              GetQueue()->get_queue_family_index(),
+                                              args_buffer->GetAnvilBuffer(),
+                                              0,
+                                              args_buffer->GetSize() );
+
+            command_buffer->record_pipeline_barrier( VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                                                    VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT,
+                                                    VK_FALSE,
+                                                    0, nullptr,
+                                                    1, &argsBarrier,
+                                                    0, nullptr );
+            args_buffer->SetFenceId( GetFenceId() );
 
-        // end recording
-        EndRecording( false, e );
+            command_buffer->record_dispatch_indirect( args_buffer->GetAnvilBuffer(), offset );
+        }
+        else
+        {
+            command_buffer->record_dispatch( num_groups[ 0 ], num_groups[ 1 ], num_groups[ 2 ] );
+        }
+
+        if ( timestamp_pair >= 0 )
+        {
+            vkCmdWriteTimestamp( command_buffer->get_command_buffer(), VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_timestamp_pool, 2 * timestamp_pair + 1 );
+        }
+
+        vulkan_function->SetFenceId( GetFenceId() );
+        descriptor_set_entry.fence_id = GetFenceId();
+
+        if ( nullptr != e )
+        {
+            *e = new EventVulkan( this, timestamp_pair );
+        }
+
+        // long batches are submitted to keep the GPU busy meanwhile
+        if ( ++m_num_batched_dispatches >= MAX_BATCHED_DISPATCHES )
+        {
+            CommitCommandBuffer( false );
+        }
 
         // remove references to buffers. they were already referenced by the CommandBuffer.
         vulkan_function->UnreferenceParametersBuffers();
@@ -471,6 +855,33 @@ namespace Calc
         }
     }
 
+    // Batches complete in submission order, so the event of the oldest fence completes first
+    std::size_t DeviceVulkanw::WaitForAnyEvent( Event** e, std::size_t num_events )
+    {
+        if ( 0 == num_events )
+        {
+            throw ExceptionVk( "No events to wait for" );
+        }
+
+        std::size_t first = 0;
+        for ( std::size_t i = 1; i < num_events; ++i )
+        {
+            if ( static_cast<EventVulkan*>( e[i] )->GetFenceId() < static_cast<EventVulkan*>( e[first] )->GetFenceId() )
+            {
+                first = i;
+            }
+        }
+
+        e[first]->Wait();
+        return first;
+    }
+
+    void DeviceVulkanw::EnqueueWaitForEvent( std::uint32_t queue, Event* e )
+    {
+        // Batches are submitted to a single queue and every dispatch starts with
+        // a barrier, so later work already waits for the event
+    }
+
     void DeviceVulkanw::DeleteEvent( Event* e )
     {
         if ( nullptr != e )
@@ -480,19 +891,17 @@ namespace Calc
     }
 
     // Queue management functions
+    // Submit the open batch
     void DeviceVulkanw::Flush( std::uint32_t queue )
     {
-        if(false == m_is_command_buffer_recording)
-        {
-            StartRecording();
-        }
-        EndRecording(true, nullptr);
+        SubmitFence( m_cpu_fence_id );
     }
 
+    // Submit the open batch and wait for all the submitted work
     void DeviceVulkanw::Finish( std::uint32_t queue )
     {
-        // TODO work out semantics of these two
-        Flush(queue);
+        Flush( queue );
+        WaitForFence( m_cpu_fence_id );
     }
 
     bool DeviceVulkanw::HasBuiltinPrimitives() const
@@ -512,6 +921,69 @@ namespace Calc
         VK_EMPTY_IMPLEMENTATION;
     }
 
+    // The open batch is submitted first, so the wait only applies to later work
+    void DeviceVulkanw::WaitSemaphore( Anvil::Semaphore* semaphore, std::uint32_t stage_mask )
+    {
+        Flush( 0 );
+
+        m_wait_semaphores.push_back( semaphore );
+        m_wait_stage_masks.push_back( static_cast<VkPipelineStageFlags>( stage_mask ) );
+    }
+
+    // Submit the open batch, or an empty one if there is nothing recorded, signalling the semaphore
+    void DeviceVulkanw::SignalSemaphore( Anvil::Semaphore* semaphore )
+    {
+        if ( false == m_is_command_buffer_recording )
+        {
+            StartRecording();
+        }
+
+        m_signal_semaphore = semaphore;
+        CommitCommandBuffer( false );
+    }
+
+    void DeviceVulkanw::SetProfilingEnabled( bool enabled )
+    {
+        if ( enabled && VK_NULL_HANDLE == m_timestamp_pool )
+        {
+            const VkPhysicalDeviceProperties& properties = m_anvil_device->get_physical_device()->get_device_properties();
+            if ( VK_FALSE == properties.limits.timestampComputeAndGraphics )
+            {
+                throw ExceptionVk( "Device does not support timestamps on compute queues" );
+            }
+
+            VkQueryPoolCreateInfo info = {};
+            info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            info.queryCount = 2 * MAX_TIMESTAMP_PAIRS;
+
+            if ( VK_SUCCESS != vkCreateQueryPool( m_anvil_device->get_device_vk(), &info, nullptr, &m_timestamp_pool ) )
+            {
+                throw ExceptionVk( "Failed to create timestamp query pool" );
+            }
+        }
+
+        m_profiling = enabled;
+    }
+
+    float DeviceVulkanw::GetTimestampDuration( uint32_t pair ) const
+    {
+        uint64_t timestamps[2] = { 0, 0 };
+
+        VkResult result = vkGetQueryPoolResults( m_anvil_device->get_device_vk(), m_timestamp_pool, 2 * pair, 2,
+                                                 sizeof( timestamps ), timestamps, sizeof( uint64_t ),
+                                                 VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT );
+
+        if ( VK_SUCCESS != result )
+        {
+            throw ExceptionVk( "Failed to read timestamps" );
+        }
+
+        // timestamp period is in nanoseconds per tick
+        const float period = m_anvil_device->get_physical_device()->get_device_properties().limits.timestampPeriod;
+        return static_cast<float>( timestamps[1] - timestamps[0] ) * period * 1e-6f;
+    }
+
     uint64_t DeviceVulkanw::AllocNextFenceId() {
         // stall if we have run out of fences to use
         while( m_cpu_fence_id >= m_gpu_known_fence_id + NUM_FENCE_TRACKERS)
@@ -527,14 +999,116 @@ namespace Calc
         AssertEx( id < m_gpu_known_fence_id + NUM_FENCE_TRACKERS,
                 "CPU too far ahead of GPU" );
 
+        SubmitFence( id );
+
+        bool advanced = false;
         while(HasFenceBeenPassed(id) == false ) {
+            uint64_t known = m_gpu_known_fence_id;
             vkWaitForFences(m_anvil_device->get_device_vk(), 1,
-                            GetFence(m_gpu_known_fence_id)->get_fence_ptr(),
+                            GetFence(known)->get_fence_ptr(),
                             VK_TRUE,
                             UINT64_MAX);
 
-            // don't known id update until wait has finished
-            m_gpu_known_fence_id++;
+            // don't known id update until wait has finished, the watcher might have done it meanwhile
+            m_gpu_known_fence_id.compare_exchange_strong( known, known + 1 );
+            advanced = true;
+        }
+
+        if ( advanced )
+        {
+            NotifyFenceWatcher();
+        }
+    }
+
+    void DeviceVulkanw::AddFenceCallback( uint64_t id, Event::CompletionCallback callback, void* data ) const
+    {
+        SubmitFence( id );
+
+        {
+            std::lock_guard<std::mutex> lock( m_fence_mutex );
+            if ( !HasFenceBeenPassed( id ) )
+            {
+                m_fence_callbacks.push_back( FenceCallback{ id, callback, data } );
+
+                if ( !m_fence_watcher.joinable() )
+                {
+                    m_fence_watcher = std::thread( &DeviceVulkanw::WatchFences, this );
+                }
+
+                callback = nullptr;
+            }
+        }
+
+        if ( nullptr == callback )
+        {
+            m_fence_cv.notify_one();
+        }
+        else
+        {
+            callback( data );
+        }
+    }
+
+    void DeviceVulkanw::NotifyFenceWatcher() const
+    {
+        // taking the lock orders the advance before the watcher checks its callbacks
+        {
+            std::lock_guard<std::mutex> lock( m_fence_mutex );
+            if ( m_fence_callbacks.empty() )
+            {
+                return;
+            }
+        }
+        m_fence_cv.notify_one();
+    }
+
+    void DeviceVulkanw::WatchFences() const
+    {
+        // the watched fence may be reset for reuse once the known id moved past it, so waits are bounded
+        const uint64_t kWaitTimeoutNs = 1000000;
+
+        std::unique_lock<std::mutex> lock( m_fence_mutex );
+
+        for (;;)
+        {
+            auto pending = std::partition( m_fence_callbacks.begin(), m_fence_callbacks.end(),
+                                           [this]( FenceCallback const& c ) { return !HasFenceBeenPassed( c.id ); } );
+
+            if ( pending != m_fence_callbacks.end() )
+            {
+                std::vector<FenceCallback> ready( pending, m_fence_callbacks.end() );
+                m_fence_callbacks.erase( pending, m_fence_callbacks.end() );
+
+                lock.unlock();
+                for ( auto const& c : ready )
+                {
+                    c.callback( c.data );
+                }
+                lock.lock();
+                continue;
+            }
+
+            if ( m_stop_fence_watcher )
+            {
+                return;
+            }
+
+            uint64_t known = m_gpu_known_fence_id;
+            if ( m_fence_callbacks.empty() || known >= m_submitted_fence_id )
+            {
+                m_fence_cv.wait( lock );
+                continue;
+            }
+
+            lock.unlock();
+            if ( VK_SUCCESS == vkWaitForFences( m_anvil_device->get_device_vk(), 1,
+                                                GetFence( known )->get_fence_ptr(),
+                                                VK_TRUE,
+                                                kWaitTimeoutNs ) )
+            {
+                m_gpu_known_fence_id.compare_exchange_strong( known, known + 1 );
+            }
+            lock.lock();
         }
     }
 
@@ -22,12 +22,19 @@ THE SOFTWARE.
 #pragma once
 
 #include "device.h"
+#include "event.h"
 #include "wrappers/command_buffer.h"
 #include "wrappers/device.h"
 #include "wrappers/fence.h"
 #include <atomic>
 #include <array>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include <device_vk.h>
 
 
@@ -42,8 +49,14 @@ namespace Calc
     {
     public:
         static const unsigned int NUM_FENCE_TRACKERS = 16;
-
-        DeviceVulkanw( Anvil::Device* inDevice, bool in_use_compute_pipe );
+        // Dispatches recorded into a command buffer before it is submitted without waiting for a sync point
+        static const unsigned int MAX_BATCHED_DISPATCHES = 64;
+        // Timestamp pairs of profiled dispatches, reused round robin
+        static const unsigned int MAX_TIMESTAMP_PAIRS = 1024;
+        // Descriptor set groups a Function keeps for different sets of bound buffers
+        static const unsigned int MAX_CACHED_DESCRIPTOR_SETS = 16;
+
+        DeviceVulkanw( Anvil::Device* inDevice, bool in_use_compute_pipe, Anvil::Queue* in_queue = nullptr );
         ~DeviceVulkanw();
 
         // Return specification of the device
@@ -52,11 +65,14 @@ namespace Calc
         // Buffer creation and deletion
         Buffer* CreateBuffer( std::size_t size, std::uint32_t flags ) override;
         Buffer* CreateBuffer( std::size_t size, std::uint32_t flags, void* initdata ) override;
+        Buffer* CreateSubBuffer( Buffer* buffer, std::size_t offset, std::size_t size ) override;
         void DeleteBuffer( Buffer* buffer ) override;
 
         // Data movement
         void ReadBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* dst, Event** e ) const override;
         void WriteBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, void* src, Event** e ) override;
+        void CopyBuffer( Buffer const* src, Buffer const* dst, std::uint32_t queue, std::size_t src_offset, std::size_t dst_offset, std::size_t size, Event** e ) override;
+        void FillBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t value, Event** e ) override;
 
         // Buffer mapping 
         void MapBuffer( Buffer const* buffer, std::uint32_t queue, std::size_t offset, std::size_t size, std::uint32_t map_type, void** mapdata, Event** e ) override;
@@ -77,25 +93,39 @@ namespace Calc
 
         // Execution
         void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e ) override;
+        void Execute( Function const* func, std::uint32_t queue, std::uint32_t dims, size_t const* global_size, size_t const* local_size, Event** e ) override;
+        void ExecuteIndirect( Function const* func, std::uint32_t queue, Buffer const* args, std::size_t offset, Event** e ) override;
 
         // Events handling
         void WaitForEvent( Event* e ) override;
         void WaitForMultipleEvents( Event** e, std::size_t num_events ) override;
+        std::size_t WaitForAnyEvent( Event** e, std::size_t num_events ) override;
+        void EnqueueWaitForEvent( std::uint32_t queue, Event* e ) override;
         void DeleteEvent( Event* e ) override;
 
         // Queue management functions
         void Flush( std::uint32_t queue ) override;
         void Finish( std::uint32_t queue ) override;
 
+        // Profiling
+        void SetProfilingEnabled( bool enabled ) override;
+        // GPU time in milliseconds between the timestamps of a profiled dispatch
+        float GetTimestampDuration( uint32_t pair ) const;
+
         // Parallel prims handling
         bool HasBuiltinPrimitives() const override;
         Primitives* CreatePrimitives() const override;
         void DeletePrimitives( Primitives* prims ) override;
 
+        // Semaphores shared with the application
+        void WaitSemaphore( Anvil::Semaphore* semaphore, std::uint32_t stage_mask ) override;
+        void SignalSemaphore( Anvil::Semaphore* semaphore ) override;
+
         bool InitializeVulkanResources();
         bool InitializeVulkanCommandBuffer(Anvil::CommandPool* cmd_pool);
         
-        Anvil::PrimaryCommandBuffer* GetCommandBuffer() const { return m_command_buffer.get(); }
+        // CommandBuffer of the batch being recorded
+        Anvil::PrimaryCommandBuffer* GetCommandBuffer() const { return m_command_buffers[m_cpu_fence_id % NUM_FENCE_TRACKERS].get(); }
 
         // Return platform to allow running together with OpenCL
         Platform GetPlatform() const override { return Platform::kVulkan; }
@@ -109,37 +139,99 @@ namespace Calc
 
         void WaitForFence( uint64_t id ) const;
 
+        // Call callback with data once the fence has been passed, right away if it already has.
+        // The batch of the fence is submitted and a watcher thread waits for it.
+        void AddFenceCallback( uint64_t id, Event::CompletionCallback callback, void* data ) const;
+
     private:
         typedef std::unique_ptr<Anvil::PrimaryCommandBuffer, Anvil::CommandBufferDeleter> PrimaryCommandBuffer;
         typedef std::array<std::unique_ptr<Anvil::Fence, Anvil::FenceDeleter>, NUM_FENCE_TRACKERS> FenceArray;
+        typedef std::array<PrimaryCommandBuffer, NUM_FENCE_TRACKERS> CommandBufferArray;
 
         uint64_t AllocNextFenceId();
 
-        // Managing CommandBuffer to record Vulkan commands
+        // Record a dispatch of num_groups groups or of the group counts in args if it is not null
+        void Dispatch( Function const* func, Buffer const* args, std::size_t offset, uint32_t const num_groups[3], Event** e );
+
+        // Descriptor set group binding the current buffers of the Function, only written when none of the cached ones matches
+        FunctionVulkan::DescriptorSet& AcquireDescriptorSet( FunctionVulkan* func );
+
+        // Record a transfer command into the open batch, after a barrier on each of its buffers
+        void RecordTransfer( BufferVulkan* const* buffers, VkAccessFlags const* access, uint32_t num_buffers,
+                             std::function<void( VkCommandBuffer )> const& record, Event** e );
+
+        // Managing CommandBuffer to record Vulkan commands. Dispatches are batched
+        // into the open CommandBuffer until a sync point needs its results.
         void StartRecording();
-        void EndRecording( bool in_wait_till_completed, Event** out_event );
-        void CommitCommandBuffer( bool in_wait_till_completed );
+        void CommitCommandBuffer( bool in_wait_till_completed ) const;
+        // Submit the open batch if fence id refers to it
+        void SubmitFence( uint64_t id ) const;
 
         Anvil::Fence* GetFence( uint64_t id ) const { return m_anvil_fences[id%NUM_FENCE_TRACKERS].get(); }
 
         Anvil::Queue* GetQueue() const;
 
+        // Callback waiting for its fence to be passed
+        struct FenceCallback
+        {
+            uint64_t id;
+            Event::CompletionCallback callback;
+            void* data;
+        };
+
+        // Body of the watcher thread, waits for submitted fences while callbacks are pending
+        void WatchFences() const;
+        // Wake the watcher after the known fence id has been advanced
+        void NotifyFenceWatcher() const;
+
+        // Persisted pipeline cache management
+        std::string GetPipelineCacheFile() const;
+        void LoadPipelineCache();
+        void StorePipelineCache();
+
         // Anvil device
         Anvil::Device* m_anvil_device;
 
-        // Main CommandBuffer to record Vulkan commands
-        PrimaryCommandBuffer m_command_buffer;
+        // CommandBuffers to record Vulkan commands, one per fence so a batch is
+        // only reset once its previous submission has completed
+        CommandBufferArray m_command_buffers;
 
         // To indicate whether recording is already in progress
-        bool m_is_command_buffer_recording;
+        mutable bool m_is_command_buffer_recording;
+        // Number of dispatches recorded into the open batch
+        mutable uint32_t m_num_batched_dispatches;
 
         // Whether to use compute pipe
         bool m_use_compute_pipe;
 
+        // Application queue to submit to, device queue is used if null
+        Anvil::Queue* m_queue;
+
+        // Semaphores the next submission waits for and signals
+        mutable std::vector<Anvil::Semaphore*> m_wait_semaphores;
+        mutable std::vector<VkPipelineStageFlags> m_wait_stage_masks;
+        mutable Anvil::Semaphore* m_signal_semaphore;
+
         // Fences for synchronization
         FenceArray    m_anvil_fences;
         std::atomic<uint64_t> m_cpu_fence_id;
         mutable std::atomic<uint64_t> m_gpu_known_fence_id;
+        // Fences below the id belong to submitted batches
+        mutable std::atomic<uint64_t> m_submitted_fence_id;
+
+        // Fence watcher, started by the first callback
+        mutable std::mutex m_fence_mutex;
+        mutable std::condition_variable m_fence_cv;
+        mutable std::vector<FenceCallback> m_fence_callbacks;
+        mutable std::thread m_fence_watcher;
+        mutable bool m_stop_fence_watcher;
+
+        // Dispatches with events write timestamps when profiling is enabled
+        bool m_profiling;
+        // Timestamp query pool, created when profiling is enabled for the first time
+        VkQueryPool m_timestamp_pool;
+        // Next timestamp pair to write
+        uint32_t m_next_timestamp_pair;
 
     };
 
@@ -22,6 +22,7 @@ THE SOFTWARE.
 #pragma once
 
 #include "device_vkw.h"
+#include "except_vk.h"
 #include "wrappers/event.h"
 
 namespace Calc {
@@ -31,8 +32,10 @@ namespace Calc {
     class EventVulkan : public Event
     {
     public:
-        EventVulkan( const DeviceVulkanw* in_device ) :
+        // timestamp_pair is the timestamp query pair of a profiled dispatch or -1
+        EventVulkan( const DeviceVulkanw* in_device, int timestamp_pair = -1 ) :
                 m_device( in_device )
+                , m_timestamp_pair( timestamp_pair )
         {
             m_event_fence = m_device->GetFenceId();
         }
@@ -53,8 +56,29 @@ namespace Calc {
             Assert( nullptr != m_device );
             return m_device->HasFenceBeenPassed(m_event_fence);
         }
+
+        float GetDuration() const override
+        {
+            Assert( nullptr != m_device );
+            if ( m_timestamp_pair < 0 )
+            {
+                throw ExceptionVk( "Event has no timestamps, profiling was not enabled for the command" );
+            }
+
+            m_device->WaitForFence(m_event_fence);
+            return m_device->GetTimestampDuration( static_cast<uint32_t>( m_timestamp_pair ) );
+        }
+
+        void SetCompletionCallback( CompletionCallback callback, void* data ) override
+        {
+            Assert( nullptr != m_device );
+            m_device->AddFenceCallback( m_event_fence, callback, data );
+        }
+
+        uint64_t GetFenceId() const { return m_event_fence; }
     private:
         const DeviceVulkanw* m_device;
         std::atomic<uint64_t>           m_event_fence;
+        int m_timestamp_pair;
     };
 }
@@ -24,6 +24,10 @@ THE SOFTWARE.
 //#define DUMP_SPIRV_BLOB
 
 #include "function_vk.h"
+#include "cache_vk.h"
+#include <fstream>
+#include <iterator>
+#include <vector>
 namespace Calc {
 
 
@@ -70,6 +74,26 @@ namespace Calc {
         // useful whilst developing, not currently used
         Function *CreateFunction(char const *name, const std::map<const std::string, const std::string>& defines ) {
 
+            // SPIR-V blobs are looked up in the binary cache first, the file
+            // names match the ones written by Tools/scripts/compile_spirv.py
+            define_table all_defines = m_defines;
+            for (auto &&item : defines) {
+                all_defines[item.first] = item.second;
+            }
+
+            std::string cache_file = VulkanCache::GetFile(std::string(name) + "_",
+                                                          VulkanCache::GetShaderKey(GetSourceCode(), name, all_defines),
+                                                          ".spv");
+
+            std::vector<char> spirv;
+            if (VulkanCache::Load(cache_file, spirv) && spirv.size() % sizeof(std::uint32_t) == 0) {
+                Anvil::ShaderModule *shaderModule = new Anvil::ShaderModule(
+                        m_device, &spirv[0], static_cast<uint32_t>(spirv.size()),
+                        "main", "", "", "", "", "");
+
+                return WrapShaderModule(shaderModule);
+            }
+
             Anvil::GLSLShaderToSPIRVGenerator toSPIRVConverter(    m_device->get_physical_device(),
                                                                 m_source_mode,
                                                                 m_file_name_or_source_code,
@@ -99,9 +123,23 @@ namespace Calc {
 #endif
 
 
+            VulkanCache::Store(cache_file,
+                               reinterpret_cast<char const *>(toSPIRVConverter.get_spirv_blob()),
+                               toSPIRVConverter.get_spirv_blob_size());
+
             Anvil::ShaderModule *shaderModule = new Anvil::ShaderModule(
                     m_device, toSPIRVConverter);
 
+            return WrapShaderModule(shaderModule);
+        }
+
+        void DeleteFunction(Function *func) {
+            delete func;
+        }
+
+    private:
+        // Wrap compiled shader module into a function
+        Function *WrapShaderModule(Anvil::ShaderModule *shaderModule) {
             Anvil::ShaderModuleStageEntryPoint functionEntryPoint = Anvil::ShaderModuleStageEntryPoint(
                     "main", shaderModule, Anvil::SHADER_STAGE_COMPUTE);
 
@@ -113,16 +151,26 @@ namespace Calc {
             );
         }
 
-        void DeleteFunction(Function *func) {
-            delete func;
+        // Source code text, loaded from disk in file mode
+        std::string const &GetSourceCode() {
+            if (m_source_mode == Anvil::GLSLShaderToSPIRVGenerator::MODE_USE_SPECIFIED_SOURCE) {
+                return m_file_name_or_source_code;
+            }
+
+            if (m_file_source_code.empty()) {
+                std::ifstream in(m_file_name_or_source_code, std::ios::in | std::ios::binary);
+                m_file_source_code.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            }
+
+            return m_file_source_code;
         }
 
-    private:
         Anvil::Device *m_device;
         std::string m_file_name_or_source_code;
         Anvil::GLSLShaderToSPIRVGenerator::Mode m_source_mode;
         typedef std::map<std::string, std::string> define_table;
         define_table m_defines;
+        std::string m_file_source_code;
         bool m_use_compute_pipe;
     };
 }
\ No newline at end of file
@@ -20,12 +20,27 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #pragma once
+#pragma once
+
+#include <cstring>
 
 namespace Calc {
 
     // Class that represent Vulkan implementation of a Function
     class FunctionVulkan : public Function {
     public:
+        // Push constant space every Vulkan implementation provides
+        static const uint32_t MAX_PUSH_CONSTANTS_SIZE = 128;
+
+        // Descriptor set group bound with a set of buffers, reused as long as the same buffers are bound
+        struct DescriptorSet {
+            // ids of the bound buffers, 0 for arguments passed as push constants
+            std::vector<uint64_t> buffer_ids;
+            Anvil::DescriptorSetGroup *descriptor_set_group;
+            // fence of the batch the set has been last dispatched in
+            uint64_t fence_id;
+        };
+
         FunctionVulkan(Anvil::Device *in_anvil_device,
                        const Anvil::ShaderModuleStageEntryPoint &in_function_entry_point,
                        Anvil::ShaderModule *in_shader_module,
@@ -37,7 +52,8 @@ namespace Calc {
                 : Function(), m_anvil_device(in_anvil_device),
                   m_function_entry_point(in_function_entry_point),
                   m_shader_module(in_shader_module), m_parameters(),
-                  m_descriptor_set_group(nullptr), m_pipeline_id(~0u),
+                  m_push_constant_offsets(), m_push_constants(), m_push_constants_size(0),
+                  m_descriptor_sets(), m_pipeline_id(~0u), m_fence_id(0),
                   m_use_compute_pipe(in_use_compute_pipe)
 #if _DEBUG
         , FileName( in_file_name )
@@ -59,67 +75,57 @@ namespace Calc {
                 m_pipeline_id = ~0u;
             }
 
-            // release a descriptor set group
-            if (nullptr != m_descriptor_set_group) {
-                m_descriptor_set_group->release();
-                m_descriptor_set_group = nullptr;
+            // release descriptor set groups
+            for (auto &&descriptor_set : m_descriptor_sets) {
+                descriptor_set.descriptor_set_group->release();
             }
+            m_descriptor_sets.clear();
 
             // release spirv shader module
             m_shader_module->release();
-
-            // release all internally created buffers
-            for (auto i = 0U; i < m_parameters.size(); ++i) {
-                const Buffer *localBuffer = m_parameters[i];
-
-                if (nullptr != localBuffer) {
-                    BufferVulkan *vulkanBuffer = const_cast<BufferVulkan *>( Cast<const BufferVulkan, const Buffer>(
-                            localBuffer));
-                    if (true == vulkanBuffer->GetIsCreatedInternally()) {
-                        delete vulkanBuffer;
-                    }
-                }
-            }
         }
 
         // Argument setters
+        // single values/vectors are passed as push constants, packed in the order of their arguments
         void SetArg(std::uint32_t idx, std::size_t arg_size, void *arg) {
-            const Anvil::QueueFamilyBits queueToUse =
-                    true == m_use_compute_pipe ? Anvil::QUEUE_FAMILY_COMPUTE_BIT
-                                               : Anvil::QUEUE_FAMILY_GRAPHICS_BIT;
-            // for single values/vector an additional (internal) buffer has to be created
-            Anvil::Buffer *newBuffer = new Anvil::Buffer(m_anvil_device,
-                                                         arg_size, queueToUse,
-                                                         VK_SHARING_MODE_EXCLUSIVE,
-                                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                                         true, true, arg);
-
-            BufferVulkan *vBuffer = new BufferVulkan(newBuffer, true);
-
-            // set it up as a normal buffer
-            SetArg(idx, vBuffer);
-        }
+            if (idx >= m_parameters.size()) {
+                Assert(idx == m_parameters.size());
+                m_parameters.resize(idx + 1, nullptr);
+                m_push_constant_offsets.resize(idx + 1, ~0u);
+            }
 
-        void SetArg(std::uint32_t idx, Buffer const *arg) {
-            // release previously attached internal buffers
-            if (idx < m_parameters.size()) {
-                const Buffer *localBuffer = m_parameters[idx];
-                if (nullptr != localBuffer) {
-                    BufferVulkan *vulkanBuffer = const_cast<BufferVulkan *>( Cast<const BufferVulkan, const Buffer>(
-                            localBuffer));
-                    Assert(true == vulkanBuffer->GetIsCreatedInternally());
-                    if (true == vulkanBuffer->GetIsCreatedInternally()) {
-                        delete vulkanBuffer;
-                    }
+            uint32_t offset = m_push_constant_offsets[idx];
+
+            // 1st time the argument is set, append it to the push constants
+            if (~0u == offset) {
+                // Assert instead of moving arguments, the pipeline layout is fixed once created
+                Assert(~0u == m_pipeline_id);
+
+                // std430 alignment of scalars and vectors
+                uint32_t alignment = arg_size >= 16 ? 16 : (arg_size >= 8 ? 8 : 4);
+                offset = (m_push_constants_size + alignment - 1) & ~(alignment - 1);
+
+                if (offset + arg_size > MAX_PUSH_CONSTANTS_SIZE) {
+                    throw ExceptionVk("Arguments exceed the push constant space");
                 }
 
-                m_parameters[idx] = arg;
+                m_push_constant_offsets[idx] = offset;
+                m_push_constants_size = offset + static_cast<uint32_t>(arg_size);
             }
 
-            else {
+            memcpy(&m_push_constants[offset], arg, arg_size);
+            m_parameters[idx] = nullptr;
+        }
+
+        void SetArg(std::uint32_t idx, Buffer const *arg) {
+            if (idx >= m_parameters.size()) {
                 Assert(idx == m_parameters.size());
-                m_parameters.push_back(arg);
+                m_parameters.resize(idx + 1, nullptr);
+                m_push_constant_offsets.resize(idx + 1, ~0u);
             }
+
+            Assert(~0u == m_push_constant_offsets[idx]);
+            m_parameters[idx] = arg;
         }
 
         void SetArg(std::uint32_t idx, std::size_t size, SharedMemory shmem) {
@@ -128,46 +134,54 @@ namespace Calc {
 
         // release references to the parameter buffers.
         void UnreferenceParametersBuffers() {
-            // release all internally created buffers
             for (auto i = 0U; i < m_parameters.size(); ++i) {
-                const Buffer *localBuffer = m_parameters[i];
-                Assert(nullptr != localBuffer);
-                BufferVulkan *vulkanBuffer = ConstCast<BufferVulkan>( localBuffer );
-                if (false == vulkanBuffer->GetIsCreatedInternally()) {
-                    m_parameters[i] = nullptr;
-                }
+                m_parameters[i] = nullptr;
             }
         }
 
         // setters/getters
         const Anvil::ShaderModuleStageEntryPoint &GetFunctionEntryPoint() const { return m_function_entry_point; }
 
+        // bound buffers, null for arguments passed as push constants
         const std::vector<Buffer const *> &GetParameters() const { return m_parameters; }
 
-        Anvil::DescriptorSetGroup *GetDescriptorSetGroup() const { return m_descriptor_set_group; }
+        bool IsPushConstant(uint32_t idx) const { return ~0u != m_push_constant_offsets[idx]; }
 
-        void SetDescriptorSetGroup(
-                Anvil::DescriptorSetGroup *in_new_descriptor_set_group) {
-            m_descriptor_set_group = in_new_descriptor_set_group;
-        }
+        const uint8_t *GetPushConstants() const { return m_push_constants; }
+
+        uint32_t GetPushConstantsSize() const { return m_push_constants_size; }
+
+        std::vector<DescriptorSet> &GetDescriptorSets() { return m_descriptor_sets; }
 
         Anvil::ComputePipelineID GetPipelineID() const { return m_pipeline_id; }
 
         void SetPipelineID(
                 Anvil::ComputePipelineID in_new_pipeline_id) { m_pipeline_id = in_new_pipeline_id; }
 
+        // fence of the batch this Function has been last dispatched in
+        uint64_t GetFenceId() const { return m_fence_id; }
+
+        void SetFenceId(uint64_t in_fence_id) { m_fence_id = in_fence_id; }
+
     private:
         Anvil::Device *m_anvil_device;
         Anvil::ShaderModuleStageEntryPoint m_function_entry_point;
         Anvil::ShaderModule *m_shader_module;
         std::vector<Buffer const *> m_parameters;
 
-        // descriptor set group used by this function
-        Anvil::DescriptorSetGroup *m_descriptor_set_group;
+        // offsets of the arguments within the push constants, ~0u for buffers
+        std::vector<uint32_t> m_push_constant_offsets;
+        uint8_t m_push_constants[MAX_PUSH_CONSTANTS_SIZE];
+        uint32_t m_push_constants_size;
+
+        // descriptor set groups used by this function keyed by their bound buffers
+        std::vector<DescriptorSet> m_descriptor_sets;
 
         // Vulkan pipeline attached with the descriptor set group and shader module defined above
         Anvil::ComputePipelineID m_pipeline_id;
 
+        uint64_t m_fence_id;
+
         // Whether Vulkan implementation should use Compute pipe or Graphics pipe to dispatch this Function's shader
         bool m_use_compute_pipe;
 #if _DEBUG
@@ -175,4 +189,4 @@ namespace Calc {
 #endif
     };
 
-}
\ No newline at end of file
+}
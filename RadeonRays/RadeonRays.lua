@@ -24,6 +24,11 @@ project "RadeonRays"
         defines {"RR_RAYMASK"}
     end
 
+    -- Sockets of the remote device
+    if os.is("windows") then
+        links {"ws2_32"}
+    end
+
     defines {"EXPORT_API"}
 
     files { "../RadeonRays/**.h", "../RadeonRays/**.cpp","../RadeonRays/src/kernels/CL/**.cl", "../RadeonRays/src/kernels/GLSL/**.comp"}
@@ -117,6 +122,11 @@ project "RadeonRays"
         defines { "USE_SAFE_MATH" }
     end
 
+    if _OPTIONS["watertight"] then
+        configuration {}
+        defines { "RR_WATERTIGHT" }
+    end
+
     if _OPTIONS["use_vulkan"] then
         local vulkanSDKPath = os.getenv( "VK_SDK_PATH" );
         if vulkanSDKPath == nil then
@@ -24,6 +24,10 @@ THE SOFTWARE.
 #include <cmath>
 #include <algorithm>
 
+#ifdef RR_SSE_MATH
+#include <emmintrin.h>
+#endif
+
 #if defined(_WIN32) && !defined(NO_MIN_MAX)
 #undef MIN
 #undef MAX
@@ -40,20 +44,83 @@ namespace RadeonRays
 
         float& operator [](int i)       { return *(&x + i); }
         float  operator [](int i) const { return *(&x + i); }
-        float3 operator-() const        { return float3(-x, -y, -z); }
+        float3 operator-() const;
 
         float  sqnorm() const           { return x*x + y*y + z*z; }
         void   normalize()              { (*this)/=(std::sqrt(sqnorm()));} 
 
-        float3& operator += (float3 const& o) { x+=o.x; y+=o.y; z+= o.z; return *this;}
-        float3& operator -= (float3 const& o) { x-=o.x; y-=o.y; z-= o.z; return *this;}
-        float3& operator *= (float3 const& o) { x*=o.x; y*=o.y; z*= o.z; return *this;}
-        float3& operator *= (float c) { x*=c; y*=c; z*= c; return *this;}
-        float3& operator /= (float c) { float cinv = 1.f/c; x*=cinv; y*=cinv; z*=cinv; return *this;}
+        float3& operator += (float3 const& o);
+        float3& operator -= (float3 const& o);
+        float3& operator *= (float3 const& o);
+        float3& operator *= (float c);
+        float3& operator /= (float c);
 
         float x, y, z, w;
     };
 
+#ifdef RR_SSE_MATH
+    // SSE implementation works on all 4 lanes and restores w
+    // where the scalar one leaves it untouched or zeroes it, so
+    // both produce the same values
+    namespace detail
+    {
+        inline __m128 load(float3 const& v) { return _mm_loadu_ps(&v.x); }
+        inline void store(__m128 v, float3& res) { _mm_storeu_ps(&res.x, v); }
+        inline __m128 xyzmask() { return _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1)); }
+        // xyz from v, w from o
+        inline __m128 keepw(__m128 v, __m128 o) { __m128 mask = xyzmask(); return _mm_or_ps(_mm_and_ps(mask, v), _mm_andnot_ps(mask, o)); }
+        inline __m128 zerow(__m128 v) { return _mm_and_ps(xyzmask(), v); }
+    }
+
+    inline float3 float3::operator-() const
+    {
+        float3 res;
+        detail::store(detail::zerow(_mm_xor_ps(detail::load(*this), _mm_set1_ps(-0.f))), res);
+        return res;
+    }
+
+    inline float3& float3::operator += (float3 const& o)
+    {
+        __m128 v = detail::load(*this);
+        detail::store(detail::keepw(_mm_add_ps(v, detail::load(o)), v), *this);
+        return *this;
+    }
+
+    inline float3& float3::operator -= (float3 const& o)
+    {
+        __m128 v = detail::load(*this);
+        detail::store(detail::keepw(_mm_sub_ps(v, detail::load(o)), v), *this);
+        return *this;
+    }
+
+    inline float3& float3::operator *= (float3 const& o)
+    {
+        __m128 v = detail::load(*this);
+        detail::store(detail::keepw(_mm_mul_ps(v, detail::load(o)), v), *this);
+        return *this;
+    }
+
+    inline float3& float3::operator *= (float c)
+    {
+        __m128 v = detail::load(*this);
+        detail::store(detail::keepw(_mm_mul_ps(v, _mm_set1_ps(c)), v), *this);
+        return *this;
+    }
+
+    inline float3& float3::operator /= (float c)
+    {
+        return (*this) *= (1.f / c);
+    }
+#else
+    inline float3 float3::operator-() const { return float3(-x, -y, -z); }
+
+    inline float3& float3::operator += (float3 const& o) { x+=o.x; y+=o.y; z+= o.z; return *this;}
+    inline float3& float3::operator -= (float3 const& o) { x-=o.x; y-=o.y; z-= o.z; return *this;}
+    inline float3& float3::operator *= (float3 const& o) { x*=o.x; y*=o.y; z*= o.z; return *this;}
+    inline float3& float3::operator *= (float c) { x*=c; y*=c; z*= c; return *this;}
+    inline float3& float3::operator /= (float c) { float cinv = 1.f/c; x*=cinv; y*=cinv; z*=cinv; return *this;}
+#endif
+
     typedef float3 float4;
 
 
@@ -106,6 +173,32 @@ namespace RadeonRays
         return float3(v1.y * v2.z - v2.y * v1.z, v2.x * v1.z - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
     }
 
+#ifdef RR_SSE_MATH
+    // Operands go in std::min/std::max order
+    inline float3 vmin(float3 const& v1, float3 const& v2)
+    {
+        float3 res;
+        detail::store(detail::zerow(_mm_min_ps(detail::load(v2), detail::load(v1))), res);
+        return res;
+    }
+
+    inline void vmin(float3 const& v1, float3 const& v2, float3& v)
+    {
+        detail::store(detail::keepw(_mm_min_ps(detail::load(v2), detail::load(v1)), detail::load(v)), v);
+    }
+
+    inline float3 vmax(float3 const& v1, float3 const& v2)
+    {
+        float3 res;
+        detail::store(detail::zerow(_mm_max_ps(detail::load(v2), detail::load(v1))), res);
+        return res;
+    }
+
+    inline void vmax(float3 const& v1, float3 const& v2, float3& v)
+    {
+        detail::store(detail::keepw(_mm_max_ps(detail::load(v2), detail::load(v1)), detail::load(v)), v);
+    }
+#else
     inline float3 vmin(float3 const& v1, float3 const& v2)
     {
         return float3(std::min(v1.x, v2.x), std::min(v1.y, v2.y), std::min(v1.z, v2.z));
@@ -129,4 +222,5 @@ namespace RadeonRays
         v.y = std::max(v1.y, v2.y);
         v.z = std::max(v1.z, v2.z);
     }
+#endif
 }
\ No newline at end of file
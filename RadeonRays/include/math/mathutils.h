@@ -110,11 +110,17 @@ namespace RadeonRays
     /// Transform a point using a matrix
     inline float3 transform_point(float3 const& p, matrix const& m)
     {
+#ifdef RR_SSE_MATH
+        float3 res;
+        detail::store(detail::transform(m, p, true), res);
+        return res;
+#else
         float3 res = m * p;
         res.x += m.m03;
         res.y += m.m13;
         res.z += m.m23;
         return res;
+#endif
     }
 
     /// Transform a vector using a matrix
@@ -81,6 +81,7 @@ namespace RadeonRays
         };
     };
 
+    matrix operator*(matrix const& m1, matrix const& m2);
 
     inline matrix matrix::operator -() const
     {
@@ -118,17 +119,7 @@ namespace RadeonRays
 
     inline matrix& matrix::operator *= (matrix const& o)
     {
-        matrix temp;
-        for (int i=0;i<4;++i)
-        {
-            for (int j=0;j<4;++j)
-            {
-                temp.m[i][j] = 0.f;
-                for (int k=0;k<4;++k)
-                    temp.m[i][j] += m[i][k] * o.m[k][j];
-            }
-        }
-        *this = temp;
+        *this = *this * o;
         return *this;
     }
 
@@ -152,6 +143,21 @@ namespace RadeonRays
         return res-=m2;
     }
 
+#ifdef RR_SSE_MATH
+    inline matrix operator*(matrix const& m1, matrix const& m2)
+    {
+        matrix res;
+        for (int i=0;i<4;++i)
+        {
+            // Row i is a combination of m2 rows accumulated in scalar order
+            __m128 row = _mm_setzero_ps();
+            for (int k=0;k<4;++k)
+                row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m1.m[i][k]), _mm_loadu_ps(&m2.m[k][0])));
+            _mm_storeu_ps(&res.m[i][0], row);
+        }
+        return res;
+    }
+#else
     inline matrix operator*(matrix const& m1, matrix const& m2)
     {
         matrix res;
@@ -166,6 +172,7 @@ namespace RadeonRays
         }
         return res;
     }
+#endif
 
     inline matrix operator*(matrix const& m, float c)
     {
@@ -179,6 +186,38 @@ namespace RadeonRays
         return res*=c;
     }
 
+#ifdef RR_SSE_MATH
+    namespace detail
+    {
+        // Upper 3x3 part of m applied to v with optional translation,
+        // sums go in scalar order and w is zero
+        inline __m128 transform(matrix const& m, float3 const& v, bool translate)
+        {
+            __m128 c0 = _mm_loadu_ps(&m.m[0][0]);
+            __m128 c1 = _mm_loadu_ps(&m.m[1][0]);
+            __m128 c2 = _mm_loadu_ps(&m.m[2][0]);
+            __m128 c3 = _mm_setzero_ps();
+            _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+            __m128 res = _mm_setzero_ps();
+            res = _mm_add_ps(res, _mm_mul_ps(c0, _mm_set1_ps(v.x)));
+            res = _mm_add_ps(res, _mm_mul_ps(c1, _mm_set1_ps(v.y)));
+            res = _mm_add_ps(res, _mm_mul_ps(c2, _mm_set1_ps(v.z)));
+
+            if (translate)
+                res = _mm_add_ps(res, c3);
+
+            return zerow(res);
+        }
+    }
+
+    inline float3 operator * (matrix const& m, float3 const& v)
+    {
+        float3 res;
+        detail::store(detail::transform(m, v, false), res);
+        return res;
+    }
+#else
     inline float3 operator * (matrix const& m, float3 const& v)
     {
         float3 res;
@@ -192,6 +231,7 @@ namespace RadeonRays
 
         return res;
     }
+#endif
 
     inline matrix inverse(matrix const& m)
     {
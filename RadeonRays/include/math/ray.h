@@ -21,6 +21,9 @@ THE SOFTWARE.
 ********************************************************************/
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <limits>
 
 #include "float3.h"
@@ -89,9 +92,141 @@ namespace RadeonRays
             return extra.y > 0;
         }
 
+        // Traversal flags of a ray, kept in extra.y above the active bit and cleared by SetActive.
+        // Only honored by OpenCL "bvh" accelerator, values have to match RAY_FLAG_* in kernels
+        enum Flags
+        {
+            // Stop at the first hit found instead of the closest one in intersection and mixed queries
+            kFlagAnyHit = 2,
+            // Skip back faces: faces whose normal (v1 - v0) x (v2 - v0) points along the ray direction,
+            // i.e. faces with clockwise vertices as seen from the ray origin
+            kFlagCullBackFaces = 4,
+            // Treat every face as opaque: "acc.hit_filter" is not called for the ray
+            kFlagOpaque = 8
+        };
+
+        // Set a combination of Flags, flags of inactive rays are ignored
+        void SetFlags(int flags)
+        {
+            if (IsActive())
+            {
+                extra.y = 1 | (flags & ~1);
+            }
+        }
+
+        int GetFlags() const
+        {
+            return extra.y & ~1;
+        }
+
+        // Mixed queries (see IntersectionApi::QueryMixed) stop rays flagged as any hit at their
+        // first hit, shorthand for kFlagAnyHit
+        void SetAnyHit(bool anyhit)
+        {
+            SetFlags(anyhit ? GetFlags() | kFlagAnyHit : GetFlags() & ~kFlagAnyHit);
+        }
+
+        bool IsAnyHit() const
+        {
+            return (GetFlags() & kFlagAnyHit) != 0;
+        }
+
+        // Cone width growth per unit distance, used by LOD groups with kLodRuleConeWidth
+        void SetSpread(float spread)
+        {
+            std::memcpy(&padding.x, &spread, sizeof(float));
+        }
+
+        float GetSpread() const
+        {
+            float spread;
+            std::memcpy(&spread, &padding.x, sizeof(float));
+            return spread;
+        }
+
+        // Rays with the same seed select the same LOD group levels
+        void SetLodSeed(int seed)
+        {
+            padding.y = seed;
+        }
+
+        int GetLodSeed() const
+        {
+            return padding.y;
+        }
+
         float4 o;
         float4 d;
         int2 extra;
+        // Spread (float bits) and LOD seed, zero by default
         int2 padding;
     };
+
+    ///< Compact ray used with "acc.ray_format" set to "compact": 32 bytes,
+    ///< always active, all mask bits set and zero time.
+    ///<
+    struct ray_compact
+    {
+        ray_compact(float3 const& oo = float3(0,0,0),
+            float3 const& dd = float3(0,0,0),
+            float maxt = std::numeric_limits<float>::max())
+            : o(oo)
+            , d(dd)
+        {
+            o.w = maxt;
+            d.w = 0.f;
+        }
+
+        // Origin in xyz, max distance in w
+        float4 o;
+        // Direction in xyz, w is unused
+        float4 d;
+    };
+
+    ///< Ray with octahedral encoded direction used with "acc.ray_format" set to "oct": 20 bytes,
+    ///< always active, all mask bits set and zero time. The direction is normalized by the encoding,
+    ///< so maxt and hit distances are measured in units of the normalized direction.
+    ///<
+    struct ray_oct
+    {
+        ray_oct(float3 const& oo = float3(0,0,0),
+            float3 const& dd = float3(0,0,1),
+            float tmax = std::numeric_limits<float>::max())
+            : maxt(tmax)
+            , d(EncodeDirection(dd))
+        {
+            o[0] = oo.x;
+            o[1] = oo.y;
+            o[2] = oo.z;
+        }
+
+        // Pack a non-zero direction into two 16-bit snorm octahedral coordinates, x in low bits
+        static std::uint32_t EncodeDirection(float3 const& dd)
+        {
+            float const l1 = std::abs(dd.x) + std::abs(dd.y) + std::abs(dd.z);
+            float x = dd.x / l1;
+            float y = dd.y / l1;
+
+            // Fold the lower hemisphere over the diagonals
+            if (dd.z < 0.f)
+            {
+                float const fx = (1.f - std::abs(y)) * (x >= 0.f ? 1.f : -1.f);
+                float const fy = (1.f - std::abs(x)) * (y >= 0.f ? 1.f : -1.f);
+                x = fx;
+                y = fy;
+            }
+
+            auto snorm = [](float v) -> std::uint32_t
+            {
+                v = v < -1.f ? -1.f : (v > 1.f ? 1.f : v);
+                return static_cast<std::uint16_t>(static_cast<std::int16_t>(std::floor(v * 32767.f + 0.5f)));
+            };
+
+            return snorm(x) | (snorm(y) << 16);
+        }
+
+        float o[3];
+        float maxt;
+        std::uint32_t d;
+    };
 }
\ No newline at end of file
@@ -53,8 +53,8 @@ namespace RadeonRays
     struct Intersection;
 
     /// Represents a device, which can be used by API for intersection purposes.
-    /// API is distributing the work across multiple devices itsels, so
-    /// this structure is only used to query devices configuration and
+    /// API created with CreateHybrid is distributing the work across multiple devices itself,
+    /// so this structure is only used to query devices configuration and
     /// limit the number of devices available for the API.
     struct RRAPI DeviceInfo
     {
@@ -71,6 +71,8 @@ namespace RadeonRays
             kOpenCL = 0x1,
             kVulkan = 0x2,
             kEmbree = 0x4,
+            // Built-in SSE traversal on the host, needs no third party libraries
+            kNative = 0x8,
 
             kAny = 0xFF
         };
@@ -84,10 +86,172 @@ namespace RadeonRays
         Platform platform;
     };
 
+    /// GPU execution time of a kernel launched by a query or a commit,
+    /// recorded when "acc.profiling" option is enabled
+    struct RRAPI KernelTiming
+    {
+        // Kernel name ("intersect", "occlude", "refit", "hlbvh_emit" etc.)
+        char const* name;
+        // Execution time in milliseconds
+        float time;
+    };
+
+    /// Span of the commit or query pipeline reported to the callback set by IntersectionApi::SetTraceCallback
+    struct RRAPI TraceEvent
+    {
+        // Span name ("Commit", "Process", "QueryIntersection", kernel names of GPU spans etc.)
+        char const* name;
+        // Pipeline stage: "api", "device", "intersector", "builder", "translator", "upload", "query" or "gpu"
+        char const* category;
+        // Start time and duration in microseconds, start is relative to the first use of tracing in the process
+        double start;
+        double duration;
+        // Host thread number in order of the first reported span, device queue index for GPU spans
+        std::uint32_t thread;
+        // Kernel launch timed by "acc.profiling", placed at the host time its completion was waited for
+        bool gpu;
+    };
+
+    // Trace callback, calls are serialized
+    typedef void (*TraceCallback)(TraceEvent const& event, void* userdata);
+
+    /// Traversal counters of a single ray, recorded when "acc.traversal_stats" option is enabled
+    struct RRAPI TraversalStats
+    {
+        // Nodes fetched, leaves included
+        int nodes;
+        // Leaves whose primitives were tested
+        int leaves;
+        // Primitive intersection tests
+        int prims;
+        // Short stack spills to global memory ("fatbvh" only)
+        int spills;
+    };
+
+    /// Report on the latest IntersectionApi::Commit call.
+    /// Timings are in milliseconds and are zero for the phases
+    /// which have been skipped (for ex. if nothing has changed since previous commit).
+    /// Acceleration structure figures describe the current tree (top level one for 2-level BVH)
+    /// and are kept by commits which do not rebuild it.
+    struct RRAPI CommitStatistics
+    {
+        // Whole commit time
+        float total_time;
+        // Primitive bounds gathering
+        float bounds_time;
+        // Acceleration structure build (or refit)
+        float build_time;
+        // Translation into device node layout
+        float translate_time;
+        // Host to device data transfers
+        float upload_time;
+        // Kernel compilation
+        float compile_time;
+
+        // Number of BVH nodes
+        int num_nodes;
+        // Number of BVH leaves
+        int num_leaves;
+        // BVH height
+        int height;
+        // SAH cost of the BVH as built, refits do not update it
+        // (node traversal cost is taken from "bvh.sah.traversal_cost")
+        float sah_cost;
+        // 1 if existing BVH has been refitted (or 2-level top level updated incrementally) instead of rebuilt, 0 otherwise
+        int refitted;
+
+        // Bytes uploaded to the device per buffer
+        // BVH nodes
+        size_t nodes_bytes;
+        // Vertex positions
+        size_t vertices_bytes;
+        // Face indices
+        size_t faces_bytes;
+        // Per shape data (2-level BVH)
+        size_t shapes_bytes;
+        // Auxiliary buffers (refit links and flags)
+        size_t other_bytes;
+
+        // Number of structure simplifications applied to fit "acc.memory_budget", 0 if none were needed
+        int budget_steps;
+    };
+
+    // Memory held by an API, device figures are sizes of allocated buffers,
+    // which may be larger than the data they hold since buffers are pooled and grown
+    struct RRAPI MemoryUsage
+    {
+        // Device memory per category
+        // Vertex positions (or precomputed triangles)
+        size_t vertices_bytes;
+        // Face indices
+        size_t faces_bytes;
+        // BVH nodes
+        size_t nodes_bytes;
+        // Per shape data: shape IDs, masks, motion and instance data of 2-level BVH
+        size_t instances_bytes;
+        // Traversal stacks, refit links, build temporaries, ray counters and
+        // sorting, decoding and compaction buffers of queries
+        size_t scratch_bytes;
+        // Released buffers kept for reuse by buffer pools
+        size_t pool_bytes;
+        // Host memory per category
+        // Event holders of the API
+        size_t event_pool_bytes;
+        // Chunk buffers of queries on rays in host memory
+        size_t host_chunks_bytes;
+        // Compiled kernel binaries, OpenCL only
+        size_t kernel_binaries_bytes;
+        // Mesh vertices and indices copied into API memory, views of caller memory don't count
+        size_t host_geometry_bytes;
+
+        // Sums of the categories above
+        size_t device_bytes;
+        size_t host_bytes;
+    };
+
     // Forward declaration of entities
     typedef int Id;
     const Id kNullId = -1;
 
+    // Check ray idx of QueryOcclusion results written with "acc.occlusion_format" "bits":
+    // bit idx % 32 of word idx / 32 is set for occluded rays
+    inline bool IsOccluded(int const* hitresults, int idx)
+    {
+        return ((static_cast<unsigned>(hitresults[idx >> 5]) >> (idx & 31)) & 1u) != 0;
+    }
+
+    // Expand numrays bit-packed occlusion results into "int" format results (1 for hit, -1 for miss)
+    inline void UnpackOcclusion(int const* hitresults, int numrays, int* unpacked)
+    {
+        for (int i = 0; i < numrays; ++i)
+        {
+            unpacked[i] = IsOccluded(hitresults, i) ? 1 : -1;
+        }
+    }
+
+    // How shape geometry is going to change, lets 2 level BVH (built for instances, groups, curves,
+    // motion or "bvh.force2level") pick a bottom level builder per mesh
+    enum BuildHint
+    {
+        // Builder given by "bvh.builder"
+        kBuildHintDefault,
+        // Geometry rarely changes: SAH build, slower to build but faster to traverse
+        kBuildHintStatic,
+        // Geometry is often replaced: LBVH build
+        kBuildHintDynamic,
+        // Vertices move keeping the topology: built by "bvh.builder" once and refitted on vertex updates
+        kBuildHintDeforming
+    };
+
+    // Metric LOD groups compare against their level thresholds (see IntersectionApi::CreateLodGroup)
+    enum LodRule
+    {
+        // World space distance from the ray origin to the group origin
+        kLodRuleDistance,
+        // Ray cone width at the group origin: the distance scaled by the ray spread (see ray::SetSpread)
+        kLodRuleConeWidth
+    };
+
     // Shape interface to repesent intersectable entities
     // The shape is assigned a particular ID which
     // is put by an intersection engine into Intersection structure
@@ -100,7 +264,8 @@ namespace RadeonRays
         virtual void SetTransform(matrix const& m, matrix const& minv) = 0;
         virtual void GetTransform(matrix& m, matrix& minv) const = 0;
 
-        // Motion blur
+        // Motion blur, shapes move by v and rotate around their object space origin by q
+        // from ray time 0 to ray time 1 (see ray::SetTime), applied by 2 level BVH on OpenCL
         virtual void SetLinearVelocity(float3 const& v) = 0;
         virtual float3 GetLinearVelocity() const = 0;
 
@@ -114,6 +279,17 @@ namespace RadeonRays
         // Geometry mask to mask out intersections
         virtual void SetMask(int mask) = 0;
         virtual int  GetMask() const = 0;
+
+        // Bottom level builder hint, ignored for instances and groups (kBuildHintDefault by default)
+        virtual void SetBuildHint(BuildHint hint) = 0;
+        virtual BuildHint GetBuildHint() const = 0;
+
+        // Update vertex positions keeping the topology intact.
+        // vnum must match the number of vertices the mesh has been created with.
+        // Changes become visible after IntersectionApi::Commit, which refits
+        // acceleration structures instead of rebuilding them if possible.
+        // Throws for shapes which do not own geometry (instances).
+        virtual void UpdateVertices(float const* vertices, int vnum, int vstride) = 0;
     };
 
     // Buffer represents a chunk of memory hosted inside the API
@@ -128,11 +304,18 @@ namespace RadeonRays
     class RRAPI Event
     {
     public:
+        typedef void (*CompletionCallback)(Event* event, void* data);
+
         virtual ~Event() = 0;
         // Indicates whether the related action has been completed
         virtual bool Complete() const = 0;
         // Blocks execution until the event is completed
         virtual void Wait() = 0;
+        // Call callback once the related action has been completed, right away if it already is.
+        // It is called on a driver or worker thread and should return quickly without calling
+        // into the API. Deleting the event doesn't cancel the callback, its event argument
+        // then points to the deleted event.
+        virtual void SetCompletionCallback(CompletionCallback callback, void* data) = 0;
     };
 
     // Exception class
@@ -166,6 +349,95 @@ namespace RadeonRays
         kMapWrite = 0x2
     };
 
+    enum BufferFlags
+    {
+        kBufferDefault = 0x0,
+        // Buffer stays mapped until it is deleted, see IntersectionApi::CreateBuffer
+        kBufferPersistentMap = 0x1,
+        // Buffer uses initdata memory in place on devices sharing memory with the host (APUs)
+        kBufferUseHostPtr = 0x2
+    };
+
+    enum QueryType
+    {
+        // Closest hit query writing hits as set by "acc.hit_format"
+        kQueryIntersection,
+        // Any hit query writing an int per ray
+        kQueryOcclusion
+    };
+
+    // Mesh of a batch created by IntersectionApi::CreateMeshes, arguments of CreateMesh
+    struct MeshDesc
+    {
+        // Position data
+        float const* vertices;
+        int vnum;
+        int vstride;
+        // Index data for vertices
+        int const* indices;
+        int istride;
+        // Numbers of vertices per face
+        int const* numfacevertices;
+        // Number of faces
+        int numfaces;
+    };
+
+    // Query of a batch submitted by IntersectionApi::QueryBatch
+    struct QueryDesc
+    {
+        QueryType type;
+        // Rays and their count
+        Buffer const* rays;
+        int numrays;
+        // Query results
+        Buffer* hits;
+    };
+
+    // Sequence of queries recorded by IntersectionApi::CreateQueryGraph
+    class RRAPI QueryGraph
+    {
+    public:
+        virtual ~QueryGraph() = 0;
+    };
+
+    // Camera of IntersectionApi::GenerateCameraRays
+    struct CameraDesc
+    {
+        float3 position;
+        // Viewing direction and a vector pointing to the top of the image,
+        // the right of the image is cross(forward, up)
+        float3 forward;
+        float3 up;
+        // Width and height of the sensor placed at focal_length in front of the position
+        float2 sensor_size;
+        float focal_length;
+        // Lens radius, 0 for pinhole cameras
+        float aperture;
+        // Distance of the plane in focus along the viewing direction for thin lens cameras
+        float focus_distance;
+        float maxt;
+        // Random positions inside pixels if nonzero, pixel centers otherwise
+        int jitter;
+    };
+
+    // Surface point secondary rays start from, a zero normal marks a missing point (e.g. a miss)
+    // and generates inactive rays. Points are offset along the normal to avoid self intersections.
+    struct SurfacePoint
+    {
+        float3 position;
+        float3 normal;
+    };
+
+    // Light of IntersectionApi::GenerateShadowRays: a point light or a parallelogram
+    // spanned by the edges from the position
+    struct LightDesc
+    {
+        float3 position;
+        // Zero for point lights
+        float3 edge1;
+        float3 edge2;
+    };
+
     // IntersectionApi is designed to provide fast means for ray-scene intersection
     // for AMD architectures. It effectively absracts underlying AMD hardware and
     // software stack and allows user to issue low-latency batched ray queries.
@@ -190,6 +462,19 @@ namespace RadeonRays
         // device(s) to use
         static void SetPlatform(const DeviceInfo::Platform platform);
 
+        // Directory to cache compiled kernel binaries in, keyed by device, driver version,
+        // kernel source and build options. Set before creating APIs to skip kernel
+        // compilation on the following runs. Null or empty path disables the cache (default).
+        static void SetKernelCachePath(char const* path);
+
+        // Report spans of commits, builds, uploads and queries of all APIs in the process to callback,
+        // nullptr disables tracing (default). GPU spans are reported if "acc.profiling" is enabled.
+        static void SetTraceCallback(TraceCallback callback, void* userdata);
+        // Write the spans to filename as Chrome trace event JSON (chrome://tracing, ui.perfetto.dev)
+        // until StopTrace is called, the trace callback can't be set meanwhile
+        static void StartTrace(char const* filename);
+        static void StopTrace();
+
 
         /******************************************
         Device management
@@ -206,6 +491,22 @@ namespace RadeonRays
         ******************************************/
         static IntersectionApi* Create(std::uint32_t devidx);
 
+        // Create API distributing every query across several devices (e.g. Embree next to a GPU),
+        // rays are split by the throughput measured on previous queries and results are merged.
+        // Buffers are kept in host memory and Map/Unmap calls do not involve the devices.
+        // Only "full" hit and ray formats are supported. See "hybrid.partition" option for scenes
+        // too large to be held by every device.
+        static IntersectionApi* CreateHybrid(std::uint32_t const* devidx, std::uint32_t numdevices);
+
+        // Create API sending the queries to a RemoteServer over TCP, address is "host[:port]"
+        // (default port 7755). Scenes are serialized on Commit and built by the server, only
+        // active rays are sent and the server batches queries of several clients into single
+        // launches. Buffers are kept in host memory and Map/Unmap calls do not involve the network.
+        // Only "full" hit and ray formats are supported, hit filters, hit callbacks and custom intersectors
+        // are not. The server only applies options changing how trees are built and traversed, others such as
+        // file paths and thread counts stay local. Returns nullptr if the server can't be reached.
+        static IntersectionApi* CreateRemote(char const* address);
+
         // Deallocation
         static void Delete(IntersectionApi* api);
 
@@ -217,6 +518,9 @@ namespace RadeonRays
         // The mesh might be mixed quad\triangle mesh which is determined
         // by numfacevertices array containing numfaces entries describing
         // the number of vertices for current face (3 or 4)
+        // OpenCL "bvh" and "bvh2l" accelerators intersect quads as a whole and
+        // report quad coordinates in uvwt.xy for quad faces, where idx[0] is (0, 0)
+        // and idx[2] is (1, 1). Other accelerators only intersect idx[0], idx[1], idx[2].
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateMesh(
             // Position data
@@ -229,41 +533,179 @@ namespace RadeonRays
             int  numfaces
             ) const = 0;
 
-        // Create an instance of a shape with its own transform (set via Shape interface).
+        // Create nummeshes meshes described like CreateMesh arguments and write them to shapes.
+        // Meshes are built in parallel and get consecutive IDs in the order of descs, nothing
+        // is created if any of them fails. The call is blocking.
+        virtual void CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** shapes) const = 0;
+
+        // Create a triangle mesh referencing host memory instead of copying it.
+        // Vertices and indices are read with the given strides on every commit,
+        // so the memory has to stay valid until the mesh is deleted. Changes
+        // of the memory are picked up after UpdateVertices is called.
         // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateMeshView(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices, 3 indices per face
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const = 0;
+
+        // Create an instance of a shape with its own transform (set via Shape interface).
+        // Meshes and groups can be instanced, an instance of an instance references
+        // the same base shape. The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateInstance(Shape const* shape) const = 0;
+        // Create round cubic Bezier curves (hair, fur) intersected natively instead of being tessellated.
+        // Control points are x, y, z and radius (vstride is in bytes, 0 means 4 floats), every segment
+        // references 4 control points. Hits report segment index as primid, curve parameter in uvwt.x
+        // and position across the curve width in uvwt.y. Curves are attached, instanced or grouped
+        // like meshes and are only supported by OpenCL devices.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateCurves(
+            // Control points
+            float const * vertices, int vnum, int vstride,
+            // 4 control point indices per segment
+            int const * indices,
+            // Number of segments
+            int numsegments
+            ) const = 0;
+        // Create analytic spheres (particles, point clouds) intersected natively instead of being tessellated.
+        // Spheres are x, y, z and radius (stride is in bytes, 0 means 4 floats). Hits report sphere index as
+        // primid and spherical coordinates of the hit point (longitude, latitude in [0, 1]) in uvwt.x and uvwt.y.
+        // Like curves, spheres are attached, instanced or grouped like meshes and are only supported by OpenCL devices.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateSpheres(float const * spheres, int numspheres, int stride) const = 0;
+        // Create analytic two sided disks given by x, y, z, radius and normal x, y, z (stride is in bytes, 0 means
+        // 7 floats). Hits report disk index as primid, distance from the center relative to the radius in uvwt.x
+        // and the angle around the normal in [0, 1] in uvwt.y. Same support as spheres.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateDisks(float const * disks, int numdisks, int stride) const = 0;
+        // Create custom primitives given by their object space bounds, min x, y, z and max x, y, z (stride is in
+        // bytes, 0 means 6 floats), and intersected by the "acc.custom_intersector" function. Hits report primitive
+        // index as primid and the uv returned by the function. Same support as spheres.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateCustomPrimitives(float const * bounds, int numprims, int stride) const = 0;
+        // Create a group of meshes, instances or other groups placed with their transforms
+        // relative to the group. Groups are attached or instanced as a single shape and hits
+        // report the ID of the shape attached to the scene. Shapes have to outlive the group,
+        // groups can be nested up to 3 levels and are only supported by OpenCL devices.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateGroup(Shape const* const* shapes, int numshapes) const = 0;
+        // Create a LOD group of level shapes (meshes, instances or groups, finest first) placed relative to
+        // the group like group members. Rays enter a single level selected when the top level traversal reaches
+        // the group: the number of thresholds[1..numlevels-1] (ascending, world units) not above the rule metric
+        // measured at the group origin. The metric is jittered by up to +-transition/2 of itself, hashed from
+        // the ray LOD seed (see ray::SetLodSeed), so that levels blend stochastically instead of popping.
+        // LOD groups are groups otherwise: attached or instanced as a single shape, they take one nesting level
+        // for themselves and one for the levels. Only supported by the OpenCL 2 level BVH.
+        // The call is blocking, so the returned value is ready upon return.
+        virtual Shape* CreateLodGroup(Shape const* const* levels, float const* thresholds, int numlevels,
+            LodRule rule, float transition) const = 0;
         // Delete the shape (to simplify DLL boundary crossing
         virtual void DeleteShape(Shape const* shape) = 0;
         // Attach shape to participate in intersection process
         virtual void AttachShape(Shape const* shape) = 0;
+        // Attach numshapes shapes at once, same as AttachShape for each of them
+        virtual void AttachShapes(Shape const* const* shapes, int numshapes) = 0;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         virtual void DetachShape(Shape const* shape) = 0;
         // Detach all objects
         virtual void DetachAll() = 0;
         // Commit all geometry creations/changes
         virtual void Commit() = 0;
+        // Commit without blocking: the scene is prepared in the background while queries keep
+        // using the previously committed one, which is replaced once the event completes.
+        // API calls changing the scene or options and Shape setters wait for the commit.
+        // The event can only be waited for or polled, it is never a wait event of other calls.
+        // Event pointer might be nullptr.
+        virtual void CommitAsync(Event** event) = 0;
         //Sets the shape id allocator to its default value (1)
         virtual void ResetIdCounter() = 0;
         //Returns true if no shapes are in the world
         virtual bool IsWorldEmpty() = 0;
+        // Commit the scene and write its triangle meshes and instances (ids, masks, transforms,
+        // motion, attachment) together with the trees built by "bvh" and "fatbvh" accelerators
+        // into a single file. Groups, curves and meshes with non-triangle faces are not supported.
+        virtual void SaveSnapshot(char const* path) = 0;
+        // Load shapes saved by SaveSnapshot, shapes which were attached get attached again.
+        // Returns the number of shapes (meshes first, then instances), only counting them
+        // if shapes is nullptr, and throws if maxshapes is too small. The file is mapped until
+        // the API is deleted: meshes reference it and the next commit uses stored trees
+        // matching the current options instead of building them. Shapes are deleted by the caller.
+        virtual int LoadSnapshot(char const* path, Shape** shapes, int maxshapes) = 0;
+
+        /******************************************
+        Queues
+        ******************************************/
+        // Number of device queues. Memory and ray casting calls take a queue index
+        // in [0, GetQueueCount()), calls on the same queue execute in order, calls on
+        // different queues might overlap and are only ordered by waiting for their events.
+        // Memory and ray casting calls can be issued from different threads without external
+        // locking: a device lock serializes the setup and launch of queries, so their kernels
+        // can't pick up each other's arguments, while the kernels themselves run asynchronously. Queries share
+        // intersector scratch memory, so a query on another queue than the previous query
+        // waits for the previous queue to finish, transfers on other queues still overlap.
+        virtual int GetQueueCount() const = 0;
 
         /******************************************
         Memory management
         ******************************************/
         // Create a buffer to use the most efficient acceleration possible
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
+        // Create a buffer with BufferFlags. For kBufferPersistentMap *data receives a host pointer
+        // valid until the buffer is deleted, so ray generators write rays in place without
+        // MapBuffer calls. The memory is host visible (zero-copy on APUs and GPUs exposing
+        // their memory to the host), writes done before a query is issued are seen by it
+        // and results are readable once the query event completes. Do not touch the memory
+        // while a query using the buffer is in flight.
+        // For kBufferUseHostPtr the buffer is backed by initdata itself where the device shares
+        // memory with the host, so rays and hits skip the upload and MapBuffer does not copy.
+        // initdata has to stay alive until DeleteBuffer, page aligned memory keeps drivers
+        // from copying. Other devices copy initdata as CreateBuffer does.
+        // data may be nullptr unless kBufferPersistentMap is set.
+        virtual Buffer* CreateBuffer(size_t size, void* initdata, int flags, void** data) const = 0;
+        // Create a view of size bytes of buffer starting at offset, usable wherever a buffer is,
+        // e.g. to trace a tile of a shared ray pool without copies. offset has to be a multiple
+        // of the device base address alignment (4096 bytes is always valid), buffer must not
+        // be a sub-buffer itself and has to outlive the view. Released by DeleteBuffer.
+        virtual Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const = 0;
         // Delete the buffer
         virtual void DeleteBuffer(Buffer* buffer) const = 0;
         // Map buffer. Event pointer might be nullptr.
         // The call is asynchronous.
-        virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const = 0;
+        virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue = 0) const = 0;
         // Unmap buffer
-        virtual void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const = 0;
+        virtual void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue = 0) const = 0;
+        // Copy size bytes from src to dst on the device, e.g. to keep rays produced by a query
+        // as input of the next one without a round trip through host memory. The regions must
+        // not overlap. The call is asynchronous if event is not nullptr, otherwise it is blocking.
+        virtual void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue = 0) const = 0;
+        // Update vertex positions of a mesh from a buffer, e.g. written by a skinning kernel.
+        // vnum positions are read with vstride bytes between them from the start of the buffer,
+        // otherwise it behaves like Shape::UpdateVertices. The call is blocking.
+        virtual void UpdateVertices(Shape* shape, Buffer* vertices, int vnum, int vstride) const = 0;
+        // Set world transforms of numshapes shapes at once, e.g. of animated instances every frame.
+        // transforms holds the top 3 rows of a row major matrix (12 floats) per shape with tstride bytes
+        // between them (0 for tightly packed ones), inverses are computed by the API. Only transforms
+        // are marked changed, so the following commit keeps bottom level BVHs and 2 level BVH
+        // refits its top level with "bvh.refit". Otherwise it behaves like Shape::SetTransform.
+        virtual void SetTransforms(Shape* const* shapes, int numshapes, float const* transforms, int tstride) = 0;
+        // Set transforms of shapes reading them from the start of a buffer, e.g. written by an animation
+        // kernel, in the layout of the overload above. The call is blocking.
+        virtual void SetTransforms(Shape* const* shapes, int numshapes, Buffer* transforms, int tstride) = 0;
 
         /******************************************
           Events handling
         *******************************************/
         virtual void DeleteEvent(Event* event) const = 0;
+        // Create an event owned by the caller. Passing a pointer to it as event argument
+        // of memory and ray casting calls signals it again instead of allocating a new event,
+        // other values of the pointed to event are overwritten. Release with DeleteEvent.
+        // Caller owned events are complete until they are passed to a call.
+        virtual Event* CreateReusableEvent() const = 0;
+        // Block until at least one of the events is completed and return its index
+        virtual int WaitAny(Event* const* events, int numevents) const = 0;
 
         /******************************************
           Ray casting
@@ -271,37 +713,353 @@ namespace RadeonRays
         // Complete path:
         // Find closest intersection
         // The call is asynchronous. Event pointers might be nullptrs.
-        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const = 0;
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
-        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue = 0) const = 0;
 
         // Find closest intersection, number of rays is in remote memory
         // The call is asynchronous. Event pointers might be nullptrs.
-        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const = 0;
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
-        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Find closest and any intersections in a single launch, e.g. for extension and shadow rays of a wavefront
+        // bounce. Rays flagged by ray::SetAnyHit stop at their first hit, the others find the closest one, both
+        // write Intersection structs to hitinfos. Needs "full" hit format, compact ray formats can't flag any hit
+        // rays. OpenCL "bvh" accelerator honors ray flags in QueryIntersection too, so this is QueryIntersection
+        // named for intent; other accelerators and devices trace every ray to its closest hit, which is a valid
+        // result of any hit rays too.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryMixed(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Find up to k (1 to 8) closest intersections per ray in a single traversal, e.g. for transparency.
+        // hitinfos holds k Intersection structs per ray, hits of ray i are in [i * k, i * k + k) sorted by
+        // distance and misses fill the rest. Hit callbacks are not called. OpenCL "bvh" accelerator only.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Find the closest point of the scene within each sphere, e.g. for collision probes.
+        // spheres holds float4 centers (xyz) and radii (w), a large radius makes it a closest point query.
+        // hitinfos gets shape and primitive IDs of the closest face, barycentrics of the closest point in uvwt.xy
+        // and the distance to it in uvwt.w, spheres not touching the scene report kNullId. OpenCL "bvh" accelerator only.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Ambient occlusion of SurfacePoints: numsamples cosine distributed rays of radius length are generated
+        // over the normal of each point and traced on the device without storing rays or hits, visibility gets
+        // the fraction of unoccluded rays as a float per point (1 for points with a zero normal).
+        // Directions match GenerateHemisphereRays with the same seed. Hit filters and callbacks are not
+        // applied. OpenCL "bvh" accelerator only.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Host memory path:
+        // Find closest intersection for rays in host memory, faster than buffer
+        // mapping for rays produced and consumed on the CPU. Rays and hits are laid out
+        // as set by "acc.ray_format" and "acc.hit_format" options.
+        // Transfers of ray chunks overlap with traversal (see "acc.host_chunk_size").
+        // The call is blocking.
+        virtual void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue = 0) const = 0;
+        // Find any intersection for rays in host memory.
+        // The call is blocking.
+        virtual void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue = 0) const = 0;
+
+        // Run a batch of queries, cheaper than issuing them one by one.
+        // Queries are executed in order, waitevent is awaited before the first one
+        // and event is signaled once all of them are complete.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Record a sequence of queries replayed by ExecuteQueryGraph, e.g. the queries of every frame.
+        // Buffers and ray counts are bound once here, so replays skip the ray count upload and
+        // synchronization of QueryBatch. The buffers have to outlive the graph, their contents
+        // may change between replays. Graphs stay valid across commits.
+        virtual QueryGraph* CreateQueryGraph(QueryDesc const* queries, int numqueries) const = 0;
+        // Delete the graph, pending replays have to be complete
+        virtual void DeleteQueryGraph(QueryGraph* graph) const = 0;
+        // Run the queries of the graph in order, waitevent is awaited before the first one
+        // and event is signaled once all of them are complete.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Get ready for queries of the given types with up to maxrays rays after a commit: scratch buffers
+        // (traversal stacks, ray sorting and decoding buffers) are allocated for maxrays and the traversal
+        // kernels are run once over no rays, so the first queries don't pay for allocations and driver
+        // compilation. The call blocks until the warm-up is complete. Commits selecting another accelerator
+        // discard the preparation, devices without per query setup ignore the call.
+        virtual void Prepare(int maxrays, QueryType const* types, int numtypes, int queue = 0) const = 0;
+
+        // Wavefront compaction:
+        // Copy rays with a nonzero predicate (an int per ray, active rays if predicate is nullptr)
+        // to the front of outrays preserving their order and write their number to outcount.
+        // numrays and outcount hold a single int, so outcount can be passed to the queries
+        // taking the number of rays in remote memory. outrays must not alias rays. OpenCL only.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Hit grouping:
+        // Write the indices of the rays of full format hits ordered by the group key of the hit shape into
+        // outindices (maxrays ints), so shading can process rays of a material together without sorting them.
+        // The key is the shape id or shapekeys[shape id] if shapekeys (numkeys non-negative ints) is passed.
+        // The order is stable, misses and hits of shapes without a key come after all the hits and rays past
+        // numrays (a single int) go last. outkeys (maxrays ints, might be nullptr) receives the key of every
+        // entry of outindices, kNullId for misses and rays past numrays, so group ranges can be found on the
+        // device. Not supported by Vulkan and Embree devices.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        virtual void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Ray generation:
+        // Write rays straight into a ray buffer on the device instead of generating them on the host
+        // and uploading them. Random numbers depend on the ray index and seed only, so pass a different
+        // seed per frame or sample. OpenCL only.
+        // The calls are asynchronous. Event pointers might be nullptrs.
+        // width * height camera rays in rows starting at the top left pixel
+        virtual void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const = 0;
+        // numsamples cosine distributed rays over the normal of every SurfacePoint, rays of a point are consecutive.
+        // numpoints holds a single int (nullptr uses all maxpoints), rays of points past it are inactive,
+        // so rays can hold maxpoints * numsamples rays and be traced with the maximum count.
+        virtual void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const = 0;
+        // A ray per SurfacePoint toward a random position of the light ending right before it,
+        // to be traced with QueryOcclusion. numpoints is handled as in GenerateHemisphereRays.
+        virtual void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const = 0;
+
+        // Set the buffer "acc.hit_filter" functions read (opacity textures, per shape texture ids, uvs etc.)
+        // The buffer is used by the following queries and has to stay alive while they run, nullptr unsets it.
+        virtual void SetHitFilterData(Buffer const* data) = 0;
+
+        // Set the buffer receiving TraversalStats of every ray of the following QueryIntersection and QueryOcclusion
+        // calls with "acc.traversal_stats" enabled, in ray order. Rays past the end of the buffer are not recorded,
+        // the buffer has to stay alive while the queries run, nullptr unsets it.
+        virtual void SetTraversalStatsBuffer(Buffer* stats) = 0;
+
+        // Set the Intersection buffer of a previous QueryIntersection (e.g. the same rays of the last frame) as hints
+        // for the following QueryIntersection calls with "bvh.hit_hints" enabled. Ray i tests the primitive hit by
+        // element i before traversal, hints past the end of the buffer, misses and primitives which are gone are
+        // skipped. The buffer has to stay alive while the queries run and may be their output, nullptr unsets it.
+        // Devices and accelerators not supporting hints ignore them.
+        virtual void SetHitHints(Buffer const* hits) = 0;
+
+        // Set rays representative of later queries, e.g. primary rays of a previous frame. The next commit rebuilds
+        // "bvh", "fatbvh", "qbvh" and "hashbvh" trees and rotates their subtrees to lower the cost of tracing these
+        // rays (see "bvh.ray_samples_weight"), 2-level and "paged" trees are not affected. Active rays are copied,
+        // at most 16384 of them evenly picked from larger sets, nullptr or no rays unset them.
+        virtual void SetRaySamples(ray const* rays, int numrays) = 0;
 
         /******************************************
         Utility
         ******************************************/
         // Supported options:
-        // option "bvh.type" values {"bvh" (regular bvh, default), "qbvh" (4 branching factor), "hlbvh" (fast builds)}
+        // option "acc.type" values {"bvh" (regular bvh, default), "fatbvh" (short stack traversal, 2-level BVH of meshes and their instances
+        //         is traversed with a short stack across both levels on OpenCL unless it has groups, curves, motion, compact transforms,
+        //         device built top level or too deep levels), "qbvh" (4 branching factor, compressed nodes), "hlbvh" (fast builds),
+        //         "hashbvh" (stackless bit trail traversal, OpenCL only),
+        //         "grid" (two-level uniform grid rebuilt on the device on every change, fastest builds, OpenCL only),
+        //         "paged" (stream geometry pages through a device cache for scenes larger than device memory, OpenCL only),
+        //         "auto" (build each single level structure and keep the one tracing a probe batch fastest, the choice is kept
+        //         until shapes or face counts change, instanced and grouped worlds still use 2-level BVH)}
+        // option "acc.auto_probe_rays" values {float, default = 16384} (number of probe rays traced by "auto" per candidate
+        //         and by "acc.tune_local_size" per work group size)
+        // option "acc.tune_local_size" values {0(default), 1} 1 times the probe batch with each work group size of "bvh" and "fatbvh"
+        //         traversal kernels at commit and keeps the fastest one (OpenCL only), results are kept per device model and
+        //         acc.type for the lifetime of the process. By default the size is 64 rounded to whole hardware wavefronts
+        //         and "fatbvh" LDS stack depth is fitted to device local memory
+        // option "acc.page_size" values {float, default = 0 (a quarter of device memory)} (geometry page size in megabytes
+        //         for "paged", two pages are cached on the device, shapes are not split between pages)
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
-        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
+        // option "bvh.forceflat" values {0(default), 1} 1 uses single level BVH for instanced and moving shapes too
+        //         (instances are flattened, motion is ignored, groups and curves still need 2-level BVH)
+        // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default),
+        //         "lbvh" (sort primitives along Morton curve, fastest to build on CPU)}
+        // option "bvh.lbvh.sah_top" values {0, 1(default)} (build the top of "lbvh" tree with SAH over clusters of nearby primitives)
         // option "bvh.sah.use_splits" values {0(default),1} (allow spatial splits for BVH)
         // option "bvh.sah.traversal_cost" values {float, default = 10.f for GPU } (cost of node traversal vs triangle intersection)
+        // option "bvh.sah.num_bins" values {int, default = 64} (number of SAH bins per axis)
         // option "bvh.sah.min_overlap" values { float < 1.f, default = 0.005f } 
         //         (overlap area which is considered for a spatial splits, fraction of parent bbox)
         // option "bvh.sah.max_split_depth" values {int, default = 10} (max depth in the tree where spatial split can happen)
         // option "bvh.sah.extra_node_budget" values {float, default = 1.f} (maximum node memory budget compared to normal bvh (2*num_tris - 1), for ex. 0.3 = 30% more nodes allowed
-        // Set API global option: string
+        // option "bvh.max_leaf_size" values {int, default = 1} (maximum number of triangles "sah" builder puts into a leaf
+        //         when it is cheaper than splitting, up to 15 for "bvh" on OpenCL and 255 for "qbvh", ignored otherwise)
+        // option "bvh.num_threads" values {int, default = 0 (all hardware threads)} (worker threads of CPU BVH builders, 1 builds serially)
+        // option "bvh.progressive" values {0(default), 1} (commits rebuilding the tree build an "lbvh" tree queries can start with
+        //         right away and the tree of "bvh.builder" on a background thread, it is swapped in at the first commit after it's done
+        //         unless shapes have been attached or detached since, "bvh" acc.type only, no effect with "lbvh" builder or ray samples)
+        // option "bvh.toplevel.builder" values {"cpu" (default), "hlbvh" (build 2-level BVH top level on the device, OpenCL only),
+        //         "rebraid" (open instances with loose world bounds into subtrees of their mesh BVHs and build SAH top level over
+        //         those, for long overlapping rotated instances, skip links OpenCL only, scenes with motion are not opened)}
+        // option "bvh.toplevel.incremental_max_cost" values {float, default = 1.5, 0 disables} (2 level BVH built on the host keeps
+        //         its top level when only instances are attached or detached: their leaves are removed and inserted at the lowest
+        //         SAH cost and changed top level nodes are uploaded, the top level is rebuilt once its SAH cost exceeds this factor
+        //         times its cost after the last build scaled by the height of a balanced tree, not with groups or motion)
+        // option "bvh.hlbvh.treelets" values {0(default), 1} (restructure treelets of device built HLBVH to lower its SAH cost,
+        //         slower build for faster traversal, OpenCL only)
+        // option "bvh.hlbvh.builder" values {"lbvh" (default), "sah" (binned SAH built on the device level by level, slower build
+        //         for faster traversal, does not need parallel primitives)} (device builder of "hlbvh" acc.type and "hlbvh" top level)
+        // option "bvh.hlbvh.morton64" values {0(default), 1} (use 63-bit instead of 30-bit Morton codes for device built HLBVH,
+        //         fewer duplicate codes and better splits in large spread out scenes at the cost of a slower sort, OpenCL only)
+        // option "bvh.hlbvh.refit_max_cost" values {float >= 1, default = 1.5} (device built "hlbvh" trees are refitted when only
+        //         vertices or transforms have changed and "bvh.refit" is on, they are rebuilt once the estimated SAH cost of the refitted
+        //         tree exceeds this factor times its cost after the build, "lbvh" builder only, OpenCL only)
+        // option "bvh.hlbvh.background_rebuild" values {0(default), 1} (once "bvh.hlbvh.refit_max_cost" is exceeded keep refitting
+        //         and build a replacement tree on the secondary queue instead, it is swapped in at the first commit after it's done)
+        // option "bvh.hlbvh.traversal" values {"stack" (default), "short_stack" (translate device built nodes into fat nodes
+        //         on the device after each build and traverse them with the "fatbvh" kernel, OpenCL only)} (traversal of "hlbvh" acc.type)
+        // option "bvh.cache_dir" values {string, default = "" (disabled)} (existing directory to store built BVHs in
+        //         and memory map them from on later commits with the same geometry and build options, "bvh" and "fatbvh" only,
+        //         processes sharing the directory build each BVH once, the others wait for it and map it)
+        // option "bvh.shared_library" values {0(default), 1} (share built 2-level BVH bottom levels with other IntersectionApi
+        //         instances in the process, meshes with the same face bounds and build options are built once)
+        // option "bvh.dedup_meshes" values {0(default), 1} (meshes with the same vertices and faces share 2-level BVH
+        //         bottom level data as if they were instances of the first one, each keeps its own transform, ID and mask)
+        // option "bvh.refit" values {0, 1(default)} (refit existing BVH instead of rebuilding it
+        //         if only shape transforms or vertex positions have changed since the previous commit, 2 level BVH
+        //         refits its top level if only transforms have changed)
+        // option "bvh.ray_samples_weight" values {float in [0, 1], default = 0.5} (share of node probabilities given by
+        //         the fraction of SetRaySamples rays hitting the node rather than its surface area, 0 skips the optimization)
+        // option "bvh.compressed" values {0(default), 1} (quantize "fatbvh" child bounds to 8 bits halving node memory,
+        //         OpenCL only, disables refits)
+        // option "bvh.layout" values {"bfs"(default), "treelet"} (node order of "fatbvh" and "hashbvh", "treelet" groups
+        //         nodes likely to be traversed together into small subtrees stored contiguously for better cache hit rates)
+        // option "bvh.precomputed_triangles" values {0(default), 1} (store a vertex and two edges per triangle in leaf order
+        //         instead of indexed vertices, one fetch per triangle at the cost of memory, "bvh" and "fatbvh" only,
+        //         OpenCL only, disables refits)
+        // option "bvh.persistent_threads" values {0(default), 1} (launch only enough work groups to fill the device
+        //         and let them fetch batches of rays from a global counter, helps incoherent rays, "bvh" only, OpenCL only)
+        // option "bvh.packet_traversal" values {0(default), 1} (traverse rays as work group packets sharing an LDS stack
+        //         with frustum culling of child bounds, helps coherent primary and shadow rays, "fatbvh" only, OpenCL only;
+        //         the native cpu device traces SSE packets of 4 rays instead)
+        // option "bvh.packed_vertices" values {0(default), 1} (store vertices as 3 floats instead of padded float4,
+        //         25% less vertex memory and bandwidth, ignored with precomputed triangles, "bvh" and "fatbvh" only, OpenCL only)
+        // option "bvh.triangle_pairs" values {0(default), 1} (pair triangles of a mesh sharing an edge into a single leaf primitive
+        //         of 4 vertices tested together, a third less face memory and fewer leaf fetches on manifold meshes, ignored with quads
+        //         and precomputed triangles, up to 2^26 vertices, "bvh" only, OpenCL only)
+        // option "bvh.occlusion_area_order" values {0(default), 1} (store the child with larger surface area first,
+        //         occlusion queries visit children in stored order and are likely to find a hit earlier, "bvh" and "fatbvh" only)
+        // option "bvh.direction_ordered" values {0(default), 1} (store 8 copies of the skip links tree, one per ray direction
+        //         octant, each visiting the nearer child first so that far hits are culled as with stack traversal,
+        //         8x node memory, "bvh" only, OpenCL only, disables refits)
+        // option "bvh.hit_hints" values {0(default), 1} (intersection queries test the primitive hit by the same ray in the
+        //         buffer set by IntersectionApi::SetHitHints before traversal, so that tighter t_max culls most of the tree
+        //         for coherent rays like primary rays of consecutive frames, an int per primitive and 3 per shape of
+        //         extra memory, "bvh" only, OpenCL only)
+        // option "bvh.specialize_kernels" values {0, 1(default)} (compile 2-level BVH kernel variants without shape mask tests
+        //         if every shape has all mask bits set and without ray transforms if every shape transform is identity,
+        //         variants are kept for later commits, OpenCL only)
+        // option "bvh.compact_transforms" values {0(default), 1} (store 2-level BVH shape transforms as snorm16 quaternion,
+        //         translation and uniform scale, 40 instead of 64 bytes per shape, used only if no shape has shear,
+        //         non uniform scale or mirroring, rotation is lossy, OpenCL only)
+        // option "acc.sort_rays" values {0(default), 1} (sort rays by origin and direction Morton codes before traversal
+        //         and scatter hits back to the original order, helps incoherent rays, OpenCL only)
+        // option "acc.hit_format" values {"full" (Intersection struct, default), "t" (float distance, -1.f for miss),
+        //         "primid_t" (int primid followed by float distance, 8 bytes), "ids" (int shapeid followed by int primid, 8 bytes),
+        //         "soa" (planes of int shapeids, int primids, float u, float v and float distances, 20 bytes per ray)}
+        //         (layout of QueryIntersection results, misses report kNullId ids, occlusion results are not affected,
+        //         compact formats are supported by "bvh" and uncompressed "fatbvh" on OpenCL and can't be combined with "acc.sort_rays",
+        //         "soa" is also supported by embree devices. Planes are numrays elements long, maxrays for ray counts in device memory)
+        // option "acc.occlusion_format" values {"int" (1 for hit, -1 for miss per ray, default), "bits" (1 bit per ray,
+        //         see IsOccluded and UnpackOcclusion)} (layout of QueryOcclusion results, packed results take
+        //         (numrays + 31) / 32 ints and report inactive rays as not occluded. Supported by "bvh" and uncompressed
+        //         "fatbvh" on OpenCL with work group sizes of multiples of 32, can't be combined with "acc.sort_rays"
+        //         or "acc.hit_callback")
+        // option "acc.hit_callback" values {OpenCL C source, default = ""} (functions called by "bvh" traversal instead of
+        //         writing query results, the source has to define
+        //             void rr_closest_hit(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void* output)
+        //             void rr_closest_miss(int ray_idx, ray const* r, GLOBAL void* output)
+        //             void rr_any_hit(int ray_idx, ray const* r, GLOBAL void* output)
+        //             void rr_any_miss(int ray_idx, ray const* r, GLOBAL void* output)
+        //         output being the hits buffer of the query, compiled into the traversal program at commit,
+        //         can't be combined with "acc.sort_rays", OpenCL only)
+        // option "acc.hit_filter" values {OpenCL C source, default = ""} (any hit filter called by "bvh" traversal for every
+        //         candidate hit of closest and occlusion queries, e.g. for alpha tested geometry, the source has to define
+        //             bool rr_hit_filter(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void const* data)
+        //         returning false to skip the hit and continue traversal, data being the buffer set by SetHitFilterData,
+        //         shape ids set by Shape::SetId can index per shape data, compiled into the traversal program at commit,
+        //         can't be combined with "acc.sort_rays", OpenCL only)
+        // option "acc.custom_intersector" values {OpenCL C source, default = ""} (intersection function of primitives created
+        //         by CreateCustomPrimitives, called by 2 level BVH traversal for every primitive whose bounds the ray hits,
+        //         the source has to define
+        //             float rr_intersect_custom(ray const* r, int shape_id, int prim_id, float3 pmin, float3 pmax, float t_max, float2* uv)
+        //         returning the hit distance along the object space ray and its uv, or t_max if the primitive is missed,
+        //         shape_id being the ID of the shape attached to the scene, compiled into the traversal program at commit,
+        //         OpenCL only)
+        // option "acc.ray_format" values {"full" (ray struct, default), "compact" (ray_compact struct, 32 bytes),
+        //         "oct" (ray_oct struct with octahedral encoded direction, 20 bytes),
+        //         "soa" (12 planes holding the 4 byte words of ray structs in order, 48 bytes per ray)}
+        //         (layout of query rays, compact rays are always active with all mask bits set and are expanded
+        //         on the device before traversal, OpenCL only. "soa" rays keep all the fields of ray, planes are sized
+        //         like "soa" hit planes and embree devices support them too. Host memory queries can't use "soa" layouts)
+        // option "acc.host_chunk_size" values {int, default = 65536} (rays transferred per pinned memory chunk
+        //         by host memory queries rounded up to a multiple of 32, two chunks are in flight, OpenCL and Vulkan)
+        // option "acc.host_query_threshold" values {int, default = 0 (disabled)} (host memory queries of at most this many
+        //         rays are traced on a copy of the scene built on the host at commit, skipping kernel launches and
+        //         transfers, for latency bound picking or probe queries. Only used with "full" hit and ray formats, "int"
+        //         occlusion format and no hit filter, callback, traversal stats or motion, for triangle meshes and
+        //         instances; commit takes longer, ray masks are always applied and batches with ray flags are
+        //         traced on the device. OpenCL and Vulkan)
+        // option "acc.buffer_pool_size" values {float, default = 256} (megabytes of device memory kept by deleted buffers
+        //         and rebuilt acceleration structures for reuse by later allocations of similar size, 0 disables reuse,
+        //         Calc devices only)
+        // option "acc.memory_budget" values {float, default = 0 (no budget)} (megabytes of device memory the acceleration
+        //         structure may take, estimated before the build from face and vertex counts. While the estimate exceeds
+        //         the budget, cheaper representations are chosen in this order: no spatial splits, no precomputed triangles,
+        //         packed vertices (OpenCL only), shared bottom levels of meshes with the same geometry (2-level BVH),
+        //         compressed nodes ("fatbvh" on OpenCL). Commit throws without building if the cheapest one still
+        //         doesn't fit, see CommitStatistics::budget_steps. Structures kept for other acc.type values are released,
+        //         meshes deduplicated by the build are counted in full, CommitAsync builds in place of the previous structure
+        //         instead of aside of it, Calc devices only)
+        // option "acc.profiling" values {0(default), 1} (time acceleration structure build, refit and query kernels
+        //         on the GPU, see GetLastQueryTimings. Profiled launches are waited for, so calls become blocking, Calc devices only)
+        // option "acc.traversal_stats" values {0(default), 1} (compile traversal kernels counting visited nodes, leaves, primitive
+        //         tests and short stack spills per ray into the buffer set by SetTraversalStatsBuffer, slower traversal,
+        //         packet traversal is disabled, "bvh" and uncompressed "fatbvh" only, can't be combined with "acc.sort_rays", OpenCL only)
+        // option "acc.watertight" values {0, 1} (default = 1 for builds with the watertight premake option, 0 otherwise)
+        //         (watertight ray triangle tests and conservatively rounded box tests, rays don't leak through edges shared
+        //         by triangles, precomputed triangles store vertices instead of edges, switching is supported
+        //         by "bvh" and "fatbvh" on OpenCL, other accelerators follow the build)
+        // option "capture.path" values {string, default = "" (disabled)} (file the options and shapes of every commit and
+        //         the query batches following it are written to, for offline analysis with "Benchmark replay". Only triangle
+        //         meshes and instances are captured, rays in device memory are read back after the query, making it blocking,
+        //         "soa" rays aren't captured. Setting another path starts a new file on the next commit)
+        // option "capture.max_queries" values {int, default = 16} (intersection and occlusion batches captured after each commit)
+        // option "embree.num_threads" values {int, default = 0 (all hardware threads)} (worker threads converting and tracing rays, Embree only)
+        // option "embree.chunk_size" values {int, default = 256} (rays converted and traced by a single worker task,
+        //         rounded up to a multiple of the packet size, Embree only)
+        // option "embree.sort_rays" values {0(default), 1} (each worker orders the rays of its chunk by direction octant
+        //         and Morton code of the origin before packing them into packets and scatters the hits back,
+        //         fills packets of incoherent rays better, Embree only)
+        // option "embree.traversal" values {"auto" (widest packet the CPU supports, default), "packet4", "packet8", "packet16",
+        //         "stream" (rtcIntersectN over each chunk)} (how rays are handed over to Embree, Embree only)
+        // option "embree.build_quality" values {"auto" (default, "high" for "sah" bvh.builder, "low" for "lbvh" bvh.builder
+        //         or "hlbvh" acc.type, "medium" otherwise), "low" (dynamic scenes with the fast rebuild builder), "medium" (static
+        //         scenes), "high" (static high quality scenes with spatial splits, slowest commit, fastest traversal),
+        //         "refit" (deformable geometry refitted on vertex updates from the first one)} (builder of mesh scenes, Embree only)
+        // option "embree.compact" values {0(default), 1} (memory conservative scenes, slower traversal, Embree only)
+        // option "embree.robust" values {0(default), 1} (robust traversal not missing hits on shared edges, Embree only)
+        //         Changing "embree.build_quality", "embree.compact" or "embree.robust" rebuilds all the scenes on the next commit,
+        //         new mesh scenes are committed concurrently on "embree.num_threads" workers
+        // option "grid.density" values {float > 0, default = 2} (leaf cells per primitive of a top level cell of "grid" acc.type)
+        // option "grid.top_density" values {float > 0, default = 0.0625} (top level cells per primitive of "grid" acc.type)
+        // option "hybrid.partition" values {"replicate" (every device holds the whole scene, default), "spatial" (shapes are
+        //         split along the longest axis of the scene into one part per device with similar primitive counts,
+        //         every device traces all the rays against its part and the nearest hits are merged on the host,
+        //         for scenes not fitting into a single device)} (scene distribution of APIs created with CreateHybrid)
+        // Set API global option: string, throws for unknown options and options taking float values
         virtual void SetOption(char const* name, char const* value) = 0;
-        // Set API global option: float
+        // Set API global option: float, throws for unknown options and options taking string values
         virtual void SetOption(char const* name, float value) = 0;
+        // Get timings and acceleration structure figures of the latest Commit call
+        virtual void GetCommitStatistics(CommitStatistics& stats) const = 0;
+        // Get memory held by the API per category, including structures of all the
+        // accelerators built so far since they are kept for later "acc.type" switches.
+        // Embree scenes are not reported, only host geometry is filled for Embree devices
+        virtual void GetMemoryUsage(MemoryUsage& usage) const = 0;
+        // Copy up to maxtimings GPU kernel timings of the latest query or Commit call and return
+        // the number of recorded timings, 0 unless "acc.profiling" is enabled on a Calc device
+        virtual int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const = 0;
 
     protected:
         IntersectionApi();
@@ -323,6 +1081,7 @@ namespace RadeonRays
     inline Buffer::~Buffer(){}
     inline Shape::~Shape(){}
     inline Event::~Event(){}
+    inline QueryGraph::~QueryGraph(){}
     inline Exception::~Exception(){}
 }
 
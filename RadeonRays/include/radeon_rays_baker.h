@@ -0,0 +1,75 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#ifndef RADEON_RAYS_BAKER_H
+#define RADEON_RAYS_BAKER_H
+
+#include "radeon_rays.h"
+
+namespace RadeonRays
+{
+    // Texture space baking on top of IntersectionApi: meshes are rasterized into texel positions
+    // and normals, which are baked in tiles with fused ambient occlusion queries. Passes are
+    // accumulated progressively and tiles are scheduled over several APIs (e.g. one per device).
+    class RRAPI Baker
+    {
+    public:
+        // Called after every pass with the number of finished passes, result holds their average then
+        typedef void (*ProgressCallback)(int pass, int numpasses, void* data);
+
+        // Create a baker tracing with the APIs, each of them has to hold the same committed scene
+        // and must not be used by other threads while baking
+        static Baker* Create(IntersectionApi* const* apis, int numapis);
+        static void Delete(Baker* baker);
+
+        // Rasterize a triangle mesh into a width x height map in rows starting at v = 0. Texels whose
+        // centers are covered by a uv triangle get its interpolated position and normal (geometric normal
+        // if normals is nullptr), the rest get zero normals and bake to full visibility.
+        // Strides are in bytes, 0 means tightly packed floats. points receives width * height elements.
+        static void RasterizeUV(
+            float const* positions, int pstride,
+            float const* normals, int nstride,
+            float const* uvs, int uvstride,
+            int const* indices, int numfaces,
+            int width, int height, SurfacePoint* points);
+
+        // Size of square tiles traced by a single query, larger tiles keep devices busier
+        virtual void SetTileSize(int size) = 0;
+
+        // Bake ambient occlusion of width * height points (e.g. from RasterizeUV) into result, a float
+        // per point. Every pass traces numsamples rays of radius length per point and updates result with
+        // the average of the passes so far, callback (might be nullptr) is called after each one.
+        // The call is blocking.
+        virtual void BakeAmbientOcclusion(SurfacePoint const* points, int width, int height,
+            int numsamples, int numpasses, float radius, float* result,
+            ProgressCallback callback, void* data) = 0;
+
+    protected:
+        Baker() = default;
+        virtual ~Baker() = default;
+        Baker(Baker const&) = delete;
+        Baker& operator = (Baker const&) = delete;
+    };
+}
+
+#endif // RADEON_RAYS_BAKER_H
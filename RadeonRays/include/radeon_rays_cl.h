@@ -36,9 +36,16 @@ THE SOFTWARE.
 namespace RadeonRays {
     class IntersectionApi;
     class Buffer;
+    class Event;
 
     RRAPI IntersectionApi* CreateFromOpenClContext(cl_context context, cl_device_id device, cl_command_queue queue);
+    // Use several application queues, API queue index i submits to queues[i]
+    RRAPI IntersectionApi* CreateFromOpenClContext(cl_context context, cl_device_id device, cl_command_queue const* queues, int numqueues);
     RRAPI Buffer* CreateFromOpenClBuffer(IntersectionApi* api, cl_mem buffer);
+    // Wrap application event to be used as a wait event, the event is retained until DeleteEvent
+    RRAPI Event* CreateFromOpenClEvent(IntersectionApi* api, cl_event event);
+    // OpenCL event of an API event, valid until DeleteEvent
+    RRAPI cl_event GetOpenClEvent(IntersectionApi* api, Event const* event);
 }
 
 
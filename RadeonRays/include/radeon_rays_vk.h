@@ -27,12 +27,23 @@ THE SOFTWARE.
 #if USE_VULKAN
 
 #include "radeon_rays.h"
-namespace Anvil { class Device; class CommandPool; }
+namespace Anvil { class Device; class CommandPool; class Queue; class Buffer; class Semaphore; }
 
 namespace RadeonRays {
 
     RRAPI IntersectionApi* CreateFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool);
+    // Same as above submitting queries to the application queue (e.g. the one the renderer uses),
+    // cmd_pool has to belong to the queue family
+    RRAPI IntersectionApi* CreateFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool, Anvil::Queue* queue);
+    // Wrap application buffer for ray or hit data, no copies are made. The buffer is retained,
+    // so the application keeps its own reference.
     RRAPI Buffer* CreateFromVulkanBuffer(IntersectionApi* api, Anvil::Buffer* buffer);
+    // Make the next query wait on the device for the semaphore signalled by application work,
+    // stage_mask is VkPipelineStageFlags waiting for the semaphore
+    RRAPI void VulkanWaitSemaphore(IntersectionApi* api, Anvil::Semaphore* semaphore, std::uint32_t stage_mask);
+    // Submit queries issued so far signalling the semaphore once they have completed,
+    // so application work can consume the results without host synchronization
+    RRAPI void VulkanSignalSemaphore(IntersectionApi* api, Anvil::Semaphore* semaphore);
 }
 #endif
 
@@ -0,0 +1,395 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "binned_sah_bvh.h"
+#include "buffer.h"
+#include "primitives.h"
+#include "executable.h"
+#include "../except/except.h"
+#include "../intersector/kernel_timer.h"
+#include "../intersector/memory_usage.h"
+#include "../util/trace.h"
+#include "calc.h"
+#include "event.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <utility>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+
+#if USE_VULKAN
+#    include "RadeonRays/src/kernelcache/kernels_vk.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+#define INITIAL_TRIANGLE_CAPACITY 100000
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+    // Number of groups reducing scene bounds
+    static int const kNumReduceGroups = 64;
+    // Must match build_sah kernels: bins per axis, ints per bin,
+    // minimum primitives of tasks binned with global atomics
+    static int const kNumBins = 16;
+    static int const kBinStride = 8;
+    static int const kLargeTaskSize = 256;
+    // Size of a device side task
+    static std::size_t const kTaskSize = 2 * sizeof(bbox) + 12 * sizeof(int);
+
+    static std::size_t GlobalSize(int size)
+    {
+        return ((std::max(size, 1) + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+    }
+
+    BinnedSahBvh::BinnedSahBvh(Calc::Device* device)
+    : m_device(device)
+    , m_gpudata(new GpuData(device))
+    , m_num_prims(0)
+    , m_capacity(0)
+    , m_num_levels(0)
+    , m_timer(nullptr)
+    {
+        InitGpuData();
+    }
+
+    BinnedSahBvh::~BinnedSahBvh()
+    {
+    }
+
+    void BinnedSahBvh::AllocateBuffers(std::size_t num_prims)
+    {
+        // Release previously allocated buffers
+        m_device->DeleteBuffer(m_gpudata->bounds);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            m_device->DeleteBuffer(m_gpudata->indices[i]);
+            m_device->DeleteBuffer(m_gpudata->prim_tasks[i]);
+            m_device->DeleteBuffer(m_gpudata->tasks[i]);
+        }
+
+        m_device->DeleteBuffer(m_gpudata->bins);
+        m_device->DeleteBuffer(m_gpudata->flags);
+        m_device->DeleteBuffer(m_gpudata->offsets);
+        m_device->DeleteBuffer(m_gpudata->group_sums);
+        m_device->DeleteBuffer(m_gpudata->nodes);
+        m_device->DeleteBuffer(m_gpudata->sorted_bounds);
+
+        // Every task has at least two primitives, so do large tasks have more than kLargeTaskSize
+        std::size_t const max_tasks = num_prims / 2 + 1;
+        std::size_t const max_large_tasks = num_prims / (kLargeTaskSize + 1) + 1;
+        std::size_t const num_groups = (num_prims + kWorkGroupSize - 1) / kWorkGroupSize;
+
+        m_gpudata->bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            m_gpudata->indices[i] = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->prim_tasks[i] = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->tasks[i] = m_device->CreateBuffer(max_tasks * kTaskSize, Calc::BufferType::kWrite);
+        }
+
+        m_gpudata->bins = m_device->CreateBuffer(max_large_tasks * 3 * kNumBins * kBinStride * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->flags = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->offsets = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->group_sums = m_device->CreateBuffer(std::max<std::size_t>(num_groups, 1) * sizeof(int), Calc::BufferType::kWrite);
+
+        m_gpudata->nodes = m_device->CreateBuffer(2 * num_prims * 4 * sizeof(int), Calc::BufferType::kWrite);
+        // Both internal nodes and leaves have bounds
+        m_gpudata->sorted_bounds = m_device->CreateBuffer(2 * num_prims * sizeof(bbox), Calc::BufferType::kWrite);
+
+        m_capacity = static_cast<int>(num_prims);
+    }
+
+    void BinnedSahBvh::InitGpuData()
+    {
+#ifndef RR_EMBED_KERNELS
+        if ( m_device->GetPlatform() == Calc::Platform::kOpenCL )
+        {
+            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_sah.cl", nullptr, 0, nullptr );
+        }
+
+        else
+        {
+            assert( m_device->GetPlatform() == Calc::Platform::kVulkan );
+            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/GLSL/build_sah.comp", nullptr, 0, nullptr );
+        }
+#else
+        auto& device = m_device;
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_build_sah_opencl, std::strlen(g_build_sah_opencl), nullptr);
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_build_sah_vulkan, std::strlen(g_build_sah_vulkan), nullptr);
+        }
+#endif
+
+#endif
+        m_gpudata->clear_bins_func = m_gpudata->executable->CreateFunction("clear_bins_main");
+        m_gpudata->reduce_func = m_gpudata->executable->CreateFunction("reduce_bounds_main");
+        m_gpudata->init_func = m_gpudata->executable->CreateFunction("init_build_main");
+        m_gpudata->bin_func = m_gpudata->executable->CreateFunction("bin_main");
+        m_gpudata->split_func = m_gpudata->executable->CreateFunction("split_main");
+        m_gpudata->flag_func = m_gpudata->executable->CreateFunction("flag_left_main");
+        m_gpudata->scatter_func = m_gpudata->executable->CreateFunction("scatter_main");
+
+        // Partition offsets come from parallel primitives if the device has them,
+        // Vulkan devices scan with the kernels of the build program
+        if (m_device->HasBuiltinPrimitives())
+        {
+            m_gpudata->pp = m_device->CreatePrimitives();
+        }
+        else
+        {
+            m_gpudata->scan_groups_func = m_gpudata->executable->CreateFunction("scan_groups_main");
+            m_gpudata->scan_sums_func = m_gpudata->executable->CreateFunction("scan_group_sums_main");
+            m_gpudata->add_sums_func = m_gpudata->executable->CreateFunction("add_group_sums_main");
+        }
+
+        m_gpudata->root_bin = m_device->CreateBuffer(kBinStride * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->counters = m_device->CreateBuffer(4 * sizeof(int), Calc::BufferType::kWrite);
+
+        // Allocate GPU buffers
+        AllocateBuffers(INITIAL_TRIANGLE_CAPACITY);
+    }
+
+    void BinnedSahBvh::Build(bbox const* bounds, int numbounds)
+    {
+        if (numbounds > m_capacity)
+        {
+            AllocateBuffers(numbounds);
+        }
+
+        // Write bounds buffer
+        {
+            bbox* tmp = nullptr;
+            m_device->MapBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
+            m_device->Finish(0);
+            std::memcpy(tmp, bounds, sizeof(bbox) * numbounds);
+            m_device->UnmapBuffer(m_gpudata->bounds, 0, tmp, nullptr);
+        }
+
+        Build(m_gpudata->bounds, numbounds);
+    }
+
+    void BinnedSahBvh::Build(Calc::Buffer const* bounds, int numbounds)
+    {
+        TraceScope trace("BinnedSahBvh::Build", "builder");
+#ifdef RR_PROFILE
+        auto s = std::chrono::high_resolution_clock::now();
+#endif
+        ThrowIf(numbounds <= 0, "Binned SAH BVH needs at least one primitive");
+
+        int size = numbounds;
+
+        if (size > m_capacity)
+        {
+            AllocateBuffers(size);
+        }
+
+        m_num_prims = size;
+        m_num_levels = 0;
+
+        // Scene bounds are reduced into the root bin
+        int num_root_bins = 1;
+
+        int arg = 0;
+        m_gpudata->clear_bins_func->SetArg(arg++, m_gpudata->root_bin);
+        m_gpudata->clear_bins_func->SetArg(arg++, sizeof(num_root_bins), &num_root_bins);
+        m_gpudata->clear_bins_func->SetArg(arg++, m_gpudata->counters);
+        Execute("sah_clear_bins", m_gpudata->clear_bins_func, GlobalSize(kBinStride));
+
+        arg = 0;
+        m_gpudata->reduce_func->SetArg(arg++, bounds);
+        m_gpudata->reduce_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->reduce_func->SetArg(arg++, m_gpudata->root_bin);
+        Execute("sah_reduce_bounds", m_gpudata->reduce_func, kNumReduceGroups * kWorkGroupSize);
+
+        arg = 0;
+        m_gpudata->init_func->SetArg(arg++, bounds);
+        m_gpudata->init_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->root_bin);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->indices[0]);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->prim_tasks[0]);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->tasks[0]);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->counters);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->init_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        Execute("sah_init", m_gpudata->init_func, GlobalSize(size));
+
+        // Split one level of the tree at a time until all the tasks are single primitives
+        int cur = 0;
+        int counts[2] = { size > 1 ? 1 : 0, size > kLargeTaskSize ? 1 : 0 };
+
+        while (counts[0] > 0)
+        {
+            int num_tasks = counts[0];
+            int num_large_tasks = counts[1];
+            int const next = 1 - cur;
+
+            // Reset bins of large tasks and task counters of the next level
+            arg = 0;
+            m_gpudata->clear_bins_func->SetArg(arg++, m_gpudata->bins);
+            m_gpudata->clear_bins_func->SetArg(arg++, sizeof(num_large_tasks), &num_large_tasks);
+            m_gpudata->clear_bins_func->SetArg(arg++, m_gpudata->counters);
+            Execute("sah_clear_bins", m_gpudata->clear_bins_func, GlobalSize(num_large_tasks * 3 * kNumBins * kBinStride));
+
+            if (num_large_tasks > 0)
+            {
+                arg = 0;
+                m_gpudata->bin_func->SetArg(arg++, bounds);
+                m_gpudata->bin_func->SetArg(arg++, m_gpudata->indices[cur]);
+                m_gpudata->bin_func->SetArg(arg++, m_gpudata->prim_tasks[cur]);
+                m_gpudata->bin_func->SetArg(arg++, sizeof(size), &size);
+                m_gpudata->bin_func->SetArg(arg++, m_gpudata->tasks[cur]);
+                m_gpudata->bin_func->SetArg(arg++, m_gpudata->bins);
+                Execute("sah_bin", m_gpudata->bin_func, GlobalSize(size));
+            }
+
+            arg = 0;
+            m_gpudata->split_func->SetArg(arg++, bounds);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->indices[cur]);
+            m_gpudata->split_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->tasks[cur]);
+            m_gpudata->split_func->SetArg(arg++, sizeof(num_tasks), &num_tasks);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->bins);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->tasks[next]);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->counters);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->split_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            Execute("sah_split", m_gpudata->split_func, GlobalSize(num_tasks));
+
+            arg = 0;
+            m_gpudata->flag_func->SetArg(arg++, bounds);
+            m_gpudata->flag_func->SetArg(arg++, m_gpudata->indices[cur]);
+            m_gpudata->flag_func->SetArg(arg++, m_gpudata->prim_tasks[cur]);
+            m_gpudata->flag_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->flag_func->SetArg(arg++, m_gpudata->tasks[cur]);
+            m_gpudata->flag_func->SetArg(arg++, m_gpudata->flags);
+            Execute("sah_flag", m_gpudata->flag_func, GlobalSize(size));
+
+            Scan(m_gpudata->flags, m_gpudata->offsets, size);
+
+            arg = 0;
+            m_gpudata->scatter_func->SetArg(arg++, bounds);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->indices[cur]);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->prim_tasks[cur]);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->flags);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->offsets);
+            m_gpudata->scatter_func->SetArg(arg++, sizeof(size), &size);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->tasks[cur]);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->indices[next]);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->prim_tasks[next]);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->nodes);
+            m_gpudata->scatter_func->SetArg(arg++, m_gpudata->sorted_bounds);
+            Execute("sah_scatter", m_gpudata->scatter_func, GlobalSize(size));
+
+            // Tasks of the next level
+            m_device->ReadBuffer(m_gpudata->counters, 0, 0, sizeof(counts), counts, nullptr);
+            m_device->Finish(0);
+
+            cur = next;
+            ++m_num_levels;
+        }
+
+#ifdef RR_PROFILE
+        auto d = std::chrono::high_resolution_clock::now() - s;
+        std::cout << "Binned SAH BVH construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms, " << m_num_levels << " levels\n";
+#endif
+    }
+
+    void BinnedSahBvh::Scan(Calc::Buffer const* from, Calc::Buffer* to, int size)
+    {
+        if (m_gpudata->pp)
+        {
+            m_gpudata->pp->ScanExclusiveAddInt32(0, from, to, size);
+            return;
+        }
+
+        int num_groups = (size + kWorkGroupSize - 1) / kWorkGroupSize;
+
+        int arg = 0;
+        m_gpudata->scan_groups_func->SetArg(arg++, from);
+        m_gpudata->scan_groups_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->scan_groups_func->SetArg(arg++, to);
+        m_gpudata->scan_groups_func->SetArg(arg++, m_gpudata->group_sums);
+        Execute("sah_scan", m_gpudata->scan_groups_func, GlobalSize(size));
+
+        arg = 0;
+        m_gpudata->scan_sums_func->SetArg(arg++, m_gpudata->group_sums);
+        m_gpudata->scan_sums_func->SetArg(arg++, sizeof(num_groups), &num_groups);
+        Execute("sah_scan", m_gpudata->scan_sums_func, kWorkGroupSize);
+
+        arg = 0;
+        m_gpudata->add_sums_func->SetArg(arg++, to);
+        m_gpudata->add_sums_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->add_sums_func->SetArg(arg++, m_gpudata->group_sums);
+        Execute("sah_scan", m_gpudata->add_sums_func, GlobalSize(size));
+    }
+
+    void BinnedSahBvh::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->nodes);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+
+        for (int i = 0; i < 2; ++i)
+        {
+            AddBufferBytes(usage.scratch_bytes, m_gpudata->indices[i]);
+            AddBufferBytes(usage.scratch_bytes, m_gpudata->prim_tasks[i]);
+            AddBufferBytes(usage.scratch_bytes, m_gpudata->tasks[i]);
+        }
+
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bins);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->root_bin);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->counters);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->flags);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->offsets);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->group_sums);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_bounds);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+
+    void BinnedSahBvh::Execute(char const* name, Calc::Function const* func, std::size_t global_size) const
+    {
+        if (m_timer)
+        {
+            m_timer->Execute(name, func, 0, global_size, kWorkGroupSize, nullptr);
+        }
+        else
+        {
+            m_device->Execute(func, 0, global_size, kWorkGroupSize, nullptr);
+        }
+    }
+}
@@ -0,0 +1,217 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BINNED_SAH_BVH_H
+#define BINNED_SAH_BVH_H
+
+#include "calc.h"
+#include "device.h"
+#include "executable.h"
+#include "radeon_rays.h"
+#include "math/bbox.h"
+
+#include <memory>
+
+namespace RadeonRays
+{
+    class KernelTimer;
+
+    ///< The class represents binned SAH BVH constructed fully on GPU.
+    ///< Levels of the tree are split breadth first: primitives of large tasks
+    ///< are binned in parallel with global atomics, small tasks are binned
+    ///< by a single work item, and primitives are partitioned into child
+    ///< ranges with an exclusive scan. Nodes use Hlbvh layout.
+    ///
+    class BinnedSahBvh
+    {
+    public:
+        BinnedSahBvh(Calc::Device* device);
+
+        virtual ~BinnedSahBvh();
+
+        // Build function
+        void Build(bbox const* bounds, int numbounds);
+
+        // Build from primitive bounds already in device memory. The host
+        // waits for the task count after each level of the tree.
+        void Build(Calc::Buffer const* bounds, int numbounds);
+
+        // This class has its own GPU data,
+        // and it provides it as an interface in GPU memory
+        struct GpuData;
+        GpuData const& GetGpuData() const { return *m_gpudata; }
+
+        // Number of primitives of the last build
+        int GetNumPrims() const { return m_num_prims; }
+
+        // Number of tree levels split by the last build
+        int GetNumLevels() const { return m_num_levels; }
+
+        // Time build kernels with the timer of the owning intersector (nullptr: no timing)
+        void SetTimer(KernelTimer const* timer) { m_timer = timer; }
+
+        // Add nodes, build temporaries and the build program to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        void InitGpuData();
+        void AllocateBuffers(std::size_t numprims);
+        // Exclusive scan of size ints, with parallel primitives if the device has them
+        void Scan(Calc::Buffer const* from, Calc::Buffer* to, int size);
+        // Launch a build kernel on queue 0, timed if there is a timer
+        void Execute(char const* name, Calc::Function const* func, std::size_t global_size) const;
+
+        BinnedSahBvh(BinnedSahBvh const&);
+        BinnedSahBvh& operator = (BinnedSahBvh const&);
+
+        // Context for GPU work submision
+        Calc::Device* m_device;
+
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+
+        // Number of primitives of the last build
+        int m_num_prims;
+        // Number of primitives GPU buffers can hold
+        int m_capacity;
+        // Number of tree levels of the last build
+        int m_num_levels;
+        // Build kernel timer (nullptr if not set)
+        KernelTimer const* m_timer;
+    };
+
+    struct BinnedSahBvh::GpuData
+    {
+        // Device
+        Calc::Device* device;
+
+        // Parallel primitives, nullptr if the device has none
+        Calc::Primitives* pp;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* clear_bins_func;
+        Calc::Function* reduce_func;
+        Calc::Function* init_func;
+        Calc::Function* bin_func;
+        Calc::Function* split_func;
+        Calc::Function* flag_func;
+        Calc::Function* scatter_func;
+        // Scan used when there are no parallel primitives
+        Calc::Function* scan_groups_func;
+        Calc::Function* scan_sums_func;
+        Calc::Function* add_sums_func;
+
+        // Primitive bounds uploaded by the host
+        Calc::Buffer* bounds;
+        // Primitive indices and their tasks, ping-ponged between levels
+        Calc::Buffer* indices[2];
+        Calc::Buffer* prim_tasks[2];
+        // Split tasks of the current and next levels
+        Calc::Buffer* tasks[2];
+        // Bins of large tasks and the root bounds
+        Calc::Buffer* bins;
+        Calc::Buffer* root_bin;
+        // Task and node counters
+        Calc::Buffer* counters;
+        // Left side flags and their exclusive scan
+        Calc::Buffer* flags;
+        Calc::Buffer* offsets;
+        Calc::Buffer* group_sums;
+
+        // Nodes: first N-1 - internal nodes, last N - leafs
+        Calc::Buffer* nodes;
+        // Bounds of both internal nodes and leaves
+        Calc::Buffer* sorted_bounds;
+
+        GpuData(Calc::Device* dev)
+            : device(dev)
+            , pp(nullptr)
+            , executable(nullptr)
+            , clear_bins_func(nullptr)
+            , reduce_func(nullptr)
+            , init_func(nullptr)
+            , bin_func(nullptr)
+            , split_func(nullptr)
+            , flag_func(nullptr)
+            , scatter_func(nullptr)
+            , scan_groups_func(nullptr)
+            , scan_sums_func(nullptr)
+            , add_sums_func(nullptr)
+            , bounds(nullptr)
+            , indices{ nullptr, nullptr }
+            , prim_tasks{ nullptr, nullptr }
+            , tasks{ nullptr, nullptr }
+            , bins(nullptr)
+            , root_bin(nullptr)
+            , counters(nullptr)
+            , flags(nullptr)
+            , offsets(nullptr)
+            , group_sums(nullptr)
+            , nodes(nullptr)
+            , sorted_bounds(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(clear_bins_func);
+                executable->DeleteFunction(reduce_func);
+                executable->DeleteFunction(init_func);
+                executable->DeleteFunction(bin_func);
+                executable->DeleteFunction(split_func);
+                executable->DeleteFunction(flag_func);
+                executable->DeleteFunction(scatter_func);
+                executable->DeleteFunction(scan_groups_func);
+                executable->DeleteFunction(scan_sums_func);
+                executable->DeleteFunction(add_sums_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
+
+            device->DeleteBuffer(bounds);
+
+            for (int i = 0; i < 2; ++i)
+            {
+                device->DeleteBuffer(indices[i]);
+                device->DeleteBuffer(prim_tasks[i]);
+                device->DeleteBuffer(tasks[i]);
+            }
+
+            device->DeleteBuffer(bins);
+            device->DeleteBuffer(root_bin);
+            device->DeleteBuffer(counters);
+            device->DeleteBuffer(flags);
+            device->DeleteBuffer(offsets);
+            device->DeleteBuffer(group_sums);
+            device->DeleteBuffer(nodes);
+            device->DeleteBuffer(sorted_bounds);
+        }
+    };
+}
+
+#endif // BINNED_SAH_BVH_H
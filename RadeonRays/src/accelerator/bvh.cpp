@@ -25,13 +25,30 @@ THE SOFTWARE.
 #include <thread>
 #include <stack>
 #include <numeric>
+#include <queue>
 #include <cassert>
 #include <vector>
 #include <future>
+#include <cmath>
+
+#include "../async/task_scheduler.h"
+#include "../util/build_arena.h"
+#include "../util/trace.h"
 
 namespace RadeonRays
 {
-    static int constexpr kMaxPrimitivesPerLeaf = 1;
+    // Minimum number of primitives to use parallel build at all
+    static int constexpr kParallelBuildThreshold = 1 << 14;
+    // Minimum number of primitives in a subtree to spawn a task for it
+    static int constexpr kParallelSubtreeThreshold = 1 << 12;
+    // Minimum number of primitives in a node to bin in parallel
+    static int constexpr kParallelBinningThreshold = 1 << 16;
+    // Number of primitives binned by a single task
+    static int constexpr kBinningChunkSize = 1 << 14;
+    // Passes over the tree rotating subtrees for ray samples
+    static int constexpr kMaxRotationPasses = 4;
+    // Smallest probability decrease a rotation has to bring, keeps rounding noise from rotating back and forth
+    static float constexpr kMinRotationGain = 1e-6f;
 
     static bool is_nan(float v)
     {
@@ -40,13 +57,74 @@ namespace RadeonRays
 
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
+        TraceScope trace("Bvh::Build", "builder");
+
         for (int i = 0; i < numbounds; ++i)
         {
             // Calc bbox
             m_bounds.grow(bounds[i]);
         }
 
+        m_flat = false;
         BuildImpl(bounds, numbounds);
+
+        if (m_ray_samples && m_num_ray_samples > 0 && m_ray_weight > 0.f)
+        {
+            RotateForRaySamples();
+        }
+
+        if (m_area_order)
+        {
+            OrderChildrenByArea();
+        }
+    }
+
+    void Bvh::BuildFlat(bbox const* bounds, int numbounds, bbox* nodes)
+    {
+        TraceScope trace("Bvh::BuildFlat", "builder");
+        assert(m_max_leaf_size == 1);
+
+        for (int i = 0; i < numbounds; ++i)
+        {
+            // Calc bbox
+            m_bounds.grow(bounds[i]);
+        }
+
+        // Children are ordered by area while splitting
+        m_flat_nodes = nodes;
+        m_flat = true;
+
+        struct FlatGuard
+        {
+            Bvh* bvh;
+            ~FlatGuard() { bvh->m_flat_nodes = nullptr; }
+        } guard = { this };
+
+        Bvh::BuildImpl(bounds, numbounds);
+
+        // Nodes are contiguous, so SAH cost is a linear pass rather than a tree walk
+        float root_area = m_bounds.surface_area();
+        m_flat_sah_cost = 0.f;
+
+        if (root_area > 0.f)
+        {
+            for (int i = 0; i < m_nodecnt; ++i)
+            {
+                float probability = nodes[i].surface_area() / root_area;
+                m_flat_sah_cost += probability * (nodes[i].pmin.w == -1.f ? m_traversal_cost : 1.f);
+            }
+        }
+    }
+
+    void Bvh::WriteFlatNode(SplitRequest const& req, Node const& node) const
+    {
+        bbox& flat = m_flat_nodes[req.address];
+        flat = node.bounds;
+
+        // Subtree of n primitives takes 2n - 1 nodes, the node following it is the skip link
+        int next = req.address + 2 * req.numprims - 1;
+        flat.pmax.w = next == m_nodecnt ? -1.f : (float)next;
+        flat.pmin.w = node.type == kLeaf ? (float)((node.startidx << 4) | (node.numprims & 0xF)) : -1.f;
     }
 
     bbox const& Bvh::Bounds() const
@@ -65,31 +143,332 @@ namespace RadeonRays
         return &m_nodes[m_nodecnt++];
     }
 
+    void Bvh::UpdateHeight(int level)
+    {
+        int height = m_height.load();
+        while (height < level && !m_height.compare_exchange_weak(height, level))
+        {
+        }
+    }
+
+    void Bvh::OrderChildrenByArea()
+    {
+        std::vector<Node*> stack;
+
+        if (m_root)
+        {
+            stack.push_back(m_root);
+        }
+
+        while (!stack.empty())
+        {
+            Node* node = stack.back();
+            stack.pop_back();
+
+            if (node->type == kInternal)
+            {
+                if (node->rc->bounds.surface_area() > node->lc->bounds.surface_area())
+                {
+                    std::swap(node->lc, node->rc);
+                }
+
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+        }
+    }
+
+    struct Bvh::RaySample
+    {
+        float3 o;
+        float3 invd;
+        float maxt;
+    };
+
+    int Bvh::CountHits(std::vector<RaySample> const& rays, std::vector<int> const& ids, bbox const& b, std::vector<int>* hits)
+    {
+        int count = 0;
+
+        for (auto id : ids)
+        {
+            if (IntersectsBox(rays[id], b))
+            {
+                ++count;
+
+                if (hits)
+                {
+                    hits->push_back(id);
+                }
+            }
+        }
+
+        return count;
+    }
+
+    bool Bvh::IntersectsBox(RaySample const& r, bbox const& b)
+    {
+        float tmin = 0.f;
+        float tmax = r.maxt;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float t0 = (b.pmin[axis] - r.o[axis]) * r.invd[axis];
+            float t1 = (b.pmax[axis] - r.o[axis]) * r.invd[axis];
+            tmin = std::max(tmin, std::min(t0, t1));
+            tmax = std::min(tmax, std::max(t0, t1));
+        }
+
+        return tmin <= tmax;
+    }
+
+    void Bvh::RotateForRaySamples()
+    {
+        TraceScope trace("Bvh::RotateForRaySamples", "builder");
+
+        float root_area = m_bounds.surface_area();
+
+        if (!m_root || m_root->type != kInternal || root_area <= 0.f)
+        {
+            return;
+        }
+
+        // Only rays reaching the scene tell anything about the nodes
+        std::vector<RaySample> rays;
+        rays.reserve(m_num_ray_samples);
+
+        for (int i = 0; i < m_num_ray_samples; ++i)
+        {
+            ray const& r = m_ray_samples[i];
+
+            if (!r.IsActive())
+            {
+                continue;
+            }
+
+            RaySample sample;
+            sample.o = float3(r.o.x, r.o.y, r.o.z);
+            sample.maxt = r.GetMaxT();
+
+            // Huge finite inverse keeps slab tests of axis parallel rays free of NaNs
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float d = r.d[axis];
+                sample.invd[axis] = std::abs(d) > 1e-20f ? 1.f / d : std::copysign(1e20f, d);
+            }
+
+            if (IntersectsBox(sample, m_bounds))
+            {
+                rays.push_back(sample);
+            }
+        }
+
+        if (rays.empty())
+        {
+            return;
+        }
+
+        float const area_scale = (1.f - m_ray_weight) / root_area;
+        float const ray_scale = m_ray_weight / rays.size();
+
+        std::vector<int> all(rays.size());
+        std::iota(all.begin(), all.end(), 0);
+
+        bool rotated = false;
+
+        for (int pass = 0; pass < kMaxRotationPasses; ++pass)
+        {
+            bool changed = false;
+
+            // Top down, rotations only change nodes below the current one
+            std::vector<std::pair<Node*, std::vector<int>>> stack;
+            stack.emplace_back(m_root, all);
+
+            while (!stack.empty())
+            {
+                Node* node = stack.back().first;
+                std::vector<int> ids = std::move(stack.back().second);
+                stack.pop_back();
+
+                changed = RotateNode(node, rays, ids, area_scale, ray_scale) || changed;
+
+                for (auto child : { node->lc, node->rc })
+                {
+                    if (child->type == kInternal)
+                    {
+                        std::vector<int> hits;
+                        CountHits(rays, ids, child->bounds, &hits);
+                        stack.emplace_back(child, std::move(hits));
+                    }
+                }
+            }
+
+            rotated = rotated || changed;
+
+            if (!changed)
+            {
+                break;
+            }
+        }
+
+        if (rotated)
+        {
+            UpdateTreeFigures();
+        }
+    }
+
+    bool Bvh::RotateNode(Node* node, std::vector<RaySample> const& rays, std::vector<int> const& ids,
+        float area_scale, float ray_scale) const
+    {
+        // A rotation swaps a child with a grandchild under the other child, only the bounds
+        // of the other child change, so the change of its probability is the change of the cost
+        float best = -kMinRotationGain;
+        Node** best_child = nullptr;
+        Node** best_grandchild = nullptr;
+        Node* best_parent = nullptr;
+        bbox best_bounds;
+
+        for (int side = 0; side < 2; ++side)
+        {
+            Node** child = side ? &node->rc : &node->lc;
+            Node* other = side ? node->lc : node->rc;
+
+            if (other->type != kInternal)
+            {
+                continue;
+            }
+
+            float current = area_scale * other->bounds.surface_area() +
+                ray_scale * CountHits(rays, ids, other->bounds, nullptr);
+
+            for (int g = 0; g < 2; ++g)
+            {
+                Node** grandchild = g ? &other->rc : &other->lc;
+                Node const* kept = g ? other->lc : other->rc;
+
+                bbox bounds = (*child)->bounds;
+                bounds.grow(kept->bounds);
+
+                float rotated = area_scale * bounds.surface_area() +
+                    ray_scale * CountHits(rays, ids, bounds, nullptr);
+
+                if (rotated - current < best)
+                {
+                    best = rotated - current;
+                    best_child = child;
+                    best_grandchild = grandchild;
+                    best_parent = other;
+                    best_bounds = bounds;
+                }
+            }
+        }
+
+        if (!best_child)
+        {
+            return false;
+        }
+
+        std::swap(*best_child, *best_grandchild);
+        best_parent->bounds = best_bounds;
+        return true;
+    }
+
+    void Bvh::UpdateTreeFigures()
+    {
+        // Builds without complete tree indices leave them zero
+        bool const indexed = m_root->index != 0;
+
+        int height = 0;
+        std::vector<std::pair<Node*, int>> stack(1, std::make_pair(m_root, 0));
+
+        while (!stack.empty())
+        {
+            Node* node = stack.back().first;
+            int level = stack.back().second;
+            stack.pop_back();
+
+            height = std::max(height, level);
+
+            if (node->type == kInternal)
+            {
+                if (indexed)
+                {
+                    node->lc->index = node->index << 1;
+                    node->rc->index = (node->index << 1) + 1;
+                }
+
+                stack.push_back(std::make_pair(node->lc, level + 1));
+                stack.push_back(std::make_pair(node->rc, level + 1));
+            }
+        }
+
+        m_height = height;
+    }
+
+    void Bvh::RunBuild(int numbounds, std::function<void()> const& build)
+    {
+        if (numbounds < kParallelBuildThreshold ||
+            (!m_external_scheduler && (m_num_threads == 1 ||
+            (m_num_threads <= 0 && std::thread::hardware_concurrency() < 2))))
+        {
+            build();
+            return;
+        }
+
+        // Create own scheduler unless we were given one
+        std::unique_ptr<task_scheduler> own_scheduler;
+        if (!m_external_scheduler)
+        {
+            own_scheduler.reset(new task_scheduler(m_num_threads));
+        }
+
+        task_scheduler& scheduler = m_external_scheduler ? *m_external_scheduler : *own_scheduler;
+        task_group group;
+
+        m_scheduler = &scheduler;
+        m_build_group = &group;
+
+        // Reset scheduler pointers on exit, even if the build throws
+        struct SchedulerGuard
+        {
+            Bvh* bvh;
+            ~SchedulerGuard() { bvh->m_scheduler = nullptr; bvh->m_build_group = nullptr; }
+        } guard = { this };
+
+        try
+        {
+            build();
+        }
+        catch (...)
+        {
+            // Let spawned tasks finish before the data goes away
+            try { scheduler.wait(group); } catch (...) {}
+            throw;
+        }
+
+        scheduler.wait(group);
+    }
+
     void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
-        Node* node = AllocateNode();
+        // Flat build only needs the node until it is written
+        Node flatnode;
+        Node* node = m_flat_nodes ? &flatnode : AllocateNode();
         node->bounds = req.bounds;
         node->index = req.index;
 
         // Create leaf node if we have enough prims
+        // Partitioning is done in place, so leaves reference
+        // their ranges of primindices directly and the array
+        // becomes packed indices once the build is finished.
         if (req.numprims < 2)
         {
-#ifdef USE_TBB
-            primitive_mutex_.lock();
-#endif
             node->type = kLeaf;
-            node->startidx = static_cast<int>(m_packed_indices.size());
+            node->startidx = req.startidx;
             node->numprims = req.numprims;
 
-            for (auto i = 0U; i < req.numprims; ++i)
-            {
-                m_packed_indices.push_back(primindices[req.startidx + i]);
-            }
-#ifdef USE_TBB
-            primitive_mutex_.unlock();
-#endif
+            if (m_flat_nodes) WriteFlatNode(req, *node);
         }
         else
         {
@@ -101,25 +480,24 @@ namespace RadeonRays
             {
                 SahSplit ss = FindSahSplit(req, bounds, centroids, primindices);
 
+                // Leaf cost is a single intersection per primitive,
+                // primitives with coincident centroids can't be split
+                // by SAH at all, so keep them together if they fit
+                if (req.numprims <= m_max_leaf_size &&
+                    (is_nan(ss.split) || req.numprims < ss.sah))
+                {
+                    node->type = kLeaf;
+                    node->startidx = req.startidx;
+                    node->numprims = req.numprims;
+
+                    if (req.ptr) *req.ptr = node;
+                    return;
+                }
+
                 if (!is_nan(ss.split))
                 {
                     axis = ss.dim;
                     border = ss.split;
-
-                    if (req.numprims < ss.sah && req.numprims < kMaxPrimitivesPerLeaf)
-                    {
-                        node->type = kLeaf;
-                        node->startidx = static_cast<int>(m_packed_indices.size());
-                        node->numprims = req.numprims;
-
-                        for (auto i = 0U; i < req.numprims; ++i)
-                        {
-                            m_packed_indices.push_back(primindices[req.startidx + i]);
-                        }
-
-                        if (req.ptr) *req.ptr = node;
-                        return;
-                    }
                 }
             }
 
@@ -224,16 +602,42 @@ namespace RadeonRays
             }
 
             // Left request
-            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1) };
+            SplitRequest leftrequest = { req.startidx, splitidx - req.startidx, &node->lc, leftbounds, leftcentroid_bounds, req.level + 1, (req.index << 1), req.address + 1 };
             // Right request
-            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1 };
+            SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1, (req.index << 1) + 1, 0 };
 
+            if (m_flat_nodes)
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
+                // Children follow the parent depth first, larger one first if requested
+                leftrequest.ptr = rightrequest.ptr = nullptr;
+
+                if (m_area_order && rightbounds.surface_area() > leftbounds.surface_area())
+                {
+                    leftrequest.address = req.address + 2 * rightrequest.numprims;
+                    rightrequest.address = req.address + 1;
+                }
+                else
+                {
+                    rightrequest.address = req.address + 2 * leftrequest.numprims;
+                }
+
+                WriteFlatNode(req, *node);
             }
 
+            // Large subtrees are handed over to the scheduler, idle
+            // workers steal them while we descend into the left one
+            if (m_scheduler && rightrequest.numprims >= kParallelSubtreeThreshold)
+            {
+                m_scheduler->spawn(*m_build_group, [this, rightrequest, bounds, centroids, primindices]()
+                {
+                    BuildNode(rightrequest, bounds, centroids, primindices);
+                });
+
+                BuildNode(leftrequest, bounds, centroids, primindices);
+            }
+            else
             {
+                BuildNode(leftrequest, bounds, centroids, primindices);
                 BuildNode(rightrequest, bounds, centroids, primindices);
             }
         }
@@ -246,14 +650,11 @@ namespace RadeonRays
     {
         // SAH implementation
         // calc centroids histogram
-        // int const kNumBins = 128;
-        // moving split bin index
-        int splitidx = -1;
-        // Set SAH to maximum float value as a start
-        float sah = std::numeric_limits<float>::max();
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = std::numeric_limits<float>::max();
+        split.overlap = 0.f;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -265,59 +666,113 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
-        {
-            bbox bounds;
-            int count;
-        };
+        // Keep bins for all dimensions, all the axes are binned
+        // in a single pass over the primitives
+        BuildArena::Scope scope;
+        std::vector<Bin, BuildArena::Allocator<Bin>> bins(3 * m_num_bins, Bin{ bbox(), 0 });
 
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
-
-        // Precompute inverse parent area
-        float invarea = 1.f / req.bounds.surface_area();
-        // Precompute min point
+        // Precompute min point and inverse ranges for histogram
         float3 rootmin = req.centroid_bounds.pmin;
+        float3 invrng = GetInvCentroidRange(req.centroid_bounds);
 
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
+        // Calc primitive refs histogram for a range of primitives
+        auto calc_histogram = [=](int begin, int end, Bin* histogram)
         {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            float centroid_rng = centroid_extents[axis];
-            float invcentroid_rng = 1.f / centroid_rng;
+            for (int i = begin; i < end; ++i)
+            {
+                int idx = primindices[i];
+                AddToBins(bounds[idx], centroids[idx], rootmin, invrng, histogram);
+            }
+        };
 
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
+        if (m_scheduler && req.numprims >= kParallelBinningThreshold)
+        {
+            // Bin chunks of primitives into private histograms
+            // and merge them afterwards
+            int num_chunks = (req.numprims + kBinningChunkSize - 1) / kBinningChunkSize;
+            std::vector<Bin, BuildArena::Allocator<Bin>> chunk_bins(num_chunks * 3 * m_num_bins, Bin{ bbox(), 0 });
 
-            // Initialize bins
-            for (unsigned i = 0; i < m_num_bins; ++i)
+            task_group group;
+            for (int c = 0; c < num_chunks; ++c)
             {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
+                int begin = req.startidx + c * kBinningChunkSize;
+                int end = std::min(begin + kBinningChunkSize, req.startidx + req.numprims);
+                Bin* histogram = &chunk_bins[c * 3 * m_num_bins];
+
+                m_scheduler->spawn(group, [=]() { calc_histogram(begin, end, histogram); });
             }
 
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                int idx = primindices[i];
-                int binidx = (int)std::min<float>(m_num_bins * ((centroids[idx][axis] - rootminc) * invcentroid_rng), m_num_bins - 1);
+            m_scheduler->wait(group);
 
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(bounds[idx]);
+            for (int c = 0; c < num_chunks; ++c)
+            {
+                MergeBins(&chunk_bins[c * 3 * m_num_bins], &bins[0]);
             }
+        }
+        else
+        {
+            calc_histogram(req.startidx, req.startidx + req.numprims, &bins[0]);
+        }
 
-            std::vector<bbox> rightbounds(m_num_bins - 1);
+        return SweepBins(req, invrng, &bins[0]);
+    }
+
+    float3 Bvh::GetInvCentroidRange(bbox const& centroid_bounds)
+    {
+        float3 centroid_extents = centroid_bounds.extents();
+        float3 invrng;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // Degenerate axes put everything into the first bin
+            // and are skipped by the sweep
+            invrng[axis] = centroid_extents[axis] == 0.f ? 0.f : 1.f / centroid_extents[axis];
+        }
+
+        return invrng;
+    }
+
+    void Bvh::MergeBins(Bin const* other, Bin* bins) const
+    {
+        for (int i = 0; i < 3 * m_num_bins; ++i)
+        {
+            bins[i].count += other[i].count;
+            GrowBin(other[i].bounds, bins[i].bounds);
+        }
+    }
+
+    Bvh::SahSplit Bvh::SweepBins(SplitRequest const& req, float3 const& invrng, Bin const* bins) const
+    {
+        // moving split bin index
+        int splitidx = -1;
+        // Set SAH to maximum float value as a start
+        float sah = std::numeric_limits<float>::max();
+        SahSplit split;
+        split.dim = 0;
+        split.split = std::numeric_limits<float>::quiet_NaN();
+        split.sah = sah;
+        split.overlap = 0.f;
+
+        // Precompute inverse parent area
+        float invarea = 1.f / req.bounds.surface_area();
+        float3 centroid_extents = req.centroid_bounds.extents();
+
+        BuildArena::Scope scope;
+        std::vector<bbox, BuildArena::Allocator<bbox>> rightbounds(m_num_bins - 1);
+
+        // Evaluate all dimensions
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            // If the box is degenerate in that dimension skip it
+            if (invrng[axis] == 0.f) continue;
+
+            Bin const* axisbins = bins + axis * m_num_bins;
 
             // Start with 1-bin right box
             bbox rightbox = bbox();
             for (int i = m_num_bins - 1; i > 0; --i)
             {
-                rightbox.grow(bins[axis][i].bounds);
+                GrowBin(axisbins[i].bounds, rightbox);
                 rightbounds[i - 1] = rightbox;
             }
 
@@ -330,9 +785,9 @@ namespace RadeonRays
             float sahtmp = 0.f;
             for (int i = 0; i < m_num_bins - 1; ++i)
             {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
+                GrowBin(axisbins[i].bounds, leftbox);
+                leftcount += axisbins[i].count;
+                rightcount -= axisbins[i].count;
 
                 // Compute SAH
                 sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
@@ -343,6 +798,9 @@ namespace RadeonRays
                     split.dim = axis;
                     splitidx = i;
                     split.sah = sah = sahtmp;
+
+                    // Calculate percentage of overlap
+                    split.overlap = intersection(leftbox, rightbounds[i]).surface_area() * invarea;
                 }
             }
         }
@@ -350,7 +808,7 @@ namespace RadeonRays
         // Choose split plane
         if (splitidx != -1)
         {
-            split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
+            split.split = req.centroid_bounds.pmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
         }
 
         return split;
@@ -358,11 +816,22 @@ namespace RadeonRays
 
     void Bvh::BuildImpl(bbox const* bounds, int numbounds)
     {
-        // Structure describing split request
-        InitNodeAllocator(2 * numbounds - 1);
+        // Structure describing split request, flat build writes nodes
+        // straight into the caller's array and only needs the count
+        if (m_flat_nodes)
+        {
+            m_nodes.clear();
+            m_nodecnt = 2 * numbounds - 1;
+        }
+        else
+        {
+            InitNodeAllocator(2 * numbounds - 1);
+        }
 
-        // Cache some stuff to have faster partitioning
-        std::vector<float3> centroids(numbounds);
+        // Cache some stuff to have faster partitioning,
+        // small builds reuse the memory of previous ones
+        BuildArena::Scope scope;
+        std::vector<float3, BuildArena::Allocator<float3>> centroids(numbounds);
         m_indices.resize(numbounds);
         std::iota(m_indices.begin(), m_indices.end(), 0);
 
@@ -375,7 +844,7 @@ namespace RadeonRays
             centroids[i] = c;
         }
 
-        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1 };
+        SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0, 1, 0 };
 
 #ifdef USE_BUILD_STACK
         std::stack<SplitRequest> stack;
@@ -484,18 +953,422 @@ namespace RadeonRays
             if (req.ptr) *req.ptr = node;
         }
 #else
-        BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        // Subtrees and binning of large nodes are distributed
+        // between worker threads, the tree is the same as in serial build
+        RunBuild(numbounds, [&]()
+        {
+            BuildNode(init, bounds, &centroids[0], &m_indices[0]);
+        });
+
+        // Leaves are referencing in place partitioned indices
+        m_packed_indices = m_indices;
 #endif
 
         // Set root_ pointer
+        m_root = m_flat_nodes ? nullptr : &m_nodes[0];
+    }
+
+    int Bvh::GetLeafCount() const
+    {
+        // Flat build has single primitive leaves only
+        if (m_flat)
+        {
+            return (m_nodecnt + 1) / 2;
+        }
+
+        // Walk the tree rather than the node storage, some builders allocate nodes in chunks
+        int numleaves = 0;
+        std::vector<Node const*> stack;
+
+        if (m_root && m_nodecnt > 0)
+        {
+            stack.push_back(m_root);
+        }
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+
+            if (node->type == kLeaf)
+            {
+                ++numleaves;
+            }
+            else
+            {
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+        }
+
+        return numleaves;
+    }
+
+    bool Bvh::Refit(bbox const* bounds, int numbounds)
+    {
+        if (m_flat || !m_root || numbounds != (int)m_indices.size())
+        {
+            return false;
+        }
+
+        // Nodes are pushed before their children, so reverse order visits children first
+        std::vector<Node*> order(1, m_root);
+
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            if (order[i]->type == kInternal)
+            {
+                order.push_back(order[i]->lc);
+                order.push_back(order[i]->rc);
+            }
+        }
+
+        for (auto iter = order.rbegin(); iter != order.rend(); ++iter)
+        {
+            Node* node = *iter;
+
+            if (node->type == kLeaf)
+            {
+                node->bounds = bbox();
+
+                for (int i = 0; i < node->numprims; ++i)
+                {
+                    node->bounds.grow(bounds[m_packed_indices[node->startidx + i]]);
+                }
+            }
+            else
+            {
+                node->bounds = bboxunion(node->lc->bounds, node->rc->bounds);
+            }
+        }
+
+        m_bounds = m_root->bounds;
+        return true;
+    }
+
+    bool Bvh::Update(bbox const* bounds, int numbounds, int const* remap, int numremap)
+    {
+        if (m_flat || !m_root || numbounds == 0 || numremap != (int)m_packed_indices.size())
+        {
+            return false;
+        }
+
+        TraceScope trace("Bvh::Update", "builder");
+
+        // Every new index is referenced at most once, the rest are inserted
+        std::vector<char> kept(numbounds, 0);
+        int numkept = 0;
+
+        for (int i = 0; i < numremap; ++i)
+        {
+            if (remap[i] < 0)
+            {
+                continue;
+            }
+
+            if (remap[i] >= numbounds || kept[remap[i]])
+            {
+                return false;
+            }
+
+            kept[remap[i]] = 1;
+            ++numkept;
+        }
+
+        // New primitive index of each leaf slot, internal nodes keep -1
+        std::vector<int> prims(m_nodes.size(), -1);
+        std::vector<Node const*> stack(1, m_root);
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+
+            if (node->type == kInternal)
+            {
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+            else if (node->numprims != 1)
+            {
+                return false;
+            }
+            else
+            {
+                prims[node - &m_nodes[0]] = remap[m_packed_indices[node->startidx]];
+            }
+        }
+
+        // Each inserted primitive takes a leaf and a new parent
+        int const numinserted = numbounds - numkept;
+        std::vector<int> parents;
+        CompactNodes(m_nodecnt + 2 * numinserted, prims, parents);
+
+        // Removed leaves are replaced by their siblings, unlinked nodes stay in the storage
+        int const numnodes = m_nodecnt;
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            if (m_nodes[i].type != kLeaf || prims[i] >= 0)
+            {
+                continue;
+            }
+
+            int const parent = parents[i];
+
+            if (parent < 0)
+            {
+                m_root = nullptr;
+                continue;
+            }
+
+            Node* sibling = m_nodes[parent].lc == &m_nodes[i] ? m_nodes[parent].rc : m_nodes[parent].lc;
+            int const grandparent = parents[parent];
+            int const siblingidx = (int)(sibling - &m_nodes[0]);
+
+            sibling->index = m_nodes[parent].index;
+            parents[siblingidx] = grandparent;
+
+            if (grandparent < 0)
+            {
+                m_root = sibling;
+            }
+            else if (m_nodes[grandparent].lc == &m_nodes[parent])
+            {
+                m_nodes[grandparent].lc = sibling;
+            }
+            else
+            {
+                m_nodes[grandparent].rc = sibling;
+            }
+        }
+
+        // Children follow their parents, so reverse order refits kept nodes bottom up.
+        // Unlinked nodes are refitted too, their children are still valid.
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            Node& node = m_nodes[i];
+
+            if (node.type == kInternal)
+            {
+                node.bounds = bboxunion(node.lc->bounds, node.rc->bounds);
+            }
+            else if (prims[i] >= 0)
+            {
+                node.bounds = bounds[prims[i]];
+            }
+        }
+
+        for (int i = 0; i < numbounds; ++i)
+        {
+            if (kept[i])
+            {
+                continue;
+            }
+
+            Node* leaf = AllocateNode();
+            int const leafidx = (int)(leaf - &m_nodes[0]);
+            leaf->type = kLeaf;
+            leaf->bounds = bounds[i];
+            leaf->index = 0;
+            leaf->startidx = 0;
+            leaf->numprims = 1;
+            prims[leafidx] = i;
+
+            if (!m_root)
+            {
+                leaf->index = 1;
+                parents[leafidx] = -1;
+                m_root = leaf;
+                continue;
+            }
+
+            // New parent takes the place of the sibling
+            Node* sibling = FindBestSibling(bounds[i]);
+            int const siblingidx = (int)(sibling - &m_nodes[0]);
+            int const grandparent = parents[siblingidx];
+
+            Node* parent = AllocateNode();
+            int const parentidx = (int)(parent - &m_nodes[0]);
+            parent->type = kInternal;
+            parent->index = sibling->index;
+            parent->lc = sibling;
+            parent->rc = leaf;
+            parent->bounds = bboxunion(sibling->bounds, leaf->bounds);
+
+            parents[parentidx] = grandparent;
+            parents[siblingidx] = parentidx;
+            parents[leafidx] = parentidx;
+
+            if (grandparent < 0)
+            {
+                m_root = parent;
+            }
+            else if (m_nodes[grandparent].lc == sibling)
+            {
+                m_nodes[grandparent].lc = parent;
+            }
+            else
+            {
+                m_nodes[grandparent].rc = parent;
+            }
+
+            // Grow the ancestors
+            for (int j = grandparent; j >= 0; j = parents[j])
+            {
+                m_nodes[j].bounds = bboxunion(m_nodes[j].lc->bounds, m_nodes[j].rc->bounds);
+            }
+        }
+
+        // Drop unlinked nodes, leaves reference packed indices in depth first order again
+        CompactNodes(2 * numbounds - 1, prims, parents);
+
+        m_packed_indices.resize(numbounds);
+        int numleaves = 0;
+
+        for (int i = 0; i < m_nodecnt; ++i)
+        {
+            if (m_nodes[i].type == kLeaf)
+            {
+                m_nodes[i].startidx = numleaves;
+                m_packed_indices[numleaves++] = prims[i];
+            }
+        }
+
+        m_indices = m_packed_indices;
+        m_bounds = m_root->bounds;
+        UpdateTreeFigures();
+        return true;
+    }
+
+    void Bvh::CompactNodes(int capacity, std::vector<int>& data, std::vector<int>& parents)
+    {
+        std::vector<Node> nodes(capacity);
+        std::vector<int> slotdata(capacity, -1);
+        parents.assign(capacity, -1);
+
+        // Node with the slot of its copied parent
+        std::vector<std::pair<Node*, int>> stack(1, std::make_pair(m_root, -1));
+        int count = 0;
+
+        while (!stack.empty())
+        {
+            Node* node = stack.back().first;
+            int const parent = stack.back().second;
+            stack.pop_back();
+
+            int const slot = count++;
+            nodes[slot] = *node;
+            slotdata[slot] = data[node - &m_nodes[0]];
+            parents[slot] = parent;
+
+            // Left child is copied right after its parent, so it is fixed up first
+            if (parent >= 0)
+            {
+                Node& copy = nodes[parent];
+                (copy.lc == node ? copy.lc : copy.rc) = &nodes[slot];
+            }
+
+            if (node->type == kInternal)
+            {
+                stack.push_back(std::make_pair(node->rc, slot));
+                stack.push_back(std::make_pair(node->lc, slot));
+            }
+        }
+
+        m_nodes.swap(nodes);
+        data.swap(slotdata);
+        m_nodecnt = count;
         m_root = &m_nodes[0];
     }
 
+    Bvh::Node* Bvh::FindBestSibling(bbox const& b) const
+    {
+        float const area = b.surface_area();
+        Node* best = m_root;
+        float best_cost = bboxunion(m_root->bounds, b).surface_area();
+
+        // Candidates are visited by the area increase of their ancestors, a subtree is
+        // skipped once that plus the area of the new leaf can't beat the best cost
+        typedef std::pair<float, Node*> Candidate;
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> queue;
+        queue.push(std::make_pair(0.f, m_root));
+
+        while (!queue.empty())
+        {
+            float const inherited = queue.top().first;
+            Node* node = queue.top().second;
+            queue.pop();
+
+            if (inherited + area >= best_cost)
+            {
+                break;
+            }
+
+            float const direct = bboxunion(node->bounds, b).surface_area();
+
+            if (direct + inherited < best_cost)
+            {
+                best_cost = direct + inherited;
+                best = node;
+            }
+
+            if (node->type == kInternal)
+            {
+                float const child_inherited = inherited + direct - node->bounds.surface_area();
+
+                if (child_inherited + area < best_cost)
+                {
+                    queue.push(std::make_pair(child_inherited, node->lc));
+                    queue.push(std::make_pair(child_inherited, node->rc));
+                }
+            }
+        }
+
+        return best;
+    }
+
+    float Bvh::GetSahCost() const
+    {
+        if (m_flat)
+        {
+            return m_flat_sah_cost;
+        }
+
+        float root_area = m_bounds.surface_area();
+
+        if (!m_root || m_nodecnt == 0 || root_area <= 0.f)
+        {
+            return 0.f;
+        }
+
+        float cost = 0.f;
+        std::vector<Node const*> stack(1, m_root);
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+
+            float probability = node->bounds.surface_area() / root_area;
+            cost += probability * (node->type == kLeaf ? (float)node->numprims : m_traversal_cost);
+
+            if (node->type == kInternal)
+            {
+                stack.push_back(node->lc);
+                stack.push_back(node->rc);
+            }
+        }
+
+        return cost;
+    }
+
     void Bvh::PrintStatistics(std::ostream& os) const
     {
         os << "Class name: " << "Bvh\n";
         os << "SAH: " << (m_usesah ? "enabled\n" : "disabled\n");
         os << "SAH bins: " << m_num_bins << "\n";
+        os << "Max leaf size: " << m_max_leaf_size << "\n";
         os << "Number of triangles: " << m_indices.size() << "\n";
         os << "Number of nodes: " << m_nodecnt << "\n";
         os << "Tree height: " << GetHeight() << "\n";
@@ -27,12 +27,23 @@ THE SOFTWARE.
 #include <list>
 #include <atomic>
 #include <iostream>
+#include <functional>
+#include <algorithm>
 
 
 #include "math/bbox.h"
+#include "math/ray.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RR_BVH_SSE 1
+#include <emmintrin.h>
+#endif
 
 namespace RadeonRays
 {
+    class task_scheduler;
+    class task_group;
+
     ///< The class represents bounding volume hierarachy
     ///< intersection accelerator
     ///<
@@ -40,15 +51,28 @@ namespace RadeonRays
     {
     public:
         Bvh(float traversal_cost, int num_bins = 64, bool usesah = false)
-            : m_root(nullptr)
+            : m_nodecnt(0)
+            , m_root(nullptr)
             , m_num_bins(num_bins)
             , m_usesah(usesah)
             , m_height(0)
             , m_traversal_cost(traversal_cost)
+            , m_scheduler(nullptr)
+            , m_build_group(nullptr)
+            , m_external_scheduler(nullptr)
+            , m_num_threads(0)
+            , m_max_leaf_size(1)
+            , m_area_order(false)
+            , m_ray_samples(nullptr)
+            , m_num_ray_samples(0)
+            , m_ray_weight(0.f)
+            , m_flat_nodes(nullptr)
+            , m_flat(false)
+            , m_flat_sah_cost(0.f)
         {
         }
 
-        ~Bvh();
+        virtual ~Bvh();
 
         // World space bounding box
         bbox const& Bounds() const;
@@ -57,9 +81,72 @@ namespace RadeonRays
         // bounds is an array of bounding boxes
         void Build(bbox const* bounds, int numbounds);
 
+        // Build straight into the skip link layout of PlainBvhTranslator without
+        // the pointer tree, nodes has to hold 2 * numbounds - 1 entries. Leaves
+        // have to be single primitive ones (max leaf size 1), so a subtree of n
+        // primitives takes 2n - 1 nodes and addresses are known while splitting.
+        // Always uses the Bvh build, node storage is not allocated afterwards
+        void BuildFlat(bbox const* bounds, int numbounds, bbox* nodes);
+
+        // Recompute node bounds bottom up for new bounds of the same primitives
+        // keeping the topology and primitive order. Returns false for flat
+        // builds, which have no pointer tree, or a different number of bounds
+        bool Refit(bbox const* bounds, int numbounds);
+
+        // Update a tree with single primitive leaves to a changed set of primitives, e.g. a
+        // top level over instances attached or detached one at a time. remap holds the new
+        // index of each of numremap primitives the tree has been built over (-1 for removed
+        // ones), primitives of bounds remap does not reference are inserted. Leaves of removed
+        // primitives are unlinked collapsing their parents, kept ones are refitted and new ones
+        // are paired with the node whose enlargement costs the least SAH (branch and bound
+        // search). Returns false for flat builds, larger leaves or an invalid remap
+        bool Update(bbox const* bounds, int numbounds, int const* remap, int numremap);
+
         // Get tree height
         int GetHeight() const;
 
+        // Get number of nodes
+        int GetNodeCount() const;
+
+        // Get number of leaf nodes
+        int GetLeafCount() const;
+
+        // Get SAH cost of the tree: expected number of node traversals
+        // multiplied by traversal cost plus primitive intersections per ray
+        float GetSahCost() const;
+
+        // Use external scheduler for parallel builds, so that several
+        // BVHs can be built at once sharing the same worker threads
+        // (nullptr: own scheduler is created for large builds)
+        void SetScheduler(task_scheduler* scheduler) { m_external_scheduler = scheduler; }
+
+        // Number of worker threads of the own scheduler
+        // (0: all hardware threads, 1: serial build), ignored with external scheduler
+        void SetNumThreads(int num_threads) { m_num_threads = num_threads; }
+
+        // Maximum number of primitives SAH builder is allowed to put
+        // into a leaf, leaves are created when their intersection cost
+        // is lower than the cost of the best split (1: single primitive leaves).
+        // Spatial split builder always keeps single primitive leaves
+        void SetMaxLeafSize(int max_leaf_size) { m_max_leaf_size = max_leaf_size; }
+
+        // Put the child with larger surface area first after the build, so
+        // occlusion traversal visiting children in stored order is likely to
+        // find a hit earlier
+        void SetAreaOrder(bool area_order) { m_area_order = area_order; }
+
+        // Rays representative of the queries, e.g. primary rays of a previous frame. After the
+        // build subtrees are rotated to lower the cost of tracing them, node probabilities blend
+        // the fraction of the rays hitting the node (weight) with its relative surface area
+        // (1 - weight), the ray distribution heuristic. Rays have to stay valid during the build,
+        // flat builds ignore them (nullptr: surface area only)
+        void SetRaySamples(ray const* rays, int num_rays, float weight)
+        {
+            m_ray_samples = rays;
+            m_num_ray_samples = num_rays;
+            m_ray_weight = weight;
+        }
+
         // Get reordered prim indices Nodes are pointing to
         virtual int const* GetIndices() const;
 
@@ -95,6 +182,8 @@ namespace RadeonRays
             int level;
             // Node index
             int index;
+            // Node address in the flat layout
+            int address;
         };
 
         struct SahSplit
@@ -109,6 +198,61 @@ namespace RadeonRays
 
         SahSplit FindSahSplit(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices) const;
 
+        // SAH bin has bbox and occurence count
+        struct Bin
+        {
+            bbox bounds;
+            int count;
+        };
+
+        // Inverse centroid range per axis, zero for degenerate axes
+        static float3 GetInvCentroidRange(bbox const& centroid_bounds);
+        // Bin a primitive for all 3 axes at once, bins are stored axis by axis
+        void AddToBins(bbox const& b, float3 const& c, float3 const& rootmin, float3 const& invrng, Bin* bins) const;
+        // Merge 3 * m_num_bins bins into bins
+        void MergeBins(Bin const* other, Bin* bins) const;
+        // Sweep the bins of non-degenerate axes and return the best split
+        SahSplit SweepBins(SplitRequest const& req, float3 const& invrng, Bin const* bins) const;
+        // Grow box by another box
+        static void GrowBin(bbox const& b, bbox& box);
+
+        // Thread safe tree height update
+        void UpdateHeight(int level);
+
+        // Run build function, for large inputs m_scheduler and
+        // m_build_group are set for the duration of the build and
+        // all the tasks spawned into the group are waited for
+        void RunBuild(int numbounds, std::function<void()> const& build);
+
+        // Swap children of internal nodes to have larger one first
+        void OrderChildrenByArea();
+
+        // Sample ray prepared for slab tests
+        struct RaySample;
+        // Check if the ray segment hits the box
+        static bool IntersectsBox(RaySample const& r, bbox const& b);
+        // Count rays of ids hitting the box, their ids are appended to hits if it is not nullptr
+        static int CountHits(std::vector<RaySample> const& rays, std::vector<int> const& ids, bbox const& b, std::vector<int>* hits);
+        // Rotate subtrees while that lowers the ray distribution heuristic cost
+        void RotateForRaySamples();
+        // Apply the best rotation of the children of node with grandchildren if it lowers the cost,
+        // ids are the rays hitting node. Returns true if the tree has changed
+        bool RotateNode(Node* node, std::vector<RaySample> const& rays, std::vector<int> const& ids,
+            float area_scale, float ray_scale) const;
+        // Recompute node indices and tree height after rotations
+        void UpdateTreeFigures();
+
+        // Copy the tree into new storage of capacity nodes in depth first order, children
+        // follow their parents. data holds a value per node slot and is permuted along with
+        // the nodes, parents receives the slot of each node's parent (-1 for the root)
+        void CompactNodes(int capacity, std::vector<int>& data, std::vector<int>& parents);
+        // Find the node a new leaf with bounds b is best paired with: the sum of the area of
+        // their parent and area increases of the ancestors is the lowest
+        Node* FindBestSibling(bbox const& b) const;
+
+        // Write node of a flat build into m_flat_nodes
+        void WriteFlatNode(SplitRequest const& req, Node const& node) const;
+
         // Enum for node type
         enum NodeType
         {
@@ -132,12 +276,34 @@ namespace RadeonRays
         Node* m_root;
         // SAH flag
         bool m_usesah;
-        // Tree height
-        int m_height;
+        // Tree height, atomic for thread safety
+        std::atomic<int> m_height;
         // Node traversal cost
         float m_traversal_cost;
         // Number of spatial bins to use for SAH
         int m_num_bins;
+        // Task scheduler used for parallel build (nullptr for serial build)
+        task_scheduler* m_scheduler;
+        // Task group all the subtree tasks are spawned into
+        task_group* m_build_group;
+        // Scheduler provided by the user
+        task_scheduler* m_external_scheduler;
+        // Number of worker threads for own scheduler
+        int m_num_threads;
+        // Maximum number of primitives in a leaf for SAH build
+        int m_max_leaf_size;
+        // Order children by surface area after the build
+        bool m_area_order;
+        // Rays to optimize the tree for (nullptr if not set)
+        ray const* m_ray_samples;
+        int m_num_ray_samples;
+        // Weight of ray hits in node probabilities
+        float m_ray_weight;
+        // Skip link nodes written during a flat build (nullptr: pointer tree build)
+        bbox* m_flat_nodes;
+        // Last build was a flat one, tree figures are kept here
+        bool m_flat;
+        float m_flat_sah_cost;
 
 
     private:
@@ -146,6 +312,8 @@ namespace RadeonRays
 
         friend class PlainBvhTranslator;
         friend class FatNodeBvhTranslator;
+        friend class QbvhTranslator;
+        friend class LinearBvh;
     };
 
     struct Bvh::Node
@@ -193,6 +361,49 @@ namespace RadeonRays
     {
         return m_height;
     }
+
+    inline int Bvh::GetNodeCount() const
+    {
+        return m_nodecnt;
+    }
+
+    inline void Bvh::GrowBin(bbox const& b, bbox& box)
+    {
+#ifdef RR_BVH_SSE
+        // Operands go in std::min/std::max order of bbox::grow
+        _mm_storeu_ps(&box.pmin.x, _mm_min_ps(_mm_loadu_ps(&b.pmin.x), _mm_loadu_ps(&box.pmin.x)));
+        _mm_storeu_ps(&box.pmax.x, _mm_max_ps(_mm_loadu_ps(&b.pmax.x), _mm_loadu_ps(&box.pmax.x)));
+#else
+        box.grow(b);
+#endif
+    }
+
+    inline void Bvh::AddToBins(bbox const& b, float3 const& c, float3 const& rootmin, float3 const& invrng, Bin* bins) const
+    {
+        int binidx[4];
+
+#ifdef RR_BVH_SSE
+        // Same operation order as the scalar code, so primitives
+        // land in the same bins
+        __m128 const numbins = _mm_set1_ps((float)m_num_bins);
+        __m128 const maxbin = _mm_set1_ps((float)(m_num_bins - 1));
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&c.x), _mm_loadu_ps(&rootmin.x)), _mm_loadu_ps(&invrng.x));
+        t = _mm_min_ps(maxbin, _mm_mul_ps(numbins, t));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(binidx), _mm_cvttps_epi32(t));
+#else
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            binidx[axis] = (int)std::min<float>(m_num_bins * ((c[axis] - rootmin[axis]) * invrng[axis]), m_num_bins - 1);
+        }
+#endif
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            Bin& bin = bins[axis * m_num_bins + binidx[axis]];
+            ++bin.count;
+            GrowBin(b, bin.bounds);
+        }
+    }
 }
 
 #endif // BVH_H
@@ -0,0 +1,83 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_library.h"
+
+#include <algorithm>
+
+namespace RadeonRays
+{
+    static std::size_t const kMinPruneSize = 64;
+
+    BvhLibrary::BvhLibrary()
+        : m_prune_size(kMinPruneSize)
+    {
+    }
+
+    BvhLibrary& BvhLibrary::Get()
+    {
+        static BvhLibrary library;
+        return library;
+    }
+
+    std::shared_ptr<Bvh> BvhLibrary::Find(std::uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto iter = m_entries.find(key);
+        return iter != m_entries.cend() ? iter->second.lock() : nullptr;
+    }
+
+    std::shared_ptr<Bvh> BvhLibrary::Insert(std::uint64_t key, std::shared_ptr<Bvh> const& bvh)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto& entry = m_entries[key];
+
+        if (auto existing = entry.lock())
+        {
+            return existing;
+        }
+
+        entry = bvh;
+
+        // Drop entries of BVHs no intersector references anymore once
+        // the map has grown enough since the last pass
+        if (m_entries.size() >= m_prune_size)
+        {
+            for (auto iter = m_entries.begin(); iter != m_entries.end();)
+            {
+                if (iter->second.expired())
+                {
+                    iter = m_entries.erase(iter);
+                }
+                else
+                {
+                    ++iter;
+                }
+            }
+
+            m_prune_size = std::max(kMinPruneSize, 2 * m_entries.size());
+        }
+
+        return bvh;
+    }
+}
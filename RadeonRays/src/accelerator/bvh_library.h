@@ -0,0 +1,62 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BVH_LIBRARY_H
+#define BVH_LIBRARY_H
+
+#include "bvh.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace RadeonRays
+{
+    /// This class shares built bottom level BVHs between intersectors of all
+    /// IntersectionApi instances in the process. Entries are keyed the same way
+    /// as BvhCache ones (primitive bounds and build options) and only live while
+    /// some intersector references them.
+    //
+    class BvhLibrary
+    {
+    public:
+        // Process wide library
+        static BvhLibrary& Get();
+
+        // BVH built for a given key, nullptr if there is none alive
+        std::shared_ptr<Bvh> Find(std::uint64_t key);
+        // Publish a built BVH, returns the one already published for the key if there is one
+        std::shared_ptr<Bvh> Insert(std::uint64_t key, std::shared_ptr<Bvh> const& bvh);
+
+    private:
+        BvhLibrary();
+        BvhLibrary(BvhLibrary const&) = delete;
+        BvhLibrary& operator = (BvhLibrary const&) = delete;
+
+        std::mutex m_mutex;
+        std::unordered_map<std::uint64_t, std::weak_ptr<Bvh>> m_entries;
+        // Map size triggering removal of expired entries
+        std::size_t m_prune_size;
+    };
+}
+
+#endif // BVH_LIBRARY_H
@@ -24,13 +24,18 @@ THE SOFTWARE.
 #include "primitives.h"
 #include "executable.h"
 #include "../except/except.h"
+#include "../intersector/kernel_timer.h"
+#include "../intersector/memory_usage.h"
+#include "../util/trace.h"
 #include "calc.h"
 #include "event.h"
 
+#include <algorithm>
 #include <vector>
 #include <numeric>
 #include <chrono>
 #include <cstring>
+#include <cstdint>
 #include <iostream>
 #include <assert.h>
 
@@ -46,10 +51,18 @@ namespace RadeonRays
 {
     
     static int kWorkGroupSize = 64;
+    // Number of groups reducing tree cost
+    static int kNumReduceGroups = 64;
     
-    Hlbvh::Hlbvh(Calc::Device* device)
+    Hlbvh::Hlbvh(Calc::Device* device, bool morton64)
     : m_device(device)
     , m_gpudata(new GpuData(device))
+    , m_num_prims(0)
+    , m_capacity(0)
+    , m_treelets(false)
+    , m_morton64(morton64)
+    , m_timer(nullptr)
+    , m_queue(0)
     {
         InitGpuData();
     }
@@ -61,36 +74,56 @@ namespace RadeonRays
     
     void Hlbvh::AllocateBuffers(size_t num_prims)
     {
+        // Grow geometrically so that slowly growing animated content
+        // doesn't reallocate on every build
+        num_prims = std::max(num_prims, static_cast<size_t>(m_capacity) + m_capacity / 2);
+
+        // Release previously allocated buffers
+        m_device->DeleteBuffer(m_gpudata->positions);
+        m_device->DeleteBuffer(m_gpudata->morton_codes);
+        m_device->DeleteBuffer(m_gpudata->prim_indices);
+        m_device->DeleteBuffer(m_gpudata->sorted_morton_codes);
+        m_device->DeleteBuffer(m_gpudata->sorted_prim_indices);
+        m_device->DeleteBuffer(m_gpudata->nodes);
+        m_device->DeleteBuffer(m_gpudata->bounds);
+        m_device->DeleteBuffer(m_gpudata->sorted_bounds);
+        m_device->DeleteBuffer(m_gpudata->flags);
+        m_device->DeleteBuffer(m_gpudata->costs);
+
         // * 3 since only triangles are supported just yet
         m_gpudata->positions = m_device->CreateBuffer(num_prims * sizeof(float3), Calc::BufferType::kWrite);
-        // * 3 since 3 vertex indices + 1 material idx
-        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
-        
-        
+
         std::vector<int> iota(num_prims);
         std::iota(iota.begin(), iota.end(), 0);
         
         m_gpudata->prim_indices = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite, &iota[0]);
-        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
-        m_gpudata->sorted_morton_codes = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
+        std::size_t const code_size = m_morton64 ? sizeof(std::uint64_t) : sizeof(int);
+        m_gpudata->morton_codes = m_device->CreateBuffer(num_prims * code_size, Calc::BufferType::kWrite);
+        m_gpudata->sorted_morton_codes = m_device->CreateBuffer(num_prims * code_size, Calc::BufferType::kWrite);
         m_gpudata->sorted_prim_indices = m_device->CreateBuffer(num_prims * sizeof(int), Calc::BufferType::kWrite);
         
         m_gpudata->nodes = m_device->CreateBuffer(2 * num_prims * sizeof(Node), Calc::BufferType::kWrite);
         // Bounds
         m_gpudata->bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
-        m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kRead);
-        m_gpudata->sorted_bounds = m_device->CreateBuffer(num_prims * sizeof(bbox), Calc::BufferType::kWrite);
+        // Both internal nodes and leaves have bounds
+        m_gpudata->sorted_bounds = m_device->CreateBuffer(2 * num_prims * sizeof(bbox), Calc::BufferType::kWrite);
         // Propagation flags
         m_gpudata->flags = m_device->CreateBuffer(2 * num_prims * sizeof(int), Calc::BufferType::kWrite);
+        // Subtree costs
+        m_gpudata->costs = m_device->CreateBuffer(2 * num_prims * sizeof(float), Calc::BufferType::kWrite);
+
+        m_capacity = static_cast<int>(num_prims);
     }
     
     void Hlbvh::InitGpuData()
     {
-        
+        // Wide codes are only supported by OpenCL kernels
+        char const* buildopts = m_morton64 ? "-D HLBVH_MORTON64 " : nullptr;
+
 #ifndef RR_EMBED_KERNELS
         if ( m_device->GetPlatform() == Calc::Platform::kOpenCL )
         {
-            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", nullptr, 0, nullptr );
+            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/CL/build_hlbvh.cl", nullptr, 0, buildopts );
         }
 
         else
@@ -103,7 +136,7 @@ namespace RadeonRays
 #if USE_OPENCL
         if (device->GetPlatform() == Calc::Platform::kOpenCL)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_build_hlbvh_opencl, std::strlen(g_build_hlbvh_opencl), nullptr);
+            m_gpudata->executable = m_device->CompileExecutable(g_build_hlbvh_opencl, std::strlen(g_build_hlbvh_opencl), buildopts);
         }
 #endif
 
@@ -118,6 +151,17 @@ namespace RadeonRays
         m_gpudata->morton_code_func = m_gpudata->executable->CreateFunction("calculate_morton_code_main");
         m_gpudata->build_func = m_gpudata->executable->CreateFunction("emit_hierarchy_main");
         m_gpudata->refit_func = m_gpudata->executable->CreateFunction("refit_bounds_main");
+        m_gpudata->treelet_func = m_gpudata->executable->CreateFunction("restructure_treelets_main");
+        m_gpudata->clear_func = m_gpudata->executable->CreateFunction("clear_flags_main");
+
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->leaf_bounds_func = m_gpudata->executable->CreateFunction("update_leaf_bounds_main");
+            m_gpudata->cost_func = m_gpudata->executable->CreateFunction("tree_cost_main");
+        }
+
+        // Reduction buffers don't depend on the number of primitives
+        m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kRead);
 
         // Allocate GPU buffers
         AllocateBuffers(INITIAL_TRIANGLE_CAPACITY);
@@ -134,21 +178,130 @@ namespace RadeonRays
     // Build function
     void Hlbvh::Build(bbox const* bounds, int numbounds)
     {
-//#ifdef _DEBUG
+        TraceScope trace("Hlbvh::Build", "builder");
+#ifdef RR_PROFILE
         auto s = std::chrono::high_resolution_clock::now();
-//#endif
+#endif
         BuildImpl(bounds, numbounds);
-//#ifdef _DEBUG
+#ifdef RR_PROFILE
         m_device->Finish(0);
         // Note, that this is total time spent for setup and construction 
         // including the time spent waiting in the queue.
         auto d = std::chrono::high_resolution_clock::now() - s;
         std::cout << "HLBVH setup + construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
-//#endif
+#endif
+    }
+
+    // Build function
+    void Hlbvh::Build(Calc::Buffer const* bounds, int numbounds)
+    {
+        TraceScope trace("Hlbvh::Build", "builder");
+#ifdef RR_PROFILE
+        auto s = std::chrono::high_resolution_clock::now();
+#endif
+        BuildImpl(bounds, numbounds);
+#ifdef RR_PROFILE
+        m_device->Finish(0);
+        auto d = std::chrono::high_resolution_clock::now() - s;
+        std::cout << "HLBVH construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
+#endif
     }
     
+
+    bool Hlbvh::Refit(Calc::Buffer const* bounds, int numbounds)
+    {
+        TraceScope trace("Hlbvh::Refit", "builder");
+
+        if (!m_gpudata->leaf_bounds_func || numbounds != m_num_prims)
+        {
+            return false;
+        }
+
+        int size = numbounds;
+
+        // Leaves first, then internal nodes bottom up
+        int arg = 0;
+        m_gpudata->leaf_bounds_func->SetArg(arg++, bounds);
+        m_gpudata->leaf_bounds_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->leaf_bounds_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->leaf_bounds_func->SetArg(arg++, m_gpudata->sorted_bounds);
+
+        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        Execute("hlbvh_leaf_bounds", m_gpudata->leaf_bounds_func, globalsize);
+
+        int num_flags = 2 * size;
+
+        arg = 0;
+        m_gpudata->clear_func->SetArg(arg++, m_gpudata->flags);
+        m_gpudata->clear_func->SetArg(arg++, sizeof(num_flags), &num_flags);
+
+        Execute("hlbvh_clear", m_gpudata->clear_func, ((num_flags + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize);
+
+        // Plain refit even for restructured trees, treelets are only optimized on builds
+        arg = 0;
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->refit_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->nodes);
+        m_gpudata->refit_func->SetArg(arg++, m_gpudata->flags);
+
+        Execute("hlbvh_refit", m_gpudata->refit_func, globalsize);
+
+        return true;
+    }
+
+    float Hlbvh::GetCost() const
+    {
+        if (!m_gpudata->cost_func || m_num_prims < 2)
+        {
+            return 0.f;
+        }
+
+        int size = m_num_prims;
+
+        int arg = 0;
+        m_gpudata->cost_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        m_gpudata->cost_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->cost_func->SetArg(arg++, m_gpudata->costs);
+
+        Execute("hlbvh_tree_cost", m_gpudata->cost_func, kNumReduceGroups * kWorkGroupSize);
+
+        // Sum group costs on the host
+        float* group_costs = nullptr;
+        Calc::Event* e = nullptr;
+        m_device->MapBuffer(m_gpudata->costs, m_queue, 0, kNumReduceGroups * sizeof(float), Calc::MapType::kMapRead, (void**)&group_costs, &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        float cost = 0.f;
+        for (int i = 0; i < kNumReduceGroups; ++i)
+        {
+            cost += group_costs[i];
+        }
+
+        m_device->UnmapBuffer(m_gpudata->costs, m_queue, group_costs, &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        return cost;
+    }
     
     // World space bounding box
+    void Hlbvh::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->nodes);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->positions);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->morton_codes);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->prim_indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_morton_codes);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_prim_indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_bounds);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->scene_bound);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->flags);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->costs);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+
     bbox const& Hlbvh::Bounds() const
     {
         // TODO: implement me
@@ -159,68 +312,79 @@ namespace RadeonRays
     // Build function
     void Hlbvh::BuildImpl(bbox const* bounds, int numbounds)
     {
-        int size = numbounds;
-        
-        // Make sure to allocate enough mem on GPU
-        // We are trying to reuse space as reallocation takes time
-        // but this call might be really frequent
-        if (size > m_gpudata->positions->GetSize())
+        if (numbounds > m_capacity)
         {
-            AllocateBuffers(size);
+            AllocateBuffers(numbounds);
         }
 
-        // Evaluate scene bouds
-        bbox scene_bound = bbox();
-        for (auto i = 0; i < numbounds; ++i)
-            scene_bound.grow(bounds[i]);
-
-        m_device->WriteBuffer(m_gpudata->scene_bound, 0, 0, sizeof(bbox), &scene_bound, nullptr);
-
         // Write bounds buffer
         {
             bbox* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->bounds, 0, 0, sizeof(bbox) * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
+            m_device->MapBuffer(m_gpudata->bounds, m_queue, 0, sizeof(bbox) * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
+            m_device->Finish(m_queue);
             std::memcpy(tmp, bounds, sizeof(bbox) * numbounds);
-            m_device->UnmapBuffer(m_gpudata->bounds, 0, tmp, nullptr);
-            m_device->Finish(0);
+            m_device->UnmapBuffer(m_gpudata->bounds, m_queue, tmp, nullptr);
         }
+
+        BuildImpl(m_gpudata->bounds, numbounds);
+    }
+
+    // Build function
+    void Hlbvh::BuildImpl(Calc::Buffer const* bounds, int numbounds)
+    {
+        int size = numbounds;
         
-        // Initialize flags with zero 
+        // Make sure to allocate enough mem on GPU
+        // We are trying to reuse space as reallocation takes time
+        // but this call might be really frequent
+        if (size > m_capacity)
         {
-            int* tmp = nullptr;
-            m_device->MapBuffer(m_gpudata->flags, 0, 0, sizeof(int) * 2 * numbounds, Calc::kMapWrite, (void**)&tmp, nullptr);
-            m_device->Finish(0);
-            std::memset(tmp, 0, sizeof(int) * numbounds * 2);
-            m_device->UnmapBuffer(m_gpudata->flags, 0, tmp, nullptr);
-            m_device->Finish(0);
+            AllocateBuffers(size);
         }
 
-        // Calculate Morton codes array
+        m_num_prims = size;
+
+        // Evaluate scene bounds on the device
+        m_gpudata->pp->ReduceBounds(m_queue, bounds, m_gpudata->scene_bound, size);
+
+        // Initialize flags with zero
+        int num_flags = 2 * size;
+
         int arg = 0;
-        m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->bounds);
+        m_gpudata->clear_func->SetArg(arg++, m_gpudata->flags);
+        m_gpudata->clear_func->SetArg(arg++, sizeof(num_flags), &num_flags);
+
+        int globalsize = ((num_flags + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        Execute("hlbvh_clear", m_gpudata->clear_func, globalsize);
+
+        // Calculate Morton codes array
+        arg = 0;
+        m_gpudata->morton_code_func->SetArg(arg++, bounds);
         m_gpudata->morton_code_func->SetArg(arg++, sizeof(size), &size);
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->scene_bound);
         m_gpudata->morton_code_func->SetArg(arg++, m_gpudata->morton_codes);
 
         // Calculate global size
-        int globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch Morton codes kernel
-        m_device->Execute(m_gpudata->morton_code_func, 0, globalsize, kWorkGroupSize, nullptr);
-        m_device->Finish(0);
+        Execute("hlbvh_morton_codes", m_gpudata->morton_code_func, globalsize);
         
         // Sort primitives according to their Morton codes
-        m_gpudata->pp->SortRadixInt32(0, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        if (m_morton64)
+        {
+            m_gpudata->pp->SortRadixInt64(m_queue, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        }
+        else
+        {
+            m_gpudata->pp->SortRadixInt32(m_queue, m_gpudata->morton_codes, m_gpudata->sorted_morton_codes, m_gpudata->prim_indices, m_gpudata->sorted_prim_indices, size);
+        }
+
 
-        std::vector<int> codes(size);
-        m_device->ReadBuffer(m_gpudata->sorted_prim_indices, 0, 0, sizeof(int) * size, &codes[0], nullptr);
-        m_device->Finish(0);
-       
         // Prepare tree construction kernel
         arg = 0;
         m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_morton_codes);
-        m_gpudata->build_func->SetArg(arg++, m_gpudata->bounds);
+        m_gpudata->build_func->SetArg(arg++, bounds);
         m_gpudata->build_func->SetArg(arg++, m_gpudata->sorted_prim_indices);
         m_gpudata->build_func->SetArg(arg++, sizeof(size), &size);
         m_gpudata->build_func->SetArg(arg++, m_gpudata->nodes);
@@ -230,18 +394,48 @@ namespace RadeonRays
         globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
         // Launch hierarchy emission kernel
-        m_device->Execute(m_gpudata->build_func, 0, globalsize, kWorkGroupSize, nullptr);
+        Execute("hlbvh_emit", m_gpudata->build_func, globalsize);
         
-        // Refit bounds
+        // Refit bounds, treelet pass refits them on its way up as well
+        auto refit_func = m_treelets ? m_gpudata->treelet_func : m_gpudata->refit_func;
+
         arg = 0;
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
-        m_gpudata->refit_func->SetArg(arg++, sizeof(size), &size);
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->nodes);
-        m_gpudata->refit_func->SetArg(arg++, m_gpudata->flags);
+        refit_func->SetArg(arg++, m_gpudata->sorted_bounds);
+        refit_func->SetArg(arg++, sizeof(size), &size);
+        refit_func->SetArg(arg++, m_gpudata->nodes);
+        refit_func->SetArg(arg++, m_gpudata->flags);
+
+        if (m_treelets)
+        {
+            refit_func->SetArg(arg++, m_gpudata->costs);
+        }
         
         globalsize = ((size + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
         
-        // Launch refit kernel
-        m_device->Execute(m_gpudata->refit_func, 0, globalsize, kWorkGroupSize, nullptr);
+        // Launch refit kernel, the build is complete once it is
+        if (m_gpudata->build_event)
+        {
+            m_device->DeleteEvent(m_gpudata->build_event);
+            m_gpudata->build_event = nullptr;
+        }
+
+        Execute(m_treelets ? "hlbvh_treelets" : "hlbvh_refit", refit_func, globalsize, &m_gpudata->build_event);
+    }
+
+    bool Hlbvh::IsBuildComplete() const
+    {
+        return !m_gpudata->build_event || m_gpudata->build_event->IsComplete();
+    }
+
+    void Hlbvh::Execute(char const* name, Calc::Function const* func, std::size_t global_size, Calc::Event** e) const
+    {
+        if (m_timer)
+        {
+            m_timer->Execute(name, func, m_queue, global_size, kWorkGroupSize, e);
+        }
+        else
+        {
+            m_device->Execute(func, m_queue, global_size, kWorkGroupSize, e);
+        }
     }
 }
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "executable.h"
+#include "radeon_rays.h"
 #include "math/bbox.h"
 #include "../accelerator/bvh.h"
 
@@ -32,13 +33,17 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    class KernelTimer;
+
     ///< The class represents hierarchical LBVH constructed fully on GPU
     ///< https://research.nvidia.com/sites/default/files/publications/HLBVH-final.pdf
     ///
     class Hlbvh
     {
     public:
-        Hlbvh(Calc::Device* device);
+        // 63-bit Morton codes separate more primitives in large scenes
+        // at the cost of a slower sort, OpenCL only
+        Hlbvh(Calc::Device* device, bool morton64 = false);
         
         virtual ~Hlbvh();
         
@@ -47,23 +52,58 @@ namespace RadeonRays
         
         // Build function
         void Build(bbox const* bounds, int numbounds);
+
+        // Build from primitive bounds already in device memory. Scene bounds
+        // are reduced on the device and the build is only enqueued,
+        // no host synchronization takes place.
+        void Build(Calc::Buffer const* bounds, int numbounds);
+        
+        // Refit the last built hierarchy to new bounds of the same primitives
+        // in device memory keeping its topology, OpenCL only. Returns false
+        // and leaves the tree as is if the number of primitives differs.
+        bool Refit(Calc::Buffer const* bounds, int numbounds);
+
+        // Estimated SAH cost of the tree: sum of internal node areas relative
+        // to the root area. Waits for the device.
+        float GetCost() const;
         
         // This class has its own  GPU data,
         // and it provides it as an interface in GPU memory
         struct GpuData;
         GpuData const& GetGpuData() const { return *m_gpudata; }
         
-        // Get reordered indices
-        int const* GetIndices() const { return &m_prim_indices[0]; }
+        // Number of primitives of the last build
+        int GetNumPrims() const { return m_num_prims; }
+
+        // Restructure treelets of the emitted hierarchy to lower its SAH cost
+        void SetTreeletOptimization(bool enable) { m_treelets = enable; }
+
+        // Whether 63-bit Morton codes are used
+        bool IsMorton64() const { return m_morton64; }
+
+        // Time build kernels with the timer of the owning intersector (nullptr: no timing)
+        void SetTimer(KernelTimer const* timer) { m_timer = timer; }
+
+        // Queue to enqueue builds, refits and cost evaluations on (0 by default)
+        void SetQueue(std::uint32_t queue) { m_queue = queue; }
+
+        // Whether the last enqueued build has finished on the device, doesn't wait
+        bool IsBuildComplete() const;
+
+        // Add nodes, build temporaries and the build program to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
 
     
     protected:
         // Build function
         virtual void BuildImpl(bbox const* bounds, int numbounds);
+        virtual void BuildImpl(Calc::Buffer const* bounds, int numbounds);
         
     private:
         void InitGpuData();
         void AllocateBuffers(size_t numprims);
+        // Launch a build kernel on the build queue, timed if there is a timer
+        void Execute(char const* name, Calc::Function const* func, std::size_t global_size, Calc::Event** e = nullptr) const;
         
         Hlbvh(Hlbvh const&);
         Hlbvh& operator = (Hlbvh const&);
@@ -79,8 +119,18 @@ namespace RadeonRays
         // GPU data
         std::unique_ptr<GpuData> m_gpudata;
         
-        // Primitive indices
-        std::vector<int> m_prim_indices;
+        // Number of primitives of the last build
+        int m_num_prims;
+        // Number of primitives GPU buffers can hold
+        int m_capacity;
+        // Run treelet restructuring pass instead of plain refit
+        bool m_treelets;
+        // Use 63-bit Morton codes and 64-bit key sort
+        bool m_morton64;
+        // Build kernel timer (nullptr if not set)
+        KernelTimer const* m_timer;
+        // Queue build kernels are enqueued on
+        std::uint32_t m_queue;
     };
     
     // BVH node
@@ -89,7 +139,8 @@ namespace RadeonRays
         int parent;
         int left;
         int right;
-        int next;
+        // Number of primitives in the subtree
+        int count;
     };
     
     struct Hlbvh::GpuData
@@ -105,6 +156,11 @@ namespace RadeonRays
         Calc::Function* morton_code_func;
         Calc::Function* build_func;
         Calc::Function* refit_func;
+        Calc::Function* treelet_func;
+        Calc::Function* clear_func;
+        // Refit and tree cost, OpenCL only
+        Calc::Function* leaf_bounds_func;
+        Calc::Function* cost_func;
         
         // Parallel primitives instance
         //CLWParallelPrimitives pp_;
@@ -126,13 +182,40 @@ namespace RadeonRays
         // Bounds
         Calc::Buffer* bounds;
         Calc::Buffer* sorted_bounds;
+        // Scene bounds reduced by parallel primitives
         Calc::Buffer* scene_bound;
         
         // Atomic flags
         Calc::Buffer*  flags;
+        // SAH costs of the subtrees for treelet restructuring, group costs of the tree cost
+        Calc::Buffer* costs;
+
+        // Last kernel of the last build
+        Calc::Event* build_event;
 
         GpuData(Calc::Device* dev)
             : device(dev)
+            , pp(nullptr)
+            , executable(nullptr)
+            , morton_code_func(nullptr)
+            , build_func(nullptr)
+            , refit_func(nullptr)
+            , treelet_func(nullptr)
+            , clear_func(nullptr)
+            , leaf_bounds_func(nullptr)
+            , cost_func(nullptr)
+            , positions(nullptr)
+            , morton_codes(nullptr)
+            , prim_indices(nullptr)
+            , sorted_morton_codes(nullptr)
+            , sorted_prim_indices(nullptr)
+            , nodes(nullptr)
+            , bounds(nullptr)
+            , sorted_bounds(nullptr)
+            , scene_bound(nullptr)
+            , flags(nullptr)
+            , costs(nullptr)
+            , build_event(nullptr)
         {
         }
 
@@ -141,6 +224,10 @@ namespace RadeonRays
             executable->DeleteFunction(morton_code_func);
             executable->DeleteFunction(build_func);
             executable->DeleteFunction(refit_func);
+            executable->DeleteFunction(treelet_func);
+            executable->DeleteFunction(clear_func);
+            executable->DeleteFunction(leaf_bounds_func);
+            executable->DeleteFunction(cost_func);
             device->DeleteExecutable(executable);
             device->DeletePrimitives(pp);
             device->DeleteBuffer(positions);
@@ -153,6 +240,12 @@ namespace RadeonRays
             device->DeleteBuffer(sorted_bounds);
             device->DeleteBuffer(scene_bound);
             device->DeleteBuffer(flags);
+            device->DeleteBuffer(costs);
+
+            if (build_event)
+            {
+                device->DeleteEvent(build_event);
+            }
         }
     };
 }
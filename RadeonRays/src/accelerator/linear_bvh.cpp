@@ -0,0 +1,514 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#include "linear_bvh.h"
+
+#include "../async/task_scheduler.h"
+#include "../util/cpu_features.h"
+
+#include <algorithm>
+#include <numeric>
+
+#ifdef RR_BVH_SSE
+#include <immintrin.h>
+#endif
+
+namespace RadeonRays
+{
+    // Number of primitives processed by a single task in linear passes
+    static int constexpr kChunkSize = 1 << 16;
+    // Minimum number of primitives in a subtree to spawn a task for it
+    static int constexpr kParallelSubtreeThreshold = 1 << 12;
+    // Morton code bits per axis
+    static int constexpr kMortonBits = 10;
+    // Radix sort digit bits, 3 passes cover 30 bit codes
+    static int constexpr kRadixBits = 10;
+    static int constexpr kRadixSize = 1 << kRadixBits;
+    // Primitives sharing highest kClusterBits of their codes form a cluster for SAH top
+    static int constexpr kClusterBits = 12;
+    // Minimum number of primitives to build SAH top for
+    static int constexpr kMinSahTopPrims = 1 << 16;
+
+    // Run func(chunk, begin, end) for chunks of [0, count) in parallel if possible
+    template <typename F>
+    static void ForEachChunk(task_scheduler* scheduler, int count, F const& func)
+    {
+        int const num_chunks = (count + kChunkSize - 1) / kChunkSize;
+
+        auto chunk = [&](int c)
+        {
+            int begin = c * kChunkSize;
+            func(c, begin, std::min(begin + kChunkSize, count));
+        };
+
+        if (scheduler && num_chunks > 1)
+        {
+            parallel_for(*scheduler, 0, num_chunks, 1, chunk);
+        }
+        else
+        {
+            for (int c = 0; c < num_chunks; ++c)
+            {
+                chunk(c);
+            }
+        }
+    }
+
+#ifdef RR_BVH_SSE
+    // Morton encoders below have to produce identical codes, so they run the same
+    // operations in the same order with a different number of primitives per instruction
+    static_assert(sizeof(bbox) == 8 * sizeof(float), "Encoders gather bounds with a stride of 8 floats");
+
+    // Quantize and spread all the axes of a primitive at once
+    static void EncodeMortonSse(bbox const* bounds, int begin, int end, float3 const& origin, float3 const& scale, float numcells, std::uint32_t* keys)
+    {
+        __m128 const vorigin = _mm_loadu_ps(&origin.x);
+        __m128 const vscale = _mm_loadu_ps(&scale.x);
+        __m128 const vmaxcell = _mm_set1_ps(numcells - 1.f);
+        __m128 const vhalf = _mm_set1_ps(0.5f);
+
+        for (int i = begin; i < end; ++i)
+        {
+            __m128 c = _mm_mul_ps(vhalf, _mm_add_ps(_mm_loadu_ps(&bounds[i].pmin.x), _mm_loadu_ps(&bounds[i].pmax.x)));
+            __m128 q = _mm_mul_ps(_mm_sub_ps(c, vorigin), vscale);
+            q = _mm_max_ps(_mm_min_ps(q, vmaxcell), _mm_setzero_ps());
+
+            __m128i v = _mm_cvttps_epi32(q);
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 16)), _mm_set1_epi32(0x030000FF));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 8)), _mm_set1_epi32(0x0300F00F));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 4)), _mm_set1_epi32(0x030C30C3));
+            v = _mm_and_si128(_mm_or_si128(v, _mm_slli_epi32(v, 2)), _mm_set1_epi32(0x09249249));
+
+            std::uint32_t bits[4];
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(bits), v);
+
+            keys[i] = (bits[0] << 2) | (bits[1] << 1) | bits[2];
+        }
+    }
+
+    // One axis of 8 primitives per instruction, returns the first primitive left for narrower encoders
+    static RR_TARGET_AVX2 int EncodeMortonAvx2(bbox const* bounds, int begin, int end, float3 const& origin, float3 const& scale, float numcells, std::uint32_t* keys)
+    {
+        __m256i const stride = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+        __m256 const vmaxcell = _mm256_set1_ps(numcells - 1.f);
+        __m256 const vhalf = _mm256_set1_ps(0.5f);
+
+        int i = begin;
+        for (; i + 8 <= end; i += 8)
+        {
+            float const* base = &bounds[i].pmin.x;
+            __m256i key = _mm256_setzero_si256();
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                __m256 pmin = _mm256_i32gather_ps(base + axis, stride, 4);
+                __m256 pmax = _mm256_i32gather_ps(base + 4 + axis, stride, 4);
+                __m256 c = _mm256_mul_ps(vhalf, _mm256_add_ps(pmin, pmax));
+                __m256 q = _mm256_mul_ps(_mm256_sub_ps(c, _mm256_set1_ps(origin[axis])), _mm256_set1_ps(scale[axis]));
+                q = _mm256_max_ps(_mm256_min_ps(q, vmaxcell), _mm256_setzero_ps());
+
+                __m256i v = _mm256_cvttps_epi32(q);
+                v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 16)), _mm256_set1_epi32(0x030000FF));
+                v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 8)), _mm256_set1_epi32(0x0300F00F));
+                v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 4)), _mm256_set1_epi32(0x030C30C3));
+                v = _mm256_and_si256(_mm256_or_si256(v, _mm256_slli_epi32(v, 2)), _mm256_set1_epi32(0x09249249));
+
+                key = _mm256_or_si256(key, _mm256_slli_epi32(v, 2 - axis));
+            }
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(keys + i), key);
+        }
+
+        return i;
+    }
+
+    // GCC expands the unmasked AVX-512 intrinsics over a self-initialized _mm512_undefined_*()
+    // source and reports it as maybe-uninitialized once they are inlined through a target attribute
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    // One axis of 16 primitives per instruction, returns the first primitive left for narrower encoders
+    static RR_TARGET_AVX512 int EncodeMortonAvx512(bbox const* bounds, int begin, int end, float3 const& origin, float3 const& scale, float numcells, std::uint32_t* keys)
+    {
+        __m512i const stride = _mm512_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120);
+        __m512 const vmaxcell = _mm512_set1_ps(numcells - 1.f);
+        __m512 const vhalf = _mm512_set1_ps(0.5f);
+
+        int i = begin;
+        for (; i + 16 <= end; i += 16)
+        {
+            float const* base = &bounds[i].pmin.x;
+            __m512i key = _mm512_setzero_si512();
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                __m512 pmin = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, stride, base + axis, 4);
+                __m512 pmax = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, stride, base + 4 + axis, 4);
+                __m512 c = _mm512_mul_ps(vhalf, _mm512_add_ps(pmin, pmax));
+                __m512 q = _mm512_mul_ps(_mm512_sub_ps(c, _mm512_set1_ps(origin[axis])), _mm512_set1_ps(scale[axis]));
+                q = _mm512_max_ps(_mm512_min_ps(q, vmaxcell), _mm512_setzero_ps());
+
+                __m512i v = _mm512_cvttps_epi32(q);
+                v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 16)), _mm512_set1_epi32(0x030000FF));
+                v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 8)), _mm512_set1_epi32(0x0300F00F));
+                v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 4)), _mm512_set1_epi32(0x030C30C3));
+                v = _mm512_and_si512(_mm512_or_si512(v, _mm512_slli_epi32(v, 2)), _mm512_set1_epi32(0x09249249));
+
+                key = _mm512_or_si512(key, _mm512_slli_epi32(v, 2 - axis));
+            }
+
+            _mm512_storeu_si512(reinterpret_cast<void*>(keys + i), key);
+        }
+
+        return i;
+    }
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#else
+    // Spread lower 10 bits of v so that there are 2 zero bits between each
+    static std::uint32_t ExpandBits(std::uint32_t v)
+    {
+        v = (v | (v << 16)) & 0x030000FF;
+        v = (v | (v << 8)) & 0x0300F00F;
+        v = (v | (v << 4)) & 0x030C30C3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+#endif
+
+    void LinearBvh::BuildImpl(bbox const* bounds, int numbounds)
+    {
+        InitNodeAllocator(2 * numbounds - 1);
+
+        std::vector<std::uint32_t> codes;
+
+        RunBuild(numbounds, [&]()
+        {
+            SortPrimitives(bounds, numbounds, codes);
+
+            if (m_sah_top && numbounds >= kMinSahTopPrims)
+            {
+                EmitSahTop(bounds, &codes[0], numbounds);
+            }
+            else
+            {
+                EmitNode(bounds, &codes[0], 0, numbounds, 0, 1);
+            }
+        });
+
+        // Leaves are referencing ranges of sorted indices
+        m_packed_indices = m_indices;
+
+        // Set root_ pointer
+        m_root = &m_nodes[0];
+    }
+
+    void LinearBvh::SortPrimitives(bbox const* bounds, int numbounds, std::vector<std::uint32_t>& codes)
+    {
+        int const num_chunks = (numbounds + kChunkSize - 1) / kChunkSize;
+
+        // Centroid bounds define Morton grid
+        std::vector<bbox> chunk_bounds(num_chunks);
+        ForEachChunk(m_scheduler, numbounds, [&](int c, int begin, int end)
+        {
+            bbox cb;
+            for (int i = begin; i < end; ++i)
+            {
+                cb.grow(bounds[i].center());
+            }
+
+            chunk_bounds[c] = cb;
+        });
+
+        bbox centroid_bounds;
+        for (auto& cb : chunk_bounds)
+        {
+            centroid_bounds.grow(cb);
+        }
+
+        // Quantize centroids to the grid, degenerate axes map to 0
+        float const numcells = (float)(1 << kMortonBits);
+        float3 origin = centroid_bounds.pmin;
+        float3 extents = centroid_bounds.extents();
+        float3 scale;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            scale[axis] = extents[axis] > 0.f ? numcells / extents[axis] : 0.f;
+        }
+
+        std::vector<std::uint32_t> keys(numbounds);
+        std::vector<int> indices(numbounds);
+
+        ForEachChunk(m_scheduler, numbounds, [&](int c, int begin, int end)
+        {
+#ifdef RR_BVH_SSE
+            // Widest instruction set of the host first, the rest goes through SSE
+            CpuFeatures const& isa = GetCpuFeatures();
+            int i = begin;
+
+            if (isa.avx512f)
+            {
+                i = EncodeMortonAvx512(bounds, i, end, origin, scale, numcells, &keys[0]);
+            }
+
+            if (isa.avx2)
+            {
+                i = EncodeMortonAvx2(bounds, i, end, origin, scale, numcells, &keys[0]);
+            }
+
+            EncodeMortonSse(bounds, i, end, origin, scale, numcells, &keys[0]);
+
+            for (i = begin; i < end; ++i)
+            {
+                indices[i] = i;
+            }
+#else
+            for (int i = begin; i < end; ++i)
+            {
+                float3 q = (bounds[i].center() - origin) * scale;
+
+                std::uint32_t bits[3];
+                for (int axis = 0; axis < 3; ++axis)
+                {
+                    bits[axis] = ExpandBits((std::uint32_t)std::max(std::min(q[axis], numcells - 1.f), 0.f));
+                }
+
+                keys[i] = (bits[0] << 2) | (bits[1] << 1) | bits[2];
+                indices[i] = i;
+            }
+#endif
+        });
+
+        // LSD radix sort: chunks count their digits, then scatter
+        // into disjoint ranges, so passes are stable and parallel
+        std::vector<std::uint32_t> tmpkeys(numbounds);
+        std::vector<int> tmpindices(numbounds);
+        std::vector<int> offsets(num_chunks * kRadixSize);
+
+        for (int shift = 0; shift < 3 * kMortonBits; shift += kRadixBits)
+        {
+            ForEachChunk(m_scheduler, numbounds, [&](int c, int begin, int end)
+            {
+                int* histogram = &offsets[c * kRadixSize];
+                std::fill(histogram, histogram + kRadixSize, 0);
+
+                for (int i = begin; i < end; ++i)
+                {
+                    ++histogram[(keys[i] >> shift) & (kRadixSize - 1)];
+                }
+            });
+
+            // Digit major prefix sum over chunk histograms
+            int sum = 0;
+            for (int d = 0; d < kRadixSize; ++d)
+            {
+                for (int c = 0; c < num_chunks; ++c)
+                {
+                    int count = offsets[c * kRadixSize + d];
+                    offsets[c * kRadixSize + d] = sum;
+                    sum += count;
+                }
+            }
+
+            ForEachChunk(m_scheduler, numbounds, [&](int c, int begin, int end)
+            {
+                int* offset = &offsets[c * kRadixSize];
+
+                for (int i = begin; i < end; ++i)
+                {
+                    int dst = offset[(keys[i] >> shift) & (kRadixSize - 1)]++;
+                    tmpkeys[dst] = keys[i];
+                    tmpindices[dst] = indices[i];
+                }
+            });
+
+            keys.swap(tmpkeys);
+            indices.swap(tmpindices);
+        }
+
+        codes.swap(keys);
+        m_indices.swap(indices);
+    }
+
+    Bvh::Node* LinearBvh::EmitNode(bbox const* bounds, std::uint32_t const* codes, int begin, int end, int level, int index)
+    {
+        Node* node = AllocateNode();
+        node->index = index;
+
+        // Leaves are the deepest nodes, height is set from them only
+        if (end - begin < 2)
+        {
+            UpdateHeight(level);
+
+            node->type = kLeaf;
+            node->startidx = begin;
+            node->numprims = end - begin;
+            node->bounds = bounds[m_indices[begin]];
+            return node;
+        }
+
+        // Split at the highest bit the codes of the range differ in,
+        // codes sharing the bit above it are sorted so the ones with
+        // the bit cleared go first. Equal codes are split in half.
+        int split = begin + ((end - begin) >> 1);
+        std::uint32_t diff = codes[begin] ^ codes[end - 1];
+
+        if (diff)
+        {
+            std::uint32_t bit = diff;
+            bit |= bit >> 1;
+            bit |= bit >> 2;
+            bit |= bit >> 4;
+            bit |= bit >> 8;
+            bit |= bit >> 16;
+            bit ^= bit >> 1;
+
+            split = (int)(std::partition_point(codes + begin, codes + end,
+                [bit](std::uint32_t code) { return (code & bit) == 0; }) - codes);
+        }
+
+        node->type = kInternal;
+
+        // Large subtrees are handed over to the scheduler, idle
+        // workers steal them while we descend into the left one
+        if (m_scheduler && end - split >= kParallelSubtreeThreshold)
+        {
+            task_group group;
+            m_scheduler->spawn(group, [this, node, bounds, codes, split, end, level, index]()
+            {
+                node->rc = EmitNode(bounds, codes, split, end, level + 1, (index << 1) + 1);
+            });
+
+            node->lc = EmitNode(bounds, codes, begin, split, level + 1, index << 1);
+            m_scheduler->wait(group);
+        }
+        else
+        {
+            node->lc = EmitNode(bounds, codes, begin, split, level + 1, index << 1);
+            node->rc = EmitNode(bounds, codes, split, end, level + 1, (index << 1) + 1);
+        }
+
+        node->bounds = bboxunion(node->lc->bounds, node->rc->bounds);
+        return node;
+    }
+
+    void LinearBvh::EmitSahTop(bbox const* bounds, std::uint32_t const* codes, int numbounds)
+    {
+        // Clusters are runs of sorted primitives in the same coarse cell
+        int const shift = 3 * kMortonBits - kClusterBits;
+        std::vector<int> cluster_start(1, 0);
+
+        for (int i = 1; i < numbounds; ++i)
+        {
+            if ((codes[i] >> shift) != (codes[i - 1] >> shift))
+            {
+                cluster_start.push_back(i);
+            }
+        }
+
+        int const num_clusters = (int)cluster_start.size();
+        cluster_start.push_back(numbounds);
+
+        if (num_clusters < 2)
+        {
+            EmitNode(bounds, codes, 0, numbounds, 0, 1);
+            return;
+        }
+
+        std::vector<bbox> cluster_bounds(num_clusters);
+        ForEachChunk(m_scheduler, num_clusters, [&](int c, int begin, int end)
+        {
+            for (int i = begin; i < end; ++i)
+            {
+                bbox cb;
+                for (int j = cluster_start[i]; j < cluster_start[i + 1]; ++j)
+                {
+                    cb.grow(bounds[m_indices[j]]);
+                }
+
+                cluster_bounds[i] = cb;
+            }
+        });
+
+        Bvh top(m_traversal_cost, m_num_bins, true);
+        top.SetScheduler(m_scheduler);
+        top.Build(&cluster_bounds[0], num_clusters);
+
+        int const* top_indices = top.GetIndices();
+
+        // Copy the top tree into our nodes replacing its leaves by the
+        // cluster subtrees, indices and levels continue from the top
+        struct Item
+        {
+            Node const* top;
+            Node** ptr;
+            int level;
+            int index;
+        };
+
+        task_group group;
+        std::vector<Item> stack(1, Item{ top.m_root, nullptr, 0, 1 });
+
+        while (!stack.empty())
+        {
+            Item item = stack.back();
+            stack.pop_back();
+
+            if (item.top->type == kLeaf)
+            {
+                int cluster = top_indices[item.top->startidx];
+                int begin = cluster_start[cluster];
+                int end = cluster_start[cluster + 1];
+
+                if (m_scheduler && end - begin >= kParallelSubtreeThreshold)
+                {
+                    m_scheduler->spawn(group, [this, item, bounds, codes, begin, end]()
+                    {
+                        *item.ptr = EmitNode(bounds, codes, begin, end, item.level, item.index);
+                    });
+                }
+                else
+                {
+                    *item.ptr = EmitNode(bounds, codes, begin, end, item.level, item.index);
+                }
+
+                continue;
+            }
+
+            Node* node = AllocateNode();
+            node->type = kInternal;
+            node->bounds = item.top->bounds;
+            node->index = item.index;
+
+            if (item.ptr) *item.ptr = node;
+
+            stack.push_back(Item{ item.top->rc, &node->rc, item.level + 1, (item.index << 1) + 1 });
+            stack.push_back(Item{ item.top->lc, &node->lc, item.level + 1, item.index << 1 });
+        }
+
+        if (m_scheduler)
+        {
+            m_scheduler->wait(group);
+        }
+    }
+}
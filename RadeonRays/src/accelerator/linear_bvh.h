@@ -0,0 +1,68 @@
+/**********************************************************************
+ Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+ 
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+ 
+ The above copyright notice and this permission notice shall be included in
+ all copies or substantial portions of the Software.
+ 
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ THE SOFTWARE.
+ ********************************************************************/
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "bvh.h"
+
+#include <cstdint>
+
+namespace RadeonRays
+{
+    ///< The class represents linear BVH built on CPU:
+    ///< primitives are sorted along the Morton curve of their centroids
+    ///< with a parallel radix sort and the tree is emitted from the
+    ///< bits of sorted codes, so the build is a few linear passes.
+    ///< Optionally the top of the tree is built with SAH over the
+    ///< clusters of primitives sharing the same coarse grid cell (HLBVH).
+    ///< http://research.nvidia.com/sites/default/files/publications/HLBVH-final.pdf
+    ///<
+    class LinearBvh : public Bvh
+    {
+    public:
+        LinearBvh(float traversal_cost, int num_bins = 64, bool sah_top = true)
+            : Bvh(traversal_cost, num_bins, false)
+            , m_sah_top(sah_top)
+        {
+        }
+
+    protected:
+        // Build function
+        void BuildImpl(bbox const* bounds, int numbounds) override;
+
+    private:
+        // Sort primitive indices by Morton codes of their centroids
+        void SortPrimitives(bbox const* bounds, int numbounds, std::vector<std::uint32_t>& codes);
+        // Emit the subtree for sorted primitives [begin, end)
+        Node* EmitNode(bbox const* bounds, std::uint32_t const* codes, int begin, int end, int level, int index);
+        // Build SAH tree over primitive clusters and emit the clusters below its leaves
+        void EmitSahTop(bbox const* bounds, std::uint32_t const* codes, int numbounds);
+
+        // Build the top of the tree with SAH
+        bool m_sah_top;
+
+        LinearBvh(LinearBvh const&);
+        LinearBvh& operator = (LinearBvh const&);
+    };
+}
+
+#endif // LINEAR_BVH_H
@@ -1,9 +1,15 @@
 #include "split_bvh.h"
 #include "math/mathutils.h"
+#include "../async/task_scheduler.h"
+#include "../util/build_arena.h"
 #include <cassert>
+#include <stack>
 
 namespace RadeonRays
 {
+    // Minimum number of primitive refs in a subtree to spawn a task for it
+    static int constexpr kParallelSubtreeThreshold = 1 << 12;
+
     static float3 clamp3(float3 val, float3 a, float3 b)
     {
         return float3{ clamp(val.x, a.x, b.x), clamp(val.y, a.y, b.y), clamp(val.z, a.z, b.z) };
@@ -14,8 +20,6 @@ namespace RadeonRays
         // Initialize prim refs structures
         PrimRefArray primrefs(numbounds);
 
-        // Keep centroids to speed up partitioning
-        std::vector<float3> centroids(numbounds);
         bbox centroid_bounds;
 
         for (auto i = 0; i < numbounds; ++i)
@@ -33,30 +37,65 @@ namespace RadeonRays
 
         SplitRequest init = { 0, numbounds, nullptr, m_bounds, centroid_bounds, 0 };
 
-        // Start from the top
-        BuildNode(init, primrefs);
+        // Start from the top, large subtrees are built by worker
+        // threads in their own prim ref arrays
+        RunBuild(numbounds, [&]()
+        {
+            BuildNode(init, primrefs);
+        });
+
+        PackIndices();
+    }
+
+    void SplitBvh::PackIndices()
+    {
+        m_packed_indices.clear();
+
+        // Leaves are keeping primitive index in startidx during the build,
+        // gather them in the same order the serial build produces (right first)
+        std::stack<Node*> stack;
+        stack.push(m_root);
+
+        while (!stack.empty())
+        {
+            Node* node = stack.top();
+            stack.pop();
+
+            if (node->type == kLeaf)
+            {
+                int idx = node->startidx;
+                node->startidx = static_cast<int>(m_packed_indices.size());
+
+                if (node->numprims > 0)
+                {
+                    m_packed_indices.push_back(idx);
+                }
+            }
+            else
+            {
+                stack.push(node->lc);
+                stack.push(node->rc);
+            }
+        }
     }
 
     void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
     {
         // Update current height
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
         // Allocate new node
         Node* node = AllocateNode();
         node->bounds = req.bounds;
 
         // Create leaf node if we have enough prims
+        // Leaf keeps the primitive index itself until PackIndices
+        // since prim ref arrays are reused and thread local
         if (req.numprims < 2)
         {
             node->type = kLeaf;
-            node->startidx = (int)m_packed_indices.size();
+            node->startidx = req.numprims > 0 ? primrefs[req.startidx].idx : -1;
             node->numprims = req.numprims;
-
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                m_packed_indices.push_back(primrefs[i].idx);
-            }
         }
         else
         {
@@ -181,13 +220,31 @@ namespace RadeonRays
             SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
 
 
-            // The order is very important here since right node uses the space at the end of the array to partition
+            if (m_scheduler && rightrequest.numprims >= kParallelSubtreeThreshold)
             {
-                BuildNode(rightrequest, primrefs);
-            }
+                // Move right refs into a separate arena, so both subtrees
+                // are free to append split refs at the end of their arrays.
+                // Parity of the start index is kept since it defines
+                // partitioning direction.
+                int offset = rightrequest.startidx & 0x1;
+                auto arena = std::make_shared<PrimRefArray>(offset + rightrequest.numprims);
+                std::copy(primrefs.begin() + rightrequest.startidx,
+                    primrefs.begin() + rightrequest.startidx + rightrequest.numprims,
+                    arena->begin() + offset);
+                rightrequest.startidx = offset;
+
+                m_scheduler->spawn(*m_build_group, [this, rightrequest, arena]()
+                {
+                    SplitRequest request = rightrequest;
+                    BuildNode(request, *arena);
+                });
 
+                BuildNode(leftrequest, primrefs);
+            }
+            else
             {
-                // Put those to stack
+                // The order is very important here since right node uses the space at the end of the array to partition
+                BuildNode(rightrequest, primrefs);
                 BuildNode(leftrequest, primrefs);
             }
         }
@@ -200,14 +257,11 @@ namespace RadeonRays
     {
         // SAH implementation
         // calc centroids histogram
-        // moving split bin index
-        int splitidx = -1;
-        // Set SAH to maximum float value as a start
-        auto sah = std::numeric_limits<float>::max();
         SahSplit split;
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
-        split.sah = sah;
+        split.sah = std::numeric_limits<float>::max();
+        split.overlap = 0.f;
 
         // if we cannot apply histogram algorithm
         // put NAN sentinel as split border
@@ -219,100 +273,22 @@ namespace RadeonRays
             return split;
         }
 
-        // Bin has bbox and occurence count
-        struct Bin
-        {
-            bbox bounds;
-            int count;
-        };
-
-        // Keep bins for each dimension
-        std::vector<Bin> bins[3];
-        bins[0].resize(m_num_bins);
-        bins[1].resize(m_num_bins);
-        bins[2].resize(m_num_bins);
+        // Keep bins for all dimensions, all the axes are binned
+        // in a single pass over the primitive refs
+        BuildArena::Scope scope;
+        std::vector<Bin, BuildArena::Allocator<Bin>> bins(3 * m_num_bins, Bin{ bbox(), 0 });
 
-        // Precompute inverse parent area
-        auto invarea = 1.f / req.bounds.surface_area();
-        // Precompute min point
+        // Precompute min point and inverse ranges for histogram
         auto rootmin = req.centroid_bounds.pmin;
+        auto invrng = GetInvCentroidRange(req.centroid_bounds);
 
-        // Evaluate all dimensions
-        for (int axis = 0; axis < 3; ++axis)
-        {
-            float rootminc = rootmin[axis];
-            // Range for histogram
-            auto centroid_rng = centroid_extents[axis];
-            auto invcentroid_rng = 1.f / centroid_rng;
-
-            // If the box is degenerate in that dimension skip it
-            if (centroid_rng == 0.f) continue;
-
-            // Initialize bins
-            for (unsigned i = 0; i < m_num_bins; ++i)
-            {
-                bins[axis][i].count = 0;
-                bins[axis][i].bounds = bbox();
-            }
-
-            // Calc primitive refs histogram
-            for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
-            {
-                auto idx = i;
-                auto binidx = (int)std::min<float>(m_num_bins * ((refs[idx].center[axis] - rootminc) * invcentroid_rng), m_num_bins - 1);
-
-                ++bins[axis][binidx].count;
-                bins[axis][binidx].bounds.grow(refs[idx].bounds);
-            }
-
-            std::vector<bbox> rightbounds(m_num_bins - 1);
-
-            // Start with 1-bin right box
-            bbox rightbox = bbox();
-            for (int i = m_num_bins - 1; i > 0; --i)
-            {
-                rightbox.grow(bins[axis][i].bounds);
-                rightbounds[i - 1] = rightbox;
-            }
-
-            bbox leftbox = bbox();
-            int  leftcount = 0;
-            int  rightcount = req.numprims;
-
-            // Start best SAH search
-            // i is current split candidate (split between i and i + 1)
-            float sahtmp = 0.f;
-            for (int i = 0; i < m_num_bins - 1; ++i)
-            {
-                leftbox.grow(bins[axis][i].bounds);
-                leftcount += bins[axis][i].count;
-                rightcount -= bins[axis][i].count;
-
-                // Compute SAH
-                sahtmp = m_traversal_cost + (leftcount * leftbox.surface_area() + rightcount * rightbounds[i].surface_area()) * invarea;
-
-                // Check if it is better than what we found so far
-                if (sahtmp < sah)
-                {
-                    split.dim = axis;
-                    splitidx = i;
-                    sah = sahtmp;
-
-                    // Calculate percentage of overlap 
-                    split.overlap = intersection(leftbox, rightbounds[i]).surface_area() * invarea;
-                }
-            }
-        }
-
-        // Choose split plane
-        if (splitidx != -1)
+        // Calc primitive refs histogram
+        for (int i = req.startidx; i < req.startidx + req.numprims; ++i)
         {
-            split.split = rootmin[split.dim] + (splitidx + 1) * (centroid_extents[split.dim] / m_num_bins);
-            split.sah = sah;
-
+            AddToBins(refs[i].bounds, refs[i].center, rootmin, invrng, &bins[0]);
         }
 
-        return split;
+        return SweepBins(req, invrng, &bins[0]);
     }
 
     SplitBvh::SahSplit SplitBvh::FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const
@@ -326,6 +302,7 @@ namespace RadeonRays
         split.dim = 0;
         split.split = std::numeric_limits<float>::quiet_NaN();
         split.sah = sah;
+        split.overlap = 0.f;
 
 
         // Extents
@@ -498,24 +475,57 @@ namespace RadeonRays
 
     SplitBvh::Node* SplitBvh::AllocateNode()
     {
-        if (m_nodecnt - m_num_nodes_archived >= m_num_nodes_for_regular)
+        int idx = m_nodecnt++;
+
+        // Find the chunk: chunk k starts at m_chunk_size * (2^k - 1)
+        int chunk = 0;
+        int chunk_start = 0;
+        int chunk_size = m_chunk_size;
+        while (idx >= chunk_start + chunk_size)
+        {
+            chunk_start += chunk_size;
+            chunk_size <<= 1;
+            ++chunk;
+        }
+
+        assert(chunk < kMaxNodeChunks);
+
+        Node* nodes = m_node_chunks[chunk].load();
+        if (!nodes)
         {
-            m_node_archive.push_back(std::move(m_nodes));
-            m_num_nodes_archived += m_num_nodes_for_regular;
-            m_nodes = std::vector<Node>(m_num_nodes_for_regular);
+            // Several threads might race here, only one allocation survives
+            Node* new_nodes = new Node[chunk_size];
+            if (m_node_chunks[chunk].compare_exchange_strong(nodes, new_nodes))
+            {
+                nodes = new_nodes;
+            }
+            else
+            {
+                delete[] new_nodes;
+            }
         }
 
-        return &m_nodes[m_nodecnt++ - m_num_nodes_archived];
+        return nodes + (idx - chunk_start);
     }
 
     void SplitBvh::InitNodeAllocator(size_t maxnum)
     {
-        m_node_archive.clear();
+        FreeNodeChunks();
+
         m_nodecnt = 0;
-        m_nodes.resize(maxnum);
+        m_chunk_size = static_cast<int>(std::max<size_t>(maxnum, 1));
+        m_node_chunks[0] = new Node[m_chunk_size];
 
         // Set root_ pointer
-        m_root = &m_nodes[0];
+        m_root = m_node_chunks[0];
+    }
+
+    void SplitBvh::FreeNodeChunks()
+    {
+        for (auto& chunk : m_node_chunks)
+        {
+            delete[] chunk.exchange(nullptr);
+        }
     }
 
     void SplitBvh::PrintStatistics(std::ostream& os) const
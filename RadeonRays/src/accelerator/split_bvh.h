@@ -40,8 +40,12 @@ namespace RadeonRays
         , m_extra_refs_budget(extra_refs_budget)
         , m_num_nodes_required(0)
         , m_num_nodes_for_regular(0)
-        , m_num_nodes_archived(0)
+        , m_chunk_size(0)
         {
+            for (auto& chunk : m_node_chunks)
+            {
+                chunk = nullptr;
+            }
         }
 
         ~SplitBvh();
@@ -64,6 +68,8 @@ namespace RadeonRays
         SahSplit FindSpatialSahSplit(SplitRequest const& req, PrimRefArray const& refs) const;
         
         void SplitPrimRefs(SahSplit const& split, SplitRequest const& req, PrimRefArray& refs, int& extra_refs);
+        // Assign packed indices to leaves once the tree is built
+        void PackIndices();
         bool SplitPrimRef(PrimRef const& ref, int axis, float split, PrimRef& leftref, PrimRef& rightref) const;
 
         // Print BVH statistics
@@ -81,14 +87,17 @@ namespace RadeonRays
         int m_num_nodes_required;
         int m_num_nodes_for_regular;
 
-        // Node archive for memory management
-        // As m_nodes fills up we archive it into m_node_archive
-        // allocate new chunk and work there.
+        // Lock free node allocator: as the number of nodes is not known
+        // in advance, nodes live in chunks of geometrically growing size
+        // (chunk k holds m_chunk_size << k nodes) which are allocated
+        // on demand by the first thread touching them.
+        static int constexpr kMaxNodeChunks = 24;
+        // Size of the first chunk
+        int m_chunk_size;
+        // Node chunks
+        std::atomic<Node*> m_node_chunks[kMaxNodeChunks];
 
-        // How many nodes have been archived so far
-        int m_num_nodes_archived;
-        // Container for archived chunks
-        std::list<std::vector<Node>> m_node_archive;
+        void FreeNodeChunks();
 
         SplitBvh(SplitBvh const&);
         SplitBvh& operator = (SplitBvh const&);
@@ -107,5 +116,6 @@ namespace RadeonRays
     
     inline SplitBvh::~SplitBvh()
     {
+        FreeNodeChunks();
     }
 }
\ No newline at end of file
@@ -0,0 +1,338 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "uniform_grid.h"
+#include "buffer.h"
+#include "primitives.h"
+#include "executable.h"
+#include "../except/except.h"
+#include "../intersector/kernel_timer.h"
+#include "../intersector/memory_usage.h"
+#include "../util/trace.h"
+#include "calc.h"
+#include "event.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+    // Upper limit of top level cells regardless of the density
+    static int const kMaxTopCells = 1 << 22;
+
+    // Delete a buffer if there is one
+    static void DeleteBuffer(Calc::Device* device, Calc::Buffer*& buffer)
+    {
+        if (buffer)
+        {
+            device->DeleteBuffer(buffer);
+            buffer = nullptr;
+        }
+    }
+
+    // Grow geometrically so that slowly growing animated content
+    // doesn't reallocate on every build
+    static int GrowCapacity(int size, int capacity)
+    {
+        return std::max(std::max(size, capacity + capacity / 2), 1);
+    }
+
+    UniformGrid::UniformGrid(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+        , m_top_density(0.0625f)
+        , m_leaf_density(2.f)
+        , m_num_prims(0)
+        , m_num_top_cells(0)
+        , m_num_leaf_cells(0)
+        , m_num_refs(0)
+        , m_bounds_capacity(0)
+        , m_top_capacity(0)
+        , m_leaf_capacity(0)
+        , m_refs_capacity(0)
+        , m_timer(nullptr)
+    {
+        InitGpuData();
+    }
+
+    UniformGrid::~UniformGrid()
+    {
+    }
+
+    void UniformGrid::InitGpuData()
+    {
+        // Counting sort needs scans of the parallel primitives
+        if (!m_device->HasBuiltinPrimitives())
+        {
+            throw ExceptionImpl("This device does not support grid construction\n");
+        }
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/build_grid.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_build_grid_opencl, std::strlen(g_build_grid_opencl), nullptr);
+#endif
+#endif
+
+        m_gpudata->init_grid_func = m_gpudata->executable->CreateFunction("init_grid_main");
+        m_gpudata->count_top_func = m_gpudata->executable->CreateFunction("count_top_cells_main");
+        m_gpudata->init_top_func = m_gpudata->executable->CreateFunction("init_top_cells_main");
+        m_gpudata->count_leaf_func = m_gpudata->executable->CreateFunction("count_leaf_cells_main");
+        m_gpudata->scatter_func = m_gpudata->executable->CreateFunction("scatter_refs_main");
+
+        m_gpudata->scene_bound = m_device->CreateBuffer(sizeof(bbox), Calc::BufferType::kWrite);
+        m_gpudata->desc = m_device->CreateBuffer(sizeof(Desc), Calc::BufferType::kWrite);
+        m_gpudata->pp = m_device->CreatePrimitives();
+    }
+
+    void UniformGrid::SetDensity(float top_density, float leaf_density)
+    {
+        ThrowIf(!(top_density > 0.f) || !(leaf_density > 0.f), "Grid densities should be positive");
+        m_top_density = top_density;
+        m_leaf_density = leaf_density;
+    }
+
+    void UniformGrid::AllocateBounds(int num_prims)
+    {
+        if (num_prims > m_bounds_capacity)
+        {
+            m_bounds_capacity = GrowCapacity(num_prims, m_bounds_capacity);
+            DeleteBuffer(m_device, m_gpudata->bounds);
+            m_gpudata->bounds = m_device->CreateBuffer(m_bounds_capacity * sizeof(bbox), Calc::BufferType::kRead);
+        }
+    }
+
+    void UniformGrid::AllocateTopCells(int num_cells)
+    {
+        if (num_cells > m_top_capacity)
+        {
+            m_top_capacity = GrowCapacity(num_cells, m_top_capacity);
+            DeleteBuffer(m_device, m_gpudata->top_counts);
+            DeleteBuffer(m_device, m_gpudata->top_res);
+            DeleteBuffer(m_device, m_gpudata->top_leaf_counts);
+            DeleteBuffer(m_device, m_gpudata->top_leaf_starts);
+            m_gpudata->top_counts = m_device->CreateBuffer(m_top_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->top_res = m_device->CreateBuffer(m_top_capacity * 4 * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->top_leaf_counts = m_device->CreateBuffer(m_top_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->top_leaf_starts = m_device->CreateBuffer(m_top_capacity * sizeof(int), Calc::BufferType::kWrite);
+        }
+    }
+
+    void UniformGrid::AllocateLeafCells(int num_cells)
+    {
+        if (num_cells > m_leaf_capacity)
+        {
+            m_leaf_capacity = GrowCapacity(num_cells, m_leaf_capacity);
+            DeleteBuffer(m_device, m_gpudata->leaf_counts);
+            DeleteBuffer(m_device, m_gpudata->leaf_starts);
+            DeleteBuffer(m_device, m_gpudata->leaf_ends);
+            m_gpudata->leaf_counts = m_device->CreateBuffer(m_leaf_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->leaf_starts = m_device->CreateBuffer(m_leaf_capacity * sizeof(int), Calc::BufferType::kWrite);
+            m_gpudata->leaf_ends = m_device->CreateBuffer(m_leaf_capacity * sizeof(int), Calc::BufferType::kWrite);
+        }
+    }
+
+    void UniformGrid::AllocateRefs(int num_refs)
+    {
+        if (num_refs > m_refs_capacity)
+        {
+            m_refs_capacity = GrowCapacity(num_refs, m_refs_capacity);
+            DeleteBuffer(m_device, m_gpudata->refs);
+            m_gpudata->refs = m_device->CreateBuffer(m_refs_capacity * sizeof(int), Calc::BufferType::kWrite);
+        }
+    }
+
+    void UniformGrid::Build(bbox const* bounds, int numbounds)
+    {
+        AllocateBounds(numbounds);
+
+        if (numbounds > 0)
+        {
+            m_device->WriteBuffer(m_gpudata->bounds, 0, 0, numbounds * sizeof(bbox), const_cast<bbox*>(bounds), nullptr);
+        }
+
+        Build(m_gpudata->bounds, numbounds);
+    }
+
+    void UniformGrid::Build(Calc::Buffer const* bounds, int numbounds)
+    {
+        TraceScope trace("UniformGrid::Build", "builder");
+
+        int num_prims = numbounds;
+        int max_cells = static_cast<int>(std::min(std::ceil(m_top_density * num_prims), static_cast<float>(kMaxTopCells)));
+        max_cells = std::max(max_cells, 1);
+
+        AllocateTopCells(max_cells);
+
+        m_num_prims = num_prims;
+
+        // Empty scenes get a single empty cell, traversal then misses right away
+        if (num_prims == 0)
+        {
+            Desc desc = {};
+            desc.res[0] = desc.res[1] = desc.res[2] = desc.res[3] = 1;
+            int const top_res[4] = { 0, 0, 0, 0 };
+            m_device->WriteBuffer(m_gpudata->desc, 0, 0, sizeof(Desc), &desc, nullptr);
+            m_device->WriteBuffer(m_gpudata->top_res, 0, 0, sizeof(top_res), const_cast<int*>(top_res), nullptr);
+            m_device->Finish(0);
+            AllocateLeafCells(1);
+            AllocateRefs(1);
+            m_num_top_cells = 1;
+            m_num_leaf_cells = 0;
+            m_num_refs = 0;
+            return;
+        }
+
+        int globalsize = ((num_prims + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        int cells_globalsize = ((max_cells + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Lay the top level out over the scene bounds
+        m_gpudata->pp->ReduceBounds(0, bounds, m_gpudata->scene_bound, num_prims);
+
+        int arg = 0;
+        m_gpudata->init_grid_func->SetArg(arg++, m_gpudata->scene_bound);
+        m_gpudata->init_grid_func->SetArg(arg++, sizeof(num_prims), &num_prims);
+        m_gpudata->init_grid_func->SetArg(arg++, sizeof(m_top_density), &m_top_density);
+        m_gpudata->init_grid_func->SetArg(arg++, sizeof(max_cells), &max_cells);
+        m_gpudata->init_grid_func->SetArg(arg++, m_gpudata->desc);
+
+        Execute("grid_init", m_gpudata->init_grid_func, kWorkGroupSize);
+
+        // Count primitives of top level cells
+        m_device->FillBuffer(m_gpudata->top_counts, 0, 0, max_cells * sizeof(int), 0, nullptr);
+
+        arg = 0;
+        m_gpudata->count_top_func->SetArg(arg++, bounds);
+        m_gpudata->count_top_func->SetArg(arg++, sizeof(num_prims), &num_prims);
+        m_gpudata->count_top_func->SetArg(arg++, m_gpudata->desc);
+        m_gpudata->count_top_func->SetArg(arg++, m_gpudata->top_counts);
+
+        Execute("grid_count_top", m_gpudata->count_top_func, globalsize);
+
+        // Sub-grid resolutions and their leaf cell ranges
+        arg = 0;
+        m_gpudata->init_top_func->SetArg(arg++, m_gpudata->top_counts);
+        m_gpudata->init_top_func->SetArg(arg++, sizeof(max_cells), &max_cells);
+        m_gpudata->init_top_func->SetArg(arg++, sizeof(m_leaf_density), &m_leaf_density);
+        m_gpudata->init_top_func->SetArg(arg++, m_gpudata->desc);
+        m_gpudata->init_top_func->SetArg(arg++, m_gpudata->top_res);
+        m_gpudata->init_top_func->SetArg(arg++, m_gpudata->top_leaf_counts);
+
+        Execute("grid_init_top", m_gpudata->init_top_func, cells_globalsize);
+
+        m_gpudata->pp->ScanExclusiveAddInt32(0, m_gpudata->top_leaf_counts, m_gpudata->top_leaf_starts, max_cells);
+
+        int const num_leaf_cells = ReadTotal(m_gpudata->top_leaf_starts, m_gpudata->top_leaf_counts, max_cells);
+        AllocateLeafCells(num_leaf_cells);
+
+        // Count primitives of leaf cells
+        m_device->FillBuffer(m_gpudata->leaf_counts, 0, 0, num_leaf_cells * sizeof(int), 0, nullptr);
+
+        arg = 0;
+        m_gpudata->count_leaf_func->SetArg(arg++, bounds);
+        m_gpudata->count_leaf_func->SetArg(arg++, sizeof(num_prims), &num_prims);
+        m_gpudata->count_leaf_func->SetArg(arg++, m_gpudata->desc);
+        m_gpudata->count_leaf_func->SetArg(arg++, m_gpudata->top_res);
+        m_gpudata->count_leaf_func->SetArg(arg++, m_gpudata->top_leaf_starts);
+        m_gpudata->count_leaf_func->SetArg(arg++, m_gpudata->leaf_counts);
+
+        Execute("grid_count_leaf", m_gpudata->count_leaf_func, globalsize);
+
+        m_gpudata->pp->ScanExclusiveAddInt32(0, m_gpudata->leaf_counts, m_gpudata->leaf_starts, num_leaf_cells);
+
+        int const num_refs = ReadTotal(m_gpudata->leaf_starts, m_gpudata->leaf_counts, num_leaf_cells);
+        AllocateRefs(num_refs);
+
+        // Scatter advances range starts to range ends
+        m_device->CopyBuffer(m_gpudata->leaf_starts, m_gpudata->leaf_ends, 0, 0, 0, num_leaf_cells * sizeof(int), nullptr);
+
+        arg = 0;
+        m_gpudata->scatter_func->SetArg(arg++, bounds);
+        m_gpudata->scatter_func->SetArg(arg++, sizeof(num_prims), &num_prims);
+        m_gpudata->scatter_func->SetArg(arg++, m_gpudata->desc);
+        m_gpudata->scatter_func->SetArg(arg++, m_gpudata->top_res);
+        m_gpudata->scatter_func->SetArg(arg++, m_gpudata->top_leaf_starts);
+        m_gpudata->scatter_func->SetArg(arg++, m_gpudata->leaf_ends);
+        m_gpudata->scatter_func->SetArg(arg++, m_gpudata->refs);
+
+        Execute("grid_scatter", m_gpudata->scatter_func, globalsize);
+
+        // Top level resolution is only needed for statistics
+        Desc desc;
+        m_device->ReadBuffer(m_gpudata->desc, 0, 0, sizeof(Desc), &desc, nullptr);
+        m_device->Finish(0);
+
+        m_num_top_cells = desc.res[3];
+        m_num_leaf_cells = num_leaf_cells;
+        m_num_refs = num_refs;
+    }
+
+    int UniformGrid::ReadTotal(Calc::Buffer const* starts, Calc::Buffer const* counts, int size) const
+    {
+        int last[2] = { 0, 0 };
+        m_device->ReadBuffer(starts, 0, (size - 1) * sizeof(int), sizeof(int), &last[0], nullptr);
+        m_device->ReadBuffer(counts, 0, (size - 1) * sizeof(int), sizeof(int), &last[1], nullptr);
+        m_device->Finish(0);
+        return last[0] + last[1];
+    }
+
+    void UniformGrid::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->desc);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->top_res);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->top_leaf_starts);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->leaf_starts);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->leaf_ends);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->refs);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->scene_bound);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->top_counts);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->top_leaf_counts);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->leaf_counts);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+
+    void UniformGrid::Execute(char const* name, Calc::Function const* func, std::size_t global_size) const
+    {
+        if (m_timer)
+        {
+            m_timer->Execute(name, func, 0, global_size, kWorkGroupSize, nullptr);
+        }
+        else
+        {
+            m_device->Execute(func, 0, global_size, kWorkGroupSize, nullptr);
+        }
+    }
+}
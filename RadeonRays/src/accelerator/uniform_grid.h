@@ -0,0 +1,220 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef UNIFORM_GRID_H
+#define UNIFORM_GRID_H
+
+#include "calc.h"
+#include "device.h"
+#include "executable.h"
+#include "radeon_rays.h"
+#include "math/bbox.h"
+
+#include <memory>
+
+namespace RadeonRays
+{
+    class KernelTimer;
+
+    ///< The class represents two-level uniform grid constructed fully on GPU
+    ///< "Two-Level Grids for Ray Tracing on GPUs", Kalojanov et al. 2011
+    ///
+    class UniformGrid
+    {
+    public:
+        UniformGrid(Calc::Device* device);
+
+        ~UniformGrid();
+
+        // Build function
+        void Build(bbox const* bounds, int numbounds);
+
+        // Build from primitive bounds already in device memory. Reads
+        // back the number of leaf cells and of references, so the build
+        // waits for the device twice.
+        void Build(Calc::Buffer const* bounds, int numbounds);
+
+        // Top level cells and leaf cells per primitive
+        void SetDensity(float top_density, float leaf_density);
+
+        // This class has its own GPU data,
+        // and it provides it as an interface in GPU memory
+        struct GpuData;
+        GpuData const& GetGpuData() const { return *m_gpudata; }
+
+        // Sizes of the last build
+        int GetNumPrims() const { return m_num_prims; }
+        int GetNumTopCells() const { return m_num_top_cells; }
+        int GetNumLeafCells() const { return m_num_leaf_cells; }
+        int GetNumRefs() const { return m_num_refs; }
+
+        // Time build kernels with the timer of the owning intersector (nullptr: no timing)
+        void SetTimer(KernelTimer const* timer) { m_timer = timer; }
+
+        // Add cells, references, build temporaries and the build program to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        void InitGpuData();
+        // Grow buffers to hold the given numbers of elements
+        void AllocateBounds(int num_prims);
+        void AllocateTopCells(int num_cells);
+        void AllocateLeafCells(int num_cells);
+        void AllocateRefs(int num_refs);
+        // Sum of the last elements of an exclusive scan and of its input, waits for the device
+        int ReadTotal(Calc::Buffer const* starts, Calc::Buffer const* counts, int size) const;
+        // Launch a build kernel, timed if there is a timer
+        void Execute(char const* name, Calc::Function const* func, std::size_t global_size) const;
+
+        UniformGrid(UniformGrid const&);
+        UniformGrid& operator = (UniformGrid const&);
+
+        // Context for GPU work submision
+        Calc::Device* m_device;
+
+        // Device data types
+        struct Desc;
+
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+
+        // Top level cells and leaf cells per primitive
+        float m_top_density;
+        float m_leaf_density;
+        // Sizes of the last build
+        int m_num_prims;
+        int m_num_top_cells;
+        int m_num_leaf_cells;
+        int m_num_refs;
+        // Number of elements GPU buffers can hold
+        int m_bounds_capacity;
+        int m_top_capacity;
+        int m_leaf_capacity;
+        int m_refs_capacity;
+        // Build kernel timer (nullptr if not set)
+        KernelTimer const* m_timer;
+    };
+
+    // Grid layout, matches grid_desc of the kernels
+    struct UniformGrid::Desc
+    {
+        float4 pmin;
+        float4 pmax;
+        // Top level cell size
+        float4 cell_size;
+        // Top level resolution, number of top level cells in w
+        int res[4];
+    };
+
+    struct UniformGrid::GpuData
+    {
+        // Device
+        Calc::Device* device;
+
+        // Parallel primitives
+        Calc::Primitives* pp;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* init_grid_func;
+        Calc::Function* count_top_func;
+        Calc::Function* init_top_func;
+        Calc::Function* count_leaf_func;
+        Calc::Function* scatter_func;
+
+        // Bounds uploaded by host side builds
+        Calc::Buffer* bounds;
+        // Scene bounds reduced by parallel primitives
+        Calc::Buffer* scene_bound;
+        // Grid layout
+        Calc::Buffer* desc;
+
+        // Primitive counts, sub-grid resolutions, leaf cell counts
+        // and first leaf cells of top level cells
+        Calc::Buffer* top_counts;
+        Calc::Buffer* top_res;
+        Calc::Buffer* top_leaf_counts;
+        Calc::Buffer* top_leaf_starts;
+
+        // Primitive counts and reference ranges of leaf cells
+        Calc::Buffer* leaf_counts;
+        Calc::Buffer* leaf_starts;
+        Calc::Buffer* leaf_ends;
+
+        // Primitive indices referenced by leaf cells
+        Calc::Buffer* refs;
+
+        GpuData(Calc::Device* dev)
+            : device(dev)
+            , pp(nullptr)
+            , executable(nullptr)
+            , init_grid_func(nullptr)
+            , count_top_func(nullptr)
+            , init_top_func(nullptr)
+            , count_leaf_func(nullptr)
+            , scatter_func(nullptr)
+            , bounds(nullptr)
+            , scene_bound(nullptr)
+            , desc(nullptr)
+            , top_counts(nullptr)
+            , top_res(nullptr)
+            , top_leaf_counts(nullptr)
+            , top_leaf_starts(nullptr)
+            , leaf_counts(nullptr)
+            , leaf_starts(nullptr)
+            , leaf_ends(nullptr)
+            , refs(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(init_grid_func);
+                executable->DeleteFunction(count_top_func);
+                executable->DeleteFunction(init_top_func);
+                executable->DeleteFunction(count_leaf_func);
+                executable->DeleteFunction(scatter_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
+
+            // Buffers are allocated on the first build that needs them
+            Calc::Buffer* buffers[] = { bounds, scene_bound, desc, top_counts, top_res, top_leaf_counts,
+                top_leaf_starts, leaf_counts, leaf_starts, leaf_ends, refs };
+
+            for (auto buffer : buffers)
+            {
+                if (buffer)
+                {
+                    device->DeleteBuffer(buffer);
+                }
+            }
+        }
+    };
+}
+
+#endif // UNIFORM_GRID_H
@@ -24,9 +24,16 @@ THE SOFTWARE.
 
 #include "calc.h"
 #include "device.h"
+#include "except.h"
 
 #include "../device/calc_intersection_device.h"
+#include "../device/hybrid_intersection_device.h"
+#include "../device/remote_intersection_device.h"
+#include "../util/trace.h"
 #include <cassert>
+#include <cstdlib>
+#include <string>
+#include <vector>
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -41,6 +48,8 @@ THE SOFTWARE.
     #include "../device/embree_intersection_device.h"
 #endif //USE_EMBREE
 
+#include "../device/cpu_intersection_device.h"
+
 #ifndef CALC_STATIC_LIBRARY
 
 #ifdef WIN32
@@ -94,7 +103,7 @@ namespace RadeonRays
     static RadeonRays::DeviceInfo::Platform s_calc_platform = RadeonRays::DeviceInfo::Platform::kAny;
 
 #ifndef CALC_STATIC_LIBRARY
-    static void* GetCalcEntryPoint(Calc::Platform platform, char const* name)
+    static HANDLE_TYPE LoadCalcLibrary()
     {
         HANDLE_TYPE hdll = LOADLIBRARY(LIBNAME);
 
@@ -103,54 +112,65 @@ namespace RadeonRays
             hdll = LOADLIBRARY(LONGNAME);
         }
 
-        if (!hdll)
+        return hdll;
+    }
+
+    static void* GetCalcEntryPoint(Calc::Platform platform, char const* name)
+    {
+        // Resolve the library once, every entry point lookup reuses the handle
+        static HANDLE_TYPE s_hdll = LoadCalcLibrary();
+
+        if (!s_hdll)
         {
             return nullptr;
         }
 
-        return GETFUNC(hdll, name);
+        return GETFUNC(s_hdll, name);
     }
 #endif
 
-#define GetCalc_impl(platform)                                                        \
-    static Calc::Calc* GetCalc##platform()                                            \
-    {                                                                                \
-        static Calc::Calc* s_calc##platform = nullptr;                                \
-        if (!s_calc##platform)                                                        \
-        {                                                                            \
-            s_calc##platform = CreateCalc(Calc::Platform::k##platform, 0);    \
-        }                                                                            \
-        return s_calc##platform;                                                    \
-    }
-
-    //GetCalc_impl(OpenCL)
-
-    GetCalc_impl(Vulkan)
-#undef GetCalc_impl
-
-    static Calc::Calc* GetCalcOpenCL()
+    // Creating a backend enumerates every platform and device it has,
+    // so it is attempted at most once and a failure is remembered
+    // instead of being retried on each device count or info query
+    static Calc::Calc* CreateCalcOnce(Calc::Platform platform)
     {
-        static Calc::Calc* s_calcOpenCL = nullptr;
-
-        if (!s_calcOpenCL)
+        try
         {
 #ifndef CALC_STATIC_LIBRARY
-            auto pfn_create_calc = GetCalcEntryPoint(Calc::Platform::kOpenCL, "CreateCalc");
+            auto pfn_create_calc = GetCalcEntryPoint(platform, "CreateCalc");
 
             if (pfn_create_calc)
             {
                 auto create_calc = reinterpret_cast<decltype(CreateCalc)*>(pfn_create_calc);
-                s_calcOpenCL = create_calc(Calc::Platform::kOpenCL, 0);
+                return create_calc(platform, 0);
             }
+
+            return nullptr;
 #else
-            s_calcOpenCL = CreateCalc(Calc::Platform::kOpenCL, 0);
+            return CreateCalc(platform, 0);
 #endif
         }
+        catch (Calc::Exception&)
+        {
+            return nullptr;
+        }
+    }
 
-        return s_calcOpenCL;
+#define GetCalc_impl(platform)                                                        \
+    static Calc::Calc* GetCalc##platform()                                            \
+    {                                                                                \
+        static Calc::Calc* s_calc##platform = CreateCalcOnce(Calc::Platform::k##platform); \
+        return s_calc##platform;                                                    \
     }
 
-    static Calc::Calc* GetCalc()
+    GetCalc_impl(OpenCL)
+
+    GetCalc_impl(Vulkan)
+#undef GetCalc_impl
+
+    // Only the first allowed backend exposing devices gets initialized,
+    // Vulkan is never touched when OpenCL already provides devices
+    static Calc::Calc* GetCalc(DeviceInfo::Platform* platform = nullptr)
     {
         // if CL allowed see if we have any devices if not
         // try Vulkan if allowed, if neither try embree if allowed
@@ -158,7 +178,11 @@ namespace RadeonRays
         if( s_calc_platform & DeviceInfo::Platform::kOpenCL )
         {
             auto* calc = GetCalcOpenCL();
-            if (calc != nullptr) { return calc; }
+            if (calc != nullptr && calc->GetDeviceCount() > 0)
+            {
+                if (platform) { *platform = DeviceInfo::Platform::kOpenCL; }
+                return calc;
+            }
         }
 #endif
 
@@ -166,7 +190,11 @@ namespace RadeonRays
         if ( s_calc_platform & DeviceInfo::Platform::kVulkan )
         {
             auto* calc = GetCalcVulkan();
-            if (calc != nullptr) { return calc; }
+            if (calc != nullptr && calc->GetDeviceCount() > 0)
+            {
+                if (platform) { *platform = DeviceInfo::Platform::kVulkan; }
+                return calc;
+            }
         }
 #endif
         return nullptr;
@@ -177,48 +205,72 @@ namespace RadeonRays
         s_calc_platform = platform;
     }
 
-    std::uint32_t IntersectionApi::GetDeviceCount()
+    void IntersectionApi::SetKernelCachePath(char const* path)
+    {
+        SetCalcBinaryCachePath(path);
+    }
+
+    void IntersectionApi::SetTraceCallback(TraceCallback callback, void* userdata)
+    {
+        Tracer::SetCallback(callback, userdata);
+    }
+
+    void IntersectionApi::StartTrace(char const* filename)
+    {
+        Tracer::StartFile(filename);
+    }
+
+    void IntersectionApi::StopTrace()
+    {
+        Tracer::StopFile();
+    }
+
+    static std::uint32_t GetCalcDeviceCount()
     {
         auto* calc = GetCalc();
-        std::uint32_t result = 0;
-        if (calc != nullptr)
-        {
-            result += GetCalc()->GetDeviceCount();
-        }
-        // embree is always the last device
+        return calc != nullptr ? calc->GetDeviceCount() : 0;
+    }
+
+    static std::uint32_t GetEmbreeDeviceCount()
+    {
 #ifdef USE_EMBREE
         if (s_calc_platform & DeviceInfo::Platform::kEmbree)
         {
-            ++result;
+            return 1;
         }
 #endif //USE_EMBREE
+        return 0;
+    }
+
+    std::uint32_t IntersectionApi::GetDeviceCount()
+    {
+        std::uint32_t result = GetCalcDeviceCount() + GetEmbreeDeviceCount();
+
+        // native cpu device goes after embree
+        if (s_calc_platform & DeviceInfo::Platform::kNative)
+        {
+            ++result;
+        }
 
         return result;
     }
+
+    // embree goes right after calc devices
     static bool IsDeviceIndexEmbree(uint32_t devidx)
     {
+        return GetEmbreeDeviceCount() != 0 && devidx == GetCalcDeviceCount();
+    }
 
-#ifdef USE_EMBREE
-        auto* calc = GetCalc();
-        if (calc != nullptr)
-        {
-            if (devidx == GetCalc()->GetDeviceCount())
-            {
-                return true;
-            }
-        }
-        else if(devidx == 0)
-        {
-            return true;
-        }
-#endif //USE_EMBREE
-        return false;
+    static bool IsDeviceIndexNative(uint32_t devidx)
+    {
+        return (s_calc_platform & DeviceInfo::Platform::kNative) &&
+            devidx == GetCalcDeviceCount() + GetEmbreeDeviceCount();
     }
 
     void IntersectionApi::GetDeviceInfo(std::uint32_t devidx, DeviceInfo& devinfo)
     {
-
-        auto* calc = GetCalc();
+        DeviceInfo::Platform platform = DeviceInfo::Platform::kAny;
+        auto* calc = GetCalc(&platform);
 
         if (IsDeviceIndexEmbree(devidx))
         {
@@ -232,6 +284,15 @@ namespace RadeonRays
 #endif //USE_EMBREE
             return;
         }
+
+        if (IsDeviceIndexNative(devidx))
+        {
+            devinfo.name = "cpu";
+            devinfo.vendor = "amd";
+            devinfo.type = DeviceInfo::kCpu;
+            devinfo.platform = DeviceInfo::kNative;
+            return;
+        }
         assert(calc);
 
         Calc::DeviceSpec spec;
@@ -241,28 +302,86 @@ namespace RadeonRays
         devinfo.name = spec.name;
         devinfo.vendor = spec.vendor;
         devinfo.type = spec.type == Calc::DeviceType::kGpu ? DeviceInfo::kGpu : DeviceInfo::kCpu;
+        devinfo.platform = platform;
     }
 
-    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    static IntersectionDevice* CreateIntersectionDevice(std::uint32_t devidx)
     {
         if (IsDeviceIndexEmbree(devidx))
         {
 #ifdef USE_EMBREE
-            return new IntersectionApiImpl(new EmbreeIntersectionDevice());
+            return new EmbreeIntersectionDevice();
 #endif //USE_EMBREE
         }
+        else if (IsDeviceIndexNative(devidx))
+        {
+            return new CpuIntersectionDevice();
+        }
         else
         {
             auto* calc = GetCalc();
             if (calc != nullptr)
             {
-                return new IntersectionApiImpl(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx)));
+                return new CalcIntersectionDevice(calc, calc->CreateDevice(devidx));
             }
         }
 
         return nullptr;
     }
 
+    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    {
+        auto device = CreateIntersectionDevice(devidx);
+        return device ? new IntersectionApiImpl(device) : nullptr;
+    }
+
+    IntersectionApi* IntersectionApi::CreateHybrid(std::uint32_t const* devidx, std::uint32_t numdevices)
+    {
+        std::vector<IntersectionDevice*> devices;
+        for (auto i = 0U; i < numdevices; ++i)
+        {
+            auto device = CreateIntersectionDevice(devidx[i]);
+            if (!device)
+            {
+                for (auto d : devices)
+                {
+                    delete d;
+                }
+
+                return nullptr;
+            }
+
+            devices.push_back(device);
+        }
+
+        if (devices.empty())
+            return nullptr;
+
+        return new IntersectionApiImpl(new HybridIntersectionDevice(devices));
+    }
+
+    IntersectionApi* IntersectionApi::CreateRemote(char const* address)
+    {
+        if (!address)
+            return nullptr;
+
+        std::string host = address;
+        int port = Remote::kDefaultPort;
+
+        auto colon = host.rfind(':');
+        if (colon != std::string::npos)
+        {
+            port = std::atoi(host.c_str() + colon + 1);
+            host = host.substr(0, colon);
+        }
+
+        Socket socket = Socket::Connect(host.c_str(), port);
+        if (!socket.IsValid())
+            return nullptr;
+
+        return new IntersectionApiImpl(new RemoteIntersectionDevice(std::move(socket)));
+    }
+
     // Deallocation (to simplify DLL scenario)
     void IntersectionApi::Delete(IntersectionApi* api)
     {
@@ -282,6 +401,19 @@ namespace RadeonRays
             return nullptr;
         }
     }
+
+    RRAPI IntersectionApi* CreateFromVulkan(Anvil::Device* device, Anvil::CommandPool* cmd_pool, Anvil::Queue* queue)
+    {
+        auto calc = dynamic_cast<Calc::Calc*>(GetCalcVulkan());
+        if (calc)
+        {
+            return new IntersectionApiImpl(new CalcIntersectionDeviceVK(calc, Calc::CreateDeviceFromVulkan(device, cmd_pool, queue)));
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
 #endif
 
 #ifdef USE_OPENCL
@@ -303,6 +435,45 @@ namespace RadeonRays
             }
 #else
             calc_device = CreateDeviceFromOpenCL(context, device, queue);
+#endif
+            if (calc_device)
+            {
+                return new IntersectionApiImpl(new CalcIntersectionDeviceCl(calc, calc_device));
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+
+    RRAPI IntersectionApi* CreateFromOpenClContext(cl_context context, cl_device_id device, cl_command_queue const* queues, int numqueues)
+    {
+        if (!queues || numqueues <= 0)
+        {
+            return nullptr;
+        }
+
+        auto calc = dynamic_cast<Calc::Calc*>(GetCalcOpenCL());
+
+        if (calc)
+        {
+            Calc::DeviceCl* calc_device = nullptr;
+
+#ifndef CALC_STATIC_LIBRARY
+            auto pfn_create_device_from_cl = GetCalcEntryPoint(Calc::Platform::kOpenCL, "CreateDeviceFromOpenCLQueues");
+
+            if (pfn_create_device_from_cl)
+            {
+                auto create_device_from_cl = reinterpret_cast<decltype(CreateDeviceFromOpenCLQueues)*>(pfn_create_device_from_cl);
+                calc_device = create_device_from_cl(context, device, queues, numqueues);
+            }
+#else
+            calc_device = CreateDeviceFromOpenCLQueues(context, device, queues, numqueues);
 #endif
             if (calc_device)
             {
@@ -23,8 +23,15 @@ THE SOFTWARE.
 #include "radeon_rays_impl.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../primitive/group.h"
+#include "../primitive/lod_group.h"
+#include "../primitive/curves.h"
+#include "../primitive/procedurals.h"
 #include "../except/except.h"
 #include "../device/intersection_device.h"
+#include "../util/trace.h"
+#include "../async/future_callback.h"
+#include "../async/task_scheduler.h"
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -36,29 +43,97 @@ THE SOFTWARE.
 #endif
 
 #include <vector>
+#include <algorithm>
 #include <cfloat>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 
 namespace RadeonRays
 {
+    // Most rays SetRaySamples keeps
+    static std::size_t const kMaxRaySamples = 16384;
+    // Meshes built by a single task of CreateMeshes
+    static int const kMeshGrainSize = 64;
+
     IntersectionApiImpl::IntersectionApiImpl(IntersectionDevice* device)
         : nextid_(1)
     , m_device(device)
     {
         world_.hint_ = 0;
+        m_commit_stats = CommitStatistics();
     }
 
     void IntersectionApiImpl::SetOption(char const* name, char const* value)
     {
+        WaitForCommit();
         world_.options_.SetValue(name, value);
     }
 
     void IntersectionApiImpl::SetOption(char const* name, float value)
     {
+        WaitForCommit();
         world_.options_.SetValue(name, value);
     }
 
+    void IntersectionApiImpl::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        WaitForCommit();
+        stats = m_commit_stats;
+    }
+
+    void IntersectionApiImpl::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        WaitForCommit();
+
+        usage = MemoryUsage();
+        m_device->GetMemoryUsage(usage);
+
+        // Meshes attached directly or through instances, each counted once
+        std::unordered_set<Mesh const*> meshes;
+        for (auto shape : world_.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->is_instance())
+            {
+                shapeimpl = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape());
+            }
+
+            if (!shapeimpl->is_instance() && !shapeimpl->is_group() && !shapeimpl->is_curves() && !shapeimpl->is_procedural())
+            {
+                meshes.insert(static_cast<Mesh const*>(shapeimpl));
+            }
+        }
+
+        for (auto mesh : meshes)
+        {
+            usage.host_geometry_bytes += mesh->GetHostBytes();
+        }
+
+        usage.device_bytes = usage.vertices_bytes + usage.faces_bytes + usage.nodes_bytes +
+            usage.instances_bytes + usage.scratch_bytes + usage.pool_bytes;
+        usage.host_bytes = usage.event_pool_bytes + usage.host_chunks_bytes +
+            usage.kernel_binaries_bytes + usage.host_geometry_bytes;
+    }
+
+    int IntersectionApiImpl::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        return m_device->GetLastQueryTimings(timings, maxtimings);
+    }
+
     IntersectionApiImpl::~IntersectionApiImpl()
     {
+        try
+        {
+            WaitForCommit();
+        }
+        catch (...)
+        {
+        }
     }
 
     Shape* IntersectionApiImpl::CreateMesh(
@@ -75,6 +150,63 @@ namespace RadeonRays
         Mesh* mesh = new Mesh(vertices, vnum, vstride, indices, istride, numfacevertices, numface);
 
         mesh->SetId(nextid_++);
+        mesh->SetOwner(this);
+
+        return mesh;
+    }
+
+    void IntersectionApiImpl::CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** shapes) const
+    {
+        ThrowIf(nummeshes < 0, "Invalid number of meshes");
+        ThrowIf(nummeshes > 0 && (!descs || !shapes), "Mesh descriptors and output shapes have to be specified");
+
+        // Meshes are owned here until all of them are built
+        std::vector<std::unique_ptr<Mesh> > meshes(nummeshes);
+
+        auto create = [&](int i)
+        {
+            MeshDesc const& desc = descs[i];
+            meshes[i].reset(new Mesh(desc.vertices, desc.vnum, desc.vstride, desc.indices, desc.istride, desc.numfacevertices, desc.numfaces));
+        };
+
+        // Small batches are not worth starting worker threads
+        if (nummeshes > kMeshGrainSize)
+        {
+            task_scheduler scheduler;
+            parallel_for(scheduler, 0, nummeshes, kMeshGrainSize, create);
+        }
+        else
+        {
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                create(i);
+            }
+        }
+
+        // IDs are reserved in a single step
+        Id const firstid = nextid_.fetch_add(nummeshes);
+
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            meshes[i]->SetId(firstid + i);
+            meshes[i]->SetOwner(this);
+            shapes[i] = meshes[i].release();
+        }
+    }
+
+    Shape* IntersectionApiImpl::CreateMeshView(
+        // Position data
+        float const * vertices, int vnum, int vstride,
+        // Index data for vertices
+        int const * indices, int istride,
+        // Number of faces
+        int  numface
+        ) const
+    {
+        Mesh* mesh = new Mesh(vertices, vnum, vstride, indices, istride, numface);
+
+        mesh->SetId(nextid_++);
+        mesh->SetOwner(this);
 
         return mesh;
     }
@@ -82,42 +214,327 @@ namespace RadeonRays
 
     Shape* IntersectionApiImpl::CreateInstance(Shape const* shape) const
     {
-        Mesh const* mesh = static_cast<Mesh const*>(shape);
+        // Instances replace the transform of their base shape, so instancing
+        // an instance is the same as instancing its base shape
+        while (static_cast<ShapeImpl const*>(shape)->is_instance())
+        {
+            shape = static_cast<Instance const*>(shape)->GetBaseShape();
+        }
 
-        Instance* instance = new Instance(mesh);
+        Instance* instance = new Instance(shape);
 
         instance->SetId(nextid_++);
+        instance->SetOwner(this);
 
         return instance;
     }
 
+    Shape* IntersectionApiImpl::CreateCurves(
+        // Control points
+        float const * vertices, int vnum, int vstride,
+        // 4 control point indices per segment
+        int const * indices,
+        // Number of segments
+        int numsegments
+        ) const
+    {
+        ThrowIf(numsegments <= 0 || !vertices || !indices, "Curves have to contain at least one segment");
+
+        Curves* curves = new Curves(vertices, vnum, vstride, indices, numsegments);
+
+        curves->SetId(nextid_++);
+        curves->SetOwner(this);
+
+        return curves;
+    }
+
+    Shape* IntersectionApiImpl::CreateSpheres(float const * spheres, int numspheres, int stride) const
+    {
+        ThrowIf(numspheres <= 0 || !spheres, "Spheres have to contain at least one sphere");
+
+        Procedurals* procedurals = new Procedurals(Procedurals::kSpheres, spheres, numspheres, stride);
+
+        procedurals->SetId(nextid_++);
+        procedurals->SetOwner(this);
+
+        return procedurals;
+    }
+
+    Shape* IntersectionApiImpl::CreateDisks(float const * disks, int numdisks, int stride) const
+    {
+        ThrowIf(numdisks <= 0 || !disks, "Disks have to contain at least one disk");
+
+        Procedurals* procedurals = new Procedurals(Procedurals::kDisks, disks, numdisks, stride);
+
+        procedurals->SetId(nextid_++);
+        procedurals->SetOwner(this);
+
+        return procedurals;
+    }
+
+    Shape* IntersectionApiImpl::CreateCustomPrimitives(float const * bounds, int numprims, int stride) const
+    {
+        ThrowIf(numprims <= 0 || !bounds, "Custom primitives have to contain at least one primitive");
+
+        Procedurals* procedurals = new Procedurals(Procedurals::kCustom, bounds, numprims, stride);
+
+        procedurals->SetId(nextid_++);
+        procedurals->SetOwner(this);
+
+        return procedurals;
+    }
+
+    Shape* IntersectionApiImpl::CreateGroup(Shape const* const* shapes, int numshapes) const
+    {
+        ThrowIf(numshapes <= 0 || !shapes, "Group has to contain at least one shape");
+
+        Group* group = new Group(shapes, numshapes);
+
+        group->SetId(nextid_++);
+        group->SetOwner(this);
+
+        return group;
+    }
+
+    Shape* IntersectionApiImpl::CreateLodGroup(Shape const* const* levels, float const* thresholds, int numlevels,
+        LodRule rule, float transition) const
+    {
+        ThrowIf(numlevels <= 0 || !levels || !thresholds, "LOD group has to contain at least one level");
+        ThrowIf(rule != kLodRuleDistance && rule != kLodRuleConeWidth, "Unknown LOD rule");
+        ThrowIf(transition < 0.f, "LOD transition has to be non-negative");
+
+        for (int i = 0; i < numlevels; ++i)
+        {
+            // Levels are entered right away, so the kernel can not select again below them
+            ThrowIf(static_cast<ShapeImpl const*>(levels[i])->is_lod(), "LOD levels can not be LOD groups");
+            ThrowIf(i > 1 && thresholds[i] < thresholds[i - 1], "LOD thresholds have to be ascending");
+        }
+
+        LodGroup* group = new LodGroup(levels, thresholds, numlevels, rule, transition);
+
+        group->SetId(nextid_++);
+        group->SetOwner(this);
+
+        return group;
+    }
+
     void IntersectionApiImpl::DeleteShape(Shape const* shape)
     {
+        WaitForCommit();
         delete shape;
     }
 
     void IntersectionApiImpl::AttachShape(Shape const* shape)
     {
+        WaitForCommit();
         world_.AttachShape(shape);
     }
 
+    void IntersectionApiImpl::AttachShapes(Shape const* const* shapes, int numshapes)
+    {
+        WaitForCommit();
+        ThrowIf(numshapes < 0, "Invalid number of shapes");
+        ThrowIf(numshapes > 0 && !shapes, "Shapes have to be specified");
+        world_.AttachShapes(shapes, numshapes);
+    }
+
     void IntersectionApiImpl::DetachShape(Shape const* shape)
     {
+        WaitForCommit();
         world_.DetachShape(shape);
     }
 
     void IntersectionApiImpl::DetachAll()
     {
+        WaitForCommit();
         world_.DetachAll();
     }
 
 
     void IntersectionApiImpl::Commit()
     {
+        WaitForCommit();
+        ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+        TraceScope trace("Commit", "api");
+
+        CommitWorld(false);
+    }
+
+    // Event of a background commit, completes once the new scene is used by queries
+    class CommitEvent : public Event
+    {
+    public:
+        explicit CommitEvent(std::shared_future<void> const& commit)
+            : m_commit(commit)
+        {
+        }
+
+        bool Complete() const override
+        {
+            return m_commit.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        // Errors are reported by the next call waiting for the commit
+        void Wait() override
+        {
+            m_commit.wait();
+        }
+
+        void SetCompletionCallback(CompletionCallback callback, void* data) override
+        {
+            call_when_ready(m_commit, this, callback, data);
+        }
+
+    private:
+        std::shared_future<void> m_commit;
+    };
+
+    void IntersectionApiImpl::CommitAsync(Event** event)
+    {
+        WaitForCommit();
         ThrowIf(world_.shapes_.empty(), "Scene is empty.");
-        m_device->Preprocess(world_);
+
+        m_pending_commit = std::async(std::launch::async, [this]()
+        {
+            TraceScope trace("CommitAsync", "api");
+            CommitWorld(true);
+        }).share();
+
+        if (event)
+        {
+            *event = new CommitEvent(m_pending_commit);
+        }
+    }
+
+    void IntersectionApiImpl::CommitWorld(bool concurrent)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        if (concurrent)
+        {
+            m_device->PreprocessConcurrent(world_);
+        }
+        else
+        {
+            m_device->Preprocess(world_);
+        }
+
+        auto delta = std::chrono::high_resolution_clock::now() - start;
+
+        m_device->GetCommitStatistics(m_commit_stats);
+        m_commit_stats.total_time = std::chrono::duration<float, std::milli>(delta).count();
 
         world_.OnCommit();
+
+        // Capture the committed scene, the previous capture is kept for queries of the same path
+        auto path = world_.options_.GetOption(Options::kCapturePath);
+        if (!path || path->AsString().empty())
+        {
+            std::atomic_store(&m_capture, std::shared_ptr<WorkloadCapture>());
+            return;
+        }
+
+        auto capture = std::atomic_load(&m_capture);
+        if (!capture || capture->GetPath() != path->AsString())
+        {
+            capture = std::make_shared<WorkloadCapture>(path->AsString());
+            std::atomic_store(&m_capture, capture);
+        }
+
+        capture->WriteScene(world_);
+    }
+
+    // Bytes per ray of "acc.ray_format", 0 for planar layouts which aren't captured
+    static std::size_t GetCaptureRayStride(Options const& options)
+    {
+        auto format = options.GetOption(Options::kAccRayFormat);
+        if (!format || format->AsString() == "full")
+        {
+            return sizeof(ray);
+        }
+        else if (format->AsString() == "compact")
+        {
+            return sizeof(ray_compact);
+        }
+        else if (format->AsString() == "oct")
+        {
+            return sizeof(ray_oct);
+        }
+
+        return 0;
+    }
+
+    void IntersectionApiImpl::CaptureQuery(QueryType type, Buffer const* rays, Buffer const* numrays, int maxrays, int queue) const
+    {
+        auto capture = std::atomic_load(&m_capture);
+        auto stride = GetCaptureRayStride(world_.options_);
+        if (!capture || stride == 0 || !capture->IsCapturingQueries())
+        {
+            return;
+        }
+
+        // Queues are in order, so maps wait for the query and the kernels writing its ray count
+        Event* event = nullptr;
+        auto count = maxrays;
+        if (numrays)
+        {
+            int* data = nullptr;
+            m_device->MapBuffer(const_cast<Buffer*>(numrays), kMapRead, 0, sizeof(int), (void**)&data, &event, queue);
+            event->Wait();
+            m_device->DeleteEvent(event);
+            count = std::min(*data, maxrays);
+            m_device->UnmapBuffer(const_cast<Buffer*>(numrays), data, &event, queue);
+            event->Wait();
+            m_device->DeleteEvent(event);
+        }
+
+        if (count <= 0)
+        {
+            return;
+        }
+
+        // Copy out before writing, so that buffers aren't left mapped by write errors
+        std::vector<char> copy(count * stride);
+        void* data = nullptr;
+        m_device->MapBuffer(const_cast<Buffer*>(rays), kMapRead, 0, copy.size(), &data, &event, queue);
+        event->Wait();
+        m_device->DeleteEvent(event);
+        std::memcpy(copy.data(), data, copy.size());
+        m_device->UnmapBuffer(const_cast<Buffer*>(rays), data, &event, queue);
+        event->Wait();
+        m_device->DeleteEvent(event);
+
+        capture->WriteQuery(type, copy.data(), count, stride);
+    }
+
+    void IntersectionApiImpl::CaptureQuery(QueryType type, ray const* rays, int numrays) const
+    {
+        auto capture = std::atomic_load(&m_capture);
+        auto stride = GetCaptureRayStride(world_.options_);
+        if (capture && stride != 0 && numrays > 0)
+        {
+            capture->WriteQuery(type, rays, numrays, stride);
+        }
+    }
+
+    void IntersectionApiImpl::WaitForShapeAccess() const
+    {
+        // The commit is left pending, so that its error is reported by the next API call
+        auto commit = m_pending_commit;
+        if (commit.valid())
+        {
+            commit.wait();
+        }
+    }
+
+    void IntersectionApiImpl::WaitForCommit() const
+    {
+        if (m_pending_commit.valid())
+        {
+            auto commit = std::move(m_pending_commit);
+            m_pending_commit = std::shared_future<void>();
+            commit.get();
+        }
     }
 
     void IntersectionApiImpl::DeleteBuffer(Buffer* buffer) const
@@ -125,44 +542,442 @@ namespace RadeonRays
         m_device->DeleteBuffer(buffer);
     }
 
-    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event, queue);
+        CaptureQuery(kQueryIntersection, rays, nullptr, numrays, queue);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event, queue);
+        CaptureQuery(kQueryOcclusion, rays, nullptr, numrays, queue);
+    }
+
+    void IntersectionApiImpl::QueryMixed(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryMixed(rays, numrays, hitinfos, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryMultiHit(rays, numrays, k, hitinfos, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryProximity(spheres, numspheres, hitinfos, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
     {
-        m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event);
+        CheckQueue(queue);
+        m_device->QueryAmbientOcclusion(points, numpoints, numsamples, radius, seed, visibility, waitevent, event, queue);
     }
 
-    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const
     {
-        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
+        CheckQueue(queue);
+        m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event, queue);
+        CaptureQuery(kQueryIntersection, rays, numrays, maxrays, queue);
     }
 
-    void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
+    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const
     {
-        m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event);
+        CheckQueue(queue);
+        m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event, queue);
+        CaptureQuery(kQueryOcclusion, rays, numrays, maxrays, queue);
     }
 
-    void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
+    void IntersectionApiImpl::QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const
     {
-        m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
+        CheckQueue(queue);
+        m_device->QueryIntersection(rays, numrays, hitinfos, queue);
+        CaptureQuery(kQueryIntersection, rays, numrays);
+    }
+
+    void IntersectionApiImpl::QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryOcclusion(rays, numrays, hitresults, queue);
+        CaptureQuery(kQueryOcclusion, rays, numrays);
+    }
+
+    void IntersectionApiImpl::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->QueryBatch(queries, numqueries, waitevent, event, queue);
+
+        for (int i = 0; i < numqueries; ++i)
+        {
+            CaptureQuery(queries[i].type, queries[i].rays, nullptr, queries[i].numrays, queue);
+        }
+    }
+
+    QueryGraph* IntersectionApiImpl::CreateQueryGraph(QueryDesc const* queries, int numqueries) const
+    {
+        ThrowIf(!queries || numqueries <= 0, "Query graph is empty");
+        return m_device->CreateQueryGraph(queries, numqueries);
+    }
+
+    void IntersectionApiImpl::DeleteQueryGraph(QueryGraph* graph) const
+    {
+        m_device->DeleteQueryGraph(graph);
+    }
+
+    void IntersectionApiImpl::ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        ThrowIf(!graph, "Query graph is null");
+        m_device->ExecuteQueryGraph(graph, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const
+    {
+        // Kernels and buffers belong to the intersector of the latest commit
+        WaitForCommit();
+        CheckQueue(queue);
+        ThrowIf(maxrays <= 0, "Invalid maximum ray count");
+        ThrowIf(!types || numtypes <= 0, "No query types to prepare");
+        m_device->Prepare(maxrays, types, numtypes, queue);
+    }
+
+    void IntersectionApiImpl::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        ThrowIf(rays == outrays, "Compacted rays can't be written in place");
+        m_device->CompactRays(rays, numrays, maxrays, predicate, outrays, outcount, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        ThrowIf(maxrays <= 0 || !hits || !numrays || !outindices, "Invalid hit grouping parameters");
+        ThrowIf(shapekeys ? numkeys <= 0 : numkeys != 0, "Shape keys and their number don't match");
+        m_device->GroupHits(hits, numrays, maxrays, shapekeys, numkeys, outindices, outkeys, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->GenerateCameraRays(camera, width, height, seed, rays, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->GenerateHemisphereRays(points, numpoints, maxpoints, numsamples, maxt, seed, rays, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        m_device->GenerateShadowRays(points, numpoints, maxpoints, light, seed, rays, waitevent, event, queue);
+    }
+
+    void IntersectionApiImpl::SetHitFilterData(Buffer const* data)
+    {
+        WaitForCommit();
+        m_device->SetHitFilterData(data);
+    }
+
+    void IntersectionApiImpl::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        WaitForCommit();
+        m_device->SetTraversalStatsBuffer(stats);
+    }
+
+    void IntersectionApiImpl::SetHitHints(Buffer const* hits)
+    {
+        WaitForCommit();
+        m_device->SetHitHints(hits);
+    }
+
+    void IntersectionApiImpl::SetRaySamples(ray const* rays, int numrays)
+    {
+        WaitForCommit();
+        ThrowIf(numrays < 0 || (numrays > 0 && !rays), "Invalid ray samples");
+
+        std::shared_ptr<std::vector<ray>> samples;
+
+        if (rays && numrays > 0)
+        {
+            samples = std::make_shared<std::vector<ray>>();
+
+            for (int i = 0; i < numrays; ++i)
+            {
+                if (rays[i].IsActive())
+                {
+                    samples->push_back(rays[i]);
+                }
+            }
+
+            // Evenly strided subset keeps the tree optimization cost bounded
+            if (samples->size() > kMaxRaySamples)
+            {
+                std::size_t const count = samples->size();
+
+                for (std::size_t i = 0; i < kMaxRaySamples; ++i)
+                {
+                    (*samples)[i] = (*samples)[i * count / kMaxRaySamples];
+                }
+
+                samples->resize(kMaxRaySamples);
+            }
+
+            if (samples->empty())
+            {
+                samples.reset();
+            }
+        }
+
+        if (samples || world_.ray_samples_)
+        {
+            world_.ray_samples_ = samples;
+            world_.has_changed_ = true;
+        }
     }
 
     void IntersectionApiImpl::DeleteEvent(Event* event) const
     {
+        // Commit events are created by the API rather than the device
+        if (dynamic_cast<CommitEvent*>(event))
+        {
+            delete event;
+            return;
+        }
+
         m_device->DeleteEvent(event);
     }
 
+    Event* IntersectionApiImpl::CreateReusableEvent() const
+    {
+        return m_device->CreateReusableEvent();
+    }
+
+    // State shared with the callbacks of WaitAny, it outlives the call
+    // as the callbacks of the events still running are called later
+    struct WaitAnyState
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        int index;
+    };
+
+    struct WaitAnyCallback
+    {
+        std::shared_ptr<WaitAnyState> state;
+        int index;
+    };
+
+    static void OnWaitAnyComplete(Event*, void* data)
+    {
+        std::unique_ptr<WaitAnyCallback> payload(static_cast<WaitAnyCallback*>(data));
+        auto& state = *payload->state;
+
+        {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            if (state.index >= 0)
+            {
+                return;
+            }
+
+            state.index = payload->index;
+        }
+
+        state.cv.notify_one();
+    }
+
+    int IntersectionApiImpl::WaitAny(Event* const* events, int numevents) const
+    {
+        ThrowIf(!events || numevents <= 0, "No events to wait for");
+
+        for (int i = 0; i < numevents; ++i)
+        {
+            if (events[i]->Complete())
+            {
+                return i;
+            }
+        }
+
+        auto state = std::make_shared<WaitAnyState>();
+        state->index = -1;
+
+        for (int i = 0; i < numevents; ++i)
+        {
+            std::unique_ptr<WaitAnyCallback> payload(new WaitAnyCallback{ state, i });
+            events[i]->SetCompletionCallback(OnWaitAnyComplete, payload.get());
+            payload.release();
+        }
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&state]() { return state->index >= 0; });
+        return state->index;
+    }
+
     Buffer* IntersectionApiImpl::CreateBuffer(size_t size, void* initdata) const
     {
         return m_device->CreateBuffer(size, initdata);
     }
 
-    void IntersectionApiImpl::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    Buffer* IntersectionApiImpl::CreateBuffer(size_t size, void* initdata, int flags, void** data) const
+    {
+        if (flags & kBufferPersistentMap)
+        {
+            ThrowIf(!data, "Persistently mapped buffer needs a pointer to receive the mapping");
+            return m_device->CreateMappedBuffer(size, initdata, data);
+        }
+
+        if (data)
+        {
+            *data = nullptr;
+        }
+
+        if (flags & kBufferUseHostPtr)
+        {
+            ThrowIf(!initdata, "Buffer using host memory in place needs initdata");
+            return m_device->CreateHostPtrBuffer(size, initdata);
+        }
+
+        return m_device->CreateBuffer(size, initdata);
+    }
+
+    Buffer* IntersectionApiImpl::CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const
+    {
+        ThrowIf(!buffer || size == 0, "Invalid sub-buffer");
+
+        auto sub_buffer = m_device->CreateSubBuffer(buffer, offset, size);
+        ThrowIf(!sub_buffer, "Sub-buffers are not supported by the device");
+
+        return sub_buffer;
+    }
+
+    int IntersectionApiImpl::GetQueueCount() const
     {
-        return m_device->MapBuffer(buffer, type, offset, size, data, event);
+        return m_device->GetQueueCount();
     }
 
-    void IntersectionApiImpl::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    void IntersectionApiImpl::CheckQueue(int queue) const
     {
-        return m_device->UnmapBuffer(buffer, ptr, event);
+        ThrowIf(queue < 0 || queue >= m_device->GetQueueCount(), "Invalid queue index");
+    }
+
+    void IntersectionApiImpl::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        return m_device->MapBuffer(buffer, type, offset, size, data, event, queue);
+    }
+
+    void IntersectionApiImpl::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        return m_device->UnmapBuffer(buffer, ptr, event, queue);
+    }
+
+    void IntersectionApiImpl::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        CheckQueue(queue);
+        ThrowIf(!src || !dst, "Source and destination buffers have to be specified");
+        ThrowIf(src == dst && srcoffset < dstoffset + size && dstoffset < srcoffset + size, "Copy regions overlap");
+        return m_device->CopyBuffer(src, dst, srcoffset, dstoffset, size, event, queue);
+    }
+
+    void IntersectionApiImpl::UpdateVertices(Shape* shape, Buffer* vertices, int vnum, int vstride) const
+    {
+        WaitForCommit();
+        ThrowIf(!shape || !vertices, "Shape and vertex buffer have to be specified");
+
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+        ThrowIf(shapeimpl->is_instance() || shapeimpl->is_group() || shapeimpl->is_curves() || shapeimpl->is_procedural(),
+            "Only meshes can update vertices from a buffer");
+        // Views would keep referencing the mapping after it is released
+        ThrowIf(static_cast<Mesh const*>(shape)->is_view(), "Mesh views have to be updated from host memory");
+        ThrowIf(vnum != static_cast<Mesh const*>(shape)->num_vertices(), "Vertex count mismatch, topology changes require a new mesh");
+
+        vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+
+        // Positions are read through a mapping, the following commit refits and
+        // uploads them in the layout of the current intersector
+        std::size_t const size = (std::size_t)(vnum - 1) * vstride + 3 * sizeof(float);
+        void* data = nullptr;
+        Event* e = nullptr;
+
+        m_device->MapBuffer(vertices, kMapRead, 0, size, &data, &e, 0);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        shape->UpdateVertices(static_cast<float const*>(data), vnum, vstride);
+
+        m_device->UnmapBuffer(vertices, data, &e, 0);
+        e->Wait();
+        m_device->DeleteEvent(e);
+    }
+
+    void IntersectionApiImpl::SetTransforms(Shape* const* shapes, int numshapes, float const* transforms, int tstride)
+    {
+        WaitForCommit();
+        ThrowIf(numshapes < 0, "Invalid number of shapes");
+        ThrowIf(numshapes > 0 && (!shapes || !transforms), "Shapes and transforms have to be specified");
+
+        tstride = (tstride == 0) ? (12 * sizeof(float)) : tstride;
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            ThrowIf(!shapes[i], "Invalid shape");
+
+            float const* t = reinterpret_cast<float const*>(reinterpret_cast<char const*>(transforms) + (std::size_t)i * tstride);
+            matrix const m(t[0], t[1], t[2], t[3],
+                t[4], t[5], t[6], t[7],
+                t[8], t[9], t[10], t[11],
+                0.f, 0.f, 0.f, 1.f);
+
+            // All the shapes are ShapeImpl, the qualified call skips virtual dispatch
+            static_cast<ShapeImpl*>(shapes[i])->ShapeImpl::SetTransform(m, inverse(m));
+        }
+    }
+
+    void IntersectionApiImpl::SetTransforms(Shape* const* shapes, int numshapes, Buffer* transforms, int tstride)
+    {
+        WaitForCommit();
+        ThrowIf(!transforms, "Transform buffer has to be specified");
+
+        if (numshapes <= 0)
+        {
+            ThrowIf(numshapes < 0, "Invalid number of shapes");
+            return;
+        }
+
+        tstride = (tstride == 0) ? (12 * sizeof(float)) : tstride;
+
+        // Transforms are read through a single mapping
+        std::size_t const size = (std::size_t)(numshapes - 1) * tstride + 12 * sizeof(float);
+        void* data = nullptr;
+        Event* e = nullptr;
+
+        m_device->MapBuffer(transforms, kMapRead, 0, size, &data, &e, 0);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        try
+        {
+            SetTransforms(shapes, numshapes, static_cast<float const*>(data), tstride);
+        }
+        catch (...)
+        {
+            m_device->UnmapBuffer(transforms, data, &e, 0);
+            e->Wait();
+            m_device->DeleteEvent(e);
+            throw;
+        }
+
+        m_device->UnmapBuffer(transforms, data, &e, 0);
+        e->Wait();
+        m_device->DeleteEvent(e);
     }
 
     void IntersectionApiImpl::ResetIdCounter()
@@ -175,6 +990,87 @@ namespace RadeonRays
         return world_.shapes_.size() == 0;
     }
 
+    void IntersectionApiImpl::SaveSnapshot(char const* path)
+    {
+        WaitForCommit();
+        ThrowIf(!path, "Invalid snapshot path");
+        ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+        TraceScope trace("SaveSnapshot", "api");
+
+        // Trees are only kept by intersectors in device formats, so rebuild the scene
+        // with a recording cache to collect them (trees of loaded snapshots are reused)
+        auto trees = world_.bvh_snapshot_;
+        if (!trees)
+        {
+            world_.bvh_snapshot_ = std::make_shared<BvhCache::Snapshot>();
+        }
+
+        world_.bvh_snapshot_->SetRecording(true);
+
+        try
+        {
+            world_.has_changed_ = true;
+            CommitWorld(false);
+            SceneSnapshot::Save(path, world_, world_.bvh_snapshot_->GetRecorded());
+        }
+        catch (...)
+        {
+            world_.bvh_snapshot_->SetRecording(false);
+            world_.bvh_snapshot_ = trees;
+            throw;
+        }
+
+        world_.bvh_snapshot_->SetRecording(false);
+        world_.bvh_snapshot_ = trees;
+    }
+
+    int IntersectionApiImpl::LoadSnapshot(char const* path, Shape** shapes, int maxshapes)
+    {
+        WaitForCommit();
+        ThrowIf(!path, "Invalid snapshot path");
+
+        std::unique_ptr<SceneSnapshot> snapshot(new SceneSnapshot(path));
+        int const numshapes = snapshot->GetShapeCount();
+
+        if (!shapes)
+        {
+            return numshapes;
+        }
+
+        ThrowIf(maxshapes < numshapes, "Not enough space for snapshot shapes");
+
+        std::vector<ShapeImpl*> created;
+        std::vector<bool> attached;
+        snapshot->CreateShapes(created, attached);
+
+        for (std::size_t i = 0; i < created.size(); ++i)
+        {
+            created[i]->SetOwner(this);
+            shapes[i] = created[i];
+
+            if (attached[i])
+            {
+                world_.AttachShape(created[i]);
+            }
+
+            // Keep new IDs clear of the loaded ones
+            Id id = nextid_;
+            while (created[i]->GetId() >= id && !nextid_.compare_exchange_weak(id, created[i]->GetId() + 1))
+            {
+            }
+        }
+
+        if (!world_.bvh_snapshot_)
+        {
+            world_.bvh_snapshot_ = std::make_shared<BvhCache::Snapshot>();
+        }
+
+        snapshot->AddTrees(*world_.bvh_snapshot_);
+        m_snapshots.push_back(std::move(snapshot));
+
+        return numshapes;
+    }
+
 #ifdef USE_OPENCL
     RRAPI Buffer* CreateFromOpenClBuffer(RadeonRays::IntersectionApi* api, cl_mem buffer)
     {
@@ -193,6 +1089,36 @@ namespace RadeonRays
 
         return nullptr;
     }
+
+    RRAPI Event* CreateFromOpenClEvent(RadeonRays::IntersectionApi* api, cl_event event)
+    {
+        auto apii = static_cast<IntersectionApiImpl*>(api);
+        auto cldev = dynamic_cast<CalcIntersectionDeviceCl*>(apii->GetDevice());
+
+        if (cldev)
+        {
+            return cldev->AdoptEvent(event);
+        }
+
+        Throw("CL interop not supported");
+
+        return nullptr;
+    }
+
+    RRAPI cl_event GetOpenClEvent(RadeonRays::IntersectionApi* api, Event const* event)
+    {
+        auto apii = static_cast<IntersectionApiImpl*>(api);
+        auto cldev = dynamic_cast<CalcIntersectionDeviceCl*>(apii->GetDevice());
+
+        if (cldev)
+        {
+            return cldev->GetEvent(event);
+        }
+
+        Throw("CL interop not supported");
+
+        return nullptr;
+    }
 #endif
 
 #ifdef USE_VULKAN
@@ -210,5 +1136,25 @@ namespace RadeonRays
 
         return nullptr;
     }
+
+    RRAPI void VulkanWaitSemaphore(RadeonRays::IntersectionApi* api, Anvil::Semaphore* semaphore, std::uint32_t stage_mask)
+    {
+        auto apii = static_cast<IntersectionApiImpl*>(api);
+        auto vkdev = dynamic_cast<CalcIntersectionDeviceVK*>(apii->GetDevice());
+
+        ThrowIf(!vkdev, "Vulkan interop not supported");
+
+        vkdev->WaitSemaphore(semaphore, stage_mask);
+    }
+
+    RRAPI void VulkanSignalSemaphore(RadeonRays::IntersectionApi* api, Anvil::Semaphore* semaphore)
+    {
+        auto apii = static_cast<IntersectionApiImpl*>(api);
+        auto vkdev = dynamic_cast<CalcIntersectionDeviceVK*>(apii->GetDevice());
+
+        ThrowIf(!vkdev, "Vulkan interop not supported");
+
+        vkdev->SignalSemaphore(semaphore);
+    }
 #endif
 }
@@ -23,9 +23,13 @@ THE SOFTWARE.
 #define INTERSECTIONAPI_IMPL
 
 #include <atomic>
+#include <future>
 
 #include "radeon_rays.h"
 #include "../world/world.h"
+#include "../world/scene_snapshot.h"
+#include "../world/workload_capture.h"
+#include "../primitive/shapeimpl.h"
 
 namespace RadeonRays
 {
@@ -39,7 +43,7 @@ namespace RadeonRays
     ///    - Complete path: the data can be put into remote memory allocated with API and can be accessed.
     ///      by the app directly in remote memory space.
     ///
-    class IntersectionApiImpl : public IntersectionApi
+    class IntersectionApiImpl : public IntersectionApi, public ShapeOwner
     {
     public:
         /******************************************
@@ -62,42 +66,104 @@ namespace RadeonRays
             int  numfaces
             ) const override;
 
+        // Create meshes in parallel
+        void CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** shapes) const override;
+
+        // Create a triangle mesh referencing host memory instead of copying it.
+        // The call is blocking, so the returned value is ready upon return.
+        Shape* CreateMeshView(
+            // Position data
+            float const * vertices, int vnum, int vstride,
+            // Index data for vertices, 3 indices per face
+            int const * indices, int istride,
+            // Number of faces
+            int  numfaces
+            ) const override;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         Shape* CreateInstance(Shape const* shape) const override;
+        // Create round cubic Bezier curves.
+        // The call is blocking, so the returned value is ready upon return.
+        Shape* CreateCurves(
+            // Control points
+            float const * vertices, int vnum, int vstride,
+            // 4 control point indices per segment
+            int const * indices,
+            // Number of segments
+            int numsegments
+            ) const override;
+        // Create analytic spheres, disks or custom primitives intersected by "acc.custom_intersector".
+        // The calls are blocking, so the returned values are ready upon return.
+        Shape* CreateSpheres(float const * spheres, int numspheres, int stride) const override;
+        Shape* CreateDisks(float const * disks, int numdisks, int stride) const override;
+        Shape* CreateCustomPrimitives(float const * bounds, int numprims, int stride) const override;
+        // Create a group of shapes placed relative to the group.
+        // The call is blocking, so the returned value is ready upon return.
+        Shape* CreateGroup(Shape const* const* shapes, int numshapes) const override;
+        Shape* CreateLodGroup(Shape const* const* levels, float const* thresholds, int numlevels,
+            LodRule rule, float transition) const override;
         // Delete the shape (to simplify DLL boundary crossing
         void DeleteShape(Shape const* shape) override;
         // Attach shape to participate in intersection process
         void AttachShape(Shape const* shape) override;
+        // Attach several shapes at once
+        void AttachShapes(Shape const* const* shapes, int numshapes) override;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         void DetachShape(Shape const* shape) override;
         // Detach all objects
         void DetachAll() override;
         // Commit all geometry creations/changes
         void Commit() override;
+        // Commit in the background while queries use the previous scene
+        void CommitAsync(Event** event) override;
 
         //Sets the shape id allocator to its default value (1)
         void ResetIdCounter() override;
         //Returns true if no shapes are in the world
         bool IsWorldEmpty() override;
+        // Commit and write shapes and trees of the scene into a file
+        void SaveSnapshot(char const* path) override;
+        // Create shapes of a snapshot file, the next commit reuses its trees
+        int LoadSnapshot(char const* path, Shape** shapes, int maxshapes) override;
+
+        /******************************************
+        Queues
+        ******************************************/
+        // Number of device queues which can be passed to memory and ray casting calls
+        int GetQueueCount() const override;
 
         /******************************************
         Memory management
         ******************************************/
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        // Create a buffer with BufferFlags
+        Buffer* CreateBuffer(size_t size, void* initdata, int flags, void** data) const override;
+        // Create a view of a buffer region
+        Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const override;
 
         // Delete the buffer
         void DeleteBuffer(Buffer* buffer) const override;
         // Map buffer. Event pointer might be nullptr.
         // The call is asynchronous.
-        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue = 0) const override;
         // Unmap buffer
-        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue = 0) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue = 0) const override;
+        // Update vertex positions of a mesh from a buffer
+        void UpdateVertices(Shape* shape, Buffer* vertices, int vnum, int vstride) const override;
+        // Update transforms of several shapes from host memory or a buffer
+        void SetTransforms(Shape* const* shapes, int numshapes, float const* transforms, int tstride) override;
+        void SetTransforms(Shape* const* shapes, int numshapes, Buffer* transforms, int tstride) override;
 
         /******************************************
           Events handling
         *******************************************/
         void DeleteEvent(Event* event) const override;
+        // Create an event owned by the caller and reused by calls
+        Event* CreateReusableEvent() const override;
+        // Block until one of the events is completed
+        int WaitAny(Event* const* events, int numevents) const override;
 
         /******************************************
         Ray casting
@@ -107,19 +173,68 @@ namespace RadeonRays
         // TODO: do we need to modify rays' intersection range?
         // TODO: SoA vs AoS?
         // The call is asynchronous. Event pointers might be nullptrs.
-        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const override;
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
-        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue = 0) const override;
 
         // Find closest intersection, number of rays is in remote memory
         // TODO: do we need to modify rays' intersection range?
         // TODO: SoA vs AoS?
         // The call is asynchronous. Event pointers might be nullptrs.
-        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const override;
         // Find any intersection.
         // The call is asynchronous. Event pointer mights be nullptrs.
-        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        // Find up to k closest intersections per ray.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        // Find the closest point of the scene within each sphere.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hitinfos, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        // Estimate ambient occlusion of surface points with rays generated on the device.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        // Find closest intersection for rays in host memory.
+        // The call is blocking.
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue = 0) const override;
+        // Find any intersection for rays in host memory.
+        // The call is blocking.
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue = 0) const override;
+
+        // Run a batch of queries in order.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        QueryGraph* CreateQueryGraph(QueryDesc const* queries, int numqueries) const override;
+        void DeleteQueryGraph(QueryGraph* graph) const override;
+        void ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue = 0) const override;
+        void Prepare(int maxrays, QueryType const* types, int numtypes, int queue = 0) const override;
+
+        // Compact rays with a nonzero predicate.
+        // The call is asynchronous. Event pointers might be nullptrs.
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue = 0) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue = 0) const override;
+        // Write camera, hemisphere or shadow rays on the device
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue = 0) const override;
+
+        // Set the buffer read by "acc.hit_filter" functions
+        void SetHitFilterData(Buffer const* data) override;
+
+        // Set the buffer receiving per ray "acc.traversal_stats" counters
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+
+        void SetHitHints(Buffer const* hits) override;
+
+        // Set rays trees of the following commits are optimized for
+        void SetRaySamples(ray const* rays, int numrays) override;
 
         /******************************************
         Utility
@@ -128,10 +243,19 @@ namespace RadeonRays
         void SetOption(char const* name, char const* value) override;
         // Set API global option: float
         void SetOption(char const* name, float value) override;
+        // Get timings and acceleration structure figures of the latest Commit call
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        // Get memory held by the device and mesh data
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        // Get GPU kernel timings of the latest query or Commit call
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
         
 
         IntersectionDevice* GetDevice() const { return m_device.get(); }
 
+        // Wait for the background commit reading shapes, called by setters of shapes of this API
+        void WaitForShapeAccess() const override;
+
         IntersectionApiImpl(IntersectionDevice* device);
     protected:
         friend class IntersectionApi;
@@ -139,12 +263,31 @@ namespace RadeonRays
         ~IntersectionApiImpl();
 
     private:
+        // Throw if the queue index is out of range
+        void CheckQueue(int queue) const;
+        // Preprocess the world and collect statistics, concurrent preprocessing keeps queries running
+        void CommitWorld(bool concurrent);
+        // Wait for the background commit started by CommitAsync, rethrowing its error
+        void WaitForCommit() const;
+        // Write a query batch issued on the queue to the "capture.path" file if one is open,
+        // numrays may be nullptr for maxrays rays
+        void CaptureQuery(QueryType type, Buffer const* rays, Buffer const* numrays, int maxrays, int queue) const;
+        void CaptureQuery(QueryType type, ray const* rays, int numrays) const;
+
         // Container for all shapes
         World world_;
         // Shape ID tracker
         mutable std::atomic<Id> nextid_;
         // Intersection device
         std::unique_ptr<IntersectionDevice> m_device;
+        // Statistics of the latest commit
+        CommitStatistics m_commit_stats;
+        // Background commit started by CommitAsync (invalid if there is none)
+        mutable std::shared_future<void> m_pending_commit;
+        // Loaded snapshots, meshes created from them reference the mapped files
+        std::vector<std::unique_ptr<SceneSnapshot>> m_snapshots;
+        // File of "capture.path" (null if disabled), replaced by commits while queries use it
+        std::shared_ptr<WorkloadCapture> m_capture;
     };
 }
 
@@ -0,0 +1,53 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef FUTURE_CALLBACK_H
+#define FUTURE_CALLBACK_H
+
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include "radeon_rays.h"
+
+namespace RadeonRays
+{
+    ///< Completion callback of an event tracking a shared future. The callback
+    ///< is called right away if the future is ready, otherwise a detached thread
+    ///< waits for it, as the host tasks the futures track run on their own threads.
+    ///<
+    inline void call_when_ready(std::shared_future<void> const& future, Event* event, Event::CompletionCallback callback, void* data)
+    {
+        if (future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+            callback(event, data);
+            return;
+        }
+
+        std::thread([future, event, callback, data]()
+        {
+            future.wait();
+            callback(event, data);
+        }).detach();
+    }
+}
+
+#endif // FUTURE_CALLBACK_H
@@ -0,0 +1,414 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+
+#include "../util/numa.h"
+
+namespace RadeonRays
+{
+    ///< A group of tasks which can be waited on as a whole.
+    ///< Tasks spawned from within other tasks of the same group
+    ///< are accounted for as well, so a single group is enough
+    ///< for recursive fork-join workloads.
+    ///<
+    class task_group
+    {
+    public:
+        task_group()
+            : pending_(0)
+        {
+        }
+
+        bool done() const
+        {
+            return pending_.load() == 0;
+        }
+
+    private:
+        task_group(task_group const&);
+        task_group& operator = (task_group const&);
+
+        std::atomic<int> pending_;
+        std::mutex error_mutex_;
+        std::exception_ptr error_;
+
+        friend class task_scheduler;
+    };
+
+    ///< Fixed size pool of worker threads with per-thread
+    ///< task deques. Workers push and pop at the back of their own
+    ///< deque and steal from the front of others' deques, which keeps
+    ///< recursive workloads local and load balanced.
+    ///< Threads calling wait() help executing tasks and park on a
+    ///< condition variable only when there is nothing left to run.
+    ///< On NUMA hosts workers are spread over the nodes in contiguous
+    ///< blocks and bound to them, so memory they first touch (build
+    ///< arenas, ray chunks) stays local, and they steal from workers
+    ///< of their own node before crossing sockets.
+    ///<
+    class task_scheduler
+    {
+    public:
+        typedef std::function<void()> task;
+
+        // numa: bind workers to NUMA nodes (no-op on hosts with a single node)
+        explicit task_scheduler(int num_threads = 0, bool numa = true)
+            : done_(false)
+            , num_pending_(0)
+            , num_sleeping_(0)
+        {
+            if (num_threads <= 0)
+            {
+                num_threads = std::thread::hardware_concurrency();
+                num_threads = num_threads == 0 ? 2 : num_threads;
+            }
+
+            // One extra queue for tasks submitted by external threads
+            for (int i = 0; i < num_threads + 1; ++i)
+            {
+                queues_.emplace_back(new work_queue());
+            }
+
+            num_nodes_ = numa ? std::min(GetNumaNodeCount(), num_threads) : 1;
+
+            // External threads run anywhere, their queue has no node
+            for (int i = 0; i < num_threads; ++i)
+            {
+                nodes_.push_back(i * num_nodes_ / num_threads);
+            }
+
+            nodes_.push_back(-1);
+
+            for (int i = 0; i < num_threads; ++i)
+            {
+                threads_.push_back(std::thread(&task_scheduler::run_loop, this, i));
+            }
+        }
+
+        ~task_scheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+                done_ = true;
+            }
+
+            sleep_cv_.notify_all();
+
+            for (auto& t : threads_)
+            {
+                t.join();
+            }
+        }
+
+        // Number of worker threads
+        int num_threads() const
+        {
+            return static_cast<int>(threads_.size());
+        }
+
+        // Number of NUMA nodes workers are spread over
+        int num_nodes() const
+        {
+            return num_nodes_;
+        }
+
+        // NUMA node of the calling worker, 0 for external threads
+        int current_node() const
+        {
+            return std::max(nodes_[worker_index()], 0);
+        }
+
+        // Schedule a task for execution as a part of a group
+        void spawn(task_group& group, task&& t)
+        {
+            ++group.pending_;
+
+            work_queue& queue = *queues_[worker_index()];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.tasks.push_back(entry{ std::move(t), &group });
+            }
+
+            ++num_pending_;
+            wake(1);
+        }
+
+        // Schedule a batch of tasks with a single queue lock and
+        // wake up as many sleeping workers as there are tasks
+        void spawn(task_group& group, std::vector<task>& tasks)
+        {
+            int const count = static_cast<int>(tasks.size());
+            if (count == 0)
+                return;
+
+            group.pending_ += count;
+
+            work_queue& queue = *queues_[worker_index()];
+            {
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                for (auto& t : tasks)
+                {
+                    queue.tasks.push_back(entry{ std::move(t), &group });
+                }
+            }
+
+            tasks.clear();
+
+            num_pending_ += count;
+            wake(count);
+        }
+
+        // Wait until all the tasks of the group are finished
+        // executing pending tasks meanwhile. Rethrows the first
+        // exception thrown by any of the group tasks.
+        void wait(task_group& group)
+        {
+            int index = worker_index();
+
+            while (!group.done())
+            {
+                entry e;
+                if (try_pop(index, e))
+                {
+                    execute(e);
+                    continue;
+                }
+
+                // Nothing to help with: park until either new tasks
+                // arrive or the last task of the group finishes
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                ++num_sleeping_;
+                sleep_cv_.wait(lock,
+                    [this, &group]() { return group.done() || num_pending_.load() > 0; });
+                --num_sleeping_;
+            }
+
+            if (group.error_)
+            {
+                std::exception_ptr error = group.error_;
+                group.error_ = nullptr;
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        task_scheduler(task_scheduler const&);
+        task_scheduler& operator = (task_scheduler const&);
+
+        struct entry
+        {
+            task func;
+            task_group* group;
+        };
+
+        struct work_queue
+        {
+            std::mutex mutex;
+            std::deque<entry> tasks;
+        };
+
+        // Queue index of the calling thread: workers own queue
+        // or the shared one for external threads
+        int worker_index() const
+        {
+            auto id = std::this_thread::get_id();
+            for (auto i = 0U; i < threads_.size(); ++i)
+            {
+                if (threads_[i].get_id() == id)
+                    return static_cast<int>(i);
+            }
+
+            return static_cast<int>(threads_.size());
+        }
+
+        // Pop from the back of our own queue, then try to steal
+        // from the front of the others on our node and then of the rest
+        bool try_pop(int index, entry& e)
+        {
+            {
+                work_queue& queue = *queues_[index];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                if (!queue.tasks.empty())
+                {
+                    e = std::move(queue.tasks.back());
+                    queue.tasks.pop_back();
+                    --num_pending_;
+                    return true;
+                }
+            }
+
+            int num_queues = static_cast<int>(queues_.size());
+            for (int pass = num_nodes_ > 1 ? 0 : 1; pass < 2; ++pass)
+            {
+                for (int i = 1; i < num_queues; ++i)
+                {
+                    int victim = (index + i) % num_queues;
+                    bool local = nodes_[victim] == nodes_[index];
+                    if (num_nodes_ > 1 && local != (pass == 0))
+                        continue;
+
+                    work_queue& queue = *queues_[victim];
+                    std::lock_guard<std::mutex> lock(queue.mutex);
+                    if (!queue.tasks.empty())
+                    {
+                        e = std::move(queue.tasks.front());
+                        queue.tasks.pop_front();
+                        --num_pending_;
+                        return true;
+                    }
+                }
+            }
+
+            return false;
+        }
+
+        void execute(entry& e)
+        {
+            try
+            {
+                e.func();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(e.group->error_mutex_);
+                if (!e.group->error_)
+                    e.group->error_ = std::current_exception();
+            }
+
+            // The last task of the group wakes up the threads
+            // parked in wait(). Taking the lock orders the wake up
+            // after the waiter's predicate check.
+            if (--e.group->pending_ == 0)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(sleep_mutex_);
+                }
+
+                sleep_cv_.notify_all();
+            }
+        }
+
+        // Wake up to count parked threads if there are any. The
+        // pending counter is bumped before checking for sleepers and
+        // sleepers are registered before checking the counter, so
+        // one of the sides always sees the other.
+        void wake(int count)
+        {
+            if (num_sleeping_.load() == 0)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex_);
+            }
+
+            if (count == 1)
+                sleep_cv_.notify_one();
+            else
+                sleep_cv_.notify_all();
+        }
+
+        void run_loop(int index)
+        {
+            if (num_nodes_ > 1)
+            {
+                BindThreadToNumaNode(nodes_[index]);
+            }
+
+            while (true)
+            {
+                entry e;
+                if (try_pop(index, e))
+                {
+                    execute(e);
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> lock(sleep_mutex_);
+                if (done_)
+                    break;
+
+                ++num_sleeping_;
+                sleep_cv_.wait(lock,
+                    [this]() { return done_ || num_pending_.load() > 0; });
+                --num_sleeping_;
+
+                if (done_)
+                    break;
+            }
+        }
+
+        std::vector<std::unique_ptr<work_queue> > queues_;
+        std::vector<std::thread> threads_;
+        // NUMA node of each queue, -1 for the external one
+        std::vector<int> nodes_;
+        int num_nodes_;
+        std::mutex sleep_mutex_;
+        std::condition_variable sleep_cv_;
+        bool done_;
+        std::atomic<int> num_pending_;
+        std::atomic<int> num_sleeping_;
+    };
+
+    ///< Run func(i) for each i in [begin, end) splitting the range
+    ///< into tasks of grain iterations and wait for all of them.
+    ///< All the tasks are submitted at once and the calling thread
+    ///< takes part in executing them.
+    ///<
+    template <typename F>
+    inline void parallel_for(task_scheduler& scheduler, int begin, int end, int grain, F const& func)
+    {
+        task_group group;
+        grain = std::max(grain, 1);
+
+        std::vector<task_scheduler::task> tasks;
+        tasks.reserve((std::max(end - begin, 0) + grain - 1) / grain);
+
+        for (int i = begin; i < end; i += grain)
+        {
+            int const chunk_end = std::min(end - i, grain) + i;
+            tasks.push_back([&func, i, chunk_end]()
+            {
+                for (int j = i; j < chunk_end; ++j)
+                {
+                    func(j);
+                }
+            });
+        }
+
+        scheduler.spawn(group, tasks);
+        scheduler.wait(group);
+    }
+}
+
+#endif // TASK_SCHEDULER_H
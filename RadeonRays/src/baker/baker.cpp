@@ -0,0 +1,417 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "baker.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <thread>
+
+namespace RadeonRays
+{
+    // Tiles a worker has queued before waiting for the oldest one
+    static int const kMaxInFlight = 2;
+
+    struct BakerImpl::Tile
+    {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    struct BakerImpl::Worker
+    {
+        IntersectionApi* api;
+        // Tiles traced by this worker and their uploaded points, in the same order
+        std::vector<int> tiles;
+        std::vector<Buffer*> points;
+        // Results of the tiles in flight
+        Buffer* visibility[kMaxInFlight];
+        int num_slots;
+        // Shared tile counter of the first pass
+        std::atomic<int>* next_tile;
+        std::exception_ptr error;
+    };
+
+    Baker* Baker::Create(IntersectionApi* const* apis, int numapis)
+    {
+        return new BakerImpl(apis, numapis);
+    }
+
+    void Baker::Delete(Baker* baker)
+    {
+        delete baker;
+    }
+
+    static float3 FetchFloat3(float const* data, int stride, int index)
+    {
+        auto ptr = reinterpret_cast<float const*>(reinterpret_cast<char const*>(data) + (std::size_t)index * (stride ? stride : 3 * sizeof(float)));
+        return float3(ptr[0], ptr[1], ptr[2]);
+    }
+
+    static float2 FetchFloat2(float const* data, int stride, int index)
+    {
+        auto ptr = reinterpret_cast<float const*>(reinterpret_cast<char const*>(data) + (std::size_t)index * (stride ? stride : 2 * sizeof(float)));
+        return float2(ptr[0], ptr[1]);
+    }
+
+    static float EdgeFunction(float2 const& a, float2 const& b, float2 const& c)
+    {
+        return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    }
+
+    void Baker::RasterizeUV(
+        float const* positions, int pstride,
+        float const* normals, int nstride,
+        float const* uvs, int uvstride,
+        int const* indices, int numfaces,
+        int width, int height, SurfacePoint* points)
+    {
+        ThrowIf(!positions || !uvs || !indices || !points, "Invalid rasterization data");
+        ThrowIf(width <= 0 || height <= 0 || numfaces < 0, "Invalid rasterization size");
+
+        std::fill(points, points + (std::size_t)width * height, SurfacePoint());
+
+        // Texel centers exactly on shared edges belong to both triangles, the later one wins
+        float const kEpsilon = 1e-6f;
+
+        for (int f = 0; f < numfaces; ++f)
+        {
+            int idx[3] = { indices[3 * f], indices[3 * f + 1], indices[3 * f + 2] };
+
+            float2 uv[3];
+            float3 p[3];
+            for (int i = 0; i < 3; ++i)
+            {
+                uv[i] = FetchFloat2(uvs, uvstride, idx[i]);
+                uv[i].x *= width;
+                uv[i].y *= height;
+                p[i] = FetchFloat3(positions, pstride, idx[i]);
+            }
+
+            float area = EdgeFunction(uv[0], uv[1], uv[2]);
+            if (std::fabs(area) < kEpsilon)
+            {
+                continue;
+            }
+
+            float3 face_normal = normalize(cross(p[1] - p[0], p[2] - p[0]));
+
+            // Texels whose centers fall inside the uv bounds
+            int xmin = std::max(0, (int)std::ceil(std::min(std::min(uv[0].x, uv[1].x), uv[2].x) - 0.5f));
+            int xmax = std::min(width - 1, (int)std::floor(std::max(std::max(uv[0].x, uv[1].x), uv[2].x) - 0.5f));
+            int ymin = std::max(0, (int)std::ceil(std::min(std::min(uv[0].y, uv[1].y), uv[2].y) - 0.5f));
+            int ymax = std::min(height - 1, (int)std::floor(std::max(std::max(uv[0].y, uv[1].y), uv[2].y) - 0.5f));
+
+            for (int y = ymin; y <= ymax; ++y)
+            {
+                for (int x = xmin; x <= xmax; ++x)
+                {
+                    float2 c(x + 0.5f, y + 0.5f);
+                    float w0 = EdgeFunction(uv[1], uv[2], c) / area;
+                    float w1 = EdgeFunction(uv[2], uv[0], c) / area;
+                    float w2 = 1.f - w0 - w1;
+
+                    if (w0 < -kEpsilon || w1 < -kEpsilon || w2 < -kEpsilon)
+                    {
+                        continue;
+                    }
+
+                    SurfacePoint& point = points[(std::size_t)y * width + x];
+                    point.position = p[0] * w0 + p[1] * w1 + p[2] * w2;
+
+                    if (normals)
+                    {
+                        float3 n = FetchFloat3(normals, nstride, idx[0]) * w0 +
+                            FetchFloat3(normals, nstride, idx[1]) * w1 +
+                            FetchFloat3(normals, nstride, idx[2]) * w2;
+                        point.normal = n.sqnorm() > 0.f ? normalize(n) : face_normal;
+                    }
+                    else
+                    {
+                        point.normal = face_normal;
+                    }
+                }
+            }
+        }
+    }
+
+    BakerImpl::BakerImpl(IntersectionApi* const* apis, int numapis)
+        : m_apis(apis, apis + std::max(numapis, 0))
+        , m_tile_size(256)
+    {
+        ThrowIf(!apis || numapis <= 0, "Baker needs at least one API");
+
+        for (auto api : m_apis)
+        {
+            ThrowIf(!api, "Invalid baker API");
+        }
+    }
+
+    BakerImpl::~BakerImpl()
+    {
+    }
+
+    void BakerImpl::SetTileSize(int size)
+    {
+        ThrowIf(size <= 0, "Invalid tile size");
+        m_tile_size = size;
+    }
+
+    void BakerImpl::RunPass(Worker& worker, std::vector<Tile> const& tiles, SurfacePoint const* points, int width,
+        int numsamples, float radius, int pass, std::vector<float>& sum) const
+    {
+        auto api = worker.api;
+
+        struct InFlight
+        {
+            int tile;
+            int count;
+        };
+
+        InFlight slots[kMaxInFlight];
+        int next = 0;
+
+        // Index into worker.tiles of the next tile, -1 when the worker is done
+        auto acquire = [&]() -> int
+        {
+            if (pass == 0)
+            {
+                int tile = worker.next_tile->fetch_add(1);
+                if (tile >= (int)tiles.size())
+                {
+                    return -1;
+                }
+
+                // Gather and upload the tile points once, later passes reuse them
+                Tile const& t = tiles[tile];
+                std::vector<SurfacePoint> packed((std::size_t)t.width * t.height);
+                for (int y = 0; y < t.height; ++y)
+                {
+                    std::copy(points + (std::size_t)(t.y + y) * width + t.x,
+                        points + (std::size_t)(t.y + y) * width + t.x + t.width,
+                        packed.begin() + (std::size_t)y * t.width);
+                }
+
+                worker.tiles.push_back(tile);
+                worker.points.push_back(api->CreateBuffer(packed.size() * sizeof(SurfacePoint), packed.data()));
+            }
+
+            return next < (int)worker.tiles.size() ? next++ : -1;
+        };
+
+        auto issue = [&](int slot, int index)
+        {
+            int tile = worker.tiles[index];
+            Tile const& t = tiles[tile];
+
+            slots[slot].tile = tile;
+            slots[slot].count = t.width * t.height;
+
+            // Samples differ across passes and tiles
+            int seed = pass * (int)tiles.size() + tile;
+            api->QueryAmbientOcclusion(worker.points[index], slots[slot].count, numsamples, radius, seed,
+                worker.visibility[slot], nullptr, nullptr, slot);
+        };
+
+        auto collect = [&](int slot)
+        {
+            Tile const& t = tiles[slots[slot].tile];
+
+            float* visibility = nullptr;
+            Event* e = nullptr;
+            api->MapBuffer(worker.visibility[slot], kMapRead, 0, slots[slot].count * sizeof(float), (void**)&visibility, &e, slot);
+            e->Wait();
+            api->DeleteEvent(e);
+
+            // Tiles don't overlap, so workers write disjoint parts of sum
+            for (int y = 0; y < t.height; ++y)
+            {
+                float* dst = sum.data() + (std::size_t)(t.y + y) * width + t.x;
+                float const* src = visibility + (std::size_t)y * t.width;
+                for (int x = 0; x < t.width; ++x)
+                {
+                    dst[x] += src[x];
+                }
+            }
+
+            api->UnmapBuffer(worker.visibility[slot], visibility, &e, slot);
+            e->Wait();
+            api->DeleteEvent(e);
+
+            slots[slot].tile = -1;
+        };
+
+        for (int slot = 0; slot < worker.num_slots; ++slot)
+        {
+            slots[slot].tile = -1;
+        }
+
+        // Keep the queues busy: while a tile is read back the other one is traced
+        for (int slot = 0; ; slot = (slot + 1) % worker.num_slots)
+        {
+            if (slots[slot].tile >= 0)
+            {
+                collect(slot);
+            }
+
+            int index = acquire();
+            if (index < 0)
+            {
+                break;
+            }
+
+            issue(slot, index);
+        }
+
+        for (int slot = 0; slot < worker.num_slots; ++slot)
+        {
+            if (slots[slot].tile >= 0)
+            {
+                collect(slot);
+            }
+        }
+    }
+
+    void BakerImpl::BakeAmbientOcclusion(SurfacePoint const* points, int width, int height,
+        int numsamples, int numpasses, float radius, float* result,
+        ProgressCallback callback, void* data)
+    {
+        ThrowIf(!points || !result, "Invalid bake data");
+        ThrowIf(width <= 0 || height <= 0 || numsamples <= 0 || numpasses <= 0 || radius <= 0.f, "Invalid bake parameters");
+
+        std::vector<Tile> tiles;
+        for (int y = 0; y < height; y += m_tile_size)
+        {
+            for (int x = 0; x < width; x += m_tile_size)
+            {
+                Tile tile = { x, y, std::min(m_tile_size, width - x), std::min(m_tile_size, height - y) };
+                tiles.push_back(tile);
+            }
+        }
+
+        std::atomic<int> next_tile(0);
+        std::vector<Worker> workers(m_apis.size());
+
+        auto release = [&]()
+        {
+            for (auto& worker : workers)
+            {
+                for (auto buffer : worker.points)
+                {
+                    worker.api->DeleteBuffer(buffer);
+                }
+
+                for (int slot = 0; slot < worker.num_slots; ++slot)
+                {
+                    if (worker.visibility[slot])
+                    {
+                        worker.api->DeleteBuffer(worker.visibility[slot]);
+                    }
+                }
+            }
+        };
+
+        for (std::size_t i = 0; i < workers.size(); ++i)
+        {
+            Worker& worker = workers[i];
+            worker.api = m_apis[i];
+            worker.num_slots = std::max(1, std::min(kMaxInFlight, worker.api->GetQueueCount()));
+            worker.next_tile = &next_tile;
+            std::fill(worker.visibility, worker.visibility + kMaxInFlight, nullptr);
+        }
+
+        std::vector<float> sum((std::size_t)width * height, 0.f);
+
+        try
+        {
+            for (auto& worker : workers)
+            {
+                for (int slot = 0; slot < worker.num_slots; ++slot)
+                {
+                    worker.visibility[slot] = worker.api->CreateBuffer((std::size_t)m_tile_size * m_tile_size * sizeof(float), nullptr);
+                }
+            }
+
+            for (int pass = 0; pass < numpasses; ++pass)
+            {
+                if (workers.size() == 1)
+                {
+                    RunPass(workers[0], tiles, points, width, numsamples, radius, pass, sum);
+                }
+                else
+                {
+                    std::vector<std::thread> threads;
+                    for (auto& worker : workers)
+                    {
+                        threads.emplace_back([&, pass]()
+                        {
+                            try
+                            {
+                                RunPass(worker, tiles, points, width, numsamples, radius, pass, sum);
+                            }
+                            catch (...)
+                            {
+                                worker.error = std::current_exception();
+                            }
+                        });
+                    }
+
+                    for (auto& thread : threads)
+                    {
+                        thread.join();
+                    }
+
+                    for (auto& worker : workers)
+                    {
+                        if (worker.error)
+                        {
+                            std::rethrow_exception(worker.error);
+                        }
+                    }
+                }
+
+                float scale = 1.f / (pass + 1);
+                for (std::size_t i = 0; i < sum.size(); ++i)
+                {
+                    result[i] = sum[i] * scale;
+                }
+
+                if (callback)
+                {
+                    callback(pass + 1, numpasses, data);
+                }
+            }
+        }
+        catch (...)
+        {
+            release();
+            throw;
+        }
+
+        release();
+    }
+}
@@ -0,0 +1,61 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BAKER_H
+#define BAKER_H
+
+#include "radeon_rays_baker.h"
+
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Baker implementation: tiles of the first pass are pulled by a worker thread
+    ///< per API as they finish, so faster devices take more of them. Later passes
+    ///< trace the same tiles on the same APIs reusing their uploaded points, only
+    ///< a float per texel is read back after each query.
+    ///<
+    class BakerImpl : public Baker
+    {
+    public:
+        BakerImpl(IntersectionApi* const* apis, int numapis);
+        ~BakerImpl();
+
+        void SetTileSize(int size) override;
+
+        void BakeAmbientOcclusion(SurfacePoint const* points, int width, int height,
+            int numsamples, int numpasses, float radius, float* result,
+            ProgressCallback callback, void* data) override;
+
+    private:
+        struct Tile;
+        struct Worker;
+
+        // Trace a pass of the tiles assigned to a worker, or pulled from next_tile in the first pass
+        void RunPass(Worker& worker, std::vector<Tile> const& tiles, SurfacePoint const* points, int width,
+            int numsamples, float radius, int pass, std::vector<float>& sum) const;
+
+        std::vector<IntersectionApi*> m_apis;
+        int m_tile_size;
+    };
+}
+
+#endif // BAKER_H
@@ -0,0 +1,178 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "calc_buffer_pool.h"
+
+#include "event.h"
+#include "../util/trace.h"
+
+namespace RadeonRays
+{
+    // Smallest size class
+    static std::size_t const kMinSizeClass = 256;
+
+    CalcBufferPool::CalcBufferPool(Calc::Device* device)
+        : m_device(device)
+        , m_cached_bytes(0)
+        , m_budget(kDefaultBudget)
+    {
+    }
+
+    CalcBufferPool::~CalcBufferPool()
+    {
+        Trim();
+    }
+
+    std::size_t CalcBufferPool::GetSizeClass(std::size_t size)
+    {
+        if (size <= kMinSizeClass)
+        {
+            return kMinSizeClass;
+        }
+
+        // Find the power of two below size and round up to a quarter of it
+        std::size_t base = kMinSizeClass;
+        while (base * 2 < size)
+        {
+            base *= 2;
+        }
+
+        std::size_t step = base / 4;
+        return (size + step - 1) / step * step;
+    }
+
+    Calc::Buffer* CalcBufferPool::Acquire(std::size_t size, std::uint32_t type)
+    {
+        Bin bin(GetSizeClass(size), type);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        Calc::Buffer* buffer = nullptr;
+
+        auto iter = m_bins.find(bin);
+        if (iter != m_bins.end() && !iter->second.empty())
+        {
+            buffer = iter->second.back();
+            iter->second.pop_back();
+            m_cached_bytes -= bin.first;
+        }
+        else
+        {
+            buffer = m_device->CreateBuffer(bin.first, type);
+        }
+
+        m_acquired[buffer] = bin;
+        return buffer;
+    }
+
+    Calc::Buffer* CalcBufferPool::Acquire(std::size_t size, std::uint32_t type, void* initdata)
+    {
+        Calc::Buffer* buffer = Acquire(size, type);
+
+        // Caller may free initdata right after the call
+        TraceScope trace("WriteBuffer", "upload");
+        Calc::Event* e = nullptr;
+        m_device->WriteBuffer(buffer, 0, 0, size, initdata, &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        return buffer;
+    }
+
+    void CalcBufferPool::Release(Calc::Buffer* buffer)
+    {
+        if (!buffer)
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto iter = m_acquired.find(buffer);
+
+        // Not one of ours or reuse is disabled
+        if (iter == m_acquired.end() || iter->second.first > m_budget)
+        {
+            if (iter != m_acquired.end())
+            {
+                m_acquired.erase(iter);
+            }
+
+            m_device->DeleteBuffer(buffer);
+            return;
+        }
+
+        Bin bin = iter->second;
+        m_acquired.erase(iter);
+
+        m_bins[bin].push_back(buffer);
+        m_cached_bytes += bin.first;
+
+        Shrink();
+    }
+
+    void CalcBufferPool::SetBudget(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_budget = bytes;
+        Shrink();
+    }
+
+    void CalcBufferPool::Trim()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto& bin : m_bins)
+        {
+            for (auto buffer : bin.second)
+            {
+                m_device->DeleteBuffer(buffer);
+            }
+        }
+
+        m_bins.clear();
+        m_cached_bytes = 0;
+    }
+
+    std::size_t CalcBufferPool::GetCachedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_cached_bytes;
+    }
+
+    void CalcBufferPool::Shrink()
+    {
+        // Largest buffers go first, small ones are the most likely to be requested again
+        for (auto iter = m_bins.rbegin(); iter != m_bins.rend() && m_cached_bytes > m_budget; ++iter)
+        {
+            auto& buffers = iter->second;
+
+            while (!buffers.empty() && m_cached_bytes > m_budget)
+            {
+                m_device->DeleteBuffer(buffers.back());
+                buffers.pop_back();
+                m_cached_bytes -= iter->first.first;
+            }
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "buffer.h"
+#include "device.h"
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Pool of Calc buffers binned by size class and buffer type. Released buffers
+    ///< are kept for reuse by later requests of the same class, so rebuilding
+    ///< acceleration structures or recreating ray buffers every frame doesn't go
+    ///< through the driver allocator once the pool has warmed up.
+    ///< Size classes are a quarter of a power of two apart, buffers are up to 25% larger
+    ///< than requested. Released buffers exceeding the cache budget are deleted.
+    ///< Buffers must not be used by pending commands of other queues when released.
+    ///<
+    class CalcBufferPool
+    {
+    public:
+        CalcBufferPool(Calc::Device* device);
+        ~CalcBufferPool();
+
+        // Get a buffer of at least size bytes
+        Calc::Buffer* Acquire(std::size_t size, std::uint32_t type);
+        // Get a buffer of at least size bytes with initdata uploaded, blocks until the upload is done
+        Calc::Buffer* Acquire(std::size_t size, std::uint32_t type, void* initdata);
+        // Return a buffer to the pool, nullptr is ignored
+        void Release(Calc::Buffer* buffer);
+
+        // Set the amount of memory released buffers may hold, 0 disables reuse
+        void SetBudget(std::size_t bytes);
+        // Delete all the released buffers
+        void Trim();
+
+        // Memory held by released buffers
+        std::size_t GetCachedBytes() const;
+
+        // Size class a request of size bytes is rounded up to
+        static std::size_t GetSizeClass(std::size_t size);
+
+        // Default cache budget
+        static std::size_t const kDefaultBudget = 256 * 1024 * 1024;
+
+    private:
+        CalcBufferPool(CalcBufferPool const&);
+        CalcBufferPool& operator = (CalcBufferPool const&);
+
+        // Delete released buffers until they fit into the budget
+        void Shrink();
+
+        typedef std::pair<std::size_t, std::uint32_t> Bin;
+
+        // Device to use
+        Calc::Device* m_device;
+        // Released buffers per size class and type
+        std::map<Bin, std::vector<Calc::Buffer*> > m_bins;
+        // Bins of the buffers handed out
+        std::unordered_map<Calc::Buffer const*, Bin> m_acquired;
+        // Memory held by released buffers
+        std::size_t m_cached_bytes;
+        // Cache budget
+        std::size_t m_budget;
+        // Pool is shared by API calls from different threads
+        mutable std::mutex m_mutex;
+    };
+}
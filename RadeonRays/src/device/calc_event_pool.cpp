@@ -0,0 +1,164 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "calc_event_pool.h"
+
+#include "../except/except.h"
+
+#include <functional>
+
+namespace RadeonRays
+{
+    static std::uint64_t const kIndexMask = 0xFFFFFFFFull;
+
+    CalcEventPool::CalcEventPool()
+        : m_head(kNullIndex)
+        , m_num_chunks(0)
+    {
+        for (std::uint32_t i = 0; i < kMaxChunks; ++i)
+        {
+            m_chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        Grow();
+    }
+
+    CalcEventPool::~CalcEventPool()
+    {
+        auto num_chunks = m_num_chunks.load();
+        for (std::uint32_t i = 0; i < num_chunks; ++i)
+        {
+            delete[] m_chunks[i].load();
+        }
+    }
+
+    CalcEventHolder* CalcEventPool::Get(std::uint32_t index) const
+    {
+        return m_chunks[index / kChunkSize].load(std::memory_order_acquire) + index % kChunkSize;
+    }
+
+    CalcEventHolder* CalcEventPool::Acquire()
+    {
+        auto head = m_head.load(std::memory_order_acquire);
+
+        for (;;)
+        {
+            auto index = static_cast<std::uint32_t>(head & kIndexMask);
+
+            if (index == kNullIndex)
+            {
+                Grow();
+                head = m_head.load(std::memory_order_acquire);
+                continue;
+            }
+
+            // The holder might be popped by someone else meanwhile,
+            // in this case the tag has changed and CAS fails
+            auto holder = Get(index);
+            std::uint64_t next = holder->m_next.load(std::memory_order_relaxed);
+            std::uint64_t tag = (head >> 32) + 1;
+
+            if (m_head.compare_exchange_weak(head, (tag << 32) | next, std::memory_order_acq_rel, std::memory_order_acquire))
+            {
+                return holder;
+            }
+        }
+    }
+
+    void CalcEventPool::Release(CalcEventHolder* holder)
+    {
+        holder->m_caller_owned = false;
+        Push(holder, holder);
+    }
+
+    void CalcEventPool::Push(CalcEventHolder* first, CalcEventHolder* last)
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+        std::uint64_t new_head;
+
+        do
+        {
+            last->m_next.store(static_cast<std::uint32_t>(head & kIndexMask), std::memory_order_relaxed);
+            new_head = (((head >> 32) + 1) << 32) | first->m_index;
+        }
+        while (!m_head.compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    void CalcEventPool::Grow()
+    {
+        std::lock_guard<std::mutex> lock(m_grow_mutex);
+
+        // Someone else might have grown the pool already
+        if ((m_head.load(std::memory_order_acquire) & kIndexMask) != kNullIndex)
+        {
+            return;
+        }
+
+        auto num_chunks = m_num_chunks.load(std::memory_order_relaxed);
+        ThrowIf(num_chunks == kMaxChunks, "Too many events in flight");
+
+        auto chunk = new CalcEventHolder[kChunkSize];
+        for (std::uint32_t i = 0; i < kChunkSize; ++i)
+        {
+            chunk[i].m_index = num_chunks * kChunkSize + i;
+            chunk[i].m_next.store(chunk[i].m_index + 1, std::memory_order_relaxed);
+        }
+
+        m_chunks[num_chunks].store(chunk, std::memory_order_release);
+        m_num_chunks.store(num_chunks + 1, std::memory_order_release);
+
+        Push(chunk, chunk + kChunkSize - 1);
+    }
+
+    std::size_t CalcEventPool::GetAllocatedBytes() const
+    {
+        return m_num_chunks.load(std::memory_order_acquire) * kChunkSize * sizeof(CalcEventHolder);
+    }
+
+    bool CalcEventPool::IsCallerOwned(Event const* event) const
+    {
+        if (!event)
+        {
+            return false;
+        }
+
+        std::less<char const*> less;
+        auto address = reinterpret_cast<char const*>(event);
+        auto num_chunks = m_num_chunks.load(std::memory_order_acquire);
+
+        for (std::uint32_t i = 0; i < num_chunks; ++i)
+        {
+            CalcEventHolder const* chunk = m_chunks[i].load(std::memory_order_acquire);
+            auto begin = reinterpret_cast<char const*>(chunk);
+
+            if (less(address, begin) || !less(address, begin + kChunkSize * sizeof(CalcEventHolder)))
+            {
+                continue;
+            }
+
+            // Only exact holder addresses are accepted
+            auto holder = chunk + (address - begin) / sizeof(CalcEventHolder);
+            return static_cast<Event const*>(holder) == event && holder->m_caller_owned;
+        }
+
+        return false;
+    }
+}
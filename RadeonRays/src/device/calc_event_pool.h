@@ -0,0 +1,78 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+#include "calc_holder.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace RadeonRays
+{
+    ///< Lock free pool of event holders. Holders are allocated in chunks which are
+    ///< never released until the pool is destroyed, so acquiring and releasing
+    ///< holders doesn't allocate once the pool has grown to the number of events in flight.
+    ///< Free holders form a stack linked by indices, the head carries a version tag
+    ///< to protect concurrent pops from ABA.
+    ///<
+    class CalcEventPool
+    {
+    public:
+        CalcEventPool();
+        ~CalcEventPool();
+
+        // Get a free holder, grows the pool if there is none
+        CalcEventHolder* Acquire();
+        // Return a holder to the pool
+        void Release(CalcEventHolder* holder);
+        // Check if event is a caller owned holder of this pool. The pointer is only
+        // dereferenced if it points to a holder, so stale and foreign pointers are safe.
+        bool IsCallerOwned(Event const* event) const;
+        // Memory held by the holder chunks allocated so far
+        std::size_t GetAllocatedBytes() const;
+
+    private:
+        CalcEventPool(CalcEventPool const&);
+        CalcEventPool& operator = (CalcEventPool const&);
+
+        // Allocate one more chunk and push its holders
+        void Grow();
+        // Push a chain of holders linked by m_next
+        void Push(CalcEventHolder* first, CalcEventHolder* last);
+        // Holder by its index
+        CalcEventHolder* Get(std::uint32_t index) const;
+
+        static std::uint32_t const kChunkSize = 256;
+        static std::uint32_t const kMaxChunks = 1024;
+        static std::uint32_t const kNullIndex = 0xFFFFFFFF;
+
+        // Index of the first free holder in low bits, version tag in high bits
+        std::atomic<std::uint64_t> m_head;
+        // Holder chunks
+        std::atomic<CalcEventHolder*> m_chunks[kMaxChunks];
+        std::atomic<std::uint32_t> m_num_chunks;
+        // Serializes growth only
+        std::mutex m_grow_mutex;
+    };
+}
@@ -25,6 +25,8 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "device.h"
 #include "event.h"
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <functional>
 
@@ -38,6 +40,11 @@ namespace RadeonRays
         {
         }
 
+        CalcBufferHolder(Calc::Buffer* buffer, std::function<void(Calc::Buffer*)> deleter)
+            : m_buffer(buffer, deleter)
+        {
+        }
+
         ~CalcBufferHolder() = default;
 
         Calc::Buffer* GetData() const
@@ -48,33 +55,68 @@ namespace RadeonRays
         std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>> m_buffer;
     };
 
+    // Deleter returning Calc events to their device
+    struct CalcEventDeleter
+    {
+        Calc::Device* device;
+
+        void operator()(Calc::Event* event) const
+        {
+            device->DeleteEvent(event);
+        }
+    };
+
     struct CalcEventHolder : public RadeonRays::Event
     {
         CalcEventHolder()
-            : m_event()
+            : m_event(nullptr, CalcEventDeleter{ nullptr })
+            , m_next(0)
+            , m_index(0)
+            , m_caller_owned(false)
         {
         }
 
         CalcEventHolder(Calc::Device* device, Calc::Event* event)
-            : m_event(event, [device](Calc::Event* event) { device->DeleteEvent(event); })
+            : m_event(event, CalcEventDeleter{ device })
+            , m_next(0)
+            , m_index(0)
+            , m_caller_owned(false)
         {
         }
 
         ~CalcEventHolder() = default;
 
+        // Replace the event, the previous one is returned to its device
         void Set(Calc::Device* device, Calc::Event* event)
         {
-            m_event = decltype(m_event)(event, [device](Calc::Event* event) { device->DeleteEvent(event); });
+            m_event = std::unique_ptr<Calc::Event, CalcEventDeleter>(event, CalcEventDeleter{ device });
         }
 
+        // Caller owned events which have not been passed to any call yet are complete
         bool Complete() const override
         {
-            return m_event->IsComplete();
+            return !m_event || m_event->IsComplete();
         }
 
         void Wait() override
         {
-            return m_event->Wait();
+            if (m_event)
+            {
+                m_event->Wait();
+            }
+        }
+
+        void SetCompletionCallback(CompletionCallback callback, void* data) override
+        {
+            if (!m_event)
+            {
+                callback(this, data);
+                return;
+            }
+
+            std::unique_ptr<CallbackPayload> payload(new CallbackPayload{ this, callback, data });
+            m_event->SetCompletionCallback(&CalcEventHolder::OnComplete, payload.get());
+            payload.release();
         }
 
         Calc::Event* GetData()
@@ -82,7 +124,27 @@ namespace RadeonRays
             return m_event.get();
         }
 
-        std::unique_ptr<Calc::Event, std::function<void(Calc::Event*)>> m_event;
+        // Callback passed to the Calc event, deleted once called
+        struct CallbackPayload
+        {
+            RadeonRays::Event* event;
+            CompletionCallback callback;
+            void* data;
+        };
+
+        static void OnComplete(void* data)
+        {
+            std::unique_ptr<CallbackPayload> payload(static_cast<CallbackPayload*>(data));
+            payload->callback(payload->event, payload->data);
+        }
+
+        std::unique_ptr<Calc::Event, CalcEventDeleter> m_event;
+
+        // Free list link and index in CalcEventPool
+        std::atomic<std::uint32_t> m_next;
+        std::uint32_t m_index;
+        // Created by IntersectionApi::CreateReusableEvent and reused by the queries it is passed to
+        bool m_caller_owned;
     };
 }
 
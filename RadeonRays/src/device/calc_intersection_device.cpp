@@ -26,328 +26,1885 @@ THE SOFTWARE.
 #include "device.h"
 #include "event.h"
 #include "../primitive/shapeimpl.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
 
 #include "calc_holder.h"
+#include "calc_event_pool.h"
+#include "cpu_intersection_device.h"
 
 #include "../intersector/intersector.h"
 #include "../intersector/intersector_2level.h"
 #include "../intersector/intersector_skip_links.h"
 #include "../intersector/intersector_short_stack.h"
+#include "../intersector/intersector_qbvh.h"
 #include "../intersector/intersector_hlbvh.h"
 #include "../intersector/intersector_bittrail.h"
+#include "../intersector/intersector_paged.h"
+#include "../intersector/intersector_grid.h"
+#include "../intersector/ray_compactor.h"
+#include "../intersector/hit_grouper.h"
+#include "../intersector/ray_generator.h"
+#include "../intersector/memory_usage.h"
+#include "../translator/plain_bvh_translator.h"
+#include "../translator/fatnode_bvh_translator.h"
+#include "../translator/compressed_bvh_translator.h"
 #include "../world/world.h"
+#include "../except/except.h"
+#include "../util/trace.h"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include <future>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <unordered_set>
 
 namespace RadeonRays
 {
+    // Rays per chunk of host memory queries
+    static int const kDefaultHostChunkSize = 65536;
+
+    // Option change trading speed for memory, tried in order while "acc.memory_budget" is exceeded
+    struct BudgetStep
+    {
+        Options::OptionId option;
+        float value;
+    };
+
+    static BudgetStep const kBudgetSteps[] =
+    {
+        { Options::kBvhSahUseSplits, 0.f },
+        { Options::kBvhPrecomputedTriangles, 0.f },
+        { Options::kBvhPackedVertices, 1.f },
+        { Options::kBvhDedupMeshes, 1.f },
+        { Options::kBvhCompressed, 1.f },
+    };
+
+    static bool IsOptionEnabled(World const& world, Options::OptionId id)
+    {
+        auto option = world.options_.GetOption(id);
+        return option && option->AsFloat() > 0.f;
+    }
+
+    // Check if the world needs 2 level BVH: forced, instanced or moving shapes unless
+    // flattening is forced, groups, curves and procedurals always
+    static bool NeedsTwoLevel(World const& world)
+    {
+        if (IsOptionEnabled(world, Options::kBvhForce2level) || world.HasGroups() || world.HasCurves() || world.HasProcedurals())
+        {
+            return true;
+        }
+
+        if (IsOptionEnabled(world, Options::kBvhForceflat))
+        {
+            return false;
+        }
+
+        // Motion is only applied by 2 level BVH
+        return std::any_of(world.shapes_.cbegin(), world.shapes_.cend(), [](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            return shapeimpl->is_instance() || shapeimpl->HasMotion();
+        });
+    }
+
+    // Structure the world is built into: "paged", "bvh2l" or a single level acc.type,
+    // "auto" is estimated as "bvh"
+    static std::string GetStructureType(World const& world)
+    {
+        auto optacctype = world.options_.GetOption(Options::kAccType);
+        std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+        if (acctype == "paged")
+        {
+            return acctype;
+        }
+
+        if (NeedsTwoLevel(world))
+        {
+            return "bvh2l";
+        }
+
+        return acctype == "auto" ? "bvh" : acctype;
+    }
+
+    // Check if SplitBvh is built for the structure, "lbvh" builder ignores splits
+    static bool UsesSpatialSplits(std::string const& acctype, World const& world)
+    {
+        auto builder = world.options_.GetOption(Options::kBvhBuilder);
+
+        return IsOptionEnabled(world, Options::kBvhSahUseSplits) &&
+            (acctype == "bvh" || acctype == "fatbvh" || acctype == "qbvh" || acctype == "hashbvh") &&
+            !(builder && builder->AsString() == "lbvh");
+    }
+
+    // Check if a budget step changes the structure built with the current options
+    static bool IsBudgetStepApplicable(BudgetStep const& step, std::string const& acctype, World const& world, bool opencl)
+    {
+        if (IsOptionEnabled(world, step.option) == (step.value > 0.f))
+        {
+            return false;
+        }
+
+        bool const flat = acctype == "bvh" || acctype == "fatbvh";
+
+        switch (step.option)
+        {
+        case Options::kBvhSahUseSplits:
+            return UsesSpatialSplits(acctype, world);
+        case Options::kBvhPrecomputedTriangles:
+            return flat;
+        case Options::kBvhPackedVertices:
+            return flat && opencl && !IsOptionEnabled(world, Options::kBvhPrecomputedTriangles);
+        case Options::kBvhDedupMeshes:
+            return acctype == "bvh2l";
+        case Options::kBvhCompressed:
+        {
+            // Compressed nodes can't write compact hits or packed occlusion, count traversal steps or call back
+            auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+            auto occlusionformat = world.options_.GetOption(Options::kAccOcclusionFormat);
+            auto callback = world.options_.GetOption(Options::kAccHitCallback);
+            auto filter = world.options_.GetOption(Options::kAccHitFilter);
+            return acctype == "fatbvh" && opencl &&
+                (!hitformat || hitformat->AsString() == "full") &&
+                (!occlusionformat || occlusionformat->AsString() == "int") &&
+                !IsOptionEnabled(world, Options::kAccTraversalStats) &&
+                (!callback || callback->AsString().empty()) &&
+                (!filter || filter->AsString().empty());
+        }
+        default:
+            return false;
+        }
+    }
+
+    // Device memory the structure is expected to take: nodes, vertices and faces of the meshes,
+    // flattened for single level structures and once per mesh for 2 level BVH. Traversal stacks
+    // are left out and meshes deduplicated by the build are counted in full
+    static std::size_t EstimateStructureBytes(std::string const& acctype, World const& world, bool opencl)
+    {
+        std::size_t numfaces = 0;
+        std::size_t numvertices = 0;
+        std::unordered_set<Shape const*> meshes;
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->is_instance())
+            {
+                shapeimpl = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape());
+            }
+
+            if (shapeimpl->is_instance() || shapeimpl->is_group() || shapeimpl->is_curves() || shapeimpl->is_procedural())
+            {
+                continue;
+            }
+
+            // Bottom levels of 2 level BVH are built once per mesh
+            if (acctype == "bvh2l" && !meshes.insert(shapeimpl).second)
+            {
+                continue;
+            }
+
+            auto mesh = static_cast<Mesh const*>(shapeimpl);
+            numfaces += mesh->num_faces();
+            numvertices += mesh->num_vertices();
+        }
+
+        // Single primitive leaves
+        std::size_t numnodes = numfaces > 0 ? 2 * numfaces - 1 : 0;
+
+        if (UsesSpatialSplits(acctype, world))
+        {
+            auto budget = world.options_.GetOption(Options::kBvhSahExtraNodeBudget);
+            numnodes += static_cast<std::size_t>(numnodes * std::max(budget ? budget->AsFloat() : 0.5f, 0.f));
+        }
+
+        // Indices, shape mask, shape and primitive IDs
+        std::size_t const facesize = 6 * sizeof(int);
+        bool const flat = acctype == "bvh" || acctype == "fatbvh";
+        bool const triangles = flat && opencl && IsOptionEnabled(world, Options::kBvhPrecomputedTriangles);
+        bool const packed = flat && opencl && !triangles && IsOptionEnabled(world, Options::kBvhPackedVertices);
+
+        std::size_t nodesize = sizeof(PlainBvhTranslator::Node);
+        // Fat BVH leaves and precomputed triangles hold their faces
+        std::size_t facebytes = triangles ? 0 : numfaces * facesize;
+
+        if (acctype == "fatbvh")
+        {
+            nodesize = IsOptionEnabled(world, Options::kBvhCompressed) && opencl ?
+                sizeof(CompressedBvhTranslator::Node) : sizeof(FatNodeBvhTranslator::Node);
+            facebytes = 0;
+        }
+
+        // A vertex and two edges per face instead of indexed vertices
+        std::size_t const vertexbytes = triangles ?
+            numfaces * 3 * sizeof(float3) : numvertices * (packed ? 3 * sizeof(float) : sizeof(float3));
+
+        std::size_t bytes = numnodes * nodesize + vertexbytes + facebytes;
+
+        if (acctype == "grid")
+        {
+            // Resolution and first leaf cell per top level cell, reference range per leaf cell
+            // and about two references per face instead of nodes
+            auto density = world.options_.GetOption(Options::kGridDensity);
+            auto top_density = world.options_.GetOption(Options::kGridTopDensity);
+            std::size_t const numtop = static_cast<std::size_t>(numfaces * (top_density ? top_density->AsFloat() : 0.0625f));
+            std::size_t const numleaves = static_cast<std::size_t>(numfaces * (density ? density->AsFloat() : 2.f));
+            bytes = numtop * 5 * sizeof(int) + numleaves * 2 * sizeof(int) + numfaces * 2 * sizeof(int) + vertexbytes + facebytes;
+        }
+
+        if (acctype == "bvh2l")
+        {
+            // Top level nodes and per shape transforms, IDs and masks
+            std::size_t const numshapes = world.shapes_.size();
+            bytes += (2 * numshapes) * sizeof(PlainBvhTranslator::Node) + numshapes * 2 * sizeof(matrix);
+        }
+
+        return bytes;
+    }
+
     // TODO: handle different BVH strategies, for now hardcoded
     CalcIntersectionDevice::CalcIntersectionDevice(Calc::Calc* calc, Calc::Device* device)
         : m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
-        , m_intersector(new IntersectorSkipLinks(device))
-        , m_intersector_string("bvh")
+        , m_intersector(nullptr)
+        , m_pending_string("bvh")
+        , m_staging(false)
+        , m_compile_time(0.f)
+        , m_stats()
+        , m_budget_steps(0)
+        , m_buffer_pool(device)
+        , m_scratch(new CalcScratchBuffers(device))
+        , m_filter_data(nullptr)
+        , m_stats_buffer(nullptr)
+        , m_hint_buffer(nullptr)
+        , m_host_chunk_size(kDefaultHostChunkSize)
+        , m_host_ray_capacity(0)
+        , m_host_hit_capacity(0)
+        , m_host_threshold(0)
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_num_queues = std::max(static_cast<int>(spec.max_num_queues), 1);
+        m_unified_memory = spec.unified_memory && m_device->GetPlatform() == Calc::Platform::kOpenCL;
+
+        // Compile the default intersector while the scene is being set up
+        m_pending = std::async(std::launch::async, [device]() -> Intersector* { return new IntersectorSkipLinks(device); });
+    }
+
+    CalcIntersectionDevice::~CalcIntersectionDevice()
+    {
+        ReleaseHostChunks();
+
+        // Collect the background compilation if it has never been used
+        if (m_pending.valid())
+        {
+            try
+            {
+                delete m_pending.get();
+            }
+            catch (...)
+            {
+            }
+        }
+    }
+
+    void CalcIntersectionDevice::SelectIntersector(std::string const& name, std::function<Intersector*()> const& create) const
+    {
+        if (m_staging)
+        {
+            m_staged_string = name;
+            m_staged_create = create;
+            return;
+        }
+
+        if (m_intersector && m_intersector_string == name)
+        {
+            return;
+        }
+
+        auto iter = m_intersectors.find(name);
+
+        if (iter == m_intersectors.end())
+        {
+            std::unique_ptr<Intersector> intersector;
+
+            if (m_pending.valid() && m_pending_string == name)
+            {
+                intersector.reset(m_pending.get());
+            }
+            else
+            {
+                intersector.reset(create());
+            }
+
+            intersector->SetScratchBuffers(m_scratch);
+            iter = m_intersectors.emplace(name, std::move(intersector)).first;
+        }
+
+        m_intersector = iter->second.get();
+        m_intersector_string = name;
+    }
+
+    Intersector* CalcIntersectionDevice::GetIntersector() const
+    {
+        if (!m_intersector)
+        {
+            auto device = m_device.get();
+            SelectIntersector("bvh", [device]() -> Intersector* { return new IntersectorSkipLinks(device); });
+        }
+
+        return m_intersector;
+    }
+
+    void CalcIntersectionDevice::SelectFlatIntersector(std::string const& acctype, World const& world) const
+    {
+        auto device = m_device.get();
+
+        auto opttriangles = world.options_.GetOption(Options::kBvhPrecomputedTriangles);
+        bool triangles = opttriangles && opttriangles->AsFloat() > 0.f;
+
+        if (acctype == "bvh")
+        {
+            std::string name = triangles ? "bvh.triangles" : "bvh";
+
+            SelectIntersector(name, [device, triangles]() -> Intersector* { return new IntersectorSkipLinks(device, triangles); });
+        }
+        else if (acctype == "fatbvh")
+        {
+            auto optcompressed = world.options_.GetOption(Options::kBvhCompressed);
+            bool compressed = optcompressed && optcompressed->AsFloat() > 0.f;
+            std::string name = std::string("fatbvh") + (compressed ? ".compressed" : "") + (triangles ? ".triangles" : "");
+
+            SelectIntersector(name, [device, compressed, triangles]() -> Intersector* { return new IntersectorShortStack(device, compressed, triangles); });
+        }
+        else if (acctype == "qbvh")
+        {
+            SelectIntersector("qbvh", [device]() -> Intersector* { return new IntersectorQbvh(device); });
+        }
+        else if (acctype == "hlbvh")
+        {
+            SelectIntersector("hlbvh", [device]() -> Intersector* { return new IntersectorHlbvh(device); });
+        }
+        else if (acctype == "hashbvh")
+        {
+            SelectIntersector("hashbvh", [device]() -> Intersector* { return new IntersectorBitTrail(device); });
+        }
+        else if (acctype == "grid")
+        {
+            SelectIntersector("grid", [device]() -> Intersector* { return new IntersectorGrid(device); });
+        }
+    }
+
+    void CalcIntersectionDevice::CreateProbeRays(World const& world, std::vector<ray>& rays) const
+    {
+        // Probe rays are shot from random points of the scene bounds towards random faces,
+        // instances are left out of the targets but still traced through
+        std::vector<Mesh const*> meshes;
+        bbox bounds;
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->is_instance())
+            {
+                continue;
+            }
+
+            auto mesh = static_cast<Mesh const*>(shapeimpl);
+
+            for (int i = 0; i < mesh->num_faces(); ++i)
+            {
+                bbox facebounds;
+                mesh->GetFaceBounds(i, false, facebounds);
+                bounds.grow(facebounds);
+            }
+
+            if (mesh->num_faces() > 0)
+            {
+                meshes.push_back(mesh);
+            }
+        }
+
+        rays.clear();
+
+        if (meshes.empty())
+        {
+            return;
+        }
+
+        auto optproberays = world.options_.GetOption(Options::kAccAutoProbeRays);
+        int num_rays = optproberays ? std::max(static_cast<int>(optproberays->AsFloat()), 1) : kDefaultProbeRays;
+
+        std::minstd_rand rng(1337);
+        std::uniform_real_distribution<float> uniform(0.f, 1.f);
+        float3 extents = bounds.extents();
+
+        rays.resize(num_rays);
+
+        for (auto& r : rays)
+        {
+            auto mesh = meshes[std::min(static_cast<std::size_t>(uniform(rng) * meshes.size()), meshes.size() - 1)];
+            int face = std::min(static_cast<int>(uniform(rng) * mesh->num_faces()), mesh->num_faces() - 1);
+
+            bbox facebounds;
+            mesh->GetFaceBounds(face, false, facebounds);
+
+            float3 o = bounds.pmin + float3(uniform(rng) * extents.x, uniform(rng) * extents.y, uniform(rng) * extents.z);
+            float3 d = facebounds.center() - o;
+            // Origins landing on the target get an arbitrary direction
+            r = ray(o, dot(d, d) > 0.f ? normalize(d) : float3(0.f, 0.f, 1.f));
+        }
+    }
+
+    float CalcIntersectionDevice::TimeProbe(Calc::Buffer const* rays, int num_rays, Calc::Buffer* hits) const
+    {
+        // First run is a warm up, the best of the remaining ones is taken
+        float time = std::numeric_limits<float>::max();
+
+        for (int i = 0; i <= kProbeRuns; ++i)
+        {
+            auto probe_start = std::chrono::high_resolution_clock::now();
+            m_intersector->QueryIntersection(0, rays, num_rays, hits, nullptr, nullptr);
+            m_device->Finish(0);
+
+            if (i > 0)
+            {
+                time = std::min(time, std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - probe_start).count());
+            }
+        }
+
+        return time;
+    }
+
+    bool CalcIntersectionDevice::SelectAutoIntersector(World const& world)
+    {
+        TraceScope trace("SelectAutoIntersector", "device");
+
+        std::size_t num_faces = 0;
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (!shapeimpl->is_instance())
+            {
+                num_faces += static_cast<Mesh const*>(shapeimpl)->num_faces();
+            }
+        }
+
+        auto key = std::make_pair(world.shapes_.size(), num_faces);
+
+        // Keep the previous choice while the scene composition stays the same
+        if (!m_auto_type.empty() && m_auto_key == key)
+        {
+            SelectFlatIntersector(m_auto_type, world);
+            return false;
+        }
+
+        m_auto_key = key;
+
+        // Timings of small scenes are dominated by launch overhead
+        if (num_faces < kAutoMinFaces)
+        {
+            m_auto_type = "bvh";
+            SelectFlatIntersector(m_auto_type, world);
+            return false;
+        }
+
+        std::vector<ray> rays;
+        CreateProbeRays(world, rays);
+        int num_rays = static_cast<int>(rays.size());
+
+        auto ray_buffer = m_device->CreateBuffer(num_rays * sizeof(ray), Calc::BufferType::kRead, rays.data());
+        auto hit_buffer = m_device->CreateBuffer(num_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+
+        static char const* const candidates[] = { "bvh", "fatbvh", "qbvh", "hlbvh", "grid" };
+
+        std::string best;
+        float best_time = std::numeric_limits<float>::max();
+
+        // Cache names of the candidates, they depend on the options
+        std::vector<std::string> built;
+
+        for (auto candidate : candidates)
+        {
+            SelectFlatIntersector(candidate, world);
+            built.push_back(m_intersector_string);
+
+            try
+            {
+                m_intersector->SetHitFilterData(m_filter_data);
+                m_intersector->SetTraversalStatsBuffer(m_stats_buffer);
+                m_intersector->SetHitHints(m_hint_buffer);
+                m_intersector->SetWorld(world);
+            }
+            catch (Exception&)
+            {
+                // Candidates not supporting the requested options are skipped
+                continue;
+            }
+
+            float time = TimeProbe(ray_buffer, num_rays, hit_buffer);
+
+            if (time < best_time)
+            {
+                best_time = time;
+                best = candidate;
+            }
+        }
+
+        m_device->DeleteBuffer(ray_buffer);
+        m_device->DeleteBuffer(hit_buffer);
+
+        ThrowIf(best.empty(), "No acceleration structure supports the world options");
+
+        // Structures of the losers are dropped, the winner keeps the world set above
+        SelectFlatIntersector(best, world);
+
+        for (auto const& name : built)
+        {
+            if (name != m_intersector_string)
+            {
+                m_intersectors.erase(name);
+            }
+        }
+
+        m_auto_type = best;
+        return true;
+    }
+
+    void CalcIntersectionDevice::TuneLocalSize(World const& world)
+    {
+        TraceScope trace("TuneLocalSize", "device");
+
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        // Tuned sizes are shared by the devices of the same model
+        static std::mutex cache_mutex;
+        static std::map<std::string, std::size_t> cache;
+
+        std::string key = std::string(spec.name) + "/" + m_intersector_string;
+
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            auto iter = cache.find(key);
+
+            if (iter != cache.end())
+            {
+                m_intersector->SetLocalSize(iter->second);
+                return;
+            }
+        }
+
+        std::vector<ray> rays;
+        CreateProbeRays(world, rays);
+
+        if (rays.empty())
+        {
+            return;
+        }
+
+        int num_rays = static_cast<int>(rays.size());
+        auto ray_buffer = m_device->CreateBuffer(num_rays * sizeof(ray), Calc::BufferType::kRead, rays.data());
+        auto hit_buffer = m_device->CreateBuffer(num_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+
+        // Powers of two of whole hardware threads up to the device limit
+        std::size_t min_size = spec.simd_width > kMinTunedLocalSize ? spec.simd_width : kMinTunedLocalSize;
+        std::size_t max_size = spec.max_local_size > 0 && spec.max_local_size < kMaxTunedLocalSize ? spec.max_local_size : kMaxTunedLocalSize;
+
+        std::size_t best = m_intersector->GetLocalSize();
+        float best_time = TimeProbe(ray_buffer, num_rays, hit_buffer);
+
+        for (std::size_t size = min_size; size <= max_size; size *= 2)
+        {
+            if (size == best)
+            {
+                continue;
+            }
+
+            try
+            {
+                m_intersector->SetLocalSize(size);
+            }
+            catch (Exception&)
+            {
+                // Programs exceeding the device resources at this size are skipped
+                continue;
+            }
+
+            float time = TimeProbe(ray_buffer, num_rays, hit_buffer);
+
+            if (time < best_time)
+            {
+                best_time = time;
+                best = size;
+            }
+        }
+
+        m_device->DeleteBuffer(ray_buffer);
+        m_device->DeleteBuffer(hit_buffer);
+
+        m_intersector->SetLocalSize(best);
+
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        cache[key] = best;
+    }
+
+    bool CalcIntersectionDevice::SelectWorldIntersector(World const& world)
     {
-        // Initialize event pool
-        for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
+        auto device = m_device.get();
+        bool prebuilt = false;
+
+        auto optacctype = world.options_.GetOption(Options::kAccType);
+        // Paged geometry flattens instances itself
+        bool usepaged = optacctype && optacctype->AsString() == "paged";
+        // Groups can't be flattened, curves and procedurals are only intersected by 2 level BVH
+        bool const usegroups = world.HasGroups();
+        bool const usecurves = world.HasCurves() || world.HasProcedurals();
+        bool const use2level = NeedsTwoLevel(world);
+
+        ThrowIf(usegroups && usepaged, "Groups are only supported by 2 level BVH");
+        ThrowIf(usecurves && usepaged, "Curves, spheres, disks and custom primitives are only supported by 2 level BVH");
+
+        if (usepaged)
+        {
+            SelectIntersector("paged", [device]() -> Intersector* { return new IntersectorPaged(device); });
+        }
+        else if (use2level)
+        {
+            SelectIntersector("bvh2l", [device]() -> Intersector* { return new IntersectorTwoLevel(device); });
+        }
+        else
+        {
+            std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+            if (acctype == "auto")
+            {
+                prebuilt = SelectAutoIntersector(world);
+            }
+            else
+            {
+                SelectFlatIntersector(acctype, world);
+            }
+        }
+
+        return prebuilt;
+    }
+
+    void CalcIntersectionDevice::SetDeviceOptions(World const& world)
+    {
+        auto poolsize = world.options_.GetOption(Options::kAccBufferPoolSize);
+        m_buffer_pool.SetBudget(poolsize ?
+            static_cast<std::size_t>(std::max(poolsize->AsFloat(), 0.f) * 1024.f * 1024.f) :
+            CalcBufferPool::kDefaultBudget);
+
+        auto chunksize = world.options_.GetOption(Options::kAccHostChunkSize);
+        int host_chunk_size = chunksize ? std::max(static_cast<int>(chunksize->AsFloat()), 1) : kDefaultHostChunkSize;
+        // Chunks of bit-packed occlusion results start at word boundaries
+        host_chunk_size = (host_chunk_size + 31) / 32 * 32;
+
+        if (host_chunk_size != m_host_chunk_size)
+        {
+            ReleaseHostChunks();
+            m_host_chunk_size = host_chunk_size;
+        }
+    }
+
+    int CalcIntersectionDevice::GetHostQueryThreshold(World const& world)
+    {
+        auto threshold = world.options_.GetOption(Options::kAccHostQueryThreshold);
+        if (!threshold || threshold->AsFloat() < 1.f)
+        {
+            return 0;
+        }
+
+        // The host traversal writes full hits and int occlusion results only and has no device side hooks
+        auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+        auto rayformat = world.options_.GetOption(Options::kAccRayFormat);
+        auto occlusionformat = world.options_.GetOption(Options::kAccOcclusionFormat);
+        auto callback = world.options_.GetOption(Options::kAccHitCallback);
+        auto filter = world.options_.GetOption(Options::kAccHitFilter);
+
+        bool const supported = (!hitformat || hitformat->AsString() == "full") &&
+            (!rayformat || rayformat->AsString() == "full") &&
+            (!occlusionformat || occlusionformat->AsString() == "int") &&
+            !IsOptionEnabled(world, Options::kAccTraversalStats) &&
+            (!callback || callback->AsString().empty()) &&
+            (!filter || filter->AsString().empty()) &&
+            !world.HasGroups() && !world.HasCurves() && !world.HasProcedurals() &&
+            std::none_of(world.shapes_.cbegin(), world.shapes_.cend(), [](Shape const* shape)
+            {
+                return static_cast<ShapeImpl const*>(shape)->HasMotion();
+            });
+
+        return supported ? static_cast<int>(threshold->AsFloat()) : 0;
+    }
+
+    World const& CalcIntersectionDevice::ApplyMemoryBudget(World const& world, World& adjusted)
+    {
+        m_budget_steps = 0;
+
+        auto optbudget = world.options_.GetOption(Options::kAccMemoryBudget);
+
+        if (!optbudget || optbudget->AsFloat() <= 0.f)
+        {
+            return world;
+        }
+
+        std::size_t const budget = static_cast<std::size_t>(static_cast<double>(optbudget->AsFloat()) * 1024.0 * 1024.0);
+        bool const opencl = m_device->GetPlatform() == Calc::Platform::kOpenCL;
+        std::string const acctype = GetStructureType(world);
+
+        World const* current = &world;
+        std::size_t estimate = EstimateStructureBytes(acctype, world, opencl);
+
+        for (auto const& step : kBudgetSteps)
+        {
+            if (estimate <= budget)
+            {
+                break;
+            }
+
+            if (!IsBudgetStepApplicable(step, acctype, *current, opencl))
+            {
+                continue;
+            }
+
+            if (current == &world)
+            {
+                adjusted = world;
+                current = &adjusted;
+            }
+
+            adjusted.options_.SetValue(Options::GetOptionName(step.option), step.value);
+            estimate = EstimateStructureBytes(acctype, adjusted, opencl);
+            ++m_budget_steps;
+        }
+
+        if (estimate > budget)
+        {
+            std::ostringstream message;
+            message << "Acceleration structure needs an estimated " << (estimate >> 20) << " MB of device memory, "
+                "which exceeds acc.memory_budget of " << (budget >> 20) << " MB";
+            Throw(message.str());
+        }
+
+        return *current;
+    }
+
+    void CalcIntersectionDevice::ReleaseCachedIntersectors() const
+    {
+        for (auto iter = m_intersectors.begin(); iter != m_intersectors.end();)
+        {
+            if (iter->second.get() == m_intersector)
+            {
+                ++iter;
+            }
+            else
+            {
+                iter = m_intersectors.erase(iter);
+            }
+        }
+    }
+
+    void CalcIntersectionDevice::Preprocess(World const& input)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        TraceScope trace("Preprocess", "device");
+
+        World adjusted;
+        World const& world = ApplyMemoryBudget(input, adjusted);
+
+        // Intersector creation time is mostly kernel compilation
+        auto start = std::chrono::high_resolution_clock::now();
+        // Auto tuning leaves the winning intersector with the world already set
+        bool prebuilt = SelectWorldIntersector(world);
+        m_compile_time += std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        SetDeviceOptions(world);
+
+        // Structures of other acc.type values would take memory outside of the budget
+        if (world.options_.GetOption(Options::kAccMemoryBudget))
+        {
+            ReleaseCachedIntersectors();
+        }
+
+        try
+        {
+            // Let intersector to do its preprocessing job
+            if (!prebuilt)
+            {
+                m_intersector->SetHitFilterData(m_filter_data);
+                m_intersector->SetTraversalStatsBuffer(m_stats_buffer);
+                m_intersector->SetHitHints(m_hint_buffer);
+                m_intersector->SetWorld(world);
+            }
+        }
+        catch (Exception& e)
+        {
+            std::cout << e.what();
+            throw;
+        }
+
+        auto opttune = world.options_.GetOption(Options::kAccTuneLocalSize);
+
+        if (opttune && opttune->AsFloat() > 0.f && m_intersector->SupportsLocalSize())
+        {
+            TuneLocalSize(world);
+        }
+
+        // The host copy follows the incremental changes of the world
+        int const host_threshold = GetHostQueryThreshold(world);
+        if (host_threshold > 0)
+        {
+            if (!m_host_device)
+            {
+                m_host_device.reset(new CpuIntersectionDevice());
+            }
+
+            try
+            {
+                m_host_device->Preprocess(world);
+            }
+            catch (Exception&)
+            {
+                // Trees the host traversal can't handle leave every query to the device
+                m_host_device.reset();
+            }
+        }
+        else
+        {
+            m_host_device.reset();
+        }
+
+        m_host_threshold = m_host_device ? host_threshold : 0;
+
+        m_stats = m_intersector->GetStatistics();
+        m_stats.compile_time = m_compile_time;
+        m_stats.budget_steps = m_budget_steps;
+        m_compile_time = 0.f;
+    }
+
+    void CalcIntersectionDevice::PreprocessConcurrent(World const& world)
+    {
+        auto optacctype = world.options_.GetOption(Options::kAccType);
+        auto opttune = world.options_.GetOption(Options::kAccTuneLocalSize);
+        auto optbudget = world.options_.GetOption(Options::kAccMemoryBudget);
+
+        // Auto selection and local size tuning trace probe rays with the current intersector,
+        // Vulkan devices are not safe to use from several threads. A structure built aside
+        // of the current one would take twice the memory budget
+        if ((optacctype && optacctype->AsString() == "auto") || (opttune && opttune->AsFloat() > 0.f) ||
+            (optbudget && optbudget->AsFloat() > 0.f) || m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            Preprocess(world);
+            return;
+        }
+
+        TraceScope trace("PreprocessConcurrent", "device");
+
+        std::string name;
+        std::function<Intersector*()> create;
+        std::future<Intersector*> pending;
+        Calc::Buffer const* filter_data = nullptr;
+        Calc::Buffer* stats_buffer = nullptr;
+        Calc::Buffer const* hint_buffer = nullptr;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            m_staging = true;
+
+            try
+            {
+                SelectWorldIntersector(world);
+            }
+            catch (...)
+            {
+                m_staging = false;
+                throw;
+            }
+
+            m_staging = false;
+            name = m_staged_string;
+            create = std::move(m_staged_create);
+
+            if (m_pending.valid() && m_pending_string == name)
+            {
+                pending = std::move(m_pending);
+            }
+
+            SetDeviceOptions(world);
+            filter_data = m_filter_data;
+            stats_buffer = m_stats_buffer;
+            hint_buffer = m_hint_buffer;
+        }
+
+        // The new version is built by a fresh intersector without holding the lock, so queries
+        // keep using the current one meanwhile. It can't continue from the state of the current one.
+        auto start = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<Intersector> intersector(pending.valid() ? pending.get() : create());
+        float const compile_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        intersector->SetHitFilterData(filter_data);
+        intersector->SetTraversalStatsBuffer(stats_buffer);
+        intersector->SetHitHints(hint_buffer);
+        intersector->SetScratchBuffers(m_scratch);
+        intersector->SetWorld(world);
+        m_device->Finish(0);
+
+        // Small queries keep tracing the current host copy meanwhile, the new one is built aside too
+        int host_threshold = GetHostQueryThreshold(world);
+        std::unique_ptr<CpuIntersectionDevice> host_device;
+        if (host_threshold > 0)
+        {
+            try
+            {
+                host_device.reset(new CpuIntersectionDevice());
+                host_device->Preprocess(world);
+            }
+            catch (Exception&)
+            {
+                host_device.reset();
+                host_threshold = 0;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_host_device = std::move(host_device);
+        m_host_threshold = host_threshold;
+
+        // Queries submitted before the swap may still read buffers of the replaced intersector
+        for (int i = 0; i < m_num_queues; ++i)
+        {
+            m_device->Finish(i);
+        }
+
+        auto& cached = m_intersectors[name];
+        cached = std::move(intersector);
+        m_intersector = cached.get();
+        m_intersector_string = name;
+
+        m_stats = m_intersector->GetStatistics();
+        m_stats.compile_time = m_compile_time + compile_time;
+        m_compile_time = 0.f;
+    }
+
+    void CalcIntersectionDevice::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        stats = m_stats;
+    }
+
+    void CalcIntersectionDevice::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Intersectors kept for acc.type switches hold their structures too
+        for (auto const& iter : m_intersectors)
+        {
+            iter.second->GetMemoryUsage(usage);
+        }
+
+        if (m_ray_compactor)
+        {
+            m_ray_compactor->GetMemoryUsage(usage);
+        }
+
+        if (m_hit_grouper)
+        {
+            m_hit_grouper->GetMemoryUsage(usage);
+        }
+
+        if (m_ray_generator)
+        {
+            m_ray_generator->GetMemoryUsage(usage);
+        }
+
+        usage.pool_bytes += m_buffer_pool.GetCachedBytes();
+        usage.scratch_bytes += m_scratch->GetAllocatedBytes();
+        usage.event_pool_bytes += m_event_pool.GetAllocatedBytes() + m_caller_event_pool.GetAllocatedBytes();
+
+        for (auto const& chunk : m_host_chunks)
+        {
+            AddBufferBytes(usage.host_chunks_bytes, chunk.pinned_rays);
+            AddBufferBytes(usage.host_chunks_bytes, chunk.pinned_hits);
+            AddBufferBytes(usage.scratch_bytes, chunk.rays);
+            AddBufferBytes(usage.scratch_bytes, chunk.hits);
+            AddBufferBytes(usage.scratch_bytes, chunk.num_rays);
+        }
+    }
+
+    int CalcIntersectionDevice::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        return m_intersector ? m_intersector->GetTimings(timings, maxtimings) : 0;
+    }
+
+    int CalcIntersectionDevice::GetQueueCount() const
+    {
+        return m_num_queues;
+    }
+
+    Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        // Ray and hit buffers recreated every frame get the memory of the deleted ones
+        Calc::Buffer* calc_buffer = nullptr;
+
+        if (initdata)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            calc_buffer = m_buffer_pool.Acquire(size, Calc::BufferType::kWrite, initdata);
+        }
+        else
+        {
+            calc_buffer = m_buffer_pool.Acquire(size, Calc::BufferType::kWrite);
+        }
+
+        auto pool = &m_buffer_pool;
+        return new CalcBufferHolder(calc_buffer, [pool](Calc::Buffer* buffer) { pool->Release(buffer); });
+    }
+
+    Buffer* CalcIntersectionDevice::CreateMappedBuffer(size_t size, void* initdata, void** data) const
+    {
+        // Vulkan maps through a proxy copy, so the mapping would not reach the kernels
+        ThrowIf(m_device->GetPlatform() != Calc::Platform::kOpenCL, "Persistently mapped buffers are supported on OpenCL devices only");
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Not pooled: the mapping lives with the allocation
+        auto flags = Calc::BufferType::kWrite | Calc::BufferType::kPersistent;
+        Calc::Buffer* calc_buffer = initdata ?
+            m_device->CreateBuffer(size, flags, initdata) :
+            m_device->CreateBuffer(size, flags);
+
+        void* mapped = nullptr;
+        m_device->MapBuffer(calc_buffer, 0, 0, size, Calc::MapType::kMapRead | Calc::MapType::kMapWrite, &mapped, nullptr);
+        m_device->Finish(0);
+
+        *data = mapped;
+
+        auto device = m_device.get();
+        auto mutex = &m_mutex;
+        return new CalcBufferHolder(calc_buffer, [device, mutex, mapped](Calc::Buffer* buffer)
+        {
+            std::lock_guard<std::mutex> lock(*mutex);
+            device->UnmapBuffer(buffer, 0, mapped, nullptr);
+            device->Finish(0);
+            device->DeleteBuffer(buffer);
+        });
+    }
+
+    Buffer* CalcIntersectionDevice::CreateHostPtrBuffer(size_t size, void* hostdata) const
+    {
+        // Discrete GPUs would read the memory over the bus in every kernel
+        if (!m_unified_memory)
+        {
+            return CreateBuffer(size, hostdata);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite | Calc::BufferType::kUseHostPtr, hostdata);
+        return new CalcBufferHolder(m_device.get(), calc_buffer);
+    }
+
+    Buffer* CalcIntersectionDevice::CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const
+    {
+        auto parent = static_cast<CalcBufferHolder*>(buffer)->GetData();
+        ThrowIf(offset + size > parent->GetSize(), "Sub-buffer exceeds the buffer");
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Kernels see the region as a buffer of its own, so queries need no offsets
+        auto calc_buffer = m_device->CreateSubBuffer(parent, offset, size);
+        return new CalcBufferHolder(m_device.get(), calc_buffer);
+    }
+
+    void CalcIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void CalcIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        // Calc event is released once the holder is reused, so no locking is needed
+        if (m_caller_event_pool.IsCallerOwned(event))
+        {
+            m_caller_event_pool.Release(static_cast<CalcEventHolder*>(event));
+        }
+        else
+        {
+            m_event_pool.Release(static_cast<CalcEventHolder*>(event));
+        }
+    }
+
+    Event* CalcIntersectionDevice::CreateReusableEvent() const
+    {
+        auto holder = m_caller_event_pool.Acquire();
+
+        {
+            // Release the Calc event of the previous owner
+            std::lock_guard<std::mutex> lock(m_mutex);
+            holder->m_event.reset();
+        }
+
+        holder->m_caller_owned = true;
+        return holder;
+    }
+
+    static Calc::MapType CalcMapType(MapType type)
+    {
+        switch (type)
+        {
+        case kMapRead:
+            return Calc::MapType::kMapRead;
+        case kMapWrite:
+            return Calc::MapType::kMapWrite;
+        default:
+            return Calc::MapType::kMapWrite;
+        }
+    }
+
+    void CalcIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        TraceScope trace("MapBuffer", "upload");
+
+        if (event)
+        {
+            Calc::Event* e = nullptr;
+            m_device->MapBuffer(calc_buffer->GetData(), queue, offset, size, CalcMapType(type), data, &e);
+
+            SetEvent(event, e);
+        }
+        else
+        {
+            m_device->MapBuffer(calc_buffer->GetData(), queue, offset, size, CalcMapType(type), data, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        TraceScope trace("UnmapBuffer", "upload");
+
+        if (event)
+        {
+            Calc::Event* e = nullptr;
+            m_device->UnmapBuffer(calc_buffer->GetData(), queue, ptr, &e);
+
+            SetEvent(event, e);
+        }
+        else
+        {
+            m_device->UnmapBuffer(calc_buffer->GetData(), queue, ptr, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto calc_src = static_cast<CalcBufferHolder const*>(src);
+        auto calc_dst = static_cast<CalcBufferHolder*>(dst);
+        TraceScope trace("CopyBuffer", "upload");
+
+        Calc::Event* e = nullptr;
+        m_device->CopyBuffer(calc_src->GetData(), calc_dst->GetData(), queue, srcoffset, dstoffset, size, &e);
+
+        if (event)
+        {
+            SetEvent(event, e);
+        }
+        else
+        {
+            m_device->WaitForEvent(e);
+            m_device->DeleteEvent(e);
+        }
+    }
+
+
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
+        }
+        else
+        {
+            GetIntersector()->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
+        }
+        else
+        {
+            GetIntersector()->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryMixed(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
+        }
+        else
         {
-            m_event_pool.push(new CalcEventHolder());
+            GetIntersector()->QueryMixed(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
         }
     }
 
-    CalcIntersectionDevice::~CalcIntersectionDevice()
+    void CalcIntersectionDevice::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const
     {
-        while (!m_event_pool.empty())
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        ThrowIf(k <= 0, "Multi hit queries need at least one hit per ray");
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryMultiHit(queue, ray_buffer, numrays, k, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
+        }
+        else
         {
-            auto event = m_event_pool.front();
-            m_event_pool.pop();
-            delete event;
+            GetIntersector()->QueryMultiHit(queue, ray_buffer, numrays, k, hit_buffer, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::Preprocess(World const& world)
+    void CalcIntersectionDevice::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const
     {
-        bool use2level = false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto sphere_buffer = static_cast<CalcBufferHolder const*>(spheres)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
-        // First check if 2 level BVH has been forced
-        auto opt2level = world.options_.GetOption("bvh.force2level");
-        if (opt2level && opt2level->AsFloat() > 0.f)
+        if (event)
         {
-            use2level = true;
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryProximity(queue, sphere_buffer, numspheres, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
         }
         else
         {
-            auto opt_force_flat = world.options_.GetOption("bvh.forceflat");
-
-            if (opt_force_flat && opt_force_flat->AsFloat() > 0.f)
-            {
-                use2level = false;
-            }
-            else
-            {
-                // Otherwise check if there are instances in the world
-                for (auto iter = world.shapes_.cbegin(); iter != world.shapes_.cend(); ++iter)
-                {
-                    // Get implementation
-                    auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
-                    // Check if it is an instance and update flag
-                    use2level = use2level | shapeimpl->is_instance();
-                }
-            }
+            GetIntersector()->QueryProximity(queue, sphere_buffer, numspheres, hit_buffer, e, nullptr);
         }
+    }
 
-        if (use2level)
+    void CalcIntersectionDevice::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto point_buffer = static_cast<CalcBufferHolder const*>(points)->m_buffer.get();
+        auto visibility_buffer = static_cast<CalcBufferHolder*>(visibility)->m_buffer.get();
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
         {
-            if (m_intersector_string != "bvh2l")
-            {
-                m_intersector.reset(new IntersectorTwoLevel(m_device.get()));
-                m_intersector_string = "bvh2l";
-            }
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryAmbientOcclusion(queue, point_buffer, numpoints, numsamples, radius, seed, visibility_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
         }
         else
         {
-            {
-                auto optacctype = world.options_.GetOption("acc.type");
-                std::string acctype = optacctype ? optacctype->AsString() : "bvh";
-
-                if (acctype == "bvh")
-                {
-                    if (m_intersector_string != "bvh")
-                    {
-                        m_intersector.reset(new IntersectorSkipLinks(m_device.get()));
-                        m_intersector_string = "bvh";
-                    }
-                }
-                else if (acctype == "fatbvh")
-                {
-                    if (m_intersector_string != "fatbvh")
-                    {
-                        m_intersector.reset(new IntersectorShortStack(m_device.get()));
-                        m_intersector_string = "fatbvh";
-                    }
-                }
-                else if (acctype == "hlbvh")
-                {
-                    if (m_intersector_string != "hlbvh")
-                    {
-                        m_intersector.reset(new IntersectorHlbvh(m_device.get()));
-                        m_intersector_string = "hlbvh";
-                    }
-                }
-                /*else if (acctype == "hashbvh")
-                {
-                    if (m_intersector_string != "hashbvh")
-                    {
-                        m_intersector.reset(new IntersectorBitTrail(m_device.get()));
-                        m_intersector_string = "hashbvh";
-                    }
-                }*/
-            }
+            GetIntersector()->QueryAmbientOcclusion(queue, point_buffer, numpoints, numsamples, radius, seed, visibility_buffer, e, nullptr);
         }
+    }
 
-        try
+    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
         {
-            // Let intersector to do its preprocessing job
-            m_intersector->SetWorld(world);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
         }
-        catch (Exception& e)
+        else
         {
-            std::cout << e.what();
-            throw;
+            GetIntersector()->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
         }
     }
 
-    Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
     {
-        // If initdata is passed in use different Calc call with init data
-        if (initdata)
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Extract Calc buffers from their holders
+        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
+        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+
+        if (event)
         {
-            auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite, initdata);
-            return new CalcBufferHolder(m_device.get(), calc_buffer);
+            // event pointer has been provided, so construct holder and return event to the user
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+
+            SetEvent(event, calc_event);
         }
         else
         {
-            auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
-            return new CalcBufferHolder(m_device.get(), calc_buffer);
+            GetIntersector()->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
         }
+
     }
 
-    void CalcIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    void CalcIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const
     {
-        delete buffer;
+        QueryHost(kQueryIntersection, rays, numrays, hits, queue);
     }
 
-    void CalcIntersectionDevice::DeleteEvent(Event* const event) const
+    void CalcIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const
     {
-        ReleaseEventHolder(static_cast<CalcEventHolder*>(event));
+        QueryHost(kQueryOcclusion, rays, numrays, hits, queue);
     }
 
-    static Calc::MapType CalcMapType(MapType type)
+    void CalcIntersectionDevice::QueryHost(QueryType type, void const* rays, int numrays, void* hits, int queue) const
     {
-        switch (type)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        TraceScope trace(type == kQueryOcclusion ? "QueryOcclusionHost" : "QueryIntersectionHost", "query");
+
+        if (numrays <= 0)
+            return;
+
+        // Tiny batches take less time on the host copy than a launch and its transfers,
+        // unless they carry traversal flags the host copy doesn't honor
+        auto const has_flags = [rays, numrays]()
         {
-        case kMapRead:
-            return Calc::MapType::kMapRead;
-        case kMapWrite:
-            return Calc::MapType::kMapWrite;
-        default:
-            return Calc::MapType::kMapWrite;
+            ray const* r = static_cast<ray const*>(rays);
+            return std::any_of(r, r + numrays, [](ray const& x) { return x.GetFlags() != 0; });
+        };
+
+        if (numrays <= m_host_threshold && !has_flags())
+        {
+            if (type == kQueryOcclusion)
+                m_host_device->QueryOcclusion(static_cast<ray const*>(rays), numrays, static_cast<int*>(hits), 0);
+            else
+                m_host_device->QueryIntersection(static_cast<ray const*>(rays), numrays, static_cast<Intersection*>(hits), 0);
+            return;
+        }
+
+        // Chunks are contiguous ranges of rays and hits, planes would be cut apart
+        ThrowIf(GetIntersector()->HasPlanarLayout(), "Host memory queries don't support soa ray and hit formats");
+
+        std::size_t const ray_stride = GetIntersector()->GetRayStride();
+        std::size_t const hit_stride = type == kQueryOcclusion ? sizeof(int) : GetIntersector()->GetHitStride();
+        ReserveHostChunks(ray_stride, hit_stride);
+
+        // Bytes of results of count rays, bit-packed occlusion results take a word per 32 rays
+        auto hit_bytes = [&](std::size_t count)
+        {
+            return type == kQueryOcclusion ? GetIntersector()->GetOcclusionResultSize(count) : count * hit_stride;
+        };
+
+        // Transfers go to a neighbour queue, so they overlap with traversal
+        std::uint32_t const trace_queue = queue;
+        std::uint32_t const copy_queue = m_num_queues > 1 ? (queue + 1) % m_num_queues : queue;
+
+        int const chunk_size = m_host_chunk_size;
+        int const num_chunks = (numrays + chunk_size - 1) / chunk_size;
+
+        auto upload = [&](int k)
+        {
+            TraceScope trace("UploadChunk", "upload");
+            HostChunk& chunk = m_host_chunks[k % kNumHostChunks];
+            chunk.count = static_cast<std::uint32_t>(std::min(chunk_size, numrays - k * chunk_size));
+
+            std::size_t size = chunk.count * ray_stride;
+            std::memcpy(chunk.mapped_rays, static_cast<char const*>(rays) + k * chunk_size * ray_stride, size);
+            m_device->WriteBuffer(chunk.rays, copy_queue, 0, size, chunk.mapped_rays, &chunk.upload);
+            m_device->Flush(copy_queue);
+        };
+
+        auto collect = [&](int k)
+        {
+            TraceScope trace("CollectChunk", "upload");
+            HostChunk& chunk = m_host_chunks[k % kNumHostChunks];
+            m_device->WaitForEvent(chunk.download);
+            m_device->DeleteEvent(chunk.download);
+            chunk.download = nullptr;
+
+            std::memcpy(static_cast<char*>(hits) + hit_bytes(k * chunk_size), chunk.mapped_hits, hit_bytes(chunk.count));
+        };
+
+        upload(0);
+
+        for (int k = 0; k < num_chunks; ++k)
+        {
+            HostChunk& chunk = m_host_chunks[k % kNumHostChunks];
+
+            // Traversal starts once the rays have landed
+            m_device->EnqueueWaitForEvent(trace_queue, chunk.upload);
+            m_device->DeleteEvent(chunk.upload);
+            chunk.upload = nullptr;
+
+            m_device->WriteBuffer(chunk.num_rays, trace_queue, 0, sizeof(std::uint32_t), &chunk.count, nullptr);
+
+            Calc::Event* traced = nullptr;
+            if (type == kQueryOcclusion)
+                GetIntersector()->QueryOcclusion(trace_queue, chunk.rays, chunk.num_rays, chunk.count, chunk.hits, nullptr, &traced);
+            else
+                GetIntersector()->QueryIntersection(trace_queue, chunk.rays, chunk.num_rays, chunk.count, chunk.hits, nullptr, &traced);
+            m_device->Flush(trace_queue);
+
+            // The other chunk is free once its results are back
+            if (k + 1 < num_chunks)
+            {
+                if (k > 0)
+                    collect(k - 1);
+
+                upload(k + 1);
+            }
+
+            m_device->EnqueueWaitForEvent(copy_queue, traced);
+            m_device->DeleteEvent(traced);
+            m_device->ReadBuffer(chunk.hits, copy_queue, 0, hit_bytes(chunk.count), chunk.mapped_hits, &chunk.download);
+            m_device->Flush(copy_queue);
         }
+
+        if (num_chunks > 1)
+            collect(num_chunks - 2);
+
+        collect(num_chunks - 1);
     }
 
-    void CalcIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    void CalcIntersectionDevice::ReserveHostChunks(std::size_t ray_stride, std::size_t hit_stride) const
     {
-        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        std::size_t ray_size = m_host_chunk_size * ray_stride;
+        std::size_t hit_size = m_host_chunk_size * hit_stride;
 
-        if (event)
+        if (ray_size <= m_host_ray_capacity && hit_size <= m_host_hit_capacity)
+            return;
+
+        ray_size = std::max(ray_size, m_host_ray_capacity);
+        hit_size = std::max(hit_size, m_host_hit_capacity);
+        ReleaseHostChunks();
+
+        for (auto& chunk : m_host_chunks)
         {
+            chunk.pinned_rays = m_device->CreateBuffer(ray_size, Calc::BufferType::kWrite | Calc::BufferType::kPinned);
+            chunk.pinned_hits = m_device->CreateBuffer(hit_size, Calc::BufferType::kRead | Calc::BufferType::kPinned);
+            chunk.rays = m_device->CreateBuffer(ray_size, Calc::BufferType::kRead);
+            chunk.hits = m_device->CreateBuffer(hit_size, Calc::BufferType::kWrite);
+            chunk.num_rays = m_device->CreateBuffer(sizeof(std::uint32_t), Calc::BufferType::kRead);
+
+            // Mappings are kept until the buffers are released
             Calc::Event* e = nullptr;
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, &e);
+            m_device->MapBuffer(chunk.pinned_rays, 0, 0, ray_size, Calc::MapType::kMapWrite, &chunk.mapped_rays, &e);
+            m_device->WaitForEvent(e);
+            m_device->DeleteEvent(e);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), e);
-            *event = holder;
+            m_device->MapBuffer(chunk.pinned_hits, 0, 0, hit_size, Calc::MapType::kMapRead, &chunk.mapped_hits, &e);
+            m_device->WaitForEvent(e);
+            m_device->DeleteEvent(e);
         }
-        else
+
+        m_host_ray_capacity = ray_size;
+        m_host_hit_capacity = hit_size;
+    }
+
+    void CalcIntersectionDevice::ReleaseHostChunks() const
+    {
+        if (m_host_ray_capacity == 0)
+            return;
+
+        for (auto& chunk : m_host_chunks)
         {
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, nullptr);
+            m_device->UnmapBuffer(chunk.pinned_rays, 0, chunk.mapped_rays, nullptr);
+            m_device->UnmapBuffer(chunk.pinned_hits, 0, chunk.mapped_hits, nullptr);
+            m_device->Finish(0);
+
+            m_device->DeleteBuffer(chunk.pinned_rays);
+            m_device->DeleteBuffer(chunk.pinned_hits);
+            m_device->DeleteBuffer(chunk.rays);
+            m_device->DeleteBuffer(chunk.hits);
+            m_device->DeleteBuffer(chunk.num_rays);
+
+            chunk = HostChunk();
         }
+
+        m_host_ray_capacity = 0;
+        m_host_hit_capacity = 0;
     }
 
-    void CalcIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    void CalcIntersectionDevice::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
     {
-        auto calc_buffer = static_cast<CalcBufferHolder*>(buffer);
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        ThrowIf(numqueries <= 0, "Query batch is empty");
+
+        // Extract Calc buffers from their holders
+        std::vector<Intersector::Query> batch(numqueries);
+        for (int i = 0; i < numqueries; ++i)
+        {
+            batch[i].type = queries[i].type;
+            batch[i].rays = static_cast<CalcBufferHolder const*>(queries[i].rays)->m_buffer.get();
+            batch[i].num_rays = queries[i].numrays;
+            batch[i].hits = static_cast<CalcBufferHolder const*>(queries[i].hits)->m_buffer.get();
+        }
+
+        // If waitevent is passed in we have to extract it as well
+        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
         if (event)
         {
-            Calc::Event* e = nullptr;
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, &e);
+            // A single event covers the whole batch
+            Calc::Event* calc_event = nullptr;
+            GetIntersector()->QueryBatch(queue, &batch[0], numqueries, e, &calc_event);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), e);
-            *event = holder;
+            SetEvent(event, calc_event);
         }
         else
         {
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, nullptr);
+            GetIntersector()->QueryBatch(queue, &batch[0], numqueries, e, nullptr);
         }
     }
 
+    // Query graph holding the Calc buffers of its queries and their ray counts in device memory
+    class CalcQueryGraph : public QueryGraph
+    {
+    public:
+        std::vector<Intersector::Query> m_queries;
+        std::vector<std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>>> m_counters;
+        std::vector<Calc::Buffer const*> m_num_rays;
+    };
 
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    QueryGraph* CalcIntersectionDevice::CreateQueryGraph(QueryDesc const* queries, int numqueries) const
     {
-        // Extract Calc buffers from their holders
-        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
-        // If waitevent is passed in we have to extract it as well
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        ThrowIf(numqueries <= 0, "Query graph is empty");
+
+        std::unique_ptr<CalcQueryGraph> graph(new CalcQueryGraph());
+        graph->m_queries.resize(numqueries);
+
+        auto device = m_device.get();
+        for (int i = 0; i < numqueries; ++i)
+        {
+            auto& query = graph->m_queries[i];
+            query.type = queries[i].type;
+            query.rays = static_cast<CalcBufferHolder const*>(queries[i].rays)->m_buffer.get();
+            query.num_rays = queries[i].numrays;
+            query.hits = static_cast<CalcBufferHolder const*>(queries[i].hits)->m_buffer.get();
+
+            // Ray counts never change, so they are uploaded once instead of on every replay
+            graph->m_counters.emplace_back(device->CreateBuffer(sizeof(std::uint32_t), Calc::BufferType::kRead, &query.num_rays),
+                [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); });
+            graph->m_num_rays.push_back(graph->m_counters.back().get());
+        }
+
+        return graph.release();
+    }
+
+    void CalcIntersectionDevice::DeleteQueryGraph(QueryGraph* graph) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        delete graph;
+    }
+
+    void CalcIntersectionDevice::ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto calc_graph = static_cast<CalcQueryGraph const*>(graph);
+        auto num_queries = static_cast<std::uint32_t>(calc_graph->m_queries.size());
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
 
         if (event)
         {
-            // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            GetIntersector()->ReplayBatch(queue, &calc_graph->m_queries[0], &calc_graph->m_num_rays[0], num_queries, e, &calc_event);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
-            *event = holder;
+            SetEvent(event, calc_event);
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            GetIntersector()->ReplayBatch(queue, &calc_graph->m_queries[0], &calc_graph->m_num_rays[0], num_queries, e, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        GetIntersector()->Prepare(queue, static_cast<std::uint32_t>(maxrays), types, static_cast<std::uint32_t>(numtypes));
+    }
+
+    void CalcIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_ray_compactor)
+        {
+            m_ray_compactor.reset(new RayCompactor(m_device.get()));
+        }
+
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
-        // If waitevent is passed in we have to extract it as well
-        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
+        auto predicate_buffer = predicate ? static_cast<CalcBufferHolder const*>(predicate)->m_buffer.get() : nullptr;
+        auto outray_buffer = static_cast<CalcBufferHolder*>(outrays)->m_buffer.get();
+        auto outcount_buffer = static_cast<CalcBufferHolder*>(outcount)->m_buffer.get();
+
+        if (waitevent)
+        {
+            m_device->EnqueueWaitForEvent(queue, static_cast<CalcEventHolder const*>(waitevent)->m_event.get());
+        }
 
         if (event)
         {
-            // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            m_ray_compactor->CompactRays(queue, ray_buffer, numrays_buffer, maxrays, predicate_buffer, outray_buffer, outcount_buffer, &calc_event);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
-            *event = holder;
+            SetEvent(event, calc_event);
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            m_ray_compactor->CompactRays(queue, ray_buffer, numrays_buffer, maxrays, predicate_buffer, outray_buffer, outcount_buffer, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
     {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_hit_grouper)
+        {
+            m_hit_grouper.reset(new HitGrouper(m_device.get()));
+        }
+
         // Extract Calc buffers from their holders
-        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
-        // If waitevent is passed in we have to extract it as well
-        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto shapekeys_buffer = shapekeys ? static_cast<CalcBufferHolder const*>(shapekeys)->m_buffer.get() : nullptr;
+        auto outindices_buffer = static_cast<CalcBufferHolder*>(outindices)->m_buffer.get();
+        auto outkeys_buffer = outkeys ? static_cast<CalcBufferHolder*>(outkeys)->m_buffer.get() : nullptr;
+
+        if (waitevent)
+        {
+            m_device->EnqueueWaitForEvent(queue, static_cast<CalcEventHolder const*>(waitevent)->m_event.get());
+        }
 
         if (event)
         {
-            // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_hit_grouper->GroupHits(queue, hit_buffer, numrays_buffer, maxrays, shapekeys_buffer, numkeys, outindices_buffer, outkeys_buffer, &calc_event);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
-            *event = holder;
+            SetEvent(event, calc_event);
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_hit_grouper->GroupHits(queue, hit_buffer, numrays_buffer, maxrays, shapekeys_buffer, numkeys, outindices_buffer, outkeys_buffer, nullptr);
         }
     }
 
-    void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void CalcIntersectionDevice::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
     {
-        // Extract Calc buffers from their holders
-        auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
-        auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
-        auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
-        // If waitevent is passed in we have to extract it as well
-        auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_ray_generator)
+        {
+            m_ray_generator.reset(new RayGenerator(m_device.get()));
+        }
+
+        auto ray_buffer = static_cast<CalcBufferHolder*>(rays)->m_buffer.get();
+
+        if (waitevent)
+        {
+            m_device->EnqueueWaitForEvent(queue, static_cast<CalcEventHolder const*>(waitevent)->m_event.get());
+        }
 
         if (event)
         {
-            // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_ray_generator->GenerateCameraRays(queue, camera, width, height, seed, ray_buffer, &calc_event);
 
-            auto holder = CreateEventHolder();
-            holder->Set(m_device.get(), calc_event);
-            *event = holder;
+            SetEvent(event, calc_event);
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_ray_generator->GenerateCameraRays(queue, camera, width, height, seed, ray_buffer, nullptr);
         }
+    }
+
+    void CalcIntersectionDevice::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_ray_generator)
+        {
+            m_ray_generator.reset(new RayGenerator(m_device.get()));
+        }
+
+        auto point_buffer = static_cast<CalcBufferHolder const*>(points)->m_buffer.get();
+        auto numpoints_buffer = numpoints ? static_cast<CalcBufferHolder const*>(numpoints)->m_buffer.get() : nullptr;
+        auto ray_buffer = static_cast<CalcBufferHolder*>(rays)->m_buffer.get();
+
+        if (waitevent)
+        {
+            m_device->EnqueueWaitForEvent(queue, static_cast<CalcEventHolder const*>(waitevent)->m_event.get());
+        }
+
+        if (event)
+        {
+            Calc::Event* calc_event = nullptr;
+            m_ray_generator->GenerateHemisphereRays(queue, point_buffer, numpoints_buffer, maxpoints, numsamples, maxt, seed, ray_buffer, &calc_event);
 
+            SetEvent(event, calc_event);
+        }
+        else
+        {
+            m_ray_generator->GenerateHemisphereRays(queue, point_buffer, numpoints_buffer, maxpoints, numsamples, maxt, seed, ray_buffer, nullptr);
+        }
     }
 
-    CalcEventHolder* CalcIntersectionDevice::CreateEventHolder() const
+    void CalcIntersectionDevice::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
     {
-        if (m_event_pool.empty())
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_ray_generator)
+        {
+            m_ray_generator.reset(new RayGenerator(m_device.get()));
+        }
+
+        auto point_buffer = static_cast<CalcBufferHolder const*>(points)->m_buffer.get();
+        auto numpoints_buffer = numpoints ? static_cast<CalcBufferHolder const*>(numpoints)->m_buffer.get() : nullptr;
+        auto ray_buffer = static_cast<CalcBufferHolder*>(rays)->m_buffer.get();
+
+        if (waitevent)
+        {
+            m_device->EnqueueWaitForEvent(queue, static_cast<CalcEventHolder const*>(waitevent)->m_event.get());
+        }
+
+        if (event)
         {
-            auto event = new CalcEventHolder();
-            return event;
+            Calc::Event* calc_event = nullptr;
+            m_ray_generator->GenerateShadowRays(queue, point_buffer, numpoints_buffer, maxpoints, light, seed, ray_buffer, &calc_event);
+
+            SetEvent(event, calc_event);
         }
         else
         {
-            auto event = m_event_pool.front();
-            m_event_pool.pop();
-            return event;
+            m_ray_generator->GenerateShadowRays(queue, point_buffer, numpoints_buffer, maxpoints, light, seed, ray_buffer, nullptr);
+        }
+    }
+
+    void CalcIntersectionDevice::SetHitFilterData(Buffer const* data)
+    {
+        m_filter_data = data ? static_cast<CalcBufferHolder const*>(data)->m_buffer.get() : nullptr;
+
+        // Intersectors selected later get the data at commit
+        if (m_intersector)
+        {
+            m_intersector->SetHitFilterData(m_filter_data);
+        }
+    }
+
+    void CalcIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        m_stats_buffer = stats ? static_cast<CalcBufferHolder*>(stats)->m_buffer.get() : nullptr;
+
+        // Intersectors selected later get the buffer at commit
+        if (m_intersector)
+        {
+            m_intersector->SetTraversalStatsBuffer(m_stats_buffer);
+        }
+    }
+
+    void CalcIntersectionDevice::SetHitHints(Buffer const* hits)
+    {
+        m_hint_buffer = hits ? static_cast<CalcBufferHolder const*>(hits)->m_buffer.get() : nullptr;
+
+        // Intersectors selected later get the buffer at commit
+        if (m_intersector)
+        {
+            m_intersector->SetHitHints(m_hint_buffer);
         }
     }
 
-    void    CalcIntersectionDevice::ReleaseEventHolder(CalcEventHolder* e) const
+    void CalcIntersectionDevice::SetEvent(Event** event, Calc::Event* calc_event) const
     {
-        m_event_pool.push(e);
+        // Caller owned events are signaled again, the rest get a holder from the pool
+        auto holder = m_caller_event_pool.IsCallerOwned(*event) ?
+            static_cast<CalcEventHolder*>(*event) : m_event_pool.Acquire();
+
+        holder->Set(m_device.get(), calc_event);
+        *event = holder;
     }
 }
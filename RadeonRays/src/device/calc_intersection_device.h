@@ -25,16 +25,27 @@ THE SOFTWARE.
 
 #include "calc.h"
 #include "device.h"
+#include "calc_event_pool.h"
+#include "calc_buffer_pool.h"
+#include "calc_scratch_buffers.h"
 
 #include <memory>
 #include <functional>
-#include <queue>
+#include <mutex>
+#include <future>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
 
 namespace RadeonRays
 {
     class Intersector;
-    struct CalcEventHolder;
+    class CpuIntersectionDevice;
+    class RayCompactor;
+    class HitGrouper;
+    class RayGenerator;
 
     ///< The class represents Calc based intersection device.
     ///< It uses Calc::Device abstraction to implement intersection algorithm.
@@ -48,37 +59,206 @@ namespace RadeonRays
 
         void Preprocess(World const& world) override;
 
+        void PreprocessConcurrent(World const& world) override;
+
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
+
+        int GetQueueCount() const override;
+
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
 
+        Buffer* CreateMappedBuffer(size_t size, void* initdata, void** data) const override;
+
+        Buffer* CreateHostPtrBuffer(size_t size, void* hostdata) const override;
+
+        Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const override;
+
         void DeleteBuffer(Buffer* const) const override;
 
         void DeleteEvent(Event* const) const override;
 
-        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+        Event* CreateReusableEvent() const override;
+
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const override;
+
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const override;
+
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
 
-        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
 
-        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
 
-        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
 
-        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const override;
 
-        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const override;
+
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const override;
+
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const override;
+
+        QueryGraph* CreateQueryGraph(QueryDesc const* queries, int numqueries) const override;
+        void DeleteQueryGraph(QueryGraph* graph) const override;
+        void ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue) const override;
+        void Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const override;
+
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+
+        void SetHitFilterData(Buffer const* data) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+        void SetHitHints(Buffer const* hits) override;
 
         Calc::Platform GetPlatform() const { return m_device->GetPlatform(); }
     protected:
-        CalcEventHolder* CreateEventHolder() const;
-        void      ReleaseEventHolder(CalcEventHolder* e) const;
+        // Store calc_event into *event reusing it if it is a caller owned event
+        void SetEvent(Event** event, Calc::Event* calc_event) const;
+        // Make the intersector with the given name current, taking it from the cache,
+        // from the background compilation or creating it when none of those has it
+        void SelectIntersector(std::string const& name, std::function<Intersector*()> const& create) const;
+        // Current intersector, queries preceding the first commit get the default one
+        Intersector* GetIntersector() const;
+        // Select the intersector the world needs with SelectIntersector,
+        // returns true if acc.type "auto" has left the winner with the world already set
+        bool SelectWorldIntersector(World const& world);
+        // Apply device wide options of the world
+        void SetDeviceOptions(World const& world);
+        // Return the world to build under "acc.memory_budget": world itself, or adjusted holding a copy
+        // of it with cheaper structure options. Throws if the cheapest structure is estimated not to fit
+        World const& ApplyMemoryBudget(World const& world, World& adjusted);
+        // Delete cached intersectors other than the current one
+        void ReleaseCachedIntersectors() const;
+        // Make the single level intersector of the given acc.type current
+        void SelectFlatIntersector(std::string const& acctype, World const& world) const;
+        // Pick the fastest single level intersector for acc.type "auto" by tracing a probe
+        // batch with each candidate, returns true if the winner has the world already set
+        bool SelectAutoIntersector(World const& world);
+        // Pick the fastest work group size of the current intersector for "acc.tune_local_size",
+        // results are cached per device model and intersector for the lifetime of the process
+        void TuneLocalSize(World const& world);
+        // Rays from random points of the world bounds towards random faces, empty if there are no meshes
+        void CreateProbeRays(World const& world, std::vector<ray>& rays) const;
+        // Best time in milliseconds of the current intersector tracing the probe batch
+        float TimeProbe(Calc::Buffer const* rays, int num_rays, Calc::Buffer* hits) const;
+
+        // Worlds with fewer faces skip the probe and get the default intersector
+        static std::size_t const kAutoMinFaces = 4096;
+        static int const kDefaultProbeRays = 16384;
+        // Timed probe runs, following a warm up run
+        static int const kProbeRuns = 3;
+        // Range of work group sizes tried by "acc.tune_local_size"
+        static std::size_t const kMinTunedLocalSize = 32;
+        static std::size_t const kMaxTunedLocalSize = 256;
+
+        // Number of host memory query chunks in flight
+        static int const kNumHostChunks = 2;
+
+        // Pinned staging and device memory of a host memory query chunk
+        struct HostChunk
+        {
+            // Page locked buffers persistently mapped for DMA transfers
+            Calc::Buffer* pinned_rays = nullptr;
+            Calc::Buffer* pinned_hits = nullptr;
+            void* mapped_rays = nullptr;
+            void* mapped_hits = nullptr;
+            // Device memory traced by the intersector
+            Calc::Buffer* rays = nullptr;
+            Calc::Buffer* hits = nullptr;
+            Calc::Buffer* num_rays = nullptr;
+            // Ray count, kept here since buffer writes are asynchronous
+            std::uint32_t count = 0;
+            // Transfers in flight
+            Calc::Event* upload = nullptr;
+            Calc::Event* download = nullptr;
+        };
+
+        // Trace rays in host memory in chunks, uploading a chunk and reading the results
+        // of the previous one back while the current one is traced
+        void QueryHost(QueryType type, void const* rays, int numrays, void* hits, int queue) const;
+        // Grow chunk buffers to hold rays and hits of the given sizes
+        void ReserveHostChunks(std::size_t ray_stride, std::size_t hit_stride) const;
+        // Unmap and delete chunk buffers
+        void ReleaseHostChunks() const;
+        // Rays up to which host memory queries of the world can be traced on the host copy of the scene,
+        // 0 if "acc.host_query_threshold" is not set or the world uses features the host copy lacks
+        static int GetHostQueryThreshold(World const& world);
 
         std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
-        std::unique_ptr<Intersector> m_intersector;
-        std::string m_intersector_string;
+        // Intersectors are created on the first use and kept for later acc.type switches,
+        // the current one is owned by the cache
+        mutable std::map<std::string, std::unique_ptr<Intersector>> m_intersectors;
+        mutable Intersector* m_intersector;
+        mutable std::string m_intersector_string;
+        // Default intersector compiled in the background since construction
+        mutable std::future<Intersector*> m_pending;
+        std::string m_pending_string;
+        // While set, SelectIntersector only records the name and the factory of the
+        // intersector into the staged fields, PreprocessConcurrent builds it aside
+        mutable bool m_staging;
+        mutable std::string m_staged_string;
+        mutable std::function<Intersector*()> m_staged_create;
+        // Intersector kernels compile time not yet reported by commit statistics
+        mutable float m_compile_time;
+        // Statistics of the latest Preprocess call
+        CommitStatistics m_stats;
+        // Budget steps applied by the latest ApplyMemoryBudget call
+        int m_budget_steps;
+        // Intersector chosen by acc.type "auto" and the shape and face counts it was tuned for
+        std::string m_auto_type;
+        std::pair<std::size_t, std::size_t> m_auto_key;
+
+        // Number of device queues
+        int m_num_queues;
+        // OpenCL device sharing memory with the host, API buffers may wrap host memory
+        bool m_unified_memory;
+        // Serializes submissions from different threads
+        mutable std::mutex m_mutex;
+
+        // Holders of the events returned by calls
+        mutable CalcEventPool m_event_pool;
+        // Holders of the events created by CreateReusableEvent, kept separate so stale
+        // pointers to released call events never alias a caller owned event
+        mutable CalcEventPool m_caller_event_pool;
+        // Memory of deleted API buffers reused by later CreateBuffer calls
+        mutable CalcBufferPool m_buffer_pool;
+        // Ray count and traversal stack buffers shared by all the intersectors
+        std::shared_ptr<CalcScratchBuffers> m_scratch;
+        // Ray compaction, created on the first CompactRays call
+        mutable std::unique_ptr<RayCompactor> m_ray_compactor;
+        // Hit grouping, created on the first GroupHits call
+        mutable std::unique_ptr<HitGrouper> m_hit_grouper;
+        // Ray generation, created on the first Generate*Rays call
+        mutable std::unique_ptr<RayGenerator> m_ray_generator;
+        // Data of "acc.hit_filter" functions, handed over to intersectors (nullptr if not set)
+        Calc::Buffer const* m_filter_data;
+        // Buffer receiving "acc.traversal_stats" counters, handed over to intersectors (nullptr if not set)
+        Calc::Buffer* m_stats_buffer;
+        // Hits tested first by "bvh.hit_hints" traversal, handed over to intersectors (nullptr if not set)
+        Calc::Buffer const* m_hint_buffer;
 
-        // Initial number of events in the pool
-        static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
-        // Event pool
-        mutable std::queue<CalcEventHolder*> m_event_pool;
+        // Rays per host memory query chunk set by "acc.host_chunk_size" option
+        int m_host_chunk_size;
+        // Chunk buffers of host memory queries and sizes they are allocated for
+        mutable HostChunk m_host_chunks[kNumHostChunks];
+        mutable std::size_t m_host_ray_capacity;
+        mutable std::size_t m_host_hit_capacity;
+        // Host copy of the scene tracing small host memory queries, null unless "acc.host_query_threshold" is used
+        std::unique_ptr<CpuIntersectionDevice> m_host_device;
+        // Rays up to which host memory queries go to m_host_device, 0 without it
+        int m_host_threshold;
     };
 }
 
@@ -39,6 +39,20 @@ namespace RadeonRays
     {
         return new CalcBufferHolder(m_device.get(), static_cast<Calc::DeviceCl*>(m_device.get())->CreateBuffer(mem));
     }
+
+    Event* CalcIntersectionDeviceCl::AdoptEvent(cl_event ev) const
+    {
+        // Released through DeleteEvent like the events returned by calls
+        Event* event = nullptr;
+        SetEvent(&event, static_cast<Calc::DeviceCl*>(m_device.get())->AdoptEvent(ev));
+        return event;
+    }
+
+    cl_event CalcIntersectionDeviceCl::GetEvent(Event const* ev) const
+    {
+        auto holder = static_cast<CalcEventHolder const*>(ev);
+        return static_cast<Calc::DeviceCl*>(m_device.get())->GetEvent(holder->m_event.get());
+    }
 }
 
 #endif // USE_OPENCL
\ No newline at end of file
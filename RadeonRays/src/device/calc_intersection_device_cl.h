@@ -43,6 +43,10 @@ namespace RadeonRays
         CalcIntersectionDeviceCl(Calc::Calc* calc, Calc::DeviceCl* device);
         
         virtual Buffer* CreateBuffer(cl_mem mem) const;
+        // Wrap application event into an API event
+        virtual Event* AdoptEvent(cl_event ev) const;
+        // OpenCL event of an API event
+        virtual cl_event GetEvent(Event const* ev) const;
     };
 }
 
@@ -37,8 +37,20 @@ namespace RadeonRays
 
     Buffer* CalcIntersectionDeviceVK::AdoptBuffer(Anvil::Buffer* buffer) const
     {
+        // Calc buffer releases its reference on deletion
+        buffer->retain();
         return new CalcBufferHolder(m_device.get(), new Calc::BufferVulkan(buffer, false));
     }
 
+    void CalcIntersectionDeviceVK::WaitSemaphore(Anvil::Semaphore* semaphore, std::uint32_t stage_mask)
+    {
+        static_cast<Calc::DeviceVulkan*>(m_device.get())->WaitSemaphore(semaphore, stage_mask);
+    }
+
+    void CalcIntersectionDeviceVK::SignalSemaphore(Anvil::Semaphore* semaphore)
+    {
+        static_cast<Calc::DeviceVulkan*>(m_device.get())->SignalSemaphore(semaphore);
+    }
+
 }
 #endif
@@ -24,7 +24,7 @@ THE SOFTWARE.
 #include "calc_intersection_device.h"
 
 namespace Calc { class DeviceVulkan; }
-namespace Anvil { class Buffer; }
+namespace Anvil { class Buffer; class Semaphore; }
 
 namespace RadeonRays
 {
@@ -36,6 +36,10 @@ namespace RadeonRays
         CalcIntersectionDeviceVK(Calc::Calc* calc, Calc::DeviceVulkan* device);
 
         Buffer* AdoptBuffer(Anvil::Buffer* buffer) const;
+
+        // Synchronization with application work
+        void WaitSemaphore(Anvil::Semaphore* semaphore, std::uint32_t stage_mask);
+        void SignalSemaphore(Anvil::Semaphore* semaphore);
     };
 }
 
@@ -0,0 +1,111 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "calc_scratch_buffers.h"
+#include "calc_buffer_pool.h"
+
+#include "../util/trace.h"
+
+namespace RadeonRays
+{
+    // Buffer type of each slot
+    static std::uint32_t const kSlotTypes[CalcScratchBuffers::kNumSlots] =
+    {
+        Calc::BufferType::kRead,
+        Calc::BufferType::kWrite
+    };
+
+    CalcScratchBuffers::CalcScratchBuffers(Calc::Device* device)
+        : m_device(device)
+        , m_queue(0)
+    {
+        for (auto& buffer : m_buffers)
+        {
+            buffer = nullptr;
+        }
+    }
+
+    CalcScratchBuffers::~CalcScratchBuffers()
+    {
+        Release();
+    }
+
+    Calc::Buffer* CalcScratchBuffers::Get(Slot slot, std::size_t size, std::uint32_t queue_idx)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (queue_idx != m_queue)
+        {
+            TraceScope trace("SwitchQueue", "query");
+            m_device->Finish(m_queue);
+            m_queue = queue_idx;
+        }
+
+        auto& buffer = m_buffers[slot];
+
+        if (!buffer || buffer->GetSize() < size)
+        {
+            if (buffer)
+            {
+                // Commands already submitted may still use the smaller buffer
+                m_device->Finish(queue_idx);
+                m_device->DeleteBuffer(buffer);
+                buffer = nullptr;
+            }
+
+            // Rounded up to a size class so slowly growing batches don't reallocate every query
+            buffer = m_device->CreateBuffer(CalcBufferPool::GetSizeClass(size), kSlotTypes[slot]);
+        }
+
+        return buffer;
+    }
+
+    void CalcScratchBuffers::Release()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        for (auto& buffer : m_buffers)
+        {
+            if (buffer)
+            {
+                m_device->DeleteBuffer(buffer);
+                buffer = nullptr;
+            }
+        }
+    }
+
+    std::size_t CalcScratchBuffers::GetAllocatedBytes() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        std::size_t bytes = 0;
+
+        for (auto buffer : m_buffers)
+        {
+            if (buffer)
+            {
+                bytes += buffer->GetSize();
+            }
+        }
+
+        return bytes;
+    }
+}
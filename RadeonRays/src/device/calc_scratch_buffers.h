@@ -0,0 +1,76 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "buffer.h"
+#include "device.h"
+
+#include <cstdint>
+#include <mutex>
+
+namespace RadeonRays
+{
+    ///< Query scratch buffers shared by all the intersectors of a device, so switching
+    ///< acc.type or keeping several intersectors cached holds a single copy of them.
+    ///< Buffers are created on the first request and grown to the largest size requested,
+    ///< they are never shrunk. Like the scratch buffers of an intersector they are shared
+    ///< by all the queues, commands of the previous queue finish before another queue gets them.
+    ///<
+    class CalcScratchBuffers
+    {
+    public:
+        enum Slot
+        {
+            // Ray count of queries with the count in host memory
+            kRayCount,
+            // Global memory part of traversal stacks
+            kTraversalStack,
+            kNumSlots
+        };
+
+        CalcScratchBuffers(Calc::Device* device);
+        ~CalcScratchBuffers();
+
+        // Get the buffer of a slot holding at least size bytes for commands of queue_idx,
+        // its contents are lost when it grows
+        Calc::Buffer* Get(Slot slot, std::size_t size, std::uint32_t queue_idx);
+        // Delete the buffers, the next Get creates them again
+        void Release();
+
+        // Memory held by the buffers
+        std::size_t GetAllocatedBytes() const;
+
+    private:
+        CalcScratchBuffers(CalcScratchBuffers const&);
+        CalcScratchBuffers& operator = (CalcScratchBuffers const&);
+
+        // Device to use
+        Calc::Device* m_device;
+        // Buffer of each slot (nullptr until requested)
+        Calc::Buffer* m_buffers[kNumSlots];
+        // Queue of the latest request
+        std::uint32_t m_queue;
+        // Buffers are shared by intersectors built and queried from different threads
+        mutable std::mutex m_mutex;
+    };
+}
@@ -0,0 +1,1212 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "cpu_intersection_device.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../accelerator/bvh.h"
+#include "../except/except.h"
+#include "../util/numa.h"
+#include "../async/future_callback.h"
+#include "host_hit_grouping.h"
+#include "buffer.h"
+#include "event.h"
+
+#include <xmmintrin.h>
+
+//count of rays traced by one scheduler task
+#define TASK_SIZE 256
+//traversal stack depth, deeper trees are rejected by Preprocess
+#define STACK_SIZE 64
+//occlusion result of a ray hitting anything
+#define HIT_MARKER 1
+//bytes of a buffer first touched by one scheduler task
+#define FIRST_TOUCH_SIZE size_t(1 << 20)
+
+namespace RadeonRays
+{
+    //host memory RadeonRays::Buffer implementation
+    class CpuBuffer : public Buffer
+    {
+    public:
+        // Large buffers on NUMA hosts are first touched by scheduler workers,
+        // so their pages are spread over the nodes tracing them
+        CpuBuffer(size_t size, void* init, task_scheduler& scheduler)
+            : m_data(nullptr)
+            , m_owner(true)
+        {
+            char* data = new char[size];
+            m_data = data;
+
+            if (scheduler.num_nodes() > 1 && size >= 2 * FIRST_TOUCH_SIZE)
+            {
+                int const numchunks = (int)((size + FIRST_TOUCH_SIZE - 1) / FIRST_TOUCH_SIZE);
+                parallel_for(scheduler, 0, numchunks, 1, [data, init, size](int chunk)
+                {
+                    size_t const offset = chunk * FIRST_TOUCH_SIZE;
+                    size_t const bytes = std::min(FIRST_TOUCH_SIZE, size - offset);
+                    if (init)
+                        memcpy(data + offset, static_cast<char const*>(init) + offset, bytes);
+                    else
+                        memset(data + offset, 0, bytes);
+                });
+            }
+            else if (init)
+            {
+                memcpy(m_data, init, size);
+            }
+        }
+        // View of memory owned by another buffer
+        explicit CpuBuffer(void* data)
+            : m_data(data)
+            , m_owner(false)
+        {
+        }
+        virtual ~CpuBuffer()
+        {
+            if (m_owner)
+                delete[] static_cast<char*>(m_data);
+            m_data = nullptr;
+        }
+
+        void* GetData()
+        {
+            return m_data;
+        }
+
+        const void* GetData() const
+        {
+            return m_data;
+        }
+
+    private:
+        void* m_data;
+        bool m_owner;
+    };
+
+    //RadeonRays::Event of a job running on its own thread
+    class CpuEvent : public Event
+    {
+    public:
+        CpuEvent(std::function<void()>&& f)
+            : m_ftr()
+        {
+            std::packaged_task<void()> task(std::move(f));
+            m_ftr = task.get_future().share();
+            std::thread(std::move(task)).detach();
+        }
+
+        virtual ~CpuEvent()
+        {
+            Wait();
+        }
+
+        virtual bool Complete() const
+        {
+            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        virtual void Wait()
+        {
+            m_ftr.wait();
+        }
+
+        virtual void SetCompletionCallback(CompletionCallback callback, void* data)
+        {
+            call_when_ready(m_ftr, this, callback, data);
+        }
+
+        std::shared_future<void> const& GetFuture() const
+        {
+            return m_ftr;
+        }
+    private:
+        std::shared_future<void> m_ftr;
+    };
+
+    //single ray prepared for slab tests
+    struct CpuRay
+    {
+        float3 o;
+        float3 d;
+        __m128 invdir;
+        __m128 oxinvdir;
+        int mask;
+    };
+
+    //4 rays in SOA layout, lanes without a ray have negative t_max
+    struct CpuRayPacket
+    {
+        __m128 ox, oy, oz;
+        __m128 dx, dy, dz;
+        __m128 ix, iy, iz;
+        __m128 oix, oiy, oiz;
+        __m128 tmax;
+        int mask[4];
+        // Lanes still traversed
+        int active;
+    };
+
+    //avoid division by zero producing NaNs in slab tests
+    static inline float SafeInverse(float x)
+    {
+        float const ooeps = 8.271806e-25f; // 2^-80
+        return 1.f / (std::fabs(x) > ooeps ? x : std::copysign(ooeps, x));
+    }
+
+    static inline void PrepareRay(ray const& r, CpuRay& dst)
+    {
+        dst.o = float3(r.o.x, r.o.y, r.o.z);
+        dst.d = float3(r.d.x, r.d.y, r.d.z);
+        dst.invdir = _mm_set_ps(0.f, SafeInverse(r.d.z), SafeInverse(r.d.y), SafeInverse(r.d.x));
+        dst.oxinvdir = _mm_mul_ps(_mm_set_ps(0.f, -r.o.z, -r.o.y, -r.o.x), dst.invdir);
+        dst.mask = r.GetMask();
+    }
+
+    //rays count <= 4, inactive rays and missing lanes never hit anything
+    static inline void PreparePacket(ray const* rays, int count, CpuRayPacket& dst)
+    {
+        alignas(16) float v[15][4];
+        dst.active = 0;
+
+        for (int j = 0; j < 4; ++j)
+        {
+            bool const active = j < count && rays[j].IsActive();
+            ray const r = active ? rays[j] : ray(float3(0.f, 0.f, 0.f), float3(1.f, 1.f, 1.f));
+
+            v[0][j] = r.o.x; v[1][j] = r.o.y; v[2][j] = r.o.z;
+            v[3][j] = r.d.x; v[4][j] = r.d.y; v[5][j] = r.d.z;
+            v[6][j] = SafeInverse(r.d.x); v[7][j] = SafeInverse(r.d.y); v[8][j] = SafeInverse(r.d.z);
+            v[9][j] = -r.o.x * v[6][j]; v[10][j] = -r.o.y * v[7][j]; v[11][j] = -r.o.z * v[8][j];
+            v[12][j] = active ? r.GetMaxT() : -1.f;
+            dst.mask[j] = active ? r.GetMask() : 0;
+            dst.active |= active ? (1 << j) : 0;
+        }
+
+        dst.ox = _mm_load_ps(v[0]); dst.oy = _mm_load_ps(v[1]); dst.oz = _mm_load_ps(v[2]);
+        dst.dx = _mm_load_ps(v[3]); dst.dy = _mm_load_ps(v[4]); dst.dz = _mm_load_ps(v[5]);
+        dst.ix = _mm_load_ps(v[6]); dst.iy = _mm_load_ps(v[7]); dst.iz = _mm_load_ps(v[8]);
+        dst.oix = _mm_load_ps(v[9]); dst.oiy = _mm_load_ps(v[10]); dst.oiz = _mm_load_ps(v[11]);
+        dst.tmax = _mm_load_ps(v[12]);
+    }
+
+    //slab test of a single ray, w lanes of fat node bounds hold child addresses and are ignored
+    static inline bool IntersectBox(bbox const& box, CpuRay const& r, float t_max, float& t_near)
+    {
+        __m128 const f = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&box.pmax.x), r.invdir), r.oxinvdir);
+        __m128 const n = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&box.pmin.x), r.invdir), r.oxinvdir);
+        __m128 const tmax = _mm_max_ps(f, n);
+        __m128 const tmin = _mm_min_ps(f, n);
+
+        __m128 const t1 = _mm_min_ss(_mm_min_ss(tmax, _mm_shuffle_ps(tmax, tmax, 0x55)),
+            _mm_min_ss(_mm_shuffle_ps(tmax, tmax, 0xAA), _mm_set_ss(t_max)));
+        __m128 const t0 = _mm_max_ss(_mm_max_ss(tmin, _mm_shuffle_ps(tmin, tmin, 0x55)),
+            _mm_max_ss(_mm_shuffle_ps(tmin, tmin, 0xAA), _mm_setzero_ps()));
+
+        t_near = _mm_cvtss_f32(t0);
+        return t_near <= _mm_cvtss_f32(t1);
+    }
+
+    //slab test of a packet, returns lanes hitting the box
+    static inline int IntersectBox(bbox const& box, CpuRayPacket const& p, __m128& t_near)
+    {
+        __m128 const x0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmin.x), p.ix), p.oix);
+        __m128 const y0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmin.y), p.iy), p.oiy);
+        __m128 const z0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmin.z), p.iz), p.oiz);
+        __m128 const x1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmax.x), p.ix), p.oix);
+        __m128 const y1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmax.y), p.iy), p.oiy);
+        __m128 const z1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(box.pmax.z), p.iz), p.oiz);
+
+        __m128 const t0 = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), _mm_setzero_ps()));
+        __m128 const t1 = _mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_min_ps(_mm_max_ps(z0, z1), p.tmax));
+
+        t_near = t0;
+        return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+    }
+
+    //closest near distance among the lanes of mask
+    static inline float MinLane(__m128 v, int mask)
+    {
+        alignas(16) float lanes[4];
+        _mm_store_ps(lanes, v);
+
+        float result = std::numeric_limits<float>::max();
+        for (int j = 0; j < 4; ++j)
+            if (mask & (1 << j))
+                result = std::min(result, lanes[j]);
+        return result;
+    }
+
+    //triangle test of a single ray, hit distance has to be in [0, t_max)
+    static inline bool IntersectTriangle(CpuRay const& r, float3 const& v1, float3 const& v2, float3 const& v3, float t_max, float& t, float& b1, float& b2)
+    {
+        float3 const e1 = v2 - v1;
+        float3 const e2 = v3 - v1;
+        float3 const s1 = cross(r.d, e2);
+        float const invd = 1.f / dot(s1, e1);
+        float3 const d = r.o - v1;
+        b1 = dot(d, s1) * invd;
+        float3 const s2 = cross(d, e1);
+        b2 = dot(r.d, s2) * invd;
+        t = dot(e2, s2) * invd;
+
+        //written to reject NaNs of degenerate triangles
+        return b1 >= 0.f && b1 <= 1.f && b2 >= 0.f && b1 + b2 <= 1.f && t >= 0.f && t < t_max;
+    }
+
+    //triangle test of a packet, returns lanes hitting the triangle closer than their t_max
+    static inline int IntersectTriangle(CpuRayPacket const& p, float3 const& v1, float3 const& v2, float3 const& v3, __m128& t, __m128& b1, __m128& b2)
+    {
+        __m128 const e1x = _mm_set1_ps(v2.x - v1.x);
+        __m128 const e1y = _mm_set1_ps(v2.y - v1.y);
+        __m128 const e1z = _mm_set1_ps(v2.z - v1.z);
+        __m128 const e2x = _mm_set1_ps(v3.x - v1.x);
+        __m128 const e2y = _mm_set1_ps(v3.y - v1.y);
+        __m128 const e2z = _mm_set1_ps(v3.z - v1.z);
+
+        __m128 const s1x = _mm_sub_ps(_mm_mul_ps(p.dy, e2z), _mm_mul_ps(p.dz, e2y));
+        __m128 const s1y = _mm_sub_ps(_mm_mul_ps(p.dz, e2x), _mm_mul_ps(p.dx, e2z));
+        __m128 const s1z = _mm_sub_ps(_mm_mul_ps(p.dx, e2y), _mm_mul_ps(p.dy, e2x));
+        __m128 const det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(s1x, e1x), _mm_mul_ps(s1y, e1y)), _mm_mul_ps(s1z, e1z));
+        __m128 const invd = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+        __m128 const dx = _mm_sub_ps(p.ox, _mm_set1_ps(v1.x));
+        __m128 const dy = _mm_sub_ps(p.oy, _mm_set1_ps(v1.y));
+        __m128 const dz = _mm_sub_ps(p.oz, _mm_set1_ps(v1.z));
+        b1 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, s1x), _mm_mul_ps(dy, s1y)), _mm_mul_ps(dz, s1z)), invd);
+
+        __m128 const s2x = _mm_sub_ps(_mm_mul_ps(dy, e1z), _mm_mul_ps(dz, e1y));
+        __m128 const s2y = _mm_sub_ps(_mm_mul_ps(dz, e1x), _mm_mul_ps(dx, e1z));
+        __m128 const s2z = _mm_sub_ps(_mm_mul_ps(dx, e1y), _mm_mul_ps(dy, e1x));
+        b2 = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(p.dx, s2x), _mm_mul_ps(p.dy, s2y)), _mm_mul_ps(p.dz, s2z)), invd);
+        t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, s2x), _mm_mul_ps(e2y, s2y)), _mm_mul_ps(e2z, s2z)), invd);
+
+        __m128 const zero = _mm_setzero_ps();
+        __m128 const one = _mm_set1_ps(1.f);
+        __m128 valid = _mm_and_ps(_mm_cmpge_ps(b1, zero), _mm_cmple_ps(b1, one));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(b2, zero));
+        valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(b1, b2), one));
+        valid = _mm_and_ps(valid, _mm_cmpge_ps(t, zero));
+        valid = _mm_and_ps(valid, _mm_cmplt_ps(t, p.tmax));
+        return _mm_movemask_ps(valid);
+    }
+
+    //lanes of a packet whose ray mask matches shape mask
+    static inline int GetMaskedLanes(CpuRayPacket const& p, int shape_mask)
+    {
+        int lanes = 0;
+        for (int j = 0; j < 4; ++j)
+            lanes |= (p.mask[j] & shape_mask) ? (1 << j) : 0;
+        return lanes & p.active;
+    }
+
+    CpuIntersectionDevice::CpuIntersectionDevice()
+        : m_scheduler(new task_scheduler())
+        , m_packet_traversal(false)
+        , m_stats()
+    {
+    }
+
+    CpuIntersectionDevice::~CpuIntersectionDevice()
+    {
+        Finish();
+    }
+
+    void CpuIntersectionDevice::Preprocess(World const& world)
+    {
+        //in flight queries trace the current tree
+        Finish();
+
+        auto packet = world.options_.GetOption(Options::kBvhPacketTraversal);
+        m_packet_traversal = packet && packet->AsFloat() > 0.f;
+
+        m_stats = CommitStatistics();
+
+        if (!m_nodes.empty() && !world.has_changed() && world.GetStateChange() == ShapeImpl::kStateChangeNone)
+            return;
+
+        ThrowIf(world.HasGroups(), "Groups are not supported by cpu device.");
+        ThrowIf(world.HasCurves(), "Curves are not supported by cpu device.");
+        ThrowIf(world.HasProcedurals(), "Spheres, disks and custom primitives are not supported by cpu device.");
+
+        auto builder = world.options_.GetOption(Options::kBvhBuilder);
+        auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+        auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+        auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+
+        bool use_sah = builder && builder->AsString() == "sah";
+        int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        // Flatten meshes and instances into world space triangles
+        int numshapes = (int)world.shapes_.size();
+        std::vector<Mesh const*> meshes(numshapes);
+        std::vector<int> vertex_start(numshapes + 1, 0);
+        std::vector<int> face_start(numshapes + 1, 0);
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            auto shape = static_cast<ShapeImpl const*>(world.shapes_[i]);
+            meshes[i] = static_cast<Mesh const*>(shape->is_instance() ? static_cast<Instance const*>(shape)->GetBaseShape() : shape);
+            ThrowIf(!meshes[i]->puretriangle(), "Only triangle meshes supported by now.");
+
+            vertex_start[i + 1] = vertex_start[i] + meshes[i]->num_vertices();
+            face_start[i + 1] = face_start[i] + meshes[i]->num_faces();
+        }
+
+        int numfaces = face_start[numshapes];
+        m_vertices.resize(vertex_start[numshapes]);
+
+        parallel_for(*m_scheduler, 0, numshapes, 1, [&](int i)
+        {
+            matrix m, minv;
+            world.shapes_[i]->GetTransform(m, minv);
+
+            for (int j = 0; j < meshes[i]->num_vertices(); ++j)
+            {
+                m_vertices[vertex_start[i] + j] = transform_point(meshes[i]->GetVertex(j), m);
+            }
+        });
+
+        m_nodes.clear();
+        m_node_replicas.clear();
+        m_vertex_replicas.clear();
+
+        if (numfaces == 0)
+        {
+            m_stats.bounds_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            return;
+        }
+
+        // Face bounds and indices into m_vertices
+        std::vector<bbox> bounds(numfaces);
+        std::vector<FatNodeBvhTranslator::Face> faces(numfaces);
+
+        parallel_for(*m_scheduler, 0, numshapes, 1, [&](int i)
+        {
+            for (int j = 0; j < meshes[i]->num_faces(); ++j)
+            {
+                Mesh::Face const face = meshes[i]->GetFace(j);
+                FatNodeBvhTranslator::Face& dst = faces[face_start[i] + j];
+                dst.idx[0] = face.i0 + vertex_start[i];
+                dst.idx[1] = face.i1 + vertex_start[i];
+                dst.idx[2] = face.i2 + vertex_start[i];
+                dst.shapeidx = world.shapes_[i]->GetId();
+                dst.id = j;
+                dst.shape_mask = world.shapes_[i]->GetMask();
+
+                bbox& b = bounds[face_start[i] + j];
+                b = bbox(m_vertices[dst.idx[0]], m_vertices[dst.idx[1]]);
+                b.grow(m_vertices[dst.idx[2]]);
+            }
+        });
+
+        m_stats.bounds_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        start = std::chrono::high_resolution_clock::now();
+
+        Bvh bvh(traversal_cost, num_bins, use_sah);
+        bvh.SetNumThreads(num_threads);
+        bvh.Build(&bounds[0], numfaces);
+
+        m_stats.build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        m_stats.num_nodes = bvh.GetNodeCount();
+        m_stats.num_leaves = bvh.GetLeafCount();
+        m_stats.height = bvh.GetHeight();
+        m_stats.sah_cost = bvh.GetSahCost();
+
+        ThrowIf(bvh.GetHeight() >= STACK_SIZE, "cpu device can cause stack overflow for this scene");
+
+        start = std::chrono::high_resolution_clock::now();
+
+        FatNodeBvhTranslator translator;
+        translator.Process(bvh);
+
+        // Leaves get faces in the order of the tree
+        int const* reordering = bvh.GetIndices();
+        int numindices = (int)bvh.GetNumIndices();
+        std::vector<FatNodeBvhTranslator::Face> sorted(numindices);
+        for (int i = 0; i < numindices; ++i)
+        {
+            sorted[i] = faces[reordering[i]];
+        }
+
+        translator.InjectIndices(&sorted[0]);
+        m_nodes.swap(translator.nodes_);
+
+        ReplicateSceneData();
+
+        m_stats.translate_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        m_stats.nodes_bytes = m_nodes.size() * sizeof(Node);
+        m_stats.vertices_bytes = m_vertices.size() * sizeof(float3);
+    }
+
+    void CpuIntersectionDevice::ReplicateSceneData()
+    {
+        m_node_replicas.clear();
+        m_vertex_replicas.clear();
+
+        int const num_nodes = m_scheduler->num_nodes();
+        if (num_nodes < 2 || m_nodes.empty())
+            return;
+
+        m_node_replicas.resize(num_nodes - 1);
+        m_vertex_replicas.resize(num_nodes - 1);
+
+        // Copies are made by threads bound to their nodes, so pages are first touched there
+        std::vector<std::thread> threads;
+        for (int node = 1; node < num_nodes; ++node)
+        {
+            threads.push_back(std::thread([this, node]()
+            {
+                BindThreadToNumaNode(node);
+                m_node_replicas[node - 1] = m_nodes;
+                m_vertex_replicas[node - 1] = m_vertices;
+            }));
+        }
+
+        for (auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void CpuIntersectionDevice::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        stats = m_stats;
+    }
+
+    void CpuIntersectionDevice::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        // Nothing lives in device memory, the tree and vertices are host data
+        usage.nodes_bytes += m_nodes.capacity() * sizeof(Node);
+        usage.vertices_bytes += m_vertices.capacity() * sizeof(float3);
+
+        for (std::size_t i = 0; i < m_node_replicas.size(); ++i)
+        {
+            usage.nodes_bytes += m_node_replicas[i].capacity() * sizeof(Node);
+            usage.vertices_bytes += m_vertex_replicas[i].capacity() * sizeof(float3);
+        }
+    }
+
+    int CpuIntersectionDevice::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        // Nothing runs on a GPU
+        return 0;
+    }
+
+    Buffer* CpuIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new CpuBuffer(size, initdata, *m_scheduler);
+    }
+
+    Buffer* CpuIntersectionDevice::CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const
+    {
+        CpuBuffer* buf = dynamic_cast<CpuBuffer*>(buffer);
+        ThrowIf(!buf, "Invalid cpu buffer.");
+        return new CpuBuffer(static_cast<char*>(buf->GetData()) + offset);
+    }
+
+    void CpuIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete buffer;
+    }
+
+    void CpuIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    Event* CpuIntersectionDevice::CreateReusableEvent() const
+    {
+        Throw("Not implemented for cpu device.");
+        return nullptr;
+    }
+
+    int CpuIntersectionDevice::GetQueueCount() const
+    {
+        // Queries are executed by the thread pool in submission order
+        return 1;
+    }
+
+    void CpuIntersectionDevice::Submit(std::function<void()>&& job, Event const* waitevent, Event** event) const
+    {
+        std::shared_future<void> wait;
+        if (waitevent)
+        {
+            //cpu events are chained, events of other devices
+            //may be deleted before the job starts so they are waited here
+            const CpuEvent* ev = dynamic_cast<const CpuEvent*>(waitevent);
+            if (ev)
+                wait = ev->GetFuture();
+            else
+                const_cast<Event*>(waitevent)->Wait();
+        }
+
+        CpuEvent* ev = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_job_mutex);
+            std::shared_future<void> previous = m_last_job;
+            ev = new CpuEvent([previous, wait, job]()
+            {
+                if (previous.valid())
+                    previous.wait();
+                if (wait.valid())
+                    wait.wait();
+                job();
+            });
+            m_last_job = ev->GetFuture();
+        }
+
+        if (event)
+        {
+            *event = ev;
+        }
+        else
+        {
+            ev->Wait();
+            DeleteEvent(ev);
+        }
+    }
+
+    void CpuIntersectionDevice::Finish() const
+    {
+        std::shared_future<void> last;
+        {
+            std::lock_guard<std::mutex> lock(m_job_mutex);
+            last = m_last_job;
+        }
+
+        if (last.valid())
+            last.wait();
+    }
+
+    void CpuIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        if (data)
+        {
+            CpuBuffer* buf = dynamic_cast<CpuBuffer*>(buffer);
+            ThrowIf(!buf, "Invalid cpu buffer.");
+            *data = static_cast<char*>(buf->GetData()) + offset;
+        }
+
+        //buffers live in host memory, the map completes with the queries submitted before it
+        Submit([]() {}, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        Submit([]() {}, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        CpuBuffer* srcbuf = dynamic_cast<CpuBuffer*>(const_cast<Buffer*>(src));
+        CpuBuffer* dstbuf = dynamic_cast<CpuBuffer*>(dst);
+        ThrowIf(!srcbuf || !dstbuf, "Invalid cpu buffer.");
+
+        //copies are ordered with the queries, so a query result can feed the next query
+        Submit([srcbuf, dstbuf, srcoffset, dstoffset, size]()
+        {
+            memcpy(static_cast<char*>(dstbuf->GetData()) + dstoffset, static_cast<char*>(srcbuf->GetData()) + srcoffset, size);
+        }, nullptr, event);
+    }
+
+    void CpuIntersectionDevice::GetSceneData(Node const*& nodes, float3 const*& vertices) const
+    {
+        int node = m_node_replicas.empty() ? 0 : m_scheduler->current_node();
+
+        if (node == 0)
+        {
+            nodes = m_nodes.data();
+            vertices = m_vertices.data();
+        }
+        else
+        {
+            nodes = m_node_replicas[node - 1].data();
+            vertices = m_vertex_replicas[node - 1].data();
+        }
+    }
+
+    void CpuIntersectionDevice::FillIntersection(Intersection& dst, int leaf, float u, float v, float t) const
+    {
+        if (leaf == -1)
+        {
+            dst.shapeid = kNullId;
+            dst.primid = kNullId;
+            return;
+        }
+
+        Node const& node = m_nodes[leaf];
+        dst.shapeid = node.s1.shape_id;
+        dst.primid = node.s1.prim_id;
+        dst.uvwt = float4(u, v, 0.f, t);
+    }
+
+    void CpuIntersectionDevice::IntersectSingle(const ray* rays, Intersection* hits, int count) const
+    {
+        Node const* nodes;
+        float3 const* vertices;
+        GetSceneData(nodes, vertices);
+
+        int stack[STACK_SIZE];
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (!rays[i].IsActive())
+                continue;
+
+            CpuRay r;
+            PrepareRay(rays[i], r);
+
+            float t_max = rays[i].GetMaxT();
+            float u = 0.f;
+            float v = 0.f;
+            int isect = -1;
+
+            int sp = 0;
+            int addr = 0;
+
+            while (true)
+            {
+                Node const& node = nodes[addr];
+
+                if (node.s1.child0 == -1)
+                {
+                    float t, b1, b2;
+                    if ((node.s1.shape_mask & r.mask) &&
+                        IntersectTriangle(r, vertices[node.s1.i0], vertices[node.s1.i1], vertices[node.s1.i2], t_max, t, b1, b2))
+                    {
+                        t_max = t;
+                        u = b1;
+                        v = b2;
+                        isect = addr;
+                    }
+                }
+                else
+                {
+                    float n0, n1;
+                    bool const c0 = IntersectBox(node.s0.bounds[0], r, t_max, n0);
+                    bool const c1 = IntersectBox(node.s0.bounds[1], r, t_max, n1);
+
+                    if (c0 && c1)
+                    {
+                        // Closer child first, the other one is postponed
+                        bool const c1first = n1 < n0;
+                        stack[sp++] = c1first ? node.s1.child0 : node.s1.child1;
+                        addr = c1first ? node.s1.child1 : node.s1.child0;
+                        continue;
+                    }
+                    else if (c0 || c1)
+                    {
+                        addr = c0 ? node.s1.child0 : node.s1.child1;
+                        continue;
+                    }
+                }
+
+                if (sp == 0)
+                    break;
+
+                addr = stack[--sp];
+            }
+
+            FillIntersection(hits[i], isect, u, v, t_max);
+        }
+    }
+
+    void CpuIntersectionDevice::OccludeSingle(const ray* rays, int* hits, int count) const
+    {
+        Node const* nodes;
+        float3 const* vertices;
+        GetSceneData(nodes, vertices);
+
+        int stack[STACK_SIZE];
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (!rays[i].IsActive())
+                continue;
+
+            CpuRay r;
+            PrepareRay(rays[i], r);
+
+            float const t_max = rays[i].GetMaxT();
+            int result = kNullId;
+
+            int sp = 0;
+            int addr = 0;
+
+            while (true)
+            {
+                Node const& node = nodes[addr];
+
+                if (node.s1.child0 == -1)
+                {
+                    // Any hit closer than t_max terminates traversal
+                    float t, b1, b2;
+                    if ((node.s1.shape_mask & r.mask) &&
+                        IntersectTriangle(r, vertices[node.s1.i0], vertices[node.s1.i1], vertices[node.s1.i2], t_max, t, b1, b2))
+                    {
+                        result = HIT_MARKER;
+                        break;
+                    }
+                }
+                else
+                {
+                    // Any hit will do, children are visited in stored order
+                    float n0, n1;
+                    bool const c0 = IntersectBox(node.s0.bounds[0], r, t_max, n0);
+                    bool const c1 = IntersectBox(node.s0.bounds[1], r, t_max, n1);
+
+                    if (c0 && c1)
+                    {
+                        stack[sp++] = node.s1.child1;
+                        addr = node.s1.child0;
+                        continue;
+                    }
+                    else if (c0 || c1)
+                    {
+                        addr = c0 ? node.s1.child0 : node.s1.child1;
+                        continue;
+                    }
+                }
+
+                if (sp == 0)
+                    break;
+
+                addr = stack[--sp];
+            }
+
+            hits[i] = result;
+        }
+    }
+
+    void CpuIntersectionDevice::IntersectPackets(const ray* rays, Intersection* hits, int count) const
+    {
+        Node const* nodes;
+        float3 const* vertices;
+        GetSceneData(nodes, vertices);
+
+        int stack[STACK_SIZE];
+
+        for (int i = 0; i < count; i += 4)
+        {
+            int const numrays = std::min(count - i, 4);
+
+            CpuRayPacket p;
+            PreparePacket(rays + i, numrays, p);
+
+            if (!p.active)
+                continue;
+
+            alignas(16) float t_max[4];
+            alignas(16) float u[4] = {};
+            alignas(16) float v[4] = {};
+            int isect[4] = { -1, -1, -1, -1 };
+            _mm_store_ps(t_max, p.tmax);
+
+            int sp = 0;
+            int addr = 0;
+
+            while (true)
+            {
+                Node const& node = nodes[addr];
+
+                if (node.s1.child0 == -1)
+                {
+                    int const lanes = GetMaskedLanes(p, node.s1.shape_mask);
+                    __m128 t, b1, b2;
+                    int const hit = lanes ? IntersectTriangle(p, vertices[node.s1.i0], vertices[node.s1.i1], vertices[node.s1.i2], t, b1, b2) & lanes : 0;
+
+                    if (hit)
+                    {
+                        alignas(16) float tt[4], bb1[4], bb2[4];
+                        _mm_store_ps(tt, t);
+                        _mm_store_ps(bb1, b1);
+                        _mm_store_ps(bb2, b2);
+
+                        for (int j = 0; j < 4; ++j)
+                        {
+                            if (hit & (1 << j))
+                            {
+                                t_max[j] = tt[j];
+                                u[j] = bb1[j];
+                                v[j] = bb2[j];
+                                isect[j] = addr;
+                            }
+                        }
+
+                        p.tmax = _mm_load_ps(t_max);
+                    }
+                }
+                else
+                {
+                    __m128 n0, n1;
+                    int const c0 = IntersectBox(node.s0.bounds[0], p, n0);
+                    int const c1 = IntersectBox(node.s0.bounds[1], p, n1);
+
+                    if (c0 && c1)
+                    {
+                        // Child closer to the packet first, the other one is postponed
+                        bool const c1first = MinLane(n1, c1) < MinLane(n0, c0);
+                        stack[sp++] = c1first ? node.s1.child0 : node.s1.child1;
+                        addr = c1first ? node.s1.child1 : node.s1.child0;
+                        continue;
+                    }
+                    else if (c0 || c1)
+                    {
+                        addr = c0 ? node.s1.child0 : node.s1.child1;
+                        continue;
+                    }
+                }
+
+                if (sp == 0)
+                    break;
+
+                addr = stack[--sp];
+            }
+
+            for (int j = 0; j < numrays; ++j)
+            {
+                if (p.active & (1 << j))
+                {
+                    FillIntersection(hits[i + j], isect[j], u[j], v[j], t_max[j]);
+                }
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::OccludePackets(const ray* rays, int* hits, int count) const
+    {
+        Node const* nodes;
+        float3 const* vertices;
+        GetSceneData(nodes, vertices);
+
+        int stack[STACK_SIZE];
+
+        for (int i = 0; i < count; i += 4)
+        {
+            int const numrays = std::min(count - i, 4);
+
+            CpuRayPacket p;
+            PreparePacket(rays + i, numrays, p);
+
+            int const traced = p.active;
+            int occluded = 0;
+
+            int sp = 0;
+            int addr = 0;
+
+            while (p.active)
+            {
+                Node const& node = nodes[addr];
+
+                if (node.s1.child0 == -1)
+                {
+                    int const lanes = GetMaskedLanes(p, node.s1.shape_mask);
+                    __m128 t, b1, b2;
+                    int const hit = lanes ? IntersectTriangle(p, vertices[node.s1.i0], vertices[node.s1.i1], vertices[node.s1.i2], t, b1, b2) & lanes : 0;
+
+                    if (hit)
+                    {
+                        // Occluded lanes stop hitting anything
+                        occluded |= hit;
+                        p.active &= ~hit;
+
+                        alignas(16) float t_max[4];
+                        _mm_store_ps(t_max, p.tmax);
+                        for (int j = 0; j < 4; ++j)
+                            if (hit & (1 << j))
+                                t_max[j] = -1.f;
+                        p.tmax = _mm_load_ps(t_max);
+                    }
+                }
+                else
+                {
+                    // Any hit will do, children are visited in stored order
+                    __m128 n0, n1;
+                    int const c0 = IntersectBox(node.s0.bounds[0], p, n0);
+                    int const c1 = IntersectBox(node.s0.bounds[1], p, n1);
+
+                    if (c0 && c1)
+                    {
+                        stack[sp++] = node.s1.child1;
+                        addr = node.s1.child0;
+                        continue;
+                    }
+                    else if (c0 || c1)
+                    {
+                        addr = c0 ? node.s1.child0 : node.s1.child1;
+                        continue;
+                    }
+                }
+
+                if (sp == 0)
+                    break;
+
+                addr = stack[--sp];
+            }
+
+            for (int j = 0; j < numrays; ++j)
+            {
+                if (traced & (1 << j))
+                {
+                    hits[i + j] = (occluded & (1 << j)) ? HIT_MARKER : kNullId;
+                }
+            }
+        }
+    }
+
+    void CpuIntersectionDevice::Intersect(const ray* rays, Intersection* hits, int numrays) const
+    {
+        int const numtasks = (numrays + TASK_SIZE - 1) / TASK_SIZE;
+        bool const packets = m_packet_traversal;
+
+        //each task traces its chunk of rays and writes hits straight into the output
+        parallel_for(*m_scheduler, 0, numtasks, 1, [this, rays, hits, numrays, packets](int task)
+        {
+            int const i = task * TASK_SIZE;
+            int const count = std::min(numrays - i, TASK_SIZE);
+
+            if (m_nodes.empty())
+            {
+                for (int j = 0; j < count; ++j)
+                    if (rays[i + j].IsActive())
+                        FillIntersection(hits[i + j], -1, 0.f, 0.f, 0.f);
+            }
+            else if (packets)
+            {
+                IntersectPackets(rays + i, hits + i, count);
+            }
+            else
+            {
+                IntersectSingle(rays + i, hits + i, count);
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::Occlude(const ray* rays, int* hits, int numrays) const
+    {
+        int const numtasks = (numrays + TASK_SIZE - 1) / TASK_SIZE;
+        bool const packets = m_packet_traversal;
+
+        //each task traces its chunk of rays and writes results straight into the output
+        parallel_for(*m_scheduler, 0, numtasks, 1, [this, rays, hits, numrays, packets](int task)
+        {
+            int const i = task * TASK_SIZE;
+            int const count = std::min(numrays - i, TASK_SIZE);
+
+            if (m_nodes.empty())
+            {
+                for (int j = 0; j < count; ++j)
+                    if (rays[i + j].IsActive())
+                        hits[i + j] = kNullId;
+            }
+            else if (packets)
+            {
+                OccludePackets(rays + i, hits + i, count);
+            }
+            else
+            {
+                OccludeSingle(rays + i, hits + i, count);
+            }
+        });
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const CpuBuffer* cpuRays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpuRays, "Invalid cpu buffer.");
+        CpuBuffer* cpuHits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+
+        Submit([this, cpuRays, cpuHits, numrays]()
+        {
+            Intersect(static_cast<const ray*>(cpuRays->GetData()), static_cast<Intersection*>(cpuHits->GetData()), numrays);
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const CpuBuffer* cpuRays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpuRays, "Invalid cpu buffer.");
+        CpuBuffer* cpuHits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+
+        Submit([this, cpuRays, cpuHits, numrays]()
+        {
+            Occlude(static_cast<const ray*>(cpuRays->GetData()), static_cast<int*>(cpuHits->GetData()), numrays);
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const CpuBuffer* cpuRays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpuRays, "Invalid cpu buffer.");
+        const CpuBuffer* cpuCount = dynamic_cast<const CpuBuffer*>(numrays); ThrowIf(!cpuCount, "Invalid cpu buffer.");
+        CpuBuffer* cpuHits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+
+        //the count is read when the job runs, after the jobs producing it
+        Submit([this, cpuRays, cpuCount, cpuHits, maxrays]()
+        {
+            int count = std::min(*static_cast<const int*>(cpuCount->GetData()), maxrays);
+            Intersect(static_cast<const ray*>(cpuRays->GetData()), static_cast<Intersection*>(cpuHits->GetData()), count);
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const CpuBuffer* cpuRays = dynamic_cast<const CpuBuffer*>(rays); ThrowIf(!cpuRays, "Invalid cpu buffer.");
+        const CpuBuffer* cpuCount = dynamic_cast<const CpuBuffer*>(numrays); ThrowIf(!cpuCount, "Invalid cpu buffer.");
+        CpuBuffer* cpuHits = dynamic_cast<CpuBuffer*>(hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+
+        Submit([this, cpuRays, cpuCount, cpuHits, maxrays]()
+        {
+            int count = std::min(*static_cast<const int*>(cpuCount->GetData()), maxrays);
+            Occlude(static_cast<const ray*>(cpuRays->GetData()), static_cast<int*>(cpuHits->GetData()), count);
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const
+    {
+        //host memory is traced in place
+        Intersect(rays, hits, numrays);
+    }
+
+    void CpuIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const
+    {
+        Occlude(rays, hits, numrays);
+    }
+
+    void CpuIntersectionDevice::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
+    {
+        ThrowIf(numqueries <= 0, "Query batch is empty");
+
+        // The whole batch is traced by a single job
+        std::vector<std::function<void()>> jobs;
+        for (int i = 0; i < numqueries; ++i)
+        {
+            const CpuBuffer* cpuRays = dynamic_cast<const CpuBuffer*>(queries[i].rays); ThrowIf(!cpuRays, "Invalid cpu buffer.");
+            CpuBuffer* cpuHits = dynamic_cast<CpuBuffer*>(queries[i].hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+            int numrays = queries[i].numrays;
+
+            if (queries[i].type == kQueryOcclusion)
+            {
+                jobs.push_back([this, cpuRays, cpuHits, numrays]()
+                {
+                    Occlude(static_cast<const ray*>(cpuRays->GetData()), static_cast<int*>(cpuHits->GetData()), numrays);
+                });
+            }
+            else
+            {
+                jobs.push_back([this, cpuRays, cpuHits, numrays]()
+                {
+                    Intersect(static_cast<const ray*>(cpuRays->GetData()), static_cast<Intersection*>(cpuHits->GetData()), numrays);
+                });
+            }
+        }
+
+        Submit([jobs]()
+        {
+            for (auto const& job : jobs)
+                job();
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
+    {
+        const CpuBuffer* cpuHits = dynamic_cast<const CpuBuffer*>(hits); ThrowIf(!cpuHits, "Invalid cpu buffer.");
+        const CpuBuffer* cpuCount = dynamic_cast<const CpuBuffer*>(numrays); ThrowIf(!cpuCount, "Invalid cpu buffer.");
+        const CpuBuffer* cpuKeys = dynamic_cast<const CpuBuffer*>(shapekeys); ThrowIf(shapekeys && !cpuKeys, "Invalid cpu buffer.");
+        CpuBuffer* cpuIndices = dynamic_cast<CpuBuffer*>(outindices); ThrowIf(!cpuIndices, "Invalid cpu buffer.");
+        CpuBuffer* cpuOutKeys = dynamic_cast<CpuBuffer*>(outkeys); ThrowIf(outkeys && !cpuOutKeys, "Invalid cpu buffer.");
+
+        //hits are grouped after the queries submitted before
+        Submit([cpuHits, cpuCount, maxrays, cpuKeys, numkeys, cpuIndices, cpuOutKeys]()
+        {
+            GroupHitsOnHost(static_cast<const Intersection*>(cpuHits->GetData()), *static_cast<const int*>(cpuCount->GetData()), maxrays,
+                cpuKeys ? static_cast<const int*>(cpuKeys->GetData()) : nullptr, numkeys,
+                static_cast<int*>(cpuIndices->GetData()), cpuOutKeys ? static_cast<int*>(cpuOutKeys->GetData()) : nullptr);
+        }, waitevent, event);
+    }
+
+    void CpuIntersectionDevice::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        // A closest hit is a valid result of any hit rays too
+        QueryIntersection(rays, numrays, hits, waitevent, event, queue);
+    }
+
+    void CpuIntersectionDevice::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::SetHitFilterData(Buffer const* data)
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        Throw("Not implemented for cpu device.");
+    }
+
+    void CpuIntersectionDevice::SetHitHints(Buffer const* hits)
+    {
+        // Hints are an optimization of OpenCL traversal only
+    }
+}
@@ -0,0 +1,127 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include "../translator/fatnode_bvh_translator.h"
+#include "../async/task_scheduler.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <functional>
+
+namespace RadeonRays
+{
+    ///< The class represents native CPU intersection device.
+    ///< Shapes are flattened into world space triangles, the tree is built
+    ///< with Bvh and translated into fat nodes (same layout as fatbvh uses on GPUs)
+    ///< and traversed with SSE single ray or 4 ray packet kernels in scheduler tasks.
+    ///< On NUMA hosts each node traces its own copy of the tree.
+    ///<
+    class CpuIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        CpuIntersectionDevice();
+        ~CpuIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
+        int GetQueueCount() const override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        Event* CreateReusableEvent() const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const override;
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const override;
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void SetHitFilterData(Buffer const* data) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+        void SetHitHints(Buffer const* hits) override;
+
+    protected:
+        typedef FatNodeBvhTranslator::Node Node;
+
+        // Trace a chunk of rays one at a time
+        void IntersectSingle(const ray* rays, Intersection* hits, int count) const;
+        void OccludeSingle(const ray* rays, int* hits, int count) const;
+        // Trace a chunk of rays in packets of 4
+        void IntersectPackets(const ray* rays, Intersection* hits, int count) const;
+        void OccludePackets(const ray* rays, int* hits, int count) const;
+        // Trace rays in scheduler tasks of TASK_SIZE rays
+        void Intersect(const ray* rays, Intersection* hits, int numrays) const;
+        void Occlude(const ray* rays, int* hits, int numrays) const;
+        // Tree and vertices replicated on the NUMA node of the calling thread
+        void GetSceneData(Node const*& nodes, float3 const*& vertices) const;
+        // Copy the tree and vertices to every other NUMA node of the scheduler
+        void ReplicateSceneData();
+        // Write hit data of a leaf
+        void FillIntersection(Intersection& dst, int leaf, float u, float v, float t) const;
+        // Run a job on its own thread after the wait event and all the jobs submitted before it,
+        // hand its event over or wait for it if event is nullptr
+        void Submit(std::function<void()>&& job, Event const* waitevent, Event** event) const;
+        // Wait for all submitted jobs
+        void Finish() const;
+
+        //work stealing scheduler tracing chunks of rays
+        std::unique_ptr<task_scheduler> m_scheduler;
+
+        //fat nodes with leaves referencing m_vertices, root is the first one
+        std::vector<Node> m_nodes;
+        //world space vertices of all the shapes
+        std::vector<float3> m_vertices;
+        //copies of m_nodes and m_vertices for NUMA nodes 1..N-1, empty on single node hosts
+        std::vector<std::vector<Node> > m_node_replicas;
+        std::vector<std::vector<float3> > m_vertex_replicas;
+
+        //trace rays in packets of 4 ("bvh.packet_traversal")
+        bool m_packet_traversal;
+
+        //last submitted job, the next one starts after it completes
+        mutable std::shared_future<void> m_last_job;
+        mutable std::mutex m_job_mutex;
+
+        //statistics of the latest Preprocess call
+        CommitStatistics m_stats;
+    };
+}
@@ -22,8 +22,14 @@ THE SOFTWARE.
 #include "embree_intersection_device.h"
 
 #include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <set>
 #include <future>
 #include <thread>
+#include <chrono>
 #include "../world/world.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
@@ -33,17 +39,15 @@ THE SOFTWARE.
 #include "../except/except.h"
 #include "embree2/rtcore.h"
 #include "embree2/rtcore_ray.h"
-#include "../async/thread_pool.h"
+#include "../async/task_scheduler.h"
+#include "../async/future_callback.h"
 
 #include <xmmintrin.h>
 #include <pmmintrin.h>
 
-//count of elements for one thread pool task
+//default count of elements for one scheduler task
 #define TASK_SIZE 256
 
-//switch between rtcIntersect4 and rtcIntercetN
-//#define INTERSECTN
-
 
 namespace RadeonRays
 {
@@ -53,14 +57,22 @@ namespace RadeonRays
     public:
         EmbreeBuffer(size_t size, void* init)
             : m_data(nullptr)
+            , m_owner(true)
         {
             m_data = new char[size];
             if (init)
                 memcpy(m_data, init, size);
         }
+        // View of memory owned by another buffer
+        explicit EmbreeBuffer(void* data)
+            : m_data(data)
+            , m_owner(false)
+        {
+        }
         virtual ~EmbreeBuffer()
         {
-            delete[] m_data;
+            if (m_owner)
+                delete[] static_cast<char*>(m_data);
             m_data = nullptr;
         }
 
@@ -76,6 +88,31 @@ namespace RadeonRays
 
     private:
         void* m_data;
+        bool m_owner;
+    };
+
+    //packet width and traversal entry points for each embree packet type
+    template <typename RTCRayN> struct EmbreePacket;
+
+    template <> struct EmbreePacket<RTCRay4>
+    {
+        static int const size = 4;
+        static void Intersect(const void* valid, RTCScene scene, RTCRay4& ray) { rtcIntersect4(valid, scene, ray); }
+        static void Occluded(const void* valid, RTCScene scene, RTCRay4& ray) { rtcOccluded4(valid, scene, ray); }
+    };
+
+    template <> struct EmbreePacket<RTCRay8>
+    {
+        static int const size = 8;
+        static void Intersect(const void* valid, RTCScene scene, RTCRay8& ray) { rtcIntersect8(valid, scene, ray); }
+        static void Occluded(const void* valid, RTCScene scene, RTCRay8& ray) { rtcOccluded8(valid, scene, ray); }
+    };
+
+    template <> struct EmbreePacket<RTCRay16>
+    {
+        static int const size = 16;
+        static void Intersect(const void* valid, RTCScene scene, RTCRay16& ray) { rtcIntersect16(valid, scene, ray); }
+        static void Occluded(const void* valid, RTCScene scene, RTCRay16& ray) { rtcOccluded16(valid, scene, ray); }
     };
 
     //simple RadeonRays::Event implementation
@@ -86,7 +123,7 @@ namespace RadeonRays
             : m_ftr()
         {
             std::packaged_task<void()> task(std::move(f));
-            m_ftr = task.get_future();
+            m_ftr = task.get_future().share();
             std::thread(std::move(task)).detach();
         }
 
@@ -104,26 +141,58 @@ namespace RadeonRays
         {
             m_ftr.wait();
         }
+
+        virtual void SetCompletionCallback(CompletionCallback callback, void* data)
+        {
+            call_when_ready(m_ftr, this, callback, data);
+        }
+
+        std::shared_future<void> const& GetFuture() const
+        {
+            return m_ftr;
+        }
     private:
-        std::future<void> m_ftr;
+        std::shared_future<void> m_ftr;
     };
 
     EmbreeIntersectionDevice::EmbreeIntersectionDevice()
-        : m_pool(1)
+        : m_scheduler(new task_scheduler())
+        , m_num_threads(0)
+        , m_chunk_size(TASK_SIZE)
+        , m_native_mode(kPacket4)
+        , m_mode(kPacket4)
+        , m_sort_rays(false)
+        , m_mesh_flags(RTC_SCENE_STATIC)
+        , m_common_flags(0)
+        , m_refit(false)
+        , m_soa_rays(false)
+        , m_soa_hits(false)
+        , m_stats()
     {
         m_device = rtcNewDevice(nullptr);
         RTCError result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree rtcDevice: " << result << std::endl;
 
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        //top level scene is updated incrementally as shapes get added, removed or moved
+        m_scene = rtcDeviceNewScene(m_device, static_cast<RTCSceneFlags>(RTC_SCENE_DYNAMIC | m_common_flags), RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
         result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree scene: " << result << std::endl;
+
+        //embree reports wide packets as supported only if the CPU has the ISA for them
+        if (rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT16))
+            m_native_mode = kPacket16;
+        else if (rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT8))
+            m_native_mode = kPacket8;
+
+        m_mode = m_native_mode;
     }
     
     EmbreeIntersectionDevice::~EmbreeIntersectionDevice()
     {
+        Finish();
+
         if (m_device)
         {
             rtcDeleteDevice(m_device);
@@ -134,90 +203,377 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::Preprocess(World const& world)
     {
+        //in flight queries trace m_scene with the current settings
+        Finish();
+
+        auto numthreads = world.options_.GetOption(Options::kEmbreeNumThreads);
+        auto chunksize = world.options_.GetOption(Options::kEmbreeChunkSize);
+        auto traversal = world.options_.GetOption(Options::kEmbreeTraversal);
+        auto sortrays = world.options_.GetOption(Options::kEmbreeSortRays);
+        auto quality = world.options_.GetOption(Options::kEmbreeBuildQuality);
+        auto compact = world.options_.GetOption(Options::kEmbreeCompact);
+        auto robust = world.options_.GetOption(Options::kEmbreeRobust);
+
+        m_sort_rays = sortrays && sortrays->AsFloat() > 0.f;
+
+        m_mode = m_native_mode;
+        if (traversal)
+        {
+            std::string value = traversal->AsString();
+            if (value == "packet4")
+                m_mode = kPacket4;
+            else if (value == "packet8")
+                m_mode = kPacket8;
+            else if (value == "packet16")
+                m_mode = kPacket16;
+            else if (value == "stream")
+                m_mode = kStream;
+            else
+                ThrowIf(value != "auto", "Unknown embree traversal mode");
+        }
+
+        //"soa" layouts are transposed per chunk, other compact formats are left to OpenCL devices
+        auto rayformat = world.options_.GetOption(Options::kAccRayFormat);
+        auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+        m_soa_rays = rayformat && rayformat->AsString() == "soa";
+        m_soa_hits = hitformat && hitformat->AsString() == "soa";
+
+        int num_threads = numthreads ? std::max(static_cast<int>(numthreads->AsFloat()), 0) : 0;
+        m_chunk_size = chunksize ? std::max(static_cast<int>(chunksize->AsFloat()), 1) : TASK_SIZE;
+
+        // Keep chunks made of whole packets
+        int const packet = m_mode == kPacket16 ? 16 : (m_mode == kPacket8 ? 8 : (m_mode == kPacket4 ? 4 : 1));
+        m_chunk_size = (m_chunk_size + packet - 1) / packet * packet;
+
+        if (num_threads != m_num_threads)
+        {
+            m_scheduler.reset(new task_scheduler(num_threads));
+            m_num_threads = num_threads;
+        }
+
+        //build quality follows the bvh builder of the other devices unless given explicitly
+        std::string buildquality = quality ? quality->AsString() : "auto";
+        if (buildquality == "auto")
+        {
+            auto builder = world.options_.GetOption(Options::kBvhBuilder);
+            auto acctype = world.options_.GetOption(Options::kAccType);
+            if (builder && builder->AsString() == "sah")
+                buildquality = "high";
+            else if ((builder && builder->AsString() == "lbvh") || (acctype && acctype->AsString() == "hlbvh"))
+                buildquality = "low";
+            else
+                buildquality = "medium";
+        }
+
+        int commonflags = 0;
+        if (compact && compact->AsFloat() > 0.f)
+            commonflags |= RTC_SCENE_COMPACT;
+        if (robust && robust->AsFloat() > 0.f)
+            commonflags |= RTC_SCENE_ROBUST;
+
+        int meshflags = commonflags;
+        bool refit = false;
+        if (buildquality == "low")
+            meshflags |= RTC_SCENE_DYNAMIC;
+        else if (buildquality == "high")
+            meshflags |= RTC_SCENE_STATIC | RTC_SCENE_HIGH_QUALITY;
+        else if (buildquality == "refit")
+            refit = true;
+        else
+            ThrowIf(buildquality != "medium", "Unknown embree build quality");
+
+        bool changed = false;
+
+        //mesh scenes which are not needed anymore, they are deleted
+        //after the commit when no instance refers to them
+        std::vector<RTCScene> retired;
+
+        if (meshflags != m_mesh_flags || commonflags != m_common_flags || refit != m_refit)
+        {
+            //scenes built with the old flags are dropped and all the shapes are added back below
+            for (auto& it : m_instances)
+                RemoveShape(it.second, retired);
+            m_instances.clear();
+            m_pending.clear();
+
+            rtcDeleteScene(m_scene);
+            CheckEmbreeError();
+            m_scene = rtcDeviceNewScene(m_device, static_cast<RTCSceneFlags>(RTC_SCENE_DYNAMIC | commonflags), RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+            CheckEmbreeError();
+
+            m_mesh_flags = meshflags;
+            m_common_flags = commonflags;
+            m_refit = refit;
+            changed = true;
+        }
+
         for (auto& it : m_instances)
             it.second.updated = false;
 
         //checking removed shapes
-        for (auto it = world.shapes_.begin(); it != world.shapes_.end(); ++it)
+        for (auto i : world.shapes_)
         {
-            auto& i = *it;
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            if (m_instances.count(shape))
-                m_instances[shape].updated = true;
+            auto it = m_instances.find(shape);
+            if (it != m_instances.end())
+                it->second.updated = true;
         }
 
-        //cleanup not updated instances
+        //remove instances of detached shapes and meshes nobody refers to anymore
         auto itr = m_instances.begin();
         while (itr != m_instances.end())
         {
             if (!itr->second.updated)
             {
-                //if no instances left => clear stored mesh
-                auto& mesh = m_meshes[itr->first];
-                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
-                --mesh.instance_count;
-                if (mesh.instance_count == 0)
-                {
-                    rtcDeleteScene(itr->second.scene);
-                    CheckEmbreeError();
-                    m_meshes.erase(itr->first);
-                }
+                RemoveShape(itr->second, retired);
                 itr = m_instances.erase(itr);
+                changed = true;
             }
             else
             {
                 ++itr;
             }
         }
-        m_instances.clear();
-        rtcDeleteScene(m_scene); CheckEmbreeError();
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN); CheckEmbreeError();
+
+        //count shapes using each mesh: meshes used by a single shape are placed
+        //in m_scene directly to skip the instance level during traversal,
+        //shared ones are instanced
+        std::map<const Mesh*, int> users;
+        for (auto i : world.shapes_)
+        {
+            const Instance* inst = dynamic_cast<const Instance*>(i);
+            const Mesh* mesh = dynamic_cast<const Mesh*>(inst ? inst->GetBaseShape() : i);
+            if (mesh)
+                ++users[mesh];
+        }
+
+        //refresh vertices of cached meshes updated since the last commit
+        std::set<const Mesh*> refitted;
+        for (auto i : world.shapes_)
+        {
+            const Instance* inst = dynamic_cast<const Instance*>(i);
+            const Mesh* mesh = dynamic_cast<const Mesh*>(inst ? inst->GetBaseShape() : i);
+            if (mesh && users[mesh] > 1 && m_meshes.count(mesh) && !refitted.count(mesh) && (mesh->GetStateChange() & ShapeImpl::kStateChangeVertices))
+            {
+                UpdateEmbreeMeshVertices(mesh, retired);
+                refitted.insert(mesh);
+            }
+        }
+
+        ThrowIf(world.HasGroups(), "Groups are not supported by Embree device.");
+        ThrowIf(world.HasCurves(), "Curves are not supported by Embree device.");
+        ThrowIf(world.HasProcedurals(), "Spheres, disks and custom primitives are not supported by Embree device.");
 
         for (auto i : world.shapes_)
         {
             const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
             ThrowIf(!shape, "Invalid shape.");
 
-            //update only if shape already precessed before
-            EmbreeSceneData& data = m_instances[shape];
-            data.mesh_id = shape->GetId();
-            data.updated = true;
+            const Instance* inst = dynamic_cast<const Instance*> (shape);
+            const Mesh* mesh = dynamic_cast<const Mesh*> (inst ? inst->GetBaseShape() : shape);
+            ThrowIf(!mesh, "Invalid mesh.");
 
-            //for each new Shape creating new embree scene with geometry
-            //and adding its instance to m_scene
-            const Mesh* mesh = dynamic_cast<const Mesh*> (shape);
-            if (mesh)
+            bool direct = users[mesh] == 1;
+
+            auto it = m_instances.find(shape);
+            if (it != m_instances.end() && (it->second.mesh != mesh || it->second.direct != direct))
+            {
+                //a new shape reusing the address of a removed one
+                //or a mesh which got shared or stopped being shared
+                RemoveShape(it->second, retired);
+                m_instances.erase(it);
+                it = m_instances.end();
+            }
+
+            if (it == m_instances.end())
+            {
+                //new shape: place its triangles in m_scene if nobody else uses the mesh,
+                //otherwise instance the mesh scene creating it on first use
+                EmbreeSceneData& data = m_instances[shape];
+                data.mesh = mesh;
+                if (direct)
+                {
+                    AddDirectMesh(shape, data, m_refit);
+                }
+                else
+                {
+                    data.scene = AcquireEmbreeMesh(mesh);
+                    AddInstance(shape, data);
+                }
+                changed = true;
+            }
+            else if (!direct && it->second.scene != m_meshes[mesh].scene)
             {
-                data.scene = GetEmbreeMesh(mesh);
+                //mesh scene has been replaced by a deformable one
+                EmbreeSceneData& data = it->second;
+                rtcDeleteGeometry(m_scene, data.geom);
+                CheckEmbreeError();
+                data.scene = m_meshes[mesh].scene;
+                AddInstance(shape, data);
+                changed = true;
             }
-            else // instance
+            else
             {
-                const Instance* inst = dynamic_cast<const Instance*> (shape);
-                ThrowIf(!inst, "Invalid shape.");
-                mesh = dynamic_cast<const Mesh*> (inst->GetBaseShape());
-                ThrowIf(!mesh, "Invalid mesh.");
-                //adding mesh of instance if it's not being processed before
-                data.scene = GetEmbreeMesh(mesh);
-                ++m_meshes[mesh].instance_count;
+                //existing shape: apply its own changes and pick up refitted mesh bounds
+                changed = UpdateShape(shape) || changed;
+                if (refitted.count(mesh))
+                {
+                    rtcUpdate(m_scene, it->second.geom);
+                    CheckEmbreeError();
+                    changed = true;
+                }
             }
+        }
 
-            unsigned geom = rtcNewInstance(m_scene, data.scene);
-            CheckEmbreeError();
-            matrix trans, transInv;
-            shape->GetTransform(trans, transInv);
-            rtcSetTransform(m_scene, geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
-            CheckEmbreeError();
-            rtcSetMask(m_scene, geom, shape->GetMask());
+        m_stats = CommitStatistics();
+
+        if (changed)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+
+            //mesh scenes are independent, they are built concurrently on the scheduler
+            //workers and m_scene instancing them is committed last
+            std::vector<RTCScene> pending;
+            pending.swap(m_pending);
+            parallel_for(*m_scheduler, 0, static_cast<int>(pending.size()), 1, [this, &pending](int i)
+            {
+                rtcCommit(pending[i]);
+                CheckEmbreeError();
+            });
+
+            rtcCommit(m_scene);
             CheckEmbreeError();
-            rtcSetUserData(m_scene, geom, &data);
+
+            m_stats.build_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+
+        for (auto scene : retired)
+        {
+            rtcDeleteScene(scene);
             CheckEmbreeError();
+        }
+    }
 
-            data.geom = geom;
+    void EmbreeIntersectionDevice::AddInstance(const ShapeImpl* shape, EmbreeSceneData& data)
+    {
+        data.mesh_id = shape->GetId();
+        data.updated = true;
+
+        unsigned geom = rtcNewInstance(m_scene, data.scene);
+        CheckEmbreeError();
+        matrix trans, transInv;
+        shape->GetTransform(trans, transInv);
+        rtcSetTransform(m_scene, geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
+        CheckEmbreeError();
+        rtcSetMask(m_scene, geom, shape->GetMask());
+        CheckEmbreeError();
+        rtcSetUserData(m_scene, geom, &data);
+        CheckEmbreeError();
+
+        data.geom = geom;
+    }
+
+    //occlusion hits report geomID 0 only, direct meshes record the hit geometry
+    //in instID so occlusion results resolve shape ids the same way as instances
+    static void DirectMeshOcclusionFilter(void* ptr, RTCRay& ray)
+    {
+        ray.instID = ray.geomID;
+    }
+
+    template <typename RTCRayN>
+    static void DirectMeshOcclusionFilterN(const void* valid, void* ptr, RTCRayN& ray)
+    {
+        const int* mask = static_cast<const int*>(valid);
+        for (int i = 0; i < EmbreePacket<RTCRayN>::size; ++i)
+            if (mask[i])
+                ray.instID[i] = ray.geomID[i];
+    }
 
+    void EmbreeIntersectionDevice::AddDirectMesh(const ShapeImpl* shape, EmbreeSceneData& data, bool deformable)
+    {
+        const Mesh* mesh = data.mesh;
+        ThrowIf(!mesh->puretriangle(), "Only triangle meshes supported by now.");
+
+        data.scene = nullptr;
+        data.mesh_id = shape->GetId();
+        data.updated = true;
+        data.direct = true;
+        data.deformable = deformable;
+
+        unsigned geom = rtcNewTriangleMesh(m_scene, deformable ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
+        CheckEmbreeError();
+
+        matrix trans, transInv;
+        shape->GetTransform(trans, transInv);
+        CopyVertices(m_scene, geom, mesh, &trans);
+
+        int* indices = static_cast<int*>(rtcMapBuffer(m_scene, geom, RTC_INDEX_BUFFER));
+        CheckEmbreeError();
+        ThrowIf(!indices, "Failed to map embree buffer.");
+        for (int i = 0; i < mesh->num_faces(); ++i)
+        {
+            const Mesh::Face kFace = mesh->GetFace(i);
+            indices[3 * i] = kFace.i0;
+            indices[3 * i + 1] = kFace.i1;
+            indices[3 * i + 2] = kFace.i2;
+        }
+        rtcUnmapBuffer(m_scene, geom, RTC_INDEX_BUFFER);
+        CheckEmbreeError();
+
+        rtcSetMask(m_scene, geom, shape->GetMask());
+        CheckEmbreeError();
+        rtcSetUserData(m_scene, geom, &data);
+        CheckEmbreeError();
+        rtcSetOcclusionFilterFunction(m_scene, geom, DirectMeshOcclusionFilter);
+        rtcSetOcclusionFilterFunction4(m_scene, geom, DirectMeshOcclusionFilterN<RTCRay4>);
+        rtcSetOcclusionFilterFunction8(m_scene, geom, DirectMeshOcclusionFilterN<RTCRay8>);
+        rtcSetOcclusionFilterFunction16(m_scene, geom, DirectMeshOcclusionFilterN<RTCRay16>);
+        CheckEmbreeError();
+
+        data.geom = geom;
+    }
+
+    void EmbreeIntersectionDevice::UpdateDirectMesh(const ShapeImpl* shape, EmbreeSceneData& data)
+    {
+        //first update of a static direct mesh: recreate it as deformable geometry
+        if (!data.deformable)
+        {
+            rtcDeleteGeometry(m_scene, data.geom);
+            CheckEmbreeError();
+            AddDirectMesh(shape, data, true);
+            return;
         }
 
-        rtcCommit(m_scene);
+        matrix trans, transInv;
+        shape->GetTransform(trans, transInv);
+        CopyVertices(m_scene, data.geom, data.mesh, &trans);
+        rtcUpdateBuffer(m_scene, data.geom, RTC_VERTEX_BUFFER);
+        CheckEmbreeError();
+    }
+
+    void EmbreeIntersectionDevice::RemoveShape(EmbreeSceneData& data, std::vector<RTCScene>& retired)
+    {
+        rtcDeleteGeometry(m_scene, data.geom);
         CheckEmbreeError();
+        if (!data.direct)
+            ReleaseEmbreeMesh(data.mesh, retired);
+    }
+
+    void EmbreeIntersectionDevice::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        stats = m_stats;
+    }
+
+    void EmbreeIntersectionDevice::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        // Embree scenes live in host memory allocated by Embree, which only reports it
+        // through a process wide monitor callback, so nothing is added here
+    }
+
+    int EmbreeIntersectionDevice::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        // Nothing runs on a GPU
+        return 0;
     }
 
     Buffer* EmbreeIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
@@ -225,6 +581,13 @@ namespace RadeonRays
         return new EmbreeBuffer(size, initdata);
     }
 
+    Buffer* EmbreeIntersectionDevice::CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const
+    {
+        EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
+        ThrowIf(!buf, "Invalid embree buffer.");
+        return new EmbreeBuffer(static_cast<char*>(buf->GetData()) + offset);
+    }
+
     void EmbreeIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
     {
         delete buffer;
@@ -235,14 +598,45 @@ namespace RadeonRays
         delete event;
     }
 
-    void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
+    Event* EmbreeIntersectionDevice::CreateReusableEvent() const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
-        if (data)
+        Throw("Not implemented for embree device.");
+        return nullptr;
+    }
+
+    int EmbreeIntersectionDevice::GetQueueCount() const
+    {
+        // Queries are executed by the thread pool in submission order
+        return 1;
+    }
+
+    void EmbreeIntersectionDevice::Submit(std::function<void()>&& job, Event const* waitevent, Event** event) const
+    {
+        std::shared_future<void> wait;
+        if (waitevent)
         {
-            EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
-            ThrowIf(!buf, "Invalid embree buffer.");
-            *data = buf->GetData();
+            //embree events are chained, events of other devices
+            //may be deleted before the job starts so they are waited here
+            const EmbreeEvent* ev = dynamic_cast<const EmbreeEvent*>(waitevent);
+            if (ev)
+                wait = ev->GetFuture();
+            else
+                const_cast<Event*>(waitevent)->Wait();
+        }
+
+        EmbreeEvent* ev = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_job_mutex);
+            std::shared_future<void> previous = m_last_job;
+            ev = new EmbreeEvent([previous, wait, job]()
+            {
+                if (previous.valid())
+                    previous.wait();
+                if (wait.valid())
+                    wait.wait();
+                job();
+            });
+            m_last_job = ev->GetFuture();
         }
 
         if (event)
@@ -256,315 +650,573 @@ namespace RadeonRays
         }
     }
 
-    void EmbreeIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
+    void EmbreeIntersectionDevice::Finish() const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
-
-        if (event)
+        std::shared_future<void> last;
         {
-            *event = ev;
+            std::lock_guard<std::mutex> lock(m_job_mutex);
+            last = m_last_job;
         }
-        else
+
+        if (last.valid())
+            last.wait();
+    }
+
+    void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        if (data)
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
+            ThrowIf(!buf, "Invalid embree buffer.");
+            *data = buf->GetData();
         }
+
+        //buffers live in host memory, the map completes with the queries submitted before it
+        Submit([]() {}, nullptr, event);
+    }
+
+    void EmbreeIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        Submit([]() {}, nullptr, event);
+    }
+
+    void EmbreeIntersectionDevice::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        EmbreeBuffer* srcbuf = dynamic_cast<EmbreeBuffer*>(const_cast<Buffer*>(src));
+        EmbreeBuffer* dstbuf = dynamic_cast<EmbreeBuffer*>(dst);
+        ThrowIf(!srcbuf || !dstbuf, "Invalid embree buffer.");
+
+        //copies are ordered with the queries, so a query result can feed the next query
+        Submit([srcbuf, dstbuf, srcoffset, dstoffset, size]()
+        {
+            memcpy(static_cast<char*>(dstbuf->GetData()) + dstoffset, static_cast<char*>(srcbuf->GetData()) + srcoffset, size);
+        }, nullptr, event);
     }
     
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    //spread the lower 10 bits of v so that there are 2 zero bits between them
+    static std::uint32_t ExpandBits(std::uint32_t v)
     {
-        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
-        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]() 
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcIntersect
-            //3. convert RTCRay hit result to RadeonRays::Intersection
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+    //order of the rays of a chunk: by direction octant, then by 30 bit Morton code of the origin
+    //within the chunk's origin bounds, inactive rays go last
+    static void SortChunk(const ray* rays, int count, std::vector<int>& order)
+    {
+        float3 pmin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max());
+        float3 pmax = -pmin;
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i+=4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0,}; //disable all rays
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i+j]);
-                        }
-                        rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                            FillIntersection(hit[i+j], data, j);
-                    }
-                }))));
-            }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        for (int i = 0; i < count; ++i)
+        {
+            if (!rays[i].IsActive())
+                continue;
+
+            pmin = vmin(pmin, rays[i].o);
+            pmax = vmax(pmax, rays[i].o);
+        }
+
+        float3 const extent = pmax - pmin;
+        float3 const scale(extent.x > 0.f ? 1023.f / extent.x : 0.f, extent.y > 0.f ? 1023.f / extent.y : 0.f, extent.z > 0.f ? 1023.f / extent.z : 0.f);
+
+        //octant in the top 3 bits, Morton code below it and the ray index in the lower 31 bits
+        thread_local std::vector<std::uint64_t> keys;
+        keys.resize(count);
+
+        for (int i = 0; i < count; ++i)
+        {
+            ray const& r = rays[i];
+            std::uint64_t key = ~0ull << 31;
+
+            if (r.IsActive())
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                std::uint32_t const octant = (r.d.x < 0.f ? 1u : 0u) | (r.d.y < 0.f ? 2u : 0u) | (r.d.z < 0.f ? 4u : 0u);
+                std::uint32_t const x = static_cast<std::uint32_t>((r.o.x - pmin.x) * scale.x);
+                std::uint32_t const y = static_cast<std::uint32_t>((r.o.y - pmin.y) * scale.y);
+                std::uint32_t const z = static_cast<std::uint32_t>((r.o.z - pmin.z) * scale.z);
+                std::uint32_t const morton = (ExpandBits(x) << 2) | (ExpandBits(y) << 1) | ExpandBits(z);
+                key = (static_cast<std::uint64_t>(octant) << 61) | (static_cast<std::uint64_t>(morton) << 31);
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcIntersectN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* src_hit = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
 
-                jobs.push_back(std::move(m_pool.submit([this, hit, src_hit, src_ray, count]()
-                {
-                    for (int i = 0; i < count; ++i)
-                        if (src_ray[i].IsActive())
-                        {
-                            FillIntersection(hit[i], src_hit[i]);
-                        }
-                })));
+            keys[i] = key | static_cast<std::uint64_t>(i);
+        }
+
+        std::sort(keys.begin(), keys.end());
+
+        order.resize(count);
+        for (int i = 0; i < count; ++i)
+            order[i] = static_cast<int>(keys[i] & 0x7FFFFFFFu);
+    }
+
+    void EmbreeIntersectionDevice::IntersectChunk(const ray* rays, Intersection* hits, int count, TraversalMode mode, bool sort) const
+    {
+        if (sort)
+        {
+            //hits of inactive rays are left untouched, so they are gathered along with the rays
+            thread_local std::vector<int> order;
+            thread_local std::vector<ray> sorted_rays;
+            thread_local std::vector<Intersection> sorted_hits;
+            SortChunk(rays, count, order);
+
+            sorted_rays.resize(count);
+            sorted_hits.resize(count);
+            for (int i = 0; i < count; ++i)
+            {
+                sorted_rays[i] = rays[order[i]];
+                sorted_hits[i] = hits[order[i]];
             }
-            
-#endif // INTERSECTN
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+            IntersectChunk(&sorted_rays[0], &sorted_hits[0], count, mode, false);
 
-        if (event)
+            for (int i = 0; i < count; ++i)
+                hits[order[i]] = sorted_hits[i];
+            return;
+        }
+
+        switch (mode)
         {
-            *event = ev;
+        case kPacket16:
+            IntersectPackets<RTCRay16>(rays, hits, count);
+            break;
+        case kPacket8:
+            IntersectPackets<RTCRay8>(rays, hits, count);
+            break;
+        case kStream:
+            IntersectStream(rays, hits, count);
+            break;
+        default:
+            IntersectPackets<RTCRay4>(rays, hits, count);
+            break;
         }
-        else
+    }
+
+    void EmbreeIntersectionDevice::OccludeChunk(const ray* rays, int* hits, int count, TraversalMode mode, bool sort) const
+    {
+        if (sort)
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            thread_local std::vector<int> order;
+            thread_local std::vector<ray> sorted_rays;
+            thread_local std::vector<int> sorted_hits;
+            SortChunk(rays, count, order);
+
+            sorted_rays.resize(count);
+            sorted_hits.resize(count);
+            for (int i = 0; i < count; ++i)
+            {
+                sorted_rays[i] = rays[order[i]];
+                sorted_hits[i] = hits[order[i]];
+            }
+
+            OccludeChunk(&sorted_rays[0], &sorted_hits[0], count, mode, false);
+
+            for (int i = 0; i < count; ++i)
+                hits[order[i]] = sorted_hits[i];
+            return;
+        }
+
+        switch (mode)
+        {
+        case kPacket16:
+            OccludePackets<RTCRay16>(rays, hits, count);
+            break;
+        case kPacket8:
+            OccludePackets<RTCRay8>(rays, hits, count);
+            break;
+        case kStream:
+            OccludeStream(rays, hits, count);
+            break;
+        default:
+            OccludePackets<RTCRay4>(rays, hits, count);
+            break;
         }
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::Intersect(const ray* rays, Intersection* hits, int numrays) const
     {
-        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
-        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+        int const chunk = m_chunk_size;
+        TraversalMode const mode = m_mode;
+        bool const sort = m_sort_rays;
+        int const numtasks = (numrays + chunk - 1) / chunk;
+
+        //each task converts its chunk of rays, traces it
+        //and writes hits straight into the output
+        parallel_for(*m_scheduler, 0, numtasks, 1, [this, rays, hits, numrays, chunk, mode, sort](int task)
+        {
+            int const i = task * chunk;
+            int count = (i + chunk) < numrays ? chunk : numrays - i;
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]()
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcOccluded
-            //3. convert RTCRay hit result
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
-            {
+            IntersectChunk(rays + i, hits + i, count, mode, sort);
+        });
+    }
 
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+    void EmbreeIntersectionDevice::Occlude(const ray* rays, int* hits, int numrays) const
+    {
+        int const chunk = m_chunk_size;
+        TraversalMode const mode = m_mode;
+        bool const sort = m_sort_rays;
+        int const numtasks = (numrays + chunk - 1) / chunk;
+
+        //each task converts its chunk of rays, traces it
+        //and writes results straight into the output
+        parallel_for(*m_scheduler, 0, numtasks, 1, [this, rays, hits, numrays, chunk, mode, sort](int task)
+        {
+            int const i = task * chunk;
+            int count = (i + chunk) < numrays ? chunk : numrays - i;
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i += 4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0, }; //disable all rays
-                        for (int j = 0; j < 4; ++j)
-                        {
-                            data.orgx[j] = 0;
-                            data.orgy[j] = 0;
-                            data.orgz[j] = 0;
-
-                            data.dirx[j] = 0;
-                            data.diry[j] = 0;
-                            data.dirz[j] = 0;
-
-                            data.tnear[j] = 0;
-                            data.tfar[j] = 0;
-                            data.geomID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.primID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.instID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.time[j] = 0;
-                            data.mask[j] = 0xFFFFFF;
-                        }
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i + j]);
-                        }
-                        rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
-                            {
-                                hit[i + j] = RTC_INVALID_GEOMETRY_ID;
-                                continue;
-                            }
-                            hit[i + j] = data.instID[j];
-                            EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i + j]));
-                            hit[i + j] = data->mesh_id;
-                        }
-                    }
-                }))));
+            OccludeChunk(rays + i, hits + i, count, mode, sort);
+        });
+    }
+
+    //"soa" layouts: plane k holds word k of every ray or hit struct, planes are numrays elements long
+    static void GatherWords(const std::uint32_t* planes, int numrays, int first, int count, int numwords, std::uint32_t* dst)
+    {
+        for (int j = 0; j < count; ++j)
+            for (int k = 0; k < numwords; ++k)
+                dst[j * numwords + k] = planes[k * numrays + first + j];
+    }
+
+    //closest hit planes are shape IDs, primitive IDs, u, v and hit distances
+    static int const kSoaHitWords[] = { 0, 1, 4, 5, 7 };
+
+    void EmbreeIntersectionDevice::Trace(QueryType type, const void* rays, void* hits, int numrays) const
+    {
+        bool const soa_hits = m_soa_hits && type != kQueryOcclusion;
+
+        if (!m_soa_rays && !soa_hits)
+        {
+            if (type == kQueryOcclusion)
+                Occlude(static_cast<const ray*>(rays), static_cast<int*>(hits), numrays);
+            else
+                Intersect(static_cast<const ray*>(rays), static_cast<Intersection*>(hits), numrays);
+            return;
+        }
+
+        int const chunk = m_chunk_size;
+        TraversalMode const mode = m_mode;
+        bool const sort = m_sort_rays;
+        bool const soa_rays = m_soa_rays;
+        int const numtasks = (numrays + chunk - 1) / chunk;
+
+        //each task transposes its chunk into structs, traces it and transposes the hits back
+        parallel_for(*m_scheduler, 0, numtasks, 1, [this, type, rays, hits, numrays, chunk, mode, sort, soa_rays, soa_hits](int task)
+        {
+            int const i = task * chunk;
+            int count = (i + chunk) < numrays ? chunk : numrays - i;
+
+            thread_local std::vector<ray> chunk_rays;
+            thread_local std::vector<Intersection> chunk_hits;
+
+            const ray* r = static_cast<const ray*>(rays) + i;
+            if (soa_rays)
+            {
+                int const numwords = sizeof(ray) / sizeof(std::uint32_t);
+                chunk_rays.resize(count);
+                GatherWords(static_cast<const std::uint32_t*>(rays), numrays, i, count, numwords, reinterpret_cast<std::uint32_t*>(&chunk_rays[0]));
+                r = &chunk_rays[0];
             }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+
+            if (type == kQueryOcclusion)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                OccludeChunk(r, static_cast<int*>(hits) + i, count, mode, sort);
+                return;
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcOccludedN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+
+            if (!soa_hits)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                RTCRay* hit_src = &data[i];
-                jobs.push_back(std::move(m_pool.submit([this, hit, hit_src, src_ray, count]()
-                {
-                    for (int i = 0; i < count; ++i)
-                    {
-                        if (hit_src[i].instID == RTC_INVALID_GEOMETRY_ID || hit_src[i].geomID == RTC_INVALID_GEOMETRY_ID)
-                        {
-                            hit[i] = RTC_INVALID_GEOMETRY_ID;
-                            continue;
-                        }
-                        hit[i] = hit_src[i].instID;
-                        EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i]));
-                        hit[i] = data->mesh_id;
-                    }
-                })));
+                IntersectChunk(r, static_cast<Intersection*>(hits) + i, count, mode, sort);
+                return;
             }
-#endif // INTERSECTN
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
+            //hits of inactive rays are left untouched, so the current values are read first
+            auto planes = static_cast<std::uint32_t*>(hits);
+            int const numwords = sizeof(Intersection) / sizeof(std::uint32_t);
+            int const numplanes = sizeof(kSoaHitWords) / sizeof(kSoaHitWords[0]);
+
+            chunk_hits.resize(count);
+            auto words = reinterpret_cast<std::uint32_t*>(&chunk_hits[0]);
+
+            for (int j = 0; j < count; ++j)
+                for (int k = 0; k < numplanes; ++k)
+                    words[j * numwords + kSoaHitWords[k]] = planes[k * numrays + i + j];
+
+            IntersectChunk(r, &chunk_hits[0], count, mode, sort);
+
+            for (int j = 0; j < count; ++j)
+                for (int k = 0; k < numplanes; ++k)
+                    planes[k * numrays + i + j] = words[j * numwords + kSoaHitWords[k]];
         });
+    }
 
-        if (event)
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        Submit([this, fireRays, fireHits, numrays]()
         {
-            *event = ev;
-        }
-        else
+            Trace(kQueryIntersection, fireRays->GetData(), fireHits->GetData(), numrays);
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        Submit([this, fireRays, fireHits, numrays]()
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            Trace(kQueryOcclusion, fireRays->GetData(), fireHits->GetData(), numrays);
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const
+    {
+        //host memory is traced in place
+        Intersect(rays, hits, numrays);
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const
+    {
+        Occlude(rays, hits, numrays);
+    }
+
+    void EmbreeIntersectionDevice::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
+    {
+        ThrowIf(numqueries <= 0, "Query batch is empty");
+
+        // The whole batch is traced by a single job
+        std::vector<std::function<void()>> jobs;
+        for (int i = 0; i < numqueries; ++i)
+        {
+            const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(queries[i].rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+            EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(queries[i].hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+            int numrays = queries[i].numrays;
+
+            QueryType type = queries[i].type;
+            jobs.push_back([this, type, fireRays, fireHits, numrays]()
+            {
+                Trace(type, fireRays->GetData(), fireHits->GetData(), numrays);
+            });
         }
+
+        Submit([jobs]()
+        {
+            for (auto const& job : jobs)
+                job();
+        }, waitevent, event);
+    }
+
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        // A closest hit is a valid result of any hit rays too
+        QueryIntersection(rays, numrays, hits, waitevent, event, queue);
+    }
+
+    void EmbreeIntersectionDevice::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
+    }
+
+    void EmbreeIntersectionDevice::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Not implemented for embree device.");
     }
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::SetHitFilterData(Buffer const* data)
     {
         Throw("Not implemented for embree device.");
     }
 
-    void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
     {
         Throw("Not implemented for embree device.");
     }
 
-    RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const RadeonRays::Mesh* mesh)
+    void EmbreeIntersectionDevice::SetHitHints(Buffer const* hits)
+    {
+        // Hints are an optimization of OpenCL traversal only
+    }
+
+    RTCScene EmbreeIntersectionDevice::AcquireEmbreeMesh(const RadeonRays::Mesh* mesh)
+    {
+        EmbreeMesh& data = m_meshes[mesh];
+        if (!data.scene)
+        {
+            data.scene = CreateEmbreeMesh(mesh, m_refit);
+            data.deformable = m_refit;
+        }
+
+        ++data.instance_count;
+        return data.scene;
+    }
+
+    void EmbreeIntersectionDevice::ReleaseEmbreeMesh(const RadeonRays::Mesh* mesh, std::vector<RTCScene>& retired)
+    {
+        auto it = m_meshes.find(mesh);
+        ThrowIf(it == m_meshes.end() || it->second.instance_count <= 0, "Invalid embree mesh");
+
+        //if no instances left => clear stored mesh
+        if (--it->second.instance_count == 0)
+        {
+            retired.push_back(it->second.scene);
+            m_meshes.erase(it);
+        }
+    }
+
+    RTCScene EmbreeIntersectionDevice::CreateEmbreeMesh(const RadeonRays::Mesh* mesh, bool deformable)
     {
-        if (m_meshes.count(mesh))
-            return m_meshes[mesh].scene;
-        RTCScene result = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        //deformable meshes are refitted on vertex updates instead of being rebuilt
+        RTCScene result = rtcDeviceNewScene(m_device, static_cast<RTCSceneFlags>(deformable ? RTC_SCENE_DYNAMIC | m_common_flags : m_mesh_flags), RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
         CheckEmbreeError();
         ThrowIf(!mesh->puretriangle(), "Only triangle meshes supported by now.");
 
-        unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
-        CheckEmbreeError();
-        
-        const float3* kMeshVerts = mesh->GetVertexData();
-        float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
+        unsigned id = rtcNewTriangleMesh(result, deformable ? RTC_GEOMETRY_DEFORMABLE : RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
         CheckEmbreeError();
-        ThrowIf(!verts, "Failed to map embree buffer.");
-        for (int i = 0; i < mesh->num_vertices(); ++i)
-        {
-            verts[4 * i] = kMeshVerts[i].x;
-            verts[4 * i + 1] = kMeshVerts[i].y;
-            verts[4 * i + 2] = kMeshVerts[i].z;
-            verts[4 * i + 3] = kMeshVerts[i].w;
-        }
-        rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
+
+        CopyVertices(result, id, mesh, nullptr);
 
         int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
         for (int i = 0; i < mesh->num_faces(); ++i)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            const Mesh::Face kFace = mesh->GetFace(i);
+            indices[3 * i] = kFace.i0;
+            indices[3 * i + 1] = kFace.i1;
+            indices[3 * i + 2] = kFace.i2;
         }
         rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
-        rtcCommit(result);
 
-        m_meshes[mesh].scene = result;
-        m_meshes[mesh].instance_count = 1;
+        //committed with m_scene
+        m_pending.push_back(result);
 
         return result;
     }
 
-    void EmbreeIntersectionDevice::UpdateShape(const RadeonRays::ShapeImpl* shape)
+    void EmbreeIntersectionDevice::UpdateEmbreeMeshVertices(const RadeonRays::Mesh* mesh, std::vector<RTCScene>& retired)
+    {
+        EmbreeMesh& data = m_meshes[mesh];
+
+        //first update of a static mesh: switch it to a deformable scene,
+        //the old one is still instanced until the instances are recreated
+        if (!data.deformable)
+        {
+            retired.push_back(data.scene);
+            data.scene = CreateEmbreeMesh(mesh, true);
+            data.deformable = true;
+            return;
+        }
+
+        // each mesh scene holds a single geometry
+        unsigned id = 0;
+
+        CopyVertices(data.scene, id, mesh, nullptr);
+        rtcUpdateBuffer(data.scene, id, RTC_VERTEX_BUFFER);
+        CheckEmbreeError();
+        m_pending.push_back(data.scene);
+    }
+
+    void EmbreeIntersectionDevice::CopyVertices(RTCScene scene, unsigned geom, const RadeonRays::Mesh* mesh, const matrix* transform)
+    {
+        float* verts = static_cast<float*>(rtcMapBuffer(scene, geom, RTC_VERTEX_BUFFER));
+        CheckEmbreeError();
+        ThrowIf(!verts, "Failed to map embree buffer.");
+        for (int i = 0; i < mesh->num_vertices(); ++i)
+        {
+            const float3 kVertex = transform ? transform_point(mesh->GetVertex(i), *transform) : mesh->GetVertex(i);
+            verts[4 * i] = kVertex.x;
+            verts[4 * i + 1] = kVertex.y;
+            verts[4 * i + 2] = kVertex.z;
+            verts[4 * i + 3] = kVertex.w;
+        }
+        rtcUnmapBuffer(scene, geom, RTC_VERTEX_BUFFER);
+        CheckEmbreeError();
+    }
+
+    bool EmbreeIntersectionDevice::UpdateShape(const RadeonRays::ShapeImpl* shape)
     {
-        const EmbreeSceneData& data = m_instances[shape];
+        EmbreeSceneData& data = m_instances[shape];
         int state = shape->GetStateChange();
+        //vertices of a direct mesh instance are updated through its base mesh
+        if (data.direct)
+            state |= data.mesh->GetStateChange() & ShapeImpl::kStateChangeVertices;
         if (state == ShapeImpl::kStateChangeNone)
-            return;
+            return false;
 
+        bool changed = false;
         if (state & ShapeImpl::kStateChangeMask)
         {
             rtcSetMask(m_scene, data.geom, shape->GetMask());
             CheckEmbreeError();
+            changed = true;
+        }
+        if (data.direct && (state & (ShapeImpl::kStateChangeTransform | ShapeImpl::kStateChangeVertices)))
+        {
+            //transform is baked into the vertices
+            UpdateDirectMesh(shape, data);
+            changed = true;
         }
-        if (state & ShapeImpl::kStateChangeTransform)
+        else if (state & ShapeImpl::kStateChangeTransform)
         {
             matrix trans, transInv;
             shape->GetTransform(trans, transInv);
             rtcSetTransform(m_scene, data.geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
             CheckEmbreeError();
+            changed = true;
         }
         if (state & ShapeImpl::kStateChangeId)
         {
-            m_instances[shape].mesh_id = shape->GetId();
+            //ids are read through geometry user data, no commit needed
+            data.mesh_id = shape->GetId();
         }
 
-        ThrowIf((state & ShapeImpl::kStateChangeMotion) ? true : false, "Not implemented for embree device");
+        //motion is not supported by embree device and is ignored
+        return changed;
     }
 
     void EmbreeIntersectionDevice::FillRTCRay(RTCRay& dst, const ray& src) const
@@ -586,7 +1238,8 @@ namespace RadeonRays
         dst.mask = src.GetMask();
     }
 
-    void EmbreeIntersectionDevice::FillRTCRay(RTCRay4& dst, int i, const ray& src) const
+    template <typename RTCRayN>
+    void EmbreeIntersectionDevice::FillRTCRay(RTCRayN& dst, int i, const ray& src) const
     {
         dst.orgx[i] = src.o.x;
         dst.orgy[i] = src.o.y;
@@ -605,10 +1258,128 @@ namespace RadeonRays
         dst.mask[i] = src.GetMask();
     }
 
+    template <typename RTCRayN>
+    void EmbreeIntersectionDevice::ClearRTCRay(RTCRayN& dst, int i) const
+    {
+        dst.orgx[i] = 0;
+        dst.orgy[i] = 0;
+        dst.orgz[i] = 0;
+
+        dst.dirx[i] = 0;
+        dst.diry[i] = 0;
+        dst.dirz[i] = 0;
+
+        dst.tnear[i] = 0;
+        dst.tfar[i] = 0;
+        dst.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.primID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.instID[i] = RTC_INVALID_GEOMETRY_ID;
+        dst.time[i] = 0;
+        dst.mask[i] = 0xFFFFFF;
+    }
+
+    template <typename RTCRayN>
+    void EmbreeIntersectionDevice::IntersectPackets(const ray* rays, Intersection* hits, int count) const
+    {
+        int const N = EmbreePacket<RTCRayN>::size;
+
+        RTCRayN data;
+        for (int i = 0; i < count; i += N)
+        {
+            int rays_count = (i + N) < count ? N : count - i; // count of valid rays
+            RTCORE_ALIGN(64) int valid[N] = {}; //disable all rays
+            for (int j = 0; j < rays_count; ++j)
+            {
+                valid[j] = rays[i + j].IsActive() ? -1 : 0;
+                FillRTCRay(data, j, rays[i + j]);
+            }
+            EmbreePacket<RTCRayN>::Intersect(valid, m_scene, data); CheckEmbreeError();
+            for (int j = 0; j < rays_count; ++j)
+                FillIntersection(hits[i + j], data, j);
+        }
+    }
+
+    template <typename RTCRayN>
+    void EmbreeIntersectionDevice::OccludePackets(const ray* rays, int* hits, int count) const
+    {
+        int const N = EmbreePacket<RTCRayN>::size;
+
+        RTCRayN data;
+        for (int i = 0; i < count; i += N)
+        {
+            int rays_count = (i + N) < count ? N : count - i; // count of valid rays
+            RTCORE_ALIGN(64) int valid[N] = {}; //disable all rays
+            for (int j = rays_count; j < N; ++j)
+            {
+                ClearRTCRay(data, j);
+            }
+            for (int j = 0; j < rays_count; ++j)
+            {
+                valid[j] = rays[i + j].IsActive() ? -1 : 0;
+                FillRTCRay(data, j, rays[i + j]);
+            }
+            EmbreePacket<RTCRayN>::Occluded(valid, m_scene, data); CheckEmbreeError();
+            for (int j = 0; j < rays_count; ++j)
+            {
+                if (data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
+                {
+                    hits[i + j] = RTC_INVALID_GEOMETRY_ID;
+                    continue;
+                }
+                const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, data.instID[j]));
+                hits[i + j] = kData->mesh_id;
+            }
+        }
+    }
+
+    void EmbreeIntersectionDevice::IntersectStream(const ray* rays, Intersection* hits, int count) const
+    {
+        //per thread staging area, reused by all the chunks the thread picks up
+        thread_local std::vector<RTCRay> data;
+        data.resize(count);
+
+        for (int i = 0; i < count; ++i)
+            FillRTCRay(data[i], rays[i]);
+
+        rtcIntersectN(m_scene, &data[0], count, sizeof(RTCRay));
+        CheckEmbreeError();
+
+        for (int i = 0; i < count; ++i)
+            if (rays[i].IsActive())
+            {
+                FillIntersection(hits[i], data[i]);
+            }
+    }
+
+    void EmbreeIntersectionDevice::OccludeStream(const ray* rays, int* hits, int count) const
+    {
+        //per thread staging area, reused by all the chunks the thread picks up
+        thread_local std::vector<RTCRay> data;
+        data.resize(count);
+
+        for (int i = 0; i < count; ++i)
+            FillRTCRay(data[i], rays[i]);
+
+        rtcOccludedN(m_scene, &data[0], count, sizeof(RTCRay));
+        CheckEmbreeError();
+
+        for (int i = 0; i < count; ++i)
+        {
+            if (data[i].geomID == RTC_INVALID_GEOMETRY_ID)
+            {
+                hits[i] = RTC_INVALID_GEOMETRY_ID;
+                continue;
+            }
+            const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, data[i].instID));
+            hits[i] = kData->mesh_id;
+        }
+    }
+
 
     void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay& src) const
     {
-        dst.shapeid = src.instID;
+        //direct meshes are hit without instance
+        dst.shapeid = src.instID != RTC_INVALID_GEOMETRY_ID ? src.instID : src.geomID;
         if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
         {
             const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
@@ -621,9 +1392,10 @@ namespace RadeonRays
         dst.uvwt.z = 0;
         dst.uvwt.w = src.tfar;
     }
-    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay4& src, int i) const
+    template <typename RTCRayN>
+    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRayN& src, int i) const
     {
-        dst.shapeid = src.instID[i];
+        dst.shapeid = src.instID[i] != RTC_INVALID_GEOMETRY_ID ? src.instID[i] : src.geomID[i];
         if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
         {
             const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
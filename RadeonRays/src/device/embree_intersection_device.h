@@ -23,9 +23,14 @@ THE SOFTWARE.
 
 #include "intersection_device.h"
 #include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <functional>
 
 #include <embree2/rtcore.h>
-#include "../async/thread_pool.h"
+#include "../async/task_scheduler.h"
 
 namespace RadeonRays
 {
@@ -38,30 +43,98 @@ namespace RadeonRays
     class EmbreeIntersectionDevice : public IntersectionDevice
     {
     public:
+        // How rays are handed over to embree
+        enum TraversalMode
+        {
+            kPacket4,
+            kPacket8,
+            kPacket16,
+            kStream
+        };
+
         //
         EmbreeIntersectionDevice();
         ~EmbreeIntersectionDevice();
 
         //IntersectionDevice
         void Preprocess(World const& world) override;
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
+        int GetQueueCount() const override;
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const override;
         void DeleteBuffer(Buffer* const) const override;
         void DeleteEvent(Event* const) const override;
-        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
-        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
-        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
-        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
-        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
-        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        Event* CreateReusableEvent() const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const override;
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const override;
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void SetHitFilterData(Buffer const* data) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+        void SetHitHints(Buffer const* hits) override;
     
     protected:
-        RTCScene GetEmbreeMesh(const Mesh*);
-        void UpdateShape(const ShapeImpl*);
+        struct EmbreeSceneData;
+
+        // Get the embree scene of a mesh creating it on first use and add a reference
+        RTCScene AcquireEmbreeMesh(const Mesh*);
+        // Drop a reference, the scene is retired with the last one
+        void ReleaseEmbreeMesh(const Mesh*, std::vector<RTCScene>& retired);
+        RTCScene CreateEmbreeMesh(const Mesh*, bool deformable);
+        void UpdateEmbreeMeshVertices(const Mesh*, std::vector<RTCScene>& retired);
+        // Copy mesh vertices to an embree geometry, transformed if transform is not nullptr
+        void CopyVertices(RTCScene scene, unsigned geom, const Mesh*, const matrix* transform);
+        void AddInstance(const ShapeImpl*, EmbreeSceneData&);
+        // Add the triangles of a single use mesh to m_scene with the shape transform baked in
+        void AddDirectMesh(const ShapeImpl*, EmbreeSceneData&, bool deformable);
+        // Rebake vertices of a direct mesh after a vertex or transform change
+        void UpdateDirectMesh(const ShapeImpl*, EmbreeSceneData&);
+        // Delete the geometry of a shape from m_scene and release its mesh scene
+        void RemoveShape(EmbreeSceneData&, std::vector<RTCScene>& retired);
+        // Returns true if m_scene needs a commit
+        bool UpdateShape(const ShapeImpl*);
         void FillRTCRay(RTCRay& dst, const ray& src) const;
-        void FillRTCRay(RTCRay4& dst, int i, const ray& src) const;
+        template <typename RTCRayN> void FillRTCRay(RTCRayN& dst, int i, const ray& src) const;
+        template <typename RTCRayN> void ClearRTCRay(RTCRayN& dst, int i) const;
         void FillIntersection(Intersection& dst, const RTCRay& src) const;
-        void FillIntersection(Intersection& dst, const RTCRay4& src, int i) const;
+        template <typename RTCRayN> void FillIntersection(Intersection& dst, const RTCRayN& src, int i) const;
+        // Trace a chunk of rays in RTCRay4/8/16 packets
+        template <typename RTCRayN> void IntersectPackets(const ray* rays, Intersection* hits, int count) const;
+        template <typename RTCRayN> void OccludePackets(const ray* rays, int* hits, int count) const;
+        // Trace a chunk of rays with rtcIntersectN/rtcOccludedN
+        void IntersectStream(const ray* rays, Intersection* hits, int count) const;
+        void OccludeStream(const ray* rays, int* hits, int count) const;
+        // Trace a chunk of rays in the given mode, coherent rays are packed together if sort is set
+        void IntersectChunk(const ray* rays, Intersection* hits, int count, TraversalMode mode, bool sort) const;
+        void OccludeChunk(const ray* rays, int* hits, int count, TraversalMode mode, bool sort) const;
+        // Trace rays in scheduler tasks of m_chunk_size rays
+        void Intersect(const ray* rays, Intersection* hits, int numrays) const;
+        void Occlude(const ray* rays, int* hits, int numrays) const;
+        // Trace rays of a buffer query in the layouts set by "acc.ray_format" and "acc.hit_format"
+        void Trace(QueryType type, const void* rays, void* hits, int numrays) const;
         void CheckEmbreeError() const;
+        // Run a job on its own thread after the wait event and all the jobs submitted before it,
+        // hand its event over or wait for it if event is nullptr
+        void Submit(std::function<void()>&& job, Event const* waitevent, Event** event) const;
+        // Wait for all submitted jobs
+        void Finish() const;
         
         // embree device
         RTCDevice m_device;
@@ -69,13 +142,50 @@ namespace RadeonRays
         // scene for intersection
         RTCScene m_scene; 
 
-        //thread pool for parallelizing work with buffers
-        mutable thread_pool<void> m_pool;
+        //work stealing scheduler for parallelizing work with buffers
+        std::unique_ptr<task_scheduler> m_scheduler;
+
+        //worker count requested by "embree.num_threads" (0 - all hardware threads)
+        int m_num_threads;
+
+        //rays converted and traced by a single scheduler task
+        int m_chunk_size;
+
+        //widest packet supported by the CPU and the mode used for queries
+        TraversalMode m_native_mode;
+        TraversalMode m_mode;
+
+        //chunks are reordered by direction octant and origin before tracing ("embree.sort_rays")
+        bool m_sort_rays;
+
+        //flags of static mesh scenes ("embree.build_quality") and flags of all the scenes
+        //("embree.compact", "embree.robust"), scenes are recreated when they change
+        int m_mesh_flags;
+        int m_common_flags;
+
+        //mesh scenes and direct geometries are deformable from the start ("refit" build quality)
+        bool m_refit;
+
+        //mesh scenes created or refitted since the last commit, they are committed
+        //concurrently on the scheduler workers before m_scene
+        std::vector<RTCScene> m_pending;
+
+        //buffer queries read rays and write closest hits in planes ("soa" formats)
+        bool m_soa_rays;
+        bool m_soa_hits;
+
+        //last submitted job, the next one starts after it completes
+        mutable std::shared_future<void> m_last_job;
+        mutable std::mutex m_job_mutex;
+
+        //statistics of the latest Preprocess call (embree only reports scene build time)
+        CommitStatistics m_stats;
 
         struct EmbreeMesh
         {
             RTCScene scene = nullptr; // scene with mesh geometry
             int instance_count = 0; //instances of the mesh
+            bool deformable = false; //scene is refitted on vertex updates
         };
 
 
@@ -83,19 +193,25 @@ namespace RadeonRays
         {
             EmbreeSceneData()
                 : scene(nullptr)
+                , mesh(nullptr)
                 , mesh_id(kNullId)
                 , geom(RTC_INVALID_GEOMETRY_ID)
                 , updated(false)
+                , direct(false)
+                , deformable(false)
             {}
-            RTCScene scene; //instantiated scene
+            RTCScene scene; //instantiated scene, nullptr for direct meshes
+            const Mesh* mesh; //mesh the instantiated scene is built from
             Id mesh_id; //FireRays::Shape id
             unsigned geom; //embree geometry id
             bool updated;  //shows is data updated through last IntersectionDevice::Preprocess call
+            bool direct; //mesh triangles are placed in m_scene with the transform baked in
+            bool deformable; //direct geometry is refitted on vertex updates
         };
 
         //used for synchronization embree and FireRays::Shape ids
-        std::map<const Shape*, EmbreeSceneData> m_instances; //scenes to instantiate
-        std::map<const Shape*, EmbreeMesh> m_meshes; // contains all original embree meshes. Any geometry used in m_scene is an instance.
+        std::map<const Shape*, EmbreeSceneData> m_instances; //geometries of m_scene
+        std::map<const Shape*, EmbreeMesh> m_meshes; // embree scenes of meshes used by several shapes, m_scene instances them. Meshes used by a single shape are placed in m_scene directly.
     };
 }
 
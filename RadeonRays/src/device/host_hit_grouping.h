@@ -0,0 +1,64 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef HOST_HIT_GROUPING_H
+#define HOST_HIT_GROUPING_H
+
+#include "radeon_rays.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace RadeonRays
+{
+    // GroupHits of devices with buffers in host memory: count hits ordered by the key of their shape
+    // with misses last, then indices of the rest of maxrays entries. outkeys might be nullptr.
+    inline void GroupHitsOnHost(Intersection const* hits, int count, int maxrays, int const* shapekeys, int numkeys, int* outindices, int* outkeys)
+    {
+        count = std::max(std::min(count, maxrays), 0);
+
+        // Misses and shapes without a key map to kNullId, the largest key when compared as unsigned
+        std::vector<std::pair<std::uint32_t, int> > entries(count);
+        for (int i = 0; i < count; ++i)
+        {
+            int const id = hits[i].shapeid;
+            int key = id;
+            if (shapekeys)
+                key = id >= 0 && id < numkeys ? shapekeys[id] : kNullId;
+
+            entries[i] = std::make_pair(static_cast<std::uint32_t>(key), i);
+        }
+
+        std::stable_sort(entries.begin(), entries.end(),
+            [](std::pair<std::uint32_t, int> const& a, std::pair<std::uint32_t, int> const& b) { return a.first < b.first; });
+
+        for (int i = 0; i < maxrays; ++i)
+        {
+            outindices[i] = i < count ? entries[i].second : i;
+            if (outkeys)
+                outkeys[i] = i < count ? static_cast<int>(entries[i].first) : kNullId;
+        }
+    }
+}
+
+#endif // HOST_HIT_GROUPING_H
@@ -0,0 +1,984 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "hybrid_intersection_device.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <numeric>
+#include <thread>
+
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/curves.h"
+#include "../primitive/procedurals.h"
+#include "../primitive/instance.h"
+#include "../primitive/group.h"
+#include "math/mathutils.h"
+#include "../except/except.h"
+#include "event.h"
+#include "host_hit_grouping.h"
+#include "../async/task_scheduler.h"
+#include "../async/future_callback.h"
+
+namespace RadeonRays
+{
+    // Rays a device has to trace for its timing to update the throughput estimate
+    static int const kMinMeasuredRays = 1024;
+    // Fraction of the rays every device gets regardless of its throughput,
+    // keeps the estimates of slow devices up to date
+    static float const kMinShare = 0.125f;
+    // Upper bound of slices a device part is pipelined in
+    static int const kMaxSlices = 2;
+    // Smallest slice worth a queue of its own
+    static int const kMinSliceRays = 16384;
+
+    // Bounds of a shape without its own transform, instances are bounded by their base shape
+    static bbox GetObjectBounds(ShapeImpl const* shape)
+    {
+        bbox bounds;
+
+        if (shape->is_instance())
+        {
+            bounds = GetObjectBounds(static_cast<ShapeImpl const*>(static_cast<Instance const*>(shape)->GetBaseShape()));
+        }
+        else if (shape->is_group())
+        {
+            for (auto member : static_cast<Group const*>(shape)->GetShapes())
+            {
+                auto memberimpl = static_cast<ShapeImpl const*>(member);
+                bbox memberbounds = GetObjectBounds(memberimpl);
+
+                if (memberbounds.pmin.x <= memberbounds.pmax.x)
+                {
+                    matrix m, minv;
+                    memberimpl->GetTransform(m, minv);
+                    bounds.grow(transform_bbox(memberbounds, m));
+                }
+            }
+        }
+        else if (shape->is_curves())
+        {
+            auto curves = static_cast<Curves const*>(shape);
+            std::vector<bbox> segments(curves->num_segments());
+
+            if (!segments.empty())
+            {
+                curves->GetAllSegmentBounds(segments.data());
+            }
+
+            for (auto const& segment : segments)
+            {
+                bounds.grow(segment);
+            }
+        }
+        else if (shape->is_procedural())
+        {
+            auto procedurals = static_cast<Procedurals const*>(shape);
+            std::vector<bbox> prims(procedurals->num_primitives());
+
+            if (!prims.empty())
+            {
+                procedurals->GetAllPrimitiveBounds(prims.data());
+            }
+
+            for (auto const& prim : prims)
+            {
+                bounds.grow(prim);
+            }
+        }
+        else
+        {
+            auto mesh = static_cast<Mesh const*>(shape);
+
+            for (int i = 0; i < mesh->num_vertices(); ++i)
+            {
+                bounds.grow(mesh->GetVertex(i));
+            }
+        }
+
+        return bounds;
+    }
+
+    // Primitives of a shape as an estimate of the device memory it takes,
+    // instances count their base shape as it is uploaded along with them
+    static std::int64_t GetPrimitiveCount(ShapeImpl const* shape)
+    {
+        if (shape->is_instance())
+        {
+            return GetPrimitiveCount(static_cast<ShapeImpl const*>(static_cast<Instance const*>(shape)->GetBaseShape()));
+        }
+        else if (shape->is_group())
+        {
+            std::int64_t count = 0;
+            for (auto member : static_cast<Group const*>(shape)->GetShapes())
+            {
+                count += GetPrimitiveCount(static_cast<ShapeImpl const*>(member));
+            }
+
+            return count;
+        }
+        else if (shape->is_curves())
+        {
+            return static_cast<Curves const*>(shape)->num_segments();
+        }
+        else if (shape->is_procedural())
+        {
+            return static_cast<Procedurals const*>(shape)->num_primitives();
+        }
+
+        return static_cast<Mesh const*>(shape)->num_faces();
+    }
+
+    ///< Host memory buffer with per device staging copies
+    ///<
+    class HybridIntersectionDevice::HybridBuffer : public Buffer
+    {
+    public:
+        HybridBuffer(size_t size, void* init, size_t numslots)
+            : m_data(size)
+            , m_staging(numslots, nullptr)
+            , m_staging_size(numslots, 0)
+        {
+            if (init && size)
+                memcpy(&m_data[0], init, size);
+        }
+
+        char* GetData()
+        {
+            return m_data.empty() ? nullptr : &m_data[0];
+        }
+
+        char const* GetData() const
+        {
+            return m_data.empty() ? nullptr : &m_data[0];
+        }
+
+        // Get a device buffer of at least size bytes for a slot (device slice),
+        // reallocated on growth
+        Buffer* GetStaging(size_t idx, IntersectionDevice const& device, size_t size) const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_staging_size[idx] < size)
+            {
+                if (m_staging[idx])
+                    device.DeleteBuffer(m_staging[idx]);
+
+                m_staging[idx] = nullptr;
+                m_staging[idx] = device.CreateBuffer(size, nullptr);
+                m_staging_size[idx] = size;
+            }
+
+            return m_staging[idx];
+        }
+
+        // Release staging buffers, has to be called before destruction
+        void ReleaseStaging(std::vector<std::unique_ptr<IntersectionDevice> > const& devices)
+        {
+            for (auto i = 0U; i < m_staging.size(); ++i)
+            {
+                if (m_staging[i])
+                    devices[i / kMaxSlices]->DeleteBuffer(m_staging[i]);
+            }
+
+            m_staging.clear();
+            m_staging_size.clear();
+        }
+
+    private:
+        std::vector<char> m_data;
+        mutable std::vector<Buffer*> m_staging;
+        mutable std::vector<size_t> m_staging_size;
+        mutable std::mutex m_mutex;
+    };
+
+    ///< Event tracking a task running on a separate thread
+    ///<
+    class HybridEvent : public Event
+    {
+    public:
+        // Already completed event
+        HybridEvent()
+        {
+            std::promise<void> done;
+            done.set_value();
+            m_ftr = done.get_future().share();
+        }
+
+        explicit HybridEvent(std::function<void()>&& f)
+        {
+            std::packaged_task<void()> task(std::move(f));
+            m_ftr = task.get_future().share();
+            std::thread(std::move(task)).detach();
+        }
+
+        ~HybridEvent()
+        {
+            Wait();
+        }
+
+        bool Complete() const override
+        {
+            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        void Wait() override
+        {
+            m_ftr.wait();
+        }
+
+        void SetCompletionCallback(CompletionCallback callback, void* data) override
+        {
+            call_when_ready(m_ftr, this, callback, data);
+        }
+
+    private:
+        std::shared_future<void> m_ftr;
+    };
+
+    HybridIntersectionDevice::HybridIntersectionDevice(std::vector<IntersectionDevice*> const& devices)
+        : m_scheduler(new task_scheduler(static_cast<int>(devices.size())))
+        , m_throughput(devices.size(), 1.f)
+        , m_stats()
+    {
+        for (auto device : devices)
+        {
+            m_devices.emplace_back(device);
+        }
+
+        ThrowIf(m_devices.empty(), "Hybrid device needs at least one device");
+    }
+
+    HybridIntersectionDevice::~HybridIntersectionDevice()
+    {
+    }
+
+    void HybridIntersectionDevice::Preprocess(World const& world)
+    {
+        // Every device has to read and write the same layouts
+        auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+        auto rayformat = world.options_.GetOption(Options::kAccRayFormat);
+        auto occlusionformat = world.options_.GetOption(Options::kAccOcclusionFormat);
+        ThrowIf(hitformat && hitformat->AsString() != "full", "Hybrid device supports full hit format only");
+        ThrowIf(rayformat && rayformat->AsString() != "full", "Hybrid device supports full ray format only");
+        ThrowIf(occlusionformat && occlusionformat->AsString() != "int", "Hybrid device supports int occlusion format only");
+
+        auto partition = world.options_.GetOption(Options::kHybridPartition);
+        bool const partitioned = partition && partition->AsString() == "spatial";
+        ThrowIf(partition && !partitioned && partition->AsString() != "replicate", "Unknown hybrid.partition value");
+
+        // Devices which held a part of the scene have to rebuild for the whole scene
+        std::unique_ptr<World> replicated;
+        if (!partitioned && !m_partitions.empty())
+        {
+            replicated.reset(new World(world));
+            replicated->has_changed_ = true;
+        }
+
+        if (partitioned)
+        {
+            Partition(world);
+        }
+        else
+        {
+            m_partitions.clear();
+        }
+
+        m_stats = CommitStatistics();
+
+        bool first = true;
+        for (auto i = 0U; i < m_devices.size(); ++i)
+        {
+            // Devices without shapes are skipped by queries
+            if (partitioned && m_partitions[i]->shapes_.empty())
+            {
+                continue;
+            }
+
+            m_devices[i]->Preprocess(partitioned ? *m_partitions[i] : replicated ? *replicated : world);
+
+            CommitStatistics stats;
+            m_devices[i]->GetCommitStatistics(stats);
+
+            // Acceleration structure figures of the first device
+            if (first)
+            {
+                m_stats = stats;
+                first = false;
+            }
+            else
+            {
+                m_stats.bounds_time += stats.bounds_time;
+                m_stats.build_time += stats.build_time;
+                m_stats.translate_time += stats.translate_time;
+                m_stats.upload_time += stats.upload_time;
+                m_stats.compile_time += stats.compile_time;
+            }
+        }
+
+        // Changes are cleared once every device has seen them, as
+        // instances in different parts can share their base shape
+        for (auto& part : m_partitions)
+        {
+            part->OnCommit();
+        }
+    }
+
+    void HybridIntersectionDevice::Partition(World const& world)
+    {
+        int const numdevices = static_cast<int>(m_devices.size());
+        std::size_t const numshapes = world.shapes_.size();
+
+        // Shapes are ordered along the longest axis of their centers,
+        // bounds only steer the split so they can be loose
+        std::vector<float3> centers(numshapes);
+        std::vector<std::int64_t> costs(numshapes);
+        bbox centerbounds;
+        std::int64_t total = 0;
+
+        for (std::size_t i = 0; i < numshapes; ++i)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(world.shapes_[i]);
+            bbox bounds = GetObjectBounds(shapeimpl);
+
+            if (bounds.pmin.x <= bounds.pmax.x)
+            {
+                matrix m, minv;
+                shapeimpl->GetTransform(m, minv);
+                centers[i] = transform_bbox(bounds, m).center();
+            }
+
+            centerbounds.grow(centers[i]);
+            costs[i] = std::max<std::int64_t>(GetPrimitiveCount(shapeimpl), 1);
+            total += costs[i];
+        }
+
+        int const axis = numshapes > 0 ? centerbounds.maxdim() : 0;
+
+        std::vector<std::size_t> order(numshapes);
+        std::iota(order.begin(), order.end(), 0);
+        std::sort(order.begin(), order.end(), [&centers, axis](std::size_t a, std::size_t b)
+        {
+            return centers[a][axis] < centers[b][axis];
+        });
+
+        // Contiguous runs of similar primitive counts, a shape goes to the part its middle falls into
+        std::vector<int> assignment(numshapes);
+        std::int64_t acc = 0;
+        for (auto idx : order)
+        {
+            assignment[idx] = std::min(numdevices - 1, static_cast<int>((acc + costs[idx] / 2) * numdevices / total));
+            acc += costs[idx];
+        }
+
+        if (m_partitions.size() != m_devices.size())
+        {
+            m_partitions.clear();
+            for (int i = 0; i < numdevices; ++i)
+            {
+                m_partitions.emplace_back(new World());
+            }
+        }
+
+        for (int i = 0; i < numdevices; ++i)
+        {
+            World& part = *m_partitions[i];
+
+            // Shapes moved to other parts or detached, shapes attached since the last
+            // commit are attached again as they might reuse the address of a deleted shape
+            std::vector<Shape const*> detached;
+            for (auto shape : part.shapes_)
+            {
+                auto iter = world.shape_indices_.find(shape);
+                if (iter == world.shape_indices_.cend() || assignment[iter->second] != i || world.shapes_added_.count(shape))
+                {
+                    detached.push_back(shape);
+                }
+            }
+
+            for (auto shape : detached)
+            {
+                part.DetachShape(shape);
+            }
+
+            for (std::size_t j = 0; j < numshapes; ++j)
+            {
+                if (assignment[j] == i)
+                {
+                    part.AttachShape(world.shapes_[j]);
+                }
+            }
+
+            part.has_changed_ = part.has_changed_ || world.has_changed_;
+            part.hint_ = world.hint_;
+            part.options_ = world.options_;
+            part.bvh_snapshot_ = world.bvh_snapshot_;
+            part.ray_samples_ = world.ray_samples_;
+        }
+    }
+
+    void HybridIntersectionDevice::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        stats = m_stats;
+    }
+
+    void HybridIntersectionDevice::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        for (auto const& device : m_devices)
+        {
+            device->GetMemoryUsage(usage);
+        }
+    }
+
+    int HybridIntersectionDevice::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        // Queries are split between the devices, their kernel timings are not tracked
+        return 0;
+    }
+
+    int HybridIntersectionDevice::GetQueueCount() const
+    {
+        return 1;
+    }
+
+    Buffer* HybridIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new HybridBuffer(size, initdata, m_devices.size() * kMaxSlices);
+    }
+
+    void HybridIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        auto hybrid = static_cast<HybridBuffer*>(buffer);
+        hybrid->ReleaseStaging(m_devices);
+        delete hybrid;
+    }
+
+    void HybridIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    Event* HybridIntersectionDevice::CreateReusableEvent() const
+    {
+        Throw("Not implemented for hybrid device.");
+        return nullptr;
+    }
+
+    void HybridIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        auto hybrid = static_cast<HybridBuffer*>(buffer);
+        *data = hybrid->GetData() + offset;
+
+        if (event)
+        {
+            *event = new HybridEvent();
+        }
+    }
+
+    void HybridIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        if (event)
+        {
+            *event = new HybridEvent();
+        }
+    }
+
+    void HybridIntersectionDevice::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        auto hybrid_src = static_cast<HybridBuffer const*>(src);
+        auto hybrid_dst = static_cast<HybridBuffer*>(dst);
+
+        // Hybrid buffers live in host memory, devices only see them while tracing
+        Submit([hybrid_src, hybrid_dst, srcoffset, dstoffset, size]()
+        {
+            memcpy(hybrid_dst->GetData() + dstoffset, hybrid_src->GetData() + srcoffset, size);
+        }, nullptr, event);
+    }
+
+    void HybridIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_hits = static_cast<HybridBuffer*>(hits);
+
+        Submit([this, hybrid_rays, numrays, hybrid_hits]()
+        {
+            Query(kQueryIntersection, hybrid_rays, numrays, hybrid_hits);
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_hits = static_cast<HybridBuffer*>(hits);
+
+        Submit([this, hybrid_rays, numrays, hybrid_hits]()
+        {
+            Query(kQueryOcclusion, hybrid_rays, numrays, hybrid_hits);
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_numrays = static_cast<HybridBuffer const*>(numrays);
+        auto hybrid_hits = static_cast<HybridBuffer*>(hits);
+
+        // The ray count is read once the wait event resolves
+        Submit([this, hybrid_rays, hybrid_numrays, maxrays, hybrid_hits]()
+        {
+            int count = *reinterpret_cast<int const*>(hybrid_numrays->GetData());
+            Query(kQueryIntersection, hybrid_rays, std::min(count, maxrays), hybrid_hits);
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_numrays = static_cast<HybridBuffer const*>(numrays);
+        auto hybrid_hits = static_cast<HybridBuffer*>(hits);
+
+        // The ray count is read once the wait event resolves
+        Submit([this, hybrid_rays, hybrid_numrays, maxrays, hybrid_hits]()
+        {
+            int count = *reinterpret_cast<int const*>(hybrid_numrays->GetData());
+            Query(kQueryOcclusion, hybrid_rays, std::min(count, maxrays), hybrid_hits);
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const
+    {
+        if (!m_partitions.empty())
+        {
+            Broadcast(kQueryIntersection, numrays, hits, [this, rays, numrays](int idx, void* result)
+            {
+                QueryDeviceHost(idx, kQueryIntersection, rays, 0, numrays, result);
+            });
+            return;
+        }
+
+        // Parts are handed over to the host memory path of the devices
+        Balance(numrays, [this, rays, hits](int idx, int offset, int count)
+        {
+            return QueryDeviceHost(idx, kQueryIntersection, rays, offset, count, hits);
+        });
+    }
+
+    void HybridIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const
+    {
+        if (!m_partitions.empty())
+        {
+            Broadcast(kQueryOcclusion, numrays, hits, [this, rays, numrays](int idx, void* result)
+            {
+                QueryDeviceHost(idx, kQueryOcclusion, rays, 0, numrays, result);
+            });
+            return;
+        }
+
+        Balance(numrays, [this, rays, hits](int idx, int offset, int count)
+        {
+            return QueryDeviceHost(idx, kQueryOcclusion, rays, offset, count, hits);
+        });
+    }
+
+    void HybridIntersectionDevice::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
+    {
+        ThrowIf(numqueries <= 0, "Query batch is empty");
+
+        std::vector<QueryDesc> batch(queries, queries + numqueries);
+
+        Submit([this, batch]()
+        {
+            for (auto& query : batch)
+            {
+                Query(query.type, static_cast<HybridBuffer const*>(query.rays), query.numrays, static_cast<HybridBuffer*>(query.hits));
+            }
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const
+    {
+        // The split between the devices follows their throughput, so each one is prepared for all the rays
+        for (auto const& device : m_devices)
+        {
+            device->Prepare(maxrays, types, numtypes, 0);
+        }
+    }
+
+    void HybridIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_rays = static_cast<HybridBuffer const*>(rays);
+        auto hybrid_numrays = static_cast<HybridBuffer const*>(numrays);
+        auto hybrid_predicate = static_cast<HybridBuffer const*>(predicate);
+        auto hybrid_outrays = static_cast<HybridBuffer*>(outrays);
+        auto hybrid_outcount = static_cast<HybridBuffer*>(outcount);
+
+        // Buffers live in host memory, so rays are compacted in place of a device pass
+        Submit([hybrid_rays, hybrid_numrays, maxrays, hybrid_predicate, hybrid_outrays, hybrid_outcount]()
+        {
+            int count = std::min(*reinterpret_cast<int const*>(hybrid_numrays->GetData()), maxrays);
+            auto in = reinterpret_cast<ray const*>(hybrid_rays->GetData());
+            auto flags = hybrid_predicate ? reinterpret_cast<int const*>(hybrid_predicate->GetData()) : nullptr;
+            auto out = reinterpret_cast<ray*>(hybrid_outrays->GetData());
+
+            int num_kept = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                if (flags ? flags[i] != 0 : in[i].extra.y != 0)
+                {
+                    out[num_kept++] = in[i];
+                }
+            }
+
+            *reinterpret_cast<int*>(hybrid_outcount->GetData()) = num_kept;
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
+    {
+        auto hybrid_hits = static_cast<HybridBuffer const*>(hits);
+        auto hybrid_numrays = static_cast<HybridBuffer const*>(numrays);
+        auto hybrid_shapekeys = static_cast<HybridBuffer const*>(shapekeys);
+        auto hybrid_outindices = static_cast<HybridBuffer*>(outindices);
+        auto hybrid_outkeys = static_cast<HybridBuffer*>(outkeys);
+
+        // Buffers live in host memory, so hits are grouped in place of a device pass
+        Submit([hybrid_hits, hybrid_numrays, maxrays, hybrid_shapekeys, numkeys, hybrid_outindices, hybrid_outkeys]()
+        {
+            GroupHitsOnHost(reinterpret_cast<Intersection const*>(hybrid_hits->GetData()),
+                *reinterpret_cast<int const*>(hybrid_numrays->GetData()), maxrays,
+                hybrid_shapekeys ? reinterpret_cast<int const*>(hybrid_shapekeys->GetData()) : nullptr, numkeys,
+                reinterpret_cast<int*>(hybrid_outindices->GetData()),
+                hybrid_outkeys ? reinterpret_cast<int*>(hybrid_outkeys->GetData()) : nullptr);
+        }, waitevent, event);
+    }
+
+    void HybridIntersectionDevice::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        // Hybrid buffers live in host memory, so there is no device pass to save
+        Throw("Ray generation is not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ray generation is not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ray generation is not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        // Rays are split as closest hit ones, a closest hit is a valid result of any hit rays too
+        QueryIntersection(rays, numrays, hits, waitevent, event, queue);
+    }
+
+    void HybridIntersectionDevice::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        // Results of several devices can't be merged into per ray hit lists
+        Throw("Multi hit queries are not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Proximity queries are not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ambient occlusion queries are not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::SetHitFilterData(Buffer const* data)
+    {
+        // Filters are compiled into OpenCL traversal, which can't read host memory buffers
+        ThrowIf(data != nullptr, "Hit filters are not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        // Counters are written by OpenCL traversal kernels only
+        ThrowIf(stats != nullptr, "Traversal statistics are not supported by hybrid devices");
+    }
+
+    void HybridIntersectionDevice::SetHitHints(Buffer const* hits)
+    {
+        // Rays are split between devices differently from query to query, so hints are ignored
+    }
+
+    void HybridIntersectionDevice::Submit(std::function<void()>&& work, Event const* waitevent, Event** event) const
+    {
+        // Hybrid events can be waited on from any thread
+        Event* wait = const_cast<Event*>(waitevent);
+
+        if (event)
+        {
+            *event = new HybridEvent([wait, work]()
+            {
+                if (wait)
+                    wait->Wait();
+                work();
+            });
+        }
+        else
+        {
+            if (wait)
+                wait->Wait();
+            work();
+        }
+    }
+
+    void HybridIntersectionDevice::Query(QueryType type, HybridBuffer const* rays, int numrays, HybridBuffer* hits) const
+    {
+        if (!m_partitions.empty())
+        {
+            Broadcast(type, numrays, hits->GetData(), [this, type, rays, numrays, hits](int idx, void* result)
+            {
+                QueryDevice(idx, type, rays, 0, numrays, hits, static_cast<char*>(result));
+            });
+            return;
+        }
+
+        size_t const hitsize = type == kQueryOcclusion ? sizeof(int) : sizeof(Intersection);
+
+        Balance(numrays, [this, type, rays, hits, hitsize](int idx, int offset, int count)
+        {
+            return QueryDevice(idx, type, rays, offset, count, hits, hits->GetData() + offset * hitsize);
+        });
+    }
+
+    void HybridIntersectionDevice::Broadcast(QueryType type, int numrays, void* hits, std::function<void(int, void*)> const& trace) const
+    {
+        if (numrays <= 0)
+            return;
+
+        int const numdevices = static_cast<int>(m_devices.size());
+        size_t const hitsize = type == kQueryOcclusion ? sizeof(int) : sizeof(Intersection);
+
+        // Every device holding shapes traces all the rays into results of its own
+        std::vector<std::vector<char> > results(numdevices);
+        parallel_for(*m_scheduler, 0, numdevices, 1, [&](int i)
+        {
+            if (m_partitions[i]->shapes_.empty())
+                return;
+
+            results[i].resize(numrays * hitsize);
+            trace(i, &results[i][0]);
+        });
+
+        // Occlusion results are 1 for hits and -1 for misses, so any hit is the largest value
+        if (type == kQueryOcclusion)
+        {
+            auto out = static_cast<int*>(hits);
+            std::fill(out, out + numrays, -1);
+
+            for (auto const& result : results)
+            {
+                auto part = reinterpret_cast<int const*>(result.data());
+                for (int j = 0; j < static_cast<int>(result.size() / hitsize); ++j)
+                {
+                    out[j] = std::max(out[j], part[j]);
+                }
+            }
+
+            return;
+        }
+
+        // Keep the nearest hit of the parts
+        auto out = static_cast<Intersection*>(hits);
+        bool first = true;
+
+        for (auto const& result : results)
+        {
+            if (result.empty())
+                continue;
+
+            auto part = reinterpret_cast<Intersection const*>(result.data());
+            if (first)
+            {
+                std::copy(part, part + numrays, out);
+                first = false;
+                continue;
+            }
+
+            for (int j = 0; j < numrays; ++j)
+            {
+                if (part[j].shapeid != kNullId && (out[j].shapeid == kNullId || part[j].uvwt.w < out[j].uvwt.w))
+                {
+                    out[j] = part[j];
+                }
+            }
+        }
+    }
+
+    void HybridIntersectionDevice::Balance(int numrays, std::function<float(int, int, int)> const& trace) const
+    {
+        if (numrays <= 0)
+            return;
+
+        int const numdevices = static_cast<int>(m_devices.size());
+
+        // Split the rays in proportion to the measured throughput
+        std::vector<float> share;
+        {
+            std::lock_guard<std::mutex> lock(m_throughput_mutex);
+            share = m_throughput;
+        }
+
+        float total = 0.f;
+        for (auto s : share)
+        {
+            total += s;
+        }
+
+        float const minshare = kMinShare / numdevices;
+        float sum = 0.f;
+        for (auto& s : share)
+        {
+            s = std::max(s / total, minshare);
+            sum += s;
+        }
+
+        std::vector<int> offsets(numdevices + 1, 0);
+        float acc = 0.f;
+        for (int i = 0; i < numdevices; ++i)
+        {
+            acc += share[i];
+            offsets[i + 1] = i == numdevices - 1 ? numrays : static_cast<int>(numrays * (acc / sum));
+        }
+
+        // Devices are driven concurrently, the calling thread drives one of them
+        std::vector<float> elapsed(numdevices, 0.f);
+        parallel_for(*m_scheduler, 0, numdevices, 1, [&](int i)
+        {
+            int const count = offsets[i + 1] - offsets[i];
+            if (count > 0)
+                elapsed[i] = trace(i, offsets[i], count);
+        });
+
+        // Update the estimates with a moving average, small parts
+        // are dominated by launch latency and are not measured
+        std::lock_guard<std::mutex> lock(m_throughput_mutex);
+        for (int i = 0; i < numdevices; ++i)
+        {
+            int const count = offsets[i + 1] - offsets[i];
+            if (count >= kMinMeasuredRays && elapsed[i] > 0.f)
+            {
+                m_throughput[i] = 0.5f * m_throughput[i] + 0.5f * (count / elapsed[i]);
+            }
+        }
+    }
+
+    float HybridIntersectionDevice::QueryDeviceHost(int idx, QueryType type, ray const* rays, int offset, int numrays, void* hits) const
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        IntersectionDevice const& device = *m_devices[idx];
+
+        if (type == kQueryOcclusion)
+            device.QueryOcclusion(rays + offset, numrays, static_cast<int*>(hits) + offset, 0);
+        else
+            device.QueryIntersection(rays + offset, numrays, static_cast<Intersection*>(hits) + offset, 0);
+
+        return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+
+    float HybridIntersectionDevice::QueryDevice(int idx, QueryType type, HybridBuffer const* rays, int offset, int numrays, HybridBuffer* hits, char* result) const
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+
+        IntersectionDevice const& device = *m_devices[idx];
+
+        size_t const raysize = sizeof(ray);
+        size_t const hitsize = type == kQueryOcclusion ? sizeof(int) : sizeof(Intersection);
+
+        // Devices are free to map asynchronously, so every map is waited on
+        auto wait = [&device](Event* e)
+        {
+            e->Wait();
+            device.DeleteEvent(e);
+        };
+
+        // Split the part into slices on separate queues, so that uploading
+        // a slice overlaps tracing the previous one
+        int const numslices = std::min(std::min(device.GetQueueCount(), kMaxSlices), std::max(numrays / kMinSliceRays, 1));
+
+        struct Slice
+        {
+            int offset;
+            int count;
+            Buffer* hits;
+            Event* mapped;
+            void* ptr;
+        };
+
+        Slice slices[kMaxSlices];
+
+        for (int s = 0; s < numslices; ++s)
+        {
+            Slice& slice = slices[s];
+            slice.offset = offset + numrays * s / numslices;
+            slice.count = offset + numrays * (s + 1) / numslices - slice.offset;
+
+            int const slot = idx * kMaxSlices + s;
+            Buffer* devrays = rays->GetStaging(slot, device, slice.count * raysize);
+            slice.hits = hits->GetStaging(slot, device, slice.count * hitsize);
+
+            // Upload the slice, the queue keeps the calls in order
+            void* ptr = nullptr;
+            Event* e = nullptr;
+            device.MapBuffer(devrays, kMapWrite, 0, slice.count * raysize, &ptr, &e, s);
+            wait(e);
+            memcpy(ptr, rays->GetData() + slice.offset * raysize, slice.count * raysize);
+            device.UnmapBuffer(devrays, ptr, nullptr, s);
+
+            if (type == kQueryOcclusion)
+                device.QueryOcclusion(devrays, slice.count, slice.hits, nullptr, &e, s);
+            else
+                device.QueryIntersection(devrays, slice.count, slice.hits, nullptr, &e, s);
+
+            // Dropping the event keeps the query in flight, the map below is ordered after it
+            device.DeleteEvent(e);
+
+            // Results are read back once all the slices are in flight
+            slice.mapped = nullptr;
+            device.MapBuffer(slice.hits, kMapRead, 0, slice.count * hitsize, &slice.ptr, &slice.mapped, s);
+        }
+
+        // Gather the results
+        for (int s = 0; s < numslices; ++s)
+        {
+            Slice& slice = slices[s];
+            wait(slice.mapped);
+            memcpy(result + (slice.offset - offset) * hitsize, slice.ptr, slice.count * hitsize);
+
+            Event* e = nullptr;
+            device.UnmapBuffer(slice.hits, slice.ptr, &e, s);
+            wait(e);
+        }
+
+        return std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+}
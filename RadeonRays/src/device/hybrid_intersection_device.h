@@ -0,0 +1,125 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    class task_scheduler;
+    class World;
+
+    ///< The class represents a composite device distributing each query
+    ///< across several intersection devices. Rays are split in proportion
+    ///< to the throughput measured on previous queries and every device
+    ///< works on its own copy of the scene. Buffers live in host memory
+    ///< and get staged to the child devices for each query, large parts
+    ///< are pipelined over two device queues to overlap copies and tracing.
+    ///< With "hybrid.partition" set to "spatial" the scene is split between
+    ///< the devices instead and every device traces all the rays against its
+    ///< part, the nearest hits of the parts are merged on the host.
+    ///<
+    class HybridIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // Takes ownership of the devices
+        explicit HybridIntersectionDevice(std::vector<IntersectionDevice*> const& devices);
+        ~HybridIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
+        int GetQueueCount() const override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        Event* CreateReusableEvent() const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const override;
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const override;
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const override;
+        void Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void SetHitFilterData(Buffer const* data) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+        void SetHitHints(Buffer const* hits) override;
+
+    private:
+        class HybridBuffer;
+
+        // Split the rays by throughput, trace each part on its device and gather the results
+        void Query(QueryType type, HybridBuffer const* rays, int numrays, HybridBuffer* hits) const;
+        // Split the rays by throughput and run trace(device, offset, count) concurrently,
+        // trace returns elapsed time in ms used to update the estimates
+        void Balance(int numrays, std::function<float(int, int, int)> const& trace) const;
+        // Run trace(device, hits) for all the rays on every device holding a part of the scene
+        // and merge the hits of the parts into hits
+        void Broadcast(QueryType type, int numrays, void* hits, std::function<void(int, void*)> const& trace) const;
+        // Split the shapes of the world into the device parts
+        void Partition(World const& world);
+        // Trace a part of rays in host memory on a single device, returns elapsed time in ms
+        float QueryDeviceHost(int device, QueryType type, ray const* rays, int offset, int numrays, void* hits) const;
+        // Trace a part of the rays on a single device writing the results of the part to result,
+        // returns elapsed time in ms
+        float QueryDevice(int device, QueryType type, HybridBuffer const* rays, int offset, int numrays, HybridBuffer* hits, char* result) const;
+        // Run the work asynchronously if event is requested or wait for it otherwise
+        void Submit(std::function<void()>&& work, Event const* waitevent, Event** event) const;
+
+        // Child devices
+        std::vector<std::unique_ptr<IntersectionDevice> > m_devices;
+
+        // Part of the scene of every device, empty unless the scene is partitioned.
+        // Parts persist between commits so devices see the changes of their shapes.
+        std::vector<std::unique_ptr<World> > m_partitions;
+
+        // Worker per device driving its part of a query
+        std::unique_ptr<task_scheduler> m_scheduler;
+
+        // Rays per ms measured on each device, updated after every query
+        mutable std::vector<float> m_throughput;
+        mutable std::mutex m_throughput_mutex;
+
+        // Statistics of the latest Preprocess call summed over the devices
+        CommitStatistics m_stats;
+    };
+}
@@ -25,6 +25,8 @@ THE SOFTWARE.
 #define INTERSECTION_DEVICE_H
 #include "radeon_rays.h"
 
+#include <vector>
+
 namespace RadeonRays
 {
     class World;
@@ -41,37 +43,84 @@ namespace RadeonRays
         // The call is blocking.
         virtual void Preprocess(World const& world) = 0;
 
+        // Preprocess the scene while queries from other threads keep running against
+        // the previous one, which is replaced once the call returns.
+        // Devices unable to do that just preprocess. The call is blocking.
+        virtual void PreprocessConcurrent(World const& world) { Preprocess(world); }
+
+        // Get statistics of the latest Preprocess call.
+        virtual void GetCommitStatistics(CommitStatistics& stats) const = 0;
+
+        // Add memory held by the device to usage, totals are left to the caller.
+        virtual void GetMemoryUsage(MemoryUsage& usage) const = 0;
+
+        // Get GPU kernel timings of the latest query or Preprocess call.
+        virtual int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const = 0;
+
+        // Number of queues accepted by memory and query calls.
+        virtual int GetQueueCount() const = 0;
+
         // Create a buffer of a specified size with specified initial data.
         // if initdata == nullptr the buffer is allocated, but not initialized.
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
 
+        // Create a buffer mapped until it is deleted, *data receives the host pointer.
+        // Devices keeping buffers in host memory hand out the buffer storage itself.
+        virtual Buffer* CreateMappedBuffer(size_t size, void* initdata, void** data) const
+        {
+            auto buffer = CreateBuffer(size, initdata);
+            MapBuffer(buffer, MapType(kMapRead | kMapWrite), 0, size, data, nullptr, 0);
+            return buffer;
+        }
+
+        // Create a buffer backed by hostdata where the device shares memory with the host,
+        // others copy it like CreateBuffer.
+        virtual Buffer* CreateHostPtrBuffer(size_t size, void* hostdata) const
+        {
+            return CreateBuffer(size, hostdata);
+        }
+
+        // Create a view of a buffer region sharing its memory, nullptr if not supported.
+        virtual Buffer* CreateSubBuffer(Buffer* buffer, size_t offset, size_t size) const
+        {
+            return nullptr;
+        }
+
         // Release buffer memory.
         virtual void DeleteBuffer(Buffer* const) const = 0;
 
         // Release an event (this method is optimized for frequent calls)
         virtual void DeleteEvent(Event* const) const = 0;
 
+        // Create an event owned by the caller, calls signal it instead of returning a new one
+        // if it is passed in event argument. Released by DeleteEvent.
+        virtual Event* CreateReusableEvent() const = 0;
+
         // Map buffer data.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const = 0;
+        virtual void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const = 0;
 
         // Unmap buffer data.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const = 0;
+        virtual void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const = 0;
+
+        // Copy buffer data on the device.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const = 0;
 
         // Find intersection for the rays in rays buffer and write them into hits buffer.
         // rays is assumed AOS with elements of type RadeonRays::ray.
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
 
         // Find if the rays in rays buffer intersect any of the primitives in the scene.
         // rays is assumed AOS with elements of type RadeonRays::ray.
         // hits is assumed AOS with elements of type int (-1 if no intersection, 1 otherwise).
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
 
         // Find intersection for the rays in rays buffer and write them into hits buffer. Take the number of rays from the buffer in remote memory.
         // rays is assumed AOS with elements of type RadeonRays::ray.
@@ -79,7 +128,7 @@ namespace RadeonRays
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
 
         // Find if the rays in rays buffer intersect any of the primitives in the scene. Take the number of rays from the buffer in remote memory.
         // rays is assumed AOS with elements of type RadeonRays::ray.
@@ -87,8 +136,113 @@ namespace RadeonRays
         // hits is assumed AOS with elements of type RadeonRays::Intersection.
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
-        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+        virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Find closest intersections of the rays in rays buffer and any intersection of the ones flagged
+        // by ray::SetAnyHit in a single traversal, hits is assumed AOS with RadeonRays::Intersection elements.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Find up to k closest intersections for the rays in rays buffer in a single traversal.
+        // hits is assumed AOS with k elements of type RadeonRays::Intersection per ray, sorted by distance.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Find the closest point of the scene within each sphere of spheres buffer.
+        // spheres is assumed an array of float4 centers (xyz) and radii (w).
+        // hits is assumed AOS with elements of type RadeonRays::Intersection.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Estimate ambient occlusion of points, an array of SurfacePoint structs.
+        // visibility gets a float per point, the fraction of numsamples hemisphere rays not hitting anything.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Find intersection for the rays in host memory and write them into hits array.
+        // rays and hits are laid out as for buffer queries.
+        // The call is blocking.
+        virtual void QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const = 0;
+
+        // Find if the rays in host memory intersect any of the primitives in the scene.
+        // hits is an array of int (-1 if no intersection, 1 otherwise).
+        // The call is blocking.
+        virtual void QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const = 0;
+
+        // Run a batch of queries in order, results are written as by the corresponding single queries.
+        // The call waits until waitevent is resolved (on a target device) before the first query if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Record queries replayed by ExecuteQueryGraph. Devices without a cheaper replay
+        // keep a copy of the descriptions and run them as a batch.
+        virtual QueryGraph* CreateQueryGraph(QueryDesc const* queries, int numqueries) const
+        {
+            return new QueryGraphDesc(queries, numqueries);
+        }
+
+        virtual void DeleteQueryGraph(QueryGraph* graph) const
+        {
+            delete graph;
+        }
+
+        // Run the queries of the graph as QueryBatch does.
+        virtual void ExecuteQueryGraph(QueryGraph const* graph, Event const* waitevent, Event** event, int queue) const
+        {
+            auto& queries = static_cast<QueryGraphDesc const*>(graph)->m_queries;
+            QueryBatch(&queries[0], static_cast<int>(queries.size()), waitevent, event, queue);
+        }
+
+        // Allocate scratch memory and run the kernels queries of the given types with up to maxrays rays
+        // need, blocking until they are done. Devices without per query setup do nothing.
+        virtual void Prepare(int maxrays, QueryType const* types, int numtypes, int queue) const {}
+
+        // Copy rays with a nonzero predicate (active rays if predicate is nullptr) to the front of outrays
+        // preserving their order and write their number into outcount, a single int element.
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Write ray indices of hits ordered by the key of the hit shape (see IntersectionApi::GroupHits).
+        // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
+        virtual void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Write camera, hemisphere or shadow rays into a ray buffer on the device.
+        // The calls wait until waitevent is resolved (on a target device) if waitevent != nullptr.
+        // The calls are non-blocking if event is passed in, otherwise (event == nullptr) they are blocking.
+        virtual void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const = 0;
+        virtual void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const = 0;
+        virtual void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const = 0;
+
+        // Set the buffer passed to "acc.hit_filter" functions by the following queries, nullptr for none.
+        virtual void SetHitFilterData(Buffer const* data) = 0;
+
+        // Set the buffer receiving per ray "acc.traversal_stats" counters of the following queries, nullptr for none.
+        virtual void SetTraversalStatsBuffer(Buffer* stats) = 0;
+
+        // Set the Intersection buffer of a previous query whose hits are tested first by the following
+        // intersection queries, nullptr for none. Hints only speed traversal up, so devices may ignore them.
+        virtual void SetHitHints(Buffer const* hits) = 0;
     
+    protected:
+        // Query graph keeping the query descriptions
+        class QueryGraphDesc : public QueryGraph
+        {
+        public:
+            QueryGraphDesc(QueryDesc const* queries, int numqueries)
+                : m_queries(queries, queries + numqueries)
+            {
+            }
+
+            std::vector<QueryDesc> m_queries;
+        };
+
+    public:
         IntersectionDevice(IntersectionDevice const&) = delete;
         IntersectionDevice& operator = (IntersectionDevice const&) = delete;
     };
@@ -0,0 +1,635 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "remote_intersection_device.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "../world/world.h"
+#include "../world/scene_snapshot.h"
+#include "../except/except.h"
+#include "../async/future_callback.h"
+#include "host_hit_grouping.h"
+
+namespace RadeonRays
+{
+    ///< Host memory buffer, results are written into it by the receiver thread
+    ///<
+    class RemoteIntersectionDevice::RemoteBuffer : public Buffer
+    {
+    public:
+        RemoteBuffer(size_t size, void* init)
+            : m_data(size)
+        {
+            if (init && size)
+                memcpy(&m_data[0], init, size);
+        }
+
+        char* GetData()
+        {
+            return m_data.empty() ? nullptr : &m_data[0];
+        }
+
+        char const* GetData() const
+        {
+            return m_data.empty() ? nullptr : &m_data[0];
+        }
+
+    private:
+        std::vector<char> m_data;
+    };
+
+    ///< Event tracking a request or a task running on a separate thread,
+    ///< waiting rethrows errors reported by the server
+    ///<
+    class RemoteEvent : public Event
+    {
+    public:
+        explicit RemoteEvent(std::shared_future<void> const& ftr)
+            : m_ftr(ftr)
+        {
+        }
+
+        explicit RemoteEvent(std::function<void()>&& f)
+        {
+            std::packaged_task<void()> task(std::move(f));
+            m_ftr = task.get_future().share();
+            std::thread(std::move(task)).detach();
+        }
+
+        ~RemoteEvent()
+        {
+            m_ftr.wait();
+        }
+
+        bool Complete() const override
+        {
+            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        void Wait() override
+        {
+            m_ftr.get();
+        }
+
+        void SetCompletionCallback(CompletionCallback callback, void* data) override
+        {
+            call_when_ready(m_ftr, this, callback, data);
+        }
+
+    private:
+        std::shared_future<void> m_ftr;
+    };
+
+    RemoteIntersectionDevice::RemoteIntersectionDevice(Socket&& socket)
+        : m_socket(std::move(socket))
+        , m_connected(true)
+        , m_next_id(1)
+        , m_has_scene(false)
+        , m_stats()
+    {
+        ThrowIf(!m_socket.IsValid(), "Remote device needs a connected socket");
+        m_receiver = std::thread(&RemoteIntersectionDevice::Receive, this);
+    }
+
+    RemoteIntersectionDevice::~RemoteIntersectionDevice()
+    {
+        // Unblocks the receiver, which fails the requests still in flight
+        m_socket.Shutdown();
+        m_receiver.join();
+    }
+
+    void RemoteIntersectionDevice::Receive()
+    {
+        Remote::MessageHeader header;
+        std::vector<char> payload;
+
+        while (Remote::ReadMessage(m_socket, header, payload))
+        {
+            std::shared_ptr<Request> request;
+            {
+                std::lock_guard<std::mutex> lock(m_requests_mutex);
+                auto iter = m_requests.find(header.id);
+                if (iter == m_requests.end())
+                {
+                    continue;
+                }
+
+                request = iter->second;
+                m_requests.erase(iter);
+            }
+
+            if (header.type == Remote::kError)
+            {
+                std::string message = "Remote server: " + std::string(payload.begin(), payload.end());
+                request->done.set_exception(std::make_exception_ptr(ExceptionImpl(message)));
+                continue;
+            }
+
+            std::size_t const result_size = request->type == Remote::kScene ? 0 : Remote::GetResultSize(request->type);
+            if (header.type != Remote::kResult || payload.size() != request->active.size() * result_size)
+            {
+                request->done.set_exception(std::make_exception_ptr(ExceptionImpl("Malformed answer of the remote server")));
+                continue;
+            }
+
+            // Results of the active rays are scattered back, inactive ones are left untouched
+            for (std::size_t i = 0; i < request->active.size(); ++i)
+            {
+                memcpy(request->hits + request->active[i] * result_size, &payload[i * result_size], result_size);
+            }
+
+            request->done.set_value();
+        }
+
+        std::unordered_map<std::uint64_t, std::shared_ptr<Request>> failed;
+        {
+            std::lock_guard<std::mutex> lock(m_requests_mutex);
+            m_connected = false;
+            failed.swap(m_requests);
+        }
+
+        for (auto& request : failed)
+        {
+            request.second->done.set_exception(std::make_exception_ptr(ExceptionImpl("Connection to the remote server lost")));
+        }
+    }
+
+    std::shared_future<void> RemoteIntersectionDevice::Send(Remote::MessageType type, std::vector<char> const& payload, std::shared_ptr<Request> request) const
+    {
+        std::shared_future<void> done = request->done.get_future().share();
+        std::uint64_t const id = m_next_id++;
+
+        {
+            std::lock_guard<std::mutex> lock(m_requests_mutex);
+            ThrowIf(!m_connected, "Connection to the remote server lost");
+            m_requests[id] = request;
+        }
+
+        bool sent = false;
+        {
+            std::lock_guard<std::mutex> lock(m_send_mutex);
+            sent = Remote::WriteMessage(m_socket, type, id, payload.empty() ? nullptr : &payload[0], payload.size());
+        }
+
+        // The receiver fails the request along with the others
+        if (!sent)
+        {
+            m_socket.Shutdown();
+        }
+
+        return done;
+    }
+
+    std::shared_future<void> RemoteIntersectionDevice::Trace(QueryType type, ray const* rays, int numrays, char* hits) const
+    {
+        std::shared_ptr<Request> request = std::make_shared<Request>();
+        request->type = type == kQueryIntersection ? Remote::kIntersect : Remote::kOcclude;
+        request->hits = hits;
+
+        // Inactive rays are not sent, wavefront renderers leave many of them behind
+        std::vector<char> payload;
+        payload.reserve(std::min<std::size_t>(numrays, Remote::kMaxQueryRays) * sizeof(ray));
+        int i = 0;
+        for (; i < numrays && request->active.size() < Remote::kMaxQueryRays; ++i)
+        {
+            if (rays[i].IsActive())
+            {
+                request->active.push_back(i);
+                Remote::Append(payload, &rays[i], sizeof(ray));
+            }
+        }
+
+        if (request->active.empty())
+        {
+            request->done.set_value();
+            return request->done.get_future().share();
+        }
+
+        std::shared_future<void> done = Send(request->type, payload, request);
+        if (i == numrays)
+        {
+            return done;
+        }
+
+        // The server takes at most kMaxQueryRays rays per message, the rest goes in further ones.
+        // Both parts are waited for before reporting errors, so that no results arrive after them
+        std::shared_future<void> rest;
+        try
+        {
+            rest = Trace(type, rays + i, numrays - i, hits + i * Remote::GetResultSize(request->type));
+        }
+        catch (...)
+        {
+            done.wait();
+            throw;
+        }
+
+        return std::async(std::launch::async, [done, rest]()
+        {
+            done.wait();
+            rest.wait();
+            done.get();
+            rest.get();
+        }).share();
+    }
+
+    void RemoteIntersectionDevice::Complete(std::shared_future<void> const& future, Event** event) const
+    {
+        if (event)
+        {
+            *event = new RemoteEvent(future);
+        }
+        else
+        {
+            future.get();
+        }
+    }
+
+    void RemoteIntersectionDevice::Submit(std::function<void()>&& work, Event const* waitevent, Event** event) const
+    {
+        // Remote events can be waited on from any thread
+        Event* wait = const_cast<Event*>(waitevent);
+
+        if (event)
+        {
+            *event = new RemoteEvent([wait, work]()
+            {
+                if (wait)
+                    wait->Wait();
+                work();
+            });
+        }
+        else
+        {
+            if (wait)
+                wait->Wait();
+            work();
+        }
+    }
+
+    void RemoteIntersectionDevice::Preprocess(World const& world)
+    {
+        // Results are copied as they are, so the server has to write the layouts of the client
+        auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+        auto rayformat = world.options_.GetOption(Options::kAccRayFormat);
+        auto occlusionformat = world.options_.GetOption(Options::kAccOcclusionFormat);
+        ThrowIf(hitformat && hitformat->AsString() != "full", "Remote device supports full hit format only");
+        ThrowIf(rayformat && rayformat->AsString() != "full", "Remote device supports full ray format only");
+        ThrowIf(occlusionformat && occlusionformat->AsString() != "int", "Remote device supports int occlusion format only");
+
+        // The server doesn't run client code
+        for (auto id : { Options::kAccHitFilter, Options::kAccHitCallback, Options::kAccCustomIntersector })
+        {
+            auto option = world.options_.GetOption(id);
+            ThrowIf(option && !option->AsString().empty(), std::string("Remote device doesn't support ") + Options::GetOptionName(id));
+        }
+
+        // Options the server refuses are local to the client and left out: captures are written
+        // by the client API, the server doesn't write files, run threads or share data for clients
+        std::vector<Remote::SceneOption> options;
+        for (int i = 0; i < Options::kNumOptions; ++i)
+        {
+            auto id = static_cast<Options::OptionId>(i);
+            auto option = world.options_.GetOption(id);
+            if (option)
+            {
+                Remote::SceneOption remote;
+                remote.name = Options::GetOptionName(id);
+                remote.is_string = Options::GetOptionType(id) == Options::kOptionString;
+                remote.strval = option->AsString();
+                remote.floatval = option->AsFloat();
+                if (Remote::IsSceneOption(remote))
+                {
+                    options.push_back(remote);
+                }
+            }
+        }
+
+        std::vector<char> payload;
+        Remote::WriteSceneOptions(options, payload);
+
+        // The server keeps the previous scene if nothing has changed
+        if (m_has_scene && payload == m_options && !world.has_changed() && world.GetStateChange() == 0)
+        {
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+
+        m_options = payload;
+        m_has_scene = false;
+
+        bool const ok = SceneSnapshot::Write(world, std::vector<std::vector<char>>(), [&payload](void const* data, std::size_t size)
+        {
+            Remote::Append(payload, data, size);
+            return true;
+        });
+        ThrowIf(!ok, "Can't serialize the scene");
+
+        std::shared_ptr<Request> request = std::make_shared<Request>();
+        request->type = Remote::kScene;
+        request->hits = nullptr;
+
+        // Commits are blocking, the server answers once it has committed the scene
+        Send(Remote::kScene, payload, request).get();
+        m_has_scene = true;
+
+        m_stats = CommitStatistics();
+        m_stats.upload_time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        m_stats.other_bytes = payload.size();
+    }
+
+    void RemoteIntersectionDevice::GetCommitStatistics(CommitStatistics& stats) const
+    {
+        stats = m_stats;
+    }
+
+    void RemoteIntersectionDevice::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        // Device memory is held by the server
+    }
+
+    int RemoteIntersectionDevice::GetLastQueryTimings(KernelTiming* timings, int maxtimings) const
+    {
+        // Queries of several clients share server launches, their kernel timings are not tracked
+        return 0;
+    }
+
+    int RemoteIntersectionDevice::GetQueueCount() const
+    {
+        return 1;
+    }
+
+    Buffer* RemoteIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        return new RemoteBuffer(size, initdata);
+    }
+
+    void RemoteIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        delete static_cast<RemoteBuffer*>(buffer);
+    }
+
+    void RemoteIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete event;
+    }
+
+    Event* RemoteIntersectionDevice::CreateReusableEvent() const
+    {
+        Throw("Not implemented for remote device.");
+        return nullptr;
+    }
+
+    void RemoteIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const
+    {
+        auto remote = static_cast<RemoteBuffer*>(buffer);
+        *data = remote->GetData() + offset;
+
+        if (event)
+        {
+            *event = new RemoteEvent([]() {});
+        }
+    }
+
+    void RemoteIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const
+    {
+        if (event)
+        {
+            *event = new RemoteEvent([]() {});
+        }
+    }
+
+    void RemoteIntersectionDevice::CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const
+    {
+        auto remote_src = static_cast<RemoteBuffer const*>(src);
+        auto remote_dst = static_cast<RemoteBuffer*>(dst);
+
+        // Remote buffers live in host memory, the server only sees rays and results
+        memcpy(remote_dst->GetData() + dstoffset, remote_src->GetData() + srcoffset, size);
+
+        if (event)
+        {
+            *event = new RemoteEvent([]() {});
+        }
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_hits = static_cast<RemoteBuffer*>(hits);
+
+        if (waitevent && !waitevent->Complete())
+        {
+            // Rays are read once the wait event resolves
+            Submit([this, remote_rays, numrays, remote_hits]()
+            {
+                Trace(kQueryIntersection, reinterpret_cast<ray const*>(remote_rays->GetData()), numrays, remote_hits->GetData()).get();
+            }, waitevent, event);
+            return;
+        }
+
+        // Requests are pipelined, the results arrive while the caller goes on
+        Complete(Trace(kQueryIntersection, reinterpret_cast<ray const*>(remote_rays->GetData()), numrays, remote_hits->GetData()), event);
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_hits = static_cast<RemoteBuffer*>(hits);
+
+        if (waitevent && !waitevent->Complete())
+        {
+            Submit([this, remote_rays, numrays, remote_hits]()
+            {
+                Trace(kQueryOcclusion, reinterpret_cast<ray const*>(remote_rays->GetData()), numrays, remote_hits->GetData()).get();
+            }, waitevent, event);
+            return;
+        }
+
+        Complete(Trace(kQueryOcclusion, reinterpret_cast<ray const*>(remote_rays->GetData()), numrays, remote_hits->GetData()), event);
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_numrays = static_cast<RemoteBuffer const*>(numrays);
+        auto remote_hits = static_cast<RemoteBuffer*>(hits);
+
+        // The ray count is read once the wait event resolves
+        Submit([this, remote_rays, remote_numrays, maxrays, remote_hits]()
+        {
+            int count = *reinterpret_cast<int const*>(remote_numrays->GetData());
+            Trace(kQueryIntersection, reinterpret_cast<ray const*>(remote_rays->GetData()), std::min(count, maxrays), remote_hits->GetData()).get();
+        }, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_numrays = static_cast<RemoteBuffer const*>(numrays);
+        auto remote_hits = static_cast<RemoteBuffer*>(hits);
+
+        // The ray count is read once the wait event resolves
+        Submit([this, remote_rays, remote_numrays, maxrays, remote_hits]()
+        {
+            int count = *reinterpret_cast<int const*>(remote_numrays->GetData());
+            Trace(kQueryOcclusion, reinterpret_cast<ray const*>(remote_rays->GetData()), std::min(count, maxrays), remote_hits->GetData()).get();
+        }, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::QueryIntersection(ray const* rays, int numrays, Intersection* hits, int queue) const
+    {
+        Trace(kQueryIntersection, rays, numrays, reinterpret_cast<char*>(hits)).get();
+    }
+
+    void RemoteIntersectionDevice::QueryOcclusion(ray const* rays, int numrays, int* hits, int queue) const
+    {
+        Trace(kQueryOcclusion, rays, numrays, reinterpret_cast<char*>(hits)).get();
+    }
+
+    void RemoteIntersectionDevice::QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const
+    {
+        ThrowIf(numqueries <= 0, "Query batch is empty");
+
+        std::vector<QueryDesc> batch(queries, queries + numqueries);
+
+        // All the queries are in flight at once and the server can launch them together
+        Submit([this, batch]()
+        {
+            std::vector<std::shared_future<void>> results;
+            for (auto& query : batch)
+            {
+                results.push_back(Trace(query.type, reinterpret_cast<ray const*>(static_cast<RemoteBuffer const*>(query.rays)->GetData()),
+                    query.numrays, static_cast<RemoteBuffer*>(query.hits)->GetData()));
+            }
+
+            for (auto& result : results)
+            {
+                result.get();
+            }
+        }, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_rays = static_cast<RemoteBuffer const*>(rays);
+        auto remote_numrays = static_cast<RemoteBuffer const*>(numrays);
+        auto remote_predicate = static_cast<RemoteBuffer const*>(predicate);
+        auto remote_outrays = static_cast<RemoteBuffer*>(outrays);
+        auto remote_outcount = static_cast<RemoteBuffer*>(outcount);
+
+        // Buffers live in host memory, so rays are compacted in place of a device pass
+        Submit([remote_rays, remote_numrays, maxrays, remote_predicate, remote_outrays, remote_outcount]()
+        {
+            int count = std::min(*reinterpret_cast<int const*>(remote_numrays->GetData()), maxrays);
+            auto in = reinterpret_cast<ray const*>(remote_rays->GetData());
+            auto flags = remote_predicate ? reinterpret_cast<int const*>(remote_predicate->GetData()) : nullptr;
+            auto out = reinterpret_cast<ray*>(remote_outrays->GetData());
+
+            int num_kept = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                if (flags ? flags[i] != 0 : in[i].extra.y != 0)
+                {
+                    out[num_kept++] = in[i];
+                }
+            }
+
+            *reinterpret_cast<int*>(remote_outcount->GetData()) = num_kept;
+        }, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const
+    {
+        auto remote_hits = static_cast<RemoteBuffer const*>(hits);
+        auto remote_numrays = static_cast<RemoteBuffer const*>(numrays);
+        auto remote_shapekeys = static_cast<RemoteBuffer const*>(shapekeys);
+        auto remote_outindices = static_cast<RemoteBuffer*>(outindices);
+        auto remote_outkeys = static_cast<RemoteBuffer*>(outkeys);
+
+        // Buffers live in host memory, so hits are grouped in place of a device pass
+        Submit([remote_hits, remote_numrays, maxrays, remote_shapekeys, numkeys, remote_outindices, remote_outkeys]()
+        {
+            GroupHitsOnHost(reinterpret_cast<Intersection const*>(remote_hits->GetData()),
+                *reinterpret_cast<int const*>(remote_numrays->GetData()), maxrays,
+                remote_shapekeys ? reinterpret_cast<int const*>(remote_shapekeys->GetData()) : nullptr, numkeys,
+                reinterpret_cast<int*>(remote_outindices->GetData()),
+                remote_outkeys ? reinterpret_cast<int*>(remote_outkeys->GetData()) : nullptr);
+        }, waitevent, event);
+    }
+
+    void RemoteIntersectionDevice::GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        // Generated rays would only travel to the server and back
+        Throw("Ray generation is not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ray generation is not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ray generation is not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        // The server traces closest hits, a closest hit is a valid result of any hit rays too
+        QueryIntersection(rays, numrays, hits, waitevent, event, queue);
+    }
+
+    void RemoteIntersectionDevice::QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Multi hit queries are not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Proximity queries are not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const
+    {
+        Throw("Ambient occlusion queries are not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::SetHitFilterData(Buffer const* data)
+    {
+        // Filter data would have to follow every query to the server
+        ThrowIf(data != nullptr, "Hit filters are not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::SetTraversalStatsBuffer(Buffer* stats)
+    {
+        ThrowIf(stats != nullptr, "Traversal statistics are not supported by remote devices");
+    }
+
+    void RemoteIntersectionDevice::SetHitHints(Buffer const* hits)
+    {
+        // Hints would have to follow every query to the server, they are ignored
+    }
+}
@@ -0,0 +1,129 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+#include "remote_protocol.h"
+#include "../util/socket.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class represents a device tracing rays on a RadeonRays server
+    ///< (RemoteServer) over a TCP connection. The scene is sent as a snapshot
+    ///< on commit, queries send their active rays and the results are written
+    ///< back into buffers in host memory. Requests are pipelined: they are sent
+    ///< right away and a receiver thread completes them as results arrive, the
+    ///< server merges queries of clients sharing a scene into large launches.
+    ///<
+    class RemoteIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // Takes ownership of a connected socket
+        explicit RemoteIntersectionDevice(Socket&& socket);
+        ~RemoteIntersectionDevice();
+
+        //IntersectionDevice
+        void Preprocess(World const& world) override;
+        void GetCommitStatistics(CommitStatistics& stats) const override;
+        void GetMemoryUsage(MemoryUsage& usage) const override;
+        int GetLastQueryTimings(KernelTiming* timings, int maxtimings) const override;
+        int GetQueueCount() const override;
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        void DeleteBuffer(Buffer* const) const override;
+        void DeleteEvent(Event* const) const override;
+        Event* CreateReusableEvent() const override;
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event, int queue) const override;
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event, int queue) const override;
+        void CopyBuffer(Buffer const* src, Buffer* dst, size_t srcoffset, size_t dstoffset, size_t size, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event, int queue) const override;
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMixed(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryMultiHit(Buffer const* rays, int numrays, int k, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryProximity(Buffer const* spheres, int numspheres, Buffer* hits, Event const* waitevent, Event** event, int queue) const override;
+        void QueryAmbientOcclusion(Buffer const* points, int numpoints, int numsamples, float radius, int seed, Buffer* visibility, Event const* waitevent, Event** event, int queue) const override;
+        void QueryIntersection(ray const* rays, int numrays, Intersection* hitinfos, int queue) const override;
+        void QueryOcclusion(ray const* rays, int numrays, int* hitresults, int queue) const override;
+        void QueryBatch(QueryDesc const* queries, int numqueries, Event const* waitevent, Event** event, int queue) const override;
+        void CompactRays(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer const* predicate, Buffer* outrays, Buffer* outcount, Event const* waitevent, Event** event, int queue) const override;
+        void GroupHits(Buffer const* hits, Buffer const* numrays, int maxrays, Buffer const* shapekeys, int numkeys, Buffer* outindices, Buffer* outkeys, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateCameraRays(CameraDesc const& camera, int width, int height, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateHemisphereRays(Buffer const* points, Buffer const* numpoints, int maxpoints, int numsamples, float maxt, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void GenerateShadowRays(Buffer const* points, Buffer const* numpoints, int maxpoints, LightDesc const& light, int seed, Buffer* rays, Event const* waitevent, Event** event, int queue) const override;
+        void SetHitFilterData(Buffer const* data) override;
+        void SetTraversalStatsBuffer(Buffer* stats) override;
+        void SetHitHints(Buffer const* hits) override;
+
+    private:
+        class RemoteBuffer;
+
+        // Request waiting for its answer
+        struct Request
+        {
+            Remote::MessageType type;
+            char* hits;
+            // Results of the active rays go to these indices of hits
+            std::vector<int> active;
+            std::promise<void> done;
+        };
+
+        // Send the active rays of a query, the future completes once the results are written to hits
+        std::shared_future<void> Trace(QueryType type, ray const* rays, int numrays, char* hits) const;
+        // Register a request and send it, throws if the connection is lost
+        std::shared_future<void> Send(Remote::MessageType type, std::vector<char> const& payload, std::shared_ptr<Request> request) const;
+        // Body of the receiver thread, completes requests as their answers arrive
+        void Receive();
+        // Hand the future over to event if requested or wait for it otherwise
+        void Complete(std::shared_future<void> const& future, Event** event) const;
+        // Run the work asynchronously if event is requested or wait for it otherwise
+        void Submit(std::function<void()>&& work, Event const* waitevent, Event** event) const;
+
+        Socket m_socket;
+        // Sends of different threads must not interleave
+        mutable std::mutex m_send_mutex;
+
+        // Requests by id, failed if the connection is lost
+        mutable std::unordered_map<std::uint64_t, std::shared_ptr<Request>> m_requests;
+        mutable bool m_connected;
+        mutable std::mutex m_requests_mutex;
+        mutable std::atomic<std::uint64_t> m_next_id;
+
+        std::thread m_receiver;
+
+        // Options sent with the latest scene, the scene is sent again if they change
+        std::vector<char> m_options;
+        bool m_has_scene;
+
+        CommitStatistics m_stats;
+    };
+}
@@ -0,0 +1,302 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef REMOTE_PROTOCOL_H
+#define REMOTE_PROTOCOL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../util/socket.h"
+
+namespace RadeonRays
+{
+    ///< Messages exchanged by remote intersection devices and RemoteServer.
+    ///< Every message is a header followed by size bytes of payload, answers
+    ///< carry the id of their request and may arrive in any order.
+    ///<
+    ///< kScene:     options accepted by IsSceneOption followed by a scene snapshot (see SceneSnapshot),
+    ///<             answered once the scene has been committed
+    ///< kIntersect: active rays of a closest hit query, inactive rays are left out
+    ///< kOcclude:   active rays of an any hit query
+    ///< kResult:    Intersection or int results of the rays of a query,
+    ///<             empty for kScene
+    ///< kError:     error message of a failed request
+    ///<
+    namespace Remote
+    {
+        // Bump on any message layout change
+        static std::uint32_t const kMagic = 0x31505252; // "RRP1"
+
+        static int const kDefaultPort = 7755;
+
+        // Rays of a query message, larger queries are split by the client
+        static std::size_t const kMaxQueryRays = 1 << 21;
+        // Bytes of a scene message
+        static std::uint64_t const kMaxScenePayload = 1ull << 32;
+        // Bytes of an error message
+        static std::uint64_t const kMaxErrorPayload = 1 << 16;
+
+        enum MessageType
+        {
+            kScene = 1,
+            kIntersect,
+            kOcclude,
+            kResult,
+            kError
+        };
+
+        struct MessageHeader
+        {
+            std::uint32_t magic;
+            std::uint32_t type;
+            std::uint64_t id;
+            std::uint64_t size;
+        };
+
+        // Option of a scene message
+        struct SceneOption
+        {
+            std::string name;
+            std::string strval;
+            float floatval;
+            bool is_string;
+        };
+
+        // Options of scene messages, they only change how trees are built and traversed. Others could make
+        // the server write files (capture, tree cache), compile client code (hit filters, callbacks, custom
+        // intersectors), hold server resources (thread counts, shared libraries) or change the layouts of answers
+        static char const* const kSceneOptions[] =
+        {
+            "acc.auto_probe_rays",
+            "acc.memory_budget",
+            "acc.sort_rays",
+            "acc.tune_local_size",
+            "acc.type",
+            "acc.watertight",
+            "bvh.builder",
+            "bvh.compact_transforms",
+            "bvh.compressed",
+            "bvh.dedup_meshes",
+            "bvh.direction_ordered",
+            "bvh.force2level",
+            "bvh.forceflat",
+            "bvh.hlbvh.builder",
+            "bvh.hlbvh.morton64",
+            "bvh.hlbvh.refit_max_cost",
+            "bvh.hlbvh.traversal",
+            "bvh.hlbvh.treelets",
+            "bvh.layout",
+            "bvh.lbvh.sah_top",
+            "bvh.max_leaf_size",
+            "bvh.occlusion_area_order",
+            "bvh.packed_vertices",
+            "bvh.packet_traversal",
+            "bvh.persistent_threads",
+            "bvh.precomputed_triangles",
+            "bvh.ray_samples_weight",
+            "bvh.refit",
+            "bvh.sah.extra_node_budget",
+            "bvh.sah.max_split_depth",
+            "bvh.sah.min_overlap",
+            "bvh.sah.num_bins",
+            "bvh.sah.traversal_cost",
+            "bvh.sah.use_splits",
+            "bvh.specialize_kernels",
+            "bvh.toplevel.builder",
+            "bvh.toplevel.incremental_max_cost",
+            "bvh.triangle_pairs",
+            "embree.build_quality",
+            "embree.chunk_size",
+            "embree.compact",
+            "embree.robust",
+            "embree.sort_rays",
+            "embree.traversal",
+            "grid.density",
+            "grid.top_density"
+        };
+
+        // Check an option of a scene message, formats are accepted at the values the protocol uses
+        inline bool IsSceneOption(SceneOption const& option)
+        {
+            if (option.name == "acc.hit_format" || option.name == "acc.ray_format")
+            {
+                return option.is_string && option.strval == "full";
+            }
+
+            if (option.name == "acc.occlusion_format")
+            {
+                return option.is_string && option.strval == "int";
+            }
+
+            return std::find(std::begin(kSceneOptions), std::end(kSceneOptions), option.name) != std::end(kSceneOptions);
+        }
+
+        // Send a message, the caller serializes concurrent sends on the socket
+        inline bool WriteMessage(Socket const& socket, MessageType type, std::uint64_t id, void const* payload, std::size_t size)
+        {
+            MessageHeader header = { kMagic, static_cast<std::uint32_t>(type), id, size };
+            return socket.Send(&header, sizeof(header)) && (size == 0 || socket.Send(payload, size));
+        }
+
+        // Largest payload of a message type, 0 for unknown types
+        inline std::uint64_t GetMaxPayloadSize(std::uint32_t type)
+        {
+            switch (type)
+            {
+            case kScene:
+                return kMaxScenePayload;
+            case kIntersect:
+            case kOcclude:
+                return kMaxQueryRays * sizeof(ray);
+            case kResult:
+                return kMaxQueryRays * sizeof(Intersection);
+            case kError:
+                return kMaxErrorPayload;
+            default:
+                return 0;
+            }
+        }
+
+        // Receive a message, false on failure or malformed messages.
+        // Sizes are checked before allocating, so a malformed header can't exhaust memory
+        inline bool ReadMessage(Socket const& socket, MessageHeader& header, std::vector<char>& payload)
+        {
+            if (!socket.Receive(&header, sizeof(header)) || header.magic != kMagic ||
+                header.size > GetMaxPayloadSize(header.type) || header.size > std::numeric_limits<std::size_t>::max())
+            {
+                return false;
+            }
+
+            payload.resize(static_cast<std::size_t>(header.size));
+            return payload.empty() || socket.Receive(&payload[0], payload.size());
+        }
+
+        inline void Append(std::vector<char>& payload, void const* data, std::size_t size)
+        {
+            auto bytes = static_cast<char const*>(data);
+            payload.insert(payload.end(), bytes, bytes + size);
+        }
+
+        // Options go first in a scene payload: count, then type, name and value of each
+        inline void WriteSceneOptions(std::vector<SceneOption> const& options, std::vector<char>& payload)
+        {
+            auto const count = static_cast<std::uint32_t>(options.size());
+            Append(payload, &count, sizeof(count));
+
+            for (auto const& option : options)
+            {
+                std::uint32_t const is_string = option.is_string ? 1 : 0;
+                auto const namelen = static_cast<std::uint32_t>(option.name.size());
+                Append(payload, &is_string, sizeof(is_string));
+                Append(payload, &namelen, sizeof(namelen));
+                Append(payload, option.name.data(), namelen);
+
+                if (option.is_string)
+                {
+                    auto const len = static_cast<std::uint32_t>(option.strval.size());
+                    Append(payload, &len, sizeof(len));
+                    Append(payload, option.strval.data(), len);
+                }
+                else
+                {
+                    Append(payload, &option.floatval, sizeof(float));
+                }
+            }
+        }
+
+        // Parse the options of a scene payload, returns the offset of the snapshot or 0 if malformed
+        inline std::size_t ReadSceneOptions(std::vector<char> const& payload, std::vector<SceneOption>& options)
+        {
+            std::size_t offset = 0;
+            auto read = [&payload, &offset](void* data, std::size_t size)
+            {
+                if (payload.size() - offset < size)
+                {
+                    return false;
+                }
+
+                if (size)
+                {
+                    std::memcpy(data, &payload[offset], size);
+                }
+                offset += size;
+                return true;
+            };
+
+            auto read_string = [&payload, &offset, &read](std::string& s)
+            {
+                std::uint32_t len = 0;
+                if (!read(&len, sizeof(len)) || payload.size() - offset < len)
+                {
+                    return false;
+                }
+
+                s.assign(payload.data() + offset, len);
+                offset += len;
+                return true;
+            };
+
+            std::uint32_t count = 0;
+            if (!read(&count, sizeof(count)))
+            {
+                return 0;
+            }
+
+            options.clear();
+            for (std::uint32_t i = 0; i < count; ++i)
+            {
+                SceneOption option;
+                std::uint32_t is_string = 0;
+                option.floatval = 0.f;
+
+                if (!read(&is_string, sizeof(is_string)) || !read_string(option.name))
+                {
+                    return 0;
+                }
+
+                option.is_string = is_string != 0;
+                if (option.is_string ? !read_string(option.strval) : !read(&option.floatval, sizeof(float)))
+                {
+                    return 0;
+                }
+
+                options.push_back(option);
+            }
+
+            return offset;
+        }
+
+        // Size of a result of the query type
+        inline std::size_t GetResultSize(MessageType type)
+        {
+            return type == kIntersect ? sizeof(Intersection) : sizeof(int);
+        }
+    }
+}
+
+#endif // REMOTE_PROTOCOL_H
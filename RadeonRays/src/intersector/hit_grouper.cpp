@@ -0,0 +1,191 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "hit_grouper.h"
+#include "memory_usage.h"
+#include "radeon_rays.h"
+#include "buffer.h"
+#include "primitives.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+
+    struct HitGrouper::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Parallel primitives
+        Calc::Primitives* pp;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* key_func;
+        Calc::Function* output_func;
+
+        // Group keys and ray indices
+        Calc::Buffer* keys;
+        Calc::Buffer* indices;
+        Calc::Buffer* sorted_keys;
+        Calc::Buffer* sorted_indices;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , pp(nullptr)
+            , executable(nullptr)
+            , keys(nullptr)
+            , indices(nullptr)
+            , sorted_keys(nullptr)
+            , sorted_indices(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(keys);
+            device->DeleteBuffer(indices);
+            device->DeleteBuffer(sorted_keys);
+            device->DeleteBuffer(sorted_indices);
+
+            if (executable)
+            {
+                executable->DeleteFunction(key_func);
+                executable->DeleteFunction(output_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
+        }
+    };
+
+    HitGrouper::HitGrouper(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+        , m_capacity(0)
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL || !device->HasBuiltinPrimitives(),
+            "Hit grouping is only supported by OpenCL devices");
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/group_hits.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_group_hits_opencl, std::strlen(g_group_hits_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->key_func = m_gpudata->executable->CreateFunction("calculate_hit_keys_main");
+        m_gpudata->output_func = m_gpudata->executable->CreateFunction("write_hit_groups_main");
+
+        m_gpudata->pp = m_device->CreatePrimitives();
+    }
+
+    HitGrouper::~HitGrouper()
+    {
+    }
+
+    void HitGrouper::AllocateBuffers(std::uint32_t max_rays)
+    {
+        m_device->DeleteBuffer(m_gpudata->keys);
+        m_device->DeleteBuffer(m_gpudata->indices);
+        m_device->DeleteBuffer(m_gpudata->sorted_keys);
+        m_device->DeleteBuffer(m_gpudata->sorted_indices);
+
+        m_gpudata->keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->sorted_keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->sorted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+
+        m_capacity = max_rays;
+    }
+
+    void HitGrouper::GroupHits(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* shape_keys, int num_keys, Calc::Buffer* out_indices,
+        Calc::Buffer* out_keys, Calc::Event** event)
+    {
+        // Buffers are reused between calls and only grow
+        if (max_rays > m_capacity)
+        {
+            AllocateBuffers(max_rays);
+        }
+
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Keys of all the max_rays entries, the actual number of rays is only known on the device.
+        // Hits stand in for missing shape keys since they are not read then.
+        int size = static_cast<int>(max_rays);
+
+        int arg = 0;
+        m_gpudata->key_func->SetArg(arg++, hits);
+        m_gpudata->key_func->SetArg(arg++, num_rays);
+        m_gpudata->key_func->SetArg(arg++, shape_keys ? shape_keys : hits);
+        m_gpudata->key_func->SetArg(arg++, sizeof(num_keys), &num_keys);
+        m_gpudata->key_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->key_func->SetArg(arg++, m_gpudata->keys);
+        m_gpudata->key_func->SetArg(arg++, m_gpudata->indices);
+        m_device->Execute(m_gpudata->key_func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        // Radix sort is stable, so rays of a group keep their order
+        m_gpudata->pp->SortRadixInt32(queue_idx, m_gpudata->keys, m_gpudata->sorted_keys, m_gpudata->indices, m_gpudata->sorted_indices, max_rays);
+
+        // Primitives don't signal events, so results are written by a kernel which does.
+        // Sorted keys stand in for missing output keys since they are not written then.
+        int write_keys = out_keys ? 1 : 0;
+
+        arg = 0;
+        m_gpudata->output_func->SetArg(arg++, m_gpudata->sorted_keys);
+        m_gpudata->output_func->SetArg(arg++, m_gpudata->sorted_indices);
+        m_gpudata->output_func->SetArg(arg++, sizeof(write_keys), &write_keys);
+        m_gpudata->output_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->output_func->SetArg(arg++, out_indices);
+        m_gpudata->output_func->SetArg(arg++, out_keys ? out_keys : m_gpudata->sorted_keys);
+        m_device->Execute(m_gpudata->output_func, queue_idx, globalsize, kWorkGroupSize, event);
+    }
+
+    void HitGrouper::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->keys);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_keys);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_indices);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
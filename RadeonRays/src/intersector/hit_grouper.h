@@ -0,0 +1,73 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef HIT_GROUPER_H
+#define HIT_GROUPER_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class orders ray indices of closest hits by a key of the hit shape
+    ///< (shape id or a user key per shape id) on the device with the radix sort
+    ///< of parallel primitives, so shading passes can run rays of the same
+    ///< material together without a sort of their own.
+    ///<
+    class HitGrouper
+    {
+    public:
+        // Throws if the device doesn't provide radix sort
+        HitGrouper(Calc::Device* device);
+
+        ~HitGrouper();
+
+        // Write ray indices ordered by key into out_indices and their keys into out_keys
+        // (might be nullptr), shape_keys might be nullptr
+        void GroupHits(std::uint32_t queue_idx, Calc::Buffer const* hits, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* shape_keys, int num_keys, Calc::Buffer* out_indices,
+            Calc::Buffer* out_keys, Calc::Event** event);
+
+        // Add scratch buffers and kernel binaries to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        void AllocateBuffers(std::uint32_t max_rays);
+
+        HitGrouper(HitGrouper const&);
+        HitGrouper& operator = (HitGrouper const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Number of rays GPU buffers can hold
+        std::uint32_t m_capacity;
+    };
+}
+
+#endif // HIT_GROUPER_H
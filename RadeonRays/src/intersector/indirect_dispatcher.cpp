@@ -0,0 +1,125 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "indirect_dispatcher.h"
+#include "memory_usage.h"
+#include "buffer.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <cstring>
+#include <assert.h>
+
+#if USE_VULKAN
+#include "device_vk.h"
+#endif
+
+#ifdef RR_EMBED_KERNELS
+#if USE_VULKAN
+#    include "RadeonRays/src/kernelcache/kernels_vk.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    struct IndirectDispatcher::GpuData
+    {
+        // Device
+        Calc::Device* device;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* args_func;
+
+        // VkDispatchIndirectCommand of the latest query
+        Calc::Buffer* args;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , executable(nullptr)
+            , args_func(nullptr)
+            , args(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(args);
+
+            if (executable)
+            {
+                executable->DeleteFunction(args_func);
+                device->DeleteExecutable(executable);
+            }
+        }
+    };
+
+    IndirectDispatcher::IndirectDispatcher(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kVulkan,
+            "Indirect dispatch is only supported by Vulkan devices");
+
+#ifndef RR_EMBED_KERNELS
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/dispatch_args.comp", nullptr, 0, nullptr);
+#else
+#if USE_VULKAN
+        m_gpudata->executable = m_device->CompileExecutable(g_dispatch_args_vulkan, std::strlen(g_dispatch_args_vulkan), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->args_func = m_gpudata->executable->CreateFunction("dispatch_args_main");
+
+        // x, y and z group counts
+        m_gpudata->args = m_device->CreateBuffer(3 * sizeof(std::uint32_t), Calc::BufferType::kWrite);
+    }
+
+    IndirectDispatcher::~IndirectDispatcher()
+    {
+    }
+
+    void IndirectDispatcher::Execute(Calc::Function const* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::uint32_t max_groups, std::uint32_t local_size, Calc::Event** event) const
+    {
+#if USE_VULKAN
+        std::uint32_t params[2] = { local_size, max_groups };
+
+        int arg = 0;
+        m_gpudata->args_func->SetArg(arg++, num_rays);
+        m_gpudata->args_func->SetArg(arg++, m_gpudata->args);
+        m_gpudata->args_func->SetArg(arg++, sizeof(params), params);
+
+        // Vulkan devices take the number of groups
+        m_device->Execute(m_gpudata->args_func, queue_idx, 1, 1, nullptr);
+
+        static_cast<Calc::DeviceVulkan*>(m_device)->ExecuteIndirect(func, queue_idx, m_gpudata->args, 0, event);
+#endif
+    }
+
+    void IndirectDispatcher::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->args);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
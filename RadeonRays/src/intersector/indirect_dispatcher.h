@@ -0,0 +1,68 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef INDIRECT_DISPATCHER_H
+#define INDIRECT_DISPATCHER_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class launches ray query kernels with as many groups as the ray
+    ///< count in device memory needs. A single group kernel turns the count
+    ///< into dispatch arguments, so queries fed by GPU compaction don't launch
+    ///< empty groups for maxrays rays.
+    ///<
+    class IndirectDispatcher
+    {
+    public:
+        // Throws if the device is not a Vulkan one
+        IndirectDispatcher(Calc::Device* device);
+
+        ~IndirectDispatcher();
+
+        // Execute func over num_rays work items in groups of local_size,
+        // the number of groups is clamped to max_groups
+        void Execute(Calc::Function const* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::uint32_t max_groups, std::uint32_t local_size, Calc::Event** event) const;
+
+        // Add scratch buffers and kernel binaries to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        IndirectDispatcher(IndirectDispatcher const&);
+        IndirectDispatcher& operator = (IndirectDispatcher const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+    };
+}
+
+#endif // INDIRECT_DISPATCHER_H
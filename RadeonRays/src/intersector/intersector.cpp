@@ -1,13 +1,56 @@
 #include "intersector.h"
 #include "device.h"
+#include "executable.h"
+
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../accelerator/bvh.h"
+#include "../translator/bvh_cache.h"
+#include "ray_sorter.h"
+#include "ray_decoder.h"
+#include "indirect_dispatcher.h"
+#include "kernel_timer.h"
+#include "memory_usage.h"
+#include "../util/trace.h"
+#include "../device/calc_buffer_pool.h"
+#include "../device/calc_scratch_buffers.h"
+#include "../except/except.h"
+
+#include <algorithm>
 
 namespace RadeonRays
 {
+    // "acc.watertight" defaults to the premake option kernels are built with
+#ifdef RR_WATERTIGHT
+    static bool const kWatertightDefault = true;
+#else
+    static bool const kWatertightDefault = false;
+#endif
+    // "bvh.ray_samples_weight" default
+    static float const kDefaultRaySamplesWeight = 0.5f;
+
     Intersector::Intersector(Calc::Device *device)
-        : m_device(device),
-        m_counter(device->CreateBuffer(sizeof(int), Calc::BufferType::kRead),
-                  [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); })
+        : m_device(device)
+        , m_stats()
+        , m_hit_format(kHitFormatFull)
+        , m_occlusion_bits(false)
+        , m_filter_data(nullptr)
+        , m_traversal_stats(false)
+        , m_watertight(kWatertightDefault)
+        , m_local_size(GetDefaultLocalSize(device))
+        , m_stats_buffer(nullptr)
+        , m_hint_buffer(nullptr)
+        , m_timer(new KernelTimer(device))
+        , m_queue(0)
+        , m_ray_stride(sizeof(ray))
+        , m_buffer_pool(new CalcBufferPool(device))
+        , m_scratch(new CalcScratchBuffers(device))
     {
+        if (device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_indirect_dispatcher.reset(new IndirectDispatcher(device));
+        }
     }
 
     Intersector::~Intersector()
@@ -16,9 +59,376 @@ namespace RadeonRays
     
     void Intersector::SetWorld(World const &world)
     {
+        // Tree figures describe the current tree, so they are kept until it is rebuilt
+        CommitStatistics stats = CommitStatistics();
+        stats.num_nodes = m_stats.num_nodes;
+        stats.num_leaves = m_stats.num_leaves;
+        stats.height = m_stats.height;
+        stats.sah_cost = m_stats.sah_cost;
+        m_stats = stats;
+
+        // Acceleration structure updates go to queue 0
+        SwitchQueue(0);
+
+        auto profiling = world.options_.GetOption(Options::kAccProfiling);
+        m_timer->SetEnabled(profiling && profiling->AsFloat() > 0.f);
+        m_timer->Clear();
+
+        auto hitformat = world.options_.GetOption(Options::kAccHitFormat);
+        std::string format = hitformat ? hitformat->AsString() : "full";
+
+        HitFormat hit_format = kHitFormatFull;
+        if (format == "t")
+        {
+            hit_format = kHitFormatT;
+        }
+        else if (format == "primid_t")
+        {
+            hit_format = kHitFormatPrimIdT;
+        }
+        else if (format == "ids")
+        {
+            hit_format = kHitFormatIds;
+        }
+        else if (format == "soa")
+        {
+            hit_format = kHitFormatSoa;
+        }
+        else
+        {
+            ThrowIf(format != "full", "Unknown hit format: " + format);
+        }
+
+        // Sorting scatters full Intersection structs back
+        auto sortrays = world.options_.GetOption(Options::kAccSortRays);
+        bool sort = sortrays && sortrays->AsFloat() > 0.f;
+
+        ThrowIf(hit_format != kHitFormatFull && !SupportsCompactHits(),
+            "Compact hit formats are only supported by bvh and fatbvh accelerators on OpenCL devices");
+        ThrowIf(hit_format != kHitFormatFull && sort, "Compact hit formats can't be used with acc.sort_rays");
+
+        // Packed words can't be scattered back and rays of a word are traced by one work group
+        auto occlusionformat = world.options_.GetOption(Options::kAccOcclusionFormat);
+        std::string occlusion = occlusionformat ? occlusionformat->AsString() : "int";
+        ThrowIf(occlusion != "int" && occlusion != "bits", "Unknown occlusion format: " + occlusion);
+
+        bool const occlusion_bits = occlusion == "bits";
+        ThrowIf(occlusion_bits && !SupportsOcclusionBits(),
+            "Bit-packed occlusion results are only supported by bvh and uncompressed fatbvh accelerators on OpenCL devices");
+        ThrowIf(occlusion_bits && sort, "Bit-packed occlusion results can't be used with acc.sort_rays");
+
+        // Callbacks write to user defined outputs which can't be scattered back
+        auto hitcallback = world.options_.GetOption(Options::kAccHitCallback);
+        if (hitcallback && !hitcallback->AsString().empty())
+        {
+            ThrowIf(!SupportsHitCallback(), "Hit callbacks are only supported by bvh accelerator on OpenCL devices");
+            ThrowIf(sort, "Hit callbacks can't be used with acc.sort_rays");
+            ThrowIf(occlusion_bits, "Hit callbacks can't be used with bit-packed occlusion results");
+        }
+
+        // Filters are compiled into the traversal program like callbacks and get the same ray indices
+        auto hitfilter = world.options_.GetOption(Options::kAccHitFilter);
+        if (hitfilter && !hitfilter->AsString().empty())
+        {
+            ThrowIf(!SupportsHitCallback(), "Hit filters are only supported by bvh accelerator on OpenCL devices");
+            ThrowIf(sort, "Hit filters can't be used with acc.sort_rays");
+        }
+
+        // Counters are written by ray index, which sorting would permute
+        auto traversalstats = world.options_.GetOption(Options::kAccTraversalStats);
+        bool traversal_stats = traversalstats && traversalstats->AsFloat() > 0.f;
+
+        ThrowIf(traversal_stats && !SupportsTraversalStats(),
+            "Traversal statistics are only supported by bvh and fatbvh accelerators on OpenCL devices");
+        ThrowIf(traversal_stats && sort, "Traversal statistics can't be used with acc.sort_rays");
+
+        // Kernels of most accelerators are compiled once, those can only follow the build
+        auto watertightopt = world.options_.GetOption(Options::kAccWatertight);
+        bool watertight = watertightopt ? watertightopt->AsFloat() > 0.f : kWatertightDefault;
+
+        ThrowIf(watertight != kWatertightDefault && !SupportsWatertight(),
+            "Watertight mode can only be switched by bvh and fatbvh accelerators on OpenCL devices");
+
+        m_hit_format = hit_format;
+        m_occlusion_bits = occlusion_bits;
+        m_traversal_stats = traversal_stats;
+        m_watertight = watertight;
+
+        auto rayformat = world.options_.GetOption(Options::kAccRayFormat);
+        std::string layout = rayformat ? rayformat->AsString() : "full";
+
+        if (layout == "full")
+        {
+            m_ray_decoder.reset();
+            m_ray_stride = sizeof(ray);
+        }
+        else
+        {
+            ThrowIf(layout != "compact" && layout != "oct" && layout != "soa", "Unknown ray format: " + layout);
+
+            if (!m_ray_decoder)
+            {
+                m_ray_decoder.reset(new RayDecoder(m_device));
+            }
+
+            if (layout == "soa")
+            {
+                m_ray_decoder->SetFormat(RayDecoder::kFormatSoa);
+                m_ray_stride = sizeof(ray);
+            }
+            else
+            {
+                m_ray_decoder->SetFormat(layout == "oct" ? RayDecoder::kFormatOct : RayDecoder::kFormatCompact);
+                m_ray_stride = layout == "oct" ? sizeof(ray_oct) : sizeof(ray_compact);
+            }
+        }
+
+        // Sorting kernels are only compiled once they are needed,
+        // devices without radix sort ignore the option
+        bool can_sort = m_device->GetPlatform() == Calc::Platform::kOpenCL && m_device->HasBuiltinPrimitives();
+
+        if (can_sort && sort)
+        {
+            if (!m_ray_sorter)
+            {
+                m_ray_sorter.reset(new RaySorter(m_device));
+            }
+        }
+        else
+        {
+            m_ray_sorter.reset();
+        }
+
+        auto poolsize = world.options_.GetOption(Options::kAccBufferPoolSize);
+        m_buffer_pool->SetBudget(poolsize ?
+            static_cast<std::size_t>(std::max(poolsize->AsFloat(), 0.f) * 1024.f * 1024.f) :
+            CalcBufferPool::kDefaultBudget);
+
+        TraceScope trace("Process", "intersector");
         Process(world);
     }
 
+    CommitStatistics const& Intersector::GetStatistics() const
+    {
+        return m_stats;
+    }
+
+    void Intersector::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        for (auto const& counter : m_batch_counters)
+        {
+            AddBufferBytes(usage.scratch_bytes, counter.get());
+        }
+
+        if (m_ray_sorter)
+        {
+            m_ray_sorter->GetMemoryUsage(usage);
+        }
+
+        if (m_ray_decoder)
+        {
+            m_ray_decoder->GetMemoryUsage(usage);
+        }
+
+        if (m_indirect_dispatcher)
+        {
+            m_indirect_dispatcher->GetMemoryUsage(usage);
+        }
+
+        usage.pool_bytes += m_buffer_pool->GetCachedBytes();
+
+        GetMemoryUsageImpl(usage);
+    }
+
+    int Intersector::GetTimings(KernelTiming* timings, int max_timings) const
+    {
+        return m_timer->GetTimings(timings, max_timings);
+    }
+
+    void Intersector::SetHitFilterData(Calc::Buffer const* data)
+    {
+        m_filter_data = data;
+    }
+
+    void Intersector::SetTraversalStatsBuffer(Calc::Buffer* stats)
+    {
+        m_stats_buffer = stats;
+    }
+
+    void Intersector::SetHitHints(Calc::Buffer const* hits)
+    {
+        m_hint_buffer = hits;
+    }
+
+    void Intersector::SetScratchBuffers(std::shared_ptr<CalcScratchBuffers> scratch)
+    {
+        m_scratch = std::move(scratch);
+    }
+
+    void Intersector::SetTraversalStatsArgs(Calc::Function* func, int& arg) const
+    {
+        if (!m_traversal_stats)
+        {
+            return;
+        }
+
+        // Without a buffer kernels get a valid one and nothing to write to it
+        int num_stats = m_stats_buffer ? static_cast<int>(m_stats_buffer->GetSize() / sizeof(TraversalStats)) : 0;
+        func->SetArg(arg++, m_stats_buffer ? m_stats_buffer : GetRayCountBuffer(m_queue));
+        func->SetArg(arg++, sizeof(num_stats), &num_stats);
+    }
+
+    void Intersector::SetLocalSize(std::size_t local_size)
+    {
+        ThrowIf(local_size != m_local_size && !SupportsLocalSize(), "Work group size of the intersector can't be changed");
+
+        if (local_size != m_local_size)
+        {
+            m_local_size = local_size;
+            OnLocalSizeChanged();
+        }
+    }
+
+    std::size_t Intersector::GetLocalSize() const
+    {
+        return m_local_size;
+    }
+
+    bool Intersector::SupportsLocalSize() const
+    {
+        return false;
+    }
+
+    void Intersector::OnLocalSizeChanged()
+    {
+    }
+
+    std::size_t Intersector::GetDefaultLocalSize(Calc::Device* device)
+    {
+        if (device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            return kDefaultLocalSize;
+        }
+
+        Calc::DeviceSpec spec;
+        device->GetSpec(spec);
+
+        std::size_t local_size = kDefaultLocalSize;
+
+        if (spec.max_local_size > 0)
+        {
+            local_size = std::min(local_size, spec.max_local_size);
+        }
+
+        // Partially filled hardware threads waste lanes on every launch
+        if (spec.simd_width > 0)
+        {
+            local_size = std::max(local_size / spec.simd_width, std::size_t(1)) * spec.simd_width;
+        }
+
+        return local_size;
+    }
+
+    std::size_t Intersector::RoundToLocalSize(std::size_t global_size) const
+    {
+        return ((global_size + m_local_size - 1) / m_local_size) * m_local_size;
+    }
+
+    std::size_t Intersector::GetRayStride() const
+    {
+        return m_ray_stride;
+    }
+
+    std::size_t Intersector::GetHitStride() const
+    {
+        switch (m_hit_format)
+        {
+        case kHitFormatT:
+            return sizeof(float);
+        case kHitFormatPrimIdT:
+        case kHitFormatIds:
+            return 2 * sizeof(int);
+        case kHitFormatSoa:
+            return 5 * sizeof(int);
+        default:
+            return sizeof(Intersection);
+        }
+    }
+
+    std::size_t Intersector::GetOcclusionResultSize(std::size_t num_rays) const
+    {
+        return m_occlusion_bits ? (num_rays + 31) / 32 * sizeof(std::uint32_t) : num_rays * sizeof(int);
+    }
+
+    bool Intersector::HasPlanarLayout() const
+    {
+        return m_hit_format == kHitFormatSoa || (m_ray_decoder && m_ray_decoder->GetFormat() == RayDecoder::kFormatSoa);
+    }
+
+    float Intersector::GetElapsedTime(Clock::time_point start)
+    {
+        return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+    }
+
+    void Intersector::SetBvhStatistics(Bvh const& bvh)
+    {
+        m_stats.num_nodes = bvh.GetNodeCount();
+        m_stats.num_leaves = bvh.GetLeafCount();
+        m_stats.height = bvh.GetHeight();
+        m_stats.sah_cost = bvh.GetSahCost();
+    }
+
+    Calc::Buffer* Intersector::AcquireBuffer(std::size_t size, std::uint32_t type, void* initdata) const
+    {
+        return initdata ? m_buffer_pool->Acquire(size, type, initdata) : m_buffer_pool->Acquire(size, type);
+    }
+
+    void Intersector::ReleaseBuffer(Calc::Buffer* buffer) const
+    {
+        m_buffer_pool->Release(buffer);
+    }
+
+    void Intersector::ExecuteQuery(char const* name, Calc::Function const* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+        std::size_t global_size, std::size_t local_size, Calc::Event** event) const
+    {
+        if (!m_indirect_dispatcher)
+        {
+            m_timer->Execute(name, func, queue_idx, global_size, local_size, event);
+            return;
+        }
+
+        Calc::Event* local = nullptr;
+        auto max_groups = static_cast<std::uint32_t>((global_size + local_size - 1) / local_size);
+        m_indirect_dispatcher->Execute(func, queue_idx, num_rays, max_groups, static_cast<std::uint32_t>(local_size), m_timer->GetLaunchEvent(&local, event));
+        m_timer->Record(name, queue_idx, local, event);
+    }
+
+    std::unique_ptr<BvhCache> Intersector::CreateBvhCache(World const& world)
+    {
+        auto dir = world.options_.GetOption(Options::kBvhCacheDir);
+        std::string path = dir ? dir->AsString() : std::string();
+
+        // Scene snapshots work without a cache directory
+        if ((path.empty() && !world.bvh_snapshot_) || world.ray_samples_)
+        {
+            return nullptr;
+        }
+
+        return std::unique_ptr<BvhCache>(new BvhCache(path, world.bvh_snapshot_));
+    }
+
+    void Intersector::ApplyRaySamples(Bvh& bvh, World const& world)
+    {
+        if (!world.ray_samples_ || world.ray_samples_->empty())
+        {
+            return;
+        }
+
+        auto weight = world.options_.GetOption(Options::kBvhRaySamplesWeight);
+        bvh.SetRaySamples(world.ray_samples_->data(), static_cast<int>(world.ray_samples_->size()),
+            weight ? std::min(std::max(weight->AsFloat(), 0.f), 1.f) : kDefaultRaySamplesWeight);
+    }
+
     bool Intersector::IsCompatible(World const& world) const
     {
         return IsCompatibleImpl(world);
@@ -28,32 +438,488 @@ namespace RadeonRays
     {
         return true;
     }
+
+    void Intersector::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+    }
+
+    bool Intersector::SupportsCompactHits() const
+    {
+        return false;
+    }
+
+    bool Intersector::SupportsOcclusionBits() const
+    {
+        return false;
+    }
+
+    bool Intersector::SupportsHitCallback() const
+    {
+        return false;
+    }
+
+    bool Intersector::SupportsTraversalStats() const
+    {
+        return false;
+    }
+
+    bool Intersector::SupportsWatertight() const
+    {
+        return false;
+    }
+
+    bool Intersector::CanRefit(World const& world)
+    {
+        auto refit = world.options_.GetOption(Options::kBvhRefit);
+
+        if (world.has_changed() || (refit && refit->AsFloat() == 0.f))
+        {
+            return false;
+        }
+
+        int const refit_changes = ShapeImpl::kStateChangeTransform | ShapeImpl::kStateChangeVertices;
+
+        std::vector<World::ShapeChange> changes;
+        world.GetChanges(changes);
+
+        return !changes.empty() && std::all_of(changes.cbegin(), changes.cend(), [refit_changes](World::ShapeChange const& change)
+        {
+            return (change.flags & ~refit_changes) == 0;
+        });
+    }
+
+    bool Intersector::HasGeometryChanged(Shape const* shape)
+    {
+        int const geometry_changes = ShapeImpl::kStateChangeTransform | ShapeImpl::kStateChangeVertices;
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        if (shapeimpl->GetStateChange() & geometry_changes)
+        {
+            return true;
+        }
+
+        if (shapeimpl->is_instance())
+        {
+            auto baseshape = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shape)->GetBaseShape());
+            return (baseshape->GetStateChange() & ShapeImpl::kStateChangeVertices) != 0;
+        }
+
+        return false;
+    }
+
+    void Intersector::GetWorldSpaceVertices(Shape const* shape, float3* vertices)
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        // Instances are using their own transform for base shape geometry
+        Mesh const* mesh = shapeimpl->is_instance() ?
+            static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+            static_cast<Mesh const*>(shape);
+
+        matrix m, minv;
+        shape->GetTransform(m, minv);
+
+        for (int j = 0; j < mesh->num_vertices(); ++j)
+        {
+            vertices[j] = transform_point(mesh->GetVertex(j), m);
+        }
+    }
     
+    void Intersector::GetPackedWorldSpaceVertices(Shape const* shape, float* vertices)
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        Mesh const* mesh = shapeimpl->is_instance() ?
+            static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+            static_cast<Mesh const*>(shape);
+
+        matrix m, minv;
+        shape->GetTransform(m, minv);
+
+        for (int j = 0; j < mesh->num_vertices(); ++j)
+        {
+            float3 const v = transform_point(mesh->GetVertex(j), m);
+            vertices[3 * j] = v.x;
+            vertices[3 * j + 1] = v.y;
+            vertices[3 * j + 2] = v.z;
+        }
+    }
+
+    void Intersector::PackShapeRanges(std::vector<int> const& face_shape_ids, std::vector<int>& ranges)
+    {
+        std::vector<int> first_faces;
+        std::vector<int> shape_ids;
+
+        for (int i = 0; i < static_cast<int>(face_shape_ids.size()); ++i)
+        {
+            if (shape_ids.empty() || shape_ids.back() != face_shape_ids[i])
+            {
+                first_faces.push_back(i);
+                shape_ids.push_back(face_shape_ids[i]);
+            }
+        }
+
+        ranges.clear();
+        ranges.reserve(1 + 2 * shape_ids.size());
+        ranges.push_back(static_cast<int>(shape_ids.size()));
+        ranges.insert(ranges.end(), first_faces.cbegin(), first_faces.cend());
+        ranges.insert(ranges.end(), shape_ids.cbegin(), shape_ids.cend());
+    }
+
+    std::size_t Intersector::UploadWorldSpaceVertices(Calc::Buffer* buffer, std::vector<Shape const*> const& shapes, std::vector<int> const& vertex_start,
+        int first, int last, bool packed, bool changed_only) const
+    {
+        std::size_t const vertexsize = GetVertexSize(packed);
+        int const startvertex = vertex_start[first];
+        std::size_t const size = (vertex_start[last + 1] - startvertex) * vertexsize;
+
+        if (size == 0)
+        {
+            return 0;
+        }
+
+        char* vertexdata = nullptr;
+        Calc::Event* e = nullptr;
+        m_device->MapBuffer(buffer, 0, startvertex * vertexsize, size, Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+#pragma omp parallel for
+        for (int i = first; i <= last; ++i)
+        {
+            if (changed_only && !HasGeometryChanged(shapes[i]))
+            {
+                continue;
+            }
+
+            char* shapedata = vertexdata + (vertex_start[i] - startvertex) * vertexsize;
+
+            if (packed)
+            {
+                GetPackedWorldSpaceVertices(shapes[i], reinterpret_cast<float*>(shapedata));
+            }
+            else
+            {
+                GetWorldSpaceVertices(shapes[i], reinterpret_cast<float3*>(shapedata));
+            }
+        }
+
+        m_device->UnmapBuffer(buffer, 0, vertexdata, &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        return size;
+    }
+
+    Calc::Buffer* Intersector::CreateTriangleBuffer(float3 const* vertices, int const* indices, int num_faces) const
+    {
+        std::vector<float3> triangles(3 * num_faces);
+
+        // Watertight tests need vertices shared by neighbours bit for bit, rounded edges are not
+        bool const edges = !m_watertight;
+
+#pragma omp parallel for
+        for (int i = 0; i < num_faces; ++i)
+        {
+            float3 const& v1 = vertices[indices[3 * i]];
+            triangles[3 * i] = v1;
+            triangles[3 * i + 1] = edges ? vertices[indices[3 * i + 1]] - v1 : vertices[indices[3 * i + 1]];
+            triangles[3 * i + 2] = edges ? vertices[indices[3 * i + 2]] - v1 : vertices[indices[3 * i + 2]];
+        }
+
+        return AcquireBuffer(triangles.size() * sizeof(float3), Calc::BufferType::kRead, &triangles[0]);
+    }
+
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
         Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Intersect(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        TraceScope trace("QueryIntersection", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_rays);
+        DispatchIntersect(queue_idx, rays, count, num_rays, hits, wait_event, event);
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
         Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        m_device->WriteBuffer(m_counter.get(), 0, 0, sizeof(num_rays), &num_rays, nullptr);
-        m_device->Finish(0);
-        Occluded(queue_idx, rays, m_counter.get(), num_rays, hits, wait_event, event);
+        TraceScope trace("QueryOcclusion", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_rays);
+        DispatchOccluded(queue_idx, rays, count, num_rays, hits, wait_event, event);
     }
 
     void Intersector::QueryIntersection(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        TraceScope trace("QueryIntersection", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        DispatchIntersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
     }
 
     void Intersector::QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
         std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
     {
-        Occluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+        TraceScope trace("QueryOcclusion", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        DispatchOccluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
+
+    void Intersector::QueryMixed(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays,
+        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        TraceScope trace("QueryMixed", "query");
+        ThrowIf(m_hit_format != kHitFormatFull, "Mixed queries need full hit format");
+
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_rays);
+
+        // Decoded rays are never flagged as any hit, they all get their closest hit
+        if (m_ray_decoder)
+        {
+            rays = m_ray_decoder->DecodeRays(queue_idx, rays, count, num_rays);
+        }
+
+        // Rays are not sorted, two kinds of rays would need separate sort keys
+        Mixed(queue_idx, rays, count, num_rays, hits, wait_event, event);
+    }
+
+    void Intersector::Mixed(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+    }
+
+    void Intersector::QueryMultiHit(std::uint32_t queue_idx, Calc::Buffer const *rays, std::uint32_t num_rays, std::uint32_t k,
+        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        TraceScope trace("QueryMultiHit", "query");
+        ThrowIf(k == 0 || k > kMaxMultiHits, "Multi hit queries support 1 to 8 hits per ray");
+
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_rays);
+
+        if (m_ray_decoder)
+        {
+            rays = m_ray_decoder->DecodeRays(queue_idx, rays, count, num_rays);
+        }
+
+        // Rays are not sorted as hits can't be scattered back in groups of k
+        MultiHit(queue_idx, rays, count, num_rays, k, hits, wait_event, event);
+    }
+
+    void Intersector::MultiHit(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, std::uint32_t k, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        Throw("Multi hit queries are only supported by bvh accelerator on OpenCL devices");
+    }
+
+    void Intersector::QueryProximity(std::uint32_t queue_idx, Calc::Buffer const *spheres, std::uint32_t num_spheres,
+        Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        TraceScope trace("QueryProximity", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_spheres);
+        Proximity(queue_idx, spheres, count, num_spheres, hits, wait_event, event);
+    }
+
+    void Intersector::Proximity(std::uint32_t queue_idx, Calc::Buffer const *spheres, Calc::Buffer const *num_spheres,
+        std::uint32_t max_spheres, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        Throw("Proximity queries are only supported by bvh accelerator on OpenCL devices");
+    }
+
+    void Intersector::QueryAmbientOcclusion(std::uint32_t queue_idx, Calc::Buffer const *points, std::uint32_t num_points,
+        std::uint32_t num_samples, float radius, std::uint32_t seed, Calc::Buffer *visibility,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        TraceScope trace("QueryAmbientOcclusion", "query");
+        ThrowIf(num_samples == 0, "Ambient occlusion queries need at least one sample per point");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+        auto count = UploadCount(queue_idx, num_points);
+        AmbientOcclusion(queue_idx, points, count, num_points, num_samples, radius, seed, visibility, wait_event, event);
+    }
+
+    void Intersector::AmbientOcclusion(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points,
+        std::uint32_t max_points, std::uint32_t num_samples, float radius, std::uint32_t seed, Calc::Buffer *visibility,
+        Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        Throw("Ambient occlusion queries are only supported by bvh accelerator on OpenCL devices");
+    }
+
+    void Intersector::QueryBatch(std::uint32_t queue_idx, Query const* queries, std::uint32_t num_queries,
+        Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        TraceScope trace("QueryBatch", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+
+        auto device = m_device;
+        while (m_batch_counters.size() < num_queries)
+        {
+            m_batch_counters.emplace_back(m_device->CreateBuffer(sizeof(int), Calc::BufferType::kRead),
+                [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); });
+        }
+
+        // Fill the ray counts on the device, ordered before the queries on the queue
+        {
+            TraceScope upload("UploadCounts", "upload");
+
+            for (std::uint32_t i = 0; i < num_queries; ++i)
+            {
+                m_device->FillBuffer(m_batch_counters[i].get(), queue_idx, 0, sizeof(std::uint32_t), queries[i].num_rays, nullptr);
+            }
+        }
+
+        std::vector<Calc::Buffer const*> num_rays(num_queries);
+        for (std::uint32_t i = 0; i < num_queries; ++i)
+        {
+            num_rays[i] = m_batch_counters[i].get();
+        }
+
+        Dispatch(queue_idx, queries, &num_rays[0], num_queries, wait_event, event);
+    }
+
+    void Intersector::ReplayBatch(std::uint32_t queue_idx, Query const* queries, Calc::Buffer const* const* num_rays,
+        std::uint32_t num_queries, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        TraceScope trace("ReplayBatch", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+
+        Dispatch(queue_idx, queries, num_rays, num_queries, wait_event, event);
+    }
+
+    void Intersector::Dispatch(std::uint32_t queue_idx, Query const* queries, Calc::Buffer const* const* num_rays,
+        std::uint32_t num_queries, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        // The queue executes queries in order, so waiting before the first one
+        // and signaling after the last one covers the whole batch
+        for (std::uint32_t i = 0; i < num_queries; ++i)
+        {
+            auto e = i == 0 ? wait_event : nullptr;
+            auto ev = i == num_queries - 1 ? event : nullptr;
+
+            if (queries[i].type == kQueryOcclusion)
+            {
+                DispatchOccluded(queue_idx, queries[i].rays, num_rays[i], queries[i].num_rays, queries[i].hits, e, ev);
+            }
+            else
+            {
+                DispatchIntersect(queue_idx, queries[i].rays, num_rays[i], queries[i].num_rays, queries[i].hits, e, ev);
+            }
+        }
+    }
+
+    void Intersector::Prepare(std::uint32_t queue_idx, std::uint32_t max_rays, QueryType const* types, std::uint32_t num_types) const
+    {
+        TraceScope trace("Prepare", "query");
+        SwitchQueue(queue_idx);
+        m_timer->Clear();
+
+        // Kernels never read rays past the count on the device, so placeholder buffers
+        // of a single ray stand in for the rays and results of max_rays rays
+        auto device = m_device;
+        auto deleter = [device](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); };
+        std::unique_ptr<Calc::Buffer, decltype(deleter)> rays(m_device->CreateBuffer(m_ray_stride, Calc::BufferType::kRead), deleter);
+        std::unique_ptr<Calc::Buffer, decltype(deleter)> hits(m_device->CreateBuffer(
+            std::max(GetHitStride(), GetOcclusionResultSize(1)), Calc::BufferType::kWrite), deleter);
+
+        auto count = UploadCount(queue_idx, 0);
+
+        for (std::uint32_t i = 0; i < num_types; ++i)
+        {
+            if (types[i] == kQueryOcclusion)
+            {
+                DispatchOccluded(queue_idx, rays.get(), count, max_rays, hits.get(), nullptr, nullptr);
+            }
+            else
+            {
+                DispatchIntersect(queue_idx, rays.get(), count, max_rays, hits.get(), nullptr, nullptr);
+            }
+        }
+
+        // Placeholders are released once the launches reading them are done
+        m_device->Finish(queue_idx);
+    }
+
+    void Intersector::SwitchQueue(std::uint32_t queue_idx) const
+    {
+        // Scratch buffers are shared by all the queues, so queries
+        // submitted to the previous queue have to finish first
+        if (queue_idx != m_queue)
+        {
+            TraceScope trace("SwitchQueue", "query");
+            m_device->Finish(m_queue);
+            m_queue = queue_idx;
+        }
+    }
+
+    Calc::Buffer* Intersector::UploadCount(std::uint32_t queue_idx, std::uint32_t count) const
+    {
+        // Queries take the count from device memory, a device side fill is
+        // ordered before them on the queue so the host doesn't wait for it
+        TraceScope trace("UploadCount", "upload");
+        auto buffer = GetRayCountBuffer(queue_idx);
+        m_device->FillBuffer(buffer, queue_idx, 0, sizeof(count), count, nullptr);
+        return buffer;
+    }
+
+    Calc::Buffer* Intersector::GetRayCountBuffer(std::uint32_t queue_idx) const
+    {
+        return m_scratch->Get(CalcScratchBuffers::kRayCount, sizeof(std::uint32_t), queue_idx);
+    }
+
+    Calc::Buffer* Intersector::GetStackBuffer(std::size_t size, std::uint32_t queue_idx) const
+    {
+        return m_scratch->Get(CalcScratchBuffers::kTraversalStack, size, queue_idx);
+    }
+
+    void Intersector::DispatchIntersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        if (m_ray_decoder)
+        {
+            rays = m_ray_decoder->DecodeRays(queue_idx, rays, num_rays, max_rays);
+        }
+
+        if (!m_ray_sorter)
+        {
+            Intersect(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+            return;
+        }
+
+        // Traverse rays in sorted order and move hits back
+        auto sorted_rays = m_ray_sorter->SortRays(queue_idx, rays, num_rays, max_rays);
+        Intersect(queue_idx, sorted_rays, num_rays, max_rays, m_ray_sorter->GetSortedHits(), wait_event, nullptr);
+        m_ray_sorter->ScatterHits(queue_idx, rays, num_rays, max_rays, hits, event);
+    }
+
+    void Intersector::DispatchOccluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+        std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const
+    {
+        if (m_ray_decoder)
+        {
+            rays = m_ray_decoder->DecodeRays(queue_idx, rays, num_rays, max_rays);
+        }
+
+        if (!m_ray_sorter)
+        {
+            Occluded(queue_idx, rays, num_rays, max_rays, hits, wait_event, event);
+            return;
+        }
+
+        auto sorted_rays = m_ray_sorter->SortRays(queue_idx, rays, num_rays, max_rays);
+        Occluded(queue_idx, sorted_rays, num_rays, max_rays, m_ray_sorter->GetSortedHits(), wait_event, nullptr);
+        m_ray_sorter->ScatterOcclusion(queue_idx, rays, num_rays, max_rays, hits, event);
     }
 }
@@ -29,15 +29,26 @@ THE SOFTWARE.
 #pragma once
 #include "radeon_rays.h"
 #include "calc.h"
+#include "device.h"
 #include "buffer.h"
 #include "event.h"
 
 #include <functional>
 #include <memory>
+#include <chrono>
+#include <vector>
 
 namespace RadeonRays
 {
     class World;
+    class Bvh;
+    class BvhCache;
+    class RaySorter;
+    class RayDecoder;
+    class IndirectDispatcher;
+    class CalcBufferPool;
+    class CalcScratchBuffers;
+    class KernelTimer;
 
     /** 
     \brief Intersector interface
@@ -135,15 +146,218 @@ namespace RadeonRays
         void QueryOcclusion(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
             std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
 
+        /**
+        \brief Query closest and any hits for a batch of rays in a single launch
+
+        The function is asynchronous and returns immediately. Rays flagged by ray::SetAnyHit stop at their
+        first hit, the others find the closest one, both write Intersection structs to hits.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param hits Hit data buffer.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryMixed(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays,
+            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Query up to k closest hits for a batch of rays
+
+        The function is asynchronous and returns immediately. Hits of a ray are written sorted by distance
+        to k consecutive Intersection structs, misses fill the rest of them.
+
+        \param queue_idx Device queue index.
+        \param rays Ray buffer.
+        \param num_rays Number of rays in the buffer.
+        \param k Number of hits per ray, from 1 to kMaxMultiHits.
+        \param hits Hit data buffer holding num_rays * k Intersection structs.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryMultiHit(std::uint32_t queue_idx, Calc::Buffer const* rays, std::uint32_t num_rays, std::uint32_t k,
+            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Query the closest point of the scene within each sphere of a batch
+
+        The function is asynchronous and returns immediately. Shape and primitive IDs of the closest face,
+        barycentrics of the closest point and the distance to it are written to Intersection structs.
+
+        \param queue_idx Device queue index.
+        \param spheres Buffer of float4 sphere centers and radii.
+        \param num_spheres Number of spheres in the buffer.
+        \param hits Hit data buffer.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryProximity(std::uint32_t queue_idx, Calc::Buffer const* spheres, std::uint32_t num_spheres,
+            Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Estimate ambient occlusion of a batch of surface points
+
+        The function is asynchronous and returns immediately. Hemisphere rays of every point are generated
+        and traced by a single kernel without storing them, only the fraction of unoccluded rays is written.
+
+        \param queue_idx Device queue index.
+        \param points Buffer of SurfacePoint structs.
+        \param num_points Number of points in the buffer.
+        \param num_samples Number of rays per point.
+        \param radius Length of the rays.
+        \param seed Seed of the sample directions.
+        \param visibility Buffer receiving a float per point.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryAmbientOcclusion(std::uint32_t queue_idx, Calc::Buffer const* points, std::uint32_t num_points,
+            std::uint32_t num_samples, float radius, std::uint32_t seed, Calc::Buffer* visibility,
+            Calc::Event const* wait_event, Calc::Event** event) const;
+
+        // Maximum number of hits per ray of multi hit queries, has to match MAX_MULTI_HITS in kernels
+        static std::uint32_t const kMaxMultiHits = 8;
+        // Work group size of traversal kernels unless the device needs another one
+        static std::size_t const kDefaultLocalSize = 64;
+
+        // Query of a batch
+        struct Query
+        {
+            QueryType type;
+            Calc::Buffer const* rays;
+            std::uint32_t num_rays;
+            Calc::Buffer* hits;
+        };
+
+        /** 
+        \brief Run a batch of queries
+
+        The function is asynchronous and returns immediately. Ray counts of all the queries are uploaded
+        with a single synchronization and the queries are submitted back to back, so the result of the whole
+        batch is available as soon as event is signaled.
+
+        \param queue_idx Device queue index.
+        \param queries Queries to run in order.
+        \param num_queries Number of queries.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void QueryBatch(std::uint32_t queue_idx, Query const* queries, std::uint32_t num_queries,
+            Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Run a batch of queries with ray counts already in device memory
+
+        Same as QueryBatch without the count upload and its synchronization, used to replay query graphs.
+
+        \param queue_idx Device queue index.
+        \param queries Queries to run in order.
+        \param num_rays Single uint buffers holding the ray count of each query.
+        \param num_queries Number of queries.
+        \param wait_event Event to wait for before execution.
+        \param event Completion event.
+        */
+        void ReplayBatch(std::uint32_t queue_idx, Query const* queries, Calc::Buffer const* const* num_rays,
+            std::uint32_t num_queries, Calc::Event const* wait_event, Calc::Event** event) const;
+
+        /**
+        \brief Get ready for queries of up to max_rays rays
+
+        Scratch buffers are allocated for max_rays and each query type is run once with a zero ray count
+        in device memory, launching its kernels over max_rays work items which exit right away. The function
+        blocks until the warm-up is complete, later queries of up to max_rays rays skip allocations and
+        driver compilation.
+
+        \param queue_idx Device queue index.
+        \param max_rays Maximum number of rays of later queries.
+        \param types Query types to prepare.
+        \param num_types Number of query types.
+        */
+        void Prepare(std::uint32_t queue_idx, std::uint32_t max_rays, QueryType const* types, std::uint32_t num_types) const;
+
+        /**
+        \brief Get statistics of the latest SetWorld call.
+
+        Kernel compile time is not reported by intersectors since compilation happens on construction.
+        */
+        CommitStatistics const& GetStatistics() const;
+
+        // Add device buffers and kernel binaries of the intersector, including query helpers
+        // and buffers released into its pool, to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+        // Copy up to max_timings GPU times of kernels launched by the latest query or SetWorld call
+        // with "acc.profiling" enabled, returns the number of recorded timings
+        int GetTimings(KernelTiming* timings, int max_timings) const;
+
+        // Set buffer read by "acc.hit_filter" functions of the following queries, nullptr if they don't need any
+        void SetHitFilterData(Calc::Buffer const* data);
+        // Set buffer receiving TraversalStats of each ray of the following intersection and occlusion
+        // queries with "acc.traversal_stats" enabled, nullptr to stop recording
+        void SetTraversalStatsBuffer(Calc::Buffer* stats);
+        // Set Intersection buffer of a previous query whose hits are tested first by the following
+        // intersection queries with "bvh.hit_hints" enabled, nullptr for none
+        void SetHitHints(Calc::Buffer const* hits);
+        // Share query scratch buffers with other intersectors of the device, each intersector
+        // has its own ones otherwise. They are counted by GetMemoryUsage of their owner.
+        void SetScratchBuffers(std::shared_ptr<CalcScratchBuffers> scratch);
+
+        // Set work group size of traversal kernels, intersectors supporting it recompile them if needed
+        void SetLocalSize(std::size_t local_size);
+        // Work group size of traversal kernels
+        std::size_t GetLocalSize() const;
+        // Check if traversal kernels can be compiled for other work group sizes than the default one
+        virtual bool SupportsLocalSize() const;
+
+        // Size of a query ray as set by "acc.ray_format" option
+        std::size_t GetRayStride() const;
+        // Size of a closest hit query result as set by "acc.hit_format" option
+        std::size_t GetHitStride() const;
+        // Size of occlusion query results of num_rays rays as set by "acc.occlusion_format" option
+        std::size_t GetOcclusionResultSize(std::size_t num_rays) const;
+        // Check if rays or closest hits are laid out in planes as long as the ray count of a query
+        // ("soa" formats), such queries can't be split into parts
+        bool HasPlanarLayout() const;
+
         // Disallow intersector copies
         Intersector(Intersector const&) = delete;
         Intersector& operator = (Intersector const&) = delete;
 
     private:
+        // Wait for the queries of the previous queue if queue_idx is a different one
+        void SwitchQueue(std::uint32_t queue_idx) const;
+        // Fill the ray count scratch buffer with count on the device, returns the buffer
+        Calc::Buffer* UploadCount(std::uint32_t queue_idx, std::uint32_t count) const;
+
+        // Run the queries through ray decoding if "acc.ray_format" is not "full"
+        // and ray sorting if it is enabled by "acc.sort_rays" option
+        void DispatchIntersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const;
+        void DispatchOccluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event const *wait_event, Calc::Event **event) const;
+        // Dispatch the queries of a batch back to back
+        void Dispatch(std::uint32_t queue_idx, Query const* queries, Calc::Buffer const* const* num_rays,
+            std::uint32_t num_queries, Calc::Event const* wait_event, Calc::Event** event) const;
+
         // Preprocess implementation
         virtual void Process(World const& world) = 0;
         // Compatibility check implemetation
         virtual bool IsCompatibleImpl(World const& world) const;
+        // Add buffers and executables of the acceleration structure to usage, nothing by default
+        virtual void GetMemoryUsageImpl(MemoryUsage& usage) const;
+        // Check if Intersect implementation can write compact hit formats
+        virtual bool SupportsCompactHits() const;
+        // Check if Occluded implementation can write bit-packed results
+        virtual bool SupportsOcclusionBits() const;
+        // Check if traversal can call "acc.hit_callback" functions
+        virtual bool SupportsHitCallback() const;
+        // Check if traversal kernels can be compiled with "acc.traversal_stats" counters
+        virtual bool SupportsTraversalStats() const;
+        // Check if "acc.watertight" can differ from the build default
+        virtual bool SupportsWatertight() const;
+        // Called by SetLocalSize when the work group size changes, programs built for
+        // the previous size should be recompiled here
+        virtual void OnLocalSizeChanged();
         // Intersection implementation
         virtual void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
@@ -152,12 +366,145 @@ namespace RadeonRays
         virtual void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const = 0;
+        // Mixed query implementation, runs the intersection query by default: accelerators
+        // honoring ray flags stop any hit rays there, the others find closest hits which are
+        // valid results of any hit rays too
+        virtual void Mixed(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Multi hit implementation, throws by default
+        virtual void MultiHit(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, std::uint32_t k, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Proximity implementation, throws by default
+        virtual void Proximity(std::uint32_t queue_idx, Calc::Buffer const *spheres, Calc::Buffer const *num_spheres,
+            std::uint32_t max_spheres, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const;
+        // Ambient occlusion implementation, throws by default
+        virtual void AmbientOcclusion(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points,
+            std::uint32_t max_points, std::uint32_t num_samples, float radius, std::uint32_t seed, Calc::Buffer *visibility,
+            Calc::Event const *wait_event, Calc::Event **event) const;
 
     protected: 
+        // Layout of closest hit query results set by "acc.hit_format" option,
+        // values have to match HIT_FORMAT_* in kernels/CL/common.cl
+        enum HitFormat
+        {
+            // Intersection struct
+            kHitFormatFull,
+            // Hit distance
+            kHitFormatT,
+            // Primitive ID and hit distance
+            kHitFormatPrimIdT,
+            // Shape ID and primitive ID
+            kHitFormatIds,
+            // Planes of shape IDs, primitive IDs, u, v and hit distances
+            kHitFormatSoa
+        };
+
+        /**
+        \brief Check if BVH topology can be kept and only refitted.
+
+        True if the world composition is the same as at the previous commit, only shape transforms and
+        vertex positions have changed since then and refitting is not disabled by "bvh.refit" option.
+        */
+        static bool CanRefit(World const& world);
+        // Check if world space vertices of a mesh or an instance have changed since the last commit
+        static bool HasGeometryChanged(Shape const* shape);
+        // Write world space vertices of a mesh or an instance
+        static void GetWorldSpaceVertices(Shape const* shape, float3* vertices);
+        // Write world space vertices of a mesh or an instance as 3 floats each without padding
+        static void GetPackedWorldSpaceVertices(Shape const* shape, float* vertices);
+        // Size of a vertex in device buffers, packed vertices are kernels' RR_PACKED_VERTICES layout
+        static std::size_t GetVertexSize(bool packed) { return packed ? 3 * sizeof(float) : sizeof(float3); }
+        // Write world space vertices of shapes [first, last] into a buffer laid out by vertex_start
+        // (start vertex of each shape plus the total count), only the shapes whose geometry has changed
+        // if changed_only is set. Returns the number of bytes mapped for writing
+        std::size_t UploadWorldSpaceVertices(Calc::Buffer* buffer, std::vector<Shape const*> const& shapes, std::vector<int> const& vertex_start,
+            int first, int last, bool packed, bool changed_only) const;
+        // Pack shape IDs of faces in leaf order into the shape range table of skip links kernels: the number
+        // of runs of faces sharing a shape ID, the first face of every run and the shape ID of every run
+        static void PackShapeRanges(std::vector<int> const& face_shape_ids, std::vector<int>& ranges);
+        // Create buffer of precomputed triangles: a vertex and two edges adjacent to it per face,
+        // indices hold 3 vertex indices per face
+        Calc::Buffer* CreateTriangleBuffer(float3 const* vertices, int const* indices, int num_faces) const;
+
+        typedef std::chrono::high_resolution_clock Clock;
+        // Milliseconds elapsed since start
+        static float GetElapsedTime(Clock::time_point start);
+        // Fill tree figures of commit statistics
+        void SetBvhStatistics(Bvh const& bvh);
+        // Create BVH cache if "bvh.cache_dir" option is set, nullptr otherwise.
+        // Trees optimized for ray samples aren't cached, so there is no cache with samples set
+        static std::unique_ptr<BvhCache> CreateBvhCache(World const& world);
+        // Hand ray samples of the world and "bvh.ray_samples_weight" to a world space tree before its build
+        static void ApplyRaySamples(Bvh& bvh, World const& world);
+        // Get a device buffer reusing memory released by previous commits,
+        // the buffer may be larger than requested and initdata is uploaded before returning
+        Calc::Buffer* AcquireBuffer(std::size_t size, std::uint32_t type, void* initdata = nullptr) const;
+        // Return a buffer obtained from AcquireBuffer for reuse, nullptr is ignored
+        void ReleaseBuffer(Calc::Buffer* buffer) const;
+        // Launch a ray query kernel over global_size work items, Vulkan devices
+        // only launch the groups needed by the ray count in num_rays.
+        // The launch is timed under name if "acc.profiling" is enabled
+        void ExecuteQuery(char const* name, Calc::Function const* func, std::uint32_t queue_idx, Calc::Buffer const* num_rays,
+            std::size_t global_size, std::size_t local_size, Calc::Event** event) const;
+        // Default work group size of traversal kernels for the device: kDefaultLocalSize rounded
+        // to whole hardware SIMD widths within the device limit, Vulkan programs keep kDefaultLocalSize
+        static std::size_t GetDefaultLocalSize(Calc::Device* device);
+        // Round global_size up to whole work groups of the current local size
+        std::size_t RoundToLocalSize(std::size_t global_size) const;
+
+        // Ray count scratch buffer, also bound where kernels need a valid buffer they don't read
+        Calc::Buffer* GetRayCountBuffer(std::uint32_t queue_idx) const;
+        // Scratch buffer of at least size bytes for global memory traversal stacks
+        Calc::Buffer* GetStackBuffer(std::size_t size, std::uint32_t queue_idx) const;
+
+        // Set trailing stats buffer and its size arguments of kernels compiled with RR_TRAVERSAL_STATS,
+        // nothing is set if "acc.traversal_stats" is disabled
+        void SetTraversalStatsArgs(Calc::Function* func, int& arg) const;
+
         // Device to use
         Calc::Device* m_device;
-        // Buffer holding ray count
-        std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>> m_counter;
+        // Statistics of the latest SetWorld call, filled by Process
+        CommitStatistics m_stats;
+        // Closest hit output format
+        HitFormat m_hit_format;
+        // Occlusion results are packed 32 rays per word, set by "acc.occlusion_format" option
+        bool m_occlusion_bits;
+        // Buffer passed to "acc.hit_filter" functions (nullptr if not set)
+        Calc::Buffer const* m_filter_data;
+        // Traversal kernels record per ray counters, set by "acc.traversal_stats" option
+        bool m_traversal_stats;
+        // Watertight triangle and box tests, set by "acc.watertight" option
+        bool m_watertight;
+        // Work group size of traversal kernels
+        std::size_t m_local_size;
+        // Buffer receiving per ray counters (nullptr if not set)
+        Calc::Buffer* m_stats_buffer;
+        // Hits of a previous query tested before traversal (nullptr if not set)
+        Calc::Buffer const* m_hint_buffer;
+        // GPU times of acceleration structure updates and queries, launches
+        // that should be profiled go through it instead of the device
+        std::unique_ptr<KernelTimer> m_timer;
+
+    private:
+        // Queue of the latest query or acceleration structure update
+        mutable std::uint32_t m_queue;
+        // Size of a query ray in the current ray format
+        std::size_t m_ray_stride;
+        // Ray count buffers of batched queries, grown on demand
+        mutable std::vector<std::unique_ptr<Calc::Buffer, std::function<void(Calc::Buffer*)>>> m_batch_counters;
+        // Ray reordering before traversal (nullptr if disabled)
+        std::unique_ptr<RaySorter> m_ray_sorter;
+        // Expansion of compact rays before traversal (nullptr for full rays)
+        std::unique_ptr<RayDecoder> m_ray_decoder;
+        // Group counts of query launches computed on the device (Vulkan only)
+        std::unique_ptr<IndirectDispatcher> m_indirect_dispatcher;
+        // Acceleration structure buffers released by rebuilds, sized by "acc.buffer_pool_size"
+        std::unique_ptr<CalcBufferPool> m_buffer_pool;
+        // Ray count and traversal stack buffers, shared by the intersectors of a device
+        std::shared_ptr<CalcScratchBuffers> m_scratch;
     };
 }
 
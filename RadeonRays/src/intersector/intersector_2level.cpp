@@ -20,22 +20,260 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "intersector_2level.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
 #include "../accelerator/bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../accelerator/hlbvh.h"
+#include "../accelerator/binned_sah_bvh.h"
+#include "../accelerator/bvh_library.h"
 #include "../translator/plain_bvh_translator.h"
+#include "../translator/fatnode_bvh_translator.h"
+#include "../translator/bvh_cache.h"
 #include "../world/world.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
+#include "../primitive/group.h"
+#include "../primitive/lod_group.h"
+#include "../primitive/curves.h"
+#include "../primitive/procedurals.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
 #include "device.h"
 #include "executable.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
 
 static int const kWorkGroupSize = 64;
+// Number of shapes processed by a single task
+static int const kShapeGrainSize = 256;
+// Shape level BVHs traversed by kernels compiled with RR_GROUPS (MAX_LEVELS),
+// the top level one and up to 3 levels of nested groups
+static int const kMaxGroupLevels = 3;
+// LDS stack depth of "fatbvh" short stack traversal, has to match intersect_bvh2level_short_stack.cl.
+// Deferred nodes of both levels and the marker between them have to fit the LDS stack and two spills.
+static int const kShortStackSize = 16;
+static int const kGlobalStackSize = 2 * kShortStackSize;
+static int const kMaxStackDepth = 3 * (kShortStackSize - 1);
+// Rebraided top level references at most this many subtrees per shape on average
+static int const kRebraidSubtreesPerShape = 2;
 
 namespace RadeonRays
 {
+    // Bottom level shape type, kept in ShapeData and matching SHAPE_TYPE_* in kernels
+    enum ShapeType
+    {
+        kShapeTypeMesh = 0,
+        kShapeTypeGroup = 1,
+        kShapeTypeCurves = 2,
+        // LOD group, bvhidx references its LOD record
+        kShapeTypeLod = 3,
+        // Spheres, disks or custom primitives, the kind is kept in their faces
+        kShapeTypeProcedurals = 4
+    };
+
+    // Meshes, curves and procedurals all have bottom level BVHs, curve segments
+    // and analytic or custom primitives are their primitives
+    static int GetNumPrimitives(Shape const* shape)
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        if (shapeimpl->is_curves())
+        {
+            return static_cast<Curves const*>(shape)->num_segments();
+        }
+        else if (shapeimpl->is_procedural())
+        {
+            return static_cast<Procedurals const*>(shape)->num_primitives();
+        }
+
+        return static_cast<Mesh const*>(shape)->num_faces();
+    }
+
+    // Curve segments get their own copies of control points, so that
+    // leaves reference 4 consecutive vertices with a single index,
+    // procedurals keep 2 vertices of data per primitive
+    static int GetNumVertices(Shape const* shape)
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        if (shapeimpl->is_curves())
+        {
+            return 4 * static_cast<Curves const*>(shape)->num_segments();
+        }
+        else if (shapeimpl->is_procedural())
+        {
+            return 2 * static_cast<Procedurals const*>(shape)->num_primitives();
+        }
+
+        return static_cast<Mesh const*>(shape)->num_vertices();
+    }
+
+    // Object space bounds of bottom level primitives, bounds must hold GetNumPrimitives(shape) entries
+    static void GetPrimitiveBounds(ShapeImpl const* shape, bbox* bounds)
+    {
+        if (shape->is_curves())
+        {
+            static_cast<Curves const*>(shape)->GetAllSegmentBounds(bounds);
+        }
+        else if (shape->is_procedural())
+        {
+            static_cast<Procedurals const*>(shape)->GetAllPrimitiveBounds(bounds);
+        }
+        else
+        {
+            static_cast<Mesh const*>(shape)->GetAllFaceBounds(true, bounds);
+        }
+    }
+
+    // World space bounds of a moving shape at time 0 and time 1. Shapes rotate around
+    // their object space origin, so rotating ones are bounded by the sphere around it,
+    // which makes linear interpolation of the bounds conservative at any time.
+    static void GetMotionBounds(ShapeImpl const* shape, bbox const& objbounds, bbox& bounds0, bbox& bounds1)
+    {
+        matrix m, minv;
+        shape->GetTransform(m, minv);
+
+        bbox bounds = objbounds;
+        quaternion const q = shape->GetAngularVelocity();
+
+        if (q.x != 0.f || q.y != 0.f || q.z != 0.f)
+        {
+            float3 const extents = vmax(-objbounds.pmin, objbounds.pmax);
+            float const radius = std::sqrt(extents.sqnorm());
+            bounds = bbox(float3(-radius, -radius, -radius), float3(radius, radius, radius));
+        }
+
+        bounds0 = transform_bbox(bounds, m);
+
+        float3 const v = shape->GetLinearVelocity();
+        bounds1 = bbox(bounds0.pmin + v, bounds0.pmax + v);
+    }
+
+    // Keep 3 rows of the inverse transform, projective row is never used
+    // Hash of object space vertex positions and faces, meshes with the same hash are treated as duplicates
+    static std::uint64_t HashMeshGeometry(Mesh const* mesh)
+    {
+        int const counts[2] = { mesh->num_vertices(), mesh->num_faces() };
+        std::uint64_t hash = BvhCache::Hash(counts, sizeof(counts));
+
+        for (int i = 0; i < mesh->num_vertices(); ++i)
+        {
+            float3 const vertex = mesh->GetVertex(i);
+            float const position[3] = { vertex.x, vertex.y, vertex.z };
+            hash = BvhCache::Hash(position, sizeof(position), hash);
+        }
+
+        for (int i = 0; i < mesh->num_faces(); ++i)
+        {
+            Mesh::Face const face = mesh->GetFace(i);
+            int const indices[4] = { face.idx[0], face.idx[1], face.idx[2], face.type_ == Mesh::FaceType::QUAD ? face.idx[3] : -1 };
+            hash = BvhCache::Hash(indices, sizeof(indices), hash);
+        }
+
+        return hash;
+    }
+
+    // Rows get the inverse rotation and scale and the shape origin in world space. Kernels
+    // subtract the origin before rotating instead of adding the inverse translation after it,
+    // which would cancel two large values in scenes far from the world origin.
+    static void SetTransform(ShapeImpl const* shape, float3* rows)
+    {
+        matrix m, minv;
+        shape->GetTransform(m, minv);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            rows[i] = float3(minv.m[i][0], minv.m[i][1], minv.m[i][2], m.m[i][3]);
+        }
+    }
+
+    // Pack snorm16 pair into an int
+    static int PackSnorm16(float lo, float hi)
+    {
+        int const l = (int)std::lround(std::min(std::max(lo, -1.f), 1.f) * 32767.f);
+        int const h = (int)std::lround(std::min(std::max(hi, -1.f), 1.f) * 32767.f);
+        return (l & 0xFFFF) | (h << 16);
+    }
+
+    // Try to encode rows as rotation, uniform scale and translation,
+    // returns false for shears, non uniform scales and mirroring
+    static bool CompactTransform(float3 const* rows, int* rotation, float* translation, float& scale)
+    {
+        float3 const r0(rows[0].x, rows[0].y, rows[0].z);
+        float3 const r1(rows[1].x, rows[1].y, rows[1].z);
+        float3 const r2(rows[2].x, rows[2].y, rows[2].z);
+
+        float const sq = r0.sqnorm();
+        float const eps = 1e-4f * sq;
+
+        if (sq <= 0.f ||
+            std::abs(r1.sqnorm() - sq) > eps || std::abs(r2.sqnorm() - sq) > eps ||
+            std::abs(dot(r0, r1)) > eps || std::abs(dot(r0, r2)) > eps || std::abs(dot(r1, r2)) > eps ||
+            dot(cross(r0, r1), r2) <= 0.f)
+        {
+            return false;
+        }
+
+        scale = std::sqrt(sq);
+
+        matrix rot;
+        for (int i = 0; i < 3; ++i)
+        {
+            rot.m[i][0] = rows[i].x / scale;
+            rot.m[i][1] = rows[i].y / scale;
+            rot.m[i][2] = rows[i].z / scale;
+        }
+
+        quaternion q = normalize(quaternion(rot));
+        // Keep w positive, both signs encode the same rotation
+        if (q.w < 0.f)
+        {
+            q = -q;
+        }
+
+        rotation[0] = PackSnorm16(q.x, q.y);
+        rotation[1] = PackSnorm16(q.z, q.w);
+        translation[0] = rows[0].w;
+        translation[1] = rows[1].w;
+        translation[2] = rows[2].w;
+        return true;
+    }
+
+    // Span [first, last) of translated nodes differing from the previous ones, both are nodesize
+    // bytes each. Skip links address nodes, so a changed node count shifts the rest of them.
+    static void GetChangedNodes(std::vector<char> const& previous, char const* nodes, std::size_t numnodes,
+        std::size_t nodesize, std::size_t& first, std::size_t& last)
+    {
+        std::size_t const numprevious = previous.size() / nodesize;
+        std::size_t const numcommon = std::min(numnodes, numprevious);
+
+        first = 0;
+        last = numnodes;
+
+        while (first < numcommon && std::memcmp(&previous[first * nodesize], nodes + first * nodesize, nodesize) == 0)
+        {
+            ++first;
+        }
+
+        while (numnodes == numprevious && last > first &&
+            std::memcmp(&previous[(last - 1) * nodesize], nodes + (last - 1) * nodesize, nodesize) == 0)
+        {
+            --last;
+        }
+    }
+
     struct IntersectorTwoLevel::ShapeData
     {
         // Shape ID
@@ -43,10 +281,28 @@ namespace RadeonRays
         // Index of root bvh node
         int bvhidx;
         int mask;
-        int padding1;
-        // Transform
-        matrix minv;
-        // Motion blur data
+        // Root node BVH type (ShapeType), group BVH leaves reference shapes
+        int type;
+        // Inverse rotation and scale rows, w keeps the shape origin (see SetTransform)
+        float3 minv[3];
+    };
+
+    // Rigid inverse transform as shape origin, snorm16 quaternion and uniform scale
+    struct IntersectorTwoLevel::CompactShapeData
+    {
+        Id id;
+        int bvhidx;
+        int mask;
+        int type;
+        // Quaternion components packed in pairs (x | y << 16, z | w << 16)
+        int rotation[2];
+        float translation[3];
+        float scale;
+    };
+
+    // Motion blur data, only read by kernels built with RR_MOTION_BLUR
+    struct IntersectorTwoLevel::ShapeMotion
+    {
         float3 linearvelocity;
         // Angular veocity (quaternion)
         quaternion angularvelocity;
@@ -62,10 +318,23 @@ namespace RadeonRays
         int shape_id;
         // Primitive ID
         int prim_id;
+        // Fourth vertex index of quads, -1 for triangles (RR_QUADS only)
+        int idx3;
+        int padding;
     };
 
     struct IntersectorTwoLevel::GpuData
     {
+        // Kernel variant compiled for a set of scene specialization defines
+        struct Program
+        {
+            Calc::Executable* executable;
+            Calc::Function* isect_func;
+            Calc::Function* occlude_func;
+            // Short stack kernels traversing fat nodes
+            bool short_stack;
+        };
+
         // Device
         Calc::Device* device;
         // BVH nodes
@@ -76,12 +345,23 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Top level node bounds at time 1
+        Calc::Buffer* motion;
+        // Shape velocities
+        Calc::Buffer* shape_motion;
+        // Union of shape masks below top level nodes
+        Calc::Buffer* node_masks;
+        // LOD group records
+        Calc::Buffer* lods;
 
         int bvhrootidx;
 
-        Calc::Executable* executable;
-        Calc::Function* isect_func;
-        Calc::Function* occlude_func;
+        // Compiled variants keyed by their defines (prefixed for short stack ones), generic one has empty key
+        std::map<std::string, Program> programs;
+        // Variant used by queries
+        Program const* program;
+        // Top level translation lives in the generic variant
+        Calc::Function* translate_func;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -89,10 +369,13 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
+            , motion(nullptr)
+            , shape_motion(nullptr)
+            , node_masks(nullptr)
+            , lods(nullptr)
             , bvhrootidx(-1)
-            , executable(nullptr)
-            , isect_func(nullptr)
-            , occlude_func(nullptr)
+            , program(nullptr)
+            , translate_func(nullptr)
         {
         }
 
@@ -102,11 +385,21 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
-            if(executable != nullptr)
+            device->DeleteBuffer(motion);
+            device->DeleteBuffer(shape_motion);
+            device->DeleteBuffer(node_masks);
+            device->DeleteBuffer(lods);
+
+            if (translate_func)
             {
-                executable->DeleteFunction(isect_func);
-                executable->DeleteFunction(occlude_func);
-                device->DeleteExecutable(executable);
+                programs[""].executable->DeleteFunction(translate_func);
+            }
+
+            for (auto& iter : programs)
+            {
+                iter.second.executable->DeleteFunction(iter.second.isect_func);
+                iter.second.executable->DeleteFunction(iter.second.occlude_func);
+                device->DeleteExecutable(iter.second.executable);
             }
         }
     };
@@ -118,9 +411,53 @@ namespace RadeonRays
         std::vector<int> mesh_faces_start_idx;
         std::vector<Bvh const*> bvhptrs;
         std::vector<ShapeData> shapedata;
-        std::vector<bbox> bounds;
+        std::vector<CompactShapeData> compactdata;
+        std::vector<ShapeMotion> shapemotion;
+        std::vector<int> nodemasks;
+        // LOD group records: number of levels, rule and transition followed by
+        // shape data entry and threshold of every level (floats are stored as bits)
+        std::vector<int> lods;
+        // Meshes (and their IDs) bottom level data has been built for
+        std::vector<Shape const*> meshes;
+        std::vector<Id> mesh_ids;
+        // Build hints bottom level BVHs have been built for
+        std::vector<BuildHint> mesh_hints;
+        // Geometry hashes (and IDs they were computed for) of meshes at the last commit with "bvh.dedup_meshes"
+        std::unordered_map<Shape const*, std::pair<Id, std::uint64_t> > mesh_hashes;
+        // Number of group BVHs translated with bottom level ones
+        int num_groups;
+        // Nodes are translated by fattranslator for short stack traversal
+        bool use_fatnodes;
+        // Top level BVH has been built on the host over shape bounds, so it can be refitted
+        bool refit_top;
+        // Shapes of host built top level leaves in shape order, leaves of attached or detached
+        // instances are inserted or removed until its cost degrades from the one after the last build
+        std::vector<Shape const*> top_shapes;
+        float top_sah_cost;
+        int top_num_shapes;
+        // Settings bottom level BVHs have been built with
+        bool use_sah;
+        bool use_lbvh;
+        bool use_sah_top;
+        float traversal_cost;
+        int num_bins;
 
         PlainBvhTranslator translator;
+        FatNodeBvhTranslator fattranslator;
+
+        CpuData()
+            : num_groups(0)
+            , use_fatnodes(false)
+            , refit_top(false)
+            , top_sah_cost(0.f)
+            , top_num_shapes(0)
+            , use_sah(false)
+            , use_lbvh(false)
+            , use_sah_top(false)
+            , traversal_cost(0.f)
+            , num_bins(0)
+        {
+        }
     };
 
     IntersectorTwoLevel::IntersectorTwoLevel(Calc::Device* device)
@@ -128,6 +465,36 @@ namespace RadeonRays
         , m_gpudata(new GpuData(device))
         , m_cpudata(new CpuData)
     {
+        SelectProgram("");
+
+        // Device top level builds are only implemented for OpenCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->translate_func = m_gpudata->program->executable->CreateFunction("translate_hlbvh_main");
+        }
+    }
+
+#ifndef RR_EMBED_KERNELS
+    // Kernel source to append custom intersection functions to, includes are resolved by the compiler
+    static std::string LoadKernelSource(char const* filename)
+    {
+        std::ifstream in(filename, std::ios::in | std::ios::binary);
+        ThrowIf(!in, std::string("Can't open kernel source ") + filename);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+#endif
+
+    void IntersectorTwoLevel::SelectProgram(std::string const& defines, bool short_stack, std::string const& custom_intersector)
+    {
+        std::string const key = (short_stack ? "short_stack " + defines : defines) + custom_intersector;
+        auto iter = m_gpudata->programs.find(key);
+
+        if (iter != m_gpudata->programs.cend())
+        {
+            m_gpudata->program = &iter->second;
+            return;
+        }
+
         std::string buildopts =
 #ifdef RR_RAY_MASK
             "-D RR_RAY_MASK ";
@@ -139,39 +506,75 @@ namespace RadeonRays
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
+        buildopts.append(defines);
+
+        GpuData::Program program = { nullptr, nullptr, nullptr, short_stack };
+
+        // Custom intersection functions are compiled as a part of the skip links program source
+        if (!custom_intersector.empty())
+        {
+            ThrowIf(m_device->GetPlatform() != Calc::Platform::kOpenCL || short_stack, "Custom primitives are only supported by OpenCL devices");
+
+            buildopts.append("-D RR_CUSTOM_PRIMITIVES ");
+
+#ifndef RR_EMBED_KERNELS
+            std::string source = LoadKernelSource("../RadeonRays/src/kernels/CL/intersect_bvh2level_skiplinks.cl");
+#else
+            std::string source;
+#if USE_OPENCL
+            source = g_intersect_bvh2level_skiplinks_opencl;
+#endif
+#endif
+            source.append("\n").append(custom_intersector).append("\n");
+            program.executable = m_device->CompileExecutable(source.c_str(), source.size(), buildopts.c_str());
+        }
 #ifndef RR_EMBED_KERNELS
-        if ( device->GetPlatform() == Calc::Platform::kOpenCL )
+        else if ( m_device->GetPlatform() == Calc::Platform::kOpenCL )
         {
             char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
 
             int numheaders = sizeof(headers) / sizeof(char const*);
 
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2level_skiplinks.cl", headers, numheaders, buildopts.c_str());
+            char const* source = short_stack ?
+                "../RadeonRays/src/kernels/CL/intersect_bvh2level_short_stack.cl" :
+                "../RadeonRays/src/kernels/CL/intersect_bvh2level_skiplinks.cl";
+
+            program.executable = m_device->CompileExecutable(source, headers, numheaders, buildopts.c_str());
         }
         else
         {
-            assert( device->GetPlatform() == Calc::Platform::kVulkan );
-            m_gpudata->executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/GLSL/bvh2l.comp", nullptr, 0, buildopts.c_str());
+            assert( m_device->GetPlatform() == Calc::Platform::kVulkan );
+            program.executable = m_device->CompileExecutable( "../RadeonRays/src/kernels/GLSL/bvh2l.comp", nullptr, 0, buildopts.c_str());
         }
 
 #else
 #if USE_OPENCL
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        if (program.executable == nullptr && m_device->GetPlatform() == Calc::Platform::kOpenCL)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2level_skiplinks_opencl, std::strlen(g_intersect_bvh2level_skiplinks_opencl), buildopts.c_str());
+            char const* source = short_stack ?
+                g_intersect_bvh2level_short_stack_opencl :
+                g_intersect_bvh2level_skiplinks_opencl;
+
+            program.executable = m_device->CompileExecutable(source, std::strlen(source), buildopts.c_str());
         }
 #endif
 
 #if USE_VULKAN
-        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        if (program.executable == nullptr && m_device->GetPlatform() == Calc::Platform::kVulkan)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_bvh2l_vulkan, std::strlen(g_bvh2l_vulkan), buildopts.c_str());
+            program.executable = m_device->CompileExecutable(g_bvh2l_vulkan, std::strlen(g_bvh2l_vulkan), buildopts.c_str());
         }
 #endif
 #endif
 
-        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
-        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+        program.isect_func = program.executable->CreateFunction("intersect_main");
+        program.occlude_func = program.executable->CreateFunction("occluded_main");
+
+        m_gpudata->program = &(m_gpudata->programs[key] = program);
     }
 
     void IntersectorTwoLevel::Process(World const& world)
@@ -179,70 +582,275 @@ namespace RadeonRays
         // If something has been changed we need to rebuild BVH
         int statechange = world.GetStateChange();
 
-        // Full rebuild in case number of objects changes
-        if (m_bvhs.size() == 0 || world.has_changed())
+        if (m_bvhs.size() != 0 && !world.has_changed() && statechange == ShapeImpl::kStateChangeNone)
         {
-            if (m_bvhs.size() != 0)
-            {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
-                m_device->DeleteBuffer(m_gpudata->shapes);
-            }
+            return;
+        }
 
+        // Worker threads for CPU side work
+        auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+        task_scheduler scheduler(numthreads ? (int)numthreads->AsFloat() : 0);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+        auto builder = world.options_.GetOption(Options::kBvhBuilder);
+        auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+        auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+        auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+        auto shared = world.options_.GetOption(Options::kBvhSharedLibrary);
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        bool use_sah = false;
+        bool use_lbvh = false;
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+        bool use_library = shared && shared->AsFloat() > 0.f;
+
+        if (builder && builder->AsString() == "sah")
+        {
+            use_sah = true;
+        }
+        else if (builder && builder->AsString() == "lbvh")
+        {
+            use_lbvh = true;
+        }
 
+        // Copy the shapes here to be able to partition them and handle more efficiently
+        // #22: we need to be able to handle instances whos base shapes are not present 
+        // in the scene, so we have to add them manually here.
+        std::vector<Shape const*> shapes;
+        std::unordered_set<Shape const*> shapes_disabled;
+        // Groups referenced by the scene, nested ones go first
+        std::vector<Group const*> groups;
+        std::unordered_set<Shape const*> groups_visited;
 
-            if (builder && builder->AsString() == "sah")
+        auto add_base_mesh = [&](Shape const* base_shape)
+        {
+            if (!world.IsAttached(base_shape) && shapes_disabled.insert(base_shape).second)
             {
-                use_sah = true;
+                // Need to add the shape to the list, it is marked disabled
+                shapes.push_back(base_shape);
             }
+        };
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+        std::function<void(Shape const*)> add_references = [&](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->is_instance())
+            {
+                // Here we know this is an instance, need to check if its base shape has been added as well
+                auto base_shape = static_cast<Instance const*>(shapeimpl)->GetBaseShape();
 
-            for (auto s : world.shapes_)
+                if (static_cast<ShapeImpl const*>(base_shape)->is_group())
+                {
+                    add_references(base_shape);
+                }
+                else
+                {
+                    add_base_mesh(base_shape);
+                }
+            }
+            else if (shapeimpl->is_group() && groups_visited.insert(shape).second)
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                auto group = static_cast<Group const*>(shapeimpl);
 
-                if (shapeimpl->is_instance())
+                for (auto member : group->GetShapes())
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
+                    auto memberimpl = static_cast<ShapeImpl const*>(member);
 
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
+                    if (memberimpl->is_instance() || memberimpl->is_group())
+                    {
+                        add_references(member);
+                    }
+                    else
                     {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
+                        add_base_mesh(member);
                     }
                 }
 
-                shapes.push_back(s);
+                groups.push_back(group);
+            }
+        };
+
+        for (auto s : world.shapes_)
+        {
+            add_references(s);
+            shapes.push_back(s);
+        }
+
+        int numgroups = (int)groups.size();
+        ThrowIf(numgroups > 0 && m_device->GetPlatform() != Calc::Platform::kOpenCL, "Groups are only supported by OpenCL devices");
+
+        // Now partition the range into meshes and instances (or groups). Partition should be stable
+        // so that mesh order (and bottom level layout) survives adding or removing instances.
+        auto firstinst = std::stable_partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+        {
+            return !static_cast<ShapeImpl const*>(shape)->is_instance() && !static_cast<ShapeImpl const*>(shape)->is_group();
+        });
+
+        // Previous position of each mesh in the bottom level layout
+        std::unordered_map<Shape const*, int> mesh_indices;
+
+        for (int i = 0; i < (int)m_cpudata->meshes.size(); ++i)
+        {
+            mesh_indices[m_cpudata->meshes[i]] = i;
+        }
+
+        // World does not keep attachment order on detach, so meshes are put back into
+        // their previous layout order with new ones following them
+        auto get_mesh_index = [&](Shape const* shape)
+        {
+            auto iter = mesh_indices.find(shape);
+            return iter != mesh_indices.cend() ? iter->second : (int)mesh_indices.size();
+        };
+
+        std::stable_sort(shapes.begin(), firstinst, [&](Shape const* lhs, Shape const* rhs)
+        {
+            return get_mesh_index(lhs) < get_mesh_index(rhs);
+        });
+
+        // Meshes with the same geometry as an earlier one are moved to instances of it,
+        // keeping their own transforms, IDs and masks in the top level
+        std::unordered_map<Shape const*, Shape const*> duplicates;
+        auto dedup = world.options_.GetOption(Options::kBvhDedupMeshes);
+
+        if (dedup && dedup->AsFloat() > 0.f)
+        {
+            int const numcandidates = (int)std::distance(shapes.begin(), firstinst);
+            std::vector<std::uint64_t> hashes(numcandidates);
+
+            // Hashes are kept between commits and only recomputed for new meshes or changed vertices
+            parallel_for(scheduler, 0, numcandidates, 1, [&](int i)
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+
+                if (shapeimpl->is_curves() || shapeimpl->is_procedural())
+                {
+                    return;
+                }
+
+                auto iter = m_cpudata->mesh_hashes.find(shapeimpl);
+
+                if (iter != m_cpudata->mesh_hashes.cend() && iter->second.first == shapeimpl->GetId() &&
+                    !(shapeimpl->GetStateChange() & ShapeImpl::kStateChangeVertices))
+                {
+                    hashes[i] = iter->second.second;
+                }
+                else
+                {
+                    hashes[i] = HashMeshGeometry(static_cast<Mesh const*>(shapeimpl));
+                }
+            });
+
+            std::unordered_map<std::uint64_t, Shape const*> representatives;
+            m_cpudata->mesh_hashes.clear();
+
+            for (int i = 0; i < numcandidates; ++i)
+            {
+                if (static_cast<ShapeImpl const*>(shapes[i])->is_curves() || static_cast<ShapeImpl const*>(shapes[i])->is_procedural())
+                {
+                    continue;
+                }
+
+                m_cpudata->mesh_hashes[shapes[i]] = std::make_pair(shapes[i]->GetId(), hashes[i]);
+
+                auto result = representatives.emplace(hashes[i], shapes[i]);
+
+                if (!result.second)
+                {
+                    duplicates[shapes[i]] = result.first->second;
+                }
             }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+            firstinst = std::stable_partition(shapes.begin(), firstinst, [&](Shape const* shape)
             {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
+                return duplicates.find(shape) == duplicates.cend();
             });
+        }
+        else
+        {
+            m_cpudata->mesh_hashes.clear();
+        }
+
+        // Count the number of meshes
+        int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+        // Count the number of instances, groups and duplicate meshes attached to the scene
+        int numinstances = (int)std::distance(firstinst, shapes.end());
+
+        // Curves are bottom level shapes like meshes
+        bool const has_curves = std::any_of(shapes.begin(), firstinst, [](Shape const* shape)
+        {
+            return static_cast<ShapeImpl const*>(shape)->is_curves();
+        });
+
+        ThrowIf(has_curves && m_device->GetPlatform() != Calc::Platform::kOpenCL, "Curves are only supported by OpenCL devices");
+
+        bool const has_procedurals = std::any_of(shapes.begin(), firstinst, [](Shape const* shape)
+        {
+            return static_cast<ShapeImpl const*>(shape)->is_procedural();
+        });
+
+        ThrowIf(has_procedurals && m_device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Spheres, disks and custom primitives are only supported by OpenCL devices");
+
+        // Quads are intersected natively by OpenCL kernel, other platforms only see their first triangle
+        bool const has_quads = m_device->GetPlatform() == Calc::Platform::kOpenCL &&
+            std::any_of(shapes.begin(), firstinst, [](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            return !shapeimpl->is_curves() && !shapeimpl->is_procedural() && !static_cast<Mesh const*>(shape)->puretriangle();
+        });
+
+        // Bottom level data is still valid if the set of meshes and their geometry
+        // are the same, so in this case we only need to rebuild top level BVH
+        bool rebuild_bottom = m_bvhs.size() == 0 ||
+            use_sah != m_cpudata->use_sah ||
+            use_lbvh != m_cpudata->use_lbvh ||
+            use_sah_top != m_cpudata->use_sah_top ||
+            traversal_cost != m_cpudata->traversal_cost ||
+            num_bins != m_cpudata->num_bins ||
+            nummeshes != (int)m_cpudata->meshes.size();
+
+        for (int i = 0; i < nummeshes && !rebuild_bottom; ++i)
+        {
+            rebuild_bottom = !IsBottomLevelValid(shapes[i], i);
+        }
+
+        if (rebuild_bottom)
+        {
+            if (m_bvhs.size() != 0)
+            {
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->faces);
+                m_gpudata->vertices = nullptr;
+                m_gpudata->faces = nullptr;
+            }
 
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+            // Cached bottom level BVHs can be reused for meshes whose geometry has not been changed
+            // (these are moved from here, missing entries need to be rebuilt)
+            bool const reuse_bvhs = use_sah == m_cpudata->use_sah &&
+                use_lbvh == m_cpudata->use_lbvh &&
+                use_sah_top == m_cpudata->use_sah_top &&
+                traversal_cost == m_cpudata->traversal_cost &&
+                num_bins == m_cpudata->num_bins;
+
+            std::vector<std::shared_ptr<Bvh> > bvhs(nummeshes + 1);
+            // Deforming meshes whose BVHs are refitted instead of rebuilt
+            std::vector<int> refit_order;
+
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                auto iter = mesh_indices.find(shapes[i]);
+
+                if (reuse_bvhs && iter != mesh_indices.cend() && IsBottomLevelValid(shapes[i], iter->second))
+                {
+                    bvhs[i] = std::move(m_bvhs[iter->second]);
+                }
+                else if (reuse_bvhs && iter != mesh_indices.cend() && IsBottomLevelRefittable(shapes[i], iter->second))
+                {
+                    bvhs[i] = std::move(m_bvhs[iter->second]);
+                    refit_order.push_back(i);
+                }
+            }
 
             int numvertices = 0;
             int numfaces = 0;
@@ -250,106 +858,138 @@ namespace RadeonRays
             // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
             m_cpudata->mesh_vertices_start_idx.resize(nummeshes);
             m_cpudata->mesh_faces_start_idx.resize(nummeshes);
-            m_cpudata->bvhptrs.resize(nummeshes + 1);
-            m_cpudata->shapedata.resize(nummeshes + numinstances);
+            m_cpudata->bvhptrs.resize(nummeshes);
+            m_cpudata->meshes.resize(nummeshes);
+            m_cpudata->mesh_ids.resize(nummeshes);
+            m_cpudata->mesh_hints.resize(nummeshes);
 
             // [0...numshapes-1] contain bottom level BVHs
             // [numshapes] is the top level one
-            m_bvhs.resize(nummeshes + 1);
-            // Create actual BVH objects
-            for (int i = 0; i < nummeshes + 1; ++i)
-            {
-                m_bvhs[i].reset(new Bvh(traversal_cost, num_bins, use_sah));
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
-            }
+            m_bvhs = std::move(bvhs);
 
             // Prepare necessary offsets in the arrays
             // in order to be able to parallelize
             for (int i = 0; i < nummeshes; ++i)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-
                 m_cpudata->mesh_faces_start_idx[i] = numfaces;
                 m_cpudata->mesh_vertices_start_idx[i] = numvertices;
+                m_cpudata->meshes[i] = shapes[i];
+                m_cpudata->mesh_ids[i] = shapes[i]->GetId();
+                m_cpudata->mesh_hints[i] = shapes[i]->GetBuildHint();
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
+                numfaces += GetNumPrimitives(shapes[i]);
+                numvertices += GetNumVertices(shapes[i]);
             }
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            m_cpudata->bounds.resize(numfaces);
+            m_cpudata->use_sah = use_sah;
+            m_cpudata->use_lbvh = use_lbvh;
+            m_cpudata->use_sah_top = use_sah_top;
+            m_cpudata->traversal_cost = traversal_cost;
+            m_cpudata->num_bins = num_bins;
 
-            // We are storing individual object bounds here to build top level BVH
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
-
-            matrix m, minv;
+            auto start = Clock::now();
 
-            // Handle simple shapes
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            // Refit BVHs of deforming meshes to their new vertices, the ones
+            // that can't be refitted are built like new ones below
+            parallel_for(scheduler, 0, (int)refit_order.size(), 1, [&](int j)
             {
+                int const i = refit_order[j];
+                std::vector<bbox> bounds(GetNumPrimitives(shapes[i]));
+                GetPrimitiveBounds(static_cast<ShapeImpl const*>(shapes[i]), bounds.data());
 
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
-
-                for (int j = 0; j < mesh->num_faces(); ++j)
+                if (!m_bvhs[i]->Refit(bounds.data(), (int)bounds.size()))
                 {
-                    // Request bounds in object space since we build BVHs for objects locally
-                    mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
+                    m_bvhs[i].reset();
                 }
+            });
 
-                // Build BVH for current mesh
-                m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
+            // Build BVHs for new and changed meshes. Each mesh is built by a separate task,
+            // large meshes spawn more tasks into the same scheduler while building.
+            // Start with the largest ones to balance the load better.
+            std::vector<int> build_order;
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                if (!m_bvhs[i])
+                {
+                    build_order.push_back(i);
+                }
+            }
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+            std::sort(build_order.begin(), build_order.end(), [&](int lhs, int rhs)
+            {
+                return GetNumPrimitives(shapes[lhs]) > GetNumPrimitives(shapes[rhs]);
+            });
 
-                // Collect BVH pointers for toip level build
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
-            }
+            task_group build_group;
 
-            // Handle instances
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            for (auto i : build_order)
             {
+                auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+                std::shared_ptr<Bvh>* result = &m_bvhs[i];
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
+                scheduler.spawn(build_group, [&, shapeimpl, result]()
+                {
+                    // Static meshes get SAH and dynamic ones LBVH whatever the builder option is
+                    BuildHint const hint = shapeimpl->GetBuildHint();
+                    bool const mesh_lbvh = hint == kBuildHintDynamic || (hint != kBuildHintStatic && use_lbvh);
+                    bool const mesh_sah = hint == kBuildHintStatic || (hint != kBuildHintDynamic && use_sah);
 
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                    // Library entries are keyed by face bounds and build options like BvhCache ones,
+                    // BVHs of deforming meshes are refitted in place, so they are never shared
+                    bool const mesh_library = use_library && hint != kBuildHintDeforming;
+                    float const buildopts[] = { mesh_lbvh ? (use_sah_top ? 3.f : 2.f) : mesh_sah ? 1.f : 0.f, (float)num_bins, traversal_cost };
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+                    // Request bounds in object space since we build BVHs for objects locally
+                    std::vector<bbox> bounds(GetNumPrimitives(shapeimpl));
+                    GetPrimitiveBounds(shapeimpl, bounds.data());
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+                    std::uint64_t key = 0;
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+                    if (mesh_library)
+                    {
+                        key = BvhCache::Hash(bounds.data(), bounds.size() * sizeof(bbox));
+                        key = BvhCache::Hash(buildopts, sizeof(buildopts), key);
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
-            }
+                        *result = BvhLibrary::Get().Find(key);
 
-            // Calculate top level BVH
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+                        if (*result)
+                        {
+                            return;
+                        }
+                    }
 
-            m_cpudata->translator.Flush();
-            // TODO: parallelize this
-            m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
+                    std::shared_ptr<Bvh> bvh(mesh_lbvh ?
+                        new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                        new Bvh(traversal_cost, num_bins, mesh_sah));
 
-            // Update GPU data
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
-            m_gpudata->bvhrootidx = m_cpudata->translator.root_;
+                    // Build BVH for current mesh, large meshes spawn more tasks into the same scheduler.
+                    // The scheduler does not outlive this call.
+                    bvh->SetScheduler(&scheduler);
+                    bvh->Build(&bounds[0], (int)bounds.size());
+                    bvh->SetScheduler(nullptr);
 
-            // Create vertex buffer
-            {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
+                    // Other intersectors might have built the same BVH meanwhile
+                    *result = mesh_library ? BvhLibrary::Get().Insert(key, bvh) : bvh;
+                });
+            }
+
+            scheduler.wait(build_group);
+
+            // Collect BVH pointers for top level build
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+            }
+
+            // Object space face bounds are gathered by build tasks as well
+            m_stats.build_time = GetElapsedTime(start);
+            start = Clock::now();
+
+            // Create vertex buffer
+            {
+                // Vertices
+                m_stats.vertices_bytes = numvertices * sizeof(float3);
+                m_gpudata->vertices = AcquireBuffer(numvertices * sizeof(float3), Calc::kRead);
 
                 // Get the pointer to mapped data
                 float3* vertexdata = nullptr;
@@ -360,24 +1000,52 @@ namespace RadeonRays
                 e->Wait();
                 m_device->DeleteEvent(e);
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                // Vertices are kept in object space, transforms are applied during traversal
+                parallel_for(scheduler, 0, nummeshes, 1, [&](int i)
                 {
+                    float3* shapevertices = vertexdata + m_cpudata->mesh_vertices_start_idx[i];
+
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_curves())
+                    {
+                        // Control points of a segment follow each other, radius is kept in w
+                        Curves const* curves = static_cast<Curves const*>(shapes[i]);
+
+                        for (int j = 0; j < curves->num_segments(); ++j)
+                        {
+                            int const* segment = curves->GetSegment(j);
+
+                            for (int k = 0; k < 4; ++k)
+                            {
+                                shapevertices[4 * j + k] = curves->GetControlPoint(segment[k]);
+                            }
+                        }
+
+                        return;
+                    }
+
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_procedural())
+                    {
+                        // Primitive data is copied as it is
+                        Procedurals const* procedurals = static_cast<Procedurals const*>(shapes[i]);
+
+                        for (int j = 0; j < procedurals->num_primitives(); ++j)
+                        {
+                            shapevertices[2 * j] = procedurals->GetPrimitive(j)[0];
+                            shapevertices[2 * j + 1] = procedurals->GetPrimitive(j)[1];
+                        }
+
+                        return;
+                    }
+
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
 
-                    // Iterate thru vertices multiply and append them to GPU buffer
+                    // Iterate thru vertices and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = myvertexdata[j];
+                        shapevertices[j] = mesh->GetVertex(j);
                     }
-                }
+                });
 
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
@@ -387,14 +1055,18 @@ namespace RadeonRays
 
             // Create face buffer
             {
+                // Faces without quads don't carry the last two fields
+                size_t const facesize = has_quads ? sizeof(Face) : offsetof(Face, idx3);
+
                 // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::kRead);
+                m_stats.faces_bytes = numfaces * facesize;
+                m_gpudata->faces = AcquireBuffer(numfaces * facesize, Calc::kRead);
 
                 // Get the pointer to mapped data
-                Face* facedata = nullptr;
+                char* facebytes = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(Face), Calc::MapType::kMapWrite, (void**)&facedata, &e);
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * facesize, Calc::MapType::kMapWrite, (void**)&facebytes, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
@@ -404,18 +1076,64 @@ namespace RadeonRays
                 // Besides that we need to permute the faces accorningly to BVH reordering, whihc
                 // is contained within bvh.primids_
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                parallel_for(scheduler, 0, nummeshes, 1, [&](int i)
                 {
                     // Reordering indices for a given mesh
                     int const* reordering = m_bvhs[i]->GetIndices();
 
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                    int startidx = m_cpudata->mesh_vertices_start_idx[i];
 
-                    Mesh::Face const* myfaces = mesh->GetFaceData();
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_curves())
+                    {
+                        // Segments reference their first control point
+                        for (int j = 0; j < GetNumPrimitives(shapes[i]); ++j)
+                        {
+                            int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
+                            int segmentidx = reordering[j];
+                            Face* face = reinterpret_cast<Face*>(facebytes + myidx * facesize);
+
+                            face->idx[0] = face->idx[1] = face->idx[2] = startidx + 4 * segmentidx;
+                            face->shape_id = shapes[i]->GetId();
+                            face->prim_id = segmentidx;
+
+                            if (has_quads)
+                            {
+                                face->idx3 = -1;
+                                face->padding = 0;
+                            }
+                        }
+
+                        return;
+                    }
 
-                    int startidx = m_cpudata->mesh_vertices_start_idx[i];
+                    if (static_cast<ShapeImpl const*>(shapes[i])->is_procedural())
+                    {
+                        // Primitives reference their data and keep their kind in the second index
+                        int const kind = static_cast<Procedurals const*>(shapes[i])->GetKind();
+
+                        for (int j = 0; j < GetNumPrimitives(shapes[i]); ++j)
+                        {
+                            int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
+                            int primidx = reordering[j];
+                            Face* face = reinterpret_cast<Face*>(facebytes + myidx * facesize);
+
+                            face->idx[0] = startidx + 2 * primidx;
+                            face->idx[1] = face->idx[2] = kind;
+                            face->shape_id = shapes[i]->GetId();
+                            face->prim_id = primidx;
+
+                            if (has_quads)
+                            {
+                                face->idx3 = -1;
+                                face->padding = 0;
+                            }
+                        }
+
+                        return;
+                    }
+
+                    // Get the mesh
+                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
                     for (int j = 0; j < mesh->num_faces(); ++j)
                     {
@@ -423,246 +1141,995 @@ namespace RadeonRays
                         int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
                         int faceidx = reordering[j];
 
-                        facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
-                        facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
-                        facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
+                        Mesh::Face const myface = mesh->GetFace(faceidx);
+                        Face* face = reinterpret_cast<Face*>(facebytes + myidx * facesize);
+                        face->idx[0] = myface.idx[0] + startidx;
+                        face->idx[1] = myface.idx[1] + startidx;
+                        face->idx[2] = myface.idx[2] + startidx;
+
+                        face->shape_id = mesh->GetId();
+                        face->prim_id = faceidx;
 
-                        facedata[myidx].shape_id = mesh->GetId();
-                        facedata[myidx].prim_id = faceidx;
+                        if (has_quads)
+                        {
+                            face->idx3 = myface.type_ == Mesh::FaceType::QUAD ? myface.idx[3] + startidx : -1;
+                            face->padding = 0;
+                        }
                     }
-                }
+                });
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+                m_device->UnmapBuffer(m_gpudata->faces, 0, facebytes, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
             }
 
+            m_stats.upload_time = GetElapsedTime(start);
+        }
 
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+        auto start = Clock::now();
 
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
-            {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+        // BVHs shapes can reference: meshes go first, group BVHs follow them
+        // and the top level one is the last
+        std::unordered_map<Shape const*, int> bvhindices(nummeshes + numgroups);
+
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            bvhindices[shapes[i]] = i;
+        }
+
+        for (int i = 0; i < numgroups; ++i)
+        {
+            bvhindices[groups[i]] = nummeshes + i;
+        }
+
+        // Instances reference BVH of their base shape, duplicate meshes the one of their representative
+        auto get_bvhidx = [&](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            Shape const* base_shape = shapeimpl->is_instance() ? static_cast<Instance const*>(shapeimpl)->GetBaseShape() : shape;
+            auto duplicate = duplicates.find(base_shape);
+            auto iter = bvhindices.find(duplicate != duplicates.cend() ? duplicate->second : base_shape);
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
+            // TODO: should be assert
+            ThrowIf(iter == bvhindices.cend(), "Internal error");
 
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+            return iter->second;
+        };
+
+        // Group BVHs are built over their members placed by their own transforms, like the
+        // top level one over the scene. Nested groups are built before groups referencing them.
+        // Group data entries follow top level ones in the shape data, starting at group_entries.
+        std::vector<int> group_entries(numgroups + 1, 0);
+        std::vector<int> group_levels(numgroups);
+        bool group_motion = false;
+
+        m_group_bvhs.resize(numgroups);
+        m_cpudata->bvhptrs.resize(nummeshes + numgroups + 1);
+
+        for (int i = 0; i < numgroups; ++i)
+        {
+            auto const& members = groups[i]->GetShapes();
+            std::vector<bbox> member_bounds(members.size());
+            int levels = 0;
+
+            for (std::size_t j = 0; j < members.size(); ++j)
+            {
+                auto memberimpl = static_cast<ShapeImpl const*>(members[j]);
+                int const bvhidx = get_bvhidx(memberimpl);
+                bbox const& bounds = m_cpudata->bvhptrs[bvhidx]->Bounds();
+
+                if (memberimpl->HasMotion())
                 {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+                    // Group BVHs are static, so moving members are bounded over the whole frame
+                    bbox bounds0, bounds1;
+                    GetMotionBounds(memberimpl, bounds, bounds0, bounds1);
+                    member_bounds[j] = bboxunion(bounds0, bounds1);
+                    group_motion = true;
                 }
                 else
                 {
-                    m_cpudata->shapedata[i].mask = 0x0;
+                    matrix m, minv;
+                    memberimpl->GetTransform(m, minv);
+                    member_bounds[j] = transform_bbox(bounds, m);
                 }
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+                if (bvhidx >= nummeshes)
+                {
+                    levels = std::max(levels, group_levels[bvhidx - nummeshes]);
+                }
+            }
+
+            group_levels[i] = levels + 1;
+            ThrowIf(group_levels[i] > kMaxGroupLevels, "Groups can be nested up to 3 levels");
+
+            m_group_bvhs[i].reset(use_lbvh ?
+                new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                new Bvh(traversal_cost, num_bins, use_sah));
+            m_group_bvhs[i]->Build(&member_bounds[0], (int)members.size());
+
+            m_cpudata->bvhptrs[nummeshes + i] = m_group_bvhs[i].get();
+            group_entries[i + 1] = group_entries[i] + (int)members.size();
+        }
+
+        m_stats.build_time += GetElapsedTime(start);
+        start = Clock::now();
+
+        // We are storing individual object bounds here to build top level BVH
+        std::vector<bbox> object_bounds(nummeshes + numinstances);
+        // Index of the bottom level BVH for each shape
+        std::vector<int> shape_bvhidx(nummeshes + numinstances);
+
+        // Handle simple shapes
+        parallel_for(scheduler, 0, nummeshes, kShapeGrainSize, [&](int i)
+        {
+            matrix m, minv;
+            // Get transform to apply to object bounds
+            shapes[i]->GetTransform(m, minv);
+
+            // Extract and store bounds. Note they are in object space and we need to translate them to world space
+            object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+            shape_bvhidx[i] = i;
+        });
+
+        // Handle instances and groups
+        parallel_for(scheduler, nummeshes, nummeshes + numinstances, kShapeGrainSize, [&](int i)
+        {
+            matrix m, minv;
+            // Get transform to apply to object bounds
+            shapes[i]->GetTransform(m, minv);
+
+            // Find BVH for the instance or the group
+            int bvhidx = get_bvhidx(shapes[i]);
+
+            // Extract and store bounds. Note they are in object space and we need to translate them to world space
+            object_bounds[i] = transform_bbox(m_cpudata->bvhptrs[bvhidx]->Bounds(), m);
+            shape_bvhidx[i] = bvhidx;
+        });
 
-                if (!shapeimpl->is_instance())
+        int numshapes = nummeshes + numinstances;
+
+        // Moving shapes need top level bounds at both ends of the frame, the tree is built
+        // over their union. Motion is only applied by OpenCL kernels.
+        bool const has_motion = m_device->GetPlatform() == Calc::Platform::kOpenCL && (group_motion ||
+            std::any_of(shapes.cbegin(), shapes.cend(), [](Shape const* shape)
+            {
+                return static_cast<ShapeImpl const*>(shape)->HasMotion();
+            }));
+
+        std::vector<bbox> object_bounds0;
+        std::vector<bbox> object_bounds1;
+
+        if (has_motion)
+        {
+            object_bounds0.resize(numshapes);
+            object_bounds1.resize(numshapes);
+
+            parallel_for(scheduler, 0, numshapes, kShapeGrainSize, [&](int i)
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+
+                if (shapeimpl->HasMotion())
                 {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
+                    GetMotionBounds(shapeimpl, m_cpudata->bvhptrs[shape_bvhidx[i]]->Bounds(), object_bounds0[i], object_bounds1[i]);
+                    object_bounds[i] = bboxunion(object_bounds0[i], object_bounds1[i]);
                 }
                 else
                 {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+                    object_bounds0[i] = object_bounds1[i] = object_bounds[i];
+                }
+            });
+        }
+
+        m_stats.bounds_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        // Top level BVH can be built on the device, this is only supported for OpenCL
+        auto toplevel = world.options_.GetOption(Options::kBvhToplevelBuilder);
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+        // Binned SAH builder doesn't need parallel primitives
+        auto hlbvh_builder = world.options_.GetOption(Options::kBvhHlbvhBuilder);
+        bool const use_binned_sah = hlbvh_builder && hlbvh_builder->AsString() == "sah";
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+        // Device built top level doesn't keep motion bounds
+        bool const use_hlbvh = toplevel && toplevel->AsString() == "hlbvh" &&
+            m_gpudata->translate_func && (use_binned_sah || m_device->HasBuiltinPrimitives()) && numshapes > 1 && !has_motion;
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+        // Rebraided top level references subtrees of mesh BVHs, which only skip links OpenCL kernel
+        // can enter. Moving shapes are bounded by whole trees, so scenes with motion are not opened.
+        bool const use_rebraid = toplevel && toplevel->AsString() == "rebraid" &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL && !has_motion;
+
+        // Top level leaves reference shapes or subtrees of their BVHs if the top level is rebraided
+        std::vector<PlainBvhTranslator::Subtree> subtrees;
+        int numentries = numshapes;
+        // Leaves of attached or detached instances have been inserted into the top level or removed from it
+        bool update_top = false;
+
+        // Calculate top level BVH
+        if (use_hlbvh && use_binned_sah)
+        {
+            if (!m_sah_bvh)
+            {
+                m_sah_bvh.reset(new BinnedSahBvh(m_device));
+                m_sah_bvh->SetTimer(m_timer.get());
+            }
+
+            m_sah_bvh->Build(&object_bounds[0], numshapes);
+            m_bvhs[nummeshes].reset();
+            m_hlbvh.reset();
+            m_cpudata->refit_top = false;
+
+            m_stats.num_nodes = 2 * numshapes - 1;
+            m_stats.num_leaves = numshapes;
+        }
+        else if (use_hlbvh)
+        {
+            auto morton64 = world.options_.GetOption(Options::kBvhHlbvhMorton64);
+            bool const use_morton64 = morton64 && morton64->AsFloat() > 0.f;
+
+            if (!m_hlbvh || m_hlbvh->IsMorton64() != use_morton64)
+            {
+                m_hlbvh.reset(new Hlbvh(m_device, use_morton64));
+                m_hlbvh->SetTimer(m_timer.get());
+            }
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            auto treelets = world.options_.GetOption(Options::kBvhHlbvhTreelets);
+            m_hlbvh->SetTreeletOptimization(treelets && treelets->AsFloat() > 0.f);
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
+            m_hlbvh->Build(&object_bounds[0], numshapes);
+            m_bvhs[nummeshes].reset();
+            m_sah_bvh.reset();
+            m_cpudata->refit_top = false;
+
+            m_stats.num_nodes = 2 * numshapes - 1;
+            m_stats.num_leaves = numshapes;
+        }
+        else if (use_rebraid)
+        {
+            // Long rotated instances have loose world bounds overlapping a lot, their
+            // BVHs are opened into subtrees with tighter ones and SAH top level is built
+            // over those. Groups are kept whole.
+            std::vector<Bvh const*> shape_bvhs(numshapes);
+            std::vector<matrix> transforms(numshapes);
+
+            parallel_for(scheduler, 0, numshapes, kShapeGrainSize, [&](int i)
+            {
+                matrix minv;
+                shapes[i]->GetTransform(transforms[i], minv);
+                shape_bvhs[i] = shape_bvhidx[i] < nummeshes ? m_cpudata->bvhptrs[shape_bvhidx[i]] : nullptr;
+            });
+
+            PlainBvhTranslator::OpenSubtrees(&shape_bvhs[0], &transforms[0], &object_bounds[0],
+                numshapes, kRebraidSubtreesPerShape * numshapes, subtrees);
+            numentries = (int)subtrees.size();
+
+            std::vector<bbox> subtree_bounds(numentries);
+
+            for (int i = 0; i < numentries; ++i)
+            {
+                subtree_bounds[i] = subtrees[i].bounds;
+            }
+
+            m_bvhs[nummeshes].reset(new Bvh(traversal_cost, num_bins, true));
+            m_bvhs[nummeshes]->SetScheduler(&scheduler);
+            m_bvhs[nummeshes]->Build(&subtree_bounds[0], numentries);
+            m_bvhs[nummeshes]->SetScheduler(nullptr);
+            m_cpudata->refit_top = false;
+
+            SetBvhStatistics(*m_bvhs[nummeshes]);
+        }
+        else
+        {
+            // Only transforms have changed: shapes keep their order and bottom levels,
+            // so the top level is refitted to their new bounds (animated instances)
+            bool const refit_top = m_cpudata->refit_top && !rebuild_bottom && numgroups == 0 && !has_motion &&
+                m_bvhs[nummeshes] && CanRefit(world) && m_bvhs[nummeshes]->Refit(&object_bounds[0], numshapes);
+
+            // Only instances have been attached or detached: meshes keep their order and bottom levels,
+            // so leaves of the shapes which are gone are removed from the top level and new ones inserted.
+            // Repeated updates degrade the tree, it is rebuilt once its cost exceeds the limit. The cost
+            // grows with tree depth anyway, so the built one is scaled by the height of a balanced tree.
+            auto incremental = world.options_.GetOption(Options::kBvhToplevelIncrementalMaxCost);
+            float const max_cost = incremental ? incremental->AsFloat() : 1.5f;
+
+            if (!refit_top && max_cost > 0.f && world.has_changed() && m_cpudata->refit_top && !rebuild_bottom &&
+                numgroups == 0 && !has_motion && m_bvhs[nummeshes])
+            {
+                std::unordered_map<Shape const*, int> shape_indices(numshapes);
+
+                for (int i = 0; i < numshapes; ++i)
+                {
+                    shape_indices[shapes[i]] = i;
                 }
+
+                auto const& top_shapes = m_cpudata->top_shapes;
+                std::vector<int> remap(top_shapes.size());
+
+                for (std::size_t i = 0; i < top_shapes.size(); ++i)
+                {
+                    auto iter = shape_indices.find(top_shapes[i]);
+                    remap[i] = iter != shape_indices.cend() ? iter->second : -1;
+                }
+
+                float const depth_scale = std::log2((float)std::max(numshapes, 2)) /
+                    std::log2((float)std::max(m_cpudata->top_num_shapes, 2));
+
+                update_top = m_bvhs[nummeshes]->Update(&object_bounds[0], numshapes, remap.data(), (int)remap.size()) &&
+                    m_bvhs[nummeshes]->GetSahCost() <= max_cost * depth_scale * m_cpudata->top_sah_cost;
             }
 
-            // Create face ID buffer
-            m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+            if (refit_top || update_top)
+            {
+                m_stats.refitted = 1;
+            }
+            else
+            {
+                m_bvhs[nummeshes].reset(use_lbvh ?
+                    new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                    new Bvh(traversal_cost, num_bins, use_sah));
+                m_bvhs[nummeshes]->SetScheduler(&scheduler);
+                m_bvhs[nummeshes]->Build(&object_bounds[0], numshapes);
+                m_bvhs[nummeshes]->SetScheduler(nullptr);
+            }
+
+            m_cpudata->refit_top = true;
+            m_cpudata->top_shapes.assign(shapes.cbegin(), shapes.cbegin() + numshapes);
+
+            SetBvhStatistics(*m_bvhs[nummeshes]);
+
+            if (!refit_top && !update_top)
+            {
+                m_cpudata->top_sah_cost = m_stats.sah_cost;
+                m_cpudata->top_num_shapes = numshapes;
+            }
         }
-        // Refit
-        else if (statechange != ShapeImpl::kStateChangeNone)
+
+        m_cpudata->bvhptrs[nummeshes + numgroups] = m_bvhs[nummeshes].get();
+
+        m_stats.build_time += GetElapsedTime(start);
+        start = Clock::now();
+
+        // "fatbvh" acc.type traverses meshes and their instances with the short stack kernel. Scenes it
+        // can't handle (groups, curves, procedurals, motion, compact transforms, device built or rebraided top level
+        // or levels too deep for the stack together) keep skip links.
+        auto acctype = world.options_.GetOption(Options::kAccType);
+        auto compact_transforms = world.options_.GetOption(Options::kBvhCompactTransforms);
+        bool use_fatnodes = acctype && acctype->AsString() == "fatbvh" &&
+            m_device->GetPlatform() == Calc::Platform::kOpenCL &&
+            numgroups == 0 && !has_curves && !has_procedurals && !has_motion && !use_hlbvh && !use_rebraid &&
+            !(compact_transforms && compact_transforms->AsFloat() > 0.f);
+
+        if (use_fatnodes)
         {
-            //std::cout << "Refit\n";
+            int bottom_height = 0;
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                bottom_height = std::max(bottom_height, m_cpudata->bvhptrs[i]->GetHeight());
+            }
+
+            use_fatnodes = m_bvhs[nummeshes]->GetHeight() + 1 + bottom_height <= kMaxStackDepth;
+        }
+
+        // Switching node layouts translates all the levels again
+        bool const retranslate = rebuild_bottom || numgroups > 0 || m_cpudata->num_groups > 0 ||
+            use_fatnodes != m_cpudata->use_fatnodes;
 
-            for (auto s : world.shapes_)
+        // Top level nodes uploaded by the previous commit, incremental updates only upload the changed ones
+        std::vector<char> previous_top;
+
+        // Update GPU data. Group BVHs are translated with bottom level ones,
+        // their leaves reference shape data entries.
+        if (use_fatnodes)
+        {
+            // Bottom level leaves reference faces and top level ones shapes
+            if (retranslate)
+            {
+                ReleaseBuffer(m_gpudata->bvh);
+                m_gpudata->bvh = nullptr;
+
+                m_cpudata->fattranslator.Process(&m_cpudata->bvhptrs[0], m_cpudata->mesh_faces_start_idx.data(), nummeshes);
+                m_cpudata->num_groups = 0;
+            }
+            else
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                auto const& fatnodes = m_cpudata->fattranslator.nodes_;
+                int const fatroot = m_cpudata->fattranslator.root_;
 
-                if (shapeimpl->is_instance())
+                if (update_top)
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
+                    previous_top.assign((char const*)&fatnodes[fatroot], (char const*)(fatnodes.data() + fatnodes.size()));
+                }
 
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
+                m_cpudata->fattranslator.UpdateTopLevel(*m_bvhs[nummeshes]);
+            }
+        }
+        else if (retranslate)
+        {
+            ReleaseBuffer(m_gpudata->bvh);
+            m_gpudata->bvh = nullptr;
+
+            std::vector<int> offsets(m_cpudata->mesh_faces_start_idx);
+
+            for (int i = 0; i < numgroups; ++i)
+            {
+                offsets.push_back(numentries + group_entries[i]);
+            }
+
+            m_cpudata->translator.Flush();
+            // TODO: parallelize this
+            m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], offsets.data(), nummeshes + numgroups);
+            m_cpudata->num_groups = numgroups;
+        }
+        else if (!use_hlbvh)
+        {
+            // Bottom level nodes stay in place, only retranslate top level ones
+            auto const& nodes = m_cpudata->translator.nodes_;
+            int const plainroot = m_cpudata->translator.root_;
+
+            if (update_top)
+            {
+                previous_top.assign((char const*)&nodes[plainroot], (char const*)(nodes.data() + nodes.size()));
+            }
+
+            m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+        }
+
+        m_cpudata->use_fatnodes = use_fatnodes;
+
+        int root = use_fatnodes ? m_cpudata->fattranslator.root_ : m_cpudata->translator.root_;
+
+        // Top level nodes are given time 0 bounds and time 1 ones are kept aside.
+        // Nodes are refitted backwards as children follow their parents: left child
+        // is right next to the node and the right one is where the left one skips to.
+        std::vector<bbox> motion_bounds(1);
+
+        if (has_motion)
+        {
+            auto& topnodes = m_cpudata->translator.nodes_;
+            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            int const numtopnodes = (int)topnodes.size() - root;
+
+            std::vector<bbox> bounds0(numtopnodes);
+            motion_bounds.resize(numtopnodes);
+
+            for (int i = numtopnodes - 1; i >= 0; --i)
+            {
+                bbox const& node = topnodes[root + i].bounds;
+
+                if (node.pmin.w != -1.f)
+                {
+                    int const shapeidx = topindices[((int)node.pmin.w) >> 4];
+                    bounds0[i] = object_bounds0[shapeidx];
+                    motion_bounds[i] = object_bounds1[shapeidx];
+                }
+                else
+                {
+                    int const left = i + 1;
+                    int const right = (int)topnodes[root + left].bounds.pmax.w - root;
+                    bounds0[i] = bboxunion(bounds0[left], bounds0[right]);
+                    motion_bounds[i] = bboxunion(motion_bounds[left], motion_bounds[right]);
+                }
+            }
+
+            // Links are kept in w components
+            for (int i = 0; i < numtopnodes; ++i)
+            {
+                bbox& node = topnodes[root + i].bounds;
+                node.pmin = float3(bounds0[i].pmin.x, bounds0[i].pmin.y, bounds0[i].pmin.z, node.pmin.w);
+                node.pmax = float3(bounds0[i].pmax.x, bounds0[i].pmax.y, bounds0[i].pmax.z, node.pmax.w);
+            }
+        }
+
+        m_stats.translate_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        if (use_fatnodes)
+        {
+            auto const& fatnodes = m_cpudata->fattranslator.nodes_;
+            std::size_t const nodesize = sizeof(FatNodeBvhTranslator::Node);
+
+            if (!m_gpudata->bvh || m_gpudata->bvh->GetSize() < fatnodes.size() * nodesize)
+            {
+                ReleaseBuffer(m_gpudata->bvh);
+
+                m_stats.nodes_bytes = fatnodes.size() * nodesize;
+                m_gpudata->bvh = AcquireBuffer(fatnodes.size() * nodesize, Calc::kRead | Calc::kWrite, (void*)&fatnodes[0]);
+            }
+            else
+            {
+                // Copy only top BVH data, or only its changed nodes after an incremental update
+                std::size_t first = root;
+                std::size_t last = fatnodes.size();
+
+                if (update_top)
+                {
+                    GetChangedNodes(previous_top, (char const*)&fatnodes[root], fatnodes.size() - root, nodesize, first, last);
+                    first += root;
+                    last += root;
+                }
+
+                m_stats.nodes_bytes = (last - first) * nodesize;
+
+                if (last > first)
+                {
+                    Calc::Event* e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->bvh, 0, first * nodesize, (last - first) * nodesize, (char*)&fatnodes[first], &e);
+
+                    e->Wait();
+                    m_device->DeleteEvent(e);
+                }
+            }
+        }
+        else
+        {
+            auto const& nodes = m_cpudata->translator.nodes_;
+            // Top level is always 2 * N - 1 nodes as there is a single shape per leaf
+            std::size_t numnodes = use_hlbvh ? root + 2 * numshapes - 1 : nodes.size();
+
+            // Pooled buffers may be larger than requested, so they are only replaced to grow
+            if (!m_gpudata->bvh || m_gpudata->bvh->GetSize() < numnodes * sizeof(PlainBvhTranslator::Node))
+            {
+                ReleaseBuffer(m_gpudata->bvh);
+
+                if (use_hlbvh)
+                {
+                    // Copy bottom level nodes only, top level ones are written by the device
+                    m_gpudata->bvh = AcquireBuffer(numnodes * sizeof(PlainBvhTranslator::Node), Calc::kRead | Calc::kWrite);
+
+                    m_stats.nodes_bytes = root * sizeof(PlainBvhTranslator::Node);
+
+                    if (root > 0)
                     {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
+                        Calc::Event* e = nullptr;
+                        m_device->WriteBuffer(m_gpudata->bvh, 0, 0, root * sizeof(PlainBvhTranslator::Node), (char*)&nodes[0], &e);
+
+                        e->Wait();
+                        m_device->DeleteEvent(e);
                     }
                 }
+                else
+                {
+                    // Copy all the translated nodes
+                    m_stats.nodes_bytes = numnodes * sizeof(PlainBvhTranslator::Node);
+                    m_gpudata->bvh = AcquireBuffer(numnodes * sizeof(PlainBvhTranslator::Node), Calc::kRead | Calc::kWrite, (void*)&nodes[0]);
+                }
+            }
+            else if (!use_hlbvh)
+            {
+                // Copy only top BVH data, or only its changed nodes after an incremental update
+                std::size_t const nodesize = sizeof(PlainBvhTranslator::Node);
+                std::size_t first = root;
+                std::size_t last = nodes.size();
+
+                if (update_top)
+                {
+                    GetChangedNodes(previous_top, (char const*)&nodes[root], nodes.size() - root, nodesize, first, last);
+                    first += root;
+                    last += root;
+                }
+
+                m_stats.nodes_bytes = (last - first) * nodesize;
 
-                shapes.push_back(s);
+                if (last > first)
+                {
+                    Calc::Event* e = nullptr;
+                    m_device->WriteBuffer(m_gpudata->bvh, 0, first * nodesize, (last - first) * nodesize, (char*)&nodes[first], &e);
+
+                    e->Wait();
+                    m_device->DeleteEvent(e);
+                }
             }
+        }
+
+        m_stats.upload_time += GetElapsedTime(start);
+        start = Clock::now();
+
+        if (use_hlbvh)
+        {
+            // Convert HLBVH into skip links layout right in the device memory
+            auto& func = m_gpudata->translate_func;
+            auto nodes = m_sah_bvh ? m_sah_bvh->GetGpuData().nodes : m_hlbvh->GetGpuData().nodes;
+            auto bounds = m_sah_bvh ? m_sah_bvh->GetGpuData().sorted_bounds : m_hlbvh->GetGpuData().sorted_bounds;
+
+            int arg = 0;
+            func->SetArg(arg++, nodes);
+            func->SetArg(arg++, bounds);
+            func->SetArg(arg++, sizeof(int), &numshapes);
+            func->SetArg(arg++, sizeof(int), &root);
+            func->SetArg(arg++, m_gpudata->bvh);
+
+            size_t globalsize = ((2 * numshapes - 1 + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+            m_timer->Execute("translate_top_level", func, 0, globalsize, kWorkGroupSize, nullptr);
+            m_device->Finish(0);
+
+            m_stats.translate_time += GetElapsedTime(start);
+            start = Clock::now();
+        }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+        m_gpudata->bvhrootidx = root;
+
+        // Now we need to collect shapdata. Device built top level references shapes
+        // in their original order, otherwise they are permuted by top level BVH.
+        int const* topindices = use_hlbvh ? nullptr : m_bvhs[nummeshes]->GetIndices();
+
+        m_cpudata->shapedata.resize(numentries + group_entries[numgroups]);
+
+        // LOD groups reference their records instead of group BVHs. Levels are group
+        // members, so their shape data entries are ordered by the group BVH as well.
+        std::vector<int> lod_records(numgroups, -1);
+        // Kernels always take LOD records, a single dummy entry is kept for scenes without them
+        m_cpudata->lods.assign(1, 0);
+
+        for (int i = 0; i < numgroups; ++i)
+        {
+            if (!static_cast<ShapeImpl const*>(groups[i])->is_lod())
             {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
+                continue;
+            }
 
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+            auto lod = static_cast<LodGroup const*>(groups[i]);
+            int const numlevels = (int)lod->GetShapes().size();
+            int const* indices = m_group_bvhs[i]->GetIndices();
 
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+            lod_records[i] = (int)m_cpudata->lods.size();
+            m_cpudata->lods.resize(lod_records[i] + 3 + 2 * numlevels);
 
-            matrix m, minv;
+            int* record = &m_cpudata->lods[lod_records[i]];
+            float const transition = lod->GetTransition();
+            record[0] = numlevels;
+            record[1] = lod->GetRule();
+            std::memcpy(&record[2], &transition, sizeof(float));
 
-            // Go over meshes and rebuild BVH bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            for (int j = 0; j < numlevels; ++j)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+                int const level = indices[j];
+                record[3 + 2 * level] = numentries + group_entries[i] + j;
+                std::memcpy(&record[4 + 2 * level], &lod->GetThresholds()[level], sizeof(float));
             }
+        }
 
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+        // Root and type of shape data entries referencing a given BVH
+        auto const& roots = use_fatnodes ? m_cpudata->fattranslator.roots_ : m_cpudata->translator.roots_;
+        auto set_bvh = [&](ShapeData& shapedata, int bvhidx)
+        {
+            if (bvhidx >= nummeshes && lod_records[bvhidx - nummeshes] >= 0)
             {
+                shapedata.bvhidx = lod_records[bvhidx - nummeshes];
+                shapedata.type = kShapeTypeLod;
+            }
+            else
+            {
+                shapedata.bvhidx = roots[bvhidx];
+                auto shapeimpl = bvhidx < nummeshes ? static_cast<ShapeImpl const*>(shapes[bvhidx]) : nullptr;
+                shapedata.type = !shapeimpl ? kShapeTypeGroup :
+                    shapeimpl->is_curves() ? kShapeTypeCurves :
+                    shapeimpl->is_procedural() ? kShapeTypeProcedurals : kShapeTypeMesh;
+            }
+        };
+        // Kernels always take velocities, a single dummy entry is kept for static scenes
+        m_cpudata->shapemotion.assign(has_motion ? m_cpudata->shapedata.size() : 1, ShapeMotion());
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
+        parallel_for(scheduler, 0, numentries, kShapeGrainSize, [&](int i)
+        {
+            int entryidx = topindices ? topindices[i] : i;
+            int shapeidx = use_rebraid ? subtrees[entryidx].shape : entryidx;
 
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+            // Get the mesh
+            ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[shapeidx]);
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+            m_cpudata->shapedata[i].id = shapeimpl->GetId();
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            // For disabled shapes force mask to zero since these shapes 
+            // present only virtually (they have not been added to the scene)
+            // and we need to skip them while doing traversal.
+            if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+            {
+                m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+            }
+            else
+            {
+                m_cpudata->shapedata[i].mask = 0x0;
+            }
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            SetTransform(shapeimpl, m_cpudata->shapedata[i].minv);
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
+            if (has_motion)
+            {
+                m_cpudata->shapemotion[i].linearvelocity = shapeimpl->GetLinearVelocity();
+                m_cpudata->shapemotion[i].angularvelocity = shapeimpl->GetAngularVelocity();
             }
 
-            // Calculate top level BVH
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            set_bvh(m_cpudata->shapedata[i], shape_bvhidx[shapeidx]);
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
-            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+            // Opened instances enter their BVHs at subtree roots
+            if (use_rebraid)
+            {
+                m_cpudata->shapedata[i].bvhidx += subtrees[entryidx].offset;
+            }
+        });
 
+        // Group members are ordered by group BVHs, their transforms are relative to the group
+        parallel_for(scheduler, 0, numgroups, 1, [&](int i)
+        {
+            auto const& members = groups[i]->GetShapes();
+            int const* indices = m_group_bvhs[i]->GetIndices();
 
-            if (builder && builder->AsString() == "sah")
+            for (int j = 0; j < (int)members.size(); ++j)
             {
-                use_sah = true;
+                auto memberimpl = static_cast<ShapeImpl const*>(members[indices[j]]);
+                auto& shapedata = m_cpudata->shapedata[numentries + group_entries[i] + j];
+                int const bvhidx = get_bvhidx(memberimpl);
+
+                shapedata.id = memberimpl->GetId();
+                shapedata.mask = memberimpl->GetMask();
+
+                SetTransform(memberimpl, shapedata.minv);
+
+                if (has_motion)
+                {
+                    auto& motion = m_cpudata->shapemotion[numentries + group_entries[i] + j];
+                    motion.linearvelocity = memberimpl->GetLinearVelocity();
+                    motion.angularvelocity = memberimpl->GetAngularVelocity();
+                }
+
+                set_bvh(shapedata, bvhidx);
             }
+        });
 
-            m_bvhs[nummeshes].reset(new Bvh(traversal_cost, num_bins, use_sah));
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+        // Kernels always take time 1 bounds, a single dummy node is kept for static scenes
+        auto motionsize = motion_bounds.size() * sizeof(bbox);
 
+        if (!m_gpudata->motion || m_gpudata->motion->GetSize() < motionsize)
+        {
+            ReleaseBuffer(m_gpudata->motion);
+            m_gpudata->motion = AcquireBuffer(motionsize, Calc::kRead, &motion_bounds[0]);
+        }
+        else if (has_motion)
+        {
+            Calc::Event* e = nullptr;
+            m_device->WriteBuffer(m_gpudata->motion, 0, 0, motionsize, (char*)&motion_bounds[0], &e);
 
-            // TODO: parallelize this
-            m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+
+        auto shapemotionsize = m_cpudata->shapemotion.size() * sizeof(ShapeMotion);
 
-            // Update GPU data
-            // Copy only top BVH data
+        if (!m_gpudata->shape_motion || m_gpudata->shape_motion->GetSize() < shapemotionsize)
+        {
+            ReleaseBuffer(m_gpudata->shape_motion);
+            m_gpudata->shape_motion = AcquireBuffer(shapemotionsize, Calc::kRead, &m_cpudata->shapemotion[0]);
+        }
+        else if (has_motion)
+        {
             Calc::Event* e = nullptr;
-            m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * (nummeshes + numinstances) - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
+            m_device->WriteBuffer(m_gpudata->shape_motion, 0, 0, shapemotionsize, (char*)&m_cpudata->shapemotion[0], &e);
 
             e->Wait();
             m_device->DeleteEvent(e);
+        }
 
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+        // Masks are propagated up the top level the same way motion bounds are refitted.
+        // Device built top level nodes are not known here, they are never culled.
+        // Short stack kernel only tests shape masks, a dummy entry is kept for it.
+        int const numtopnodes = use_fatnodes ? 1 :
+            use_hlbvh ? 2 * numshapes - 1 : (int)m_cpudata->translator.nodes_.size() - root;
+        m_cpudata->nodemasks.assign(numtopnodes, -1);
+
+        if (!use_hlbvh && !use_fatnodes)
+        {
+            auto const& topnodes = m_cpudata->translator.nodes_;
 
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
+            for (int i = numtopnodes - 1; i >= 0; --i)
             {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+                bbox const& node = topnodes[root + i].bounds;
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+                if (node.pmin.w != -1.f)
                 {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+                    m_cpudata->nodemasks[i] = m_cpudata->shapedata[((int)node.pmin.w) >> 4].mask;
                 }
                 else
                 {
-                    m_cpudata->shapedata[i].mask = 0x0;
+                    int const left = i + 1;
+                    int const right = (int)topnodes[root + left].bounds.pmax.w - root;
+                    m_cpudata->nodemasks[i] = m_cpudata->nodemasks[left] | m_cpudata->nodemasks[right];
                 }
+            }
+        }
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+        auto nodemasksize = m_cpudata->nodemasks.size() * sizeof(int);
 
-                if (!shapeimpl->is_instance())
-                {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
-                }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+        if (!m_gpudata->node_masks || m_gpudata->node_masks->GetSize() < nodemasksize)
+        {
+            ReleaseBuffer(m_gpudata->node_masks);
+            m_gpudata->node_masks = AcquireBuffer(nodemasksize, Calc::kRead, &m_cpudata->nodemasks[0]);
+        }
+        else
+        {
+            Calc::Event* e = nullptr;
+            m_device->WriteBuffer(m_gpudata->node_masks, 0, 0, nodemasksize, (char*)&m_cpudata->nodemasks[0], &e);
+
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+        auto lodsize = m_cpudata->lods.size() * sizeof(int);
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+        if (!m_gpudata->lods || m_gpudata->lods->GetSize() < lodsize)
+        {
+            ReleaseBuffer(m_gpudata->lods);
+            m_gpudata->lods = AcquireBuffer(lodsize, Calc::kRead, &m_cpudata->lods[0]);
+        }
+        else if (m_cpudata->lods.size() > 1)
+        {
+            Calc::Event* e = nullptr;
+            m_device->WriteBuffer(m_gpudata->lods, 0, 0, lodsize, (char*)&m_cpudata->lods[0], &e);
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+        // Rigid transforms can be stored compactly, the encoding is lossy (snorm16 rotation)
+        // so it is opt-in, and used only if every shape in the scene qualifies
+        auto compact = world.options_.GetOption(Options::kBvhCompactTransforms);
+        bool use_compact = compact && compact->AsFloat() > 0.f && m_device->GetPlatform() == Calc::Platform::kOpenCL;
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
+        if (use_compact)
+        {
+            m_cpudata->compactdata.resize(m_cpudata->shapedata.size());
+
+            for (std::size_t i = 0; i < m_cpudata->shapedata.size() && use_compact; ++i)
+            {
+                auto const& shapedata = m_cpudata->shapedata[i];
+                auto& compactdata = m_cpudata->compactdata[i];
+
+                compactdata.id = shapedata.id;
+                compactdata.bvhidx = shapedata.bvhidx;
+                compactdata.mask = shapedata.mask;
+                compactdata.type = shapedata.type;
+                use_compact = CompactTransform(shapedata.minv, compactdata.rotation, compactdata.translation, compactdata.scale);
             }
+        }
 
-            // Create face ID buffer
-            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, (nummeshes + numinstances) * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+        // Create or update shape data buffer
+        auto shapedatasize = use_compact ?
+            m_cpudata->compactdata.size() * sizeof(CompactShapeData) :
+            m_cpudata->shapedata.size() * sizeof(ShapeData);
+        void* shapedataptr = use_compact ? (void*)&m_cpudata->compactdata[0] : (void*)&m_cpudata->shapedata[0];
+        m_stats.shapes_bytes = shapedatasize;
+
+        if (!m_gpudata->shapes || m_gpudata->shapes->GetSize() < shapedatasize)
+        {
+            ReleaseBuffer(m_gpudata->shapes);
+            m_gpudata->shapes = AcquireBuffer(shapedatasize, Calc::kRead, shapedataptr);
+        }
+        else
+        {
+            Calc::Event* e = nullptr;
+            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, shapedatasize, (char*)shapedataptr, &e);
 
             e->Wait();
             m_device->DeleteEvent(e);
+        }
 
-            m_device->Finish(0);
+        m_device->Finish(0);
+
+        m_stats.upload_time += GetElapsedTime(start);
+
+        // Pick kernel variant with the checks this scene doesn't need compiled out,
+        // build options are only applied by OpenCL
+        std::string defines;
+        auto specialize = world.options_.GetOption(Options::kBvhSpecializeKernels);
+
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL && (!specialize || specialize->AsFloat() > 0.f))
+        {
+            float3 const identity[3] = { float3(1.f, 0.f, 0.f, 0.f), float3(0.f, 1.f, 0.f, 0.f), float3(0.f, 0.f, 1.f, 0.f) };
+            bool full_masks = true;
+            bool identity_transforms = true;
+
+            for (auto const& shapedata : m_cpudata->shapedata)
+            {
+                full_masks = full_masks && shapedata.mask == -1;
+                identity_transforms = identity_transforms && std::equal(&shapedata.minv[0].x, &shapedata.minv[0].x + 12, &identity[0].x);
+            }
+
+            // Moving shapes are transformed even with identity matrices
+            identity_transforms = identity_transforms && !has_motion;
+
+            if (full_masks)
+            {
+                defines.append("-D RR_FULL_SHAPE_MASKS ");
+            }
+
+            if (identity_transforms)
+            {
+                defines.append("-D RR_IDENTITY_TRANSFORMS ");
+            }
+        }
+
+        // Motion and groups are not specializations, other scenes just skip them
+        if (has_motion)
+        {
+            defines.append("-D RR_MOTION_BLUR ");
         }
+
+        if (use_compact)
+        {
+            defines.append("-D RR_COMPACT_TRANSFORMS ");
+        }
+
+        if (numgroups > 0)
+        {
+            defines.append("-D RR_GROUPS ");
+        }
+
+        if (m_cpudata->lods.size() > 1)
+        {
+            defines.append("-D RR_LOD ");
+        }
+
+        // Traversal of subtrees has to stop where their roots skip to
+        if (std::any_of(subtrees.cbegin(), subtrees.cend(), [](PlainBvhTranslator::Subtree const& subtree) { return subtree.offset > 0; }))
+        {
+            defines.append("-D RR_REBRAID ");
+        }
+
+        if (has_curves)
+        {
+            defines.append("-D RR_CURVES ");
+        }
+
+        if (has_procedurals)
+        {
+            defines.append("-D RR_PROCEDURALS ");
+        }
+
+        if (has_quads)
+        {
+            defines.append("-D RR_QUADS ");
+        }
+
+        // Custom primitives can't be intersected without the function, other scenes don't compile it
+        bool const has_custom = std::any_of(shapes.begin(), shapes.begin() + nummeshes, [](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            return shapeimpl->is_procedural() && static_cast<Procedurals const*>(shape)->GetKind() == Procedurals::kCustom;
+        });
+
+        auto customintersector = world.options_.GetOption(Options::kAccCustomIntersector);
+        std::string const custom_intersector = has_custom && customintersector ? customintersector->AsString() : "";
+
+        ThrowIf(has_custom && custom_intersector.empty(), "Custom primitives need \"acc.custom_intersector\" function");
+
+        SelectProgram(defines, use_fatnodes, custom_intersector);
+    }
+
+    bool IntersectorTwoLevel::IsBottomLevelValid(Shape const* shape, int idx) const
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        // Id is checked too since a new mesh might reuse memory of a deleted one
+        return m_cpudata->meshes[idx] == shape &&
+            m_cpudata->mesh_ids[idx] == shape->GetId() &&
+            m_cpudata->mesh_hints[idx] == shapeimpl->GetBuildHint() &&
+            !(shapeimpl->GetStateChange() & ShapeImpl::kStateChangeVertices);
+    }
+
+    bool IntersectorTwoLevel::IsBottomLevelRefittable(Shape const* shape, int idx) const
+    {
+        // Topology of deforming meshes is kept, only their vertices move
+        return m_cpudata->meshes[idx] == shape &&
+            m_cpudata->mesh_ids[idx] == shape->GetId() &&
+            m_cpudata->mesh_hints[idx] == kBuildHintDeforming &&
+            shape->GetBuildHint() == kBuildHintDeforming;
     }
 
     void IntersectorTwoLevel::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->isect_func;
+        auto& func = m_gpudata->program->isect_func;
 
         // Set args
         int arg = 0;
@@ -674,17 +2141,36 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        if (m_gpudata->program->short_stack)
+        {
+            // Short stack kernels take global stack memory instead of motion, mask and LOD data
+            func->SetArg(arg++, GetStackBuffer(globalsize * kGlobalStackSize * sizeof(int), queueidx));
+            func->SetArg(arg++, hits);
+        }
+        else
+        {
+            func->SetArg(arg++, hits);
+
+            // Vulkan kernels don't apply motion
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                func->SetArg(arg++, m_gpudata->motion);
+                func->SetArg(arg++, m_gpudata->shape_motion);
+                func->SetArg(arg++, m_gpudata->node_masks);
+                func->SetArg(arg++, m_gpudata->lods);
+            }
+        }
+
+        ExecuteQuery("intersect", func, queueidx, numrays, globalsize, localsize, event);
     }
 
     void IntersectorTwoLevel::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        auto& func = m_gpudata->program->occlude_func;
 
         // Set args
         int arg = 0;
@@ -696,11 +2182,57 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(int), &m_gpudata->bvhrootidx);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        if (m_gpudata->program->short_stack)
+        {
+            // Short stack kernels take global stack memory instead of motion, mask and LOD data
+            func->SetArg(arg++, GetStackBuffer(globalsize * kGlobalStackSize * sizeof(int), queueidx));
+            func->SetArg(arg++, hits);
+        }
+        else
+        {
+            func->SetArg(arg++, hits);
+
+            // Vulkan kernels don't apply motion
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                func->SetArg(arg++, m_gpudata->motion);
+                func->SetArg(arg++, m_gpudata->shape_motion);
+                func->SetArg(arg++, m_gpudata->node_masks);
+                func->SetArg(arg++, m_gpudata->lods);
+            }
+        }
+
+        ExecuteQuery("occlude", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    void IntersectorTwoLevel::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->bvh);
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->faces);
+        AddBufferBytes(usage.instances_bytes, m_gpudata->shapes);
+        AddBufferBytes(usage.instances_bytes, m_gpudata->motion);
+        AddBufferBytes(usage.instances_bytes, m_gpudata->shape_motion);
+        AddBufferBytes(usage.instances_bytes, m_gpudata->node_masks);
+        AddBufferBytes(usage.instances_bytes, m_gpudata->lods);
+
+        for (auto const& program : m_gpudata->programs)
+        {
+            AddExecutableBytes(usage, m_device, program.second.executable);
+        }
+
+        if (m_hlbvh)
+        {
+            m_hlbvh->GetMemoryUsage(usage);
+        }
+
+        if (m_sah_bvh)
+        {
+            m_sah_bvh->GetMemoryUsage(usage);
+        }
     }
 }
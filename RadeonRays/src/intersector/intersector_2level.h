@@ -40,7 +40,7 @@ THE SOFTWARE.
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
         -Supports motion blur.
-        -Supports instancing.
+        -Supports instancing and nested groups.
         -Fast to refit.
     Cons:
         -Travesal order is fixed, so poor algorithmic characteristics.
@@ -53,12 +53,15 @@ THE SOFTWARE.
 #include "device.h"
 #include "intersector.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 
 namespace RadeonRays
 {
     class Bvh;
+    class Hlbvh;
+    class BinnedSahBvh;
 
     /** 
     \brief Intersector implementation using 2-level skip links BVH
@@ -72,6 +75,8 @@ namespace RadeonRays
     private:
         // World processing implementation
         void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
         // Intersection implementation
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
@@ -82,15 +87,33 @@ namespace RadeonRays
             Calc::Event const *wait_event, Calc::Event **event) const override;
 
     private:
+        // Check if cached bottom level data at idx has been built for this mesh and is up to date
+        bool IsBottomLevelValid(Shape const* shape, int idx) const;
+        // Check if bottom level BVH of a deforming mesh at idx can be refitted to its vertices
+        bool IsBottomLevelRefittable(Shape const* shape, int idx) const;
+
+        // Use kernel variant compiled with specialization defines, compiling it on first use.
+        // Short stack variants traverse fat nodes ("fatbvh" acc.type), custom primitive
+        // intersection functions ("acc.custom_intersector") are appended to the source.
+        void SelectProgram(std::string const& defines, bool short_stack = false, std::string const& custom_intersector = "");
+
         // Gpu data
         struct GpuData;
         struct CpuData;
         struct ShapeData;
+        struct CompactShapeData;
+        struct ShapeMotion;
         struct Face;
 
         std::unique_ptr<GpuData> m_gpudata;
         std::unique_ptr<CpuData> m_cpudata;
-        std::vector<std::unique_ptr<Bvh> > m_bvhs;
+        std::vector<std::shared_ptr<Bvh> > m_bvhs;
+        // Group BVHs, their leaves reference group members
+        std::vector<std::unique_ptr<Bvh> > m_group_bvhs;
+        // Device built top level BVH ("bvh.toplevel.builder" is "hlbvh")
+        std::unique_ptr<Hlbvh> m_hlbvh;
+        // Device built binned SAH top level, used instead with "bvh.hlbvh.builder" "sah"
+        std::unique_ptr<BinnedSahBvh> m_sah_bvh;
     };
 }
 
@@ -20,22 +20,29 @@
  THE SOFTWARE.
  ********************************************************************/
 #include "intersector_bittrail.h"
+#include "memory_usage.h"
 
 #include "calc.h"
 #include "executable.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/fatnode_bvh_translator.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
 
  // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
+// Levels below the root node indices can address
+static int const kMaxLevels = 30;
+// Nodes per treelet of "treelet" layout
+static int const kTreeletSize = 8;
 
 namespace RadeonRays
 {
@@ -47,27 +54,21 @@ namespace RadeonRays
         Calc::Buffer* bvh;
         // Vertex positions
         Calc::Buffer* vertices;
-        // Displacement table
-        Calc::Buffer* displacement;
-        // Hash table
+        // Packed perfect hash map of node indices to addresses
         Calc::Buffer* hashmap;
-        // Displacement table size
-        int displacement_size;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
 
         GpuData(Calc::Device* d)
-        : device(d)
-                          , bvh(nullptr)
-                          , vertices(nullptr)
-                          , executable(nullptr)
-                          , isect_func(nullptr)
-                          , occlude_func(nullptr)
-                          , displacement_size(0)
-                          , displacement(nullptr)
-                          , hashmap(nullptr)
+            : device(d)
+            , bvh(nullptr)
+            , vertices(nullptr)
+            , hashmap(nullptr)
+            , executable(nullptr)
+            , isect_func(nullptr)
+            , occlude_func(nullptr)
         {
         }
 
@@ -75,7 +76,6 @@ namespace RadeonRays
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
-            device->DeleteBuffer(displacement);
             device->DeleteBuffer(hashmap);
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
@@ -88,6 +88,9 @@ namespace RadeonRays
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
     {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL,
+            "hashbvh accelerator is only supported by OpenCL devices");
+
         std::string buildopts =
 #ifdef RR_RAY_MASK
             "-D RR_RAY_MASK ";
@@ -99,34 +102,19 @@ namespace RadeonRays
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
 #ifndef RR_EMBED_KERNELS
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
-        {
-            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
 
-            int numheaders = sizeof(headers) / sizeof(char const*);
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_bittrail.cl", headers, numheaders, buildopts.c_str());
-        }
-        else
-        {
-            assert(device->GetPlatform() == Calc::Platform::kVulkan);
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/hash_bvh.comp", nullptr, 0, buildopts.c_str());
-        }
+        int numheaders = sizeof(headers) / sizeof(char const*);
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_bittrail.cl", headers, numheaders, buildopts.c_str());
 #else
 #if USE_OPENCL
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
-        {
-            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_bittrail_opencl, std::strlen(g_intersect_bvh2_bittrail_opencl), buildopts.c_str());
-        }
+        m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_bittrail_opencl, std::strlen(g_intersect_bvh2_bittrail_opencl), buildopts.c_str());
 #endif
-
-#if USE_VULKAN
-        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
-        {
-            m_gpudata->executable = m_device->CompileExecutable(g_hash_bvh_vulkan, std::strlen(g_hash_bvh_vulkan), buildopts.c_str());
-        }
-#endif
-
 #endif
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
@@ -135,14 +123,14 @@ namespace RadeonRays
 
     void IntersectorBitTrail::Process(World const& world)
     {
-
         // If something has been changed we need to rebuild BVH
         if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
             if (m_bvh)
             {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->bvh);
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->hashmap);
             }
 
             int numshapes = (int)world.shapes_.size();
@@ -153,38 +141,53 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
-
+            auto builder = world.options_.GetOption(Options::kBvhBuilder);
+            auto splits = world.options_.GetOption(Options::kBvhSahUseSplits);
+            auto maxdepth = world.options_.GetOption(Options::kBvhSahMaxSplitDepth);
+            auto overlap = world.options_.GetOption(Options::kBvhSahMinOverlap);
+            auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+            auto node_budget = world.options_.GetOption(Options::kBvhSahExtraNodeBudget);
+            auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+            auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+            auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+            auto layout = world.options_.GetOption(Options::kBvhLayout);
 
             bool use_sah = false;
             bool use_splits = false;
+            bool use_lbvh = false;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             int num_bins = nbins ? (int)nbins->AsFloat() : 64;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
             float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+            int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
+            bool use_treelets = layout && layout->AsString() == "treelet";
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
                 use_splits = true;
             }
 
-            m_bvh.reset(use_splits ?
+            m_bvh.reset(use_lbvh ?
+                new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                use_splits ?
                 new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
                 new Bvh(traversal_cost, num_bins, use_sah)
             );
 
+            m_bvh->SetNumThreads(num_threads);
+            ApplyRaySamples(*m_bvh, world);
+
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
 
@@ -196,12 +199,12 @@ namespace RadeonRays
 
             // Count the number of meshes
             int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
 
-            for (int i = 0; i < nummeshes; ++i)
+            for (int i = 0; i < numshapes; ++i)
             {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                Mesh const* mesh = i < nummeshes ?
+                    static_cast<Mesh const*>(shapes[i]) :
+                    static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
 
                 mesh_faces_start_idx[i] = numfaces;
                 mesh_vertices_start_idx[i] = numvertices;
@@ -210,65 +213,81 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            auto start = Clock::now();
+
+            // We can't avoild allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+
+            // We handle meshes first collecting their world space bounds
+            // Faces of large meshes are gathered in parallel
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                // Here we directly get world space bounds
+                mesh->GetAllFaceBounds(false, bounds.data() + mesh_faces_start_idx[i]);
+            }
+
+            // Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+            for (int i = nummeshes; i < numshapes; ++i)
             {
                 Instance const* instance = static_cast<Instance const*>(shapes[i]);
                 Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
 
-                mesh_faces_start_idx[i] = numfaces;
-                mesh_vertices_start_idx[i] = numvertices;
+                // Instance is using its own transform for base shape geometry
+                // so we need to get object space bounds and transform them manually
+                matrix m, minv;
+                instance->GetTransform(m, minv);
 
-                numfaces += mesh->num_faces();
-                numvertices += mesh->num_vertices();
+                bbox* meshbounds = bounds.data() + mesh_faces_start_idx[i];
+                mesh->GetAllFaceBounds(true, meshbounds);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    meshbounds[j] = transform_bbox(meshbounds[j], m);
+                }
             }
 
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
+            m_bvh->Build(&bounds[0], numfaces);
 
-            // We handle meshes first collecting their world space bounds 
-#pragma omp parallel for 
-            for (int i = 0; i < nummeshes; ++i) 
-            { 
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]); 
- 
-                for (int j = 0; j < mesh->num_faces(); ++j) 
-                { 
-                    // Here we directly get world space bounds 
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]); 
-                } 
-            } 
- 
-            // Then we handle instances. Need to flatten them into actual geometry. 
-#pragma omp parallel for 
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i) 
-            { 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]); 
-                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape()); 
- 
-                // Instance is using its own transform for base shape geometry 
-                // so we need to get object space bounds and transform them manually 
-                matrix m, minv; 
-                instance->GetTransform(m, minv); 
- 
-                for (int j = 0; j < mesh->num_faces(); ++j) 
-                { 
-                    bbox tmp; 
-                    mesh->GetFaceBounds(j, true, tmp); 
-                    
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m); 
-                } 
-            } 
+            m_stats.build_time = GetElapsedTime(start);
+            SetBvhStatistics(*m_bvh);
 
-            m_bvh->Build(&bounds[0], numfaces);
+#ifdef RR_PROFILE
+            m_bvh->PrintStatistics(std::cout);
+#endif
 
+            start = Clock::now();
+
+            // Node indices are tracked in 31 bits by the kernels, so subtrees
+            // reaching deeper are rebuilt as balanced ones
             FatNodeBvhTranslator translator;
-            translator.Process(*m_bvh);
+            translator.Process(*m_bvh, kMaxLevels);
+
+            if (use_treelets)
+            {
+                translator.ClusterTreelets(kTreeletSize);
+            }
+
+            {
+                task_scheduler scheduler(num_threads);
+                translator.BuildHashMap(&scheduler);
+            }
+
+            m_stats.translate_time = GetElapsedTime(start);
+            m_stats.height = translator.height_;
+
+            start = Clock::now();
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_stats.vertices_bytes = numvertices * sizeof(float3);
+                m_gpudata->vertices = AcquireBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 float3* vertexdata = nullptr;
@@ -280,44 +299,10 @@ namespace RadeonRays
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
 #pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                for (int i = 0; i < numshapes; ++i)
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
-                }
-
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    instance->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    GetWorldSpaceVertices(shapes[i], vertexdata + mesh_vertices_start_idx[i]);
                 }
 
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
@@ -327,7 +312,6 @@ namespace RadeonRays
 
             // Create face buffer
             {
-
                 // This number is different from the number of faces for some BVHs
                 auto numindices = m_bvh->GetNumIndices();
                 // Create face buffer
@@ -359,17 +343,16 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].shape_mask = shapes[shapeidx]->GetMask();
@@ -380,23 +363,19 @@ namespace RadeonRays
             }
 
             // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
-
-            // Create displacement buffer
-            auto displacement_size = translator.m_hash_map->displacement_table_size();
-
-            m_gpudata->displacement_size = displacement_size;
-
-            m_gpudata->displacement = m_device->CreateBuffer(displacement_size * sizeof(int),
-                Calc::BufferType::kRead,
-                (void*)translator.m_hash_map->displacement_table_ptr());
+            m_stats.num_nodes = (int)translator.nodes_.size();
+            m_stats.nodes_bytes = translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node);
+            m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead, &translator.nodes_[0]);
 
-            m_gpudata->hashmap = m_device->CreateBuffer(translator.m_hash_map->hash_table_size() * sizeof(int),
-                Calc::BufferType::kRead,
-                (void*)translator.m_hash_map->hash_table_ptr());
+            // Hash map goes into a single buffer with 16-bit displacements
+            std::vector<std::uint32_t> hashmap;
+            translator.m_hash_map->Pack(hashmap);
+            m_gpudata->hashmap = AcquireBuffer(hashmap.size() * sizeof(std::uint32_t), Calc::BufferType::kRead, &hashmap[0]);
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            m_stats.upload_time = GetElapsedTime(start);
         }
     }
 
@@ -411,15 +390,13 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->displacement);
         func->SetArg(arg++, m_gpudata->hashmap);
-        func->SetArg(arg++, sizeof(m_gpudata->displacement_size), &m_gpudata->displacement_size);
         func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        ExecuteQuery("intersect", func, queueidx, numrays, globalsize, localsize, event);
     }
 
     void IntersectorBitTrail::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -433,14 +410,21 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->displacement);
         func->SetArg(arg++, m_gpudata->hashmap);
-        func->SetArg(arg++, sizeof(m_gpudata->displacement_size), &m_gpudata->displacement_size);
         func->SetArg(arg++, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        ExecuteQuery("occlude", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    void IntersectorBitTrail::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->bvh);
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        // Node addresses are part of the tree
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->hashmap);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
     }
 }
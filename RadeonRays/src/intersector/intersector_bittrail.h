@@ -88,8 +88,10 @@ THE SOFTWARE.
         -Benefits from BVH quality optimization.
         -Low VGPR pressure
     Cons:
-        -Depth is limited.
+        -Depth is limited: node indices have to fit into 31 bits, so subtrees reaching
+         deeper than 30 levels are rebuilt as balanced ones over their leaves.
         -Generates global memory traffic.
+        -OpenCL only.
  */
 
 namespace RadeonRays
@@ -103,6 +105,8 @@ namespace RadeonRays
 
     private:
         void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
 
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
@@ -0,0 +1,342 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "intersector_grid.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
+
+#include "../accelerator/uniform_grid.h"
+#include "../primitive/mesh.h"
+#include "../world/world.h"
+
+#include "device.h"
+#include "executable.h"
+#include "../except/except.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+
+#if USE_VULKAN
+#    include "RadeonRays/src/kernelcache/kernels_vk.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+
+namespace RadeonRays
+{
+    struct IntersectorGrid::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Vertex positions
+        Calc::Buffer* vertices;
+        // Indices
+        Calc::Buffer* faces;
+        // Face bounds the grid is built from
+        Calc::Buffer* bounds;
+        // Number of faces bounds buffer can hold
+        int bounds_capacity;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+        Calc::Function* bounds_func;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , vertices(nullptr)
+            , faces(nullptr)
+            , bounds(nullptr)
+            , bounds_capacity(0)
+            , executable(nullptr)
+            , isect_func(nullptr)
+            , occlude_func(nullptr)
+            , bounds_func(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(isect_func);
+                executable->DeleteFunction(occlude_func);
+                executable->DeleteFunction(bounds_func);
+                device->DeleteExecutable(executable);
+            }
+        }
+    };
+
+    // Device face layout, matches Face of the kernels
+    struct GridFace
+    {
+        // Vertex indices
+        int idx[3];
+        // Shape mask
+        int shape_mask;
+        // Shape ID
+        int shape_id;
+        // Primitive ID
+        int prim_id;
+    };
+
+    IntersectorGrid::IntersectorGrid(Calc::Device* device)
+        : Intersector(device)
+        , m_gpudata(new GpuData(device))
+        , m_grid(new UniformGrid(device))
+    {
+        std::string buildopts =
+#ifdef USE_SAFE_MATH
+            "-D USE_SAFE_MATH ";
+#else
+            "";
+#endif
+
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_grid.cl", headers, numheaders, buildopts.c_str());
+        }
+        else
+        {
+            assert(device->GetPlatform() == Calc::Platform::kVulkan);
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/grid.comp", nullptr, 0, buildopts.c_str());
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_intersect_grid_opencl, std::strlen(g_intersect_grid_opencl), buildopts.c_str());
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_grid_vulkan, std::strlen(g_grid_vulkan), buildopts.c_str());
+        }
+#endif
+
+#endif
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+        m_gpudata->bounds_func = m_gpudata->executable->CreateFunction("face_bounds_main");
+
+        m_grid->SetTimer(m_timer.get());
+    }
+
+    void IntersectorGrid::Process(World const& world)
+    {
+        auto density = world.options_.GetOption(Options::kGridDensity);
+        auto top_density = world.options_.GetOption(Options::kGridTopDensity);
+        m_grid->SetDensity(top_density ? top_density->AsFloat() : 0.0625f, density ? density->AsFloat() : 2.f);
+
+        if (m_vertex_start.empty() || world.has_changed())
+        {
+            // Here we know that only Meshes are present, otherwise 2level strategy would have been used
+            m_shapes = world.shapes_;
+
+            int numshapes = (int)m_shapes.size();
+            m_vertex_start.assign(numshapes + 1, 0);
+            m_face_start.assign(numshapes + 1, 0);
+
+            for (int i = 0; i < numshapes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(m_shapes[i]);
+                m_vertex_start[i + 1] = m_vertex_start[i] + mesh->num_vertices();
+                m_face_start[i + 1] = m_face_start[i] + mesh->num_faces();
+            }
+
+            int numvertices = m_vertex_start[numshapes];
+            int numfaces = m_face_start[numshapes];
+
+            auto start = Clock::now();
+
+            ReleaseBuffer(m_gpudata->vertices);
+            ReleaseBuffer(m_gpudata->faces);
+            m_gpudata->vertices = AcquireBuffer(std::max(numvertices, 1) * sizeof(float3), Calc::BufferType::kRead);
+            m_gpudata->faces = AcquireBuffer(std::max(numfaces, 1) * sizeof(GridFace), Calc::BufferType::kRead);
+
+            m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start, 0, numshapes - 1, false, false);
+            UploadFaces(numfaces);
+
+            m_stats.upload_time = GetElapsedTime(start);
+
+            BuildGrid(world, numfaces);
+        }
+        else if (world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            auto start = Clock::now();
+
+            // Faces are the same, only vertices of moved or deformed shapes are uploaded
+            int numshapes = (int)m_shapes.size();
+            m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start, 0, numshapes - 1, false, true);
+
+            m_stats.upload_time = GetElapsedTime(start);
+
+            // Cells depend on the positions of all the faces, so the grid is rebuilt
+            BuildGrid(world, m_face_start[numshapes]);
+        }
+    }
+
+    void IntersectorGrid::UploadFaces(int numfaces)
+    {
+        m_stats.faces_bytes = numfaces * sizeof(GridFace);
+
+        if (numfaces == 0)
+        {
+            return;
+        }
+
+        GridFace* facedata = nullptr;
+        Calc::Event* e = nullptr;
+
+        m_device->MapBuffer(m_gpudata->faces, 0, 0, numfaces * sizeof(GridFace), Calc::MapType::kMapWrite, (void**)&facedata, &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+#pragma omp parallel for
+        for (int i = 0; i < (int)m_shapes.size(); ++i)
+        {
+            Mesh const* mesh = static_cast<Mesh const*>(m_shapes[i]);
+
+            // Face indices are relative to the mesh, make them absolute
+            int const startvertex = m_vertex_start[i];
+
+            for (int j = 0; j < mesh->num_faces(); ++j)
+            {
+                Mesh::Face const face = mesh->GetFace(j);
+                GridFace& gridface = facedata[m_face_start[i] + j];
+                gridface.idx[0] = face.idx[0] + startvertex;
+                gridface.idx[1] = face.idx[1] + startvertex;
+                gridface.idx[2] = face.idx[2] + startvertex;
+                gridface.shape_mask = mesh->GetMask();
+                gridface.shape_id = mesh->GetId();
+                gridface.prim_id = j;
+            }
+        }
+
+        m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+
+        e->Wait();
+        m_device->DeleteEvent(e);
+    }
+
+    void IntersectorGrid::BuildGrid(World const& world, int numfaces)
+    {
+        auto start = Clock::now();
+
+        if (numfaces > m_gpudata->bounds_capacity)
+        {
+            ReleaseBuffer(m_gpudata->bounds);
+            m_gpudata->bounds = AcquireBuffer(numfaces * sizeof(bbox), Calc::BufferType::kWrite);
+            m_gpudata->bounds_capacity = numfaces;
+        }
+
+        if (numfaces > 0)
+        {
+            int arg = 0;
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->vertices);
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->faces);
+            m_gpudata->bounds_func->SetArg(arg++, sizeof(numfaces), &numfaces);
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->bounds);
+
+            int globalsize = ((numfaces + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            m_timer->Execute("bounds", m_gpudata->bounds_func, 0, globalsize, kWorkGroupSize, nullptr);
+        }
+
+        m_stats.bounds_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        m_grid->Build(m_gpudata->bounds, numfaces);
+
+        m_stats.build_time = GetElapsedTime(start);
+        m_stats.num_nodes = m_grid->GetNumTopCells() + m_grid->GetNumLeafCells();
+        m_stats.num_leaves = m_grid->GetNumLeafCells();
+    }
+
+    void IntersectorGrid::SetArgs(Calc::Function* func, Calc::Buffer const* rays, Calc::Buffer const* num_rays, Calc::Buffer* hits) const
+    {
+        auto const& grid = m_grid->GetGpuData();
+
+        int arg = 0;
+
+        func->SetArg(arg++, grid.desc);
+        func->SetArg(arg++, grid.top_res);
+        func->SetArg(arg++, grid.top_leaf_starts);
+        func->SetArg(arg++, grid.leaf_starts);
+        func->SetArg(arg++, grid.leaf_ends);
+        func->SetArg(arg++, grid.refs);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, num_rays);
+        func->SetArg(arg++, hits);
+    }
+
+    void IntersectorGrid::Intersect(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // DDA keeps its state in registers, there is no stack
+        auto& func = m_gpudata->isect_func;
+        SetArgs(func, rays, num_rays, hits);
+
+        ExecuteQuery("intersect", func, queue_idx, num_rays, globalsize, localsize, event);
+    }
+
+    void IntersectorGrid::Occluded(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
+    {
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        auto& func = m_gpudata->occlude_func;
+        SetArgs(func, rays, num_rays, hits);
+
+        ExecuteQuery("occlude", func, queue_idx, num_rays, globalsize, localsize, event);
+    }
+
+    void IntersectorGrid::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->faces);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+        m_grid->GetMemoryUsage(usage);
+    }
+}
@@ -0,0 +1,97 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "intersector.h"
+#include <memory>
+#include <vector>
+/**
+    \file intersector_grid.h
+    \brief Intersector implementation based on two-level uniform grid
+
+    IntersectorGrid implementation is based on the following paper:
+    "Two-Level Grids for Ray Tracing on GPUs"
+    Javor Kalojanov, Markus Billeter, Philipp Slusallek, in Eurographics 2011
+
+    Grid is built on GPU by counting sort of primitive references into cells of
+    both levels and traversed with 3D-DDA, no stack is needed. Grid is rebuilt
+    on every change, there is no refit.
+
+    Pros:
+        -Fastest to build, suits geometry changing every frame.
+    Cons:
+        -Slow traversal of scenes with uneven primitive density.
+        -Large primitives are referenced by many cells.
+ */
+
+namespace RadeonRays
+{
+    class UniformGrid;
+
+    /**
+    \brief Intersector implementation using two-level uniform grid.
+    */
+    class IntersectorGrid : public Intersector
+    {
+    public:
+        // Constructor
+        IntersectorGrid(Calc::Device* device);
+
+    private:
+        // World processing implementation
+        void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
+
+        // Intersection implemenation
+        void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+
+        // Occlusion implemenation
+        void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+
+    private:
+        struct GpuData;
+
+        // Upload faces of the world shapes
+        void UploadFaces(int numfaces);
+        // Compute face bounds on the device and build the grid over them
+        void BuildGrid(World const& world, int numfaces);
+        // Set traversal arguments shared by both queries
+        void SetArgs(Calc::Function* func, Calc::Buffer const* rays, Calc::Buffer const* num_rays, Calc::Buffer* hits) const;
+
+        // Implementation data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Grid data structure
+        std::unique_ptr<UniformGrid> m_grid;
+        // Shapes of the last commit
+        std::vector<Shape const*> m_shapes;
+        // Start vertex and start face of each shape plus the totals
+        std::vector<int> m_vertex_start;
+        std::vector<int> m_face_start;
+    };
+}
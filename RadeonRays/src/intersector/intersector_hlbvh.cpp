@@ -20,8 +20,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "intersector_hlbvh.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
 
 #include "../accelerator/hlbvh.h"
+#include "../accelerator/binned_sah_bvh.h"
 #include "../primitive/mesh.h"
 #include "../world/world.h"
 #include "../translator/plain_bvh_translator.h"
@@ -47,17 +50,45 @@ namespace RadeonRays
         Calc::Buffer* vertices;
         // Indices
         Calc::Buffer* faces;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Face bounds for device side builds
+        Calc::Buffer* bounds;
+        // Number of faces bounds buffer can hold
+        int bounds_capacity;
+        // Face bounds the background rebuild is built from
+        Calc::Buffer* pending_bounds;
+
+        // Fat nodes for short stack traversal
+        Calc::Buffer* fat_nodes;
+        // Number of nodes fat nodes buffer can hold
+        int fat_capacity;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        // Face bounds, OpenCL only
+        Calc::Function* bounds_func;
+        // Fat node translation, OpenCL only
+        Calc::Function* translate_func;
+
+        // Short stack traversal program
+        Calc::Executable* fat_executable;
+        Calc::Function* fat_isect_func;
+        Calc::Function* fat_occlude_func;
 
         GpuData(Calc::Device* d)
             : device(d)
             , vertices(nullptr)
             , faces(nullptr)
+            , bounds(nullptr)
+            , bounds_capacity(0)
+            , pending_bounds(nullptr)
+            , fat_nodes(nullptr)
+            , fat_capacity(0)
+            , bounds_func(nullptr)
+            , translate_func(nullptr)
+            , fat_executable(nullptr)
+            , fat_isect_func(nullptr)
+            , fat_occlude_func(nullptr)
         {
         }
 
@@ -65,17 +96,26 @@ namespace RadeonRays
         {
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
-            device->DeleteBuffer(stack);
+            device->DeleteBuffer(bounds);
+            device->DeleteBuffer(pending_bounds);
+            device->DeleteBuffer(fat_nodes);
             executable->DeleteFunction(isect_func);
             executable->DeleteFunction(occlude_func);
+            executable->DeleteFunction(bounds_func);
+            executable->DeleteFunction(translate_func);
             device->DeleteExecutable(executable);
+
+            if (fat_executable)
+            {
+                fat_executable->DeleteFunction(fat_isect_func);
+                fat_executable->DeleteFunction(fat_occlude_func);
+                device->DeleteExecutable(fat_executable);
+            }
         }
     };
 
-    IntersectorHlbvh::IntersectorHlbvh(Calc::Device* device)
-        : Intersector(device)
-        , m_gpudata(new GpuData(device))
-        , m_bvh(nullptr)
+    // Kernel build options shared by the stack and short stack traversal programs
+    static std::string GetBuildOptions()
     {
         std::string buildopts =
 #ifdef RR_RAY_MASK
@@ -83,11 +123,28 @@ namespace RadeonRays
 #else
             "";
 #endif
-        
+
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
+        return buildopts;
+    }
+
+    IntersectorHlbvh::IntersectorHlbvh(Calc::Device* device)
+        : Intersector(device)
+        , m_gpudata(new GpuData(device))
+        , m_bvh(nullptr)
+        , m_short_stack(false)
+        , m_build_cost(-1.f)
+        , m_rebuild_pending(false)
+    {
+        std::string buildopts = GetBuildOptions();
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -121,18 +178,89 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->bounds_func = m_gpudata->executable->CreateFunction("face_bounds_main");
+            m_gpudata->translate_func = m_gpudata->executable->CreateFunction("translate_fatnode_main");
+        }
+    }
+
+    void IntersectorHlbvh::InitShortStack()
+    {
+        if (m_gpudata->fat_executable)
+        {
+            return;
+        }
+
+        // Kernel defaults: RR_GROUP_SIZE matches kWorkGroupSize and kMaxStackSize entries cover GLOBAL_STACK_SIZE
+        std::string buildopts = GetBuildOptions();
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->fat_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl", headers, numheaders, buildopts.c_str());
+#else
+#if USE_OPENCL
+        m_gpudata->fat_executable = m_device->CompileExecutable(g_intersect_bvh2_short_stack_opencl, std::strlen(g_intersect_bvh2_short_stack_opencl), buildopts.c_str());
+#endif
+#endif
+
+        m_gpudata->fat_isect_func = m_gpudata->fat_executable->CreateFunction("intersect_main");
+        m_gpudata->fat_occlude_func = m_gpudata->fat_executable->CreateFunction("occluded_main");
+    }
+
+    void IntersectorHlbvh::TranslateFatNodes()
+    {
+        int numfaces = m_sah_bvh ? m_sah_bvh->GetNumPrims() : m_bvh->GetNumPrims();
+        int numnodes = 2 * numfaces - 1;
+
+        if (numnodes > m_gpudata->fat_capacity)
+        {
+            ReleaseBuffer(m_gpudata->fat_nodes);
+            // Fat node holds two boxes
+            m_gpudata->fat_nodes = AcquireBuffer(numnodes * 2 * sizeof(bbox), Calc::BufferType::kWrite);
+            m_gpudata->fat_capacity = numnodes;
+        }
+
+        auto start = Clock::now();
+
+        auto& func = m_gpudata->translate_func;
+
+        int arg = 0;
+        func->SetArg(arg++, GetNodes());
+        func->SetArg(arg++, GetNodeBounds());
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, sizeof(numfaces), &numfaces);
+        func->SetArg(arg++, m_gpudata->fat_nodes);
+
+        int globalsize = ((numnodes + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_timer->Execute("translate_fatnode", func, 0, globalsize, kWorkGroupSize, nullptr);
+
+        m_stats.translate_time = GetElapsedTime(start);
     }
 
     void IntersectorHlbvh::Process(World const& world)
     {
+        // Short stack traversal needs device translation of the nodes
+        auto traversal = world.options_.GetOption(Options::kBvhHlbvhTraversal);
+        bool const was_short_stack = m_short_stack;
+        m_short_stack = traversal && traversal->AsString() == "short_stack" && m_gpudata->translate_func;
+
+        if (m_short_stack)
+        {
+            InitShortStack();
+        }
+
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed())
+        if ((!m_bvh && !m_sah_bvh) || world.has_changed())
         {
-            if (m_bvh)
+            if (m_bvh || m_sah_bvh)
             {
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
-                m_device->DeleteBuffer(m_gpudata->stack);
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->faces);
             }
             
             int numshapes = (int)world.shapes_.size();
@@ -143,8 +271,35 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            //
-            m_bvh.reset(new Hlbvh(m_device));
+            // Binned SAH trees use the same node layout, so traversal doesn't depend on the builder
+            auto builder = world.options_.GetOption(Options::kBvhHlbvhBuilder);
+
+            if (builder && builder->AsString() == "sah")
+            {
+                if (!m_sah_bvh)
+                {
+                    m_sah_bvh.reset(new BinnedSahBvh(m_device));
+                    m_sah_bvh->SetTimer(m_timer.get());
+                }
+
+                m_bvh.reset();
+            }
+            else
+            {
+                auto morton64 = world.options_.GetOption(Options::kBvhHlbvhMorton64);
+                bool const use_morton64 = morton64 && morton64->AsFloat() > 0.f;
+
+                // Keep the builder, its program and its buffers across rebuilds
+                if (!m_bvh || m_bvh->IsMorton64() != use_morton64)
+                {
+                    m_bvh.reset(new Hlbvh(m_device, use_morton64));
+                    m_bvh->SetTimer(m_timer.get());
+                }
+
+                auto treelets = world.options_.GetOption(Options::kBvhHlbvhTreelets);
+                m_bvh->SetTreeletOptimization(treelets && treelets->AsFloat() > 0.f);
+                m_sah_bvh.reset();
+            }
 
             // Here we now that only Meshes are present, otherwise 2level strategy would have been used
             for (int i = 0; i < numshapes; ++i)
@@ -158,26 +313,13 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
-
-#pragma omp parallel for
-            for (int i = 0; i < numshapes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
-            }
-
-            m_bvh->Build(&bounds[0], numfaces);
+            auto start = Clock::now();
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_stats.vertices_bytes = numvertices * sizeof(float3);
+                m_gpudata->vertices = AcquireBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 float3* vertexdata = nullptr;
@@ -190,23 +332,20 @@ namespace RadeonRays
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
 #pragma omp parallel for
                 for (int i = 0; i < numshapes; ++i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e); 
@@ -231,7 +370,8 @@ namespace RadeonRays
                 };
 
                 // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
+                m_stats.faces_bytes = numfaces * sizeof(Face);
+                m_gpudata->faces = AcquireBuffer(numfaces * sizeof(Face), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 Face* facedata = nullptr;
@@ -259,17 +399,16 @@ namespace RadeonRays
                     // Get the mesh directly or out of instance
                     Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[shapeidx]);
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                     // Optimization: we are putting faceid here
                     facedata[i].shape_id = mesh->GetId();
@@ -282,10 +421,12 @@ namespace RadeonRays
                 m_device->DeleteEvent(e);
             }
 
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
             // Make sure everything is commited
             m_device->Finish(0);
+
+            m_stats.upload_time = GetElapsedTime(start);
+
+            BuildBvh(world, mesh_faces_start_idx, numfaces);
         }
         else if (world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
@@ -312,26 +453,14 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            // We can't avoid allocating it here, since bounds aren't stored anywhere
-            std::vector<bbox> bounds(numfaces);
-
-#pragma omp parallel for
-            for (int i = 0; i < numshapes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
-            }
-
-            m_bvh->Build(&bounds[0], numfaces);
+            auto start = Clock::now();
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_stats.vertices_bytes = numvertices * sizeof(float3);
+                ReleaseBuffer(m_gpudata->vertices);
+                m_gpudata->vertices = AcquireBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 float3* vertexdata = nullptr;
@@ -344,23 +473,20 @@ namespace RadeonRays
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
 #pragma omp parallel for
                 for (int i = 0; i < numshapes; ++i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
                 }
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
@@ -368,10 +494,234 @@ namespace RadeonRays
                 e->Wait();
                 m_device->DeleteEvent(e);
             }
+
+            m_stats.upload_time = GetElapsedTime(start);
+
+            // Faces are the same, so device built trees can keep their topology
+            if (!(m_bvh && m_gpudata->bounds_func && CanRefit(world) && RefitBvh(world, numfaces)))
+            {
+                BuildBvh(world, mesh_faces_start_idx, numfaces);
+            }
+        }
+        else if (m_short_stack && !was_short_stack)
+        {
+            // Nodes are up to date, only fat nodes are missing
+            TranslateFatNodes();
         }
     }
 
 
+    void IntersectorHlbvh::BuildBvh(World const& world, std::vector<int> const& mesh_faces_start_idx, int numfaces)
+    {
+        DiscardRebuild();
+
+        auto start = Clock::now();
+
+        if (m_gpudata->bounds_func)
+        {
+            // Geometry is on the device already, so are face bounds and
+            // the build only gets enqueued after the uploads
+            if (numfaces > m_gpudata->bounds_capacity)
+            {
+                ReleaseBuffer(m_gpudata->bounds);
+                m_gpudata->bounds = AcquireBuffer(numfaces * sizeof(bbox), Calc::BufferType::kWrite);
+                m_gpudata->bounds_capacity = numfaces;
+            }
+
+            int arg = 0;
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->vertices);
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->faces);
+            m_gpudata->bounds_func->SetArg(arg++, sizeof(numfaces), &numfaces);
+            m_gpudata->bounds_func->SetArg(arg++, m_gpudata->bounds);
+
+            int globalsize = ((numfaces + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+            m_timer->Execute("bounds", m_gpudata->bounds_func, 0, globalsize, kWorkGroupSize, nullptr);
+
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
+
+            // Nodes are built and stay on the device
+            if (m_sah_bvh)
+            {
+                m_sah_bvh->Build(m_gpudata->bounds, numfaces);
+            }
+            else
+            {
+                m_bvh->Build(m_gpudata->bounds, numfaces);
+            }
+        }
+        else
+        {
+            // We can't avoid allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+
+            // Faces of large meshes are gathered in parallel
+            for (int i = 0; i < (int)world.shapes_.size(); ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
+
+                // Here we directly get world space bounds
+                mesh->GetAllFaceBounds(false, bounds.data() + mesh_faces_start_idx[i]);
+            }
+
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
+
+            // Nodes are built and stay on the device
+            if (m_sah_bvh)
+            {
+                m_sah_bvh->Build(&bounds[0], numfaces);
+            }
+            else
+            {
+                m_bvh->Build(&bounds[0], numfaces);
+            }
+        }
+
+        m_stats.build_time = GetElapsedTime(start);
+        m_build_cost = -1.f;
+        m_stats.num_nodes = 2 * numfaces - 1;
+        m_stats.num_leaves = numfaces;
+
+        if (m_short_stack)
+        {
+            TranslateFatNodes();
+        }
+    }
+
+    bool IntersectorHlbvh::RefitBvh(World const& world, int numfaces)
+    {
+        // Swap in the background rebuild once it's done, it's refitted to current vertices below
+        if (m_rebuild_pending && m_pending_bvh->IsBuildComplete())
+        {
+            std::swap(m_bvh, m_pending_bvh);
+            m_bvh->SetQueue(0);
+            ReleaseBuffer(m_gpudata->pending_bounds);
+            m_gpudata->pending_bounds = nullptr;
+            m_rebuild_pending = false;
+            m_build_cost = -1.f;
+        }
+
+        // Cost of the tree before the first refit after a build, the tree still has old bounds
+        if (m_build_cost < 0.f)
+        {
+            m_build_cost = m_bvh->GetCost();
+        }
+
+        auto start = Clock::now();
+
+        int arg = 0;
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->vertices);
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->faces);
+        m_gpudata->bounds_func->SetArg(arg++, sizeof(numfaces), &numfaces);
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->bounds);
+
+        int globalsize = ((numfaces + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_timer->Execute("bounds", m_gpudata->bounds_func, 0, globalsize, kWorkGroupSize, nullptr);
+
+        m_stats.bounds_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        if (!m_bvh->Refit(m_gpudata->bounds, numfaces))
+        {
+            return false;
+        }
+
+        // Rebuild once refits blew the tree up too much, face bounds are already there
+        auto maxcost = world.options_.GetOption(Options::kBvhHlbvhRefitMaxCost);
+        float const max_cost = maxcost ? maxcost->AsFloat() : 1.5f;
+
+        auto background = world.options_.GetOption(Options::kBvhHlbvhBackgroundRebuild);
+
+        if (background && background->AsFloat() > 0.f)
+        {
+            // Refitted tree is used until the rebuild is swapped in at a later commit
+            if (!m_rebuild_pending && m_bvh->GetCost() > max_cost * m_build_cost)
+            {
+                ScheduleRebuild(world, numfaces);
+            }
+
+            m_stats.refitted = 1;
+        }
+        else if (m_bvh->GetCost() > max_cost * m_build_cost)
+        {
+            m_bvh->Build(m_gpudata->bounds, numfaces);
+            m_build_cost = -1.f;
+        }
+        else
+        {
+            m_stats.refitted = 1;
+        }
+
+        m_stats.build_time = GetElapsedTime(start);
+
+        if (m_short_stack)
+        {
+            TranslateFatNodes();
+        }
+
+        return true;
+    }
+
+    void IntersectorHlbvh::ScheduleRebuild(World const& world, int numfaces)
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        std::uint32_t const build_queue = spec.max_num_queues > 1 ? 1 : 0;
+
+        // Next commit overwrites face bounds, so the build gets its own copy
+        m_gpudata->pending_bounds = AcquireBuffer(numfaces * sizeof(bbox), Calc::BufferType::kWrite);
+
+        int arg = 0;
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->vertices);
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->faces);
+        m_gpudata->bounds_func->SetArg(arg++, sizeof(numfaces), &numfaces);
+        m_gpudata->bounds_func->SetArg(arg++, m_gpudata->pending_bounds);
+
+        Calc::Event* e = nullptr;
+        int globalsize = ((numfaces + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_timer->Execute("bounds", m_gpudata->bounds_func, 0, globalsize, kWorkGroupSize, &e);
+
+        if (build_queue != 0)
+        {
+            m_device->EnqueueWaitForEvent(build_queue, e);
+        }
+
+        m_device->DeleteEvent(e);
+
+        // Spare tree is reused unless code width has changed
+        if (!m_pending_bvh || m_pending_bvh->IsMorton64() != m_bvh->IsMorton64())
+        {
+            m_pending_bvh.reset(new Hlbvh(m_device, m_bvh->IsMorton64()));
+            m_pending_bvh->SetTimer(m_timer.get());
+        }
+
+        auto treelets = world.options_.GetOption(Options::kBvhHlbvhTreelets);
+        m_pending_bvh->SetTreeletOptimization(treelets && treelets->AsFloat() > 0.f);
+        m_pending_bvh->SetQueue(build_queue);
+        m_pending_bvh->Build(m_gpudata->pending_bounds, numfaces);
+
+        m_device->Flush(build_queue);
+        m_rebuild_pending = true;
+    }
+
+    void IntersectorHlbvh::DiscardRebuild()
+    {
+        if (!m_rebuild_pending)
+        {
+            return;
+        }
+
+        // Bounds go back to the pool, nothing may read them anymore
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+        m_device->Finish(spec.max_num_queues > 1 ? 1 : 0);
+
+        ReleaseBuffer(m_gpudata->pending_bounds);
+        m_gpudata->pending_bounds = nullptr;
+        m_rebuild_pending = false;
+    }
+
     void IntersectorHlbvh::Intersect(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* wait_event, Calc::Event** event) const
     {
         // Check if we can allocate enough stack memory
@@ -380,24 +730,44 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        // kMaxStackSize entries per work item
+        auto stack = GetStackBuffer(globalsize * kMaxStackSize * sizeof(int), queue_idx);
+
+        // Fat nodes carry their own triangles
+        if (m_short_stack)
+        {
+            auto& func = m_gpudata->fat_isect_func;
+
+            int arg = 0;
+
+            func->SetArg(arg++, m_gpudata->fat_nodes);
+            func->SetArg(arg++, m_gpudata->vertices);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, num_rays);
+            func->SetArg(arg++, stack);
+            func->SetArg(arg++, hits);
+
+            ExecuteQuery("intersect", func, queue_idx, num_rays, globalsize, localsize, event);
+            return;
+        }
+
         auto& func = m_gpudata->isect_func;
 
         // Set args
         int arg = 0;
 
-        func->SetArg(arg++, m_bvh->GetGpuData().nodes);
-        func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
+        func->SetArg(arg++, GetNodes());
+        func->SetArg(arg++, GetNodeBounds());
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
         func->SetArg(arg++, hits);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
-
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+        ExecuteQuery("intersect", func, queue_idx, num_rays, globalsize, localsize, event);
     }
 
     void IntersectorHlbvh::Occluded(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -408,24 +778,83 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        // kMaxStackSize entries per work item
+        auto stack = GetStackBuffer(globalsize * kMaxStackSize * sizeof(int), queue_idx);
+
+        // Fat nodes carry their own triangles
+        if (m_short_stack)
+        {
+            auto& func = m_gpudata->fat_occlude_func;
+
+            int arg = 0;
+
+            func->SetArg(arg++, m_gpudata->fat_nodes);
+            func->SetArg(arg++, m_gpudata->vertices);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, num_rays);
+            func->SetArg(arg++, stack);
+            func->SetArg(arg++, hits);
+
+            ExecuteQuery("occlude", func, queue_idx, num_rays, globalsize, localsize, event);
+            return;
+        }
+
         auto& func = m_gpudata->occlude_func;
 
         // Set args
         int arg = 0;
 
-        func->SetArg(arg++, m_bvh->GetGpuData().nodes);
-        func->SetArg(arg++, m_bvh->GetGpuData().sorted_bounds);
+        func->SetArg(arg++, GetNodes());
+        func->SetArg(arg++, GetNodeBounds());
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, num_rays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
         func->SetArg(arg++, hits);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        ExecuteQuery("occlude", func, queue_idx, num_rays, globalsize, localsize, event);
+    }
 
-        m_device->Execute(func, queue_idx, globalsize, localsize, event);
+    Calc::Buffer const* IntersectorHlbvh::GetNodes() const
+    {
+        return m_sah_bvh ? m_sah_bvh->GetGpuData().nodes : m_bvh->GetGpuData().nodes;
     }
 
+    Calc::Buffer const* IntersectorHlbvh::GetNodeBounds() const
+    {
+        return m_sah_bvh ? m_sah_bvh->GetGpuData().sorted_bounds : m_bvh->GetGpuData().sorted_bounds;
+    }
+
+    void IntersectorHlbvh::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->faces);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->pending_bounds);
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->fat_nodes);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+
+        if (m_gpudata->fat_executable)
+        {
+            AddExecutableBytes(usage, m_device, m_gpudata->fat_executable);
+        }
+
+        if (m_bvh)
+        {
+            m_bvh->GetMemoryUsage(usage);
+        }
+
+        if (m_pending_bvh)
+        {
+            m_pending_bvh->GetMemoryUsage(usage);
+        }
+
+        if (m_sah_bvh)
+        {
+            m_sah_bvh->GetMemoryUsage(usage);
+        }
+    }
 }
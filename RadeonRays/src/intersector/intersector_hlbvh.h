@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "device.h"
 #include "intersector.h"
 #include <memory>
+#include <vector>
 /**
     \file intersector_hlbvh.h
     \author Dmitry Kozlov
@@ -49,6 +50,7 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     class Hlbvh;
+    class BinnedSahBvh;
 
     /** 
     \brief Intersector implementation using HLBVH.
@@ -62,6 +64,8 @@ namespace RadeonRays
     private:
         // World processing implementation
         void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
 
         // Intersection implemenation
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
@@ -77,9 +81,35 @@ namespace RadeonRays
         struct GpuData;
         struct ShapeData;
 
+        // Compute face bounds and build the BVH, on the device if possible
+        void BuildBvh(World const& world, std::vector<int> const& mesh_faces_start_idx, int numfaces);
+        // Nodes and node bounds of whichever builder built the BVH
+        Calc::Buffer const* GetNodes() const;
+        Calc::Buffer const* GetNodeBounds() const;
+        // Refit device built tree to new vertex positions, false if it has to be built instead
+        bool RefitBvh(World const& world, int numfaces);
+        // Build face bounds of this commit into a spare tree on the secondary queue
+        void ScheduleRebuild(World const& world, int numfaces);
+        // Wait for a scheduled rebuild nobody is going to swap in anymore
+        void DiscardRebuild();
+        // Compile the short stack traversal program on the first use
+        void InitShortStack();
+        // Enqueue translation of the built nodes into fat nodes
+        void TranslateFatNodes();
+
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Hlbvh> m_bvh;
+        // Binned SAH BVH built instead for "bvh.hlbvh.builder" "sah"
+        std::unique_ptr<BinnedSahBvh> m_sah_bvh;
+        // Traverse fat nodes translated on the device ("bvh.hlbvh.traversal" is "short_stack")
+        bool m_short_stack;
+        // Tree cost after the last build, negative until the first refit evaluates it
+        float m_build_cost;
+        // Tree rebuilt in the background to replace degraded refitted one, spare tree otherwise
+        std::unique_ptr<Hlbvh> m_pending_bvh;
+        // Whether the pending tree is being built
+        bool m_rebuild_pending;
     };
 }
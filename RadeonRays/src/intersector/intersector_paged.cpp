@@ -0,0 +1,606 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "intersector_paged.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
+
+#include "../accelerator/bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../translator/plain_bvh_translator.h"
+#include "../except/except.h"
+
+#include "device.h"
+#include "executable.h"
+#include <algorithm>
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+// Number of page slots in the device cache
+static int const kNumSlots = 2;
+
+namespace RadeonRays
+{
+    struct IntersectorPaged::Page
+    {
+        // Face layout of skip links kernels
+        struct Face
+        {
+            // Up to 3 indices
+            int idx[3];
+            // Primitive ID within the mesh
+            int prim_id;
+        };
+
+        // BVH nodes
+        std::vector<PlainBvhTranslator::Node> nodes;
+        // World space vertices
+        std::vector<float3> vertices;
+        // Faces in leaf order
+        std::vector<Face> faces;
+        // Shape range table of the faces
+        std::vector<int> shape_ranges;
+    };
+
+    struct IntersectorPaged::Slot
+    {
+        // Page buffers sized for the largest page
+        Calc::Buffer* nodes;
+        Calc::Buffer* vertices;
+        Calc::Buffer* faces;
+        Calc::Buffer* shape_ranges;
+        // Resident page or -1
+        int page;
+    };
+
+    struct IntersectorPaged::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Page cache
+        Slot slots[kNumSlots];
+        // Number of slots in use
+        int num_slots;
+        // Slot to be replaced next
+        int next_slot;
+        // Rays traced by the passes
+        Calc::Buffer* paged_rays;
+        // Hits of the latest pass
+        Calc::Buffer* pass_hits;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+
+        Calc::Executable* merge_executable;
+        Calc::Function* init_isect_func;
+        Calc::Function* init_occlude_func;
+        Calc::Function* merge_isect_func;
+        Calc::Function* merge_occlude_func;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , num_slots(0)
+            , next_slot(0)
+            , paged_rays(nullptr)
+            , pass_hits(nullptr)
+            , executable(nullptr)
+            , merge_executable(nullptr)
+        {
+            for (int i = 0; i < kNumSlots; ++i)
+            {
+                slots[i].nodes = nullptr;
+                slots[i].vertices = nullptr;
+                slots[i].faces = nullptr;
+                slots[i].shape_ranges = nullptr;
+                slots[i].page = -1;
+            }
+        }
+
+        // Free slot buffers with release
+        template <typename F>
+        void ReleaseSlots(F const& release)
+        {
+            for (int i = 0; i < kNumSlots; ++i)
+            {
+                release(slots[i].nodes);
+                release(slots[i].vertices);
+                release(slots[i].faces);
+                release(slots[i].shape_ranges);
+                slots[i].nodes = nullptr;
+                slots[i].vertices = nullptr;
+                slots[i].faces = nullptr;
+                slots[i].shape_ranges = nullptr;
+                slots[i].page = -1;
+            }
+
+            num_slots = 0;
+            next_slot = 0;
+        }
+
+        ~GpuData()
+        {
+            ReleaseSlots([this](Calc::Buffer* buffer) { device->DeleteBuffer(buffer); });
+            device->DeleteBuffer(paged_rays);
+            device->DeleteBuffer(pass_hits);
+
+            if (executable)
+            {
+                executable->DeleteFunction(isect_func);
+                executable->DeleteFunction(occlude_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (merge_executable)
+            {
+                merge_executable->DeleteFunction(init_isect_func);
+                merge_executable->DeleteFunction(init_occlude_func);
+                merge_executable->DeleteFunction(merge_isect_func);
+                merge_executable->DeleteFunction(merge_occlude_func);
+                device->DeleteExecutable(merge_executable);
+            }
+        }
+    };
+
+    IntersectorPaged::IntersectorPaged(Calc::Device* device)
+        : Intersector(device)
+        , m_gpudata(new GpuData(device))
+        , m_reverse(false)
+        , m_capacity(0)
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Paged geometry is only supported by OpenCL devices");
+
+        std::string buildopts =
+#ifdef RR_RAY_MASK
+            "-D RR_RAY_MASK ";
+#else
+            "";
+#endif
+
+#ifdef USE_SAFE_MATH
+        buildopts.append("-D USE_SAFE_MATH ");
+#endif
+
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_skiplinks.cl", headers, numheaders, buildopts.c_str());
+        m_gpudata->merge_executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/merge_pages.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_skiplinks_opencl, std::strlen(g_intersect_bvh2_skiplinks_opencl), buildopts.c_str());
+        m_gpudata->merge_executable = m_device->CompileExecutable(g_merge_pages_opencl, std::strlen(g_merge_pages_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable && m_gpudata->merge_executable);
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        m_gpudata->init_isect_func = m_gpudata->merge_executable->CreateFunction("init_intersect_main");
+        m_gpudata->init_occlude_func = m_gpudata->merge_executable->CreateFunction("init_occluded_main");
+        m_gpudata->merge_isect_func = m_gpudata->merge_executable->CreateFunction("merge_intersect_main");
+        m_gpudata->merge_occlude_func = m_gpudata->merge_executable->CreateFunction("merge_occluded_main");
+    }
+
+    IntersectorPaged::~IntersectorPaged()
+    {
+    }
+
+    void IntersectorPaged::Process(World const& world)
+    {
+        // Pages are rebuilt on any change
+        if (!m_pages.empty() && !world.has_changed() && world.GetStateChange() == ShapeImpl::kStateChangeNone)
+        {
+            return;
+        }
+
+        // Slot sizes depend on the pages, buffers go back to the pool
+        m_gpudata->ReleaseSlots([this](Calc::Buffer* buffer) { ReleaseBuffer(buffer); });
+        m_pages.clear();
+        m_reverse = false;
+
+        // By default a half of the device memory is spent on the cache
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        auto pagesize = world.options_.GetOption(Options::kAccPageSize);
+        std::size_t budget = pagesize && pagesize->AsFloat() > 0.f ?
+            static_cast<std::size_t>(pagesize->AsFloat() * 1024.f * 1024.f) :
+            spec.global_mem_size / (2 * kNumSlots);
+
+        if (spec.max_alloc_size > 0)
+        {
+            budget = std::min(budget, spec.max_alloc_size);
+        }
+
+        // Pack shapes into pages in the world order, up to two nodes per face
+        // with single primitive leaves, shapes larger than a page get their own one
+        std::vector<std::vector<Shape const*> > pageshapes;
+        std::size_t pagebytes = 0;
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            Mesh const* mesh = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+                static_cast<Mesh const*>(shape);
+
+            // Shapes without faces can't be hit
+            if (mesh->num_faces() == 0)
+            {
+                continue;
+            }
+
+            std::size_t bytes = mesh->num_vertices() * sizeof(float3) +
+                mesh->num_faces() * (sizeof(Page::Face) + 2 * sizeof(PlainBvhTranslator::Node));
+
+            if (pageshapes.empty() || (pagebytes > 0 && pagebytes + bytes > budget))
+            {
+                pageshapes.emplace_back();
+                pagebytes = 0;
+            }
+
+            pageshapes.back().push_back(shape);
+            pagebytes += bytes;
+        }
+
+        m_stats.num_nodes = 0;
+        m_stats.num_leaves = 0;
+        m_stats.height = 0;
+        // Costs of separate trees do not add up
+        m_stats.sah_cost = 0.f;
+        m_stats.nodes_bytes = 0;
+        m_stats.vertices_bytes = 0;
+        m_stats.faces_bytes = 0;
+
+        m_pages.resize(pageshapes.size());
+
+        std::size_t maxnodes = 1;
+        std::size_t maxvertices = 1;
+        std::size_t maxfaces = 1;
+        std::size_t maxranges = 1;
+
+        for (std::size_t i = 0; i < m_pages.size(); ++i)
+        {
+            BuildPage(world, pageshapes[i], m_pages[i]);
+
+            maxnodes = std::max(maxnodes, m_pages[i].nodes.size());
+            maxvertices = std::max(maxvertices, m_pages[i].vertices.size());
+            maxfaces = std::max(maxfaces, m_pages[i].faces.size());
+            maxranges = std::max(maxranges, m_pages[i].shape_ranges.size());
+
+            m_stats.nodes_bytes += m_pages[i].nodes.size() * sizeof(PlainBvhTranslator::Node);
+            m_stats.vertices_bytes += m_pages[i].vertices.size() * sizeof(float3);
+            m_stats.faces_bytes += m_pages[i].faces.size() * sizeof(Page::Face) + m_pages[i].shape_ranges.size() * sizeof(int);
+        }
+
+        if (m_pages.empty())
+        {
+            return;
+        }
+
+        auto start = Clock::now();
+
+        // A single page stays resident, otherwise pages are streamed by queries
+        m_gpudata->num_slots = std::min(static_cast<int>(m_pages.size()), kNumSlots);
+
+        for (int i = 0; i < m_gpudata->num_slots; ++i)
+        {
+            Slot& slot = m_gpudata->slots[i];
+            slot.nodes = AcquireBuffer(maxnodes * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead);
+            slot.vertices = AcquireBuffer(maxvertices * sizeof(float3), Calc::BufferType::kRead);
+            slot.faces = AcquireBuffer(maxfaces * sizeof(Page::Face), Calc::BufferType::kRead);
+            slot.shape_ranges = AcquireBuffer(maxranges * sizeof(int), Calc::BufferType::kRead);
+        }
+
+        AcquirePage(0, 0);
+
+        // Make sure everything is commited
+        m_device->Finish(0);
+
+        m_stats.upload_time = GetElapsedTime(start);
+    }
+
+    void IntersectorPaged::BuildPage(World const& world, std::vector<Shape const*> const& shapes, Page& page)
+    {
+        int numshapes = (int)shapes.size();
+        int numvertices = 0;
+        int numfaces = 0;
+
+        // Mesh start indices as mesh face indices are relative to 0
+        std::vector<int> mesh_vertices_start_idx(numshapes);
+        std::vector<int> mesh_faces_start_idx(numshapes);
+        std::vector<Mesh const*> meshes(numshapes);
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shapes[i]);
+            meshes[i] = shapeimpl->is_instance() ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape()) :
+                static_cast<Mesh const*>(shapes[i]);
+
+            mesh_faces_start_idx[i] = numfaces;
+            mesh_vertices_start_idx[i] = numvertices;
+
+            numfaces += meshes[i]->num_faces();
+            numvertices += meshes[i]->num_vertices();
+        }
+
+        // Check options
+        auto builder = world.options_.GetOption(Options::kBvhBuilder);
+        auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+        auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+        auto leafsize = world.options_.GetOption(Options::kBvhMaxLeafSize);
+        auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+        auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+
+        bool use_sah = builder && builder->AsString() == "sah";
+        bool use_lbvh = builder && builder->AsString() == "lbvh";
+        bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+        int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+        int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
+
+        auto start = Clock::now();
+
+        // World space bounds, instances transform object space bounds of the base shape
+        std::vector<bbox> bounds(numfaces);
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            bool const instance = static_cast<ShapeImpl const*>(shapes[i])->is_instance();
+
+            matrix m, minv;
+            shapes[i]->GetTransform(m, minv);
+
+            bbox* meshbounds = bounds.data() + mesh_faces_start_idx[i];
+            meshes[i]->GetAllFaceBounds(instance, meshbounds);
+
+            if (instance)
+            {
+                for (int j = 0; j < meshes[i]->num_faces(); ++j)
+                {
+                    meshbounds[j] = transform_bbox(meshbounds[j], m);
+                }
+            }
+        }
+
+        m_stats.bounds_time += GetElapsedTime(start);
+        start = Clock::now();
+
+        std::unique_ptr<Bvh> pagebvh(use_lbvh ?
+            new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+            new Bvh(traversal_cost, num_bins, use_sah));
+
+        Bvh& bvh = *pagebvh;
+        bvh.SetMaxLeafSize(std::min(std::max(max_leaf_size, 1), 15));
+        bvh.SetNumThreads(num_threads);
+        bvh.Build(&bounds[0], numfaces);
+
+        m_stats.build_time += GetElapsedTime(start);
+        m_stats.num_nodes += bvh.GetNodeCount();
+        m_stats.num_leaves += bvh.GetLeafCount();
+        m_stats.height = std::max(m_stats.height, bvh.GetHeight());
+
+        start = Clock::now();
+
+        PlainBvhTranslator translator;
+        translator.Process(bvh);
+        page.nodes.swap(translator.nodes_);
+
+        page.vertices.resize(numvertices);
+
+#pragma omp parallel for
+        for (int i = 0; i < numshapes; ++i)
+        {
+            GetWorldSpaceVertices(shapes[i], &page.vertices[mesh_vertices_start_idx[i]]);
+        }
+
+        // Faces in BVH leaf order with absolute vertex indices
+        int const* reordering = bvh.GetIndices();
+        int numindices = (int)bvh.GetNumIndices();
+        page.faces.resize(numindices);
+        std::vector<int> face_shape_ids(numindices);
+
+        for (int i = 0; i < numindices; ++i)
+        {
+            int indextolook4 = reordering[i];
+
+            auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+            int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+            int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+            int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+            Page::Face& face = page.faces[i];
+            Mesh::Face const myface = meshes[shapeidx]->GetFace(faceidx);
+            face.idx[0] = myface.idx[0] + mystartidx;
+            face.idx[1] = myface.idx[1] + mystartidx;
+            face.idx[2] = myface.idx[2] + mystartidx;
+            face.prim_id = faceidx;
+            face_shape_ids[i] = shapes[shapeidx]->GetId();
+        }
+
+        PackShapeRanges(face_shape_ids, page.shape_ranges);
+
+        m_stats.translate_time += GetElapsedTime(start);
+    }
+
+    IntersectorPaged::Slot const& IntersectorPaged::AcquirePage(std::uint32_t queue_idx, int page) const
+    {
+        for (int i = 0; i < m_gpudata->num_slots; ++i)
+        {
+            if (m_gpudata->slots[i].page == page)
+            {
+                return m_gpudata->slots[i];
+            }
+        }
+
+        // Round robin replacement evicts the page traced before the previous one,
+        // queue order makes sure the passes reading it are done before the upload
+        Slot& slot = m_gpudata->slots[m_gpudata->next_slot];
+        m_gpudata->next_slot = (m_gpudata->next_slot + 1) % m_gpudata->num_slots;
+
+        // Host copies outlive the uploads, so they don't need to be waited for
+        Page const& data = m_pages[page];
+        m_device->WriteBuffer(slot.nodes, queue_idx, 0, data.nodes.size() * sizeof(PlainBvhTranslator::Node), const_cast<PlainBvhTranslator::Node*>(&data.nodes[0]), nullptr);
+        m_device->WriteBuffer(slot.vertices, queue_idx, 0, data.vertices.size() * sizeof(float3), const_cast<float3*>(&data.vertices[0]), nullptr);
+        m_device->WriteBuffer(slot.faces, queue_idx, 0, data.faces.size() * sizeof(Page::Face), const_cast<Page::Face*>(&data.faces[0]), nullptr);
+        m_device->WriteBuffer(slot.shape_ranges, queue_idx, 0, data.shape_ranges.size() * sizeof(int), const_cast<int*>(&data.shape_ranges[0]), nullptr);
+        slot.page = page;
+
+        return slot;
+    }
+
+    void IntersectorPaged::ReserveRays(std::uint32_t max_rays) const
+    {
+        // Buffers are reused between queries and only grow
+        if (max_rays > m_capacity)
+        {
+            m_device->DeleteBuffer(m_gpudata->paged_rays);
+            m_device->DeleteBuffer(m_gpudata->pass_hits);
+            m_gpudata->paged_rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kRead | Calc::BufferType::kWrite);
+            m_gpudata->pass_hits = m_device->CreateBuffer(max_rays * sizeof(Intersection), Calc::BufferType::kRead | Calc::BufferType::kWrite);
+            m_capacity = max_rays;
+        }
+    }
+
+    int IntersectorPaged::GetPassPage(int i) const
+    {
+        return m_reverse ? static_cast<int>(m_pages.size()) - 1 - i : i;
+    }
+
+    void IntersectorPaged::TracePages(Calc::Function* func, Calc::Function* init, Calc::Function* merge,
+        std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays,
+        Calc::Buffer* hits, Calc::Event** event) const
+    {
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Single page is traced in place
+        if (m_pages.size() == 1)
+        {
+            Slot const& slot = AcquirePage(queueidx, 0);
+
+            int arg = 0;
+            func->SetArg(arg++, slot.nodes);
+            func->SetArg(arg++, slot.vertices);
+            func->SetArg(arg++, slot.faces);
+            func->SetArg(arg++, slot.shape_ranges);
+            func->SetArg(arg++, rays);
+            func->SetArg(arg++, numrays);
+            func->SetArg(arg++, hits);
+
+            m_timer->Execute("page_trace", func, queueidx, globalsize, localsize, event);
+            return;
+        }
+
+        ReserveRays(maxrays);
+
+        int numpages = static_cast<int>(m_pages.size());
+
+        int arg = 0;
+        init->SetArg(arg++, rays);
+        init->SetArg(arg++, numrays);
+        init->SetArg(arg++, m_gpudata->paged_rays);
+        init->SetArg(arg++, hits);
+
+        m_timer->Execute("page_init", init, queueidx, globalsize, localsize, numpages == 0 ? event : nullptr);
+
+        for (int i = 0; i < numpages; ++i)
+        {
+            Slot const& slot = AcquirePage(queueidx, GetPassPage(i));
+
+            arg = 0;
+            func->SetArg(arg++, slot.nodes);
+            func->SetArg(arg++, slot.vertices);
+            func->SetArg(arg++, slot.faces);
+            func->SetArg(arg++, slot.shape_ranges);
+            func->SetArg(arg++, m_gpudata->paged_rays);
+            func->SetArg(arg++, numrays);
+            func->SetArg(arg++, m_gpudata->pass_hits);
+
+            m_timer->Execute("page_trace", func, queueidx, globalsize, localsize, nullptr);
+
+            arg = 0;
+            merge->SetArg(arg++, numrays);
+            merge->SetArg(arg++, m_gpudata->paged_rays);
+            merge->SetArg(arg++, m_gpudata->pass_hits);
+            merge->SetArg(arg++, hits);
+
+            m_timer->Execute("page_merge", merge, queueidx, globalsize, localsize, i == numpages - 1 ? event : nullptr);
+        }
+
+        // Start the next query with the pages cached last
+        m_reverse = !m_reverse;
+    }
+
+    void IntersectorPaged::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        TracePages(m_gpudata->isect_func, m_gpudata->init_isect_func, m_gpudata->merge_isect_func,
+            queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorPaged::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        TracePages(m_gpudata->occlude_func, m_gpudata->init_occlude_func, m_gpudata->merge_occlude_func,
+            queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorPaged::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        for (int i = 0; i < kNumSlots; ++i)
+        {
+            AddBufferBytes(usage.nodes_bytes, m_gpudata->slots[i].nodes);
+            AddBufferBytes(usage.vertices_bytes, m_gpudata->slots[i].vertices);
+            AddBufferBytes(usage.faces_bytes, m_gpudata->slots[i].faces);
+            AddBufferBytes(usage.faces_bytes, m_gpudata->slots[i].shape_ranges);
+        }
+
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->paged_rays);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->pass_hits);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+        AddExecutableBytes(usage, m_device, m_gpudata->merge_executable);
+    }
+}
@@ -0,0 +1,113 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersector_paged.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector streaming geometry pages through a fixed device cache.
+
+    IntersectorPaged is meant for scenes which do not fit into device memory. Shapes are
+    packed into pages of at most "acc.page_size" megabytes and a skip links BVH is built
+    for every page. Pages are kept in host memory and the device only holds a cache of
+    two page slots.
+
+    A query runs one pass per page:
+
+        upload the page into a cache slot unless it is resident already
+        trace all the rays against the page BVH
+        merge pass hits into the results
+
+    Closest hit merging shrinks ray maxt to the hit distance, so later pages only report
+    closer hits and cull the nodes behind the current hit. Occluded rays are deactivated
+    for the following passes. Consecutive queries visit pages in alternating order, so
+    the pages cached at the end of a query are the first ones traced by the next.
+
+    Pros:
+        -Scene size is limited by host memory only.
+        -Scenes fitting into a single page are traced in place without extra passes.
+    Cons:
+        -Every query traverses all the pages and streams the ones which are not cached.
+        -No refits, any change rebuilds the pages.
+ */
+
+#pragma once
+#include "calc.h"
+#include "device.h"
+#include "intersector.h"
+#include <memory>
+#include <vector>
+
+namespace RadeonRays
+{
+    /**
+    \brief Intersector implementation streaming geometry pages, OpenCL only
+    */
+    class IntersectorPaged : public Intersector
+    {
+    public:
+        // Constructor
+        IntersectorPaged(Calc::Device* device);
+        // Destructor, pages are only complete in the implementation
+        ~IntersectorPaged();
+
+    private:
+        // Preprocess implementation
+        void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
+        // Intersection implementation
+        void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Occulusion implementation
+        void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+
+    private:
+        struct Page;
+        struct Slot;
+        struct GpuData;
+
+        // Build page BVH and its device layout
+        void BuildPage(World const& world, std::vector<Shape const*> const& shapes, Page& page);
+        // Make page resident and return the slot holding it
+        Slot const& AcquirePage(std::uint32_t queue_idx, int page) const;
+        // Grow pass buffers to hold max_rays
+        void ReserveRays(std::uint32_t max_rays) const;
+        // Run a query pass per page, or trace the only page in place
+        void TracePages(Calc::Function* func, Calc::Function* init, Calc::Function* merge,
+            std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays, std::uint32_t max_rays,
+            Calc::Buffer* hits, Calc::Event** event) const;
+        // Page index traced by pass i of the current query
+        int GetPassPage(int i) const;
+
+        // Implementation data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Host copies of the pages
+        std::vector<Page> m_pages;
+        // Trace pages backwards during the current query
+        mutable bool m_reverse;
+        // Number of rays pass buffers can hold
+        mutable std::uint32_t m_capacity;
+    };
+}
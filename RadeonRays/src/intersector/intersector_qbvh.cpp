@@ -0,0 +1,463 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "intersector_qbvh.h"
+#include "memory_usage.h"
+
+#include "calc.h"
+#include "executable.h"
+#include "../accelerator/bvh.h"
+#include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../world/world.h"
+
+#include "../translator/qbvh_translator.h"
+#include "../except/except.h"
+
+#include <algorithm>
+
+// Preferred work group size for Radeon devices
+static int const kWorkGroupSize = 64;
+// Global stack size per ray (GLOBAL_STACK_SIZE in the kernels)
+static int const kMaxStackSize = 64;
+static int const kMaxBatchSize = 1024 * 1024;
+
+namespace RadeonRays
+{
+    struct IntersectorQbvh::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // BVH nodes
+        Calc::Buffer* bvh;
+        // Vertex positions
+        Calc::Buffer* vertices;
+        // Indices
+        Calc::Buffer* faces;
+
+        Calc::Executable* executable;
+        Calc::Function* isect_func;
+        Calc::Function* occlude_func;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , bvh(nullptr)
+            , vertices(nullptr)
+            , faces(nullptr)
+            , executable(nullptr)
+            , isect_func(nullptr)
+            , occlude_func(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(bvh);
+            device->DeleteBuffer(vertices);
+            device->DeleteBuffer(faces);
+            executable->DeleteFunction(isect_func);
+            executable->DeleteFunction(occlude_func);
+            device->DeleteExecutable(executable);
+        }
+    };
+
+    IntersectorQbvh::IntersectorQbvh(Calc::Device* device)
+        : Intersector(device)
+        , m_gpudata(new GpuData(device))
+        , m_bvh(nullptr)
+    {
+        std::string buildopts =
+#ifdef RR_RAY_MASK
+            "-D RR_RAY_MASK ";
+#else
+            "";
+#endif
+
+#ifdef USE_SAFE_MATH
+        buildopts.append("-D USE_SAFE_MATH ");
+#endif
+
+#ifdef RR_WATERTIGHT
+        buildopts.append("-D RR_WATERTIGHT ");
+#endif
+
+#ifndef RR_EMBED_KERNELS
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+            int numheaders = sizeof(headers) / sizeof(char const*);
+
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_qbvh_short_stack.cl", headers, numheaders, buildopts.c_str());
+        }
+        else
+        {
+            assert(device->GetPlatform() == Calc::Platform::kVulkan);
+            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/GLSL/qbvh.comp", nullptr, 0, buildopts.c_str());
+        }
+#else
+#if USE_OPENCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_intersect_qbvh_short_stack_opencl, std::strlen(g_intersect_qbvh_short_stack_opencl), buildopts.c_str());
+        }
+#endif
+
+#if USE_VULKAN
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kVulkan)
+        {
+            m_gpudata->executable = m_device->CompileExecutable(g_qbvh_vulkan, std::strlen(g_qbvh_vulkan), buildopts.c_str());
+        }
+#endif
+
+#endif
+
+        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
+        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+    }
+
+    void IntersectorQbvh::Process(World const& world)
+    {
+        // If something has been changed we need to rebuild BVH
+        // (compressed nodes can't be refitted in place, so geometry changes rebuild as well)
+        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            if (m_bvh)
+            {
+                ReleaseBuffer(m_gpudata->bvh);
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->faces);
+            }
+
+            // Check if we can allocate enough stack memory
+            Calc::DeviceSpec spec;
+            m_device->GetSpec(spec);
+            if (spec.max_alloc_size <= kMaxBatchSize * kMaxStackSize * sizeof(int))
+            {
+                throw ExceptionImpl("qbvh accelerator can't allocate enough stack memory, try using bvh instead");
+            }
+
+            int numshapes = (int)world.shapes_.size();
+            int numvertices = 0;
+            int numfaces = 0;
+
+            // This buffer tracks mesh start index for next stage as mesh face indices are relative to 0
+            std::vector<int> mesh_vertices_start_idx(numshapes);
+            std::vector<int> mesh_faces_start_idx(numshapes);
+
+            auto builder = world.options_.GetOption(Options::kBvhBuilder);
+            auto splits = world.options_.GetOption(Options::kBvhSahUseSplits);
+            auto maxdepth = world.options_.GetOption(Options::kBvhSahMaxSplitDepth);
+            auto overlap = world.options_.GetOption(Options::kBvhSahMinOverlap);
+            auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+            auto node_budget = world.options_.GetOption(Options::kBvhSahExtraNodeBudget);
+            auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+            auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+            auto leafsize = world.options_.GetOption(Options::kBvhMaxLeafSize);
+            auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+
+            bool use_sah = false;
+            bool use_splits = false;
+            bool use_lbvh = false;
+            int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
+            int num_bins = nbins ? (int)nbins->AsFloat() : 64;
+            float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
+            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+            float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+            int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+            int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
+
+            if (builder && builder->AsString() == "sah")
+            {
+                use_sah = true;
+            }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
+
+            if (splits && splits->AsFloat() > 0.f)
+            {
+                use_splits = true;
+            }
+
+            m_bvh.reset(use_lbvh ?
+                new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                use_splits ?
+                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
+                new Bvh(traversal_cost, num_bins, use_sah)
+            );
+
+            // Leaf children keep primitive count in 8 bits of the node
+            m_bvh->SetMaxLeafSize(std::min(std::max(max_leaf_size, 1), 255));
+            m_bvh->SetNumThreads(num_threads);
+            ApplyRaySamples(*m_bvh, world);
+
+            // Partition the array into meshes and instances
+            std::vector<Shape const*> shapes(world.shapes_);
+
+            auto firstinst = std::partition(shapes.begin(), shapes.end(),
+                [&](Shape const* shape)
+            {
+                return !static_cast<ShapeImpl const*>(shape)->is_instance();
+            });
+
+            // Count the number of meshes
+            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
+
+            for (int i = 0; i < numshapes; ++i)
+            {
+                Mesh const* mesh = i < nummeshes ?
+                    static_cast<Mesh const*>(shapes[i]) :
+                    static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
+
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                numfaces += mesh->num_faces();
+                numvertices += mesh->num_vertices();
+            }
+
+            auto start = Clock::now();
+
+            // We can't avoild allocating it here, since bounds aren't stored anywhere
+            std::vector<bbox> bounds(numfaces);
+
+            // We handle meshes first collecting their world space bounds
+            // Faces of large meshes are gathered in parallel
+            for (int i = 0; i < nummeshes; ++i)
+            {
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+
+                // Here we directly get world space bounds
+                mesh->GetAllFaceBounds(false, bounds.data() + mesh_faces_start_idx[i]);
+            }
+
+            // Then we handle instances. Need to flatten them into actual geometry.
+#pragma omp parallel for
+            for (int i = nummeshes; i < numshapes; ++i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                // Instance is using its own transform for base shape geometry
+                // so we need to get object space bounds and transform them manually
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+
+                bbox* meshbounds = bounds.data() + mesh_faces_start_idx[i];
+                mesh->GetAllFaceBounds(true, meshbounds);
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    meshbounds[j] = transform_bbox(meshbounds[j], m);
+                }
+            }
+
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
+
+            m_bvh->Build(&bounds[0], numfaces);
+
+            m_stats.build_time = GetElapsedTime(start);
+            SetBvhStatistics(*m_bvh);
+
+#ifdef RR_PROFILE
+            m_bvh->PrintStatistics(std::cout);
+#endif
+
+            start = Clock::now();
+
+            QbvhTranslator translator;
+            translator.Process(*m_bvh);
+
+            m_stats.translate_time = GetElapsedTime(start);
+
+            // Each node pushes up to 3 children, check if the tree height is reasonable
+            if (translator.height_ * (QbvhTranslator::kWidth - 1) >= kMaxStackSize)
+            {
+                m_bvh.reset(nullptr);
+                throw ExceptionImpl("qbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+            }
+
+            // Report collapsed tree figures
+            m_stats.num_nodes = (int)translator.nodes_.size();
+            m_stats.height = translator.height_;
+
+            // Reordered face indices
+            int const* reordering = m_bvh->GetIndices();
+            // This number is different from the number of faces for some BVHs
+            int numindices = (int)m_bvh->GetNumIndices();
+
+            start = Clock::now();
+
+            // Create vertex buffer
+            {
+                // Vertices
+                m_stats.vertices_bytes = numvertices * sizeof(float3);
+                m_gpudata->vertices = AcquireBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                float3* vertexdata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Here we need to put data in world space rather than object space
+#pragma omp parallel for
+                for (int i = 0; i < numshapes; ++i)
+                {
+                    GetWorldSpaceVertices(shapes[i], vertexdata + mesh_vertices_start_idx[i]);
+                }
+
+                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Create face buffer
+            {
+                struct Face
+                {
+                    // Up to 3 indices
+                    int idx[3];
+                    // Shape maks
+                    int shape_mask;
+                    // Shape ID
+                    int shape_id;
+                    // Primitive ID
+                    int prim_id;
+                };
+
+                // Create face buffer
+                m_stats.faces_bytes = numindices * sizeof(Face);
+                m_gpudata->faces = AcquireBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+
+                // Get the pointer to mapped data
+                Face* facedata = nullptr;
+                Calc::Event* e = nullptr;
+
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+
+                // Leaf children point into ranges of reordered faces,
+                // so permute the faces accorningly to BVH reordering
+                for (int i = 0; i < numindices; ++i)
+                {
+                    int indextolook4 = reordering[i];
+
+                    // We need to find a shape corresponding to current face
+                    auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
+
+                    // Find the index of the shape
+                    int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
+
+                    // Get the mesh directly or out of instance
+                    Mesh const* mesh = nullptr;
+                    if (shapeidx < nummeshes)
+                    {
+                        mesh = static_cast<Mesh const*>(shapes[shapeidx]);
+                    }
+                    else
+                    {
+                        mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+                    }
+
+                    // Find face idx
+                    int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    // Find mesh start idx
+                    int mystartidx = mesh_vertices_start_idx[shapeidx];
+
+                    // Copy face data to GPU buffer
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
+
+                    facedata[i].shape_id = shapes[shapeidx]->GetId();
+                    facedata[i].shape_mask = shapes[shapeidx]->GetMask();
+                    facedata[i].prim_id = faceidx;
+                }
+
+                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+
+                e->Wait();
+                m_device->DeleteEvent(e);
+            }
+
+            // Nodes
+            m_stats.nodes_bytes = translator.nodes_.size() * sizeof(QbvhTranslator::Node);
+            m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead, &translator.nodes_[0]);
+
+            // Make sure everything is commited
+            m_device->Finish(0);
+
+            m_stats.upload_time = GetElapsedTime(start);
+        }
+    }
+
+    void IntersectorQbvh::Traverse(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        // kMaxStackSize entries per work item
+        auto stack = GetStackBuffer(globalsize * kMaxStackSize * sizeof(int), queueidx);
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, stack);
+        func->SetArg(arg++, hits);
+
+        ExecuteQuery(func == m_gpudata->occlude_func ? "occlude" : "intersect", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    void IntersectorQbvh::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Traverse(m_gpudata->isect_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorQbvh::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        Traverse(m_gpudata->occlude_func, queueidx, rays, numrays, maxrays, hits, event);
+    }
+
+    void IntersectorQbvh::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->bvh);
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->faces);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
@@ -0,0 +1,106 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersector_qbvh.h
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 4-wide BVH stacked traversal.
+
+    Intersector is using binary BVH collapsed into 4-wide one. Nodes are
+    compressed: child bounds are quantized to 8 bits per plane relative
+    to node bounds, so a node with four children takes 64 bytes.
+    Leaf children reference ranges of reordered faces directly.
+    Traversal is using a short stack split into LDS and global memory
+    parts (see IntersectorShortStack).
+
+    Traversal pseudocode:
+
+        while(addr is valid)
+        {
+            node <- fetch next node at addr
+            intersect ray vs 4 children bounds
+            intersect faces of hit leaf children
+            if (hit any internal children)
+            {
+                sort them by distance
+                addr = closest child
+                push other children far to near
+                continue
+            }
+
+            addr <- pop from the stack
+        }
+
+    Pros:
+        -Less node fetches and 4 boxes tested at once.
+        -Compact nodes, less memory traffic.
+    Cons:
+        -Depth is limited.
+        -No refits, changes of geometry cause full rebuild.
+ */
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+#include "intersector.h"
+#include <memory>
+
+namespace RadeonRays
+{
+    class Bvh;
+
+    /** 
+    \brief Intersector implementation using 4-wide compressed BVH traversal
+    */
+    class IntersectorQbvh : public Intersector
+    {
+    public:
+        // Constructor
+        IntersectorQbvh(Calc::Device* device);
+
+    private:
+        // World preprocessing implementation
+        void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
+        // Intersection implementation
+        void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Occlusion implementation
+        void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
+            std::uint32_t max_rays, Calc::Buffer *hits, 
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+
+    private:
+        // Set kernel arguments and run traversal
+        void Traverse(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+
+        struct GpuData;
+
+        // Implementation data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Bvh data structure
+        std::unique_ptr<Bvh> m_bvh;
+    };
+}
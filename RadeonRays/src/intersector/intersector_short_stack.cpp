@@ -20,24 +20,38 @@
  THE SOFTWARE.
  ********************************************************************/
 #include "intersector_short_stack.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
 
 #include "calc.h"
 #include "executable.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/fatnode_bvh_translator.h"
+#include "../translator/compressed_bvh_translator.h"
+#include "../translator/bvh_cache.h"
 #include "../except/except.h"
 
 #include <algorithm>
 
- // Preferred work group size for Radeon devices
+ // Preferred work group size for Radeon devices, packet traversal and refit kernels always use it
 static int const kWorkGroupSize = 64;
+// LDS stack depth range, the global stack of kMaxStackSize entries per ray has to hold two spills
+static int const kMaxShortStackSize = 16;
+static int const kMinShortStackSize = 8;
+// Work groups expected to share a compute unit's local memory
+static int const kMinGroupsPerUnit = 8;
 static int const kMaxStackSize = 48;
+// Nodes per treelet of "treelet" layout, a sibling pair of fat nodes fills a 128 byte cache line
+static int const kTreeletSize = 8;
 static int const kMaxBatchSize = 1024 * 1024;
+// Has to match PACKET_STACK_SIZE in intersect_bvh2_short_stack.cl
+static int const kMaxPacketStackSize = 64;
 
 namespace RadeonRays
 {
@@ -49,21 +63,44 @@ namespace RadeonRays
         Calc::Buffer* bvh;
         // Vertex positions
         Calc::Buffer* vertices;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Parent node links (refit)
+        Calc::Buffer* parents;
+        // Leaf node indices (refit)
+        Calc::Buffer* leaves;
+        // Node visit counters (refit)
+        Calc::Buffer* flags;
+        // Number of leaves
+        int num_leaves;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        Calc::Function* refit_func;
+        Calc::Function* isect_packet_func;
+        Calc::Function* occlude_packet_func;
+        Calc::Function* isect_compact_func;
+        Calc::Function* isect_packet_compact_func;
+        Calc::Function* occlude_bits_func;
+        Calc::Function* occlude_packet_bits_func;
 
         GpuData(Calc::Device* d)
         : device(d)
                           , bvh(nullptr)
                           , vertices(nullptr)
-                          , stack(nullptr)
+                          , parents(nullptr)
+                          , leaves(nullptr)
+                          , flags(nullptr)
+                          , num_leaves(0)
                           , executable(nullptr)
                           , isect_func(nullptr)
                           , occlude_func(nullptr)
+                          , refit_func(nullptr)
+                          , isect_packet_func(nullptr)
+                          , occlude_packet_func(nullptr)
+                          , isect_compact_func(nullptr)
+                          , isect_packet_compact_func(nullptr)
+                          , occlude_bits_func(nullptr)
+                          , occlude_packet_bits_func(nullptr)
         {
         }
 
@@ -71,18 +108,81 @@ namespace RadeonRays
         {
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
-            device->DeleteBuffer(stack);
-            executable->DeleteFunction(isect_func);
-            executable->DeleteFunction(occlude_func);
-            device->DeleteExecutable(executable);
+            device->DeleteBuffer(parents);
+            device->DeleteBuffer(leaves);
+            device->DeleteBuffer(flags);
+            ReleaseProgram();
+        }
+
+        void ReleaseProgram()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(isect_func);
+                executable->DeleteFunction(occlude_func);
+                if (refit_func)
+                {
+                    executable->DeleteFunction(refit_func);
+                }
+                if (isect_packet_func)
+                {
+                    executable->DeleteFunction(isect_packet_func);
+                    executable->DeleteFunction(occlude_packet_func);
+                }
+                if (isect_compact_func)
+                {
+                    executable->DeleteFunction(isect_compact_func);
+                    executable->DeleteFunction(isect_packet_compact_func);
+                }
+                if (occlude_bits_func)
+                {
+                    executable->DeleteFunction(occlude_bits_func);
+                    executable->DeleteFunction(occlude_packet_bits_func);
+                }
+                device->DeleteExecutable(executable);
+            }
+
+            executable = nullptr;
+            isect_func = nullptr;
+            occlude_func = nullptr;
+            refit_func = nullptr;
+            isect_packet_func = nullptr;
+            occlude_packet_func = nullptr;
+            isect_compact_func = nullptr;
+            isect_packet_compact_func = nullptr;
+            occlude_bits_func = nullptr;
+            occlude_packet_bits_func = nullptr;
         }
     };
 
-    IntersectorShortStack::IntersectorShortStack(Calc::Device* device)
+    IntersectorShortStack::IntersectorShortStack(Calc::Device* device, bool compressed, bool precomputed_triangles)
         : Intersector(device)
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
+        , m_compressed(compressed)
+        , m_precomputed_triangles(precomputed_triangles)
+        , m_packet_traversal(false)
+        , m_packed_vertices(false)
+        , m_program_stats(false)
+        , m_program_watertight(false)
     {
+        // Compressed nodes and precomputed triangles traversal is only implemented for OpenCL
+        ThrowIf(m_compressed && device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Compressed fatbvh is only supported by OpenCL devices");
+        ThrowIf(m_precomputed_triangles && device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Precomputed triangles are only supported by OpenCL devices");
+
+        CompileProgram();
+    }
+
+    void IntersectorShortStack::CompileProgram()
+    {
+        m_gpudata->ReleaseProgram();
+        m_program_stats = m_traversal_stats;
+        m_program_watertight = m_watertight;
+
+        auto device = m_device;
+
         std::string buildopts =
 #ifdef RR_RAY_MASK
             "-D RR_RAY_MASK ";
@@ -94,6 +194,32 @@ namespace RadeonRays
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
 
+        if (m_program_watertight)
+        {
+            buildopts.append("-D RR_WATERTIGHT ");
+        }
+
+        if (m_precomputed_triangles)
+        {
+            buildopts.append("-D RR_PRECOMPUTED_TRIANGLES ");
+        }
+
+        if (m_packed_vertices)
+        {
+            buildopts.append("-D RR_PACKED_VERTICES ");
+        }
+
+        if (m_program_stats)
+        {
+            buildopts.append("-D RR_TRAVERSAL_STATS ");
+        }
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            buildopts.append("-D RR_GROUP_SIZE=" + std::to_string(m_local_size) + " ");
+            buildopts.append("-D SHORT_STACK_SIZE=" + std::to_string(GetShortStackSize()) + " ");
+        }
+
 #ifndef RR_EMBED_KERNELS
         if (device->GetPlatform() == Calc::Platform::kOpenCL)
         {
@@ -101,7 +227,11 @@ namespace RadeonRays
 
             int numheaders = sizeof(headers) / sizeof(char const*);
 
-            m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl", headers, numheaders, buildopts.c_str());
+            char const* source = m_compressed ?
+                "../RadeonRays/src/kernels/CL/intersect_bvh2_compressed_short_stack.cl" :
+                "../RadeonRays/src/kernels/CL/intersect_bvh2_short_stack.cl";
+
+            m_gpudata->executable = m_device->CompileExecutable(source, headers, numheaders, buildopts.c_str());
         } 
         else
         {
@@ -112,7 +242,11 @@ namespace RadeonRays
 #if USE_OPENCL
         if (device->GetPlatform() == Calc::Platform::kOpenCL)
         {
-            m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_short_stack_opencl, std::strlen(g_intersect_bvh2_short_stack_opencl), buildopts.c_str());
+            char const* source = m_compressed ?
+                g_intersect_bvh2_compressed_short_stack_opencl :
+                g_intersect_bvh2_short_stack_opencl;
+
+            m_gpudata->executable = m_device->CompileExecutable(source, std::strlen(source), buildopts.c_str());
         }
 #endif
 
@@ -127,18 +261,84 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        // BVH refit is only implemented for OpenCL fat nodes over vertices, otherwise it falls back to full rebuild
+        if (device->GetPlatform() == Calc::Platform::kOpenCL && !m_compressed && !m_precomputed_triangles)
+        {
+            m_gpudata->refit_func = m_gpudata->executable->CreateFunction("refit_main");
+        }
+
+        // Packet traversal, compact hit formats and bit-packed occlusion are only implemented for OpenCL uncompressed nodes
+        if (device->GetPlatform() == Calc::Platform::kOpenCL && !m_compressed)
+        {
+            m_gpudata->isect_packet_func = m_gpudata->executable->CreateFunction("intersect_packet_main");
+            m_gpudata->occlude_packet_func = m_gpudata->executable->CreateFunction("occluded_packet_main");
+            m_gpudata->isect_compact_func = m_gpudata->executable->CreateFunction("intersect_compact_main");
+            m_gpudata->isect_packet_compact_func = m_gpudata->executable->CreateFunction("intersect_packet_compact_main");
+            m_gpudata->occlude_bits_func = m_gpudata->executable->CreateFunction("occluded_bits_main");
+            m_gpudata->occlude_packet_bits_func = m_gpudata->executable->CreateFunction("occluded_packet_bits_main");
+        }
+    }
+
+    int IntersectorShortStack::GetShortStackSize() const
+    {
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        int size = kMaxShortStackSize;
+
+        while (size > kMinShortStackSize && kMinGroupsPerUnit * m_local_size * size * sizeof(int) > spec.local_mem_size)
+        {
+            size /= 2;
+        }
+
+        return size;
     }
 
     void IntersectorShortStack::Process(World const& world)
     {
+        // Packed vertices are only read by OpenCL kernels, precomputed triangles replace vertices altogether
+        auto packedvertices = world.options_.GetOption(Options::kBvhPackedVertices);
+        bool const packed_vertices = m_device->GetPlatform() == Calc::Platform::kOpenCL && !m_precomputed_triangles &&
+            packedvertices && packedvertices->AsFloat() > 0.f;
+
+        // Vertex layout changes with packing and precomputed triangle layout with watertight tests,
+        // so the tree has to be rebuilt
+        bool const layout_changed = packed_vertices != m_packed_vertices ||
+            (m_precomputed_triangles && m_watertight != m_program_watertight);
+
+        // Statistics variant of the kernels only changes the program, the tree is kept
+        if (layout_changed || m_traversal_stats != m_program_stats || m_watertight != m_program_watertight)
+        {
+            m_packed_vertices = packed_vertices;
+            CompileProgram();
+        }
+
+        // Packet traversal can be switched on and off between commits
+        auto packet = world.options_.GetOption(Options::kBvhPacketTraversal);
+        m_packet_traversal = m_gpudata->isect_packet_func && packet && packet->AsFloat() > 0.f;
+
+        // Only transforms or vertex positions have changed: keep the topology and refit bounds
+        if (m_bvh && m_gpudata->refit_func && !layout_changed && CanRefit(world))
+        {
+            Refit();
+            m_stats.refitted = 1;
+            return;
+        }
 
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (!m_bvh || layout_changed || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
             if (m_bvh)
             {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->bvh);
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->parents);
+                ReleaseBuffer(m_gpudata->leaves);
+                ReleaseBuffer(m_gpudata->flags);
+                m_gpudata->parents = nullptr;
+                m_gpudata->leaves = nullptr;
+                m_gpudata->flags = nullptr;
             }
 
             // Check if we can allocate enough stack memory
@@ -157,37 +357,56 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            auto builder = world.options_.GetOption(Options::kBvhBuilder);
+            auto splits = world.options_.GetOption(Options::kBvhSahUseSplits);
+            auto maxdepth = world.options_.GetOption(Options::kBvhSahMaxSplitDepth);
+            auto overlap = world.options_.GetOption(Options::kBvhSahMinOverlap);
+            auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+            auto node_budget = world.options_.GetOption(Options::kBvhSahExtraNodeBudget);
+            auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+            auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+            auto area_order = world.options_.GetOption(Options::kBvhOcclusionAreaOrder);
+            auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
+            auto layout = world.options_.GetOption(Options::kBvhLayout);
 
             bool use_sah = false;
             bool use_splits = false;
+            bool use_lbvh = false;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             int num_bins = nbins ? (int)nbins->AsFloat() : 64;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
             float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+            bool use_area_order = area_order && area_order->AsFloat() > 0.f;
+            int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
+            bool use_treelets = layout && layout->AsString() == "treelet";
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
                 use_splits = true;
             }
 
-            m_bvh.reset(use_splits ?
+            m_bvh.reset(use_lbvh ?
+                new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                use_splits ?
                 new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
                 new Bvh(traversal_cost, num_bins, use_sah)
             );
 
+            m_bvh->SetAreaOrder(use_area_order);
+            m_bvh->SetNumThreads(num_threads);
+            ApplyRaySamples(*m_bvh, world);
+
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
 
@@ -225,21 +444,19 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
+            auto start = Clock::now();
 
             // We can't avoild allocating it here, since bounds aren't stored anywhere
             std::vector<bbox> bounds(numfaces);
 
             // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
+            // Faces of large meshes are gathered in parallel
             for (int i = 0; i < nummeshes; ++i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    // Here we directly get world space bounds
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+                // Here we directly get world space bounds
+                mesh->GetAllFaceBounds(false, bounds.data() + mesh_faces_start_idx[i]);
             }
 
             // Then we handle instances. Need to flatten them into actual geometry.
@@ -254,104 +471,150 @@ namespace RadeonRays
                 matrix m, minv;
                 instance->GetTransform(m, minv);
 
+                bbox* meshbounds = bounds.data() + mesh_faces_start_idx[i];
+                mesh->GetAllFaceBounds(true, meshbounds);
+
                 for (int j = 0; j < mesh->num_faces(); ++j)
                 {
-                    bbox tmp;
-                    mesh->GetFaceBounds(j, true, tmp);
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                    meshbounds[j] = transform_bbox(meshbounds[j], m);
                 }
             }
 
-            m_bvh->Build(&bounds[0], numfaces);
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
 
-#ifdef RR_PROFILE
-            m_bvh->PrintStatistics(std::cout);
-#endif
+            // Try to map previously built BVH for the same bounds and build options
+            std::unique_ptr<BvhCache> cache = CreateBvhCache(world);
+            std::unique_ptr<BvhCache::Entry> entry;
+            // Held while building, so that processes sharing the cache build the BVH once
+            std::unique_ptr<BvhCache::BuildLock> buildlock;
+            std::uint64_t cachekey = 0;
 
-            // Check if the tree height is reasonable
-            if (m_bvh->GetHeight() >= kMaxStackSize)
+            if (cache)
             {
-                m_bvh.reset(nullptr);
-                throw ExceptionImpl("fatbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+                float const buildopts[] = { use_lbvh ? (use_sah_top ? 3.f : 2.f) : use_sah ? 1.f : 0.f, use_splits ? 1.f : 0.f, (float)max_split_depth,
+                    (float)num_bins, min_overlap, traversal_cost, extra_node_budget, use_area_order ? 1.f : 0.f,
+                    use_treelets ? 1.f : 0.f };
+
+                cachekey = BvhCache::Hash(&bounds[0], numfaces * sizeof(bbox));
+                cachekey = BvhCache::Hash(buildopts, sizeof(buildopts), cachekey);
+                entry = cache->Load(cachekey, BvhCache::kFatNode, sizeof(FatNodeBvhTranslator::Node), numfaces);
+
+                // Another process might be building it, wait and look again
+                if (!entry && (buildlock = cache->LockBuild(cachekey)))
+                {
+                    entry = cache->Load(cachekey, BvhCache::kFatNode, sizeof(FatNodeBvhTranslator::Node), numfaces);
+                }
             }
 
             FatNodeBvhTranslator translator;
-            translator.Process(*m_bvh);
-
-            // Update GPU data
+            // Reordered face indices
+            int const* reordering = nullptr;
+            // This number is different from the number of faces for some BVHs
+            int numindices = 0;
 
-            // Create vertex buffer
+            if (entry)
+            {
+                // Cached nodes are stored before face data injection
+                auto const& header = entry->GetHeader();
+                auto nodes = static_cast<FatNodeBvhTranslator::Node const*>(entry->GetNodes());
+                translator.nodes_.assign(nodes, nodes + header.num_nodes);
+                reordering = entry->GetIndices();
+                numindices = header.num_indices;
+
+                m_stats.build_time = GetElapsedTime(start);
+                m_stats.num_nodes = header.num_nodes;
+                m_stats.num_leaves = header.num_leaves;
+                m_stats.height = header.height;
+                m_stats.sah_cost = header.sah_cost;
+            }
+            else
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_bvh->Build(&bounds[0], numfaces);
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
+                m_stats.build_time = GetElapsedTime(start);
+                SetBvhStatistics(*m_bvh);
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+#ifdef RR_PROFILE
+                m_bvh->PrintStatistics(std::cout);
+#endif
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+                // Check if the tree height is reasonable
+                if (m_bvh->GetHeight() >= kMaxStackSize)
+                {
+                    m_bvh.reset(nullptr);
+                    throw ExceptionImpl("fatbvh accelerator can cause stack overflow for this scene, try using bvh instead");
+                }
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+                start = Clock::now();
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                translator.Process(*m_bvh);
+
+                if (use_treelets)
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    translator.ClusterTreelets(kTreeletSize);
                 }
 
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                reordering = m_bvh->GetIndices();
+                numindices = (int)m_bvh->GetNumIndices();
+
+                m_stats.translate_time = GetElapsedTime(start);
+
+                if (cache)
                 {
-                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    instance->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
-                    {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                    auto header = BvhCache::CreateHeader(cachekey, BvhCache::kFatNode, sizeof(FatNodeBvhTranslator::Node), numfaces,
+                        (std::uint32_t)translator.nodes_.size(), numindices);
+                    header.num_leaves = m_stats.num_leaves;
+                    header.height = m_stats.height;
+                    header.sah_cost = m_stats.sah_cost;
+                    cache->Store(header, &translator.nodes_[0], reordering);
+                    buildlock.reset();
                 }
+            }
+
+            start = Clock::now();
+
+            // Update GPU data
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
-                e->Wait();
-                m_device->DeleteEvent(e);
+            // Keep vertex layout around for refits
+            m_shapes = shapes;
+            m_vertex_start.assign(mesh_vertices_start_idx.cbegin(), mesh_vertices_start_idx.cend());
+            m_vertex_start.push_back(numvertices);
+
+            // World space vertices to build triangles from
+            std::vector<float3> worldvertices;
+
+            if (m_precomputed_triangles)
+            {
+                worldvertices.resize(numvertices);
+
+#pragma omp parallel for
+                for (int i = 0; i < nummeshes + numinstances; ++i)
+                {
+                    GetWorldSpaceVertices(shapes[i], &worldvertices[mesh_vertices_start_idx[i]]);
+                }
+            }
+            // Create vertex buffer
+            else
+            {
+                // Vertices in world space rather than object space
+                m_gpudata->vertices = AcquireBuffer(numvertices * GetVertexSize(m_packed_vertices), Calc::BufferType::kRead);
+                m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start,
+                    0, nummeshes + numinstances - 1, m_packed_vertices, false);
             }
 
+            m_stats.upload_time = GetElapsedTime(start);
+            start = Clock::now();
+
             // Create face buffer
             {
                 
-                // This number is different from the number of faces for some BVHs 
-                auto numindices = m_bvh->GetNumIndices();
                 std::vector<FatNodeBvhTranslator::Face> facedata(numindices);
 
                 // Here the point is to add mesh starting index to actual index contained within the mesh,
                 // getting absolute index in the buffer.
                 // Besides that we need to permute the faces accorningly to BVH reordering, whihc
                 // is contained within bvh.primids_
-                int const* reordering = m_bvh->GetIndices();
                 for (int i = 0; i < numindices; ++i)
                 {
                     int indextolook4 = reordering[i];
@@ -373,49 +636,167 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapes[shapeidx]->GetId();
                     facedata[i].shape_mask = shapes[shapeidx]->GetMask();
                     facedata[i].id = faceidx;
                 }
 
+                // Triangles take the place of vertices and leaves reference them instead
+                if (m_precomputed_triangles)
+                {
+                    std::vector<int> triangleindices(3 * numindices);
+                    for (int i = 0; i < numindices; ++i)
+                    {
+                        triangleindices[3 * i] = facedata[i].idx[0];
+                        triangleindices[3 * i + 1] = facedata[i].idx[1];
+                        triangleindices[3 * i + 2] = facedata[i].idx[2];
+                        facedata[i].idx[0] = i;
+                    }
+
+                    m_stats.vertices_bytes = 3 * numindices * sizeof(float3);
+                    m_gpudata->vertices = CreateTriangleBuffer(&worldvertices[0], &triangleindices[0], numindices);
+                }
+
                 translator.InjectIndices(&facedata[0]);
             }
 
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+            // Faces are stored in the leaves, so this is a part of translation
+            m_stats.translate_time += GetElapsedTime(start);
+            start = Clock::now();
+
+            if (m_compressed)
+            {
+                // Pack fat nodes into compressed ones
+                CompressedBvhTranslator compressed;
+                compressed.Process(translator);
+
+                m_stats.translate_time += GetElapsedTime(start);
+                start = Clock::now();
 
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+                m_stats.nodes_bytes = compressed.nodes_.size() * sizeof(CompressedBvhTranslator::Node);
+                m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead, &compressed.nodes_[0]);
+            }
+            else
+            {
+                // Copy translated nodes first (refit is writing them back)
+                m_stats.nodes_bytes = translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node);
+                m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead | Calc::BufferType::kWrite, &translator.nodes_[0]);
+            }
+
+            // Build parent links and leaf list for refits
+            if (m_gpudata->refit_func)
+            {
+                auto const& nodes = translator.nodes_;
+                int numnodes = (int)nodes.size();
+                std::vector<int> parents(numnodes, -1);
+                std::vector<int> leaves;
+
+                for (int i = 0; i < numnodes; ++i)
+                {
+                    if (nodes[i].s1.child0 == -1)
+                    {
+                        leaves.push_back(i);
+                    }
+                    else
+                    {
+                        // Encode the side along with the parent index
+                        parents[nodes[i].s1.child0] = (i << 1);
+                        parents[nodes[i].s1.child1] = (i << 1) | 1;
+                    }
+                }
+
+                std::vector<int> flags(numnodes, 0);
+                m_gpudata->num_leaves = (int)leaves.size();
+                m_gpudata->parents = AcquireBuffer(numnodes * sizeof(int), Calc::BufferType::kRead, &parents[0]);
+                m_gpudata->leaves = AcquireBuffer(leaves.size() * sizeof(int), Calc::BufferType::kRead, &leaves[0]);
+                m_gpudata->flags = AcquireBuffer(numnodes * sizeof(int), Calc::BufferType::kRead | Calc::BufferType::kWrite, &flags[0]);
+                m_stats.other_bytes = (2 * numnodes + leaves.size()) * sizeof(int);
+            }
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            m_stats.upload_time += GetElapsedTime(start);
         }
     }
 
+    void IntersectorShortStack::Refit()
+    {
+        // Find the range of shapes with changed geometry
+        int numshapes = (int)m_shapes.size();
+        int first = numshapes;
+        int last = -1;
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            if (HasGeometryChanged(m_shapes[i]))
+            {
+                first = std::min(first, i);
+                last = i;
+            }
+        }
+
+        if (last < 0)
+        {
+            return;
+        }
+
+        auto start = Clock::now();
+
+        // Upload new world space vertices for the range
+        m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start, first, last, m_packed_vertices, true);
+
+        m_stats.upload_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        // Propagate leaf bounds up the tree
+        auto& func = m_gpudata->refit_func;
+
+        int arg = 0;
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->parents);
+        func->SetArg(arg++, m_gpudata->leaves);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->num_leaves);
+        func->SetArg(arg++, m_gpudata->flags);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((m_gpudata->num_leaves + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_timer->Execute("refit", func, 0, globalsize, localsize, nullptr);
+
+        m_device->Finish(0);
+
+        m_stats.build_time = GetElapsedTime(start);
+    }
+
     void IntersectorShortStack::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
+        if (UsePacketTraversal())
         {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+            TraversePackets(m_hit_format != kHitFormatFull ? m_gpudata->isect_packet_compact_func : m_gpudata->isect_packet_func,
+                queueidx, rays, numrays, maxrays, hits, event);
+            return;
         }
 
-        auto& func = m_gpudata->isect_func;
+        size_t localsize = m_local_size;
+        size_t globalsize = RoundToLocalSize(maxrays);
+        // kMaxStackSize entries per work item
+        auto stack = GetStackBuffer(globalsize * kMaxStackSize * sizeof(int), queueidx);
+
+        bool const compact = m_hit_format != kHitFormatFull;
+        auto& func = compact ? m_gpudata->isect_compact_func : m_gpudata->isect_func;
 
         // Set args
         int arg = 0;
@@ -424,27 +805,40 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
         func->SetArg(arg++, hits);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        if (compact)
+        {
+            int format = m_hit_format;
+            int plane_size = static_cast<int>(maxrays);
+            func->SetArg(arg++, sizeof(format), &format);
+            func->SetArg(arg++, sizeof(plane_size), &plane_size);
+        }
+
+        SetTraversalStatsArgs(func, arg);
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        ExecuteQuery("intersect", func, queueidx, numrays, globalsize, localsize, event);
     }
 
     void IntersectorShortStack::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
-        // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
+        if (UsePacketTraversal())
         {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
+            TraversePackets(m_occlusion_bits ? m_gpudata->occlude_packet_bits_func : m_gpudata->occlude_packet_func,
+                queueidx, rays, numrays, maxrays, hits, event);
+            return;
         }
 
-        auto& func = m_gpudata->occlude_func;
+        // Every work group packs whole words
+        ThrowIf(m_occlusion_bits && m_local_size % 32 != 0, "Bit-packed occlusion results need work group sizes of multiples of 32");
+
+        size_t localsize = m_local_size;
+        size_t globalsize = RoundToLocalSize(maxrays);
+        // kMaxStackSize entries per work item
+        auto stack = GetStackBuffer(globalsize * kMaxStackSize * sizeof(int), queueidx);
+
+        auto& func = m_occlusion_bits ? m_gpudata->occlude_bits_func : m_gpudata->occlude_func;
 
        // Set args
         int arg = 0;
@@ -453,12 +847,86 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+        func->SetArg(arg++, hits);
+
+        SetTraversalStatsArgs(func, arg);
+
+        ExecuteQuery("occlude", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    bool IntersectorShortStack::SupportsCompactHits() const
+    {
+        return m_gpudata->isect_compact_func != nullptr;
+    }
+
+    bool IntersectorShortStack::SupportsOcclusionBits() const
+    {
+        return m_gpudata->occlude_bits_func != nullptr;
+    }
+
+    bool IntersectorShortStack::UsePacketTraversal() const
+    {
+        // Packet stack holds at most one deferred node per level,
+        // packet kernels don't record traversal statistics
+        return m_packet_traversal && !m_program_stats && m_stats.height < kMaxPacketStackSize;
+    }
+
+    bool IntersectorShortStack::SupportsTraversalStats() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL && !m_compressed;
+    }
+
+    bool IntersectorShortStack::SupportsWatertight() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool IntersectorShortStack::SupportsLocalSize() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    void IntersectorShortStack::OnLocalSizeChanged()
+    {
+        CompileProgram();
+    }
+
+    void IntersectorShortStack::TraversePackets(Calc::Function* func, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        // Set args, the packet stack is in LDS so no stack memory is needed
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
+        // Only closest hit queries write compact formats
+        if (func == m_gpudata->isect_packet_compact_func)
+        {
+            int format = m_hit_format;
+            int plane_size = static_cast<int>(maxrays);
+            func->SetArg(arg++, sizeof(format), &format);
+            func->SetArg(arg++, sizeof(plane_size), &plane_size);
+        }
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        bool const occlusion = func == m_gpudata->occlude_packet_func || func == m_gpudata->occlude_packet_bits_func;
+        ExecuteQuery(occlusion ? "occlude" : "intersect", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    void IntersectorShortStack::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->bvh);
+        // Precomputed triangles (or packed vertices) also stand for the faces
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->parents);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->leaves);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->flags);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
     }
 }
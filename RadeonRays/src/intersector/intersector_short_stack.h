@@ -84,7 +84,7 @@ THE SOFTWARE.
 #include "device.h"
 #include "intersector.h"
 #include <memory>
-
+#include <vector>
 
 namespace RadeonRays
 {
@@ -96,12 +96,15 @@ namespace RadeonRays
     class IntersectorShortStack : public Intersector
     {
     public:
-        // Constructor
-        IntersectorShortStack(Calc::Device* device);
+        // Constructor, compressed nodes halve BVH memory footprint, precomputed triangles
+        // trade memory for a single fetch per triangle, neither can be refitted
+        IntersectorShortStack(Calc::Device* device, bool compressed = false, bool precomputed_triangles = false);
 
     private:
         // World preprocessing implementation
         void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
         // Intersection implementation
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
@@ -110,14 +113,53 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Compact hit formats are supported for uncompressed nodes on OpenCL
+        bool SupportsCompactHits() const override;
+        bool SupportsOcclusionBits() const override;
+        // Traversal statistics are recorded for uncompressed nodes on OpenCL
+        bool SupportsTraversalStats() const override;
+        // Watertight programs are compiled on demand by OpenCL devices
+        bool SupportsWatertight() const override;
+        // Work group size and LDS stack depth of OpenCL traversal kernels are set at compilation
+        bool SupportsLocalSize() const override;
+        // Recompile the program for the new work group size
+        void OnLocalSizeChanged() override;
 
     private:
+        // (Re)create the traversal program, with statistics kernels if "acc.traversal_stats" is enabled
+        void CompileProgram();
+        // Deepest LDS stack per work item leaving room for kMinGroupsPerUnit groups in device local memory
+        int GetShortStackSize() const;
+        // Update vertices of changed shapes and refit BVH on the device
+        void Refit();
+        // Check if packet traversal is requested and the tree is shallow enough for the packet stack
+        bool UsePacketTraversal() const;
+        // Launch packet traversal kernel, the whole work group traverses the tree together
+        void TraversePackets(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, Calc::Buffer *hits, Calc::Event **event) const;
+
         struct GpuData;
 
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Shapes in the order their vertices are laid out in GPU buffer
+        std::vector<Shape const*> m_shapes;
+        // Start index of each shape vertices (plus total vertex count at the end)
+        std::vector<int> m_vertex_start;
+        // Use compressed nodes
+        bool m_compressed;
+        // Store triangles in leaf order instead of vertices
+        bool m_precomputed_triangles;
+        // Traverse coherent rays as work group packets
+        bool m_packet_traversal;
+        // Vertices are stored as 3 floats without padding (RR_PACKED_VERTICES)
+        bool m_packed_vertices;
+        // Traversal statistics the program is compiled with
+        bool m_program_stats;
+        // Watertight tests the program is compiled with
+        bool m_program_watertight;
     };
 }
 
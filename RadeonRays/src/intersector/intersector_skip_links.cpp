@@ -20,21 +20,39 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "intersector_skip_links.h"
+#include "memory_usage.h"
+#include "kernel_timer.h"
 
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
+#include "../accelerator/linear_bvh.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
 
 #include "../translator/plain_bvh_translator.h"
+#include "../translator/bvh_cache.h"
+#include "../async/task_scheduler.h"
+#include "../except/except.h"
 
 #include "device.h"
 #include "executable.h"
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <numeric>
+#include <unordered_map>
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
+// Number of persistent work groups launched per compute unit
+static int const kPersistentGroupsPerUnit = 32;
+// Vertex index bits of the second triangle of a pair, the rest keeps its vertex order (RR_TRIANGLE_PAIRS)
+static int const kPairVertexBits = 26;
 
 namespace RadeonRays
 {
@@ -48,17 +66,62 @@ namespace RadeonRays
         Calc::Buffer* vertices;
         // Indices
         Calc::Buffer* faces;
+        // Shape IDs of face ranges in leaf order
+        Calc::Buffer* shape_ranges;
+        // Leaf order faces of primitives looked up by hit hints
+        Calc::Buffer* hint_faces;
+        // Parent node indices (refit)
+        Calc::Buffer* parents;
+        // Leaf node indices (refit)
+        Calc::Buffer* leaves;
+        // Node visit counters (refit)
+        Calc::Buffer* flags;
+        // Number of leaves
+        int num_leaves;
+        // Ray batch counters (persistent threads), shared by all the launches
+        // so persistent queries are expected to be executed one at a time
+        Calc::Buffer* counters;
+        // Number of work groups filling the device (persistent threads)
+        int num_persistent_groups;
 
         Calc::Executable* executable;
         Calc::Function* isect_func;
         Calc::Function* occlude_func;
+        Calc::Function* refit_func;
+        Calc::Function* isect_persistent_func;
+        Calc::Function* occlude_persistent_func;
+        Calc::Function* isect_compact_func;
+        Calc::Function* isect_compact_persistent_func;
+        Calc::Function* occlude_bits_func;
+        Calc::Function* occlude_bits_persistent_func;
+        Calc::Function* isect_multi_func;
+        Calc::Function* proximity_func;
+        Calc::Function* ao_func;
 
         GpuData(Calc::Device* d)
             : device(d)
             , bvh(nullptr)
             , vertices(nullptr)
             , faces(nullptr)
+            , shape_ranges(nullptr)
+            , hint_faces(nullptr)
+            , parents(nullptr)
+            , leaves(nullptr)
+            , flags(nullptr)
+            , num_leaves(0)
+            , counters(nullptr)
+            , num_persistent_groups(0)
             , executable(nullptr)
+            , refit_func(nullptr)
+            , isect_persistent_func(nullptr)
+            , occlude_persistent_func(nullptr)
+            , isect_compact_func(nullptr)
+            , isect_compact_persistent_func(nullptr)
+            , occlude_bits_func(nullptr)
+            , occlude_bits_persistent_func(nullptr)
+            , isect_multi_func(nullptr)
+            , proximity_func(nullptr)
+            , ao_func(nullptr)
         {
         }
 
@@ -67,20 +130,218 @@ namespace RadeonRays
             device->DeleteBuffer(bvh);
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
+            device->DeleteBuffer(shape_ranges);
+            device->DeleteBuffer(hint_faces);
+            device->DeleteBuffer(parents);
+            device->DeleteBuffer(leaves);
+            device->DeleteBuffer(flags);
+            device->DeleteBuffer(counters);
+            ReleaseProgram();
+        }
+
+        void ReleaseProgram()
+        {
             if (executable)
             {
                 executable->DeleteFunction(isect_func);
                 executable->DeleteFunction(occlude_func);
+                if (refit_func)
+                {
+                    executable->DeleteFunction(refit_func);
+                }
+                if (isect_persistent_func)
+                {
+                    executable->DeleteFunction(isect_persistent_func);
+                    executable->DeleteFunction(occlude_persistent_func);
+                }
+                if (isect_compact_func)
+                {
+                    executable->DeleteFunction(isect_compact_func);
+                }
+                if (isect_compact_persistent_func)
+                {
+                    executable->DeleteFunction(isect_compact_persistent_func);
+                    executable->DeleteFunction(occlude_bits_persistent_func);
+                }
+                if (occlude_bits_func)
+                {
+                    executable->DeleteFunction(occlude_bits_func);
+                }
+                if (isect_multi_func)
+                {
+                    executable->DeleteFunction(isect_multi_func);
+                    executable->DeleteFunction(proximity_func);
+                    executable->DeleteFunction(ao_func);
+                }
                 device->DeleteExecutable(executable);
             }
+
+            executable = nullptr;
+            refit_func = nullptr;
+            isect_persistent_func = nullptr;
+            occlude_persistent_func = nullptr;
+            isect_compact_func = nullptr;
+            isect_compact_persistent_func = nullptr;
+            occlude_bits_func = nullptr;
+            occlude_bits_persistent_func = nullptr;
+            isect_multi_func = nullptr;
+            proximity_func = nullptr;
+            ao_func = nullptr;
         }
     };
 
-    IntersectorSkipLinks::IntersectorSkipLinks(Calc::Device* device)
+#ifndef RR_EMBED_KERNELS
+    // Kernel source to append hit callbacks to, includes are resolved by the compiler
+    static std::string LoadKernelSource(char const* filename)
+    {
+        std::ifstream in(filename, std::ios::in | std::ios::binary);
+        ThrowIf(!in, std::string("Can't open kernel source ") + filename);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+#endif
+
+    // Pair triangles sharing an edge greedily in face order, partner[i] receives the face
+    // paired with face i or -1. Faces sharing all three vertices are never paired
+    static void PairTriangles(Mesh const* mesh, std::vector<int>& partner)
+    {
+        int const numfaces = mesh->num_faces();
+        partner.assign(numfaces, -1);
+
+        // Unpaired face seen first with an edge
+        std::unordered_map<std::uint64_t, int> edges;
+        edges.reserve(3 * numfaces);
+
+        for (int i = 0; i < numfaces; ++i)
+        {
+            Mesh::Face const face = mesh->GetFace(i);
+
+            if (face.type_ != Mesh::FaceType::TRIANGLE)
+            {
+                continue;
+            }
+
+            for (int e = 0; e < 3 && partner[i] < 0; ++e)
+            {
+                std::uint32_t const a = (std::uint32_t)face.idx[e];
+                std::uint32_t const b = (std::uint32_t)face.idx[(e + 1) % 3];
+                std::uint64_t const key = ((std::uint64_t)std::min(a, b) << 32) | std::max(a, b);
+
+                auto iter = edges.find(key);
+
+                if (iter == edges.end())
+                {
+                    edges.emplace(key, i);
+                    continue;
+                }
+
+                int const other = iter->second;
+                int shared = 0;
+
+                if (other != i && partner[other] < 0)
+                {
+                    Mesh::Face const otherface = mesh->GetFace(other);
+
+                    for (int j = 0; j < 3; ++j)
+                    {
+                        shared += (otherface.idx[j] == face.idx[0] || otherface.idx[j] == face.idx[1] || otherface.idx[j] == face.idx[2]) ? 1 : 0;
+                    }
+                }
+
+                if (shared == 2)
+                {
+                    partner[i] = other;
+                    partner[other] = i;
+                }
+                else
+                {
+                    // The edge is left for later faces to pair with this one
+                    iter->second = i;
+                }
+            }
+        }
+    }
+
+    IntersectorSkipLinks::IntersectorSkipLinks(Calc::Device* device, bool precomputed_triangles)
         : Intersector(device)
         , m_gpudata(new GpuData(device))
         , m_bvh(nullptr)
+        , m_precomputed_triangles(precomputed_triangles)
+        , m_quads(false)
+        , m_triangle_pairs(false)
+        , m_packed_vertices(false)
+        , m_ordered_layouts(false)
+        , m_hit_hints(false)
+        , m_persistent_threads(false)
+        , m_program_stats(false)
+        , m_program_watertight(false)
+        , m_refined_stale(false)
     {
+        // Precomputed triangles are only implemented for OpenCL
+        ThrowIf(m_precomputed_triangles && device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Precomputed triangles are only supported by OpenCL devices");
+
+        CompileProgram("", "");
+
+        // Kernels reset counters back to zero once they are done
+        if (m_gpudata->isect_persistent_func)
+        {
+            int zeros[2] = { 0, 0 };
+            m_gpudata->counters = m_device->CreateBuffer(sizeof(zeros), Calc::BufferType::kWrite, zeros);
+        }
+    }
+
+    // Wait for a background build and free its tree, errors of dropped builds are ignored
+    static void DeleteBuiltBvh(std::future<Bvh*>& build)
+    {
+        try
+        {
+            delete build.get();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    IntersectorSkipLinks::~IntersectorSkipLinks()
+    {
+        DiscardRefinedBvh();
+
+        for (auto& build : m_discarded_bvhs)
+        {
+            DeleteBuiltBvh(build);
+        }
+    }
+
+    void IntersectorSkipLinks::DiscardRefinedBvh()
+    {
+        if (m_refined_bvh.valid())
+        {
+            m_discarded_bvhs.push_back(std::move(m_refined_bvh));
+        }
+
+        // Running builds are left to finish, nothing but the build itself owns their data
+        m_discarded_bvhs.erase(std::remove_if(m_discarded_bvhs.begin(), m_discarded_bvhs.end(), [](std::future<Bvh*>& build)
+        {
+            if (build.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            {
+                return false;
+            }
+
+            DeleteBuiltBvh(build);
+            return true;
+        }), m_discarded_bvhs.end());
+    }
+
+    void IntersectorSkipLinks::CompileProgram(std::string const& hit_callback, std::string const& hit_filter)
+    {
+        m_gpudata->ReleaseProgram();
+        m_hit_callback = hit_callback;
+        m_hit_filter = hit_filter;
+        m_program_stats = m_traversal_stats;
+        m_program_watertight = m_watertight;
+
+        auto device = m_device;
+
         std::string buildopts =
 #ifdef RR_RAY_MASK
             "-D RR_RAY_MASK ";
@@ -91,9 +352,89 @@ namespace RadeonRays
 #ifdef USE_SAFE_MATH
         buildopts.append("-D USE_SAFE_MATH ");
 #endif
-        
+
+        if (m_program_watertight)
+        {
+            buildopts.append("-D RR_WATERTIGHT ");
+        }
+
+        if (m_precomputed_triangles)
+        {
+            buildopts.append("-D RR_PRECOMPUTED_TRIANGLES ");
+        }
+
+        if (m_quads)
+        {
+            buildopts.append("-D RR_QUADS ");
+        }
+
+        if (m_packed_vertices)
+        {
+            buildopts.append("-D RR_PACKED_VERTICES ");
+        }
+
+        if (m_ordered_layouts)
+        {
+            buildopts.append("-D RR_ORDERED_LAYOUTS ");
+        }
+
+        if (m_triangle_pairs)
+        {
+            buildopts.append("-D RR_TRIANGLE_PAIRS ");
+        }
+
+        if (m_hit_hints)
+        {
+            buildopts.append("-D RR_HIT_HINTS ");
+        }
+
+        if (m_program_stats)
+        {
+            buildopts.append("-D RR_TRAVERSAL_STATS ");
+        }
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            buildopts.append("-D RR_GROUP_SIZE=" + std::to_string(m_local_size) + " ");
+
+            // Sub group traversal of the main kernels doesn't call hit callbacks and filters or count statistics
+            Calc::DeviceSpec spec;
+            device->GetSpec(spec);
+
+            if (spec.subgroups && hit_callback.empty() && hit_filter.empty() && !m_program_stats)
+            {
+                buildopts.append("-D RR_SUBGROUPS ");
+            }
+        }
+
+        // Callbacks and filters are compiled as a part of the traversal program source
+        if (!hit_callback.empty() || !hit_filter.empty())
+        {
+            ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL, "Hit callbacks and filters are only supported by OpenCL devices");
+
+            if (!hit_callback.empty())
+            {
+                buildopts.append("-D RR_HIT_CALLBACK ");
+            }
+
+            if (!hit_filter.empty())
+            {
+                buildopts.append("-D RR_HIT_FILTER ");
+            }
+
+#ifndef RR_EMBED_KERNELS
+            std::string source = LoadKernelSource("../RadeonRays/src/kernels/CL/intersect_bvh2_skiplinks.cl");
+#else
+            std::string source;
+#if USE_OPENCL
+            source = g_intersect_bvh2_skiplinks_opencl;
+#endif
+#endif
+            source.append("\n").append(hit_callback).append("\n").append(hit_filter).append("\n");
+            m_gpudata->executable = m_device->CompileExecutable(source.c_str(), source.size(), buildopts.c_str());
+        }
 #ifndef RR_EMBED_KERNELS
-        if ( device->GetPlatform() == Calc::Platform::kOpenCL )
+        else if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
             char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
 
@@ -108,7 +449,7 @@ namespace RadeonRays
         }
 #else
 #if USE_OPENCL
-        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        if (m_gpudata->executable == nullptr && device->GetPlatform() == Calc::Platform::kOpenCL)
         {
             m_gpudata->executable = m_device->CompileExecutable(g_intersect_bvh2_skiplinks_opencl, std::strlen(g_intersect_bvh2_skiplinks_opencl), buildopts.c_str());
         }
@@ -126,18 +467,141 @@ namespace RadeonRays
 
         m_gpudata->isect_func = m_gpudata->executable->CreateFunction("intersect_main");
         m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("occluded_main");
+
+        // BVH refit is only implemented for OpenCL vertices, otherwise it falls back to full rebuild
+        if (device->GetPlatform() == Calc::Platform::kOpenCL && !m_precomputed_triangles)
+        {
+            m_gpudata->refit_func = m_gpudata->executable->CreateFunction("refit_main");
+        }
+
+        // Compact hit formats, bit-packed occlusion, multi hit, proximity and ambient occlusion queries are only implemented for OpenCL
+        if (device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            m_gpudata->isect_compact_func = m_gpudata->executable->CreateFunction("intersect_compact_main");
+            m_gpudata->occlude_bits_func = m_gpudata->executable->CreateFunction("occluded_bits_main");
+            m_gpudata->isect_multi_func = m_gpudata->executable->CreateFunction("intersect_multi_main");
+            m_gpudata->proximity_func = m_gpudata->executable->CreateFunction("proximity_main");
+            m_gpudata->ao_func = m_gpudata->executable->CreateFunction("ambient_occlusion_main");
+        }
+
+        // Persistent threads need to know how many groups fill the device
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL && spec.max_compute_units > 0)
+        {
+            m_gpudata->isect_persistent_func = m_gpudata->executable->CreateFunction("intersect_main_persistent");
+            m_gpudata->occlude_persistent_func = m_gpudata->executable->CreateFunction("occluded_main_persistent");
+            m_gpudata->isect_compact_persistent_func = m_gpudata->executable->CreateFunction("intersect_compact_main_persistent");
+            m_gpudata->occlude_bits_persistent_func = m_gpudata->executable->CreateFunction("occluded_bits_main_persistent");
+            m_gpudata->num_persistent_groups = spec.max_compute_units * kPersistentGroupsPerUnit;
+        }
     }
 
     void IntersectorSkipLinks::Process(World const& world)
     {
+        // Callbacks, filters and statistics only change the program, the tree is kept
+        auto hitcallback = world.options_.GetOption(Options::kAccHitCallback);
+        std::string hit_callback = hitcallback ? hitcallback->AsString() : "";
+        auto hitfilter = world.options_.GetOption(Options::kAccHitFilter);
+        std::string hit_filter = hitfilter ? hitfilter->AsString() : "";
+
+        // Quads are intersected natively by OpenCL kernel, other platforms only see their first triangle
+        bool quads = false;
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            for (auto shape : world.shapes_)
+            {
+                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shape);
+                Mesh const* mesh = static_cast<Mesh const*>(shapeimpl->is_instance() ?
+                    static_cast<Instance const*>(shapeimpl)->GetBaseShape() : shape);
+                quads = quads || !mesh->puretriangle();
+            }
+        }
+
+        ThrowIf(quads && m_precomputed_triangles, "Precomputed triangles don't support quad faces");
+
+        // Packed vertices are only read by OpenCL kernels, precomputed triangles replace vertices altogether
+        auto packedvertices = world.options_.GetOption(Options::kBvhPackedVertices);
+        bool const packed_vertices = m_device->GetPlatform() == Calc::Platform::kOpenCL && !m_precomputed_triangles &&
+            packedvertices && packedvertices->AsFloat() > 0.f;
+
+        // Direction ordered node layouts are only read by OpenCL kernels
+        auto directionordered = world.options_.GetOption(Options::kBvhDirectionOrdered);
+        bool const ordered_layouts = m_device->GetPlatform() == Calc::Platform::kOpenCL &&
+            directionordered && directionordered->AsFloat() > 0.f;
+
+        // Triangle pairs take the place of the fourth quad index, precomputed triangles keep single triangles
+        auto trianglepairs = world.options_.GetOption(Options::kBvhTrianglePairs);
+        bool const triangle_pairs = m_device->GetPlatform() == Calc::Platform::kOpenCL && !m_precomputed_triangles && !quads &&
+            trianglepairs && trianglepairs->AsFloat() > 0.f;
+
+        // Hit hints need a primitive to face table built along with faces, hints are read by OpenCL kernels only
+        auto hithints = world.options_.GetOption(Options::kBvhHitHints);
+        bool const hit_hints = m_device->GetPlatform() == Calc::Platform::kOpenCL &&
+            hithints && hithints->AsFloat() > 0.f;
+
+        // Face layout changes with quads and triangle pairs, vertex layout with packing, node layout with direction
+        // ordering and precomputed triangle layout with watertight tests, so the tree has to be rebuilt
+        bool const layout_changed = quads != m_quads || triangle_pairs != m_triangle_pairs || packed_vertices != m_packed_vertices ||
+            ordered_layouts != m_ordered_layouts || hit_hints != m_hit_hints || (m_precomputed_triangles && m_watertight != m_program_watertight);
+
+        if (hit_callback != m_hit_callback || hit_filter != m_hit_filter || layout_changed ||
+            m_traversal_stats != m_program_stats || m_watertight != m_program_watertight)
+        {
+            m_quads = quads;
+            m_packed_vertices = packed_vertices;
+            m_ordered_layouts = ordered_layouts;
+            m_triangle_pairs = triangle_pairs;
+            m_hit_hints = hit_hints;
+            CompileProgram(hit_callback, hit_filter);
+        }
+
+        // Dispatch mode doesn't affect the data, so it can be switched at any commit
+        auto persistent = world.options_.GetOption(Options::kBvhPersistentThreads);
+        m_persistent_threads = m_gpudata->isect_persistent_func && persistent && persistent->AsFloat() > 0.f;
+
+        // Tree built in the background replaces the coarse one at the first commit after it's done unless
+        // faces have changed since, bounds of moved geometry are refitted once it's in
+        bool refine = false;
+
+        if (m_refined_bvh.valid() && !layout_changed && !world.has_changed())
+        {
+            m_refined_stale = m_refined_stale || world.GetStateChange() != ShapeImpl::kStateChangeNone;
+            refine = m_refined_bvh.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+                (!m_refined_stale || (m_gpudata->refit_func && !m_ordered_layouts));
+        }
+        else
+        {
+            DiscardRefinedBvh();
+        }
+
+        // Only transforms or vertex positions have changed: keep the topology and refit bounds,
+        // refit kernel only updates a single node layout
+        if (!refine && m_bvh && m_gpudata->refit_func && !m_ordered_layouts && !layout_changed && CanRefit(world))
+        {
+            Refit();
+            m_stats.refitted = 1;
+            return;
+        }
+
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        if (refine || !m_bvh || layout_changed || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
         {
             if (m_bvh)
             {
-                m_device->DeleteBuffer(m_gpudata->bvh);
-                m_device->DeleteBuffer(m_gpudata->vertices);
-                m_device->DeleteBuffer(m_gpudata->faces);
+                ReleaseBuffer(m_gpudata->bvh);
+                ReleaseBuffer(m_gpudata->vertices);
+                ReleaseBuffer(m_gpudata->faces);
+                ReleaseBuffer(m_gpudata->shape_ranges);
+                ReleaseBuffer(m_gpudata->hint_faces);
+                m_gpudata->hint_faces = nullptr;
+                ReleaseBuffer(m_gpudata->parents);
+                ReleaseBuffer(m_gpudata->leaves);
+                ReleaseBuffer(m_gpudata->flags);
+                m_gpudata->parents = nullptr;
+                m_gpudata->leaves = nullptr;
+                m_gpudata->flags = nullptr;
             }
 
             int numshapes = (int)world.shapes_.size();
@@ -149,36 +613,81 @@ namespace RadeonRays
             std::vector<int> mesh_faces_start_idx(numshapes);
 
             // Check options
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
-            auto nbins = world.options_.GetOption("bvh.sah.num_bins");
+            auto builder = world.options_.GetOption(Options::kBvhBuilder);
+            auto splits = world.options_.GetOption(Options::kBvhSahUseSplits);
+            auto maxdepth = world.options_.GetOption(Options::kBvhSahMaxSplitDepth);
+            auto overlap = world.options_.GetOption(Options::kBvhSahMinOverlap);
+            auto tcost = world.options_.GetOption(Options::kBvhSahTraversalCost);
+            auto node_budget = world.options_.GetOption(Options::kBvhSahExtraNodeBudget);
+            auto nbins = world.options_.GetOption(Options::kBvhSahNumBins);
+            auto sahtop = world.options_.GetOption(Options::kBvhLbvhSahTop);
+            auto area_order = world.options_.GetOption(Options::kBvhOcclusionAreaOrder);
+            auto leafsize = world.options_.GetOption(Options::kBvhMaxLeafSize);
+            auto numthreads = world.options_.GetOption(Options::kBvhNumThreads);
 
             bool use_sah = false;
             bool use_splits = false;
+            bool use_lbvh = false;
             int max_split_depth = maxdepth ? (int)maxdepth->AsFloat() : 10;
             int num_bins = nbins ? (int)nbins->AsFloat() : 64;
             float min_overlap = overlap ? overlap->AsFloat() : 0.05f;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
             float extra_node_budget = node_budget ? node_budget->AsFloat() : 0.5f;
+            bool use_sah_top = !sahtop || sahtop->AsFloat() > 0.f;
+            bool use_area_order = area_order && area_order->AsFloat() > 0.f;
+            int max_leaf_size = leafsize ? (int)leafsize->AsFloat() : 1;
+            int num_threads = numthreads ? (int)numthreads->AsFloat() : 0;
 
             if (builder && builder->AsString() == "sah")
             {
                 use_sah = true;
             }
+            else if (builder && builder->AsString() == "lbvh")
+            {
+                use_lbvh = true;
+            }
 
             if (splits && splits->AsFloat() > 0.f)
             {
                 use_splits = true;
             }
 
-            m_bvh.reset( use_splits ?
-                new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
-                new Bvh(traversal_cost, num_bins, use_sah)
-            );
+            // Background built tree only needs to be translated and uploaded,
+            // any other rebuild makes it outdated
+            bool const refined_stale = refine && m_refined_stale;
+
+            if (refine)
+            {
+                m_bvh.reset(m_refined_bvh.get());
+                m_refined_stale = false;
+            }
+            else
+            {
+                DiscardRefinedBvh();
+
+                m_bvh.reset(use_lbvh ?
+                    new LinearBvh(traversal_cost, num_bins, use_sah_top) :
+                    use_splits ?
+                    new SplitBvh(traversal_cost, num_bins, max_split_depth, min_overlap, extra_node_budget) :
+                    new Bvh(traversal_cost, num_bins, use_sah)
+                );
+            }
+
+            // Leaves keep primitive count in 4 bits of the node, multi primitive
+            // leaves are only traversed by OpenCL kernel
+            int leaf_size = m_device->GetPlatform() == Calc::Platform::kOpenCL ? std::min(std::max(max_leaf_size, 1), 15) : 1;
+
+            // Binned builder with single primitive leaves writes skip link nodes
+            // directly, there is no pointer tree to translate then (nor to rotate for ray samples)
+            bool build_flat = !refine && !use_lbvh && !use_splits && leaf_size == 1 && !world.ray_samples_;
+
+            if (!refine)
+            {
+                m_bvh->SetMaxLeafSize(leaf_size);
+                m_bvh->SetAreaOrder(use_area_order);
+                m_bvh->SetNumThreads(num_threads);
+                ApplyRaySamples(*m_bvh, world);
+            }
 
             // Partition the array into meshes and instances
             std::vector<Shape const*> shapes(world.shapes_);
@@ -217,20 +726,19 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
+            auto start = Clock::now();
+
             // We can't avoild allocating it here, since bounds aren't stored anywhere
             std::vector<bbox> bounds(numfaces);
 
             // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
+            // Faces of large meshes are gathered in parallel
             for (int i = 0; i < nummeshes; ++i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                for (int j = 0; j < mesh->num_faces(); ++j)
-                {
-                    // Here we directly get world space bounds
-                    mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
-                }
+                // Here we directly get world space bounds
+                mesh->GetAllFaceBounds(false, bounds.data() + mesh_faces_start_idx[i]);
             }
 
             // Then we handle instances. Need to flatten them into actual geometry.
@@ -245,84 +753,308 @@ namespace RadeonRays
                 matrix m, minv;
                 instance->GetTransform(m, minv);
 
+                bbox* meshbounds = bounds.data() + mesh_faces_start_idx[i];
+                mesh->GetAllFaceBounds(true, meshbounds);
+
                 for (int j = 0; j < mesh->num_faces(); ++j)
                 {
-                    bbox tmp;
-                    mesh->GetFaceBounds(j, true, tmp);
-                    bounds[mesh_faces_start_idx[i] + j] = transform_bbox(tmp, m);
+                    meshbounds[j] = transform_bbox(meshbounds[j], m);
                 }
             }
 
-            m_bvh->Build(&bounds[0], numfaces);
+            // Triangles sharing an edge are merged into pairs the tree is built over, primfaces
+            // keeps the first and the second (or -1) face index of each primitive
+            std::vector<std::pair<int, int>> primfaces;
+            int numprims = numfaces;
+
+            if (m_triangle_pairs)
+            {
+                ThrowIf(numvertices >= (1 << kPairVertexBits), "Triangle pairs support up to 2^26 vertices");
+
+                // Instances share the pairing of their base mesh
+                std::unordered_map<Mesh const*, std::vector<int>> partners;
+                primfaces.reserve(numfaces);
+
+                for (int i = 0; i < nummeshes + numinstances; ++i)
+                {
+                    Mesh const* mesh = i < nummeshes ? static_cast<Mesh const*>(shapes[i]) :
+                        static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
+
+                    auto iter = partners.find(mesh);
+                    if (iter == partners.end())
+                    {
+                        iter = partners.emplace(mesh, std::vector<int>()).first;
+                        PairTriangles(mesh, iter->second);
+                    }
+
+                    auto const& partner = iter->second;
+                    int const first = mesh_faces_start_idx[i];
+
+                    for (int j = 0; j < mesh->num_faces(); ++j)
+                    {
+                        if (partner[j] < 0)
+                        {
+                            primfaces.push_back(std::make_pair(first + j, -1));
+                        }
+                        else if (partner[j] > j)
+                        {
+                            bounds[first + j].grow(bounds[first + partner[j]]);
+                            primfaces.push_back(std::make_pair(first + j, first + partner[j]));
+                        }
+                    }
+                }
+
+                // Primitives never come before their first face, so bounds are packed in place
+                numprims = (int)primfaces.size();
+                for (int i = 0; i < numprims; ++i)
+                {
+                    bounds[i] = bounds[primfaces[i].first];
+                }
+                bounds.resize(numprims);
+            }
+
+            m_stats.bounds_time = GetElapsedTime(start);
+            start = Clock::now();
+
+            // Try to map previously built BVH for the same bounds and build options
+            std::unique_ptr<BvhCache> cache = CreateBvhCache(world);
+            std::unique_ptr<BvhCache::Entry> entry;
+            // Held while building, so that processes sharing the cache build the BVH once
+            std::unique_ptr<BvhCache::BuildLock> buildlock;
+            std::uint64_t cachekey = 0;
+
+            if (cache)
+            {
+                float const buildopts[] = { use_lbvh ? (use_sah_top ? 3.f : 2.f) : use_sah ? 1.f : 0.f, use_splits ? 1.f : 0.f, (float)max_split_depth,
+                    (float)num_bins, min_overlap, traversal_cost, extra_node_budget, (float)max_leaf_size, use_area_order ? 1.f : 0.f, m_triangle_pairs ? 1.f : 0.f };
+
+                cachekey = BvhCache::Hash(&bounds[0], numprims * sizeof(bbox));
+                cachekey = BvhCache::Hash(buildopts, sizeof(buildopts), cachekey);
+                entry = cache->Load(cachekey, BvhCache::kPlain, sizeof(PlainBvhTranslator::Node), numprims);
+
+                // Another process might be building it, wait and look again
+                if (!entry && (buildlock = cache->LockBuild(cachekey)))
+                {
+                    entry = cache->Load(cachekey, BvhCache::kPlain, sizeof(PlainBvhTranslator::Node), numprims);
+                }
+            }
+
+            // Progressive builds start with a LBVH and build the configured tree in the background
+            // from a copy of the bounds, trees found in the cache are complete already
+            auto progressive = world.options_.GetOption(Options::kBvhProgressive);
+            bool const coarse = !entry && !refine && !use_lbvh && !world.ray_samples_ && progressive && progressive->AsFloat() > 0.f;
+
+            if (coarse)
+            {
+                Bvh* refined = m_bvh.release();
+
+                m_refined_bvh = std::async(std::launch::async, [refined](std::vector<bbox> const& primbounds) -> Bvh*
+                {
+                    std::unique_ptr<Bvh> bvh(refined);
+                    bvh->Build(primbounds.data(), (int)primbounds.size());
+                    return bvh.release();
+                }, bounds);
+                m_refined_stale = false;
+
+                m_bvh.reset(new LinearBvh(traversal_cost, num_bins, use_sah_top));
+                m_bvh->SetMaxLeafSize(leaf_size);
+                m_bvh->SetAreaOrder(use_area_order);
+                m_bvh->SetNumThreads(num_threads);
+                build_flat = false;
+            }
 
-#ifdef RR_PROFILE
-            m_bvh->PrintStatistics(std::cout);
-#endif
             PlainBvhTranslator translator;
-            translator.Process(*m_bvh);
+            PlainBvhTranslator::Node const* nodes = nullptr;
+            int numnodes = 0;
+            // Reordered face indices
+            int const* reordering = nullptr;
+            // This number is different from the number of faces for some BVHs
+            int numindices = 0;
+
+            if (entry)
+            {
+                auto const& header = entry->GetHeader();
+                nodes = static_cast<PlainBvhTranslator::Node const*>(entry->GetNodes());
+                numnodes = header.num_nodes;
+                reordering = entry->GetIndices();
+                numindices = header.num_indices;
+
+                m_stats.build_time = GetElapsedTime(start);
+                m_stats.num_nodes = header.num_nodes;
+                m_stats.num_leaves = header.num_leaves;
+                m_stats.height = header.height;
+                m_stats.sah_cost = header.sah_cost;
+            }
+            else if (build_flat)
+            {
+                translator.Build(*m_bvh, &bounds[0], numprims);
 
-            // Update GPU data
-            // Copy translated nodes first
-            m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
+                m_stats.build_time = GetElapsedTime(start);
+                SetBvhStatistics(*m_bvh);
 
-            // Create vertex buffer
+#ifdef RR_PROFILE
+                m_bvh->PrintStatistics(std::cout);
+#endif
+
+                nodes = &translator.nodes_[0];
+                numnodes = (int)translator.nodes_.size();
+                reordering = m_bvh->GetIndices();
+                numindices = (int)m_bvh->GetNumIndices();
+            }
+            else
             {
-                // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                if (!refine)
+                {
+                    m_bvh->Build(&bounds[0], numprims);
+                }
 
-                // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
-                Calc::Event* e = nullptr;
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_stats.build_time = GetElapsedTime(start);
+                SetBvhStatistics(*m_bvh);
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+#ifdef RR_PROFILE
+                m_bvh->PrintStatistics(std::cout);
+#endif
+                start = Clock::now();
 
-                // Here we need to put data in world space rather than object space
-                // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
+                // Subtrees are translated in parallel and each finished range of nodes
+                // is uploaded on a secondary queue while the rest is being translated.
+                // Direction ordered layouts need the whole tree and are uploaded below
+                Calc::DeviceSpec spec;
+                m_device->GetSpec(spec);
+                std::uint32_t const copy_queue = spec.max_num_queues > 1 ? 1 : 0;
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                if (!m_ordered_layouts)
                 {
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    mesh->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    m_stats.nodes_bytes = m_bvh->GetNodeCount() * sizeof(PlainBvhTranslator::Node);
+                    m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead | Calc::BufferType::kWrite);
+                }
+
+                std::mutex upload_mutex;
+                std::vector<Calc::Event*> upload_events;
+
+                {
+                    task_scheduler scheduler(num_threads);
+
+                    translator.Process(*m_bvh, &scheduler, m_ordered_layouts ? PlainBvhTranslator::RangeCallback() : [&](int first, int count)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
-                    }
+                        std::lock_guard<std::mutex> lock(upload_mutex);
+                        Calc::Event* e = nullptr;
+                        m_device->WriteBuffer(m_gpudata->bvh, copy_queue, first * sizeof(PlainBvhTranslator::Node),
+                            count * sizeof(PlainBvhTranslator::Node), &translator.nodes_[first], &e);
+                        m_device->Flush(copy_queue);
+                        upload_events.push_back(e);
+                    });
                 }
 
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                nodes = &translator.nodes_[0];
+                numnodes = (int)translator.nodes_.size();
+                reordering = m_bvh->GetIndices();
+                numindices = (int)m_bvh->GetNumIndices();
+
+                m_stats.translate_time = GetElapsedTime(start);
+                start = Clock::now();
+
+                // Translated nodes have to stay around until the uploads are done
+                if (!upload_events.empty())
+                {
+                    m_device->WaitForMultipleEvents(&upload_events[0], upload_events.size());
+                }
+
+                for (auto e : upload_events)
+                {
+                    m_device->DeleteEvent(e);
+                }
+
+                m_stats.upload_time = GetElapsedTime(start);
+            }
+
+            // Coarse trees aren't built with the options of the key, refined ones were built from older bounds if stale
+            if (cache && !entry && !coarse && !refined_stale)
+            {
+                auto header = BvhCache::CreateHeader(cachekey, BvhCache::kPlain, sizeof(PlainBvhTranslator::Node), numprims, numnodes, numindices);
+                header.num_leaves = m_stats.num_leaves;
+                header.height = m_stats.height;
+                header.sah_cost = m_stats.sah_cost;
+                cache->Store(header, nodes, reordering);
+                buildlock.reset();
+            }
+
+            start = Clock::now();
+
+            // Update GPU data
+            // Copy cached or directly built nodes first (refit is writing them back),
+            // translated ones have been uploaded already unless they are laid out per ray octant
+            if (m_ordered_layouts)
+            {
+                std::vector<PlainBvhTranslator::Node> layouts;
+                PlainBvhTranslator::CreateOrderedLayouts(nodes, numnodes, layouts);
+                m_stats.nodes_bytes = layouts.size() * sizeof(PlainBvhTranslator::Node);
+                m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead, &layouts[0]);
+            }
+            else if (entry || build_flat)
+            {
+                m_stats.nodes_bytes = numnodes * sizeof(PlainBvhTranslator::Node);
+                m_gpudata->bvh = AcquireBuffer(m_stats.nodes_bytes, Calc::BufferType::kRead | Calc::BufferType::kWrite, const_cast<PlainBvhTranslator::Node*>(nodes));
+            }
+
+            // Keep vertex layout around for refits
+            m_shapes = shapes;
+            m_vertex_start.assign(mesh_vertices_start_idx.cbegin(), mesh_vertices_start_idx.cend());
+            m_vertex_start.push_back(numvertices);
+
+            // Build parent links and leaf list for refits
+            if (m_gpudata->refit_func && !m_ordered_layouts)
+            {
+                std::vector<int> parents(numnodes, -1);
+                std::vector<int> leaves;
+
+                for (int i = 0; i < numnodes; ++i)
                 {
-                    Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                    // Get the mesh
-                    Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
-                    // Get mesh transform
-                    instance->GetTransform(m, minv);
-
-                    //#pragma omp parallel for
-                    // Iterate thru vertices multiply and append them to GPU buffer
-                    for (int j = 0; j < mesh->num_vertices(); ++j)
+                    if (nodes[i].bounds.pmin.w != -1.f)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        leaves.push_back(i);
+                    }
+                    else
+                    {
+                        // Left child is next to the node, right one is where left child skips to
+                        int lc = i + 1;
+                        int rc = (int)nodes[lc].bounds.pmax.w;
+                        parents[lc] = i;
+                        parents[rc] = i;
                     }
                 }
 
-                m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
+                std::vector<int> flags(numnodes, 0);
+                m_gpudata->num_leaves = (int)leaves.size();
+                m_gpudata->parents = AcquireBuffer(numnodes * sizeof(int), Calc::BufferType::kRead, &parents[0]);
+                m_gpudata->leaves = AcquireBuffer(leaves.size() * sizeof(int), Calc::BufferType::kRead, &leaves[0]);
+                m_gpudata->flags = AcquireBuffer(numnodes * sizeof(int), Calc::BufferType::kRead | Calc::BufferType::kWrite, &flags[0]);
+                m_stats.other_bytes = (2 * numnodes + leaves.size()) * sizeof(int);
+            }
+
+            // World space vertices to build triangles from
+            std::vector<float3> worldvertices;
+            // Vertex indices of faces in leaf order
+            std::vector<int> triangleindices;
 
-                e->Wait();
-                m_device->DeleteEvent(e);
+            if (m_precomputed_triangles)
+            {
+                worldvertices.resize(numvertices);
+                triangleindices.resize(3 * numindices);
+
+#pragma omp parallel for
+                for (int i = 0; i < nummeshes + numinstances; ++i)
+                {
+                    GetWorldSpaceVertices(shapes[i], &worldvertices[mesh_vertices_start_idx[i]]);
+                }
+            }
+            // Create vertex buffer
+            else
+            {
+                // Vertices in world space rather than object space
+                m_gpudata->vertices = AcquireBuffer(numvertices * GetVertexSize(m_packed_vertices), Calc::BufferType::kRead);
+                m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start,
+                    0, nummeshes + numinstances - 1, m_packed_vertices, false);
             }
 
             // Create face buffer
@@ -331,36 +1063,44 @@ namespace RadeonRays
                 {
                     // Up to 3 indices
                     int idx[3];
-                    // Shape maks
-                    int shape_mask;
-                    // Shape ID
-                    int shape_id;
-                    // Primitive ID
+                    // Primitive ID within the mesh
                     int prim_id;
+                    // Fourth vertex index of quads, -1 for triangles (RR_QUADS only) or the vertex of
+                    // the second triangle of a pair with its vertex order, -1 for single triangles (RR_TRIANGLE_PAIRS only)
+                    int idx3;
+                    // Primitive ID of the second triangle of a pair (RR_TRIANGLE_PAIRS only)
+                    int prim_id2;
                 };
 
-                // This number is different from the number of faces for some BVHs
-                auto numindices = m_bvh->GetNumIndices();
+                // Faces without quads or pairs don't carry the last two fields
+                size_t const facesize = m_quads || m_triangle_pairs ? sizeof(Face) : offsetof(Face, idx3);
+
                 // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+                m_stats.faces_bytes = numindices * facesize;
+                m_gpudata->faces = AcquireBuffer(numindices * facesize, Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
-                Face* facedata = nullptr;
+                char* facebytes = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * facesize, Calc::BufferType::kWrite, (void**)&facebytes, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
+                // Shape IDs are constant per mesh, so faces only keep their primitive IDs
+                // and shape IDs go to a table of face ranges
+                std::vector<int> face_shape_ids(numindices);
+                // Leaf order face of every primitive, numbered as faces of shapes in world order
+                std::vector<int> prim_faces(m_hit_hints ? numfaces : 0, -1);
+
                 // Here the point is to add mesh starting index to actual index contained within the mesh,
                 // getting absolute index in the buffer.
                 // Besides that we need to permute the faces accorningly to BVH reordering, whihc
                 // is contained within bvh.primids_
-                int const* reordering = m_bvh->GetIndices();
                 for (int i = 0; i < numindices; ++i)
                 {
-                    int indextolook4 = reordering[i];
+                    int indextolook4 = m_triangle_pairs ? primfaces[reordering[i]].first : reordering[i];
 
                     // We need to find a shape corresponding to current face
                     auto iter = std::upper_bound(mesh_faces_start_idx.cbegin(), mesh_faces_start_idx.cend(), indextolook4);
@@ -379,38 +1119,238 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
-
-                    // Optimization: we are putting faceid here
-                    facedata[i].shape_id = shapes[shapeidx]->GetId();
-                    facedata[i].shape_mask = shapes[shapeidx]->GetMask();
-                    facedata[i].prim_id = faceidx;
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
+                    Face* face = reinterpret_cast<Face*>(facebytes + i * facesize);
+                    face->idx[0] = myface.idx[0] + mystartidx;
+                    face->idx[1] = myface.idx[1] + mystartidx;
+                    face->idx[2] = myface.idx[2] + mystartidx;
+
+                    face->prim_id = faceidx;
+                    face_shape_ids[i] = shapes[shapeidx]->GetId();
+
+                    if (m_hit_hints)
+                    {
+                        prim_faces[indextolook4] = i;
+                    }
+
+                    if (m_quads)
+                    {
+                        face->idx3 = myface.type_ == Mesh::FaceType::QUAD ? myface.idx[3] + mystartidx : -1;
+                        face->prim_id2 = 0;
+                    }
+
+                    if (m_triangle_pairs)
+                    {
+                        int const second = primfaces[reordering[i]].second;
+                        face->idx3 = -1;
+                        face->prim_id2 = -1;
+
+                        if (second >= 0)
+                        {
+                            // Vertices of the second triangle are given by their slots among the first
+                            // triangle vertices and the one it doesn't share
+                            Mesh::Face const otherface = mesh->GetFace(second - mesh_faces_start_idx[shapeidx]);
+                            int vertex = 0;
+                            int slots = 0;
+
+                            for (int j = 0; j < 3; ++j)
+                            {
+                                int const idx = otherface.idx[j];
+                                int const slot = idx == myface.idx[0] ? 0 : idx == myface.idx[1] ? 1 : idx == myface.idx[2] ? 2 : 3;
+                                vertex = slot == 3 ? idx + mystartidx : vertex;
+                                slots |= slot << (2 * j);
+                            }
+
+                            face->idx3 = (int)((std::uint32_t)vertex | ((std::uint32_t)slots << kPairVertexBits));
+                            face->prim_id2 = second - mesh_faces_start_idx[shapeidx];
+
+                            if (m_hit_hints)
+                            {
+                                prim_faces[second] = i;
+                            }
+                        }
+                    }
+
+                    if (m_precomputed_triangles)
+                    {
+                        triangleindices[3 * i] = face->idx[0];
+                        triangleindices[3 * i + 1] = face->idx[1];
+                        triangleindices[3 * i + 2] = face->idx[2];
+                    }
                 }
 
-                m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
+                m_device->UnmapBuffer(m_gpudata->faces, 0, facebytes, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
+
+                std::vector<int> shape_ranges;
+                PackShapeRanges(face_shape_ids, shape_ranges);
+
+                m_stats.faces_bytes += shape_ranges.size() * sizeof(int);
+                m_gpudata->shape_ranges = AcquireBuffer(shape_ranges.size() * sizeof(int), Calc::BufferType::kRead, &shape_ranges[0]);
+
+                if (m_hit_hints)
+                {
+                    // Shapes sorted by ID with their primitive ranges, then the faces of all primitives
+                    std::vector<int> order(nummeshes + numinstances);
+                    std::iota(order.begin(), order.end(), 0);
+                    std::sort(order.begin(), order.end(), [&shapes](int a, int b) { return shapes[a]->GetId() < shapes[b]->GetId(); });
+
+                    std::vector<int> hint_faces(1 + 3 * numshapes);
+                    hint_faces[0] = numshapes;
+
+                    for (int i = 0; i < numshapes; ++i)
+                    {
+                        int const shapeidx = order[i];
+                        int const end = shapeidx + 1 < numshapes ? mesh_faces_start_idx[shapeidx + 1] : numfaces;
+                        hint_faces[1 + i] = shapes[shapeidx]->GetId();
+                        hint_faces[1 + numshapes + i] = mesh_faces_start_idx[shapeidx];
+                        hint_faces[1 + 2 * numshapes + i] = end - mesh_faces_start_idx[shapeidx];
+                    }
+
+                    hint_faces.insert(hint_faces.end(), prim_faces.cbegin(), prim_faces.cend());
+
+                    m_stats.faces_bytes += hint_faces.size() * sizeof(int);
+                    m_gpudata->hint_faces = AcquireBuffer(hint_faces.size() * sizeof(int), Calc::BufferType::kRead, &hint_faces[0]);
+                }
+            }
+
+            // Triangles take the place of vertices
+            if (m_precomputed_triangles)
+            {
+                m_stats.vertices_bytes = 3 * numindices * sizeof(float3);
+                m_gpudata->vertices = CreateTriangleBuffer(&worldvertices[0], &triangleindices[0], numindices);
             }
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            m_stats.upload_time += GetElapsedTime(start);
+
+            // Nodes have bounds of the geometry the background build started with
+            if (refined_stale)
+            {
+                Refit(true);
+            }
         }
     }
 
+    void IntersectorSkipLinks::Refit(bool force)
+    {
+        // Find the range of shapes with changed geometry
+        int numshapes = (int)m_shapes.size();
+        int first = numshapes;
+        int last = -1;
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            if (HasGeometryChanged(m_shapes[i]))
+            {
+                first = std::min(first, i);
+                last = i;
+            }
+        }
+
+        if (last < 0 && !force)
+        {
+            return;
+        }
+
+        auto start = Clock::now();
+
+        // Upload new world space vertices for the range
+        if (last >= 0)
+        {
+            m_stats.vertices_bytes = UploadWorldSpaceVertices(m_gpudata->vertices, m_shapes, m_vertex_start, first, last, m_packed_vertices, true);
+        }
+
+        m_stats.upload_time = GetElapsedTime(start);
+        start = Clock::now();
+
+        // Propagate leaf bounds up the tree
+        auto& func = m_gpudata->refit_func;
+
+        int arg = 0;
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->parents);
+        func->SetArg(arg++, m_gpudata->leaves);
+        func->SetArg(arg++, sizeof(int), &m_gpudata->num_leaves);
+        func->SetArg(arg++, m_gpudata->flags);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((m_gpudata->num_leaves + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        m_timer->Execute("refit", func, 0, globalsize, localsize, nullptr);
+
+        m_device->Finish(0);
+
+        m_stats.build_time = GetElapsedTime(start);
+    }
+
+    bool IntersectorSkipLinks::SupportsCompactHits() const
+    {
+        return m_gpudata->isect_compact_func != nullptr;
+    }
+
+    bool IntersectorSkipLinks::SupportsOcclusionBits() const
+    {
+        return m_gpudata->occlude_bits_func != nullptr;
+    }
+
+    bool IntersectorSkipLinks::SupportsTraversalStats() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool IntersectorSkipLinks::SupportsWatertight() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool IntersectorSkipLinks::SupportsHitCallback() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    bool IntersectorSkipLinks::SupportsLocalSize() const
+    {
+        return m_device->GetPlatform() == Calc::Platform::kOpenCL;
+    }
+
+    void IntersectorSkipLinks::OnLocalSizeChanged()
+    {
+        CompileProgram(m_hit_callback, m_hit_filter);
+    }
+
+    size_t IntersectorSkipLinks::GetGlobalSize(std::uint32_t max_rays) const
+    {
+        int num_groups = static_cast<int>((max_rays + m_local_size - 1) / m_local_size);
+
+        // Persistent groups are fetching rays until all of them are done,
+        // so there is no need to launch more of them than the device can run
+        if (m_persistent_threads)
+        {
+            num_groups = std::min(num_groups, m_gpudata->num_persistent_groups);
+        }
+
+        return num_groups * m_local_size;
+    }
+
     void IntersectorSkipLinks::Intersect(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->isect_func;
+        bool const compact = m_hit_format != kHitFormatFull;
+        auto& func = m_persistent_threads ?
+            (compact ? m_gpudata->isect_compact_persistent_func : m_gpudata->isect_persistent_func) :
+            (compact ? m_gpudata->isect_compact_func : m_gpudata->isect_func);
 
         // Set args
         int arg = 0;
@@ -418,34 +1358,176 @@ namespace RadeonRays
         func->SetArg(arg++, m_gpudata->bvh);
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shape_ranges);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        if (m_persistent_threads)
+        {
+            func->SetArg(arg++, m_gpudata->counters);
+        }
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        if (compact)
+        {
+            int format = m_hit_format;
+            int plane_size = static_cast<int>(maxrays);
+            func->SetArg(arg++, sizeof(format), &format);
+            func->SetArg(arg++, sizeof(plane_size), &plane_size);
+        }
+
+        // Filters without data still need a valid buffer argument
+        if (!m_hit_filter.empty())
+        {
+            func->SetArg(arg++, m_filter_data ? m_filter_data : GetRayCountBuffer(queueidx));
+        }
+
+        // Without a hint buffer kernels get a valid one and no hints to read
+        if (m_hit_hints)
+        {
+            int num_hints = m_hint_buffer ? static_cast<int>(m_hint_buffer->GetSize() / sizeof(Intersection)) : 0;
+            func->SetArg(arg++, m_hint_buffer ? m_hint_buffer : GetRayCountBuffer(queueidx));
+            func->SetArg(arg++, sizeof(num_hints), &num_hints);
+            func->SetArg(arg++, m_gpudata->hint_faces);
+        }
+
+        SetTraversalStatsArgs(func, arg);
+
+        size_t localsize = m_local_size;
+        size_t globalsize = GetGlobalSize(maxrays);
+
+        ExecuteQuery("intersect", func, queueidx, numrays, globalsize, localsize, event);
     }
 
     void IntersectorSkipLinks::Occluded(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        // Every work group packs whole words
+        ThrowIf(m_occlusion_bits && m_local_size % 32 != 0, "Bit-packed occlusion results need work group sizes of multiples of 32");
+
+        auto& func = m_occlusion_bits ?
+            (m_persistent_threads ? m_gpudata->occlude_bits_persistent_func : m_gpudata->occlude_bits_func) :
+            (m_persistent_threads ? m_gpudata->occlude_persistent_func : m_gpudata->occlude_func);
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shape_ranges);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, hits);
+
+        if (m_persistent_threads)
+        {
+            func->SetArg(arg++, m_gpudata->counters);
+        }
+
+        if (!m_hit_filter.empty())
+        {
+            func->SetArg(arg++, m_filter_data ? m_filter_data : GetRayCountBuffer(queueidx));
+        }
+
+        SetTraversalStatsArgs(func, arg);
+
+        size_t localsize = m_local_size;
+        size_t globalsize = GetGlobalSize(maxrays);
+
+        ExecuteQuery("occlude", func, queueidx, numrays, globalsize, localsize, event);
+    }
+
+    void IntersectorSkipLinks::MultiHit(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, std::uint32_t k, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->isect_multi_func, "Multi hit queries are only supported by bvh accelerator on OpenCL devices");
+
+        auto& func = m_gpudata->isect_multi_func;
 
         // Set args
         int arg = 0;
+        int numhits = static_cast<int>(k);
 
         func->SetArg(arg++, m_gpudata->bvh);
         func->SetArg(arg++, m_gpudata->vertices);
         func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shape_ranges);
         func->SetArg(arg++, rays);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
+        func->SetArg(arg++, sizeof(numhits), &numhits);
 
+        if (!m_hit_filter.empty())
+        {
+            func->SetArg(arg++, m_filter_data ? m_filter_data : GetRayCountBuffer(queueidx));
+        }
+
+        // Every ray gets its own work item, persistent threads are not used here
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        ExecuteQuery("multi_hit", func, queueidx, numrays, globalsize, localsize, event);
     }
 
+    void IntersectorSkipLinks::Proximity(std::uint32_t queueidx, Calc::Buffer const* spheres, Calc::Buffer const* numspheres, std::uint32_t maxspheres, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->proximity_func, "Proximity queries are only supported by bvh accelerator on OpenCL devices");
+
+        auto& func = m_gpudata->proximity_func;
+
+        // Set args
+        int arg = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shape_ranges);
+        func->SetArg(arg++, spheres);
+        func->SetArg(arg++, numspheres);
+        func->SetArg(arg++, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxspheres + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ExecuteQuery("proximity", func, queueidx, numspheres, globalsize, localsize, event);
+    }
+
+    void IntersectorSkipLinks::AmbientOcclusion(std::uint32_t queueidx, Calc::Buffer const* points, Calc::Buffer const* numpoints, std::uint32_t maxpoints, std::uint32_t numsamples, float radius, std::uint32_t seed, Calc::Buffer* visibility, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        ThrowIf(!m_gpudata->ao_func, "Ambient occlusion queries are only supported by bvh accelerator on OpenCL devices");
+
+        auto& func = m_gpudata->ao_func;
+
+        // Set args
+        int arg = 0;
+        int samples = static_cast<int>(numsamples);
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, points);
+        func->SetArg(arg++, numpoints);
+        func->SetArg(arg++, sizeof(samples), &samples);
+        func->SetArg(arg++, sizeof(radius), &radius);
+        func->SetArg(arg++, sizeof(seed), &seed);
+        func->SetArg(arg++, visibility);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxpoints + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        ExecuteQuery("ambient_occlusion", func, queueidx, numpoints, globalsize, localsize, event);
+    }
+
+    void IntersectorSkipLinks::GetMemoryUsageImpl(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.nodes_bytes, m_gpudata->bvh);
+        AddBufferBytes(usage.vertices_bytes, m_gpudata->vertices);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->faces);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->shape_ranges);
+        AddBufferBytes(usage.faces_bytes, m_gpudata->hint_faces);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->parents);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->leaves);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->flags);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->counters);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
 }
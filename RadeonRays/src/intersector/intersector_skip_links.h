@@ -54,7 +54,8 @@ THE SOFTWARE.
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
     Cons:
-        -Travesal order is fixed, so poor algorithmic characteristics.
+        -Travesal order is fixed, so poor algorithmic characteristics
+         (fixed per ray direction octant with "bvh.direction_ordered" at 8x node memory).
         -Does not benefit from BVH quality optimizations.
  */
  
@@ -62,7 +63,9 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "intersector.h"
+#include <future>
 #include <memory>
+#include <vector>
 
 namespace RadeonRays
 {
@@ -74,12 +77,16 @@ namespace RadeonRays
     class IntersectorSkipLinks : public Intersector
     {
     public:
-        // Constructor
-        IntersectorSkipLinks(Calc::Device* device);
+        // Constructor, precomputed triangles trade memory for a single fetch per triangle but can't be refitted
+        IntersectorSkipLinks(Calc::Device* device, bool precomputed_triangles = false);
+        // Destructor, waits for background builds
+        ~IntersectorSkipLinks() override;
 
     private:
         // Preprocess implementation
         void Process(World const& world) override;
+        // Memory usage implementation
+        void GetMemoryUsageImpl(MemoryUsage& usage) const override;
         // Intersection implementation
         void Intersect(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
@@ -88,13 +95,80 @@ namespace RadeonRays
         void Occluded(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays, 
             std::uint32_t max_rays, Calc::Buffer *hits, 
             Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Multi hit implementation (OpenCL only)
+        void MultiHit(std::uint32_t queue_idx, Calc::Buffer const *rays, Calc::Buffer const *num_rays,
+            std::uint32_t max_rays, std::uint32_t k, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Proximity implementation (OpenCL only)
+        void Proximity(std::uint32_t queue_idx, Calc::Buffer const *spheres, Calc::Buffer const *num_spheres,
+            std::uint32_t max_spheres, Calc::Buffer *hits,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Ambient occlusion implementation (OpenCL only)
+        void AmbientOcclusion(std::uint32_t queue_idx, Calc::Buffer const *points, Calc::Buffer const *num_points,
+            std::uint32_t max_points, std::uint32_t num_samples, float radius, std::uint32_t seed, Calc::Buffer *visibility,
+            Calc::Event const *wait_event, Calc::Event **event) const override;
+        // Compact hit formats are supported on OpenCL
+        bool SupportsCompactHits() const override;
+        bool SupportsOcclusionBits() const override;
+        // Hit callbacks are supported on OpenCL
+        bool SupportsHitCallback() const override;
+        // Traversal statistics are recorded on OpenCL
+        bool SupportsTraversalStats() const override;
+        // Watertight programs are compiled on demand by OpenCL devices
+        bool SupportsWatertight() const override;
+        // Work group size of OpenCL traversal kernels is set at compilation
+        bool SupportsLocalSize() const override;
+        // Recompile the program for the new work group size
+        void OnLocalSizeChanged() override;
 
     private:
+        // Update vertices of changed shapes and refit BVH on the device, all nodes are refitted
+        // even if no shape has changed when force is set
+        void Refit(bool force = false);
+        // Drop the background build of "bvh.progressive" and free the trees of finished dropped builds
+        void DiscardRefinedBvh();
+        // Number of work items to launch for max_rays
+        size_t GetGlobalSize(std::uint32_t max_rays) const;
+        // (Re)create the traversal program with "acc.hit_callback" and "acc.hit_filter" functions appended
+        void CompileProgram(std::string const& hit_callback, std::string const& hit_filter);
+
         struct GpuData;
 
         // Implementation data
         std::unique_ptr<GpuData> m_gpudata;
         // Bvh data structure
         std::unique_ptr<Bvh> m_bvh;
+        // Shapes in the order their vertices are laid out in GPU buffer
+        std::vector<Shape const*> m_shapes;
+        // Start index of each shape vertices (plus total vertex count at the end)
+        std::vector<int> m_vertex_start;
+        // Store triangles in leaf order instead of vertices
+        bool m_precomputed_triangles;
+        // Faces carry a fourth vertex index and are intersected as quads
+        bool m_quads;
+        // Triangles sharing an edge are stored as pairs of 4 vertices (RR_TRIANGLE_PAIRS)
+        bool m_triangle_pairs;
+        // Vertices are stored as 3 floats without padding (RR_PACKED_VERTICES)
+        bool m_packed_vertices;
+        // Nodes are stored in 8 interleaved layouts visiting near children first per ray octant (RR_ORDERED_LAYOUTS)
+        bool m_ordered_layouts;
+        // Intersection queries test hinted primitives before traversal (RR_HIT_HINTS)
+        bool m_hit_hints;
+        // Use persistent threads kernels fetching batches of rays
+        bool m_persistent_threads;
+        // Hit callback source the program is compiled with
+        std::string m_hit_callback;
+        // Hit filter source the program is compiled with
+        std::string m_hit_filter;
+        // Traversal statistics the program is compiled with
+        bool m_program_stats;
+        // Watertight tests the program is compiled with
+        bool m_program_watertight;
+        // Tree of "bvh.builder" built in the background while a coarse one is used ("bvh.progressive")
+        std::future<Bvh*> m_refined_bvh;
+        // Geometry has moved since bounds of the background build were gathered
+        bool m_refined_stale;
+        // Dropped background builds still running
+        std::vector<std::future<Bvh*>> m_discarded_bvhs;
     };
 }
@@ -0,0 +1,100 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "kernel_timer.h"
+#include "event.h"
+#include "../util/trace.h"
+
+#include <algorithm>
+
+namespace RadeonRays
+{
+    KernelTimer::KernelTimer(Calc::Device* device)
+        : m_device(device)
+        , m_enabled(false)
+    {
+    }
+
+    void KernelTimer::SetEnabled(bool enabled)
+    {
+        if (enabled != m_enabled)
+        {
+            m_device->SetProfilingEnabled(enabled);
+            m_enabled = enabled;
+        }
+    }
+
+    void KernelTimer::Execute(char const* name, Calc::Function const* func, std::uint32_t queue_idx,
+        std::size_t global_size, std::size_t local_size, Calc::Event** event) const
+    {
+        Calc::Event* local = nullptr;
+        m_device->Execute(func, queue_idx, global_size, local_size, GetLaunchEvent(&local, event));
+        Record(name, queue_idx, local, event);
+    }
+
+    Calc::Event** KernelTimer::GetLaunchEvent(Calc::Event** local, Calc::Event** event) const
+    {
+        return m_enabled ? local : event;
+    }
+
+    void KernelTimer::Record(char const* name, std::uint32_t queue_idx, Calc::Event* local, Calc::Event** event) const
+    {
+        if (!m_enabled)
+        {
+            return;
+        }
+
+        local->Wait();
+
+        KernelTiming timing = { name, local->GetDuration() };
+        Tracer::ReportGpu(name, queue_idx, timing.time);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_timings.push_back(timing);
+        }
+
+        if (event)
+        {
+            *event = local;
+        }
+        else
+        {
+            m_device->DeleteEvent(local);
+        }
+    }
+
+    void KernelTimer::Clear() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_timings.clear();
+    }
+
+    int KernelTimer::GetTimings(KernelTiming* timings, int max_timings) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        int count = std::min(static_cast<int>(m_timings.size()), std::max(max_timings, 0));
+        std::copy(m_timings.begin(), m_timings.begin() + count, timings);
+
+        return static_cast<int>(m_timings.size());
+    }
+}
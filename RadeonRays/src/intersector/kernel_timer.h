@@ -0,0 +1,80 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+#include "radeon_rays.h"
+#include "calc.h"
+#include "device.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class records GPU execution times of kernel launches when "acc.profiling"
+    ///< is enabled. Profiled launches are waited for, so profiling serializes the work
+    ///< it measures. Launches are recorded since the latest Clear call and reported
+    ///< as GPU spans if tracing is enabled.
+    ///<
+    class KernelTimer
+    {
+    public:
+        KernelTimer(Calc::Device* device);
+
+        // Enable profiling on the device, throws if its queues can't report GPU time
+        void SetEnabled(bool enabled);
+        bool IsEnabled() const { return m_enabled; }
+
+        // Launch func and record its time under name if profiling is enabled,
+        // event is handed over to the caller if requested, deleted otherwise
+        void Execute(char const* name, Calc::Function const* func, std::uint32_t queue_idx,
+            std::size_t global_size, std::size_t local_size, Calc::Event** event) const;
+
+        // Event to pass to a launch: a local one if profiling is enabled, the caller's otherwise
+        Calc::Event** GetLaunchEvent(Calc::Event** local, Calc::Event** event) const;
+        // Wait for the launch done with GetLaunchEvent on queue_idx and record its time,
+        // no-op if profiling is disabled
+        void Record(char const* name, std::uint32_t queue_idx, Calc::Event* local, Calc::Event** event) const;
+
+        // Forget recorded timings
+        void Clear() const;
+        // Copy up to max_timings timings, returns the number of recorded ones
+        int GetTimings(KernelTiming* timings, int max_timings) const;
+
+    private:
+        KernelTimer(KernelTimer const&);
+        KernelTimer& operator = (KernelTimer const&);
+
+        // Device to use
+        Calc::Device* m_device;
+        // "acc.profiling" state
+        bool m_enabled;
+        // Timings of the launches since the latest Clear call
+        mutable std::vector<KernelTiming> m_timings;
+        // Queries can be issued from several threads
+        mutable std::mutex m_mutex;
+    };
+}
+
+#endif // KERNEL_TIMER_H
@@ -0,0 +1,54 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include "radeon_rays.h"
+#include "calc.h"
+#include "device.h"
+#include "buffer.h"
+
+#include <cstddef>
+
+namespace RadeonRays
+{
+    // Add the size of a buffer to bytes, nullptr adds nothing
+    inline void AddBufferBytes(std::size_t& bytes, Calc::Buffer const* buffer)
+    {
+        if (buffer)
+        {
+            bytes += buffer->GetSize();
+        }
+    }
+
+    // Add the binary size of an executable to usage, nullptr adds nothing.
+    // Only OpenCL programs can report their binaries.
+    inline void AddExecutableBytes(MemoryUsage& usage, Calc::Device* device, Calc::Executable const* executable)
+    {
+        if (executable && device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            usage.kernel_binaries_bytes += device->GetExecutableBinarySize(executable);
+        }
+    }
+}
+
+#endif // MEMORY_USAGE_H
@@ -0,0 +1,181 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_compactor.h"
+#include "memory_usage.h"
+#include "radeon_rays.h"
+#include "buffer.h"
+#include "primitives.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+
+    struct RayCompactor::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Parallel primitives
+        Calc::Primitives* pp;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* flags_func;
+        Calc::Function* gather_func;
+
+        // Keep flags and ray indices
+        Calc::Buffer* flags;
+        Calc::Buffer* indices;
+        // Indices of kept rays
+        Calc::Buffer* compacted_indices;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , pp(nullptr)
+            , executable(nullptr)
+            , flags(nullptr)
+            , indices(nullptr)
+            , compacted_indices(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(flags);
+            device->DeleteBuffer(indices);
+            device->DeleteBuffer(compacted_indices);
+
+            if (executable)
+            {
+                executable->DeleteFunction(flags_func);
+                executable->DeleteFunction(gather_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
+        }
+    };
+
+    RayCompactor::RayCompactor(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+        , m_capacity(0)
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL || !device->HasBuiltinPrimitives(),
+            "Ray compaction is only supported by OpenCL devices");
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/compact_rays.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_compact_rays_opencl, std::strlen(g_compact_rays_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->flags_func = m_gpudata->executable->CreateFunction("ray_flags_main");
+        m_gpudata->gather_func = m_gpudata->executable->CreateFunction("gather_compacted_rays_main");
+
+        m_gpudata->pp = m_device->CreatePrimitives();
+    }
+
+    RayCompactor::~RayCompactor()
+    {
+    }
+
+    void RayCompactor::AllocateBuffers(std::uint32_t max_rays)
+    {
+        m_device->DeleteBuffer(m_gpudata->flags);
+        m_device->DeleteBuffer(m_gpudata->indices);
+        m_device->DeleteBuffer(m_gpudata->compacted_indices);
+
+        m_gpudata->flags = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->compacted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+
+        m_capacity = max_rays;
+    }
+
+    void RayCompactor::CompactRays(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* out_rays, Calc::Buffer* out_count,
+        Calc::Event** event)
+    {
+        // Buffers are reused between calls and only grow
+        if (max_rays > m_capacity)
+        {
+            AllocateBuffers(max_rays);
+        }
+
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Flag rays to keep, rays stand in for a missing predicate since it is not read then
+        int use_predicate = predicate ? 1 : 0;
+        int size = static_cast<int>(max_rays);
+
+        int arg = 0;
+        m_gpudata->flags_func->SetArg(arg++, rays);
+        m_gpudata->flags_func->SetArg(arg++, num_rays);
+        m_gpudata->flags_func->SetArg(arg++, predicate ? predicate : rays);
+        m_gpudata->flags_func->SetArg(arg++, sizeof(use_predicate), &use_predicate);
+        m_gpudata->flags_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->flags_func->SetArg(arg++, m_gpudata->flags);
+        m_gpudata->flags_func->SetArg(arg++, m_gpudata->indices);
+        m_device->Execute(m_gpudata->flags_func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        // Kept indices in order and their number, the whole capacity of max_rays
+        // is compacted since the actual number of rays is only known on the device
+        m_gpudata->pp->CompactInt32(queue_idx, m_gpudata->flags, m_gpudata->indices, m_gpudata->compacted_indices, max_rays, out_count);
+
+        arg = 0;
+        m_gpudata->gather_func->SetArg(arg++, rays);
+        m_gpudata->gather_func->SetArg(arg++, out_count);
+        m_gpudata->gather_func->SetArg(arg++, m_gpudata->compacted_indices);
+        m_gpudata->gather_func->SetArg(arg++, out_rays);
+        m_device->Execute(m_gpudata->gather_func, queue_idx, globalsize, kWorkGroupSize, event);
+    }
+
+    void RayCompactor::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->flags);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->compacted_indices);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
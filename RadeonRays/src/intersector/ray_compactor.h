@@ -0,0 +1,73 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RAY_COMPACTOR_H
+#define RAY_COMPACTOR_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class moves the rays to keep to the front of a buffer
+    ///< preserving their order and writes their number on the device,
+    ///< so wavefront bounces can be chained through count-in-buffer queries
+    ///< without reading ray counts back.
+    ///<
+    class RayCompactor
+    {
+    public:
+        // Throws if the device doesn't provide parallel primitives
+        RayCompactor(Calc::Device* device);
+
+        ~RayCompactor();
+
+        // Copy rays with a nonzero predicate (active rays if predicate is nullptr)
+        // into out_rays and write their number into out_count
+        void CompactRays(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer const* predicate, Calc::Buffer* out_rays, Calc::Buffer* out_count,
+            Calc::Event** event);
+
+        // Add scratch buffers and kernel binaries to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        void AllocateBuffers(std::uint32_t max_rays);
+
+        RayCompactor(RayCompactor const&);
+        RayCompactor& operator = (RayCompactor const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Number of rays GPU buffers can hold
+        std::uint32_t m_capacity;
+    };
+}
+
+#endif // RAY_COMPACTOR_H
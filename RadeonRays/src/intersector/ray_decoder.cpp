@@ -0,0 +1,157 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_decoder.h"
+#include "memory_usage.h"
+#include "radeon_rays.h"
+#include "buffer.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+
+    struct RayDecoder::GpuData
+    {
+        // Device
+        Calc::Device* device;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* decode_compact_func;
+        Calc::Function* decode_oct_func;
+        Calc::Function* decode_soa_func;
+
+        // Rays in the full layout
+        Calc::Buffer* decoded_rays;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , executable(nullptr)
+            , decoded_rays(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(decoded_rays);
+
+            if (executable)
+            {
+                executable->DeleteFunction(decode_compact_func);
+                executable->DeleteFunction(decode_oct_func);
+                executable->DeleteFunction(decode_soa_func);
+                device->DeleteExecutable(executable);
+            }
+        }
+    };
+
+    RayDecoder::RayDecoder(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+        , m_format(kFormatCompact)
+        , m_capacity(0)
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Compact ray formats are only supported by OpenCL devices");
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/decode_rays.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_decode_rays_opencl, std::strlen(g_decode_rays_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->decode_compact_func = m_gpudata->executable->CreateFunction("decode_compact_rays_main");
+        m_gpudata->decode_oct_func = m_gpudata->executable->CreateFunction("decode_oct_rays_main");
+        m_gpudata->decode_soa_func = m_gpudata->executable->CreateFunction("decode_soa_rays_main");
+    }
+
+    RayDecoder::~RayDecoder()
+    {
+    }
+
+    void RayDecoder::SetFormat(Format format)
+    {
+        m_format = format;
+    }
+
+    RayDecoder::Format RayDecoder::GetFormat() const
+    {
+        return m_format;
+    }
+
+    Calc::Buffer const* RayDecoder::DecodeRays(std::uint32_t queue_idx, Calc::Buffer const* rays,
+        Calc::Buffer const* num_rays, std::uint32_t max_rays)
+    {
+        // Buffer is reused between queries and only grows
+        if (max_rays > m_capacity)
+        {
+            m_device->DeleteBuffer(m_gpudata->decoded_rays);
+            m_gpudata->decoded_rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite);
+            m_capacity = max_rays;
+        }
+
+        Calc::Function* func = m_format == kFormatOct ? m_gpudata->decode_oct_func :
+            (m_format == kFormatSoa ? m_gpudata->decode_soa_func : m_gpudata->decode_compact_func);
+
+        int arg = 0;
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, num_rays);
+
+        // Planes are as long as the largest ray count of the query
+        if (m_format == kFormatSoa)
+        {
+            int plane_size = static_cast<int>(max_rays);
+            func->SetArg(arg++, sizeof(plane_size), &plane_size);
+        }
+
+        func->SetArg(arg++, m_gpudata->decoded_rays);
+
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_device->Execute(func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        return m_gpudata->decoded_rays;
+    }
+
+    void RayDecoder::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->decoded_rays);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
@@ -0,0 +1,87 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RAY_DECODER_H
+#define RAY_DECODER_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class expands rays given in a compact layout into full rays
+    ///< before traversal. Compact rays are read from the device memory once,
+    ///< so traversal kernels don't need a variant per ray layout.
+    ///<
+    class RayDecoder
+    {
+    public:
+        // Ray layouts set by "acc.ray_format" option
+        enum Format
+        {
+            // ray_compact: origin + maxt and direction, 32 bytes
+            kFormatCompact,
+            // ray_oct: origin, maxt and octahedral encoded direction, 20 bytes
+            kFormatOct,
+            // Planes of the 12 4-byte words of ray, max_rays elements each
+            kFormatSoa
+        };
+
+        // Throws if the device is not an OpenCL one
+        RayDecoder(Calc::Device* device);
+
+        ~RayDecoder();
+
+        // Set layout of the rays passed to DecodeRays
+        void SetFormat(Format format);
+        // Layout of the rays passed to DecodeRays
+        Format GetFormat() const;
+
+        // Decode rays and return the buffer holding them in the full layout,
+        // the buffer is valid until the next call
+        Calc::Buffer const* DecodeRays(std::uint32_t queue_idx, Calc::Buffer const* rays,
+            Calc::Buffer const* num_rays, std::uint32_t max_rays);
+
+        // Add scratch buffers and kernel binaries to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        RayDecoder(RayDecoder const&);
+        RayDecoder& operator = (RayDecoder const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Layout of input rays
+        Format m_format;
+        // Number of rays GPU buffers can hold
+        std::uint32_t m_capacity;
+    };
+}
+
+#endif // RAY_DECODER_H
@@ -0,0 +1,178 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_generator.h"
+#include "memory_usage.h"
+#include "buffer.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+
+    struct RayGenerator::GpuData
+    {
+        // Device
+        Calc::Device* device;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* camera_func;
+        Calc::Function* hemisphere_func;
+        Calc::Function* shadow_func;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , executable(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            if (executable)
+            {
+                executable->DeleteFunction(camera_func);
+                executable->DeleteFunction(hemisphere_func);
+                executable->DeleteFunction(shadow_func);
+                device->DeleteExecutable(executable);
+            }
+        }
+    };
+
+    static size_t GetGlobalSize(int num_items)
+    {
+        return ((num_items + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+    }
+
+    RayGenerator::RayGenerator(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL,
+            "Ray generation is only supported by OpenCL devices");
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/generate_rays.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_generate_rays_opencl, std::strlen(g_generate_rays_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->camera_func = m_gpudata->executable->CreateFunction("generate_camera_rays_main");
+        m_gpudata->hemisphere_func = m_gpudata->executable->CreateFunction("generate_hemisphere_rays_main");
+        m_gpudata->shadow_func = m_gpudata->executable->CreateFunction("generate_shadow_rays_main");
+    }
+
+    RayGenerator::~RayGenerator()
+    {
+    }
+
+    void RayGenerator::GenerateCameraRays(std::uint32_t queue_idx, CameraDesc const& camera, int width, int height,
+        std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event)
+    {
+        ThrowIf(width <= 0 || height <= 0, "Invalid image size");
+
+        // float3 holds 4 floats on the host, so vectors are passed as float4 arguments
+        CameraDesc desc = camera;
+
+        int arg = 0;
+        auto func = m_gpudata->camera_func;
+        func->SetArg(arg++, sizeof(desc.position), &desc.position);
+        func->SetArg(arg++, sizeof(desc.forward), &desc.forward);
+        func->SetArg(arg++, sizeof(desc.up), &desc.up);
+        func->SetArg(arg++, sizeof(desc.sensor_size), &desc.sensor_size);
+        func->SetArg(arg++, sizeof(desc.focal_length), &desc.focal_length);
+        func->SetArg(arg++, sizeof(desc.aperture), &desc.aperture);
+        func->SetArg(arg++, sizeof(desc.focus_distance), &desc.focus_distance);
+        func->SetArg(arg++, sizeof(desc.maxt), &desc.maxt);
+        func->SetArg(arg++, sizeof(desc.jitter), &desc.jitter);
+        func->SetArg(arg++, sizeof(width), &width);
+        func->SetArg(arg++, sizeof(height), &height);
+        func->SetArg(arg++, sizeof(seed), &seed);
+        func->SetArg(arg++, rays);
+        m_device->Execute(func, queue_idx, GetGlobalSize(width * height), kWorkGroupSize, event);
+    }
+
+    void RayGenerator::GenerateHemisphereRays(std::uint32_t queue_idx, Calc::Buffer const* points, Calc::Buffer const* num_points,
+        int max_points, int num_samples, float maxt, std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event)
+    {
+        ThrowIf(max_points <= 0 || num_samples <= 0, "Invalid number of points or samples");
+
+        // Points stand in for a missing count since it is not read then
+        int use_num_points = num_points ? 1 : 0;
+
+        int arg = 0;
+        auto func = m_gpudata->hemisphere_func;
+        func->SetArg(arg++, points);
+        func->SetArg(arg++, num_points ? num_points : points);
+        func->SetArg(arg++, sizeof(use_num_points), &use_num_points);
+        func->SetArg(arg++, sizeof(max_points), &max_points);
+        func->SetArg(arg++, sizeof(num_samples), &num_samples);
+        func->SetArg(arg++, sizeof(maxt), &maxt);
+        func->SetArg(arg++, sizeof(seed), &seed);
+        func->SetArg(arg++, rays);
+        m_device->Execute(func, queue_idx, GetGlobalSize(max_points * num_samples), kWorkGroupSize, event);
+    }
+
+    void RayGenerator::GenerateShadowRays(std::uint32_t queue_idx, Calc::Buffer const* points, Calc::Buffer const* num_points,
+        int max_points, LightDesc const& light, std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event)
+    {
+        ThrowIf(max_points <= 0, "Invalid number of points");
+
+        int use_num_points = num_points ? 1 : 0;
+        LightDesc desc = light;
+
+        int arg = 0;
+        auto func = m_gpudata->shadow_func;
+        func->SetArg(arg++, points);
+        func->SetArg(arg++, num_points ? num_points : points);
+        func->SetArg(arg++, sizeof(use_num_points), &use_num_points);
+        func->SetArg(arg++, sizeof(max_points), &max_points);
+        func->SetArg(arg++, sizeof(desc.position), &desc.position);
+        func->SetArg(arg++, sizeof(desc.edge1), &desc.edge1);
+        func->SetArg(arg++, sizeof(desc.edge2), &desc.edge2);
+        func->SetArg(arg++, sizeof(seed), &seed);
+        func->SetArg(arg++, rays);
+        m_device->Execute(func, queue_idx, GetGlobalSize(max_points), kWorkGroupSize, event);
+    }
+
+    void RayGenerator::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
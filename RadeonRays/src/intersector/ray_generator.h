@@ -0,0 +1,74 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RAY_GENERATOR_H
+#define RAY_GENERATOR_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class writes camera, hemisphere and shadow rays straight
+    ///< into device buffers, so common passes don't generate rays
+    ///< on the host and upload them.
+    ///<
+    class RayGenerator
+    {
+    public:
+        // Throws if the device is not an OpenCL one
+        RayGenerator(Calc::Device* device);
+
+        ~RayGenerator();
+
+        // width * height primary rays in rows starting at the top left pixel
+        void GenerateCameraRays(std::uint32_t queue_idx, CameraDesc const& camera, int width, int height,
+            std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event);
+
+        // num_samples cosine distributed rays per point (all max_points if num_points is nullptr)
+        void GenerateHemisphereRays(std::uint32_t queue_idx, Calc::Buffer const* points, Calc::Buffer const* num_points,
+            int max_points, int num_samples, float maxt, std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event);
+
+        // A ray per point toward a sampled position of the light
+        void GenerateShadowRays(std::uint32_t queue_idx, Calc::Buffer const* points, Calc::Buffer const* num_points,
+            int max_points, LightDesc const& light, std::uint32_t seed, Calc::Buffer* rays, Calc::Event** event);
+
+        // Add kernel binaries to usage, generated rays live in caller buffers
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        RayGenerator(RayGenerator const&);
+        RayGenerator& operator = (RayGenerator const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+    };
+}
+
+#endif // RAY_GENERATOR_H
@@ -0,0 +1,257 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "ray_sorter.h"
+#include "memory_usage.h"
+#include "radeon_rays.h"
+#include "buffer.h"
+#include "primitives.h"
+#include "executable.h"
+#include "../except/except.h"
+
+#include <climits>
+#include <cstring>
+#include <assert.h>
+
+#ifdef RR_EMBED_KERNELS
+#if USE_OPENCL
+#    include "RadeonRays/src/kernelcache/kernels_cl.h"
+#endif
+#endif // RR_EMBED_KERNELS
+
+namespace RadeonRays
+{
+    static int const kWorkGroupSize = 64;
+
+    struct RaySorter::GpuData
+    {
+        // Device
+        Calc::Device* device;
+        // Parallel primitives
+        Calc::Primitives* pp;
+
+        // GPU program
+        Calc::Executable* executable;
+        Calc::Function* bound_func;
+        Calc::Function* key_func;
+        Calc::Function* gather_func;
+        Calc::Function* scatter_hits_func;
+        Calc::Function* scatter_occlusion_func;
+
+        // Ray origin bounds as ordered ints
+        Calc::Buffer* bounds;
+        // Sort keys and ray indices
+        Calc::Buffer* keys;
+        Calc::Buffer* indices;
+        Calc::Buffer* sorted_keys;
+        Calc::Buffer* sorted_indices;
+        // Rays and their hits in sorted order
+        Calc::Buffer* sorted_rays;
+        Calc::Buffer* sorted_hits;
+
+        GpuData(Calc::Device* d)
+            : device(d)
+            , pp(nullptr)
+            , executable(nullptr)
+            , bounds(nullptr)
+            , keys(nullptr)
+            , indices(nullptr)
+            , sorted_keys(nullptr)
+            , sorted_indices(nullptr)
+            , sorted_rays(nullptr)
+            , sorted_hits(nullptr)
+        {
+        }
+
+        ~GpuData()
+        {
+            device->DeleteBuffer(bounds);
+            device->DeleteBuffer(keys);
+            device->DeleteBuffer(indices);
+            device->DeleteBuffer(sorted_keys);
+            device->DeleteBuffer(sorted_indices);
+            device->DeleteBuffer(sorted_rays);
+            device->DeleteBuffer(sorted_hits);
+
+            if (executable)
+            {
+                executable->DeleteFunction(bound_func);
+                executable->DeleteFunction(key_func);
+                executable->DeleteFunction(gather_func);
+                executable->DeleteFunction(scatter_hits_func);
+                executable->DeleteFunction(scatter_occlusion_func);
+                device->DeleteExecutable(executable);
+            }
+
+            if (pp)
+            {
+                device->DeletePrimitives(pp);
+            }
+        }
+    };
+
+    RaySorter::RaySorter(Calc::Device* device)
+        : m_device(device)
+        , m_gpudata(new GpuData(device))
+        , m_capacity(0)
+    {
+        ThrowIf(device->GetPlatform() != Calc::Platform::kOpenCL || !device->HasBuiltinPrimitives(),
+            "Ray sorting is only supported by OpenCL devices");
+
+#ifndef RR_EMBED_KERNELS
+        char const* headers[] = { "../RadeonRays/src/kernels/CL/common.cl" };
+
+        int numheaders = sizeof(headers) / sizeof(char const*);
+
+        m_gpudata->executable = m_device->CompileExecutable("../RadeonRays/src/kernels/CL/sort_rays.cl", headers, numheaders, nullptr);
+#else
+#if USE_OPENCL
+        m_gpudata->executable = m_device->CompileExecutable(g_sort_rays_opencl, std::strlen(g_sort_rays_opencl), nullptr);
+#endif
+#endif
+
+        assert(m_gpudata->executable);
+
+        m_gpudata->bound_func = m_gpudata->executable->CreateFunction("bound_rays_main");
+        m_gpudata->key_func = m_gpudata->executable->CreateFunction("calculate_ray_keys_main");
+        m_gpudata->gather_func = m_gpudata->executable->CreateFunction("gather_rays_main");
+        m_gpudata->scatter_hits_func = m_gpudata->executable->CreateFunction("scatter_hits_main");
+        m_gpudata->scatter_occlusion_func = m_gpudata->executable->CreateFunction("scatter_occlusion_main");
+
+        m_gpudata->pp = m_device->CreatePrimitives();
+        m_gpudata->bounds = m_device->CreateBuffer(6 * sizeof(int), Calc::BufferType::kWrite);
+    }
+
+    RaySorter::~RaySorter()
+    {
+    }
+
+    void RaySorter::AllocateBuffers(std::uint32_t max_rays)
+    {
+        // Release previously allocated buffers
+        m_device->DeleteBuffer(m_gpudata->keys);
+        m_device->DeleteBuffer(m_gpudata->indices);
+        m_device->DeleteBuffer(m_gpudata->sorted_keys);
+        m_device->DeleteBuffer(m_gpudata->sorted_indices);
+        m_device->DeleteBuffer(m_gpudata->sorted_rays);
+        m_device->DeleteBuffer(m_gpudata->sorted_hits);
+
+        m_gpudata->keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->sorted_keys = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->sorted_indices = m_device->CreateBuffer(max_rays * sizeof(int), Calc::BufferType::kWrite);
+        m_gpudata->sorted_rays = m_device->CreateBuffer(max_rays * sizeof(ray), Calc::BufferType::kWrite);
+        // Intersections are larger than occlusion results, so the buffer is good for both
+        m_gpudata->sorted_hits = m_device->CreateBuffer(max_rays * sizeof(Intersection), Calc::BufferType::kWrite);
+
+        m_capacity = max_rays;
+    }
+
+    Calc::Buffer const* RaySorter::SortRays(std::uint32_t queue_idx, Calc::Buffer const* rays,
+        Calc::Buffer const* num_rays, std::uint32_t max_rays)
+    {
+        // Buffers are reused between queries and only grow
+        if (max_rays > m_capacity)
+        {
+            AllocateBuffers(max_rays);
+        }
+
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        // Evaluate bounds of ray origins
+        m_device->FillBuffer(m_gpudata->bounds, queue_idx, 0, 3 * sizeof(int), static_cast<std::uint32_t>(INT_MAX), nullptr);
+        m_device->FillBuffer(m_gpudata->bounds, queue_idx, 3 * sizeof(int), 3 * sizeof(int), static_cast<std::uint32_t>(INT_MIN), nullptr);
+
+        int arg = 0;
+        m_gpudata->bound_func->SetArg(arg++, rays);
+        m_gpudata->bound_func->SetArg(arg++, num_rays);
+        m_gpudata->bound_func->SetArg(arg++, m_gpudata->bounds);
+        m_device->Execute(m_gpudata->bound_func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        // Calculate sort keys, the whole capacity of max_rays is sorted
+        // since the actual number of rays is only known on the device
+        int size = static_cast<int>(max_rays);
+
+        arg = 0;
+        m_gpudata->key_func->SetArg(arg++, rays);
+        m_gpudata->key_func->SetArg(arg++, num_rays);
+        m_gpudata->key_func->SetArg(arg++, m_gpudata->bounds);
+        m_gpudata->key_func->SetArg(arg++, sizeof(size), &size);
+        m_gpudata->key_func->SetArg(arg++, m_gpudata->keys);
+        m_gpudata->key_func->SetArg(arg++, m_gpudata->indices);
+        m_device->Execute(m_gpudata->key_func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        m_gpudata->pp->SortRadixInt32(queue_idx, m_gpudata->keys, m_gpudata->sorted_keys, m_gpudata->indices, m_gpudata->sorted_indices, max_rays);
+
+        // Reorder rays
+        arg = 0;
+        m_gpudata->gather_func->SetArg(arg++, rays);
+        m_gpudata->gather_func->SetArg(arg++, num_rays);
+        m_gpudata->gather_func->SetArg(arg++, m_gpudata->sorted_indices);
+        m_gpudata->gather_func->SetArg(arg++, m_gpudata->sorted_rays);
+        m_device->Execute(m_gpudata->gather_func, queue_idx, globalsize, kWorkGroupSize, nullptr);
+
+        return m_gpudata->sorted_rays;
+    }
+
+    Calc::Buffer* RaySorter::GetSortedHits() const
+    {
+        return m_gpudata->sorted_hits;
+    }
+
+    void RaySorter::ScatterHits(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        Scatter(m_gpudata->scatter_hits_func, queue_idx, rays, num_rays, max_rays, hits, event);
+    }
+
+    void RaySorter::ScatterOcclusion(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        Scatter(m_gpudata->scatter_occlusion_func, queue_idx, rays, num_rays, max_rays, hits, event);
+    }
+
+    void RaySorter::Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+        std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const
+    {
+        int arg = 0;
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, num_rays);
+        func->SetArg(arg++, m_gpudata->sorted_indices);
+        func->SetArg(arg++, m_gpudata->sorted_hits);
+        func->SetArg(arg++, hits);
+
+        size_t globalsize = ((max_rays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        m_device->Execute(func, queue_idx, globalsize, kWorkGroupSize, event);
+    }
+
+    void RaySorter::GetMemoryUsage(MemoryUsage& usage) const
+    {
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->bounds);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->keys);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_keys);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_indices);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_rays);
+        AddBufferBytes(usage.scratch_bytes, m_gpudata->sorted_hits);
+        AddExecutableBytes(usage, m_device, m_gpudata->executable);
+    }
+}
@@ -0,0 +1,85 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef RAY_SORTER_H
+#define RAY_SORTER_H
+
+#include "calc.h"
+#include "device.h"
+#include "radeon_rays.h"
+
+#include <cstdint>
+#include <memory>
+
+namespace RadeonRays
+{
+    ///< The class reorders batches of rays for coherent traversal.
+    ///< Rays are sorted on the device by a Morton code of their origin
+    ///< followed by a Morton code of their direction, traversed in
+    ///< sorted order and their hits are scattered back to the original order.
+    ///<
+    class RaySorter
+    {
+    public:
+        // Throws if the device doesn't provide radix sort
+        RaySorter(Calc::Device* device);
+
+        ~RaySorter();
+
+        // Sort rays and return the buffer holding them in sorted order,
+        // the buffer is valid until the next call
+        Calc::Buffer const* SortRays(std::uint32_t queue_idx, Calc::Buffer const* rays,
+            Calc::Buffer const* num_rays, std::uint32_t max_rays);
+
+        // Buffer to write hits of sorted rays to
+        Calc::Buffer* GetSortedHits() const;
+
+        // Move intersections of the sorted rays into hits in the original order
+        void ScatterHits(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const;
+
+        // Move occlusion results of the sorted rays into hits in the original order
+        void ScatterOcclusion(std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const;
+
+        // Add scratch buffers and kernel binaries to usage
+        void GetMemoryUsage(MemoryUsage& usage) const;
+
+    private:
+        void AllocateBuffers(std::uint32_t max_rays);
+        void Scatter(Calc::Function* func, std::uint32_t queue_idx, Calc::Buffer const* rays, Calc::Buffer const* num_rays,
+            std::uint32_t max_rays, Calc::Buffer* hits, Calc::Event** event) const;
+
+        RaySorter(RaySorter const&);
+        RaySorter& operator = (RaySorter const&);
+
+        struct GpuData;
+
+        // Device to use
+        Calc::Device* m_device;
+        // GPU data
+        std::unique_ptr<GpuData> m_gpudata;
+        // Number of rays GPU buffers can hold
+        std::uint32_t m_capacity;
+    };
+}
+
+#endif // RAY_SORTER_H
@@ -0,0 +1,294 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file build_grid.cl
+    \brief Two-level uniform grid build
+
+    The grid follows:
+    "Two-Level Grids for Ray Tracing on GPUs"
+    Javor Kalojanov, Markus Billeter, Philipp Slusallek, in Eurographics 2011
+
+    Both levels are filled by counting sort: primitives count the cells their bounds
+    overlap with atomics, an exclusive scan of the counts gives cell ranges and a second
+    pass scatters primitive indices into them. Top level cells get a sub-grid whose
+    resolution follows the number of primitives overlapping them.
+
+    Pros:
+        -Linear build in a few launches, cheap enough to rebuild every frame.
+    Cons:
+        -Slow traversal of scenes with uneven primitive density.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+// Must match UniformGrid: maximum resolutions per axis of both levels
+#define MAX_TOP_RES 512
+#define MAX_LEAF_RES 32
+// Primitive bounds are widened by this fraction of a cell, so rounding
+// of cell boundaries in traversal never misses an overlapped cell
+#define CELL_EPSILON 1e-3f
+// Flat extents are raised to this fraction of the largest one
+#define MIN_RELATIVE_EXTENT 1e-3f
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+typedef struct
+{
+    // Grid bounds
+    float4 pmin;
+    float4 pmax;
+    // Top level cell size
+    float4 cell_size;
+    // Top level resolution, number of top level cells in w
+    int4 res;
+} grid_desc;
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Resolution giving about num_cells cubic cells over extents, at most max_cells of them
+INLINE int3 grid_resolution(float3 extents, float num_cells, int max_cells, int max_res)
+{
+    float const max_extent = max3(extents.x, extents.y, extents.z);
+
+    if (max_extent <= 0.f)
+    {
+        return (int3)(1);
+    }
+
+    extents = max(extents, max_extent * MIN_RELATIVE_EXTENT);
+    float const k = cbrt(num_cells / (extents.x * extents.y * extents.z));
+    int3 res = clamp(convert_int3(extents * k), 1, max_res);
+
+    // Axes clamped to a single cell leave more cells to the others
+    while (res.x * res.y * res.z > max_cells)
+    {
+        res = max(res * 7 / 8, 1);
+    }
+
+    return res;
+}
+
+// Range of cells of a grid overlapped by a box
+INLINE void cell_range(bbox b, float3 pmin, float3 cell_size, int3 res, int3* lo, int3* hi)
+{
+    float3 const eps = cell_size * CELL_EPSILON;
+    *lo = clamp(convert_int3(floor((b.pmin.xyz - eps - pmin) / cell_size)), (int3)(0), res - 1);
+    *hi = clamp(convert_int3(floor((b.pmax.xyz + eps - pmin) / cell_size)), (int3)(0), res - 1);
+}
+
+// Count references of a primitive in the leaf cells it overlaps, or write
+// it into their ranges if refs is set
+INLINE void visit_leaf_cells(
+    bbox b,
+    int prim,
+    GLOBAL grid_desc const* desc,
+    GLOBAL int4 const* top_res,
+    GLOBAL int const* top_leaf_starts,
+    GLOBAL int* leaf_counters,
+    GLOBAL int* refs)
+{
+    float3 const pmin = desc->pmin.xyz;
+    float3 const cell_size = desc->cell_size.xyz;
+    int3 const res = desc->res.xyz;
+
+    int3 lo, hi;
+    cell_range(b, pmin, cell_size, res, &lo, &hi);
+
+    for (int z = lo.z; z <= hi.z; ++z)
+    for (int y = lo.y; y <= hi.y; ++y)
+    for (int x = lo.x; x <= hi.x; ++x)
+    {
+        int const cell = x + res.x * (y + res.y * z);
+        int3 const leaf_res = top_res[cell].xyz;
+        int const leaf_start = top_leaf_starts[cell];
+
+        // Sub-grid of the top level cell
+        float3 const leaf_size = cell_size / convert_float3(leaf_res);
+        float3 const cell_min = pmin + convert_float3((int3)(x, y, z)) * cell_size;
+
+        int3 leaf_lo, leaf_hi;
+        cell_range(b, cell_min, leaf_size, leaf_res, &leaf_lo, &leaf_hi);
+
+        for (int k = leaf_lo.z; k <= leaf_hi.z; ++k)
+        for (int j = leaf_lo.y; j <= leaf_hi.y; ++j)
+        for (int i = leaf_lo.x; i <= leaf_hi.x; ++i)
+        {
+            GLOBAL int* counter = leaf_counters + leaf_start + i + leaf_res.x * (j + leaf_res.y * k);
+
+            if (refs)
+            {
+                refs[atomic_inc(counter)] = prim;
+            }
+            else
+            {
+                atomic_inc(counter);
+            }
+        }
+    }
+}
+
+// Lay the top level out over the scene bounds, single work item
+KERNEL void init_grid_main(
+    // Scene bounds
+    GLOBAL bbox const* restrict scene_bound,
+    // Number of primitives
+    int num_prims,
+    // Top level cells per primitive
+    float density,
+    // Number of top level cells buffers hold
+    int max_cells,
+    // Grid layout
+    GLOBAL grid_desc* desc)
+{
+    if (get_global_id(0) == 0)
+    {
+        float3 const ext = scene_bound->pmax.xyz - scene_bound->pmin.xyz;
+        // Keep primitives on the bounds inside the grid
+        float3 const margin = max3(ext.x, ext.y, ext.z) * 1e-5f + 1e-6f;
+        float3 const pmin = scene_bound->pmin.xyz - margin;
+        float3 const pmax = scene_bound->pmax.xyz + margin;
+        int3 const res = grid_resolution(pmax - pmin, density * num_prims, max_cells, MAX_TOP_RES);
+
+        desc->pmin = (float4)(pmin, 0.f);
+        desc->pmax = (float4)(pmax, 0.f);
+        desc->cell_size = (float4)((pmax - pmin) / convert_float3(res), 0.f);
+        desc->res = (int4)(res, res.x * res.y * res.z);
+    }
+}
+
+// Count primitives overlapping each top level cell
+KERNEL void count_top_cells_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Primitive counts of top level cells
+    GLOBAL int* top_counts)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int3 const res = desc->res.xyz;
+
+        int3 lo, hi;
+        cell_range(bounds[global_id], desc->pmin.xyz, desc->cell_size.xyz, res, &lo, &hi);
+
+        for (int z = lo.z; z <= hi.z; ++z)
+        for (int y = lo.y; y <= hi.y; ++y)
+        for (int x = lo.x; x <= hi.x; ++x)
+        {
+            atomic_inc(top_counts + x + res.x * (y + res.y * z));
+        }
+    }
+}
+
+// Choose sub-grid resolutions of top level cells from their primitive counts
+KERNEL void init_top_cells_main(
+    // Primitive counts of top level cells
+    GLOBAL int const* restrict top_counts,
+    // Number of top level cells buffers hold
+    int max_cells,
+    // Leaf cells per primitive
+    float density,
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Sub-grid resolutions, number of leaf cells in w
+    GLOBAL int4* top_res,
+    // Number of leaf cells of each top level cell
+    GLOBAL int* top_leaf_counts)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_cells)
+    {
+        int const count = global_id < desc->res.w ? top_counts[global_id] : 0;
+        int4 res = (int4)(0);
+
+        if (count > 0)
+        {
+            int const num_cells = (int)ceil(density * count);
+            res.xyz = grid_resolution(desc->cell_size.xyz, density * count, num_cells, MAX_LEAF_RES);
+            res.w = res.x * res.y * res.z;
+        }
+
+        top_res[global_id] = res;
+        top_leaf_counts[global_id] = res.w;
+    }
+}
+
+// Count primitives overlapping each leaf cell
+KERNEL void count_leaf_cells_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Sub-grid resolutions
+    GLOBAL int4 const* restrict top_res,
+    // First leaf cell of each top level cell
+    GLOBAL int const* restrict top_leaf_starts,
+    // Primitive counts of leaf cells
+    GLOBAL int* leaf_counts)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        visit_leaf_cells(bounds[global_id], global_id, desc, top_res, top_leaf_starts, leaf_counts, 0);
+    }
+}
+
+// Write primitive indices into the reference ranges of leaf cells
+KERNEL void scatter_refs_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Sub-grid resolutions
+    GLOBAL int4 const* restrict top_res,
+    // First leaf cell of each top level cell
+    GLOBAL int const* restrict top_leaf_starts,
+    // Reference range starts of leaf cells, advanced to range ends
+    GLOBAL int* leaf_ends,
+    // Primitive references
+    GLOBAL int* refs)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        visit_leaf_cells(bounds[global_id], global_id, desc, top_res, top_leaf_starts, leaf_ends, refs);
+    }
+}
@@ -30,10 +30,15 @@ THE SOFTWARE.
     Jacopo Pantaleoni (NVIDIA), David Luebke (NVIDIA), in High Performance Graphics 2010, June 2010
     https://research.nvidia.com/sites/default/files/publications/HLBVH-final.pdf
 
+    Optional treelet restructuring pass follows:
+    "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+    Tero Karras, Timo Aila (NVIDIA), in High Performance Graphics 2013
+    https://research.nvidia.com/publication/fast-parallel-construction-high-quality-bounding-volume-hierarchies
+
     Pros:
         -Very fast to build and update.
     Cons:
-        -Poor BVH quality, slow traversal.
+        -Poor BVH quality, slow traversal (less so with treelet restructuring).
  */
 /*************************************************************************
 INCLUDES
@@ -47,55 +52,102 @@ DEFINES
 #define NODEIDX(i) (i)
 // Shortcut for delta evaluation
 #define DELTA(i,j) delta(morton_codes,num_prims,i,j)
+// 63-bit Morton codes keep more centroids apart in large spread out scenes
+#ifdef HLBVH_MORTON64
+#define MORTON_CODE_BITS 64
+#else
+#define MORTON_CODE_BITS 32
+#endif
+// Leaves are stored after num_prims-1 internal nodes
+#define IS_LEAF(i) ((i) >= num_prims - 1)
+// Number of treelet leaves and subsets of them
+#define TREELET_SIZE 7
+#define TREELET_SUBSETS (1 << TREELET_SIZE)
+// Minimum number of primitives in a subtree to restructure its treelet
+#define TREELET_MIN_PRIMS TREELET_SIZE
+// SAH costs of node traversal and primitive intersection
+#define COST_NODE 1.2f
+#define COST_PRIM 1.f
 
 /*************************************************************************
 TYPE DEFINITIONS
 **************************************************************************/
+#ifdef HLBVH_MORTON64
+typedef ulong morton_code;
+#else
+typedef int morton_code;
+#endif
+
 typedef struct
 {
     int parent;
     int left;
     int right;
-    int next;
+    // Number of primitives in the subtree
+    int count;
 } HlbvhNode;
 
 /*************************************************************************
 FUNCTIONS
 **************************************************************************/
-// The following two functions are from
-// http://devblogs.nvidia.com/parallelforall/thinking-parallel-part-iii-tree-construction-gpu/
-// Expands a 10-bit integer into 30 bits
+// Make a union of two bboxes
+INLINE bbox bbox_union(bbox b1, bbox b2)
+{
+    bbox res;
+    res.pmin = min(b1.pmin, b2.pmin);
+    res.pmax = max(b1.pmax, b2.pmax);
+    return res;
+}
+
+// Surface area of a bbox
+INLINE float bbox_surface_area(bbox b)
+{
+    float3 ext = b.pmax.xyz - b.pmin.xyz;
+    return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+}
+
+// Reset propagation flags
+KERNEL void clear_flags_main(
+    // Atomic flags
+    GLOBAL int* flags,
+    // Number of flags
+    int num_flags
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_flags)
+    {
+        flags[global_id] = 0;
+    }
+}
+
+#ifdef HLBVH_MORTON64
+// Expands a 21-bit integer into 63 bits
 // by inserting 2 zeros after each bit.
-INLINE uint expand_bits(uint v)
+INLINE ulong expand_bits_64(ulong v)
 {
-    v = (v * 0x00010001u) & 0xFF0000FFu;
-    v = (v * 0x00000101u) & 0x0F00F00Fu;
-    v = (v * 0x00000011u) & 0xC30C30C3u;
-    v = (v * 0x00000005u) & 0x49249249u;
+    v = (v | (v << 32)) & 0x001F00000000FFFFul;
+    v = (v | (v << 16)) & 0x001F0000FF0000FFul;
+    v = (v | (v << 8)) & 0x100F00F00F00F00Ful;
+    v = (v | (v << 4)) & 0x10C30C30C30C30C3ul;
+    v = (v | (v << 2)) & 0x1249249249249249ul;
     return v;
 }
 
-// Calculates a 30-bit Morton code for the
+// Calculates a 63-bit Morton code for the
 // given 3D point located within the unit cube [0,1].
-INLINE uint calculate_morton_code(float3 p)
+INLINE ulong calculate_morton_code_64(float3 p)
 {
-    float x = min(max(p.x * 1024.0f, 0.0f), 1023.0f);
-    float y = min(max(p.y * 1024.0f, 0.0f), 1023.0f);
-    float z = min(max(p.z * 1024.0f, 0.0f), 1023.0f);
-    unsigned int xx = expand_bits((uint)x);
-    unsigned int yy = expand_bits((uint)y);
-    unsigned int zz = expand_bits((uint)z);
+    float x = min(max(p.x * 2097152.0f, 0.0f), 2097151.0f);
+    float y = min(max(p.y * 2097152.0f, 0.0f), 2097151.0f);
+    float z = min(max(p.z * 2097152.0f, 0.0f), 2097151.0f);
+    ulong xx = expand_bits_64((ulong)x);
+    ulong yy = expand_bits_64((ulong)y);
+    ulong zz = expand_bits_64((ulong)z);
     return xx * 4 + yy * 2 + zz;
 }
-
-// Make a union of two bboxes
-INLINE bbox bbox_union(bbox b1, bbox b2)
-{
-    bbox res;
-    res.pmin = min(b1.pmin, b2.pmin);
-    res.pmax = max(b1.pmax, b2.pmax);
-    return res;
-}
+#endif
 
 // Assign Morton codes to each of positions
 KERNEL void calculate_morton_code_main(
@@ -106,7 +158,7 @@ KERNEL void calculate_morton_code_main(
     // Scene extents
     GLOBAL bbox const* restrict scene_bound, 
     // Morton codes
-    GLOBAL int* morton_codes
+    GLOBAL morton_code* morton_codes
     )
 {
     int global_id = get_global_id(0);
@@ -120,7 +172,11 @@ KERNEL void calculate_morton_code_main(
         float3 const scene_min = scene_bound->pmin.xyz;
         float3 const scene_extents = scene_bound->pmax.xyz - scene_bound->pmin.xyz;
         // Calculate morton code
+#ifdef HLBVH_MORTON64
+        morton_codes[global_id] = calculate_morton_code_64((center - scene_min) / scene_extents);
+#else
         morton_codes[global_id] = calculate_morton_code((center - scene_min) / scene_extents);
+#endif
     }
 }
 
@@ -128,7 +184,7 @@ KERNEL void calculate_morton_code_main(
 
 // Calculates longest common prefix length of bit representations
 // if  representations are equal we consider sucessive indices
-INLINE int delta(GLOBAL int const* morton_codes, int num_prims, int i1, int i2)
+INLINE int delta(GLOBAL morton_code const* morton_codes, int num_prims, int i1, int i2)
 {
     // Select left end
     int left = min(i1, i2);
@@ -140,15 +196,15 @@ INLINE int delta(GLOBAL int const* morton_codes, int num_prims, int i1, int i2)
         return -1;
     }
     // Fetch Morton codes for both ends
-    int left_code = morton_codes[left];
-    int right_code = morton_codes[right];
+    morton_code left_code = morton_codes[left];
+    morton_code right_code = morton_codes[right];
 
     // Special handling of duplicated codes: use their indices as a fallback
-    return left_code != right_code ? clz(left_code ^ right_code) : (32 + clz(left ^ right));
+    return left_code != right_code ? (int)clz(left_code ^ right_code) : (MORTON_CODE_BITS + clz(left ^ right));
 }
 
 // Find span occupied by internal node with index idx
-INLINE int2 find_span(GLOBAL int const* restrict morton_codes, int num_prims, int idx)
+INLINE int2 find_span(GLOBAL morton_code const* restrict morton_codes, int num_prims, int idx)
 {
     // Find the direction of the range
     int d = sign((float)(DELTA(idx, idx+1) - DELTA(idx, idx-1)));
@@ -183,7 +239,7 @@ INLINE int2 find_span(GLOBAL int const* restrict morton_codes, int num_prims, in
 }
 
 // Find split idx within the span
-INLINE int find_split(GLOBAL int const* restrict morton_codes, int num_prims, int2 span)
+INLINE int find_split(GLOBAL morton_code const* restrict morton_codes, int num_prims, int2 span)
 {
     // Fetch codes for both ends
     int left = span.x;
@@ -215,7 +271,7 @@ INLINE int find_split(GLOBAL int const* restrict morton_codes, int num_prims, in
 // Set parent-child relationship
 KERNEL void emit_hierarchy_main(
     // Sorted Morton codes of the primitives
-    GLOBAL int const* restrict morton_codes,
+    GLOBAL morton_code const* restrict morton_codes,
     // Bounds
     GLOBAL bbox const* restrict bounds,
     // Primitive indices
@@ -234,6 +290,7 @@ KERNEL void emit_hierarchy_main(
     if (global_id < num_prims)
     {
         nodes[LEAFIDX(global_id)].left = nodes[LEAFIDX(global_id)].right = indices[global_id];
+        nodes[LEAFIDX(global_id)].count = 1;
         bounds_sorted[LEAFIDX(global_id)] = bounds[indices[global_id]];
     }
     
@@ -252,11 +309,9 @@ KERNEL void emit_hierarchy_main(
 
         nodes[NODEIDX(global_id)].left = c1idx;
         nodes[NODEIDX(global_id)].right = c2idx;
-        //nodes[NODEIDX(global_id)].next = (range.y + 1 < num_prims) ? range.y + 1 : -1;
+        nodes[NODEIDX(global_id)].count = range.y - range.x + 1;
         nodes[c1idx].parent = NODEIDX(global_id);
-        //nodes[c1idx].next = c2idx;
         nodes[c2idx].parent = NODEIDX(global_id);
-        //nodes[c2idx].next = nodes[NODEIDX(global_id)].next;
     }
 }
 
@@ -311,4 +366,300 @@ KERNEL void refit_bounds_main(
         }
         while (idx != 0);
     }
-}
\ No newline at end of file
+}
+
+// Reload leaf bounds from new primitive bounds before a refit
+KERNEL void update_leaf_bounds_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode const* restrict nodes,
+    // Node bounds
+    GLOBAL bbox* bounds_sorted
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        // Leaves keep their primitive index in both children
+        int idx = LEAFIDX(global_id);
+        bounds_sorted[idx] = bounds[nodes[idx].left];
+    }
+}
+
+// Sum surface areas of internal nodes relative to the root area per group,
+// the estimate of the tree SAH cost tells when refits degraded the tree too much
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void tree_cost_main(
+    // Node bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Cost per group
+    GLOBAL float* group_costs
+    )
+{
+    __local float shared_costs[64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int global_size = get_global_size(0);
+
+    float inv_root_area = 1.f / max(bbox_surface_area(bounds[0]), FLT_MIN);
+    float cost = 0.f;
+
+    for (int i = global_id; i < num_prims - 1; i += global_size)
+    {
+        cost += bbox_surface_area(bounds[NODEIDX(i)]) * inv_root_area;
+    }
+
+    shared_costs[local_id] = cost;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = 32; stride > 0; stride >>= 1)
+    {
+        if (local_id < stride)
+        {
+            shared_costs[local_id] += shared_costs[local_id + stride];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        group_costs[get_group_id(0)] = shared_costs[0];
+    }
+}
+
+// Find the best topology for the treelet rooted at node idx and rewrite it
+// if it is cheaper than the current one. The subtree of idx is complete
+// and no other thread accesses it anymore.
+INLINE void restructure_treelet(
+    // Node bounds
+    GLOBAL bbox* bounds,
+    // Number of primitives
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // SAH costs of the subtrees
+    GLOBAL float* costs,
+    // Treelet root
+    int idx
+)
+{
+    // Form the treelet expanding a leaf with the largest surface area
+    int leaves[TREELET_SIZE];
+    int internal[TREELET_SIZE - 1];
+    int num_leaves = 2;
+    int num_internal = 1;
+
+    leaves[0] = nodes[idx].left;
+    leaves[1] = nodes[idx].right;
+    internal[0] = idx;
+
+    while (num_leaves < TREELET_SIZE)
+    {
+        int best = -1;
+        float best_area = -1.f;
+
+        for (int i = 0; i < num_leaves; ++i)
+        {
+            if (!IS_LEAF(leaves[i]))
+            {
+                float area = bbox_surface_area(bounds[leaves[i]]);
+
+                if (area > best_area)
+                {
+                    best = i;
+                    best_area = area;
+                }
+            }
+        }
+
+        if (best == -1)
+            break;
+
+        int node = leaves[best];
+        internal[num_internal++] = node;
+        leaves[best] = nodes[node].left;
+        leaves[num_leaves++] = nodes[node].right;
+    }
+
+    // Two leaves have a single topology
+    if (num_leaves < 3)
+        return;
+
+    bbox leaf_bounds[TREELET_SIZE];
+    for (int i = 0; i < num_leaves; ++i)
+    {
+        leaf_bounds[i] = bounds[leaves[i]];
+    }
+
+    // Optimal cost and partitioning for each subset of treelet leaves
+    float subset_cost[TREELET_SUBSETS];
+    int subset_part[TREELET_SUBSETS];
+    int const full = (1 << num_leaves) - 1;
+
+    for (int s = 1; s <= full; ++s)
+    {
+        int first = 31 - clz(s & -s);
+
+        if (popcount(s) == 1)
+        {
+            subset_cost[s] = costs[leaves[first]];
+            subset_part[s] = 0;
+            continue;
+        }
+
+        // Union of the subset bounds
+        bbox b = leaf_bounds[first];
+        for (int i = first + 1; i < num_leaves; ++i)
+        {
+            if (s & (1 << i))
+            {
+                b = bbox_union(b, leaf_bounds[i]);
+            }
+        }
+
+        // Try all the partitions keeping the lowest leaf on the left
+        // to skip mirrored ones
+        float best = FLT_MAX;
+        int best_part = 0;
+        int lowest = s & -s;
+
+        for (int p = (s - 1) & s; p > 0; p = (p - 1) & s)
+        {
+            if ((p & lowest) == 0)
+                continue;
+
+            float cost = subset_cost[p] + subset_cost[s ^ p];
+
+            if (cost < best)
+            {
+                best = cost;
+                best_part = p;
+            }
+        }
+
+        subset_cost[s] = COST_NODE * bbox_surface_area(b) + best;
+        subset_part[s] = best_part;
+    }
+
+    if (subset_cost[full] >= costs[idx])
+        return;
+
+    // Rebuild the treelet top down reusing internal nodes, children
+    // get their nodes after parents
+    int stack_subset[TREELET_SIZE - 1];
+    int stack_node[TREELET_SIZE - 1];
+    int order[TREELET_SIZE - 1];
+    int sp = 0;
+    int next_internal = 1;
+    int num_ordered = 0;
+
+    stack_subset[sp] = full;
+    stack_node[sp++] = idx;
+
+    while (sp > 0)
+    {
+        --sp;
+        int s = stack_subset[sp];
+        int node = stack_node[sp];
+        int part[2] = { subset_part[s], s ^ subset_part[s] };
+        int child[2];
+
+        order[num_ordered++] = node;
+
+        for (int i = 0; i < 2; ++i)
+        {
+            if (popcount(part[i]) == 1)
+            {
+                child[i] = leaves[31 - clz(part[i])];
+            }
+            else
+            {
+                child[i] = internal[next_internal++];
+                stack_subset[sp] = part[i];
+                stack_node[sp++] = child[i];
+            }
+
+            nodes[child[i]].parent = node;
+        }
+
+        nodes[node].left = child[0];
+        nodes[node].right = child[1];
+    }
+
+    // Update bounds, counts and costs of internal nodes bottom up
+    for (int i = num_ordered - 1; i >= 0; --i)
+    {
+        int node = order[i];
+        int lc = nodes[node].left;
+        int rc = nodes[node].right;
+
+        bbox b = bbox_union(bounds[lc], bounds[rc]);
+        bounds[node] = b;
+        nodes[node].count = nodes[lc].count + nodes[rc].count;
+        costs[node] = COST_NODE * bbox_surface_area(b) + costs[lc] + costs[rc];
+    }
+}
+
+// Propagate bounds up to the root restructuring treelets on the way.
+// Replaces refit_bounds_main when treelet optimization is enabled.
+KERNEL void restructure_treelets_main(
+    // Node bounds
+    GLOBAL bbox* bounds,
+    // Number of nodes
+    int num_prims,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Atomic flags
+    GLOBAL int* flags,
+    // SAH costs of the subtrees
+    GLOBAL float* costs
+)
+{
+    int global_id = get_global_id(0);
+
+    // Start from leaf nodes
+    if (global_id < num_prims)
+    {
+        // Get my leaf index
+        int idx = LEAFIDX(global_id);
+
+        costs[idx] = COST_PRIM * bbox_surface_area(bounds[idx]);
+
+        do
+        {
+            // Move to parent node
+            idx = nodes[idx].parent;
+
+            // Second thread arriving at the node handles it, see refit_bounds_main
+            if (atomic_cmpxchg(flags + idx, 0, 1) == 1)
+            {
+                // Fetch kids
+                int lc = nodes[idx].left;
+                int rc = nodes[idx].right;
+
+                // Calculate bounds and cost
+                bbox b = bbox_union(bounds[lc], bounds[rc]);
+                bounds[idx] = b;
+                costs[idx] = COST_NODE * bbox_surface_area(b) + costs[lc] + costs[rc];
+
+                if (nodes[idx].count >= TREELET_MIN_PRIMS)
+                {
+                    restructure_treelet(bounds, num_prims, nodes, costs, idx);
+                }
+            }
+            else
+            {
+                break;
+            }
+        }
+        while (idx != 0);
+    }
+}
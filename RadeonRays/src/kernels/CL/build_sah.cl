@@ -0,0 +1,775 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file build_sah.cl
+    \version 1.0
+    \brief Binned SAH BVH build implementation
+
+    The tree is built top down one level at a time. Every task of a level
+    is a range of primitives to split: large tasks are binned by all their
+    primitives in parallel with global atomics, small ones by a single work
+    item. Primitives are then partitioned into the child ranges with an
+    exclusive scan of the side flags.
+
+    Nodes use HLBVH layout (N-1 internal nodes followed by N leaves), so
+    the result is traversed by HLBVH kernels.
+
+    Pros:
+        -SAH quality trees built on the device.
+    Cons:
+        -Slower build than HLBVH, host reads task counts after each level.
+ */
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+#define LEAFIDX(i) ((num_prims-1) + (i))
+// Number of bins per axis
+#define SAH_NUM_BINS 16
+// Tasks with more primitives are binned with global atomics
+#define SAH_LARGE_TASK 256
+// Ints per bin: ordered int bounds and primitive count
+#define SAH_BIN_STRIDE 8
+// Counters: tasks of the next level, large tasks of the next level, internal nodes
+#define COUNTER_TASKS 0
+#define COUNTER_LARGE_TASKS 1
+#define COUNTER_NODES 2
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+typedef struct
+{
+    int parent;
+    int left;
+    int right;
+    // Number of primitives in the subtree
+    int count;
+} HlbvhNode;
+
+typedef struct
+{
+    // Bounds of the primitives and of their centroids
+    bbox bounds;
+    bbox centroid_bounds;
+    // Primitive range
+    int begin;
+    int count;
+    // Internal node emitted by the task
+    int node;
+    // Bins of a large task, -1 for small ones
+    int bins;
+    // Split axis (-1 for median split), first bin of the right side
+    // and number of primitives on the left
+    int axis;
+    int split;
+    int left_count;
+    // Child tasks, -1 for single primitive children
+    int left_task;
+    int right_task;
+    int padding[3];
+} SahTask;
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+INLINE bbox bbox_union(bbox b1, bbox b2)
+{
+    bbox res;
+    res.pmin = min(b1.pmin, b2.pmin);
+    res.pmax = max(b1.pmax, b2.pmax);
+    return res;
+}
+
+INLINE bbox bbox_intersection(bbox b1, bbox b2)
+{
+    bbox res;
+    res.pmin = max(b1.pmin, b2.pmin);
+    res.pmax = min(b1.pmax, b2.pmax);
+    return res;
+}
+
+INLINE bbox bbox_empty()
+{
+    bbox res;
+    res.pmin = make_float4(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    res.pmax = make_float4(-FLT_MAX, -FLT_MAX, -FLT_MAX, 0.f);
+    return res;
+}
+
+INLINE float bbox_surface_area(bbox b)
+{
+    float3 ext = b.pmax.xyz - b.pmin.xyz;
+    return 2.f * (ext.x * ext.y + ext.x * ext.z + ext.y * ext.z);
+}
+
+INLINE float get_axis(float4 v, int axis)
+{
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+INLINE float4 set_axis(float4 v, int axis, float value)
+{
+    if (axis == 0) v.x = value;
+    else if (axis == 1) v.y = value;
+    else v.z = value;
+    return v;
+}
+
+INLINE float4 centroid(bbox b)
+{
+    return 0.5f * (b.pmin + b.pmax);
+}
+
+// Bin of a centroid coordinate within [lo, hi], the same expression is used
+// by binning and partition so both always agree
+INLINE int bin_index(float c, float lo, float hi)
+{
+    int const b = (int)(SAH_NUM_BINS * (c - lo) / (hi - lo));
+    return clamp(b, 0, SAH_NUM_BINS - 1);
+}
+
+// Side of the split a primitive of the task goes to, 1 for the left one
+INLINE int is_left(SahTask const* task, bbox b, int idx)
+{
+    if (task->axis < 0)
+    {
+        return idx - task->begin < task->left_count;
+    }
+
+    float const lo = get_axis(task->centroid_bounds.pmin, task->axis);
+    float const hi = get_axis(task->centroid_bounds.pmax, task->axis);
+    return bin_index(get_axis(centroid(b), task->axis), lo, hi) < task->split;
+}
+
+// Atomically grow ordered int bounds stored at bin
+INLINE void bin_add(GLOBAL int* bin, bbox b)
+{
+    atomic_min(bin + 0, float_as_ordered_int(b.pmin.x));
+    atomic_min(bin + 1, float_as_ordered_int(b.pmin.y));
+    atomic_min(bin + 2, float_as_ordered_int(b.pmin.z));
+    atomic_max(bin + 3, float_as_ordered_int(b.pmax.x));
+    atomic_max(bin + 4, float_as_ordered_int(b.pmax.y));
+    atomic_max(bin + 5, float_as_ordered_int(b.pmax.z));
+    atomic_inc(bin + 6);
+}
+
+INLINE bbox bin_bounds(GLOBAL int const* bin)
+{
+    bbox res;
+    res.pmin = make_float4(ordered_int_as_float(bin[0]), ordered_int_as_float(bin[1]), ordered_int_as_float(bin[2]), 0.f);
+    res.pmax = make_float4(ordered_int_as_float(bin[3]), ordered_int_as_float(bin[4]), ordered_int_as_float(bin[5]), 0.f);
+    return res;
+}
+
+// Create the task of a child or return -1 for single primitive ones,
+// the node of the child is returned in node
+INLINE int emit_child(
+    GLOBAL SahTask* tasks,
+    GLOBAL int* counters,
+    GLOBAL HlbvhNode* nodes,
+    int num_prims,
+    int parent,
+    bbox bounds,
+    bbox centroid_bounds,
+    int begin,
+    int count,
+    int* node
+    )
+{
+    if (count == 1)
+    {
+        *node = LEAFIDX(begin);
+        return -1;
+    }
+
+    int const task_idx = atomic_inc(counters + COUNTER_TASKS);
+    *node = atomic_inc(counters + COUNTER_NODES);
+
+    SahTask task;
+    task.bounds = bounds;
+    task.centroid_bounds = centroid_bounds;
+    task.begin = begin;
+    task.count = count;
+    task.node = *node;
+    task.bins = count > SAH_LARGE_TASK ? atomic_inc(counters + COUNTER_LARGE_TASKS) : -1;
+    task.axis = -1;
+    task.split = 0;
+    task.left_count = 0;
+    task.left_task = -1;
+    task.right_task = -1;
+    tasks[task_idx] = task;
+
+    nodes[*node].parent = parent;
+    return task_idx;
+}
+
+// Reset bins to empty bounds and zero counts, the first work item also
+// resets task counters of the next level
+KERNEL void clear_bins_main(
+    // Bins
+    GLOBAL int* bins,
+    // Number of bins
+    int num_bins,
+    // Build counters
+    GLOBAL int* counters
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id == 0)
+    {
+        counters[COUNTER_TASKS] = 0;
+        counters[COUNTER_LARGE_TASKS] = 0;
+    }
+
+    if (global_id < num_bins * SAH_BIN_STRIDE)
+    {
+        int const k = global_id % SAH_BIN_STRIDE;
+        bins[global_id] = k < 3 ? INT_MAX : (k < 6 ? INT_MIN : 0);
+    }
+}
+
+// Reduce primitive bounds into the root bin: a group reduces its
+// primitives in local memory and merges the result with atomics
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void reduce_bounds_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Root bin
+    GLOBAL int* root_bin
+    )
+{
+    __local bbox shared_bounds[64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int global_size = get_global_size(0);
+
+    bbox b = bbox_empty();
+
+    for (int i = global_id; i < num_prims; i += global_size)
+    {
+        b = bbox_union(b, bounds[i]);
+    }
+
+    shared_bounds[local_id] = b;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = 32; stride > 0; stride >>= 1)
+    {
+        if (local_id < stride)
+        {
+            shared_bounds[local_id] = bbox_union(shared_bounds[local_id], shared_bounds[local_id + stride]);
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (local_id == 0)
+    {
+        bin_add(root_bin, shared_bounds[0]);
+    }
+}
+
+// Set up the root task covering all the primitives
+KERNEL void init_build_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Number of primitives
+    int num_prims,
+    // Root bin
+    GLOBAL int const* restrict root_bin,
+    // Primitive indices
+    GLOBAL int* indices,
+    // Task of each primitive index
+    GLOBAL int* prim_tasks,
+    // Tasks of the first level
+    GLOBAL SahTask* tasks,
+    // Build counters
+    GLOBAL int* counters,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* node_bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        indices[global_id] = global_id;
+        prim_tasks[global_id] = num_prims > 1 ? 0 : -1;
+    }
+
+    if (global_id == 0)
+    {
+        counters[COUNTER_NODES] = 1;
+        nodes[0].parent = -1;
+
+        if (num_prims == 1)
+        {
+            // Single leaf is the root
+            nodes[0].left = nodes[0].right = 0;
+            nodes[0].count = 1;
+            node_bounds[0] = bounds[0];
+            counters[COUNTER_TASKS] = 0;
+            counters[COUNTER_LARGE_TASKS] = 0;
+            return;
+        }
+
+        bbox const b = bin_bounds(root_bin);
+
+        SahTask task;
+        task.bounds = b;
+        task.centroid_bounds = b;
+        task.begin = 0;
+        task.count = num_prims;
+        task.node = 0;
+        task.bins = num_prims > SAH_LARGE_TASK ? 0 : -1;
+        task.axis = -1;
+        task.split = 0;
+        task.left_count = 0;
+        task.left_task = -1;
+        task.right_task = -1;
+        tasks[0] = task;
+
+        counters[COUNTER_TASKS] = 1;
+        counters[COUNTER_LARGE_TASKS] = num_prims > SAH_LARGE_TASK ? 1 : 0;
+    }
+}
+
+// Bin primitives of large tasks
+KERNEL void bin_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Task of each primitive index
+    GLOBAL int const* restrict prim_tasks,
+    // Number of primitives
+    int num_prims,
+    // Tasks
+    GLOBAL SahTask const* restrict tasks,
+    // Bins
+    GLOBAL int* bins
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int const t = prim_tasks[global_id];
+
+        if (t < 0 || tasks[t].bins < 0)
+        {
+            return;
+        }
+
+        bbox const cb = tasks[t].centroid_bounds;
+        bbox const b = bounds[indices[global_id]];
+        float4 const c = centroid(b);
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            int const bin = bin_index(get_axis(c, axis), get_axis(cb.pmin, axis), get_axis(cb.pmax, axis));
+            bin_add(bins + ((tasks[t].bins * 3 + axis) * SAH_NUM_BINS + bin) * SAH_BIN_STRIDE, b);
+        }
+    }
+}
+
+// Pick the cheapest split of each task, emit its node and child tasks
+KERNEL void split_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Number of primitives
+    int num_prims,
+    // Tasks of the level
+    GLOBAL SahTask* tasks,
+    // Number of tasks
+    int num_tasks,
+    // Bins of large tasks
+    GLOBAL int const* restrict bins,
+    // Tasks of the next level
+    GLOBAL SahTask* next_tasks,
+    // Build counters
+    GLOBAL int* counters,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* node_bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id >= num_tasks)
+    {
+        return;
+    }
+
+    SahTask task = tasks[global_id];
+
+    float best_cost = FLT_MAX;
+    bbox best_left = task.bounds;
+    bbox best_right = task.bounds;
+    task.axis = -1;
+    task.split = 0;
+    task.left_count = task.count / 2;
+
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        float const lo = get_axis(task.centroid_bounds.pmin, axis);
+        float const hi = get_axis(task.centroid_bounds.pmax, axis);
+
+        if (!(hi > lo))
+        {
+            continue;
+        }
+
+        bbox bin_box[SAH_NUM_BINS];
+        int bin_count[SAH_NUM_BINS];
+
+        if (task.bins >= 0)
+        {
+            for (int i = 0; i < SAH_NUM_BINS; ++i)
+            {
+                GLOBAL int const* bin = bins + ((task.bins * 3 + axis) * SAH_NUM_BINS + i) * SAH_BIN_STRIDE;
+                // Bounds of empty bins are not valid floats
+                bin_count[i] = bin[6];
+                bin_box[i] = bin_count[i] > 0 ? bin_bounds(bin) : bbox_empty();
+            }
+        }
+        else
+        {
+            for (int i = 0; i < SAH_NUM_BINS; ++i)
+            {
+                bin_box[i] = bbox_empty();
+                bin_count[i] = 0;
+            }
+
+            for (int i = task.begin; i < task.begin + task.count; ++i)
+            {
+                bbox const b = bounds[indices[i]];
+                int const bin = bin_index(get_axis(centroid(b), axis), lo, hi);
+                bin_box[bin] = bbox_union(bin_box[bin], b);
+                ++bin_count[bin];
+            }
+        }
+
+        // Right side costs of each split plane
+        float right_cost[SAH_NUM_BINS];
+        bbox right_box = bbox_empty();
+        int right_count = 0;
+
+        for (int i = SAH_NUM_BINS - 1; i > 0; --i)
+        {
+            right_box = bbox_union(right_box, bin_box[i]);
+            right_count += bin_count[i];
+            right_cost[i] = right_count > 0 ? bbox_surface_area(right_box) * right_count : 0.f;
+        }
+
+        bbox left_box = bbox_empty();
+        int left_count = 0;
+
+        for (int i = 1; i < SAH_NUM_BINS; ++i)
+        {
+            left_box = bbox_union(left_box, bin_box[i - 1]);
+            left_count += bin_count[i - 1];
+
+            if (left_count == 0 || left_count == task.count)
+            {
+                continue;
+            }
+
+            float const cost = bbox_surface_area(left_box) * left_count + right_cost[i];
+
+            if (cost < best_cost)
+            {
+                best_cost = cost;
+                task.axis = axis;
+                task.split = i;
+                task.left_count = left_count;
+                best_left = left_box;
+            }
+        }
+
+        if (task.axis == axis)
+        {
+            // Bounds of the right side of the best plane
+            right_box = bbox_empty();
+
+            for (int i = task.split; i < SAH_NUM_BINS; ++i)
+            {
+                right_box = bbox_union(right_box, bin_box[i]);
+            }
+
+            best_right = right_box;
+        }
+    }
+
+    // Centroids of the children are inside their bounds and on their side of the plane
+    bbox left_centroids = bbox_intersection(best_left, task.centroid_bounds);
+    bbox right_centroids = bbox_intersection(best_right, task.centroid_bounds);
+
+    if (task.axis >= 0)
+    {
+        float const lo = get_axis(task.centroid_bounds.pmin, task.axis);
+        float const hi = get_axis(task.centroid_bounds.pmax, task.axis);
+        float const plane = lo + (hi - lo) * task.split / SAH_NUM_BINS;
+        left_centroids.pmax = set_axis(left_centroids.pmax, task.axis, min(plane, get_axis(left_centroids.pmax, task.axis)));
+        right_centroids.pmin = set_axis(right_centroids.pmin, task.axis, max(plane, get_axis(right_centroids.pmin, task.axis)));
+    }
+    else
+    {
+        left_centroids = right_centroids = task.centroid_bounds;
+    }
+
+    int left_node = 0;
+    int right_node = 0;
+    task.left_task = emit_child(next_tasks, counters, nodes, num_prims, task.node, best_left, left_centroids,
+        task.begin, task.left_count, &left_node);
+    task.right_task = emit_child(next_tasks, counters, nodes, num_prims, task.node, best_right, right_centroids,
+        task.begin + task.left_count, task.count - task.left_count, &right_node);
+
+    nodes[task.node].left = left_node;
+    nodes[task.node].right = right_node;
+    nodes[task.node].count = task.count;
+    node_bounds[task.node] = task.bounds;
+
+    tasks[global_id] = task;
+}
+
+// Flag primitives going to the left side of their task split
+KERNEL void flag_left_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Task of each primitive index
+    GLOBAL int const* restrict prim_tasks,
+    // Number of primitives
+    int num_prims,
+    // Tasks
+    GLOBAL SahTask const* restrict tasks,
+    // Flags
+    GLOBAL int* flags
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_prims)
+    {
+        int const t = prim_tasks[global_id];
+
+        if (t < 0)
+        {
+            flags[global_id] = 0;
+            return;
+        }
+
+        SahTask const task = tasks[t];
+        flags[global_id] = is_left(&task, bounds[indices[global_id]], global_id);
+    }
+}
+
+// Move primitives into the ranges of the child tasks and emit leaves
+KERNEL void scatter_main(
+    // Primitive bounds
+    GLOBAL bbox const* restrict bounds,
+    // Primitive indices
+    GLOBAL int const* restrict indices,
+    // Task of each primitive index
+    GLOBAL int const* restrict prim_tasks,
+    // Left side flags
+    GLOBAL int const* restrict flags,
+    // Exclusive scan of the flags
+    GLOBAL int const* restrict offsets,
+    // Number of primitives
+    int num_prims,
+    // Tasks
+    GLOBAL SahTask const* restrict tasks,
+    // Partitioned primitive indices
+    GLOBAL int* next_indices,
+    // Next level task of each primitive index
+    GLOBAL int* next_prim_tasks,
+    // Nodes
+    GLOBAL HlbvhNode* nodes,
+    // Node bounds
+    GLOBAL bbox* node_bounds
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id >= num_prims)
+    {
+        return;
+    }
+
+    int const t = prim_tasks[global_id];
+    int const prim = indices[global_id];
+
+    if (t < 0)
+    {
+        next_indices[global_id] = prim;
+        next_prim_tasks[global_id] = -1;
+        return;
+    }
+
+    SahTask const task = tasks[t];
+    int const left_before = offsets[global_id] - offsets[task.begin];
+
+    int pos;
+    int child;
+
+    if (flags[global_id])
+    {
+        pos = task.begin + left_before;
+        child = task.left_task;
+    }
+    else
+    {
+        pos = task.begin + task.left_count + (global_id - task.begin - left_before);
+        child = task.right_task;
+    }
+
+    next_indices[pos] = prim;
+    next_prim_tasks[pos] = child;
+
+    if (child < 0)
+    {
+        int const leaf = LEAFIDX(pos);
+        nodes[leaf].parent = task.node;
+        nodes[leaf].left = nodes[leaf].right = prim;
+        nodes[leaf].count = 1;
+        node_bounds[leaf] = bounds[prim];
+    }
+}
+
+// Exclusive scan of 64 values per group, group totals are written to group_sums
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scan_groups_main(
+    GLOBAL int const* restrict values,
+    int num_values,
+    GLOBAL int* result,
+    GLOBAL int* group_sums
+    )
+{
+    __local int shared[64];
+
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+
+    int const value = global_id < num_values ? values[global_id] : 0;
+    shared[local_id] = value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int stride = 1; stride < 64; stride <<= 1)
+    {
+        int const add = local_id >= stride ? shared[local_id - stride] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        shared[local_id] += add;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (global_id < num_values)
+    {
+        result[global_id] = shared[local_id] - value;
+    }
+
+    if (local_id == 63)
+    {
+        group_sums[get_group_id(0)] = shared[63];
+    }
+}
+
+// Exclusive scan of group totals in place by a single group
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scan_group_sums_main(
+    GLOBAL int* group_sums,
+    int num_groups
+    )
+{
+    __local int shared[64];
+    __local int carry;
+
+    int local_id = get_local_id(0);
+
+    if (local_id == 0)
+    {
+        carry = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int base = 0; base < num_groups; base += 64)
+    {
+        int const idx = base + local_id;
+        int const value = idx < num_groups ? group_sums[idx] : 0;
+        shared[local_id] = value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int stride = 1; stride < 64; stride <<= 1)
+        {
+            int const add = local_id >= stride ? shared[local_id - stride] : 0;
+            barrier(CLK_LOCAL_MEM_FENCE);
+            shared[local_id] += add;
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+
+        if (idx < num_groups)
+        {
+            group_sums[idx] = carry + shared[local_id] - value;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        if (local_id == 0)
+        {
+            carry += shared[63];
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+// Add scanned group totals to the values of each group
+KERNEL void add_group_sums_main(
+    GLOBAL int* result,
+    int num_values,
+    GLOBAL int const* restrict group_sums
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_values)
+    {
+        result[global_id] += group_sums[global_id / 64];
+    }
+}
@@ -31,6 +31,23 @@ DEFINES
 #define MISS_MARKER -1
 #define INVALID_IDX -1
 
+// Closest hit output formats, has to match "acc.hit_format" option values
+// Intersection struct
+#define HIT_FORMAT_FULL 0
+// Hit distance, -1 for miss
+#define HIT_FORMAT_T 1
+// Primitive ID and hit distance, MISS_MARKER primitive ID for miss
+#define HIT_FORMAT_PRIMID_T 2
+// Shape ID and primitive ID, MISS_MARKER for miss
+#define HIT_FORMAT_IDS 3
+// Planes of shape IDs, primitive IDs, u, v and hit distances, MISS_MARKER IDs for miss
+#define HIT_FORMAT_SOA 4
+
+// Work group size of traversal kernels, the host passes the one selected for the device
+#ifndef RR_GROUP_SIZE
+#define RR_GROUP_SIZE 64
+#endif
+
 /*************************************************************************
 EXTENSIONS
 **************************************************************************/
@@ -38,6 +55,15 @@ EXTENSIONS
 #pragma OPENCL EXTENSION cl_amd_media_ops2 : enable
 #endif
 
+#ifdef cl_khr_subgroup_ballot
+#pragma OPENCL EXTENSION cl_khr_subgroup_ballot : enable
+#endif
+
+// Sub group traversal variants are compiled for devices reporting cl_khr_subgroups
+#ifdef RR_SUBGROUPS
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
 /*************************************************************************
 TYPES
 **************************************************************************/
@@ -68,6 +94,49 @@ typedef struct
     float4 uvwt;
 } Intersection;
 
+// Surface point secondary rays start from, a zero normal marks a missing point
+typedef struct
+{
+    float4 position;
+    float4 normal;
+} surface_point;
+
+// Per ray traversal counters written by kernels compiled with RR_TRAVERSAL_STATS
+typedef struct
+{
+    // Nodes fetched, leaves included
+    int nodes;
+    // Leaves whose primitives were tested
+    int leaves;
+    // Primitive intersection tests
+    int prims;
+    // Short stack spills to global memory
+    int spills;
+} traversal_stats;
+
+#ifdef RR_TRAVERSAL_STATS
+// Traversal entry points get stats buffer and its size in elements as the last arguments,
+// rays past the end of the buffer are traversed without recording
+#define TRAVERSAL_STATS_OUT(idx) ((idx) < num_stats ? stats + (idx) : 0)
+#define STATS_BEGIN() traversal_stats ray_stats = { 0, 0, 0, 0 }
+#define STATS_ADD(field, n) ray_stats.field += (n)
+#define STATS_END(out) do { if (out) *(out) = ray_stats; } while (0)
+#else
+#define TRAVERSAL_STATS_OUT(idx) 0
+#define STATS_BEGIN()
+#define STATS_ADD(field, n)
+#define STATS_END(out)
+#endif
+
+#ifdef RR_PACKED_VERTICES
+// Vertices are stored as 3 floats without the 4th padding component
+#define VERTEX_TYPE float
+#define FETCH_VERTEX(v, i) vload3((i), (v))
+#else
+#define VERTEX_TYPE float3
+#define FETCH_VERTEX(v, i) (v)[(i)]
+#endif
+
 
 /*************************************************************************
 HELPER FUNCTIONS
@@ -84,6 +153,31 @@ int ray_is_active(ray const* r)
     return r->extra.y;
 }
 
+// Traversal flags kept in extra.y above the active bit, have to match ray::Flags
+#define RAY_FLAG_ANY_HIT 2
+#define RAY_FLAG_CULL_BACK_FACES 4
+#define RAY_FLAG_OPAQUE 8
+
+INLINE
+int ray_get_flags(ray const* r)
+{
+    return r->extra.y;
+}
+
+INLINE
+bool ray_is_any_hit(ray const* r)
+{
+    return (ray_get_flags(r) & RAY_FLAG_ANY_HIT) != 0;
+}
+
+// Check if the ray skips the triangle: back faces, whose normal points along the ray,
+// with RAY_FLAG_CULL_BACK_FACES
+INLINE
+bool ray_culls_triangle(ray const* r, float3 v1, float3 v2, float3 v3)
+{
+    return (ray_get_flags(r) & RAY_FLAG_CULL_BACK_FACES) && dot(cross(v2 - v1, v3 - v1), r->d.xyz) > 0.f;
+}
+
 INLINE
 float ray_get_maxt(ray const* r)
 {
@@ -96,6 +190,18 @@ float ray_get_time(ray const* r)
     return r->d.w;
 }
 
+INLINE
+float ray_get_spread(ray const* r)
+{
+    return as_float(r->padding.x);
+}
+
+INLINE
+uint ray_get_lod_seed(ray const* r)
+{
+    return (uint)r->padding.y;
+}
+
 /*************************************************************************
 FUNCTIONS
 **************************************************************************/
@@ -165,13 +271,99 @@ INLINE float max3(float a, float b, float c)
 }
 
 
-// Intersect ray against a triangle and return intersection interval value if it is in
-// (0, t_max], return t_max otherwise.
+#ifdef RR_WATERTIGHT
+// Watertight ray triangle test (Woop, Benthin, Wald 2013). Vertices are translated to the ray
+// origin and sheared so that the ray runs along +z, edge functions of an edge shared by two
+// triangles are then computed from the same values and rays can't slip between them.
+// Returns intersection interval value if it is in [0, t_max], t_max otherwise.
+INLINE
+float watertight_intersect_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_max)
+{
+    float const dir[3] = { r.d.x, r.d.y, r.d.z };
+    float3 const ad = fabs(r.d.xyz);
+
+    // The dominant direction axis becomes z, x and y keep the winding
+    int const kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+    int kx = kz == 2 ? 0 : kz + 1;
+    int ky = kx == 2 ? 0 : kx + 1;
+
+    if (dir[kz] < 0.f)
+    {
+        int const k = kx;
+        kx = ky;
+        ky = k;
+    }
+
+    float const sx = dir[kx] / dir[kz];
+    float const sy = dir[ky] / dir[kz];
+    float const sz = 1.f / dir[kz];
+
+    float3 const a3 = v1 - r.o.xyz;
+    float3 const b3 = v2 - r.o.xyz;
+    float3 const c3 = v3 - r.o.xyz;
+    float const a[3] = { a3.x, a3.y, a3.z };
+    float const b[3] = { b3.x, b3.y, b3.z };
+    float const c[3] = { c3.x, c3.y, c3.z };
+
+    float const ax = a[kx] - sx * a[kz];
+    float const ay = a[ky] - sy * a[kz];
+    float const bx = b[kx] - sx * b[kz];
+    float const by = b[ky] - sy * b[kz];
+    float const cx = c[kx] - sx * c[kz];
+    float const cy = c[ky] - sy * c[kz];
+
+    // Scaled barycentrics, points on an edge count as inside for both triangles
+    float const u = cx * by - cy * bx;
+    float const v = ax * cy - ay * cx;
+    float const w = bx * ay - by * ax;
+
+    if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+    {
+        return t_max;
+    }
+
+    float const det = u + v + w;
+
+    if (det == 0.f)
+    {
+        return t_max;
+    }
+
+    float const t = (u * sz * a[kz] + v * sz * b[kz] + w * sz * c[kz]) / det;
+    return t >= 0.f && t <= t_max ? t : t_max;
+}
+
+// Triangle tests of the rest of the kernels go through the watertight test, vertices rebuilt
+// from edges are watertight up to the rounding of the edges
+INLINE
+float fast_intersect_triangle_edges(ray r, float3 v1, float3 e1, float3 e2, float t_max)
+{
+    return watertight_intersect_triangle(r, v1, v1 + e1, v1 + e2, t_max);
+}
+
 INLINE
 float fast_intersect_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_max)
 {
-    float3 const e1 = v2 - v1;
-    float3 const e2 = v3 - v1;
+    return watertight_intersect_triangle(r, v1, v2, v3, t_max);
+}
+
+INLINE
+bool fast_occlude_triangle_edges(ray r, float3 v1, float3 e1, float3 e2, float t_max)
+{
+    return watertight_intersect_triangle(r, v1, v1 + e1, v1 + e2, t_max) < t_max;
+}
+
+INLINE
+bool fast_occlude_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_max)
+{
+    return watertight_intersect_triangle(r, v1, v2, v3, t_max) < t_max;
+}
+#else
+// Intersect ray against a triangle given by a vertex and two edges adjacent to it
+// and return intersection interval value if it is in (0, t_max], return t_max otherwise.
+INLINE
+float fast_intersect_triangle_edges(ray r, float3 v1, float3 e1, float3 e2, float t_max)
+{
     float3 const s1 = cross(r.d.xyz, e2);
     float const invd = native_recip(dot(s1, e1));
     float3 const d = r.o.xyz - v1;
@@ -190,10 +382,87 @@ float fast_intersect_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_ma
     }
 }
 
+// Intersect ray against a triangle and return intersection interval value if it is in
+// (0, t_max], return t_max otherwise.
+INLINE
+float fast_intersect_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_max)
+{
+    return fast_intersect_triangle_edges(r, v1, v2 - v1, v3 - v1, t_max);
+}
+
+// Shadow ray version of the triangle test given by a vertex and two edges: only reports if
+// there is a hit in (0, t_max), bails out as soon as a barycentric coordinate is out of range.
+INLINE
+bool fast_occlude_triangle_edges(ray r, float3 v1, float3 e1, float3 e2, float t_max)
+{
+    float3 const s1 = cross(r.d.xyz, e2);
+    float const invd = native_recip(dot(s1, e1));
+    float3 const d = r.o.xyz - v1;
+    float const b1 = dot(d, s1) * invd;
+
+    if (b1 < 0.f || b1 > 1.f)
+    {
+        return false;
+    }
+
+    float3 const s2 = cross(d, e1);
+    float const b2 = dot(r.d.xyz, s2) * invd;
+
+    if (b2 < 0.f || b1 + b2 > 1.f)
+    {
+        return false;
+    }
+
+    float const temp = dot(e2, s2) * invd;
+    return temp >= 0.f && temp < t_max;
+}
+
+// Shadow ray version of the triangle test
+INLINE
+bool fast_occlude_triangle(ray r, float3 v1, float3 v2, float3 v3, float t_max)
+{
+    return fast_occlude_triangle_edges(r, v1, v2 - v1, v3 - v1, t_max);
+}
+#endif
+
+// Precomputed triangles (RR_PRECOMPUTED_TRIANGLES) are stored as a vertex and two edges adjacent
+// to it. Edges rounded per triangle differ between neighbours, so watertight builds store the
+// three vertices instead and the accessors below hide the difference from traversal kernels.
+INLINE
+float3 precomputed_triangle_vertex(GLOBAL float3 const* triangle, int i)
+{
+#ifdef RR_WATERTIGHT
+    return triangle[i];
+#else
+    return i == 0 ? triangle[0] : triangle[0] + triangle[i];
+#endif
+}
+
+INLINE
+float precomputed_intersect_triangle(ray r, GLOBAL float3 const* triangle, float t_max)
+{
+#ifdef RR_WATERTIGHT
+    return watertight_intersect_triangle(r, triangle[0], triangle[1], triangle[2], t_max);
+#else
+    return fast_intersect_triangle_edges(r, triangle[0], triangle[1], triangle[2], t_max);
+#endif
+}
+
+INLINE
+bool precomputed_occlude_triangle(ray r, GLOBAL float3 const* triangle, float t_max)
+{
+#ifdef RR_WATERTIGHT
+    return watertight_intersect_triangle(r, triangle[0], triangle[1], triangle[2], t_max) < t_max;
+#else
+    return fast_occlude_triangle_edges(r, triangle[0], triangle[1], triangle[2], t_max);
+#endif
+}
+
+// Watertight builds need the exact reciprocal to keep the slab test error bounded
 INLINE
 float3 safe_invdir(ray r)
 {
-#ifdef USE_SAFE_MATH
+#if defined(USE_SAFE_MATH) || defined(RR_WATERTIGHT)
     float const dirx = r.d.x;
     float const diry = r.d.y;
     float const dirz = r.d.z;
@@ -215,19 +484,128 @@ float2 fast_intersect_bbox1(bbox box, float3 invdir, float3 oxinvdir, float t_ma
 {
     float3 const f = mad(box.pmax.xyz, invdir, oxinvdir);
     float3 const n = mad(box.pmin.xyz, invdir, oxinvdir);
+#ifdef RR_WATERTIGHT
+    // Rounding may shrink the span below a triangle hit found by the watertight test, slabs are
+    // widened by the error bound of p * invdir - o * invdir (Ize 2013). The bound is absolute
+    // as the terms cancel for far origins, 4 ulps cover the divide and both products.
+    float3 const err = (max(fabs(f), fabs(n)) + 2.f * fabs(oxinvdir)) * 4.8e-7f;
+    float3 const tmax = max(f, n) + err;
+    float3 const tmin = min(f, n) - err;
+#else
     float3 const tmax = max(f, n);
     float3 const tmin = min(f, n);
+#endif
     float const t1 = min(min3(tmax.x, tmax.y, tmax.z), t_max);
     float const t0 = max(max3(tmin.x, tmin.y, tmin.z), 0.f);
     return make_float2(t0, t1);
 }
 
-// Given a point in triangle plane, calculate its barycentrics
+// Hash based random numbers for sampling, uncorrelated for different indices and seeds
 INLINE
-float2 triangle_calculate_barycentrics(float3 p, float3 v1, float3 v2, float3 v3)
+uint hash_uint(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+// Pair of uniform numbers in [0, 1)
+INLINE
+float2 random_float2(uint index, uint seed)
+{
+    uint h0 = hash_uint(index ^ hash_uint(seed));
+    uint h1 = hash_uint(h0);
+    return (float2)((h0 >> 8) * (1.f / 16777216.f), (h1 >> 8) * (1.f / 16777216.f));
+}
+
+INLINE
+float2 sample_disk(float2 u)
+{
+    float r = sqrt(u.x);
+    float phi = 2.f * PI * u.y;
+    return (float2)(r * cos(phi), r * sin(phi));
+}
+
+// Move the origin off the surface to the side rays leave to
+INLINE
+float3 offset_origin(float3 p, float3 n, float3 d)
+{
+    float eps = 1e-4f * max(1.f, max3(fabs(p.x), fabs(p.y), fabs(p.z)));
+    return p + (dot(n, d) < 0.f ? -n : n) * eps;
+}
+
+INLINE
+int surface_point_valid(surface_point const* p)
+{
+    return dot(p->normal.xyz, p->normal.xyz) > 0.f;
+}
+
+// Cosine distributed direction over the normal for a pair of uniform numbers
+INLINE
+float3 sample_hemisphere_cosine(float3 n, float2 u)
+{
+    // Orthonormal basis around the normal
+    float sign = n.z >= 0.f ? 1.f : -1.f;
+    float a = -1.f / (sign + n.z);
+    float b = n.x * n.y * a;
+    float3 t = (float3)(1.f + sign * n.x * n.x * a, sign * b, -sign * n.x);
+    float3 s = (float3)(b, sign + n.y * n.y * a, -n.y);
+
+    float2 disk = sample_disk(u);
+    return normalize(t * disk.x + s * disk.y + n * sqrt(max(0.f, 1.f - u.x)));
+}
+
+// Squared distance from point to bbox, zero for points inside
+INLINE
+float distance_to_bbox_sq(bbox box, float3 p)
+{
+    float3 const d = max(max(box.pmin.xyz - p, p - box.pmax.xyz), 0.f);
+    return dot(d, d);
+}
+
+// Closest point to p on triangle a b c, from "Real-Time Collision Detection" by Christer Ericson
+INLINE
+float3 closest_point_triangle(float3 p, float3 a, float3 b, float3 c)
+{
+    float3 const ab = b - a;
+    float3 const ac = c - a;
+    float3 const ap = p - a;
+
+    // Vertex regions first, then edge regions, then the face
+    float const d1 = dot(ab, ap);
+    float const d2 = dot(ac, ap);
+    if (d1 <= 0.f && d2 <= 0.f) return a;
+
+    float3 const bp = p - b;
+    float const d3 = dot(ab, bp);
+    float const d4 = dot(ac, bp);
+    if (d3 >= 0.f && d4 <= d3) return b;
+
+    float const vc = d1 * d4 - d3 * d2;
+    if (vc <= 0.f && d1 >= 0.f && d3 <= 0.f) return a + ab * (d1 / (d1 - d3));
+
+    float3 const cp = p - c;
+    float const d5 = dot(ab, cp);
+    float const d6 = dot(ac, cp);
+    if (d6 >= 0.f && d5 <= d6) return c;
+
+    float const vb = d5 * d2 - d1 * d6;
+    if (vb <= 0.f && d2 >= 0.f && d6 <= 0.f) return a + ac * (d2 / (d2 - d6));
+
+    float const va = d3 * d6 - d5 * d4;
+    if (va <= 0.f && (d4 - d3) >= 0.f && (d5 - d6) >= 0.f) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+
+    float const denom = 1.f / (va + vb + vc);
+    return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+// Given a point in triangle plane, calculate its barycentrics (triangle given by a vertex and two edges)
+INLINE
+float2 triangle_calculate_barycentrics_edges(float3 p, float3 v1, float3 e1, float3 e2)
 {
-    float3 const e1 = v2 - v1;
-    float3 const e2 = v3 - v1;
     float3 const e = p - v1;
     float const d00 = dot(e1, e1);
     float const d01 = dot(e1, e2);
@@ -239,3 +617,297 @@ float2 triangle_calculate_barycentrics(float3 p, float3 v1, float3 v2, float3 v3
     float const b2 = (d00 * d21 - d01 * d20) * invdenom;
     return make_float2(b1, b2);
 }
+
+// Given a point in triangle plane, calculate its barycentrics
+INLINE
+float2 triangle_calculate_barycentrics(float3 p, float3 v1, float3 v2, float3 v3)
+{
+    return triangle_calculate_barycentrics_edges(p, v1, v2 - v1, v3 - v1);
+}
+
+// Given a point in precomputed triangle plane, calculate its barycentrics
+INLINE
+float2 precomputed_triangle_barycentrics(float3 p, GLOBAL float3 const* triangle)
+{
+#ifdef RR_WATERTIGHT
+    return triangle_calculate_barycentrics(p, triangle[0], triangle[1], triangle[2]);
+#else
+    return triangle_calculate_barycentrics_edges(p, triangle[0], triangle[1], triangle[2]);
+#endif
+}
+
+// Intersect ray against a quad v1 v2 v3 v4 as a single primitive. Quad halves (v1 v2 v3 and v1 v4 v3)
+// share the diagonal edge and the origin offset, so the ray setup is done once for both of them.
+// Returns intersection interval value if it is in (0, t_max], t_max otherwise.
+INLINE
+float fast_intersect_quad(ray r, float3 v1, float3 v2, float3 v3, float3 v4, float t_max)
+{
+#ifdef RR_WATERTIGHT
+    return min(fast_intersect_triangle(r, v1, v2, v3, t_max), fast_intersect_triangle(r, v1, v4, v3, t_max));
+#else
+    float3 const e2 = v3 - v1;
+    float3 const s1 = cross(r.d.xyz, e2);
+    float3 const d = r.o.xyz - v1;
+    float const ds1 = dot(d, s1);
+    float t = t_max;
+
+    for (int i = 0; i < 2; ++i)
+    {
+        float3 const e1 = (i == 0 ? v2 : v4) - v1;
+        float const invd = native_recip(dot(s1, e1));
+        float const b1 = ds1 * invd;
+        float3 const s2 = cross(d, e1);
+        float const b2 = dot(r.d.xyz, s2) * invd;
+        float const temp = dot(e2, s2) * invd;
+
+        if (b1 >= 0.f && b1 <= 1.f && b2 >= 0.f && b1 + b2 <= 1.f && temp >= 0.f && temp <= t)
+        {
+            t = temp;
+        }
+    }
+
+    return t;
+#endif
+}
+
+// Shadow ray version of the quad test
+INLINE
+bool fast_occlude_quad(ray r, float3 v1, float3 v2, float3 v3, float3 v4, float t_max)
+{
+#ifdef RR_WATERTIGHT
+    return fast_occlude_triangle(r, v1, v2, v3, t_max) || fast_occlude_triangle(r, v1, v4, v3, t_max);
+#else
+    float3 const e2 = v3 - v1;
+    float3 const s1 = cross(r.d.xyz, e2);
+    float3 const d = r.o.xyz - v1;
+    float const ds1 = dot(d, s1);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        float3 const e1 = (i == 0 ? v2 : v4) - v1;
+        float const invd = native_recip(dot(s1, e1));
+        float const b1 = ds1 * invd;
+        float3 const s2 = cross(d, e1);
+        float const b2 = dot(r.d.xyz, s2) * invd;
+        float const temp = dot(e2, s2) * invd;
+
+        if (b1 >= 0.f && b1 <= 1.f && b2 >= 0.f && b1 + b2 <= 1.f && temp >= 0.f && temp < t_max)
+        {
+            return true;
+        }
+    }
+
+    return false;
+#endif
+}
+
+// Given a point in quad plane, calculate its quad coordinates: v1 is (0, 0), v2 is (1, 0),
+// v3 is (1, 1) and v4 is (0, 1), which is linear over each half of the quad
+INLINE
+float2 quad_calculate_uv(float3 p, float3 v1, float3 v2, float3 v3, float3 v4)
+{
+    float2 const b = triangle_calculate_barycentrics(p, v1, v2, v3);
+
+    // The point is on v2 side of the diagonal
+    if (b.x >= 0.f)
+    {
+        return make_float2(b.x + b.y, b.y);
+    }
+
+    float2 const c = triangle_calculate_barycentrics(p, v1, v4, v3);
+    return make_float2(c.y, c.x + c.y);
+}
+
+// The following two functions are from
+// http://devblogs.nvidia.com/parallelforall/thinking-parallel-part-iii-tree-construction-gpu/
+// Expands a 10-bit integer into 30 bits
+// by inserting 2 zeros after each bit.
+INLINE uint expand_bits(uint v)
+{
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+// Calculates a 30-bit Morton code for the
+// given 3D point located within the unit cube [0,1].
+INLINE uint calculate_morton_code(float3 p)
+{
+    float x = min(max(p.x * 1024.0f, 0.0f), 1023.0f);
+    float y = min(max(p.y * 1024.0f, 0.0f), 1023.0f);
+    float z = min(max(p.z * 1024.0f, 0.0f), 1023.0f);
+    unsigned int xx = expand_bits((uint)x);
+    unsigned int yy = expand_bits((uint)y);
+    unsigned int zz = expand_bits((uint)z);
+    return xx * 4 + yy * 2 + zz;
+}
+
+// Map float to int preserving the order, so float bounds
+// can be evaluated with integer atomics
+INLINE int float_as_ordered_int(float f)
+{
+    int const i = as_int(f);
+    return i >= 0 ? i : i ^ 0x7FFFFFFF;
+}
+
+INLINE float ordered_int_as_float(int i)
+{
+    return as_float(i >= 0 ? i : i ^ 0x7FFFFFFF);
+}
+
+// Check if the hit format reports barycentric coordinates
+INLINE bool hit_format_has_uv(int format)
+{
+    return format == HIT_FORMAT_FULL || format == HIT_FORMAT_SOA;
+}
+
+// Store closest hit in the requested format, uv is only used by formats reporting it
+// and plane_size (elements per plane) only by HIT_FORMAT_SOA
+INLINE
+void store_hit(GLOBAL int* hits, int idx, int format, int plane_size, int shape_id, int prim_id, float2 uv, float t)
+{
+    switch (format)
+    {
+    case HIT_FORMAT_SOA:
+        hits[idx] = shape_id;
+        hits[plane_size + idx] = prim_id;
+        ((GLOBAL float*)hits)[2 * plane_size + idx] = uv.x;
+        ((GLOBAL float*)hits)[3 * plane_size + idx] = uv.y;
+        ((GLOBAL float*)hits)[4 * plane_size + idx] = t;
+        break;
+    case HIT_FORMAT_T:
+        ((GLOBAL float*)hits)[idx] = t;
+        break;
+    case HIT_FORMAT_PRIMID_T:
+        vstore2(make_int2(prim_id, as_int(t)), idx, hits);
+        break;
+    case HIT_FORMAT_IDS:
+        vstore2(make_int2(shape_id, prim_id), idx, hits);
+        break;
+    default:
+        {
+            GLOBAL Intersection* isect = (GLOBAL Intersection*)hits + idx;
+            isect->shape_id = shape_id;
+            isect->prim_id = prim_id;
+            isect->uvwt = make_float4(uv.x, uv.y, 0.f, t);
+        }
+        break;
+    }
+}
+
+// Store a miss in the requested format
+INLINE
+void store_miss(GLOBAL int* hits, int idx, int format, int plane_size)
+{
+    switch (format)
+    {
+    case HIT_FORMAT_SOA:
+        hits[idx] = MISS_MARKER;
+        hits[plane_size + idx] = MISS_MARKER;
+        break;
+    case HIT_FORMAT_T:
+        ((GLOBAL float*)hits)[idx] = -1.f;
+        break;
+    case HIT_FORMAT_PRIMID_T:
+        vstore2(make_int2(MISS_MARKER, as_int(-1.f)), idx, hits);
+        break;
+    case HIT_FORMAT_IDS:
+        vstore2(make_int2(MISS_MARKER, MISS_MARKER), idx, hits);
+        break;
+    default:
+        {
+            GLOBAL Intersection* isect = (GLOBAL Intersection*)hits + idx;
+            isect->shape_id = MISS_MARKER;
+            isect->prim_id = MISS_MARKER;
+        }
+        break;
+    }
+}
+
+// Store bit-packed occlusion results ("acc.occlusion_format" "bits"): bit ray_idx % 32
+// of word ray_idx / 32 is set for occluded rays. All the work items of the group have to
+// call it with consecutive ray indices starting at a multiple of 32 and the group size
+// has to be a multiple of 32, so every group writes whole words and nothing is cleared
+INLINE
+void store_occlusion_bits(GLOBAL uint* bits, int ray_idx, int num_rays, bool occluded, __local uint* lds_bits)
+{
+    int const local_id = get_local_id(0);
+    // First ray of each word writes it, words past the working set are left alone
+    bool const writer = (ray_idx & 31) == 0 && ray_idx < num_rays;
+
+#ifdef cl_khr_subgroup_ballot
+    // Sub groups of whole words get them straight from the ballot
+    if (get_max_sub_group_size() % 32 == 0)
+    {
+        uint4 const ballot = sub_group_ballot(occluded ? 1 : 0);
+        uint const lane = get_sub_group_local_id();
+        uint const word = lane < 64 ? (lane < 32 ? ballot.x : ballot.y) : (lane < 96 ? ballot.z : ballot.w);
+
+        if (writer)
+        {
+            bits[ray_idx / 32] = word;
+        }
+
+        return;
+    }
+#endif
+
+    if (local_id < (int)get_local_size(0) / 32)
+    {
+        lds_bits[local_id] = 0;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (occluded)
+    {
+        atomic_or(lds_bits + local_id / 32, 1u << (local_id & 31));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (writer)
+    {
+        bits[ray_idx / 32] = lds_bits[local_id / 32];
+    }
+
+    // Persistent threads reuse the words for the next batch
+    barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+// Persistent threads: fetch start index of the next batch of rays for the
+// work group from the global counter, the index is the same for all the work items
+INLINE
+int fetch_ray_batch(GLOBAL int* counters, __local int* batch_start)
+{
+    if (get_local_id(0) == 0)
+    {
+        *batch_start = atomic_add(counters, (int)get_local_size(0));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+    int const start = *batch_start;
+    // Make sure everybody has read the value before it is overwritten
+    barrier(CLK_LOCAL_MEM_FENCE);
+    return start;
+}
+
+// Persistent threads: the last work group to finish resets the counters
+// back to zero, so they are ready for the next launch
+INLINE
+void release_ray_batches(GLOBAL int* counters)
+{
+    if (get_local_id(0) == 0)
+    {
+        // All the fetches of this group are done before signaling
+        mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+        if (atomic_inc(counters + 1) == (int)get_num_groups(0) - 1)
+        {
+            counters[0] = 0;
+            counters[1] = 0;
+        }
+    }
+}
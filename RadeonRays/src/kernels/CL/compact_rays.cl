@@ -0,0 +1,108 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file compact_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray compaction kernels.
+
+    Wavefront renderers terminate rays between bounces, compaction moves the
+    remaining ones to the front of a buffer preserving their order, so the
+    next bounce only launches work items for live rays:
+
+        ray_flags_main: 0 or 1 flag and identity index per ray
+        compaction of indices (Calc::Primitives), writes the new ray count
+        gather_compacted_rays_main: rays of the compacted indices
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Flag rays to keep: nonzero predicate or active rays if there is no predicate,
+// entries past the ray count are never kept
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void ray_flags_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Per ray predicate, only read if use_predicate is set
+    GLOBAL int const* restrict predicate,
+    // Read predicate instead of ray activity
+    int use_predicate,
+    // Number of entries in flags and indices buffers
+    int max_rays,
+    // Flags
+    GLOBAL int* flags,
+    // Ray indices
+    GLOBAL int* indices
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_rays)
+    {
+        int flag = 0;
+
+        if (global_id < *num_rays)
+        {
+            if (use_predicate)
+            {
+                flag = predicate[global_id] != 0 ? 1 : 0;
+            }
+            else
+            {
+                ray const r = rays[global_id];
+                flag = ray_is_active(&r) ? 1 : 0;
+            }
+        }
+
+        flags[global_id] = flag;
+        indices[global_id] = global_id;
+    }
+}
+
+// Copy kept rays to the front of the output buffer
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void gather_compacted_rays_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of kept rays
+    GLOBAL int const* restrict num_compacted,
+    // Indices of kept rays
+    GLOBAL int const* restrict indices,
+    // Compacted rays
+    GLOBAL ray* compacted_rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_compacted)
+    {
+        compacted_rays[global_id] = rays[indices[global_id]];
+    }
+}
@@ -0,0 +1,162 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file decode_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Compact ray format decoding kernels.
+
+    Queries issued with "acc.ray_format" other than "full" read compact rays
+    once and expand them into the full ray layout, so traversal kernels are
+    shared between all the formats.
+
+        decode_compact_rays_main: 32 byte rays, origin + maxt and direction
+        decode_oct_rays_main: 20 byte rays, origin + maxt and octahedral encoded direction
+        decode_soa_rays_main: planes of the 4 byte words of full rays
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+// Compact ray definition
+typedef struct
+{
+    float4 o;
+    float4 d;
+} ray_compact;
+
+// Ray with octahedral encoded direction
+typedef struct
+{
+    float o[3];
+    float maxt;
+    uint d;
+} ray_oct;
+
+/*************************************************************************
+HELPER FUNCTIONS
+**************************************************************************/
+// Full ray which is active, has all mask bits set and zero time
+INLINE
+ray make_ray(float3 o, float maxt, float3 d)
+{
+    ray r;
+    r.o = (float4)(o, maxt);
+    r.d = (float4)(d, 0.f);
+    r.extra = (int2)(-1, 1);
+    r.padding = (int2)(0, 0);
+    return r;
+}
+
+// Unpack two 16-bit snorm octahedral coordinates into a unit vector
+INLINE
+float3 decode_oct_direction(uint d)
+{
+    float2 v = (float2)((float)(short)(d & 0xFFFF), (float)(short)(d >> 16)) / 32767.f;
+    v = clamp(v, -1.f, 1.f);
+
+    float const z = 1.f - fabs(v.x) - fabs(v.y);
+
+    // Unfold the lower hemisphere
+    if (z < 0.f)
+    {
+        float2 const s = (float2)(v.x >= 0.f ? 1.f : -1.f, v.y >= 0.f ? 1.f : -1.f);
+        v = (1.f - fabs(v.yx)) * s;
+    }
+
+    return normalize((float3)(v, z));
+}
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void decode_compact_rays_main(
+    // Compact rays
+    GLOBAL ray_compact const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Decoded rays
+    GLOBAL ray* decoded_rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray_compact const r = rays[global_id];
+        decoded_rays[global_id] = make_ray(r.o.xyz, r.o.w, r.d.xyz);
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void decode_oct_rays_main(
+    // Rays with octahedral encoded directions
+    GLOBAL ray_oct const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Decoded rays
+    GLOBAL ray* decoded_rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        GLOBAL ray_oct const* r = rays + global_id;
+        float3 const o = (float3)(r->o[0], r->o[1], r->o[2]);
+        decoded_rays[global_id] = make_ray(o, r->maxt, decode_oct_direction(r->d));
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void decode_soa_rays_main(
+    // Planes of origin x, y, z, maxt, direction x, y, z, time, mask, activity, spread and LOD seed
+    // of plane_size rays each
+    GLOBAL float const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Elements per plane
+    int plane_size,
+    // Decoded rays
+    GLOBAL ray* decoded_rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        GLOBAL float const* r = rays + global_id;
+
+        ray res;
+        res.o = (float4)(r[0], r[plane_size], r[2 * plane_size], r[3 * plane_size]);
+        res.d = (float4)(r[4 * plane_size], r[5 * plane_size], r[6 * plane_size], r[7 * plane_size]);
+        res.extra = (int2)(as_int(r[8 * plane_size]), as_int(r[9 * plane_size]));
+        res.padding = (int2)(as_int(r[10 * plane_size]), as_int(r[11 * plane_size]));
+        decoded_rays[global_id] = res;
+    }
+}
@@ -0,0 +1,202 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file generate_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray generation kernels.
+
+    Common ray sets are written straight into ray buffers, so primary, ambient
+    occlusion and shadow passes don't generate rays on the host and upload them:
+
+        generate_camera_rays_main: pinhole or thin lens rays, one per pixel
+        generate_hemisphere_rays_main: cosine distributed rays over surface points
+        generate_shadow_rays_main: rays from surface points to point or area lights
+
+    Random numbers are hashed from the ray index and the seed (common.cl).
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+HELPER FUNCTIONS
+**************************************************************************/
+INLINE
+void write_ray(GLOBAL ray* r, float3 o, float3 d, float maxt, int active)
+{
+    ray result;
+    result.o = (float4)(o, maxt);
+    result.d = (float4)(d, 0.f);
+    result.extra = (int2)(0xFFFFFFFF, active);
+    result.padding = (int2)(0, 0);
+    *r = result;
+}
+
+/*************************************************************************
+KERNELS
+**************************************************************************/
+// Rays of a width x height image in rows starting at the top left pixel
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void generate_camera_rays_main(
+    // Camera frame
+    float4 position,
+    float4 forward,
+    float4 up,
+    // Sensor size in scene units at focal distance
+    float2 sensor_size,
+    float focal_length,
+    // Lens radius, 0 for pinhole cameras
+    float aperture,
+    float focus_distance,
+    float maxt,
+    // Random positions inside pixels instead of their centers
+    int jitter,
+    int width,
+    int height,
+    uint seed,
+    // Generated rays
+    GLOBAL ray* rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < width * height)
+    {
+        int x = global_id % width;
+        int y = global_id / width;
+
+        float3 w = normalize(forward.xyz);
+        float3 u = normalize(cross(w, up.xyz));
+        float3 v = cross(u, w);
+
+        float2 pixel = jitter ? random_float2(global_id, seed) : (float2)(0.5f, 0.5f);
+        float sx = ((x + pixel.x) / width - 0.5f) * sensor_size.x;
+        float sy = (0.5f - (y + pixel.y) / height) * sensor_size.y;
+
+        float3 o = position.xyz;
+        float3 d = normalize(w * focal_length + u * sx + v * sy);
+
+        if (aperture > 0.f)
+        {
+            // Rays through the lens meet on the plane in focus
+            float3 focus = o + d * (focus_distance / dot(d, w));
+            float2 lens = sample_disk(random_float2(global_id, hash_uint(seed) + 1)) * aperture;
+            o += u * lens.x + v * lens.y;
+            d = normalize(focus - o);
+        }
+
+        write_ray(rays + global_id, o, d, maxt, 1);
+    }
+}
+
+// Cosine distributed rays over point normals, num_samples consecutive rays per point
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void generate_hemisphere_rays_main(
+    // Surface points
+    GLOBAL surface_point const* restrict points,
+    // Number of points, only read if use_num_points is set
+    GLOBAL int const* restrict num_points,
+    int use_num_points,
+    int max_points,
+    int num_samples,
+    float maxt,
+    uint seed,
+    // Generated rays
+    GLOBAL ray* rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_points * num_samples)
+    {
+        int point_idx = global_id / num_samples;
+        int count = use_num_points ? min(*num_points, max_points) : max_points;
+
+        surface_point p = points[point_idx];
+
+        if (point_idx >= count || !surface_point_valid(&p))
+        {
+            write_ray(rays + global_id, (float3)(0.f, 0.f, 0.f), (float3)(0.f, 0.f, 1.f), 0.f, 0);
+            return;
+        }
+
+        float3 n = normalize(p.normal.xyz);
+        float3 d = sample_hemisphere_cosine(n, random_float2(global_id, seed));
+
+        write_ray(rays + global_id, offset_origin(p.position.xyz, n, d), d, maxt, 1);
+    }
+}
+
+// A ray per point toward a sampled light position, ending before the light
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void generate_shadow_rays_main(
+    // Surface points
+    GLOBAL surface_point const* restrict points,
+    // Number of points, only read if use_num_points is set
+    GLOBAL int const* restrict num_points,
+    int use_num_points,
+    int max_points,
+    // Point light position or corner of a parallelogram light
+    float4 light_position,
+    // Area light edges, zero for point lights
+    float4 light_edge1,
+    float4 light_edge2,
+    uint seed,
+    // Generated rays
+    GLOBAL ray* rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_points)
+    {
+        int count = use_num_points ? min(*num_points, max_points) : max_points;
+
+        surface_point p = points[global_id];
+
+        if (global_id >= count || !surface_point_valid(&p))
+        {
+            write_ray(rays + global_id, (float3)(0.f, 0.f, 0.f), (float3)(0.f, 0.f, 1.f), 0.f, 0);
+            return;
+        }
+
+        float2 r = random_float2(global_id, seed);
+        float3 target = light_position.xyz + light_edge1.xyz * r.x + light_edge2.xyz * r.y;
+
+        float3 n = normalize(p.normal.xyz);
+        float3 o = offset_origin(p.position.xyz, n, target - p.position.xyz);
+        float3 to_light = target - o;
+        float dist = length(to_light);
+
+        if (dist <= 0.f)
+        {
+            write_ray(rays + global_id, o, n, 0.f, 0);
+            return;
+        }
+
+        // Stop short of the light so its own geometry doesn't occlude it
+        write_ray(rays + global_id, o, to_light / dist, dist * (1.f - 1e-3f), 1);
+    }
+}
@@ -0,0 +1,114 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file group_hits.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Hit grouping kernels.
+
+    Shading is more coherent when rays hitting the same material run together,
+    so ray indices of closest hits are ordered by a key of the hit shape:
+
+        calculate_hit_keys_main: key and identity index per ray
+        radix sort of keys and indices (Calc::Primitives)
+        write_hit_groups_main: sorted indices and keys to the output buffers
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Group key of every ray: shape id or its user key, misses, shapes without a key
+// and entries past the ray count get -1 which is sorted last as an unsigned key
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void calculate_hit_keys_main(
+    // Closest hits
+    GLOBAL Intersection const* restrict hits,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Key per shape id, only read if num_keys is not 0
+    GLOBAL int const* restrict shape_keys,
+    // Number of shape keys
+    int num_keys,
+    // Number of entries in keys and indices buffers
+    int max_rays,
+    // Keys
+    GLOBAL int* keys,
+    // Ray indices
+    GLOBAL int* indices
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_rays)
+    {
+        int key = -1;
+
+        if (global_id < *num_rays)
+        {
+            int shape_id = hits[global_id].shape_id;
+            key = shape_id;
+
+            if (num_keys > 0)
+            {
+                key = (shape_id >= 0 && shape_id < num_keys) ? shape_keys[shape_id] : -1;
+            }
+        }
+
+        keys[global_id] = key;
+        indices[global_id] = global_id;
+    }
+}
+
+// Copy sorted ray indices and optionally their keys to the caller buffers
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void write_hit_groups_main(
+    // Sorted keys
+    GLOBAL int const* restrict sorted_keys,
+    // Sorted ray indices
+    GLOBAL int const* restrict sorted_indices,
+    // Write keys too
+    int write_keys,
+    // Number of entries
+    int max_rays,
+    // Ray indices grouped by key
+    GLOBAL int* out_indices,
+    // Their keys, only written if write_keys is set
+    GLOBAL int* out_keys
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_rays)
+    {
+        out_indices[global_id] = sorted_indices[global_id];
+
+        if (write_keys)
+        {
+            out_keys[global_id] = sorted_keys[global_id];
+        }
+    }
+}
@@ -82,7 +82,7 @@ THE SOFTWARE.
         -Benefits from BVH quality optimization.
         -Low VGPR pressure
     Cons:
-        -Depth is limited.
+        -Depth is limited to 30 levels, deeper subtrees are rebuilt balanced on the host.
         -Generates global memory traffic.
  */
 
@@ -128,6 +128,29 @@ typedef struct
 
 } bvh_node;
 
+// Mix bits of a node index, matches perfect_hash_mix on the host
+INLINE uint perfect_hash_mix(uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Find node address by its index using perfect hashing of node indices,
+// hash map layout follows PerfectHashMap::Pack: header, 16-bit displacements, hash table
+INLINE int perfect_hash_lookup(int node_idx, GLOBAL uint const * restrict hash_map)
+{
+    uint const bucket = perfect_hash_mix((uint)node_idx) & hash_map[0];
+    uint const displacement = (hash_map[4 + (bucket >> 1)] >> ((bucket & 1) << 4)) & 0xffff;
+    uint const seed = displacement * 0x9e3779b9u + 0x85ebca6bu;
+    uint const slice_bits = hash_map[2];
+    uint const slot = ((bucket >> hash_map[1]) << slice_bits) | (perfect_hash_mix((uint)node_idx ^ seed) & ((1u << slice_bits) - 1));
+    return as_int(hash_map[hash_map[3] + slot]);
+}
+
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 KERNEL void
@@ -140,12 +163,8 @@ occluded_main(
     GLOBAL ray const * restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
-    // Displacement table for perfect hashing
-    GLOBAL int const * restrict displacement_table,
-    // Hash table for perfect hashing
-    GLOBAL int const * restrict hash_table,
-    // Displacement table size
-    int const displacement_table_size,
+    // Perfect hash map of node indices to addresses
+    GLOBAL uint const * restrict hash_map,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL int* hits
     )
@@ -188,10 +207,8 @@ occluded_main(
                     float3 const v1 = vertices[node.i0];
                     float3 const v2 = vertices[node.i1];
                     float3 const v3 = vertices[node.i2];
-                    // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit store the result and bail out
-                    if (f < t_max)
+                    // Intersect triangle, if hit store the result and bail out
+                    if (fast_occlude_triangle(r, v1, v2, v3, t_max))
                     {
                         hits[global_id] = HIT_MARKER;
                         return;
@@ -262,8 +279,7 @@ occluded_main(
                 node_idx = (node_idx >> num_levels) ^ 0x1;
 
                 // Calculate node address using perfect hasing of node indices
-                int const displacement = displacement_table[node_idx / displacement_table_size];
-                addr = hash_table[displacement + (node_idx & (displacement_table_size - 1))];
+                addr = perfect_hash_lookup(node_idx, hash_map);
             }
 
             // Finished traversal, but no intersection found
@@ -283,12 +299,8 @@ KERNEL void intersect_main(
     GLOBAL ray const * restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
-    // Displacement table for perfect hashing
-    GLOBAL int const * restrict displacement_table,
-    // Hash table for perfect hashing
-    GLOBAL int const * restrict hash_table,
-    // Displacement table size
-    int const displacement_table_size,
+    // Perfect hash map of node indices to addresses
+    GLOBAL uint const * restrict hash_map,
     // Hit results: 1 for hit and -1 for miss
     GLOBAL Intersection* hits)
 {
@@ -406,8 +418,7 @@ KERNEL void intersect_main(
                 node_idx = (node_idx >> num_levels) ^ 0x1;
 
                 // Calculate node address using perfect hasing of node indices
-                int displacement = displacement_table[node_idx / displacement_table_size];
-                addr = hash_table[displacement + (node_idx & (displacement_table_size - 1))];
+                addr = perfect_hash_lookup(node_idx, hash_map);
             }
 
             // Check if we have found an intersection
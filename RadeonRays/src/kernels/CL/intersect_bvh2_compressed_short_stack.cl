@@ -0,0 +1,524 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_bvh2_compressed_short_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on compressed BVH stacked travesal.
+
+    Intersector is using binary BVH with two bounding boxes per node.
+    Bounding boxes are quantized to 8 bits per plane relative to their
+    union and the right child always follows the left one, so a node
+    takes 32 bytes instead of 64.
+    Traversal is using a stack which is split into two parts:
+        -Top part in fast LDS memory
+        -Bottom part in slow global memory.
+    Push operations first check for top part overflow and offload top
+    part into slow global memory if necessary.
+    Pop operations first check for top part emptiness and try to offload
+    from bottom part if necessary. 
+
+    Traversal pseudocode:
+
+        while(addr is valid)
+        {
+            node <- fetch next node at addr
+
+            if (node is leaf)
+                intersect leaf
+            else
+            {
+                intersect ray vs left child
+                intersect ray vs right child
+                if (intersect any of children)
+                {
+                    determine closer child
+                    if intersect both
+                    {
+                        addr = closer child
+                        check top stack and offload if necesary
+                        push farther child into the stack
+                    }
+                    else
+                    {
+                        addr = intersected child
+                    }
+                    continue
+                }
+            }
+
+            addr <- pop from top stack
+            if (addr is not valid)
+            {
+                try loading data from bottom stack to top stack
+                addr <- pop from top stack
+            }
+        }
+
+    Pros:
+        -Very fast traversal.
+        -Benefits from BVH quality optimization.
+    Cons:
+        -Depth is limited.
+        -Generates LDS traffic.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define LEAFNODE(x) (((x).leaf_marker) == -1)
+// LDS stack depth per work item is selected by the host for the device local memory,
+// the global stack holds two spills of it
+#ifndef SHORT_STACK_SIZE
+#define SHORT_STACK_SIZE 16
+#endif
+#define GLOBAL_STACK_SIZE (2 * SHORT_STACK_SIZE)
+// LDS stacks are interleaved over the work items of a group
+#define WAVEFRONT_SIZE RR_GROUP_SIZE
+
+// Compressed BVH node
+typedef struct
+{
+    union 
+    {
+        struct
+        {
+            // Children union bounds minimum
+            float origin_x, origin_y, origin_z;
+            // Address of a left child, right one is next to it
+            int child0;
+            // Per axis scale exponents (biased by 127)
+            uchar4 exponent;
+            // Quantized child bounds
+            uchar2 qmin_x, qmin_y, qmin_z;
+            uchar2 qmax_x, qmax_y, qmax_z;
+        };
+
+        struct
+        {
+            // If node is a leaf we keep vertex indices here
+            int i0, i1, i2;
+            // -1 for leaves
+            int leaf_marker;
+            // Shape mask
+            int shape_mask;
+            // Shape ID
+            int shape_id;
+            // Primitive ID
+            int prim_id;
+            int padding;
+        };
+    };
+
+} bvh_node;
+
+// Intersect ray vs both children bounds and return intersection spans (x, y for the left one, z, w for the right one).
+// Intersection criteria is ret.x <= ret.y
+INLINE
+float4 intersect_children(bvh_node const* node, float3 invdir, float3 oxinvdir, float t_max)
+{
+    // Decode power of two scales directly from exponents,
+    // q * scale is exact so decoded bounds are conservative
+    float const sx = as_float((uint)node->exponent.x << 23);
+    float const sy = as_float((uint)node->exponent.y << 23);
+    float const sz = as_float((uint)node->exponent.z << 23);
+
+    float2 const nx = mad(mad(convert_float2(node->qmin_x), sx, node->origin_x), invdir.x, oxinvdir.x);
+    float2 const ny = mad(mad(convert_float2(node->qmin_y), sy, node->origin_y), invdir.y, oxinvdir.y);
+    float2 const nz = mad(mad(convert_float2(node->qmin_z), sz, node->origin_z), invdir.z, oxinvdir.z);
+    float2 const fx = mad(mad(convert_float2(node->qmax_x), sx, node->origin_x), invdir.x, oxinvdir.x);
+    float2 const fy = mad(mad(convert_float2(node->qmax_y), sy, node->origin_y), invdir.y, oxinvdir.y);
+    float2 const fz = mad(mad(convert_float2(node->qmax_z), sz, node->origin_z), invdir.z, oxinvdir.z);
+
+    float2 const t0 = max(max(min(nx, fx), min(ny, fy)), max(min(nz, fz), 0.f));
+    float2 const t1 = min(min(max(nx, fx), max(ny, fy)), min(max(nz, fz), t_max));
+
+    return make_float4(t0.x, t1.x, t0.y, t1.y);
+}
+
+// Intersect ray vs leaf triangle, returns hit distance or t_max if there is no hit
+INLINE
+float intersect_leaf(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, ray const* r, float t_max)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    // Leaves reference precomputed triangles, the layout is hidden by common.cl accessors
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_intersect_triangle(*r, triangle, t_max);
+#else
+    // Leafs directly store vertex indices
+    // so we load vertices directly
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return fast_intersect_triangle(*r, v1, v2, v3, t_max);
+#endif
+}
+
+// Check if ray hits leaf triangle closer than t_max
+INLINE
+bool occlude_leaf(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, ray const* r, float t_max)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_occlude_triangle(*r, triangle, t_max);
+#else
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return fast_occlude_triangle(*r, v1, v2, v3, t_max);
+#endif
+}
+
+// Calculate barycentric coordinates of a point on leaf triangle
+INLINE
+float2 leaf_calculate_barycentrics(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, float3 p)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_triangle_barycentrics(p, triangle);
+#else
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return triangle_calculate_barycentrics(p, v1, v2, v3);
+#endif
+}
+
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const * restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float const t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest intersection leaf index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh_node const node = nodes[addr];
+
+                // Check if it is a leaf
+                if (LEAFNODE(node))
+                {
+                    // Any hit closer than t_max terminates traversal
+                    if (occlude_leaf(vertices, &node, &r, t_max))
+                    {
+                        hits[global_id] = HIT_MARKER;
+                        return;
+                    }
+                }
+                else
+                {
+                    // It is internal node, so intersect vs both children bounds
+                    float4 const s = intersect_children(&node, invdir, oxinvdir, t_max);
+                    float2 const s0 = s.xy;
+                    float2 const s1 = s.zw;
+
+                    // Determine which one to traverse
+                    bool const traverse_c0 = (s0.x <= s0.y);
+                    bool const traverse_c1 = (s1.x <= s1.y);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        int deferred = -1;
+
+                        // Any hit will do, so there is no need to find the closer child:
+                        // children are visited in stored order (larger first with area ordered trees)
+                        if (!traverse_c0)
+                        {
+                            // Left one not traversed
+                            addr = node.child0 + 1;
+                            deferred = node.child0;
+                        }
+                        else
+                        {
+                            // Traverse left node otherwise
+                            addr = node.child0;
+                            deferred = node.child0 + 1;
+                        }
+
+                        // If we traverse both children we need to postpone the node
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            // If short stack is full, we offload it into global memory
+                            if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                            {
+                                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                                {
+                                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                                }
+
+                                gm_stack += SHORT_STACK_SIZE;
+                                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                            }
+
+                            *lm_stack = deferred;
+                            lm_stack += WAVEFRONT_SIZE;
+                        }
+
+                        // Continue traversal
+                        continue;
+                    }
+                }
+
+                // Try popping from local stack
+                lm_stack -= WAVEFRONT_SIZE;
+                addr = *(lm_stack);
+
+                // If we popped INVALID_IDX then check global stack
+                if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+                {
+                    // Adjust stack pointer
+                    gm_stack -= SHORT_STACK_SIZE;
+                    // Copy data from global memory to LDS
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+                    }
+                    // Point local stack pointer to the end
+                    lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+                    addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+                }
+            }
+
+            // Finished traversal, but no intersection found
+            hits[global_id] = MISS_MARKER;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL Intersection* hits)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest intersection leaf index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                bvh_node const node = nodes[addr];
+
+                // Check if it is a leaf
+                if (LEAFNODE(node))
+                {
+                    // Intersect triangle
+                    float const f = intersect_leaf(vertices, &node, &r, t_max);
+                    // If hit update closest hit distance and index
+                    if (f < t_max)
+                    {
+                        t_max = f;
+                        isect_idx = addr;
+                    }
+                }
+                else
+                {
+                    // It is internal node, so intersect vs both children bounds
+                    float4 const s = intersect_children(&node, invdir, oxinvdir, t_max);
+                    float2 const s0 = s.xy;
+                    float2 const s1 = s.zw;
+
+                    // Determine which one to traverse
+                    bool const traverse_c0 = (s0.x <= s0.y);
+                    bool const traverse_c1 = (s1.x <= s1.y);
+                    bool const c1first = traverse_c1 && (s0.x > s1.x);
+
+                    if (traverse_c0 || traverse_c1)
+                    {
+                        int deferred = -1;
+
+                        // Determine which one to traverse first
+                        if (c1first || !traverse_c0)
+                        {
+                            // Right one is closer or left one not travesed
+                            addr = node.child0 + 1;
+                            deferred = node.child0;
+                        }
+                        else
+                        {
+                            // Traverse left node otherwise
+                            addr = node.child0;
+                            deferred = node.child0 + 1;
+                        }
+
+                        // If we traverse both children we need to postpone the node
+                        if (traverse_c0 && traverse_c1)
+                        {
+                            // If short stack is full, we offload it into global memory
+                            if ( lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+                            {
+                                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                                {
+                                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                                }
+
+                                gm_stack += SHORT_STACK_SIZE;
+                                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                            }
+
+                            *lm_stack = deferred;
+                            lm_stack += WAVEFRONT_SIZE;
+                        }
+
+                        // Continue traversal
+                        continue;
+                    }
+                }
+
+                // Try popping from local stack
+                lm_stack -= WAVEFRONT_SIZE;
+                addr = *(lm_stack);
+
+                // If we popped INVALID_IDX then check global stack
+                if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+                {
+                    // Adjust stack pointer
+                    gm_stack -= SHORT_STACK_SIZE;
+                    // Copy data from global memory to LDS
+                    for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                    {
+                        lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+                    }
+                    // Point local stack pointer to the end
+                    lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+                    addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+                }
+            }
+
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Fetch the node
+                bvh_node const node = nodes[isect_idx];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = leaf_calculate_barycentrics(vertices, &node, p);
+                // Update hit information
+                hits[global_id].shape_id = node.shape_id;
+                hits[global_id].prim_id = node.prim_id;
+                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+            }
+            else
+            {
+                // Miss here
+                hits[global_id].shape_id = MISS_MARKER;
+                hits[global_id].prim_id = MISS_MARKER;
+            }
+        }
+    }
+}
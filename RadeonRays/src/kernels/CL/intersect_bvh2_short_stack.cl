@@ -77,6 +77,11 @@ THE SOFTWARE.
     Cons:
         -Depth is limited.
         -Generates LDS traffic.
+
+    Packet kernels traverse the tree with the whole work group in lockstep:
+    the group votes which children to visit and keeps a single stack in LDS.
+    Coherent packets are culled against child bounds with interval arithmetic
+    before testing individual rays.
  */
 
 /*************************************************************************
@@ -90,9 +95,17 @@ TYPE DEFINITIONS
 **************************************************************************/
 
 #define LEAFNODE(x) (((x).child0) == -1)
-#define GLOBAL_STACK_SIZE 32
+// LDS stack depth per work item is selected by the host for the device local memory,
+// the global stack holds two spills of it
+#ifndef SHORT_STACK_SIZE
 #define SHORT_STACK_SIZE 16
-#define WAVEFRONT_SIZE 64
+#endif
+#define GLOBAL_STACK_SIZE (2 * SHORT_STACK_SIZE)
+// LDS stacks are interleaved over the work items of a group
+#define WAVEFRONT_SIZE RR_GROUP_SIZE
+#define PACKET_STACK_SIZE 64
+#define PACKET_FRUSTUM_SIZE 14
+#define PACKET_VOTES_SIZE 4
 
 // BVH node
 typedef struct
@@ -124,23 +137,92 @@ typedef struct
 
 } bvh_node;
 
+// Bounds of the rays in a packet, same for all the lanes
+typedef struct
+{
+    // Origin bounds
+    float3 omin;
+    float3 omax;
+    // Inverse direction bounds
+    float3 imin;
+    float3 imax;
+    // Max parametric distance
+    float t_max;
+    // Packet has active rays
+    int active;
+    // All the rays have the same direction signs
+    int coherent;
+} packet_frustum;
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL void
-occluded_main(
+// Intersect ray vs leaf triangle, returns hit distance or t_max if there is no hit
+INLINE
+float intersect_leaf(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, ray const* r, float t_max)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    // Leaves reference precomputed triangles, the layout is hidden by common.cl accessors
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_intersect_triangle(*r, triangle, t_max);
+#else
+    // Leafs directly store vertex indices
+    // so we load vertices directly
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return fast_intersect_triangle(*r, v1, v2, v3, t_max);
+#endif
+}
+
+// Check if ray hits leaf triangle closer than t_max
+INLINE
+bool occlude_leaf(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, ray const* r, float t_max)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_occlude_triangle(*r, triangle, t_max);
+#else
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return fast_occlude_triangle(*r, v1, v2, v3, t_max);
+#endif
+}
+
+// Calculate barycentric coordinates of a point on leaf triangle
+INLINE
+float2 leaf_calculate_barycentrics(GLOBAL VERTEX_TYPE const* restrict vertices, bvh_node const* node, float3 p)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * node->i0;
+    return precomputed_triangle_barycentrics(p, triangle);
+#else
+    float3 const v1 = FETCH_VERTEX(vertices, node->i0);
+    float3 const v2 = FETCH_VERTEX(vertices, node->i1);
+    float3 const v3 = FETCH_VERTEX(vertices, node->i2);
+    return triangle_calculate_barycentrics(p, v1, v2, v3);
+#endif
+}
+
+
+// Find any hit of the work group rays, results are written to hits unless it is 0.
+// Returns true for occluded rays, false for misses and rays which are out of the working set or inactive
+INLINE
+bool occlude_any(
     // Bvh nodes
     GLOBAL bvh_node const * restrict nodes,
-    // Triangles vertices
-    GLOBAL float3 const * restrict vertices,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
     // Rays
     GLOBAL ray const * restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const * restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
+    // Short stack memory in LDS
+    __local int* lds,
     // Hit results: 1 for hit and -1 for miss
-    GLOBAL int* hits
-    )
+    GLOBAL int* hits,
+    // Traversal counters of the ray, only written with RR_TRAVERSAL_STATS
+    GLOBAL traversal_stats* stats_out)
 {
     int global_id = get_global_id(0);
     int local_id = get_local_id(0);
@@ -150,6 +232,7 @@ occluded_main(
     if (global_id < *num_rays)
     {
         ray const r = rays[global_id];
+        STATS_BEGIN();
 
         if (ray_is_active(&r))
         {
@@ -157,7 +240,6 @@ occluded_main(
             __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
             __global int* gm_stack = gm_stack_base;
             // Allocate stack in LDS
-            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
             __local int* lm_stack_base = lds + local_id;
             __local int* lm_stack = lm_stack_base;
 
@@ -181,22 +263,23 @@ occluded_main(
             {
                 // Fetch next node
                 bvh_node const node = nodes[addr];
+                STATS_ADD(nodes, 1);
 
                 // Check if it is a leaf
                 if (LEAFNODE(node))
                 {
-                    // Leafs directly store vertex indices
-                    // so we load vertices directly
-                    float3 const v1 = vertices[node.i0];
-                    float3 const v2 = vertices[node.i1];
-                    float3 const v3 = vertices[node.i2];
-                    // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit update closest hit distance and index
-                    if (f < t_max)
+                    STATS_ADD(leaves, 1);
+                    STATS_ADD(prims, 1);
+                    // Any hit closer than t_max terminates traversal
+                    if (occlude_leaf(vertices, &node, &r, t_max))
                     {
-                        hits[global_id] = HIT_MARKER;
-                        return;
+                        if (hits)
+                        {
+                            hits[global_id] = HIT_MARKER;
+                        }
+
+                        STATS_END(stats_out);
+                        return true;
                     }
                 }
                 else
@@ -208,16 +291,16 @@ occluded_main(
                     // Determine which one to traverse
                     bool const traverse_c0 = (s0.x <= s0.y);
                     bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
 
                     if (traverse_c0 || traverse_c1)
                     {
                         int deferred = -1;
 
-                        // Determine which one to traverse first
-                        if (c1first || !traverse_c0)
+                        // Any hit will do, so there is no need to find the closer child:
+                        // children are visited in stored order (larger first with area ordered trees)
+                        if (!traverse_c0)
                         {
-                            // Right one is closer or left one not travesed
+                            // Left one not traversed
                             addr = node.child1;
                             deferred = node.child0;
                         }
@@ -241,6 +324,7 @@ occluded_main(
 
                                 gm_stack += SHORT_STACK_SIZE;
                                 lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                                STATS_ADD(spills, 1);
                             }
 
                             *lm_stack = deferred;
@@ -273,25 +357,102 @@ occluded_main(
             }
 
             // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            if (hits)
+            {
+                hits[global_id] = MISS_MARKER;
+            }
         }
+
+        STATS_END(stats_out);
     }
+
+    return false;
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL void intersect_main(
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const * restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+    )
+{
+    int global_id = get_global_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    occlude_any(nodes, vertices, rays, num_rays, stack, lds, hits, TRAVERSAL_STATS_OUT(global_id));
+}
+
+// Bit-packed version ("acc.occlusion_format" "bits"): one bit per ray, set for occluded ones
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void
+occluded_bits_main(
+    // Bvh nodes
+    GLOBAL bvh_node const * restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const * restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const * restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 32 rays per word
+    GLOBAL uint* hits
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+    )
+{
+    int global_id = get_global_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    __local uint lds_bits[(WAVEFRONT_SIZE + 31) / 32];
+    bool const occluded = occlude_any(nodes, vertices, rays, num_rays, stack, lds, 0, TRAVERSAL_STATS_OUT(global_id));
+    store_occlusion_bits(hits, global_id, *num_rays, occluded, lds_bits);
+}
+
+// Find closest hits of the work group rays
+INLINE
+void intersect_closest(
     // Bvh nodes
     GLOBAL bvh_node const* restrict nodes,
-    // Triangles vertices
-    GLOBAL float3 const* restrict vertices,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
     // Rays
     GLOBAL ray const* restrict rays,
     // Number of rays in rays buffer
     GLOBAL int const* restrict num_rays,
     // Stack memory
     GLOBAL int* stack,
-    // Hit data
-    GLOBAL Intersection* hits)
+    // Short stack memory in LDS
+    __local int* lds,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size,
+    // Traversal counters of the ray, only written with RR_TRAVERSAL_STATS
+    GLOBAL traversal_stats* stats_out)
 {
     int global_id = get_global_id(0);
     int local_id = get_local_id(0);
@@ -301,6 +462,7 @@ KERNEL void intersect_main(
     if (global_id < *num_rays)
     {
         ray const r = rays[global_id];
+        STATS_BEGIN();
 
         if (ray_is_active(&r))
         {
@@ -308,7 +470,6 @@ KERNEL void intersect_main(
             __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
             __global int* gm_stack = gm_stack_base;
             // Allocate stack in LDS
-            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
             __local int* lm_stack_base = lds + local_id;
             __local int* lm_stack = lm_stack_base;
 
@@ -332,17 +493,15 @@ KERNEL void intersect_main(
             {
                 // Fetch next node
                 bvh_node const node = nodes[addr];
+                STATS_ADD(nodes, 1);
 
                 // Check if it is a leaf
                 if (LEAFNODE(node))
                 {
-                    // Leafs directly store vertex indices
-                    // so we load vertices directly
-                    float3 const v1 = vertices[node.i0];
-                    float3 const v2 = vertices[node.i1];
-                    float3 const v3 = vertices[node.i2];
+                    STATS_ADD(leaves, 1);
+                    STATS_ADD(prims, 1);
                     // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                    float const f = intersect_leaf(vertices, &node, &r, t_max);
                     // If hit update closest hit distance and index
                     if (f < t_max)
                     {
@@ -392,6 +551,7 @@ KERNEL void intersect_main(
 
                                 gm_stack += SHORT_STACK_SIZE;
                                 lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+                                STATS_ADD(spills, 1);
                             }
 
                             *lm_stack = deferred;
@@ -426,26 +586,635 @@ KERNEL void intersect_main(
             // Check if we have found an intersection
             if (isect_idx != INVALID_IDX)
             {
-                // Fetch the node & vertices
+                // Fetch the node
                 bvh_node const node = nodes[isect_idx];
-                float3 const v1 = vertices[node.i0];
-                float3 const v2 = vertices[node.i1];
-                float3 const v3 = vertices[node.i2];
-                // Calculate hit position
-                float3 const p = r.o.xyz + r.d.xyz * t_max;
-                // Calculte barycentric coordinates
-                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Barycentric coordinates are only reported in full format
+                float2 uv = make_float2(0.f, 0.f);
+
+                if (hit_format_has_uv(format))
+                {
+                    // Calculate hit position
+                    float3 const p = r.o.xyz + r.d.xyz * t_max;
+                    // Calculte barycentric coordinates
+                    uv = leaf_calculate_barycentrics(vertices, &node, p);
+                }
+
                 // Update hit information
-                hits[global_id].shape_id = node.shape_id;
-                hits[global_id].prim_id = node.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+                store_hit(hits, global_id, format, plane_size, node.shape_id, node.prim_id, uv, t_max);
             }
             else
             {
                 // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                store_miss(hits, global_id, format, plane_size);
             }
         }
+
+        STATS_END(stats_out);
+    }
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL Intersection* hits
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+    )
+{
+    int global_id = get_global_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    intersect_closest(nodes, vertices, rays, num_rays, stack, lds, (GLOBAL int*)hits, HIT_FORMAT_FULL, 0, TRAVERSAL_STATS_OUT(global_id));
+}
+
+// Compact hit formats version: only the data requested by "acc.hit_format" is written
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+    )
+{
+    int global_id = get_global_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+    intersect_closest(nodes, vertices, rays, num_rays, stack, lds, hits, format, plane_size, TRAVERSAL_STATS_OUT(global_id));
+}
+
+// Evaluate packet bounds over active rays and reset traversal votes
+INLINE
+void packet_init(float3 o, float t_max, float3 invdir, bool active, __local int* lds_frustum, __local int* lds_votes, packet_frustum* frustum)
+{
+    if (get_local_id(0) == 0)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            lds_frustum[i] = INT_MAX;
+            lds_frustum[i + 3] = INT_MIN;
+            lds_frustum[i + 6] = INT_MAX;
+            lds_frustum[i + 9] = INT_MIN;
+        }
+
+        lds_frustum[12] = INT_MIN;
+        lds_frustum[13] = 0;
+
+        for (int i = 0; i < 2 * PACKET_VOTES_SIZE; ++i)
+        {
+            lds_votes[i] = 0;
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (active)
+    {
+        atomic_min(lds_frustum + 0, float_as_ordered_int(o.x));
+        atomic_min(lds_frustum + 1, float_as_ordered_int(o.y));
+        atomic_min(lds_frustum + 2, float_as_ordered_int(o.z));
+        atomic_max(lds_frustum + 3, float_as_ordered_int(o.x));
+        atomic_max(lds_frustum + 4, float_as_ordered_int(o.y));
+        atomic_max(lds_frustum + 5, float_as_ordered_int(o.z));
+        atomic_min(lds_frustum + 6, float_as_ordered_int(invdir.x));
+        atomic_min(lds_frustum + 7, float_as_ordered_int(invdir.y));
+        atomic_min(lds_frustum + 8, float_as_ordered_int(invdir.z));
+        atomic_max(lds_frustum + 9, float_as_ordered_int(invdir.x));
+        atomic_max(lds_frustum + 10, float_as_ordered_int(invdir.y));
+        atomic_max(lds_frustum + 11, float_as_ordered_int(invdir.z));
+        atomic_max(lds_frustum + 12, float_as_ordered_int(t_max));
+        // Low 3 bits for positive directions, high 3 bits for negative ones
+        atomic_or(lds_frustum + 13,
+            (invdir.x < 0.f ? 8 : 1) | (invdir.y < 0.f ? 16 : 2) | (invdir.z < 0.f ? 32 : 4));
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    frustum->omin = make_float3(ordered_int_as_float(lds_frustum[0]), ordered_int_as_float(lds_frustum[1]), ordered_int_as_float(lds_frustum[2]));
+    frustum->omax = make_float3(ordered_int_as_float(lds_frustum[3]), ordered_int_as_float(lds_frustum[4]), ordered_int_as_float(lds_frustum[5]));
+    frustum->imin = make_float3(ordered_int_as_float(lds_frustum[6]), ordered_int_as_float(lds_frustum[7]), ordered_int_as_float(lds_frustum[8]));
+    frustum->imax = make_float3(ordered_int_as_float(lds_frustum[9]), ordered_int_as_float(lds_frustum[10]), ordered_int_as_float(lds_frustum[11]));
+    frustum->t_max = ordered_int_as_float(lds_frustum[12]);
+
+    int const signs = lds_frustum[13];
+    frustum->active = signs != 0;
+    // Incoherent if positive and negative directions are mixed along any axis
+    frustum->coherent = ((signs & (signs >> 3)) & 7) == 0;
+}
+
+// Conservative packet vs bbox test using interval arithmetic, false means none of
+// the rays can hit the box. Coherent packets only: entry and exit planes are the same for all the rays.
+INLINE
+bool packet_intersect_bbox(bbox box, packet_frustum const* frustum)
+{
+    int3 const negative = frustum->imax < 0.f;
+    float3 const entry = select(box.pmin.xyz, box.pmax.xyz, negative);
+    float3 const exit = select(box.pmax.xyz, box.pmin.xyz, negative);
+
+    // Distance intervals are (plane - [omin, omax]) * [imin, imax]
+    float3 const en0 = (entry - frustum->omin) * frustum->imin;
+    float3 const en1 = (entry - frustum->omin) * frustum->imax;
+    float3 const en2 = (entry - frustum->omax) * frustum->imin;
+    float3 const en3 = (entry - frustum->omax) * frustum->imax;
+    float3 const ex0 = (exit - frustum->omin) * frustum->imin;
+    float3 const ex1 = (exit - frustum->omin) * frustum->imax;
+    float3 const ex2 = (exit - frustum->omax) * frustum->imin;
+    float3 const ex3 = (exit - frustum->omax) * frustum->imax;
+
+    float3 const entry_lo = min(min(en0, en1), min(en2, en3));
+    float3 const exit_hi = max(max(ex0, ex1), max(ex2, ex3));
+
+    float const t0 = max3(entry_lo.x, entry_lo.y, entry_lo.z);
+    float const t1 = min3(exit_hi.x, exit_hi.y, exit_hi.z);
+
+    // NaNs from infinite inverse directions fail the comparisons and keep the box
+    return !(t0 > t1 || t1 < 0.f || t0 > frustum->t_max);
+}
+
+// Vote for the children of internal node, returns the child the packet proceeds to
+// or INVALID_IDX if none of the rays needs any. If the packet needs both children
+// the farther one is returned in deferred. Needs to be called by all the lanes.
+INLINE
+int packet_traverse_node(bvh_node const* node, packet_frustum const* frustum, bool active,
+    float3 invdir, float3 oxinvdir, float t_max, __local int* votes, __local int* next_votes, int* deferred)
+{
+    // The whole packet skips a child if its frustum misses the bounds
+    bool const cull_c0 = frustum->coherent && !packet_intersect_bbox(node->bounds[0], frustum);
+    bool const cull_c1 = frustum->coherent && !packet_intersect_bbox(node->bounds[1], frustum);
+
+    if (active && !(cull_c0 && cull_c1))
+    {
+        float2 const s0 = fast_intersect_bbox1(node->bounds[0], invdir, oxinvdir, t_max);
+        float2 const s1 = fast_intersect_bbox1(node->bounds[1], invdir, oxinvdir, t_max);
+
+        bool const traverse_c0 = !cull_c0 && (s0.x <= s0.y);
+        bool const traverse_c1 = !cull_c1 && (s1.x <= s1.y);
+
+        if (traverse_c0)
+        {
+            atomic_inc(votes + 0);
+        }
+
+        if (traverse_c1)
+        {
+            atomic_inc(votes + 1);
+        }
+
+        // Rays needing both children vote for the closer one
+        if (traverse_c0 && traverse_c1)
+        {
+            atomic_inc(votes + (s0.x > s1.x ? 3 : 2));
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int const num_c0 = votes[0];
+    int const num_c1 = votes[1];
+    int const num_c0first = votes[2];
+    int const num_c1first = votes[3];
+
+    // The other half has been read before the barrier above, it is
+    // ready for the next node once the caller synchronizes again
+    if (get_local_id(0) == 0)
+    {
+        for (int i = 0; i < PACKET_VOTES_SIZE; ++i)
+        {
+            next_votes[i] = 0;
+        }
+    }
+
+    *deferred = INVALID_IDX;
+
+    if (num_c0 == 0 && num_c1 == 0)
+    {
+        return INVALID_IDX;
+    }
+
+    if (num_c0 == 0)
+    {
+        return node->child1;
+    }
+
+    if (num_c1 == 0)
+    {
+        return node->child0;
+    }
+
+    bool const c1first = num_c1first > num_c0first || (num_c1first == num_c0first && num_c1 > num_c0);
+    *deferred = c1first ? node->child0 : node->child1;
+    return c1first ? node->child1 : node->child0;
+}
+
+// Find closest hits of the work group rays traversing the tree as a packet
+INLINE
+void intersect_packet(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Packet stack, frustum and double buffered votes in LDS
+    __local int* lds_stack,
+    __local int* lds_frustum,
+    __local int* lds_votes,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+
+    // Lanes out of the working set still take part in votes and barriers
+    bool const valid = global_id < *num_rays;
+    ray const r = rays[valid ? global_id : 0];
+    bool const active = valid && ray_is_active(&r);
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float t_max = r.o.w;
+
+    packet_frustum frustum;
+    packet_init(r.o.xyz, t_max, invdir, active, lds_frustum, lds_votes, &frustum);
+
+    // Current node address, uniform across the packet
+    int addr = frustum.active ? 0 : INVALID_IDX;
+    // Current closest intersection leaf index
+    int isect_idx = INVALID_IDX;
+    // Stack pointer is uniform, so each lane keeps a copy
+    int sp = 0;
+    // Votes buffer to use for the next internal node
+    int parity = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Check if it is a leaf
+        if (LEAFNODE(node))
+        {
+            if (active)
+            {
+                // Intersect triangle
+                float const f = intersect_leaf(vertices, &node, &r, t_max);
+                // If hit update closest hit distance and index
+                if (f < t_max)
+                {
+                    t_max = f;
+                    isect_idx = addr;
+                }
+            }
+        }
+        else
+        {
+            int deferred = INVALID_IDX;
+            int const next = packet_traverse_node(&node, &frustum, active, invdir, oxinvdir, t_max,
+                lds_votes + parity * PACKET_VOTES_SIZE, lds_votes + (parity ^ 1) * PACKET_VOTES_SIZE, &deferred);
+
+            // Postpone farther child
+            if (deferred != INVALID_IDX)
+            {
+                if (local_id == 0)
+                {
+                    lds_stack[sp] = deferred;
+                }
+
+                ++sp;
+            }
+
+            // Make stack and votes reset visible to everybody
+            barrier(CLK_LOCAL_MEM_FENCE);
+            parity ^= 1;
+
+            if (next != INVALID_IDX)
+            {
+                addr = next;
+                continue;
+            }
+        }
+
+        // Pop next node
+        addr = sp > 0 ? lds_stack[--sp] : INVALID_IDX;
+    }
+
+    if (active)
+    {
+        // Check if we have found an intersection
+        if (isect_idx != INVALID_IDX)
+        {
+            // Fetch the node
+            bvh_node const node = nodes[isect_idx];
+            // Barycentric coordinates are only reported in full format
+            float2 uv = make_float2(0.f, 0.f);
+
+            if (hit_format_has_uv(format))
+            {
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                uv = leaf_calculate_barycentrics(vertices, &node, p);
+            }
+
+            // Update hit information
+            store_hit(hits, global_id, format, plane_size, node.shape_id, node.prim_id, uv, t_max);
+        }
+        else
+        {
+            // Miss here
+            store_miss(hits, global_id, format, plane_size);
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_packet_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL Intersection* hits)
+{
+    // Packet stack, frustum and double buffered votes
+    __local int lds_stack[PACKET_STACK_SIZE];
+    __local int lds_frustum[PACKET_FRUSTUM_SIZE];
+    __local int lds_votes[2 * PACKET_VOTES_SIZE];
+
+    intersect_packet(nodes, vertices, rays, num_rays, lds_stack, lds_frustum, lds_votes, (GLOBAL int*)hits, HIT_FORMAT_FULL, 0);
+}
+
+// Compact hit formats version: only the data requested by "acc.hit_format" is written
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_packet_compact_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size)
+{
+    // Packet stack, frustum and double buffered votes
+    __local int lds_stack[PACKET_STACK_SIZE];
+    __local int lds_frustum[PACKET_FRUSTUM_SIZE];
+    __local int lds_votes[2 * PACKET_VOTES_SIZE];
+
+    intersect_packet(nodes, vertices, rays, num_rays, lds_stack, lds_frustum, lds_votes, hits, format, plane_size);
+}
+
+// Find any hit of the packet rays, results are written to hits unless it is 0.
+// Returns true for occluded rays, all the work items have to call it
+INLINE
+bool occlude_packet(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Packet stack, frustum and double buffered votes
+    __local int* lds_stack,
+    __local int* lds_frustum,
+    __local int* lds_votes,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+
+    // Lanes out of the working set still take part in votes and barriers
+    bool const valid = global_id < *num_rays;
+    ray const r = rays[valid ? global_id : 0];
+    // Rays stop voting once they have found a hit
+    bool active = valid && ray_is_active(&r);
+    bool hit = false;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance
+    float const t_max = r.o.w;
+
+    packet_frustum frustum;
+    packet_init(r.o.xyz, t_max, invdir, active, lds_frustum, lds_votes, &frustum);
+
+    // Current node address, uniform across the packet
+    int addr = frustum.active ? 0 : INVALID_IDX;
+    // Stack pointer is uniform, so each lane keeps a copy
+    int sp = 0;
+    // Votes buffer to use for the next internal node
+    int parity = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+
+        // Check if it is a leaf
+        if (LEAFNODE(node))
+        {
+            if (active && occlude_leaf(vertices, &node, &r, t_max))
+            {
+                hit = true;
+                active = false;
+            }
+        }
+        else
+        {
+            int deferred = INVALID_IDX;
+            int const next = packet_traverse_node(&node, &frustum, active, invdir, oxinvdir, t_max,
+                lds_votes + parity * PACKET_VOTES_SIZE, lds_votes + (parity ^ 1) * PACKET_VOTES_SIZE, &deferred);
+
+            // Postpone farther child
+            if (deferred != INVALID_IDX)
+            {
+                if (local_id == 0)
+                {
+                    lds_stack[sp] = deferred;
+                }
+
+                ++sp;
+            }
+
+            // Make stack and votes reset visible to everybody
+            barrier(CLK_LOCAL_MEM_FENCE);
+            parity ^= 1;
+
+            if (next != INVALID_IDX)
+            {
+                addr = next;
+                continue;
+            }
+        }
+
+        // Pop next node, once all the rays are done nobody votes and the stack drains
+        addr = sp > 0 ? lds_stack[--sp] : INVALID_IDX;
+    }
+
+    if (hits && valid && ray_is_active(&r))
+    {
+        hits[global_id] = hit ? HIT_MARKER : MISS_MARKER;
+    }
+
+    return hit;
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_packet_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits)
+{
+    // Packet stack, frustum and double buffered votes
+    __local int lds_stack[PACKET_STACK_SIZE];
+    __local int lds_frustum[PACKET_FRUSTUM_SIZE];
+    __local int lds_votes[2 * PACKET_VOTES_SIZE];
+
+    occlude_packet(nodes, vertices, rays, num_rays, lds_stack, lds_frustum, lds_votes, hits);
+}
+
+// Bit-packed version ("acc.occlusion_format" "bits"): one bit per ray, set for occluded ones
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_packet_bits_main(
+    // Bvh nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangles vertices (precomputed triangles with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit results: 32 rays per word
+    GLOBAL uint* hits)
+{
+    // Packet stack, frustum and double buffered votes
+    __local int lds_stack[PACKET_STACK_SIZE];
+    __local int lds_frustum[PACKET_FRUSTUM_SIZE];
+    __local int lds_votes[2 * PACKET_VOTES_SIZE];
+    __local uint lds_bits[2];
+
+    bool const occluded = occlude_packet(nodes, vertices, rays, num_rays, lds_stack, lds_frustum, lds_votes, 0);
+    store_occlusion_bits(hits, get_global_id(0), *num_rays, occluded, lds_bits);
+}
+
+// Refit child bounds bottom-up keeping tree topology intact.
+// Each thread starts from a leaf and walks up to the root, the node is
+// updated by the thread which arrives there second (both children are ready).
+// Parent links are encoded as (parent << 1) | side, where side is 0 for the left child.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL
+void refit_main(
+    // BVH nodes
+    GLOBAL bvh_node* nodes,
+    // Triangle vertices
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Parent node links
+    GLOBAL int const* restrict parents,
+    // Leaf node indices
+    GLOBAL int const* restrict leaves,
+    // Number of leaves
+    int num_leaves,
+    // Visit counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* flags
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_leaves)
+    {
+        int idx = leaves[global_id];
+        bvh_node const node = nodes[idx];
+
+        float3 const v1 = FETCH_VERTEX(vertices, node.i0);
+        float3 const v2 = FETCH_VERTEX(vertices, node.i1);
+        float3 const v3 = FETCH_VERTEX(vertices, node.i2);
+        float3 pmin = min(v1, min(v2, v3));
+        float3 pmax = max(v1, max(v2, v3));
+
+        int link;
+        while ((link = parents[idx]) != INVALID_IDX)
+        {
+            int const parent = link >> 1;
+            int const side = link & 1;
+
+            // Child bounds are stored in the parent, keep .w components (child links)
+            nodes[parent].bounds[side].pmin.xyz = pmin;
+            nodes[parent].bounds[side].pmax.xyz = pmax;
+
+            // Make sure our bounds are visible before signaling
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+            // The first thread to arrive bails out
+            if (atomic_inc(flags + parent) == 0)
+            {
+                break;
+            }
+
+            flags[parent] = 0;
+
+            pmin = min(nodes[parent].bounds[0].pmin.xyz, nodes[parent].bounds[1].pmin.xyz);
+            pmax = max(nodes[parent].bounds[0].pmax.xyz, nodes[parent].bounds[1].pmax.xyz);
+            idx = parent;
+        }
     }
 }
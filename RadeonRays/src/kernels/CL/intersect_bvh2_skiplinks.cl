@@ -75,6 +75,14 @@ DEFINES
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
 #define NEXT(x)     ((int)((x).pmax.w))
 
+#ifdef RR_ORDERED_LAYOUTS
+// Nodes of 8 layouts visiting the near child first for each ray direction octant are
+// interleaved, node addr of the layout of octant o is at 8 * addr + o ("bvh.direction_ordered")
+#define NODE_INDEX(addr, octant) (((addr) << 3) | (octant))
+#else
+#define NODE_INDEX(addr, octant) (addr)
+#endif
+
 
 
 /*************************************************************************
@@ -86,194 +94,1789 @@ typedef struct
 {
     // Vertex indices
     int idx[3];
-    // Shape maks
-    int shape_mask;
-    // Shape ID
-    int shape_id;
-    // Primitive ID
+    // Primitive ID within the mesh, shape ID comes from the shape range table
     int prim_id;
+#if defined(RR_QUADS)
+    // Fourth vertex index of quads, -1 for triangles
+    int idx3;
+    int padding;
+#elif defined(RR_TRIANGLE_PAIRS)
+    // Vertex of the second triangle of a pair which is not shared with the first one in the
+    // lower 26 bits and slots of the second triangle vertices in (idx[0], idx[1], idx[2], that
+    // vertex) as 2 bits each in the upper 6 bits, -1 for a single triangle
+    int idx3;
+    // Primitive ID of the second triangle
+    int prim_id2;
+#endif
 } Face;
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL 
-void intersect_main(
+#ifdef RR_TRIANGLE_PAIRS
+// Hit indices keep the triangle of the pair in the lowest bit
+#define HIT_FACE(h)     ((h) >> 1)
+#define MAKE_HIT(f, t)  (((f) << 1) | (t))
+#define PAIR_VERTEX_MASK 0x3FFFFFF
+#define PAIR_SLOTS_SHIFT 26
+#else
+#define HIT_FACE(h)     (h)
+#define MAKE_HIT(f, t)  (f)
+#endif
+
+#ifdef RR_HIT_CALLBACK
+// Hit callbacks appended to the program by "acc.hit_callback" option. They are called
+// instead of writing query results, output is the hits buffer passed to the query.
+void rr_closest_hit(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void* output);
+void rr_closest_miss(int ray_idx, ray const* r, GLOBAL void* output);
+void rr_any_hit(int ray_idx, ray const* r, GLOBAL void* output);
+void rr_any_miss(int ray_idx, ray const* r, GLOBAL void* output);
+#endif
+
+#ifdef RR_HIT_FILTER
+// Hit filter appended to the program by "acc.hit_filter" option. It is called for every
+// candidate hit inside leaves, hits it returns false for are skipped and traversal goes on.
+// data is the buffer passed to IntersectionApi::SetHitFilterData.
+bool rr_hit_filter(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void const* data);
+// Traversal entry points get filter data as the last argument
+#define HIT_FILTER_DATA filter_data
+#else
+#define HIT_FILTER_DATA 0
+#endif
+
+#ifdef RR_HIT_HINTS
+// Closest hit entry points get hits of a previous query and the primitive to face table
+// ("bvh.hit_hints") after filter data
+#define HIT_HINTS_DATA hints, num_hints, hint_faces
+#else
+#define HIT_HINTS_DATA 0, 0, 0
+#endif
+
+// Octant of the ray direction, bit i is set if component i is negative
+INLINE
+int ray_octant(ray const* r)
+{
+    return (r->d.x < 0.f ? 1 : 0) | (r->d.y < 0.f ? 2 : 0) | (r->d.z < 0.f ? 4 : 0);
+}
+
+#ifdef RR_TRIANGLE_PAIRS
+// Vertex index in slot (0-2 for the first triangle vertices, 3 for the vertex of the second one)
+INLINE
+int pair_vertex_index(Face const* face, int slot)
+{
+    return slot == 3 ? (face->idx3 & PAIR_VERTEX_MASK) : face->idx[slot];
+}
+
+// Vertices of the second triangle of a pair in their original order
+INLINE
+void pair_second_triangle(GLOBAL VERTEX_TYPE const* restrict vertices, Face const* face, float3* v1, float3* v2, float3* v3)
+{
+    uint const slots = ((uint)face->idx3) >> PAIR_SLOTS_SHIFT;
+    *v1 = FETCH_VERTEX(vertices, pair_vertex_index(face, slots & 3));
+    *v2 = FETCH_VERTEX(vertices, pair_vertex_index(face, (slots >> 2) & 3));
+    *v3 = FETCH_VERTEX(vertices, pair_vertex_index(face, (slots >> 4) & 3));
+}
+#endif
+
+// Primitive ID of the hit triangle
+INLINE
+int face_prim_id(Face const* face, int hit_idx)
+{
+#ifdef RR_TRIANGLE_PAIRS
+    return (hit_idx & 1) ? face->prim_id2 : face->prim_id;
+#else
+    return face->prim_id;
+#endif
+}
+
+// Shape ID of the face. Faces of a shape are consecutive in leaf order more often than not, so
+// shape IDs are kept per range of faces: shape_ranges[0] is the number of ranges n, followed by
+// n first face indices in increasing order and n shape IDs of those ranges.
+INLINE
+int face_shape_id(GLOBAL int const* restrict shape_ranges, int face_idx)
+{
+    int const num_ranges = shape_ranges[0];
+    GLOBAL int const* restrict first_faces = shape_ranges + 1;
+
+    // Find the last range starting at or before the face
+    int lo = 0;
+    int hi = num_ranges - 1;
+
+    while (lo < hi)
+    {
+        int const mid = (lo + hi + 1) >> 1;
+
+        if (first_faces[mid] <= face_idx)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return first_faces[num_ranges + lo];
+}
+
+#ifdef RR_HIT_HINTS
+// Leaf order face holding the primitive the ray hit in a previous query, INVALID_IDX if there is none.
+// hint_faces[0] is the number of shapes n, followed by n shape IDs in increasing order, n offsets and
+// n primitive counts of the shapes into the face indices of all primitives, which follow them.
+INLINE
+int hint_face(GLOBAL Intersection const* hints, int num_hints, GLOBAL int const* restrict hint_faces, int ray_idx)
+{
+    if (ray_idx >= num_hints)
+    {
+        return INVALID_IDX;
+    }
+
+    int const shape_id = hints[ray_idx].shape_id;
+    int const prim_id = hints[ray_idx].prim_id;
+    int const num_shapes = hint_faces[0];
+    GLOBAL int const* restrict table = hint_faces + 1;
+
+    // Find the first shape with ID not less than the hinted one, misses find none
+    int lo = 0;
+    int hi = num_shapes;
+
+    while (lo < hi)
+    {
+        int const mid = (lo + hi) >> 1;
+
+        if (table[mid] < shape_id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    if (lo == num_shapes || table[lo] != shape_id || prim_id < 0 || prim_id >= table[2 * num_shapes + lo])
+    {
+        return INVALID_IDX;
+    }
+
+    return table[3 * num_shapes + table[num_shapes + lo] + prim_id];
+}
+#endif
+
+// Intersect ray vs face, returns hit distance or t_max if there is no hit or the ray culls the face.
+// hit_idx receives the hit index of the face if it is hit (telling the triangles of a pair apart)
+INLINE
+float intersect_face(GLOBAL VERTEX_TYPE const* restrict vertices, GLOBAL Face const* restrict faces, ray const* r, int face_idx, float t_max, int* hit_idx)
+{
+    *hit_idx = MAKE_HIT(face_idx, 0);
+
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    // Triangles are stored in leaf order, the layout is hidden by common.cl accessors
+    GLOBAL float3 const* triangle = vertices + 3 * face_idx;
+    if (ray_culls_triangle(r, precomputed_triangle_vertex(triangle, 0), precomputed_triangle_vertex(triangle, 1), precomputed_triangle_vertex(triangle, 2)))
+    {
+        return t_max;
+    }
+    return precomputed_intersect_triangle(*r, triangle, t_max);
+#else
+    Face const face = faces[face_idx];
+    float3 const v1 = FETCH_VERTEX(vertices, face.idx[0]);
+    float3 const v2 = FETCH_VERTEX(vertices, face.idx[1]);
+    float3 const v3 = FETCH_VERTEX(vertices, face.idx[2]);
+#ifdef RR_TRIANGLE_PAIRS
+    // Triangles of a pair are culled separately, the second one has to be closer than the first
+    float t = ray_culls_triangle(r, v1, v2, v3) ? t_max : fast_intersect_triangle(*r, v1, v2, v3, t_max);
+
+    if (face.idx3 != -1)
+    {
+        float3 w1, w2, w3;
+        pair_second_triangle(vertices, &face, &w1, &w2, &w3);
+
+        float const t2 = ray_culls_triangle(r, w1, w2, w3) ? t : fast_intersect_triangle(*r, w1, w2, w3, t);
+
+        if (t2 < t)
+        {
+            t = t2;
+            *hit_idx = MAKE_HIT(face_idx, 1);
+        }
+    }
+
+    return t;
+#else
+    // Quads are culled by their first triangle
+    if (ray_culls_triangle(r, v1, v2, v3))
+    {
+        return t_max;
+    }
+#ifdef RR_QUADS
+    if (face.idx3 >= 0)
+    {
+        return fast_intersect_quad(*r, v1, v2, v3, FETCH_VERTEX(vertices, face.idx3), t_max);
+    }
+#endif
+    return fast_intersect_triangle(*r, v1, v2, v3, t_max);
+#endif
+#endif
+}
+
+// Check if ray hits the face closer than t_max, faces culled by the ray are never hit
+INLINE
+bool occlude_face(GLOBAL VERTEX_TYPE const* restrict vertices, GLOBAL Face const* restrict faces, ray const* r, int face_idx, float t_max)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * face_idx;
+    if (ray_culls_triangle(r, precomputed_triangle_vertex(triangle, 0), precomputed_triangle_vertex(triangle, 1), precomputed_triangle_vertex(triangle, 2)))
+    {
+        return false;
+    }
+    return precomputed_occlude_triangle(*r, triangle, t_max);
+#else
+    Face const face = faces[face_idx];
+    float3 const v1 = FETCH_VERTEX(vertices, face.idx[0]);
+    float3 const v2 = FETCH_VERTEX(vertices, face.idx[1]);
+    float3 const v3 = FETCH_VERTEX(vertices, face.idx[2]);
+#ifdef RR_TRIANGLE_PAIRS
+    if (!ray_culls_triangle(r, v1, v2, v3) && fast_occlude_triangle(*r, v1, v2, v3, t_max))
+    {
+        return true;
+    }
+
+    if (face.idx3 == -1)
+    {
+        return false;
+    }
+
+    float3 w1, w2, w3;
+    pair_second_triangle(vertices, &face, &w1, &w2, &w3);
+    return !ray_culls_triangle(r, w1, w2, w3) && fast_occlude_triangle(*r, w1, w2, w3, t_max);
+#else
+    if (ray_culls_triangle(r, v1, v2, v3))
+    {
+        return false;
+    }
+#ifdef RR_QUADS
+    if (face.idx3 >= 0)
+    {
+        return fast_occlude_quad(*r, v1, v2, v3, FETCH_VERTEX(vertices, face.idx3), t_max);
+    }
+#endif
+    return fast_occlude_triangle(*r, v1, v2, v3, t_max);
+#endif
+#endif
+}
+
+// Calculate barycentric coordinates of a point on the hit triangle
+INLINE
+float2 face_calculate_barycentrics(GLOBAL VERTEX_TYPE const* restrict vertices, GLOBAL Face const* restrict faces, int hit_idx, float3 p)
+{
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * hit_idx;
+    return precomputed_triangle_barycentrics(p, triangle);
+#else
+    Face const face = faces[HIT_FACE(hit_idx)];
+#ifdef RR_TRIANGLE_PAIRS
+    // Barycentrics follow the vertex order of the hit triangle
+    if (hit_idx & 1)
+    {
+        float3 w1, w2, w3;
+        pair_second_triangle(vertices, &face, &w1, &w2, &w3);
+        return triangle_calculate_barycentrics(p, w1, w2, w3);
+    }
+#endif
+    float3 const v1 = FETCH_VERTEX(vertices, face.idx[0]);
+    float3 const v2 = FETCH_VERTEX(vertices, face.idx[1]);
+    float3 const v3 = FETCH_VERTEX(vertices, face.idx[2]);
+#ifdef RR_QUADS
+    if (face.idx3 >= 0)
+    {
+        return quad_calculate_uv(p, v1, v2, v3, FETCH_VERTEX(vertices, face.idx3));
+    }
+#endif
+    return triangle_calculate_barycentrics(p, v1, v2, v3);
+#endif
+}
+
+#ifdef RR_HIT_FILTER
+// Check if the hit at distance t is kept by the hit filter, always true for opaque rays
+INLINE
+bool filter_face(GLOBAL VERTEX_TYPE const* restrict vertices, GLOBAL Face const* restrict faces, GLOBAL int const* restrict shape_ranges, ray const* r, int ray_idx, int hit_idx, float t, GLOBAL void const* filter_data)
+{
+    // Opaque rays keep every hit
+    if (ray_get_flags(r) & RAY_FLAG_OPAQUE)
+    {
+        return true;
+    }
+
+    Face const face = faces[HIT_FACE(hit_idx)];
+    float3 const p = r->o.xyz + r->d.xyz * t;
+    float2 const uv = face_calculate_barycentrics(vertices, faces, hit_idx, p);
+    return rr_hit_filter(ray_idx, r, face_shape_id(shape_ranges, HIT_FACE(hit_idx)), face_prim_id(&face, hit_idx), uv, t, filter_data);
+}
+#endif
+
+// Find closest hit of a single ray, rays flagged as any hit stop at their first hit
+INLINE
+void intersect_closest(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
-    // Triangle vertices
-    GLOBAL float3 const* restrict vertices,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
     // Triangle indices
     GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
     // Rays 
     GLOBAL ray const* restrict rays,
-    // Number of rays
-    GLOBAL int const* restrict num_rays,
-    // Hit data
-    GLOBAL Intersection* hits
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Ray index
+    int ray_idx,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size,
+    // Data read by hit filter
+    GLOBAL void const* filter_data,
+    // Hits of a previous query tested first, their count and primitive to face table (RR_HIT_HINTS only)
+    GLOBAL Intersection const* hints,
+    int num_hints,
+    GLOBAL int const* restrict hint_faces,
+    // Traversal counters of the ray, only written with RR_TRAVERSAL_STATS
+    GLOBAL traversal_stats* stats_out
 )
 {
-    int global_id = get_global_id(0);
+    // Fetch ray
+    ray const r = rays[ray_idx];
+    STATS_BEGIN();
 
-    if (global_id < *num_rays)
+    if (ray_is_active(&r))
     {
-        // Fetch ray
-        ray const r = rays[global_id];
+        // Precompute inverse direction and origin / dir for bbox testing
+        float3 const invdir = safe_invdir(r);
+        float3 const oxinvdir = -r.o.xyz * invdir;
+        // Layout visiting near children first
+        int const octant = ray_octant(&r);
+        // Intersection parametric distance
+        float t_max = r.o.w;
+        // Any hit rays leave the traversal loop at their first hit
+        bool const any_hit = ray_is_any_hit(&r);
 
-        if (ray_is_active(&r))
-        {
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float t_max = r.o.w;
+        // Current node address
+        int addr = 0;
+        // Current closest face index
+        int isect_idx = INVALID_IDX;
 
-            // Current node address
-            int addr = 0;
-            // Current closest face index
-            int isect_idx = INVALID_IDX;
+#ifdef RR_HIT_HINTS
+        // Testing the previous hit first tightens t_max before traversal, so most of the tree is culled
+        int const hinted = hint_face(hints, num_hints, hint_faces, ray_idx);
 
-            while (addr != INVALID_IDX)
+        if (hinted != INVALID_IDX)
+        {
+            int hit_idx;
+            float const f = intersect_face(vertices, faces, &r, hinted, t_max, &hit_idx);
+#ifdef RR_HIT_FILTER
+            if (f < t_max && filter_face(vertices, faces, shape_ranges, &r, ray_idx, hit_idx, f, filter_data))
+#else
+            if (f < t_max)
+#endif
             {
-                // Fetch next node
-                bvh_node node = nodes[addr];
-                // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+                t_max = f;
+                isect_idx = hit_idx;
+            }
+        }
+
+        // Any hit rays are done if the hint is hit
+        if (any_hit && isect_idx != INVALID_IDX)
+        {
+            addr = INVALID_IDX;
+        }
+#endif
 
-                if (s.x <= s.y)
+        while (addr != INVALID_IDX)
+        {
+            // Fetch next node
+            bvh_node node = nodes[NODE_INDEX(addr, octant)];
+            STATS_ADD(nodes, 1);
+            // Intersect against bbox
+            float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+
+            if (s.x <= s.y)
+            {
+                // Check if the node is a leaf
+                if (LEAFNODE(node))
                 {
-                    // Check if the node is a leaf
-                    if (LEAFNODE(node))
+                    int const start_idx = STARTIDX(node);
+                    int const num_prims = NUMPRIMS(node);
+                    STATS_ADD(leaves, 1);
+                    STATS_ADD(prims, num_prims);
+
+                    // Intersect leaf triangles
+                    for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-                        float3 const v1 = vertices[face.idx[0]];
-                        float3 const v2 = vertices[face.idx[1]];
-                        float3 const v3 = vertices[face.idx[2]];
-
-                        // Intersect triangle
-                        float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+                        int hit_idx;
+                        float const f = intersect_face(vertices, faces, &r, face_idx, t_max, &hit_idx);
                         // If hit update closest hit distance and index
+#ifdef RR_HIT_FILTER
+                        if (f < t_max && filter_face(vertices, faces, shape_ranges, &r, ray_idx, hit_idx, f, filter_data))
+#else
                         if (f < t_max)
+#endif
                         {
                             t_max = f;
-                            isect_idx = face_idx;
+                            isect_idx = hit_idx;
                         }
                     }
-                    else
+
+                    if (any_hit && isect_idx != INVALID_IDX)
                     {
-                        // Move to next node otherwise.
-                        // Left child is always at addr + 1
-                        ++addr;
-                        continue;
+                        break;
                     }
                 }
-
-                addr = NEXT(node);
+                else
+                {
+                    // Move to next node otherwise.
+                    // Left child is always at addr + 1
+                    ++addr;
+                    continue;
+                }
             }
 
-            // Check if we have found an intersection
-            if (isect_idx != INVALID_IDX)
+            addr = NEXT(node);
+        }
+
+        // Check if we have found an intersection
+        if (isect_idx != INVALID_IDX)
+        {
+            // Fetch the face
+            Face const face = faces[HIT_FACE(isect_idx)];
+#ifdef RR_HIT_CALLBACK
+            // Hand the hit over to the callback without writing it to memory
+            float3 const p = r.o.xyz + r.d.xyz * t_max;
+            float2 const uv = face_calculate_barycentrics(vertices, faces, isect_idx, p);
+            rr_closest_hit(ray_idx, &r, face_shape_id(shape_ranges, HIT_FACE(isect_idx)), face_prim_id(&face, isect_idx), uv, t_max, hits);
+        }
+        else
+        {
+            rr_closest_miss(ray_idx, &r, hits);
+        }
+#else
+            // Barycentric coordinates are only reported in full format
+            float2 uv = make_float2(0.f, 0.f);
+
+            if (hit_format_has_uv(format))
             {
-                // Fetch the node & vertices
-                Face const face = faces[isect_idx];
-                float3 const v1 = vertices[face.idx[0]];
-                float3 const v2 = vertices[face.idx[1]];
-                float3 const v3 = vertices[face.idx[2]];
                 // Calculate hit position
                 float3 const p = r.o.xyz + r.d.xyz * t_max;
                 // Calculte barycentric coordinates
-                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
-                // Update hit information
-                hits[global_id].shape_id = face.shape_id;
-                hits[global_id].prim_id = face.prim_id;
-                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
-            }
-            else
-            {
-                // Miss here
-                hits[global_id].shape_id = MISS_MARKER;
-                hits[global_id].prim_id = MISS_MARKER;
+                uv = face_calculate_barycentrics(vertices, faces, isect_idx, p);
             }
+
+            // Update hit information
+            store_hit(hits, ray_idx, format, plane_size, face_shape_id(shape_ranges, HIT_FACE(isect_idx)), face_prim_id(&face, isect_idx), uv, t_max);
+        }
+        else
+        {
+            // Miss here
+            store_miss(hits, ray_idx, format, plane_size);
         }
+#endif
     }
+
+    STATS_END(stats_out);
 }
 
-__attribute__((reqd_work_group_size(64, 1, 1)))
-KERNEL 
-void occluded_main(
+// Find any hit of a single ray, the result is written to hits unless it is 0.
+// Returns true if the ray is occluded
+INLINE
+bool intersect_any(
     // BVH nodes
     GLOBAL bvh_node const* restrict nodes,
-    // Triangle vertices
-    GLOBAL float3 const* restrict vertices,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
     // Triangle indices
     GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
     // Rays 
     GLOBAL ray const* restrict rays,
-    // Number of rays
-    GLOBAL int const* restrict num_rays,
     // Hit data
-    GLOBAL int* hits
+    GLOBAL int* hits,
+    // Ray index
+    int ray_idx,
+    // Data read by hit filter
+    GLOBAL void const* filter_data,
+    // Traversal counters of the ray, only written with RR_TRAVERSAL_STATS
+    GLOBAL traversal_stats* stats_out
 )
 {
-    int global_id = get_global_id(0);
+    // Fetch ray
+    ray const r = rays[ray_idx];
+    STATS_BEGIN();
 
-    // Handle only working subset
-    if (global_id < *num_rays)
+    if (ray_is_active(&r))
     {
-        // Fetch ray
-        ray const r = rays[global_id];
+        // Precompute inverse direction and origin / dir for bbox testing
+        float3 const invdir = safe_invdir(r);
+        float3 const oxinvdir = -r.o.xyz * invdir;
+        // Layout visiting near children first
+        int const octant = ray_octant(&r);
+        // Intersection parametric distance
+        float t_max = r.o.w;
 
-        if (ray_is_active(&r))
-        {
-            // Precompute inverse direction and origin / dir for bbox testing
-            float3 const invdir = safe_invdir(r);
-            float3 const oxinvdir = -r.o.xyz * invdir;
-            // Intersection parametric distance
-            float t_max = r.o.w;
+        // Current node address
+        int addr = 0;
 
-            // Current node address
-            int addr = 0;
+        while (addr != INVALID_IDX)
+        {
+            // Fetch next node
+            bvh_node node = nodes[NODE_INDEX(addr, octant)];
+            STATS_ADD(nodes, 1);
+            // Intersect against bbox
+            float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
 
-            while (addr != INVALID_IDX)
+            if (s.x <= s.y)
             {
-                // Fetch next node
-                bvh_node node = nodes[addr];
-                // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
-
-                if (s.x <= s.y)
+                // Check if the node is a leaf
+                if (LEAFNODE(node))
                 {
-                    // Check if the node is a leaf
-                    if (LEAFNODE(node))
+                    int const start_idx = STARTIDX(node);
+                    int const num_prims = NUMPRIMS(node);
+                    STATS_ADD(leaves, 1);
+                    STATS_ADD(prims, num_prims);
+
+                    // Intersect leaf triangles
+                    for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
                     {
-                        int const face_idx = STARTIDX(node);
-                        Face const face = faces[face_idx];
-                        float3 const v1 = vertices[face.idx[0]];
-                        float3 const v2 = vertices[face.idx[1]];
-                        float3 const v3 = vertices[face.idx[2]];
-
-                        // Intersect triangle
-                        float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
                         // If hit store the result and bail out
-                        if (f < t_max)
+#ifdef RR_HIT_FILTER
+                        // Filter needs the hit distance
+                        int hit_idx;
+                        float const f = intersect_face(vertices, faces, &r, face_idx, t_max, &hit_idx);
+                        if (f < t_max && filter_face(vertices, faces, shape_ranges, &r, ray_idx, hit_idx, f, filter_data))
+#else
+                        if (occlude_face(vertices, faces, &r, face_idx, t_max))
+#endif
                         {
-                            hits[global_id] = HIT_MARKER;
-                            return;
+#ifdef RR_HIT_CALLBACK
+                            rr_any_hit(ray_idx, &r, hits);
+#else
+                            if (hits)
+                            {
+                                hits[ray_idx] = HIT_MARKER;
+                            }
+#endif
+                            STATS_END(stats_out);
+                            return true;
                         }
                     }
-                    else
-                    {
-                        // Move to next node otherwise.
-                        // Left child is always at addr + 1
-                        ++addr;
-                        continue;
-                    }
                 }
+                else
+                {
+                    // Move to next node otherwise.
+                    // Left child is always at addr + 1
+                    ++addr;
+                    continue;
+                }
+            }
+
+            addr = NEXT(node);
+        }
+
+        // Finished traversal, but no intersection found
+#ifdef RR_HIT_CALLBACK
+        rr_any_miss(ray_idx, &r, hits);
+#else
+        if (hits)
+        {
+            hits[ray_idx] = MISS_MARKER;
+        }
+#endif
+    }
+
+    STATS_END(stats_out);
+    return false;
+}
+
+#ifdef RR_SUBGROUPS
+// Sub group variants of the traversal, selected by the host for devices supporting
+// cl_khr_subgroups (without hit callbacks, filters or statistics). Work items of a sub group
+// keep iterating until none of them has nodes left, so all of them reach votes and broadcasts.
+// Work items past the working set or with inactive rays just take part in the votes.
+
+// Lanes mostly visit the same nodes near the root, such a node is fetched from a sub group
+// uniform address, so a single scalar load serves the whole sub group. Lanes which are done
+// don't break it.
+INLINE
+bvh_node fetch_node_subgroup(GLOBAL bvh_node const* restrict nodes, int addr, int octant)
+{
+    int const idx = addr == INVALID_IDX ? INVALID_IDX : NODE_INDEX(addr, octant);
+    // Largest index is a valid one while any lane has nodes left
+    int const uniform_idx = sub_group_reduce_max(idx);
+
+    if (sub_group_all(idx == uniform_idx || idx == INVALID_IDX))
+    {
+        return nodes[uniform_idx];
+    }
+
+    return nodes[max(idx, 0)];
+}
+
+// Find closest hit of a single ray if valid is set, the whole sub group has to call it
+INLINE
+void intersect_closest_subgroup(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Ray index
+    int ray_idx,
+    // Ray index is within the working set
+    bool valid,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size,
+    // Hits of a previous query tested first, their count and primitive to face table (RR_HIT_HINTS only)
+    GLOBAL Intersection const* hints,
+    int num_hints,
+    GLOBAL int const* restrict hint_faces
+)
+{
+    // Fetch ray
+    ray const r = rays[valid ? ray_idx : 0];
+    bool const active = valid && ray_is_active(&r);
+    // Any hit rays drop out at their first hit
+    bool const any_hit = ray_is_any_hit(&r);
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Layout visiting near children first
+    int const octant = ray_octant(&r);
+    // Intersection parametric distance
+    float t_max = r.o.w;
+
+    // Current node address
+    int addr = active ? 0 : INVALID_IDX;
+    // Current closest face index
+    int isect_idx = INVALID_IDX;
+
+#ifdef RR_HIT_HINTS
+    // Testing the previous hit first tightens t_max before traversal
+    int const hinted = active ? hint_face(hints, num_hints, hint_faces, ray_idx) : INVALID_IDX;
+
+    if (hinted != INVALID_IDX)
+    {
+        int hit_idx;
+        float const f = intersect_face(vertices, faces, &r, hinted, t_max, &hit_idx);
+
+        if (f < t_max)
+        {
+            t_max = f;
+            isect_idx = hit_idx;
+        }
+    }
+
+    addr = any_hit && isect_idx != INVALID_IDX ? INVALID_IDX : addr;
+#endif
+
+    while (sub_group_any(addr != INVALID_IDX))
+    {
+        // Fetch next node, lanes which are done fetch one as well and skip it
+        bvh_node const node = fetch_node_subgroup(nodes, addr, octant);
+
+        if (addr == INVALID_IDX)
+        {
+            continue;
+        }
+
+        // Intersect against bbox
+        float2 const s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+
+        if (s.x <= s.y)
+        {
+            if (!LEAFNODE(node))
+            {
+                // Left child is always at addr + 1
+                ++addr;
+                continue;
+            }
+
+            int const start_idx = STARTIDX(node);
+            int const num_prims = NUMPRIMS(node);
+
+            // Intersect leaf triangles
+            for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
+            {
+                int hit_idx;
+                float const f = intersect_face(vertices, faces, &r, face_idx, t_max, &hit_idx);
+
+                if (f < t_max)
+                {
+                    t_max = f;
+                    isect_idx = hit_idx;
+                }
+            }
+        }
+
+        addr = any_hit && isect_idx != INVALID_IDX ? INVALID_IDX : NEXT(node);
+    }
+
+    if (!active)
+    {
+        return;
+    }
+
+    if (isect_idx != INVALID_IDX)
+    {
+        Face const face = faces[HIT_FACE(isect_idx)];
+        // Barycentric coordinates are only reported in full format
+        float2 uv = make_float2(0.f, 0.f);
+
+        if (hit_format_has_uv(format))
+        {
+            float3 const p = r.o.xyz + r.d.xyz * t_max;
+            uv = face_calculate_barycentrics(vertices, faces, isect_idx, p);
+        }
+
+        store_hit(hits, ray_idx, format, plane_size, face_shape_id(shape_ranges, HIT_FACE(isect_idx)), face_prim_id(&face, isect_idx), uv, t_max);
+    }
+    else
+    {
+        store_miss(hits, ray_idx, format, plane_size);
+    }
+}
+
+// Find any hit of a single ray if valid is set, the whole sub group has to call it.
+// The result is written to hits unless it is 0. Returns true if the ray is occluded
+INLINE
+bool intersect_any_subgroup(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Hit data
+    GLOBAL int* hits,
+    // Ray index
+    int ray_idx,
+    // Ray index is within the working set
+    bool valid
+)
+{
+    // Fetch ray
+    ray const r = rays[valid ? ray_idx : 0];
+    bool const active = valid && ray_is_active(&r);
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    int const octant = ray_octant(&r);
+    float const t_max = r.o.w;
+
+    // Current node address
+    int addr = active ? 0 : INVALID_IDX;
+    bool occluded = false;
+
+    // Occluded rays drop out right away, the sub group leaves
+    // as soon as the vote finds no lane with nodes left
+    while (sub_group_any(addr != INVALID_IDX))
+    {
+        // Fetch next node, lanes which are done fetch one as well and skip it
+        bvh_node const node = fetch_node_subgroup(nodes, addr, octant);
+
+        if (addr == INVALID_IDX)
+        {
+            continue;
+        }
+
+        // Intersect against bbox
+        float2 const s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
 
-                addr = NEXT(node);
+        if (s.x <= s.y)
+        {
+            if (!LEAFNODE(node))
+            {
+                // Left child is always at addr + 1
+                ++addr;
+                continue;
             }
 
-            // Finished traversal, but no intersection found
-            hits[global_id] = MISS_MARKER;
+            int const start_idx = STARTIDX(node);
+            int const num_prims = NUMPRIMS(node);
+
+            // Intersect leaf triangles
+            for (int face_idx = start_idx; face_idx < start_idx + num_prims && !occluded; ++face_idx)
+            {
+                occluded = occlude_face(vertices, faces, &r, face_idx, t_max);
+            }
         }
+
+        addr = occluded ? INVALID_IDX : NEXT(node);
     }
-}
\ No newline at end of file
+
+    if (active && hits)
+    {
+        hits[ray_idx] = occluded ? HIT_MARKER : MISS_MARKER;
+    }
+
+    return occluded;
+}
+#endif
+
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void intersect_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL Intersection* hits
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_HIT_HINTS
+    ,
+    // Hits of a previous query tested first
+    GLOBAL Intersection const* hints,
+    // Number of elements in hints buffer
+    int num_hints,
+    // Primitive to face table of hints
+    GLOBAL int const* restrict hint_faces
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    int global_id = get_global_id(0);
+
+#ifdef RR_SUBGROUPS
+    intersect_closest_subgroup(nodes, vertices, faces, shape_ranges, rays, (GLOBAL int*)hits, global_id, global_id < *num_rays, HIT_FORMAT_FULL, 0, HIT_HINTS_DATA);
+#else
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_closest(nodes, vertices, faces, shape_ranges, rays, (GLOBAL int*)hits, global_id, HIT_FORMAT_FULL, 0, HIT_FILTER_DATA, HIT_HINTS_DATA, TRAVERSAL_STATS_OUT(global_id));
+    }
+#endif
+}
+
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void occluded_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL int* hits
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    int global_id = get_global_id(0);
+
+#ifdef RR_SUBGROUPS
+    intersect_any_subgroup(nodes, vertices, faces, rays, hits, global_id, global_id < *num_rays);
+#else
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_any(nodes, vertices, faces, shape_ranges, rays, hits, global_id, HIT_FILTER_DATA, TRAVERSAL_STATS_OUT(global_id));
+    }
+#endif
+}
+
+// Bit-packed version ("acc.occlusion_format" "bits"): one bit per ray, set for occluded ones
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void occluded_bits_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data: 32 rays per word
+    GLOBAL uint* hits
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    __local uint lds_bits[(RR_GROUP_SIZE + 31) / 32];
+    int global_id = get_global_id(0);
+    int const rays_count = *num_rays;
+    bool occluded = false;
+
+#ifdef RR_SUBGROUPS
+    occluded = intersect_any_subgroup(nodes, vertices, faces, rays, 0, global_id, global_id < rays_count);
+#else
+    // Handle only working subset, the others still take part in packing
+    if (global_id < rays_count)
+    {
+        occluded = intersect_any(nodes, vertices, faces, shape_ranges, rays, 0, global_id, HIT_FILTER_DATA, TRAVERSAL_STATS_OUT(global_id));
+    }
+#endif
+
+    store_occlusion_bits(hits, global_id, rays_count, occluded, lds_bits);
+}
+
+// Persistent threads versions: only enough work groups to fill the device
+// are launched, each one keeps fetching batches of rays from the global counter
+// until all of them are processed. Groups finishing short rays early pick up
+// new work instead of idling while other groups of the same launch trace long ones.
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void intersect_main_persistent(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL Intersection* hits,
+    // Batch fetch and finished groups counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* counters
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_HIT_HINTS
+    ,
+    // Hits of a previous query tested first
+    GLOBAL Intersection const* hints,
+    // Number of elements in hints buffer
+    int num_hints,
+    // Primitive to face table of hints
+    GLOBAL int const* restrict hint_faces
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    __local int batch_start;
+    int const rays_count = *num_rays;
+
+    while (true)
+    {
+        // The batch is the same for the whole group, so is the exit condition
+        int const start = fetch_ray_batch(counters, &batch_start);
+
+        if (start >= rays_count)
+        {
+            break;
+        }
+
+        int const ray_idx = start + get_local_id(0);
+
+        if (ray_idx < rays_count)
+        {
+            intersect_closest(nodes, vertices, faces, shape_ranges, rays, (GLOBAL int*)hits, ray_idx, HIT_FORMAT_FULL, 0, HIT_FILTER_DATA, HIT_HINTS_DATA, TRAVERSAL_STATS_OUT(ray_idx));
+        }
+    }
+
+    release_ray_batches(counters);
+}
+
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void occluded_main_persistent(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL int* hits,
+    // Batch fetch and finished groups counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* counters
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    __local int batch_start;
+    int const rays_count = *num_rays;
+
+    while (true)
+    {
+        // The batch is the same for the whole group, so is the exit condition
+        int const start = fetch_ray_batch(counters, &batch_start);
+
+        if (start >= rays_count)
+        {
+            break;
+        }
+
+        int const ray_idx = start + get_local_id(0);
+
+        if (ray_idx < rays_count)
+        {
+            intersect_any(nodes, vertices, faces, shape_ranges, rays, hits, ray_idx, HIT_FILTER_DATA, TRAVERSAL_STATS_OUT(ray_idx));
+        }
+    }
+
+    release_ray_batches(counters);
+}
+
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void occluded_bits_main_persistent(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data: 32 rays per word
+    GLOBAL uint* hits,
+    // Batch fetch and finished groups counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* counters
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    __local int batch_start;
+    __local uint lds_bits[(RR_GROUP_SIZE + 31) / 32];
+    int const rays_count = *num_rays;
+
+    while (true)
+    {
+        // The batch is the same for the whole group, so is the exit condition
+        int const start = fetch_ray_batch(counters, &batch_start);
+
+        if (start >= rays_count)
+        {
+            break;
+        }
+
+        int const ray_idx = start + get_local_id(0);
+        bool occluded = false;
+
+        if (ray_idx < rays_count)
+        {
+            occluded = intersect_any(nodes, vertices, faces, shape_ranges, rays, 0, ray_idx, HIT_FILTER_DATA, TRAVERSAL_STATS_OUT(ray_idx));
+        }
+
+        // Batches start at multiples of the group size, so they pack into whole words
+        store_occlusion_bits(hits, ray_idx, rays_count, occluded, lds_bits);
+    }
+
+    release_ray_batches(counters);
+}
+
+// Compact hit formats versions: only the data requested by "acc.hit_format" is written
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void intersect_compact_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_HIT_HINTS
+    ,
+    // Hits of a previous query tested first
+    GLOBAL Intersection const* hints,
+    // Number of elements in hints buffer
+    int num_hints,
+    // Primitive to face table of hints
+    GLOBAL int const* restrict hint_faces
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        intersect_closest(nodes, vertices, faces, shape_ranges, rays, hits, global_id, format, plane_size, HIT_FILTER_DATA, HIT_HINTS_DATA, TRAVERSAL_STATS_OUT(global_id));
+    }
+}
+
+__attribute__((reqd_work_group_size(RR_GROUP_SIZE, 1, 1)))
+KERNEL 
+void intersect_compact_main_persistent(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays 
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data in the requested format
+    GLOBAL int* hits,
+    // Batch fetch and finished groups counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* counters,
+    // Hit output format
+    int format,
+    // Elements per plane of HIT_FORMAT_SOA hits
+    int plane_size
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+#ifdef RR_HIT_HINTS
+    ,
+    // Hits of a previous query tested first
+    GLOBAL Intersection const* hints,
+    // Number of elements in hints buffer
+    int num_hints,
+    // Primitive to face table of hints
+    GLOBAL int const* restrict hint_faces
+#endif
+#ifdef RR_TRAVERSAL_STATS
+    ,
+    // Per ray traversal counters
+    GLOBAL traversal_stats* stats,
+    // Number of elements in stats buffer
+    int num_stats
+#endif
+)
+{
+    __local int batch_start;
+    int const rays_count = *num_rays;
+
+    while (true)
+    {
+        // The batch is the same for the whole group, so is the exit condition
+        int const start = fetch_ray_batch(counters, &batch_start);
+
+        if (start >= rays_count)
+        {
+            break;
+        }
+
+        int const ray_idx = start + get_local_id(0);
+
+        if (ray_idx < rays_count)
+        {
+            intersect_closest(nodes, vertices, faces, shape_ranges, rays, hits, ray_idx, format, plane_size, HIT_FILTER_DATA, HIT_HINTS_DATA, TRAVERSAL_STATS_OUT(ray_idx));
+        }
+    }
+
+    release_ray_batches(counters);
+}
+
+// Maximum number of hits per ray reported by multi hit queries
+#define MAX_MULTI_HITS 8
+
+// Multi hit version: up to k closest hits per ray are collected in a single traversal
+// and written sorted by distance to k consecutive Intersection structs, misses fill the rest.
+// Hit callbacks are not called, results are always written.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL
+void intersect_multi_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Hit data, k entries per ray
+    GLOBAL Intersection* hits,
+    // Number of hits per ray, up to MAX_MULTI_HITS
+    int k
+#ifdef RR_HIT_FILTER
+    ,
+    // Data read by hit filter
+    GLOBAL void const* filter_data
+#endif
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id >= *num_rays)
+    {
+        return;
+    }
+
+    // Fetch ray
+    ray const r = rays[global_id];
+
+    if (!ray_is_active(&r))
+    {
+        return;
+    }
+
+    // Hit distances and face indices sorted by distance
+    float hit_t[MAX_MULTI_HITS];
+    int hit_idx[MAX_MULTI_HITS];
+    int num_hits = 0;
+
+    // Precompute inverse direction and origin / dir for bbox testing
+    float3 const invdir = safe_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    // Intersection parametric distance, the farthest kept hit once the list is full
+    float t_max = r.o.w;
+    // Layout visiting near children first
+    int const octant = ray_octant(&r);
+
+    // Current node address
+    int addr = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node node = nodes[NODE_INDEX(addr, octant)];
+        // Intersect against bbox
+        float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+
+        if (s.x <= s.y)
+        {
+            // Check if the node is a leaf
+            if (LEAFNODE(node))
+            {
+                int const start_idx = STARTIDX(node);
+                int const num_prims = NUMPRIMS(node);
+
+                // Intersect leaf triangles
+                for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
+                {
+                    int face_hit;
+                    float const f = intersect_face(vertices, faces, &r, face_idx, t_max, &face_hit);
+
+#ifdef RR_HIT_FILTER
+                    if (f >= t_max || !filter_face(vertices, faces, shape_ranges, &r, global_id, face_hit, f, filter_data))
+#else
+                    if (f >= t_max)
+#endif
+                    {
+                        continue;
+                    }
+
+                    // Spatial splits reference the same face from several leaves, skip repeated hits
+                    Face const face = faces[face_idx];
+                    bool repeated = false;
+                    for (int i = 0; i < num_hits && !repeated; ++i)
+                    {
+                        Face const other = faces[HIT_FACE(hit_idx[i])];
+                        repeated = hit_t[i] == f &&
+                            face_prim_id(&other, hit_idx[i]) == face_prim_id(&face, face_hit) &&
+                            face_shape_id(shape_ranges, HIT_FACE(hit_idx[i])) == face_shape_id(shape_ranges, face_idx);
+                    }
+
+                    if (repeated)
+                    {
+                        continue;
+                    }
+
+                    // Insert keeping the list sorted, a full list drops its farthest hit
+                    int i = num_hits < k ? num_hits++ : k - 1;
+                    while (i > 0 && hit_t[i - 1] > f)
+                    {
+                        hit_t[i] = hit_t[i - 1];
+                        hit_idx[i] = hit_idx[i - 1];
+                        --i;
+                    }
+
+                    hit_t[i] = f;
+                    hit_idx[i] = face_hit;
+
+                    if (num_hits == k)
+                    {
+                        t_max = hit_t[k - 1];
+                    }
+                }
+            }
+            else
+            {
+                // Move to next node otherwise.
+                // Left child is always at addr + 1
+                ++addr;
+                continue;
+            }
+        }
+
+        addr = NEXT(node);
+    }
+
+    for (int i = 0; i < k; ++i)
+    {
+        if (i < num_hits)
+        {
+            Face const face = faces[HIT_FACE(hit_idx[i])];
+            float3 const p = r.o.xyz + r.d.xyz * hit_t[i];
+            float2 const uv = face_calculate_barycentrics(vertices, faces, hit_idx[i], p);
+            store_hit((GLOBAL int*)hits, global_id * k + i, HIT_FORMAT_FULL, 0, face_shape_id(shape_ranges, HIT_FACE(hit_idx[i])), face_prim_id(&face, hit_idx[i]), uv, hit_t[i]);
+        }
+        else
+        {
+            store_miss((GLOBAL int*)hits, global_id * k + i, HIT_FORMAT_FULL, 0);
+        }
+    }
+}
+
+// Closest point to p on the face, hit_idx receives the hit index of the triangle it lies on
+INLINE
+float3 face_closest_point(GLOBAL VERTEX_TYPE const* restrict vertices, GLOBAL Face const* restrict faces, int face_idx, float3 p, int* hit_idx)
+{
+    *hit_idx = MAKE_HIT(face_idx, 0);
+#ifdef RR_PRECOMPUTED_TRIANGLES
+    GLOBAL float3 const* triangle = vertices + 3 * face_idx;
+    return closest_point_triangle(p, precomputed_triangle_vertex(triangle, 0),
+        precomputed_triangle_vertex(triangle, 1), precomputed_triangle_vertex(triangle, 2));
+#else
+    Face const face = faces[face_idx];
+    float3 const v1 = FETCH_VERTEX(vertices, face.idx[0]);
+    float3 const v2 = FETCH_VERTEX(vertices, face.idx[1]);
+    float3 const v3 = FETCH_VERTEX(vertices, face.idx[2]);
+    float3 const c = closest_point_triangle(p, v1, v2, v3);
+#if defined(RR_TRIANGLE_PAIRS)
+    if (face.idx3 != -1)
+    {
+        float3 w1, w2, w3;
+        pair_second_triangle(vertices, &face, &w1, &w2, &w3);
+        float3 const c2 = closest_point_triangle(p, w1, w2, w3);
+
+        if (dot(c2 - p, c2 - p) < dot(c - p, c - p))
+        {
+            *hit_idx = MAKE_HIT(face_idx, 1);
+            return c2;
+        }
+    }
+#elif defined(RR_QUADS)
+    // The other half of the quad
+    if (face.idx3 >= 0)
+    {
+        float3 const c2 = closest_point_triangle(p, v1, FETCH_VERTEX(vertices, face.idx3), v3);
+        return dot(c2 - p, c2 - p) < dot(c - p, c - p) ? c2 : c;
+    }
+#endif
+    return c;
+#endif
+}
+
+// Proximity queries: find the closest point of the scene within a sphere given as center and radius.
+// Shape and primitive IDs of the closest face, barycentrics of the closest point and the distance
+// to it are written to Intersection struct, spheres not containing any face report a miss.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL
+void proximity_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Shape ID ranges of faces in leaf order
+    GLOBAL int const* restrict shape_ranges,
+    // Spheres: center and radius
+    GLOBAL float4 const* restrict spheres,
+    // Number of spheres
+    GLOBAL int const* restrict num_spheres,
+    // Hit data
+    GLOBAL Intersection* hits
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id >= *num_spheres)
+    {
+        return;
+    }
+
+    float4 const sphere = spheres[global_id];
+    float3 const center = sphere.xyz;
+    // Squared search radius, shrinks to the closest face found so far
+    float dist_sq = sphere.w * sphere.w;
+    float3 closest_point = center;
+    int closest_idx = INVALID_IDX;
+
+    // Current node address, spheres have no direction and use the first layout
+    int addr = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node node = nodes[NODE_INDEX(addr, 0)];
+
+        if (distance_to_bbox_sq(node, center) <= dist_sq)
+        {
+            // Check if the node is a leaf
+            if (LEAFNODE(node))
+            {
+                int const start_idx = STARTIDX(node);
+                int const num_prims = NUMPRIMS(node);
+
+                for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
+                {
+                    int hit_idx;
+                    float3 const p = face_closest_point(vertices, faces, face_idx, center, &hit_idx);
+                    float const d = dot(p - center, p - center);
+
+                    if (d <= dist_sq)
+                    {
+                        dist_sq = d;
+                        closest_point = p;
+                        closest_idx = hit_idx;
+                    }
+                }
+            }
+            else
+            {
+                // Move to next node otherwise.
+                // Left child is always at addr + 1
+                ++addr;
+                continue;
+            }
+        }
+
+        addr = NEXT(node);
+    }
+
+    if (closest_idx != INVALID_IDX)
+    {
+        Face const face = faces[HIT_FACE(closest_idx)];
+        float2 const uv = face_calculate_barycentrics(vertices, faces, closest_idx, closest_point);
+        store_hit((GLOBAL int*)hits, global_id, HIT_FORMAT_FULL, 0, face_shape_id(shape_ranges, HIT_FACE(closest_idx)), face_prim_id(&face, closest_idx), uv, sqrt(dist_sq));
+    }
+    else
+    {
+        store_miss((GLOBAL int*)hits, global_id, HIT_FORMAT_FULL, 0);
+    }
+}
+
+// Check if a ray in registers hits anything, hit filters and callbacks are not applied
+INLINE
+bool occlude_ray(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Ray
+    ray const* r
+)
+{
+    float3 const invdir = safe_invdir(*r);
+    float3 const oxinvdir = -r->o.xyz * invdir;
+    float const t_max = r->o.w;
+    int const octant = ray_octant(r);
+
+    // Current node address
+    int addr = 0;
+
+    while (addr != INVALID_IDX)
+    {
+        bvh_node node = nodes[NODE_INDEX(addr, octant)];
+        float2 s = fast_intersect_bbox1(node, invdir, oxinvdir, t_max);
+
+        if (s.x <= s.y)
+        {
+            if (LEAFNODE(node))
+            {
+                int const start_idx = STARTIDX(node);
+                int const num_prims = NUMPRIMS(node);
+
+                for (int face_idx = start_idx; face_idx < start_idx + num_prims; ++face_idx)
+                {
+                    if (occlude_face(vertices, faces, r, face_idx, t_max))
+                    {
+                        return true;
+                    }
+                }
+            }
+            else
+            {
+                // Left child is always at addr + 1
+                ++addr;
+                continue;
+            }
+        }
+
+        addr = NEXT(node);
+    }
+
+    return false;
+}
+
+// Ambient occlusion: num_samples cosine distributed rays of radius length over the normal of each point
+// are generated and traced in registers, only the fraction of unoccluded ones is written.
+// Directions match generate_hemisphere_rays_main for the same seed, missing points are fully visible.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL
+void ambient_occlusion_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Triangle vertices (precomputed triangles in leaf order with RR_PRECOMPUTED_TRIANGLES)
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Surface points
+    GLOBAL surface_point const* restrict points,
+    // Number of points
+    GLOBAL int const* restrict num_points,
+    // Rays per point
+    int num_samples,
+    // Occlusion distance
+    float radius,
+    uint seed,
+    // Visibility per point
+    GLOBAL float* visibility
+)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id >= *num_points)
+    {
+        return;
+    }
+
+    surface_point const p = points[global_id];
+
+    if (!surface_point_valid(&p))
+    {
+        visibility[global_id] = 1.f;
+        return;
+    }
+
+    float3 const n = normalize(p.normal.xyz);
+    int unoccluded = 0;
+
+    for (int i = 0; i < num_samples; ++i)
+    {
+        float3 const d = sample_hemisphere_cosine(n, random_float2(global_id * num_samples + i, seed));
+
+        ray r;
+        r.o = (float4)(offset_origin(p.position.xyz, n, d), radius);
+        r.d = (float4)(d, 0.f);
+        r.extra = (int2)(0xFFFFFFFF, 1);
+        r.padding = (int2)(0, 0);
+
+        unoccluded += occlude_ray(nodes, vertices, faces, &r) ? 0 : 1;
+    }
+
+    visibility[global_id] = (float)unoccluded / num_samples;
+}
+
+// Refit node bounds bottom-up keeping tree topology intact.
+// Each thread starts from a leaf and walks up to the root, the node is
+// updated by the thread which arrives there second (both children are ready).
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL
+void refit_main(
+    // BVH nodes
+    GLOBAL bvh_node* nodes,
+    // Triangle vertices
+    GLOBAL VERTEX_TYPE const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Parent node indices
+    GLOBAL int const* restrict parents,
+    // Leaf node indices
+    GLOBAL int const* restrict leaves,
+    // Number of leaves
+    int num_leaves,
+    // Visit counters, zero initialized and reset back to zero by the kernel
+    GLOBAL int* flags
+)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_leaves)
+    {
+        int idx = leaves[global_id];
+        bvh_node node = nodes[idx];
+
+        // Calculate leaf bounds from its triangles
+        int const start_idx = STARTIDX(node);
+        int const num_prims = NUMPRIMS(node);
+        float3 pmin = make_float3(FLT_MAX, FLT_MAX, FLT_MAX);
+        float3 pmax = make_float3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+
+        for (int i = 0; i < num_prims; ++i)
+        {
+            Face const face = faces[start_idx + i];
+            float3 const v1 = FETCH_VERTEX(vertices, face.idx[0]);
+            float3 const v2 = FETCH_VERTEX(vertices, face.idx[1]);
+            float3 const v3 = FETCH_VERTEX(vertices, face.idx[2]);
+            pmin = min(pmin, min(v1, min(v2, v3)));
+            pmax = max(pmax, max(v1, max(v2, v3)));
+#if defined(RR_QUADS)
+            if (face.idx3 >= 0)
+            {
+                float3 const v4 = FETCH_VERTEX(vertices, face.idx3);
+                pmin = min(pmin, v4);
+                pmax = max(pmax, v4);
+            }
+#elif defined(RR_TRIANGLE_PAIRS)
+            if (face.idx3 != -1)
+            {
+                float3 const v4 = FETCH_VERTEX(vertices, face.idx3 & PAIR_VERTEX_MASK);
+                pmin = min(pmin, v4);
+                pmax = max(pmax, v4);
+            }
+#endif
+        }
+
+        // Keep .w components: they encode leaf data and skip links
+        nodes[idx].pmin.xyz = pmin;
+        nodes[idx].pmax.xyz = pmax;
+
+        while ((idx = parents[idx]) != INVALID_IDX)
+        {
+            // Make sure our bounds are visible before signaling
+            mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+            // The first thread to arrive bails out
+            if (atomic_inc(flags + idx) == 0)
+            {
+                break;
+            }
+
+            flags[idx] = 0;
+
+            // Left child is always at idx + 1, right one is where it skips to
+            int const lc = idx + 1;
+            int const rc = NEXT(nodes[lc]);
+
+            nodes[idx].pmin.xyz = min(nodes[lc].pmin.xyz, nodes[rc].pmin.xyz);
+            nodes[idx].pmax.xyz = max(nodes[lc].pmax.xyz, nodes[rc].pmax.xyz);
+        }
+    }
+}
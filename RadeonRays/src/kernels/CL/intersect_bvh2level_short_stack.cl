@@ -0,0 +1,460 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_bvh2level_short_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 2-level BVH with short stack traversal.
+
+    Bottom level BVHs of the meshes and the top level BVH over the shapes are translated
+    into fat nodes (see intersect_bvh2_short_stack.cl) sharing one node buffer. Top level
+    leaves reference shapes, bottom level ones faces. Both levels are traversed with the
+    same LDS short stack: entering a shape pushes a marker before the bottom level nodes,
+    popping it brings the world space ray back and traversal continues at the top level.
+    The stack is never reset on transitions, so spills to global memory survive them.
+
+    Pros:
+        -Closer child first traversal of both levels.
+        -Benefits from BVH quality optimization.
+    Cons:
+        -Single level of instancing: no groups, curves or motion blur.
+        -Depth of both levels together is limited.
+        -Generates LDS traffic.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define LEAFNODE(x) (((x).child0) == -1)
+// LDS stack depth per work item, the global stack holds two spills of it
+#define SHORT_STACK_SIZE 16
+#define GLOBAL_STACK_SIZE (2 * SHORT_STACK_SIZE)
+// LDS stacks are interleaved over the work items of a group
+#define WAVEFRONT_SIZE 64
+// Stack entry below the nodes of a bottom level, returns traversal to the top level
+#define TOP_LEVEL_MARKER -2
+
+// BVH node
+typedef struct
+{
+    union
+    {
+        struct
+        {
+            // Child bounds
+            bbox bounds[2];
+        };
+
+        struct
+        {
+            // Leaves keep face index (bottom level) or shape index (top level) here
+            int i0, i1, i2;
+            // Address of a left child
+            int child0;
+            // Unused by 2 level leaves
+            int shape_mask;
+            int shape_id;
+            int prim_id;
+            // Address of a right child
+            int child1;
+        };
+    };
+
+} bvh_node;
+
+typedef struct
+{
+    // Shape ID
+    int id;
+    // Shape BVH root index
+    int bvh_idx;
+    // Shape mask
+    int mask;
+    // BVH type, always mesh
+    int type;
+    // Inverse rotation and scale rows, w keeps the shape origin in world space
+    float4 m0;
+    float4 m1;
+    float4 m2;
+} Shape;
+
+typedef struct
+{
+    // Vertex indices
+    int idx[3];
+    // Shape maks
+    int shape_mask;
+    // Shape ID
+    int shape_id;
+    // Primitive ID
+    int prim_id;
+#ifdef RR_QUADS
+    // Fourth vertex index of quads, -1 for triangles
+    int idx3;
+    int padding;
+#endif
+} Face;
+
+// Scene specializations, see intersect_bvh2level_skiplinks.cl
+#ifdef RR_FULL_SHAPE_MASKS
+#define RAY_VISIBLE(r) (ray_get_mask(r) != 0)
+#define SHAPE_VISIBLE(r, shapes, shape_idx) true
+#else
+#define RAY_VISIBLE(r) true
+#define SHAPE_VISIBLE(r, shapes, shape_idx) ((ray_get_mask(r) & shapes[shape_idx].mask) != 0)
+#endif
+
+
+// Shape origin is subtracted before rotating, see intersect_bvh2level_skiplinks.cl
+INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2)
+{
+    float3 const q = p - make_float3(m0.s3, m1.s3, m2.s3);
+    float3 res;
+    res.x = m0.s0 * q.x + m0.s1 * q.y + m0.s2 * q.z;
+    res.y = m1.s0 * q.x + m1.s1 * q.y + m1.s2 * q.z;
+    res.z = m2.s0 * q.x + m2.s1 * q.y + m2.s2 * q.z;
+    return res;
+}
+
+INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2)
+{
+    float3 res;
+    res.x = m0.s0 * p.x + m0.s1 * p.y + m0.s2 * p.z;
+    res.y = m1.s0 * p.x + m1.s1 * p.y + m1.s2 * p.z;
+    res.z = m2.s0 * p.x + m2.s1 * p.y + m2.s2 * p.z;
+    return res;
+}
+
+// Transform world space ray into shape object space
+INLINE ray transform_ray(ray r, GLOBAL Shape const* restrict shape)
+{
+    ray res = r;
+    res.o.xyz = transform_point(r.o.xyz, shape->m0, shape->m1, shape->m2);
+    res.d.xyz = transform_vector(r.d.xyz, shape->m0, shape->m1, shape->m2);
+    return res;
+}
+
+// Trace the ray through both levels, returns true if a hit closer than ray max distance is found.
+// Any hit query returns on the first one, closest hit query fills hit data of the closest one.
+INLINE
+bool trace_ray(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Top level BVH root index
+    int root_idx,
+    // World space ray
+    ray const* world_ray,
+    // Stack of the work item in global memory
+    GLOBAL int* gm_stack_base,
+    // Short stack of the work item in LDS
+    __local int* lm_stack_base,
+    // Stop at any hit
+    bool any_hit,
+    // Closest hit data
+    Intersection* hit)
+{
+    GLOBAL int* gm_stack = gm_stack_base;
+    __local int* lm_stack = lm_stack_base;
+
+    // Current ray, object space one in bottom levels
+    ray r = *world_ray;
+    float3 const world_invdir = safe_invdir(r);
+    float3 invdir = world_invdir;
+    float3 oxinvdir = -r.o.xyz * invdir;
+    float t_max = r.o.w;
+
+    // Shape of the bottom level being traversed, INVALID_IDX at the top level
+    int shape_idx = INVALID_IDX;
+    int closest_shape_id = INVALID_IDX;
+    int closest_prim_id = INVALID_IDX;
+    float2 closest_barycentrics;
+
+    //  Initalize local stack
+    *lm_stack = INVALID_IDX;
+    lm_stack += WAVEFRONT_SIZE;
+
+    int addr = RAY_VISIBLE(world_ray) ? root_idx : INVALID_IDX;
+
+    while (addr != INVALID_IDX)
+    {
+        // Fetch next node
+        bvh_node const node = nodes[addr];
+        // Node to visit after addr, pushed if both children are hit
+        int deferred = INVALID_IDX;
+        // Continue at addr instead of popping
+        bool descend = false;
+
+        if (LEAFNODE(node))
+        {
+            if (shape_idx == INVALID_IDX)
+            {
+                // Top level leaf: drill into the shape bottom level unless it is masked vs the ray
+                if (SHAPE_VISIBLE(world_ray, shapes, node.i0))
+                {
+                    shape_idx = node.i0;
+                    deferred = TOP_LEVEL_MARKER;
+                    descend = true;
+                    addr = shapes[shape_idx].bvh_idx;
+#ifndef RR_IDENTITY_TRANSFORMS
+                    // Transform the ray into shape object space
+                    r = transform_ray(*world_ray, &shapes[shape_idx]);
+                    invdir = safe_invdir(r);
+                    oxinvdir = -r.o.xyz * invdir;
+#endif
+                }
+            }
+            else
+            {
+                // Bottom level leaf: intersect its face
+                Face const face = faces[node.i0];
+                float3 const v1 = vertices[face.idx[0]];
+                float3 const v2 = vertices[face.idx[1]];
+                float3 const v3 = vertices[face.idx[2]];
+
+#ifdef RR_QUADS
+                float3 const v4 = face.idx3 >= 0 ? vertices[face.idx3] : v1;
+                float const f = face.idx3 >= 0 ?
+                    fast_intersect_quad(r, v1, v2, v3, v4, t_max) :
+                    fast_intersect_triangle(r, v1, v2, v3, t_max);
+#else
+                float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+#endif
+                if (f < t_max)
+                {
+                    if (any_hit)
+                    {
+                        return true;
+                    }
+
+                    t_max = f;
+                    closest_prim_id = face.prim_id;
+                    closest_shape_id = shapes[shape_idx].id;
+
+                    float3 const p = r.o.xyz + r.d.xyz * t_max;
+#ifdef RR_QUADS
+                    closest_barycentrics = face.idx3 >= 0 ?
+                        quad_calculate_uv(p, v1, v2, v3, v4) :
+                        triangle_calculate_barycentrics(p, v1, v2, v3);
+#else
+                    closest_barycentrics = triangle_calculate_barycentrics(p, v1, v2, v3);
+#endif
+                }
+            }
+        }
+        else
+        {
+            // It is internal node, so intersect vs both children bounds
+            float2 const s0 = fast_intersect_bbox1(node.bounds[0], invdir, oxinvdir, t_max);
+            float2 const s1 = fast_intersect_bbox1(node.bounds[1], invdir, oxinvdir, t_max);
+
+            bool const traverse_c0 = (s0.x <= s0.y);
+            bool const traverse_c1 = (s1.x <= s1.y);
+            bool const c1first = traverse_c1 && (!traverse_c0 || s1.x < s0.x);
+
+            if (traverse_c0 || traverse_c1)
+            {
+                // Closer child goes first, the other one is postponed if hit too
+                addr = c1first ? node.child1 : node.child0;
+                descend = true;
+
+                if (traverse_c0 && traverse_c1)
+                {
+                    deferred = c1first ? node.child0 : node.child1;
+                }
+            }
+        }
+
+        if (deferred != INVALID_IDX)
+        {
+            // If short stack is full, we offload it into global memory
+            if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE)
+            {
+                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                {
+                    gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE];
+                }
+
+                gm_stack += SHORT_STACK_SIZE;
+                lm_stack = lm_stack_base + WAVEFRONT_SIZE;
+            }
+
+            *lm_stack = deferred;
+            lm_stack += WAVEFRONT_SIZE;
+        }
+
+        if (descend)
+        {
+            continue;
+        }
+
+        // Pop next node, markers on the way switch back to the top level
+        do
+        {
+            lm_stack -= WAVEFRONT_SIZE;
+            addr = *(lm_stack);
+
+            // If we popped INVALID_IDX then check global stack
+            if (addr == INVALID_IDX && gm_stack > gm_stack_base)
+            {
+                // Adjust stack pointer
+                gm_stack -= SHORT_STACK_SIZE;
+                // Copy data from global memory to LDS
+                for (int i = 1; i < SHORT_STACK_SIZE; ++i)
+                {
+                    lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i];
+                }
+                // Point local stack pointer to the end
+                lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE;
+                addr = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)];
+            }
+
+            if (addr == TOP_LEVEL_MARKER)
+            {
+                shape_idx = INVALID_IDX;
+#ifndef RR_IDENTITY_TRANSFORMS
+                r = *world_ray;
+                invdir = world_invdir;
+                oxinvdir = -r.o.xyz * invdir;
+#endif
+            }
+        } while (addr == TOP_LEVEL_MARKER);
+    }
+
+    if (closest_shape_id != INVALID_IDX)
+    {
+        hit->shape_id = closest_shape_id;
+        hit->prim_id = closest_prim_id;
+        hit->uvwt = make_float4(closest_barycentrics.x, closest_barycentrics.y, 0.f, t_max);
+        return true;
+    }
+
+    return false;
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void intersect_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Top level BVH root index
+    int root_idx,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hits
+    GLOBAL Intersection* hits
+)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            Intersection hit;
+
+            if (trace_ray(nodes, vertices, faces, shapes, root_idx, &r,
+                stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE, lds + local_id, false, &hit))
+            {
+                hits[global_id].shape_id = hit.shape_id;
+                hits[global_id].prim_id = hit.prim_id;
+                hits[global_id].uvwt = hit.uvwt;
+            }
+            else
+            {
+                // Miss here
+                hits[global_id].shape_id = MISS_MARKER;
+                hits[global_id].prim_id = MISS_MARKER;
+            }
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(WAVEFRONT_SIZE, 1, 1)))
+KERNEL void occluded_main(
+    // BVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // Vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Shapes
+    GLOBAL Shape const* restrict shapes,
+    // Top level BVH root index
+    int root_idx,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in ray buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+    __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            Intersection hit;
+
+            hits[global_id] = trace_ray(nodes, vertices, faces, shapes, root_idx, &r,
+                stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE, lds + local_id, true, &hit) ?
+                HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
@@ -40,7 +40,9 @@ THE SOFTWARE.
         -Simple and efficient kernel with low VGPR pressure.
         -Can traverse trees of arbitrary depth.
         -Supports motion blur.
-        -Supports instancing.
+        -Supports instancing and nested groups.
+        -Supports LOD groups with stochastic level selection.
+        -Supports round cubic Bezier curves.
         -Fast to refit.
     Cons:
         -Travesal order is fixed, so poor algorithmic characteristics.
@@ -76,20 +78,32 @@ typedef struct
 {
     // Shape ID
     int id;
-    // Shape BVH index (bottom level)
+    // Shape BVH index (bottom level or group), LOD record index for LOD groups
     int bvh_idx;
     // Shape mask
     int mask;
-    int padding1;
-    // Transform
+    // BVH type, group BVH leaves reference shapes, others reference primitives
+    int type;
+#ifdef RR_COMPACT_TRANSFORMS
+    // Inverse transform as shape origin in world space subtracted first, then
+    // rotation (snorm16 quaternion xy, zw) and uniform scale
+    int rotation[2];
+    float translation[3];
+    float scale;
+#else
+    // Inverse rotation and scale rows, w keeps the shape origin in world space
     float4 m0;
     float4 m1;
     float4 m2;
-    float4 m3;
-    // Motion blur params
+#endif
+} Shape;
+
+typedef struct
+{
+    // Motion blur params, only read by scenes with moving shapes
     float4 velocity_linear;
     float4 velocity_angular;
-} Shape;
+} ShapeMotion;
 
 typedef struct
 {
@@ -101,19 +115,74 @@ typedef struct
     int shape_id;
     // Primitive ID
     int prim_id;
+#ifdef RR_QUADS
+    // Fourth vertex index of quads, -1 for triangles
+    int idx3;
+    int padding;
+#endif
 } Face;
 
+// Shape BVH types
+#define SHAPE_TYPE_MESH 0
+#define SHAPE_TYPE_GROUP 1
+#define SHAPE_TYPE_CURVES 2
+#define SHAPE_TYPE_LOD 3
+#define SHAPE_TYPE_PROCEDURALS 4
+
+// Scenes with groups traverse shape level BVHs nested into each other, returns
+// from lower levels go through a stack of shape leaves and rays
+#ifdef RR_GROUPS
+#define MAX_LEVELS 4
+#define SHAPE_HAS_PRIMS(shapes, shape_idx) (shapes[shape_idx].type != SHAPE_TYPE_GROUP && shapes[shape_idx].type != SHAPE_TYPE_LOD)
+#else
+#define MAX_LEVELS 1
+#define SHAPE_HAS_PRIMS(shapes, shape_idx) true
+#endif
 
-INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2, float4 m3)
+// Curve segment leaves are only compiled in for scenes with curves
+#ifdef RR_CURVES
+#define SHAPE_IS_CURVES(shapes, shape_idx) (shapes[shape_idx].type == SHAPE_TYPE_CURVES)
+#else
+#define SHAPE_IS_CURVES(shapes, shape_idx) false
+#endif
+
+// Leaves of spheres, disks and custom primitives are only compiled in for scenes with procedurals
+#ifdef RR_PROCEDURALS
+#define SHAPE_IS_PROCEDURALS(shapes, shape_idx) (shapes[shape_idx].type == SHAPE_TYPE_PROCEDURALS)
+#else
+#define SHAPE_IS_PROCEDURALS(shapes, shape_idx) false
+#endif
+
+// Scene specializations, the intersector compiles kernel variants with these
+// defined if every shape has all the mask bits set or identity transform
+#ifdef RR_FULL_SHAPE_MASKS
+// Shapes are visible to any ray with a non-empty mask, so rays are culled once before traversal
+#define RAY_VISIBLE(r) (ray_get_mask(r) != 0)
+#define SHAPE_VISIBLE(r, shapes, shape_idx) true
+#define NODE_VISIBLE(r, node_masks, addr, root_idx, top_level) true
+#else
+#define RAY_VISIBLE(r) true
+#define SHAPE_VISIBLE(r, shapes, shape_idx) ((ray_get_mask(r) & shapes[shape_idx].mask) != 0)
+// Top level nodes keep the union of masks of shapes below them, so subtrees
+// of shapes masked out for the ray are skipped without testing their bounds
+#define NODE_VISIBLE(r, node_masks, addr, root_idx, top_level) \
+    (!(top_level) || (ray_get_mask(r) & node_masks[(addr) - (root_idx)]) != 0)
+#endif
+
+
+// Shape origin is subtracted before rotating: the difference of nearby floats is exact,
+// so object space points keep their precision in scenes far from the world origin
+INLINE float3 transform_point(float3 p, float4 m0, float4 m1, float4 m2)
 {
+    float3 const q = p - make_float3(m0.s3, m1.s3, m2.s3);
     float3 res;
-    res.x = m0.s0 * p.x + m0.s1 * p.y + m0.s2 * p.z + m0.s3;
-    res.y = m1.s0 * p.x + m1.s1 * p.y + m1.s2 * p.z + m1.s3;
-    res.z = m2.s0 * p.x + m2.s1 * p.y + m2.s2 * p.z + m2.s3;
+    res.x = m0.s0 * q.x + m0.s1 * q.y + m0.s2 * q.z;
+    res.y = m1.s0 * q.x + m1.s1 * q.y + m1.s2 * q.z;
+    res.z = m2.s0 * q.x + m2.s1 * q.y + m2.s2 * q.z;
     return res;
 }
 
-INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2, float4 m3)
+INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2)
 {
     float3 res;
     res.x = m0.s0 * p.x + m0.s1 * p.y + m0.s2 * p.z;
@@ -122,16 +191,312 @@ INLINE float3 transform_vector(float3 p, float4 m0, float4 m1, float4 m2, float4
     return res;
 }
 
-INLINE ray transform_ray(ray r, float4 m0, float4 m1, float4 m2, float4 m3)
+// Rotate vector by unit quaternion
+INLINE float3 rotate_vector(float3 v, float4 q)
+{
+    float3 const t = 2.f * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+#ifdef RR_COMPACT_TRANSFORMS
+// Unpack snorm16 quaternion components
+INLINE float4 unpack_rotation(int xy, int zw)
+{
+    float4 const q = make_float4((float)(short)(xy & 0xFFFF), (float)(short)(xy >> 16),
+        (float)(short)(zw & 0xFFFF), (float)(short)(zw >> 16));
+    return normalize(q);
+}
+#endif
+
+#ifdef RR_CURVES
+// Number of linear pieces a curve segment is approximated with
+#define CURVE_SUBDIVISIONS 8
+
+// Cubic Bezier curve point, radius is interpolated in w component
+INLINE float4 bezier_at(float4 p0, float4 p1, float4 p2, float4 p3, float s)
+{
+    float const s1 = 1.f - s;
+    return s1 * s1 * s1 * p0 + 3.f * s1 * s1 * s * p1 + 3.f * s1 * s * s * p2 + s * s * s * p3;
+}
+
+// Intersect round cubic Bezier segment given by 4 control points with radii in w.
+// Control points are moved to a frame with z along the ray, where the ray is the origin
+// and the segment is a ribbon facing it. Returns hit distance (t_max for miss),
+// uv gets curve parameter and position across the curve width.
+INLINE float intersect_curve(ray r, GLOBAL float4 const* restrict cp, float t_max, float2* uv)
+{
+    float const dlen = length(r.d.xyz);
+    float3 const dz = r.d.xyz / dlen;
+    float3 const dx = normalize(fabs(dz.x) > fabs(dz.z) ? make_float3(-dz.y, dz.x, 0.f) : make_float3(0.f, -dz.z, dz.y));
+    float3 const dy = cross(dz, dx);
+
+    float4 p[4];
+    float radius = 0.f;
+    float4 pmin = make_float4(FLT_MAX, FLT_MAX, FLT_MAX, 0.f);
+    float4 pmax = -pmin;
+
+    for (int i = 0; i < 4; ++i)
+    {
+        float4 const c = cp[i];
+        float3 const q = c.xyz - r.o.xyz;
+        p[i] = make_float4(dot(q, dx), dot(q, dy), dot(q, dz), c.w);
+        pmin = min(pmin, p[i]);
+        pmax = max(pmax, p[i]);
+        radius = max(radius, c.w);
+    }
+
+    // Ray oriented box around the control points culls most of the segments
+    if (pmin.x > radius || pmax.x < -radius || pmin.y > radius || pmax.y < -radius ||
+        pmax.z + radius < 0.f || pmin.z - radius > t_max * dlen)
+    {
+        return t_max;
+    }
+
+    float t_hit = t_max;
+    float4 prev = p[0];
+
+    for (int i = 1; i <= CURVE_SUBDIVISIONS; ++i)
+    {
+        float4 const cur = bezier_at(p[0], p[1], p[2], p[3], (float)i / CURVE_SUBDIVISIONS);
+        float2 const e = cur.xy - prev.xy;
+        // Closest point of the piece to the ray
+        float const w = clamp(-dot(prev.xy, e) / max(dot(e, e), 1e-12f), 0.f, 1.f);
+        float4 const c = mix(prev, cur, w);
+        float const dist2 = dot(c.xy, c.xy);
+        float const t = c.z / dlen;
+
+        if (dist2 <= c.w * c.w && t > 0.f && t < t_hit)
+        {
+            float const offset = c.w > 0.f ? native_sqrt(dist2) / c.w : 0.f;
+            float const side = e.x * c.y - e.y * c.x;
+            t_hit = t;
+            *uv = make_float2((i - 1 + w) / CURVE_SUBDIVISIONS, 0.5f + 0.5f * (side < 0.f ? -offset : offset));
+        }
+
+        prev = cur;
+    }
+
+    return t_hit;
+}
+#endif
+
+#ifdef RR_PROCEDURALS
+// Procedural primitive kinds, kept in the second index of their faces
+#define PROCEDURAL_SPHERES 0
+#define PROCEDURAL_DISKS 1
+#define PROCEDURAL_CUSTOM 2
+
+#ifdef RR_CUSTOM_PRIMITIVES
+// Defined by "acc.custom_intersector" source appended to the program
+float rr_intersect_custom(ray const* r, int shape_id, int prim_id, float3 pmin, float3 pmax, float t_max, float2* uv);
+#endif
+
+// Intersect sphere with center and radius in w, returns hit distance (t_max for miss),
+// uv gets longitude and latitude of the hit point
+INLINE float intersect_sphere(ray r, float4 sphere, float t_max, float2* uv)
+{
+    float3 const oc = r.o.xyz - sphere.xyz;
+    float const a = dot(r.d.xyz, r.d.xyz);
+    float const b = dot(oc, r.d.xyz);
+    float const c = dot(oc, oc) - sphere.w * sphere.w;
+    float const disc = b * b - a * c;
+
+    if (disc < 0.f)
+    {
+        return t_max;
+    }
+
+    // Far root is hit by rays starting inside the sphere
+    float const sqrt_disc = native_sqrt(disc);
+    float t = (-b - sqrt_disc) / a;
+    t = t > 0.f ? t : (-b + sqrt_disc) / a;
+
+    if (t <= 0.f || t >= t_max)
+    {
+        return t_max;
+    }
+
+    float3 const n = (oc + t * r.d.xyz) / sphere.w;
+    *uv = make_float2(atan2(n.y, n.x) / (2.f * M_PI_F) + 0.5f, acos(clamp(n.z, -1.f, 1.f)) / M_PI_F);
+    return t;
+}
+
+// Intersect two sided disk with center, radius in w and unit normal, returns hit distance
+// (t_max for miss), uv gets distance from the center relative to the radius and the angle
+INLINE float intersect_disk(ray r, float4 disk, float3 n, float t_max, float2* uv)
+{
+    float const denom = dot(n, r.d.xyz);
+
+    if (fabs(denom) < 1e-12f)
+    {
+        return t_max;
+    }
+
+    float const t = dot(disk.xyz - r.o.xyz, n) / denom;
+
+    if (t <= 0.f || t >= t_max)
+    {
+        return t_max;
+    }
+
+    float3 const p = r.o.xyz + t * r.d.xyz - disk.xyz;
+    float const dist2 = dot(p, p);
+
+    if (dist2 > disk.w * disk.w)
+    {
+        return t_max;
+    }
+
+    // Angle is measured in a frame built from the normal like the curve frame
+    float3 const dx = normalize(fabs(n.x) > fabs(n.z) ? make_float3(-n.y, n.x, 0.f) : make_float3(0.f, -n.z, n.y));
+    float3 const dy = cross(n, dx);
+    *uv = make_float2(disk.w > 0.f ? native_sqrt(dist2) / disk.w : 0.f, atan2(dot(p, dy), dot(p, dx)) / (2.f * M_PI_F) + 0.5f);
+    return t;
+}
+
+// Intersect procedural primitive of the given kind, data holds its 2 values.
+// Returns hit distance (t_max for miss), uv gets the hit parameterization.
+INLINE float intersect_procedural(ray r, GLOBAL float4 const* restrict data, int kind, int shape_id, int prim_id, float t_max, float2* uv)
+{
+    switch (kind)
+    {
+    case PROCEDURAL_SPHERES:
+        return intersect_sphere(r, data[0], t_max, uv);
+    case PROCEDURAL_DISKS:
+        return intersect_disk(r, data[0], data[1].xyz, t_max, uv);
+#ifdef RR_CUSTOM_PRIMITIVES
+    case PROCEDURAL_CUSTOM:
+    {
+        float const t = rr_intersect_custom(&r, shape_id, prim_id, data[0].xyz, data[1].xyz, t_max, uv);
+        return t > 0.f && t < t_max ? t : t_max;
+    }
+#endif
+    default:
+        return t_max;
+    }
+}
+#endif
+
+#ifdef RR_MOTION_BLUR
+// Rotation by q scaled to a fraction of its angle (slerp from identity)
+INLINE float4 quaternion_at_time(float4 q, float time)
+{
+    float const cos_half = clamp(q.w, -1.f, 1.f);
+    float const sin_half = native_sqrt(max(1.f - cos_half * cos_half, 0.f));
+
+    if (sin_half < 1e-6f)
+    {
+        return make_float4(0.f, 0.f, 0.f, 1.f);
+    }
+
+    float const half = acos(cos_half) * time;
+    float3 const axis = q.xyz / sin_half;
+    return make_float4(axis.x * sin(half), axis.y * sin(half), axis.z * sin(half), cos(half));
+}
+#endif
+
+// Transform world space ray into shape object space. Moving shapes are offset by
+// velocity_linear * time in world space and rotated around their object space
+// origin by the fraction time of velocity_angular rotation.
+INLINE ray transform_ray(ray r, GLOBAL Shape const* restrict shape, GLOBAL ShapeMotion const* restrict motion)
 {
     ray res;
-    res.o.xyz = transform_point(r.o.xyz, m0, m1, m2, m3);
-    res.d.xyz = transform_vector(r.d.xyz, m0, m1, m2, m3);
+#ifdef RR_MOTION_BLUR
+    float const time = ray_get_time(&r);
+    r.o.xyz -= motion->velocity_linear.xyz * time;
+#endif
+#ifdef RR_COMPACT_TRANSFORMS
+    float4 const rotation = unpack_rotation(shape->rotation[0], shape->rotation[1]);
+    float3 const translation = make_float3(shape->translation[0], shape->translation[1], shape->translation[2]);
+    res.o.xyz = rotate_vector(r.o.xyz - translation, rotation) * shape->scale;
+    res.d.xyz = rotate_vector(r.d.xyz, rotation) * shape->scale;
+#else
+    res.o.xyz = transform_point(r.o.xyz, shape->m0, shape->m1, shape->m2);
+    res.d.xyz = transform_vector(r.d.xyz, shape->m0, shape->m1, shape->m2);
+#endif
+#ifdef RR_MOTION_BLUR
+    float4 q = quaternion_at_time(motion->velocity_angular, time);
+    q.xyz = -q.xyz;
+    res.o.xyz = rotate_vector(res.o.xyz, q);
+    res.d.xyz = rotate_vector(res.d.xyz, q);
+#endif
     res.o.w = r.o.w;
     res.d.w = r.d.w;
     return res;
 }
 
+#ifdef RR_LOD
+// LOD records keep the number of levels, the rule and the transition (float bits)
+// followed by shape data entry and threshold (float bits) of every level, finest first
+#define LOD_RULE_DISTANCE 0
+#define LOD_RULE_CONE_WIDTH 1
+
+// Select LOD group level for the ray transformed into the group space and return its shape data entry.
+// Group space origin distance is scaled back to world units by the ratio of ray direction lengths.
+INLINE int select_lod_level(GLOBAL int const* restrict lods, int record, ray const* r, float world_dlen, float spread, uint seed)
+{
+    int const num_levels = lods[record];
+    float metric = length(r->o.xyz) * world_dlen / length(r->d.xyz);
+
+    if (lods[record + 1] == LOD_RULE_CONE_WIDTH)
+    {
+        metric *= spread;
+    }
+
+    // Rays with the same seed jitter the metric the same way, so levels blend stochastically over the transition
+    float const u = (float)(hash_uint(seed) >> 8) * (1.f / 16777216.f);
+    metric *= 1.f + as_float(lods[record + 2]) * (u - 0.5f);
+
+    int level = 0;
+
+    for (int i = 1; i < num_levels; ++i)
+    {
+        level += as_float(lods[record + 4 + 2 * i]) <= metric ? 1 : 0;
+    }
+
+    return lods[record + 3 + 2 * level];
+}
+
+// Levels are entered right away from their group leaf, so returns skip the group level
+#define RETURN_ADDR(nodes, leaf_addr) ((leaf_addr) != INVALID_IDX ? NEXT(nodes[leaf_addr]) : INVALID_IDX)
+#else
+#define RETURN_ADDR(nodes, leaf_addr) NEXT(nodes[leaf_addr])
+#endif
+
+#ifdef RR_REBRAID
+// Top level leaves of a rebraided BVH can reference subtrees of lower level BVHs,
+// their traversal ends where the subtree root skips to (INVALID_IDX for whole BVHs)
+#define SUBTREE_EXIT(nodes, addr) NEXT(nodes[addr])
+#define SUBTREE_DONE(addr, exit_addr) ((addr) == INVALID_IDX || (addr) == (exit_addr))
+#else
+#define SUBTREE_EXIT(nodes, addr) INVALID_IDX
+#define SUBTREE_DONE(addr, exit_addr) ((addr) == INVALID_IDX)
+#endif
+
+// Top level nodes keep shape bounds at time 0 if there are moving shapes,
+// bounds at time 1 are kept separately and interpolated by ray time
+#ifdef RR_MOTION_BLUR
+#define FETCH_NODE(nodes, motion_nodes, addr, root_idx, top_level, time) \
+    fetch_motion_node(nodes, motion_nodes, addr, root_idx, top_level, time)
+
+INLINE bvh_node fetch_motion_node(GLOBAL bvh_node const* restrict nodes, GLOBAL bbox const* restrict motion_nodes,
+    int addr, int root_idx, bool top_level, float time)
+{
+    bvh_node node = nodes[addr];
+
+    if (top_level)
+    {
+        bbox const node1 = motion_nodes[addr - root_idx];
+        node.pmin.xyz = mix(node.pmin.xyz, node1.pmin.xyz, time);
+        node.pmax.xyz = mix(node.pmax.xyz, node1.pmax.xyz, time);
+    }
+
+    return node;
+}
+#else
+#define FETCH_NODE(nodes, motion_nodes, addr, root_idx, top_level, time) nodes[addr]
+#endif
+
 
 __attribute__((reqd_work_group_size(64, 1, 1)))
 KERNEL void intersect_main(
@@ -150,7 +515,15 @@ KERNEL void intersect_main(
     // Number of rays in ray buffer
     GLOBAL int const* restrict num_rays,
     // Hits 
-    GLOBAL Intersection* hits
+    GLOBAL Intersection* hits,
+    // Top level node bounds at time 1
+    GLOBAL bbox const* restrict motion_nodes,
+    // Shape velocities
+    GLOBAL ShapeMotion const* restrict shape_motion,
+    // Top level node masks
+    GLOBAL int const* restrict node_masks,
+    // LOD group records
+    GLOBAL int const* restrict lods
 )
 {
     int global_id = get_global_id(0);
@@ -165,16 +538,34 @@ KERNEL void intersect_main(
         {
             // Precompute invdir for bbox testing
             float3 invdir = safe_invdir(r);
-            float3 invdirtop = invdir;
             float t_max = r.o.w;
+            float const time = ray_get_time(&r);
+#ifdef RR_LOD
+            // LOD metrics are measured in world units with the spread and the seed of the query ray
+            float const world_dlen = length(r.d.xyz);
+            float const spread = ray_get_spread(&r);
+            uint const lod_seed = ray_get_lod_seed(&r);
+#endif
+
+            // We need to keep upper level rays around for returns from lower levels
+            ray stack_ray[MAX_LEVELS];
+            float3 stack_invdir[MAX_LEVELS];
+            // Shape leaves lower level BVHs have been entered from
+            int stack_addr[MAX_LEVELS];
+            // Number of shape leaves entered
+            int depth = 0;
+            // Address lower level traversal returns at
+            int exit_addr = INVALID_IDX;
+            // Current BVH has primitive leaves
+            bool mesh_level = false;
+            // Primitives are curve segments
+            bool curve_level = false;
+            // Primitives are spheres, disks or custom primitives
+            bool procedural_level = false;
 
-            // We need to keep original ray around for returns from bottom hierarchy
-            ray top_ray = r;
             // Fetch top level BVH index
-            int addr = root_idx;
+            int addr = RAY_VISIBLE(&r) ? root_idx : INVALID_IDX;
 
-            // Set top index
-            int top_addr = INVALID_IDX;
             // Current shape ID
             int shape_id = INVALID_IDX;
             // Closest shape ID
@@ -184,18 +575,59 @@ KERNEL void intersect_main(
             while (addr != INVALID_IDX)
             {
                 // Fetch next node
-                bvh_node node = nodes[addr];
+                bvh_node node = FETCH_NODE(nodes, motion_nodes, addr, root_idx, depth == 0, time);
 
                 // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
+                float2 s = NODE_VISIBLE(&r, node_masks, addr, root_idx, depth == 0) ?
+                    fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max) : make_float2(1.f, 0.f);
 
                 if (s.x <= s.y)
                 {
                     if (LEAFNODE(node))
                     {
                         // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
-                        // or containing another BVH (top level hierarhcy)
-                        if (top_addr != INVALID_IDX)
+                        // or containing another BVH (top level hierarhcy or group)
+#ifdef RR_CURVES
+                        if (mesh_level && curve_level)
+                        {
+                            // Segment control points follow each other
+                            Face const face = faces[STARTIDX(node)];
+                            float2 uv;
+                            float const f = intersect_curve(r, (GLOBAL float4 const*)vertices + face.idx[0], t_max, &uv);
+
+                            if (f < t_max)
+                            {
+                                t_max = f;
+                                closest_prim_id = face.prim_id;
+                                closest_shape_id = shape_id;
+                                closest_barycentrics = uv;
+                            }
+
+                            addr = NEXT(node);
+                        }
+                        else
+#endif
+#ifdef RR_PROCEDURALS
+                        if (mesh_level && procedural_level)
+                        {
+                            // Primitive data follows its first index, the kind is in the second one
+                            Face const face = faces[STARTIDX(node)];
+                            float2 uv;
+                            float const f = intersect_procedural(r, (GLOBAL float4 const*)vertices + face.idx[0], face.idx[1], shape_id, face.prim_id, t_max, &uv);
+
+                            if (f < t_max)
+                            {
+                                t_max = f;
+                                closest_prim_id = face.prim_id;
+                                closest_shape_id = shape_id;
+                                closest_barycentrics = uv;
+                            }
+
+                            addr = NEXT(node);
+                        }
+                        else
+#endif
+                        if (mesh_level)
                         {
                             // Intersect leaf here
                             //
@@ -206,7 +638,14 @@ KERNEL void intersect_main(
                             float3 const v3 = vertices[face.idx[2]];
 
                             // Intersect triangle
+#ifdef RR_QUADS
+                            float3 const v4 = face.idx3 >= 0 ? vertices[face.idx3] : v1;
+                            float const f = face.idx3 >= 0 ?
+                                fast_intersect_quad(r, v1, v2, v3, v4, t_max) :
+                                fast_intersect_triangle(r, v1, v2, v3, t_max);
+#else
                             float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+#endif
                             // If hit update closest hit distance and index
                             if (f < t_max)
                             {
@@ -216,7 +655,13 @@ KERNEL void intersect_main(
 
                                 float3 const p = r.o.xyz + r.d.xyz * t_max;
                                 // Calculte barycentric coordinates
+#ifdef RR_QUADS
+                                closest_barycentrics = face.idx3 >= 0 ?
+                                    quad_calculate_uv(p, v1, v2, v3, v4) :
+                                    triangle_calculate_barycentrics(p, v1, v2, v3);
+#else
                                 closest_barycentrics = triangle_calculate_barycentrics(p, v1, v2, v3);
+#endif
                             }
 
                             // And goto next node
@@ -224,36 +669,69 @@ KERNEL void intersect_main(
                         }
                         else
                         {
-                            // This is top level hierarchy leaf
-                            // Save top node index for return
-                            top_addr = addr;
                             // Get shape descrition struct index
                             int shape_idx = SHAPEIDX(node);
-                            // Get shape mask
-                            int shape_mask = shapes[shape_idx].mask;
-                            // Drill into 2nd level BVH only if the geometry is not masked vs current ray
+                            // Drill into lower level BVH only if the geometry is not masked vs current ray
                             // otherwise skip the subtree
-                            if (ray_get_mask(&r) & shape_mask)
+                            if (SHAPE_VISIBLE(&r, shapes, shape_idx))
                             {
-                                // Fetch bottom level BVH index
-                                addr = shapes[shape_idx].bvh_idx;
-                                shape_id = shapes[shape_idx].id;
+                                // Save the leaf and the ray for return
+                                stack_addr[depth] = addr;
+#ifndef RR_IDENTITY_TRANSFORMS
+                                stack_ray[depth] = r;
+                                stack_invdir[depth] = invdir;
+#endif
+                                // Hits are reported for shapes attached to the scene
+                                if (depth == 0)
+                                {
+                                    shape_id = shapes[shape_idx].id;
+                                }
+
+                                ++depth;
 
-                                // Fetch BVH transform
-                                float4 wmi0 = shapes[shape_idx].m0;
-                                float4 wmi1 = shapes[shape_idx].m1;
-                                float4 wmi2 = shapes[shape_idx].m2;
-                                float4 wmi3 = shapes[shape_idx].m3;
+                                // Fetch lower level BVH index
+                                addr = shapes[shape_idx].bvh_idx;
+                                mesh_level = SHAPE_HAS_PRIMS(shapes, shape_idx);
+                                curve_level = SHAPE_IS_CURVES(shapes, shape_idx);
+                                procedural_level = SHAPE_IS_PROCEDURALS(shapes, shape_idx);
 
-                                r = transform_ray(r, wmi0, wmi1, wmi2, wmi3);
+#ifndef RR_IDENTITY_TRANSFORMS
+                                // Transform the ray into shape object space
+                                r = transform_ray(r, &shapes[shape_idx], &shape_motion[shape_idx]);
                                 // Recalc invdir
                                 invdir = safe_invdir(r);
-                                // And continue traversal of the bottom level BVH
+#endif
+#ifdef RR_LOD
+                                // LOD groups are not traversed, the level selected for the ray is entered instead
+                                if (shapes[shape_idx].type == SHAPE_TYPE_LOD)
+                                {
+                                    shape_idx = select_lod_level(lods, addr, &r, world_dlen, spread, lod_seed);
+
+                                    stack_addr[depth] = INVALID_IDX;
+#ifndef RR_IDENTITY_TRANSFORMS
+                                    stack_ray[depth] = r;
+                                    stack_invdir[depth] = invdir;
+#endif
+                                    ++depth;
+
+                                    addr = shapes[shape_idx].bvh_idx;
+                                    mesh_level = SHAPE_HAS_PRIMS(shapes, shape_idx);
+                                    curve_level = SHAPE_IS_CURVES(shapes, shape_idx);
+                                    procedural_level = SHAPE_IS_PROCEDURALS(shapes, shape_idx);
+
+#ifndef RR_IDENTITY_TRANSFORMS
+                                    r = transform_ray(r, &shapes[shape_idx], &shape_motion[shape_idx]);
+                                    invdir = safe_invdir(r);
+#endif
+                                }
+#endif
+                                exit_addr = SUBTREE_EXIT(nodes, addr);
+                                // And continue traversal of the lower level BVH
                                 continue;
                             }
                             else
                             {
-                                addr = INVALID_IDX;
+                                addr = NEXT(node);
                             }
                         }
                     }
@@ -270,18 +748,21 @@ KERNEL void intersect_main(
                     addr = NEXT(node);
                 }
 
-                // Here check if we ended up traversing bottom level BVH
-                // in this case idx = -1 and topidx has valid value
-                if (addr == INVALID_IDX && top_addr != INVALID_IDX)
+                // Here check if we ended up traversing lower level BVH
+                // in this case idx = -1 and there are leaves to return to
+                while (SUBTREE_DONE(addr, exit_addr) && depth > 0)
                 {
-                    //  Proceed to next top level node
-                    addr = NEXT(nodes[top_addr]);
-                    // Set topidx
-                    top_addr = INVALID_IDX;
+                    --depth;
+                    exit_addr = INVALID_IDX;
+                    //  Proceed to next upper level node
+                    addr = RETURN_ADDR(nodes, stack_addr[depth]);
+                    mesh_level = false;
+#ifndef RR_IDENTITY_TRANSFORMS
                     // Restore ray here
-                    r = top_ray;
+                    r = stack_ray[depth];
                     // Restore invdir
-                    invdir = invdirtop;
+                    invdir = stack_invdir[depth];
+#endif
                 }
             }
 
@@ -320,7 +801,15 @@ KERNEL void occluded_main(
     // Number of rays in ray buffer
     GLOBAL int const* restrict num_rays,
     // Hits 
-    GLOBAL int* hits
+    GLOBAL int* hits,
+    // Top level node bounds at time 1
+    GLOBAL bbox const* restrict motion_nodes,
+    // Shape velocities
+    GLOBAL ShapeMotion const* restrict shape_motion,
+    // Top level node masks
+    GLOBAL int const* restrict node_masks,
+    // LOD group records
+    GLOBAL int const* restrict lods
 )
 {
     int global_id = get_global_id(0);
@@ -335,31 +824,86 @@ KERNEL void occluded_main(
         {
             // Precompute invdir for bbox testing
             float3 invdir = safe_invdir(r);
-            float3 invdirtop = invdir;
             float const t_max = r.o.w;
+            float const time = ray_get_time(&r);
+#ifdef RR_LOD
+            // LOD metrics are measured in world units with the spread and the seed of the query ray
+            float const world_dlen = length(r.d.xyz);
+            float const spread = ray_get_spread(&r);
+            uint const lod_seed = ray_get_lod_seed(&r);
+#endif
 
-            // We need to keep original ray around for returns from bottom hierarchy
-            ray top_ray = r;
+            // We need to keep upper level rays around for returns from lower levels
+            ray stack_ray[MAX_LEVELS];
+            float3 stack_invdir[MAX_LEVELS];
+            // Shape leaves lower level BVHs have been entered from
+            int stack_addr[MAX_LEVELS];
+            // Number of shape leaves entered
+            int depth = 0;
+            // Address lower level traversal returns at
+            int exit_addr = INVALID_IDX;
+            // Current BVH has primitive leaves
+            bool mesh_level = false;
+            // Primitives are curve segments
+            bool curve_level = false;
+            // Primitives are spheres, disks or custom primitives
+            bool procedural_level = false;
+            // Current shape ID, passed to custom intersection functions
+            int shape_id = INVALID_IDX;
 
             // Fetch top level BVH index
-            int addr = root_idx;
-            // Set top index
-            int top_addr = INVALID_IDX;
+            int addr = RAY_VISIBLE(&r) ? root_idx : INVALID_IDX;
 
             while (addr != INVALID_IDX)
             {
                 // Fetch next node
-                bvh_node node = nodes[addr];
+                bvh_node node = FETCH_NODE(nodes, motion_nodes, addr, root_idx, depth == 0, time);
                 // Intersect against bbox
-                float2 s = fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max);
+                float2 s = NODE_VISIBLE(&r, node_masks, addr, root_idx, depth == 0) ?
+                    fast_intersect_bbox1(node, invdir, -r.o.xyz * invdir, t_max) : make_float2(1.f, 0.f);
 
                 if (s.x <= s.y)
                 {
                     if (LEAFNODE(node))
                     {
                         // If this is the leaf it can be either a leaf containing primitives (bottom hierarchy)
-                        // or containing another BVH (top level hierarhcy)
-                        if (top_addr != INVALID_IDX)
+                        // or containing another BVH (top level hierarhcy or group)
+#ifdef RR_CURVES
+                        if (mesh_level && curve_level)
+                        {
+                            // Segment control points follow each other
+                            Face const face = faces[STARTIDX(node)];
+                            float2 uv;
+
+                            // Any hit closer than t_max terminates traversal
+                            if (intersect_curve(r, (GLOBAL float4 const*)vertices + face.idx[0], t_max, &uv) < t_max)
+                            {
+                                hits[global_id] = HIT_MARKER;
+                                return;
+                            }
+
+                            addr = NEXT(node);
+                        }
+                        else
+#endif
+#ifdef RR_PROCEDURALS
+                        if (mesh_level && procedural_level)
+                        {
+                            Face const face = faces[STARTIDX(node)];
+                            float2 uv;
+
+                            // Any hit closer than t_max terminates traversal
+                            if (intersect_procedural(r, (GLOBAL float4 const*)vertices + face.idx[0], face.idx[1], shape_id, face.prim_id, t_max, &uv) < t_max)
+                            {
+                                hits[global_id] = HIT_MARKER;
+                                return;
+                            }
+
+                            addr = NEXT(node);
+                        }
+                        else
+#endif
+                        if (mesh_level)
                         {
                             // Intersect leaf here
                             //
@@ -370,9 +914,15 @@ KERNEL void occluded_main(
                             float3 const v3 = vertices[face.idx[2]];
 
                             // Intersect triangle
-                            float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                            // If hit update closest hit distance and index
-                            if (f < t_max)
+                            // Any hit closer than t_max terminates traversal
+#ifdef RR_QUADS
+                            bool const occluded = face.idx3 >= 0 ?
+                                fast_occlude_quad(r, v1, v2, v3, vertices[face.idx3], t_max) :
+                                fast_occlude_triangle(r, v1, v2, v3, t_max);
+#else
+                            bool const occluded = fast_occlude_triangle(r, v1, v2, v3, t_max);
+#endif
+                            if (occluded)
                             {
                                 hits[global_id] = HIT_MARKER;
                                 return;
@@ -383,35 +933,69 @@ KERNEL void occluded_main(
                         }
                         else
                         {
-                            // This is top level hierarchy leaf
-                            // Save top node index for return
-                            top_addr = addr;
                             // Get shape descrition struct index
                             int shape_idx = SHAPEIDX(node);
-                            // Get shape mask
-                            int shape_mask = shapes[shape_idx].mask;
-                            // Drill into 2nd level BVH only if the geometry is not masked vs current ray
+                            // Drill into lower level BVH only if the geometry is not masked vs current ray
                             // otherwise skip the subtree
-                            if (ray_get_mask(&r) & shape_mask)
+                            if (SHAPE_VISIBLE(&r, shapes, shape_idx))
                             {
-                                // Fetch bottom level BVH index
-                                addr = shapes[shape_idx].bvh_idx;
+                                // Save the leaf and the ray for return
+                                stack_addr[depth] = addr;
+#ifndef RR_IDENTITY_TRANSFORMS
+                                stack_ray[depth] = r;
+                                stack_invdir[depth] = invdir;
+#endif
+                                // Hits are reported for shapes attached to the scene
+                                if (depth == 0)
+                                {
+                                    shape_id = shapes[shape_idx].id;
+                                }
 
-                                // Fetch BVH transform
-                                float4 wmi0 = shapes[shape_idx].m0;
-                                float4 wmi1 = shapes[shape_idx].m1;
-                                float4 wmi2 = shapes[shape_idx].m2;
-                                float4 wmi3 = shapes[shape_idx].m3;
+                                ++depth;
 
-                                r = transform_ray(r, wmi0, wmi1, wmi2, wmi3);
+                                // Fetch lower level BVH index
+                                addr = shapes[shape_idx].bvh_idx;
+                                mesh_level = SHAPE_HAS_PRIMS(shapes, shape_idx);
+                                curve_level = SHAPE_IS_CURVES(shapes, shape_idx);
+                                procedural_level = SHAPE_IS_PROCEDURALS(shapes, shape_idx);
+
+#ifndef RR_IDENTITY_TRANSFORMS
+                                // Transform the ray into shape object space
+                                r = transform_ray(r, &shapes[shape_idx], &shape_motion[shape_idx]);
                                 // Recalc invdir
-                                invdir = safe_invdir(r);;
-                                // And continue traversal of the bottom level BVH
+                                invdir = safe_invdir(r);
+#endif
+#ifdef RR_LOD
+                                // LOD groups are not traversed, the level selected for the ray is entered instead
+                                if (shapes[shape_idx].type == SHAPE_TYPE_LOD)
+                                {
+                                    shape_idx = select_lod_level(lods, addr, &r, world_dlen, spread, lod_seed);
+
+                                    stack_addr[depth] = INVALID_IDX;
+#ifndef RR_IDENTITY_TRANSFORMS
+                                    stack_ray[depth] = r;
+                                    stack_invdir[depth] = invdir;
+#endif
+                                    ++depth;
+
+                                    addr = shapes[shape_idx].bvh_idx;
+                                    mesh_level = SHAPE_HAS_PRIMS(shapes, shape_idx);
+                                    curve_level = SHAPE_IS_CURVES(shapes, shape_idx);
+                                    procedural_level = SHAPE_IS_PROCEDURALS(shapes, shape_idx);
+
+#ifndef RR_IDENTITY_TRANSFORMS
+                                    r = transform_ray(r, &shapes[shape_idx], &shape_motion[shape_idx]);
+                                    invdir = safe_invdir(r);
+#endif
+                                }
+#endif
+                                exit_addr = SUBTREE_EXIT(nodes, addr);
+                                // And continue traversal of the lower level BVH
                                 continue;
                             }
                             else
                             {
-                                addr = INVALID_IDX;
+                                addr = NEXT(node);
                             }
                         }
                     }
@@ -428,22 +1012,86 @@ KERNEL void occluded_main(
                     addr = NEXT(node);
                 }
 
-                // Here check if we ended up traversing bottom level BVH
-                // in this case idx = -1 and topidx has valid value
-                if (addr == INVALID_IDX && top_addr != INVALID_IDX)
+                // Here check if we ended up traversing lower level BVH
+                // in this case idx = -1 and there are leaves to return to
+                while (SUBTREE_DONE(addr, exit_addr) && depth > 0)
                 {
-                    //  Proceed to next top level node
-                    addr = NEXT(nodes[top_addr]);
-                    // Set topidx
-                    top_addr = INVALID_IDX;
+                    --depth;
+                    exit_addr = INVALID_IDX;
+                    //  Proceed to next upper level node
+                    addr = RETURN_ADDR(nodes, stack_addr[depth]);
+                    mesh_level = false;
+#ifndef RR_IDENTITY_TRANSFORMS
                     // Restore ray here
-                    r = top_ray;
+                    r = stack_ray[depth];
                     // Restore invdir
-                    invdir = invdirtop;
+                    invdir = stack_invdir[depth];
+#endif
                 }
             }
 
             hits[global_id] = MISS_MARKER;
         }
     }
-}
\ No newline at end of file
+}
+// HLBVH node (see build_hlbvh.cl)
+typedef struct
+{
+    int parent;
+    int left;
+    int right;
+    // Number of primitives in the subtree
+    int count;
+} HlbvhNode;
+
+// Convert top level HLBVH built on the device into skip links layout.
+// HLBVH keeps N-1 internal nodes followed by N leaves, root is node 0.
+// Nodes are placed in depth first order: left child goes right after its
+// parent, right one after the whole left subtree. Node position is found
+// walking up to the root, skip link points right past the node subtree.
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void translate_hlbvh_main(
+    // HLBVH nodes
+    GLOBAL HlbvhNode const* restrict hlbvh_nodes,
+    // HLBVH node bounds
+    GLOBAL bbox const* restrict hlbvh_bounds,
+    // Number of primitives (shapes)
+    int num_prims,
+    // Top level root index in the output
+    int root_idx,
+    // Output BVH nodes
+    GLOBAL bvh_node* nodes
+)
+{
+    int global_id = get_global_id(0);
+    int const num_nodes = 2 * num_prims - 1;
+
+    if (global_id < num_nodes)
+    {
+        HlbvhNode const node = hlbvh_nodes[global_id];
+
+        // Find depth first position of the node
+        int pos = 0;
+        int idx = global_id;
+        while (idx != 0)
+        {
+            int const parent = hlbvh_nodes[idx].parent;
+            int const left = hlbvh_nodes[parent].left;
+
+            // Right child follows the parent and the whole left subtree
+            pos += (left == idx) ? 1 : 2 * hlbvh_nodes[left].count;
+            idx = parent;
+        }
+
+        int const next = pos + 2 * node.count - 1;
+
+        bvh_node out;
+        out.pmin = hlbvh_bounds[global_id].pmin;
+        out.pmax = hlbvh_bounds[global_id].pmax;
+        // Leaves reference shape directly, internal nodes are marked with -1
+        out.pmin.w = (global_id >= num_prims - 1) ? (float)((node.left << 4) | 1) : -1.f;
+        out.pmax.w = (next < num_nodes) ? (float)(root_idx + next) : -1.f;
+
+        nodes[root_idx + pos] = out;
+    }
+}
@@ -0,0 +1,365 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_grid.cl
+    \brief Two-level uniform grid traversal
+
+    Rays walk the cells of the top level and of the sub-grids of the non-empty top
+    level cells they pass in order with 3D-DDA:
+    "A Fast Voxel Traversal Algorithm for Ray Tracing"
+    John Amanatides, Andrew Woo, in Eurographics 1987
+
+    Primitives overlapping several cells are tested in each of them, closest hit
+    traversal stops in the first cell containing the closest hit found so far.
+ */
+
+ /*************************************************************************
+  INCLUDES
+  **************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+typedef struct
+{
+    // Grid bounds
+    float4 pmin;
+    float4 pmax;
+    // Top level cell size
+    float4 cell_size;
+    // Top level resolution, number of top level cells in w
+    int4 res;
+} grid_desc;
+
+typedef struct
+{
+    // Vertex indices
+    int idx[3];
+    // Shape maks
+    int shape_mask;
+    // Shape ID
+    int shape_id;
+    // Primitive ID
+    int prim_id;
+} Face;
+
+// 3D-DDA state: current cell and distances to the next cell boundary along each axis
+typedef struct
+{
+    int3 cell;
+    int3 step;
+    float3 t_next;
+    float3 t_delta;
+} dda;
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Reciprocal direction without infinities, DDA steps along axes the ray is parallel to never come
+INLINE float3 grid_invdir(ray r)
+{
+    float const ooeps = exp2(-80.0f);
+    float3 const d = r.d.xyz;
+    return 1.f / select(copysign((float3)(ooeps), d), d, isgreater(fabs(d), (float3)(ooeps)));
+}
+
+// Start walking a grid at distance t along the ray
+INLINE void dda_init(dda* s, float3 pmin, float3 cell_size, int3 res, ray r, float3 invdir, float t)
+{
+    float3 const p = r.o.xyz + r.d.xyz * t;
+    s->cell = clamp(convert_int3(floor((p - pmin) / cell_size)), (int3)(0), res - 1);
+    s->step = select((int3)(-1), (int3)(1), isgreaterequal(invdir, (float3)(0.f)));
+    float3 const boundary = pmin + convert_float3(s->cell + max(s->step, (int3)(0))) * cell_size;
+    s->t_next = (boundary - r.o.xyz) * invdir;
+    s->t_delta = fabs(cell_size * invdir);
+}
+
+// Distance the ray leaves the current cell at
+INLINE float dda_exit(dda const* s)
+{
+    return min3(s->t_next.x, s->t_next.y, s->t_next.z);
+}
+
+// Move to the next cell, false once the ray leaves the grid
+INLINE bool dda_step(dda* s, int3 res)
+{
+    if (s->t_next.x <= s->t_next.y && s->t_next.x <= s->t_next.z)
+    {
+        s->cell.x += s->step.x;
+        s->t_next.x += s->t_delta.x;
+        return s->cell.x >= 0 && s->cell.x < res.x;
+    }
+    else if (s->t_next.y <= s->t_next.z)
+    {
+        s->cell.y += s->step.y;
+        s->t_next.y += s->t_delta.y;
+        return s->cell.y >= 0 && s->cell.y < res.y;
+    }
+    else
+    {
+        s->cell.z += s->step.z;
+        s->t_next.z += s->t_delta.z;
+        return s->cell.z >= 0 && s->cell.z < res.z;
+    }
+}
+
+// Walk the grid between the ray origin and t_max, returns the closest hit face
+// or any hit face if any_hit is set, INVALID_IDX if there is none
+INLINE int traverse_grid(
+    GLOBAL grid_desc const* restrict desc,
+    GLOBAL int4 const* restrict top_res,
+    GLOBAL int const* restrict top_leaf_starts,
+    GLOBAL int const* restrict leaf_starts,
+    GLOBAL int const* restrict leaf_ends,
+    GLOBAL int const* restrict refs,
+    GLOBAL float3 const* restrict vertices,
+    GLOBAL Face const* restrict faces,
+    ray r,
+    bool any_hit,
+    float* t_hit)
+{
+    float3 const invdir = grid_invdir(r);
+    float3 const oxinvdir = -r.o.xyz * invdir;
+    float t_max = r.o.w;
+    int isect_idx = INVALID_IDX;
+
+    bbox box;
+    box.pmin = desc->pmin;
+    box.pmax = desc->pmax;
+
+    float2 const span = fast_intersect_bbox1(box, invdir, oxinvdir, t_max);
+
+    if (span.x > span.y)
+    {
+        return INVALID_IDX;
+    }
+
+    float3 const pmin = desc->pmin.xyz;
+    float3 const cell_size = desc->cell_size.xyz;
+    int3 const res = desc->res.xyz;
+
+    dda top;
+    dda_init(&top, pmin, cell_size, res, r, invdir, span.x);
+    float t_enter = span.x;
+
+    while (true)
+    {
+        int const cell = top.cell.x + res.x * (top.cell.y + res.y * top.cell.z);
+        int4 const leaf_res = top_res[cell];
+        float const t_exit = min(dda_exit(&top), span.y);
+
+        // Empty top level cells have no sub-grid
+        if (leaf_res.w > 0)
+        {
+            float3 const leaf_size = cell_size / convert_float3(leaf_res.xyz);
+            float3 const cell_min = pmin + convert_float3(top.cell) * cell_size;
+            int const leaf_start = top_leaf_starts[cell];
+
+            dda leaf;
+            dda_init(&leaf, cell_min, leaf_size, leaf_res.xyz, r, invdir, t_enter);
+
+            while (true)
+            {
+                int const leaf_idx = leaf_start + leaf.cell.x + leaf_res.x * (leaf.cell.y + leaf_res.y * leaf.cell.z);
+                int const end = leaf_ends[leaf_idx];
+
+                for (int i = leaf_starts[leaf_idx]; i < end; ++i)
+                {
+                    int const face_idx = refs[i];
+                    Face const face = faces[face_idx];
+                    float3 const v1 = vertices[face.idx[0]];
+                    float3 const v2 = vertices[face.idx[1]];
+                    float3 const v3 = vertices[face.idx[2]];
+
+                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
+
+                    if (f < t_max)
+                    {
+                        t_max = f;
+                        isect_idx = face_idx;
+
+                        if (any_hit)
+                        {
+                            *t_hit = t_max;
+                            return isect_idx;
+                        }
+                    }
+                }
+
+                float const leaf_exit = dda_exit(&leaf);
+
+                // Hits behind the cell are closer than anything in the following ones
+                if (t_max <= leaf_exit || leaf_exit >= t_exit || !dda_step(&leaf, leaf_res.xyz))
+                {
+                    break;
+                }
+            }
+
+            if (t_max <= t_exit)
+            {
+                break;
+            }
+        }
+
+        if (t_exit >= span.y || !dda_step(&top, res))
+        {
+            break;
+        }
+
+        t_enter = t_exit;
+    }
+
+    *t_hit = t_max;
+    return isect_idx;
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void occluded_main(
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Sub-grid resolutions of top level cells
+    GLOBAL int4 const* restrict top_res,
+    // First leaf cell of each top level cell
+    GLOBAL int const* restrict top_leaf_starts,
+    // Reference ranges of leaf cells
+    GLOBAL int const* restrict leaf_starts,
+    GLOBAL int const* restrict leaf_ends,
+    // Face references
+    GLOBAL int const* restrict refs,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            float t_hit;
+            int const isect_idx = traverse_grid(desc, top_res, top_leaf_starts, leaf_starts, leaf_ends, refs,
+                vertices, faces, r, true, &t_hit);
+
+            hits[global_id] = isect_idx != INVALID_IDX ? HIT_MARKER : MISS_MARKER;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_main(
+    // Grid layout
+    GLOBAL grid_desc const* restrict desc,
+    // Sub-grid resolutions of top level cells
+    GLOBAL int4 const* restrict top_res,
+    // First leaf cell of each top level cell
+    GLOBAL int const* restrict top_leaf_starts,
+    // Reference ranges of leaf cells
+    GLOBAL int const* restrict leaf_starts,
+    GLOBAL int const* restrict leaf_ends,
+    // Face references
+    GLOBAL int const* restrict refs,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Hit data
+    GLOBAL Intersection* hits)
+{
+    int global_id = get_global_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            float t_hit;
+            int const isect_idx = traverse_grid(desc, top_res, top_leaf_starts, leaf_starts, leaf_ends, refs,
+                vertices, faces, r, false, &t_hit);
+
+            if (isect_idx != INVALID_IDX)
+            {
+                Face const face = faces[isect_idx];
+                float3 const v1 = vertices[face.idx[0]];
+                float3 const v2 = vertices[face.idx[1]];
+                float3 const v3 = vertices[face.idx[2]];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_hit;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                hits[global_id].shape_id = face.shape_id;
+                hits[global_id].prim_id = face.prim_id;
+                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_hit);
+            }
+            else
+            {
+                // Miss here
+                hits[global_id].shape_id = MISS_MARKER;
+                hits[global_id].prim_id = MISS_MARKER;
+            }
+        }
+    }
+}
+
+// Calculate world space face bounds from device resident geometry
+KERNEL void face_bounds_main(
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Number of faces
+    int num_faces,
+    // Face bounds
+    GLOBAL bbox* bounds)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_faces)
+    {
+        Face const face = faces[global_id];
+        float3 const v1 = vertices[face.idx[0]];
+        float3 const v2 = vertices[face.idx[1]];
+        float3 const v3 = vertices[face.idx[2]];
+
+        bbox b;
+        b.pmin = (float4)(min(min(v1, v2), v3), 0.f);
+        b.pmax = (float4)(max(max(v1, v2), v3), 0.f);
+        bounds[global_id] = b;
+    }
+}
@@ -146,10 +146,8 @@ occluded_main(
                     float3 const v1 = vertices[face.idx[0]];
                     float3 const v2 = vertices[face.idx[1]];
                     float3 const v3 = vertices[face.idx[2]];
-                    // Intersect triangle
-                    float const f = fast_intersect_triangle(r, v1, v2, v3, t_max);
-                    // If hit update closest hit distance and index
-                    if (f < t_max)
+                    // Any hit closer than t_max terminates traversal
+                    if (fast_occlude_triangle(r, v1, v2, v3, t_max))
                     {
                         hits[global_id] = HIT_MARKER;
                         return;
@@ -164,16 +162,15 @@ occluded_main(
                     // Determine which one to traverse
                     bool const traverse_c0 = (s0.x <= s0.y);
                     bool const traverse_c1 = (s1.x <= s1.y);
-                    bool const c1first = traverse_c1 && (s0.x > s1.x);
 
                     if (traverse_c0 || traverse_c1)
                     {
                         int deferred = -1;
 
-                        // Determine which one to traverse first
-                        if (c1first || !traverse_c0)
+                        // Any hit will do, so there is no need to find the closer child
+                        if (!traverse_c0)
                         {
-                            // Right one is closer or left one not travesed
+                            // Left one not traversed
                             addr = node.child1;
                             deferred = node.child0;
                         }
@@ -413,3 +410,98 @@ KERNEL void intersect_main(
 
 
 
+
+// Calculate world space face bounds from device resident geometry
+KERNEL void face_bounds_main(
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Number of faces
+    int num_faces,
+    // Face bounds
+    GLOBAL bbox* bounds)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < num_faces)
+    {
+        Face const face = faces[global_id];
+        float3 const v1 = vertices[face.idx[0]];
+        float3 const v2 = vertices[face.idx[1]];
+        float3 const v3 = vertices[face.idx[2]];
+
+        bbox b;
+        b.pmin = (float4)(min(min(v1, v2), v3), 0.f);
+        b.pmax = (float4)(max(max(v1, v2), v3), 0.f);
+        bounds[global_id] = b;
+    }
+}
+
+// Fat BVH node of intersect_bvh2_short_stack.cl: internal nodes keep bounds of
+// both children with child addresses in the w components of the first box,
+// leaves keep the face with child0 == child1 == -1
+typedef struct
+{
+    union
+    {
+        struct
+        {
+            bbox bounds[2];
+        };
+
+        struct
+        {
+            int i0, i1, i2;
+            int child0;
+            int shape_mask;
+            int shape_id;
+            int prim_id;
+            int child1;
+        };
+    };
+} fat_node;
+
+// Convert refitted HLBVH nodes into fat nodes at the same addresses,
+// so the root stays at 0 and short stack traversal can run on them
+KERNEL void translate_fatnode_main(
+    // HLBVH nodes
+    GLOBAL bvh_node const* restrict nodes,
+    // HLBVH node bounds
+    GLOBAL bbox const* restrict bounds,
+    // Faces
+    GLOBAL Face const* restrict faces,
+    // Number of faces
+    int num_faces,
+    // Fat nodes
+    GLOBAL fat_node* fat_nodes)
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < 2 * num_faces - 1)
+    {
+        bvh_node const node = nodes[global_id];
+        fat_node fat;
+
+        if (LEAFNODE(node))
+        {
+            Face const face = faces[STARTIDX(node)];
+            fat.i0 = face.idx[0];
+            fat.i1 = face.idx[1];
+            fat.i2 = face.idx[2];
+            fat.child0 = fat.child1 = -1;
+            fat.shape_mask = face.shape_mask;
+            fat.shape_id = face.shape_id;
+            fat.prim_id = face.prim_id;
+        }
+        else
+        {
+            fat.bounds[0] = bounds[node.child0];
+            fat.bounds[1] = bounds[node.child1];
+            fat.child0 = node.child0;
+            fat.child1 = node.child1;
+        }
+
+        fat_nodes[global_id] = fat;
+    }
+}
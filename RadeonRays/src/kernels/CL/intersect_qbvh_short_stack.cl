@@ -0,0 +1,466 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file intersect_qbvh_short_stack.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Intersector implementation based on 4-wide BVH stacked traversal.
+
+    Intersector is using 4-wide BVH with compressed nodes: child bounds
+    are quantized to 8 bits per plane relative to node bounds using
+    power of two scale per axis, so a node takes 64 bytes.
+    Leaf children reference ranges of reordered faces directly.
+    Traversal is using a stack which is split into two parts:
+        -Top part in fast LDS memory
+        -Bottom part in slow global memory.
+
+    Traversal pseudocode:
+
+        while(addr is valid)
+        {
+            node <- fetch next node at addr
+            intersect ray vs 4 children bounds
+            intersect faces of hit leaf children
+            sort hit internal children by distance
+            if (hit any internal children)
+            {
+                addr = closest child
+                push other children far to near
+                continue
+            }
+
+            addr <- pop from the stack
+        }
+
+    Pros:
+        -Less node fetches and 4 boxes tested at once.
+        -Compact nodes, less memory traffic.
+    Cons:
+        -Depth is limited.
+        -Generates LDS traffic.
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+
+/*************************************************************************
+TYPE DEFINITIONS
+**************************************************************************/
+
+#define GLOBAL_STACK_SIZE 64
+#define SHORT_STACK_SIZE 16
+#define WAVEFRONT_SIZE 64
+
+// Compressed 4-wide BVH node
+typedef struct
+{
+    // Internal children: node addresses, leaf children: first face index, -1 for empty slots
+    int4 child;
+    // Node bounds minimum
+    float origin_x, origin_y, origin_z;
+    // Per axis scale exponents (biased by 127)
+    uchar4 exponent;
+    // Quantized child bounds minimum
+    uchar4 qmin_x, qmin_y, qmin_z;
+    // Number of faces for leaf children, 0 for internal ones
+    uchar4 count;
+    // Quantized child bounds maximum
+    uchar4 qmax_x, qmax_y, qmax_z;
+    int padding;
+} qbvh_node;
+
+typedef struct
+{
+    // Vertex indices
+    int idx[3];
+    // Shape maks
+    int shape_mask;
+    // Shape ID
+    int shape_id;
+    // Primitive ID
+    int prim_id;
+} Face;
+
+// Push node address into the short stack offloading it into global memory if full
+#define PUSH(x) \
+    { \
+        if (lm_stack - lm_stack_base >= SHORT_STACK_SIZE * WAVEFRONT_SIZE) \
+        { \
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i) \
+            { \
+                gm_stack[i] = lm_stack_base[i * WAVEFRONT_SIZE]; \
+            } \
+            gm_stack += SHORT_STACK_SIZE; \
+            lm_stack = lm_stack_base + WAVEFRONT_SIZE; \
+        } \
+        *lm_stack = (x); \
+        lm_stack += WAVEFRONT_SIZE; \
+    }
+
+// Pop node address from the short stack reloading it from global memory if empty
+#define POP(x) \
+    { \
+        lm_stack -= WAVEFRONT_SIZE; \
+        x = *(lm_stack); \
+        if (x == INVALID_IDX && gm_stack > gm_stack_base) \
+        { \
+            gm_stack -= SHORT_STACK_SIZE; \
+            for (int i = 1; i < SHORT_STACK_SIZE; ++i) \
+            { \
+                lm_stack_base[i * WAVEFRONT_SIZE] = gm_stack[i]; \
+            } \
+            lm_stack = lm_stack_base + (SHORT_STACK_SIZE - 1) * WAVEFRONT_SIZE; \
+            x = lm_stack_base[WAVEFRONT_SIZE * (SHORT_STACK_SIZE - 1)]; \
+        } \
+    }
+
+// Compare and swap child distances and addresses
+#define SORT2(d0, d1, c0, c1) \
+    if (d1 < d0) \
+    { \
+        float const td = d0; d0 = d1; d1 = td; \
+        int const tc = c0; c0 = c1; c1 = tc; \
+    }
+
+// Intersect ray vs 4 children bounds, returns entry distances or INFINITY for misses
+INLINE
+float4 intersect_children(qbvh_node const* node, float3 invdir, float3 oxinvdir, float t_max)
+{
+    // Decode power of two scales directly from exponents,
+    // q * scale is exact so decoded bounds are conservative
+    float const sx = as_float((uint)node->exponent.x << 23);
+    float const sy = as_float((uint)node->exponent.y << 23);
+    float const sz = as_float((uint)node->exponent.z << 23);
+
+    float4 const minx = mad(convert_float4(node->qmin_x), sx, node->origin_x);
+    float4 const miny = mad(convert_float4(node->qmin_y), sy, node->origin_y);
+    float4 const minz = mad(convert_float4(node->qmin_z), sz, node->origin_z);
+    float4 const maxx = mad(convert_float4(node->qmax_x), sx, node->origin_x);
+    float4 const maxy = mad(convert_float4(node->qmax_y), sy, node->origin_y);
+    float4 const maxz = mad(convert_float4(node->qmax_z), sz, node->origin_z);
+
+    float4 const nx = mad(minx, invdir.x, oxinvdir.x);
+    float4 const ny = mad(miny, invdir.y, oxinvdir.y);
+    float4 const nz = mad(minz, invdir.z, oxinvdir.z);
+    float4 const fx = mad(maxx, invdir.x, oxinvdir.x);
+    float4 const fy = mad(maxy, invdir.y, oxinvdir.y);
+    float4 const fz = mad(maxz, invdir.z, oxinvdir.z);
+
+    float4 const t0 = max(max(min(nx, fx), min(ny, fy)), max(min(nz, fz), 0.f));
+    float4 const t1 = min(min(max(nx, fx), max(ny, fy)), min(max(nz, fz), t_max));
+
+    return select((float4)(INFINITY), t0, (t0 <= t1) & (node->child != -1));
+}
+
+// Intersect ray vs faces of a leaf updating closest hit, returns true if hit found
+INLINE
+bool intersect_leaf(
+    GLOBAL Face const* restrict faces,
+    GLOBAL float3 const* restrict vertices,
+    ray const* r,
+    int start,
+    int count,
+    float* t_max,
+    int* isect_idx)
+{
+    bool hit = false;
+
+    for (int i = start; i < start + count; ++i)
+    {
+        Face const face = faces[i];
+        float3 const v1 = vertices[face.idx[0]];
+        float3 const v2 = vertices[face.idx[1]];
+        float3 const v3 = vertices[face.idx[2]];
+
+        // Intersect triangle
+        float const f = fast_intersect_triangle(*r, v1, v2, v3, *t_max);
+        // If hit update closest hit distance and index
+        if (f < *t_max)
+        {
+            *t_max = f;
+            *isect_idx = i;
+            hit = true;
+        }
+    }
+
+    return hit;
+}
+
+// Process node children: intersect leaves and sort internal ones near to far,
+// returns the number of internal children to traverse
+INLINE
+int process_children(
+    qbvh_node const* node,
+    GLOBAL Face const* restrict faces,
+    GLOBAL float3 const* restrict vertices,
+    ray const* r,
+    float3 invdir,
+    float3 oxinvdir,
+    bool any_hit,
+    float* t_max,
+    int* isect_idx,
+    int* children)
+{
+    float4 dist = intersect_children(node, invdir, oxinvdir, *t_max);
+
+    // Leaf children are intersected right away
+    if (dist.x < INFINITY && node->count.x > 0)
+    {
+        if (intersect_leaf(faces, vertices, r, node->child.x, node->count.x, t_max, isect_idx) && any_hit) return -1;
+        dist.x = INFINITY;
+    }
+
+    if (dist.y < INFINITY && node->count.y > 0)
+    {
+        if (intersect_leaf(faces, vertices, r, node->child.y, node->count.y, t_max, isect_idx) && any_hit) return -1;
+        dist.y = INFINITY;
+    }
+
+    if (dist.z < INFINITY && node->count.z > 0)
+    {
+        if (intersect_leaf(faces, vertices, r, node->child.z, node->count.z, t_max, isect_idx) && any_hit) return -1;
+        dist.z = INFINITY;
+    }
+
+    if (dist.w < INFINITY && node->count.w > 0)
+    {
+        if (intersect_leaf(faces, vertices, r, node->child.w, node->count.w, t_max, isect_idx) && any_hit) return -1;
+        dist.w = INFINITY;
+    }
+
+    // Cull internal children behind found hit
+    dist = select(dist, (float4)(INFINITY), dist > *t_max);
+
+    float d0 = dist.x, d1 = dist.y, d2 = dist.z, d3 = dist.w;
+    int c0 = node->child.x, c1 = node->child.y, c2 = node->child.z, c3 = node->child.w;
+
+    // Sorting network for 4 elements
+    SORT2(d0, d1, c0, c1);
+    SORT2(d2, d3, c2, c3);
+    SORT2(d0, d2, c0, c2);
+    SORT2(d1, d3, c1, c3);
+    SORT2(d1, d2, c1, c2);
+
+    children[0] = c0;
+    children[1] = c1;
+    children[2] = c2;
+    children[3] = c3;
+
+    return (d0 < INFINITY) + (d1 < INFINITY) + (d2 < INFINITY) + (d3 < INFINITY);
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void
+occluded_main(
+    // Bvh nodes
+    GLOBAL qbvh_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit results: 1 for hit and -1 for miss
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working set
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest intersection face index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                qbvh_node const node = nodes[addr];
+
+                int children[4];
+                int const num_children = process_children(&node, faces, vertices, &r, invdir, oxinvdir, true, &t_max, &isect_idx, children);
+
+                // Any hit terminates the traversal
+                if (num_children < 0)
+                {
+                    hits[global_id] = HIT_MARKER;
+                    return;
+                }
+
+                if (num_children > 0)
+                {
+                    // Postpone farther children
+                    for (int i = num_children - 1; i > 0; --i)
+                    {
+                        PUSH(children[i]);
+                    }
+
+                    // Continue with the closest one
+                    addr = children[0];
+                    continue;
+                }
+
+                POP(addr);
+            }
+
+            // Finished traversal, but no intersection found
+            hits[global_id] = MISS_MARKER;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void intersect_main(
+    // Bvh nodes
+    GLOBAL qbvh_node const* restrict nodes,
+    // Triangles vertices
+    GLOBAL float3 const* restrict vertices,
+    // Triangle indices
+    GLOBAL Face const* restrict faces,
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays in rays buffer
+    GLOBAL int const* restrict num_rays,
+    // Stack memory
+    GLOBAL int* stack,
+    // Hit data
+    GLOBAL Intersection* hits)
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+    int group_id = get_group_id(0);
+
+    // Handle only working subset
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            // Allocate stack in global memory 
+            __global int* gm_stack_base = stack + (group_id * WAVEFRONT_SIZE + local_id) * GLOBAL_STACK_SIZE;
+            __global int* gm_stack = gm_stack_base;
+            // Allocate stack in LDS
+            __local int lds[SHORT_STACK_SIZE * WAVEFRONT_SIZE];
+            __local int* lm_stack_base = lds + local_id;
+            __local int* lm_stack = lm_stack_base;
+
+            // Precompute inverse direction and origin / dir for bbox testing
+            float3 const invdir = safe_invdir(r);
+            float3 const oxinvdir = -r.o.xyz * invdir;
+            // Intersection parametric distance
+            float t_max = r.o.w;
+
+            // Current node address
+            int addr = 0;
+            // Current closest intersection face index
+            int isect_idx = INVALID_IDX;
+
+            //  Initalize local stack
+            *lm_stack = INVALID_IDX;
+            lm_stack += WAVEFRONT_SIZE;
+
+            // Start from 0 node (root)
+            while (addr != INVALID_IDX)
+            {
+                // Fetch next node
+                qbvh_node const node = nodes[addr];
+
+                int children[4];
+                int const num_children = process_children(&node, faces, vertices, &r, invdir, oxinvdir, false, &t_max, &isect_idx, children);
+
+                if (num_children > 0)
+                {
+                    // Postpone farther children
+                    for (int i = num_children - 1; i > 0; --i)
+                    {
+                        PUSH(children[i]);
+                    }
+
+                    // Continue with the closest one
+                    addr = children[0];
+                    continue;
+                }
+
+                POP(addr);
+            }
+
+            // Check if we have found an intersection
+            if (isect_idx != INVALID_IDX)
+            {
+                // Fetch the face & vertices
+                Face const face = faces[isect_idx];
+                float3 const v1 = vertices[face.idx[0]];
+                float3 const v2 = vertices[face.idx[1]];
+                float3 const v3 = vertices[face.idx[2]];
+                // Calculate hit position
+                float3 const p = r.o.xyz + r.d.xyz * t_max;
+                // Calculte barycentric coordinates
+                float2 const uv = triangle_calculate_barycentrics(p, v1, v2, v3);
+                // Update hit information
+                hits[global_id].shape_id = face.shape_id;
+                hits[global_id].prim_id = face.prim_id;
+                hits[global_id].uvwt = make_float4(uv.x, uv.y, 0.f, t_max);
+            }
+            else
+            {
+                // Miss here
+                hits[global_id].shape_id = MISS_MARKER;
+                hits[global_id].prim_id = MISS_MARKER;
+            }
+        }
+    }
+}
@@ -0,0 +1,153 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file merge_pages.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Pass setup and hit merging kernels of paged geometry queries.
+
+    Paged queries trace a private copy of the rays against one geometry page at a time
+    and merge each pass into the results:
+
+        init_intersect_main / init_occluded_main: copy rays and reset results of active rays
+        merge_intersect_main: keep pass hits and shrink ray maxt to the hit distance
+        merge_occluded_main: keep pass hits and deactivate occluded rays
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void init_intersect_main(
+    // Query rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Rays traced by the passes
+    GLOBAL ray* paged_rays,
+    // Hit data
+    GLOBAL Intersection* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+        paged_rays[global_id] = r;
+
+        // Inactive rays keep their hits untouched as with a single pass
+        if (ray_is_active(&r))
+        {
+            store_miss((GLOBAL int*)hits, global_id, HIT_FORMAT_FULL, 0);
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void init_occluded_main(
+    // Query rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Rays traced by the passes
+    GLOBAL ray* paged_rays,
+    // Hit data
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+        paged_rays[global_id] = r;
+
+        if (ray_is_active(&r))
+        {
+            hits[global_id] = MISS_MARKER;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void merge_intersect_main(
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Rays traced by the passes
+    GLOBAL ray* paged_rays,
+    // Hits of the latest pass
+    GLOBAL Intersection const* restrict pass_hits,
+    // Hit data
+    GLOBAL Intersection* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = paged_rays[global_id];
+
+        // Pass hits of inactive rays are not written by traversal
+        if (ray_is_active(&r) && pass_hits[global_id].shape_id != MISS_MARKER)
+        {
+            Intersection const isect = pass_hits[global_id];
+            hits[global_id] = isect;
+
+            // Pages traced next only report closer hits
+            paged_rays[global_id].o.w = isect.uvwt.w;
+        }
+    }
+}
+
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void merge_occluded_main(
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Rays traced by the passes
+    GLOBAL ray* paged_rays,
+    // Hits of the latest pass
+    GLOBAL int const* restrict pass_hits,
+    // Hit data
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = paged_rays[global_id];
+
+        if (ray_is_active(&r) && pass_hits[global_id] == HIT_MARKER)
+        {
+            hits[global_id] = HIT_MARKER;
+
+            // Occluded rays are done
+            paged_rays[global_id].extra.y = 0;
+        }
+    }
+}
@@ -0,0 +1,241 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/**
+    \file sort_rays.cl
+    \author Dmitry Kozlov
+    \version 1.0
+    \brief Ray reordering kernels.
+
+    Rays are sorted by a key made of the Morton code of the ray origin within
+    the bounds of all the ray origins (high bits) and the Morton code of the ray
+    direction (low bits). Traversal then runs in the sorted order, so that
+    neighbouring work items fetch the same BVH nodes, and hits are scattered
+    back to the original order afterwards.
+
+        bound_rays_main: ray origin bounds using integer atomics
+        calculate_ray_keys_main: sort keys and identity indices
+        radix sort of keys and indices (Calc::Primitives)
+        gather_rays_main: rays in sorted order
+        traversal of sorted rays
+        scatter_hits_main / scatter_occlusion_main: hits in original order
+ */
+
+/*************************************************************************
+INCLUDES
+**************************************************************************/
+#include <../RadeonRays/src/kernels/CL/common.cl>
+
+/*************************************************************************
+DEFINES
+**************************************************************************/
+// Inactive rays go after active ones, unused tail of the buffers goes last,
+// so the first num_rays sorted entries are exactly the rays of the query
+#define INACTIVE_RAY_KEY (1 << 30)
+#define UNUSED_RAY_KEY 0x7FFFFFFF
+
+/*************************************************************************
+FUNCTIONS
+**************************************************************************/
+// Evaluate bounds of active ray origins, bounds are expected
+// to be initialized to {INT_MAX x 3, INT_MIN x 3} 
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void bound_rays_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Origin bounds as ordered ints: min xyz, max xyz
+    GLOBAL int* bounds
+    )
+{
+    int global_id = get_global_id(0);
+    int local_id = get_local_id(0);
+
+    __local int lds_bounds[6];
+
+    if (local_id < 6)
+    {
+        lds_bounds[local_id] = local_id < 3 ? INT_MAX : INT_MIN;
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (global_id < *num_rays)
+    {
+        ray const r = rays[global_id];
+
+        if (ray_is_active(&r))
+        {
+            atomic_min(lds_bounds + 0, float_as_ordered_int(r.o.x));
+            atomic_min(lds_bounds + 1, float_as_ordered_int(r.o.y));
+            atomic_min(lds_bounds + 2, float_as_ordered_int(r.o.z));
+            atomic_max(lds_bounds + 3, float_as_ordered_int(r.o.x));
+            atomic_max(lds_bounds + 4, float_as_ordered_int(r.o.y));
+            atomic_max(lds_bounds + 5, float_as_ordered_int(r.o.z));
+        }
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // One global atomic per component and work group
+    if (local_id < 3)
+    {
+        atomic_min(bounds + local_id, lds_bounds[local_id]);
+    }
+    else if (local_id < 6)
+    {
+        atomic_max(bounds + local_id, lds_bounds[local_id]);
+    }
+}
+
+// Calculate sort keys and initialize ray indices
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void calculate_ray_keys_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Origin bounds as ordered ints
+    GLOBAL int const* restrict bounds,
+    // Number of entries in keys and indices buffers
+    int max_rays,
+    // Sort keys
+    GLOBAL int* keys,
+    // Ray indices
+    GLOBAL int* indices
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < max_rays)
+    {
+        int key = UNUSED_RAY_KEY;
+
+        if (global_id < *num_rays)
+        {
+            ray const r = rays[global_id];
+
+            if (ray_is_active(&r))
+            {
+                float3 const pmin = make_float3(ordered_int_as_float(bounds[0]), ordered_int_as_float(bounds[1]), ordered_int_as_float(bounds[2]));
+                float3 const pmax = make_float3(ordered_int_as_float(bounds[3]), ordered_int_as_float(bounds[4]), ordered_int_as_float(bounds[5]));
+                float3 const extents = pmax - pmin;
+
+                // Degenerate extents map to zero
+                float3 const o = select((r.o.xyz - pmin) / extents, (float3)(0.f), extents <= 0.f);
+                float3 const d = normalize(r.d.xyz) * 0.5f + 0.5f;
+
+                // 6 bits per axis of origin code followed by 4 bits per axis of direction code
+                uint const origin_code = calculate_morton_code(o) >> 12;
+                uint const direction_code = calculate_morton_code(d) >> 18;
+                key = (int)((origin_code << 12) | direction_code);
+            }
+            else
+            {
+                key = INACTIVE_RAY_KEY;
+            }
+        }
+
+        keys[global_id] = key;
+        indices[global_id] = global_id;
+    }
+}
+
+// Reorder rays according to sorted indices
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void gather_rays_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Rays in sorted order
+    GLOBAL ray* sorted_rays
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        sorted_rays[global_id] = rays[indices[global_id]];
+    }
+}
+
+// Move intersections back to the original ray order, hits of inactive
+// rays are left untouched as traversal kernels do
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_hits_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Hits in sorted order
+    GLOBAL Intersection const* restrict sorted_hits,
+    // Hits in original order
+    GLOBAL Intersection* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        int const idx = indices[global_id];
+        ray const r = rays[idx];
+
+        if (ray_is_active(&r))
+        {
+            hits[idx] = sorted_hits[global_id];
+        }
+    }
+}
+
+// Move occlusion results back to the original ray order
+__attribute__((reqd_work_group_size(64, 1, 1)))
+KERNEL void scatter_occlusion_main(
+    // Rays
+    GLOBAL ray const* restrict rays,
+    // Number of rays
+    GLOBAL int const* restrict num_rays,
+    // Sorted ray indices
+    GLOBAL int const* restrict indices,
+    // Occlusion results in sorted order
+    GLOBAL int const* restrict sorted_hits,
+    // Occlusion results in original order
+    GLOBAL int* hits
+    )
+{
+    int global_id = get_global_id(0);
+
+    if (global_id < *num_rays)
+    {
+        int const idx = indices[global_id];
+        ray const r = rays[idx];
+
+        if (ray_is_active(&r))
+        {
+            hits[idx] = sorted_hits[global_id];
+        }
+    }
+}
@@ -0,0 +1,128 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef CURVES_H
+#define CURVES_H
+
+#include <vector>
+#include <algorithm>
+
+#include "shapeimpl.h"
+#include "math/bbox.h"
+#include "math/float3.h"
+
+
+namespace RadeonRays
+{
+    ///< Curves represent a set of round cubic Bezier segments (hair, fur).
+    ///< Each segment references 4 control points, control point radius
+    ///< is kept in w component and interpolated along the segment.
+    ///<
+    class Curves : public ShapeImpl
+    {
+    public:
+        // Control points are x, y, z and radius, indices hold 4 control points per segment
+        Curves(float const* vertices, int vnum, int vstride,
+            int const* indices, int numsegments);
+
+        // Number of segments
+        int num_segments() const;
+        // Control point (radius in w component)
+        float3 GetControlPoint(int i) const;
+        // Control point indices of a segment
+        int const* GetSegment(int i) const;
+        // Object space bounds of all the segments, bounds must hold num_segments() entries
+        void GetAllSegmentBounds(bbox* bounds) const;
+
+        // Curves flag
+        bool is_curves() const;
+    private:
+        /// Disallow to copy curves, too heavy
+        Curves(Curves const& o);
+        Curves& operator = (Curves const& o);
+
+        /// Control points
+        std::vector<float3> vertices_;
+        /// 4 indices per segment
+        std::vector<int> indices_;
+    };
+
+    inline Curves::Curves(float const* vertices, int vnum, int vstride,
+        int const* indices, int numsegments)
+        : vertices_(vnum)
+        , indices_(indices, indices + 4 * numsegments)
+    {
+        // Stride is in bytes
+        vstride = (vstride == 0) ? (4 * sizeof(float)) : vstride;
+
+        for (int i = 0; i < vnum; ++i)
+        {
+            float const* v = reinterpret_cast<float const*>(reinterpret_cast<char const*>(vertices) + i * vstride);
+            vertices_[i] = float3(v[0], v[1], v[2], v[3]);
+        }
+    }
+
+    inline int Curves::num_segments() const
+    {
+        return (int)indices_.size() / 4;
+    }
+
+    inline float3 Curves::GetControlPoint(int i) const
+    {
+        return vertices_[i];
+    }
+
+    inline int const* Curves::GetSegment(int i) const
+    {
+        return &indices_[4 * i];
+    }
+
+    inline void Curves::GetAllSegmentBounds(bbox* bounds) const
+    {
+        // Bezier segment lies within the convex hull of its control points,
+        // which is grown by the largest radius
+        for (int i = 0; i < num_segments(); ++i)
+        {
+            int const* segment = GetSegment(i);
+            float radius = 0.f;
+
+            bounds[i] = bbox();
+
+            for (int j = 0; j < 4; ++j)
+            {
+                float3 const p = vertices_[segment[j]];
+                bounds[i].grow(float3(p.x, p.y, p.z));
+                radius = std::max(radius, p.w);
+            }
+
+            bounds[i].pmin -= float3(radius, radius, radius);
+            bounds[i].pmax += float3(radius, radius, radius);
+        }
+    }
+
+    inline bool Curves::is_curves() const
+    {
+        return true;
+    }
+
+}
+
+#endif // CURVES_H
@@ -0,0 +1,74 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <vector>
+
+#include "shapeimpl.h"
+
+
+namespace RadeonRays
+{
+    ///< Group represents a set of shapes (meshes, instances or other groups)
+    ///< placed with their transforms relative to the group. Groups are
+    ///< placed by their own transform or instanced, which makes hierarchical
+    ///< assets possible without flattening them into the scene.
+    ///<
+    class Group : public ShapeImpl
+    {
+    public:
+        // Constructor
+        Group(Shape const* const* shapes, int numshapes);
+
+        // Get member shapes
+        std::vector<Shape const*> const& GetShapes() const;
+
+        // Group flag
+        bool is_group() const;
+    private:
+        /// Disallow to copy groups
+        Group(Group const& o);
+        Group& operator = (Group const& o);
+
+        /// Member shapes
+        std::vector<Shape const*> shapes_;
+    };
+
+    inline Group::Group(Shape const* const* shapes, int numshapes)
+        : shapes_(shapes, shapes + numshapes)
+    {
+    }
+
+    inline std::vector<Shape const*> const& Group::GetShapes() const
+    {
+        return shapes_;
+    }
+
+    inline bool Group::is_group() const
+    {
+        return true;
+    }
+
+}
+
+#endif // GROUP_H
@@ -0,0 +1,90 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef LOD_GROUP_H
+#define LOD_GROUP_H
+
+#include <vector>
+
+#include "group.h"
+
+
+namespace RadeonRays
+{
+    ///< LOD group keeps its levels as group members, finest first. Rays enter
+    ///< the single level selected by the rule metric against level thresholds,
+    ///< so the group is handled like any other group by everything but traversal.
+    ///<
+    class LodGroup : public Group
+    {
+    public:
+        // Constructor
+        LodGroup(Shape const* const* levels, float const* thresholds, int numlevels, LodRule rule, float transition);
+
+        // Thresholds levels start at, the first one is ignored
+        std::vector<float> const& GetThresholds() const;
+        // Selection rule
+        LodRule GetRule() const;
+        // Relative width of stochastic transitions
+        float GetTransition() const;
+
+        // LOD flag
+        bool is_lod() const;
+    private:
+        /// Level thresholds
+        std::vector<float> thresholds_;
+        /// Selection rule
+        LodRule rule_;
+        /// Transition width
+        float transition_;
+    };
+
+    inline LodGroup::LodGroup(Shape const* const* levels, float const* thresholds, int numlevels, LodRule rule, float transition)
+        : Group(levels, numlevels)
+        , thresholds_(thresholds, thresholds + numlevels)
+        , rule_(rule)
+        , transition_(transition)
+    {
+    }
+
+    inline std::vector<float> const& LodGroup::GetThresholds() const
+    {
+        return thresholds_;
+    }
+
+    inline LodRule LodGroup::GetRule() const
+    {
+        return rule_;
+    }
+
+    inline float LodGroup::GetTransition() const
+    {
+        return transition_;
+    }
+
+    inline bool LodGroup::is_lod() const
+    {
+        return true;
+    }
+
+}
+
+#endif // LOD_GROUP_H
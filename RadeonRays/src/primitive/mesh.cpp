@@ -25,14 +25,92 @@ THE SOFTWARE.
 
 #include <algorithm>
 #include <functional>
+#include <vector>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RR_MESH_SSE 1
+#include <xmmintrin.h>
+#endif
 
 namespace RadeonRays
 {
+    // Faces gathered by a single thread
+    static int const kMinParallelFaces = 4096;
+
+    static bool IsIdentity(matrix const& m)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                if (m.m[i][j] != (i == j ? 1.f : 0.f))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Write bounds of all the faces reading positions through vertex(index)
+    template <typename Vertex>
+    static void GatherFaceBounds(Mesh const& mesh, Vertex const& vertex, bbox* bounds)
+    {
+        int const numfaces = mesh.num_faces();
+
+#pragma omp parallel for if (numfaces >= kMinParallelFaces)
+        for (int i = 0; i < numfaces; ++i)
+        {
+            Mesh::Face const face = mesh.GetFace(i);
+            bool const quad = face.type_ == Mesh::FaceType::QUAD;
+
+#ifdef RR_MESH_SSE
+            // Positions have zero w and operands go in std::min/std::max order
+            // of bbox::grow, so the results match GetFaceBounds
+            float3 const p0 = vertex(face.i0);
+            float3 const p1 = vertex(face.i1);
+            float3 const p2 = vertex(face.i2);
+            __m128 v0 = _mm_loadu_ps(&p0.x);
+            __m128 v1 = _mm_loadu_ps(&p1.x);
+            __m128 v2 = _mm_loadu_ps(&p2.x);
+
+            __m128 pmin = _mm_min_ps(v2, _mm_min_ps(v1, v0));
+            __m128 pmax = _mm_max_ps(v2, _mm_max_ps(v1, v0));
+
+            if (quad)
+            {
+                float3 const p3 = vertex(face.i3);
+                __m128 v3 = _mm_loadu_ps(&p3.x);
+                pmin = _mm_min_ps(v3, pmin);
+                pmax = _mm_max_ps(v3, pmax);
+            }
+
+            _mm_storeu_ps(&bounds[i].pmin.x, pmin);
+            _mm_storeu_ps(&bounds[i].pmax.x, pmax);
+#else
+            bbox b(vertex(face.i0), vertex(face.i1));
+            b.grow(vertex(face.i2));
+
+            if (quad)
+            {
+                b.grow(vertex(face.i3));
+            }
+
+            bounds[i] = b;
+#endif
+        }
+    }
+
     Mesh::Mesh(float const* vertices, int vnum, int vstride,
         int const* vidx, int vistride,
         int const* nfaceverts,
         int nfaces)
-        : puretriangle_(true)
+        : view_vertices_(nullptr)
+        , view_indices_(nullptr)
+        , view_vstride_(0)
+        , view_istride_(0)
+        , num_vertices_(vnum)
+        , num_faces_(nfaces)
+        , puretriangle_(true)
     {
         // Handle vertices
         // Allocate space in advance
@@ -112,16 +190,58 @@ namespace RadeonRays
         }
     }
 
+    Mesh::Mesh(float const* vertices, int vnum, int vstride,
+        int const* vidx, int vistride,
+        int nfaces)
+        : view_vertices_(reinterpret_cast<char const*>(vertices))
+        , view_indices_(reinterpret_cast<char const*>(vidx))
+        , view_vstride_((vstride == 0) ? (3 * sizeof(float)) : vstride)
+        , view_istride_((vistride == 0) ? (3 * sizeof(int)) : vistride)
+        , num_vertices_(vnum)
+        , num_faces_(nfaces)
+        , puretriangle_(true)
+    {
+        ThrowIf(!vertices || !vidx, "Mesh view requires vertex and index memory");
+    }
+
+    void Mesh::UpdateVertices(float const* vertices, int vnum, int vstride)
+    {
+        WaitForOwner();
+        ThrowIf(vnum != num_vertices(), "Vertex count mismatch, topology changes require a new mesh");
+
+        vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
+
+        // Views only need to know where the vertices are now
+        if (view_vertices_)
+        {
+            view_vertices_ = reinterpret_cast<char const*>(vertices);
+            view_vstride_ = vstride;
+            statechange_ |= kStateChangeVertices;
+            return;
+        }
+
+#pragma omp parallel for
+        for (int i = 0; i < vnum; ++i)
+        {
+            float const* current = (float const*)((char*)vertices + i*vstride);
+
+            vertices_[i] = float3(current[0], current[1], current[2]);
+        }
+
+        statechange_ |= kStateChangeVertices;
+    }
+
     int Mesh::GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const
     {
         // origin code special cased identity matrix. TODO check speed regressions
-        outverts[0] = transform_point(vertices_[faces_[faceidx].i0], transform);
-        outverts[1] = transform_point(vertices_[faces_[faceidx].i1], transform);
-        outverts[2] = transform_point(vertices_[faces_[faceidx].i2], transform);
+        Face const face = GetFace(faceidx);
+        outverts[0] = transform_point(GetVertex(face.i0), transform);
+        outverts[1] = transform_point(GetVertex(face.i1), transform);
+        outverts[2] = transform_point(GetVertex(face.i2), transform);
 
-        if (faces_[faceidx].type_ == FaceType::QUAD)
+        if (face.type_ == FaceType::QUAD)
         {
-            outverts[3] = transform_point(vertices_[faces_[faceidx].i3], transform);
+            outverts[3] = transform_point(GetVertex(face.i3), transform);
             return 4;
         } else
         {
@@ -142,6 +262,26 @@ namespace RadeonRays
         }
     }
 
+    void Mesh::GetAllFaceBounds(bool objectspace, bbox* bounds) const
+    {
+        if (objectspace || IsIdentity(worldmat_))
+        {
+            GatherFaceBounds(*this, [this](int i) { return GetVertex(i); }, bounds);
+            return;
+        }
+
+        // Vertices are shared by several faces, so they are transformed once
+        std::vector<float3> vertices(num_vertices_);
+
+#pragma omp parallel for if (num_vertices_ >= kMinParallelFaces)
+        for (int i = 0; i < num_vertices_; ++i)
+        {
+            vertices[i] = transform_point(GetVertex(i), worldmat_);
+        }
+
+        GatherFaceBounds(*this, [&vertices](int i) { return vertices[i]; }, bounds);
+    }
+
     Mesh::~Mesh()
     {
     }
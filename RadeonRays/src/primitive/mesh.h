@@ -36,6 +36,8 @@ namespace RadeonRays
     ///< Transformable primitive implementation which represents
     ///< triangle mesh. Vertices, normals and uvs are indixed separately
     ///< using their own index buffers each.
+    ///< A mesh either owns a copy of its geometry or is a view
+    ///< reading vertices and indices from caller memory with strides.
     ///<
     class Mesh : public ShapeImpl
     {
@@ -68,6 +70,12 @@ namespace RadeonRays
             int const* vidx, int vistride,
             int const* nfaceverts,
             int nfaces);
+
+        // Triangle mesh view of caller memory which has to stay valid
+        // until the mesh is deleted
+        Mesh(float const* vertices, int vnum, int vstride,
+            int const* vidx, int vistride,
+            int nfaces);
         
         //
         ~Mesh();
@@ -77,12 +85,20 @@ namespace RadeonRays
         int num_vertices() const;
         // 
         void GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const;
-        //
-        float3 const* GetVertexData() const { return &vertices_[0]; }
-        //
-        Face const* GetFaceData() const { return &faces_[0]; }
+        // Bounds of all the faces, bounds must hold num_faces() entries
+        void GetAllFaceBounds(bool objectspace, bbox* bounds) const;
+        // Object space vertex position
+        float3 GetVertex(int i) const;
+        // Vertex indices of a face
+        Face GetFace(int i) const;
         // True if the mesh consists of triangles only
         bool puretriangle() const { return puretriangle_;  }
+        // True if geometry is read from caller memory
+        bool is_view() const { return view_vertices_ != nullptr; }
+        // Memory held by vertices and faces copied from the caller, 0 for views
+        std::size_t GetHostBytes() const;
+        // Update vertex positions in place, views start referencing the new vertices
+        void UpdateVertices(float const* vertices, int vnum, int vstride) override;
 
     private:
         /// Disallow to copy meshes, too heavy
@@ -96,6 +112,14 @@ namespace RadeonRays
         std::vector<float3> vertices_;
         /// Primitives
         std::vector<Face> faces_;
+        /// Caller memory of a view (nullptr for meshes owning the data)
+        char const* view_vertices_;
+        char const* view_indices_;
+        int view_vstride_;
+        int view_istride_;
+        /// Element counts
+        int num_vertices_;
+        int num_faces_;
         /// Pure triangle flag
         bool puretriangle_;
     };
@@ -103,13 +127,49 @@ namespace RadeonRays
     //
     inline int Mesh::num_faces() const
     {
-        return (int)faces_.size();
+        return num_faces_;
     }
 
     //
     inline int Mesh::num_vertices() const
     {
-        return (int)vertices_.size();
+        return num_vertices_;
+    }
+
+    inline std::size_t Mesh::GetHostBytes() const
+    {
+        return vertices_.capacity() * sizeof(float3) + faces_.capacity() * sizeof(Face);
+    }
+
+    //
+    inline float3 Mesh::GetVertex(int i) const
+    {
+        if (!view_vertices_)
+        {
+            return vertices_[i];
+        }
+
+        float const* current = reinterpret_cast<float const*>(view_vertices_ + (std::size_t)i * view_vstride_);
+        return float3(current[0], current[1], current[2]);
+    }
+
+    //
+    inline Mesh::Face Mesh::GetFace(int i) const
+    {
+        if (!view_indices_)
+        {
+            return faces_[i];
+        }
+
+        int const* current = reinterpret_cast<int const*>(view_indices_ + (std::size_t)i * view_istride_);
+
+        Face face;
+        face.i0 = current[0];
+        face.i1 = current[1];
+        face.i2 = current[2];
+        face.i3 = 0;
+        face.type_ = FaceType::TRIANGLE;
+        return face;
     }
 }
 
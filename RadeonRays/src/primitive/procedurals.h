@@ -0,0 +1,168 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef PROCEDURALS_H
+#define PROCEDURALS_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "shapeimpl.h"
+#include "math/bbox.h"
+#include "math/float3.h"
+
+
+namespace RadeonRays
+{
+    ///< Procedurals represent a set of analytic primitives (spheres, disks) or custom
+    ///< primitives given by their bounds and intersected by "acc.custom_intersector".
+    ///< Each primitive is kept as two float3 values, interpretation depends on the kind:
+    ///< spheres are center and radius in w, disks add their normal and custom primitives
+    ///< are their bounds.
+    ///<
+    class Procedurals : public ShapeImpl
+    {
+    public:
+        // Primitive kind, matching PROCEDURAL_* in kernels
+        enum Kind
+        {
+            kSpheres = 0,
+            kDisks = 1,
+            kCustom = 2
+        };
+
+        // Spheres are x, y, z and radius, disks x, y, z, radius and normal x, y, z,
+        // custom primitives min x, y, z and max x, y, z (stride is in bytes, 0 means packed)
+        Procedurals(Kind kind, float const* data, int numprims, int stride);
+
+        // Primitive kind
+        Kind GetKind() const;
+        // Number of primitives
+        int num_primitives() const;
+        // Primitive data, 2 values per primitive
+        float3 const* GetPrimitive(int i) const;
+        // Object space bounds of all the primitives, bounds must hold num_primitives() entries
+        void GetAllPrimitiveBounds(bbox* bounds) const;
+
+        // Procedurals flag
+        bool is_procedural() const;
+    private:
+        /// Disallow to copy procedurals, too heavy
+        Procedurals(Procedurals const& o);
+        Procedurals& operator = (Procedurals const& o);
+
+        /// Floats per primitive of the given kind
+        static int GetNumFloats(Kind kind);
+
+        /// Primitive kind
+        Kind kind_;
+        /// 2 values per primitive
+        std::vector<float3> data_;
+    };
+
+    inline int Procedurals::GetNumFloats(Kind kind)
+    {
+        return kind == kSpheres ? 4 : kind == kDisks ? 7 : 6;
+    }
+
+    inline Procedurals::Procedurals(Kind kind, float const* data, int numprims, int stride)
+        : kind_(kind)
+        , data_(2 * numprims)
+    {
+        // Stride is in bytes
+        stride = (stride == 0) ? (GetNumFloats(kind) * sizeof(float)) : stride;
+
+        for (int i = 0; i < numprims; ++i)
+        {
+            float const* p = reinterpret_cast<float const*>(reinterpret_cast<char const*>(data) + i * stride);
+
+            switch (kind)
+            {
+            case kSpheres:
+                data_[2 * i] = float3(p[0], p[1], p[2], p[3]);
+                break;
+            case kDisks:
+                // Normals are normalized here so that kernels don't have to
+                data_[2 * i] = float3(p[0], p[1], p[2], p[3]);
+                data_[2 * i + 1] = normalize(float3(p[4], p[5], p[6]));
+                break;
+            case kCustom:
+                data_[2 * i] = float3(p[0], p[1], p[2]);
+                data_[2 * i + 1] = float3(p[3], p[4], p[5]);
+                break;
+            }
+        }
+    }
+
+    inline Procedurals::Kind Procedurals::GetKind() const
+    {
+        return kind_;
+    }
+
+    inline int Procedurals::num_primitives() const
+    {
+        return (int)data_.size() / 2;
+    }
+
+    inline float3 const* Procedurals::GetPrimitive(int i) const
+    {
+        return &data_[2 * i];
+    }
+
+    inline void Procedurals::GetAllPrimitiveBounds(bbox* bounds) const
+    {
+        for (int i = 0; i < num_primitives(); ++i)
+        {
+            float3 const* p = GetPrimitive(i);
+            float3 const center(p[0].x, p[0].y, p[0].z);
+            float const radius = p[0].w;
+
+            switch (kind_)
+            {
+            case kSpheres:
+                bounds[i] = bbox(center - float3(radius, radius, radius), center + float3(radius, radius, radius));
+                break;
+            case kDisks:
+            {
+                // Disk extent along an axis is radius times the sine of the angle between the axis and the normal
+                float3 const n = p[1];
+                float3 const extent(radius * std::sqrt(std::max(1.f - n.x * n.x, 0.f)),
+                    radius * std::sqrt(std::max(1.f - n.y * n.y, 0.f)),
+                    radius * std::sqrt(std::max(1.f - n.z * n.z, 0.f)));
+                bounds[i] = bbox(center - extent, center + extent);
+                break;
+            }
+            case kCustom:
+                bounds[i] = bbox(p[0], p[1]);
+                break;
+            }
+        }
+    }
+
+    inline bool Procedurals::is_procedural() const
+    {
+        return true;
+    }
+
+}
+
+#endif // PROCEDURALS_H
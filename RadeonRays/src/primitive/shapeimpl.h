@@ -25,9 +25,23 @@ THE SOFTWARE.
 #include "radeon_rays.h"
 #include "math/float3.h"
 #include "math/matrix.h"
+#include "../except/except.h"
 
 namespace RadeonRays
 {
+    ///< Creator of shapes which may read their state on another thread (background commits),
+    ///< shapes wait for it before changing their state
+    ///<
+    class ShapeOwner
+    {
+    public:
+        // Block until the owner no longer reads shape state, errors are left to the owner to report
+        virtual void WaitForShapeAccess() const = 0;
+
+    protected:
+        ~ShapeOwner() {}
+    };
+
     ///< Basic implementation of shape interface capable of handling the state required from
     ///< the API standpoint.
     ///<
@@ -41,7 +55,12 @@ namespace RadeonRays
             kStateChangeTransform = 0x1,
             kStateChangeMotion = 0x2,
             kStateChangeId = 0x4,
-            kStateChangeMask = 0x5
+            kStateChangeMask = 0x8,
+            kStateChangeVertices = 0x10,
+            // Attachment changes, only reported by World::GetChanges
+            kStateChangeAdded = 0x20,
+            kStateChangeRemoved = 0x40,
+            kStateChangeBuildHint = 0x80
         };
         
         // Constructor
@@ -52,6 +71,14 @@ namespace RadeonRays
 
         // This is needed since instances need special API handling
         virtual bool is_instance() const;
+        // Groups are only supported by 2 level BVH
+        virtual bool is_group() const;
+        // Curves are only supported by 2 level BVH
+        virtual bool is_curves() const;
+        // Spheres, disks and custom primitives are only supported by 2 level BVH
+        virtual bool is_procedural() const;
+        // LOD groups are groups traversed by a single selected level
+        virtual bool is_lod() const;
 
         // World space transform
         void SetTransform(matrix const& m, matrix const& minv) override;
@@ -70,6 +97,9 @@ namespace RadeonRays
         
         // Get angular motion
         quaternion GetAngularVelocity() const override;
+
+        // Check if the shape moves during the frame
+        bool HasMotion() const;
         
         // ID of a shape
         void SetId(Id id) override;
@@ -82,27 +112,48 @@ namespace RadeonRays
 
         // Get intersection mask
         int  GetMask() const override;
+
+        // Set bottom level builder hint
+        void SetBuildHint(BuildHint hint) override;
+
+        // Get bottom level builder hint
+        BuildHint GetBuildHint() const override;
+
+        // Vertex update, not supported by default
+        void UpdateVertices(float const* vertices, int vnum, int vstride) override;
         
         // Get state changes since last OnCommit
         int GetStateChange() const;
 
         // Clear state change
         void OnCommit() const;
+
+        // Set the owner setters wait for, nullptr for none
+        void SetOwner(ShapeOwner const* owner);
         
     protected:
+        // Wait for the owner before changing the state
+        void WaitForOwner() const;
+
         // World transform
         matrix worldmat_;
         matrix worldmatinv_;
         float3 linearmotion_;
         quaternion angulrmotion_;
         int mask_;
+        // Bottom level builder hint
+        BuildHint buildhint_;
         // Id
         Id id_;
         // State change
         mutable int statechange_;
+        ShapeOwner const* owner_;
     };
 
     inline ShapeImpl::ShapeImpl()
+        : buildhint_(kBuildHintDefault)
+        , statechange_(kStateChangeNone)
+        , owner_(nullptr)
     {
         SetMask(0xFFFFFFFF);
     }
@@ -111,8 +162,22 @@ namespace RadeonRays
     {
     }
     
+    inline void ShapeImpl::SetOwner(ShapeOwner const* owner)
+    {
+        owner_ = owner;
+    }
+
+    inline void ShapeImpl::WaitForOwner() const
+    {
+        if (owner_)
+        {
+            owner_->WaitForShapeAccess();
+        }
+    }
+
     inline void ShapeImpl::SetTransform(matrix const& m, matrix const& minv)
     {
+        WaitForOwner();
         worldmat_ = m;
         worldmatinv_ = minv;
         statechange_ |= kStateChangeTransform;
@@ -126,6 +191,7 @@ namespace RadeonRays
     
     inline void ShapeImpl::SetLinearVelocity(float3 const& v)
     {
+        WaitForOwner();
         linearmotion_ = v;
         statechange_ |= kStateChangeMotion;
     }
@@ -137,6 +203,7 @@ namespace RadeonRays
     
     inline void ShapeImpl::SetAngularVelocity(quaternion const& q)
     {
+        WaitForOwner();
         angulrmotion_ = q;
         statechange_ |= kStateChangeMotion;
     }
@@ -146,8 +213,15 @@ namespace RadeonRays
         return angulrmotion_;
     }
     
+    inline bool ShapeImpl::HasMotion() const
+    {
+        return linearmotion_.x != 0.f || linearmotion_.y != 0.f || linearmotion_.z != 0.f ||
+            angulrmotion_.x != 0.f || angulrmotion_.y != 0.f || angulrmotion_.z != 0.f;
+    }
+    
     inline void ShapeImpl::SetId(Id id)
     {
+        WaitForOwner();
         id_ = id;
         statechange_ |= kStateChangeId;
     }
@@ -172,8 +246,29 @@ namespace RadeonRays
         return false;
     }
 
+    inline bool ShapeImpl::is_group() const
+    {
+        return false;
+    }
+
+    inline bool ShapeImpl::is_curves() const
+    {
+        return false;
+    }
+
+    inline bool ShapeImpl::is_procedural() const
+    {
+        return false;
+    }
+
+    inline bool ShapeImpl::is_lod() const
+    {
+        return false;
+    }
+
     inline void ShapeImpl::SetMask(int mask)
     {
+        WaitForOwner();
         mask_ = mask;
         statechange_ |= kStateChangeMask;
     }
@@ -182,6 +277,23 @@ namespace RadeonRays
     {
         return mask_;
     }
+
+    inline void ShapeImpl::SetBuildHint(BuildHint hint)
+    {
+        WaitForOwner();
+        buildhint_ = hint;
+        statechange_ |= kStateChangeBuildHint;
+    }
+
+    inline BuildHint ShapeImpl::GetBuildHint() const
+    {
+        return buildhint_;
+    }
+
+    inline void ShapeImpl::UpdateVertices(float const* vertices, int vnum, int vstride)
+    {
+        throw ExceptionImpl("Vertex update is not supported for this shape");
+    }
 }
 
 
@@ -0,0 +1,509 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "bvh_cache.h"
+#include "plain_bvh_translator.h"
+#include "fatnode_bvh_translator.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RadeonRays
+{
+    static char const kMagic[4] = { 'R', 'R', 'B', 'C' };
+
+    static_assert(sizeof(BvhCache::Header) % 16 == 0, "Nodes following the header should stay 16 bytes aligned");
+
+    BvhCache::Entry::Entry()
+        : m_data(nullptr)
+        , m_size(0)
+        , m_mapped(false)
+#ifdef WIN32
+        , m_file(INVALID_HANDLE_VALUE)
+        , m_mapping(nullptr)
+#endif
+    {
+    }
+
+    BvhCache::Entry::~Entry()
+    {
+#ifdef WIN32
+        if (m_data && m_mapped)
+        {
+            UnmapViewOfFile(m_data);
+        }
+
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+        }
+#else
+        if (m_data && m_mapped)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+#endif
+    }
+
+    BvhCache::BuildLock::BuildLock()
+#ifdef WIN32
+        : m_file(INVALID_HANDLE_VALUE)
+#else
+        : m_fd(-1)
+#endif
+    {
+    }
+
+    BvhCache::BuildLock::~BuildLock()
+    {
+#ifdef WIN32
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            OVERLAPPED overlapped = {};
+            UnlockFileEx(m_file, 0, 1, 0, &overlapped);
+            CloseHandle(m_file);
+        }
+#else
+        if (m_fd >= 0)
+        {
+            flock(m_fd, LOCK_UN);
+            close(m_fd);
+        }
+#endif
+    }
+
+    BvhCache::Snapshot::Snapshot()
+        : m_recording(false)
+    {
+    }
+
+    void BvhCache::Snapshot::AddEntry(void const* data)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto entry = static_cast<char const*>(data);
+        m_entries[reinterpret_cast<Header const*>(entry)->key] = entry;
+    }
+
+    void BvhCache::Snapshot::SetRecording(bool recording)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_recording = recording;
+        m_recorded.clear();
+    }
+
+    std::vector<std::vector<char>> BvhCache::Snapshot::GetRecorded() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_recorded;
+    }
+
+    char const* BvhCache::Snapshot::Find(std::uint64_t key) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto iter = m_entries.find(key);
+        return iter != m_entries.end() ? iter->second : nullptr;
+    }
+
+    void BvhCache::Snapshot::Record(Header const& header, void const* nodes, int const* indices)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!m_recording)
+        {
+            return;
+        }
+
+        // Several intersectors of a commit might go through the same entry
+        for (auto const& recorded : m_recorded)
+        {
+            if (reinterpret_cast<Header const*>(recorded.data())->key == header.key)
+            {
+                return;
+            }
+        }
+
+        std::size_t const nodes_size = (std::size_t)header.num_nodes * header.node_size;
+        std::vector<char> entry(GetEntrySize(header));
+        std::memcpy(entry.data(), &header, sizeof(Header));
+        std::memcpy(entry.data() + sizeof(Header), nodes, nodes_size);
+        std::memcpy(entry.data() + sizeof(Header) + nodes_size, indices, (std::size_t)header.num_indices * sizeof(int));
+        m_recorded.push_back(std::move(entry));
+    }
+
+    BvhCache::BvhCache(std::string const& dir, std::shared_ptr<Snapshot> snapshot)
+        : m_dir(dir)
+        , m_snapshot(snapshot)
+    {
+        if (!m_dir.empty() && m_dir.back() != '/' && m_dir.back() != '\\')
+        {
+            m_dir.push_back('/');
+        }
+    }
+
+    std::uint64_t BvhCache::Hash(void const* data, std::size_t size, std::uint64_t seed)
+    {
+        // FNV-1a
+        std::uint64_t hash = seed;
+        auto bytes = static_cast<unsigned char const*>(data);
+
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    std::string BvhCache::GetPath(std::uint64_t key) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.rrbvh", (unsigned long long)key);
+        return m_dir + name;
+    }
+
+    std::string BvhCache::GetLockPath(std::uint64_t key) const
+    {
+        return GetPath(key) + ".lock";
+    }
+
+    BvhCache::Header BvhCache::CreateHeader(std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims,
+        std::uint32_t num_nodes, std::uint32_t num_indices)
+    {
+        Header header;
+        std::memset(&header, 0, sizeof(Header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.layout = layout;
+        header.node_size = node_size;
+        header.key = key;
+        header.num_prims = num_prims;
+        header.num_nodes = num_nodes;
+        header.num_indices = num_indices;
+        return header;
+    }
+
+    std::size_t BvhCache::GetEntrySize(Header const& header)
+    {
+        return sizeof(Header) + (std::size_t)header.num_nodes * header.node_size + (std::size_t)header.num_indices * sizeof(int);
+    }
+
+    bool BvhCache::IsValid(char const* data, std::size_t size, std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims)
+    {
+        // Reject stale, foreign or truncated entries
+        Header const& header = *reinterpret_cast<Header const*>(data);
+
+        return std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+            header.version == kVersion &&
+            header.layout == (std::uint32_t)layout &&
+            header.node_size == node_size &&
+            header.key == key &&
+            header.num_prims == num_prims &&
+            header.num_nodes != 0 &&
+            size == GetEntrySize(header);
+    }
+
+    bool BvhCache::IsConsistent(char const* data)
+    {
+        Header const& header = *reinterpret_cast<Header const*>(data);
+        int const* indices = reinterpret_cast<int const*>(data + sizeof(Header) + (std::size_t)header.num_nodes * header.node_size);
+        float const num_nodes = (float)header.num_nodes;
+
+        // Every primitive is referenced, split trees reference some of them more than once
+        if (header.num_nodes > INT_MAX || header.num_indices > INT_MAX || header.num_indices < header.num_prims)
+        {
+            return false;
+        }
+
+        for (std::uint32_t i = 0; i < header.num_indices; ++i)
+        {
+            if (indices[i] < 0 || (std::uint32_t)indices[i] >= header.num_prims)
+            {
+                return false;
+            }
+        }
+
+        // Children and skip links always come after their nodes, so traversal can't loop.
+        // Addresses are compared as floats first, casting out of range floats is undefined.
+        if (header.layout == kPlain)
+        {
+            auto nodes = reinterpret_cast<PlainBvhTranslator::Node const*>(data + sizeof(Header));
+
+            for (std::uint32_t i = 0; i < header.num_nodes; ++i)
+            {
+                float const next = nodes[i].bounds.pmax.w;
+                float const leaf = nodes[i].bounds.pmin.w;
+
+                if (next != -1.f && !(next > (float)i && next < num_nodes && (std::uint32_t)next > i))
+                {
+                    return false;
+                }
+
+                if (leaf == -1.f)
+                {
+                    // Left child follows its parent, the right one is where the left one skips to
+                    if (i + 1 >= header.num_nodes)
+                    {
+                        return false;
+                    }
+                }
+                else
+                {
+                    // Leaves encode the first index and the number of indices
+                    if (!(leaf >= 0.f && leaf < 2147483648.f))
+                    {
+                        return false;
+                    }
+
+                    std::uint32_t const encoded = (std::uint32_t)leaf;
+                    if ((encoded >> 4) + (encoded & 0xF) > header.num_indices)
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+        else if (header.layout == kFatNode)
+        {
+            auto nodes = reinterpret_cast<FatNodeBvhTranslator::Node const*>(data + sizeof(Header));
+
+            for (std::uint32_t i = 0; i < header.num_nodes; ++i)
+            {
+                auto const& node = nodes[i].s1;
+
+                if (node.child0 == -1)
+                {
+                    // Leaves keep their index until face data is injected
+                    if (node.i0 < 0 || (std::uint32_t)node.i0 >= header.num_indices)
+                    {
+                        return false;
+                    }
+                }
+                else if (node.child0 <= (int)i || (std::uint32_t)node.child0 >= header.num_nodes ||
+                    node.child1 <= (int)i || (std::uint32_t)node.child1 >= header.num_nodes)
+                {
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    std::unique_ptr<BvhCache::Entry> BvhCache::Load(std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims) const
+    {
+        std::unique_ptr<Entry> entry(new Entry());
+
+        // Snapshot entries are used in place, their sizes have been checked against the snapshot file.
+        // Their contents are checked as well, snapshots are loaded from files sent to the remote server.
+        char const* snapshot_data = m_snapshot ? m_snapshot->Find(key) : nullptr;
+        if (snapshot_data && IsValid(snapshot_data, GetEntrySize(*reinterpret_cast<Header const*>(snapshot_data)), key, layout, node_size, num_prims) &&
+            IsConsistent(snapshot_data))
+        {
+            entry->m_data = snapshot_data;
+            entry->m_size = GetEntrySize(entry->GetHeader());
+            m_snapshot->Record(entry->GetHeader(), entry->GetNodes(), entry->GetIndices());
+            return entry;
+        }
+
+        if (m_dir.empty())
+        {
+            return nullptr;
+        }
+
+        std::string path = GetPath(key);
+
+#ifdef WIN32
+        entry->m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (entry->m_file == INVALID_HANDLE_VALUE)
+        {
+            return nullptr;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(entry->m_file, &size) || size.QuadPart < (LONGLONG)sizeof(Header))
+        {
+            return nullptr;
+        }
+
+        entry->m_mapping = CreateFileMappingA(entry->m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!entry->m_mapping)
+        {
+            return nullptr;
+        }
+
+        entry->m_data = static_cast<char const*>(MapViewOfFile(entry->m_mapping, FILE_MAP_READ, 0, 0, 0));
+        entry->m_size = (std::size_t)size.QuadPart;
+        entry->m_mapped = true;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header))
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        void* data = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            return nullptr;
+        }
+
+        entry->m_data = static_cast<char const*>(data);
+        entry->m_size = (std::size_t)st.st_size;
+        entry->m_mapped = true;
+#endif
+
+        if (!entry->m_data)
+        {
+            return nullptr;
+        }
+
+        if (!IsValid(entry->m_data, entry->m_size, key, layout, node_size, num_prims))
+        {
+            return nullptr;
+        }
+
+        if (m_snapshot)
+        {
+            m_snapshot->Record(entry->GetHeader(), entry->GetNodes(), entry->GetIndices());
+        }
+
+        return entry;
+    }
+
+    std::unique_ptr<BvhCache::BuildLock> BvhCache::LockBuild(std::uint64_t key) const
+    {
+        if (m_dir.empty())
+        {
+            return nullptr;
+        }
+
+        std::unique_ptr<BuildLock> lock(new BuildLock());
+        std::string path = GetLockPath(key);
+
+        // Lock files are left in place, removing them would race with processes waiting on them
+#ifdef WIN32
+        lock->m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (lock->m_file == INVALID_HANDLE_VALUE)
+        {
+            return nullptr;
+        }
+
+        OVERLAPPED overlapped = {};
+        if (!LockFileEx(lock->m_file, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped))
+        {
+            return nullptr;
+        }
+#else
+        lock->m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (lock->m_fd < 0)
+        {
+            return nullptr;
+        }
+
+        int status = 0;
+        do
+        {
+            status = flock(lock->m_fd, LOCK_EX);
+        } while (status != 0 && errno == EINTR);
+
+        if (status != 0)
+        {
+            return nullptr;
+        }
+#endif
+
+        return lock;
+    }
+
+    void BvhCache::Store(Header const& header, void const* nodes, int const* indices) const
+    {
+        if (m_snapshot)
+        {
+            m_snapshot->Record(header, nodes, indices);
+        }
+
+        if (m_dir.empty())
+        {
+            return;
+        }
+
+        std::string path = GetPath(header.key);
+        // Write to a temporary file first, so that concurrent readers never see partial entries.
+        // It is named after the process in case writers don't hold the build lock.
+        char suffix[32];
+#ifdef WIN32
+        std::snprintf(suffix, sizeof(suffix), ".%lu.tmp", (unsigned long)GetCurrentProcessId());
+#else
+        std::snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long)getpid());
+#endif
+        std::string tmp_path = path + suffix;
+
+        FILE* file = std::fopen(tmp_path.c_str(), "wb");
+        if (!file)
+        {
+            return;
+        }
+
+        bool ok = std::fwrite(&header, sizeof(Header), 1, file) == 1 &&
+            std::fwrite(nodes, header.node_size, header.num_nodes, file) == header.num_nodes &&
+            std::fwrite(indices, sizeof(int), header.num_indices, file) == header.num_indices;
+
+        ok = (std::fclose(file) == 0) && ok;
+
+        if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(tmp_path.c_str());
+        }
+    }
+}
@@ -0,0 +1,203 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace RadeonRays
+{
+    /// This class stores translated BVH node arrays along with reordered
+    /// primitive indices in a directory, so that they can be memory mapped
+    /// on later runs instead of being rebuilt. Entries are keyed by a hash
+    /// of the data the builder consumes (primitive bounds and build options).
+    /// Processes sharing the directory build each entry once: builders hold
+    /// a per key file lock, the others wait for it and map the stored entry.
+    //
+    class BvhCache
+    {
+    public:
+        // Node layouts, entries are only loaded for the same layout they have been stored with
+        enum Layout
+        {
+            kPlain = 1,
+            kFatNode = 2
+        };
+
+        // Entry file header, the data follows it: nodes first, then indices
+        struct Header
+        {
+            char magic[4];
+            std::uint32_t version;
+            std::uint32_t layout;
+            std::uint32_t node_size;
+            std::uint64_t key;
+            std::uint32_t num_prims;
+            std::uint32_t num_nodes;
+            std::uint32_t num_indices;
+            std::int32_t num_leaves;
+            std::int32_t height;
+            float sah_cost;
+        };
+
+        // Memory mapped cache entry
+        class Entry
+        {
+        public:
+            ~Entry();
+
+            Header const& GetHeader() const;
+            void const* GetNodes() const;
+            int const* GetIndices() const;
+
+        private:
+            Entry();
+            Entry(Entry const&);
+            Entry& operator = (Entry const&);
+
+            char const* m_data;
+            std::size_t m_size;
+            // Entries of snapshots point into memory mapped by the snapshot owner
+            bool m_mapped;
+#ifdef WIN32
+            void* m_file;
+            void* m_mapping;
+#endif
+            friend class BvhCache;
+        };
+
+        // Exclusive lock on building the entry of a key, held until destruction.
+        // It is a lock on a file next to the entry, so it is dropped by the OS
+        // if the process holding it dies.
+        class BuildLock
+        {
+        public:
+            ~BuildLock();
+
+        private:
+            BuildLock();
+            BuildLock(BuildLock const&);
+            BuildLock& operator = (BuildLock const&);
+
+#ifdef WIN32
+            void* m_file;
+#else
+            int m_fd;
+#endif
+            friend class BvhCache;
+        };
+
+        // Entries kept in memory next to the directory. Entries of a loaded scene snapshot
+        // are looked up first, while recording every entry loaded or stored is collected
+        // so that it can be written into a new snapshot.
+        class Snapshot
+        {
+        public:
+            Snapshot();
+
+            // Add an entry (header followed by nodes and indices), the memory has to outlive the snapshot
+            void AddEntry(void const* data);
+            // Collect entries loaded or stored through caches using the snapshot
+            void SetRecording(bool recording);
+            // Entries collected while recording, each one is a header followed by nodes and indices
+            std::vector<std::vector<char>> GetRecorded() const;
+
+        private:
+            friend class BvhCache;
+
+            // Entry data for a key, nullptr if there is none
+            char const* Find(std::uint64_t key) const;
+            void Record(Header const& header, void const* nodes, int const* indices);
+
+            std::unordered_map<std::uint64_t, char const*> m_entries;
+            std::vector<std::vector<char>> m_recorded;
+            bool m_recording;
+            mutable std::mutex m_mutex;
+        };
+
+        // dir should exist, cache files are named after the keys, an empty dir only uses the snapshot
+        explicit BvhCache(std::string const& dir, std::shared_ptr<Snapshot> snapshot = nullptr);
+
+        // Hash a chunk of data, pass the previous result as a seed to hash several chunks
+        static std::uint64_t Hash(void const* data, std::size_t size, std::uint64_t seed = kHashSeed);
+
+        // Map an entry for a given key, nullptr if there is no valid entry
+        std::unique_ptr<Entry> Load(std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims) const;
+
+        // Take the build lock of a key, blocks while another process or cache holds it.
+        // Load again after locking since the entry might have been stored meanwhile.
+        // nullptr if there is no directory or the lock file can't be used.
+        std::unique_ptr<BuildLock> LockBuild(std::uint64_t key) const;
+
+        // Store an entry. Failures are ignored since the cache is only an optimization.
+        void Store(Header const& header, void const* nodes, int const* indices) const;
+
+        // Create a header for a given entry
+        static Header CreateHeader(std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims,
+            std::uint32_t num_nodes, std::uint32_t num_indices);
+
+        // Bump on any node layout or file format change
+        static std::uint32_t const kVersion = 1;
+        static std::uint64_t const kHashSeed = 14695981039346656037ULL;
+
+        // Size of an entry with the header, nodes and indices
+        static std::size_t GetEntrySize(Header const& header);
+
+    private:
+        // Path of the entry file for a given key
+        std::string GetPath(std::uint64_t key) const;
+        // Path of the build lock file for a given key
+        std::string GetLockPath(std::uint64_t key) const;
+        // Check if mapped entry data is a valid entry for the arguments
+        static bool IsValid(char const* data, std::size_t size, std::uint64_t key, Layout layout, std::uint32_t node_size, std::uint32_t num_prims);
+        // Check that the nodes and indices of a valid entry only reference nodes and primitives of the entry,
+        // snapshot entries might have been written by another host
+        static bool IsConsistent(char const* data);
+
+        std::string m_dir;
+        std::shared_ptr<Snapshot> m_snapshot;
+    };
+
+    inline BvhCache::Header const& BvhCache::Entry::GetHeader() const
+    {
+        return *reinterpret_cast<Header const*>(m_data);
+    }
+
+    inline void const* BvhCache::Entry::GetNodes() const
+    {
+        return m_data + sizeof(Header);
+    }
+
+    inline int const* BvhCache::Entry::GetIndices() const
+    {
+        Header const& header = GetHeader();
+        return reinterpret_cast<int const*>(m_data + sizeof(Header) + (std::size_t)header.num_nodes * header.node_size);
+    }
+}
+
+#endif // BVH_CACHE_H
@@ -0,0 +1,77 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "compressed_bvh_translator.h"
+#include "quantized_bounds.h"
+
+#include "../except/except.h"
+#include "../util/trace.h"
+
+namespace RadeonRays
+{
+    void CompressedBvhTranslator::Process(FatNodeBvhTranslator const& translator)
+    {
+        TraceScope trace("CompressedBvhTranslator::Process", "translator");
+        auto const& fatnodes = translator.nodes_;
+        int numnodes = static_cast<int>(fatnodes.size());
+
+        nodes_.resize(numnodes);
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            auto const& fatnode = fatnodes[i];
+            Node& node = nodes_[i];
+
+            if (fatnode.s1.child0 == -1)
+            {
+                node.s1.i0 = fatnode.s1.i0;
+                node.s1.i1 = fatnode.s1.i1;
+                node.s1.i2 = fatnode.s1.i2;
+                node.s1.child0 = -1;
+                node.s1.shape_mask = fatnode.s1.shape_mask;
+                node.s1.shape_id = fatnode.s1.shape_id;
+                node.s1.prim_id = fatnode.s1.prim_id;
+                node.s1.padding = 0;
+                continue;
+            }
+
+            // Fat nodes are laid out breadth first, so siblings are adjacent
+            ThrowIf(fatnode.s1.child1 != fatnode.s1.child0 + 1, "Compressed BVH requires adjacent child nodes");
+
+            bbox const& lb = fatnode.s0.bounds[0];
+            bbox const& rb = fatnode.s0.bounds[1];
+            bbox bounds = bboxunion(lb, rb);
+
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                float const cmin[2] = { lb.pmin[axis], rb.pmin[axis] };
+                float const cmax[2] = { lb.pmax[axis], rb.pmax[axis] };
+
+                node.s0.origin[axis] = bounds.pmin[axis];
+                node.s0.exponent[axis] = QuantizeAxis(bounds.pmin[axis], bounds.pmax[axis] - bounds.pmin[axis],
+                    cmin, cmax, 2, node.s0.qmin[axis], node.s0.qmax[axis]);
+            }
+
+            node.s0.child0 = fatnode.s1.child0;
+            node.s0.exponent[3] = 0;
+        }
+    }
+}
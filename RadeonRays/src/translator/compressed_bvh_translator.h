@@ -0,0 +1,91 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef COMPRESSED_BVH_TRANSLATOR_H
+#define COMPRESSED_BVH_TRANSLATOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "fatnode_bvh_translator.h"
+
+namespace RadeonRays
+{
+    /// Compressed translator packs fat BVH nodes into half of their size:
+    /// * Child bounds are quantized to 8 bits per plane relative to their union
+    /// * Only left child address is stored, right child always follows it
+    /// * Leaves keep face data the same way fat nodes do
+    ///
+    class CompressedBvhTranslator
+    {
+    public:
+        // Compressed fat BVH node, 32 bytes
+        // Encoding:
+        // child0 == -1 if the node is a leaf
+        // Child bounds along axis a are (origin[a] + q * 2^(exponent[a] - 127)), q being quantized value
+        struct Node
+        {
+            union
+            {
+                struct
+                {
+                    // Children union bounds minimum
+                    float origin[3];
+                    // Address of a left child, right one is next to it
+                    int child0;
+                    // Per axis scale exponents (biased by 127), 4th one is unused
+                    std::uint8_t exponent[4];
+                    // Quantized child bounds minimum, [axis][child]
+                    std::uint8_t qmin[3][2];
+                    // Quantized child bounds maximum, [axis][child]
+                    std::uint8_t qmax[3][2];
+                }s0;
+
+                struct
+                {
+                    // If node is a leaf we keep vertex indices here
+                    int i0, i1, i2;
+                    // -1 for leaves
+                    int child0;
+                    // Shape mask
+                    int shape_mask;
+                    // Shape ID
+                    int shape_id;
+                    // Primitive ID
+                    int prim_id;
+                    int padding;
+                }s1;
+            };
+
+            Node()
+                : s1()
+            {
+            }
+        };
+
+        // Pack fat nodes, faces should already be injected
+        void Process(FatNodeBvhTranslator const& translator);
+
+        std::vector<Node> nodes_;
+    };
+}
+
+#endif // COMPRESSED_BVH_TRANSLATOR_H
@@ -24,18 +24,34 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "../util/trace.h"
 
+#include <algorithm>
 #include <cassert>
 #include <queue>
-#include <iostream>
 
 namespace RadeonRays
 {
-    void FatNodeBvhTranslator::Process(Bvh& bvh)
+    // Number of levels of a balanced tree over a given number of leaves
+    static int GetBalancedHeight(int numleaves)
     {
+        int height = 0;
+
+        for (int n = numleaves - 1; n > 0; n >>= 1)
+        {
+            ++height;
+        }
+
+        return height;
+    }
+
+    void FatNodeBvhTranslator::Process(Bvh& bvh, int max_levels)
+    {
+        TraceScope trace("FatNodeBvhTranslator::Process", "translator");
         // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
         nodecnt_ = 0;
         max_idx_ = -1;
+        height_ = 0;
         int newsize = bvh.m_nodecnt;
         nodes_.resize(newsize);
         extra_.resize(newsize);
@@ -45,26 +61,74 @@ namespace RadeonRays
         // Check if we have been initialized
         assert(bvh.m_root);
 
-        // Process root
-        ProcessRootNode(bvh.m_root);
+        // Process root, the limit only matters for trees exceeding it
+        ProcessRootNode(bvh.m_root, max_levels > 0 && bvh.GetHeight() > max_levels ? max_levels : 0);
+
+        nodes_.resize(nodecnt_);
+        extra_.resize(nodecnt_);
+        indices_.resize(nodecnt_);
+        addresses_.resize(nodecnt_);
+    }
+
+    void FatNodeBvhTranslator::Process(Bvh const** bvhs, int const* offsets, int numbvhs)
+    {
+        TraceScope trace("FatNodeBvhTranslator::Process", "translator");
+        // Every tree is translated into its own node count, so the storage is allocated upfront
+        int nodecnt = 0;
+
+        for (int i = 0; i <= numbvhs; ++i)
+        {
+            nodecnt += bvhs[i]->m_nodecnt;
+        }
+
+        nodecnt_ = 0;
+        max_idx_ = -1;
+        height_ = 0;
+        nodes_.resize(nodecnt);
+        extra_.resize(nodecnt);
+        indices_.resize(nodecnt);
+        addresses_.resize(nodecnt);
+        roots_.resize(numbvhs);
+
+        for (int i = 0; i < numbvhs; ++i)
+        {
+            roots_[i] = nodecnt_;
+            ProcessRootNode(bvhs[i]->m_root, 0, offsets[i]);
+        }
+
+        // Top level goes last, so it can be replaced alone
+        root_ = nodecnt_;
+        ProcessRootNode(bvhs[numbvhs]->m_root, 0);
+
+        nodes_.resize(nodecnt_);
+        extra_.resize(nodecnt_);
+        indices_.resize(nodecnt_);
+        addresses_.resize(nodecnt_);
+    }
+
+    void FatNodeBvhTranslator::UpdateTopLevel(Bvh const& bvh)
+    {
+        TraceScope trace("FatNodeBvhTranslator::UpdateTopLevel", "translator");
+
+        nodecnt_ = root_;
+        int newsize = root_ + bvh.m_nodecnt;
+        nodes_.resize(newsize);
+        extra_.resize(newsize);
+        indices_.resize(newsize);
+        addresses_.resize(newsize);
+
+        ProcessRootNode(bvh.m_root, 0);
 
         nodes_.resize(nodecnt_);
         extra_.resize(nodecnt_);
         indices_.resize(nodecnt_);
         addresses_.resize(nodecnt_);
+    }
 
-        // Build a hash
-        //m_hash_map.reset(new PerfectHashMap<int, int>(max_idx_, &indices_[0], &addresses_[0], (int)indices_.size(), -1));
-        //std::cout << "Finished hash building\n";
-
-//#define CONSISTENCY_TEST
-//#ifdef CONSISTENCY_TEST
-//        for (int i = 0; i < indices_.size(); ++i)
-//        {
-//            auto val = (*m_hash_map)[indices_[i]];
-//            assert(val == addresses_[i]);
-//        }
-//#endif
+    void FatNodeBvhTranslator::BuildHashMap(task_scheduler* scheduler)
+    {
+        TraceScope trace("FatNodeBvhTranslator::BuildHashMap", "translator");
+        m_hash_map.reset(new PerfectHashMap<int, int>(max_idx_, &indices_[0], &addresses_[0], (int)indices_.size(), -1, scheduler));
     }
 
     void FatNodeBvhTranslator::InjectIndices(Face const* faces)
@@ -84,50 +148,282 @@ namespace RadeonRays
         }
     }
 
+    void FatNodeBvhTranslator::ClusterTreelets(int treelet_size)
+    {
+        TraceScope trace("FatNodeBvhTranslator::ClusterTreelets", "translator");
+
+        int numnodes = (int)nodes_.size();
+
+        if (numnodes < 3)
+        {
+            return;
+        }
+
+        // Internal node whose children are not placed yet
+        struct Candidate
+        {
+            int node;
+            float area;
+
+            bool operator < (Candidate const& rhs) const
+            {
+                return area < rhs.area;
+            }
+        };
+
+        // New address of each node
+        std::vector<int> addresses(numnodes, -1);
+        int numplaced = 0;
+        addresses[root_] = numplaced++;
+
+        // Internal nodes starting treelets with their children,
+        // the one on top is placed right after the current treelet
+        std::vector<int> roots(1, root_);
+        std::priority_queue<Candidate> candidates;
+        std::vector<Candidate> rest;
+
+        while (!roots.empty())
+        {
+            candidates.push(Candidate{ roots.back(), 0.f });
+            roots.pop_back();
+
+            // Grow the treelet by both children of the largest candidate
+            for (int size = 0; !candidates.empty() && size < treelet_size; size += 2)
+            {
+                int current = candidates.top().node;
+                candidates.pop();
+
+                for (int i = 0; i < 2; ++i)
+                {
+                    int child = i == 0 ? nodes_[current].s1.child0 : nodes_[current].s1.child1;
+                    addresses[child] = numplaced++;
+
+                    if (nodes_[child].s1.child0 != -1)
+                    {
+                        candidates.push(Candidate{ child, nodes_[current].s0.bounds[i].surface_area() });
+                    }
+                }
+            }
+
+            // Remaining candidates start new treelets, larger ones first
+            rest.clear();
+
+            for (; !candidates.empty(); candidates.pop())
+            {
+                rest.push_back(candidates.top());
+            }
+
+            for (auto iter = rest.crbegin(); iter != rest.crend(); ++iter)
+            {
+                roots.push_back(iter->node);
+            }
+        }
+
+        assert(numplaced == numnodes);
+
+        std::vector<Node> nodes(numnodes);
+        std::vector<int> extra(numnodes);
+        std::vector<int> indices(numnodes);
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            int address = addresses[i];
+            nodes[address] = nodes_[i];
+            extra[address] = extra_[i];
+            indices[address] = indices_[i];
+
+            if (nodes_[i].s1.child0 != -1)
+            {
+                nodes[address].s1.child0 = addresses[nodes_[i].s1.child0];
+                nodes[address].s1.child1 = addresses[nodes_[i].s1.child1];
+            }
+        }
+
+        nodes_.swap(nodes);
+        extra_.swap(extra);
+        indices_.swap(indices);
+        root_ = 0;
+
+        for (int i = 0; i < numnodes; ++i)
+        {
+            addresses_[i] = i;
+        }
+    }
+
+    void FatNodeBvhTranslator::GetSubtreeInfo(Bvh::Node const* root, std::unordered_map<Bvh::Node const*, SubtreeInfo>& info) const
+    {
+        // Children follow their parents in preorder, so walking it
+        // backwards visits them first
+        std::vector<Bvh::Node const*> preorder;
+        std::vector<Bvh::Node const*> stack(1, root);
+
+        while (!stack.empty())
+        {
+            auto node = stack.back();
+            stack.pop_back();
+            preorder.push_back(node);
+
+            if (node->type == Bvh::NodeType::kInternal)
+            {
+                stack.push_back(node->rc);
+                stack.push_back(node->lc);
+            }
+        }
+
+        info.reserve(preorder.size());
+
+        for (auto iter = preorder.crbegin(); iter != preorder.crend(); ++iter)
+        {
+            auto node = *iter;
+
+            if (node->type == Bvh::NodeType::kInternal)
+            {
+                auto const& left = info[node->lc];
+                auto const& right = info[node->rc];
+                info[node] = SubtreeInfo{ std::max(left.height, right.height) + 1, left.numleaves + right.numleaves };
+            }
+            else
+            {
+                info[node] = SubtreeInfo{ 0, 1 };
+            }
+        }
+    }
+
+    void FatNodeBvhTranslator::GatherLeaves(Bvh::Node const* root, std::vector<Bvh::Node const*>& leaves) const
+    {
+        std::vector<Bvh::Node const*> stack(1, root);
+
+        while (!stack.empty())
+        {
+            auto node = stack.back();
+            stack.pop_back();
 
-    int FatNodeBvhTranslator::ProcessRootNode(Bvh::Node const* root)
+            if (node->type == Bvh::NodeType::kInternal)
+            {
+                stack.push_back(node->rc);
+                stack.push_back(node->lc);
+            }
+            else
+            {
+                leaves.push_back(node);
+            }
+        }
+    }
+
+    int FatNodeBvhTranslator::ProcessRootNode(Bvh::Node const* root, int max_levels, int offset)
     {
+        // Node to emit: either a node of the tree or a range
+        // of leaves of a subtree rebuilt as a balanced one
+        struct Item
+        {
+            Bvh::Node const* node;
+            // Parent address + 1, negative for right children, 0 for the root
+            int parent;
+            int level;
+            // Index in a complete tree, children of i are 2i and 2i + 1
+            int index;
+            // Range of leaves if node is nullptr
+            int begin;
+            int end;
+        };
+
+        // Subtree heights and sizes are only needed to handle the depth limit
+        std::unordered_map<Bvh::Node const*, SubtreeInfo> info;
+        // Leaves of rebuilt subtrees
+        std::vector<Bvh::Node const*> leaves;
+
+        if (max_levels > 0)
+        {
+            GetSubtreeInfo(root, info);
+            ThrowIf(GetBalancedHeight(info[root].numleaves) > max_levels, "Too many primitives for the BVH depth limit");
+        }
+
         // Keep the nodes to process here
-        std::queue<std::pair<Bvh::Node const*, int> > workqueue;
+        std::queue<Item> workqueue;
 
-        workqueue.push(std::make_pair(root, 0));
+        workqueue.push(Item{ root, 0, 0, 1, 0, 0 });
 
         while (!workqueue.empty())
         {
             auto current = workqueue.front();
             workqueue.pop();
 
+            // Subtree reaching past the limit is kept as is while its children
+            // still fit into the limit when rebuilt, otherwise it is rebuilt here
+            if (current.node && max_levels > 0 && current.node->type == Bvh::NodeType::kInternal)
+            {
+                auto const& subtree = info[current.node];
+
+                if (current.level + subtree.height > max_levels &&
+                    current.level + 1 + GetBalancedHeight(subtree.numleaves) > max_levels)
+                {
+                    current.begin = (int)leaves.size();
+                    GatherLeaves(current.node, leaves);
+                    current.end = (int)leaves.size();
+                    current.node = nullptr;
+                }
+            }
+
+            // Single leaf range is the leaf itself
+            if (!current.node && current.end - current.begin == 1)
+            {
+                current.node = leaves[current.begin];
+            }
+
             Node& node(nodes_[nodecnt_]);
-            indices_[nodecnt_] = current.first->index;
+            indices_[nodecnt_] = current.index;
             addresses_[nodecnt_] = nodecnt_;
             ++nodecnt_;
 
-            if (current.first->index > max_idx_)
+            max_idx_ = std::max(max_idx_, current.index);
+            height_ = std::max(height_, current.level);
+
+            if (!current.node)
             {
-                max_idx_ = current.first->index;
-            }
+                // Split leaves in halves by centroids along the widest axis
+                auto first = leaves.begin() + current.begin;
+                auto last = leaves.begin() + current.end;
+                auto mid = first + (current.end - current.begin) / 2;
+
+                bbox centroids;
+                std::for_each(first, last, [&](Bvh::Node const* leaf) { centroids.grow(leaf->bounds.center()); });
+                int axis = centroids.maxdim();
 
-            if (current.first->type == Bvh::NodeType::kInternal)
+                std::nth_element(first, mid, last, [axis](Bvh::Node const* lhs, Bvh::Node const* rhs)
+                {
+                    return lhs->bounds.center()[axis] < rhs->bounds.center()[axis];
+                });
+
+                node.s0.bounds[0] = bbox();
+                node.s0.bounds[1] = bbox();
+                std::for_each(first, mid, [&](Bvh::Node const* leaf) { node.s0.bounds[0].grow(leaf->bounds); });
+                std::for_each(mid, last, [&](Bvh::Node const* leaf) { node.s0.bounds[1].grow(leaf->bounds); });
+
+                int split = current.begin + (current.end - current.begin) / 2;
+                workqueue.push(Item{ nullptr, nodecnt_, current.level + 1, current.index << 1, current.begin, split });
+                workqueue.push(Item{ nullptr, -nodecnt_, current.level + 1, (current.index << 1) + 1, split, current.end });
+            }
+            else if (current.node->type == Bvh::NodeType::kInternal)
             {
-                node.s0.bounds[0] = current.first->lc->bounds;
-                node.s0.bounds[1] = current.first->rc->bounds;
-                workqueue.push(std::make_pair(current.first->lc, nodecnt_));
-                workqueue.push(std::make_pair(current.first->rc, -nodecnt_));
+                node.s0.bounds[0] = current.node->lc->bounds;
+                node.s0.bounds[1] = current.node->rc->bounds;
+                workqueue.push(Item{ current.node->lc, nodecnt_, current.level + 1, current.index << 1, 0, 0 });
+                workqueue.push(Item{ current.node->rc, -nodecnt_, current.level + 1, (current.index << 1) + 1, 0, 0 });
             }
             else
             {
                 node.s1.child0 = node.s1.child1 = -1;
-                node.s1.i0 = current.first->startidx;
+                node.s1.i0 = current.node->startidx + offset;
             }
 
-            if (current.second > 0)
+            if (current.parent > 0)
             {
-                nodes_[current.second - 1].s1.child0 = nodecnt_ - 1;
+                nodes_[current.parent - 1].s1.child0 = nodecnt_ - 1;
             }
-            else if (current.second < 0)
+            else if (current.parent < 0)
             {
-                nodes_[-current.second - 1].s1.child1 = nodecnt_ - 1;
-            }           
+                nodes_[-current.parent - 1].s1.child1 = nodecnt_ - 1;
+            }
         }
 
         return 0;
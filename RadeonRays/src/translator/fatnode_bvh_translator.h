@@ -23,6 +23,8 @@ THE SOFTWARE.
 #define FATNODE_BVH_TRANSLATOR_H
 
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 #include "radeon_rays.h"
 #include "../accelerator/bvh.h"
@@ -59,6 +61,8 @@ namespace RadeonRays
         FatNodeBvhTranslator()
             : nodecnt_(0)
             , root_(0)
+            , max_idx_(-1)
+            , height_(0)
         {
         }
 
@@ -101,10 +105,22 @@ namespace RadeonRays
         };
 
         void Flush();
-        void Process(Bvh& bvh);
+        // Translate the tree, if max_levels is not 0 subtrees reaching deeper than max_levels
+        // (root is level 0) are rebuilt as balanced ones over their leaves
+        void Process(Bvh& bvh, int max_levels = 0);
         void InjectIndices(Face const* faces);
-        //void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
-        //void UpdateTopLevel(Bvh const& bvh);
+        // Reorder translated nodes into treelets of up to treelet_size nodes grown from
+        // their roots by the largest child surface area, so the nodes a ray is likely to
+        // visit next share cache lines; siblings stay adjacent and the root stays first
+        void ClusterTreelets(int treelet_size);
+        // Build m_hash_map from complete tree indices of the nodes to their addresses,
+        // in parallel if scheduler is not nullptr
+        void BuildHashMap(task_scheduler* scheduler = nullptr);
+        // Translate 2 level BVH: numbvhs bottom level trees with leaf indices offset by offsets
+        // followed by the top level one (bvhs[numbvhs]) starting at root_
+        void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
+        // Retranslate top level tree in place of the previous one, bottom level nodes stay
+        void UpdateTopLevel(Bvh const& bvh);
 
         std::vector<Node> nodes_;
         std::vector<int> extra_;
@@ -115,9 +131,20 @@ namespace RadeonRays
         int root_;
         std::unique_ptr<PerfectHashMap<int, int>> m_hash_map;
         int max_idx_;
+        // Number of levels below the root
+        int height_;
 
     private:
-        int ProcessRootNode(Bvh::Node const* node);
+        // Height and number of leaves of a subtree
+        struct SubtreeInfo
+        {
+            int height;
+            int numleaves;
+        };
+
+        int ProcessRootNode(Bvh::Node const* node, int max_levels, int offset = 0);
+        void GetSubtreeInfo(Bvh::Node const* root, std::unordered_map<Bvh::Node const*, SubtreeInfo>& info) const;
+        void GatherLeaves(Bvh::Node const* root, std::vector<Bvh::Node const*>& leaves) const;
         //int ProcessNode(Bvh::Node const* n, int offset);
 
         FatNodeBvhTranslator(FatNodeBvhTranslator const&);
@@ -24,35 +24,248 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "../util/trace.h"
+#include "math/mathutils.h"
 
+#include <algorithm>
 #include <cassert>
+#include <queue>
 #include <stack>
 #include <iostream>
+#include <unordered_map>
 
 namespace RadeonRays
 {
-    void PlainBvhTranslator::Process(Bvh& bvh)
+    // Trees smaller than this are not worth splitting into tasks
+    static int const kMinParallelNodes = 1 << 16;
+    // Subtrees per thread to balance uneven subtree sizes
+    static int const kSubtreesPerThread = 8;
+
+    void PlainBvhTranslator::Process(Bvh& bvh, task_scheduler* scheduler, RangeCallback const& callback)
     {
-        // WARNING: this is crucial in order for the nodes not to migrate in memory as push_back adds nodes
-        nodecnt_ = 0;
+        TraceScope trace("PlainBvhTranslator::Process", "translator");
         int newsize = bvh.m_nodecnt;
+        nodecnt_ = newsize;
         nodes_.resize(newsize);
         extra_.resize(newsize);
 
         // Check if we have been initialized
         assert(bvh.m_root);
 
-        // Save current root position
-        int rootidx = 0;
+        if (!scheduler || newsize < kMinParallelNodes)
+        {
+            ProcessSubtree(bvh.m_root, 0, -1);
 
-        // Process root
-        ProcessNode(bvh.m_root);
+            if (callback)
+            {
+                callback(0, newsize);
+            }
+
+            return;
+        }
+
+        // Cut the tree at a depth giving enough subtrees to keep the threads busy,
+        // nodes above the cut are translated here once the subtree sizes are known
+        int maxdepth = 0;
+
+        while ((1 << maxdepth) < kSubtreesPerThread * scheduler->num_threads() && maxdepth < 16)
+        {
+            ++maxdepth;
+        }
+
+        struct Subtree
+        {
+            Bvh::Node const* root;
+            int first;
+            int next;
+            int count;
+        };
+
+        std::vector<Subtree> subtrees;
+        std::vector<Bvh::Node const*> topnodes;
+        std::vector<std::pair<Bvh::Node const*, int>> stack(1, std::make_pair(bvh.m_root, 0));
+
+        while (!stack.empty())
+        {
+            auto current = stack.back();
+            stack.pop_back();
+
+            if (current.second == maxdepth)
+            {
+                subtrees.push_back(Subtree{ current.first, 0, 0, 0 });
+            }
+            else
+            {
+                topnodes.push_back(current.first);
+
+                if (current.first->type == Bvh::kInternal)
+                {
+                    stack.push_back(std::make_pair(current.first->rc, current.second + 1));
+                    stack.push_back(std::make_pair(current.first->lc, current.second + 1));
+                }
+            }
+        }
+
+        // Count subtree nodes
+        parallel_for(*scheduler, 0, (int)subtrees.size(), 1, [&](int i)
+        {
+            std::vector<Bvh::Node const*> nodes(1, subtrees[i].root);
+
+            while (!nodes.empty())
+            {
+                auto node = nodes.back();
+                nodes.pop_back();
+                ++subtrees[i].count;
+
+                if (node->type == Bvh::kInternal)
+                {
+                    nodes.push_back(node->lc);
+                    nodes.push_back(node->rc);
+                }
+            }
+        });
+
+        // Sizes of nodes above the cut, children follow their parents in topnodes
+        std::unordered_map<Bvh::Node const*, int> sizes;
+        std::unordered_map<Bvh::Node const*, Subtree*> cut;
+
+        for (auto& subtree : subtrees)
+        {
+            sizes[subtree.root] = subtree.count;
+            cut[subtree.root] = &subtree;
+        }
+
+        for (auto iter = topnodes.crbegin(); iter != topnodes.crend(); ++iter)
+        {
+            auto node = *iter;
+            sizes[node] = node->type == Bvh::kInternal ? 1 + sizes[node->lc] + sizes[node->rc] : 1;
+        }
+
+        // Lay out the nodes above the cut with their skip links and place the subtrees
+        // between them, runs of consecutive nodes above the cut are reported together
+        std::vector<std::pair<int, int>> runs;
+
+        struct Item
+        {
+            Bvh::Node const* node;
+            int idx;
+            int next;
+        };
+
+        std::vector<Item> items(1, Item{ bvh.m_root, 0, -1 });
+
+        while (!items.empty())
+        {
+            auto current = items.back();
+            items.pop_back();
+
+            auto subtree = cut.find(current.node);
+
+            if (subtree != cut.end())
+            {
+                subtree->second->first = current.idx;
+                subtree->second->next = current.next;
+                continue;
+            }
+
+            Node& node = nodes_[current.idx];
+            node.bounds = current.node->bounds;
+            node.bounds.pmax.w = (float)current.next;
+
+            if (current.node->type == Bvh::kLeaf)
+            {
+                extra_[current.idx] = (current.node->startidx << 4) | (current.node->numprims & 0xF);
+                node.bounds.pmin.w = (float)extra_[current.idx];
+            }
+            else
+            {
+                int right = current.idx + 1 + sizes[current.node->lc];
+                node.bounds.pmin.w = -1.f;
+                items.push_back(Item{ current.node->rc, right, current.next });
+                items.push_back(Item{ current.node->lc, current.idx + 1, right });
+            }
+
+            if (!runs.empty() && runs.back().first + runs.back().second == current.idx)
+            {
+                ++runs.back().second;
+            }
+            else
+            {
+                runs.push_back(std::make_pair(current.idx, 1));
+            }
+        }
+
+        if (callback)
+        {
+            for (auto const& run : runs)
+            {
+                callback(run.first, run.second);
+            }
+        }
+
+        // Translate the subtrees
+        parallel_for(*scheduler, 0, (int)subtrees.size(), 1, [&](int i)
+        {
+            auto const& subtree = subtrees[i];
+            ProcessSubtree(subtree.root, subtree.first, subtree.next);
+
+            if (callback)
+            {
+                callback(subtree.first, subtree.count);
+            }
+        });
+    }
+
+    void PlainBvhTranslator::Build(Bvh& bvh, bbox const* bounds, int numbounds)
+    {
+        static_assert(sizeof(Node) == sizeof(bbox), "Flat build writes nodes as boxes");
+
+        nodecnt_ = 2 * numbounds - 1;
+        root_ = 0;
+        nodes_.resize(nodecnt_);
+        // Leaf data is encoded in the nodes only
+        extra_.clear();
+
+        bvh.BuildFlat(bounds, numbounds, &nodes_[0].bounds);
+    }
+
+    int PlainBvhTranslator::ProcessSubtree(Bvh::Node const* root, int first, int next)
+    {
+        // Lay the nodes out depth first keeping right child addresses in pmin.w
+        // until the skip links are set, the pairs hold the parent of a right child
+        int count = 0;
+        std::vector<std::pair<Bvh::Node const*, int>> stack(1, std::make_pair(root, -1));
+
+        while (!stack.empty())
+        {
+            auto current = stack.back();
+            stack.pop_back();
+
+            int idx = first + count++;
+            Node& node = nodes_[idx];
+            node.bounds = current.first->bounds;
+
+            if (current.second >= 0)
+            {
+                nodes_[current.second].bounds.pmin.w = (float)idx;
+            }
+
+            if (current.first->type == Bvh::kLeaf)
+            {
+                extra_[idx] = (current.first->startidx << 4) | (current.first->numprims & 0xF);
+                node.bounds.pmin.w = -1.f;
+            }
+            else
+            {
+                stack.push_back(std::make_pair(current.first->rc, idx));
+                stack.push_back(std::make_pair(current.first->lc, -1));
+            }
+        }
 
         // Set next ptr
-        nodes_[rootidx].bounds.pmax.w = -1;
+        nodes_[first].bounds.pmax.w = (float)next;
 
-        //
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
+        for (int i = first; i < first + count; ++i)
         {
             if (nodes_[i].bounds.pmin.w != -1.f)
             {
@@ -61,7 +274,7 @@ namespace RadeonRays
             }
         }
 
-        for (int i = rootidx; i < (int)nodes_.size(); ++i)
+        for (int i = first; i < first + count; ++i)
         {
             if (nodes_[i].bounds.pmin.w == -1.f)
             {
@@ -72,11 +285,88 @@ namespace RadeonRays
                 nodes_[i].bounds.pmin.w = -1.f;
             }
         }
+
+        return count;
+    }
+
+    void PlainBvhTranslator::CreateOrderedLayouts(Node const* nodes, int numnodes, std::vector<Node>& layouts)
+    {
+        TraceScope trace("PlainBvhTranslator::CreateOrderedLayouts", "translator");
+        layouts.resize(kNumOrderedLayouts * numnodes);
+
+        // Children follow their parents, so subtree sizes are gathered backwards. Right child
+        // is where the left one skips to, the first child for positive directions is kept in order
+        std::vector<int> sizes(numnodes, 1);
+        std::vector<int> rightchild(numnodes, -1);
+        std::vector<int> axis(numnodes, 0);
+        std::vector<char> swapped(numnodes, 0);
+
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            if (nodes[i].bounds.pmin.w != -1.f)
+            {
+                continue;
+            }
+
+            int const lc = i + 1;
+            int const rc = (int)nodes[lc].bounds.pmax.w;
+            float3 const lcenter = nodes[lc].bounds.center();
+            float3 const rcenter = nodes[rc].bounds.center();
+
+            sizes[i] = 1 + sizes[lc] + sizes[rc];
+            rightchild[i] = rc;
+            axis[i] = bbox(lcenter, rcenter).maxdim();
+            swapped[i] = rcenter[axis[i]] < lcenter[axis[i]] ? 1 : 0;
+        }
+
+        struct Item
+        {
+            int node;
+            int idx;
+            int next;
+        };
+
+        for (int octant = 0; octant < kNumOrderedLayouts; ++octant)
+        {
+            std::vector<Item> items(1, Item{ 0, 0, -1 });
+
+            while (!items.empty())
+            {
+                auto current = items.back();
+                items.pop_back();
+
+                Node& node = layouts[kNumOrderedLayouts * current.idx + octant];
+                node.bounds = nodes[current.node].bounds;
+                node.bounds.pmax.w = (float)current.next;
+
+                if (rightchild[current.node] < 0)
+                {
+                    continue;
+                }
+
+                // Near child goes first: the one with smaller centroid for positive directions
+                bool const negative = ((octant >> axis[current.node]) & 1) != 0;
+                int first = current.node + 1;
+                int second = rightchild[current.node];
+
+                if (negative != (swapped[current.node] != 0))
+                {
+                    std::swap(first, second);
+                }
+
+                int const secondidx = current.idx + 1 + sizes[first];
+                items.push_back(Item{ second, secondidx, current.next });
+                items.push_back(Item{ first, current.idx + 1, secondidx });
+            }
+        }
     }
 
     void PlainBvhTranslator::UpdateTopLevel(Bvh const& bvh)
     {
+        // Bottom level nodes are kept, top level might have changed its size
         nodecnt_ = root_;
+        nodes_.resize(root_ + bvh.m_nodecnt);
+        extra_.resize(root_ + bvh.m_nodecnt);
 
         // Process root
         ProcessNode(bvh.m_root);
@@ -107,8 +397,106 @@ namespace RadeonRays
 
     }
 
+    void PlainBvhTranslator::OpenSubtrees(Bvh const* const* bvhs, matrix const* transforms, bbox const* bounds,
+        int numshapes, int maxnum, std::vector<Subtree>& subtrees)
+    {
+        TraceScope trace("PlainBvhTranslator::OpenSubtrees", "translator");
+
+        struct Candidate
+        {
+            Subtree subtree;
+            float area;
+            Bvh::Node const* node;
+
+            bool operator < (Candidate const& rhs) const
+            {
+                return area < rhs.area;
+            }
+        };
+
+        // Node counts of left subtrees give right child offsets, instances share them
+        std::unordered_map<Bvh::Node const*, int> sizes;
+        auto get_size = [&sizes](Bvh::Node const* root)
+        {
+            auto iter = sizes.find(root);
+
+            if (iter != sizes.cend())
+            {
+                return iter->second;
+            }
+
+            int count = 0;
+            std::vector<Bvh::Node const*> nodes(1, root);
+
+            while (!nodes.empty())
+            {
+                auto node = nodes.back();
+                nodes.pop_back();
+                ++count;
+
+                if (node->type == Bvh::kInternal)
+                {
+                    nodes.push_back(node->lc);
+                    nodes.push_back(node->rc);
+                }
+            }
+
+            sizes[root] = count;
+            return count;
+        };
+
+        subtrees.clear();
+        std::priority_queue<Candidate> candidates;
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            Subtree const subtree{ bounds[i], i, 0 };
+
+            if (bvhs[i] && bvhs[i]->m_root)
+            {
+                candidates.push(Candidate{ subtree, bounds[i].surface_area(), bvhs[i]->m_root });
+            }
+            else
+            {
+                subtrees.push_back(subtree);
+            }
+        }
+
+        int numsubtrees = numshapes;
+
+        while (!candidates.empty())
+        {
+            auto current = candidates.top();
+            candidates.pop();
+
+            if (numsubtrees < maxnum && current.node->type == Bvh::kInternal)
+            {
+                auto const& m = transforms[current.subtree.shape];
+                bbox const lbounds = transform_bbox(current.node->lc->bounds, m);
+                bbox const rbounds = transform_bbox(current.node->rc->bounds, m);
+                float const larea = lbounds.surface_area();
+                float const rarea = rbounds.surface_area();
+
+                if (larea + rarea < current.area)
+                {
+                    // Left child follows its parent and the right one follows the left subtree
+                    int const loffset = current.subtree.offset + 1;
+                    int const roffset = loffset + get_size(current.node->lc);
+
+                    candidates.push(Candidate{ Subtree{ lbounds, current.subtree.shape, loffset }, larea, current.node->lc });
+                    candidates.push(Candidate{ Subtree{ rbounds, current.subtree.shape, roffset }, rarea, current.node->rc });
+                    ++numsubtrees;
+                    continue;
+                }
+            }
+
+            subtrees.push_back(current.subtree);
+        }
+    }
+
     void PlainBvhTranslator::Process(Bvh const** bvhs, int const* offsets, int numbvhs)
     {
+        TraceScope trace("PlainBvhTranslator::Process", "translator");
         // First of all count the number of required nodes for all BVH's
         int nodecnt = 0;
         for (int i = 0; i < numbvhs + 1; ++i)
@@ -167,6 +555,12 @@ namespace RadeonRays
         // The final one
         root_ = nodecnt_;
 
+        // Top level might be built elsewhere (on the device)
+        if (!bvhs[numbvhs])
+        {
+            return;
+        }
+
         // Process root
         ProcessNode(bvhs[numbvhs]->m_root);
 
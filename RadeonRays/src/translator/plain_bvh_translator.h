@@ -22,10 +22,12 @@ THE SOFTWARE.
 #ifndef PLAIN_BVH_TRANSLATOR_H
 #define PLAIN_BVH_TRANSLATOR_H
 
+#include <functional>
 #include <map>
 
 #include "radeon_rays.h"
 #include "../accelerator/bvh.h"
+#include "../async/task_scheduler.h"
 
 #include "math/matrix.h"
 #include "math/quaternion.h"
@@ -53,11 +55,47 @@ namespace RadeonRays
             bbox bounds;
         };
 
+        // Receives ranges of nodes which are final, possibly from several threads at once
+        typedef std::function<void(int first, int count)> RangeCallback;
+
         void Flush();
-        void Process(Bvh& bvh);
+        // Translate the tree, subtrees are translated in parallel if scheduler is not nullptr
+        // and each finished range of nodes is passed to callback right away (e.g. to upload it)
+        void Process(Bvh& bvh, task_scheduler* scheduler = nullptr, RangeCallback const& callback = nullptr);
+        // Build bvh straight into nodes_ skipping the pointer tree and translation,
+        // bvh has to have single primitive leaves (see Bvh::BuildFlat)
+        void Build(Bvh& bvh, bbox const* bounds, int numbounds);
         void Process(Bvh const** bvhs, int const* offsets, int numbvhs);
         void UpdateTopLevel(Bvh const& bvh);
 
+        // Subtree of a bottom level BVH placed into the world by a shape transform
+        struct Subtree
+        {
+            // World space bounds of the subtree
+            bbox bounds;
+            // Index of the shape placing the BVH
+            int shape;
+            // Offset of the subtree root from the BVH root in the skip links layout
+            int offset;
+        };
+
+        // Open bottom level BVHs of shapes into subtrees for a top level build (rebraiding).
+        // Starting with whole trees bounded by bounds, the subtree with the largest world
+        // space surface area is replaced by its children while their surface areas add up
+        // to less than its own and there are less than maxnum subtrees. Shapes with nullptr
+        // BVHs are never opened.
+        static void OpenSubtrees(Bvh const* const* bvhs, matrix const* transforms, bbox const* bounds,
+            int numshapes, int maxnum, std::vector<Subtree>& subtrees);
+
+        // Number of direction ordered layouts, one per ray direction octant
+        static int const kNumOrderedLayouts = 8;
+
+        // Lay out skip links nodes once per ray direction octant so that the child nearer along
+        // the axis separating child centroids the most comes first. Layouts are interleaved:
+        // node i of the layout of octant o (bit k set for negative direction component k) is
+        // layouts[kNumOrderedLayouts * i + o], links are node indices within the layout.
+        static void CreateOrderedLayouts(Node const* nodes, int numnodes, std::vector<Node>& layouts);
+
         std::vector<Node> nodes_;
         std::vector<int>  extra_;
         std::vector<int>  roots_;
@@ -67,6 +105,9 @@ namespace RadeonRays
     private:
         int ProcessNode(Bvh::Node const* node);
         int ProcessNode(Bvh::Node const* n, int offset);
+        // Translate a subtree on the calling thread into nodes starting at first,
+        // next is the skip link of the subtree root, returns the number of nodes
+        int ProcessSubtree(Bvh::Node const* root, int first, int next);
 
         PlainBvhTranslator(PlainBvhTranslator const&);
         PlainBvhTranslator& operator =(PlainBvhTranslator const&);
@@ -0,0 +1,168 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "qbvh_translator.h"
+#include "quantized_bounds.h"
+
+#include "../except/except.h"
+#include "../util/trace.h"
+
+#include <algorithm>
+#include <cassert>
+#include <stack>
+
+namespace RadeonRays
+{
+    void QbvhTranslator::Process(Bvh const& bvh)
+    {
+        TraceScope trace("QbvhTranslator::Process", "translator");
+        // Check if we have been initialized
+        assert(bvh.m_root);
+
+        struct StackEntry
+        {
+            // Binary node to collapse
+            Bvh::Node const* node;
+            // Address of the wide node to emit
+            int addr;
+            // Level of the wide node
+            int level;
+        };
+
+        nodes_.clear();
+        height_ = 0;
+
+        // Wide tree has at most as many nodes as there are internal binary ones
+        nodes_.reserve(std::max(bvh.GetNodeCount() / 2, 1));
+        nodes_.emplace_back();
+
+        std::stack<StackEntry> stack;
+        stack.push(StackEntry{ bvh.m_root, 0, 1 });
+
+        while (!stack.empty())
+        {
+            StackEntry current = stack.top();
+            stack.pop();
+
+            height_ = std::max(height_, current.level);
+
+            Bvh::Node const* children[kWidth];
+            int num_children = CollapseNode(current.node, children);
+
+            Node node;
+            QuantizeBounds(current.node->bounds, children, num_children, node);
+
+            for (int i = 0; i < kWidth; ++i)
+            {
+                node.child[i] = -1;
+                node.count[i] = 0;
+            }
+
+            for (int i = 0; i < num_children; ++i)
+            {
+                if (children[i]->type == Bvh::NodeType::kLeaf)
+                {
+                    ThrowIf(children[i]->numprims <= 0 || children[i]->numprims > 255,
+                        "qbvh leaves should contain from 1 to 255 primitives");
+
+                    node.child[i] = children[i]->startidx;
+                    node.count[i] = static_cast<std::uint8_t>(children[i]->numprims);
+                }
+                else
+                {
+                    node.child[i] = static_cast<int>(nodes_.size());
+                    nodes_.emplace_back();
+                    stack.push(StackEntry{ children[i], node.child[i], current.level + 1 });
+                }
+            }
+
+            node.padding = 0;
+            nodes_[current.addr] = node;
+        }
+    }
+
+    int QbvhTranslator::CollapseNode(Bvh::Node const* node, Bvh::Node const** children)
+    {
+        // Single leaf tree: root is the only child
+        if (node->type == Bvh::NodeType::kLeaf)
+        {
+            children[0] = node;
+            return 1;
+        }
+
+        children[0] = node->lc;
+        children[1] = node->rc;
+        int num_children = 2;
+
+        while (num_children < kWidth)
+        {
+            // Open internal child with the largest surface area
+            int best = -1;
+            float best_area = -1.f;
+            for (int i = 0; i < num_children; ++i)
+            {
+                if (children[i]->type == Bvh::NodeType::kInternal &&
+                    children[i]->bounds.surface_area() > best_area)
+                {
+                    best = i;
+                    best_area = children[i]->bounds.surface_area();
+                }
+            }
+
+            if (best == -1)
+                break;
+
+            Bvh::Node const* opened = children[best];
+            children[best] = opened->lc;
+            children[num_children++] = opened->rc;
+        }
+
+        return num_children;
+    }
+
+    void QbvhTranslator::QuantizeBounds(bbox const& bounds, Bvh::Node const* const* children, int num_children, Node& node)
+    {
+        node.exponent[3] = 0;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            float cmin[kWidth];
+            float cmax[kWidth];
+
+            for (int i = 0; i < num_children; ++i)
+            {
+                cmin[i] = children[i]->bounds.pmin[axis];
+                cmax[i] = children[i]->bounds.pmax[axis];
+            }
+
+            node.origin[axis] = bounds.pmin[axis];
+            node.exponent[axis] = QuantizeAxis(bounds.pmin[axis], bounds.pmax[axis] - bounds.pmin[axis],
+                cmin, cmax, num_children, node.qmin[axis], node.qmax[axis]);
+
+            // Empty slots are never traversed, keep them degenerate
+            for (int i = num_children; i < kWidth; ++i)
+            {
+                node.qmin[axis][i] = 0;
+                node.qmax[axis][i] = 0;
+            }
+        }
+    }
+}
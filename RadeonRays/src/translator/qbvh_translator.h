@@ -0,0 +1,85 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef QBVH_TRANSLATOR_H
+#define QBVH_TRANSLATOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "radeon_rays.h"
+#include "../accelerator/bvh.h"
+
+namespace RadeonRays
+{
+    /// This class collapses binary BVH into 4-wide one and translates it into
+    /// compressed nodes. Child bounds are quantized to 8 bits per plane relative
+    /// to parent bounds (with power of two per axis scales), so a node with
+    /// four children fits into a single 64 bytes cache line.
+    /// Leaf children reference ranges of reordered primitives directly,
+    /// so no separate leaf nodes exist.
+    ///
+    class QbvhTranslator
+    {
+    public:
+        // Branching factor
+        static int const kWidth = 4;
+
+        // Compressed 4-wide node, layout must match kernels
+        // Child bounds along axis a are (origin[a] + q * 2^(exponent[a] - 127)), q being quantized value
+        struct Node
+        {
+            // Internal children: node addresses, leaf children: first primitive index, -1 for empty slots
+            int child[kWidth];
+            // Node bounds minimum
+            float origin[3];
+            // Per axis scale exponents (biased by 127), 4th one is unused
+            std::uint8_t exponent[4];
+            // Quantized child bounds minimum, [axis][child]
+            std::uint8_t qmin[3][kWidth];
+            // Number of primitives for leaf children, 0 for internal ones
+            std::uint8_t count[kWidth];
+            // Quantized child bounds maximum, [axis][child]
+            std::uint8_t qmax[3][kWidth];
+            int padding;
+        };
+
+        // Constructor
+        QbvhTranslator()
+            : height_(0)
+        {
+        }
+
+        void Process(Bvh const& bvh);
+
+        std::vector<Node> nodes_;
+        // Number of levels in collapsed tree
+        int height_;
+
+    private:
+        // Find up to kWidth descendants to replace a node with, largest internal ones are opened first
+        static int CollapseNode(Bvh::Node const* node, Bvh::Node const** children);
+        // Quantize child bounds conservatively relative to parent bounds
+        static void QuantizeBounds(bbox const& bounds, Bvh::Node const* const* children, int num_children, Node& node);
+    };
+}
+
+#endif // QBVH_TRANSLATOR_H
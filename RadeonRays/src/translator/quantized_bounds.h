@@ -0,0 +1,86 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef QUANTIZED_BOUNDS_H
+#define QUANTIZED_BOUNDS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "../except/except.h"
+
+namespace RadeonRays
+{
+    /// Quantize child bounds along one axis to 8 bits relative to parent bounds minimum.
+    /// Decoded bounds are (origin + q * 2^(exponent - 127)): the scale is a power of two,
+    /// so q * scale is exact and decoding rounds only once, which keeps bounds conservative
+    /// as long as kernels do a single rounding (mad or fma) as well.
+    /// Returns biased exponent of the scale.
+    ///
+    inline std::uint8_t QuantizeAxis(float origin, float extent,
+        float const* cmin, float const* cmax, int count,
+        std::uint8_t* qmin, std::uint8_t* qmax)
+    {
+        // Smallest power of two scale covering the extent with 255 steps
+        int exp = 0;
+        std::frexp(extent / 255.f, &exp);
+        int biased = std::min(std::max(exp + 127, 1), 254);
+
+        while (true)
+        {
+            float scale = std::ldexp(1.f, biased - 127);
+            bool fits = true;
+
+            for (int i = 0; i < count; ++i)
+            {
+                // Round down for minimum and up for maximum, then fix
+                // possible rounding errors of the decoding
+                int lo = std::max(static_cast<int>(std::floor((cmin[i] - origin) / scale)), 0);
+                while (lo > 0 && origin + lo * scale > cmin[i])
+                    --lo;
+
+                int hi = std::max(static_cast<int>(std::ceil((cmax[i] - origin) / scale)), 0);
+                while (hi <= 255 && origin + hi * scale < cmax[i])
+                    ++hi;
+
+                if (lo > 255 || hi > 255)
+                {
+                    fits = false;
+                    break;
+                }
+
+                qmin[i] = static_cast<std::uint8_t>(lo);
+                qmax[i] = static_cast<std::uint8_t>(hi);
+            }
+
+            if (fits)
+                break;
+
+            ThrowIf(biased >= 254, "Node bounds can't be quantized");
+            ++biased;
+        }
+
+        return static_cast<std::uint8_t>(biased);
+    }
+}
+
+#endif // QUANTIZED_BOUNDS_H
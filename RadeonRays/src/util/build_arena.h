@@ -0,0 +1,205 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef BUILD_ARENA_H
+#define BUILD_ARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "alignedalloc.h"
+
+namespace RadeonRays
+{
+    /// Bump allocator for temporary data of BVH builds. Memory is handed out from
+    /// blocks kept for later builds, so many small builds don't go to the heap for
+    /// every node. Allocations are only valid inside a Scope and are all released
+    /// when it ends, scopes of an arena have to be nested, which is why each thread
+    /// gets its own arena.
+    class BuildArena
+    {
+    public:
+        // Releases everything allocated from the arena during its lifetime
+        class Scope
+        {
+        public:
+            explicit Scope(BuildArena& arena = GetThreadArena())
+                : arena_(arena)
+                , block_(arena.current_)
+                , offset_(arena.offset_)
+            {
+                ++arena_.depth_;
+            }
+
+            ~Scope()
+            {
+                arena_.current_ = block_;
+                arena_.offset_ = offset_;
+
+                if (--arena_.depth_ == 0)
+                {
+                    arena_.Trim();
+                }
+            }
+
+        private:
+            BuildArena& arena_;
+            std::size_t block_;
+            std::size_t offset_;
+
+            Scope(Scope const&);
+            Scope& operator = (Scope const&);
+        };
+
+        // STL allocator taking memory from the arena of the allocating thread,
+        // containers using it can't outlive the innermost scope of that thread
+        template <typename T>
+        struct Allocator
+        {
+            typedef T value_type;
+
+            Allocator() throw() {}
+
+            template <typename U>
+            Allocator(Allocator<U> const&) throw() {}
+
+            T* allocate(std::size_t n)
+            {
+                return static_cast<T*>(GetThreadArena().Allocate(n * sizeof(T)));
+            }
+
+            void deallocate(T*, std::size_t)
+            {
+            }
+
+            template <typename U>
+            struct rebind { typedef Allocator<U> other; };
+        };
+
+        BuildArena()
+            : current_(0)
+            , offset_(0)
+            , depth_(0)
+        {
+        }
+
+        ~BuildArena()
+        {
+            for (auto& block : blocks_)
+            {
+                block_allocator().deallocate(block.data, block.size);
+            }
+        }
+
+        // Allocate size bytes aligned to kAlignment inside the current scope
+        void* Allocate(std::size_t size)
+        {
+            assert(depth_ > 0);
+            size = (size + kAlignment - 1) & ~(kAlignment - 1);
+
+            // Blocks too small for the request are skipped until the scope ends
+            for (; current_ < blocks_.size(); ++current_, offset_ = 0)
+            {
+                if (offset_ + size <= blocks_[current_].size)
+                {
+                    void* ptr = blocks_[current_].data + offset_;
+                    offset_ += size;
+                    return ptr;
+                }
+            }
+
+            std::size_t blocksize = size > kBlockSize ? size : kBlockSize;
+            blocks_.push_back(Block{ block_allocator().allocate(blocksize), blocksize });
+            current_ = blocks_.size() - 1;
+            offset_ = size;
+            return blocks_.back().data;
+        }
+
+        // Arena of the calling thread
+        static BuildArena& GetThreadArena()
+        {
+            static thread_local BuildArena arena;
+            return arena;
+        }
+
+    private:
+        // Alignment of all the allocations (SSE loads of boxes)
+        static std::size_t const kAlignment = 16;
+        // Minimum block size
+        static std::size_t const kBlockSize = 64 * 1024;
+        // Memory kept by an idle arena, blocks of large builds past it are freed
+        static std::size_t const kMaxRetainedSize = 4 * 1024 * 1024;
+
+        typedef aligned_allocator<char, 64> block_allocator;
+
+        struct Block
+        {
+            char* data;
+            std::size_t size;
+        };
+
+        // Free trailing blocks exceeding the retained size once nothing is allocated
+        void Trim()
+        {
+            std::size_t total = 0;
+
+            for (auto const& block : blocks_)
+            {
+                total += block.size;
+            }
+
+            while (total > kMaxRetainedSize)
+            {
+                total -= blocks_.back().size;
+                block_allocator().deallocate(blocks_.back().data, blocks_.back().size);
+                blocks_.pop_back();
+            }
+
+            current_ = 0;
+            offset_ = 0;
+        }
+
+        std::vector<Block> blocks_;
+        // Block and offset of the next allocation
+        std::size_t current_;
+        std::size_t offset_;
+        // Number of active scopes
+        int depth_;
+
+        BuildArena(BuildArena const&);
+        BuildArena& operator = (BuildArena const&);
+    };
+
+    template <typename T, typename U>
+    bool operator == (BuildArena::Allocator<T> const&, BuildArena::Allocator<U> const&)
+    {
+        return true;
+    }
+
+    template <typename T, typename U>
+    bool operator != (BuildArena::Allocator<T> const&, BuildArena::Allocator<U> const&)
+    {
+        return false;
+    }
+}
+
+#endif // BUILD_ARENA_H
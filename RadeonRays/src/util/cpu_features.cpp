@@ -0,0 +1,107 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "cpu_features.h"
+
+#ifdef RR_CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#include <cstdint>
+
+namespace RadeonRays
+{
+#ifdef RR_CPU_X86
+    // regs: eax, ebx, ecx, edx of the leaf
+    static void CpuId(unsigned leaf, unsigned subleaf, unsigned regs[4])
+    {
+#ifdef _MSC_VER
+        int r[4];
+        __cpuidex(r, (int)leaf, (int)subleaf);
+        for (int i = 0; i < 4; ++i)
+            regs[i] = (unsigned)r[i];
+#else
+        __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+    }
+
+    // Register state enabled by the OS
+    static std::uint64_t GetXcr0()
+    {
+#ifdef _MSC_VER
+        return _xgetbv(0);
+#else
+        unsigned lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        return ((std::uint64_t)hi << 32) | lo;
+#endif
+    }
+
+    static CpuFeatures DetectCpuFeatures()
+    {
+        CpuFeatures features = {};
+
+        unsigned regs[4];
+        CpuId(0, 0, regs);
+        unsigned const maxleaf = regs[0];
+
+        if (maxleaf < 1)
+            return features;
+
+        CpuId(1, 0, regs);
+        features.sse41 = (regs[2] & (1u << 19)) != 0;
+
+        // AVX registers are usable only if the OS saves them
+        bool const osxsave = (regs[2] & (1u << 27)) != 0;
+        bool const avx = (regs[2] & (1u << 28)) != 0;
+        std::uint64_t const xcr0 = osxsave ? GetXcr0() : 0;
+        bool const ymm = (xcr0 & 0x6) == 0x6;
+        bool const zmm = (xcr0 & 0xE6) == 0xE6;
+
+        features.avx = avx && ymm;
+
+        if (maxleaf >= 7)
+        {
+            CpuId(7, 0, regs);
+            features.avx2 = features.avx && (regs[1] & (1u << 5)) != 0;
+            features.avx512f = features.avx && zmm && (regs[1] & (1u << 16)) != 0;
+        }
+
+        return features;
+    }
+#else
+    static CpuFeatures DetectCpuFeatures()
+    {
+        CpuFeatures features = {};
+        return features;
+    }
+#endif
+
+    CpuFeatures const& GetCpuFeatures()
+    {
+        static CpuFeatures const features = DetectCpuFeatures();
+        return features;
+    }
+}
@@ -0,0 +1,59 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef CPU_FEATURES_H
+#define CPU_FEATURES_H
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define RR_CPU_X86 1
+#endif
+
+// Functions compiled for an instruction set above the build baseline,
+// callers have to check GetCpuFeatures() first. MSVC emits any intrinsic
+// without target flags.
+#if defined(RR_CPU_X86) && (defined(__GNUC__) || defined(__clang__))
+#define RR_TARGET_AVX2 __attribute__((target("avx2")))
+#define RR_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define RR_TARGET_AVX2
+#define RR_TARGET_AVX512
+#endif
+
+namespace RadeonRays
+{
+    ///< Instruction sets usable on the host. An extension counts as available
+    ///< only if both the CPU and the OS (saved register state) support it, so
+    ///< hot CPU paths can pick a multi-versioned implementation at runtime
+    ///< instead of requiring per-host builds.
+    ///<
+    struct CpuFeatures
+    {
+        bool sse41;
+        bool avx;
+        bool avx2;
+        bool avx512f;
+    };
+
+    // Features of the host, detected once on first call
+    CpuFeatures const& GetCpuFeatures();
+}
+
+#endif // CPU_FEATURES_H
@@ -0,0 +1,170 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "numa.h"
+
+#if defined(__linux__)
+#include <sched.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#elif defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+#include <vector>
+
+namespace RadeonRays
+{
+#if defined(__linux__)
+    // Parse sysfs lists of comma separated ranges: "0-15,32-47"
+    static std::vector<int> ReadList(std::string const& path)
+    {
+        std::vector<int> result;
+        std::ifstream in(path);
+        std::string range;
+
+        while (std::getline(in, range, ','))
+        {
+            int first = 0, last = 0;
+            char dash = 0;
+            std::stringstream rs(range);
+            if (!(rs >> first))
+                continue;
+            if (!(rs >> dash >> last))
+                last = first;
+
+            for (int i = first; i <= last; ++i)
+                result.push_back(i);
+        }
+
+        return result;
+    }
+
+    // Allowed CPUs of each node with any of them
+    static std::vector<std::vector<int> > DetectNodes()
+    {
+        std::vector<std::vector<int> > nodes;
+
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+            return nodes;
+
+        for (int node : ReadList("/sys/devices/system/node/possible"))
+        {
+            std::vector<int> cpus;
+            for (int cpu : ReadList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+            {
+                if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            }
+
+            // Memory only nodes and nodes outside of the affinity mask are skipped
+            if (!cpus.empty())
+                nodes.push_back(cpus);
+        }
+
+        return nodes;
+    }
+
+    static std::vector<std::vector<int> > const& GetNodes()
+    {
+        static std::vector<std::vector<int> > const nodes = DetectNodes();
+        return nodes;
+    }
+
+    int GetNumaNodeCount()
+    {
+        return GetNodes().size() > 1 ? static_cast<int>(GetNodes().size()) : 1;
+    }
+
+    bool BindThreadToNumaNode(int node)
+    {
+        auto const& nodes = GetNodes();
+        if (nodes.size() < 2 || node < 0 || node >= static_cast<int>(nodes.size()))
+            return false;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : nodes[node])
+            CPU_SET(cpu, &set);
+
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+#elif defined(_WIN32)
+    // Allowed CPUs of each node with any of them, single processor group
+    static std::vector<ULONGLONG> DetectNodes()
+    {
+        std::vector<ULONGLONG> nodes;
+
+        DWORD_PTR process_mask = 0, system_mask = 0;
+        ULONG highest = 0;
+        if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) ||
+            !GetNumaHighestNodeNumber(&highest))
+            return nodes;
+
+        for (ULONG node = 0; node <= highest && node < 64; ++node)
+        {
+            ULONGLONG mask = 0;
+            if (GetNumaNodeProcessorMask(static_cast<UCHAR>(node), &mask))
+            {
+                mask &= process_mask;
+                if (mask)
+                    nodes.push_back(mask);
+            }
+        }
+
+        return nodes;
+    }
+
+    static std::vector<ULONGLONG> const& GetNodes()
+    {
+        static std::vector<ULONGLONG> const nodes = DetectNodes();
+        return nodes;
+    }
+
+    int GetNumaNodeCount()
+    {
+        return GetNodes().size() > 1 ? static_cast<int>(GetNodes().size()) : 1;
+    }
+
+    bool BindThreadToNumaNode(int node)
+    {
+        auto const& nodes = GetNodes();
+        if (nodes.size() < 2 || node < 0 || node >= static_cast<int>(nodes.size()))
+            return false;
+
+        return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(nodes[node])) != 0;
+    }
+#else
+    int GetNumaNodeCount()
+    {
+        return 1;
+    }
+
+    bool BindThreadToNumaNode(int node)
+    {
+        return false;
+    }
+#endif
+}
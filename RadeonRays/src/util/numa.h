@@ -0,0 +1,40 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef NUMA_H
+#define NUMA_H
+
+namespace RadeonRays
+{
+    ///< Host NUMA topology as seen by the process: nodes are numbered 0..count-1
+    ///< and only nodes with CPUs in the process affinity mask are counted, so
+    ///< hosts without NUMA, restricted to a single socket or on platforms without
+    ///< topology queries report one node and binding is a no-op there.
+    ///<
+
+    // Number of NUMA nodes the process can run on, at least 1
+    int GetNumaNodeCount();
+
+    // Restrict the calling thread to the CPUs of node, false if it is not possible
+    bool BindThreadToNumaNode(int node);
+}
+
+#endif // NUMA_H
@@ -20,31 +20,142 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "options.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cstring>
 
 namespace RadeonRays
 {
+    namespace
+    {
+        struct OptionDesc
+        {
+            char const* name;
+            Options::OptionType type;
+        };
+
+        // Has to follow Options::OptionId order
+        OptionDesc const g_options[] =
+        {
+        { "acc.auto_probe_rays", Options::kOptionFloat },
+        { "acc.buffer_pool_size", Options::kOptionFloat },
+        { "acc.custom_intersector", Options::kOptionString },
+        { "acc.hit_callback", Options::kOptionString },
+        { "acc.hit_filter", Options::kOptionString },
+        { "acc.hit_format", Options::kOptionString },
+        { "acc.host_chunk_size", Options::kOptionFloat },
+        { "acc.host_query_threshold", Options::kOptionFloat },
+        { "acc.memory_budget", Options::kOptionFloat },
+        { "acc.occlusion_format", Options::kOptionString },
+        { "acc.page_size", Options::kOptionFloat },
+        { "acc.profiling", Options::kOptionFloat },
+        { "acc.ray_format", Options::kOptionString },
+        { "acc.sort_rays", Options::kOptionFloat },
+        { "acc.traversal_stats", Options::kOptionFloat },
+        { "acc.tune_local_size", Options::kOptionFloat },
+        { "acc.type", Options::kOptionString },
+        { "acc.watertight", Options::kOptionFloat },
+        { "bvh.builder", Options::kOptionString },
+        { "bvh.cache_dir", Options::kOptionString },
+        { "bvh.compact_transforms", Options::kOptionFloat },
+        { "bvh.compressed", Options::kOptionFloat },
+        { "bvh.dedup_meshes", Options::kOptionFloat },
+        { "bvh.direction_ordered", Options::kOptionFloat },
+        { "bvh.force2level", Options::kOptionFloat },
+        { "bvh.forceflat", Options::kOptionFloat },
+        { "bvh.hit_hints", Options::kOptionFloat },
+        { "bvh.hlbvh.background_rebuild", Options::kOptionFloat },
+        { "bvh.hlbvh.builder", Options::kOptionString },
+        { "bvh.hlbvh.morton64", Options::kOptionFloat },
+        { "bvh.hlbvh.refit_max_cost", Options::kOptionFloat },
+        { "bvh.hlbvh.traversal", Options::kOptionString },
+        { "bvh.hlbvh.treelets", Options::kOptionFloat },
+        { "bvh.layout", Options::kOptionString },
+        { "bvh.lbvh.sah_top", Options::kOptionFloat },
+        { "bvh.max_leaf_size", Options::kOptionFloat },
+        { "bvh.num_threads", Options::kOptionFloat },
+        { "bvh.occlusion_area_order", Options::kOptionFloat },
+        { "bvh.packed_vertices", Options::kOptionFloat },
+        { "bvh.packet_traversal", Options::kOptionFloat },
+        { "bvh.persistent_threads", Options::kOptionFloat },
+        { "bvh.precomputed_triangles", Options::kOptionFloat },
+        { "bvh.progressive", Options::kOptionFloat },
+        { "bvh.ray_samples_weight", Options::kOptionFloat },
+        { "bvh.refit", Options::kOptionFloat },
+        { "bvh.sah.extra_node_budget", Options::kOptionFloat },
+        { "bvh.sah.max_split_depth", Options::kOptionFloat },
+        { "bvh.sah.min_overlap", Options::kOptionFloat },
+        { "bvh.sah.num_bins", Options::kOptionFloat },
+        { "bvh.sah.traversal_cost", Options::kOptionFloat },
+        { "bvh.sah.use_splits", Options::kOptionFloat },
+        { "bvh.shared_library", Options::kOptionFloat },
+        { "bvh.specialize_kernels", Options::kOptionFloat },
+        { "bvh.toplevel.builder", Options::kOptionString },
+        { "bvh.toplevel.incremental_max_cost", Options::kOptionFloat },
+        { "bvh.triangle_pairs", Options::kOptionFloat },
+        { "capture.max_queries", Options::kOptionFloat },
+        { "capture.path", Options::kOptionString },
+        { "embree.build_quality", Options::kOptionString },
+        { "embree.chunk_size", Options::kOptionFloat },
+        { "embree.compact", Options::kOptionFloat },
+        { "embree.num_threads", Options::kOptionFloat },
+        { "embree.robust", Options::kOptionFloat },
+        { "embree.sort_rays", Options::kOptionFloat },
+        { "embree.traversal", Options::kOptionString },
+        { "grid.density", Options::kOptionFloat },
+        { "grid.top_density", Options::kOptionFloat },
+        { "hybrid.partition", Options::kOptionString },
+        };
 
-    void Options::SetValue(std::string const& name, std::string const& value)
+        static_assert(sizeof(g_options) / sizeof(g_options[0]) == Options::kNumOptions, "Option table doesn't match OptionId");
+    }
+
+    Options::Options()
     {
-        values_[name] = Option(value);
+        std::fill(set_, set_ + kNumOptions, false);
     }
 
-    void Options::SetValue(std::string const& name, float value)
+    void Options::SetValue(char const* name, char const* value)
     {
-        values_[name] = Option(value);
+        OptionId id = FindOption(name);
+        ThrowIf(id == kNumOptions, std::string("Unknown option ") + name);
+        ThrowIf(g_options[id].type != kOptionString, std::string("Option ") + name + " expects a float value");
+
+        values_[id] = Option(std::string(value));
+        set_[id] = true;
     }
 
-    Options::Option const* Options::GetOption(std::string const& name) const
+    void Options::SetValue(char const* name, float value)
     {
-        auto iter = values_.find(name);
+        OptionId id = FindOption(name);
+        ThrowIf(id == kNumOptions, std::string("Unknown option ") + name);
+        ThrowIf(g_options[id].type != kOptionFloat, std::string("Option ") + name + " expects a string value");
 
-        if (iter != values_.end())
-        {
-            return &iter->second;
-        }
-        else
+        values_[id] = Option(value);
+        set_[id] = true;
+    }
+
+    Options::OptionId Options::FindOption(char const* name)
+    {
+        for (int i = 0; i < kNumOptions; ++i)
         {
-            return nullptr;
+            if (std::strcmp(g_options[i].name, name) == 0)
+            {
+                return static_cast<OptionId>(i);
+            }
         }
+
+        return kNumOptions;
+    }
+
+    char const* Options::GetOptionName(OptionId id)
+    {
+        return g_options[id].name;
+    }
+
+    Options::OptionType Options::GetOptionType(OptionId id)
+    {
+        return g_options[id].type;
     }
-}
\ No newline at end of file
+}
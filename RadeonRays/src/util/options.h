@@ -22,18 +22,99 @@ THE SOFTWARE.
 #ifndef OPTIONS_H
 #define OPTIONS_H
 
-#include <map>
 #include <string>
 
 namespace RadeonRays
 {
-    ///< The class stores a set of key-value options. 
-    ///< The value might be either float or string and 
-    ///< lookup is O(nlg(n))
+    ///< The class stores a set of key-value options.
+    ///< Names are resolved to OptionId once when an option is set, so lookups
+    ///< by id are plain array accesses. Unknown names and values of the wrong
+    ///< type are rejected by SetValue.
     ///<
     class Options
     {
     public:
+        // Known options, names are listed in the same order in options.cpp
+        enum OptionId
+        {
+            kAccAutoProbeRays,
+            kAccBufferPoolSize,
+            kAccCustomIntersector,
+            kAccHitCallback,
+            kAccHitFilter,
+            kAccHitFormat,
+            kAccHostChunkSize,
+            kAccHostQueryThreshold,
+            kAccMemoryBudget,
+            kAccOcclusionFormat,
+            kAccPageSize,
+            kAccProfiling,
+            kAccRayFormat,
+            kAccSortRays,
+            kAccTraversalStats,
+            kAccTuneLocalSize,
+            kAccType,
+            kAccWatertight,
+            kBvhBuilder,
+            kBvhCacheDir,
+            kBvhCompactTransforms,
+            kBvhCompressed,
+            kBvhDedupMeshes,
+            kBvhDirectionOrdered,
+            kBvhForce2level,
+            kBvhForceflat,
+            kBvhHitHints,
+            kBvhHlbvhBackgroundRebuild,
+            kBvhHlbvhBuilder,
+            kBvhHlbvhMorton64,
+            kBvhHlbvhRefitMaxCost,
+            kBvhHlbvhTraversal,
+            kBvhHlbvhTreelets,
+            kBvhLayout,
+            kBvhLbvhSahTop,
+            kBvhMaxLeafSize,
+            kBvhNumThreads,
+            kBvhOcclusionAreaOrder,
+            kBvhPackedVertices,
+            kBvhPacketTraversal,
+            kBvhPersistentThreads,
+            kBvhPrecomputedTriangles,
+            kBvhProgressive,
+            kBvhRaySamplesWeight,
+            kBvhRefit,
+            kBvhSahExtraNodeBudget,
+            kBvhSahMaxSplitDepth,
+            kBvhSahMinOverlap,
+            kBvhSahNumBins,
+            kBvhSahTraversalCost,
+            kBvhSahUseSplits,
+            kBvhSharedLibrary,
+            kBvhSpecializeKernels,
+            kBvhToplevelBuilder,
+            kBvhToplevelIncrementalMaxCost,
+            kBvhTrianglePairs,
+            kCaptureMaxQueries,
+            kCapturePath,
+            kEmbreeBuildQuality,
+            kEmbreeChunkSize,
+            kEmbreeCompact,
+            kEmbreeNumThreads,
+            kEmbreeRobust,
+            kEmbreeSortRays,
+            kEmbreeTraversal,
+            kGridDensity,
+            kGridTopDensity,
+            kHybridPartition,
+            kNumOptions
+        };
+
+        // Value type of an option
+        enum OptionType
+        {
+            kOptionFloat,
+            kOptionString
+        };
+
         /// Single option
         struct Option
         {
@@ -47,6 +128,7 @@ namespace RadeonRays
             Option(std::string const& val="")
             {
                 value.strval = val;
+                value.floatval = 0.f;
             }
 
             // Construct from float
@@ -56,7 +138,7 @@ namespace RadeonRays
             }
 
             // Interpret as string
-            std::string AsString() const
+            std::string const& AsString() const
             {
                 return value.strval;
             }
@@ -69,20 +151,33 @@ namespace RadeonRays
         };
 
         // Constructor
-        Options(){}
+        Options();
+
+        // Set string value, throws if the option is unknown or holds floats
+        void SetValue(char const* name, char const* value);
+        // Set float value, throws if the option is unknown or holds strings
+        void SetValue(char const* name, float value);
 
-        // Set string value
-        void SetValue(std::string const& name, std::string const& value);
-        // Set float value
-        void SetValue(std::string const& name, float value);
+        // Get option, nullptr if it has not been set
+        Option const* GetOption(OptionId id) const;
 
-        // Get option
-        Option const* GetOption(std::string const& name) const;
+        // Id of the option with the given name, kNumOptions if there is no such option
+        static OptionId FindOption(char const* name);
+        // Name and value type of an option
+        static char const* GetOptionName(OptionId id);
+        static OptionType GetOptionType(OptionId id);
 
     private:
-        // Options 
-        std::map<std::string, Option> values_;
+        // Options indexed by OptionId
+        Option values_[kNumOptions];
+        // Flags of the options that have been set
+        bool set_[kNumOptions];
     };
+
+    inline Options::Option const* Options::GetOption(OptionId id) const
+    {
+        return set_[id] ? &values_[id] : nullptr;
+    }
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -7,7 +7,11 @@
 #include <numeric>
 #include <array>
 #include <cstdlib>
+#include <cstdint>
 #include <map>
+#include <cstring>
+
+#include "../async/task_scheduler.h"
 
 // Round up to next power of two
 template <typename T> inline T round_up_to_pow2(T v);
@@ -36,191 +40,318 @@ template <> inline unsigned round_up_to_pow2<unsigned>(unsigned v)
     return v;
 }
 
+// Mix bits of a 32-bit key, keys are hashed on the device
+// the same way (perfect_hash_mix in the kernels)
+inline std::uint32_t perfect_hash_mix(std::uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
 // Establish perfect mapping between specified keys and values
 // O(1) worst case lookup time
-template <typename K, typename V, typename D = int> class PerfectHashMap
+//
+// Keys are hashed into buckets of a few keys each, buckets are grouped into partitions
+// owning equal slices of the hash table. Every bucket is assigned a displacement placing
+// all its keys into free slots of its slice:
+//
+//     bucket = mix(key) & (displacement_table_size - 1)
+//     seed = displacement[bucket] * 0x9e3779b9 + 0x85ebca6b
+//     slot = ((bucket >> partition_shift) << slice_bits) | (mix(key ^ seed) & ((1 << slice_bits) - 1))
+//
+// Partitions are independent, so they are placed in parallel and each one works
+// within a slice small enough to stay in cache. Tables are sized by the number of keys
+// rather than max_key, so sparse keys like node indices of deep trees are handled
+// in linear time. Displacements are below 2^16 and fit D = std::uint16_t.
+template <typename K, typename V, typename D = std::uint16_t> class PerfectHashMap
 {
 public:
+    // Words of the Pack header
+    enum PackHeader
+    {
+        // displacement_table_size - 1
+        kPackBucketMask,
+        // log2 of the number of buckets per partition
+        kPackPartitionShift,
+        // log2 of the slice size
+        kPackSliceBits,
+        // Hash table start in words, displacements are packed 2 per word before it
+        kPackTableOffset,
+        kPackHeaderSize
+    };
+
     // max_key is the upper bound for all the keys in keys array
-    // keys and values are arrays of size count
+    // keys and values are arrays of size count, keys should be unique
     // invalid_value is returned by the query later if there is no such key in the table
-    PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value);
+    // Partitions are placed in parallel if scheduler is not nullptr
+    PerfectHashMap(K max_key, K const* keys, V const* values, int count, V invalid_value,
+        RadeonRays::task_scheduler* scheduler = nullptr);
     PerfectHashMap() = delete;
 
     // Look up value for a specified key
     // O(1) time
     V operator[](K key) const;
 
-
-    // DEBUG:
-    D hash_table_size() const { return static_cast<D>(m_hash_table.size()); }
-    D displacement_table_size() const { return m_t; }
+    // Table sizes are powers of 2
+    int hash_table_size() const { return static_cast<int>(m_hash_table.size()); }
+    int displacement_table_size() const { return static_cast<int>(m_displacement.size()); }
     D const* displacement_table_ptr() const { return &m_displacement[0]; }
     V const* hash_table_ptr() const { return &m_hash_table[0]; }
 
+    // Pack the header, 16-bit displacements and 32-bit values into a single array to upload
+    void Pack(std::vector<std::uint32_t>& data) const;
+
 private:
-    // Intermediate table dim, should be at least sqrt(max_key)
-    D m_t;
-    // Displacement table of rows
+    // Average number of keys per bucket
+    static int const kBucketSize = 4;
+    // Buckets per partition
+    static int const kPartitionBuckets = 1024;
+    // Displacements tried for a bucket before the hash table is grown
+    static int const kMaxDisplacement = 1 << 16;
+
+    // Slot of a key within its slice for a given displacement
+    std::uint32_t GetSlot(K key, std::uint32_t displacement) const;
+
+    // Place buckets of a partition into its slice, false if some bucket can't be placed
+    bool PlacePartition(int partition, K const* keys, V const* values, std::vector<int> const& bucket_start,
+        std::vector<int> const& order, V invalid_value);
+
+    // log2 of buckets per partition
+    int m_partition_shift;
+    // log2 of the slice size
+    int m_slice_bits;
+    // Displacement table of buckets
     std::vector<D> m_displacement;
     // Hash table
     std::vector<V> m_hash_table;
 };
 
+// Integer log2 of a power of 2
+inline int perfect_hash_log2(std::uint32_t v)
+{
+    int bits = 0;
+
+    while ((1u << bits) < v)
+    {
+        ++bits;
+    }
+
+    return bits;
+}
 
 template <typename K, typename V, typename D>
 inline
-PerfectHashMap<K,V,D>::PerfectHashMap(K max_key, K const* keys, V const* values, D count, V invalid_value)
+PerfectHashMap<K,V,D>::PerfectHashMap(K max_key, K const* keys, V const* values, int count, V invalid_value,
+    RadeonRays::task_scheduler* scheduler)
 {
-    // 1. We first hash keys into an intermediate 2D array of m_t * m_t size
-    // 2. We build a histogram over rows
-    // 3. We sort rows according to this histogram
-    // 4. We iterate over all the rows and shift each one to the right
-    //    until it does not have collisions with previous rows (each column has
-    //    at most 1 element), storing offsets into m_displacement array.
-    // 5. We compress the rows into a hash table.
-
-    // Row structure to build histogram over rows
-    struct Row
+    static_assert(sizeof(D) >= 2, "Displacements need at least 16 bits");
+
+    // 1. We hash keys into buckets, buckets into partitions.
+    // 2. We iterate over buckets of each partition in descending order of size
+    //    trying increasing displacements until all the keys of a bucket land
+    //    into free slots of the slice, storing displacements into m_displacement array.
+    // 3. If some bucket can't be placed slices are doubled and we start over.
+
+    // Check max key constraint
+    for (int i = 0; i < count; ++i)
     {
-        D index;
-        D count;
-    };
+        if (keys[i] > max_key)
+            throw std::runtime_error("Max key condition violated");
+    }
 
-    // Row vector
-    std::vector<Row> rows;
-    // Intermediate 2D array to hash keys into
-    std::vector<V> intermediate;
-
-    // Determine intermediate table size:
-    // to be able to hash max_key it should be at least sqrt(max_key)
-    m_t = round_up_to_pow2(static_cast<D>(std::ceil(std::sqrt(max_key))));
-    // Allocate intermediate table
-    intermediate.resize(m_t * m_t);
-    // Allocate displacement table
-    m_displacement.resize(m_t);
-    // Allocate space for row histogram bins
-    rows.resize(m_t);
-
-    // Initialize rows
-    for (auto i = 0; i < rows.size(); ++i)
+    int const num_buckets = round_up_to_pow2(std::max(count / kBucketSize, 1));
+    int const partition_buckets = std::min(num_buckets, static_cast<int>(kPartitionBuckets));
+    int const num_partitions = num_buckets / partition_buckets;
+
+    m_partition_shift = perfect_hash_log2(partition_buckets);
+    m_displacement.assign(num_buckets, 0);
+
+    // Bucket keys with counting sort: bucket_start holds the start of each bucket in order,
+    // buckets of a partition are contiguous
+    std::vector<int> bucket_start(num_buckets + 1, 0);
+    std::vector<int> order(count);
+
+    for (int i = 0; i < count; ++i)
     {
-        rows[i].count = 0;
-        rows[i].index = i;
+        ++bucket_start[(perfect_hash_mix(static_cast<std::uint32_t>(keys[i])) & (num_buckets - 1)) + 1];
     }
 
-    // Initialize tables
-    std::fill(std::begin(intermediate), std::end(intermediate), invalid_value);
-    std::fill(std::begin(m_displacement), std::end(m_displacement), invalid_value);
+    for (int i = 0; i < num_buckets; ++i)
+    {
+        bucket_start[i + 1] += bucket_start[i];
+    }
 
-    // Hash keys into an intermediate table
-    for (auto i = 0; i < count; ++i)
     {
-        auto key = keys[i];
-        auto value = values[i];
+        std::vector<int> bucket_end(bucket_start.cbegin(), bucket_start.cend() - 1);
 
-        // Check max key constraint
-        if (key > max_key)
-            throw std::runtime_error("Max key condition violated");
+        for (int i = 0; i < count; ++i)
+        {
+            order[bucket_end[perfect_hash_mix(static_cast<std::uint32_t>(keys[i])) & (num_buckets - 1)]++] = i;
+        }
+    }
 
-        // Hash key into row, col
-        auto row = key / m_t;
-        // We can & (m_t - 1) since it is pow of 2
-        auto col = key & (m_t - 1);
+    // Keep the load factor of every slice under 1/2
+    int max_partition_keys = 1;
+
+    for (int i = 0; i < num_partitions; ++i)
+    {
+        max_partition_keys = std::max(max_partition_keys,
+            bucket_start[(i + 1) * partition_buckets] - bucket_start[i * partition_buckets]);
+    }
 
-        // Update intermediate table
-        intermediate[row * m_t + col] = value;
+    m_slice_bits = perfect_hash_log2(round_up_to_pow2(2 * max_partition_keys));
 
-        // Update histogram
-        ++rows[row].count;
+    for (;;)
+    {
+        m_hash_table.assign(static_cast<std::size_t>(num_partitions) << m_slice_bits, invalid_value);
+
+        std::vector<char> placed(num_partitions, 0);
+
+        auto place = [&](int partition)
+        {
+            placed[partition] = PlacePartition(partition, keys, values, bucket_start, order, invalid_value);
+        };
+
+        if (scheduler && num_partitions > 1)
+        {
+            RadeonRays::parallel_for(*scheduler, 0, num_partitions, 1, place);
+        }
+        else
+        {
+            for (int i = 0; i < num_partitions; ++i)
+            {
+                place(i);
+            }
+        }
+
+        if (std::all_of(placed.cbegin(), placed.cend(), [](char p) { return p != 0; }))
+        {
+            break;
+        }
+
+        ++m_slice_bits;
     }
+}
 
-    // Sort rows in descending order based on histogram
-    std::sort(std::begin(rows), std::end(rows), [](Row const& lhs, Row const& rhs)
+template <typename K, typename V, typename D>
+inline
+bool PerfectHashMap<K,V,D>::PlacePartition(int partition, K const* keys, V const* values, std::vector<int> const& bucket_start,
+    std::vector<int> const& order, V invalid_value)
+{
+    int const first_bucket = partition << m_partition_shift;
+    int const last_bucket = first_bucket + (1 << m_partition_shift);
+    std::uint32_t const slice_start = static_cast<std::uint32_t>(partition) << m_slice_bits;
+
+    // Larger buckets are placed first while the slice is still empty
+    std::vector<int> buckets(last_bucket - first_bucket);
+    std::iota(buckets.begin(), buckets.end(), first_bucket);
+    std::stable_sort(buckets.begin(), buckets.end(), [&](int lhs, int rhs)
     {
-        return lhs.count > rhs.count;
+        return bucket_start[lhs + 1] - bucket_start[lhs] > bucket_start[rhs + 1] - bucket_start[rhs];
     });
 
-    // Start shifting rows to the right
-    for (auto& row: rows)
+    std::vector<char> used(std::size_t(1) << m_slice_bits, 0);
+    std::vector<std::uint32_t> slots;
+
+    for (auto bucket : buckets)
     {
-        // If we have zero here it is guaranteed we can early-out
-        // since the rows are sorted in descending order.
-        if (!row.count)
+        int const begin = bucket_start[bucket];
+        int const end = bucket_start[bucket + 1];
+
+        // Empty buckets go last
+        if (begin == end)
         {
             break;
         }
 
-        // Try increasing offsets
-        auto idx = row.index;
-        for (auto offset = 0;;++offset)
+        bool found = false;
+
+        for (int displacement = 0; displacement < kMaxDisplacement && !found; ++displacement)
         {
-            bool collision = false;
-            // Check if current row has no collisions
-            for (auto i = 0; i < m_t; ++i)
+            slots.clear();
+            found = true;
+
+            // Keys of the bucket have to land into distinct free slots
+            for (int i = begin; i < end && found; ++i)
             {
-                // Check if there is current element which can potentially create collision
-                if (intermediate[idx * m_t + i] != invalid_value)
-                {
-                    // Check if collision is actually happening
-                    auto dstidx = offset + i;
-                    // If dstidx > m_hash_table size there can be no collision, since
-                    // no rows has been compressed into the table past the end
-                    if (dstidx < m_hash_table.size() && m_hash_table[dstidx] != invalid_value)
-                    {
-                        collision = true;
-                        break;
-                    }
-                }
+                auto slot = GetSlot(keys[order[i]], displacement);
+
+                found = !used[slot];
+                used[slot] = 1;
+                slots.push_back(slot);
             }
 
-            // We checked all elements and found no collisions
-            // with current offset
-            if (!collision)
+            if (found)
             {
-                // Store displacement value for the row
-                m_displacement[idx] = offset;
-
-                // Compress the row into the table
-                for (auto i = 0; i < m_t; ++i)
+                m_displacement[bucket] = static_cast<D>(displacement);
+            }
+            else
+            {
+                // Roll back, the last slot has been occupied before
+                for (std::size_t i = 0; i + 1 < slots.size(); ++i)
                 {
-                    auto value = intermediate[idx * m_t + i];
-                    auto dstidx = offset + i;
-
-                    // If we are adding past the end we do not care of
-                    // missing keys (successive rows can rewrite missing values)
-                    if (dstidx >= m_hash_table.size())
-                    {
-                        m_hash_table.push_back(value);
-                    }
-                    else
-                    {
-                        // If we are adding prior to the end we only add valid entries
-                        // in order not to overwrite existing ones.
-                        if (value != invalid_value)
-                        {
-                            m_hash_table[dstidx] = value;
-                        }
-                    }
-
+                    used[slots[i]] = 0;
                 }
-
-                // Stop trying offsets and go to the next row
-                break;
             }
         }
+
+        if (!found)
+        {
+            return false;
+        }
+
+        for (int i = begin; i < end; ++i)
+        {
+            m_hash_table[slice_start + slots[i - begin]] = values[order[i]];
+        }
     }
+
+    return true;
+}
+
+template <typename K, typename V, typename D>
+inline
+std::uint32_t PerfectHashMap<K,V,D>::GetSlot(K key, std::uint32_t displacement) const
+{
+    auto seed = displacement * 0x9e3779b9u + 0x85ebca6bu;
+    return perfect_hash_mix(static_cast<std::uint32_t>(key) ^ seed) & ((1u << m_slice_bits) - 1);
 }
 
 template <typename K, typename V, typename D>
 inline
 V PerfectHashMap<K,V,D>::operator[](K key) const
 {
-    // Hash key into row, col
-    auto row = key / m_t;
-    auto col = key & (m_t - 1);
-    // Find displacement for the row
-    auto d = m_displacement[row];
-    // Return hashed value
-    return m_hash_table[d + col];
+    // Hash key into bucket
+    auto bucket = perfect_hash_mix(static_cast<std::uint32_t>(key)) & static_cast<std::uint32_t>(m_displacement.size() - 1);
+    // Find displacement for the bucket
+    auto d = static_cast<std::uint32_t>(m_displacement[bucket]);
+    // Return hashed value from the slice of the bucket partition
+    return m_hash_table[((bucket >> m_partition_shift) << m_slice_bits) | GetSlot(key, d)];
+}
+
+template <typename K, typename V, typename D>
+inline
+void PerfectHashMap<K,V,D>::Pack(std::vector<std::uint32_t>& data) const
+{
+    static_assert(sizeof(V) == sizeof(std::uint32_t), "Packed values are 32-bit");
+
+    std::uint32_t const offset = kPackHeaderSize + static_cast<std::uint32_t>((m_displacement.size() + 1) / 2);
+
+    data.assign(offset + m_hash_table.size(), 0);
+    data[kPackBucketMask] = static_cast<std::uint32_t>(m_displacement.size() - 1);
+    data[kPackPartitionShift] = static_cast<std::uint32_t>(m_partition_shift);
+    data[kPackSliceBits] = static_cast<std::uint32_t>(m_slice_bits);
+    data[kPackTableOffset] = offset;
+
+    // Displacements are stored as 16-bit little endian pairs
+    for (std::size_t i = 0; i < m_displacement.size(); ++i)
+    {
+        data[kPackHeaderSize + i / 2] |= (static_cast<std::uint32_t>(m_displacement[i]) & 0xffffu) << (16 * (i & 1));
+    }
+
+    std::memcpy(&data[offset], &m_hash_table[0], m_hash_table.size() * sizeof(V));
 }
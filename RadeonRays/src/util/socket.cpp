@@ -0,0 +1,279 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "socket.h"
+
+#include <cstring>
+#include <mutex>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace RadeonRays
+{
+#ifdef WIN32
+    typedef SOCKET NativeSocket;
+    static std::intptr_t const kInvalidHandle = static_cast<std::intptr_t>(INVALID_SOCKET);
+
+    // Winsock has to be initialized once per process, it stays initialized until exit
+    static void InitSockets()
+    {
+        static std::once_flag once;
+        std::call_once(once, []()
+        {
+            WSADATA data;
+            WSAStartup(MAKEWORD(2, 2), &data);
+        });
+    }
+
+    static void CloseNative(NativeSocket s)
+    {
+        closesocket(s);
+    }
+#else
+    typedef int NativeSocket;
+    static std::intptr_t const kInvalidHandle = -1;
+
+    static void InitSockets()
+    {
+    }
+
+    static void CloseNative(NativeSocket s)
+    {
+        close(s);
+    }
+#endif
+
+    static NativeSocket ToNative(std::intptr_t handle)
+    {
+        return static_cast<NativeSocket>(handle);
+    }
+
+    Socket::Socket()
+        : m_handle(kInvalidHandle)
+    {
+    }
+
+    Socket::Socket(std::intptr_t handle)
+        : m_handle(handle)
+    {
+    }
+
+    Socket::~Socket()
+    {
+        Close();
+    }
+
+    Socket::Socket(Socket&& other)
+        : m_handle(other.m_handle)
+    {
+        other.m_handle = kInvalidHandle;
+    }
+
+    Socket& Socket::operator = (Socket&& other)
+    {
+        if (this != &other)
+        {
+            Close();
+            m_handle = other.m_handle;
+            other.m_handle = kInvalidHandle;
+        }
+
+        return *this;
+    }
+
+    void Socket::Close()
+    {
+        if (m_handle != kInvalidHandle)
+        {
+            CloseNative(ToNative(m_handle));
+            m_handle = kInvalidHandle;
+        }
+    }
+
+    bool Socket::IsValid() const
+    {
+        return m_handle != kInvalidHandle;
+    }
+
+    Socket Socket::Connect(std::string const& host, int port)
+    {
+        InitSockets();
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+        {
+            return Socket();
+        }
+
+        Socket result;
+        for (addrinfo* address = addresses; address && !result.IsValid(); address = address->ai_next)
+        {
+            NativeSocket s = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (static_cast<std::intptr_t>(s) == kInvalidHandle)
+            {
+                continue;
+            }
+
+            if (connect(s, address->ai_addr, static_cast<int>(address->ai_addrlen)) != 0)
+            {
+                CloseNative(s);
+                continue;
+            }
+
+            int const nodelay = 1;
+            setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&nodelay), sizeof(nodelay));
+            result = Socket(static_cast<std::intptr_t>(s));
+        }
+
+        freeaddrinfo(addresses);
+        return result;
+    }
+
+    Socket Socket::Listen(int port)
+    {
+        InitSockets();
+
+        NativeSocket s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (static_cast<std::intptr_t>(s) == kInvalidHandle)
+        {
+            return Socket();
+        }
+
+        Socket result(static_cast<std::intptr_t>(s));
+
+        // Restarted servers can bind while connections of the previous run linger
+        int const reuse = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char const*>(&reuse), sizeof(reuse));
+
+        sockaddr_in address;
+        std::memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(static_cast<unsigned short>(port));
+
+        if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(s, SOMAXCONN) != 0)
+        {
+            return Socket();
+        }
+
+        return result;
+    }
+
+    Socket Socket::Accept() const
+    {
+        NativeSocket s = accept(ToNative(m_handle), nullptr, nullptr);
+        if (static_cast<std::intptr_t>(s) == kInvalidHandle)
+        {
+            return Socket();
+        }
+
+        int const nodelay = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<char const*>(&nodelay), sizeof(nodelay));
+        return Socket(static_cast<std::intptr_t>(s));
+    }
+
+    bool Socket::Send(void const* data, std::size_t size) const
+    {
+        auto bytes = static_cast<char const*>(data);
+
+        while (size > 0)
+        {
+            // Chunks keep the length in range of the int Winsock takes
+            int const chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+#ifdef WIN32
+            int sent = send(ToNative(m_handle), bytes, chunk, 0);
+#else
+            // Writes to a closed connection fail instead of raising SIGPIPE
+            auto sent = send(ToNative(m_handle), bytes, chunk, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#endif
+            if (sent <= 0)
+            {
+                return false;
+            }
+
+            bytes += sent;
+            size -= static_cast<std::size_t>(sent);
+        }
+
+        return true;
+    }
+
+    bool Socket::Receive(void* data, std::size_t size) const
+    {
+        auto bytes = static_cast<char*>(data);
+
+        while (size > 0)
+        {
+            int const chunk = static_cast<int>(size < (1u << 30) ? size : (1u << 30));
+#ifdef WIN32
+            int received = recv(ToNative(m_handle), bytes, chunk, 0);
+#else
+            auto received = recv(ToNative(m_handle), bytes, chunk, 0);
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+#endif
+            if (received <= 0)
+            {
+                return false;
+            }
+
+            bytes += received;
+            size -= static_cast<std::size_t>(received);
+        }
+
+        return true;
+    }
+
+    void Socket::Shutdown() const
+    {
+        if (m_handle != kInvalidHandle)
+        {
+#ifdef WIN32
+            shutdown(ToNative(m_handle), SD_BOTH);
+#else
+            shutdown(ToNative(m_handle), SHUT_RDWR);
+#endif
+        }
+    }
+}
@@ -0,0 +1,73 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace RadeonRays
+{
+    ///< Blocking TCP stream socket. Sends and receives transfer whole
+    ///< messages or fail, failures leave the socket unusable. Nagle's
+    ///< algorithm is disabled since requests are small and latency bound.
+    ///<
+    class Socket
+    {
+    public:
+        // Invalid socket
+        Socket();
+        ~Socket();
+
+        Socket(Socket&& other);
+        Socket& operator = (Socket&& other);
+
+        // Connect to host:port, invalid socket on failure
+        static Socket Connect(std::string const& host, int port);
+        // Listen on port of all interfaces, invalid socket on failure
+        static Socket Listen(int port);
+        // Wait for a connection to a listening socket, invalid socket on failure
+        Socket Accept() const;
+
+        bool IsValid() const;
+
+        // Send size bytes, false on failure
+        bool Send(void const* data, std::size_t size) const;
+        // Receive exactly size bytes, false on failure or if the peer closed the connection
+        bool Receive(void* data, std::size_t size) const;
+
+        // Make pending and later transfers fail, can be called from any thread
+        void Shutdown() const;
+
+    private:
+        Socket(Socket const&);
+        Socket& operator = (Socket const&);
+
+        explicit Socket(std::intptr_t handle);
+        void Close();
+
+        std::intptr_t m_handle;
+    };
+}
+
+#endif // SOCKET_H
@@ -0,0 +1,205 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "trace.h"
+#include "radeon_rays.h"
+#include "../except/except.h"
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+
+namespace RadeonRays
+{
+    namespace
+    {
+        // Tracing state shared by all APIs, callbacks are serialized by the mutex
+        struct TraceState
+        {
+            std::mutex mutex;
+            std::atomic<bool> enabled;
+            TraceCallback callback;
+            void* userdata;
+            std::ofstream file;
+            Tracer::Clock::time_point origin;
+            std::atomic<std::uint32_t> num_threads;
+
+            TraceState()
+                : enabled(false)
+                , callback(nullptr)
+                , userdata(nullptr)
+                , origin(Tracer::Clock::now())
+                , num_threads(0)
+            {
+            }
+        };
+
+        TraceState& GetState()
+        {
+            static TraceState state;
+            return state;
+        }
+
+        double ToMicroseconds(Tracer::Clock::duration d)
+        {
+            return std::chrono::duration<double, std::micro>(d).count();
+        }
+
+        // Small thread numbers in order of the first reported span
+        std::uint32_t GetThreadIndex()
+        {
+            thread_local std::uint32_t index = GetState().num_threads++;
+            return index;
+        }
+
+        void WriteString(std::ostream& out, char const* s)
+        {
+            out << '"';
+            for (; *s; ++s)
+            {
+                if (*s == '"' || *s == '\\')
+                {
+                    out << '\\';
+                }
+                out << *s;
+            }
+            out << '"';
+        }
+
+        // Callback writing complete events, GPU queues are shown as a separate process
+        void WriteEvent(TraceEvent const& event, void* userdata)
+        {
+            std::ofstream& out = *static_cast<std::ofstream*>(userdata);
+
+            out << ",\n{\"name\": ";
+            WriteString(out, event.name);
+            out << ", \"cat\": ";
+            WriteString(out, event.category);
+            out << ", \"ph\": \"X\", \"ts\": " << event.start << ", \"dur\": " << event.duration
+                << ", \"pid\": " << (event.gpu ? 2 : 1) << ", \"tid\": " << event.thread << "}";
+        }
+    }
+
+    bool Tracer::IsEnabled()
+    {
+        return GetState().enabled.load(std::memory_order_relaxed);
+    }
+
+    void Tracer::SetCallback(TraceCallback callback, void* userdata)
+    {
+        TraceState& state = GetState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        ThrowIf(state.file.is_open(), "Trace file is being written, call StopTrace first");
+
+        state.callback = callback;
+        state.userdata = userdata;
+        state.enabled = callback != nullptr;
+    }
+
+    void Tracer::StartFile(char const* filename)
+    {
+        TraceState& state = GetState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        ThrowIf(state.file.is_open(), "Trace file is being written, call StopTrace first");
+
+        state.file.open(filename, std::ios::out | std::ios::trunc);
+        ThrowIf(!state.file, std::string("Can't open trace file ") + filename);
+
+        state.file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": ["
+            << "\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"CPU\"}}"
+            << ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 2, \"args\": {\"name\": \"GPU queues\"}}";
+        state.callback = WriteEvent;
+        state.userdata = &state.file;
+        state.enabled = true;
+    }
+
+    void Tracer::StopFile()
+    {
+        TraceState& state = GetState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        if (state.file.is_open())
+        {
+            state.file << "\n]}\n";
+            state.file.close();
+            state.callback = nullptr;
+            state.userdata = nullptr;
+            state.enabled = false;
+        }
+    }
+
+    void Tracer::Report(char const* name, char const* category, Clock::time_point start, Clock::time_point end)
+    {
+        TraceState& state = GetState();
+
+        TraceEvent event = { name, category, ToMicroseconds(start - state.origin), ToMicroseconds(end - start), GetThreadIndex(), false };
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        if (state.callback)
+        {
+            state.callback(event, state.userdata);
+        }
+    }
+
+    void Tracer::ReportGpu(char const* name, std::uint32_t queue_idx, float duration)
+    {
+        if (!IsEnabled())
+        {
+            return;
+        }
+
+        TraceState& state = GetState();
+
+        // Launch has just been waited for, so it ended about now on the host clock
+        double const end = ToMicroseconds(Clock::now() - state.origin);
+        double const dur = 1000.0 * duration;
+        TraceEvent event = { name, "gpu", end - dur, dur, queue_idx, true };
+
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        if (state.callback)
+        {
+            state.callback(event, state.userdata);
+        }
+    }
+
+    TraceScope::TraceScope(char const* name, char const* category)
+        : m_name(name)
+        , m_category(category)
+        , m_enabled(Tracer::IsEnabled())
+    {
+        if (m_enabled)
+        {
+            m_start = Tracer::Clock::now();
+        }
+    }
+
+    TraceScope::~TraceScope()
+    {
+        if (m_enabled)
+        {
+            Tracer::Report(m_name, m_category, m_start, Tracer::Clock::now());
+        }
+    }
+}
@@ -0,0 +1,78 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <chrono>
+#include <cstdint>
+
+namespace RadeonRays
+{
+    // Declared in radeon_rays.h
+    struct TraceEvent;
+    typedef void (*TraceCallback)(TraceEvent const& event, void* userdata);
+
+    ///< The class hands spans of the commit and query pipeline over to the callback set by
+    ///< IntersectionApi::SetTraceCallback or writes them as Chrome trace event JSON between
+    ///< IntersectionApi::StartTrace and StopTrace. Tracing is process wide and disabled by
+    ///< default, disabled spans only cost an atomic load.
+    ///<
+    class Tracer
+    {
+    public:
+        typedef std::chrono::high_resolution_clock Clock;
+
+        // Check if spans are reported
+        static bool IsEnabled();
+        // Report spans to callback, nullptr disables tracing
+        static void SetCallback(TraceCallback callback, void* userdata);
+        // Write spans to a Chrome trace JSON file until StopFile, replaces the callback
+        static void StartFile(char const* filename);
+        // Finish the trace file and disable tracing
+        static void StopFile();
+        // Report CPU span of the calling thread
+        static void Report(char const* name, char const* category, Clock::time_point start, Clock::time_point end);
+        // Report GPU span of a queue which has just finished, duration in milliseconds
+        static void ReportGpu(char const* name, std::uint32_t queue_idx, float duration);
+    };
+
+    ///< Reports the span between its construction and destruction
+    ///<
+    class TraceScope
+    {
+    public:
+        TraceScope(char const* name, char const* category);
+        ~TraceScope();
+
+    private:
+        TraceScope(TraceScope const&);
+        TraceScope& operator = (TraceScope const&);
+
+        char const* m_name;
+        char const* m_category;
+        // Whether the span is reported, tracing can be switched on while it is open
+        bool m_enabled;
+        Tracer::Clock::time_point m_start;
+    };
+}
+
+#endif // TRACE_H
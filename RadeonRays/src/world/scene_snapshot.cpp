@@ -0,0 +1,491 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "scene_snapshot.h"
+#include "world.h"
+
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../except/except.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace RadeonRays
+{
+    static char const kMagic[4] = { 'R', 'R', 'S', 'S' };
+
+    // Tree entries are placed at 16 bytes boundaries, so nodes are aligned like in BvhCache files
+    static std::size_t const kTreeAlignment = 16;
+
+    // File header, followed by mesh records, instance records, tree records and data
+    struct SnapshotHeader
+    {
+        char magic[4];
+        std::uint32_t version;
+        std::uint32_t num_meshes;
+        std::uint32_t num_instances;
+        std::uint32_t num_trees;
+        std::uint32_t reserved[3];
+    };
+
+    // State of a shape set through the Shape interface
+    struct SnapshotShape
+    {
+        float transform[16];
+        float transform_inv[16];
+        float linear_motion[4];
+        float angular_motion[4];
+        std::int32_t id;
+        std::int32_t mask;
+        std::uint32_t attached;
+        // Index of the base mesh for instances
+        std::uint32_t base;
+    };
+
+    // Offsets are in bytes from the beginning of the file, vertices are 3 floats, faces 3 indices
+    struct SnapshotMesh
+    {
+        SnapshotShape shape;
+        std::uint64_t vertices;
+        std::uint64_t indices;
+        std::uint32_t num_vertices;
+        std::uint32_t num_faces;
+    };
+
+    struct SnapshotTree
+    {
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    static void StoreShapeState(ShapeImpl const* shape, bool attached, std::uint32_t base, SnapshotShape& state)
+    {
+        matrix m, minv;
+        shape->GetTransform(m, minv);
+        float3 const linear = shape->GetLinearVelocity();
+        quaternion const angular = shape->GetAngularVelocity();
+
+        std::memcpy(state.transform, &m.m[0][0], sizeof(state.transform));
+        std::memcpy(state.transform_inv, &minv.m[0][0], sizeof(state.transform_inv));
+        float const motion[8] = { linear.x, linear.y, linear.z, 0.f, angular.x, angular.y, angular.z, angular.w };
+        std::memcpy(state.linear_motion, motion, sizeof(state.linear_motion));
+        std::memcpy(state.angular_motion, motion + 4, sizeof(state.angular_motion));
+        state.id = shape->GetId();
+        state.mask = shape->GetMask();
+        state.attached = attached ? 1 : 0;
+        state.base = base;
+    }
+
+    static void LoadShapeState(SnapshotShape const& state, ShapeImpl* shape)
+    {
+        matrix m, minv;
+        std::memcpy(&m.m[0][0], state.transform, sizeof(state.transform));
+        std::memcpy(&minv.m[0][0], state.transform_inv, sizeof(state.transform_inv));
+        shape->SetTransform(m, minv);
+
+        float3 const linear(state.linear_motion[0], state.linear_motion[1], state.linear_motion[2]);
+        quaternion const angular(state.angular_motion[0], state.angular_motion[1], state.angular_motion[2], state.angular_motion[3]);
+
+        // Motion setters flag a state change, only call them for moving shapes
+        if (linear.x != 0.f || linear.y != 0.f || linear.z != 0.f)
+        {
+            shape->SetLinearVelocity(linear);
+        }
+
+        if (angular.x != 0.f || angular.y != 0.f || angular.z != 0.f)
+        {
+            shape->SetAngularVelocity(angular);
+        }
+
+        shape->SetId(state.id);
+        shape->SetMask(state.mask);
+    }
+
+    void SceneSnapshot::Save(std::string const& path, World const& world, std::vector<std::vector<char>> const& trees)
+    {
+        // Write to a temporary file first, so that readers never map partial snapshots
+        std::string tmp_path = path + ".tmp";
+        FILE* file = std::fopen(tmp_path.c_str(), "wb");
+        ThrowIf(!file, "Can't create snapshot file " + path);
+
+        bool ok = false;
+        try
+        {
+            ok = Write(world, trees, [file](void const* data, std::size_t size)
+            {
+                return std::fwrite(data, size, 1, file) == 1;
+            });
+        }
+        catch (...)
+        {
+            std::fclose(file);
+            std::remove(tmp_path.c_str());
+            throw;
+        }
+
+        ok = (std::fclose(file) == 0) && ok;
+
+        // Replace an existing snapshot of the same name
+        std::remove(path.c_str());
+        if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(tmp_path.c_str());
+            Throw("Can't write snapshot file " + path);
+        }
+    }
+
+    bool SceneSnapshot::Write(World const& world, std::vector<std::vector<char>> const& trees,
+        std::function<bool(void const*, std::size_t)> const& write_data)
+    {
+        // Meshes first: attached ones and bases of attached instances
+        std::vector<Mesh const*> meshes;
+        std::vector<bool> meshes_attached;
+        std::unordered_map<Shape const*, std::uint32_t> mesh_indices;
+        std::vector<Instance const*> instances;
+
+        auto add_mesh = [&](Shape const* shape, bool attached) -> std::uint32_t
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            ThrowIf(shapeimpl->is_group() || shapeimpl->is_curves() || shapeimpl->is_procedural() || shapeimpl->is_instance(),
+                "Snapshots only support meshes and instances of meshes");
+
+            auto mesh = static_cast<Mesh const*>(shapeimpl);
+            ThrowIf(!mesh->puretriangle(), "Snapshots only support triangle meshes");
+
+            auto iter = mesh_indices.find(shape);
+            if (iter != mesh_indices.end())
+            {
+                meshes_attached[iter->second] = meshes_attached[iter->second] || attached;
+                return iter->second;
+            }
+
+            auto index = static_cast<std::uint32_t>(meshes.size());
+            mesh_indices[shape] = index;
+            meshes.push_back(mesh);
+            meshes_attached.push_back(attached);
+            return index;
+        };
+
+        for (auto shape : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            if (shapeimpl->is_instance())
+            {
+                instances.push_back(static_cast<Instance const*>(shapeimpl));
+            }
+            else
+            {
+                add_mesh(shape, true);
+            }
+        }
+
+        std::vector<std::uint32_t> instance_bases;
+        for (auto instance : instances)
+        {
+            instance_bases.push_back(add_mesh(instance->GetBaseShape(), false));
+        }
+
+        SnapshotHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, kMagic, sizeof(kMagic));
+        header.version = kVersion;
+        header.num_meshes = static_cast<std::uint32_t>(meshes.size());
+        header.num_instances = static_cast<std::uint32_t>(instances.size());
+        header.num_trees = static_cast<std::uint32_t>(trees.size());
+
+        std::vector<SnapshotMesh> mesh_records(meshes.size());
+        std::vector<SnapshotShape> instance_records(instances.size());
+        std::vector<SnapshotTree> tree_records(trees.size());
+
+        std::uint64_t offset = sizeof(header) +
+            mesh_records.size() * sizeof(SnapshotMesh) +
+            instance_records.size() * sizeof(SnapshotShape) +
+            tree_records.size() * sizeof(SnapshotTree);
+
+        for (std::size_t i = 0; i < meshes.size(); ++i)
+        {
+            StoreShapeState(meshes[i], meshes_attached[i], 0, mesh_records[i].shape);
+            mesh_records[i].num_vertices = static_cast<std::uint32_t>(meshes[i]->num_vertices());
+            mesh_records[i].num_faces = static_cast<std::uint32_t>(meshes[i]->num_faces());
+            mesh_records[i].vertices = offset;
+            offset += 3ull * mesh_records[i].num_vertices * sizeof(float);
+            mesh_records[i].indices = offset;
+            offset += 3ull * mesh_records[i].num_faces * sizeof(int);
+        }
+
+        for (std::size_t i = 0; i < instances.size(); ++i)
+        {
+            StoreShapeState(instances[i], true, instance_bases[i], instance_records[i]);
+        }
+
+        for (std::size_t i = 0; i < trees.size(); ++i)
+        {
+            offset = (offset + kTreeAlignment - 1) / kTreeAlignment * kTreeAlignment;
+            tree_records[i].offset = offset;
+            tree_records[i].size = trees[i].size();
+            offset += trees[i].size();
+        }
+
+        std::uint64_t written = 0;
+        auto write = [&](void const* data, std::size_t size)
+        {
+            if (size && !write_data(data, size))
+            {
+                return false;
+            }
+            written += size;
+            return true;
+        };
+
+        bool ok = write(&header, sizeof(header)) &&
+            write(mesh_records.data(), mesh_records.size() * sizeof(SnapshotMesh)) &&
+            write(instance_records.data(), instance_records.size() * sizeof(SnapshotShape)) &&
+            write(tree_records.data(), tree_records.size() * sizeof(SnapshotTree));
+
+        // Mesh data goes through a buffer as meshes might be views with strides
+        std::vector<float> vertices;
+        std::vector<int> indices;
+        for (std::size_t i = 0; ok && i < meshes.size(); ++i)
+        {
+            vertices.resize(3 * static_cast<std::size_t>(meshes[i]->num_vertices()));
+            for (int v = 0; v < meshes[i]->num_vertices(); ++v)
+            {
+                float3 const p = meshes[i]->GetVertex(v);
+                vertices[3 * v] = p.x;
+                vertices[3 * v + 1] = p.y;
+                vertices[3 * v + 2] = p.z;
+            }
+
+            indices.resize(3 * static_cast<std::size_t>(meshes[i]->num_faces()));
+            for (int f = 0; f < meshes[i]->num_faces(); ++f)
+            {
+                Mesh::Face const face = meshes[i]->GetFace(f);
+                indices[3 * f] = face.i0;
+                indices[3 * f + 1] = face.i1;
+                indices[3 * f + 2] = face.i2;
+            }
+
+            ok = write(vertices.data(), vertices.size() * sizeof(float)) && write(indices.data(), indices.size() * sizeof(int));
+        }
+
+        char const padding[kTreeAlignment] = {};
+        for (std::size_t i = 0; ok && i < trees.size(); ++i)
+        {
+            ok = write(padding, static_cast<std::size_t>(tree_records[i].offset - written)) &&
+                write(trees[i].data(), trees[i].size());
+        }
+
+        return ok;
+    }
+
+    SceneSnapshot::SceneSnapshot(std::string const& path)
+        : m_data(nullptr)
+        , m_size(0)
+#ifdef WIN32
+        , m_file(INVALID_HANDLE_VALUE)
+        , m_mapping(nullptr)
+#endif
+    {
+#ifdef WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        ThrowIf(m_file == INVALID_HANDLE_VALUE, "Can't open snapshot file " + path);
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size) || size.QuadPart < (LONGLONG)sizeof(SnapshotHeader) ||
+            !(m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr)) ||
+            !(m_data = static_cast<char const*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0))))
+        {
+            Release();
+            Throw("Can't map snapshot file " + path);
+        }
+
+        m_size = (std::size_t)size.QuadPart;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        ThrowIf(fd < 0, "Can't open snapshot file " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(SnapshotHeader))
+        {
+            close(fd);
+            Throw("Can't map snapshot file " + path);
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        void* data = mmap(nullptr, (std::size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        ThrowIf(data == MAP_FAILED, "Can't map snapshot file " + path);
+
+        m_data = static_cast<char const*>(data);
+        m_size = (std::size_t)st.st_size;
+#endif
+
+        // Reject foreign or truncated files before anything references the mapping
+        auto header = reinterpret_cast<SnapshotHeader const*>(m_data);
+        std::uint64_t const records_size = sizeof(SnapshotHeader) +
+            (std::uint64_t)header->num_meshes * sizeof(SnapshotMesh) +
+            (std::uint64_t)header->num_instances * sizeof(SnapshotShape) +
+            (std::uint64_t)header->num_trees * sizeof(SnapshotTree);
+
+        // Counts are used as ints by shapes and intersectors
+        bool valid = std::memcmp(header->magic, kMagic, sizeof(kMagic)) == 0 &&
+            header->version == kVersion && records_size <= m_size &&
+            (std::uint64_t)header->num_meshes + header->num_instances <= INT_MAX;
+
+        // Data follows the records, offsets near 2^64 must not wrap around the size check
+        auto contains = [this, records_size](std::uint64_t offset, std::uint64_t size)
+        {
+            return offset >= records_size && offset <= m_size && size <= m_size - offset;
+        };
+
+        auto meshes = reinterpret_cast<SnapshotMesh const*>(m_data + sizeof(SnapshotHeader));
+        auto instances = reinterpret_cast<SnapshotShape const*>(meshes + (valid ? header->num_meshes : 0));
+        auto trees = reinterpret_cast<SnapshotTree const*>(instances + (valid ? header->num_instances : 0));
+
+        for (std::uint32_t i = 0; valid && i < header->num_meshes; ++i)
+        {
+            valid = meshes[i].vertices % sizeof(float) == 0 && meshes[i].indices % sizeof(int) == 0 &&
+                contains(meshes[i].vertices, 3ull * meshes[i].num_vertices * sizeof(float)) &&
+                contains(meshes[i].indices, 3ull * meshes[i].num_faces * sizeof(int)) &&
+                meshes[i].num_vertices <= INT_MAX && meshes[i].num_faces <= INT_MAX;
+
+            // Faces are not checked against vertices past this point
+            auto faces = reinterpret_cast<int const*>(m_data + (valid ? meshes[i].indices : 0));
+            for (std::uint64_t j = 0; valid && j < 3ull * meshes[i].num_faces; ++j)
+            {
+                valid = faces[j] >= 0 && (std::uint32_t)faces[j] < meshes[i].num_vertices;
+            }
+        }
+
+        for (std::uint32_t i = 0; valid && i < header->num_instances; ++i)
+        {
+            valid = instances[i].base < header->num_meshes;
+        }
+
+        for (std::uint32_t i = 0; valid && i < header->num_trees; ++i)
+        {
+            valid = trees[i].offset % kTreeAlignment == 0 && trees[i].size >= sizeof(BvhCache::Header) &&
+                contains(trees[i].offset, trees[i].size) &&
+                BvhCache::GetEntrySize(*reinterpret_cast<BvhCache::Header const*>(m_data + trees[i].offset)) == trees[i].size;
+        }
+
+        if (!valid)
+        {
+            Release();
+            Throw("Invalid snapshot file " + path);
+        }
+    }
+
+    SceneSnapshot::~SceneSnapshot()
+    {
+        Release();
+    }
+
+    void SceneSnapshot::Release()
+    {
+#ifdef WIN32
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+        }
+
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+        }
+
+        if (m_file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_file);
+        }
+
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = nullptr;
+#else
+        if (m_data)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+#endif
+        m_data = nullptr;
+    }
+
+    int SceneSnapshot::GetShapeCount() const
+    {
+        auto header = reinterpret_cast<SnapshotHeader const*>(m_data);
+        return static_cast<int>(header->num_meshes + header->num_instances);
+    }
+
+    void SceneSnapshot::CreateShapes(std::vector<ShapeImpl*>& shapes, std::vector<bool>& attached) const
+    {
+        auto header = reinterpret_cast<SnapshotHeader const*>(m_data);
+        auto meshes = reinterpret_cast<SnapshotMesh const*>(m_data + sizeof(SnapshotHeader));
+        auto instances = reinterpret_cast<SnapshotShape const*>(meshes + header->num_meshes);
+
+        std::size_t const first = shapes.size();
+
+        for (std::uint32_t i = 0; i < header->num_meshes; ++i)
+        {
+            auto const& record = meshes[i];
+            Mesh* mesh = new Mesh(reinterpret_cast<float const*>(m_data + record.vertices), (int)record.num_vertices, 3 * sizeof(float),
+                reinterpret_cast<int const*>(m_data + record.indices), 3 * sizeof(int), (int)record.num_faces);
+
+            LoadShapeState(record.shape, mesh);
+            shapes.push_back(mesh);
+            attached.push_back(record.shape.attached != 0);
+        }
+
+        for (std::uint32_t i = 0; i < header->num_instances; ++i)
+        {
+            Instance* instance = new Instance(shapes[first + instances[i].base]);
+
+            LoadShapeState(instances[i], instance);
+            shapes.push_back(instance);
+            attached.push_back(instances[i].attached != 0);
+        }
+    }
+
+    void SceneSnapshot::AddTrees(BvhCache::Snapshot& trees) const
+    {
+        auto header = reinterpret_cast<SnapshotHeader const*>(m_data);
+        auto records = reinterpret_cast<SnapshotTree const*>(m_data + sizeof(SnapshotHeader) +
+            header->num_meshes * sizeof(SnapshotMesh) + header->num_instances * sizeof(SnapshotShape));
+
+        for (std::uint32_t i = 0; i < header->num_trees; ++i)
+        {
+            trees.AddEntry(m_data + records[i].offset);
+        }
+    }
+}
@@ -0,0 +1,84 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef SCENE_SNAPSHOT_H
+#define SCENE_SNAPSHOT_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "../translator/bvh_cache.h"
+
+namespace RadeonRays
+{
+    class World;
+    class ShapeImpl;
+
+    /// Whole scene snapshot: triangle meshes and instances of a world with their ids, masks,
+    /// transforms and motion, followed by the trees built for them (BvhCache entries), in one
+    /// file. Loaded snapshots are memory mapped, meshes are views of the mapping and
+    /// the trees are found by BvhCache lookups of the next commit instead of being built.
+    ///
+    class SceneSnapshot
+    {
+    public:
+        // Map a snapshot file, throws if it can't be mapped or is not a valid snapshot
+        explicit SceneSnapshot(std::string const& path);
+        ~SceneSnapshot();
+
+        // Write attached shapes and meshes referenced by attached instances along with
+        // entries collected by a recording BvhCache::Snapshot, throws on failure
+        static void Save(std::string const& path, World const& world, std::vector<std::vector<char>> const& trees);
+        // Produce the contents of a snapshot file through write(data, size), which returns false
+        // on failure. Returns false if a write failed, throws for unsupported shapes.
+        static bool Write(World const& world, std::vector<std::vector<char>> const& trees,
+            std::function<bool(void const*, std::size_t)> const& write);
+
+        // Number of shapes stored, meshes come first and instances follow them
+        int GetShapeCount() const;
+        // Create shapes in the stored order, attached says if the shape was attached when saved.
+        // Meshes reference the mapping, so the snapshot has to outlive them.
+        void CreateShapes(std::vector<ShapeImpl*>& shapes, std::vector<bool>& attached) const;
+        // Add stored trees to the snapshot BvhCache looks up through World
+        void AddTrees(BvhCache::Snapshot& trees) const;
+
+        // Bump on any file format change
+        static std::uint32_t const kVersion = 1;
+
+    private:
+        SceneSnapshot(SceneSnapshot const&);
+        SceneSnapshot& operator = (SceneSnapshot const&);
+
+        // Unmap the file
+        void Release();
+
+        char const* m_data;
+        std::size_t m_size;
+#ifdef WIN32
+        void* m_file;
+        void* m_mapping;
+#endif
+    };
+}
+
+#endif // SCENE_SNAPSHOT_H
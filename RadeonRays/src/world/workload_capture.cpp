@@ -0,0 +1,119 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "workload_capture.h"
+#include "world.h"
+#include "scene_snapshot.h"
+
+#include "../device/remote_protocol.h"
+#include "../util/options.h"
+#include "../except/except.h"
+
+namespace RadeonRays
+{
+    // Query batches written after each scene unless "capture.max_queries" is set
+    static int const kDefaultMaxQueries = 16;
+
+    WorkloadCapture::WorkloadCapture(std::string const& path)
+        : m_path(path)
+        , m_file(std::fopen(path.c_str(), "wb"))
+        , m_num_queries(0)
+        , m_max_queries(0)
+    {
+        ThrowIf(!m_file, "Can't create capture file " + path);
+    }
+
+    WorkloadCapture::~WorkloadCapture()
+    {
+        std::fclose(m_file);
+    }
+
+    void WorkloadCapture::WriteScene(World const& world)
+    {
+        // Capture options are left out, so that replays don't capture again
+        std::vector<Remote::SceneOption> options;
+        for (int i = 0; i < Options::kNumOptions; ++i)
+        {
+            auto id = static_cast<Options::OptionId>(i);
+            auto option = world.options_.GetOption(id);
+            if (option && id != Options::kCaptureMaxQueries && id != Options::kCapturePath)
+            {
+                Remote::SceneOption capture;
+                capture.name = Options::GetOptionName(id);
+                capture.is_string = Options::GetOptionType(id) == Options::kOptionString;
+                capture.strval = option->AsString();
+                capture.floatval = option->AsFloat();
+                options.push_back(capture);
+            }
+        }
+
+        std::vector<char> payload;
+        Remote::WriteSceneOptions(options, payload);
+
+        // Trees are left out too, replays build them with their own options
+        bool const ok = SceneSnapshot::Write(world, std::vector<std::vector<char>>(), [&payload](void const* data, std::size_t size)
+        {
+            Remote::Append(payload, data, size);
+            return true;
+        });
+        ThrowIf(!ok, "Can't serialize the scene");
+
+        auto maxqueries = world.options_.GetOption(Options::kCaptureMaxQueries);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        WriteRecord(Capture::kScene, nullptr, 0, payload.data(), payload.size());
+        m_num_queries = 0;
+        m_max_queries = maxqueries ? (int)maxqueries->AsFloat() : kDefaultMaxQueries;
+    }
+
+    bool WorkloadCapture::IsCapturingQueries() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_num_queries < m_max_queries;
+    }
+
+    void WorkloadCapture::WriteQuery(QueryType type, void const* rays, int numrays, std::size_t stride)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_num_queries >= m_max_queries)
+        {
+            return;
+        }
+
+        Capture::QueryRecord record = { static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(numrays),
+            static_cast<std::uint32_t>(stride), 0 };
+        WriteRecord(Capture::kQuery, &record, sizeof(record), rays, numrays * stride);
+        ++m_num_queries;
+    }
+
+    void WorkloadCapture::WriteRecord(Capture::RecordType type, void const* head, std::size_t headsize, void const* data, std::size_t size)
+    {
+        Capture::RecordHeader header = { Capture::kMagic, static_cast<std::uint32_t>(type), headsize + size };
+
+        bool const ok = std::fwrite(&header, sizeof(header), 1, m_file) == 1 &&
+            (headsize == 0 || std::fwrite(head, headsize, 1, m_file) == 1) &&
+            (size == 0 || std::fwrite(data, size, 1, m_file) == 1) &&
+            std::fflush(m_file) == 0;
+
+        ThrowIf(!ok, "Can't write capture file " + m_path);
+    }
+}
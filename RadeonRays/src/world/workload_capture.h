@@ -0,0 +1,124 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef WORKLOAD_CAPTURE_H
+#define WORKLOAD_CAPTURE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "radeon_rays.h"
+
+namespace RadeonRays
+{
+    class World;
+
+    ///< Workload capture files written with "capture.path" and replayed by "Benchmark replay".
+    ///< Every record is a header followed by size bytes of payload:
+    ///<
+    ///< kScene: scene of a commit laid out like kScene messages of the remote protocol
+    ///<         (see remote_protocol.h): options followed by a scene snapshot without trees
+    ///< kQuery: QueryRecord of a batch issued after the commit followed by its rays
+    ///<         in the layout of "acc.ray_format"
+    ///<
+    namespace Capture
+    {
+        // Bump on any record layout change
+        static std::uint32_t const kMagic = 0x31435252; // "RRC1"
+
+        enum RecordType
+        {
+            kScene = 1,
+            kQuery
+        };
+
+        struct RecordHeader
+        {
+            std::uint32_t magic;
+            std::uint32_t type;
+            std::uint64_t size;
+        };
+
+        struct QueryRecord
+        {
+            // QueryType of the batch
+            std::uint32_t type;
+            std::uint32_t numrays;
+            // Bytes per ray
+            std::uint32_t stride;
+            std::uint32_t reserved;
+        };
+
+        // Read the next record, false at the end of the file or for malformed records
+        inline bool ReadRecord(std::FILE* file, RecordHeader& header, std::vector<char>& payload)
+        {
+            if (std::fread(&header, sizeof(header), 1, file) != 1 || header.magic != kMagic)
+            {
+                return false;
+            }
+
+            payload.resize(static_cast<std::size_t>(header.size));
+            return payload.empty() || std::fread(&payload[0], payload.size(), 1, file) == 1;
+        }
+    }
+
+    /// Writer of a workload capture file. A scene is written at every commit and up to
+    /// "capture.max_queries" query batches issued after it follow, calls are thread safe.
+    /// Records are flushed as they are written, so captures of crashing applications are usable.
+    ///
+    class WorkloadCapture
+    {
+    public:
+        // Create the file, throws if it can't be created
+        explicit WorkloadCapture(std::string const& path);
+        ~WorkloadCapture();
+
+        std::string const& GetPath() const { return m_path; }
+
+        // Write options and shapes of a world, throws for shapes snapshots don't support
+        void WriteScene(World const& world);
+        // Check if a batch issued now would be written, rays in device memory are
+        // only read back for batches that are
+        bool IsCapturingQueries() const;
+        // Write numrays rays of stride bytes each, batches past the limit are dropped
+        void WriteQuery(QueryType type, void const* rays, int numrays, std::size_t stride);
+
+    private:
+        WorkloadCapture(WorkloadCapture const&);
+        WorkloadCapture& operator = (WorkloadCapture const&);
+
+        // Write a record of fixed size part and data, throws on failure
+        void WriteRecord(Capture::RecordType type, void const* head, std::size_t headsize, void const* data, std::size_t size);
+
+        std::string m_path;
+        std::FILE* m_file;
+        // Query batches written since the last scene and their limit
+        int m_num_queries;
+        int m_max_queries;
+        mutable std::mutex m_mutex;
+    };
+}
+
+#endif // WORKLOAD_CAPTURE_H
@@ -22,32 +22,133 @@ THE SOFTWARE.
 #include "world.h"
 
 #include "../primitive/shapeimpl.h"
+#include "../primitive/instance.h"
+#include "../primitive/group.h"
+
+#include <algorithm>
 
 namespace RadeonRays
 {
+    // State changes of shapes referenced by an instance or a group
+    static int GetNestedStateChange(ShapeImpl const* shapeimpl)
+    {
+        int statechange = ShapeImpl::kStateChangeNone;
+
+        if (shapeimpl->is_instance())
+        {
+            auto baseshape = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape());
+
+            // Base shape geometry might have been updated even if it is not attached,
+            // group members are placed relative to the instance so any change matters
+            statechange |= baseshape->is_group() ?
+                GetNestedStateChange(baseshape) :
+                baseshape->GetStateChange() & ShapeImpl::kStateChangeVertices;
+        }
+        else if (shapeimpl->is_group())
+        {
+            for (auto shape : static_cast<Group const*>(shapeimpl)->GetShapes())
+            {
+                auto member = static_cast<ShapeImpl const*>(shape);
+                statechange |= member->GetStateChange() | GetNestedStateChange(member);
+            }
+        }
+
+        return statechange;
+    }
+
+    // Check if the shape is of a kind (e.g. ShapeImpl::is_curves) or references one through instances and groups
+    static bool ContainsKind(ShapeImpl const* shapeimpl, bool (ShapeImpl::*is_kind)() const)
+    {
+        if (shapeimpl->is_instance())
+        {
+            return ContainsKind(static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape()), is_kind);
+        }
+        else if (shapeimpl->is_group())
+        {
+            auto const& members = static_cast<Group const*>(shapeimpl)->GetShapes();
+
+            return std::any_of(members.cbegin(), members.cend(), [is_kind](Shape const* shape)
+            {
+                return ContainsKind(static_cast<ShapeImpl const*>(shape), is_kind);
+            });
+        }
+
+        return (shapeimpl->*is_kind)();
+    }
+
+    // Clear state changes of shapes referenced by an instance or a group
+    static void OnNestedCommit(ShapeImpl const* shapeimpl)
+    {
+        if (shapeimpl->is_instance())
+        {
+            auto baseshape = static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape());
+            baseshape->OnCommit();
+            OnNestedCommit(baseshape);
+        }
+        else if (shapeimpl->is_group())
+        {
+            for (auto shape : static_cast<Group const*>(shapeimpl)->GetShapes())
+            {
+                auto member = static_cast<ShapeImpl const*>(shape);
+                member->OnCommit();
+                OnNestedCommit(member);
+            }
+        }
+    }
+
     void World::AttachShape(Shape const* shape)
     {
-        if (std::find(shapes_.cbegin(), shapes_.cend(), shape) == shapes_.cend())
+        if (shape_indices_.emplace(shape, shapes_.size()).second)
         {
             shapes_.push_back(shape);
-            has_changed_ = true;
+            shapes_added_.insert(shape);
+        }
+    }
+
+    void World::AttachShapes(Shape const* const* shapes, int numshapes)
+    {
+        shapes_.reserve(shapes_.size() + numshapes);
+        shape_indices_.reserve(shape_indices_.size() + numshapes);
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            AttachShape(shapes[i]);
         }
     }
 
     void World::DetachShape(Shape const* shape)
     {
-        auto iter = std::find(shapes_.begin(), shapes_.end(), shape);
-        if (iter != shapes_.end())
+        auto iter = shape_indices_.find(shape);
+        if (iter != shape_indices_.end())
         {
-            shapes_.erase(iter);
-            has_changed_ = true;
+            // Move the last shape into the freed slot
+            auto last = shapes_.back();
+            shapes_[iter->second] = last;
+            shape_indices_[last] = iter->second;
+            shapes_.pop_back();
+            shape_indices_.erase(shape);
+            OnDetach(shape);
         }
     }
     
     void World::DetachAll()
     {
+        for (auto shape : shapes_)
+        {
+            OnDetach(shape);
+        }
+
         shapes_.clear();
-        has_changed_ = true;
+        shape_indices_.clear();
+    }
+
+    void World::OnDetach(Shape const* shape)
+    {
+        // Shapes attached since the last commit are simply forgotten
+        if (shapes_added_.erase(shape) == 0)
+        {
+            shapes_removed_.push_back(shape);
+        }
     }
 
     int World::GetStateChange() const
@@ -58,12 +159,66 @@ namespace RadeonRays
         {
             ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
-            statechange_ |= shapeimpl->GetStateChange();
+            statechange_ |= shapeimpl->GetStateChange() | GetNestedStateChange(shapeimpl);
         }
 
         return statechange_;
     }
 
+    void World::GetChanges(std::vector<ShapeChange>& changes) const
+    {
+        changes.clear();
+
+        for (auto shape : shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            int flags = shapeimpl->GetStateChange() | GetNestedStateChange(shapeimpl);
+
+            if (shapes_added_.count(shape))
+            {
+                flags |= ShapeImpl::kStateChangeAdded;
+            }
+
+            if (flags != ShapeImpl::kStateChangeNone)
+            {
+                changes.push_back(ShapeChange{ shape, flags });
+            }
+        }
+
+        for (auto shape : shapes_removed_)
+        {
+            changes.push_back(ShapeChange{ shape, ShapeImpl::kStateChangeRemoved });
+        }
+    }
+
+    bool World::HasGroups() const
+    {
+        return std::any_of(shapes_.cbegin(), shapes_.cend(), [](Shape const* shape)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            return shapeimpl->is_group() || (shapeimpl->is_instance() &&
+                static_cast<ShapeImpl const*>(static_cast<Instance const*>(shapeimpl)->GetBaseShape())->is_group());
+        });
+    }
+
+    bool World::HasCurves() const
+    {
+        return std::any_of(shapes_.cbegin(), shapes_.cend(), [](Shape const* shape)
+        {
+            return ContainsKind(static_cast<ShapeImpl const*>(shape), &ShapeImpl::is_curves);
+        });
+    }
+
+    bool World::HasProcedurals() const
+    {
+        return std::any_of(shapes_.cbegin(), shapes_.cend(), [](Shape const* shape)
+        {
+            return ContainsKind(static_cast<ShapeImpl const*>(shape), &ShapeImpl::is_procedural);
+        });
+    }
+
     void World::OnCommit()
     {
         for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
@@ -71,8 +226,11 @@ namespace RadeonRays
             auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
             shapeimpl->OnCommit();
+            OnNestedCommit(shapeimpl);
         }
 
+        shapes_added_.clear();
+        shapes_removed_.clear();
         has_changed_ = false;
     }
 }
\ No newline at end of file
@@ -23,10 +23,13 @@ THE SOFTWARE.
 #define WORLD_H
 
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "radeon_rays.h"
 #include "../util/options.h"
+#include "../translator/bvh_cache.h"
 
 namespace RadeonRays
 {
@@ -38,36 +41,71 @@ namespace RadeonRays
     class World
     {
     public:
+        // Change of a shape since the last commit
+        struct ShapeChange
+        {
+            // Detached shapes might have been deleted already, so the pointer only identifies them
+            Shape const* shape;
+            // ShapeImpl::StateChangeFlags, including changes of shapes referenced by instances and groups
+            int flags;
+        };
+
         //
         World();
         //
         virtual ~World();
         // Attach the shape updating all the flags
         void AttachShape(Shape const* shape);
+        // Attach several shapes reserving space for all of them first
+        void AttachShapes(Shape const* const* shapes, int numshapes);
         // Detach the shape 
         void DetachShape(Shape const* shape);
         // Detach all
         void DetachAll();
+        // Check if the shape is attached
+        bool IsAttached(Shape const* shape) const;
         // Call this as scene has been commited
         void OnCommit();
-        // 
+        // Check if shapes have been attached or detached since the last commit,
+        // shapes attached and detached again in between don't count
         bool has_changed() const;
-        //
+        // State changes of all the attached shapes combined
         int GetStateChange() const;
+        // Per shape changes since the last commit, unchanged shapes are left out.
+        // A shape detached and attached again is reported as both removed and added,
+        // since a new shape might have taken the address of a deleted one
+        void GetChanges(std::vector<ShapeChange>& changes) const;
+        // Check if groups are attached or instanced, these are only traversed by 2 level BVH
+        bool HasGroups() const;
+        // Check if curves are attached, instanced or grouped, these are only traversed by 2 level BVH
+        bool HasCurves() const;
+        // Check if spheres, disks or custom primitives are attached, instanced or grouped, these are only traversed by 2 level BVH
+        bool HasProcedurals() const;
 
+    private:
+        // Record detachment of a shape
+        void OnDetach(Shape const* shape);
 
     public:
-        // Shapes in the scene
+        // Shapes in the scene, detaching moves the last one into the freed slot
+        // so the order is only preserved while shapes are attached
         std::vector<Shape const*> shapes_;
-        // Flags to indicate shapes have been changed
-        std::vector<int> shapes_dirty_;
+        // Position of each attached shape in shapes_
+        std::unordered_map<Shape const*, std::size_t> shape_indices_;
+        // Shapes attached and detached since the last commit
+        std::unordered_set<Shape const*> shapes_added_;
+        std::vector<Shape const*> shapes_removed_;
 
-        // TODO: Do more preciese dirty flags tracking
+        // Nothing has been committed yet
         bool has_changed_;
         // Global flags
         int hint_;
         // Options
         Options options_;
+        // Trees of a loaded scene snapshot, also collects trees while a snapshot is saved (nullptr if unused)
+        std::shared_ptr<BvhCache::Snapshot> bvh_snapshot_;
+        // Rays set by IntersectionApi::SetRaySamples that world space trees are optimized for (nullptr if not set)
+        std::shared_ptr<std::vector<ray> const> ray_samples_;
     };
 
     inline World::World()
@@ -79,9 +117,14 @@ namespace RadeonRays
     {
     }
 
+    inline bool World::IsAttached(Shape const* shape) const
+    {
+        return shape_indices_.find(shape) != shape_indices_.cend();
+    }
+
     inline bool World::has_changed() const
     {
-        return has_changed_;
+        return has_changed_ || !shapes_added_.empty() || !shapes_removed_.empty();
     }
 }
 
@@ -0,0 +1,72 @@
+project "RemoteServer"
+    location "../RemoteServer"
+    kind "ConsoleApp"
+    includedirs { "../RadeonRays/include", "../RadeonRays/src", "." }
+    links {"RadeonRays", "Calc"}
+    files { "**.cpp", "**.h", "../RadeonRays/src/util/socket.cpp", "../RadeonRays/src/util/socket.h" }
+
+    if _OPTIONS["shared_calc"] then
+       defines {"CALC_IMPORT_API"};
+    else
+       defines {"CALC_STATIC_LIBRARY"}
+    end
+
+    if os.is("macosx") then
+        buildoptions "-std=c++11 -stdlib=libc++"
+    elseif os.is("linux") then
+        buildoptions "-std=c++11"
+        links {"pthread"}
+    elseif os.is("windows") then
+        links {"ws2_32"}
+    end
+
+    if _OPTIONS["use_opencl"] then
+        links {"CLW"}
+    end
+
+    if _OPTIONS["use_embree"] then
+        configuration {"x32"}
+            libdirs { "../3rdParty/embree/lib/x86"}
+        configuration {"x64"}
+            libdirs { "../3rdParty/embree/lib/x64"}
+        configuration {}
+
+        if os.is("macosx") then
+            links {"embree.2"}
+        else
+            links {"embree"}
+        end
+    end
+
+    if _OPTIONS["use_vulkan"] then
+        local vulkanSDKPath = os.getenv( "VK_SDK_PATH" );
+        if vulkanSDKPath == nil then
+            vulkanSDKPath = os.getenv( "VULKAN_SDK" );
+        end
+        if vulkanSDKPath ~= nil then
+            configuration {"x32"}
+            libdirs { vulkanSDKPath .. "/Bin32" }
+            configuration {"x64"}
+            libdirs { vulkanSDKPath .. "/Bin" }
+            configuration {}
+        end
+        if os.is("linux") then
+            libdirs { vulkanSDKPath .. "/lib" }
+            links { "Anvil",
+                    "vulkan",
+                    "pthread"}
+        elseif os.is("windows") then
+            links {"Anvil"}
+            links{"vulkan-1"}
+        end
+    end
+
+    configuration {"x32", "Debug"}
+        targetdir "../Bin/Debug/x86"
+    configuration {"x64", "Debug"}
+        targetdir "../Bin/Debug/x64"
+    configuration {"x32", "Release"}
+        targetdir "../Bin/Release/x86"
+    configuration {"x64", "Release"}
+        targetdir "../Bin/Release/x64"
+    configuration {}
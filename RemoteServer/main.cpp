@@ -0,0 +1,565 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// Remote intersection server: serves IntersectionApi::CreateRemote clients over TCP.
+/// Scenes are committed on a local device and shared by clients sending identical scenes,
+/// queries of all the clients of a scene are gathered into single launches.
+///
+/// Usage: RemoteServer [-p port] [-d device] [-w batch_window_us] [-t tmp_dir]
+///
+/// The device defaults to the first GPU, scene snapshots are written to tmp_dir
+/// (current directory by default) while the scene is in use.
+
+#include "radeon_rays.h"
+#include "device/remote_protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace RadeonRays;
+
+namespace
+{
+    // Rays of a single launch, clients split queries above it
+    std::size_t const kMaxBatchRays = Remote::kMaxQueryRays;
+
+    struct Settings
+    {
+        std::uint32_t devidx;
+        int window_us;
+        std::string tmp_dir;
+    };
+
+    Settings g_settings = { 0, 500, "." };
+
+    // Client connection, answers of batcher threads and the connection thread are serialized
+    struct Connection
+    {
+        explicit Connection(Socket&& s)
+            : socket(std::move(s))
+        {
+        }
+
+        void Answer(Remote::MessageType type, std::uint64_t id, void const* payload, std::size_t size)
+        {
+            std::lock_guard<std::mutex> lock(send_mutex);
+            if (!Remote::WriteMessage(socket, type, id, payload, size))
+            {
+                // The connection thread notices on its next read
+                socket.Shutdown();
+            }
+        }
+
+        void Fail(std::uint64_t id, std::string const& message)
+        {
+            // Longer errors would be dropped as malformed by the client
+            std::size_t const size = std::min<std::size_t>(message.size(), Remote::kMaxErrorPayload);
+            Answer(Remote::kError, id, message.data(), size);
+        }
+
+        Socket socket;
+        std::mutex send_mutex;
+    };
+
+    // Query waiting for a launch
+    struct Job
+    {
+        std::shared_ptr<Connection> connection;
+        std::uint64_t id;
+        Remote::MessageType type;
+        std::vector<char> rays;
+    };
+
+    // Committed scene, shared by the connections which sent the same payload
+    class Scene
+    {
+    public:
+        Scene(std::vector<char> const& payload, std::uint64_t key)
+            : m_api(nullptr)
+            , m_stop(false)
+        {
+            std::vector<Remote::SceneOption> options;
+            std::size_t offset = Remote::ReadSceneOptions(payload, options);
+            if (offset == 0)
+            {
+                throw std::runtime_error("Malformed scene message");
+            }
+
+            // Rejected before anything is written or created
+            for (auto const& option : options)
+            {
+                if (!Remote::IsSceneOption(option))
+                {
+                    throw std::runtime_error("Option " + option.name + " is not accepted by the server");
+                }
+            }
+
+            std::ostringstream path;
+            path << g_settings.tmp_dir << "/remote_scene_" << std::hex << key << "_" << this << ".rrsnap";
+            m_path = path.str();
+
+            // Snapshots are loaded from files, the file stays mapped while the scene lives
+            FILE* file = std::fopen(m_path.c_str(), "wb");
+            bool written = file && std::fwrite(&payload[offset], 1, payload.size() - offset, file) == payload.size() - offset;
+            if (file)
+            {
+                std::fclose(file);
+            }
+
+            if (!written)
+            {
+                std::remove(m_path.c_str());
+                throw std::runtime_error("Can't write scene file " + m_path);
+            }
+
+            try
+            {
+                m_api = IntersectionApi::Create(g_settings.devidx);
+                if (!m_api)
+                {
+                    throw std::runtime_error("Can't create intersection API");
+                }
+
+                for (auto const& option : options)
+                {
+                    if (option.is_string)
+                        m_api->SetOption(option.name.c_str(), option.strval.c_str());
+                    else
+                        m_api->SetOption(option.name.c_str(), option.floatval);
+                }
+
+                int numshapes = m_api->LoadSnapshot(m_path.c_str(), nullptr, 0);
+                m_shapes.resize(numshapes);
+                if (numshapes)
+                {
+                    m_api->LoadSnapshot(m_path.c_str(), &m_shapes[0], numshapes);
+                }
+
+                m_api->Commit();
+            }
+            catch (...)
+            {
+                Release();
+                throw;
+            }
+
+            m_batcher = std::thread(&Scene::Batch, this);
+        }
+
+        ~Scene()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_cv.notify_one();
+            m_batcher.join();
+
+            Release();
+        }
+
+        void Enqueue(Job&& job)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_jobs.push_back(std::move(job));
+            }
+            m_cv.notify_one();
+        }
+
+    private:
+        void Release()
+        {
+            if (m_api)
+            {
+                for (auto shape : m_shapes)
+                {
+                    m_api->DeleteShape(shape);
+                }
+
+                IntersectionApi::Delete(m_api);
+                m_api = nullptr;
+            }
+
+            std::remove(m_path.c_str());
+        }
+
+        // Gather jobs of one type for a short window and trace them in a single launch
+        void Batch()
+        {
+            std::vector<Job> batch;
+            std::vector<ray> rays;
+            std::vector<char> hits;
+
+            for (;;)
+            {
+                batch.clear();
+                {
+                    std::unique_lock<std::mutex> lock(m_mutex);
+                    m_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+                    if (m_stop)
+                    {
+                        return;
+                    }
+
+                    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(g_settings.window_us);
+                    std::size_t numrays = 0;
+                    Remote::MessageType type = m_jobs.front().type;
+
+                    for (;;)
+                    {
+                        for (auto iter = m_jobs.begin(); iter != m_jobs.end();)
+                        {
+                            std::size_t count = iter->rays.size() / sizeof(ray);
+                            if (iter->type == type && (batch.empty() || numrays + count <= kMaxBatchRays))
+                            {
+                                numrays += count;
+                                batch.push_back(std::move(*iter));
+                                iter = m_jobs.erase(iter);
+                            }
+                            else
+                            {
+                                ++iter;
+                            }
+                        }
+
+                        if (m_stop || numrays >= kMaxBatchRays ||
+                            !m_cv.wait_until(lock, deadline, [this]() { return m_stop || !m_jobs.empty(); }))
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                Trace(batch, rays, hits);
+            }
+        }
+
+        void Trace(std::vector<Job>& batch, std::vector<ray>& rays, std::vector<char>& hits)
+        {
+            Remote::MessageType type = batch.front().type;
+            std::size_t const result_size = Remote::GetResultSize(type);
+
+            rays.clear();
+            for (auto const& job : batch)
+            {
+                auto first = reinterpret_cast<ray const*>(job.rays.data());
+                rays.insert(rays.end(), first, first + job.rays.size() / sizeof(ray));
+            }
+
+            try
+            {
+                hits.resize(rays.size() * result_size);
+                if (type == Remote::kIntersect)
+                    m_api->QueryIntersection(rays.data(), static_cast<int>(rays.size()), reinterpret_cast<Intersection*>(hits.data()));
+                else
+                    m_api->QueryOcclusion(rays.data(), static_cast<int>(rays.size()), reinterpret_cast<int*>(hits.data()));
+            }
+            catch (Exception& e)
+            {
+                for (auto& job : batch)
+                {
+                    job.connection->Fail(job.id, e.what());
+                }
+                return;
+            }
+            catch (std::exception& e)
+            {
+                for (auto& job : batch)
+                {
+                    job.connection->Fail(job.id, e.what());
+                }
+                return;
+            }
+
+            std::size_t offset = 0;
+            for (auto& job : batch)
+            {
+                std::size_t size = job.rays.size() / sizeof(ray) * result_size;
+                job.connection->Answer(Remote::kResult, job.id, hits.data() + offset, size);
+                offset += size;
+            }
+        }
+
+        IntersectionApi* m_api;
+        std::vector<Shape*> m_shapes;
+        std::string m_path;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::vector<Job> m_jobs;
+        bool m_stop;
+        std::thread m_batcher;
+    };
+
+    // Scene of a payload, pending while the connection which sent it first builds it
+    struct SceneEntry
+    {
+        std::vector<char> payload;
+        std::weak_ptr<Scene> scene;
+        std::shared_future<std::shared_ptr<Scene>> pending;
+    };
+
+    // Scenes by payload hash, payloads are compared as hashes can be made to collide.
+    // A scene is deleted with its last connection
+    std::mutex g_scenes_mutex;
+    std::multimap<std::uint64_t, SceneEntry> g_scenes;
+
+    std::uint64_t Hash(std::vector<char> const& payload)
+    {
+        // FNV-1a
+        std::uint64_t hash = 14695981039346656037ULL;
+        for (char c : payload)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    std::shared_ptr<Scene> GetScene(std::vector<char> const& payload)
+    {
+        std::uint64_t key = Hash(payload);
+
+        // Identical scenes sent at once are built once, by the first connection and outside the lock,
+        // the others wait for it
+        std::promise<std::shared_ptr<Scene>> build;
+        std::shared_future<std::shared_ptr<Scene>> pending;
+        std::multimap<std::uint64_t, SceneEntry>::iterator slot;
+        {
+            std::lock_guard<std::mutex> lock(g_scenes_mutex);
+            auto range = g_scenes.equal_range(key);
+            for (auto iter = range.first; iter != range.second;)
+            {
+                auto scene = iter->second.scene.lock();
+                if (!scene && !iter->second.pending.valid())
+                {
+                    iter = g_scenes.erase(iter);
+                    continue;
+                }
+
+                if (iter->second.payload == payload)
+                {
+                    if (scene)
+                    {
+                        return scene;
+                    }
+
+                    pending = iter->second.pending;
+                    break;
+                }
+
+                ++iter;
+            }
+
+            if (!pending.valid())
+            {
+                SceneEntry entry;
+                entry.payload = payload;
+                entry.pending = build.get_future().share();
+                slot = g_scenes.insert(std::make_pair(key, std::move(entry)));
+            }
+        }
+
+        // Errors of the build are rethrown to every waiting connection
+        if (pending.valid())
+        {
+            return pending.get();
+        }
+
+        std::shared_ptr<Scene> scene;
+        try
+        {
+            scene = std::make_shared<Scene>(payload, key);
+        }
+        catch (...)
+        {
+            build.set_exception(std::current_exception());
+            std::lock_guard<std::mutex> lock(g_scenes_mutex);
+            g_scenes.erase(slot);
+            throw;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(g_scenes_mutex);
+            slot->second.scene = scene;
+            slot->second.pending = std::shared_future<std::shared_ptr<Scene>>();
+        }
+
+        build.set_value(scene);
+        return scene;
+    }
+
+    void Serve(std::shared_ptr<Connection> connection)
+    {
+        // Errors of a connection, such as failed allocations, only drop that connection
+        try
+        {
+            std::shared_ptr<Scene> scene;
+            Remote::MessageHeader header;
+            std::vector<char> payload;
+
+            while (Remote::ReadMessage(connection->socket, header, payload))
+            {
+                switch (header.type)
+                {
+                case Remote::kScene:
+                    try
+                    {
+                        scene.reset();
+                        scene = GetScene(payload);
+                        connection->Answer(Remote::kResult, header.id, nullptr, 0);
+                    }
+                    catch (std::exception& e)
+                    {
+                        connection->Fail(header.id, e.what());
+                    }
+                    catch (Exception& e)
+                    {
+                        connection->Fail(header.id, e.what());
+                    }
+                    break;
+
+                case Remote::kIntersect:
+                case Remote::kOcclude:
+                    if (!scene)
+                    {
+                        connection->Fail(header.id, "No scene committed");
+                    }
+                    else if (payload.size() % sizeof(ray) != 0)
+                    {
+                        connection->Fail(header.id, "Malformed query message");
+                    }
+                    else
+                    {
+                        Job job;
+                        job.connection = connection;
+                        job.id = header.id;
+                        job.type = static_cast<Remote::MessageType>(header.type);
+                        job.rays.swap(payload);
+                        scene->Enqueue(std::move(job));
+                    }
+                    break;
+
+                default:
+                    connection->Fail(header.id, "Unknown message");
+                    break;
+                }
+            }
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << "Connection dropped: " << e.what() << "\n";
+        }
+        catch (...)
+        {
+            std::cerr << "Connection dropped\n";
+        }
+
+        connection->socket.Shutdown();
+    }
+
+    std::uint32_t FindGpu()
+    {
+        for (std::uint32_t i = 0; i < IntersectionApi::GetDeviceCount(); ++i)
+        {
+            DeviceInfo devinfo;
+            IntersectionApi::GetDeviceInfo(i, devinfo);
+            if (devinfo.type == DeviceInfo::kGpu)
+            {
+                return i;
+            }
+        }
+
+        return 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int port = Remote::kDefaultPort;
+    bool has_device = false;
+
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (!std::strcmp(argv[i], "-p"))
+            port = std::atoi(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "-d"))
+        {
+            g_settings.devidx = static_cast<std::uint32_t>(std::atoi(argv[i + 1]));
+            has_device = true;
+        }
+        else if (!std::strcmp(argv[i], "-w"))
+            g_settings.window_us = std::atoi(argv[i + 1]);
+        else if (!std::strcmp(argv[i], "-t"))
+            g_settings.tmp_dir = argv[i + 1];
+        else
+        {
+            std::cerr << "Usage: RemoteServer [-p port] [-d device] [-w batch_window_us] [-t tmp_dir]\n";
+            return 1;
+        }
+    }
+
+    if (!has_device)
+    {
+        g_settings.devidx = FindGpu();
+    }
+
+    DeviceInfo devinfo;
+    IntersectionApi::GetDeviceInfo(g_settings.devidx, devinfo);
+
+    Socket listener = Socket::Listen(port);
+    if (!listener.IsValid())
+    {
+        std::cerr << "Can't listen on port " << port << "\n";
+        return 1;
+    }
+
+    std::cout << "Serving " << devinfo.name << " on port " << port << std::endl;
+
+    for (;;)
+    {
+        Socket socket = listener.Accept();
+        if (!socket.IsValid())
+        {
+            continue;
+        }
+
+        std::thread(Serve, std::make_shared<Connection>(std::move(socket))).detach();
+    }
+
+    return 0;
+}
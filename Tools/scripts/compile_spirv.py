@@ -0,0 +1,75 @@
+#!/usr/bin/env python
+# Precompile Vulkan compute kernels into the SPIR-V cache read by Calc.
+#
+# usage: compile_spirv.py <glsl dir> <cache dir> [embedded|files]
+#
+# Every top level "void Name()" function of the .comp files in <glsl dir> is
+# compiled with Name defined to main, the way ExecutableVulkan does at run time,
+# and written to <cache dir>/<Name>_<key>.spv. Pass <cache dir> to
+# IntersectionApi::SetKernelCachePath to skip GLSL compilation on startup.
+# The key hashes the source text the way it is passed to Calc: embedded mode
+# (default) matches the kernels stringified by stringify.py, files mode matches
+# kernels loaded from disk.
+import sys
+import os
+import re
+import struct
+import subprocess
+
+FNV_OFFSET = 14695981039346656037
+FNV_PRIME = 1099511628211
+
+def hash_bytes(hash, data):
+    for b in bytearray(data):
+        hash ^= b
+        hash = (hash * FNV_PRIME) & 0xFFFFFFFFFFFFFFFF
+    return hash
+
+def hash_string(hash, data):
+    # Matches VulkanCache::HashString, size goes first as a 64 bit integer
+    hash = hash_bytes(hash, struct.pack('<Q', len(data)))
+    return hash_bytes(hash, data)
+
+def embedded_source(path):
+    # Source text as emitted by stringify.py for each line read
+    fh = open(path, 'rb')
+    lines = fh.readlines()
+    fh.close()
+    return b''.join(line.rstrip(b'\r\n') + b' \n' for line in lines)
+
+def file_source(path):
+    fh = open(path, 'rb')
+    data = fh.read()
+    fh.close()
+    return data
+
+if len(sys.argv) < 3:
+    print('usage: compile_spirv.py <glsl dir> <cache dir> [embedded|files]')
+    sys.exit(1)
+
+glsl_dir = sys.argv[1]
+cache_dir = sys.argv[2]
+mode = sys.argv[3] if len(sys.argv) > 3 else 'embedded'
+
+if not os.path.isdir(cache_dir):
+    os.makedirs(cache_dir)
+
+failed = 0
+
+for file in sorted(os.listdir(glsl_dir)):
+    if not file.endswith('.comp'):
+        continue
+
+    path = os.path.join(glsl_dir, file)
+    source = embedded_source(path) if mode == 'embedded' else file_source(path)
+
+    for name in re.findall(br'^void\s+(\w+)\s*\(\s*\)', source, re.MULTILINE):
+        key = hash_string(hash_string(FNV_OFFSET, source), name)
+        name = name.decode('ascii')
+        out = os.path.join(cache_dir, '%s_%016x.spv' % (name, key))
+
+        if subprocess.call(['glslangValidator', '-V', '-S', 'comp', '-D%s=main' % name, '-o', out, path]) != 0:
+            print('failed to compile %s from %s' % (name, file))
+            failed += 1
+
+sys.exit(1 if failed else 0)
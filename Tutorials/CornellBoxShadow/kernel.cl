@@ -172,7 +172,8 @@ __kernel void Shading(//scene
                 float4 light,
                 int width,
                 int height,
-                __global unsigned char* out)
+                // GL texture when shared with OpenCL
+                write_only image2d_t out)
 {
     int2 globalid;
     globalid.x  = get_global_id(0);
@@ -185,6 +186,8 @@ __kernel void Shading(//scene
         int shape_id = isect[k].shapeid;
         int prim_id = isect[k].primid;
 
+        float4 col = (float4)( 0.f, 0.f, 0.f, 0.f );
+
         if (shape_id != -1 && prim_id != -1 && occl[k] == -1)
         {
             // Calculate position and normal of the intersection point
@@ -201,17 +204,13 @@ __kernel void Shading(//scene
                                         colors[color_id + 2], 1.f);
 
             // Calculate lighting
-            float4 col = (float4)( 0.f, 0.f, 0.f, 0.f );
             float4 light_dir = normalize(light - pos);
             float dot_prod = dot(norm, light_dir);
             if (dot_prod > 0)
                 col += dot_prod * diff_col;
-
-            out[k * 4] = col.x * 255;
-            out[k * 4 + 1] = col.y * 255;
-            out[k * 4 + 2] = col.z * 255;
-            out[k * 4 + 3] = 255;
         }
+
+        write_imagef(out, globalid, (float4)(col.x, col.y, col.z, 1.f));
     }
 }
 
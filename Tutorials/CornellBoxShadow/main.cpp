@@ -27,7 +27,9 @@ THE SOFTWARE.
 #include <GLUT/GLUT.h>
 #include <cassert>
 #include <iostream>
+#include <cmath>
 #include <memory>
+#include "../tools/gl_interop.h"
 #include "../tools/shader_manager.h"
 #include "../tools/tiny_obj_loader.h"
 
@@ -54,6 +56,22 @@ namespace {
     CLWBuffer<float> g_colors;
     CLWBuffer<int> g_indent;
 
+    // Frame data, created once and reused by every frame
+    CLWBuffer<ray> g_primary_rays;
+    CLWBuffer<ray> g_shadow_rays;
+    CLWBuffer<Intersection> g_isect;
+    CLWBuffer<int> g_occl;
+    Buffer* g_primary_rays_rr = nullptr;
+    Buffer* g_shadow_rays_rr = nullptr;
+    Buffer* g_isect_rr = nullptr;
+    Buffer* g_occl_rr = nullptr;
+
+    // Shading output, written by OpenCL straight into g_texture when GL sharing is supported
+    std::unique_ptr<InteropTexture> g_output;
+
+    // The light circles around the ceiling, so every frame is rendered
+    int g_frame = 0;
+
 
     struct Camera
     {
@@ -122,7 +140,7 @@ void InitData()
     g_indent = CLWBuffer<int>::Create(g_context, CL_MEM_READ_ONLY, indents.size(), indents.data());
 }
 
-Buffer* GeneratePrimaryRays()
+void GeneratePrimaryRays()
 {
     //prepare camera buf
     Camera cam;
@@ -133,9 +151,8 @@ Buffer* GeneratePrimaryRays()
     CLWBuffer<Camera> camera_buf = CLWBuffer<Camera>::Create(g_context, CL_MEM_READ_ONLY, 1, &cam);
 
     //run kernel
-    CLWBuffer<ray> ray_buf = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, g_window_width*g_window_height);
     CLWKernel kernel = g_program.GetKernel("GeneratePerspectiveRays");
-    kernel.SetArg(0, ray_buf);
+    kernel.SetArg(0, g_primary_rays);
     kernel.SetArg(1, camera_buf);
     kernel.SetArg(2, g_window_width);
     kernel.SetArg(3, g_window_height);
@@ -145,14 +162,11 @@ Buffer* GeneratePrimaryRays()
     size_t ls[] = { 8, 8 };
     g_context.Launch2D(0, gs, ls, kernel);
     g_context.Flush(0);
-
-    return CreateFromOpenClBuffer(g_api, ray_buf);
 }
 
-Buffer* GenerateShadowRays(CLWBuffer<Intersection> & isect, const float3& light)
+void GenerateShadowRays(const float3& light)
 {
     //prepare buffers
-    CLWBuffer<ray> ray_buf = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, g_window_width*g_window_height);
     cl_float4 light_cl = { light.x,
                             light.y,
                             light.z,
@@ -160,13 +174,13 @@ Buffer* GenerateShadowRays(CLWBuffer<Intersection> & isect, const float3& light)
     
     //run kernel
     CLWKernel kernel = g_program.GetKernel("GenerateShadowRays");
-    kernel.SetArg(0, ray_buf);
+    kernel.SetArg(0, g_shadow_rays);
     kernel.SetArg(1, g_positions);
     kernel.SetArg(2, g_normals);
     kernel.SetArg(3, g_indices);
     kernel.SetArg(4, g_colors);
     kernel.SetArg(5, g_indent);
-    kernel.SetArg(6, isect);
+    kernel.SetArg(6, g_isect);
     kernel.SetArg(7, light_cl);
     kernel.SetArg(8, g_window_width);
     kernel.SetArg(9, g_window_height);
@@ -176,44 +190,85 @@ Buffer* GenerateShadowRays(CLWBuffer<Intersection> & isect, const float3& light)
     size_t ls[] = { 8, 8 };
     g_context.Launch2D(0, gs, ls, kernel);
     g_context.Flush(0);
-
-    return CreateFromOpenClBuffer(g_api, ray_buf);
 }
 
-Buffer* Shading(const CLWBuffer<Intersection> &isect, const CLWBuffer<int> &occluds, const float3& light)
+void Shading(const float3& light)
 {
-    //pass data to buffers
-    CLWBuffer<unsigned char> out_buff = CLWBuffer<unsigned char>::Create(g_context, CL_MEM_READ_ONLY, 4*g_window_width*g_window_height);
     cl_float4 light_cl = { light.x,
                             light.y,
                             light.z,
                             light.w };
     //run kernel
-    CLWBuffer<ray> ray_buf = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, g_window_width*g_window_height);
     CLWKernel kernel = g_program.GetKernel("Shading");
     kernel.SetArg(0, g_positions);
     kernel.SetArg(1, g_normals);
     kernel.SetArg(2, g_indices);
     kernel.SetArg(3, g_colors);
     kernel.SetArg(4, g_indent);
-    kernel.SetArg(5, isect);
-    kernel.SetArg(6, occluds);
+    kernel.SetArg(5, g_isect);
+    kernel.SetArg(6, g_occl);
     kernel.SetArg(7, light_cl);
     kernel.SetArg(8, g_window_width);
     kernel.SetArg(9, g_window_height);
-    kernel.SetArg(10, out_buff);
+    // The image stays on the device, no readback when it is the GL texture
+    kernel.SetArg(10, g_output->Acquire(0));
 
-    // Run generation kernel
+    // Run shading kernel
     size_t gs[] = { static_cast<size_t>((g_window_width + 7) / 8 * 8), static_cast<size_t>((g_window_height + 7) / 8 * 8) };
     size_t ls[] = { 8, 8 };
     g_context.Launch2D(0, gs, ls, kernel);
-    g_context.Flush(0);
 
-    return CreateFromOpenClBuffer(g_api, out_buff);
+    // Give the texture back to GL
+    g_output->Present(0);
+}
+
+void InitFrame()
+{
+    const int k_raypack_size = g_window_height * g_window_width;
+
+    g_primary_rays = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, k_raypack_size);
+    g_shadow_rays = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, k_raypack_size);
+    g_isect = CLWBuffer<Intersection>::Create(g_context, CL_MEM_READ_WRITE, k_raypack_size);
+    g_occl = CLWBuffer<int>::Create(g_context, CL_MEM_READ_WRITE, k_raypack_size);
+
+    g_primary_rays_rr = CreateFromOpenClBuffer(g_api, g_primary_rays);
+    g_shadow_rays_rr = CreateFromOpenClBuffer(g_api, g_shadow_rays);
+    g_isect_rr = CreateFromOpenClBuffer(g_api, g_isect);
+    g_occl_rr = CreateFromOpenClBuffer(g_api, g_occl);
+
+    g_output.reset(new InteropTexture(g_context, g_texture, g_window_width, g_window_height));
+
+    if (!g_output->IsShared())
+    {
+        std::cout << "GL sharing is not supported, the image is copied through the host\n";
+    }
+
+    // The camera doesn't move, so primary hits are found once
+    GeneratePrimaryRays();
+    g_api->QueryIntersection(g_primary_rays_rr, k_raypack_size, g_isect_rr, nullptr, nullptr);
+}
+
+void RenderFrame()
+{
+    const int k_raypack_size = g_window_height * g_window_width;
+
+    // Point light position
+    float angle = 0.02f * g_frame++;
+    float3 light = { -0.01f + 0.3f * std::cos(angle), 1.85f, 0.1f + 0.3f * std::sin(angle) };
+
+    // Shadow rays
+    GenerateShadowRays(light);
+
+    // Occlusion
+    g_api->QueryOcclusion(g_shadow_rays_rr, k_raypack_size, g_occl_rr, nullptr, nullptr);
+
+    // Shading
+    Shading(light);
 }
 
 void DrawScene()
 {
+    RenderFrame();
 
     glDisable(GL_DEPTH_TEST);
     glViewport(0, 0, g_window_width, g_window_height);
@@ -301,6 +356,9 @@ void InitGl()
 
 void InitCl()
 {
+    // Prefer a context sharing the texture with GL
+    g_context = CreateGLSharedContext();
+
     std::vector<CLWPlatform> platforms;
     CLWPlatform::CreateAllPlatforms(platforms);
 
@@ -309,7 +367,7 @@ void InitCl()
         throw std::runtime_error("No OpenCL platforms installed.");
     }
 
-    for (int i = 0; i < platforms.size(); ++i)
+    for (int i = 0; i < platforms.size() && !g_context; ++i)
     {
         for (int d = 0; d < (int)platforms[i].GetDeviceCount(); ++d)
         {
@@ -375,49 +433,19 @@ int main(int argc, char* argv[])
     // ommit scene changes
     g_api->Commit();
 
-    const int k_raypack_size = g_window_height * g_window_width;
-    
-    // Prepare rays. One for each texture pixel.
-    Buffer* ray_buffer = GeneratePrimaryRays();
-    // Intersection data
-    CLWBuffer<Intersection> isect_buffer_cl = CLWBuffer<Intersection>::Create(g_context, CL_MEM_READ_WRITE, g_window_width*g_window_height);
-    Buffer* isect_buffer = CreateFromOpenClBuffer(g_api, isect_buffer_cl);
-    
-    // Intersection
-    g_api->QueryIntersection(ray_buffer, k_raypack_size, isect_buffer, nullptr, nullptr);
-
-    // Point light position
-    float3 light = { -0.01f, 1.85f, 0.1f };
-    
-    // Shadow rays
-    Buffer* shadow_rays_buffer = GenerateShadowRays(isect_buffer_cl, light);
-    CLWBuffer<int> occl_buffer_cl = CLWBuffer<int>::Create(g_context, CL_MEM_READ_WRITE, g_window_width*g_window_height);
-    Buffer* occl_buffer = CreateFromOpenClBuffer(g_api, occl_buffer_cl);
-
-    // Occlusion
-    g_api->QueryOcclusion(shadow_rays_buffer, k_raypack_size, occl_buffer, nullptr, nullptr);
-    
-    // Shading
-    Buffer* tex_buf = Shading(isect_buffer_cl, occl_buffer_cl, light);
-    
-    // Get image data
-    std::vector<unsigned char> tex_data(k_raypack_size * 4);
-    unsigned char* pixels = nullptr;
-    Event* e = nullptr;
-    g_api->MapBuffer(tex_buf, kMapRead, 0, 4 * k_raypack_size * sizeof(unsigned char), (void**)&pixels, &e);
-    e->Wait();
-    memcpy(tex_data.data(), pixels, 4 * k_raypack_size * sizeof(unsigned char));
-
-    // Update texture data
-    glBindTexture(GL_TEXTURE_2D, g_texture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, g_window_width, g_window_height, GL_RGBA, GL_UNSIGNED_BYTE, tex_data.data());
-    glBindTexture(GL_TEXTURE_2D, NULL);
+    // Allocate frame buffers and find primary hits
+    InitFrame();
 
     // Start the main loop
     glutDisplayFunc(DrawScene);
+    glutIdleFunc(glutPostRedisplay);
     glutMainLoop();
 
     // Cleanup
+    g_api->DeleteBuffer(g_primary_rays_rr);
+    g_api->DeleteBuffer(g_shadow_rays_rr);
+    g_api->DeleteBuffer(g_isect_rr);
+    g_api->DeleteBuffer(g_occl_rr);
     IntersectionApi::Delete(g_api); g_api = nullptr;
 
     return 0;
@@ -0,0 +1,159 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "gl_interop.h"
+
+#include <stdexcept>
+#include <string>
+
+#if !defined(__APPLE__) && !defined(WIN32)
+#include <GL/glx.h>
+#endif
+
+// Properties binding a new OpenCL context to the current GL context
+static std::vector<cl_context_properties> GetGLSharingProperties(cl_platform_id platform)
+{
+    std::vector<cl_context_properties> props;
+
+#ifdef __APPLE__
+    CGLContextObj gl_context = CGLGetCurrentContext();
+    props.push_back(CL_CONTEXT_PROPERTY_USE_CGL_SHAREGROUP_APPLE);
+    props.push_back((cl_context_properties)CGLGetShareGroup(gl_context));
+#elif WIN32
+    props.push_back(CL_GL_CONTEXT_KHR);
+    props.push_back((cl_context_properties)wglGetCurrentContext());
+    props.push_back(CL_WGL_HDC_KHR);
+    props.push_back((cl_context_properties)wglGetCurrentDC());
+    props.push_back(CL_CONTEXT_PLATFORM);
+    props.push_back((cl_context_properties)platform);
+#else
+    props.push_back(CL_GL_CONTEXT_KHR);
+    props.push_back((cl_context_properties)glXGetCurrentContext());
+    props.push_back(CL_GLX_DISPLAY_KHR);
+    props.push_back((cl_context_properties)glXGetCurrentDisplay());
+    props.push_back(CL_CONTEXT_PLATFORM);
+    props.push_back((cl_context_properties)platform);
+#endif
+
+    props.push_back(0);
+
+    return props;
+}
+
+CLWContext CreateGLSharedContext()
+{
+    std::vector<CLWPlatform> platforms;
+    CLWPlatform::CreateAllPlatforms(platforms);
+
+    for (int i = 0; i < platforms.size(); ++i)
+    {
+        std::vector<cl_context_properties> props = GetGLSharingProperties(platforms[i]);
+
+        for (int d = 0; d < (int)platforms[i].GetDeviceCount(); ++d)
+        {
+            CLWDevice device = platforms[i].GetDevice(d);
+
+            if (device.GetType() != CL_DEVICE_TYPE_GPU)
+                continue;
+
+            std::string const& extensions = device.GetExtensions();
+            if (extensions.find("cl_khr_gl_sharing") == std::string::npos &&
+                extensions.find("cl_APPLE_gl_sharing") == std::string::npos)
+                continue;
+
+            // Creation fails on GPUs which are not driving the GL context
+            try
+            {
+                return CLWContext::Create(device, &props[0]);
+            }
+            catch (CLWException&)
+            {
+            }
+        }
+    }
+
+    return CLWContext();
+}
+
+InteropTexture::InteropTexture(CLWContext context, GLuint texture, int width, int height)
+: context_(context)
+, texture_(texture)
+, width_(width)
+, height_(height)
+, shared_(false)
+, acquired_(false)
+{
+    // The context might not share objects with GL even if it was created for it
+    try
+    {
+        image_ = context_.CreateImage2DFromGLTexture(texture_);
+        shared_ = true;
+    }
+    catch (CLWException&)
+    {
+        cl_image_format format = { CL_RGBA, CL_UNORM_INT8 };
+        image_ = CLWImage2D::Create(context_, &format, width_, height_, 0);
+        pixels_.resize(4 * width_ * height_);
+    }
+}
+
+CLWImage2D const& InteropTexture::Acquire(unsigned int queue)
+{
+    if (shared_ && !acquired_)
+    {
+        // GL commands using the texture have to complete before OpenCL takes it over
+        glFinish();
+        context_.AcquireGLObjects(queue, std::vector<cl_mem>(1, image_));
+        acquired_ = true;
+    }
+
+    return image_;
+}
+
+void InteropTexture::Present(unsigned int queue)
+{
+    if (shared_)
+    {
+        if (acquired_)
+        {
+            context_.ReleaseGLObjects(queue, std::vector<cl_mem>(1, image_));
+            acquired_ = false;
+        }
+
+        // Without cl_khr_gl_event GL can only use the texture once the queue has finished
+        context_.Finish(queue);
+        return;
+    }
+
+    size_t origin[3] = { 0, 0, 0 };
+    size_t region[3] = { static_cast<size_t>(width_), static_cast<size_t>(height_), 1 };
+
+    cl_int status = clEnqueueReadImage(context_.GetCommandQueue(queue), image_, CL_TRUE, origin, region, 0, 0, &pixels_[0], 0, nullptr, nullptr);
+
+    if (status != CL_SUCCESS)
+    {
+        throw std::runtime_error("Failed to read the rendered image");
+    }
+
+    glBindTexture(GL_TEXTURE_2D, texture_);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width_, height_, GL_RGBA, GL_UNSIGNED_BYTE, &pixels_[0]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
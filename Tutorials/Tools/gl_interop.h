@@ -0,0 +1,68 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef GL_INTEROP_H
+#define GL_INTEROP_H
+
+#include "shader_manager.h"
+#include "CLW.h"
+
+#include <vector>
+
+// Creates an OpenCL context on a GPU sharing objects with the current GL context,
+// the context is empty if no device supports GL sharing
+CLWContext CreateGLSharedContext();
+
+// GL texture written by OpenCL kernels as a write_only image2d_t.
+// With a GL shared context the kernels write the texture itself, otherwise they write a
+// device image which is copied to the texture through the host when the frame is presented.
+class InteropTexture
+{
+public:
+    // texture has to be a GL_RGBA8 texture of width x height
+    InteropTexture(CLWContext context, GLuint texture, int width, int height);
+
+    // Whether kernels write the GL texture directly
+    bool IsShared() const { return shared_; }
+
+    // Image for the kernels of a frame, GL must not use the texture until the frame is presented
+    CLWImage2D const& Acquire(unsigned int queue);
+
+    // Hands the texture back to GL once the kernels writing the image are enqueued
+    void Present(unsigned int queue);
+
+private:
+    InteropTexture(InteropTexture const&);
+    InteropTexture& operator = (InteropTexture const&);
+
+    CLWContext context_;
+    CLWImage2D image_;
+    GLuint texture_;
+    int width_;
+    int height_;
+    bool shared_;
+    bool acquired_;
+
+    // Staging memory of the copy path
+    std::vector<unsigned char> pixels_;
+};
+
+#endif
@@ -14,4 +14,8 @@ end
 
 if fileExists("./CornellBoxShadow/CornellBoxShadow.lua") then
     dofile("./CornellBoxShadow/CornellBoxShadow.lua")
+end
+
+if fileExists("./WavefrontPathTracer/WavefrontPathTracer.lua") then
+    dofile("./WavefrontPathTracer/WavefrontPathTracer.lua")
 end
\ No newline at end of file
@@ -0,0 +1,40 @@
+project "TutorialWavefrontPathTracer"
+    kind "ConsoleApp"
+    location "../WavefrontPathTracer"
+    links {"RadeonRays", "CLW", "Calc"}
+    files { "../WavefrontPathTracer/**.h", "../WavefrontPathTracer/**.cpp", "../Tools/tiny_obj_loader.h", "../Tools/tiny_obj_loader.cpp" }
+    includedirs{ "../../RadeonRays/include", "../../CLW", "../Tools", "." }
+
+    if os.is("macosx") then
+        sysincludedirs {"/usr/local/include"}
+        libdirs {"/usr/local/lib"}
+        buildoptions "-std=c++11 -stdlib=libc++"
+    end
+
+    if os.is("windows") then
+        links {"RadeonRays",}
+        libdirs { "../../3rdparty/embree/lib/%{cfg.platform}" }
+    end
+
+    if os.is("linux") then
+        buildoptions "-std=c++11"
+        links {"pthread",}
+        os.execute("rm -rf obj");
+    end
+
+    configuration {"x32", "Debug"}
+        targetdir "../../Bin/Debug/x86"
+    configuration {"x64", "Debug"}
+        targetdir "../../Bin/Debug/x64"
+    configuration {"x32", "Release"}
+        targetdir "../../Bin/Release/x86"
+    configuration {"x64", "Release"}
+        targetdir "../../Bin/Release/x64"
+    configuration {}
+
+    if os.is("windows") then
+        postbuildcommands  { 
+          'copy "..\\..\\3rdparty\\embree\\bin\\%{cfg.platform}\\embree.dll" "%{cfg.buildtarget.directory}"',
+          'copy "..\\..\\3rdparty\\embree\\bin\\%{cfg.platform}\\tbb.dll" "%{cfg.buildtarget.directory}"'
+        }
+    end
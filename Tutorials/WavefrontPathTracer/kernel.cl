@@ -0,0 +1,274 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef KERNEL_CL
+#define KERNEL_CL
+
+#define PI 3.14159265358979f
+#define EPSILON 0.001f
+// Bounces after which paths are terminated randomly
+#define RUSSIAN_ROULETTE_DEPTH 2
+
+typedef struct _Ray
+{
+    /// xyz - origin, w - max range
+    float4 o;
+    /// xyz - direction, w - time
+    float4 d;
+    /// x - ray mask, y - activity flag
+    int2 extra;
+    /// x - pixel of the path, moved along with the ray by compaction
+    int2 padding;
+} Ray;
+
+typedef struct _Intersection
+{
+    // id of a shape
+    int shapeid;
+    // Primitive index
+    int primid;
+    // Padding elements
+    int padding0;
+    int padding1;
+
+    // uv - hit barycentrics, w - ray distance
+    float4 uvwt;
+} Intersection;
+
+// Parallelogram light spanned by the edges from the corner
+typedef struct _Light
+{
+    float4 corner;
+    float4 edge1;
+    float4 edge2;
+    float4 radiance;
+} Light;
+
+uint Hash(uint x)
+{
+    x = (x ^ 61u) ^ (x >> 16);
+    x *= 9u;
+    x = x ^ (x >> 4);
+    x *= 0x27d4eb2du;
+    x = x ^ (x >> 15);
+    return x;
+}
+
+// Random number in [0, 1) of a pixel, sample, bounce and dimension
+float Random(int pixel, uint seed, int bounce, int dim)
+{
+    uint h = Hash(Hash(Hash((uint)pixel ^ Hash(seed)) + (uint)bounce) + (uint)dim);
+    return (h >> 8) * (1.f / 16777216.f);
+}
+
+float3 SampleHemisphereCosine(float3 n, float r0, float r1)
+{
+    float3 t = fabs(n.x) > 0.5f ? (float3)(-n.y, n.x, 0.f) : (float3)(0.f, -n.z, n.y);
+    t = normalize(t);
+    float3 b = cross(n, t);
+
+    float phi = 2.f * PI * r0;
+    float r = sqrt(r1);
+    return normalize(t * (r * cos(phi)) + b * (r * sin(phi)) + n * sqrt(max(0.f, 1.f - r1)));
+}
+
+// Camera rays start paths, ray i belongs to pixel i
+__kernel void InitPaths(__global Ray* rays,
+                        __global float4* throughput,
+                        __global int* num_rays,
+                        int num_pixels)
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < num_pixels)
+    {
+        rays[globalid].padding.x = globalid;
+        throughput[globalid] = (float4)(1.f, 1.f, 1.f, 0.f);
+
+        if (globalid == 0)
+        {
+            *num_rays = num_pixels;
+        }
+    }
+}
+
+// Shade hits of the active rays: add emission seen by camera rays, prepare a shadow ray
+// toward the light and replace the ray with the next bounce or deactivate it
+__kernel void ShadeHits(__global Ray* rays,
+                        // Number of rays, written by the previous compaction
+                        __global const int* num_rays,
+                        __global const Intersection* isect,
+                        //scene
+                        __global const float* positions,
+                        __global const int* indices,
+                        __global const int* face_offsets,
+                        __global const float4* albedo,
+                        __global const float4* emission,
+                        Light light,
+                        int bounce,
+                        uint seed,
+                        //paths
+                        __global float4* throughput,
+                        __global float4* radiance,
+                        //light sampling
+                        __global Ray* shadow_rays,
+                        __global float4* shadow_radiance)
+{
+    int globalid = get_global_id(0);
+
+    if (globalid >= *num_rays)
+    {
+        return;
+    }
+
+    Ray r = rays[globalid];
+    int pixel = r.padding.x;
+
+    // No shadow ray unless the light is sampled below
+    shadow_rays[globalid].extra.y = 0;
+
+    // Inactive rays have no intersection results
+    if (r.extra.y == 0)
+    {
+        return;
+    }
+
+    Intersection hit = isect[globalid];
+
+    if (hit.shapeid == -1 || hit.primid == -1)
+    {
+        rays[globalid].extra.y = 0;
+        return;
+    }
+
+    int face = face_offsets[hit.shapeid] + hit.primid;
+    float3 v0 = vload3(indices[face * 3], positions);
+    float3 v1 = vload3(indices[face * 3 + 1], positions);
+    float3 v2 = vload3(indices[face * 3 + 2], positions);
+
+    float3 pos = r.o.xyz + r.d.xyz * hit.uvwt.w;
+    float3 n = normalize(cross(v1 - v0, v2 - v0));
+    // Face the incoming ray
+    if (dot(n, r.d.xyz) > 0.f)
+    {
+        n = -n;
+    }
+
+    float3 beta = throughput[pixel].xyz;
+    float3 e = emission[face].xyz;
+
+    // Light sampling accounts for emitters hit by bounces
+    if (any(e > 0.f))
+    {
+        if (bounce == 0)
+        {
+            radiance[pixel] += (float4)(beta * e, 0.f);
+        }
+
+        rays[globalid].extra.y = 0;
+        return;
+    }
+
+    float3 a = albedo[face].xyz;
+    float3 o = pos + n * EPSILON;
+
+    // Next event estimation toward a random point of the light
+    float3 target = light.corner.xyz + light.edge1.xyz * Random(pixel, seed, bounce, 0) + light.edge2.xyz * Random(pixel, seed, bounce, 1);
+    float3 to_light = target - o;
+    float dist = length(to_light);
+    float3 wi = to_light / dist;
+    float3 light_normal = cross(light.edge1.xyz, light.edge2.xyz);
+    float area = length(light_normal);
+    float cos_surface = dot(n, wi);
+    float cos_light = fabs(dot(light_normal / area, wi));
+
+    if (cos_surface > 0.f && dist > EPSILON)
+    {
+        Ray shadow;
+        shadow.o = (float4)(o, dist * (1.f - EPSILON));
+        shadow.d = (float4)(wi, 0.f);
+        shadow.extra = (int2)(0xFFFFFFFF, 1);
+        shadow.padding = (int2)(pixel, 0);
+        shadow_rays[globalid] = shadow;
+
+        float3 l = beta * a / PI * light.radiance.xyz * cos_surface * cos_light * area / (dist * dist);
+        shadow_radiance[globalid] = (float4)(l, 0.f);
+    }
+
+    // Diffuse bounce, cosine sampling cancels the cosine and pi of the estimator
+    beta *= a;
+
+    if (bounce >= RUSSIAN_ROULETTE_DEPTH)
+    {
+        float q = min(max(beta.x, max(beta.y, beta.z)), 0.95f);
+        if (Random(pixel, seed, bounce, 2) >= q)
+        {
+            rays[globalid].extra.y = 0;
+            return;
+        }
+
+        beta /= q;
+    }
+
+    throughput[pixel] = (float4)(beta, 0.f);
+
+    float3 d = SampleHemisphereCosine(n, Random(pixel, seed, bounce, 3), Random(pixel, seed, bounce, 4));
+    r.o = (float4)(o, r.o.w);
+    r.d = (float4)(d, 0.f);
+    rays[globalid] = r;
+}
+
+// Add light samples whose shadow rays are not occluded
+__kernel void AccumulateShadows(__global const Ray* shadow_rays,
+                                __global const int* num_rays,
+                                __global const int* occl,
+                                __global const float4* shadow_radiance,
+                                __global float4* radiance)
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < *num_rays && shadow_rays[globalid].extra.y != 0 && occl[globalid] == -1)
+    {
+        radiance[shadow_rays[globalid].padding.x] += shadow_radiance[globalid];
+    }
+}
+
+// Average of the accumulated samples with gamma correction
+__kernel void Resolve(__global const float4* radiance,
+                      int num_samples,
+                      int num_pixels,
+                      __global unsigned char* out)
+{
+    int globalid = get_global_id(0);
+
+    if (globalid < num_pixels)
+    {
+        float3 col = radiance[globalid].xyz / (float)num_samples;
+        col = pow(clamp(col, 0.f, 1.f), 1.f / 2.2f);
+
+        out[globalid * 4] = (unsigned char)(col.x * 255.f);
+        out[globalid * 4 + 1] = (unsigned char)(col.y * 255.f);
+        out[globalid * 4 + 2] = (unsigned char)(col.z * 255.f);
+        out[globalid * 4 + 3] = 255;
+    }
+}
+
+#endif //KERNEL_CL
@@ -0,0 +1,562 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+/// Wavefront path tracer: renders the Cornell box without a window and prints
+/// where the frame time goes. Paths are traced a bounce at a time for the whole image:
+///
+///     camera rays (GenerateCameraRays)
+///     for every bounce:
+///         closest hits (QueryIntersection, ray count read on the device)
+///         shading, next event estimation and next bounce rays (ShadeHits)
+///         shadow rays (QueryOcclusion) and their contribution (AccumulateShadows)
+///         terminated paths removed (CompactRays)
+///     image (Resolve)
+///
+/// Ray counts stay on the device: compaction writes the number of live rays, which
+/// queries and kernels read instead of the host, so bounces are issued without readbacks.
+/// Every kernel is launched for the maximum count and exits past the device one.
+///
+/// Usage: TutorialWavefrontPathTracer [-w width] [-h height] [-spp samples] [-b bounces]
+///        [-f frames] [-sort 0|1] [-persistent 0|1] [-compact 0|1] [-breakdown 0|1] [-o image.ppm]
+///
+/// -sort and -persistent set "acc.sort_rays" and "bvh.persistent_threads", -compact 0 traces
+/// terminated rays as inactive ones instead of removing them. With -breakdown 1 every stage is
+/// waited for and timed separately and live ray counts are read back, which adds synchronization,
+/// so compare total frame times with -breakdown 0.
+
+#include "radeon_rays.h"
+#include "radeon_rays_cl.h"
+#include "CLW.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "tiny_obj_loader.h"
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+namespace {
+    struct Options
+    {
+        int width = 640;
+        int height = 480;
+        // Samples per pixel of a frame
+        int spp = 4;
+        int bounces = 5;
+        int frames = 10;
+        bool sort = false;
+        bool persistent = false;
+        bool compact = true;
+        bool breakdown = true;
+        std::string output = "wavefront.ppm";
+    };
+
+    // Stages timed with -breakdown 1
+    enum Stage
+    {
+        kCamera,
+        kIntersect,
+        kShade,
+        kOcclude,
+        kCompact,
+        kResolve,
+        kNumStages
+    };
+
+    char const* const kStageNames[kNumStages] = { "camera", "intersect", "shade", "occlude", "compact", "resolve" };
+
+    // Parallelogram light, matches Light in kernel.cl
+    struct Light
+    {
+        cl_float4 corner;
+        cl_float4 edge1;
+        cl_float4 edge2;
+        cl_float4 radiance;
+    };
+
+    std::vector<shape_t> g_objshapes;
+    std::vector<material_t> g_objmaterials;
+    Options g_options;
+
+    IntersectionApi* g_api;
+
+    //CL data
+    CLWContext g_context;
+    CLWProgram g_program;
+    CLWBuffer<float> g_positions;
+    CLWBuffer<int> g_indices;
+    CLWBuffer<int> g_face_offsets;
+    CLWBuffer<cl_float4> g_albedo;
+    CLWBuffer<cl_float4> g_emission;
+    Light g_light;
+
+    // Rays ping-pong between compactions, counts hold a single int each
+    CLWBuffer<ray> g_rays[2];
+    CLWBuffer<int> g_num_rays[2];
+    CLWBuffer<Intersection> g_isect;
+    CLWBuffer<ray> g_shadow_rays;
+    CLWBuffer<int> g_occl;
+    CLWBuffer<cl_float4> g_shadow_radiance;
+    CLWBuffer<cl_float4> g_throughput;
+    CLWBuffer<cl_float4> g_radiance;
+    CLWBuffer<unsigned char> g_image;
+
+    // RadeonRays views of the CL buffers
+    Buffer* g_rays_rr[2];
+    Buffer* g_num_rays_rr[2];
+    Buffer* g_isect_rr;
+    Buffer* g_shadow_rays_rr;
+    Buffer* g_occl_rr;
+
+    // Accumulated milliseconds per stage and live rays per bounce
+    double g_stage_time[kNumStages];
+    std::vector<double> g_live_rays;
+}
+
+void ParseOptions(int argc, char* argv[])
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string arg = argv[i];
+        char const* value = argv[i + 1];
+
+        if (arg == "-w") g_options.width = std::max(1, std::atoi(value));
+        else if (arg == "-h") g_options.height = std::max(1, std::atoi(value));
+        else if (arg == "-spp") g_options.spp = std::max(1, std::atoi(value));
+        else if (arg == "-b") g_options.bounces = std::max(1, std::atoi(value));
+        else if (arg == "-f") g_options.frames = std::max(1, std::atoi(value));
+        else if (arg == "-sort") g_options.sort = std::atoi(value) != 0;
+        else if (arg == "-persistent") g_options.persistent = std::atoi(value) != 0;
+        else if (arg == "-compact") g_options.compact = std::atoi(value) != 0;
+        else if (arg == "-breakdown") g_options.breakdown = std::atoi(value) != 0;
+        else if (arg == "-o") g_options.output = value;
+        else throw std::runtime_error("Unknown option " + arg);
+    }
+}
+
+void InitCl()
+{
+    std::vector<CLWPlatform> platforms;
+    CLWPlatform::CreateAllPlatforms(platforms);
+
+    if (platforms.size() == 0)
+    {
+        throw std::runtime_error("No OpenCL platforms installed.");
+    }
+
+    for (int i = 0; i < platforms.size(); ++i)
+    {
+        for (int d = 0; d < (int)platforms[i].GetDeviceCount(); ++d)
+        {
+            if (platforms[i].GetDevice(d).GetType() != CL_DEVICE_TYPE_GPU)
+                continue;
+            g_context = CLWContext::Create(platforms[i].GetDevice(d));
+            break;
+        }
+
+        if (g_context)
+            break;
+    }
+
+    if (!g_context)
+    {
+        throw std::runtime_error("No OpenCL GPU found.");
+    }
+
+    const char* kBuildopts(" -cl-mad-enable -cl-fast-relaxed-math -cl-std=CL1.2 -I . ");
+
+    g_program = CLWProgram::CreateFromFile("kernel.cl", kBuildopts, g_context);
+}
+
+void InitData()
+{
+    //Load
+    std::string basepath = "../../Resources/CornellBox/";
+    std::string filename = basepath + "orig.objm";
+    std::string res = LoadObj(g_objshapes, g_objmaterials, filename.c_str(), basepath.c_str());
+    if (res != "")
+    {
+        throw std::runtime_error(res);
+    }
+
+    // Shapes share vertex and index arrays, a face of shape i is face_offsets[i] + primid
+    std::vector<float> verts;
+    std::vector<int> inds;
+    std::vector<int> face_offsets;
+    std::vector<cl_float4> albedo;
+    std::vector<cl_float4> emission;
+    bool has_light = false;
+
+    for (int id = 0; id < g_objshapes.size(); ++id)
+    {
+        const mesh_t& mesh = g_objshapes[id].mesh;
+        int base = (int)verts.size() / 3;
+
+        face_offsets.push_back((int)inds.size() / 3);
+        verts.insert(verts.end(), mesh.positions.begin(), mesh.positions.end());
+        for (int index : mesh.indices)
+        {
+            inds.push_back(base + index);
+        }
+
+        for (int mat_id : mesh.material_ids)
+        {
+            const material_t& mat = g_objmaterials[mat_id];
+            albedo.push_back({ { mat.diffuse[0], mat.diffuse[1], mat.diffuse[2], 0.f } });
+            emission.push_back({ { mat.emission[0], mat.emission[1], mat.emission[2], 0.f } });
+        }
+
+        // The first emissive mesh is the light, a parallelogram spanned by its first triangle
+        const material_t& mat = g_objmaterials[mesh.material_ids[0]];
+        if (!has_light && mesh.indices.size() >= 3 && mat.emission[0] + mat.emission[1] + mat.emission[2] > 0.f)
+        {
+            float const* p0 = &mesh.positions[mesh.indices[0] * 3];
+            float const* p1 = &mesh.positions[mesh.indices[1] * 3];
+            float const* p2 = &mesh.positions[mesh.indices[2] * 3];
+            g_light.corner = { { p0[0], p0[1], p0[2], 0.f } };
+            g_light.edge1 = { { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2], 0.f } };
+            g_light.edge2 = { { p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2], 0.f } };
+            g_light.radiance = { { mat.emission[0], mat.emission[1], mat.emission[2], 0.f } };
+            has_light = true;
+        }
+    }
+
+    if (!has_light)
+    {
+        throw std::runtime_error("The scene has no emissive mesh.");
+    }
+
+    g_positions = CLWBuffer<float>::Create(g_context, CL_MEM_READ_ONLY, verts.size(), verts.data());
+    g_indices = CLWBuffer<int>::Create(g_context, CL_MEM_READ_ONLY, inds.size(), inds.data());
+    g_face_offsets = CLWBuffer<int>::Create(g_context, CL_MEM_READ_ONLY, face_offsets.size(), face_offsets.data());
+    g_albedo = CLWBuffer<cl_float4>::Create(g_context, CL_MEM_READ_ONLY, albedo.size(), albedo.data());
+    g_emission = CLWBuffer<cl_float4>::Create(g_context, CL_MEM_READ_ONLY, emission.size(), emission.data());
+}
+
+void InitApi()
+{
+    // Create api using already exist opencl context
+    cl_device_id id = g_context.GetDevice(0).GetID();
+    cl_command_queue queue = g_context.GetCommandQueue(0);
+    g_api = RadeonRays::CreateFromOpenClContext(g_context, id, queue);
+
+    g_api->SetOption("acc.type", "bvh");
+    g_api->SetOption("bvh.builder", "sah");
+    g_api->SetOption("acc.sort_rays", g_options.sort ? 1.f : 0.f);
+    g_api->SetOption("bvh.persistent_threads", g_options.persistent ? 1.f : 0.f);
+
+    // Adding meshes to tracing scene
+    for (int id = 0; id < g_objshapes.size(); ++id)
+    {
+        shape_t& objshape = g_objshapes[id];
+        float* vertdata = objshape.mesh.positions.data();
+        int nvert = (int)objshape.mesh.positions.size() / 3;
+        int* indices = objshape.mesh.indices.data();
+        int nfaces = (int)objshape.mesh.indices.size() / 3;
+        Shape* shape = g_api->CreateMesh(vertdata, nvert, 3 * sizeof(float), indices, 0, nullptr, nfaces);
+
+        g_api->AttachShape(shape);
+        shape->SetId(id);
+    }
+
+    g_api->Commit();
+
+    // Path buffers
+    int num_pixels = g_options.width * g_options.height;
+    for (int i = 0; i < 2; ++i)
+    {
+        g_rays[i] = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+        g_num_rays[i] = CLWBuffer<int>::Create(g_context, CL_MEM_READ_WRITE, 1);
+        g_rays_rr[i] = CreateFromOpenClBuffer(g_api, g_rays[i]);
+        g_num_rays_rr[i] = CreateFromOpenClBuffer(g_api, g_num_rays[i]);
+    }
+
+    g_isect = CLWBuffer<Intersection>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_shadow_rays = CLWBuffer<ray>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_occl = CLWBuffer<int>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_shadow_radiance = CLWBuffer<cl_float4>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_throughput = CLWBuffer<cl_float4>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_radiance = CLWBuffer<cl_float4>::Create(g_context, CL_MEM_READ_WRITE, num_pixels);
+    g_image = CLWBuffer<unsigned char>::Create(g_context, CL_MEM_WRITE_ONLY, 4 * num_pixels);
+
+    g_isect_rr = CreateFromOpenClBuffer(g_api, g_isect);
+    g_shadow_rays_rr = CreateFromOpenClBuffer(g_api, g_shadow_rays);
+    g_occl_rr = CreateFromOpenClBuffer(g_api, g_occl);
+}
+
+// Close a stage: with -breakdown 1 wait for its work and add the time since start
+void EndStage(Stage stage, std::chrono::high_resolution_clock::time_point& start)
+{
+    if (!g_options.breakdown)
+    {
+        return;
+    }
+
+    g_context.Finish(0);
+    auto end = std::chrono::high_resolution_clock::now();
+    g_stage_time[stage] += std::chrono::duration<double, std::milli>(end - start).count();
+    start = end;
+}
+
+size_t GlobalSize(int count)
+{
+    return (size_t)(count + 63) / 64 * 64;
+}
+
+// Trace a sample per pixel, adding to the accumulated radiance
+void TraceSample(unsigned int seed)
+{
+    int num_pixels = g_options.width * g_options.height;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Camera looking into the box
+    CameraDesc camera;
+    camera.position = float3(0.f, 1.f, 3.f);
+    camera.forward = float3(0.f, 0.f, -1.f);
+    camera.up = float3(0.f, 1.f, 0.f);
+    camera.sensor_size = float2(2.f * g_options.width / g_options.height, 2.f);
+    camera.focal_length = 2.f;
+    camera.aperture = 0.f;
+    camera.focus_distance = 0.f;
+    camera.maxt = 1000.f;
+    camera.jitter = 1;
+
+    g_api->GenerateCameraRays(camera, g_options.width, g_options.height, (int)seed, g_rays_rr[0], nullptr, nullptr);
+
+    CLWKernel init = g_program.GetKernel("InitPaths");
+    init.SetArg(0, g_rays[0]);
+    init.SetArg(1, g_throughput);
+    init.SetArg(2, g_num_rays[0]);
+    init.SetArg(3, num_pixels);
+    g_context.Launch1D(0, GlobalSize(num_pixels), 64, init);
+    EndStage(kCamera, start);
+
+    int current = 0;
+    for (int bounce = 0; bounce < g_options.bounces; ++bounce)
+    {
+        // Number of live rays is read on the device
+        g_api->QueryIntersection(g_rays_rr[current], g_num_rays_rr[current], num_pixels, g_isect_rr, nullptr, nullptr);
+        EndStage(kIntersect, start);
+
+        CLWKernel shade = g_program.GetKernel("ShadeHits");
+        shade.SetArg(0, g_rays[current]);
+        shade.SetArg(1, g_num_rays[current]);
+        shade.SetArg(2, g_isect);
+        shade.SetArg(3, g_positions);
+        shade.SetArg(4, g_indices);
+        shade.SetArg(5, g_face_offsets);
+        shade.SetArg(6, g_albedo);
+        shade.SetArg(7, g_emission);
+        shade.SetArg(8, sizeof(Light), &g_light);
+        shade.SetArg(9, bounce);
+        shade.SetArg(10, seed);
+        shade.SetArg(11, g_throughput);
+        shade.SetArg(12, g_radiance);
+        shade.SetArg(13, g_shadow_rays);
+        shade.SetArg(14, g_shadow_radiance);
+        g_context.Launch1D(0, GlobalSize(num_pixels), 64, shade);
+        EndStage(kShade, start);
+
+        g_api->QueryOcclusion(g_shadow_rays_rr, g_num_rays_rr[current], num_pixels, g_occl_rr, nullptr, nullptr);
+
+        CLWKernel accumulate = g_program.GetKernel("AccumulateShadows");
+        accumulate.SetArg(0, g_shadow_rays);
+        accumulate.SetArg(1, g_num_rays[current]);
+        accumulate.SetArg(2, g_occl);
+        accumulate.SetArg(3, g_shadow_radiance);
+        accumulate.SetArg(4, g_radiance);
+        g_context.Launch1D(0, GlobalSize(num_pixels), 64, accumulate);
+        EndStage(kOcclude, start);
+
+        if (bounce + 1 == g_options.bounces)
+        {
+            break;
+        }
+
+        // Move rays of live paths to the front of the other buffer
+        if (g_options.compact)
+        {
+            g_api->CompactRays(g_rays_rr[current], g_num_rays_rr[current], num_pixels, nullptr,
+                g_rays_rr[1 - current], g_num_rays_rr[1 - current], nullptr, nullptr);
+            current = 1 - current;
+            EndStage(kCompact, start);
+        }
+
+        // Without compaction every bounce traces the whole image
+        if (g_options.breakdown && g_options.compact)
+        {
+            int live = 0;
+            g_context.ReadBuffer(0, g_num_rays[current], &live, 1).Wait();
+            g_live_rays[bounce + 1] += live;
+            start = std::chrono::high_resolution_clock::now();
+        }
+        else
+        {
+            g_live_rays[bounce + 1] += num_pixels;
+        }
+    }
+}
+
+void WriteImage(int num_samples)
+{
+    int num_pixels = g_options.width * g_options.height;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    CLWKernel resolve = g_program.GetKernel("Resolve");
+    resolve.SetArg(0, g_radiance);
+    resolve.SetArg(1, num_samples);
+    resolve.SetArg(2, num_pixels);
+    resolve.SetArg(3, g_image);
+    g_context.Launch1D(0, GlobalSize(num_pixels), 64, resolve);
+    EndStage(kResolve, start);
+
+    std::vector<unsigned char> pixels(4 * num_pixels);
+    g_context.ReadBuffer(0, g_image, pixels.data(), pixels.size()).Wait();
+
+    FILE* file = std::fopen(g_options.output.c_str(), "wb");
+    if (!file)
+    {
+        throw std::runtime_error("Can't write " + g_options.output);
+    }
+
+    std::fprintf(file, "P6\n%d %d\n255\n", g_options.width, g_options.height);
+    for (int i = 0; i < num_pixels; ++i)
+    {
+        std::fwrite(&pixels[i * 4], 1, 3, file);
+    }
+    std::fclose(file);
+}
+
+void PrintReport(double total_ms, int num_frames)
+{
+    int num_pixels = g_options.width * g_options.height;
+    int num_samples = num_frames * g_options.spp;
+
+    std::cout << "Resolution " << g_options.width << "x" << g_options.height << ", " << g_options.spp << " spp per frame, "
+        << g_options.bounces << " bounces, sort " << g_options.sort << ", persistent threads " << g_options.persistent
+        << ", compaction " << g_options.compact << "\n";
+    std::cout << "Frame time: " << total_ms / num_frames << " ms\n";
+
+    if (!g_options.breakdown)
+    {
+        return;
+    }
+
+    double stage_total = 0.0;
+    for (int i = 0; i < kNumStages; ++i)
+    {
+        stage_total += g_stage_time[i];
+    }
+
+    for (int i = 0; i < kNumStages; ++i)
+    {
+        double ms = g_stage_time[i] / num_frames;
+        std::printf("    %-10s %8.3f ms %5.1f%%\n", kStageNames[i], ms, stage_total > 0.0 ? 100.0 * g_stage_time[i] / stage_total : 0.0);
+    }
+
+    // A closest hit and a shadow query per traced ray
+    double rays = 0.0;
+    for (int bounce = 0; bounce < g_options.bounces; ++bounce)
+    {
+        double live = g_live_rays[bounce] / num_samples;
+        rays += 2.0 * live;
+        std::printf("    bounce %d: %.1f%% live rays\n", bounce, 100.0 * live / num_pixels);
+    }
+
+    double trace_ms = (g_stage_time[kIntersect] + g_stage_time[kOcclude]) / num_samples;
+    std::printf("Trace throughput: %.1f Mrays/s\n", trace_ms > 0.0 ? rays / (trace_ms * 1000.0) : 0.0);
+}
+
+int main(int argc, char* argv[])
+{
+    try
+    {
+        ParseOptions(argc, argv);
+
+        InitCl();
+
+        // Load CornellBox model
+        InitData();
+
+        InitApi();
+
+        std::fill(g_stage_time, g_stage_time + kNumStages, 0.0);
+        g_live_rays.assign(g_options.bounces, 0.0);
+
+        cl_float4 zero = { { 0.f, 0.f, 0.f, 0.f } };
+        g_context.FillBuffer(0, g_radiance, zero, g_options.width * g_options.height).Wait();
+
+        int num_pixels = g_options.width * g_options.height;
+
+        // Warm up kernel compilation and caches
+        TraceSample(0);
+        g_context.Finish(0);
+        std::fill(g_stage_time, g_stage_time + kNumStages, 0.0);
+        g_live_rays.assign(g_options.bounces, 0.0);
+
+        unsigned int seed = 1;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int frame = 0; frame < g_options.frames; ++frame)
+        {
+            for (int s = 0; s < g_options.spp; ++s)
+            {
+                TraceSample(seed++);
+                g_live_rays[0] += num_pixels;
+            }
+        }
+        g_context.Finish(0);
+        double total_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        // Warm up sample is part of the image
+        WriteImage(g_options.frames * g_options.spp + 1);
+        PrintReport(total_ms, g_options.frames);
+
+        // Cleanup
+        for (int i = 0; i < 2; ++i)
+        {
+            g_api->DeleteBuffer(g_rays_rr[i]);
+            g_api->DeleteBuffer(g_num_rays_rr[i]);
+        }
+        g_api->DeleteBuffer(g_isect_rr);
+        g_api->DeleteBuffer(g_shadow_rays_rr);
+        g_api->DeleteBuffer(g_occl_rr);
+        IntersectionApi::Delete(g_api); g_api = nullptr;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << "\n";
+        return -1;
+    }
+    catch (Exception& e)
+    {
+        std::cout << e.what() << "\n";
+        return -1;
+    }
+
+    return 0;
+}
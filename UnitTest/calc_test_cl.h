@@ -30,6 +30,7 @@ THE SOFTWARE.
 #include <numeric>
 #include <cstdlib>
 #include <ctime>
+#include <future>
 #include <memory>
 
 #include "gtest/gtest.h"
@@ -563,4 +564,153 @@ TEST_F(CalcTestkOpenCL, ExecuteRawParams)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+TEST_F(CalcTestkOpenCL, Execute2D)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    Calc::DeviceSpec spec;
+    device->GetSpec(spec);
+
+    if ((spec.sourceTypes & Calc::SourceType::kOpenCL) != Calc::SourceType::kOpenCL)
+    {
+        m_calc->DeleteDevice(device);
+        return;
+    }
+
+    std::string source_code =
+        "__kernel void tile(__global int* c, int width)\n"
+        "{\n"
+        "    int x = get_global_id(0);\n"
+        "    int y = get_global_id(1);\n"
+        "    c[y * width + x] = y * 1000 + x;\n"
+        "}\n";
+
+    Calc::Executable* executable = nullptr;
+    ASSERT_NO_THROW(executable = device->CompileExecutable(source_code.c_str(), source_code.size(), ""));
+
+    Calc::Function* func = nullptr;
+    ASSERT_NO_THROW(func = executable->CreateFunction("tile"));
+
+    // Screen of 8x8 tiles
+    int width = 64;
+    int height = 32;
+    size_t const global_size[2] = { 64, 32 };
+    size_t const local_size[2] = { 8, 8 };
+
+    Calc::Buffer* buffer_c = nullptr;
+    ASSERT_NO_THROW(buffer_c = device->CreateBuffer(width * height * sizeof(int), Calc::BufferType::kWrite));
+
+    ASSERT_NO_THROW(func->SetArg(0, buffer_c));
+    ASSERT_NO_THROW(func->SetArg(1, sizeof(width), &width));
+    ASSERT_NO_THROW(device->Execute(func, 0, 2, global_size, local_size, nullptr));
+
+    std::vector<int> numbers_c(width * height);
+
+    Calc::Event* e = nullptr;
+
+    ASSERT_NO_THROW(device->ReadBuffer(buffer_c, 0, 0, width * height * sizeof(int), &numbers_c[0], &e));
+
+    e->Wait();
+    device->DeleteEvent(e);
+
+    for (auto y = 0; y < height; ++y)
+    {
+        for (auto x = 0; x < width; ++x)
+        {
+            ASSERT_EQ(numbers_c[y * width + x], y * 1000 + x);
+        }
+    }
+
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_c));
+    ASSERT_NO_THROW(executable->DeleteFunction(func));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
+// Fulfills the promise passed as callback data
+static void SignalCalcPromise(void* data)
+{
+    static_cast<std::promise<void>*>(data)->set_value();
+}
+
+TEST_F(CalcTestkOpenCL, EventCallbackWaitAny)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    const auto kBufferSize = 1000;
+    std::vector<int> numbers_a(kBufferSize);
+    std::vector<int> numbers_b(kBufferSize);
+    std::iota(numbers_a.begin(), numbers_a.end(), 0);
+
+    Calc::Buffer* buffer = nullptr;
+    ASSERT_NO_THROW(buffer = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers_a[0]));
+
+    Calc::Event* events[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(device->ReadBuffer(buffer, 0, 0, kBufferSize * sizeof(int), &numbers_b[0], &events[0]));
+    ASSERT_NO_THROW(device->ReadBuffer(buffer, 0, 0, kBufferSize * sizeof(int), &numbers_b[0], &events[1]));
+
+    std::promise<void> completed;
+    auto signaled = completed.get_future();
+    ASSERT_NO_THROW(events[1]->SetCompletionCallback(SignalCalcPromise, &completed));
+
+    std::size_t index = device->WaitForAnyEvent(events, 2);
+    ASSERT_LT(index, 2U);
+    ASSERT_TRUE(events[index]->IsComplete());
+
+    // The promise has to outlive the callback
+    signaled.wait();
+    ASSERT_TRUE(events[1]->IsComplete());
+    ASSERT_TRUE(numbers_a == numbers_b);
+
+    events[0]->Wait();
+    device->DeleteEvent(events[0]);
+    device->DeleteEvent(events[1]);
+
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
+TEST_F(CalcTestkOpenCL, CopyFillBuffer)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    const auto kBufferSize = 1000;
+    std::vector<int> numbers_a(kBufferSize);
+    std::vector<int> numbers_b(2 * kBufferSize);
+    std::iota(numbers_a.begin(), numbers_a.end(), 0);
+
+    Calc::Buffer* src = nullptr;
+    Calc::Buffer* dst = nullptr;
+    ASSERT_NO_THROW(src = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kRead, &numbers_a[0]));
+    ASSERT_NO_THROW(dst = device->CreateBuffer(2 * kBufferSize * sizeof(int), Calc::BufferType::kWrite));
+
+    // Fill the first half, copy the source into the second one
+    ASSERT_NO_THROW(device->FillBuffer(dst, 0, 0, kBufferSize * sizeof(int), 0xdeadbeef, nullptr));
+    ASSERT_NO_THROW(device->CopyBuffer(src, dst, 0, 0, kBufferSize * sizeof(int), kBufferSize * sizeof(int), nullptr));
+
+    Calc::Event* e = nullptr;
+    ASSERT_NO_THROW(device->ReadBuffer(dst, 0, 0, 2 * kBufferSize * sizeof(int), &numbers_b[0], &e));
+    ASSERT_NO_THROW(e->Wait());
+    device->DeleteEvent(e);
+
+    for (auto i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(static_cast<std::uint32_t>(numbers_b[i]), 0xdeadbeef);
+        ASSERT_EQ(numbers_b[kBufferSize + i], numbers_a[i]);
+    }
+
+    // Fill pattern is 4 bytes wide
+    ASSERT_THROW(device->FillBuffer(dst, 0, 2, 4, 0, nullptr), Calc::Exception);
+
+    ASSERT_NO_THROW(device->DeleteBuffer(src));
+    ASSERT_NO_THROW(device->DeleteBuffer(dst));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 #endif //USE_OPENCL
\ No newline at end of file
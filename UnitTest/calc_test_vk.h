@@ -79,7 +79,7 @@ public:
         "#version 430\n"
         "layout( local_size_x = 64, local_size_y = 1, local_size_z = 1 ) in;\n"
         "layout(std430, binding = 0) buffer restrict readonly aBlk { int a[]; };\n"
-        "layout(std430, binding = 1) buffer restrict readonly bBlk { int b; };\n"
+        "layout(push_constant) uniform bBlk { int b; };\n"
         "layout(std430, binding = 2) buffer cBlk { int c[]; };\n"
         "void main() {\n"
         "uint idx = gl_GlobalInvocationID.x;\n"
@@ -562,5 +562,71 @@ TEST_F(CalcTestkVulkan, ExecuteRawParams)
     ASSERT_NO_THROW(m_calc->DeleteDevice(device));
 }
 
+TEST_F(CalcTestkVulkan, ExecuteRebind)
+{
+    Calc::Device* device = nullptr;
+
+    ASSERT_NO_THROW(device = m_calc->CreateDevice(0));
+
+    Calc::Executable* executable = nullptr;
+    ASSERT_NO_THROW(executable = device->CompileExecutable(gl_source_code2.c_str(), gl_source_code2.size(), ""));
+
+    Calc::Function* func = nullptr;
+    ASSERT_NO_THROW(func = executable->CreateFunction("add"));
+
+    const auto kBufferSize = 1000;
+    const auto kNumOutputs = 4;
+    std::vector<int> numbers_a(kBufferSize);
+
+    std::generate(numbers_a.begin(), numbers_a.end(), std::rand);
+
+    Calc::Buffer* buffer_a = nullptr;
+    Calc::Buffer* buffer_c[kNumOutputs] = {};
+
+    ASSERT_NO_THROW(buffer_a = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite, &numbers_a[0]));
+
+    for (auto i = 0; i < kNumOutputs; ++i)
+    {
+        ASSERT_NO_THROW(buffer_c[i] = device->CreateBuffer(kBufferSize * sizeof(int), Calc::BufferType::kWrite));
+    }
+
+    // Dispatches of one batch alternate between cached descriptor sets, values are pushed per dispatch
+    for (auto pass = 0; pass < 3; ++pass)
+    {
+        for (auto i = 0; i < kNumOutputs; ++i)
+        {
+            std::uint32_t b = pass * kNumOutputs + i;
+            ASSERT_NO_THROW(func->SetArg(0, buffer_a));
+            ASSERT_NO_THROW(func->SetArg(1, sizeof(b), &b));
+            ASSERT_NO_THROW(func->SetArg(2, buffer_c[i]));
+            ASSERT_NO_THROW(device->Execute(func, 0, kBufferSize, 1, nullptr));
+        }
+    }
+
+    for (auto i = 0; i < kNumOutputs; ++i)
+    {
+        std::vector<int> numbers_c(kBufferSize);
+
+        Calc::Event* e = nullptr;
+
+        ASSERT_NO_THROW(device->ReadBuffer(buffer_c[i], 0, 0, kBufferSize * sizeof(int), &numbers_c[0], &e));
+
+        e->Wait();
+        device->DeleteEvent(e);
+
+        for (auto j = 0; j < kBufferSize; ++j)
+        {
+            ASSERT_EQ(numbers_c[j], numbers_a[j] + 2 * kNumOutputs + i);
+        }
+
+        ASSERT_NO_THROW(device->DeleteBuffer(buffer_c[i]));
+    }
+
+    ASSERT_NO_THROW(device->DeleteBuffer(buffer_a));
+    ASSERT_NO_THROW(executable->DeleteFunction(func));
+    ASSERT_NO_THROW(device->DeleteExecutable(executable));
+    ASSERT_NO_THROW(m_calc->DeleteDevice(device));
+}
+
 
 #endif // USE_VULKAN
\ No newline at end of file
@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <numeric>
 #include <cstdlib>
 #include <ctime>
+#include <limits>
 
 #include "gtest/gtest.h"
 
@@ -156,6 +157,78 @@ TEST_F(CLW, BufferWrite)
     ASSERT_EQ(mismatch.first, initdata.cend());
 }
 
+// Checks commands of an out of order queue ordered by their wait events
+TEST_F(CLW, OutOfOrderQueue)
+{
+    int kBufferSize = 100;
+
+    CLWBuffer<cl_int> buffer;
+    std::vector<cl_int> initdata(kBufferSize);
+    std::vector<cl_int> resultdata(kBufferSize);
+    std::iota (initdata.begin(), initdata.end(), 0);
+
+    unsigned int queue = 0;
+    ASSERT_NO_THROW(queue = context_.CreateCommandQueue(0, true));
+
+    ASSERT_NO_THROW(buffer = context_.CreateBuffer<cl_int>(kBufferSize, CL_MEM_READ_WRITE));
+
+    // The read waits for the write explicitly since the queue might reorder them
+    CLWEvent write;
+    ASSERT_NO_THROW(write = context_.WriteBuffer(queue, buffer, &initdata[0], 0, kBufferSize, std::vector<CLWEvent>()));
+    ASSERT_NO_THROW(context_.ReadBuffer(queue, buffer, &resultdata[0], 0, kBufferSize, std::vector<CLWEvent>(1, write)));
+    // The marker covers every command enqueued before it
+    ASSERT_NO_THROW(context_.Marker(queue).Wait());
+
+    auto mismatch = std::mismatch(initdata.cbegin(), initdata.cend(),
+                                  resultdata.cbegin());
+
+    ASSERT_EQ(mismatch.first, initdata.cend());
+}
+
+// Checks programs rebuilt from binaries, both directly and through the binary cache
+TEST_F(CLW, ProgramBinary)
+{
+    int kBufferSize = 100;
+
+    std::string source =
+        "__kernel void add_one(__global int* a) { int i = get_global_id(0); a[i] = a[i] + 1; }";
+
+    std::vector<cl_int> initdata(kBufferSize);
+    std::vector<cl_int> resultdata(kBufferSize);
+    std::iota(initdata.begin(), initdata.end(), 0);
+
+    CLWProgram program;
+    ASSERT_NO_THROW(program = CLWProgram::CreateFromSource(source.c_str(), source.size(), buildopts_.c_str(), context_));
+
+    std::vector<std::uint8_t> binary;
+    ASSERT_NO_THROW(program.GetBinary(binary));
+    ASSERT_FALSE(binary.empty());
+
+    // First build fills the cache, second one is loaded from it
+    CLWProgram::SetBinaryCachePath(".");
+    std::vector<CLWProgram> programs(3);
+    ASSERT_NO_THROW(programs[0] = CLWProgram::CreateFromBinary(&binary[0], binary.size(), buildopts_.c_str(), context_));
+    ASSERT_NO_THROW(programs[1] = CLWProgram::CreateFromSource(source.c_str(), source.size(), buildopts_.c_str(), context_));
+    ASSERT_NO_THROW(programs[2] = CLWProgram::CreateFromSource(source.c_str(), source.size(), buildopts_.c_str(), context_));
+    CLWProgram::SetBinaryCachePath("");
+
+    auto buffer = context_.CreateBuffer<cl_int>(kBufferSize, CL_MEM_READ_WRITE, &initdata[0]);
+
+    for (auto& p : programs)
+    {
+        CLWKernel kernel = p.GetKernel("add_one");
+        kernel.SetArg(0, buffer);
+        ASSERT_NO_THROW(context_.Launch1D(0, kBufferSize, 1, kernel));
+    }
+
+    ASSERT_NO_THROW(context_.ReadBuffer(0, buffer, &resultdata[0], kBufferSize).Wait());
+
+    for (int i = 0; i < kBufferSize; ++i)
+    {
+        ASSERT_EQ(initdata[i] + 3, resultdata[i]);
+    }
+}
+
 // Checks for scan correctness
 TEST_F(CLW, ExclusiveScanSmall)
 {
@@ -427,6 +500,284 @@ TEST_F(CLW, RadixSortLarge)
     }
 }
 
+// Checks 64-bit key sort order, stability and key-value pairing
+TEST_F(CLW, RadixSort64KeysAndValues)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    // Not a multiple of the block size to check padding
+    int arraysize = 1000003;
+
+    // Host buffers: few distinct low halves for duplicates, high bits set for some keys
+    std::vector<cl_ulong> hostkeys(arraysize);
+    std::vector<cl_int> hostvalues(arraysize);
+
+    std::generate(hostkeys.begin(), hostkeys.end(), []{ return ((cl_ulong)(rand() % 64) << 58) | ((cl_ulong)rand() << 20) | (cl_ulong)(rand() % 4); });
+    std::iota(hostvalues.begin(), hostvalues.end(), 0);
+
+    // Device buffers
+    auto devkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_ulong), CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE, &hostvalues[0]);
+    auto devsortedkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_ulong), CL_MEM_READ_WRITE);
+    auto devsortedvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadix64(0, devkeys, devsortedkeys, devvalues, devsortedvalues, arraysize).Wait();
+
+    // Read data back to host
+    std::vector<cl_ulong> sortedkeys(arraysize);
+    std::vector<cl_int> sortedvalues(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, (char*)&sortedkeys[0], arraysize * sizeof(cl_ulong)).Wait();
+    context_.ReadBuffer(0, devsortedvalues, (char*)&sortedvalues[0], arraysize * sizeof(cl_int)).Wait();
+
+    // Check correctness
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(hostkeys[sortedvalues[i]], sortedkeys[i]);
+
+        if (i < arraysize - 1)
+        {
+            ASSERT_LE(sortedkeys[i], sortedkeys[i + 1]);
+
+            if (sortedkeys[i] == sortedkeys[i + 1])
+            {
+                ASSERT_LT(sortedvalues[i], sortedvalues[i + 1]);
+            }
+        }
+    }
+}
+
+TEST_F(CLW, RadixSortSegmentedKeysAndValues)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 100003;
+    int numsegments = 17;
+
+    // Host buffers: segments in random order, keys with high bit set for some elements
+    std::vector<cl_uint> hostsegments(arraysize);
+    std::vector<cl_uint> hostkeys(arraysize);
+    std::vector<cl_int> hostvalues(arraysize);
+
+    std::generate(hostsegments.begin(), hostsegments.end(), [numsegments]{ return (cl_uint)(rand() % numsegments); });
+    std::generate(hostkeys.begin(), hostkeys.end(), []{ return ((cl_uint)(rand() % 2) << 31) | (cl_uint)(rand() % 1024); });
+    std::iota(hostvalues.begin(), hostvalues.end(), 0);
+
+    // Device buffers
+    auto devsegments = context_.CreateBuffer<char>(arraysize * sizeof(cl_uint), CL_MEM_READ_WRITE, &hostsegments[0]);
+    auto devkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_uint), CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE, &hostvalues[0]);
+    auto devsortedkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_uint), CL_MEM_READ_WRITE);
+    auto devsortedvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadixSegmented(0, devsegments, devkeys, devsortedkeys, devvalues, devsortedvalues, arraysize).Wait();
+
+    // Read data back to host
+    std::vector<cl_uint> sortedkeys(arraysize);
+    std::vector<cl_int> sortedvalues(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, (char*)&sortedkeys[0], arraysize * sizeof(cl_uint)).Wait();
+    context_.ReadBuffer(0, devsortedvalues, (char*)&sortedvalues[0], arraysize * sizeof(cl_int)).Wait();
+
+    // Check correctness: grouped by segment, sorted and stable within a segment
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(hostkeys[sortedvalues[i]], sortedkeys[i]);
+
+        if (i < arraysize - 1)
+        {
+            auto s0 = hostsegments[sortedvalues[i]];
+            auto s1 = hostsegments[sortedvalues[i + 1]];
+            ASSERT_LE(s0, s1);
+
+            if (s0 == s1)
+            {
+                ASSERT_LE(sortedkeys[i], sortedkeys[i + 1]);
+
+                if (sortedkeys[i] == sortedkeys[i + 1])
+                {
+                    ASSERT_LT(sortedvalues[i], sortedvalues[i + 1]);
+                }
+            }
+        }
+    }
+}
+
+TEST_F(CLW, ReduceSumInt)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 1000003;
+
+    std::vector<cl_int> array(arraysize);
+    std::generate(array.begin(), array.end(), []{ return rand() % 16; });
+
+    auto devarray = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE, &array[0]);
+    auto devsum = context_.CreateBuffer<cl_int>(1, CL_MEM_READ_WRITE);
+
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    prims.ReduceSum(0, devarray, devsum, arraysize).Wait();
+
+    cl_int sum = 0;
+    context_.ReadBuffer(0, devsum, &sum, 1).Wait();
+
+    ASSERT_EQ(std::accumulate(array.begin(), array.end(), 0), sum);
+}
+
+TEST_F(CLW, ReduceBounds)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 100003;
+    int numsegments = 17;
+
+    // Host boxes: pmin followed by pmax, 4 floats each
+    std::vector<cl_float> boxes(arraysize * 8);
+    for (int i = 0; i < arraysize; ++i)
+    {
+        for (int c = 0; c < 3; ++c)
+        {
+            float v = (float)(rand() % 2048) - 1024.f;
+            boxes[i * 8 + c] = v;
+            boxes[i * 8 + 4 + c] = v + (float)(rand() % 16);
+        }
+        boxes[i * 8 + 3] = boxes[i * 8 + 7] = 0.f;
+    }
+
+    std::vector<cl_int> segmentstarts(numsegments);
+    for (int i = 0; i < numsegments; ++i)
+    {
+        segmentstarts[i] = i * (arraysize / numsegments);
+    }
+
+    // Device buffers
+    auto devboxes = context_.CreateBuffer<char>(arraysize * 8 * sizeof(cl_float), CL_MEM_READ_WRITE, &boxes[0]);
+    auto devsegmentstarts = context_.CreateBuffer<char>(numsegments * sizeof(cl_int), CL_MEM_READ_WRITE, &segmentstarts[0]);
+    auto devbounds = context_.CreateBuffer<char>(8 * sizeof(cl_float), CL_MEM_READ_WRITE);
+    auto devsegmentbounds = context_.CreateBuffer<char>(numsegments * 8 * sizeof(cl_float), CL_MEM_READ_WRITE);
+
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    prims.ReduceBounds(0, devboxes, devbounds, arraysize).Wait();
+    prims.SegmentedReduceBounds(0, devboxes, devsegmentstarts, devsegmentbounds, arraysize, numsegments).Wait();
+
+    std::vector<cl_float> bounds(8);
+    std::vector<cl_float> segmentbounds(numsegments * 8);
+    context_.ReadBuffer(0, devbounds, (char*)&bounds[0], 8 * sizeof(cl_float)).Wait();
+    context_.ReadBuffer(0, devsegmentbounds, (char*)&segmentbounds[0], numsegments * 8 * sizeof(cl_float)).Wait();
+
+    // Check against host reduction of every segment and of the whole array
+    for (int s = -1; s < numsegments; ++s)
+    {
+        int first = s < 0 ? 0 : segmentstarts[s];
+        int last = (s < 0 || s == numsegments - 1) ? arraysize : segmentstarts[s + 1];
+        cl_float const* result = s < 0 ? &bounds[0] : &segmentbounds[s * 8];
+
+        for (int c = 0; c < 3; ++c)
+        {
+            float pmin = std::numeric_limits<float>::max();
+            float pmax = -std::numeric_limits<float>::max();
+
+            for (int i = first; i < last; ++i)
+            {
+                pmin = std::min(pmin, boxes[i * 8 + c]);
+                pmax = std::max(pmax, boxes[i * 8 + 4 + c]);
+            }
+
+            ASSERT_EQ(pmin, result[c]);
+            ASSERT_EQ(pmax, result[4 + c]);
+        }
+    }
+}
+
+TEST_F(CLW, RadixSortOnesweepKeysAndValues)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    // Not a multiple of the tile size to check padding
+    int arraysize = 1000003;
+
+    // Host buffers: high bit set for some keys, few distinct keys for duplicates
+    std::vector<cl_uint> hostkeys(arraysize);
+    std::vector<cl_int> hostvalues(arraysize);
+
+    std::generate(hostkeys.begin(), hostkeys.end(), []{ return ((cl_uint)(rand() % 2) << 31) | ((cl_uint)(rand() % 4096) << 8); });
+    std::iota(hostvalues.begin(), hostvalues.end(), 0);
+
+    // Device buffers
+    auto devkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_uint), CL_MEM_READ_WRITE, &hostkeys[0]);
+    auto devvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE, &hostvalues[0]);
+    auto devsortedkeys = context_.CreateBuffer<char>(arraysize * sizeof(cl_uint), CL_MEM_READ_WRITE);
+    auto devsortedvalues = context_.CreateBuffer<char>(arraysize * sizeof(cl_int), CL_MEM_READ_WRITE);
+
+    // Create parallel prims object
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Perform sort
+    prims.SortRadixOnesweep(0, devkeys, devsortedkeys, devvalues, devsortedvalues, arraysize).Wait();
+
+    // Read data back to host
+    std::vector<cl_uint> sortedkeys(arraysize);
+    std::vector<cl_int> sortedvalues(arraysize);
+    context_.ReadBuffer(0, devsortedkeys, (char*)&sortedkeys[0], arraysize * sizeof(cl_uint)).Wait();
+    context_.ReadBuffer(0, devsortedvalues, (char*)&sortedvalues[0], arraysize * sizeof(cl_int)).Wait();
+
+    // Check correctness
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(hostkeys[sortedvalues[i]], sortedkeys[i]);
+
+        if (i < arraysize - 1)
+        {
+            ASSERT_LE(sortedkeys[i], sortedkeys[i + 1]);
+
+            if (sortedkeys[i] == sortedkeys[i + 1])
+            {
+                ASSERT_LT(sortedvalues[i], sortedvalues[i + 1]);
+            }
+        }
+    }
+}
+
+TEST_F(CLW, ScanExclusiveAddSinglePass)
+{
+    // Init rand
+    std::srand((unsigned)std::time(0));
+    int arraysize = 1000003;
+
+    std::vector<cl_int> array(arraysize);
+    std::vector<cl_int> array_gold(arraysize);
+    std::generate(array.begin(), array.end(), []{ return rand() % 32 - 16; });
+
+    int sum = 0;
+    for (int i = 0; i < arraysize; ++i)
+    {
+        array_gold[i] = sum;
+        sum += array[i];
+    }
+
+    auto devarray = context_.CreateBuffer<cl_int>(arraysize, CL_MEM_READ_WRITE, &array[0]);
+
+    CLWParallelPrimitives prims(context_, buildopts_.c_str());
+
+    // Scan in place
+    prims.ScanExclusiveAddSinglePass(0, devarray, devarray, arraysize).Wait();
+
+    context_.ReadBuffer(0, devarray, &array[0], arraysize).Wait();
+
+    for (int i = 0; i < arraysize; ++i)
+    {
+        ASSERT_EQ(array_gold[i], array[i]);
+    }
+}
+
 #endif
 
 #endif //USE_OPENCL
@@ -0,0 +1,727 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "geometry_ingest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace GeometryIngest
+{
+    MappedFile::MappedFile()
+        : m_data(nullptr)
+        , m_size(0)
+#ifdef _WIN32
+        , m_file(INVALID_HANDLE_VALUE)
+        , m_mapping(nullptr)
+#endif
+    {
+    }
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+#ifdef _WIN32
+    bool MappedFile::Open(char const* path)
+    {
+        Close();
+
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            CloseHandle(file);
+            return false;
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        void* data = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!data)
+        {
+            if (mapping)
+            {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file);
+            return false;
+        }
+
+        m_file = file;
+        m_mapping = mapping;
+        m_data = static_cast<char const*>(data);
+        m_size = static_cast<std::size_t>(size.QuadPart);
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_data)
+        {
+            UnmapViewOfFile(m_data);
+            CloseHandle(m_mapping);
+            CloseHandle(m_file);
+        }
+
+        m_data = nullptr;
+        m_size = 0;
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = nullptr;
+    }
+#else
+    bool MappedFile::Open(char const* path)
+    {
+        Close();
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0)
+        {
+            close(fd);
+            return false;
+        }
+
+        // The mapping keeps the file referenced after the descriptor is closed
+        void* data = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+
+        madvise(data, static_cast<std::size_t>(st.st_size), MADV_SEQUENTIAL);
+
+        m_data = static_cast<char const*>(data);
+        m_size = static_cast<std::size_t>(st.st_size);
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+        if (m_data)
+        {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+
+        m_data = nullptr;
+        m_size = 0;
+    }
+#endif
+
+    namespace
+    {
+        // Files smaller than this are parsed by a single thread
+        std::size_t const kMinChunkSize = 1 << 20;
+
+        char const kBinaryMagic[4] = { 'R', 'R', 'G', 'E' };
+        std::uint32_t const kBinaryVersion = 1;
+
+        struct BinaryHeader
+        {
+            char magic[4];
+            std::uint32_t version;
+            std::uint32_t nummeshes;
+            std::uint32_t reserved;
+        };
+
+        // Offsets are in bytes from the beginning of the file
+        struct BinaryMesh
+        {
+            std::uint64_t positions;
+            std::uint64_t indices;
+            std::uint32_t numvertices;
+            std::uint32_t numfaces;
+            std::uint32_t name;
+            std::uint32_t namelength;
+        };
+
+        // Part of an OBJ file parsed by a single thread. Positive OBJ indices are absolute, negative
+        // ones are relative to the vertices seen so far, which are only known once all chunks are parsed.
+        struct ObjChunk
+        {
+            std::vector<float> positions;
+            // Triangulated faces, 3 indices per face
+            std::vector<int> indices;
+            // Entries of indices relative to the first vertex of the chunk
+            std::vector<std::size_t> relative;
+            // Faces at which named groups start
+            std::vector<std::pair<std::size_t, std::string>> groups;
+            std::string error;
+        };
+
+        inline bool IsSpace(char c)
+        {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        inline char const* SkipSpaces(char const* p, char const* end)
+        {
+            while (p < end && IsSpace(*p))
+            {
+                ++p;
+            }
+            return p;
+        }
+
+        inline char const* SkipLine(char const* p, char const* end)
+        {
+            p = static_cast<char const*>(std::memchr(p, '\n', end - p));
+            return p ? p + 1 : end;
+        }
+
+        // Integer part of an OBJ index, stops at '/'
+        inline bool ParseInt(char const*& p, char const* end, int& value)
+        {
+            bool const negative = p < end && *p == '-';
+            if (p < end && (*p == '-' || *p == '+'))
+            {
+                ++p;
+            }
+
+            if (p == end || *p < '0' || *p > '9')
+            {
+                return false;
+            }
+
+            int v = 0;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                v = 10 * v + (*p++ - '0');
+            }
+
+            value = negative ? -v : v;
+            return true;
+        }
+
+        // Decimal float with optional exponent, parsed within the mapped range as strtof
+        // could read past the end of a file without a trailing newline
+        inline bool ParseFloat(char const*& p, char const* end, float& value)
+        {
+            static double const kPow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18 };
+
+            bool const negative = p < end && *p == '-';
+            if (p < end && (*p == '-' || *p == '+'))
+            {
+                ++p;
+            }
+
+            std::uint64_t mantissa = 0;
+            int digits = 0;
+            int exponent = 0;
+            bool any = false;
+
+            for (; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+            {
+                if (digits < 18)
+                {
+                    mantissa = 10 * mantissa + (*p - '0');
+                    digits += mantissa > 0 ? 1 : 0;
+                }
+                else
+                {
+                    ++exponent;
+                }
+            }
+
+            if (p < end && *p == '.')
+            {
+                for (++p; p < end && *p >= '0' && *p <= '9'; ++p, any = true)
+                {
+                    if (digits < 18)
+                    {
+                        mantissa = 10 * mantissa + (*p - '0');
+                        digits += mantissa > 0 ? 1 : 0;
+                        --exponent;
+                    }
+                }
+            }
+
+            if (!any)
+            {
+                return false;
+            }
+
+            if (p < end && (*p == 'e' || *p == 'E'))
+            {
+                ++p;
+                int e = 0;
+                if (!ParseInt(p, end, e))
+                {
+                    return false;
+                }
+                exponent += e;
+            }
+
+            double v = static_cast<double>(mantissa);
+            for (; exponent > 18; exponent -= 18)
+            {
+                v *= kPow10[18];
+            }
+            for (; exponent < -18; exponent += 18)
+            {
+                v /= kPow10[18];
+            }
+            v = exponent >= 0 ? v * kPow10[exponent] : v / kPow10[-exponent];
+
+            value = static_cast<float>(negative ? -v : v);
+            return true;
+        }
+
+        void ParseObjChunk(char const* p, char const* end, ObjChunk& chunk)
+        {
+            // Vertex indices of the current polygon and whether they are relative
+            std::vector<std::pair<int, bool>> polygon;
+
+            for (; p < end; p = SkipLine(p, end))
+            {
+                p = SkipSpaces(p, end);
+
+                if (end - p < 2 || !IsSpace(p[1]))
+                {
+                    continue;
+                }
+
+                char const type = p[0];
+                p = SkipSpaces(p + 2, end);
+
+                if (type == 'v')
+                {
+                    float xyz[3];
+                    for (int i = 0; i < 3; ++i)
+                    {
+                        if (!ParseFloat(p, end, xyz[i]))
+                        {
+                            chunk.error = "Invalid vertex position";
+                            return;
+                        }
+                        p = SkipSpaces(p, end);
+                    }
+                    chunk.positions.insert(chunk.positions.end(), xyz, xyz + 3);
+                }
+                else if (type == 'f')
+                {
+                    polygon.clear();
+
+                    int const numvertices = static_cast<int>(chunk.positions.size() / 3);
+                    while (p < end && *p != '\n')
+                    {
+                        int idx = 0;
+                        if (!ParseInt(p, end, idx) || idx == 0)
+                        {
+                            chunk.error = "Invalid face index";
+                            return;
+                        }
+
+                        // Texture coordinate and normal indices are not needed
+                        while (p < end && *p != '\n' && !IsSpace(*p))
+                        {
+                            ++p;
+                        }
+                        p = SkipSpaces(p, end);
+
+                        polygon.push_back(idx > 0 ? std::make_pair(idx - 1, false) : std::make_pair(numvertices + idx, true));
+                    }
+
+                    // Fan triangulation, degenerate polygons are skipped
+                    for (std::size_t i = 2; i < polygon.size(); ++i)
+                    {
+                        std::pair<int, bool> const tri[3] = { polygon[0], polygon[i - 1], polygon[i] };
+                        for (auto const& v : tri)
+                        {
+                            if (v.second)
+                            {
+                                chunk.relative.push_back(chunk.indices.size());
+                            }
+                            chunk.indices.push_back(v.first);
+                        }
+                    }
+                }
+                else if (type == 'o' || type == 'g')
+                {
+                    char const* nameend = p;
+                    while (nameend < end && *nameend != '\n')
+                    {
+                        ++nameend;
+                    }
+                    while (nameend > p && IsSpace(nameend[-1]))
+                    {
+                        --nameend;
+                    }
+                    chunk.groups.emplace_back(chunk.indices.size() / 3, std::string(p, nameend));
+                }
+            }
+        }
+    }
+
+    std::string LoadObj(char const* path, Geometry& geometry, int numthreads)
+    {
+        geometry.m_meshes.clear();
+        geometry.m_positions.clear();
+        geometry.m_indices.clear();
+
+        MappedFile file;
+        if (!file.Open(path))
+        {
+            return std::string("Can't open ") + path;
+        }
+
+        char const* const data = file.GetData();
+        std::size_t const size = file.GetSize();
+
+        // Chunks start at line boundaries
+        if (numthreads <= 0)
+        {
+            numthreads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        }
+        int const numchunks = static_cast<int>(std::min<std::size_t>(numthreads, size / kMinChunkSize + 1));
+
+        std::vector<char const*> bounds(numchunks + 1, data + size);
+        bounds[0] = data;
+        for (int i = 1; i < numchunks; ++i)
+        {
+            char const* split = std::max(bounds[i - 1], data + size / numchunks * i);
+            bounds[i] = split > data && split[-1] == '\n' ? split : SkipLine(split, data + size);
+        }
+
+        std::vector<ObjChunk> chunks(numchunks);
+        std::vector<std::thread> threads;
+        for (int i = 1; i < numchunks; ++i)
+        {
+            threads.emplace_back(ParseObjChunk, bounds[i], bounds[i + 1], std::ref(chunks[i]));
+        }
+        ParseObjChunk(bounds[0], bounds[1], chunks[0]);
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        // Vertex and face offsets of the chunks
+        std::vector<int> vertexbase(numchunks + 1, 0);
+        std::vector<std::size_t> facebase(numchunks + 1, 0);
+        for (int i = 0; i < numchunks; ++i)
+        {
+            if (!chunks[i].error.empty())
+            {
+                return chunks[i].error;
+            }
+
+            vertexbase[i + 1] = vertexbase[i] + static_cast<int>(chunks[i].positions.size() / 3);
+            facebase[i + 1] = facebase[i] + chunks[i].indices.size() / 3;
+        }
+
+        int const numvertices = vertexbase[numchunks];
+
+        // Meshes are face ranges between group statements
+        std::vector<std::pair<std::size_t, std::string>> groups(1);
+        for (int i = 0; i < numchunks; ++i)
+        {
+            for (auto& group : chunks[i].groups)
+            {
+                groups.emplace_back(facebase[i] + group.first, std::move(group.second));
+            }
+        }
+        groups.emplace_back(facebase[numchunks], std::string());
+
+        std::vector<float> positions(3 * static_cast<std::size_t>(numvertices));
+        std::vector<int> indices(3 * facebase[numchunks]);
+
+        // Resolve relative indices while gathering chunks
+        threads.clear();
+        std::vector<std::string> errors(numchunks);
+        auto gather = [&](int i)
+        {
+            ObjChunk& chunk = chunks[i];
+
+            for (auto r : chunk.relative)
+            {
+                chunk.indices[r] += vertexbase[i];
+            }
+
+            for (auto idx : chunk.indices)
+            {
+                if (idx < 0 || idx >= numvertices)
+                {
+                    errors[i] = "Face index out of range";
+                    return;
+                }
+            }
+
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + 3 * static_cast<std::size_t>(vertexbase[i]));
+            std::copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + 3 * facebase[i]);
+        };
+
+        for (int i = 1; i < numchunks; ++i)
+        {
+            threads.emplace_back(gather, i);
+        }
+        gather(0);
+
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        for (auto const& error : errors)
+        {
+            if (!error.empty())
+            {
+                return error;
+            }
+        }
+
+        chunks.clear();
+
+        // Every mesh gets its own vertices, so views don't reference the whole file
+        std::vector<int> remap(numvertices, -1);
+        std::vector<std::pair<std::size_t, std::size_t>> offsets;
+
+        for (std::size_t g = 0; g + 1 < groups.size(); ++g)
+        {
+            std::size_t const first = groups[g].first;
+            std::size_t const last = groups[g + 1].first;
+
+            if (first == last)
+            {
+                continue;
+            }
+
+            std::size_t const vertexoffset = geometry.m_positions.size();
+            std::size_t const indexoffset = geometry.m_indices.size();
+            int meshvertices = 0;
+
+            for (std::size_t i = 3 * first; i < 3 * last; ++i)
+            {
+                int const idx = indices[i];
+                if (remap[idx] < 0)
+                {
+                    remap[idx] = meshvertices++;
+                    geometry.m_positions.insert(geometry.m_positions.end(), &positions[3 * idx], &positions[3 * idx] + 3);
+                }
+                geometry.m_indices.push_back(remap[idx]);
+            }
+
+            // Reset only the entries used by the mesh
+            for (std::size_t i = 3 * first; i < 3 * last; ++i)
+            {
+                remap[indices[i]] = -1;
+            }
+
+            MeshData mesh;
+            mesh.name = groups[g].second;
+            mesh.numvertices = meshvertices;
+            mesh.numfaces = static_cast<int>(last - first);
+            geometry.m_meshes.push_back(mesh);
+            offsets.emplace_back(vertexoffset, indexoffset);
+        }
+
+        // Storage doesn't move anymore
+        for (std::size_t i = 0; i < geometry.m_meshes.size(); ++i)
+        {
+            geometry.m_meshes[i].positions = &geometry.m_positions[offsets[i].first];
+            geometry.m_meshes[i].indices = &geometry.m_indices[offsets[i].second];
+        }
+
+        return std::string();
+    }
+
+    std::string LoadBinary(char const* path, Geometry& geometry)
+    {
+        geometry.m_meshes.clear();
+        geometry.m_positions.clear();
+        geometry.m_indices.clear();
+
+        if (!geometry.m_file.Open(path))
+        {
+            return std::string("Can't open ") + path;
+        }
+
+        char const* const data = geometry.m_file.GetData();
+        std::size_t const size = geometry.m_file.GetSize();
+
+        BinaryHeader header;
+        if (size < sizeof(header))
+        {
+            geometry.m_file.Close();
+            return "Truncated geometry file";
+        }
+
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, kBinaryMagic, sizeof(kBinaryMagic)) != 0 || header.version != kBinaryVersion)
+        {
+            geometry.m_file.Close();
+            return "Unsupported geometry file format";
+        }
+
+        if (size < sizeof(header) + header.nummeshes * sizeof(BinaryMesh))
+        {
+            geometry.m_file.Close();
+            return "Truncated geometry file";
+        }
+
+        // Arrays are 4 byte aligned and the mapping is page aligned, so they are used in place
+        for (std::uint32_t i = 0; i < header.nummeshes; ++i)
+        {
+            BinaryMesh entry;
+            std::memcpy(&entry, data + sizeof(header) + i * sizeof(BinaryMesh), sizeof(entry));
+
+            std::uint64_t const positionsize = 3ull * entry.numvertices * sizeof(float);
+            std::uint64_t const indexsize = 3ull * entry.numfaces * sizeof(int);
+
+            if (entry.positions % 4 != 0 || entry.indices % 4 != 0 ||
+                entry.positions + positionsize > size || entry.indices + indexsize > size ||
+                static_cast<std::uint64_t>(entry.name) + entry.namelength > size)
+            {
+                geometry.m_meshes.clear();
+                geometry.m_file.Close();
+                return "Truncated geometry file";
+            }
+
+            MeshData mesh;
+            mesh.name.assign(data + entry.name, entry.namelength);
+            mesh.positions = reinterpret_cast<float const*>(data + entry.positions);
+            mesh.numvertices = static_cast<int>(entry.numvertices);
+            mesh.indices = reinterpret_cast<int const*>(data + entry.indices);
+            mesh.numfaces = static_cast<int>(entry.numfaces);
+            geometry.m_meshes.push_back(mesh);
+        }
+
+        return std::string();
+    }
+
+    std::string Load(char const* path, Geometry& geometry, int numthreads)
+    {
+        static char const kExtension[] = ".rrgeo";
+        std::size_t const length = std::strlen(path);
+        std::size_t const extlength = sizeof(kExtension) - 1;
+
+        if (length >= extlength && std::strcmp(path + length - extlength, kExtension) == 0)
+        {
+            return LoadBinary(path, geometry);
+        }
+
+        return LoadObj(path, geometry, numthreads);
+    }
+
+    std::string WriteBinary(char const* path, Geometry const& geometry)
+    {
+        auto const& meshes = geometry.GetMeshes();
+
+        BinaryHeader header;
+        std::memcpy(header.magic, kBinaryMagic, sizeof(kBinaryMagic));
+        header.version = kBinaryVersion;
+        header.nummeshes = static_cast<std::uint32_t>(meshes.size());
+        header.reserved = 0;
+
+        // Names follow the mesh table, arrays start at the next 4 byte boundary
+        std::vector<BinaryMesh> table(meshes.size());
+        std::uint64_t offset = sizeof(header) + table.size() * sizeof(BinaryMesh);
+
+        for (std::size_t i = 0; i < meshes.size(); ++i)
+        {
+            table[i].name = static_cast<std::uint32_t>(offset);
+            table[i].namelength = static_cast<std::uint32_t>(meshes[i].name.size());
+            offset += meshes[i].name.size();
+        }
+
+        offset = (offset + 3) & ~3ull;
+
+        for (std::size_t i = 0; i < meshes.size(); ++i)
+        {
+            table[i].numvertices = static_cast<std::uint32_t>(meshes[i].numvertices);
+            table[i].numfaces = static_cast<std::uint32_t>(meshes[i].numfaces);
+            table[i].positions = offset;
+            offset += 3ull * meshes[i].numvertices * sizeof(float);
+            table[i].indices = offset;
+            offset += 3ull * meshes[i].numfaces * sizeof(int);
+        }
+
+        std::ofstream out(path, std::ios::out | std::ios::binary);
+        if (!out)
+        {
+            return std::string("Can't open ") + path;
+        }
+
+        out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+        if (!table.empty())
+        {
+            out.write(reinterpret_cast<char const*>(&table[0]), table.size() * sizeof(BinaryMesh));
+        }
+
+        std::size_t namesize = 0;
+        for (auto const& mesh : meshes)
+        {
+            out.write(mesh.name.data(), mesh.name.size());
+            namesize += mesh.name.size();
+        }
+
+        char const padding[4] = { 0, 0, 0, 0 };
+        out.write(padding, (4 - (sizeof(header) + table.size() * sizeof(BinaryMesh) + namesize) % 4) % 4);
+
+        for (auto const& mesh : meshes)
+        {
+            out.write(reinterpret_cast<char const*>(mesh.positions), 3ull * mesh.numvertices * sizeof(float));
+            out.write(reinterpret_cast<char const*>(mesh.indices), 3ull * mesh.numfaces * sizeof(int));
+        }
+
+        return out ? std::string() : std::string("Can't write ") + path;
+    }
+
+    std::vector<RadeonRays::Shape*> CreateMeshes(RadeonRays::IntersectionApi* api, Geometry const& geometry)
+    {
+        std::vector<RadeonRays::Shape*> shapes;
+        shapes.reserve(geometry.GetMeshes().size());
+
+        for (auto const& mesh : geometry.GetMeshes())
+        {
+            shapes.push_back(api->CreateMesh(mesh.positions, mesh.numvertices, 3 * sizeof(float),
+                mesh.indices, 0, nullptr, mesh.numfaces));
+        }
+
+        return shapes;
+    }
+}
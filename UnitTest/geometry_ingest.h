@@ -0,0 +1,109 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "radeon_rays.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace GeometryIngest
+{
+    // Read only view of a file mapped into memory
+    class MappedFile
+    {
+    public:
+        MappedFile();
+        ~MappedFile();
+
+        MappedFile(MappedFile const&) = delete;
+        MappedFile& operator = (MappedFile const&) = delete;
+
+        // Map the whole file, false if it can't be opened or is empty
+        bool Open(char const* path);
+        void Close();
+
+        char const* GetData() const { return m_data; }
+        std::size_t GetSize() const { return m_size; }
+
+    private:
+        char const* m_data;
+        std::size_t m_size;
+#ifdef _WIN32
+        void* m_file;
+        void* m_mapping;
+#endif
+    };
+
+    // Triangle mesh with its own vertices, positions are 3 floats per vertex
+    struct MeshData
+    {
+        std::string name;
+        float const* positions;
+        int numvertices;
+        int const* indices;
+        int numfaces;
+    };
+
+    // Geometry of a file, meshes point either into the mapped file (binary format)
+    // or into the storage of parsed OBJ data, so the object has to outlive them
+    class Geometry
+    {
+    public:
+        Geometry() = default;
+        Geometry(Geometry const&) = delete;
+        Geometry& operator = (Geometry const&) = delete;
+
+        std::vector<MeshData> const& GetMeshes() const { return m_meshes; }
+
+    private:
+        friend std::string LoadObj(char const* path, Geometry& geometry, int numthreads);
+        friend std::string LoadBinary(char const* path, Geometry& geometry);
+
+        std::vector<MeshData> m_meshes;
+        MappedFile m_file;
+        std::vector<float> m_positions;
+        std::vector<int> m_indices;
+    };
+
+    // Parse positions and faces of an OBJ file in parallel chunks (0 threads means all hardware threads).
+    // Polygons are triangulated as fans, every "o" or "g" statement starts a new mesh. Returns an error
+    // message, empty on success.
+    std::string LoadObj(char const* path, Geometry& geometry, int numthreads = 0);
+
+    // Map a file written by WriteBinary, meshes reference the mapped memory without copies.
+    // Returns an error message, empty on success.
+    std::string LoadBinary(char const* path, Geometry& geometry);
+
+    // Pick the loader by extension, ".rrgeo" files are loaded by LoadBinary, everything else by LoadObj
+    std::string Load(char const* path, Geometry& geometry, int numthreads = 0);
+
+    // Write meshes in the compact binary format: header, mesh table and 4 byte aligned position
+    // and index arrays. Returns an error message, empty on success.
+    std::string WriteBinary(char const* path, Geometry const& geometry);
+
+    // Create meshes straight from the loaded memory, the API keeps its own copies so the
+    // geometry can be released afterwards
+    std::vector<RadeonRays::Shape*> CreateMeshes(RadeonRays::IntersectionApi* api, Geometry const& geometry);
+}
@@ -27,10 +27,22 @@ THE SOFTWARE.
 
 #include "gtest/gtest.h"
 #include "radeon_rays.h"
+#include "radeon_rays_baker.h"
 #include "math/quaternion.h"
 #include "tiny_obj_loader.h"
+#include "geometry_ingest.h"
 #include "utils.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
 using namespace RadeonRays;
 
 
@@ -59,6 +71,7 @@ public:
 
         ASSERT_NE(nativeidx, -1);
 
+        nativeidx_ = nativeidx;
         api_ = IntersectionApi::Create(nativeidx);
     }
 
@@ -75,6 +88,7 @@ public:
 
     IntersectionApi* api_;
     Event* e_;
+    std::uint32_t nativeidx_;
 
     static float const * vertices() {
         static float const vertices[] = {
@@ -111,7 +125,11 @@ TEST_F(ApiBackendOpenCL, DeviceEnum)
 
         ASSERT_NE(devinfo.name, nullptr);
         ASSERT_NE(devinfo.vendor, nullptr);
+        ASSERT_EQ(devinfo.platform, DeviceInfo::kOpenCL);
     }
+
+    // Enumeration is cached, repeated queries see the same devices
+    ASSERT_EQ(IntersectionApi::GetDeviceCount(), (std::uint32_t)numdevices);
 }
 
 // The test checks whether the api has been successfully created
@@ -134,266 +152,5443 @@ TEST_F(ApiBackendOpenCL, Mesh)
     ASSERT_NO_THROW(api_->DeleteShape(shape));
 }
 
-// The test creates an empty scene
-TEST_F(ApiBackendOpenCL, EmptyScene)
-{
-    ASSERT_THROW(api_->Commit(), Exception);
-}
-
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, MeshStrided)
+// The test checks statistics reported for a single triangle scene
+TEST_F(ApiBackendOpenCL, CommitStatistics)
 {
-    struct Vertex
-    {
-        float position[3];
-        float normal[3];
-        float uv[2];
-    };
+    Shape* shape = nullptr;
 
-    // Mesh vertices
-    Vertex vertices[] = {
-        { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
-        { 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
-        { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
-        { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
-        { 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
-        { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f }
-    };
+    ASSERT_NO_THROW(shape = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(api_->Commit());
 
-    // Indices
-    int mindices[] = { 0, 1, 2, 0, 0, 1, 2, 0};
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
 
-    Shape* shape = nullptr;
+    ASSERT_EQ(stats.num_nodes, 1);
+    ASSERT_EQ(stats.num_leaves, 1);
+    ASSERT_EQ(stats.refitted, 0);
+    ASSERT_EQ(stats.vertices_bytes, 3 * sizeof(float3));
+    ASSERT_GT(stats.nodes_bytes, 0u);
+    ASSERT_GT(stats.faces_bytes, 0u);
+    ASSERT_GE(stats.total_time, stats.build_time);
 
-    ASSERT_NO_THROW(shape = api_->CreateMesh((float*)vertices, 6, sizeof(Vertex), mindices, 4*sizeof(int), nullptr, 2));
+    // Nothing has changed, so nothing is rebuilt or uploaded
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
 
-    ASSERT_TRUE(shape != nullptr);
+    ASSERT_EQ(stats.nodes_bytes, 0u);
+    ASSERT_EQ(stats.vertices_bytes, 0u);
 
-    ASSERT_NO_THROW(api_->AttachShape(shape));
     ASSERT_NO_THROW(api_->DetachShape(shape));
     ASSERT_NO_THROW(api_->DeleteShape(shape));
 }
 
+// Mesh of 2 * n * n triangles in the z = 0 plane
+static Shape* CreateGridMesh(IntersectionApi* api, int n)
+{
+    std::vector<float> vertices;
+    std::vector<int> indices;
+    std::vector<int> numfaceverts(2 * n * n, 3);
 
+    for (int y = 0; y <= n; ++y)
+    {
+        for (int x = 0; x <= n; ++x)
+        {
+            vertices.push_back((float)x);
+            vertices.push_back((float)y);
+            vertices.push_back(0.f);
+        }
+    }
 
-//The test creates a single triangle mesh and then tries to create an instance of the mesh
-TEST_F(ApiBackendOpenCL, Instance)
-{    
+    for (int y = 0; y < n; ++y)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            int v = y * (n + 1) + x;
+            int quad[] = { v, v + 1, v + n + 2, v, v + n + 2, v + n + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+
+    return api->CreateMesh(vertices.data(), (int)vertices.size() / 3, 3 * sizeof(float),
+        indices.data(), 0, numfaceverts.data(), (int)numfaceverts.size());
+}
+
+// The test checks memory usage categories are filled and grow with the scene
+TEST_F(ApiBackendOpenCL, MemoryUsage)
+{
     Shape* shape = nullptr;
-    
-    ASSERT_NO_THROW(shape = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(),0, numfaceverts(), 1));
-    
-    ASSERT_TRUE(shape != nullptr);
-    
+
+    ASSERT_NO_THROW(shape = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
     ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(api_->Commit());
+
+    MemoryUsage small;
+    ASSERT_NO_THROW(api_->GetMemoryUsage(small));
+
+    ASSERT_GE(small.vertices_bytes, 3 * sizeof(float3));
+    ASSERT_GT(small.nodes_bytes, 0u);
+    ASSERT_GT(small.faces_bytes, 0u);
+    ASSERT_GT(small.event_pool_bytes, 0u);
+    ASSERT_GT(small.host_geometry_bytes, 0u);
+    ASSERT_EQ(small.device_bytes, small.vertices_bytes + small.faces_bytes + small.nodes_bytes +
+        small.instances_bytes + small.scratch_bytes + small.pool_bytes);
+    ASSERT_EQ(small.host_bytes, small.event_pool_bytes + small.host_chunks_bytes +
+        small.kernel_binaries_bytes + small.host_geometry_bytes);
+
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 64));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+    ASSERT_NO_THROW(api_->Commit());
+
+    MemoryUsage large;
+    ASSERT_NO_THROW(api_->GetMemoryUsage(large));
+
+    ASSERT_GT(large.vertices_bytes, small.vertices_bytes);
+    ASSERT_GT(large.faces_bytes, small.faces_bytes);
+    ASSERT_GT(large.nodes_bytes, small.nodes_bytes);
+    ASSERT_GT(large.host_geometry_bytes, small.host_geometry_bytes);
+
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
     ASSERT_NO_THROW(api_->DetachShape(shape));
-    
-    Shape* instance = nullptr;
-    
-    ASSERT_NO_THROW(instance = api_->CreateInstance(shape));
-    
-    ASSERT_TRUE(instance != nullptr);
-    
     ASSERT_NO_THROW(api_->DeleteShape(shape));
 }
 
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_1Ray)
+// The test checks structures are simplified to fit acc.memory_budget and commits fail if they can't
+TEST_F(ApiBackendOpenCL, MemoryBudget)
 {
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 64));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.sah.use_splits", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.precomputed_triangles", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.memory_budget", 1024.f));
+    ASSERT_NO_THROW(api_->Commit());
 
-    Shape* mesh = nullptr;
+    CommitStatistics stats;
+    MemoryUsage usage;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_NO_THROW(api_->GetMemoryUsage(usage));
+    ASSERT_EQ(stats.budget_steps, 0);
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    std::size_t const full = usage.nodes_bytes + usage.vertices_bytes + usage.faces_bytes;
 
-    ASSERT_TRUE(mesh != nullptr);
+    // Three quarters of the full structure
+    ASSERT_NO_THROW(api_->SetOption("acc.memory_budget", 0.75f * full / (1024.f * 1024.f)));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_NO_THROW(api_->GetMemoryUsage(usage));
+    ASSERT_GT(stats.budget_steps, 0);
+    ASSERT_LT(usage.nodes_bytes + usage.vertices_bytes + usage.faces_bytes, full);
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    // Nothing fits into a kilobyte, the commit fails instead of building
+    ASSERT_NO_THROW(api_->SetOption("acc.memory_budget", 1.f / 1024.f));
+    ASSERT_ANY_THROW(api_->Commit());
 
-    // Prepare the ray
-    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
 
-    // Intersection and hit data
-    Intersection isect;
+// The test checks intersectors share query scratch buffers instead of holding their own
+TEST_F(ApiBackendOpenCL, ScratchBuffersShared)
+{
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 16));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
-    
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    std::vector<ray> rays(4096);
+    std::vector<Intersection> hits(rays.size());
 
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        rays[i] = ray(float3((i % 64) * 0.25f, (i / 64) * 0.25f, 1.f), float3(0.f, 0.f, -1.f));
+    }
 
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_)); 
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    MemoryUsage usage[3];
+    char const* types[] = { "fatbvh", "qbvh", "fatbvh" };
 
-    // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(mesh));
-    ASSERT_NO_THROW(api_->DeleteShape(mesh));
-    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
-    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
-}
+    for (int i = 0; i < 3; ++i)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", types[i]));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+        ASSERT_NO_THROW(api_->GetMemoryUsage(usage[i]));
+    }
 
+    // Scratch grew once for the deeper qbvh stack and is reused after switching back
+    ASSERT_GT(usage[0].scratch_bytes, 0u);
+    ASSERT_GE(usage[1].scratch_bytes, usage[0].scratch_bytes);
+    ASSERT_EQ(usage[2].scratch_bytes, usage[1].scratch_bytes);
 
-#ifdef RR_RAY_MASK
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Masked)
-#else
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, DISABLED_Intersection_1Ray_Masked)
-#endif
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks trees optimized for ray samples find the same hits
+TEST_F(ApiBackendOpenCL, RaySamples)
 {
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 32));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
 
-    Shape* mesh = nullptr;
+    // Camera like rays toward one corner of the grid, targets stay off triangle edges
+    std::vector<ray> rays(4096);
 
-    api_->SetOption("acc.type", "bvh");
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.125f + 0.03f, (i / 64) * 0.125f + 0.07f, 0.f);
+        float3 origin(4.f, 4.f, 10.f);
+        rays[i] = ray(origin, normalize(target - origin));
+    }
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_ANY_THROW(api_->SetRaySamples(nullptr, 16));
 
-    // Set mask 
-    ASSERT_NO_THROW(mesh->SetMask(0xFFFFFFFF));
+    char const* types[] = { "bvh", "fatbvh", "qbvh" };
 
-    ASSERT_TRUE(mesh != nullptr);
+    for (auto type : types)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", type));
+        ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+        ASSERT_NO_THROW(api_->SetRaySamples(nullptr, 0));
+        ASSERT_NO_THROW(api_->Commit());
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh));
+        std::vector<Intersection> expected(rays.size());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
 
-    // Prepare the ray
-    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
-    r.SetMask(0xFFFFFFFF);
+        ASSERT_NO_THROW(api_->SetRaySamples(rays.data(), (int)rays.size()));
+        ASSERT_NO_THROW(api_->Commit());
 
-    // Intersection and hit data
-    Intersection isect;
+        std::vector<Intersection> hits(rays.size());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
 
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
-    auto isect_flag_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, expected[i].shapeid);
+            ASSERT_EQ(hits[i].primid, expected[i].primid);
+        }
+    }
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    Intersection* tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NO_THROW(api_->SetRaySamples(nullptr, 0));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
 
-    mesh->SetMask(0x0);
+// The test checks device built binned SAH trees find the same hits as CPU built ones
+TEST_F(ApiBackendOpenCL, HlbvhBinnedSah)
+{
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 32));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, kNullId);
+    // Rays straight down onto the grid, targets stay off triangle edges
+    std::vector<ray> rays(4096);
 
-    mesh->SetMask(0xFF000000);
-    
-    int result = kNullId;
-    // Commit geometry update
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.5f + 0.03f, (i / 64) * 0.5f + 0.07f, 0.f);
+        rays[i] = ray(target + float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
     ASSERT_NO_THROW(api_->Commit());
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
-    
-    int* isect_flag = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
-    Wait();
-    result = *isect_flag;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_GT(result, 0);
 
-    mesh->SetMask(0xFF000000);
-    
-    r.SetMask(0x000000FF);
-    
-    ray* rr = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
-    Wait();
-    *rr = r;
-    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
-    Wait();
+    std::vector<Intersection> expected(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
 
-    // Commit geometry update
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "hlbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.builder", "sah"));
     ASSERT_NO_THROW(api_->Commit());
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
-    
-    isect_flag = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
-    Wait();
-    result = *isect_flag;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
-    Wait();
-    // Check results
-    ASSERT_EQ(result, kNullId);
 
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.num_nodes, 2 * 2 * 32 * 32 - 1);
 
-    // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(mesh));
-    ASSERT_NO_THROW(api_->DeleteShape(mesh));
-    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
-    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
-    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+    std::vector<Intersection> hits(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
 
-}
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        ASSERT_EQ(hits[i].shapeid, expected[i].shapeid);
+        ASSERT_EQ(hits[i].primid, expected[i].primid);
+    }
 
+    // Single primitive tree is a root leaf
+    Shape* triangle = nullptr;
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(triangle = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(triangle));
+    ASSERT_NO_THROW(api_->Commit());
 
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    Intersection hit;
+    ASSERT_NO_THROW(api_->QueryIntersection(&r, 1, &hit));
+    ASSERT_EQ(hit.shapeid, triangle->GetId());
+    ASSERT_EQ(hit.primid, 0);
+
+    ASSERT_NO_THROW(api_->DetachShape(triangle));
+    ASSERT_NO_THROW(api_->DeleteShape(triangle));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks fat nodes translated from HLBVH nodes on the device give the same hits
+TEST_F(ApiBackendOpenCL, HlbvhShortStackTraversal)
 {
-    Shape* mesh = nullptr;
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 32));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    // Rays straight down onto the grid, targets stay off triangle edges
+    std::vector<ray> rays(4096);
 
-    ASSERT_TRUE(mesh != nullptr);
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.5f + 0.03f, (i / 64) * 0.5f + 0.07f, 0.f);
+        rays[i] = ray(target + float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f));
+    }
 
-    // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->Commit());
 
-    // Prepare the ray
-    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    std::vector<Intersection> expected(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
 
-    // Intersection and hit data
-    Intersection isect;
-    
-    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
-    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "hlbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.traversal", "short_stack"));
 
-    // Commit geometry update
-    ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    char const* builders[] = { "lbvh", "sah" };
+
+    for (auto builder : builders)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.builder", builder));
+        ASSERT_NO_THROW(api_->Commit());
+
+        std::vector<Intersection> hits(rays.size());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, expected[i].shapeid);
+            ASSERT_EQ(hits[i].primid, expected[i].primid);
+        }
+
+        std::vector<int> occluded(rays.size());
+        ASSERT_NO_THROW(api_->QueryOcclusion(rays.data(), (int)rays.size(), occluded.data()));
+
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(occluded[i] != kNullId, expected[i].shapeid != kNullId);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.traversal", "stack"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.builder", "lbvh"));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks device built trees are refitted to moved geometry and rebuilt once refits degrade them
+TEST_F(ApiBackendOpenCL, HlbvhRefit)
+{
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 32));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+
+    // Rays straight down onto the grid, targets stay off triangle edges
+    std::vector<ray> rays(4096);
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.5f + 0.03f, (i / 64) * 0.5f + 0.07f, 0.f);
+        rays[i] = ray(target + float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "hlbvh"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    std::vector<Intersection> expected(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
+
+    // Moving the grid along the rays keeps the hit primitives
+    matrix m = translation(float3(0.f, 0.f, 1.f));
+    ASSERT_NO_THROW(grid->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 1);
+
+    std::vector<Intersection> hits(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        ASSERT_EQ(hits[i].shapeid, expected[i].shapeid);
+        ASSERT_EQ(hits[i].primid, expected[i].primid);
+    }
+
+    // No refitted tree is cheaper than half of the built one
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.refit_max_cost", 0.5f));
+    ASSERT_NO_THROW(grid->SetTransform(matrix(), matrix()));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 0);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        ASSERT_EQ(hits[i].primid, expected[i].primid);
+    }
+
+    // Degraded trees keep being refitted while replacements are built in the background
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.background_rebuild", 1.f));
+
+    for (int frame = 0; frame < 8; ++frame)
+    {
+        matrix t = translation(float3(0.f, 0.f, 0.25f * (frame % 2)));
+        ASSERT_NO_THROW(grid->SetTransform(t, inverse(t)));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+        ASSERT_EQ(stats.refitted, 1);
+
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(hits[i].primid, expected[i].primid);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.background_rebuild", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.refit_max_cost", 1.5f));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks progressive commits trace a coarse tree right away and swap in the configured one later
+TEST_F(ApiBackendOpenCL, ProgressiveCommit)
+{
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 128));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+
+    // Rays straight down onto the grid, targets stay off triangle edges
+    std::vector<ray> rays(4096);
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 2.f + 0.03f, (i / 64) * 2.f + 0.07f, 0.f);
+        rays[i] = ray(target + float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f));
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    float const sah_cost = stats.sah_cost;
+
+    std::vector<Intersection> expected(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
+
+    // Reattaching the shape rebuilds the tree
+    ASSERT_NO_THROW(api_->SetOption("bvh.progressive", 1.f));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+
+    // Every commit traces correctly whichever tree is in use
+    bool refined = false;
+
+    for (int i = 0; i < 500 && !refined; ++i)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+        refined = i > 0 && std::abs(stats.sah_cost - sah_cost) <= 1e-3f * sah_cost;
+
+        std::vector<Intersection> hits(rays.size());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+        for (std::size_t j = 0; j < rays.size(); ++j)
+        {
+            ASSERT_EQ(hits[j].shapeid, expected[j].shapeid);
+            ASSERT_EQ(hits[j].primid, expected[j].primid);
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    ASSERT_TRUE(refined);
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.progressive", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "median"));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks the two-level grid finds the same hits as BVH for oblique rays and after the geometry moves
+TEST_F(ApiBackendOpenCL, GridTraversal)
+{
+    Shape* grid = nullptr;
+    ASSERT_NO_THROW(grid = CreateGridMesh(api_, 32));
+    ASSERT_NO_THROW(api_->AttachShape(grid));
+
+    // Oblique rays cross many cells on their way down, targets stay off triangle edges
+    std::vector<ray> rays(4096);
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.5f + 0.03f, (i / 64) * 0.5f + 0.07f, 0.f);
+        float3 dir = normalize(float3(0.3f * ((i % 7) - 3.f), 0.2f * ((i % 5) - 2.f), -1.f));
+        rays[i] = ray(target - dir * 10.f, dir);
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->Commit());
+
+    std::vector<Intersection> expected(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), expected.data()));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+
+    // Coarse and fine grids
+    float const densities[] = { 0.5f, 8.f };
+
+    for (auto density : densities)
+    {
+        ASSERT_NO_THROW(api_->SetOption("grid.density", density));
+        ASSERT_NO_THROW(api_->Commit());
+
+        CommitStatistics stats;
+        ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+        ASSERT_GT(stats.num_leaves, 0);
+
+        std::vector<Intersection> hits(rays.size());
+        ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data()));
+
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(hits[i].shapeid, expected[i].shapeid);
+            ASSERT_EQ(hits[i].primid, expected[i].primid);
+            ASSERT_NEAR(hits[i].uvwt.w, expected[i].uvwt.w, 1e-3f);
+        }
+
+        std::vector<int> occluded(rays.size());
+        ASSERT_NO_THROW(api_->QueryOcclusion(rays.data(), (int)rays.size(), occluded.data()));
+
+        for (std::size_t i = 0; i < rays.size(); ++i)
+        {
+            ASSERT_EQ(occluded[i] != kNullId, expected[i].shapeid != kNullId);
+        }
+    }
+
+    // Moving the grid along z keeps hit primitives, the grid is rebuilt around it
+    matrix m = translation(float3(0.f, 0.f, 1.f));
+    ASSERT_NO_THROW(grid->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+
+    std::vector<ray> down(rays.size());
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        float3 target((i % 64) * 0.5f + 0.03f, (i / 64) * 0.5f + 0.07f, 1.f);
+        down[i] = ray(target + float3(0.f, 0.f, 10.f), float3(0.f, 0.f, -1.f));
+    }
+
+    std::vector<Intersection> hits(rays.size());
+    ASSERT_NO_THROW(api_->QueryIntersection(down.data(), (int)down.size(), hits.data()));
+
+    for (std::size_t i = 0; i < rays.size(); ++i)
+    {
+        ASSERT_EQ(hits[i].shapeid, grid->GetId());
+        ASSERT_NEAR(hits[i].uvwt.w, 10.f, 1e-3f);
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->DetachShape(grid));
+    ASSERT_NO_THROW(api_->DeleteShape(grid));
+}
+
+// The test checks shapes attached and detached between commits don't force a rebuild
+TEST_F(ApiBackendOpenCL, CommitStatistics_TransientShape)
+{
+    Shape* shape = nullptr;
+    Shape* transient = nullptr;
+
+    ASSERT_NO_THROW(shape = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Transient shape leaves the composition as it was, the moved mesh is refitted
+    ASSERT_NO_THROW(transient = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(transient));
+    ASSERT_NO_THROW(api_->DetachShape(transient));
+    ASSERT_NO_THROW(api_->DeleteShape(transient));
+
+    matrix m = translation(float3(0, 2, 0));
+    ASSERT_NO_THROW(shape->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 1);
+
+    // Detached and attached again counts as a new shape
+    ASSERT_NO_THROW(api_->DetachShape(shape));
+    ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(shape->SetTransform(matrix(), matrix()));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 0);
+
+    ASSERT_NO_THROW(api_->DetachShape(shape));
+    ASSERT_NO_THROW(api_->DeleteShape(shape));
+}
+
+// The test creates an empty scene
+TEST_F(ApiBackendOpenCL, EmptyScene)
+{
+    ASSERT_THROW(api_->Commit(), Exception);
+}
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, MeshStrided)
+{
+    struct Vertex
+    {
+        float position[3];
+        float normal[3];
+        float uv[2];
+    };
+
+    // Mesh vertices
+    Vertex vertices[] = {
+        { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
+        { 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
+        { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
+        { 0.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
+        { 0.f, 1.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f },
+        { 1.f, 0.f, 0.f, 0.f, 0.f, 1.f, 0.f, 0.f }
+    };
+
+    // Indices
+    int mindices[] = { 0, 1, 2, 0, 0, 1, 2, 0};
+
+    Shape* shape = nullptr;
+
+    ASSERT_NO_THROW(shape = api_->CreateMesh((float*)vertices, 6, sizeof(Vertex), mindices, 4*sizeof(int), nullptr, 2));
+
+    ASSERT_TRUE(shape != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(api_->DetachShape(shape));
+    ASSERT_NO_THROW(api_->DeleteShape(shape));
+}
+
+
+
+// The test creates meshes in a batch, attaches them at once and checks their IDs
+TEST_F(ApiBackendOpenCL, MeshBatch)
+{
+    // Enough meshes to build them on several workers, each moved 3 units along x
+    int const nummeshes = 200;
+    std::vector<float> positions(nummeshes * 9);
+    std::vector<MeshDesc> descs(nummeshes);
+
+    for (int i = 0; i < nummeshes; ++i)
+    {
+        for (int j = 0; j < 9; ++j)
+        {
+            positions[9 * i + j] = vertices()[j] + (j % 3 == 0 ? 3.f * i : 0.f);
+        }
+
+        descs[i].vertices = &positions[9 * i];
+        descs[i].vnum = 3;
+        descs[i].vstride = 3 * sizeof(float);
+        descs[i].indices = indices();
+        descs[i].istride = 0;
+        descs[i].numfacevertices = numfaceverts();
+        descs[i].numfaces = 1;
+    }
+
+    std::vector<Shape*> shapes(nummeshes, nullptr);
+    ASSERT_NO_THROW(api_->CreateMeshes(descs.data(), nummeshes, shapes.data()));
+
+    // IDs are consecutive in descriptor order
+    for (int i = 1; i < nummeshes; ++i)
+    {
+        ASSERT_EQ(shapes[i]->GetId(), shapes[0]->GetId() + i);
+    }
+
+    ASSERT_NO_THROW(api_->AttachShapes(shapes.data(), nummeshes));
+    ASSERT_FALSE(api_->IsWorldEmpty());
+
+    ray r;
+    r.o = float4(3.f * 150, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+    ASSERT_EQ(isect->shapeid, shapes[150]->GetId());
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    for (auto shape : shapes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shape));
+        ASSERT_NO_THROW(api_->DeleteShape(shape));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+//The test creates a single triangle mesh and then tries to create an instance of the mesh
+TEST_F(ApiBackendOpenCL, Instance)
+{    
+    Shape* shape = nullptr;
+    
+    ASSERT_NO_THROW(shape = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(),0, numfaceverts(), 1));
+    
+    ASSERT_TRUE(shape != nullptr);
+    
+    ASSERT_NO_THROW(api_->AttachShape(shape));
+    ASSERT_NO_THROW(api_->DetachShape(shape));
+    
+    Shape* instance = nullptr;
+    
+    ASSERT_NO_THROW(instance = api_->CreateInstance(shape));
+    
+    ASSERT_TRUE(instance != nullptr);
+    
+    ASSERT_NO_THROW(api_->DeleteShape(shape));
+}
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_1Ray)
+{
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_)); 
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// The test writes rays into a persistently mapped buffer and reads hits back
+// through the mapping, without MapBuffer calls
+TEST_F(ApiBackendOpenCL, Intersection_PersistentMap)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray* rays = nullptr;
+    Intersection* hits = nullptr;
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(2 * sizeof(ray), nullptr, kBufferPersistentMap, (void**)&rays));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr, kBufferPersistentMap, (void**)&hits));
+    ASSERT_TRUE(rays != nullptr);
+    ASSERT_TRUE(hits != nullptr);
+
+    // The second ray misses the triangle, then the rays swap between frames
+    for (int frame = 0; frame < 2; ++frame)
+    {
+        rays[frame] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        rays[1 - frame] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, -1.f), 10000.f);
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, &e_));
+        Wait();
+
+        ASSERT_EQ(hits[frame].shapeid, mesh->GetId());
+        ASSERT_EQ(hits[1 - frame].shapeid, kNullId);
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// The test traces rays from caller memory used in place where the device allows it
+TEST_F(ApiBackendOpenCL, Intersection_UseHostPtr)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    std::vector<ray> rays(2);
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, -1.f), 10000.f);
+    std::vector<Intersection> isects(2);
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), rays.data(), kBufferUseHostPtr, nullptr));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBuffer(isects.size() * sizeof(Intersection), isects.data(), kBufferUseHostPtr, nullptr));
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(tmp[0].shapeid, mesh->GetId());
+    ASSERT_EQ(tmp[1].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// The test traces the second tile of a ray pool through sub-buffers
+TEST_F(ApiBackendOpenCL, Intersection_SubBuffer)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Tiles start at multiples of 4096 bytes whatever the element size is
+    int const tile = 4096;
+
+    std::vector<ray> rays(2 * tile, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, -1.f), 10000.f));
+    std::fill(rays.begin() + tile, rays.end(), ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f));
+
+    Intersection miss;
+    miss.shapeid = kNullId;
+    std::vector<Intersection> isects(2 * tile, miss);
+
+    auto ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(isects.size() * sizeof(Intersection), isects.data());
+
+    Buffer* ray_tile = nullptr;
+    Buffer* isect_tile = nullptr;
+    ASSERT_NO_THROW(ray_tile = api_->CreateSubBuffer(ray_buffer, tile * sizeof(ray), tile * sizeof(ray)));
+    ASSERT_NO_THROW(isect_tile = api_->CreateSubBuffer(isect_buffer, tile * sizeof(Intersection), tile * sizeof(Intersection)));
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_tile, tile, isect_tile, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, isects.size() * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    // The first tile is left as it was
+    ASSERT_EQ(tmp[tile - 1].shapeid, kNullId);
+    ASSERT_EQ(tmp[tile].shapeid, mesh->GetId());
+    ASSERT_EQ(tmp[2 * tile - 1].shapeid, mesh->GetId());
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_tile));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_tile));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+#ifdef RR_RAY_MASK
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Masked)
+#else
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_1Ray_Masked)
+#endif
+{
+
+    Shape* mesh = nullptr;
+
+    api_->SetOption("acc.type", "bvh");
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Set mask 
+    ASSERT_NO_THROW(mesh->SetMask(0xFFFFFFFF));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r.SetMask(0xFFFFFFFF);
+
+    // Intersection and hit data
+    Intersection isect;
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    mesh->SetMask(0x0);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+    mesh->SetMask(0xFF000000);
+    
+    int result = kNullId;
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
+    
+    int* isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_GT(result, 0);
+
+    mesh->SetMask(0xFF000000);
+    
+    r.SetMask(0x000000FF);
+    
+    ray* rr = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
+    Wait();
+    *rr = r;
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
+    Wait();
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_flag_buffer, nullptr, nullptr ));
+    
+    isect_flag = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, sizeof(int), (void**)&isect_flag, &e_));
+    Wait();
+    result = *isect_flag;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, isect_flag, &e_));
+    Wait();
+    // Check results
+    ASSERT_EQ(result, kNullId);
+
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+
+}
+
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    isect.primid = kNullId;
+    isect.shapeid = kNullId;
+
+    r.SetActive(false);
+    
+    ray* rr = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
+    Wait();
+    *rr = r;
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
+    Wait();
+    
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    *tmp = isect;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
+    
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    
+    // Check results
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking unknown options and values of the wrong type are rejected
+TEST_F(ApiBackendOpenCL, SetOption_Validation)
+{
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+
+    ASSERT_ANY_THROW(api_->SetOption("bvh.bulider", "sah"));
+    ASSERT_ANY_THROW(api_->SetOption("bvh.builder", 1.f));
+    ASSERT_ANY_THROW(api_->SetOption("bvh.force2level", "1"));
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+}
+
+// The test creates a single triangle mesh and tests attach/detach functionality
+TEST_F(ApiBackendOpenCL, Intersection_3Rays)
+{
+
+    Shape* mesh = nullptr;
+
+    // 
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays
+    ray rays[3];
+
+    // Prepare the ray
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(0.5f,0.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect[3];
+    
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+    
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect[0] = tmp[0];
+    isect[1] = tmp[1];
+    isect[2] = tmp[2];
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+    
+    // Check results
+    for (int i=0; i<3; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+
+// Test is checking 4-wide BVH traversal for both closest and any hit queries
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_Qbvh)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "qbvh"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, isect_flag_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* flags = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, 3*sizeof(int), (void**)&flags, &e_));
+    Wait();
+    int isect_flag[3] = { flags[0], flags[1], flags[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, flags, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect_flag[0], 1);
+    ASSERT_EQ(isect_flag[1], 1);
+    ASSERT_EQ(isect_flag[2], -1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+}
+
+// Test is checking stackless bit trail traversal over a tree deeper than its index range
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_HashBvh)
+{
+    Shape* mesh = nullptr;
+    Shape* nested = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "hashbvh"));
+
+    // Shrinking triangles behind the mesh build a degenerate deep tree
+    int const n = 48;
+    std::vector<float> nestedvertices;
+    std::vector<int> nestedindices;
+    std::vector<int> nestedfaceverts(n, 3);
+
+    for (int i = 0; i < n; ++i)
+    {
+        float const scale = std::pow(0.75f, (float)i);
+
+        for (int j = 0; j < 3; ++j)
+        {
+            nestedvertices.push_back(vertices()[3 * j] * scale);
+            nestedvertices.push_back(vertices()[3 * j + 1] * scale);
+            nestedvertices.push_back(1.f + 0.1f * i);
+            nestedindices.push_back(3 * i + j);
+        }
+    }
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(nested = api_->CreateMesh(&nestedvertices[0], 3 * n, 3*sizeof(float), &nestedindices[0], 0, &nestedfaceverts[0], n));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(nested));
+
+    // Rays: hitting the mesh, missing everything and hitting the farthest nested triangle from behind
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(0.f,0.f,100.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,-1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Node indices of the kernels cover 30 levels below the root
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_LE(stats.height, 30);
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, isect_flag_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* flags = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, 3*sizeof(int), (void**)&flags, &e_));
+    Wait();
+    int isect_flag[3] = { flags[0], flags[1], flags[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, flags, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, nested->GetId());
+    ASSERT_EQ(isect[2].primid, n - 1);
+    ASSERT_NEAR(isect[2].uvwt.w, 100.f - (1.f + 0.1f * (n - 1)), 0.001f);
+    ASSERT_EQ(isect_flag[0], 1);
+    ASSERT_EQ(isect_flag[1], -1);
+    ASSERT_EQ(isect_flag[2], 1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(nested));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+}
+
+// Test is checking treelet layout keeps compressed fatbvh traversal intact for a deep tree
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_TreeletLayout)
+{
+    Shape* mesh = nullptr;
+    Shape* nested = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.compressed", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.layout", "treelet"));
+
+    // Shrinking triangles behind the mesh build a deep tree spanning many treelets
+    int const n = 48;
+    std::vector<float> nestedvertices;
+    std::vector<int> nestedindices;
+    std::vector<int> nestedfaceverts(n, 3);
+
+    for (int i = 0; i < n; ++i)
+    {
+        float const scale = std::pow(0.75f, (float)i);
+
+        for (int j = 0; j < 3; ++j)
+        {
+            nestedvertices.push_back(vertices()[3 * j] * scale);
+            nestedvertices.push_back(vertices()[3 * j + 1] * scale);
+            nestedvertices.push_back(1.f + 0.1f * i);
+            nestedindices.push_back(3 * i + j);
+        }
+    }
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(nested = api_->CreateMesh(&nestedvertices[0], 3 * n, 3*sizeof(float), &nestedindices[0], 0, &nestedfaceverts[0], n));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(nested));
+
+    // Rays: hitting the mesh, missing everything and hitting the farthest nested triangle from behind
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(0.f,0.f,100.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,-1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, nested->GetId());
+    ASSERT_EQ(isect[2].primid, n - 1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(nested));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking acc.type "auto" picks a working structure for a world large enough to be probed
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_AutoAccType)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "auto"));
+    ASSERT_NO_THROW(api_->SetOption("acc.auto_probe_rays", 1024.f));
+
+    // Grid of 64x64 quads split into triangles in z = 0 plane
+    int const n = 64;
+    std::vector<float> gridvertices;
+    std::vector<int> gridindices;
+
+    for (int y = 0; y <= n; ++y)
+    {
+        for (int x = 0; x <= n; ++x)
+        {
+            gridvertices.push_back(-1.f + 2.f * x / n);
+            gridvertices.push_back(-1.f + 2.f * y / n);
+            gridvertices.push_back(0.f);
+        }
+    }
+
+    for (int y = 0; y < n; ++y)
+    {
+        for (int x = 0; x < n; ++x)
+        {
+            int v = y * (n + 1) + x;
+            int quad[6] = { v, v + 1, v + n + 2, v, v + n + 2, v + n + 1 };
+            gridindices.insert(gridindices.end(), quad, quad + 6);
+        }
+    }
+
+    std::vector<int> gridnumfaceverts(gridindices.size() / 3, 3);
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(gridvertices.data(), (int)gridvertices.size() / 3, 3*sizeof(float),
+        gridindices.data(), 0, gridnumfaceverts.data(), (int)gridnumfaceverts.size()));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: one hitting the grid and one missing it
+    ray rays[2];
+
+    rays[0].o = float4(0.3f,0.2f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+
+    // Second commit keeps the choice of the first one
+    for (int commit = 0; commit < 2; ++commit)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect[2] = { tmp[0], tmp[1] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+        ASSERT_EQ(isect[1].shapeid, kNullId);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking work group size tuning keeps short stack traversal results intact
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_TuneLocalSize)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("acc.tune_local_size", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.auto_probe_rays", 1024.f));
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Second commit takes the size tuned by the first one
+    for (int commit = 0; commit < 2; ++commit)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+        ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking fat BVH traversal with quantized child bounds
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_CompressedFatBvh)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.compressed", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.nodes_bytes, (size_t)stats.num_nodes * 32);
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking traversal with triangles stored in leaf order instead of indexed vertices
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_PrecomputedTriangles)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.precomputed_triangles", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.x, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.y, 0.5f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking rays through the edge shared by two triangles don't leak with watertight tests
+TEST_F(ApiBackendOpenCL, Intersection_Watertight)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.precomputed_triangles", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.watertight", 1.f));
+
+    // Unit square in z = 0 plane split along its diagonal
+    float const quad_vertices[] =
+    {
+        -1.f, -1.f, 0.f,
+        1.f, -1.f, 0.f,
+        1.f, 1.f, 0.f,
+        -1.f, 1.f, 0.f
+    };
+
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+    int const quad_numfaceverts[] = { 3, 3 };
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quad_vertices, 4, 3 * sizeof(float), quad_indices, 0, quad_numfaceverts, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays aimed at points of the diagonal from different directions
+    int const numrays = 64;
+    std::vector<ray> rays(numrays);
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        float const t = -0.9f + 0.028f * i;
+        float3 const d = float3(0.1f * (i % 7 - 3), 0.13f * (i % 5 - 2), 1.f);
+        rays[i] = ray(float3(t, t, 0.f) - 10.f * d, d, 10000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), &rays[0]);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    // Switching the mode recompiles traversal and rebuilds precomputed triangles
+    for (int watertight = 1; watertight >= 0; --watertight)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.watertight", (float)watertight));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        // Only watertight tests guarantee a hit for every ray, the other mode just has to find the square
+        int hits = 0;
+        for (int i = 0; i < numrays; ++i)
+        {
+            hits += tmp[i].shapeid == mesh->GetId() ? 1 : 0;
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        if (watertight)
+        {
+            ASSERT_EQ(hits, numrays);
+        }
+        else
+        {
+            ASSERT_GT(hits, 0);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking traversal reading vertices packed as 3 floats without padding
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_PackedVertices)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.packed_vertices", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.x, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.y, 0.5f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking direction ordered skip links find the nearest of stacked triangles from both sides
+TEST_F(ApiBackendOpenCL, Intersection_StackedTriangles_DirectionOrdered)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.direction_ordered", 1.f));
+
+    // Triangles stacked along z, one per unit
+    int const kNumTriangles = 8;
+    std::vector<float> stacked;
+    std::vector<int> stackedindices;
+
+    for (int i = 0; i < kNumTriangles; ++i)
+    {
+        float const z = (float)i;
+        float const triangle[9] = { -1.f, -1.f, z, 1.f, -1.f, z, 0.f, 1.f, z };
+        stacked.insert(stacked.end(), triangle, triangle + 9);
+        stackedindices.push_back(3 * i);
+        stackedindices.push_back(3 * i + 1);
+        stackedindices.push_back(3 * i + 2);
+    }
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(&stacked[0], 3 * kNumTriangles, 3*sizeof(float), &stackedindices[0], 0, nullptr, kNumTriangles));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: going up and down the stack in different octants and one missing it
+    ray rays[4];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,17.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,-1.f);
+
+    rays[2].o = float4(0.01f,0.01f,17.f, 1000.f);
+    rays[2].d = float3(-0.001f,-0.001f,-1.f);
+
+    rays[3].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[3].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(4*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(4*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[4] = { tmp[0], tmp[1], tmp[2], tmp[3] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, kNumTriangles - 1);
+    ASSERT_NEAR(isect[1].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].primid, kNumTriangles - 1);
+    ASSERT_EQ(isect[3].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking both triangles of a pair report their own primitive IDs and barycentrics
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_TrianglePairs)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.triangle_pairs", 1.f));
+
+    // Quad split along its diagonal into two triangles sharing an edge
+    float const quad_vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        1.f,1.f,0.f,
+        -1.f,1.f,0.f
+    };
+
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quad_vertices, 4, 3*sizeof(float), quad_indices, 0, nullptr, 2));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: one per triangle and one missing the quad
+    ray rays[3];
+
+    rays[0].o = float4(0.5f,-0.5f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(-0.5f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.x, 0.5f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.y, 0.25f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, 1);
+    ASSERT_NEAR(isect[1].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.x, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[1].uvwt.y, 0.5f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks shape IDs are resolved from face ranges for meshes sharing leaves
+TEST_F(ApiBackendOpenCL, Intersection_ShapeRanges)
+{
+    int const kNumMeshes = 8;
+    Shape* meshes[kNumMeshes] = {};
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.max_leaf_size", 4.f));
+
+    // Two triangles per mesh in a row along x, so leaves span several meshes
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        float const x = 2.f * i;
+        float const mesh_vertices[] = {
+            x,0.f,0.f,
+            x + 1.f,0.f,0.f,
+            x + 1.f,1.f,0.f,
+            x,1.f,0.f
+        };
+
+        int const mesh_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+        ASSERT_NO_THROW(meshes[i] = api_->CreateMesh(mesh_vertices, 4, 3*sizeof(float), mesh_indices, 0, nullptr, 2));
+        ASSERT_TRUE(meshes[i] != nullptr);
+        ASSERT_NO_THROW(api_->AttachShape(meshes[i]));
+    }
+
+    // One ray per triangle
+    ray rays[2 * kNumMeshes];
+
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        rays[2 * i].o = float4(2.f * i + 0.75f, 0.25f, -10.f, 1000.f);
+        rays[2 * i].d = float3(0.f,0.f,1.f);
+        rays[2 * i + 1].o = float4(2.f * i + 0.25f, 0.75f, -10.f, 1000.f);
+        rays[2 * i + 1].d = float3(0.f,0.f,1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(rays), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * kNumMeshes * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2 * kNumMeshes, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * kNumMeshes * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isect(tmp, tmp + 2 * kNumMeshes);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    for (int i = 0; i < 2 * kNumMeshes; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, meshes[i / 2]->GetId());
+        ASSERT_EQ(isect[i].primid, i % 2);
+        ASSERT_NEAR(isect[i].uvwt.w, 10.f, 0.001f);
+    }
+
+    // Bail out
+    for (int i = 0; i < kNumMeshes; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(meshes[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(meshes[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks SAH builder keeps several triangles in a leaf
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_MaxLeafSize)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.max_leaf_size", 4.f));
+
+    // Four triangles stacked along z axis
+    float stacked_vertices[4 * 9];
+    int stacked_indices[4 * 3];
+    int stacked_numfaceverts[4];
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 9; ++j)
+        {
+            stacked_vertices[i * 9 + j] = (j % 3 == 2) ? (float)i : vertices()[j];
+        }
+
+        for (int j = 0; j < 3; ++j)
+        {
+            stacked_indices[i * 3 + j] = i * 3 + j;
+        }
+
+        stacked_numfaceverts[i] = 3;
+    }
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(stacked_vertices, 12, 3*sizeof(float), stacked_indices, 0, stacked_numfaceverts, 4));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: hitting the stack from both sides
+    ray rays[2];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,-1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Splitting the stack is more expensive than intersecting all four triangles
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.num_leaves, 1);
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results: the closest triangle is reported for each ray
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, 3);
+    ASSERT_NEAR(isect[1].uvwt.w, 7.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks persistent threads kernels process every ray and can be launched repeatedly
+TEST_F(ApiBackendOpenCL, Intersection_ManyRays_PersistentThreads)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.persistent_threads", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: even ones are hitting the triangle, odd ones are missing it
+    int const kNumRays = 10000;
+    std::vector<ray> rays(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = (i & 1) ? float4(5.f,5.f,-10.f, 1000.f) : float4(0.f,0.f,-10.f, 1000.f);
+        rays[i].d = float3(0.f,0.f,1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays*sizeof(ray), &rays[0]);
+    auto isect_buffer = api_->CreateBuffer(kNumRays*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Second launch is only correct if the first one has reset ray batch counters
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr ));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::vector<Intersection> isect(tmp, tmp + kNumRays);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks hits of sorted rays are reported in the original ray order
+TEST_F(ApiBackendOpenCL, Intersection_ManyRays_SortedRays)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.sort_rays", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: even ones are hitting the triangle at different distances, odd ones are missing it
+    int const kNumRays = 1000;
+    std::vector<ray> rays(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float const z = -1.f - (float)(i % 10);
+        rays[i].o = (i & 1) ? float4(5.f,5.f,z, 1000.f) : float4(0.f,0.f,z, 1000.f);
+        rays[i].d = float3(0.f,0.f,1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays*sizeof(ray), &rays[0]);
+    auto isect_buffer = api_->CreateBuffer(kNumRays*sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(kNumRays*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr ));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occlu_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isect(tmp, tmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* otmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, kNumRays*sizeof(int), (void**)&otmp, &e_));
+    Wait();
+    std::vector<int> occlu(otmp, otmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, otmp, &e_));
+    Wait();
+
+    // Check results
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        if (i & 1)
+        {
+            ASSERT_EQ(isect[i].shapeid, kNullId);
+            ASSERT_EQ(occlu[i], kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(isect[i].uvwt.w, 1.f + (float)(i % 10), 0.001f);
+            ASSERT_NE(occlu[i], kNullId);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// The test checks packet traversal of coherent rays, last packet is partially filled
+TEST_F(ApiBackendOpenCL, Intersection_ManyRays_PacketTraversal)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.packet_traversal", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: even ones are hitting the triangle at different distances, odd ones are missing it
+    int const kNumRays = 100;
+    std::vector<ray> rays(kNumRays);
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        float const z = -1.f - (float)(i % 10);
+        rays[i].o = (i & 1) ? float4(5.f,5.f,z, 1000.f) : float4(0.f,0.f,z, 1000.f);
+        rays[i].d = float3(0.f,0.f,1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(kNumRays*sizeof(ray), &rays[0]);
+    auto isect_buffer = api_->CreateBuffer(kNumRays*sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(kNumRays*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, nullptr ));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumRays, occlu_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::vector<Intersection> isect(tmp, tmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* otmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, kNumRays*sizeof(int), (void**)&otmp, &e_));
+    Wait();
+    std::vector<int> occlu(otmp, otmp + kNumRays);
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, otmp, &e_));
+    Wait();
+
+    // Check results
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        if (i & 1)
+        {
+            ASSERT_EQ(isect[i].shapeid, kNullId);
+            ASSERT_EQ(occlu[i], kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(isect[i].uvwt.w, 1.f + (float)(i % 10), 0.001f);
+            ASSERT_NE(occlu[i], kNullId);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// Test is checking shadow ray traversal with children ordered by area, the last ray stops before the triangle
+TEST_F(ApiBackendOpenCL, Occlusion_3Rays_AreaOrder)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "fatbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.occlusion_area_order", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: one hitting the triangle, one missing it and one too short to reach it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(0.f,0.f,-10.f, 5.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_flag_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, isect_flag_buffer, nullptr, nullptr ));
+
+    int* flags = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, 3*sizeof(int), (void**)&flags, &e_));
+    Wait();
+    int isect_flag[3] = { flags[0], flags[1], flags[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, flags, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect_flag[0], 1);
+    ASSERT_EQ(isect_flag[1], -1);
+    ASSERT_EQ(isect_flag[2], -1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+}
+
+// Test is checking compact hit formats write only the requested data
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_CompactHits)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_format", "primid_t"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-5.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto hit_buffer = api_->CreateBuffer(3*2*sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect: primitive ID and distance per ray
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    int* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*2*sizeof(int), (void**)&tmp, &e_));
+    Wait();
+    int primid_t[6];
+    std::copy(tmp, tmp + 6, primid_t);
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    float t[2];
+    std::memcpy(&t[0], &primid_t[1], sizeof(float));
+    std::memcpy(&t[1], &primid_t[3], sizeof(float));
+
+    ASSERT_EQ(primid_t[0], 0);
+    ASSERT_NEAR(t[0], 10.f, 0.001f);
+    ASSERT_EQ(primid_t[2], 0);
+    ASSERT_NEAR(t[1], 5.f, 0.001f);
+    ASSERT_EQ(primid_t[4], kNullId);
+
+    // Switch to distance only
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_format", "t"));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    float* ftmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(float), (void**)&ftmp, &e_));
+    Wait();
+    float dist[3] = { ftmp[0], ftmp[1], ftmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, ftmp, &e_));
+    Wait();
+
+    ASSERT_NEAR(dist[0], 10.f, 0.001f);
+    ASSERT_NEAR(dist[1], 5.f, 0.001f);
+    ASSERT_EQ(dist[2], -1.f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+}
+
+// Test is checking bit-packed occlusion results match int results across word boundaries
+TEST_F(ApiBackendOpenCL, Intersection_OcclusionBits)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Every third ray misses the triangle, 40 rays span two words
+    int const numrays = 40;
+    std::vector<ray> rays(numrays);
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i].o = i % 3 == 2 ? float4(5.f, 5.f, -10.f, 1000.f) : float4(0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto bits_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+
+    char const* acctypes[] = { "bvh", "fatbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->SetOption("acc.occlusion_format", "bits"));
+        ASSERT_NO_THROW(api_->Commit());
+
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, bits_buffer, nullptr, nullptr));
+
+        int* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(bits_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&tmp, &e_));
+        Wait();
+        int bits[2] = { tmp[0], tmp[1] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(bits_buffer, tmp, &e_));
+        Wait();
+
+        // Host memory path packs the same words
+        int host_bits[2] = { 0, 0 };
+        ASSERT_NO_THROW(api_->QueryOcclusion(rays.data(), numrays, host_bits));
+
+        std::vector<int> unpacked(numrays);
+        UnpackOcclusion(bits, numrays, unpacked.data());
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ASSERT_EQ(IsOccluded(bits, i), i % 3 != 2);
+            ASSERT_EQ(IsOccluded(host_bits, i), i % 3 != 2);
+            ASSERT_EQ(unpacked[i], i % 3 != 2 ? 1 : -1);
+        }
+
+        // Words are not padded with results of rays past numrays
+        ASSERT_EQ(static_cast<unsigned>(bits[1]) >> 8, 0u);
+
+        ASSERT_NO_THROW(api_->SetOption("acc.occlusion_format", "int"));
+    }
+
+    // Packed words can't be scattered back to the original order
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("acc.occlusion_format", "bits"));
+    ASSERT_NO_THROW(api_->SetOption("acc.sort_rays", 1.f));
+    ASSERT_ANY_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->SetOption("acc.sort_rays", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.occlusion_format", "int"));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(bits_buffer));
+}
+
+// Test is checking hit callbacks replace query results with callback outputs
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_HitCallback)
+{
+    Shape* mesh = nullptr;
+
+    // Closest hits store the distance, misses and occlusion store markers
+    char const* callback =
+        "void rr_closest_hit(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void* output)\n"
+        "{ ((GLOBAL float*)output)[ray_idx] = t; }\n"
+        "void rr_closest_miss(int ray_idx, ray const* r, GLOBAL void* output)\n"
+        "{ ((GLOBAL float*)output)[ray_idx] = -2.f; }\n"
+        "void rr_any_hit(int ray_idx, ray const* r, GLOBAL void* output)\n"
+        "{ ((GLOBAL int*)output)[ray_idx] = 7; }\n"
+        "void rr_any_miss(int ray_idx, ray const* r, GLOBAL void* output)\n"
+        "{ ((GLOBAL int*)output)[ray_idx] = 3; }\n";
+
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_callback", callback));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-5.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto hit_buffer = api_->CreateBuffer(3*sizeof(float), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    float* ftmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(float), (void**)&ftmp, &e_));
+    Wait();
+    float dist[3] = { ftmp[0], ftmp[1], ftmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, ftmp, &e_));
+    Wait();
+
+    ASSERT_NEAR(dist[0], 10.f, 0.001f);
+    ASSERT_NEAR(dist[1], 5.f, 0.001f);
+    ASSERT_EQ(dist[2], -2.f);
+
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    int* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(int), (void**)&tmp, &e_));
+    Wait();
+    int occluded[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(occluded[0], 7);
+    ASSERT_EQ(occluded[1], 7);
+    ASSERT_EQ(occluded[2], 3);
+
+    // Callbacks can't be combined with ray sorting
+    ASSERT_NO_THROW(api_->SetOption("acc.sort_rays", 1.f));
+    ASSERT_ANY_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->SetOption("acc.sort_rays", 0.f));
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_callback", ""));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+}
+
+// Test is checking hits rejected by hit filter are skipped by both query types
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_HitFilter)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    // Filter drops hits of the shape which id is stored in filter data
+    char const* filter =
+        "bool rr_hit_filter(int ray_idx, ray const* r, int shape_id, int prim_id, float2 uv, float t, GLOBAL void const* data)\n"
+        "{ return shape_id != ((GLOBAL int const*)data)[0]; }\n";
+
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_filter", filter));
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh2));
+
+    Id cutout = mesh1->GetId();
+    auto filter_buffer = api_->CreateBuffer(sizeof(Id), &cutout);
+    ASSERT_NO_THROW(api_->SetHitFilterData(filter_buffer));
+
+    // Rays: one reaching the second mesh and one ending between the meshes
+    ray rays[2];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,-10.f, 11.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(2*sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 2, occlu_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* itmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, 2*sizeof(int), (void**)&itmp, &e_));
+    Wait();
+    int occluded[2] = { itmp[0], itmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, itmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh2->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 12.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_NE(occluded[0], kNullId);
+    ASSERT_EQ(occluded[1], kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetHitFilterData(nullptr));
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_filter", ""));
+    ASSERT_NO_THROW(api_->DetachShape(mesh1));
+    ASSERT_NO_THROW(api_->DetachShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(filter_buffer));
+}
+
+// Test is checking multi hit queries report hits along the ray sorted by distance
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_MultiHit)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    // Farther mesh goes first so traversal doesn't find hits in order
+    ASSERT_NO_THROW(api_->AttachShape(mesh2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryMultiHit(ray_buffer, 1, 3, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh2->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 12.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // A single hit matches closest hit query
+    ASSERT_NO_THROW(api_->QueryMultiHit(ray_buffer, 1, 1, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    isect[0] = tmp[0];
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+
+    ASSERT_ANY_THROW(api_->QueryMultiHit(ray_buffer, 1, 9, isect_buffer, nullptr, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh1));
+    ASSERT_NO_THROW(api_->DetachShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if mixed queries find closest hits and any hits of flagged rays in one launch
+TEST_F(ApiBackendOpenCL, Intersection_4Rays_Mixed)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+
+    // Closest hit, any hit, missing any hit and inactive ray
+    ray r[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        float offset = i == 2 ? 10.f : 0.f;
+        r[i].o = float4(offset, offset, -10.f, 1000.f);
+        r[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    r[1].SetAnyHit(true);
+    r[2].SetAnyHit(true);
+    r[3].SetActive(false);
+    ASSERT_TRUE(r[1].IsActive());
+    ASSERT_TRUE(r[1].IsAnyHit());
+    ASSERT_FALSE(r[0].IsAnyHit());
+
+    Intersection init[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        init[i].shapeid = 12345;
+    }
+
+    auto ray_buffer = api_->CreateBuffer(4*sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(4*sizeof(Intersection), init);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryMixed(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[4] = { tmp[0], tmp[1], tmp[2], tmp[3] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    // Any of the two meshes
+    ASSERT_TRUE(isect[1].shapeid == mesh1->GetId() || isect[1].shapeid == mesh2->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, isect[1].shapeid == mesh1->GetId() ? 10.f : 12.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+    ASSERT_EQ(isect[3].shapeid, 12345);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh1));
+    ASSERT_NO_THROW(api_->DetachShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking back face culling ray flag skips faces pointing away from the ray in both queries
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_CullBackFaces)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Face normal is +z: culled back face, culling ray hitting the front face and back face without culling
+    ray r[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        float z = i == 1 ? 10.f : -10.f;
+        r[i].o = float4(0.f, 0.f, z, 1000.f);
+        r[i].d = float3(0.f, 0.f, -z / 10.f);
+    }
+
+    r[0].SetFlags(ray::kFlagCullBackFaces);
+    r[1].SetFlags(ray::kFlagCullBackFaces | ray::kFlagAnyHit);
+    ASSERT_TRUE(r[0].IsActive());
+    ASSERT_TRUE(r[1].IsAnyHit());
+    ASSERT_EQ(r[2].GetFlags(), 0);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, occl_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    int* occl_tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 3*sizeof(int), (void**)&occl_tmp, &e_));
+    Wait();
+    int occluded[3] = { occl_tmp[0], occl_tmp[1], occl_tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl_tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, kNullId);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, mesh->GetId());
+    ASSERT_EQ(occluded[0], kNullId);
+    ASSERT_NE(occluded[1], kNullId);
+    ASSERT_NE(occluded[2], kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// Test is checking proximity queries find the closest point within sphere radius
+TEST_F(ApiBackendOpenCL, Proximity_3Spheres)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Spheres: one above the face, one too small to reach it and one closest to its edge
+    float4 spheres[3] = {
+        float4(0.f, 0.f, 1.5f, 2.f),
+        float4(0.f, 0.f, 1.5f, 1.f),
+        float4(0.f, -2.f, 0.f, 10.f)
+    };
+
+    auto sphere_buffer = api_->CreateBuffer(sizeof(spheres), spheres);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryProximity(sphere_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 1.5f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.x, 0.25f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.y, 0.5f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[2].uvwt.w, 1.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(sphere_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking profiled queries report GPU time of their traversal kernel
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Profiling)
+{
+    ASSERT_NO_THROW(api_->SetOption("acc.profiling", 1.f));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    KernelTiming timings[8];
+    int numtimings = 0;
+    ASSERT_NO_THROW(numtimings = api_->GetLastQueryTimings(timings, 8));
+
+    ASSERT_EQ(numtimings, 1);
+    ASSERT_STREQ(timings[0].name, "intersect");
+    ASSERT_GE(timings[0].time, 0.f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Trace callback collecting span names
+static void CollectTraceEvent(TraceEvent const& event, void* userdata)
+{
+    static_cast<std::vector<std::string>*>(userdata)->push_back(event.name);
+}
+
+// Test is checking commit and query spans are reported to the trace callback
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Trace)
+{
+    std::vector<std::string> names;
+    ASSERT_NO_THROW(IntersectionApi::SetTraceCallback(CollectTraceEvent, &names));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(IntersectionApi::SetTraceCallback(nullptr, nullptr));
+
+    ASSERT_TRUE(std::find(names.begin(), names.end(), "Commit") != names.end());
+    ASSERT_TRUE(std::find(names.begin(), names.end(), "Process") != names.end());
+    ASSERT_TRUE(std::find(names.begin(), names.end(), "QueryIntersection") != names.end());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking per ray traversal counters are recorded for a hit and a miss
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_TraversalStats)
+{
+    ASSERT_NO_THROW(api_->SetOption("acc.traversal_stats", 1.f));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray rays[2];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(5.f, 5.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+    auto stats_buffer = api_->CreateBuffer(2*sizeof(TraversalStats), nullptr);
+
+    ASSERT_NO_THROW(api_->SetTraversalStatsBuffer(stats_buffer));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    TraversalStats* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(stats_buffer, kMapRead, 0, 2*sizeof(TraversalStats), (void**)&tmp, &e_));
+    Wait();
+    TraversalStats stats[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(stats_buffer, tmp, &e_));
+    Wait();
+
+    // Single triangle tree is a single leaf
+    ASSERT_EQ(stats[0].nodes, 1);
+    ASSERT_EQ(stats[0].leaves, 1);
+    ASSERT_EQ(stats[0].prims, 1);
+    ASSERT_EQ(stats[0].spills, 0);
+    ASSERT_EQ(stats[1].nodes, 1);
+    ASSERT_EQ(stats[1].leaves, 0);
+    ASSERT_EQ(stats[1].prims, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetTraversalStatsBuffer(nullptr));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(stats_buffer));
+}
+
+// Test is checking hinted primitives don't change the closest hit whether the hints are right, stale or invalid
+TEST_F(ApiBackendOpenCL, Intersection_4Rays_HitHints)
+{
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hit_hints", 1.f));
+
+    // Near quad at z = 0 and far quad at z = 5
+    float const near_vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        1.f,1.f,0.f,
+        -1.f,1.f,0.f
+    };
+
+    float const far_vertices[] = {
+        -1.f,-1.f,5.f,
+        1.f,-1.f,5.f,
+        1.f,1.f,5.f,
+        -1.f,1.f,5.f
+    };
+
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    Shape* near_mesh = nullptr;
+    Shape* far_mesh = nullptr;
+    ASSERT_NO_THROW(near_mesh = api_->CreateMesh(near_vertices, 4, 3*sizeof(float), quad_indices, 0, nullptr, 2));
+    ASSERT_NO_THROW(far_mesh = api_->CreateMesh(far_vertices, 4, 3*sizeof(float), quad_indices, 0, nullptr, 2));
+    ASSERT_NO_THROW(api_->AttachShape(near_mesh));
+    ASSERT_NO_THROW(api_->AttachShape(far_mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // All rays hit the first triangle of both quads
+    ray rays[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        rays[i] = ray(float3(0.5f, -0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    // Stale hint of the far quad, right hint, primitive out of range and a miss
+    Intersection hints[4];
+    hints[0].shapeid = far_mesh->GetId();
+    hints[0].primid = 0;
+    hints[1].shapeid = near_mesh->GetId();
+    hints[1].primid = 0;
+    hints[2].shapeid = near_mesh->GetId();
+    hints[2].primid = 99;
+    hints[3].shapeid = kNullId;
+    hints[3].primid = kNullId;
+
+    auto ray_buffer = api_->CreateBuffer(4*sizeof(ray), rays);
+    auto hint_buffer = api_->CreateBuffer(4*sizeof(Intersection), hints);
+    auto isect_buffer = api_->CreateBuffer(4*sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->SetHitHints(hint_buffer));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[4] = { tmp[0], tmp[1], tmp[2], tmp[3] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, near_mesh->GetId());
+        ASSERT_EQ(isect[i].primid, 0);
+        ASSERT_NEAR(isect[i].uvwt.w, 10.f, 0.001f);
+    }
+
+    // Hints may be the output of the query they are used by
+    ASSERT_NO_THROW(api_->SetHitHints(isect_buffer));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    for (int i = 0; i < 4; ++i)
+    {
+        ASSERT_EQ(tmp[i].shapeid, near_mesh->GetId());
+        ASSERT_EQ(tmp[i].primid, 0);
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetHitHints(nullptr));
+    ASSERT_NO_THROW(api_->DetachShape(near_mesh));
+    ASSERT_NO_THROW(api_->DetachShape(far_mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(near_mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(far_mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hint_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking compact ray formats are decoded to the same hits as full rays
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_CompactRays)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.ray_format", "compact"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray_compact rays[3];
+    rays[0] = ray_compact(float3(0.f,0.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+    rays[1] = ray_compact(float3(0.f,0.5f,-5.f), float3(0.f,0.f,1.f), 1000.f);
+    rays[2] = ray_compact(float3(5.f,5.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray_compact), rays);
+    auto hit_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].primid, 0);
+    ASSERT_NEAR(isect[1].uvwt.w, 5.f, 0.001f);
+    ASSERT_EQ(isect[2].primid, kNullId);
+
+    // Same rays with octahedral encoded directions
+    ray_oct oct_rays[3];
+    oct_rays[0] = ray_oct(float3(0.f,0.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+    oct_rays[1] = ray_oct(float3(0.f,0.5f,-5.f), float3(0.f,0.f,1.f), 1000.f);
+    oct_rays[2] = ray_oct(float3(5.f,5.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+
+    auto oct_buffer = api_->CreateBuffer(3*sizeof(ray_oct), oct_rays);
+
+    ASSERT_NO_THROW(api_->SetOption("acc.ray_format", "oct"));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(oct_buffer, 3, hit_buffer, nullptr, nullptr ));
+
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection oct_isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(oct_isect[0].primid, 0);
+    ASSERT_NEAR(oct_isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(oct_isect[1].primid, 0);
+    ASSERT_NEAR(oct_isect[1].uvwt.w, 5.f, 0.001f);
+    ASSERT_EQ(oct_isect[2].primid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(oct_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+}
+
+// Test is checking rays read from planes and hits written to planes by "soa" formats
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_SoaLayouts)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.ray_format", "soa"));
+    ASSERT_NO_THROW(api_->SetOption("acc.hit_format", "soa"));
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it, transposed into a plane per 4 byte word
+    ray rays[3];
+    rays[0] = ray(float3(0.f,0.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+    rays[1] = ray(float3(0.f,0.5f,-5.f), float3(0.f,0.f,1.f), 1000.f);
+    rays[2] = ray(float3(5.f,5.f,-10.f), float3(0.f,0.f,1.f), 1000.f);
+
+    int const numwords = sizeof(ray) / sizeof(int);
+    std::vector<int> ray_planes(3 * numwords);
+    for (int i = 0; i < 3; ++i)
+    {
+        int words[sizeof(ray) / sizeof(int)];
+        std::memcpy(words, &rays[i], sizeof(ray));
+
+        for (int k = 0; k < numwords; ++k)
+        {
+            ray_planes[k * 3 + i] = words[k];
+        }
+    }
+
+    auto ray_buffer = api_->CreateBuffer(ray_planes.size() * sizeof(int), &ray_planes[0]);
+    auto hit_buffer = api_->CreateBuffer(3 * 5 * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr));
+
+    int* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3 * 5 * sizeof(int), (void**)&tmp, &e_));
+    Wait();
+    int hit_planes[15];
+    std::copy(tmp, tmp + 15, hit_planes);
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    // Planes: shape IDs, primitive IDs, u, v and distances
+    float t[2];
+    std::memcpy(t, &hit_planes[12], 2 * sizeof(float));
+
+    ASSERT_EQ(hit_planes[0], mesh->GetId());
+    ASSERT_EQ(hit_planes[1], mesh->GetId());
+    ASSERT_EQ(hit_planes[2], kNullId);
+    ASSERT_EQ(hit_planes[3], 0);
+    ASSERT_EQ(hit_planes[4], 0);
+    ASSERT_EQ(hit_planes[5], kNullId);
+    ASSERT_NEAR(t[0], 10.f, 0.001f);
+    ASSERT_NEAR(t[1], 5.f, 0.001f);
+
+    // Host memory queries would split the planes into chunks
+    Intersection isect[3];
+    ASSERT_ANY_THROW(api_->QueryIntersection(rays, 3, isect));
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+}
+
+// Test is checking a batch of queries gives the same results as separate queries
+TEST_F(ApiBackendOpenCL, Intersection_BatchQueries)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-5.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto hit_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto occlusion_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+    auto single_hit_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Closest hits of all rays, occlusion of all rays and closest hit of the first ray only
+    QueryDesc queries[3];
+    queries[0].type = kQueryIntersection;
+    queries[0].rays = ray_buffer;
+    queries[0].numrays = 3;
+    queries[0].hits = hit_buffer;
+
+    queries[1].type = kQueryOcclusion;
+    queries[1].rays = ray_buffer;
+    queries[1].numrays = 3;
+    queries[1].hits = occlusion_buffer;
+
+    queries[2].type = kQueryIntersection;
+    queries[2].rays = ray_buffer;
+    queries[2].numrays = 1;
+    queries[2].hits = single_hit_buffer;
+
+    ASSERT_NO_THROW(api_->QueryBatch(queries, 3, nullptr, &e_));
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, 3*sizeof(int), (void**)&occluded, &e_));
+    Wait();
+    int occl[3] = { occluded[0], occluded[1], occluded[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->MapBuffer(single_hit_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection single = tmp[0];
+    ASSERT_NO_THROW(api_->UnmapBuffer(single_hit_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].primid, 0);
+    ASSERT_NEAR(isect[1].uvwt.w, 5.f, 0.001f);
+    ASSERT_EQ(isect[2].primid, kNullId);
+
+    ASSERT_NE(occl[0], kNullId);
+    ASSERT_NE(occl[1], kNullId);
+    ASSERT_EQ(occl[2], kNullId);
+
+    ASSERT_EQ(single.primid, 0);
+    ASSERT_NEAR(single.uvwt.w, 10.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(single_hit_buffer));
+}
+
+// Test is checking a recorded query graph picks up new ray contents and scene commits on every replay
+TEST_F(ApiBackendOpenCL, Intersection_QueryGraph)
+{
+    Shape* mesh = nullptr;
+    Shape* near_mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(near_mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0, 0, -5));
+    ASSERT_NO_THROW(near_mesh->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // A ray hitting the triangle and one missing it
+    ray rays[2];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto hit_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+    auto occlusion_buffer = api_->CreateBuffer(2*sizeof(int), nullptr);
+
+    QueryDesc queries[2];
+    queries[0].type = kQueryIntersection;
+    queries[0].rays = ray_buffer;
+    queries[0].numrays = 2;
+    queries[0].hits = hit_buffer;
+
+    queries[1].type = kQueryOcclusion;
+    queries[1].rays = ray_buffer;
+    queries[1].numrays = 2;
+    queries[1].hits = occlusion_buffer;
+
+    QueryGraph* graph = nullptr;
+    ASSERT_NO_THROW(graph = api_->CreateQueryGraph(queries, 2));
+    ASSERT_TRUE(graph != nullptr);
+
+    // Replay the graph and read back the results
+    Intersection isect[2];
+    int occl[2];
+    auto replay = [&]()
+    {
+        api_->ExecuteQueryGraph(graph, nullptr, &e_);
+        Wait();
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(hit_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        std::copy(tmp, tmp + 2, isect);
+        api_->UnmapBuffer(hit_buffer, tmp, &e_);
+        Wait();
+
+        int* occluded = nullptr;
+        api_->MapBuffer(occlusion_buffer, kMapRead, 0, 2*sizeof(int), (void**)&occluded, &e_);
+        Wait();
+        std::copy(occluded, occluded + 2, occl);
+        api_->UnmapBuffer(occlusion_buffer, occluded, &e_);
+        Wait();
+    };
+
+    ASSERT_NO_THROW(replay());
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].primid, kNullId);
+    ASSERT_NE(occl[0], kNullId);
+    ASSERT_EQ(occl[1], kNullId);
+
+    // Move the second ray onto the triangle
+    ray* mapped = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, 2*sizeof(ray), (void**)&mapped, &e_));
+    Wait();
+    mapped[1].o = float4(0.f,0.5f,-5.f, 1000.f);
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, mapped, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(replay());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 5.f, 0.001f);
+    ASSERT_NE(occl[1], kNullId);
+
+    // Graphs trace the latest committed scene
+    ASSERT_NO_THROW(api_->AttachShape(near_mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(replay());
+    ASSERT_EQ(isect[0].shapeid, near_mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 5.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteQueryGraph(graph));
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(near_mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+}
+
+// Test is checking queries run as usual after Prepare and that invalid workloads are rejected
+TEST_F(ApiBackendOpenCL, Intersection_Prepare)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    QueryType types[] = { kQueryIntersection, kQueryOcclusion };
+
+    ASSERT_ANY_THROW(api_->Prepare(0, types, 2));
+    ASSERT_ANY_THROW(api_->Prepare(1024, nullptr, 2));
+    ASSERT_NO_THROW(api_->Prepare(1024, types, 2));
+
+    ray r[2];
+    r[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    r[1] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, -1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+    auto occlusion_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 2, occlusion_buffer, nullptr, nullptr));
+
+    Intersection* hits = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&hits, &e_));
+    Wait();
+
+    ASSERT_EQ(hits[0].shapeid, mesh->GetId());
+    ASSERT_EQ(hits[1].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, hits, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&occluded, &e_));
+    Wait();
+
+    ASSERT_NE(occluded[0], kNullId);
+    ASSERT_EQ(occluded[1], kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+}
+
+// Test is checking queries and transfers on the last device queue
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_Queues)
+{
+    Shape* mesh = nullptr;
+
+    int num_queues = 0;
+    ASSERT_NO_THROW(num_queues = api_->GetQueueCount());
+    ASSERT_GE(num_queues, 1);
+
+    int const queue = num_queues - 1;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-5.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto hit_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Out of range queues are rejected
+    ASSERT_ANY_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, nullptr, num_queues));
+
+    // Intersect and read back on the same queue
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, hit_buffer, nullptr, &e_, queue));
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hit_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_, queue));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffer, tmp, &e_, queue));
+    Wait();
+
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].primid, 0);
+    ASSERT_NEAR(isect[1].uvwt.w, 5.f, 0.001f);
+    ASSERT_EQ(isect[2].primid, kNullId);
+
+    // Occlusion on the default queue after the query on the other one
+    auto occlusion_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, occlusion_buffer, nullptr, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlusion_buffer, kMapRead, 0, 3*sizeof(int), (void**)&occluded, &e_));
+    Wait();
+    int occl[3] = { occluded[0], occluded[1], occluded[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlusion_buffer, occluded, &e_));
+    Wait();
+
+    ASSERT_NE(occl[0], kNullId);
+    ASSERT_NE(occl[1], kNullId);
+    ASSERT_EQ(occl[2], kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+}
+
+// Test is checking a caller owned event is signaled by several queries
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_ReusableEvent)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    Event* event = nullptr;
+    ASSERT_NO_THROW(event = api_->CreateReusableEvent());
+    ASSERT_TRUE(event != nullptr);
+    ASSERT_TRUE(event->Complete());
+
+    for (int i = 0; i < 3; ++i)
+    {
+        // The same event is signaled every time
+        Event* e = event;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &e));
+        ASSERT_EQ(e, event);
+        ASSERT_NO_THROW(e->Wait());
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e));
+        ASSERT_EQ(e, event);
+        ASSERT_NO_THROW(e->Wait());
+        Intersection isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e));
+        ASSERT_NO_THROW(e->Wait());
+
+        ASSERT_EQ(isect.primid, 0);
+        ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+    }
+
+    ASSERT_NO_THROW(api_->DeleteEvent(event));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Fulfills the promise passed as callback data
+static void SignalPromise(Event* event, void* data)
+{
+    static_cast<std::promise<Event*>*>(data)->set_value(event);
+}
+
+// Test is checking completion callbacks are called once a query has completed
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CompletionCallback)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+
+    Event* event = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &event));
+
+    std::promise<Event*> completed;
+    auto signaled = completed.get_future();
+    ASSERT_NO_THROW(event->SetCompletionCallback(SignalPromise, &completed));
+
+    ASSERT_EQ(signaled.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    ASSERT_EQ(signaled.get(), event);
+    ASSERT_TRUE(event->Complete());
+
+    // Callbacks of completed events are called right away
+    std::promise<Event*> again;
+    ASSERT_NO_THROW(event->SetCompletionCallback(SignalPromise, &again));
+    ASSERT_EQ(again.get_future().wait_for(std::chrono::seconds(0)), std::future_status::ready);
+
+    ASSERT_NO_THROW(api_->DeleteEvent(event));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking WaitAny returns a completed one of several queries
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_WaitAny)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto occlusion_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+
+    Event* events[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, &events[0]));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, occlusion_buffer, nullptr, &events[1]));
+
+    int index = -1;
+    ASSERT_NO_THROW(index = api_->WaitAny(events, 2));
+    ASSERT_GE(index, 0);
+    ASSERT_LT(index, 2);
+    ASSERT_TRUE(events[index]->Complete());
+
+    ASSERT_NO_THROW(events[1 - index]->Wait());
+    ASSERT_NO_THROW(api_->DeleteEvent(events[0]));
+    ASSERT_NO_THROW(api_->DeleteEvent(events[1]));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlusion_buffer));
+}
+
+// Test is checking if hits copied on the device match the ones of the query
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CopyBuffer)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto copy_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    // Copy the hit into the second element
+    ASSERT_NO_THROW(api_->CopyBuffer(isect_buffer, copy_buffer, 0, sizeof(Intersection), sizeof(Intersection), &e_));
+    Wait();
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(copy_buffer, kMapRead, sizeof(Intersection), sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(copy_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.primid, 0);
+
+    // Overlapping regions are rejected
+    ASSERT_THROW(api_->CopyBuffer(copy_buffer, copy_buffer, 0, 4, sizeof(Intersection), nullptr), Exception);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(copy_buffer));
+}
+
+// Test is checking if rays sharded across two GPU devices come back in order
+TEST_F(ApiBackendOpenCL, Intersection_MultiDevice)
+{
+    std::uint32_t const devices[] = { nativeidx_, nativeidx_ };
+
+    IntersectionApi* multi = nullptr;
+    ASSERT_NO_THROW(multi = IntersectionApi::CreateHybrid(devices, 2));
+    ASSERT_TRUE(multi != nullptr);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = multi->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(multi->AttachShape(mesh));
+    ASSERT_NO_THROW(multi->Commit());
+
+    // Enough rays for device parts to be pipelined, every other one misses
+    int const kNumRays = 100000;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = multi->CreateBuffer(kNumRays * sizeof(ray), &rays[0]);
+    auto isect_buffer = multi->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    Event* e = nullptr;
+    ASSERT_NO_THROW(multi->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e));
+    e->Wait();
+    multi->DeleteEvent(e);
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(multi->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, nullptr));
+
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, (i & 1) ? kNullId : mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(multi->UnmapBuffer(isect_buffer, isect, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(multi->DetachShape(mesh));
+    ASSERT_NO_THROW(multi->DeleteShape(mesh));
+    ASSERT_NO_THROW(multi->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(multi->DeleteBuffer(isect_buffer));
+    IntersectionApi::Delete(multi);
+}
+
+// Test is checking if nearest hits of a scene split between two GPU devices are merged
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_MultiDevicePartitioned)
+{
+    std::uint32_t const devices[] = { nativeidx_, nativeidx_ };
+
+    IntersectionApi* multi = nullptr;
+    ASSERT_NO_THROW(multi = IntersectionApi::CreateHybrid(devices, 2));
+    ASSERT_TRUE(multi != nullptr);
+
+    ASSERT_NO_THROW(multi->SetOption("hybrid.partition", "spatial"));
+
+    // Meshes apart along z end up on different devices
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+    ASSERT_NO_THROW(mesh1 = multi->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = multi->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(multi->AttachShape(mesh1));
+    ASSERT_NO_THROW(multi->AttachShape(mesh2));
+    ASSERT_NO_THROW(multi->Commit());
+
+    // Rays: one hitting both meshes from each side and one missing them
+    ray rays[3];
+
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(0.f, 0.f, 10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, -1.f);
+
+    rays[2].o = float4(5.f, 0.f, -10.f, 1000.f);
+    rays[2].d = float3(0.f, 0.f, 1.f);
+
+    Intersection isect[3];
+    ASSERT_NO_THROW(multi->QueryIntersection(rays, 3, isect));
+
+    ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh2->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 8.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    int occluded[3];
+    ASSERT_NO_THROW(multi->QueryOcclusion(rays, 3, occluded));
+
+    ASSERT_NE(occluded[0], kNullId);
+    ASSERT_EQ(occluded[1], 1);
+    ASSERT_EQ(occluded[2], -1);
+
+    // Bail out
+    ASSERT_NO_THROW(multi->DetachShape(mesh1));
+    ASSERT_NO_THROW(multi->DetachShape(mesh2));
+    ASSERT_NO_THROW(multi->DeleteShape(mesh1));
+    ASSERT_NO_THROW(multi->DeleteShape(mesh2));
+    IntersectionApi::Delete(multi);
+}
+
+// Test is checking if hits found in different geometry pages are merged
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_Paged)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    // Tiny pages put each mesh into its own one, so queries are streaming them
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "paged"));
+    ASSERT_NO_THROW(api_->SetOption("acc.page_size", 0.000001f));
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh2));
+
+    // Rays: one hitting both meshes from each side and one missing them
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,-1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+    auto isect_flag_buffer = api_->CreateBuffer(3*sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Consecutive queries trace pages in different order
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, isect_flag_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        int* flags = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_flag_buffer, kMapRead, 0, 3*sizeof(int), (void**)&flags, &e_));
+        Wait();
+        int isect_flag[3] = { flags[0], flags[1], flags[2] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_flag_buffer, flags, &e_));
+        Wait();
+
+        // Check results
+        ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+        ASSERT_EQ(isect[1].shapeid, mesh2->GetId());
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+        ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+        ASSERT_NEAR(isect[1].uvwt.w, 8.f, 0.001f);
+        ASSERT_EQ(isect_flag[0], 1);
+        ASSERT_EQ(isect_flag[1], 1);
+        ASSERT_EQ(isect_flag[2], -1);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh1));
+    ASSERT_NO_THROW(api_->DetachShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_flag_buffer));
+}
+
+// Test is checking if buffers reused across commits and frames hold new data
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_BufferPool)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    // Every frame swaps the mesh, rebuilds BVH and recreates ray and hit buffers
+    for (int i = 0; i < 4; ++i)
+    {
+        Shape* mesh = (i & 1) ? mesh2 : mesh1;
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        ASSERT_NO_THROW(api_->Commit());
+
+        ray r;
+        r.o = float4(0.f, 0.f, (i & 1) ? 10.f : -10.f, 1000.f);
+        r.d = float3(0.f, 0.f, (i & 1) ? -1.f : 1.f);
+
+        auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+        auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect = *tmp;
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        ASSERT_EQ(isect.shapeid, mesh->GetId());
+        ASSERT_NEAR(isect.uvwt.w, (i & 1) ? 8.f : 10.f, 0.001f);
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+        ASSERT_NO_THROW(api_->DetachShape(mesh));
+
+        // Second half runs without reuse
+        if (i == 1)
+        {
+            ASSERT_NO_THROW(api_->SetOption("acc.buffer_pool_size", 0.f));
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+}
+
+// Test is checking if host memory queries are traced in several chunks
+TEST_F(ApiBackendOpenCL, Intersection_5Rays_HostMemory)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Two rays per chunk, so the last chunk is a partial one
+    ASSERT_NO_THROW(api_->SetOption("acc.host_chunk_size", 2.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Even rays hit the triangle, odd ones miss it
+    ray r[5];
+    for (int i = 0; i < 5; ++i)
+    {
+        float offset = (i & 1) ? 10.f : 0.f;
+        r[i].o = float4(offset, offset, -10.f, 1000.f);
+        r[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    Intersection isect[5];
+    int occluded[5];
+
+    ASSERT_NO_THROW(api_->QueryIntersection(r, 5, isect));
+    ASSERT_NO_THROW(api_->QueryOcclusion(r, 5, occluded));
+
+    for (int i = 0; i < 5; ++i)
+    {
+        if (i & 1)
+        {
+            ASSERT_EQ(isect[i].shapeid, kNullId);
+            ASSERT_EQ(occluded[i], kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(isect[i].uvwt.w, 10.f, 0.001f);
+            ASSERT_NE(occluded[i], kNullId);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Test is checking if small host memory queries traced on the host copy of the scene match device ones
+TEST_F(ApiBackendOpenCL, Intersection_5Rays_HostQueryThreshold)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Batches of up to 4 rays skip the device
+    ASSERT_NO_THROW(api_->SetOption("acc.host_query_threshold", 4.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Even rays hit the triangle, odd ones miss it
+    ray r[5];
+    for (int i = 0; i < 5; ++i)
+    {
+        float offset = (i & 1) ? 10.f : 0.f;
+        r[i].o = float4(offset, offset, -10.f, 1000.f);
+        r[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    Intersection host_isect[5];
+    Intersection device_isect[5];
+    int host_occluded[5];
+    int device_occluded[5];
+
+    for (int i = 0; i < 5; i += 4)
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(r + i, std::min(4, 5 - i), host_isect + i));
+        ASSERT_NO_THROW(api_->QueryOcclusion(r + i, std::min(4, 5 - i), host_occluded + i));
+    }
+
+    ASSERT_NO_THROW(api_->QueryIntersection(r, 5, device_isect));
+    ASSERT_NO_THROW(api_->QueryOcclusion(r, 5, device_occluded));
+
+    for (int i = 0; i < 5; ++i)
+    {
+        ASSERT_EQ(host_isect[i].shapeid, device_isect[i].shapeid);
+        ASSERT_EQ(host_isect[i].primid, device_isect[i].primid);
+        ASSERT_EQ(host_occluded[i] != kNullId, device_occluded[i] != kNullId);
+
+        if (i & 1)
+        {
+            ASSERT_EQ(host_isect[i].shapeid, kNullId);
+        }
+        else
+        {
+            ASSERT_EQ(host_isect[i].shapeid, mesh->GetId());
+            ASSERT_NEAR(host_isect[i].uvwt.w, device_isect[i].uvwt.w, 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Test is checking if mesh views read strided caller memory on commit
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_MeshView)
+{
+    // Positions interleaved with an unused attribute
+    float vertices[] = {
+        -1.f,-1.f,0.f, 5.f,
+        1.f,-1.f,0.f, 5.f,
+        0.f,1.f,0.f, 5.f,
+    };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMeshView(vertices, 3, 4*sizeof(float), indices(), 0, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray r;
+    r.o = float4(0.f, 0.f, -10.f, 1000.f);
+    r.d = float3(0.f, 0.f, 1.f);
+
+    Intersection isect;
+    ASSERT_NO_THROW(api_->QueryIntersection(&r, 1, &isect));
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+
+    // Edit the memory in place and let the mesh know
+    for (int i = 0; i < 3; ++i)
+    {
+        vertices[4 * i + 2] = 2.f;
+    }
+
+    ASSERT_NO_THROW(mesh->UpdateVertices(vertices, 3, 4*sizeof(float)));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(&r, 1, &isect));
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks linear BVH builder emits a leaf per triangle and finds closest hits
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_LinearBvh)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "lbvh"));
+
+    // Four triangles stacked along z axis
+    float stacked_vertices[4 * 9];
+    int stacked_indices[4 * 3];
+    int stacked_numfaceverts[4];
+
+    for (int i = 0; i < 4; ++i)
+    {
+        for (int j = 0; j < 9; ++j)
+        {
+            stacked_vertices[i * 9 + j] = (j % 3 == 2) ? (float)i : vertices()[j];
+        }
+
+        for (int j = 0; j < 3; ++j)
+        {
+            stacked_indices[i * 3 + j] = i * 3 + j;
+        }
+
+        stacked_numfaceverts[i] = 3;
+    }
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(stacked_vertices, 12, 3*sizeof(float), stacked_indices, 0, stacked_numfaceverts, 4));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: hitting the stack from both sides
+    ray rays[2];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,-1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.num_leaves, 4);
+    ASSERT_EQ(stats.num_nodes, 7);
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results: the closest triangle is reported for each ray
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, 3);
+    ASSERT_NEAR(isect[1].uvwt.w, 7.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks HLBVH with restructured treelets still finds closest hits
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_HlbvhTreelets)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "hlbvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.hlbvh.treelets", 1.f));
+
+    // Sixteen triangles stacked along z axis, enough for several treelets
+    float stacked_vertices[16 * 9];
+    int stacked_indices[16 * 3];
+    int stacked_numfaceverts[16];
+
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int j = 0; j < 9; ++j)
+        {
+            stacked_vertices[i * 9 + j] = (j % 3 == 2) ? (float)i : vertices()[j];
+        }
+
+        for (int j = 0; j < 3; ++j)
+        {
+            stacked_indices[i * 3 + j] = i * 3 + j;
+        }
+
+        stacked_numfaceverts[i] = 3;
+    }
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(stacked_vertices, 48, 3*sizeof(float), stacked_indices, 0, stacked_numfaceverts, 16));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: hitting the stack from both sides
+    ray rays[2];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.f,30.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,-1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results: the closest triangle is reported for each ray
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].primid, 15);
+    ASSERT_NEAR(isect[1].uvwt.w, 15.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking acceleration structure switches between commits reusing created intersectors
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_AccTypeSwitch)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: two hitting the triangle and one missing it
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(5.f,5.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    // Back to the first type takes the cached intersector
+    char const* acctypes[] = { "bvh", "qbvh", "fatbvh", "bvh", "qbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+
+        // Commit geometry update
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Intersect
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        // Check results
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking 2-level kernel variants specialized for full shape masks and identity transforms
+TEST_F(ApiBackendOpenCL, Intersection_2Level_Specialized)
+{
+    Shape* mesh = nullptr;
+
+    api_->SetOption("bvh.force2level", 1.f);
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Upload ray mask, commit and return closest hit shape
+    auto query = [&](int ray_mask)
+    {
+        r.SetMask(ray_mask);
+
+        ray* rr = nullptr;
+        api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_);
+        Wait();
+        *rr = r;
+        api_->UnmapBuffer(ray_buffer, rr, &e_);
+        Wait();
+
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect.shapeid;
+    };
+
+    // Full shape masks: rays with empty masks are culled before traversal
+    ASSERT_EQ(query(0xFFFFFFFF), mesh->GetId());
+    ASSERT_EQ(query(0x0), kNullId);
+
+    // Non-identity transform moving the mesh away from the ray
+    matrix m = translation(float3(0, 2, 0));
+    ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+    ASSERT_EQ(query(0xFFFFFFFF), kNullId);
+
+    // Back to identity with per shape mask tests
+    ASSERT_NO_THROW(mesh->SetTransform(matrix(), matrix()));
+    ASSERT_NO_THROW(mesh->SetMask(0xFF000000));
+    ASSERT_EQ(query(0x000000FF), kNullId);
+    ASSERT_EQ(query(0xFF000000), mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking hits near an edge of a rotated instance far from the world origin,
+// the rays pass 0.03 inside and outside the edge in object space
+TEST_F(ApiBackendOpenCL, Intersection_2Level_FarOrigin)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(1e6f, 1e6f, 0.f)) * rotation_z(PI / 4);
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Origins are exact floats, the triangle is symmetric so the rotation sense doesn't matter
+    ray r[] =
+    {
+        ray(float3(1e6f, 1e6f + 0.4375f, -10.f), float3(0.f, 0.f, 1.f), 10000.f),
+        ray(float3(1e6f, 1e6f + 0.5f, -10.f), float3(0.f, 0.f, 1.f), 10000.f)
+    };
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(r), r);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(tmp[0].shapeid, instance->GetId());
+    ASSERT_EQ(tmp[1].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if instances masked out at the top level are skipped
+TEST_F(ApiBackendOpenCL, Intersection_2Level_NodeMasks)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    // Instance is behind the mesh and visible to other rays
+    matrix m = translation(float3(0, 0, 2));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(mesh->SetMask(0x1));
+    ASSERT_NO_THROW(instance->SetMask(0x2));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Upload ray mask, commit and return closest hit
+    auto query = [&](int ray_mask)
+    {
+        r.SetMask(ray_mask);
+
+        ray* rr = nullptr;
+        api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_);
+        Wait();
+        *rr = r;
+        api_->UnmapBuffer(ray_buffer, rr, &e_);
+        Wait();
+
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    Intersection isect = query(0x3);
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+
+    isect = query(0x2);
+    ASSERT_EQ(isect.shapeid, instance->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+
+    ASSERT_EQ(query(0x4).shapeid, kNullId);
+
+    // Mask changes are picked up by top level nodes
+    ASSERT_NO_THROW(instance->SetMask(0x4));
+    ASSERT_EQ(query(0x2).shapeid, kNullId);
+    ASSERT_EQ(query(0x4).shapeid, instance->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if detaching shapes out of attachment order keeps the 2 level layout valid
+TEST_F(ApiBackendOpenCL, Intersection_2Level_DetachOrder)
+{
+    Shape* near_mesh = nullptr;
+    Shape* far_mesh = nullptr;
+    Shape* instance = nullptr;
+
+    ASSERT_NO_THROW(near_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(far_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(near_mesh));
+
+    // Instance is in front of the meshes, the far mesh behind the near one
+    matrix m = translation(float3(0, 0, -2));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    m = translation(float3(0, 0, 2));
+    ASSERT_NO_THROW(far_mesh->SetTransform(m, inverse(m)));
+
+    // Instance goes first so detaching it moves the last mesh
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->AttachShape(near_mesh));
+    ASSERT_NO_THROW(api_->AttachShape(far_mesh));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit and return closest hit
+    auto query = [&]()
+    {
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    Intersection isect = query();
+    ASSERT_EQ(isect.shapeid, instance->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 8.f, 0.001f);
+
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    isect = query();
+    ASSERT_EQ(isect.shapeid, near_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+
+    // Base mesh is still referenced after being detached
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(near_mesh));
+    isect = query();
+    ASSERT_EQ(isect.shapeid, instance->GetId());
+
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    isect = query();
+    ASSERT_EQ(isect.shapeid, far_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(near_mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(far_mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if duplicate meshes are turned into instances keeping their own IDs and transforms
+TEST_F(ApiBackendOpenCL, Intersection_2Level_DedupMeshes)
+{
+    Shape* near_mesh = nullptr;
+    Shape* far_mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.dedup_meshes", 1.f));
+
+    ASSERT_NO_THROW(near_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(far_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0, 0, 2));
+    ASSERT_NO_THROW(far_mesh->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(near_mesh));
+    ASSERT_NO_THROW(api_->AttachShape(far_mesh));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit and return closest hit
+    auto query = [&]()
+    {
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    Intersection isect = query();
+    ASSERT_EQ(isect.shapeid, near_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+
+    // Only one copy of the geometry is uploaded
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.vertices_bytes, 3 * sizeof(float3));
+
+    // Representative goes away, the duplicate takes its place
+    ASSERT_NO_THROW(api_->DetachShape(near_mesh));
+    isect = query();
+    ASSERT_EQ(isect.shapeid, far_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+    ASSERT_EQ(isect.primid, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(near_mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(far_mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if meshes with the same geometry share bottom level BVHs correctly
+TEST_F(ApiBackendOpenCL, Intersection_2Level_SharedLibrary)
+{
+    Shape* mesh1 = nullptr;
+    Shape* mesh2 = nullptr;
+
+    api_->SetOption("bvh.force2level", 1.f);
+    api_->SetOption("bvh.shared_library", 1.f);
+
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh2 = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Second mesh is moved to the right
+    matrix m = translation(float3(4, 0, 0));
+    ASSERT_NO_THROW(mesh2->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh2));
+
+    ray rays[2];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(4.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh1->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh2->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh1));
+    ASSERT_NO_THROW(api_->DetachShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh2));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if curve segments are intersected natively
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_Curves)
+{
+    Shape* curves = nullptr;
+
+    // Straight segment along x axis with 0.1 radius
+    float const controlpoints[] = {
+        -1.f, 0.f, 0.f, 0.1f,
+        -0.33f, 0.f, 0.f, 0.1f,
+        0.33f, 0.f, 0.f, 0.1f,
+        1.f, 0.f, 0.f, 0.1f
+    };
+    int const segments[] = { 0, 1, 2, 3 };
+
+    ASSERT_NO_THROW(curves = api_->CreateCurves(controlpoints, 4, 4 * sizeof(float), segments, 1));
+    ASSERT_TRUE(curves != nullptr);
+
+    ASSERT_NO_THROW(api_->AttachShape(curves));
+
+    // Rays: hitting the middle, missing above it and hitting closer to the end
+    ray rays[3];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(0.f, 0.2f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[2] = ray(float3(0.5f, 0.05f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, curves->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[0].uvwt.x, 0.5f, 0.01f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, curves->GetId());
+    ASSERT_NEAR(isect[2].uvwt.x, 0.75f, 0.02f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(curves));
+    ASSERT_NO_THROW(api_->DeleteShape(curves));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if spheres, disks and custom primitives are intersected natively
+TEST_F(ApiBackendOpenCL, Intersection_4Rays_Procedurals)
+{
+    Shape* spheres = nullptr;
+    Shape* disks = nullptr;
+    Shape* boxes = nullptr;
+
+    float const spheredata[] = {
+        0.f, 0.f, 0.f, 1.f,
+        5.f, 0.f, 0.f, 0.5f
+    };
+    // Disk facing the rays
+    float const diskdata[] = { 0.f, 5.f, 0.f, 1.f, 0.f, 0.f, 2.f };
+    // Custom primitive is a box intersected by its slabs
+    float const boxdata[] = { -6.f, -1.f, -1.f, -4.f, 1.f, 1.f };
+
+    ASSERT_NO_THROW(spheres = api_->CreateSpheres(spheredata, 2, 0));
+    ASSERT_NO_THROW(disks = api_->CreateDisks(diskdata, 1, 0));
+    ASSERT_NO_THROW(boxes = api_->CreateCustomPrimitives(boxdata, 1, 0));
+
+    ASSERT_NO_THROW(api_->AttachShape(spheres));
+    ASSERT_NO_THROW(api_->AttachShape(disks));
+    ASSERT_NO_THROW(api_->AttachShape(boxes));
+
+    ASSERT_NO_THROW(api_->SetOption("acc.custom_intersector",
+        "float rr_intersect_custom(ray const* r, int shape_id, int prim_id, float3 pmin, float3 pmax, float t_max, float2* uv)\n"
+        "{\n"
+        "    float3 const t0 = (pmin - r->o.xyz) / r->d.xyz;\n"
+        "    float3 const t1 = (pmax - r->o.xyz) / r->d.xyz;\n"
+        "    float3 const tmin = fmin(t0, t1);\n"
+        "    float3 const tmax = fmax(t0, t1);\n"
+        "    float const tn = fmax(fmax(tmin.x, tmin.y), tmin.z);\n"
+        "    float const tf = fmin(fmin(tmax.x, tmax.y), tmax.z);\n"
+        "    *uv = (float2)(0.25f, 0.75f);\n"
+        "    return tn <= tf ? tn : t_max;\n"
+        "}\n"));
+
+    // Rays: first sphere, second sphere, disk and box
+    ray rays[4];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[2] = ray(float3(0.f, 5.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[3] = ray(float3(-5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(4 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(4 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 4 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[4] = { tmp[0], tmp[1], tmp[2], tmp[3] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, spheres->GetId());
+    ASSERT_EQ(isect[0].primid, 0);
+    ASSERT_NEAR(isect[0].uvwt.w, 9.f, 0.001f);
+    // Bottom pole of the sphere
+    ASSERT_NEAR(isect[0].uvwt.y, 1.f, 0.01f);
+    ASSERT_EQ(isect[1].shapeid, spheres->GetId());
+    ASSERT_EQ(isect[1].primid, 1);
+    ASSERT_NEAR(isect[1].uvwt.w, 9.5f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, disks->GetId());
+    ASSERT_NEAR(isect[2].uvwt.w, 10.f, 0.001f);
+    ASSERT_NEAR(isect[2].uvwt.x, 0.f, 0.001f);
+    ASSERT_EQ(isect[3].shapeid, boxes->GetId());
+    ASSERT_NEAR(isect[3].uvwt.w, 9.f, 0.001f);
+    ASSERT_NEAR(isect[3].uvwt.x, 0.25f, 0.001f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(spheres));
+    ASSERT_NO_THROW(api_->DetachShape(disks));
+    ASSERT_NO_THROW(api_->DetachShape(boxes));
+    ASSERT_NO_THROW(api_->DeleteShape(spheres));
+    ASSERT_NO_THROW(api_->DeleteShape(disks));
+    ASSERT_NO_THROW(api_->DeleteShape(boxes));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Quads are hit over both halves and report quad coordinates
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_Quad)
+{
+    float const quadvertices[] = {
+        0.f, 0.f, 0.f,
+        1.f, 0.f, 0.f,
+        1.f, 1.f, 0.f,
+        0.f, 1.f, 0.f
+    };
+    int const quadindices[] = { 0, 1, 2, 3 };
+    int const quadfaceverts[] = { 4 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quadvertices, 4, 3 * sizeof(float), quadindices, 0, quadfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: one per quad half, the second misses the first triangle
+    ray rays[2];
+    rays[0] = ray(float3(0.7f, 0.2f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    rays[1] = ray(float3(0.2f, 0.7f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[i].primid, 0);
+        ASSERT_NEAR(isect[i].uvwt.w, 10.f, 0.001f);
+        ASSERT_NEAR(isect[i].uvwt.x, rays[i].o.x, 0.001f);
+        ASSERT_NEAR(isect[i].uvwt.y, rays[i].o.y, 0.001f);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Compacted rays keep their order and their count feeds count-in-buffer queries
+TEST_F(ApiBackendOpenCL, Intersection_CompactRays)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Every other ray is inactive, active ones miss except the last one
+    int const kNumRays = 8;
+    ray r[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i] = ray(float3(i < kNumRays - 2 ? 10.f : 0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+        r[i].SetActive(i % 2 == 1);
+    }
+
+    int numrays = kNumRays;
+    auto ray_buffer = api_->CreateBuffer(sizeof(r), r);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto compacted_buffer = api_->CreateBuffer(sizeof(r), nullptr);
+    auto count_buffer = api_->CreateBuffer(sizeof(int), nullptr);
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->CompactRays(ray_buffer, numrays_buffer, kNumRays, nullptr, compacted_buffer, count_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryIntersection(compacted_buffer, count_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+
+    int* count = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(count_buffer, kMapRead, 0, sizeof(int), (void**)&count, &e_));
+    Wait();
+    ASSERT_EQ(*count, kNumRays / 2);
+    ASSERT_NO_THROW(api_->UnmapBuffer(count_buffer, count, &e_));
+    Wait();
+
+    ray* compacted = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(compacted_buffer, kMapRead, 0, kNumRays / 2 * sizeof(ray), (void**)&compacted, &e_));
+    Wait();
+    for (int i = 0; i < kNumRays / 2; ++i)
+    {
+        ASSERT_TRUE(compacted[i].IsActive());
+    }
+    ASSERT_NEAR(compacted[kNumRays / 2 - 1].o.x, 0.f, 0.001f);
+    ASSERT_NO_THROW(api_->UnmapBuffer(compacted_buffer, compacted, &e_));
+    Wait();
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kNumRays / 2 * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+    ASSERT_EQ(isect[0].shapeid, kNullId);
+    ASSERT_EQ(isect[kNumRays / 2 - 1].shapeid, mesh->GetId());
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Explicit predicate keeping only the first ray
+    int flags[kNumRays] = { 1 };
+    auto predicate_buffer = api_->CreateBuffer(sizeof(flags), flags);
+    ASSERT_NO_THROW(api_->CompactRays(ray_buffer, numrays_buffer, kNumRays, predicate_buffer, compacted_buffer, count_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(count_buffer, kMapRead, 0, sizeof(int), (void**)&count, &e_));
+    Wait();
+    ASSERT_EQ(*count, 1);
+    ASSERT_NO_THROW(api_->UnmapBuffer(count_buffer, count, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(compacted_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(count_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(predicate_buffer));
+}
+
+// Grouped hits are ordered by shape key, stable within a group, with misses and rays past the count last
+TEST_F(ApiBackendOpenCL, Intersection_GroupHits)
+{
+    // Two triangles side by side
+    float const quad_vertices[] = { -1.f, -1.f, 0.f, 1.f, -1.f, 0.f, 1.f, 1.f, 0.f, -1.f, 1.f, 0.f };
+    int const first_indices[] = { 0, 1, 2 };
+    int const second_indices[] = { 0, 2, 3 };
+
+    Shape* first = nullptr;
+    Shape* second = nullptr;
+    ASSERT_NO_THROW(first = api_->CreateMesh(quad_vertices, 4, 3 * sizeof(float), first_indices, 0, nullptr, 1));
+    ASSERT_NO_THROW(second = api_->CreateMesh(quad_vertices, 4, 3 * sizeof(float), second_indices, 0, nullptr, 1));
+    ASSERT_NO_THROW(first->SetId(0));
+    ASSERT_NO_THROW(second->SetId(1));
+    ASSERT_NO_THROW(api_->AttachShape(first));
+    ASSERT_NO_THROW(api_->AttachShape(second));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays hit second, miss, first, second, first, the last one is past the ray count
+    float const xs[] = { -0.5f, 10.f, 0.5f, -0.5f, 0.5f, 0.5f };
+    float const ys[] = { 0.5f, 0.f, -0.5f, 0.5f, -0.5f, -0.5f };
+    int const kNumRays = 6;
+    ray r[kNumRays];
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        r[i] = ray(float3(xs[i], ys[i], -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+    }
+
+    int numrays = kNumRays - 1;
+    auto ray_buffer = api_->CreateBuffer(sizeof(r), r);
+    auto numrays_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto isect_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto indices_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+    auto keys_buffer = api_->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays_buffer, kNumRays, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->GroupHits(isect_buffer, numrays_buffer, kNumRays, nullptr, 0, indices_buffer, keys_buffer, nullptr, nullptr));
+
+    int const expected_indices[] = { 2, 4, 0, 3, 1, 5 };
+    int const expected_keys[] = { 0, 0, 1, 1, kNullId, kNullId };
+
+    int* indices = nullptr;
+    int* keys = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(indices_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&indices, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->MapBuffer(keys_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&keys, &e_));
+    Wait();
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(indices[i], expected_indices[i]);
+        ASSERT_EQ(keys[i], expected_keys[i]);
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(indices_buffer, indices, &e_));
+    Wait();
+    ASSERT_NO_THROW(api_->UnmapBuffer(keys_buffer, keys, &e_));
+    Wait();
+
+    // User keys put the second shape first
+    int shape_keys[] = { 7, 3 };
+    auto shape_keys_buffer = api_->CreateBuffer(sizeof(shape_keys), shape_keys);
+    ASSERT_NO_THROW(api_->GroupHits(isect_buffer, numrays_buffer, kNumRays, shape_keys_buffer, 2, indices_buffer, nullptr, nullptr, nullptr));
+
+    int const expected_keyed_indices[] = { 0, 3, 2, 4, 1, 5 };
+    ASSERT_NO_THROW(api_->MapBuffer(indices_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&indices, &e_));
+    Wait();
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        ASSERT_EQ(indices[i], expected_keyed_indices[i]);
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(indices_buffer, indices, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(first));
+    ASSERT_NO_THROW(api_->DetachShape(second));
+    ASSERT_NO_THROW(api_->DeleteShape(first));
+    ASSERT_NO_THROW(api_->DeleteShape(second));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numrays_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(indices_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(keys_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(shape_keys_buffer));
+}
+
+// Test is checking camera, hemisphere and shadow rays generated on the device
+TEST_F(ApiBackendOpenCL, Intersection_GenerateRays)
+{
+    // Quad at z = 5 covering everything the rays can reach
+    float const quad_vertices[] = { -1000.f, -1000.f, 5.f, 1000.f, -1000.f, 5.f, 1000.f, 1000.f, 5.f, -1000.f, 1000.f, 5.f };
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quad_vertices, 4, 3 * sizeof(float), quad_indices, 0, nullptr, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const kWidth = 8;
+    int const kHeight = 4;
+    int const kNumSamples = 16;
+
+    auto ray_buffer = api_->CreateBuffer(kWidth * kHeight * sizeof(ray), nullptr);
+    auto isect_buffer = api_->CreateBuffer(kWidth * kHeight * sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(kWidth * kHeight * sizeof(int), nullptr);
+
+    // Pinhole camera looking at the quad
+    CameraDesc camera;
+    camera.position = float3(0.f, 0.f, 0.f);
+    camera.forward = float3(0.f, 0.f, 1.f);
+    camera.up = float3(0.f, 1.f, 0.f);
+    camera.sensor_size = float2(1.f, 0.5f);
+    camera.focal_length = 1.f;
+    camera.aperture = 0.f;
+    camera.focus_distance = 1.f;
+    camera.maxt = 1000.f;
+    camera.jitter = 0;
+
+    ASSERT_NO_THROW(api_->GenerateCameraRays(camera, kWidth, kHeight, 0, ray_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, kWidth * kHeight, isect_buffer, nullptr, nullptr));
+
+    ray* rays = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapRead, 0, kWidth * kHeight * sizeof(ray), (void**)&rays, &e_));
+    Wait();
+    // Top left pixel center, right of a camera looking along +z with y up is -x
+    float3 d = normalize(float3(0.5f - 0.5f / kWidth, 0.25f - 0.25f / kHeight, 1.f));
+    ASSERT_NEAR(rays[0].d.x, d.x, 1e-5f);
+    ASSERT_NEAR(rays[0].d.y, d.y, 1e-5f);
+    ASSERT_NEAR(rays[0].d.z, d.z, 1e-5f);
+    ASSERT_TRUE(rays[0].IsActive());
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rays, &e_));
+    Wait();
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, kWidth * kHeight * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+    for (int i = 0; i < kWidth * kHeight; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+    ASSERT_NEAR(isect[0].uvwt.w, 5.f / d.z, 1e-3f);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Upward point, missing point and a point past the count, rays of the last two are inactive
+    SurfacePoint points[3];
+    points[0].position = float3(0.f, 0.f, 0.f);
+    points[0].normal = float3(0.f, 0.f, 1.f);
+    points[1].position = float3(0.f, 0.f, 0.f);
+    points[1].normal = float3(0.f, 0.f, 0.f);
+    points[2] = points[0];
+
+    int numpoints = 2;
+    auto point_buffer = api_->CreateBuffer(sizeof(points), points);
+    auto numpoints_buffer = api_->CreateBuffer(sizeof(int), &numpoints);
+
+    ASSERT_NO_THROW(api_->GenerateHemisphereRays(point_buffer, numpoints_buffer, 2, kNumSamples, 1000.f, 7, ray_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumSamples, occlu_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapRead, 0, 2 * kNumSamples * sizeof(ray), (void**)&rays, &e_));
+    Wait();
+    for (int i = 0; i < kNumSamples; ++i)
+    {
+        ASSERT_TRUE(rays[i].IsActive());
+        ASSERT_GT(rays[i].d.z, 0.f);
+        ASSERT_NEAR(rays[i].d.x * rays[i].d.x + rays[i].d.y * rays[i].d.y + rays[i].d.z * rays[i].d.z, 1.f, 1e-4f);
+        ASSERT_FALSE(rays[kNumSamples + i].IsActive());
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rays, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, kNumSamples * sizeof(int), (void**)&occluded, &e_));
+    Wait();
+    for (int i = 0; i < kNumSamples; ++i)
+    {
+        ASSERT_EQ(occluded[i], 1);
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, occluded, &e_));
+    Wait();
+
+    // Area light above the quad is occluded, point light below it is not
+    LightDesc light;
+    light.position = float3(-1.f, -1.f, 10.f);
+    light.edge1 = float3(2.f, 0.f, 0.f);
+    light.edge2 = float3(0.f, 2.f, 0.f);
+
+    auto shadow_test = [&](int expected)
+    {
+        ASSERT_NO_THROW(api_->GenerateShadowRays(point_buffer, nullptr, 3, light, 3, ray_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, occlu_buffer, nullptr, nullptr));
+
+        ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&occluded, &e_));
+        Wait();
+        ASSERT_EQ(occluded[0], expected);
+        ASSERT_EQ(occluded[2], expected);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, occluded, &e_));
+        Wait();
+    };
+
+    shadow_test(1);
+
+    light.position = float3(0.f, 0.f, 2.f);
+    light.edge1 = float3(0.f, 0.f, 0.f);
+    light.edge2 = float3(0.f, 0.f, 0.f);
+    shadow_test(-1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(point_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(numpoints_buffer));
+}
+
+// Test is checking fused ambient occlusion matches tracing generated hemisphere rays
+TEST_F(ApiBackendOpenCL, Intersection_AmbientOcclusion)
+{
+    // Half plane x > 0 at z = 1
+    float const quad_vertices[] = { 0.f, -1000.f, 1.f, 1000.f, -1000.f, 1.f, 1000.f, 1000.f, 1.f, 0.f, 1000.f, 1.f };
+    int const quad_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(quad_vertices, 4, 3 * sizeof(float), quad_indices, 0, nullptr, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const kNumPoints = 4;
+    int const kNumSamples = 64;
+    float const kRadius = 100.f;
+    int const kSeed = 11;
+
+    // Below the half plane facing it, facing away, missing and far below the plane
+    SurfacePoint points[kNumPoints];
+    points[0].position = float3(0.f, 0.f, 0.f);
+    points[0].normal = float3(0.f, 0.f, 1.f);
+    points[1].position = float3(0.f, 0.f, 0.f);
+    points[1].normal = float3(0.f, 0.f, -1.f);
+    points[2].position = float3(0.f, 0.f, 0.f);
+    points[2].normal = float3(0.f, 0.f, 0.f);
+    points[3].position = float3(0.f, 0.f, -1000.f);
+    points[3].normal = float3(0.f, 0.f, 1.f);
+
+    auto point_buffer = api_->CreateBuffer(sizeof(points), points);
+    auto visibility_buffer = api_->CreateBuffer(kNumPoints * sizeof(float), nullptr);
+    auto ray_buffer = api_->CreateBuffer(kNumPoints * kNumSamples * sizeof(ray), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(kNumPoints * kNumSamples * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryAmbientOcclusion(point_buffer, kNumPoints, kNumSamples, kRadius, kSeed, visibility_buffer, nullptr, nullptr));
+
+    // Same rays generated and traced separately
+    ASSERT_NO_THROW(api_->GenerateHemisphereRays(point_buffer, nullptr, kNumPoints, kNumSamples, kRadius, kSeed, ray_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, kNumSamples, occlu_buffer, nullptr, nullptr));
+
+    float* visibility = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(visibility_buffer, kMapRead, 0, kNumPoints * sizeof(float), (void**)&visibility, &e_));
+    Wait();
+    std::vector<float> result(visibility, visibility + kNumPoints);
+    ASSERT_NO_THROW(api_->UnmapBuffer(visibility_buffer, visibility, &e_));
+    Wait();
+
+    int* occluded = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, kNumSamples * sizeof(int), (void**)&occluded, &e_));
+    Wait();
+    int unoccluded = 0;
+    for (int i = 0; i < kNumSamples; ++i)
+    {
+        unoccluded += occluded[i] == 1 ? 0 : 1;
+    }
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, occluded, &e_));
+    Wait();
+
+    ASSERT_EQ(result[0], (float)unoccluded / kNumSamples);
+    ASSERT_GT(result[0], 0.f);
+    ASSERT_LT(result[0], 1.f);
+    ASSERT_EQ(result[1], 1.f);
+    ASSERT_EQ(result[2], 1.f);
+    ASSERT_EQ(result[3], 1.f);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(point_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(visibility_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+static void CountBakerPasses(int pass, int numpasses, void* data)
+{
+    *static_cast<int*>(data) = pass;
+}
+
+// Test is checking texture space ambient occlusion baking of a quad half covered by a plane
+TEST_F(ApiBackendOpenCL, Baker_AmbientOcclusion)
+{
+    // Unit quad at z = 0 with uvs matching positions and a half plane x > 0.5 at z = 1
+    float const vertices[] = {
+        0.f, 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 1.f, 0.f, 0.f, 1.f, 0.f,
+        0.5f, -1000.f, 1.f, 1000.f, -1000.f, 1.f, 1000.f, 1000.f, 1.f, 0.5f, 1000.f, 1.f };
+    float const uvs[] = { 0.f, 0.f, 1.f, 0.f, 1.f, 1.f, 0.f, 1.f };
+    int const indices[] = { 0, 1, 2, 0, 2, 3, 4, 5, 6, 4, 6, 7 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 8, 3 * sizeof(float), indices, 0, nullptr, 4));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const kSize = 16;
+    int const kNumPasses = 3;
+
+    // Only the receiver quad is rasterized, all texel centers are inside it
+    std::vector<SurfacePoint> points(kSize * kSize);
+    ASSERT_NO_THROW(Baker::RasterizeUV(vertices, 0, nullptr, 0, uvs, 0, indices, 2, kSize, kSize, points.data()));
+
+    for (int y = 0; y < kSize; ++y)
+    {
+        for (int x = 0; x < kSize; ++x)
+        {
+            SurfacePoint const& p = points[y * kSize + x];
+            ASSERT_NEAR(p.position.x, (x + 0.5f) / kSize, 1e-5f);
+            ASSERT_NEAR(p.position.y, (y + 0.5f) / kSize, 1e-5f);
+            ASSERT_EQ(p.normal.z, 1.f);
+        }
+    }
+
+    Baker* baker = nullptr;
+    ASSERT_NO_THROW(baker = Baker::Create(&api_, 1));
+    // Several tiles, partial ones included
+    ASSERT_NO_THROW(baker->SetTileSize(6));
+
+    int passes = 0;
+    std::vector<float> result(kSize * kSize);
+    ASSERT_NO_THROW(baker->BakeAmbientOcclusion(points.data(), kSize, kSize, 32, kNumPasses, 100.f, result.data(), CountBakerPasses, &passes));
+    ASSERT_EQ(passes, kNumPasses);
+
+    float left = 0.f;
+    float right = 0.f;
+    for (int y = 0; y < kSize; ++y)
+    {
+        for (int x = 0; x < kSize; ++x)
+        {
+            float v = result[y * kSize + x];
+            ASSERT_GE(v, 0.f);
+            ASSERT_LE(v, 1.f);
+            (x < kSize / 2 ? left : right) += v;
+        }
+    }
+
+    ASSERT_GT(left, right);
+
+    // Bail out
+    ASSERT_NO_THROW(Baker::Delete(baker));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Test is checking if mesh transform is working as expected
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
+{
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Prepare the ray
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    // Intersection and hit data
+    Intersection isect;
+    
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
     
     Intersection* tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
@@ -405,24 +5600,35 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
     // Check results
     ASSERT_EQ(isect.shapeid, mesh->GetId());
 
-    isect.primid = kNullId;
-    isect.shapeid = kNullId;
+    matrix m = translation(float3(0,2,0));
+    matrix minv = inverse(m);
+    // Move the mesh
+    ASSERT_NO_THROW(mesh->SetTransform(m, minv));
+    // Reset ray
 
-    r.SetActive(false);
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
     
-    ray* rr = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, sizeof(ray), (void**)&rr, &e_));
-    Wait();
-    *rr = r;
-    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rr, &e_));
-    Wait();
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
     
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapWrite, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    *tmp = isect;
+    isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
     
+    // Check results
+    ASSERT_EQ(isect.shapeid, -1);
+
+    // Set transform to identity
+    m = matrix();
+    ASSERT_NO_THROW(mesh->SetTransform(m, m));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+    
     // Intersect
     ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
     
@@ -432,11 +5638,9 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
     isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-
     
     // Check results
-    ASSERT_EQ(isect.shapeid, kNullId);
-
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
 
     // Bail out
     ASSERT_NO_THROW(api_->DetachShape(mesh));
@@ -445,62 +5649,84 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Active)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-// The test creates a single triangle mesh and tests attach/detach functionality
-TEST_F(ApiBackendOpenCL, Intersection_3Rays)
+// Test is checking if moving mesh is intersected at the ray time
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_MotionBlur)
 {
-
     Shape* mesh = nullptr;
 
-    // 
-    ASSERT_NO_THROW(api_->SetOption("acc.type", "grid"));
-
     // Create mesh
     ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
 
     ASSERT_TRUE(mesh != nullptr);
 
+    // Move the mesh up by 2 during the frame
+    ASSERT_NO_THROW(mesh->SetLinearVelocity(float3(0.f, 2.f, 0.f)));
+
     // Attach the mesh to the scene
     ASSERT_NO_THROW(api_->AttachShape(mesh));
 
-    // Rays
+    // Rays: hitting the mesh at time 0, missing it at time 1 and hitting it at time 1
     ray rays[3];
 
-    // Prepare the ray
     rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
     rays[0].d = float3(0.f,0.f,1.f);
+    rays[0].SetTime(0.f);
 
-    rays[1].o = float4(0.f,0.5f,-10.f, 1000.f);
+    rays[1].o = float4(0.f,0.f,-10.f, 1000.f);
     rays[1].d = float3(0.f,0.f,1.f);
+    rays[1].SetTime(1.f);
 
-    rays[2].o = float4(0.5f,0.f,-10.f, 1000.f);
+    rays[2].o = float4(0.f,2.f,-10.f, 1000.f);
     rays[2].d = float3(0.f,0.f,1.f);
+    rays[2].SetTime(1.f);
 
-    // Intersection and hit data
-    Intersection isect[3];
-    
     auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
     auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
+
     // Intersect
     ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
-    
+
     Intersection* tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
-    isect[0] = tmp[0];
-    isect[1] = tmp[1];
-    isect[2] = tmp[2];
+    Intersection isect[3] = { tmp[0], tmp[1], tmp[2] };
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
+
     // Check results
-    for (int i=0; i<3; ++i)
-    {
-        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
-    }
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[2].uvwt.w, 10.f, 0.001f);
+
+    // Rotate the mesh by 180 degrees around z axis instead
+    ASSERT_NO_THROW(mesh->SetLinearVelocity(float3(0.f, 0.f, 0.f)));
+    ASSERT_NO_THROW(mesh->SetAngularVelocity(quaternion(0.f, 0.f, 1.f, 0.f)));
+
+    // Lower right corner of the triangle is swept away by time 1
+    rays[2].o = float4(0.9f,-0.9f,-10.f, 1000.f);
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    std::copy(tmp, tmp + 3, isect);
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
 
     // Bail out
     ASSERT_NO_THROW(api_->DetachShape(mesh));
@@ -509,26 +5735,336 @@ TEST_F(ApiBackendOpenCL, Intersection_3Rays)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// Test is checking if compactly stored rigid transforms place 2 level BVH shapes correctly
+TEST_F(ApiBackendOpenCL, Intersection_2Rays_CompactTransforms)
+{
+    Shape* mesh = nullptr;
+
+    api_->SetOption("bvh.force2level", 1.f);
+    api_->SetOption("bvh.compact_transforms", 1.f);
 
-// Test is checking if mesh transform is working as expected
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Scale by 2, flip upside down and move up by 2: (2,4), (-2,4), (0,0)
+    matrix m = translation(float3(0.f, 2.f, 0.f)) * rotation_z(PI) * scale(float3(2.f, 2.f, 2.f));
+    ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays: hitting the wide top edge and missing the narrow bottom corner
+    ray rays[2];
+
+    rays[0].o = float4(1.5f,3.8f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(1.5f,0.2f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2*sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Intersect
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr ));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2*sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect[2] = { tmp[0], tmp[1] };
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    // Check results
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if nested groups are placed by their transforms and report attached shape IDs
+TEST_F(ApiBackendOpenCL, Intersection_3Rays_NestedGroups)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh, it is only referenced by groups
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Group of the mesh and its instance moved to the right
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+    matrix m = translation(float3(3.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+
+    Shape* members[] = { mesh, instance };
+    Shape* group = nullptr;
+    ASSERT_NO_THROW(group = api_->CreateGroup(members, 2));
+
+    // Instance of the group moved away from the rays
+    Shape* group_instance = nullptr;
+    ASSERT_NO_THROW(group_instance = api_->CreateInstance(group));
+    m = translation(float3(0.f, 0.f, 5.f));
+    ASSERT_NO_THROW(group_instance->SetTransform(m, inverse(m)));
+
+    // Attach the group and its instance to the scene
+    ASSERT_NO_THROW(api_->AttachShape(group));
+    ASSERT_NO_THROW(api_->AttachShape(group_instance));
+
+    // Rays: hitting the mesh, its instance and missing both
+    ray rays[3];
+
+    rays[0].o = float4(0.f,0.f,-10.f, 1000.f);
+    rays[0].d = float3(0.f,0.f,1.f);
+
+    rays[1].o = float4(3.f,0.f,-10.f, 1000.f);
+    rays[1].d = float3(0.f,0.f,1.f);
+
+    rays[2].o = float4(6.f,0.f,-10.f, 1000.f);
+    rays[2].d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3*sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3*sizeof(Intersection), nullptr);
+
+    auto query = [&](Intersection* isect)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr ));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::copy(tmp, tmp + 3, isect);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    // The group is closer than its instance
+    Intersection isect[3];
+    query(isect);
+
+    ASSERT_EQ(isect[0].shapeid, group->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, group->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Only the group instance is left
+    ASSERT_NO_THROW(api_->DetachShape(group));
+    query(isect);
+
+    ASSERT_EQ(isect[0].shapeid, group_instance->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 15.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, group_instance->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 15.f, 0.001f);
+
+    // Group of the group instance, moving the instance moves nested members too
+    Shape* nested[] = { group_instance };
+    Shape* outer = nullptr;
+    ASSERT_NO_THROW(outer = api_->CreateGroup(nested, 1));
+    ASSERT_NO_THROW(api_->DetachShape(group_instance));
+    ASSERT_NO_THROW(api_->AttachShape(outer));
+
+    m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(group_instance->SetTransform(m, inverse(m)));
+    query(isect);
+
+    ASSERT_EQ(isect[0].shapeid, outer->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 12.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, outer->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 12.f, 0.001f);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    // Nesting is bounded by kernel stack size
+    Shape* level3 = nullptr;
+    Shape* level4 = nullptr;
+    ASSERT_NO_THROW(level3 = api_->CreateGroup(&outer, 1));
+    ASSERT_NO_THROW(level4 = api_->CreateGroup(&level3, 1));
+    ASSERT_NO_THROW(api_->DetachShape(outer));
+    ASSERT_NO_THROW(api_->AttachShape(level4));
+    ASSERT_ANY_THROW(api_->Commit());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(level4));
+    ASSERT_NO_THROW(api_->DeleteShape(level4));
+    ASSERT_NO_THROW(api_->DeleteShape(level3));
+    ASSERT_NO_THROW(api_->DeleteShape(outer));
+    ASSERT_NO_THROW(api_->DeleteShape(group_instance));
+    ASSERT_NO_THROW(api_->DeleteShape(group));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_LodGroup)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh, it is only referenced by the LOD group
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Coarse level is the mesh moved back, so levels are told apart by hit distances
+    Shape* coarse = nullptr;
+    ASSERT_NO_THROW(coarse = api_->CreateInstance(mesh));
+    matrix m = translation(float3(0.f, 0.f, 1.f));
+    ASSERT_NO_THROW(coarse->SetTransform(m, inverse(m)));
+
+    Shape* levels[] = { mesh, coarse };
+    float const thresholds[] = { 0.f, 20.f };
+    Shape* lod = nullptr;
+    ASSERT_NO_THROW(lod = api_->CreateLodGroup(levels, thresholds, 2, kLodRuleDistance, 0.f));
+    ASSERT_NO_THROW(api_->AttachShape(lod));
+
+    // LOD groups can not be levels of other LOD groups
+    ASSERT_ANY_THROW(api_->CreateLodGroup(&lod, thresholds, 1, kLodRuleDistance, 0.f));
+
+    // Rays: close to the group, far from it and close with a wide cone
+    int const numrays = 67;
+    std::vector<ray> rays(numrays);
+
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(0.f, 0.f, -30.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    rays[2] = rays[0];
+    rays[2].SetSpread(3.f);
+
+    // Rays at the threshold distance with different seeds
+    for (int i = 3; i < numrays; ++i)
+    {
+        rays[i].o = float4(0.f, 0.f, -20.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+        rays[i].SetLodSeed(i);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays*sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays*sizeof(Intersection), nullptr);
+
+    auto query = [&](Intersection* isect)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr ));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::copy(tmp, tmp + numrays, isect);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    // Distance rule ignores the spread
+    std::vector<Intersection> isect(numrays);
+    query(isect.data());
+
+    ASSERT_EQ(isect[0].shapeid, lod->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+    ASSERT_EQ(isect[1].shapeid, lod->GetId());
+    ASSERT_NEAR(isect[1].uvwt.w, 31.f, 0.001f);
+    ASSERT_NEAR(isect[2].uvwt.w, 10.f, 0.001f);
+
+    // Cone width rule, wide cones select the coarse level close to the group.
+    // Instances of LOD groups measure distances to their own origin.
+    Shape* lod_cone = nullptr;
+    ASSERT_NO_THROW(lod_cone = api_->CreateLodGroup(levels, thresholds, 2, kLodRuleConeWidth, 0.f));
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(lod_cone));
+    m = translation(float3(0.f, 0.f, 5.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->DetachShape(lod));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    query(isect.data());
+
+    ASSERT_EQ(isect[0].shapeid, instance->GetId());
+    ASSERT_NEAR(isect[0].uvwt.w, 15.f, 0.001f);
+    ASSERT_NEAR(isect[2].uvwt.w, 16.f, 0.001f);
+
+    // Stochastic transition, rays at the threshold select both levels depending on their seeds
+    Shape* lod_blend = nullptr;
+    ASSERT_NO_THROW(lod_blend = api_->CreateLodGroup(levels, thresholds, 2, kLodRuleDistance, 1.f));
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->AttachShape(lod_blend));
+    query(isect.data());
+
+    int numfine = 0;
+    int numcoarse = 0;
+
+    for (int i = 3; i < numrays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, lod_blend->GetId());
+        numfine += std::abs(isect[i].uvwt.w - 20.f) < 0.001f ? 1 : 0;
+        numcoarse += std::abs(isect[i].uvwt.w - 21.f) < 0.001f ? 1 : 0;
+    }
+
+    ASSERT_EQ(numfine + numcoarse, numrays - 3);
+    ASSERT_GT(numfine, 0);
+    ASSERT_GT(numcoarse, 0);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(lod_blend));
+    ASSERT_NO_THROW(api_->DeleteShape(lod_blend));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(lod_cone));
+    ASSERT_NO_THROW(api_->DeleteShape(lod));
+    ASSERT_NO_THROW(api_->DeleteShape(coarse));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks intersection after geometry addition
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_DynamicGeo)
 {
+    // Mesh vertices
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+        
+    };
+    
+    float vertices1[] = {
+        -1.f,-1.f,-1.f,
+        1.f,-1.f,-1.f,
+        0.f,1.f,-1.f,
+        
+    };
 
-    Shape* mesh = nullptr;
+    Shape* closemesh = nullptr;
+    Shape* farmesh = nullptr;
 
-    // Create mesh
-    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    // Create two meshes
+    ASSERT_NO_THROW(farmesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(closemesh = api_->CreateMesh(vertices1, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
 
-    ASSERT_TRUE(mesh != nullptr);
+    ASSERT_TRUE(farmesh != nullptr);
+    ASSERT_TRUE(closemesh != nullptr);
 
     // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(farmesh));
 
     // Prepare the ray
     ray r;
     r.o = float4(0.f,0.f,-10.f, 1000.f);
     r.d = float3(0.f,0.f,1.f);
 
+
     // Intersection and hit data
     Intersection isect;
     
@@ -549,13 +6085,10 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
     Wait();
     
     // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
 
-    matrix m = translation(float3(0,2,0));
-    matrix minv = inverse(m);
-    // Move the mesh
-    ASSERT_NO_THROW(mesh->SetTransform(m, minv));
-    // Reset ray
+    // Attach closer mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(closemesh));
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
@@ -571,11 +6104,10 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
     Wait();
     
     // Check results
-    ASSERT_EQ(isect.shapeid, -1);
+    ASSERT_EQ(isect.shapeid, closemesh->GetId());
 
-    // Set transform to identity
-    m = matrix();
-    ASSERT_NO_THROW(mesh->SetTransform(m, m));
+    // Attach closer mesh to the scene
+    ASSERT_NO_THROW(api_->DetachShape(closemesh));
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
@@ -591,116 +6123,458 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_Transformed)
     Wait();
     
     // Check results
-    ASSERT_EQ(isect.shapeid, mesh->GetId());
+    ASSERT_EQ(isect.shapeid, farmesh->GetId());
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(mesh));
-    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DetachShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(farmesh));
+    ASSERT_NO_THROW(api_->DeleteShape(closemesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
-// The test checks intersection after geometry addition
-TEST_F(ApiBackendOpenCL, Intersection_1Ray_DynamicGeo)
+// The test checks intersection after vertex positions update
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_UpdateVertices)
 {
-    // Mesh vertices
-    float vertices[] = {
-        -1.f,-1.f,0.f,
-        1.f,-1.f,0.f,
-        0.f,1.f,0.f,
-        
-    };
-    
+    // Mesh vertices moved out of the ray path
     float vertices1[] = {
-        -1.f,-1.f,-1.f,
-        1.f,-1.f,-1.f,
-        0.f,1.f,-1.f,
-        
+        -1.f,1.f,0.f,
+        1.f,1.f,0.f,
+        0.f,3.f,0.f,
+
     };
 
-    Shape* closemesh = nullptr;
-    Shape* farmesh = nullptr;
+    Shape* mesh = nullptr;
 
-    // Create two meshes
-    ASSERT_NO_THROW(farmesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
-    ASSERT_NO_THROW(closemesh = api_->CreateMesh(vertices1, 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
 
-    ASSERT_TRUE(farmesh != nullptr);
-    ASSERT_TRUE(closemesh != nullptr);
+    ASSERT_TRUE(mesh != nullptr);
 
     // Attach the mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(farmesh));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
 
     // Prepare the ray
     ray r;
     r.o = float4(0.f,0.f,-10.f, 1000.f);
     r.d = float3(0.f,0.f,1.f);
 
-
     // Intersection and hit data
     Intersection isect;
-    
+
     auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
     auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
+
     // Intersect
     ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
+
     Intersection* tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
     isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
+
     // Check results
-    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
 
-    // Attach closer mesh to the scene
-    ASSERT_NO_THROW(api_->AttachShape(closemesh));
+    // Move vertices, vertex count mismatch is an error
+    ASSERT_ANY_THROW(mesh->UpdateVertices(vertices1, 2, 3*sizeof(float)));
+    ASSERT_NO_THROW(mesh->UpdateVertices(vertices1, 3, 3*sizeof(float)));
 
     // Commit geometry update
     ASSERT_NO_THROW(api_->Commit());
-    
+
     // Intersect
     ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
+
     tmp = nullptr;
     ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
     Wait();
     isect = *tmp;
     ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
     Wait();
-    
+
     // Check results
-    ASSERT_EQ(isect.shapeid, closemesh->GetId());
+    ASSERT_EQ(isect.shapeid, -1);
 
-    // Attach closer mesh to the scene
-    ASSERT_NO_THROW(api_->DetachShape(closemesh));
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
 
-    // Commit geometry update
+// The test checks meshes with different build hints share a 2 level BVH and deforming ones follow their vertices
+TEST_F(ApiBackendOpenCL, Intersection_BuildHints)
+{
+    // Mesh vertices moved out of the ray path
+    float vertices1[] = {
+        -1.f,1.f,0.f,
+        1.f,1.f,0.f,
+        0.f,3.f,0.f
+    };
+
+    Shape* deforming = nullptr;
+    Shape* dynamic = nullptr;
+    Shape* fixed = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(deforming = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(dynamic = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(fixed = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_EQ(deforming->GetBuildHint(), kBuildHintDefault);
+    ASSERT_NO_THROW(deforming->SetBuildHint(kBuildHintDeforming));
+    ASSERT_NO_THROW(dynamic->SetBuildHint(kBuildHintDynamic));
+    ASSERT_NO_THROW(fixed->SetBuildHint(kBuildHintStatic));
+
+    // Other meshes are placed next to the deforming one
+    matrix m = translation(float3(5.f, 0.f, 0.f));
+    ASSERT_NO_THROW(dynamic->SetTransform(m, inverse(m)));
+    m = translation(float3(-5.f, 0.f, 0.f));
+    ASSERT_NO_THROW(fixed->SetTransform(m, inverse(m)));
+
+    ASSERT_NO_THROW(api_->AttachShape(deforming));
+    ASSERT_NO_THROW(api_->AttachShape(dynamic));
+    ASSERT_NO_THROW(api_->AttachShape(fixed));
     ASSERT_NO_THROW(api_->Commit());
-    
-    // Intersect
-    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr ));
-    
-    tmp = nullptr;
-    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
-    Wait();
-    isect = *tmp;
-    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
-    Wait();
-    
-    // Check results
-    ASSERT_EQ(isect.shapeid, farmesh->GetId());
+
+    ray rays[3];
+    rays[0] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    rays[1] = ray(float3(5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    rays[2] = ray(float3(-5.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+
+    Intersection hits[3];
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 3, hits));
+    ASSERT_EQ(hits[0].shapeid, deforming->GetId());
+    ASSERT_EQ(hits[1].shapeid, dynamic->GetId());
+    ASSERT_EQ(hits[2].shapeid, fixed->GetId());
+
+    // Refitted deforming mesh moves out of the ray path and back
+    ASSERT_NO_THROW(deforming->UpdateVertices(vertices1, 3, 3*sizeof(float)));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 3, hits));
+    ASSERT_EQ(hits[0].shapeid, kNullId);
+    ASSERT_EQ(hits[1].shapeid, dynamic->GetId());
+    ASSERT_EQ(hits[2].shapeid, fixed->GetId());
+
+    ASSERT_NO_THROW(deforming->UpdateVertices(vertices(), 3, 3*sizeof(float)));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 3, hits));
+    ASSERT_EQ(hits[0].shapeid, deforming->GetId());
+
+    // Hint changes rebuild the mesh with the other builder
+    ASSERT_NO_THROW(deforming->SetBuildHint(kBuildHintStatic));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 3, hits));
+    ASSERT_EQ(hits[0].shapeid, deforming->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+    ASSERT_NO_THROW(api_->DetachShape(deforming));
+    ASSERT_NO_THROW(api_->DetachShape(dynamic));
+    ASSERT_NO_THROW(api_->DetachShape(fixed));
+    ASSERT_NO_THROW(api_->DeleteShape(deforming));
+    ASSERT_NO_THROW(api_->DeleteShape(dynamic));
+    ASSERT_NO_THROW(api_->DeleteShape(fixed));
+}
+
+// The test checks vertex positions update from a device buffer is refitted
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_UpdateVerticesFromBuffer)
+{
+    // Mesh vertices moved out of the ray path, padded to 4 floats
+    float vertices1[] = {
+        -1.f,1.f,0.f,0.f,
+        1.f,1.f,0.f,0.f,
+        0.f,3.f,0.f,0.f
+    };
+
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto vertex_buffer = api_->CreateBuffer(sizeof(vertices1), vertices1);
+
+    // Commit and return closest hit
+    auto query = [&]()
+    {
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    Intersection isect = query();
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Move vertices, vertex count mismatch is an error
+    ASSERT_ANY_THROW(api_->UpdateVertices(mesh, vertex_buffer, 2, 4*sizeof(float)));
+    ASSERT_NO_THROW(api_->UpdateVertices(mesh, vertex_buffer, 3, 4*sizeof(float)));
+
+    isect = query();
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+    // Topology is kept, so the tree is refitted
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 1);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(vertex_buffer));
+}
+
+// The test checks instance transforms updated in bulk from host memory and a buffer
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_SetTransforms)
+{
+    Shape* mesh = nullptr;
+    Shape* instances[2] = { nullptr, nullptr };
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Both instances start out of the ray path
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        matrix m = translation(float3(10.f * (i + 1), 0.f, 0.f));
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    ray r;
+    r.o = float4(0.f,0.f,-10.f, 1000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Commit and return closest hit
+    auto query = [&]()
+    {
+        api_->Commit();
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    Intersection isect = query();
+    ASSERT_EQ(isect.shapeid, kNullId);
+
+    // Move the first instance onto the ray 2 units behind the origin plane, rows padded to 16 floats
+    float transforms[32] = {
+        1.f, 0.f, 0.f, 0.f,
+        0.f, 1.f, 0.f, 0.f,
+        0.f, 0.f, 1.f, 2.f
+    };
+    float const away[] = {
+        1.f, 0.f, 0.f, 20.f,
+        0.f, 1.f, 0.f, 0.f,
+        0.f, 0.f, 1.f, 0.f
+    };
+    std::memcpy(&transforms[16], away, sizeof(away));
+
+    ASSERT_NO_THROW(api_->SetTransforms(instances, 2, transforms, 16 * sizeof(float)));
+
+    isect = query();
+    ASSERT_EQ(isect.shapeid, instances[0]->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+
+    matrix m, minv;
+    instances[0]->GetTransform(m, minv);
+    ASSERT_NEAR(minv.m23, -2.f, 0.001f);
+
+    // Shapes and bottom level are kept, so the top level is refitted
+    CommitStatistics stats;
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+    ASSERT_EQ(stats.refitted, 1);
+
+    // Swap the instances reading tightly packed transforms from a buffer
+    Shape* swapped[2] = { instances[1], instances[0] };
+    float packed[24];
+    std::memcpy(&packed[0], &transforms[0], 12 * sizeof(float));
+    std::memcpy(&packed[12], away, sizeof(away));
+    auto transform_buffer = api_->CreateBuffer(sizeof(packed), packed);
+
+    ASSERT_NO_THROW(api_->SetTransforms(swapped, 2, transform_buffer, 0));
+
+    isect = query();
+    ASSERT_EQ(isect.shapeid, instances[1]->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 12.f, 0.001f);
+
+    // Bail out
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instances[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(instances[i]));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(transform_buffer));
+}
+
+// The test checks queries issued from several threads at once return their own results
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_ConcurrentQueries)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const num_threads = 4;
+    int const num_queries = 16;
+    std::vector<int> hits(num_threads, 0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            // Every thread traces its own ray origin so mixed up arguments show up as wrong distances
+            ray r(float3(0.f, 0.f, -1.f - t), float3(0.f, 0.f, 1.f), 10000.f);
+
+            auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+            auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+            for (int i = 0; i < num_queries; ++i)
+            {
+                Event* e = nullptr;
+                api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+                Intersection* tmp = nullptr;
+                api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e);
+                e->Wait();
+                api_->DeleteEvent(e);
+
+                if (tmp->shapeid == mesh->GetId() && std::abs(tmp->uvwt.w - (1.f + t)) < 0.001f)
+                {
+                    ++hits[t];
+                }
+
+                api_->UnmapBuffer(isect_buffer, tmp, &e);
+                e->Wait();
+                api_->DeleteEvent(e);
+            }
+
+            api_->DeleteBuffer(ray_buffer);
+            api_->DeleteBuffer(isect_buffer);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        ASSERT_EQ(hits[t], num_queries);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test checks queries keep running during a background commit and see the new scene after it
+TEST_F(ApiBackendOpenCL, Intersection_1Ray_CommitAsync)
+{
+    Shape* far_mesh = nullptr;
+    Shape* near_mesh = nullptr;
+
+    ASSERT_NO_THROW(far_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(near_mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    matrix m = translation(float3(0, 0, 2));
+    ASSERT_NO_THROW(far_mesh->SetTransform(m, inverse(m)));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 10000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Return closest hit against the current scene
+    auto query = [&]()
+    {
+        api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr);
+
+        Intersection* tmp = nullptr;
+        api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_);
+        Wait();
+        Intersection isect = *tmp;
+        api_->UnmapBuffer(isect_buffer, tmp, &e_);
+        Wait();
+
+        return isect;
+    };
+
+    ASSERT_NO_THROW(api_->AttachShape(far_mesh));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_EQ(query().shapeid, far_mesh->GetId());
+
+    // Either scene version may be hit until the commit completes
+    Event* commit = nullptr;
+    ASSERT_NO_THROW(api_->AttachShape(near_mesh));
+    ASSERT_NO_THROW(api_->CommitAsync(&commit));
+    ASSERT_NE(query().shapeid, kNullId);
+
+    commit->Wait();
+    ASSERT_TRUE(commit->Complete());
+    ASSERT_NO_THROW(api_->DeleteEvent(commit));
+
+    Intersection isect = query();
+    ASSERT_EQ(isect.shapeid, near_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 10.f, 0.001f);
+
+    // Scene changes wait for the background commit
+    ASSERT_NO_THROW(api_->CommitAsync(nullptr));
+    ASSERT_NO_THROW(api_->DetachShape(near_mesh));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_EQ(query().shapeid, far_mesh->GetId());
+
+    // So do shape changes, which are picked up by the next commit instead of being cleared by the background one
+    ASSERT_NO_THROW(api_->CommitAsync(nullptr));
+    m = translation(float3(0, 0, 5));
+    ASSERT_NO_THROW(far_mesh->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(api_->Commit());
+    isect = query();
+    ASSERT_EQ(isect.shapeid, far_mesh->GetId());
+    ASSERT_NEAR(isect.uvwt.w, 15.f, 0.001f);
 
     // Bail out
-    ASSERT_NO_THROW(api_->DetachShape(farmesh));
-    ASSERT_NO_THROW(api_->DeleteShape(farmesh));
-    ASSERT_NO_THROW(api_->DeleteShape(closemesh));
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(far_mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(near_mesh));
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
@@ -797,6 +6671,181 @@ TEST_F(ApiBackendOpenCL, CornellBox_1Ray)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// Test is checking parallel OBJ parsing matches tinyobj and meshes are created from mapped binary geometry
+TEST_F(ApiBackendOpenCL, CornellBox_GeometryIngest)
+{
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    tinyobj::LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+
+    GeometryIngest::Geometry obj;
+    ASSERT_EQ(GeometryIngest::LoadObj("../Resources/CornellBox/orig.objm", obj, 4), "");
+    ASSERT_EQ(obj.GetMeshes().size(), shapes.size());
+
+    for (std::size_t i = 0; i < shapes.size(); ++i)
+    {
+        ASSERT_EQ(obj.GetMeshes()[i].numfaces, (int)shapes[i].mesh.indices.size() / 3);
+    }
+
+    char const* path = "cornell_box_ingest.rrgeo";
+    ASSERT_EQ(GeometryIngest::WriteBinary(path, obj), "");
+
+    std::vector<Shape*> apishapes;
+
+    {
+        GeometryIngest::Geometry binary;
+        ASSERT_EQ(GeometryIngest::Load(path, binary), "");
+        ASSERT_EQ(binary.GetMeshes().size(), shapes.size());
+
+        // Meshes are copied by the API, mapped file is released at the end of the scope
+        ASSERT_NO_THROW(apishapes = GeometryIngest::CreateMeshes(api_, binary));
+    }
+
+    std::remove(path);
+
+    for (auto shape : apishapes)
+    {
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+    }
+
+    ray r(float3(0.f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_NE(isect.shapeid, kNullId);
+
+    for (auto shape : apishapes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shape));
+        ASSERT_NO_THROW(api_->DeleteShape(shape));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking a scene saved as a snapshot is loaded with the same shapes and hits
+TEST_F(ApiBackendOpenCL, Intersection_SceneSnapshot)
+{
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    tinyobj::LoadObj(shapes, materials, "../Resources/CornellBox/orig.objm");
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    std::vector<Shape*> apishapes;
+    for (auto const& shape : shapes)
+    {
+        Shape* mesh = nullptr;
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(&shape.mesh.positions[0], (int)shape.mesh.positions.size() / 3, 3 * sizeof(float),
+            &shape.mesh.indices[0], 0, nullptr, (int)shape.mesh.indices.size() / 3));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        apishapes.push_back(mesh);
+    }
+
+    // Moved copy of the first mesh, behind the box
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(apishapes[0]));
+    ASSERT_NO_THROW(instance->SetTransform(translation(float3(0.f, 0.f, 10.f)), translation(float3(0.f, 0.f, -10.f))));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    apishapes.push_back(instance);
+
+    std::vector<ray> r(2);
+    r[0] = ray(float3(0.f, 0.5f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+    r[1] = ray(float3(0.f, 0.5f, 30.f), float3(0.f, 0.f, -1.f), 1000.f);
+
+    auto ray_buffer = api_->CreateBuffer(r.size() * sizeof(ray), r.data());
+    auto isect_buffer = api_->CreateBuffer(r.size() * sizeof(Intersection), nullptr);
+
+    auto query = [&](std::vector<Intersection>& isects)
+    {
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)r.size(), isect_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, r.size() * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        isects.assign(tmp, tmp + r.size());
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+    };
+
+    std::vector<Intersection> expected;
+    query(expected);
+
+    char const* path = "cornell_box.rrsnap";
+    ASSERT_NO_THROW(api_->SaveSnapshot(path));
+
+    for (auto shape : apishapes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shape));
+        ASSERT_NO_THROW(api_->DeleteShape(shape));
+    }
+
+    ASSERT_EQ(api_->LoadSnapshot(path, nullptr, 0), (int)apishapes.size());
+    ASSERT_ANY_THROW(api_->LoadSnapshot(path, apishapes.data(), 1));
+    ASSERT_EQ(api_->LoadSnapshot(path, apishapes.data(), (int)apishapes.size()), (int)apishapes.size());
+
+    std::vector<Intersection> loaded;
+    query(loaded);
+
+    for (std::size_t i = 0; i < r.size(); ++i)
+    {
+        ASSERT_NE(expected[i].shapeid, kNullId);
+        ASSERT_EQ(loaded[i].shapeid, expected[i].shapeid);
+        ASSERT_EQ(loaded[i].primid, expected[i].primid);
+        ASSERT_NEAR(loaded[i].uvwt.w, expected[i].uvwt.w, 1e-5f);
+    }
+
+    // New shapes don't reuse loaded IDs
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    for (auto shape : apishapes)
+    {
+        ASSERT_NE(mesh->GetId(), shape->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+
+    for (auto shape : apishapes)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(shape));
+        ASSERT_NO_THROW(api_->DeleteShape(shape));
+    }
+
+    // Face indices past the vertices of their mesh reject the snapshot,
+    // the offset of the first mesh indices follows the file header and the shape state
+    {
+        FILE* file = std::fopen(path, "r+b");
+        ASSERT_TRUE(file != nullptr);
+        std::uint64_t offset = 0;
+        int const index = 1 << 30;
+        ASSERT_EQ(std::fseek(file, 32 + 176 + sizeof(std::uint64_t), SEEK_SET), 0);
+        ASSERT_EQ(std::fread(&offset, sizeof(offset), 1, file), 1u);
+        ASSERT_EQ(std::fseek(file, (long)offset, SEEK_SET), 0);
+        ASSERT_EQ(std::fwrite(&index, sizeof(index), 1, file), 1u);
+        std::fclose(file);
+    }
+
+    ASSERT_ANY_THROW(api_->LoadSnapshot(path, nullptr, 0));
+
+    std::remove(path);
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
 
 // Test is checking if mesh transform is working as expected
 TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstance1)
@@ -1035,6 +7084,339 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_TransformedInstanceFlat)
     ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
+// Short stack traversal of instanced scenes has to match skip links
+TEST_F(ApiBackendOpenCL, Intersection_InstancesShortStack)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh, it is only referenced by instances
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3*sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Row of instances at different depths, the last one is masked out
+    int const numinstances = 8;
+    std::vector<Shape*> instances(numinstances);
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        matrix m = translation(float3(3.f * i, 0.f, (float)(i % 3)));
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(instances[numinstances - 1]->SetMask(0x2));
+
+    // Rays hitting each instance and missing between them
+    int const numrays = 2 * numinstances;
+    std::vector<ray> rays(numrays);
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i].o = float4(1.5f * i, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+        rays[i].SetMask(0x1);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays*sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays*sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(numrays*sizeof(int), nullptr);
+
+    auto query = [&](char const* acctype, Intersection* isect, int* occlu)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occlu_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::copy(tmp, tmp + numrays, isect);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        int* tmpocclu = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, numrays*sizeof(int), (void**)&tmpocclu, &e_));
+        Wait();
+        std::copy(tmpocclu, tmpocclu + numrays, occlu);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, tmpocclu, &e_));
+        Wait();
+    };
+
+    auto compare = [&]()
+    {
+        std::vector<Intersection> isect(numrays);
+        std::vector<Intersection> isect_fat(numrays);
+        std::vector<int> occlu(numrays);
+        std::vector<int> occlu_fat(numrays);
+
+        query("bvh", isect.data(), occlu.data());
+        query("fatbvh", isect_fat.data(), occlu_fat.data());
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ASSERT_EQ(isect_fat[i].shapeid, isect[i].shapeid);
+            ASSERT_EQ(isect_fat[i].primid, isect[i].primid);
+            ASSERT_NEAR(isect_fat[i].uvwt.w, isect[i].uvwt.w, 0.001f);
+            ASSERT_EQ(occlu_fat[i], occlu[i]);
+        }
+
+        ASSERT_EQ(isect_fat[0].shapeid, instances[0]->GetId());
+        ASSERT_EQ(isect_fat[2 * (numinstances - 1)].shapeid, kNullId);
+    };
+
+    compare();
+
+    // Moved instances are picked up by both layouts
+    matrix m = translation(float3(0.f, 0.f, -2.f));
+    ASSERT_NO_THROW(instances[0]->SetTransform(m, inverse(m)));
+    compare();
+
+    // Bail out
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_InstancesRebraid)
+{
+    // Long thin strip along x split into quads, like a road segment
+    int const numsegments = 16;
+    std::vector<float> strip_vertices;
+    std::vector<int> strip_indices;
+
+    for (int i = 0; i <= numsegments; ++i)
+    {
+        float const x = (float)i - 0.5f * numsegments;
+        strip_vertices.insert(strip_vertices.end(), { x, -0.1f, 0.f, x, 0.1f, 0.f });
+    }
+
+    for (int i = 0; i < numsegments; ++i)
+    {
+        strip_indices.insert(strip_indices.end(), { 2 * i, 2 * i + 2, 2 * i + 3, 2 * i, 2 * i + 3, 2 * i + 1 });
+    }
+
+    std::vector<int> strip_numfaceverts(2 * numsegments, 3);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(strip_vertices.data(), (int)strip_vertices.size() / 3, 3 * sizeof(float),
+        strip_indices.data(), 0, strip_numfaceverts.data(), 2 * numsegments));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Crossing rotated instances at different depths, their world bounds overlap a lot.
+    // The last one is masked out.
+    int const numinstances = 8;
+    std::vector<Shape*> instances(numinstances);
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        matrix m = translation(float3(0.f, 0.f, (float)i)) * rotation_z(PI * i / numinstances + 0.3f);
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(instances[numinstances - 1]->SetMask(0x2));
+
+    // Grid of rays hitting the strips and missing them
+    int const gridsize = 32;
+    int const numrays = gridsize * gridsize;
+    std::vector<ray> rays(numrays);
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        float const x = 0.5f * (i % gridsize) - 0.25f * gridsize + 0.01f;
+        float const y = 0.5f * (i / gridsize) - 0.25f * gridsize + 0.01f;
+        rays[i].o = float4(x, y, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+        rays[i].SetMask(0x1);
+    }
+
+    // Ray along the diagonal of the first strip
+    float const angle = 0.3f;
+    rays[0].o = float4(2.f * std::cos(angle), 2.f * std::sin(angle), -10.f, 1000.f);
+
+    auto ray_buffer = api_->CreateBuffer(numrays*sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays*sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(numrays*sizeof(int), nullptr);
+
+    auto query = [&](char const* builder, Intersection* isect, int* occlu)
+    {
+        ASSERT_NO_THROW(api_->SetOption("bvh.toplevel.builder", builder));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occlu_buffer, nullptr, nullptr));
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays*sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+        std::copy(tmp, tmp + numrays, isect);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+        Wait();
+
+        int* tmpocclu = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, numrays*sizeof(int), (void**)&tmpocclu, &e_));
+        Wait();
+        std::copy(tmpocclu, tmpocclu + numrays, occlu);
+        ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, tmpocclu, &e_));
+        Wait();
+    };
+
+    auto compare = [&]()
+    {
+        std::vector<Intersection> isect(numrays);
+        std::vector<Intersection> isect_rebraid(numrays);
+        std::vector<int> occlu(numrays);
+        std::vector<int> occlu_rebraid(numrays);
+
+        query("cpu", isect.data(), occlu.data());
+        query("rebraid", isect_rebraid.data(), occlu_rebraid.data());
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            ASSERT_EQ(isect_rebraid[i].shapeid, isect[i].shapeid);
+            ASSERT_EQ(isect_rebraid[i].primid, isect[i].primid);
+            ASSERT_NEAR(isect_rebraid[i].uvwt.w, isect[i].uvwt.w, 0.001f);
+            ASSERT_EQ(occlu_rebraid[i], occlu[i]);
+        }
+    };
+
+    compare();
+
+    // Moved instances are opened again
+    matrix m = translation(float3(0.f, 0.f, -2.f)) * rotation_z(angle);
+    ASSERT_NO_THROW(instances[0]->SetTransform(m, inverse(m)));
+    compare();
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.toplevel.builder", "cpu"));
+
+    // Bail out
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// The test checks instances attached and detached one at a time update the 2 level top level in place
+TEST_F(ApiBackendOpenCL, Intersection_IncrementalTopLevel)
+{
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Row of instances, a ray is shot at each of them
+    int const numinstances = 16;
+    std::vector<Shape*> instances(numinstances);
+    std::vector<ray> rays(numinstances);
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(instances[i]->SetId(i + 1));
+        matrix m = translation(float3(3.f * i, 0.f, 0.f));
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, inverse(m)));
+
+        rays[i].o = float4(3.f * i, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numinstances * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numinstances * sizeof(Intersection), nullptr);
+
+    std::vector<bool> attached(numinstances, false);
+    CommitStatistics stats;
+
+    auto check = [&]()
+    {
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numinstances, isect_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numinstances * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        for (int i = 0; i < numinstances; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, attached[i] ? i + 1 : kNullId);
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    };
+
+    // Instances are inserted into the top level built for the first one
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+        attached[i] = true;
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+
+        ASSERT_EQ(stats.refitted, i > 0 ? 1 : 0);
+        // Base mesh is a disabled leaf of its own
+        ASSERT_EQ(stats.num_leaves, i + 2);
+        check();
+    }
+
+    // Removed ones leave the others in place
+    for (int i = 1; i < numinstances; i += 3)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instances[i]));
+        attached[i] = false;
+    }
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+
+    ASSERT_EQ(stats.refitted, 1);
+    check();
+
+    // Disabled updates rebuild the top level
+    ASSERT_NO_THROW(api_->SetOption("bvh.toplevel.incremental_max_cost", 0.f));
+    ASSERT_NO_THROW(api_->AttachShape(instances[1]));
+    attached[1] = true;
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->GetCommitStatistics(stats));
+
+    ASSERT_EQ(stats.refitted, 0);
+    check();
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.toplevel.incremental_max_cost", 1.5f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 0.f));
+
+    // Bail out
+    for (int i = 0; i < numinstances; ++i)
+    {
+        if (attached[i])
+        {
+            ASSERT_NO_THROW(api_->DetachShape(instances[i]));
+        }
+
+        ASSERT_NO_THROW(api_->DeleteShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
 // Test is checking if mesh transform is working as expected
 // DK: #22 repro case : Commit throws if base shape has not been attached
 TEST_F(ApiBackendOpenCL, Intersection_1Ray_InstanceNoShape)
@@ -1099,4 +7481,78 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_InstanceNoShape)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+TEST_F(ApiBackendOpenCL, Intersection_WorkloadCapture)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    char const* path = "workload.rrcapture";
+    ASSERT_NO_THROW(api_->SetOption("capture.path", path));
+    ASSERT_NO_THROW(api_->SetOption("capture.max_queries", 2.f));
+
+    std::vector<ray> rays(5);
+    for (auto& r : rays)
+    {
+        r = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+    std::vector<Intersection> isects(rays.size());
+
+    // The third batch after a commit is over the limit
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 4, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 5, isect_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(rays.data(), 2, isects.data()));
+
+    // Commits without a path close the file
+    ASSERT_NO_THROW(api_->SetOption("capture.path", ""));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 5, isect_buffer, nullptr, &e_));
+    Wait();
+
+    // Header of each record is magic, type and payload size, query payloads start with type and ray count
+    std::vector<std::uint32_t> types;
+    std::vector<std::uint32_t> numrays;
+
+    FILE* file = std::fopen(path, "rb");
+    ASSERT_TRUE(file != nullptr);
+
+    std::uint32_t header[4];
+    while (std::fread(header, sizeof(header), 1, file) == 1)
+    {
+        std::uint64_t size = 0;
+        std::memcpy(&size, &header[2], sizeof(size));
+        ASSERT_EQ(header[0], 0x31435252u);
+        types.push_back(header[1]);
+
+        std::vector<char> payload((std::size_t)size);
+        ASSERT_EQ(std::fread(payload.data(), payload.size(), 1, file), 1u);
+
+        if (header[1] == 2)
+        {
+            std::uint32_t query[4];
+            std::memcpy(query, payload.data(), sizeof(query));
+            ASSERT_EQ(query[2], (std::uint32_t)sizeof(ray));
+            ASSERT_EQ(payload.size(), sizeof(query) + query[1] * sizeof(ray));
+            numrays.push_back(query[1]);
+        }
+    }
+
+    std::fclose(file);
+    std::remove(path);
+
+    ASSERT_EQ(types, std::vector<std::uint32_t>({ 1, 2, 2, 1, 2 }));
+    ASSERT_EQ(numrays, std::vector<std::uint32_t>({ 3, 4, 2 }));
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
 #endif // USE_OPENCL
\ No newline at end of file
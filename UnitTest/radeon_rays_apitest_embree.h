@@ -59,6 +59,7 @@ public:
 
         ASSERT_NE(nativeidx, -1);
 
+        nativeidx_ = nativeidx;
         api_ = IntersectionApi::Create(nativeidx);
 
         //        printf("[ok] RadeonRays test setup");
@@ -77,6 +78,7 @@ public:
 
     IntersectionApi* api_;
     Event* e_;
+    std::uint32_t nativeidx_;
 
     static float const * vertices() {
         static float const vertices[] = {
@@ -525,6 +527,508 @@ TEST_F(ApiBackendEmbree, Intersection_3Rays)
 }
 
 
+// Test is checking if all the traversal modes return the same hits
+TEST_F(ApiBackendEmbree, Intersection_3Rays_TraversalModes)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays
+    ray rays[3];
+
+    // Prepare the rays, the last one misses the triangle
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(0.f, 0.5f, -10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    rays[2].o = float4(5.f, 5.f, -10.f, 1000.f);
+    rays[2].d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(3 * sizeof(int), nullptr);
+
+    // Split rays into several chunks
+    ASSERT_NO_THROW(api_->SetOption("embree.chunk_size", 1.f));
+
+    char const* modes[] = { "auto", "packet4", "packet8", "packet16", "stream" };
+
+    for (auto mode : modes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("embree.traversal", mode));
+
+        // Commit geometry update
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Intersect
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, occl_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[2].shapeid, kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&occl, &e_));
+        Wait();
+
+        ASSERT_EQ(occl[0], mesh->GetId());
+        ASSERT_EQ(occl[1], mesh->GetId());
+        ASSERT_EQ(occl[2], kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// Test is checking rays reordered inside chunks get their own hits back
+TEST_F(ApiBackendEmbree, Intersection_SortedRays)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays from both sides of the triangle in alternating order, every third one inactive
+    int const numrays = 64;
+    std::vector<ray> rays(numrays);
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        float const z = i % 2 ? 10.f : -10.f;
+        float const x = (i % 8) * 0.1f - (i % 16 >= 8 ? 2.f : 0.f);
+        rays[i] = ray(float3(x, 0.f, z), float3(0.f, 0.f, -z / 10.f), 1000.f);
+        rays[i].SetActive(i % 3 != 0);
+    }
+
+    std::vector<Intersection> expected(numrays);
+    std::vector<Intersection> sorted(numrays);
+    std::vector<int> expected_occl(numrays, 2);
+    std::vector<int> sorted_occl(numrays, 2);
+
+    ASSERT_NO_THROW(api_->SetOption("embree.chunk_size", 16.f));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(&rays[0], numrays, &expected[0]));
+    ASSERT_NO_THROW(api_->QueryOcclusion(&rays[0], numrays, &expected_occl[0]));
+
+    ASSERT_NO_THROW(api_->SetOption("embree.sort_rays", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(&rays[0], numrays, &sorted[0]));
+    ASSERT_NO_THROW(api_->QueryOcclusion(&rays[0], numrays, &sorted_occl[0]));
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(sorted[i].shapeid, expected[i].shapeid);
+        ASSERT_EQ(sorted[i].primid, expected[i].primid);
+        ASSERT_EQ(sorted_occl[i], expected_occl[i]);
+
+        if (rays[i].IsActive() && expected[i].shapeid != kNullId)
+        {
+            ASSERT_NEAR(sorted[i].uvwt.w, expected[i].uvwt.w, 0.001f);
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Test is checking if queries in flight at the same time
+// complete in order and honour their wait events
+TEST_F(ApiBackendEmbree, Intersection_3Rays_Async)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    ASSERT_TRUE(mesh != nullptr);
+
+    // Attach the mesh to the scene
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays
+    ray rays[3];
+
+    // Prepare the rays, the last one misses the triangle
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(0.f, 0.5f, -10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    rays[2].o = float4(5.f, 5.f, -10.f, 1000.f);
+    rays[2].d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(3 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(3 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(3 * sizeof(int), nullptr);
+
+    // Both queries are returned without waiting, the second one waits for the first
+    Event* isect_event = nullptr;
+    Event* occl_event = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, &isect_event));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 3, occl_buffer, isect_event, &occl_event));
+    ASSERT_TRUE(isect_event != nullptr);
+    ASSERT_TRUE(occl_event != nullptr);
+
+    occl_event->Wait();
+    ASSERT_TRUE(isect_event->Complete());
+    api_->DeleteEvent(isect_event);
+    api_->DeleteEvent(occl_event);
+
+    // Map completes after the queries submitted before it
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 3 * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 3 * sizeof(int), (void**)&occl, &e_));
+    Wait();
+
+    ASSERT_EQ(occl[0], mesh->GetId());
+    ASSERT_EQ(occl[1], mesh->GetId());
+    ASSERT_EQ(occl[2], kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// Test is checking if vertex updates reach the mesh and its instances
+// on incremental commits
+TEST_F(ApiBackendEmbree, Intersection_2Rays_UpdateVertices)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    // Create mesh and its instance moved aside
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(5.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(instance->SetId(1));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Rays
+    ray rays[2];
+
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(5.f, 0.f, -10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    // Move the triangle along z a few times: the first vertex update
+    // switches the mesh to a deformable scene, the next ones refit it
+    for (int i = 0; i < 3; ++i)
+    {
+        float const z = static_cast<float>(i);
+        float const moved[] = {
+            -1.f,-1.f, z,
+            1.f,-1.f, z,
+            0.f,1.f, z,
+        };
+
+        if (i > 0)
+        {
+            ASSERT_NO_THROW(mesh->UpdateVertices(moved, 3, 3 * sizeof(float)));
+        }
+
+        // Commit geometry update
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Intersect
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].shapeid, instance->GetId());
+        ASSERT_NEAR(isect[0].uvwt.w, 10.f + z, 0.001f);
+        ASSERT_NEAR(isect[1].uvwt.w, 10.f + z, 0.001f);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if a mesh keeps its hits while it switches between
+// being placed in the scene directly and being instanced
+TEST_F(ApiBackendEmbree, Intersection_2Rays_SharedMesh)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    // Create mesh moved along z and its instance moved aside
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(0.f, 0.f, 2.f));
+    ASSERT_NO_THROW(mesh->SetTransform(m, inverse(m)));
+    m = translation(float3(5.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(instance->SetId(1));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Rays
+    ray rays[2];
+
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(5.f, 0.f, -10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(2 * sizeof(int), nullptr);
+
+    float const moved[] = {
+        -1.f,-1.f, 1.f,
+        1.f,-1.f, 1.f,
+        0.f,1.f, 1.f,
+    };
+
+    // 0 - single use mesh, 1 - its vertices move, 2 - instance attached,
+    // 3 - instance detached again
+    for (int i = 0; i < 4; ++i)
+    {
+        if (i == 1)
+        {
+            ASSERT_NO_THROW(mesh->UpdateVertices(moved, 3, 3 * sizeof(float)));
+        }
+        else if (i == 2)
+        {
+            ASSERT_NO_THROW(api_->AttachShape(instance));
+        }
+        else if (i == 3)
+        {
+            ASSERT_NO_THROW(api_->DetachShape(instance));
+        }
+
+        // Commit geometry update
+        ASSERT_NO_THROW(api_->Commit());
+
+        // Intersect
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 2, occl_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_NEAR(isect[0].uvwt.w, i == 0 ? 12.f : 13.f, 0.001f);
+        ASSERT_EQ(isect[1].shapeid, i == 2 ? instance->GetId() : kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, 2 * sizeof(int), (void**)&occl, &e_));
+        Wait();
+
+        ASSERT_EQ(occl[0], mesh->GetId());
+        ASSERT_EQ(occl[1], i == 2 ? instance->GetId() : kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+// Test is checking if scenes are rebuilt with each build quality and scene flag
+TEST_F(ApiBackendEmbree, Intersection_2Rays_BuildQuality)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    // Single use mesh and a shared one
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(5.f, 0.f, 0.f));
+    ASSERT_NO_THROW(instance->SetTransform(m, inverse(m)));
+    ASSERT_NO_THROW(instance->SetId(1));
+
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Rays
+    ray rays[2];
+
+    rays[0].o = float4(0.f, 0.f, -10.f, 1000.f);
+    rays[0].d = float3(0.f, 0.f, 1.f);
+
+    rays[1].o = float4(5.f, 0.f, -10.f, 1000.f);
+    rays[1].d = float3(0.f, 0.f, 1.f);
+
+    auto ray_buffer = api_->CreateBuffer(2 * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+
+    // Unknown qualities are rejected at commit
+    ASSERT_NO_THROW(api_->SetOption("embree.build_quality", "best"));
+    ASSERT_ANY_THROW(api_->Commit());
+
+    char const* qualities[] = { "auto", "low", "medium", "high", "refit" };
+
+    for (auto quality : qualities)
+    {
+        for (int flags = 0; flags < 4; ++flags)
+        {
+            ASSERT_NO_THROW(api_->SetOption("embree.build_quality", quality));
+            ASSERT_NO_THROW(api_->SetOption("embree.compact", (flags & 1) ? 1.f : 0.f));
+            ASSERT_NO_THROW(api_->SetOption("embree.robust", (flags & 2) ? 1.f : 0.f));
+
+            // Commit geometry update
+            ASSERT_NO_THROW(api_->Commit());
+
+            // Intersect
+            ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+            Intersection* isect = nullptr;
+            ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, 2 * sizeof(Intersection), (void**)&isect, &e_));
+            Wait();
+
+            ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+            ASSERT_EQ(isect[1].shapeid, instance->GetId());
+            ASSERT_NEAR(isect[0].uvwt.w, 10.f, 0.001f);
+
+            ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+            Wait();
+        }
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// Test is checking if hybrid device splits the rays and merges the results
+TEST_F(ApiBackendEmbree, Intersection_Hybrid)
+{
+    std::uint32_t const devices[] = { nativeidx_, nativeidx_ };
+
+    IntersectionApi* hybrid = nullptr;
+    ASSERT_NO_THROW(hybrid = IntersectionApi::CreateHybrid(devices, 2));
+    ASSERT_TRUE(hybrid != nullptr);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = hybrid->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(hybrid->AttachShape(mesh));
+    ASSERT_NO_THROW(hybrid->Commit());
+
+    // Enough rays for the throughput estimates to update, every other one misses
+    int const kNumRays = 4096;
+    std::vector<ray> rays(kNumRays);
+    for (int i = 0; i < kNumRays; ++i)
+    {
+        rays[i].o = float4((i & 1) ? 5.f : 0.f, 0.f, -10.f, 1000.f);
+        rays[i].d = float3(0.f, 0.f, 1.f);
+    }
+
+    auto ray_buffer = hybrid->CreateBuffer(kNumRays * sizeof(ray), &rays[0]);
+    auto isect_buffer = hybrid->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+    auto occl_buffer = hybrid->CreateBuffer(kNumRays * sizeof(int), nullptr);
+
+    // The second round is split by the measured throughput
+    for (int round = 0; round < 2; ++round)
+    {
+        Event* e = nullptr;
+        ASSERT_NO_THROW(hybrid->QueryIntersection(ray_buffer, kNumRays, isect_buffer, nullptr, &e));
+        ASSERT_NO_THROW(hybrid->QueryOcclusion(ray_buffer, kNumRays, occl_buffer, e, nullptr));
+        hybrid->DeleteEvent(e);
+
+        Intersection* isect = nullptr;
+        int* occl = nullptr;
+        ASSERT_NO_THROW(hybrid->MapBuffer(isect_buffer, kMapRead, 0, kNumRays * sizeof(Intersection), (void**)&isect, nullptr));
+        ASSERT_NO_THROW(hybrid->MapBuffer(occl_buffer, kMapRead, 0, kNumRays * sizeof(int), (void**)&occl, nullptr));
+
+        for (int i = 0; i < kNumRays; ++i)
+        {
+            Id expected = (i & 1) ? kNullId : mesh->GetId();
+            ASSERT_EQ(isect[i].shapeid, expected);
+            ASSERT_EQ(occl[i], expected);
+        }
+
+        ASSERT_NO_THROW(hybrid->UnmapBuffer(isect_buffer, isect, nullptr));
+        ASSERT_NO_THROW(hybrid->UnmapBuffer(occl_buffer, occl, nullptr));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(hybrid->DetachShape(mesh));
+    ASSERT_NO_THROW(hybrid->DeleteShape(mesh));
+    ASSERT_NO_THROW(hybrid->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(hybrid->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(hybrid->DeleteBuffer(occl_buffer));
+    IntersectionApi::Delete(hybrid);
+}
+
 // Test is checking if mesh transform is working as expected
 TEST_F(ApiBackendEmbree, Intersection_1Ray_Transformed)
 {
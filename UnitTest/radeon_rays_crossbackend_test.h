@@ -0,0 +1,423 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// This test suite runs the same scene and ray sets through every compiled in backend
+/// and acceleration structure. Hits are checked against the brute force CPU results,
+/// so all configurations agree with each other, and query throughput of each one is
+/// printed side by side once the suite is done. New traversal modes get validated and
+/// timed by adding them to GetCrossBackendConfigs:
+///
+///     UnitTest --gtest_filter=*CrossBackend*
+///
+
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+#include "tiny_obj_loader.h"
+#include "utils.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+// Backend, acceleration structure and an optional extra option of a run
+struct CrossBackendConfig
+{
+    char const* name;
+    DeviceInfo::Platform platform;
+    char const* acctype;
+    char const* option;
+    float value;
+};
+
+// Readable parameter names in test output
+inline void PrintTo(CrossBackendConfig const& config, std::ostream* os)
+{
+    *os << config.name;
+}
+
+inline std::vector<CrossBackendConfig> GetCrossBackendConfigs()
+{
+    std::vector<CrossBackendConfig> configs;
+
+#if USE_OPENCL
+    configs.push_back({ "cl_bvh", DeviceInfo::kOpenCL, "bvh", nullptr, 0.f });
+    configs.push_back({ "cl_bvh_persistent", DeviceInfo::kOpenCL, "bvh", "bvh.persistent_threads", 1.f });
+    configs.push_back({ "cl_bvh2l", DeviceInfo::kOpenCL, "bvh", "bvh.force2level", 1.f });
+    configs.push_back({ "cl_fatbvh", DeviceInfo::kOpenCL, "fatbvh", nullptr, 0.f });
+    configs.push_back({ "cl_qbvh", DeviceInfo::kOpenCL, "qbvh", nullptr, 0.f });
+    configs.push_back({ "cl_hlbvh", DeviceInfo::kOpenCL, "hlbvh", nullptr, 0.f });
+    configs.push_back({ "cl_hashbvh", DeviceInfo::kOpenCL, "hashbvh", nullptr, 0.f });
+#endif
+
+#if USE_VULKAN
+    configs.push_back({ "vk_bvh", DeviceInfo::kVulkan, "bvh", nullptr, 0.f });
+    configs.push_back({ "vk_fatbvh", DeviceInfo::kVulkan, "fatbvh", nullptr, 0.f });
+    configs.push_back({ "vk_hlbvh", DeviceInfo::kVulkan, "hlbvh", nullptr, 0.f });
+#endif
+
+#if USE_EMBREE
+    // Embree builds its own structure, acc.type is ignored
+    configs.push_back({ "embree", DeviceInfo::kEmbree, "bvh", nullptr, 0.f });
+#endif
+
+    // Native device is always built, it traverses its own fat node tree
+    configs.push_back({ "native", DeviceInfo::kNative, "bvh", nullptr, 0.f });
+    configs.push_back({ "native_packet", DeviceInfo::kNative, "bvh", "bvh.packet_traversal", 1.f });
+
+    return configs;
+}
+
+// Api creation fixture, creates api_ on a device of the configuration platform and loads the scene
+class CrossBackend : public ::testing::TestWithParam<CrossBackendConfig>
+{
+public:
+    static const int kNumRays = 65536;
+    static const int kNumIterations = 10;
+
+    enum RaySet
+    {
+        kRandom,
+        kPrimary,
+        kNumRaySets
+    };
+
+    void SetUp() override;
+    void TearDown() override;
+
+    // Print the throughput table of all configurations
+    static void TearDownTestCase();
+
+    // Rays of a set, identical for every configuration
+    static std::vector<ray> CreateRays(RaySet set);
+
+    // Upload rays, run the query once for checking and kNumIterations times for timing
+    // and return the results of the first run and Mrays/s
+    template <typename T> double RunQuery(std::vector<ray> const& rays, bool closest, std::vector<T>& results);
+
+    void Record(char const* query, RaySet set, double mrays);
+
+    IntersectionApi* api_;
+    std::vector<Shape*> apishapes_;
+    std::vector<TestShape> test_shapes_;
+
+    // Tinyobj data
+    std::vector<shape_t> shapes_;
+    std::vector<material_t> materials_;
+
+    // Mrays/s per configuration and query column
+    static std::map<std::string, std::map<std::string, double>> throughput_;
+};
+
+std::map<std::string, std::map<std::string, double>> CrossBackend::throughput_;
+
+inline void CrossBackend::SetUp()
+{
+    api_ = nullptr;
+
+    CrossBackendConfig const& config = GetParam();
+    IntersectionApi::SetPlatform(config.platform);
+
+    // Prefer GPUs, fall back to any device of the platform
+    int deviceidx = -1;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (deviceidx == -1 || devinfo.type == DeviceInfo::kGpu)
+        {
+            deviceidx = idx;
+
+            if (devinfo.type == DeviceInfo::kGpu)
+            {
+                break;
+            }
+        }
+    }
+
+    if (deviceidx == -1)
+    {
+        std::printf("No device for %s, skipped\n", config.name);
+        return;
+    }
+
+    ASSERT_NO_THROW(api_ = IntersectionApi::Create(deviceidx));
+    ASSERT_NE(api_, nullptr);
+
+    // Load obj file
+    std::string res = LoadObj(shapes_, materials_, "../Resources/CornellBox/orig.objm");
+    ASSERT_TRUE(res.empty()) << res;
+
+    // Create meshes within IntersectionApi, ids are fixed so that all configurations report the same ones
+    for (int i = 0; i < (int)shapes_.size(); ++i)
+    {
+        Shape* shape = nullptr;
+
+        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3, 3 * sizeof(float),
+            &shapes_[i].mesh.indices[0], 0, nullptr, (int)shapes_[i].mesh.indices.size() / 3));
+
+        ASSERT_NO_THROW(shape->SetId(i));
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+
+        test_shapes_.push_back({ &shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3,
+            &shapes_[i].mesh.indices[0], (int)shapes_[i].mesh.indices.size(), nullptr, (int)shapes_[i].mesh.indices.size() / 3 });
+        test_shapes_.back().shape = shape;
+
+        apishapes_.push_back(shape);
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", config.acctype));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+
+    if (config.option)
+    {
+        ASSERT_NO_THROW(api_->SetOption(config.option, config.value));
+    }
+
+    ASSERT_NO_THROW(api_->Commit());
+}
+
+inline void CrossBackend::TearDown()
+{
+    for (auto shape : apishapes_)
+    {
+        EXPECT_NO_THROW(api_->DeleteShape(shape));
+    }
+
+    if (api_)
+    {
+        IntersectionApi::Delete(api_);
+    }
+
+    IntersectionApi::SetPlatform(DeviceInfo::kAny);
+}
+
+inline void CrossBackend::TearDownTestCase()
+{
+    if (throughput_.empty())
+    {
+        return;
+    }
+
+    // Columns in order of the first configuration
+    auto const& columns = throughput_.begin()->second;
+
+    std::printf("\nThroughput, Mrays/s\n%-20s", "");
+    for (auto const& column : columns)
+    {
+        std::printf("%16s", column.first.c_str());
+    }
+    std::printf("\n");
+
+    for (auto const& row : throughput_)
+    {
+        std::printf("%-20s", row.first.c_str());
+        for (auto const& column : columns)
+        {
+            auto iter = row.second.find(column.first);
+            if (iter != row.second.end())
+            {
+                std::printf("%16.1f", iter->second);
+            }
+            else
+            {
+                std::printf("%16s", "-");
+            }
+        }
+        std::printf("\n");
+    }
+    std::printf("\n");
+
+    throughput_.clear();
+}
+
+inline std::vector<ray> CrossBackend::CreateRays(RaySet set)
+{
+    std::vector<ray> rays(kNumRays);
+
+    if (set == kRandom)
+    {
+        // Incoherent rays starting inside and around the box
+        std::mt19937 rng(0xABCDEF12);
+        std::uniform_real_distribution<float> dist(0.f, 1.f);
+
+        for (auto& r : rays)
+        {
+            float3 o(dist(rng) * 3.f - 1.5f, dist(rng) * 3.f - 0.5f, dist(rng) * 3.f - 1.5f);
+            float3 d(dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f);
+            r = ray(o, normalize(d), 1000.f);
+        }
+    }
+    else
+    {
+        // Pinhole camera in front of the open side of the box
+        int const size = 256;
+        static_assert(kNumRays == 256 * 256, "Primary rays cover a 256 x 256 image");
+
+        for (int y = 0; y < size; ++y)
+        {
+            for (int x = 0; x < size; ++x)
+            {
+                float3 d((x + 0.5f) / size - 0.5f, 0.5f - (y + 0.5f) / size, -1.f);
+                rays[y * size + x] = ray(float3(0.f, 1.f, 3.5f), normalize(d), 1000.f);
+            }
+        }
+    }
+
+    return rays;
+}
+
+template <typename T>
+inline double CrossBackend::RunQuery(std::vector<ray> const& rays, bool closest, std::vector<T>& results)
+{
+    int const numrays = (int)rays.size();
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), const_cast<ray*>(rays.data()));
+    auto result_buffer = api_->CreateBuffer(numrays * sizeof(T), nullptr);
+
+    auto query = [&](Event** e)
+    {
+        if (closest)
+        {
+            api_->QueryIntersection(ray_buffer, numrays, result_buffer, nullptr, e);
+        }
+        else
+        {
+            api_->QueryOcclusion(ray_buffer, numrays, result_buffer, nullptr, e);
+        }
+    };
+
+    Event* e = nullptr;
+    query(&e);
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    T* data = nullptr;
+    api_->MapBuffer(result_buffer, kMapRead, 0, numrays * sizeof(T), (void**)&data, &e);
+    e->Wait();
+    api_->DeleteEvent(e);
+    results.assign(data, data + numrays);
+    api_->UnmapBuffer(result_buffer, data, &e);
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    // Queries on a queue run in order, waiting for the last one covers all of them
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < kNumIterations; ++i)
+    {
+        query(i + 1 == kNumIterations ? &e : nullptr);
+    }
+    e->Wait();
+    api_->DeleteEvent(e);
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    api_->DeleteBuffer(ray_buffer);
+    api_->DeleteBuffer(result_buffer);
+
+    return (double)numrays * kNumIterations / seconds * 1e-6;
+}
+
+inline void CrossBackend::Record(char const* query, RaySet set, double mrays)
+{
+    std::string column = std::string(query) + (set == kRandom ? "_random" : "_primary");
+    throughput_[GetParam().name][column] = mrays;
+    RecordProperty(column + "_mrays", (int)mrays);
+}
+
+TEST_P(CrossBackend, ClosestHit)
+{
+    if (!api_)
+    {
+        return;
+    }
+
+    for (int set = 0; set < kNumRaySets; ++set)
+    {
+        std::vector<ray> rays = CreateRays((RaySet)set);
+        std::vector<Intersection> expected(rays.size());
+        TestIntersections(test_shapes_.data(), (int)test_shapes_.size(), rays.data(), (int)rays.size(), expected.data());
+
+        std::vector<Intersection> hits;
+        double mrays = 0.0;
+        ASSERT_NO_THROW(mrays = RunQuery(rays, true, hits));
+
+        int mismatches = 0;
+        int first = -1;
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            // Rays through edges shared by two shapes may report either of them, so distances are compared
+            bool miss = expected[i].shapeid == kNullId;
+            bool ok = (hits[i].shapeid == kNullId) == miss &&
+                (miss || std::abs(hits[i].uvwt.w - expected[i].uvwt.w) < 1e-3f);
+
+            if (!ok && mismatches++ == 0)
+            {
+                first = i;
+            }
+        }
+
+        EXPECT_EQ(mismatches, 0) << "ray set " << set << ", first mismatch at ray " << first;
+        Record("closest", (RaySet)set, mrays);
+    }
+}
+
+TEST_P(CrossBackend, AnyHit)
+{
+    if (!api_)
+    {
+        return;
+    }
+
+    for (int set = 0; set < kNumRaySets; ++set)
+    {
+        std::vector<ray> rays = CreateRays((RaySet)set);
+        std::unique_ptr<bool[]> expected(new bool[rays.size()]);
+        TestOcclusions(test_shapes_.data(), (int)test_shapes_.size(), rays.data(), (int)rays.size(), expected.get());
+
+        std::vector<int> hits;
+        double mrays = 0.0;
+        ASSERT_NO_THROW(mrays = RunQuery(rays, false, hits));
+
+        int mismatches = 0;
+        int first = -1;
+        for (int i = 0; i < (int)rays.size(); ++i)
+        {
+            if (expected[i] != (hits[i] > 0) && mismatches++ == 0)
+            {
+                first = i;
+            }
+        }
+
+        EXPECT_EQ(mismatches, 0) << "ray set " << set << ", first mismatch at ray " << first;
+        Record("any", (RaySet)set, mrays);
+    }
+}
+
+INSTANTIATE_TEST_CASE_P(AllBackends, CrossBackend, ::testing::ValuesIn(GetCrossBackendConfigs()));
@@ -0,0 +1,510 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+
+/// This test suite is stressing RadeonRays OpenCL backend with concurrent use:
+/// queries of random types and sizes submitted from several threads to all queues,
+/// long event chains across queues and commits overlapping queries. Results are
+/// checked against the brute force CPU results.
+///
+/// Iteration counts are multiplied by the RR_STRESS_SCALE environment variable (1 by default)
+/// for long fuzzing runs, RR_STRESS_SEED sets the random seed, which failures report.
+///
+
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+#include "tiny_obj_loader.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if USE_OPENCL
+
+using namespace RadeonRays;
+using namespace tinyobj;
+
+// Api creation fixture, prepares api_ with the Cornell box attached
+class ApiStressOpenCL : public ::testing::Test
+{
+public:
+    static const int kMaxRays = 20000;
+
+    // Query types picked at random
+    enum QueryType
+    {
+        kClosest,
+        kAny,
+        kClosestHost,
+        kAnyHost,
+        kClosestIndirect,
+        kAnyIndirect,
+        kNumQueryTypes
+    };
+
+    void SetUp() override;
+    void TearDown() override;
+
+    static int GetScale()
+    {
+        char const* scale = std::getenv("RR_STRESS_SCALE");
+        return scale ? std::max(std::atoi(scale), 1) : 1;
+    }
+
+    static unsigned int GetSeed()
+    {
+        char const* seed = std::getenv("RR_STRESS_SEED");
+        return seed ? (unsigned int)std::strtoul(seed, nullptr, 10) : 0x5EED;
+    }
+
+    // Incoherent rays starting inside and around the box
+    static void CreateRays(std::mt19937& rng, int numrays, std::vector<ray>& rays);
+
+    // Number of rays whose hits differ from the brute force results of shapes
+    static int CountClosestMismatches(std::vector<TestShape> const& shapes, ray const* rays, Intersection const* hits, int numrays);
+    static int CountAnyMismatches(std::vector<TestShape> const& shapes, ray const* rays, int const* hits, int numrays);
+
+    // Run a query of type on queue and return the number of mismatching rays
+    int RunQuery(QueryType type, std::vector<ray> const& rays, int queue) const;
+
+    IntersectionApi* api_;
+    std::vector<Shape*> apishapes_;
+    std::vector<TestShape> test_shapes_;
+
+    // Tinyobj data
+    std::vector<shape_t> shapes_;
+    std::vector<material_t> materials_;
+};
+
+inline void ApiStressOpenCL::SetUp()
+{
+    api_ = nullptr;
+    int nativeidx = -1;
+
+    // Always use OpenCL
+    IntersectionApi::SetPlatform(DeviceInfo::kOpenCL);
+
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        DeviceInfo devinfo;
+        IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+        if (devinfo.type == DeviceInfo::kGpu && nativeidx == -1)
+        {
+            nativeidx = idx;
+        }
+    }
+
+    ASSERT_NE(nativeidx, -1);
+
+    api_ = IntersectionApi::Create(nativeidx);
+    ASSERT_NE(api_, nullptr);
+
+    // Load obj file
+    std::string res = LoadObj(shapes_, materials_, "../Resources/CornellBox/orig.objm");
+    ASSERT_TRUE(res.empty()) << res;
+
+    for (int i = 0; i < (int)shapes_.size(); ++i)
+    {
+        Shape* shape = nullptr;
+
+        ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3, 3 * sizeof(float),
+            &shapes_[i].mesh.indices[0], 0, nullptr, (int)shapes_[i].mesh.indices.size() / 3));
+
+        ASSERT_NO_THROW(api_->AttachShape(shape));
+
+        test_shapes_.push_back({ &shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3,
+            &shapes_[i].mesh.indices[0], (int)shapes_[i].mesh.indices.size(), nullptr, (int)shapes_[i].mesh.indices.size() / 3 });
+        test_shapes_.back().shape = shape;
+
+        apishapes_.push_back(shape);
+    }
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+    ASSERT_NO_THROW(api_->SetOption("bvh.builder", "sah"));
+    ASSERT_NO_THROW(api_->Commit());
+}
+
+inline void ApiStressOpenCL::TearDown()
+{
+    if (api_ != nullptr)
+    {
+        for (auto shape : apishapes_)
+        {
+            EXPECT_NO_THROW(api_->DeleteShape(shape));
+        }
+
+        IntersectionApi::Delete(api_);
+    }
+}
+
+inline void ApiStressOpenCL::CreateRays(std::mt19937& rng, int numrays, std::vector<ray>& rays)
+{
+    std::uniform_real_distribution<float> dist(0.f, 1.f);
+    rays.resize(numrays);
+
+    for (auto& r : rays)
+    {
+        float3 o(dist(rng) * 3.f - 1.5f, dist(rng) * 3.f - 0.5f, dist(rng) * 3.f - 1.5f);
+        float3 d(dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f, dist(rng) * 2.f - 1.f);
+        r = ray(o, normalize(d), 1000.f);
+    }
+}
+
+inline int ApiStressOpenCL::CountClosestMismatches(std::vector<TestShape> const& shapes, ray const* rays, Intersection const* hits, int numrays)
+{
+    std::vector<Intersection> expected(numrays);
+    TestIntersections(shapes.data(), (int)shapes.size(), rays, numrays, expected.data());
+
+    int mismatches = 0;
+    for (int i = 0; i < numrays; ++i)
+    {
+        // Rays through edges shared by two shapes may report either of them, so distances are compared
+        bool miss = expected[i].shapeid == kNullId;
+        bool ok = (hits[i].shapeid == kNullId) == miss &&
+            (miss || std::abs(hits[i].uvwt.w - expected[i].uvwt.w) < 1e-3f);
+        mismatches += ok ? 0 : 1;
+    }
+
+    return mismatches;
+}
+
+inline int ApiStressOpenCL::CountAnyMismatches(std::vector<TestShape> const& shapes, ray const* rays, int const* hits, int numrays)
+{
+    std::unique_ptr<bool[]> expected(new bool[numrays]);
+    TestOcclusions(shapes.data(), (int)shapes.size(), rays, numrays, expected.get());
+
+    int mismatches = 0;
+    for (int i = 0; i < numrays; ++i)
+    {
+        mismatches += expected[i] == (hits[i] > 0) ? 0 : 1;
+    }
+
+    return mismatches;
+}
+
+inline int ApiStressOpenCL::RunQuery(QueryType type, std::vector<ray> const& rays, int queue) const
+{
+    int const numrays = (int)rays.size();
+    bool const closest = type == kClosest || type == kClosestHost || type == kClosestIndirect;
+    std::size_t const hitsize = closest ? sizeof(Intersection) : sizeof(int);
+
+    if (type == kClosestHost || type == kAnyHost)
+    {
+        std::vector<char> hits(numrays * hitsize);
+
+        if (closest)
+        {
+            api_->QueryIntersection(rays.data(), numrays, (Intersection*)hits.data(), queue);
+            return CountClosestMismatches(test_shapes_, rays.data(), (Intersection const*)hits.data(), numrays);
+        }
+
+        api_->QueryOcclusion(rays.data(), numrays, (int*)hits.data(), queue);
+        return CountAnyMismatches(test_shapes_, rays.data(), (int const*)hits.data(), numrays);
+    }
+
+    // Buffers are sized to the maximum for indirect queries, which only trace the counted rays
+    bool const indirect = type == kClosestIndirect || type == kAnyIndirect;
+    int const maxrays = indirect ? numrays + 64 : numrays;
+
+    std::vector<ray> padded(rays);
+    padded.resize(maxrays);
+
+    auto ray_buffer = api_->CreateBuffer(maxrays * sizeof(ray), padded.data());
+    auto hit_buffer = api_->CreateBuffer(maxrays * hitsize, nullptr);
+    auto count_buffer = indirect ? api_->CreateBuffer(sizeof(int), const_cast<int*>(&numrays)) : nullptr;
+
+    Event* e = nullptr;
+    if (indirect)
+    {
+        if (closest)
+            api_->QueryIntersection(ray_buffer, count_buffer, maxrays, hit_buffer, nullptr, &e, queue);
+        else
+            api_->QueryOcclusion(ray_buffer, count_buffer, maxrays, hit_buffer, nullptr, &e, queue);
+    }
+    else
+    {
+        if (closest)
+            api_->QueryIntersection(ray_buffer, numrays, hit_buffer, nullptr, &e, queue);
+        else
+            api_->QueryOcclusion(ray_buffer, numrays, hit_buffer, nullptr, &e, queue);
+    }
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    void* hits = nullptr;
+    api_->MapBuffer(hit_buffer, kMapRead, 0, numrays * hitsize, &hits, &e, queue);
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    int mismatches = closest ?
+        CountClosestMismatches(test_shapes_, rays.data(), (Intersection const*)hits, numrays) :
+        CountAnyMismatches(test_shapes_, rays.data(), (int const*)hits, numrays);
+
+    api_->UnmapBuffer(hit_buffer, hits, &e, queue);
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    api_->DeleteBuffer(ray_buffer);
+    api_->DeleteBuffer(hit_buffer);
+    if (count_buffer)
+    {
+        api_->DeleteBuffer(count_buffer);
+    }
+
+    return mismatches;
+}
+
+// Test is checking queries of random types and sizes issued from several threads to all queues
+TEST_F(ApiStressOpenCL, ConcurrentMixedQueries)
+{
+    int const num_threads = std::max(4, (int)std::thread::hardware_concurrency());
+    int const num_iterations = 32 * GetScale();
+    unsigned int const seed = GetSeed();
+    int const num_queues = api_->GetQueueCount();
+
+    std::atomic<int> mismatches(0);
+    std::atomic<int> failures(0);
+    std::vector<std::string> errors(num_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 rng(seed + t);
+            std::vector<ray> rays;
+
+            try
+            {
+                for (int i = 0; i < num_iterations; ++i)
+                {
+                    CreateRays(rng, 1 + rng() % kMaxRays, rays);
+                    QueryType type = (QueryType)(rng() % kNumQueryTypes);
+                    mismatches += RunQuery(type, rays, rng() % num_queues);
+                }
+            }
+            catch (Exception& e)
+            {
+                errors[t] = e.what();
+                ++failures;
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto const& error : errors)
+    {
+        EXPECT_TRUE(error.empty()) << error;
+    }
+
+    EXPECT_EQ(failures, 0);
+    EXPECT_EQ(mismatches, 0) << "seed " << seed;
+}
+
+// Test is checking a long chain of queries on alternating queues, each waiting for the previous one
+TEST_F(ApiStressOpenCL, EventChain)
+{
+    int const chain_length = 64 * GetScale();
+    unsigned int const seed = GetSeed();
+    int const num_queues = api_->GetQueueCount();
+
+    std::mt19937 rng(seed);
+    std::vector<std::vector<ray>> rays(chain_length);
+    std::vector<Buffer*> ray_buffers(chain_length);
+    std::vector<Buffer*> hit_buffers(chain_length);
+    std::vector<Event*> events(chain_length, nullptr);
+
+    for (int i = 0; i < chain_length; ++i)
+    {
+        CreateRays(rng, 1 + rng() % kMaxRays, rays[i]);
+        ASSERT_NO_THROW(ray_buffers[i] = api_->CreateBuffer(rays[i].size() * sizeof(ray), rays[i].data()));
+        ASSERT_NO_THROW(hit_buffers[i] = api_->CreateBuffer(rays[i].size() * sizeof(Intersection), nullptr));
+    }
+
+    // Every fourth link signals one of two reusable events instead of a new one,
+    // so each of them is signaled again while earlier links may still be running
+    Event* reusable[2] = { nullptr, nullptr };
+    ASSERT_NO_THROW(reusable[0] = api_->CreateReusableEvent());
+    ASSERT_NO_THROW(reusable[1] = api_->CreateReusableEvent());
+
+    Event* previous = nullptr;
+    for (int i = 0; i < chain_length; ++i)
+    {
+        int const queue = i % num_queues;
+        Event** event = (i % 4) == 3 ? &reusable[(i / 4) % 2] : &events[i];
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffers[i], (int)rays[i].size(), hit_buffers[i], previous, event, queue));
+        previous = *event;
+    }
+
+    previous->Wait();
+
+    int mismatches = 0;
+    for (int i = 0; i < chain_length; ++i)
+    {
+        Intersection* hits = nullptr;
+        Event* e = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(hit_buffers[i], kMapRead, 0, rays[i].size() * sizeof(Intersection), (void**)&hits, &e));
+        e->Wait();
+        api_->DeleteEvent(e);
+
+        mismatches += CountClosestMismatches(test_shapes_, rays[i].data(), hits, (int)rays[i].size());
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(hit_buffers[i], hits, &e));
+        e->Wait();
+        api_->DeleteEvent(e);
+    }
+
+    EXPECT_EQ(mismatches, 0) << "seed " << seed;
+
+    // Bail out
+    for (int i = 0; i < chain_length; ++i)
+    {
+        if (events[i])
+        {
+            ASSERT_NO_THROW(api_->DeleteEvent(events[i]));
+        }
+
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffers[i]));
+        ASSERT_NO_THROW(api_->DeleteBuffer(hit_buffers[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteEvent(reusable[0]));
+    ASSERT_NO_THROW(api_->DeleteEvent(reusable[1]));
+}
+
+// Test is checking queries from several threads while the scene is changed and committed,
+// every query has to see either scene version as a whole
+TEST_F(ApiStressOpenCL, CommitDuringQueries)
+{
+    int const num_threads = 4;
+    int const num_commits = 16 * GetScale();
+    unsigned int const seed = GetSeed();
+    int const num_queues = api_->GetQueueCount();
+
+    // Occluder across the middle of the box, toggled between commits
+    float const occluder_vertices[] = { -1.f, 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 2.f, 0.f, -1.f, 2.f, 0.f };
+    int const occluder_indices[] = { 0, 1, 2, 0, 2, 3 };
+
+    Shape* occluder = nullptr;
+    ASSERT_NO_THROW(occluder = api_->CreateMesh(occluder_vertices, 4, 3 * sizeof(float), occluder_indices, 0, nullptr, 2));
+
+    // Scene versions for the brute force results
+    std::vector<TestShape> without_occluder = test_shapes_;
+    std::vector<TestShape> with_occluder = test_shapes_;
+    with_occluder.push_back({ occluder_vertices, 4, occluder_indices, 6, nullptr, 2 });
+    with_occluder.back().shape = occluder;
+
+    std::atomic<bool> done(false);
+    std::atomic<int> mismatches(0);
+    std::atomic<int> queries(0);
+    std::vector<std::string> errors(num_threads);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]()
+        {
+            std::mt19937 rng(seed + t);
+            std::vector<ray> rays;
+            std::vector<Intersection> hits;
+
+            try
+            {
+                while (!done)
+                {
+                    CreateRays(rng, 1 + rng() % kMaxRays, rays);
+                    hits.resize(rays.size());
+                    api_->QueryIntersection(rays.data(), (int)rays.size(), hits.data(), rng() % num_queues);
+
+                    if (CountClosestMismatches(without_occluder, rays.data(), hits.data(), (int)rays.size()) != 0 &&
+                        CountClosestMismatches(with_occluder, rays.data(), hits.data(), (int)rays.size()) != 0)
+                    {
+                        ++mismatches;
+                    }
+
+                    ++queries;
+                }
+            }
+            catch (Exception& e)
+            {
+                errors[t] = e.what();
+            }
+        });
+    }
+
+    std::mt19937 rng(seed);
+    for (int i = 0; i < num_commits; ++i)
+    {
+        // Scene changes wait for the previous background commit
+        EXPECT_NO_THROW((i % 2) ? api_->DetachShape(occluder) : api_->AttachShape(occluder));
+
+        if (rng() % 2)
+        {
+            EXPECT_NO_THROW(api_->CommitAsync(nullptr));
+        }
+        else
+        {
+            EXPECT_NO_THROW(api_->Commit());
+        }
+    }
+
+    // Let the queries see the last version too
+    EXPECT_NO_THROW(api_->Commit());
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    done = true;
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (auto const& error : errors)
+    {
+        EXPECT_TRUE(error.empty()) << error;
+    }
+
+    EXPECT_GT(queries, 0);
+    EXPECT_EQ(mismatches, 0) << "seed " << seed;
+
+    // Bail out
+    if (num_commits % 2)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(occluder));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(occluder));
+}
+
+#endif // USE_OPENCL
@@ -594,6 +594,118 @@ TEST_F(ApiCl, Intersection_DependencyEvents)
     ASSERT_NO_THROW(api_->DeleteShape(mesh));
 }
 
+// Application events are waited for and API events are exposed as OpenCL events
+TEST_F(ApiCl, Intersection_ClEvents)
+{
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r;
+    r.o = float3(0.f,0.f,-10.f,10000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto rays = api_->CreateBuffer(sizeof(ray), &r);
+    auto hitinfos = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Query waits for a user event signaled by the application
+    cl_int status = CL_SUCCESS;
+    cl_event user_event = clCreateUserEvent(rawcontext_, &status);
+    ASSERT_EQ(status, CL_SUCCESS);
+
+    Event* wait_event = nullptr;
+    ASSERT_NO_THROW(wait_event = CreateFromOpenClEvent(api_, user_event));
+    ASSERT_EQ(GetOpenClEvent(api_, wait_event), user_event);
+
+    Event* event = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(rays, 1, hitinfos, wait_event, &event));
+    ASSERT_EQ(clSetUserEventStatus(user_event, CL_COMPLETE), CL_SUCCESS);
+
+    // Returned event is usable by the application
+    cl_event query_event = nullptr;
+    ASSERT_NO_THROW(query_event = GetOpenClEvent(api_, event));
+    ASSERT_NE(query_event, nullptr);
+    ASSERT_EQ(clWaitForEvents(1, &query_event), CL_SUCCESS);
+
+    Intersection* tmp = nullptr;
+    Event* e = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(hitinfos, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e));
+    e->Wait();
+    api_->DeleteEvent(e);
+    Intersection isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(hitinfos, tmp, &e));
+    e->Wait();
+    api_->DeleteEvent(e);
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // The API keeps its own reference of the user event
+    ASSERT_NO_THROW(api_->DeleteEvent(wait_event));
+    ASSERT_NO_THROW(api_->DeleteEvent(event));
+    clReleaseEvent(user_event);
+    ASSERT_NO_THROW(api_->DeleteBuffer(rays));
+    ASSERT_NO_THROW(api_->DeleteBuffer(hitinfos));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// API queues map to the application queues
+TEST_F(ApiCl, ClQueues)
+{
+    float vertices[] = {
+        -1.f,-1.f,0.f,
+        1.f,-1.f,0.f,
+        0.f,1.f,0.f,
+    };
+    int indices[] = {0, 1, 2};
+    int numfaceverts[] = { 3 };
+
+    cl_int status = CL_SUCCESS;
+    cl_device_id device;
+    ASSERT_EQ(clGetCommandQueueInfo(queue_, CL_QUEUE_DEVICE, sizeof(device), &device, nullptr), CL_SUCCESS);
+
+    cl_command_queue queues[2] = { queue_, clCreateCommandQueue(rawcontext_, device, 0, &status) };
+    ASSERT_EQ(status, CL_SUCCESS);
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = RadeonRays::CreateFromOpenClContext(rawcontext_, device, queues, 2));
+    ASSERT_NE(api, nullptr);
+    ASSERT_GE(api->GetQueueCount(), 2);
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api->CreateMesh(vertices, 3, 3*sizeof(float), indices, 0, numfaceverts, 1));
+    ASSERT_NO_THROW(api->AttachShape(mesh));
+    ASSERT_NO_THROW(api->Commit());
+
+    ray r;
+    r.o = float3(0.f,0.f,-10.f,10000.f);
+    r.d = float3(0.f,0.f,1.f);
+
+    auto rays = api->CreateBuffer(sizeof(ray), &r);
+    auto hitinfos = api->CreateBuffer(sizeof(Intersection), nullptr);
+
+    // Finishing the second application queue completes the query
+    ASSERT_NO_THROW(api->QueryIntersection(rays, 1, hitinfos, nullptr, nullptr, 1));
+    ASSERT_EQ(clFinish(queues[1]), CL_SUCCESS);
+
+    ASSERT_NO_THROW(api->DeleteBuffer(rays));
+    ASSERT_NO_THROW(api->DeleteBuffer(hitinfos));
+    ASSERT_NO_THROW(api->DetachShape(mesh));
+    ASSERT_NO_THROW(api->DeleteShape(mesh));
+    IntersectionApi::Delete(api);
+    clReleaseCommandQueue(queues[1]);
+}
+
 #endif // USE_OPENCL
 
 #endif // RadeonRays_CL_TEST_H
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "clw_test_cl.h"
 #include "radeon_rays_apitest_cl.h"
 #include "radeon_rays_conformance_test_cl.h"
+#include "radeon_rays_stress_test_cl.h"
 //#include "radeon_rays_performance_test_cl.h"
 #include "radeon_rays_test_cl.h"
 
@@ -42,6 +43,8 @@ THE SOFTWARE.
 
 #endif
 
+#include "radeon_rays_crossbackend_test.h"
+
 #include "gtest/gtest.h"
 
 
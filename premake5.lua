@@ -49,11 +49,31 @@ newoption {
     description = "Add tutorials projects"
 }
 
+newoption {
+    trigger     = "benchmark",
+    description = "Add traversal benchmark project"
+}
+
+newoption {
+    trigger     = "remote_server",
+    description = "Add remote intersection server project"
+}
+
 newoption {
     trigger     = "safe_math",
     description = "use safe math"
 }
 
+newoption {
+    trigger     = "watertight",
+    description = "Use watertight ray triangle tests in intersection kernels"
+}
+
+newoption {
+    trigger     = "sse_math",
+    description = "Back float3 and matrix math with SSE"
+}
+
 if not _OPTIONS["use_opencl"] and not _OPTIONS["use_vulkan"] and not _OPTIONS["use_embree"] then
     _OPTIONS["use_opencl"] = 1
 end
@@ -178,6 +198,10 @@ if _OPTIONS["safe_math"] then
 	defines { "USE_SAFE_MATH" }
 end
 
+if _OPTIONS["sse_math"] then
+	defines { "RR_SSE_MATH" }
+end
+
 if fileExists("./RadeonRays/RadeonRays.lua") then
 	dofile("./RadeonRays/RadeonRays.lua")
 end
@@ -205,4 +229,16 @@ if _OPTIONS["tutorials"] then
 	if fileExists("./Tutorials/Tutorials.lua") then
 		dofile("./Tutorials/Tutorials.lua")
 	end
+end
+
+if _OPTIONS["benchmark"] then
+	if fileExists("./Benchmark/Benchmark.lua") then
+		dofile("./Benchmark/Benchmark.lua")
+	end
+end
+
+if _OPTIONS["remote_server"] then
+	if fileExists("./RemoteServer/RemoteServer.lua") then
+		dofile("./RemoteServer/RemoteServer.lua")
+	end
 end
\ No newline at end of file